@@ -56,12 +56,33 @@ include $(BUILD_STATIC_LIBRARY)
 
 
 
+include $(CLEAR_VARS)
+
+LOCAL_MODULE:= libor-crypto-aes-hw
+LOCAL_MODULE_TAGS:= optional
+
+LOCAL_SRC_FILES := aes_hw.c
+
+LOCAL_C_INCLUDES += external/openssl/include
+LOCAL_C_INCLUDES += $(TOR_LOCAL_PATH)
+
+LOCAL_CFLAGS += -UNDEBUG
+LOCAL_CFLAGS += -DHAVE_CONFIG_H
+# Only aes_hw.c gets the ARMv8 cryptography extensions; aes.c checks
+# HWCAP_AES at runtime before calling into it.
+LOCAL_CFLAGS_arm64 += -march=armv8-a+crypto
+
+include $(BUILD_STATIC_LIBRARY)
+
+
+
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE:= libor-event
 LOCAL_MODULE_TAGS:= optional
 
-LOCAL_SRC_FILES := compat_libevent.c
+LOCAL_SRC_FILES := compat_libevent.c workqueue.c
 
 LOCAL_C_INCLUDES += $(TOR_LOCAL_PATH)
 LOCAL_C_INCLUDES += external/libevent/include/
@@ -38,6 +38,7 @@
 #define CAN_USE_OPENSSL_CTR
 #endif
 #include "compat.h"
+#define AES_PRIVATE
 #include "aes.h"
 #include "util.h"
 #include "torlog.h"
@@ -182,6 +183,13 @@ struct aes_cnt_cipher {
 
   /** True iff we're using the evp implementation of this cipher. */
   uint8_t using_evp;
+
+  /** True iff we're using the built-in hardware counter mode.  If so,
+   * ctr_buf holds the next counter block to encrypt, and buf holds the
+   * keystream for the previous one, as with OpenSSL's counter mode. */
+  uint8_t using_hw;
+  /** The expanded round keys for the hardware counter mode. */
+  uint8_t hw_key[AES_HW_KEY_LEN];
 };
 
 /** True iff we should prefer the EVP implementation for AES, either because
@@ -194,6 +202,49 @@ static int should_use_EVP = 0;
 static int should_use_openssl_CTR = 0;
 #endif
 
+/** True iff the CPU has AES instructions, and our counter-mode kernel using
+ * them has passed its self-test. */
+static int should_use_hw_CTR = 0;
+
+/** Encrypt <b>len</b> bytes from <b>input</b> to <b>output</b> with
+ * <b>cipher</b>, using the hardware counter mode. */
+static void
+aes_hw_crypt(aes_cnt_cipher_t *cipher, const uint8_t *input, size_t len,
+             uint8_t *output)
+{
+  unsigned int pos = cipher->pos;
+  size_t n;
+
+  /* Use up whatever is left of the last block's keystream. */
+  while (pos && len) {
+    *(output++) = *(input++) ^ cipher->buf[pos];
+    pos = (pos + 1) & 15;
+    --len;
+  }
+
+  if ((n = len >> 4)) {
+    aes_hw_ctr_blocks(cipher->hw_key, cipher->ctr_buf.buf,
+                      input, output, n);
+    input += 16*n;
+    output += 16*n;
+    len &= 15;
+  }
+
+  if (len) {
+    /* Generate one more block of keystream, and save what we don't use. */
+    memset(cipher->buf, 0, sizeof(cipher->buf));
+    aes_hw_ctr_blocks(cipher->hw_key, cipher->ctr_buf.buf,
+                      cipher->buf, cipher->buf, 1);
+    while (len--) {
+      *(output++) = *(input++) ^ cipher->buf[pos];
+      ++pos;
+    }
+  }
+
+  cipher->pos = pos;
+}
+
+
 /** Check whether we should use the EVP interface for AES. If <b>force_val</b>
  * is nonnegative, we use use EVP iff it is true.  Otherwise, we use EVP
  * if there is an engine enabled for aes-ecb. */
@@ -271,6 +322,20 @@ evaluate_ctr_for_aes(void)
   log_notice(LD_CRYPTO, "This version of OpenSSL has a slow implementation of "
              "counter mode; not using it.");
 #endif
+
+  should_use_hw_CTR = 0;
+  if (!aes_hw_name()) {
+    /* We have no built-in counter mode for this platform. */
+  } else if (!aes_hw_cpu_supported()) {
+    log_info(LD_CRYPTO, "This CPU doesn't support %s.", aes_hw_name());
+  } else if (aes_hw_self_test() < 0) {
+    log_warn(LD_BUG, "Our %s counter mode failed its self-test; not "
+             "using it.", aes_hw_name());
+  } else {
+    log_notice(LD_CRYPTO, "This CPU supports %s; using our built-in "
+               "counter mode for AES.", aes_hw_name());
+    should_use_hw_CTR = 1;
+  }
   return 0;
 }
 
@@ -329,6 +394,11 @@ aes_new_cipher(const char *key, const char *iv)
 static void
 aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
 {
+  if (should_use_hw_CTR && !should_use_EVP && key_bits == 128) {
+    aes_hw_expand_key((const uint8_t *)key, cipher->hw_key);
+    cipher->using_hw = 1;
+    cipher->using_evp = 0;
+  } else
   if (should_use_EVP) {
     const EVP_CIPHER *c;
     switch (key_bits) {
@@ -355,6 +425,9 @@ aes_set_key(aes_cnt_cipher_t *cipher, const char *key, int key_bits)
 
   cipher->pos = 0;
 
+  if (cipher->using_hw)
+    memset(cipher->buf, 0, sizeof(cipher->buf));
+  else
 #ifdef CAN_USE_OPENSSL_CTR
   if (should_use_openssl_CTR)
     memset(cipher->buf, 0, sizeof(cipher->buf));
@@ -405,6 +478,10 @@ void
 aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
           char *output)
 {
+  if (cipher->using_hw) {
+    aes_hw_crypt(cipher, (const uint8_t *)input, len, (uint8_t *)output);
+    return;
+  }
 #ifdef CAN_USE_OPENSSL_CTR
   if (should_use_openssl_CTR) {
     if (cipher->using_evp) {
@@ -465,6 +542,10 @@ aes_crypt(aes_cnt_cipher_t *cipher, const char *input, size_t len,
 void
 aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len)
 {
+  if (cipher->using_hw) {
+    aes_hw_crypt(cipher, (const uint8_t *)data, len, (uint8_t *)data);
+    return;
+  }
 #ifdef CAN_USE_OPENSSL_CTR
   if (should_use_openssl_CTR) {
     aes_crypt(cipher, data, len, data);
@@ -512,6 +593,8 @@ aes_set_iv(aes_cnt_cipher_t *cipher, const char *iv)
   cipher->pos = 0;
   memcpy(cipher->ctr_buf.buf, iv, 16);
 
+  if (cipher->using_hw)
+    return;
 #ifdef CAN_USE_OPENSSL_CTR
   if (!should_use_openssl_CTR)
 #endif
@@ -25,5 +25,16 @@ void aes_crypt_inplace(aes_cnt_cipher_t *cipher, char *data, size_t len);
 int evaluate_evp_for_aes(int force_value);
 int evaluate_ctr_for_aes(void);
 
+#ifdef AES_PRIVATE
+/** How many bytes of expanded round keys does aes_hw_expand_key() write? */
+#define AES_HW_KEY_LEN (11*16)
+const char *aes_hw_name(void);
+int aes_hw_cpu_supported(void);
+int aes_hw_self_test(void);
+void aes_hw_expand_key(const uint8_t *key, uint8_t *out);
+void aes_hw_ctr_blocks(const uint8_t *key, uint8_t *ctr, const uint8_t *in,
+                       uint8_t *out, size_t n);
+#endif
+
 #endif
 
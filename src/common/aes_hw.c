@@ -0,0 +1,375 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file aes_hw.c
+ * \brief AES-128 counter mode using the CPU's AES instructions.
+ *
+ * Nothing here runs an AES instruction unless aes_hw_cpu_supported() has
+ * said that the CPU has them.  Keep this file small: on arm64, Android
+ * builds all of it with the cryptography extensions enabled.
+ **/
+
+#include "orconfig.h"
+
+#ifdef _WIN32
+ #ifndef _WIN32_WINNT
+ #define _WIN32_WINNT 0x0501
+ #endif
+ #define WIN32_LEAN_AND_MEAN
+ #if defined(_MSC_VER) && (_MSC_VER < 1300)
+    #include <winsock.h>
+ #else
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
+ #endif
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/aes.h>
+#include "compat.h"
+#define AES_PRIVATE
+#include "aes.h"
+
+/* We can use the CPU's AES instructions directly, if it has them: AES-NI on
+ * x86 and x86_64, or the ARMv8 cryptography extensions on arm64.  We expand
+ * the key ourselves and run AES_HW_BLOCKS counter blocks through the rounds
+ * at once, so that the pipelined AES unit stays busy.
+ *
+ * On x86, we build the AES-NI code whenever the compiler can, though aes.c
+ * only uses it when it isn't using EVP counter mode.  That way the unit
+ * tests exercise the counter handling we share with the ARMv8 code.
+ */
+#if (defined(__i386__) || defined(__x86_64__)) &&                        \
+  (defined(__clang__) ||                                                \
+   (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+/* (GCC before 4.9 can't use the intrinsics from a function with a target
+ * attribute.) */
+#define USE_AES_HW_X86
+#endif
+
+/* On Android, this is the only file we build with the ARMv8 cryptography
+ * extensions enabled.  Elsewhere, you get the ARMv8 code only by enabling
+ * them in CFLAGS yourself. */
+#if defined(__aarch64__) && !defined(__AARCH64EB__) &&                   \
+  (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)) &&      \
+  defined(HAVE_GETAUXVAL) && defined(HAVE_SYS_AUXV_H)
+#define USE_AES_HW_ARM64
+#endif
+
+#if defined(USE_AES_HW_X86) || defined(USE_AES_HW_ARM64)
+#define USE_AES_HW
+/** How many counter blocks do we encrypt per pass of the hardware kernel? */
+#define AES_HW_BLOCKS 8
+#endif
+
+#ifdef USE_AES_HW_X86
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+#ifdef USE_AES_HW_ARM64
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1<<3)
+#endif
+#endif
+
+#ifdef USE_AES_HW
+/** Run <b>stmt</b> once for each block index <b>blk</b> from 0 through
+ * AES_HW_BLOCKS-1.  We unroll by hand, since the compiler won't always do
+ * it for us, and the point of the exercise is to keep all the blocks in
+ * registers and in flight together. */
+#define AES_HW_FOR_EACH_BLOCK(blk, stmt) STMT_BEGIN                     \
+    { const int blk = 0; stmt; } { const int blk = 1; stmt; }           \
+    { const int blk = 2; stmt; } { const int blk = 3; stmt; }           \
+    { const int blk = 4; stmt; } { const int blk = 5; stmt; }           \
+    { const int blk = 6; stmt; } { const int blk = 7; stmt; }           \
+  STMT_END
+
+#ifdef USE_AES_HW_X86
+/** Helper for aes_hw_expand_key: given the previous round key <b>k</b> and
+ * the output <b>gen</b> of AESKEYGENASSIST on it, return the next round
+ * key. */
+static INLINE __m128i __attribute__((target("aes,sse2")))
+aes_hw_key_step(__m128i k, __m128i gen)
+{
+  gen = _mm_shuffle_epi32(gen, 0xff);
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+  return _mm_xor_si128(k, gen);
+}
+
+#define AES_HW_KEY_STEP(k, n, rcon) STMT_BEGIN                          \
+    k[n] = aes_hw_key_step(k[(n)-1],                                    \
+                           _mm_aeskeygenassist_si128(k[(n)-1], (rcon))); \
+  STMT_END
+
+/** Expand the 128-bit AES key <b>key</b> into AES_HW_KEY_LEN bytes of round
+ * keys in <b>out</b>. */
+void __attribute__((target("aes,sse2")))
+aes_hw_expand_key(const uint8_t *key, uint8_t *out)
+{
+  __m128i k[11];
+  int i;
+  k[0] = _mm_loadu_si128((const __m128i*)key);
+  AES_HW_KEY_STEP(k, 1, 0x01);
+  AES_HW_KEY_STEP(k, 2, 0x02);
+  AES_HW_KEY_STEP(k, 3, 0x04);
+  AES_HW_KEY_STEP(k, 4, 0x08);
+  AES_HW_KEY_STEP(k, 5, 0x10);
+  AES_HW_KEY_STEP(k, 6, 0x20);
+  AES_HW_KEY_STEP(k, 7, 0x40);
+  AES_HW_KEY_STEP(k, 8, 0x80);
+  AES_HW_KEY_STEP(k, 9, 0x1b);
+  AES_HW_KEY_STEP(k, 10, 0x36);
+  for (i = 0; i < 11; ++i)
+    _mm_storeu_si128((__m128i*)(out + 16*i), k[i]);
+}
+
+/** Encrypt the <b>n</b> counter blocks in <b>ctrs</b> with the round keys
+ * in <b>key</b>, xor the result with the <b>n</b> blocks at <b>in</b>, and
+ * store it in <b>out</b>.  <b>n</b> must be no more than AES_HW_BLOCKS. */
+static void __attribute__((target("aes,sse2")))
+aes_hw_ctr_xor(const uint8_t *key, const uint8_t *ctrs,
+               const uint8_t *in, uint8_t *out, int n)
+{
+  const __m128i *k = (const __m128i *)key;
+  __m128i b[AES_HW_BLOCKS], rk;
+  int i, r;
+
+  if (n == AES_HW_BLOCKS) {
+    rk = _mm_loadu_si128(k);
+    AES_HW_FOR_EACH_BLOCK(i_,
+      b[i_] = _mm_xor_si128(
+                _mm_loadu_si128((const __m128i*)(ctrs+16*i_)), rk));
+    for (r = 1; r < 10; ++r) {
+      rk = _mm_loadu_si128(k + r);
+      AES_HW_FOR_EACH_BLOCK(i_, b[i_] = _mm_aesenc_si128(b[i_], rk));
+    }
+    rk = _mm_loadu_si128(k + 10);
+    AES_HW_FOR_EACH_BLOCK(i_,
+      b[i_] = _mm_xor_si128(_mm_aesenclast_si128(b[i_], rk),
+                _mm_loadu_si128((const __m128i*)(in+16*i_)));
+      _mm_storeu_si128((__m128i*)(out+16*i_), b[i_]));
+    return;
+  }
+
+  for (i = 0; i < n; ++i) {
+    b[0] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(ctrs+16*i)),
+                         _mm_loadu_si128(k));
+    for (r = 1; r < 10; ++r)
+      b[0] = _mm_aesenc_si128(b[0], _mm_loadu_si128(k + r));
+    b[0] = _mm_aesenclast_si128(b[0], _mm_loadu_si128(k + 10));
+    b[0] = _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i*)(in+16*i)));
+    _mm_storeu_si128((__m128i*)(out+16*i), b[0]);
+  }
+}
+
+/** Return true iff this CPU supports the AES-NI instructions. */
+int
+aes_hw_cpu_supported(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  return (ecx & bit_AES) != 0;
+}
+#define AES_HW_NAME "AES-NI"
+#endif
+
+#ifdef USE_AES_HW_ARM64
+/** Expand the 128-bit AES key <b>key</b> into AES_HW_KEY_LEN bytes of round
+ * keys in <b>out</b>. */
+void
+aes_hw_expand_key(const uint8_t *key, uint8_t *out)
+{
+  static const uint8_t rcon[10] = {
+    0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36
+  };
+  uint32_t w[44];
+  int i;
+  memcpy(w, key, 16);
+  for (i = 4; i < 44; ++i) {
+    uint32_t t = w[i-1];
+    if ((i & 3) == 0) {
+      /* AESE with an all-zero round key is SubBytes and ShiftRows.  When
+       * all four columns are the same, ShiftRows does nothing, so this
+       * gives us SubWord. */
+      uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(t));
+      v = vaeseq_u8(v, vdupq_n_u8(0));
+      t = vgetq_lane_u32(vreinterpretq_u32_u8(v), 0);
+      /* RotWord, on a little-endian word. */
+      t = ((t >> 8) | (t << 24)) ^ rcon[(i/4)-1];
+    }
+    w[i] = w[i-4] ^ t;
+  }
+  memcpy(out, w, AES_HW_KEY_LEN);
+}
+
+/** Encrypt the <b>n</b> counter blocks in <b>ctrs</b> with the round keys
+ * in <b>key</b>, xor the result with the <b>n</b> blocks at <b>in</b>, and
+ * store it in <b>out</b>.  <b>n</b> must be no more than AES_HW_BLOCKS. */
+static void
+aes_hw_ctr_xor(const uint8_t *key, const uint8_t *ctrs,
+               const uint8_t *in, uint8_t *out, int n)
+{
+  uint8x16_t k[11], b[AES_HW_BLOCKS];
+  int i, r;
+  for (r = 0; r < 11; ++r)
+    k[r] = vld1q_u8(key + 16*r);
+
+  if (n == AES_HW_BLOCKS) {
+    AES_HW_FOR_EACH_BLOCK(i_, b[i_] = vld1q_u8(ctrs + 16*i_));
+    for (r = 0; r < 9; ++r)
+      AES_HW_FOR_EACH_BLOCK(i_, b[i_] = vaesmcq_u8(vaeseq_u8(b[i_], k[r])));
+    AES_HW_FOR_EACH_BLOCK(i_,
+      b[i_] = veorq_u8(vaeseq_u8(b[i_], k[9]), k[10]);
+      vst1q_u8(out + 16*i_, veorq_u8(b[i_], vld1q_u8(in + 16*i_))));
+    return;
+  }
+
+  for (i = 0; i < n; ++i) {
+    b[0] = vld1q_u8(ctrs + 16*i);
+    for (r = 0; r < 9; ++r)
+      b[0] = vaesmcq_u8(vaeseq_u8(b[0], k[r]));
+    b[0] = veorq_u8(vaeseq_u8(b[0], k[9]), k[10]);
+    vst1q_u8(out + 16*i, veorq_u8(b[0], vld1q_u8(in + 16*i)));
+  }
+}
+
+/** Return true iff this CPU supports the ARMv8 AES instructions. */
+int
+aes_hw_cpu_supported(void)
+{
+  return (getauxval(AT_HWCAP) & HWCAP_AES) != 0;
+}
+#define AES_HW_NAME "ARMv8 AES"
+#endif
+
+/** Encrypt <b>n</b> blocks from <b>in</b> to <b>out</b> in counter mode,
+ * using the round keys in <b>key</b> and starting with the 128-bit
+ * big-endian counter in <b>ctr</b>.  Advance <b>ctr</b> by <b>n</b>. */
+void
+aes_hw_ctr_blocks(const uint8_t *key, uint8_t *ctr,
+                  const uint8_t *in, uint8_t *out, size_t n)
+{
+  uint32_t ctrs[AES_HW_BLOCKS*4];
+  uint32_t c[4];
+  int i, j, nb;
+
+  memcpy(c, ctr, 16);
+  for (j = 0; j < 4; ++j)
+    c[j] = ntohl(c[j]);
+
+  while (n) {
+    nb = n < AES_HW_BLOCKS ? (int)n : AES_HW_BLOCKS;
+    for (i = 0; i < nb; ++i) {
+      for (j = 0; j < 4; ++j)
+        ctrs[4*i + j] = htonl(c[j]);
+      if (PREDICT_UNLIKELY(! ++c[3]))
+        if (PREDICT_UNLIKELY(! ++c[2]))
+          if (PREDICT_UNLIKELY(! ++c[1]))
+            ++c[0];
+    }
+    aes_hw_ctr_xor(key, (const uint8_t *)ctrs, in, out, nb);
+    in += 16*nb;
+    out += 16*nb;
+    n -= nb;
+  }
+
+  for (j = 0; j < 4; ++j)
+    c[j] = htonl(c[j]);
+  memcpy(ctr, c, 16);
+}
+
+/** Check that the hardware counter mode agrees with AES_encrypt(), across a
+ * carry out of the low 64 bits of the counter.  Return 0 if it does, and
+ * -1 if it doesn't. */
+int
+aes_hw_self_test(void)
+{
+  uint8_t key[16], ctr[16], ctr_tmp[16], block[16];
+  uint8_t hw_key[AES_HW_KEY_LEN];
+  uint8_t output[(AES_HW_BLOCKS+3)*16];
+  AES_KEY aes_key;
+  int i, j, r = 0;
+
+  for (i = 0; i < 16; ++i)
+    key[i] = (uint8_t)(i*17 + 1);
+  memset(ctr, 0, sizeof(ctr));
+  memset(ctr+8, 0xff, 8);
+  ctr[15] = 0xfd;
+  memcpy(ctr_tmp, ctr, sizeof(ctr));
+
+  memset(output, 0, sizeof(output));
+  aes_hw_expand_key(key, hw_key);
+  aes_hw_ctr_blocks(hw_key, ctr_tmp, output, output, AES_HW_BLOCKS+3);
+
+  AES_set_encrypt_key(key, 128, &aes_key);
+  for (i = 0; i < AES_HW_BLOCKS+3; ++i) {
+    AES_encrypt(ctr, block, &aes_key);
+    if (memcmp(block, output+16*i, 16))
+      r = -1;
+    for (j = 15; j >= 0 && ! ++ctr[j]; --j)
+      ;
+  }
+  if (memcmp(ctr, ctr_tmp, 16))
+    r = -1;
+
+  memset(&aes_key, 0, sizeof(aes_key));
+  memset(hw_key, 0, sizeof(hw_key));
+  return r;
+}
+
+#else
+
+/* We have no built-in hardware counter mode for this platform. */
+
+int
+aes_hw_cpu_supported(void)
+{
+  return 0;
+}
+
+void
+aes_hw_expand_key(const uint8_t *key, uint8_t *out)
+{
+  (void)key;
+  (void)out;
+  abort();
+}
+
+void
+aes_hw_ctr_blocks(const uint8_t *key, uint8_t *ctr,
+                  const uint8_t *in, uint8_t *out, size_t n)
+{
+  (void)key;
+  (void)ctr;
+  (void)in;
+  (void)out;
+  (void)n;
+  abort();
+}
+
+int
+aes_hw_self_test(void)
+{
+  return -1;
+}
+#endif
+
+/** Return the name of the CPU instructions that our built-in hardware
+ * counter mode uses, or NULL if we have none for this platform. */
+const char *
+aes_hw_name(void)
+{
+#ifdef AES_HW_NAME
+  return AES_HW_NAME;
+#else
+  return NULL;
+#endif
+}
+
@@ -55,6 +55,9 @@
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 #ifdef HAVE_CRT_EXTERNS_H
 #include <crt_externs.h>
 #endif
@@ -85,6 +88,9 @@
 #ifdef HAVE_SIGNAL_H
 #include <signal.h>
 #endif
+#ifdef HAVE_SCHED_SETAFFINITY
+#include <sched.h>
+#endif
 #ifdef HAVE_UTIME_H
 #include <utime.h>
 #endif
@@ -1038,15 +1044,28 @@ tor_open_socket(int domain, int type, int protocol)
   return s;
 }
 
-/** As socket(), but counts the number of open sockets. */
-tor_socket_t
-tor_accept_socket(tor_socket_t sockfd, struct sockaddr *addr, socklen_t *len)
+/** Helper for tor_accept_socket() and tor_accept_socket_nonblocking():
+ * accept a socket from <b>sockfd</b>, make it close-on-exec, and if
+ * <b>nonblocking</b>, make it nonblocking too. */
+static tor_socket_t
+tor_accept_socket_with_extensions(tor_socket_t sockfd, struct sockaddr *addr,
+                                  socklen_t *len, int nonblocking)
 {
   tor_socket_t s;
 #if defined(HAVE_ACCEPT4) && defined(SOCK_CLOEXEC)
-  s = accept4(sockfd, addr, len, SOCK_CLOEXEC);
-  if (SOCKET_OK(s))
+  int flags = SOCK_CLOEXEC;
+#ifdef SOCK_NONBLOCK
+  if (nonblocking)
+    flags |= SOCK_NONBLOCK;
+#endif
+  s = accept4(sockfd, addr, len, flags);
+  if (SOCKET_OK(s)) {
+#ifndef SOCK_NONBLOCK
+    if (nonblocking)
+      set_socket_nonblocking(s);
+#endif
     goto socket_ok;
+  }
   /* If we got an error, see if it is ENOSYS. ENOSYS indicates that,
    * even though we were built on a system with accept4 support, we
    * are running on one without. Also, check for EINVAL, which indicates that
@@ -1062,6 +1081,8 @@ tor_accept_socket(tor_socket_t sockfd, struct sockaddr *addr, socklen_t *len)
 #if defined(FD_CLOEXEC)
   fcntl(s, F_SETFD, FD_CLOEXEC);
 #endif
+  if (nonblocking)
+    set_socket_nonblocking(s);
 
   goto socket_ok; /* So that socket_ok will not be unused. */
 
@@ -1073,6 +1094,23 @@ tor_accept_socket(tor_socket_t sockfd, struct sockaddr *addr, socklen_t *len)
   return s;
 }
 
+/** As accept(), but counts the number of open sockets. */
+tor_socket_t
+tor_accept_socket(tor_socket_t sockfd, struct sockaddr *addr, socklen_t *len)
+{
+  return tor_accept_socket_with_extensions(sockfd, addr, len, 0);
+}
+
+/** As accept(), but counts the number of open sockets, and makes the new
+ * socket nonblocking, using accept4() to do it in the same call if we
+ * can. */
+tor_socket_t
+tor_accept_socket_nonblocking(tor_socket_t sockfd, struct sockaddr *addr,
+                              socklen_t *len)
+{
+  return tor_accept_socket_with_extensions(sockfd, addr, len, 1);
+}
+
 /** Return the number of sockets we currently have opened. */
 int
 get_n_open_sockets(void)
@@ -1097,6 +1135,32 @@ set_socket_nonblocking(tor_socket_t socket)
 #endif
 }
 
+/** If <b>cork</b>, tell the kernel to hold back partial segments on the
+ * TCP socket <b>s</b>, so that a burst of small writes goes out as
+ * full-sized segments.  If not <b>cork</b>, stop holding them back and
+ * send whatever is pending.  Return 0 on success, and -1 on failure or if
+ * this platform can't do that.
+ */
+int
+tor_socket_set_cork(tor_socket_t s, int cork)
+{
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+  int val = cork ? 1 : 0;
+#ifdef TCP_CORK
+  if (setsockopt(s, IPPROTO_TCP, TCP_CORK, (void*)&val, sizeof(val)) < 0)
+    return -1;
+#else
+  if (setsockopt(s, IPPROTO_TCP, TCP_NOPUSH, (void*)&val, sizeof(val)) < 0)
+    return -1;
+#endif
+  return 0;
+#else
+  (void)s;
+  (void)cork;
+  return -1;
+#endif
+}
+
 /**
  * Allocate a pair of connected sockets.  (Like socketpair(family,
  * type,protocol,fd), but works on systems that don't have
@@ -2301,7 +2365,7 @@ compute_num_cpus_impl(void)
 #endif
 }
 
-#define MAX_DETECTABLE_CPUS 16
+#define MAX_DETECTABLE_CPUS 128
 
 /** Return how many CPUs we are running with.  We assume that nobody is
  * using hot-swappable CPUs, so we don't recompute this after the first
@@ -2320,10 +2384,37 @@ compute_num_cpus(void)
                  "will not autodetect any more than %d, though.  If you "
                  "want to configure more, set NumCPUs in your torrc",
                  num_cpus, MAX_DETECTABLE_CPUS);
+    if (num_cpus > MAX_DETECTABLE_CPUS)
+      num_cpus = MAX_DETECTABLE_CPUS;
   }
   return num_cpus;
 }
 
+/** Try to make the calling thread run only on CPU number <b>cpu</b>,
+ * counting from 0.  Return 0 on success, or -1 on failure or if we don't
+ * know how to do that on this platform. */
+int
+tor_set_thread_cpu_affinity(int cpu)
+{
+#if defined(HAVE_SCHED_SETAFFINITY) && defined(CPU_SET)
+  cpu_set_t set;
+  if (cpu < 0 || cpu >= CPU_SETSIZE)
+    return -1;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  /* A pid of 0 means the calling thread, not the whole process. */
+  return sched_setaffinity(0, sizeof(set), &set) == 0 ? 0 : -1;
+#elif defined(_WIN32)
+  if (cpu < 0 || cpu >= (int)(sizeof(DWORD_PTR)*8))
+    return -1;
+  return SetThreadAffinityMask(GetCurrentThread(),
+                               ((DWORD_PTR)1) << cpu) ? 0 : -1;
+#else
+  (void)cpu;
+  return -1;
+#endif
+}
+
 /** Set *timeval to the current time of day.  On error, log and terminate.
  * (Same as gettimeofday(timeval,NULL), but never returns -1.)
  */
@@ -2375,6 +2466,111 @@ tor_gettimeofday(struct timeval *timeval)
   return;
 }
 
+/** Nanoseconds in one second. */
+#define NSEC_PER_SEC U64_LITERAL(1000000000)
+
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+/** Return the value of the clock <b>clk</b> in nanoseconds; fall back to
+ * CLOCK_MONOTONIC if <b>clk</b> is unsupported on this kernel. */
+static uint64_t
+monotime_from_clock(clockid_t clk)
+{
+  struct timespec ts;
+  if (PREDICT_UNLIKELY(clock_gettime(clk, &ts) < 0)) {
+    if (clk == CLOCK_MONOTONIC || clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+      log_err(LD_GENERAL, "clock_gettime failed.");
+      exit(1);
+    }
+  }
+  return ((uint64_t)ts.tv_sec) * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+#elif !defined(_WIN32)
+/** The largest value that tor_monotime_nsec() has returned, so that our
+ * gettimeofday()-based fallback never runs backwards. */
+static uint64_t monotime_last_nsec = 0;
+#ifdef TOR_IS_MULTITHREADED
+/** Protects monotime_last_nsec; created by tor_threads_init(), before we
+ * start any other threads. */
+static tor_mutex_t *monotime_lock = NULL;
+#endif
+#endif
+
+/** Return the number of nanoseconds elapsed since some arbitrary point in
+ * the past.  The value never decreases, and is unaffected by changes to the
+ * system clock; only differences between values are meaningful. */
+uint64_t
+tor_monotime_nsec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+  return monotime_from_clock(CLOCK_MONOTONIC);
+#elif defined(_WIN32)
+  static LARGE_INTEGER freq = { { 0, 0 } };
+  LARGE_INTEGER count;
+  if (PREDICT_UNLIKELY(freq.QuadPart == 0))
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+  return ((uint64_t)count.QuadPart / freq.QuadPart) * NSEC_PER_SEC +
+    (((uint64_t)count.QuadPart % freq.QuadPart) * NSEC_PER_SEC) /
+    freq.QuadPart;
+#else
+  /* No monotonic clock: use the wall clock, but never step backwards.  If
+   * the clock jumps back, time stands still until it catches up. */
+  struct timeval tv;
+  uint64_t now;
+  tor_gettimeofday(&tv);
+  now = ((uint64_t)tv.tv_sec) * NSEC_PER_SEC + tv.tv_usec * 1000;
+#ifdef TOR_IS_MULTITHREADED
+  if (monotime_lock)
+    tor_mutex_acquire(monotime_lock);
+#endif
+  if (now > monotime_last_nsec)
+    monotime_last_nsec = now;
+  else
+    now = monotime_last_nsec;
+#ifdef TOR_IS_MULTITHREADED
+  if (monotime_lock)
+    tor_mutex_release(monotime_lock);
+#endif
+  return now;
+#endif
+}
+
+/** Like tor_monotime_nsec(), but cheaper and less precise: on Linux, the
+ * result only advances once per kernel tick (typically 1-4 msec).  Use
+ * this for timing that is measured in seconds. */
+uint64_t
+tor_monotime_coarse_nsec(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC_COARSE)
+  return monotime_from_clock(CLOCK_MONOTONIC_COARSE);
+#else
+  return tor_monotime_nsec();
+#endif
+}
+
+/** Cached value for tor_monotime_cached_nsec(), or 0 if the cache is
+ * empty. */
+static uint64_t cached_monotime_nsec = 0;
+
+/** Return a fairly recent value of tor_monotime_nsec(): the cache is
+ * filled on first use and reset with tor_monotime_cache_clear() once per
+ * trip through the event loop.  Only call this from the main thread. */
+uint64_t
+tor_monotime_cached_nsec(void)
+{
+  if (PREDICT_UNLIKELY(cached_monotime_nsec == 0))
+    cached_monotime_nsec = tor_monotime_nsec();
+  return cached_monotime_nsec;
+}
+
+/** Reset the cached value for tor_monotime_cached_nsec(), so that the next
+ * call will look at the clock again. */
+void
+tor_monotime_cache_clear(void)
+{
+  cached_monotime_nsec = 0;
+}
+
 #if defined(TOR_IS_MULTITHREADED) && !defined(_WIN32)
 /** Defined iff we need to add locks when defining fake versions of reentrant
  * versions of time-related functions. */
@@ -2659,7 +2855,6 @@ tor_mutex_free(tor_mutex_t *m)
 
 /* Conditions. */
 #ifdef USE_PTHREADS
-#if 0
 /** Cross-platform condition implementation. */
 struct tor_cond_t {
   pthread_cond_t cond;
@@ -2707,7 +2902,6 @@ tor_cond_signal_all(tor_cond_t *cond)
 {
   pthread_cond_broadcast(&cond->cond);
 }
-#endif
 /** Set up common structures for use by threading. */
 void
 tor_threads_init(void)
@@ -2717,6 +2911,10 @@ tor_threads_init(void)
     pthread_mutexattr_settype(&attr_reentrant, PTHREAD_MUTEX_RECURSIVE);
     threads_initialized = 1;
     set_main_thread();
+    tor_memtag_init();
+#if !(defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC))
+    monotime_lock = tor_mutex_new();
+#endif
   }
 }
 #elif defined(USE_WIN32_THREADS)
@@ -2811,6 +3009,7 @@ tor_threads_init(void)
   cond_event_tls_index = TlsAlloc();
 #endif
   set_main_thread();
+  tor_memtag_init();
 }
 #endif
 
@@ -325,6 +325,10 @@ struct timeval {
 #endif
 
 void tor_gettimeofday(struct timeval *timeval);
+uint64_t tor_monotime_nsec(void);
+uint64_t tor_monotime_coarse_nsec(void);
+uint64_t tor_monotime_cached_nsec(void);
+void tor_monotime_cache_clear(void);
 
 struct tm *tor_localtime_r(const time_t *timep, struct tm *result);
 struct tm *tor_gmtime_r(const time_t *timep, struct tm *result);
@@ -418,6 +422,9 @@ int tor_close_socket(tor_socket_t s);
 tor_socket_t tor_open_socket(int domain, int type, int protocol);
 tor_socket_t tor_accept_socket(tor_socket_t sockfd, struct sockaddr *addr,
                                   socklen_t *len);
+tor_socket_t tor_accept_socket_nonblocking(tor_socket_t sockfd,
+                                           struct sockaddr *addr,
+                                           socklen_t *len);
 int get_n_open_sockets(void);
 
 #define tor_socket_send(s, buf, len, flags) send(s, buf, len, flags)
@@ -490,6 +497,7 @@ const char *tor_inet_ntop(int af, const void *src, char *dst, size_t len);
 int tor_inet_pton(int af, const char *src, void *dst);
 int tor_lookup_hostname(const char *name, uint32_t *addr) ATTR_NONNULL((1,2));
 void set_socket_nonblocking(tor_socket_t socket);
+int tor_socket_set_cork(tor_socket_t s, int cork);
 int tor_socketpair(int family, int type, int protocol, tor_socket_t fd[2]);
 int network_init(void);
 
@@ -598,6 +606,7 @@ void spawn_exit(void) ATTR_NORETURN;
 #endif
 
 int compute_num_cpus(void);
+int tor_set_thread_cpu_affinity(int cpu);
 
 /* Because we use threads instead of processes on most platforms (Windows,
  * Linux, etc), we need locking for them.  On platforms with poor thread
@@ -643,8 +652,8 @@ void tor_threads_init(void);
 void set_main_thread(void);
 int in_main_thread(void);
 
-#ifdef TOR_IS_MULTITHREADED
-#if 0
+/* So far, conditions are only implemented with pthreads. */
+#ifdef USE_PTHREADS
 typedef struct tor_cond_t tor_cond_t;
 tor_cond_t *tor_cond_new(void);
 void tor_cond_free(tor_cond_t *cond);
@@ -652,7 +661,6 @@ int tor_cond_wait(tor_cond_t *cond, tor_mutex_t *mutex);
 void tor_cond_signal_one(tor_cond_t *cond);
 void tor_cond_signal_all(tor_cond_t *cond);
 #endif
-#endif
 
 /** Macros for MIN/MAX.  Never use these when the arguments could have
  * side-effects.
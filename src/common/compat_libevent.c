@@ -699,6 +699,7 @@ void
 tor_gettimeofday_cache_clear(void)
 {
   event_base_update_cache_time(the_event_base);
+  tor_monotime_cache_clear();
 }
 #else
 /** Cache the current hi-res time; the cache gets reset when libevent
@@ -721,6 +722,7 @@ void
 tor_gettimeofday_cache_clear(void)
 {
   cached_time_hires.tv_sec = 0;
+  tor_monotime_cache_clear();
 }
 #endif
 
@@ -11,6 +11,9 @@
  * a digest-to-void* map.
  **/
 
+/* Include math.h before torlog.h redefines log(). */
+#include <math.h>
+
 #include "compat.h"
 #include "util.h"
 #include "torlog.h"
@@ -25,6 +28,9 @@
 
 /** All newly allocated smartlists have this capacity. */
 #define SMARTLIST_DEFAULT_CAPACITY 16
+/** Smartlists from smartlist_new_small() have room for this many elements
+ * before they need an array of their own. */
+#define SMARTLIST_SMALL_CAPACITY 8
 
 /** Allocate and return an empty smartlist.
  */
@@ -35,6 +41,23 @@ smartlist_new(void)
   sl->num_used = 0;
   sl->capacity = SMARTLIST_DEFAULT_CAPACITY;
   sl->list = tor_malloc(sizeof(void *) * sl->capacity);
+  sl->list_is_inline = 0;
+  return sl;
+}
+
+/** Allocate and return an empty smartlist that keeps its first few
+ * elements in the same allocation as the smartlist itself.  Use this for
+ * short-lived lists that are usually short: it costs one malloc rather than
+ * two.  Don't take over the <b>list</b> field of the result. */
+smartlist_t *
+smartlist_new_small(void)
+{
+  smartlist_t *sl = tor_malloc(sizeof(smartlist_t) +
+                               sizeof(void *) * SMARTLIST_SMALL_CAPACITY);
+  sl->num_used = 0;
+  sl->capacity = SMARTLIST_SMALL_CAPACITY;
+  sl->list = (void **)(sl + 1);
+  sl->list_is_inline = 1;
   return sl;
 }
 
@@ -46,7 +69,8 @@ smartlist_free(smartlist_t *sl)
 {
   if (!sl)
     return;
-  tor_free(sl->list);
+  if (!sl->list_is_inline)
+    tor_free(sl->list);
   tor_free(sl);
 }
 
@@ -77,10 +101,27 @@ smartlist_ensure_capacity(smartlist_t *sl, int size)
         higher *= 2;
     }
     sl->capacity = higher;
-    sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)sl->capacity));
+    if (PREDICT_UNLIKELY(sl->list_is_inline)) {
+      void **list = tor_malloc(sizeof(void*)*((size_t)sl->capacity));
+      memcpy(list, sl->list, sizeof(void*)*((size_t)sl->num_used));
+      sl->list = list;
+      sl->list_is_inline = 0;
+    } else {
+      sl->list = tor_realloc(sl->list, sizeof(void*)*((size_t)sl->capacity));
+    }
   }
 }
 
+/** Make sure that <b>sl</b> has room for at least <b>n</b> more elements,
+ * so that adding them won't need to resize it more than once. */
+void
+smartlist_reserve(smartlist_t *sl, int n)
+{
+  tor_assert(n >= 0);
+  tor_assert(sl->num_used + n >= sl->num_used); /* check for overflow. */
+  smartlist_ensure_capacity(sl, sl->num_used + n);
+}
+
 /** Append element to the end of the list. */
 void
 smartlist_add(smartlist_t *sl, void *element)
@@ -89,6 +130,16 @@ smartlist_add(smartlist_t *sl, void *element)
   sl->list[sl->num_used++] = element;
 }
 
+/** Append the <b>n</b> elements of the array <b>elts</b> to the end of
+ * <b>sl</b>, in order. */
+void
+smartlist_add_array(smartlist_t *sl, void * const *elts, int n)
+{
+  smartlist_reserve(sl, n);
+  memcpy(sl->list + sl->num_used, elts, n*sizeof(void*));
+  sl->num_used += n;
+}
+
 /** Append each element from S2 to the end of S1. */
 void
 smartlist_add_all(smartlist_t *s1, const smartlist_t *s2)
@@ -894,7 +945,43 @@ smartlist_uniq_digests256(smartlist_t *sl)
   }
 
 DEFINE_MAP_STRUCTS(strmap_t, char *key, strmap_);
-DEFINE_MAP_STRUCTS(digestmap_t, char key[DIGEST_LEN], digestmap_);
+
+/** A single slot in a digestmap_t.  Digestmaps keep their entries inline in
+ * one open-addressed array, so a lookup walks a short run of adjacent slots
+ * rather than a chain of separately allocated entries.  A slot whose val is
+ * NULL has never been used since the last rehash; one whose val is
+ * DIGESTMAP_REMOVED held an entry that was later removed. */
+typedef struct digestmap_entry_t {
+  char key[DIGEST_LEN];
+  /** digestmap_key_hash() of key.  This fits in what would otherwise be
+   * padding, and lets us skip most full key comparisons. */
+  uint32_t hash;
+  void *val;
+} digestmap_entry_t;
+
+/** A map from digests to void*s, implemented with linear probing. */
+struct digestmap_t {
+  /** Array of n_slots slots, or NULL if nothing has been inserted yet. */
+  digestmap_entry_t *slots;
+  /** Number of slots: 0, or a power of two. */
+  unsigned int n_slots;
+  /** Number of slots holding a live entry. */
+  unsigned int n_used;
+  /** Number of slots marked DIGESTMAP_REMOVED. */
+  unsigned int n_removed;
+};
+
+/** Fewest slots we allocate for a nonempty digestmap. */
+#define DIGESTMAP_MIN_SLOTS 16
+
+/** Address used to mark a digestmap slot whose entry has been removed.  We
+ * never move entries on removal, so removing during iteration is safe. */
+static char digestmap_removed_marker;
+#define DIGESTMAP_REMOVED ((void*)&digestmap_removed_marker)
+
+/** True iff the digestmap slot <b>ent</b> holds a live entry. */
+#define DIGESTMAP_SLOT_IS_LIVE(ent) \
+  ((ent)->val != NULL && (ent)->val != DIGESTMAP_REMOVED)
 
 /** Helper: compare strmap_entry_t objects by key value. */
 static INLINE int
@@ -910,24 +997,116 @@ strmap_entry_hash(const strmap_entry_t *a)
   return ht_string_hash(a->key);
 }
 
-/** Helper: compare digestmap_entry_t objects by key value. */
-static INLINE int
-digestmap_entries_eq(const digestmap_entry_t *a, const digestmap_entry_t *b)
-{
-  return tor_memeq(a->key, b->key, DIGEST_LEN);
+/** Helper: return a hash value for the digest <b>key</b>.
+ *
+ * Digests are usually uniform, but we mix the folded key anyway: we index
+ * a power-of-two table with the low bits, and keys that differ only in
+ * their high bits would otherwise all land in one run of slots. */
+static INLINE uint32_t
+digestmap_key_hash(const char *key)
+{
+  uint32_t w[DIGEST_LEN/4];
+  uint32_t h;
+  memcpy(w, key, DIGEST_LEN);
+  h = w[0] ^ w[1] ^ w[2] ^ w[3] ^ w[4];
+  h *= 0x9e3779b1u;
+  return h ^ (h >> 16);
+}
+
+/** Helper: look up <b>key</b> in <b>map</b>.  Return the slot holding it, or
+ * NULL if it is not present.  In the latter case, if <b>insert_out</b> is
+ * provided, set *<b>insert_out</b> to the slot where <b>key</b> should be
+ * inserted (NULL if the map has no slots). */
+static digestmap_entry_t *
+digestmap_lookup(const digestmap_t *map, const char *key,
+                 digestmap_entry_t **insert_out)
+{
+  digestmap_entry_t *reuse = NULL, *ent;
+  unsigned int idx, mask = map->n_slots - 1;
+  uint32_t hash;
+  if (insert_out)
+    *insert_out = NULL;
+  if (!map->n_slots)
+    return NULL;
+  hash = digestmap_key_hash(key);
+  idx = hash & mask;
+  /* This always terminates: we keep the table at most half full. */
+  for (;;) {
+    ent = &map->slots[idx];
+    if (ent->val == NULL) {
+      if (insert_out)
+        *insert_out = reuse ? reuse : ent;
+      return NULL;
+    } else if (ent->val == DIGESTMAP_REMOVED) {
+      if (!reuse)
+        reuse = ent;
+    } else if (ent->hash == hash && tor_memeq(ent->key, key, DIGEST_LEN)) {
+      return ent;
+    }
+    idx = (idx + 1) & mask;
+  }
 }
 
-/** Helper: return a hash value for a digest_map_t. */
-static INLINE unsigned int
-digestmap_entry_hash(const digestmap_entry_t *a)
+/** Helper: rebuild <b>map</b> with enough room for at least one more entry,
+ * dropping every removed-entry marker. */
+static void
+digestmap_rehash(digestmap_t *map)
+{
+  digestmap_entry_t *old_slots = map->slots, *ent;
+  unsigned int old_n_slots = map->n_slots, n_slots = DIGESTMAP_MIN_SLOTS;
+  unsigned int i, idx;
+
+  /* Leave the table at most a quarter full, so that it can take as many
+   * again before we need to come back here. */
+  while (n_slots < (map->n_used + 1) * 4)
+    n_slots <<= 1;
+
+  map->slots = tor_malloc_zero(n_slots * sizeof(digestmap_entry_t));
+  map->n_slots = n_slots;
+  map->n_removed = 0;
+  for (i = 0; i < old_n_slots; ++i) {
+    if (!DIGESTMAP_SLOT_IS_LIVE(&old_slots[i]))
+      continue;
+    idx = old_slots[i].hash & (n_slots - 1);
+    while (map->slots[idx].val)
+      idx = (idx + 1) & (n_slots - 1);
+    ent = &map->slots[idx];
+    memcpy(ent, &old_slots[i], sizeof(digestmap_entry_t));
+  }
+  tor_free(old_slots);
+}
+
+/** Helper: remove the live entry in <b>ent</b> from <b>map</b>.  Entries
+ * never move, so iterators into <b>map</b> stay valid. */
+static void
+digestmap_remove_slot(digestmap_t *map, digestmap_entry_t *ent)
+{
+  unsigned int idx = (unsigned int)(ent - map->slots);
+  unsigned int mask = map->n_slots - 1;
+  ent->val = DIGESTMAP_REMOVED;
+  --map->n_used;
+  ++map->n_removed;
+  /* If the next slot is empty, no probe sequence passes through this one:
+   * it and any removed slots right before it can become empty again. */
+  if (map->slots[(idx + 1) & mask].val != NULL)
+    return;
+  while (map->slots[idx].val == DIGESTMAP_REMOVED) {
+    map->slots[idx].val = NULL;
+    --map->n_removed;
+    idx = (idx - 1) & mask;
+  }
+}
+
+/** Helper: return the first live slot in <b>map</b> at index <b>idx</b> or
+ * later, or NULL if there is none. */
+static INLINE digestmap_entry_t *
+digestmap_next_live(digestmap_t *map, unsigned int idx)
 {
-#if SIZEOF_INT != 8
-  const uint32_t *p = (const uint32_t*)a->key;
-  return p[0] ^ p[1] ^ p[2] ^ p[3] ^ p[4];
-#else
-  const uint64_t *p = (const uint64_t*)a->key;
-  return p[0] ^ p[1];
-#endif
+  for ( ; idx < map->n_slots; ++idx) {
+    if (DIGESTMAP_SLOT_IS_LIVE(&map->slots[idx]))
+      return &map->slots[idx];
+  }
+  return NULL;
 }
 
 HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
@@ -935,10 +1114,6 @@ HT_PROTOTYPE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
 HT_GENERATE(strmap_impl, strmap_entry_t, node, strmap_entry_hash,
             strmap_entries_eq, 0.6, malloc, realloc, free)
 
-HT_PROTOTYPE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-             digestmap_entries_eq)
-HT_GENERATE(digestmap_impl, digestmap_entry_t, node, digestmap_entry_hash,
-            digestmap_entries_eq, 0.6, malloc, realloc, free)
 
 /** Constructor to create a new empty map from strings to void*'s.
  */
@@ -956,10 +1131,7 @@ strmap_new(void)
 digestmap_t *
 digestmap_new(void)
 {
-  digestmap_t *result;
-  result = tor_malloc(sizeof(digestmap_t));
-  HT_INIT(digestmap_impl, &result->head);
-  return result;
+  return tor_malloc_zero(sizeof(digestmap_t));
 }
 
 /** Set the current value for <b>key</b> to <b>val</b>.  Returns the previous
@@ -993,58 +1165,32 @@ strmap_set(strmap_t *map, const char *key, void *val)
   }
 }
 
-#define OPTIMIZED_DIGESTMAP_SET
-
 /** Like strmap_set() above but for digestmaps. */
 void *
 digestmap_set(digestmap_t *map, const char *key, void *val)
 {
-#ifndef OPTIMIZED_DIGESTMAP_SET
-  digestmap_entry_t *resolve;
-#endif
-  digestmap_entry_t search;
+  digestmap_entry_t *ent, *slot;
   void *oldval;
   tor_assert(map);
   tor_assert(key);
   tor_assert(val);
-  memcpy(&search.key, key, DIGEST_LEN);
-#ifndef OPTIMIZED_DIGESTMAP_SET
-  resolve = HT_FIND(digestmap_impl, &map->head, &search);
-  if (resolve) {
-    oldval = resolve->val;
-    resolve->val = val;
+  ent = digestmap_lookup(map, key, &slot);
+  if (ent) {
+    oldval = ent->val;
+    ent->val = val;
     return oldval;
-  } else {
-    resolve = tor_malloc_zero(sizeof(digestmap_entry_t));
-    memcpy(resolve->key, key, DIGEST_LEN);
-    resolve->val = val;
-    HT_INSERT(digestmap_impl, &map->head, resolve);
-    return NULL;
   }
-#else
-  /* We spend up to 5% of our time in this function, so the code below is
-   * meant to optimize the check/alloc/set cycle by avoiding the two trips to
-   * the hash table that we do in the unoptimized code above.  (Each of
-   * HT_INSERT and HT_FIND calls HT_SET_HASH and HT_FIND_P.)
-   */
-  HT_FIND_OR_INSERT_(digestmap_impl, node, digestmap_entry_hash, &(map->head),
-         digestmap_entry_t, &search, ptr,
-         {
-            /* we found an entry. */
-            oldval = (*ptr)->val;
-            (*ptr)->val = val;
-            return oldval;
-         },
-         {
-           /* We didn't find the entry. */
-           digestmap_entry_t *newent =
-             tor_malloc_zero(sizeof(digestmap_entry_t));
-           memcpy(newent->key, key, DIGEST_LEN);
-           newent->val = val;
-           HT_FOI_INSERT_(node, &(map->head), &search, newent, ptr);
-           return NULL;
-         });
-#endif
+  if (slot && slot->val == DIGESTMAP_REMOVED) {
+    --map->n_removed;
+  } else if ((map->n_used + map->n_removed + 1) * 2 > map->n_slots) {
+    digestmap_rehash(map);
+    digestmap_lookup(map, key, &slot);
+  }
+  memcpy(slot->key, key, DIGEST_LEN);
+  slot->hash = digestmap_key_hash(key);
+  slot->val = val;
+  ++map->n_used;
+  return NULL;
 }
 
 /** Return the current value associated with <b>key</b>, or NULL if no
@@ -1070,17 +1216,11 @@ strmap_get(const strmap_t *map, const char *key)
 void *
 digestmap_get(const digestmap_t *map, const char *key)
 {
-  digestmap_entry_t *resolve;
-  digestmap_entry_t search;
+  digestmap_entry_t *ent;
   tor_assert(map);
   tor_assert(key);
-  memcpy(&search.key, key, DIGEST_LEN);
-  resolve = HT_FIND(digestmap_impl, &map->head, &search);
-  if (resolve) {
-    return resolve->val;
-  } else {
-    return NULL;
-  }
+  ent = digestmap_lookup(map, key, NULL);
+  return ent ? ent->val : NULL;
 }
 
 /** Remove the value currently associated with <b>key</b> from the map.
@@ -1113,20 +1253,16 @@ strmap_remove(strmap_t *map, const char *key)
 void *
 digestmap_remove(digestmap_t *map, const char *key)
 {
-  digestmap_entry_t *resolve;
-  digestmap_entry_t search;
+  digestmap_entry_t *ent;
   void *oldval;
   tor_assert(map);
   tor_assert(key);
-  memcpy(&search.key, key, DIGEST_LEN);
-  resolve = HT_REMOVE(digestmap_impl, &map->head, &search);
-  if (resolve) {
-    oldval = resolve->val;
-    tor_free(resolve);
-    return oldval;
-  } else {
+  ent = digestmap_lookup(map, key, NULL);
+  if (!ent)
     return NULL;
-  }
+  oldval = ent->val;
+  digestmap_remove_slot(map, ent);
+  return oldval;
 }
 
 /** Same as strmap_set, but first converts <b>key</b> to lowercase. */
@@ -1205,7 +1341,7 @@ digestmap_iter_t *
 digestmap_iter_init(digestmap_t *map)
 {
   tor_assert(map);
-  return HT_START(digestmap_impl, &map->head);
+  return digestmap_next_live(map, 0);
 }
 
 /** Advance the iterator <b>iter</b> for <b>map</b> a single step to the next
@@ -1225,7 +1361,7 @@ digestmap_iter_next(digestmap_t *map, digestmap_iter_t *iter)
 {
   tor_assert(map);
   tor_assert(iter);
-  return HT_NEXT(digestmap_impl, &map->head, iter);
+  return digestmap_next_live(map, (unsigned int)(iter - map->slots) + 1);
 }
 
 /** Advance the iterator <b>iter</b> a single step to the next entry, removing
@@ -1251,14 +1387,11 @@ strmap_iter_next_rmv(strmap_t *map, strmap_iter_t *iter)
 digestmap_iter_t *
 digestmap_iter_next_rmv(digestmap_t *map, digestmap_iter_t *iter)
 {
-  digestmap_entry_t *rmv;
   tor_assert(map);
   tor_assert(iter);
-  tor_assert(*iter);
-  rmv = *iter;
-  iter = HT_NEXT_RMV(digestmap_impl, &map->head, iter);
-  tor_free(rmv);
-  return iter;
+  tor_assert(DIGESTMAP_SLOT_IS_LIVE(iter));
+  digestmap_remove_slot(map, iter);
+  return digestmap_next_live(map, (unsigned int)(iter - map->slots) + 1);
 }
 
 /** Set *<b>keyp</b> and *<b>valp</b> to the current entry pointed to by
@@ -1280,11 +1413,11 @@ void
 digestmap_iter_get(digestmap_iter_t *iter, const char **keyp, void **valp)
 {
   tor_assert(iter);
-  tor_assert(*iter);
+  tor_assert(DIGESTMAP_SLOT_IS_LIVE(iter));
   tor_assert(keyp);
   tor_assert(valp);
-  *keyp = (*iter)->key;
-  *valp = (*iter)->val;
+  *keyp = iter->key;
+  *valp = iter->val;
 }
 
 /** Return true iff <b>iter</b> has advanced past the last entry of
@@ -1334,18 +1467,16 @@ strmap_free(strmap_t *map, void (*free_val)(void*))
 void
 digestmap_free(digestmap_t *map, void (*free_val)(void*))
 {
-  digestmap_entry_t **ent, **next, *this;
+  unsigned int i;
   if (!map)
     return;
-  for (ent = HT_START(digestmap_impl, &map->head); ent != NULL; ent = next) {
-    this = *ent;
-    next = HT_NEXT_RMV(digestmap_impl, &map->head, ent);
-    if (free_val)
-      free_val(this->val);
-    tor_free(this);
+  if (free_val) {
+    for (i = 0; i < map->n_slots; ++i) {
+      if (DIGESTMAP_SLOT_IS_LIVE(&map->slots[i]))
+        free_val(map->slots[i].val);
+    }
   }
-  tor_assert(HT_EMPTY(&map->head));
-  HT_CLEAR(digestmap_impl, &map->head);
+  tor_free(map->slots);
   tor_free(map);
 }
 
@@ -1361,7 +1492,24 @@ strmap_assert_ok(const strmap_t *map)
 void
 digestmap_assert_ok(const digestmap_t *map)
 {
-  tor_assert(!digestmap_impl_HT_REP_IS_BAD_(&map->head));
+  unsigned int i, n_used = 0, n_removed = 0;
+  const digestmap_entry_t *ent;
+  tor_assert(map);
+  tor_assert((map->n_slots & (map->n_slots - 1)) == 0);
+  tor_assert(map->n_slots == 0 || map->slots);
+  tor_assert((map->n_used + map->n_removed) * 2 <= map->n_slots);
+  for (i = 0; i < map->n_slots; ++i) {
+    ent = &map->slots[i];
+    if (ent->val == DIGESTMAP_REMOVED) {
+      ++n_removed;
+    } else if (ent->val) {
+      ++n_used;
+      tor_assert(ent->hash == digestmap_key_hash(ent->key));
+      tor_assert(digestmap_lookup(map, ent->key, NULL) == ent);
+    }
+  }
+  tor_assert(n_used == map->n_used);
+  tor_assert(n_removed == map->n_removed);
 }
 
 /** Return true iff <b>map</b> has no entries. */
@@ -1375,7 +1523,7 @@ strmap_isempty(const strmap_t *map)
 int
 digestmap_isempty(const digestmap_t *map)
 {
-  return HT_EMPTY(&map->head);
+  return map->n_used == 0;
 }
 
 /** Return the number of items in <b>map</b>. */
@@ -1389,7 +1537,7 @@ strmap_size(const strmap_t *map)
 int
 digestmap_size(const digestmap_t *map)
 {
-  return HT_SIZE(&map->head);
+  return (int)map->n_used;
 }
 
 /** Declare a function called <b>funcname</b> that acts as a find_nth_FOO
@@ -1431,20 +1579,66 @@ IMPLEMENT_ORDER_FUNC(find_nth_long, long)
 digestset_t *
 digestset_new(int max_elements)
 {
-  /* The probability of false positives is about P=(1 - exp(-kn/m))^k, where k
-   * is the number of hash functions per entry, m is the bits in the array,
-   * and n is the number of elements inserted.  For us, k==4, n<=max_elements,
-   * and m==n_bits= approximately max_elements*32.  This gives
-   *   P<(1-exp(-4*n/(32*n)))^4 == (1-exp(1/-8))^4 == .00019
-   *
-   * It would be more optimal in space vs false positives to get this false
-   * positive rate by going for k==13, and m==18.5n, but we also want to
-   * conserve CPU, and k==13 is pretty big.
-   */
-  int n_bits = 1u << (tor_log2(max_elements)+5);
-  digestset_t *r = tor_malloc(sizeof(digestset_t));
-  r->mask = n_bits - 1;
-  r->ba = bitarray_init_zero(n_bits);
+  return digestset_new_with_fp_rate(max_elements, DIGESTSET_DEFAULT_FP_RATE);
+}
+
+/** Helper: return the false positive rate of a digestset_t whose blocks
+ * hold an average of <b>per_block</b> digests each. */
+static double
+digestset_fp_rate(double per_block)
+{
+  /* The number of digests in any one block is about Poisson-distributed.
+   * With j digests in a block, each word of the block has a given bit set
+   * with probability 1 - (1-1/32)^j, and a false positive needs the right
+   * bit in every one of the block's words. */
+  double p_j = exp(-per_block); /* Probability that a block holds j. */
+  double clear_j = 1.0; /* Probability that a given bit is still clear. */
+  double word_fp, fp = 0.0, tail = 1.0;
+  int i, j;
+  for (j = 0; j < 1024 && (tail > 1e-12 || j < per_block); ++j) {
+    word_fp = 1.0;
+    for (i = 0; i < DIGESTSET_BLOCK_WORDS; ++i)
+      word_fp *= 1.0 - clear_j;
+    fp += p_j * word_fp;
+    tail -= p_j;
+    p_j *= per_block / (j+1);
+    clear_j *= 31.0 / 32.0;
+  }
+  return fp;
+}
+
+/** Return a newly allocated digestset_t, sized so that once it holds
+ * <b>max_elements</b> digests, a digest not in the set is reported as
+ * present with probability at most about <b>fp_rate</b>. */
+digestset_t *
+digestset_new_with_fp_rate(int max_elements, double fp_rate)
+{
+  const int block_bits = DIGESTSET_BLOCK_WORDS * 32;
+  const size_t block_bytes = DIGESTSET_BLOCK_WORDS * 4;
+  int bits_per_elt;
+  uint64_t n_blocks;
+  digestset_t *r;
+
+  if (max_elements < 1)
+    max_elements = 1;
+  /* Find the fewest bits per element that meet fp_rate.  64 bits per
+   * element gets us below one in ten million, which is plenty. */
+  for (bits_per_elt = 2; bits_per_elt < 64; ++bits_per_elt) {
+    if (digestset_fp_rate(((double)block_bits) / bits_per_elt) <= fp_rate)
+      break;
+  }
+
+  n_blocks = CEIL_DIV((uint64_t)max_elements * bits_per_elt, block_bits);
+  tor_assert(n_blocks < UINT32_MAX);
+  tor_assert(n_blocks < SIZE_MAX / block_bytes);
+
+  r = tor_malloc_zero(sizeof(digestset_t));
+  r->n_blocks = (uint32_t) n_blocks;
+  /* Allocate one spare block so that we can align the blocks to a block
+   * boundary, and thereby keep each of them within one cache line. */
+  r->mem = tor_malloc_zero((size_t)(n_blocks + 1) * block_bytes);
+  r->blocks = (uint32_t*) (((uintptr_t)r->mem + block_bytes - 1) &
+                           ~(uintptr_t)(block_bytes - 1));
   return r;
 }
 
@@ -1454,7 +1648,146 @@ digestset_free(digestset_t *set)
 {
   if (!set)
     return;
-  bitarray_free(set->ba);
+  tor_free(set->mem);
   tor_free(set);
 }
 
+/** Return a new, empty hll_t. */
+hll_t *
+hll_new(void)
+{
+  return tor_malloc_zero(sizeof(hll_t));
+}
+
+/** Add every item in <b>from</b> to <b>into</b>. */
+void
+hll_merge(hll_t *into, const hll_t *from)
+{
+  int i;
+  for (i = 0; i < HLL_N_REGISTERS; ++i) {
+    if (from->registers[i] > into->registers[i])
+      into->registers[i] = from->registers[i];
+  }
+}
+
+/** Return an estimate of how many distinct items have been added to
+ * <b>hll</b>. */
+double
+hll_estimate(const hll_t *hll)
+{
+  const double m = HLL_N_REGISTERS;
+  const double alpha = 0.7213 / (1.0 + 1.079 / m);
+  double sum = 0.0, est;
+  int i, n_zero = 0;
+  for (i = 0; i < HLL_N_REGISTERS; ++i) {
+    sum += 1.0 / (double)(U64_LITERAL(1) << hll->registers[i]);
+    if (!hll->registers[i])
+      ++n_zero;
+  }
+  est = alpha * m * m / sum;
+  /* The raw estimate is biased for small counts; there, linear counting
+   * of the empty registers does better.  We use 64-bit hashes, so we need
+   * no correction at the high end. */
+  if (est <= 2.5 * m && n_zero)
+    est = m * tor_mathlog(m / n_zero);
+  return est;
+}
+
+/** An entry in the table of interned strings: a single shared copy of a
+ * string, and the number of references to it. */
+typedef struct interned_string_t {
+  HT_ENTRY(interned_string_t) node;
+  /** The string; points to <b>str</b> in every entry in the table. */
+  const char *key;
+  /** Number of callers holding this string. */
+  unsigned int refcnt;
+  char str[FLEXIBLE_ARRAY_MEMBER];
+} interned_string_t;
+
+/** Helper: compare interned_string_t objects by string value. */
+static INLINE int
+interned_strings_eq(const interned_string_t *a, const interned_string_t *b)
+{
+  return !strcmp(a->key, b->key);
+}
+
+/** Helper: return a hash value for an interned_string_t. */
+static INLINE unsigned int
+interned_string_hash(const interned_string_t *a)
+{
+  return ht_string_hash(a->key);
+}
+
+static HT_HEAD(interned_string_map, interned_string_t) interned_strings =
+  HT_INITIALIZER();
+HT_PROTOTYPE(interned_string_map, interned_string_t, node,
+             interned_string_hash, interned_strings_eq)
+HT_GENERATE(interned_string_map, interned_string_t, node,
+            interned_string_hash, interned_strings_eq, 0.6,
+            malloc, realloc, free)
+
+/** Return a shared copy of the string <b>s</b>.  Every caller that interns
+ * an equal string gets the same pointer, which must not be modified, and
+ * must eventually be released with string_intern_release().  Use this for
+ * strings that many long-lived objects hold identical copies of.
+ *
+ * The table is not locked: only call this from the main thread. */
+const char *
+string_intern(const char *s)
+{
+  interned_string_t search, *ent;
+  size_t len;
+  tor_assert(s);
+  search.key = s;
+  ent = HT_FIND(interned_string_map, &interned_strings, &search);
+  if (ent) {
+    ++ent->refcnt;
+    return ent->str;
+  }
+  len = strlen(s);
+  ent = tor_malloc(STRUCT_OFFSET(interned_string_t, str) + len + 1);
+  memcpy(ent->str, s, len + 1);
+  ent->key = ent->str;
+  ent->refcnt = 1;
+  HT_INSERT(interned_string_map, &interned_strings, ent);
+  return ent->str;
+}
+
+/** Drop one reference to <b>s</b>, which must have come from
+ * string_intern(), and free it once nobody holds it.  Does nothing if
+ * <b>s</b> is NULL. */
+void
+string_intern_release(const char *s)
+{
+  interned_string_t *ent;
+  if (!s)
+    return;
+  ent = SUBTYPE_P(s, interned_string_t, str);
+  tor_assert(ent->key == s);
+  tor_assert(ent->refcnt > 0);
+  if (--ent->refcnt)
+    return;
+  HT_REMOVE(interned_string_map, &interned_strings, ent);
+  tor_free(ent);
+}
+
+/** Return the number of distinct strings currently interned. */
+int
+string_intern_count(void)
+{
+  return (int) HT_SIZE(&interned_strings);
+}
+
+/** Free every interned string, whether or not it is still held. */
+void
+string_intern_free_all(void)
+{
+  interned_string_t **ent, **next, *this;
+  for (ent = HT_START(interned_string_map, &interned_strings);
+       ent != NULL; ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(interned_string_map, &interned_strings, ent);
+    tor_free(this);
+  }
+  HT_CLEAR(interned_string_map, &interned_strings);
+}
@@ -23,14 +23,20 @@ typedef struct smartlist_t {
   void **list;
   int num_used;
   int capacity;
+  /** True iff <b>list</b> is storage allocated along with the smartlist
+   * itself by smartlist_new_small(), which we must not free or realloc. */
+  int list_is_inline;
   /** @} */
 } smartlist_t;
 
 smartlist_t *smartlist_new(void);
+smartlist_t *smartlist_new_small(void);
 void smartlist_free(smartlist_t *sl);
 void smartlist_clear(smartlist_t *sl);
+void smartlist_reserve(smartlist_t *sl, int n);
 void smartlist_add(smartlist_t *sl, void *element);
 void smartlist_add_all(smartlist_t *sl, const smartlist_t *s2);
+void smartlist_add_array(smartlist_t *sl, void * const *elts, int n);
 void smartlist_remove(smartlist_t *sl, const void *element);
 void *smartlist_pop_last(smartlist_t *sl);
 void smartlist_reverse(smartlist_t *sl);
@@ -318,7 +324,6 @@ char *smartlist_join_strings2(smartlist_t *sl, const char *join,
 
 #define DECLARE_MAP_FNS(maptype, keytype, prefix)                       \
   typedef struct maptype maptype;                                       \
-  typedef struct prefix##entry_t *prefix##iter_t;                       \
   maptype* prefix##new(void);                                           \
   void* prefix##set(maptype *map, keytype key, void *val);              \
   void* prefix##get(const maptype *map, keytype key);                   \
@@ -334,8 +339,12 @@ char *smartlist_join_strings2(smartlist_t *sl, const char *join,
   void prefix##assert_ok(const maptype *map)
 
 /* Map from const char * to void *. Implemented with a hash table. */
+typedef struct strmap_entry_t *strmap_iter_t;
 DECLARE_MAP_FNS(strmap_t, const char *, strmap_);
-/* Map from const char[DIGEST_LEN] to void *. Implemented with a hash table. */
+/* Map from const char[DIGEST_LEN] to void *. Implemented with an
+ * open-addressed hash table; a digestmap_iter_t * points at one of its
+ * slots. */
+typedef struct digestmap_entry_t digestmap_iter_t;
 DECLARE_MAP_FNS(digestmap_t, const char *, digestmap_);
 
 #undef DECLARE_MAP_FNS
@@ -591,27 +600,47 @@ bitarray_is_set(bitarray_t *b, int bit)
   return b[bit >> BITARRAY_SHIFT] & (1u << (bit & BITARRAY_MASK));
 }
 
-/** A set of digests, implemented as a Bloom filter. */
+/** Number of 32-bit words in each block of a digestset_t.  Every digest
+ * sets exactly one bit in each word of a single block, and blocks are
+ * aligned so that each lookup touches one cache line. */
+#define DIGESTSET_BLOCK_WORDS 8
+/** False positive rate targeted by digestset_new(). */
+#define DIGESTSET_DEFAULT_FP_RATE 0.001
+
+/** A set of digests, implemented as a split-block Bloom filter. */
 typedef struct {
-  int mask; /**< One less than the number of bits in <b>ba</b>; always one less
-             * than a power of two. */
-  bitarray_t *ba; /**< A bit array to implement the Bloom filter. */
+  uint32_t n_blocks; /**< Number of blocks in <b>blocks</b>. */
+  /** n_blocks * DIGESTSET_BLOCK_WORDS words of filter bits, aligned to a
+   * multiple of the block size. */
+  uint32_t *blocks;
+  void *mem; /**< The allocation holding <b>blocks</b>. */
 } digestset_t;
 
-#define BIT(n) ((n) & set->mask)
+/** Helper: return the block of <b>set</b> that <b>digest</b> belongs in, and
+ * set *<b>bits_out</b> to the part of <b>digest</b> that picks a bit in
+ * each of the block's words.  We use the first 32 bits of the digest to
+ * choose the block, and the next 40 bits, five at a time, to choose the
+ * bits. */
+static INLINE uint32_t *
+digestset_get_block(const digestset_t *set, const char *digest,
+                    uint64_t *bits_out)
+{
+  uint32_t w[3];
+  memcpy(w, digest, sizeof(w));
+  *bits_out = w[1] | (((uint64_t)w[2]) << 32);
+  return set->blocks +
+    (((uint64_t)w[0] * set->n_blocks) >> 32) * DIGESTSET_BLOCK_WORDS;
+}
+
 /** Add the digest <b>digest</b> to <b>set</b>. */
 static INLINE void
 digestset_add(digestset_t *set, const char *digest)
 {
-  const uint32_t *p = (const uint32_t *)digest;
-  const uint32_t d1 = p[0] + (p[1]>>16);
-  const uint32_t d2 = p[1] + (p[2]>>16);
-  const uint32_t d3 = p[2] + (p[3]>>16);
-  const uint32_t d4 = p[3] + (p[0]>>16);
-  bitarray_set(set->ba, BIT(d1));
-  bitarray_set(set->ba, BIT(d2));
-  bitarray_set(set->ba, BIT(d3));
-  bitarray_set(set->ba, BIT(d4));
+  uint64_t bits;
+  uint32_t *block = digestset_get_block(set, digest, &bits);
+  int i;
+  for (i = 0; i < DIGESTSET_BLOCK_WORDS; ++i, bits >>= 5)
+    block[i] |= 1u << (bits & 31);
 }
 
 /** If <b>digest</b> is in <b>set</b>, return nonzero.  Otherwise,
@@ -619,21 +648,58 @@ digestset_add(digestset_t *set, const char *digest)
 static INLINE int
 digestset_isin(const digestset_t *set, const char *digest)
 {
-  const uint32_t *p = (const uint32_t *)digest;
-  const uint32_t d1 = p[0] + (p[1]>>16);
-  const uint32_t d2 = p[1] + (p[2]>>16);
-  const uint32_t d3 = p[2] + (p[3]>>16);
-  const uint32_t d4 = p[3] + (p[0]>>16);
-  return bitarray_is_set(set->ba, BIT(d1)) &&
-         bitarray_is_set(set->ba, BIT(d2)) &&
-         bitarray_is_set(set->ba, BIT(d3)) &&
-         bitarray_is_set(set->ba, BIT(d4));
+  uint64_t bits;
+  const uint32_t *block = digestset_get_block(set, digest, &bits);
+  int i;
+  for (i = 0; i < DIGESTSET_BLOCK_WORDS; ++i, bits >>= 5) {
+    if (!(block[i] & (1u << (bits & 31))))
+      return 0;
+  }
+  return 1;
 }
-#undef BIT
 
 digestset_t *digestset_new(int max_elements);
+digestset_t *digestset_new_with_fp_rate(int max_elements, double fp_rate);
 void digestset_free(digestset_t* set);
 
+/** How many bits of each hash pick a register in a hll_t. */
+#define HLL_INDEX_BITS 10
+/** How many registers a hll_t has.  The standard error of its estimate
+ * is about 1.04/sqrt(HLL_N_REGISTERS), or about 3%. */
+#define HLL_N_REGISTERS (1<<HLL_INDEX_BITS)
+
+/** A HyperLogLog sketch: estimates how many distinct items have been added
+ * to it, in a small fixed amount of space.  Items go in as 64-bit hashes,
+ * which must be uniformly distributed. */
+typedef struct hll_t {
+  /** For each register, the most leading zero bits, plus one, that we have
+   * seen after the index bits of any hash that picks it. */
+  uint8_t registers[HLL_N_REGISTERS];
+} hll_t;
+
+/** Add the item whose hash is <b>hash</b> to <b>hll</b>. */
+static INLINE void
+hll_add(hll_t *hll, uint64_t hash)
+{
+  const int rest_bits = 64 - HLL_INDEX_BITS;
+  unsigned idx = (unsigned)(hash >> rest_bits);
+  uint64_t rest = hash & ((U64_LITERAL(1) << rest_bits) - 1);
+  uint8_t rank = rest ? (uint8_t)(rest_bits - tor_log2(rest)) :
+    (uint8_t)(rest_bits + 1);
+  if (rank > hll->registers[idx])
+    hll->registers[idx] = rank;
+}
+
+hll_t *hll_new(void);
+void hll_merge(hll_t *into, const hll_t *from);
+double hll_estimate(const hll_t *hll);
+#define hll_free(hll) tor_free(hll)
+
+const char *string_intern(const char *s);
+void string_intern_release(const char *s);
+int string_intern_count(void);
+void string_intern_free_all(void);
+
 /* These functions, given an <b>array</b> of <b>n_elements</b>, return the
  * <b>nth</b> lowest element. <b>nth</b>=0 gives the lowest element;
  * <b>n_elements</b>-1 gives the highest; and (<b>n_elements</b>-1) / 2 gives
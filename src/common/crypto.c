@@ -120,6 +120,13 @@ struct crypto_cipher_t
   char iv[CIPHER_IV_LEN]; /**< The initial IV. */
   aes_cnt_cipher_t *cipher; /**< The key in format usable for counter-mode AES
                              * encryption */
+  /** Keystream that crypto_cipher_precompute_keystream() generated ahead of
+   * time, or NULL.  The unused bytes, from keystream_pos up to
+   * keystream_len, come before the current position of <b>cipher</b>. */
+  uint8_t *keystream;
+  size_t keystream_pos; /**< Index of the next unused byte of keystream. */
+  size_t keystream_len; /**< Number of bytes of keystream we've generated. */
+  size_t keystream_alloc; /**< Allocated length of keystream. */
 };
 
 /** A structure to hold the first half (x, g^x) of a Diffie-Hellman handshake
@@ -425,6 +432,10 @@ crypto_cipher_free(crypto_cipher_t *env)
 
   tor_assert(env->cipher);
   aes_cipher_free(env->cipher);
+  if (env->keystream) {
+    memset(env->keystream, 0, env->keystream_alloc);
+    tor_free(env->keystream);
+  }
   memset(env, 0, sizeof(crypto_cipher_t));
   tor_free(env);
 }
@@ -932,6 +943,109 @@ crypto_pk_public_checksig_digest(crypto_pk_t *env, const char *data,
   return 0;
 }
 
+/** Check the signature described by <b>check</b>, and set its
+ * <b>good</b> field. */
+static void
+crypto_pk_checksig_one(crypto_pk_checksig_t *check)
+{
+  size_t buflen = crypto_pk_keysize(check->key);
+  char *buf = tor_malloc(buflen);
+  int r = crypto_pk_public_checksig(check->key, buf, buflen,
+                                    check->sig, check->sig_len);
+  check->good = r >= 0 && (size_t)r >= check->digest_len &&
+    tor_memeq(buf, check->digest, check->digest_len);
+  tor_free(buf);
+}
+
+#ifdef USE_PTHREADS
+/** Shared state for the threads working on one call to
+ * crypto_pk_public_checksig_batch(). */
+typedef struct checksig_batch_t {
+  tor_mutex_t lock; /**< Protects every other field. */
+  tor_cond_t *done_cond; /**< Signalled when n_helpers drops to 0. */
+  crypto_pk_checksig_t *checks; /**< The signatures to check. */
+  int n_checks; /**< Number of elements in <b>checks</b>. */
+  int next; /**< Index of the next check that nobody has taken. */
+  int n_helpers; /**< Number of helper threads still running. */
+} checksig_batch_t;
+
+/** Take and perform checks from <b>batch</b> until none are left. */
+static void
+checksig_batch_work(checksig_batch_t *batch)
+{
+  tor_mutex_acquire(&batch->lock);
+  while (batch->next < batch->n_checks) {
+    crypto_pk_checksig_t *check = &batch->checks[batch->next++];
+    tor_mutex_release(&batch->lock);
+    crypto_pk_checksig_one(check);
+    tor_mutex_acquire(&batch->lock);
+  }
+  tor_mutex_release(&batch->lock);
+}
+
+/** Body of a helper thread for crypto_pk_public_checksig_batch(). */
+static void
+checksig_batch_thread_main(void *arg)
+{
+  checksig_batch_t *batch = arg;
+  checksig_batch_work(batch);
+  tor_mutex_acquire(&batch->lock);
+  if (--batch->n_helpers == 0)
+    tor_cond_signal_all(batch->done_cond);
+  /* Once we release the lock, <b>batch</b> may be gone. */
+  tor_mutex_release(&batch->lock);
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+#endif
+
+/** Check each of the <b>n_checks</b> signatures in <b>checks</b>, setting
+ * the <b>good</b> field of each.  If <b>max_threads</b> is more than 1 and
+ * we have threads, spread the work over up to that many threads, counting
+ * the calling thread, and return once all of them are done. */
+void
+crypto_pk_public_checksig_batch(crypto_pk_checksig_t *checks,
+                                int n_checks, int max_threads)
+{
+  int i;
+#ifdef USE_PTHREADS
+  checksig_batch_t batch;
+  int n_helpers = MIN(max_threads, n_checks) - 1;
+
+  if (n_helpers > 0) {
+    memset(&batch, 0, sizeof(batch));
+    tor_mutex_init(&batch.lock);
+    batch.done_cond = tor_cond_new();
+    batch.checks = checks;
+    batch.n_checks = n_checks;
+
+    tor_mutex_acquire(&batch.lock);
+    for (i = 0; i < n_helpers; ++i) {
+      if (spawn_func(checksig_batch_thread_main, &batch) < 0)
+        break;
+      ++batch.n_helpers;
+    }
+    tor_mutex_release(&batch.lock);
+
+    /* Do our share, then wait for the helpers to finish theirs. */
+    checksig_batch_work(&batch);
+    tor_mutex_acquire(&batch.lock);
+    while (batch.n_helpers)
+      tor_cond_wait(batch.done_cond, &batch.lock);
+    tor_mutex_release(&batch.lock);
+
+    tor_cond_free(batch.done_cond);
+    tor_mutex_uninit(&batch.lock);
+    return;
+  }
+#else
+  (void) max_threads;
+#endif
+
+  for (i = 0; i < n_checks; ++i)
+    crypto_pk_checksig_one(&checks[i]);
+}
+
 /** Sign <b>fromlen</b> bytes of data from <b>from</b> with the private key in
  * <b>env</b>, using PKCS1 padding.  On success, write the signature to
  * <b>to</b>, and return the number of bytes written.  On failure, return
@@ -1289,6 +1403,99 @@ crypto_cipher_get_key(crypto_cipher_t *env)
   return env->key;
 }
 
+#ifdef __GNUC__
+/** A type for xoring buffers together as fast as we can: with GCC and
+ * clang, a 16-byte vector, so that we get SSE2 or NEON where we have
+ * them. */
+typedef uint64_t xor_word_t __attribute__((vector_size(16)));
+#else
+typedef uint64_t xor_word_t;
+#endif
+
+/** Helper: xor up to <b>len</b> bytes from <b>from</b> with whatever
+ * keystream <b>env</b> has precomputed, storing the result in <b>to</b>.
+ * Return the number of bytes handled; the caller must pass the rest to
+ * the AES counter mode. */
+static INLINE size_t
+crypto_cipher_use_keystream(crypto_cipher_t *env, char *to,
+                            const char *from, size_t len)
+{
+  size_t n = env->keystream_len - env->keystream_pos, i;
+  const uint8_t *ks;
+
+  if (PREDICT_LIKELY(n == 0))
+    return 0;
+  if (n > len)
+    n = len;
+  ks = env->keystream + env->keystream_pos;
+
+  for (i = 0; i + sizeof(xor_word_t) <= n; i += sizeof(xor_word_t)) {
+    xor_word_t a, b;
+    memcpy(&a, from+i, sizeof(a));
+    memcpy(&b, ks+i, sizeof(b));
+    a ^= b;
+    memcpy(to+i, &a, sizeof(a));
+  }
+  for ( ; i < n; ++i)
+    to[i] = from[i] ^ ks[i];
+
+  env->keystream_pos += n;
+  if (env->keystream_pos == env->keystream_len)
+    env->keystream_pos = env->keystream_len = 0;
+  return n;
+}
+
+/** Helper: crypt the <b>len</b> bytes at <b>buf</b> in place with
+ * <b>env</b>, using up any precomputed keystream first. */
+static INLINE void
+crypto_cipher_crypt_chunk(crypto_cipher_t *env, char *buf, size_t len)
+{
+  size_t n = crypto_cipher_use_keystream(env, buf, buf, len);
+  if (len > n)
+    aes_crypt_inplace(env->cipher, buf+n, len-n);
+}
+
+/** Make sure that <b>env</b> has at least <b>len</b> bytes of keystream
+ * generated ahead of time, so that encrypting the next <b>len</b> bytes
+ * with it takes only an xor.  Return the number of bytes of keystream we
+ * had to generate.
+ */
+size_t
+crypto_cipher_precompute_keystream(crypto_cipher_t *env, size_t len)
+{
+  size_t have, need;
+  tor_assert(env);
+  tor_assert(len < SIZE_T_CEILING);
+
+  have = env->keystream_len - env->keystream_pos;
+  if (have >= len)
+    return 0;
+  need = len - have;
+
+  if (env->keystream_alloc < len) {
+    /* Don't use realloc: we don't want to leave old keystream lying around
+     * in freed memory. */
+    uint8_t *ks = tor_malloc(len);
+    if (have)
+      memcpy(ks, env->keystream + env->keystream_pos, have);
+    if (env->keystream) {
+      memset(env->keystream, 0, env->keystream_alloc);
+      tor_free(env->keystream);
+    }
+    env->keystream = ks;
+    env->keystream_alloc = len;
+  } else if (env->keystream_pos) {
+    memmove(env->keystream, env->keystream + env->keystream_pos, have);
+  }
+  env->keystream_pos = 0;
+
+  /* Counter mode keystream is just the encryption of zeros. */
+  memset(env->keystream + have, 0, need);
+  aes_crypt_inplace(env->cipher, (char*)env->keystream + have, need);
+  env->keystream_len = len;
+  return need;
+}
+
 /** Encrypt <b>fromlen</b> bytes from <b>from</b> using the cipher
  * <b>env</b>; on success, store the result to <b>to</b> and return 0.
  * On failure, return -1.
@@ -1297,6 +1504,7 @@ int
 crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
                       const char *from, size_t fromlen)
 {
+  size_t n;
   tor_assert(env);
   tor_assert(env->cipher);
   tor_assert(from);
@@ -1304,7 +1512,9 @@ crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
   tor_assert(to);
   tor_assert(fromlen < SIZE_T_CEILING);
 
-  aes_crypt(env->cipher, from, fromlen, to);
+  n = crypto_cipher_use_keystream(env, to, from, fromlen);
+  if (fromlen > n)
+    aes_crypt(env->cipher, from+n, fromlen-n, to+n);
   return 0;
 }
 
@@ -1316,12 +1526,15 @@ int
 crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                       const char *from, size_t fromlen)
 {
+  size_t n;
   tor_assert(env);
   tor_assert(from);
   tor_assert(to);
   tor_assert(fromlen < SIZE_T_CEILING);
 
-  aes_crypt(env->cipher, from, fromlen, to);
+  n = crypto_cipher_use_keystream(env, to, from, fromlen);
+  if (fromlen > n)
+    aes_crypt(env->cipher, from+n, fromlen-n, to+n);
   return 0;
 }
 
@@ -1332,7 +1545,28 @@ int
 crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *buf, size_t len)
 {
   tor_assert(len < SIZE_T_CEILING);
-  aes_crypt_inplace(env->cipher, buf, len);
+  crypto_cipher_crypt_chunk(env, buf, len);
+  return 0;
+}
+
+/** Encrypt <b>len</b> bytes in place in each of the <b>n_bufs</b> buffers in
+ * <b>bufs</b>, in order, using the cipher in <b>env</b>.  This is equivalent
+ * to calling crypto_cipher_crypt_inplace() on each buffer in turn, but lets
+ * callers that have a run of same-sized payloads for one cipher (such as
+ * relay cells) pay the per-call overhead once.  On success, return 0.  On
+ * failure, return -1.
+ */
+int
+crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char **bufs,
+                                  size_t len, int n_bufs)
+{
+  int i;
+  tor_assert(env);
+  tor_assert(bufs);
+  tor_assert(n_bufs >= 0);
+  tor_assert(len < SIZE_T_CEILING);
+  for (i = 0; i < n_bufs; ++i)
+    crypto_cipher_crypt_chunk(env, bufs[i], len);
   return 0;
 }
 
@@ -1574,6 +1808,132 @@ crypto_digest_get_digest(crypto_digest_t *digest,
   memset(r, 0, sizeof(r));
 }
 
+/** Check whether adding the <b>len</b> bytes at <b>data</b> to
+ * <b>digest</b> would give a digest whose first <b>expected_len</b> bytes
+ * are the ones at <b>expected</b>.  If so, add them and return 1.
+ * Otherwise, leave <b>digest</b> unchanged and return 0.
+ *
+ * This is equivalent to checking the result of crypto_digest_add_bytes()
+ * and rolling back with crypto_digest_dup() and crypto_digest_assign() on
+ * a mismatch, but it works on copies of the state that live on the stack,
+ * and so never touches the heap.
+ */
+int
+crypto_digest_add_bytes_if_matches(crypto_digest_t *digest,
+                                   const char *data, size_t len,
+                                   const char *expected, size_t expected_len)
+{
+  crypto_digest_t tentative;
+  char r[DIGEST256_LEN];
+  int matches;
+  tor_assert(digest);
+  tor_assert(data);
+  tor_assert(expected);
+  tor_assert(expected_len <= DIGEST256_LEN);
+
+  memcpy(&tentative, digest, sizeof(crypto_digest_t));
+  crypto_digest_add_bytes(&tentative, data, len);
+  crypto_digest_get_digest(&tentative, r, expected_len);
+  matches = tor_memeq(r, expected, expected_len);
+  if (matches)
+    memcpy(digest, &tentative, sizeof(crypto_digest_t));
+  memset(&tentative, 0, sizeof(tentative));
+  memset(r, 0, sizeof(r));
+  return matches;
+}
+
+/** Add the <b>len</b> bytes at <b>buf</b> to <b>digest</b>; replace the
+ * <b>mac_len</b> bytes at <b>buf</b>+<b>mac_offset</b> with the start of
+ * the resulting digest; and then encrypt all <b>len</b> bytes in place with
+ * <b>env</b>.  The MAC bytes are hashed as they are, so the caller will
+ * usually want them zeroed.  Return 0 on success, -1 on failure.
+ *
+ * This is what every hop that originates a relay cell does with it; doing
+ * it in one call means that the buffer is still in cache for the
+ * encryption, and that callers never need to unpack and repack headers.
+ */
+int
+crypto_cipher_digest_and_encrypt_inplace(crypto_cipher_t *env,
+                                         crypto_digest_t *digest,
+                                         char *buf, size_t len,
+                                         size_t mac_offset, size_t mac_len)
+{
+  char mac[DIGEST256_LEN];
+
+  tor_assert(env);
+  tor_assert(digest);
+  tor_assert(buf);
+  tor_assert(len < SIZE_T_CEILING);
+  tor_assert(mac_len <= DIGEST256_LEN);
+  tor_assert(mac_offset + mac_len <= len);
+
+  crypto_digest_add_bytes(digest, buf, len);
+  crypto_digest_get_digest(digest, mac, mac_len);
+  memcpy(buf+mac_offset, mac, mac_len);
+  crypto_cipher_crypt_chunk(env, buf, len);
+
+  memset(mac, 0, sizeof(mac));
+  return 0;
+}
+
+/** Decrypt the <b>len</b> bytes at <b>buf</b> in place with <b>env</b>.
+ * Then, if the <b>zero_len</b> bytes at <b>buf</b>+<b>zero_offset</b> are
+ * all zero, check whether the <b>mac_len</b> bytes at
+ * <b>buf</b>+<b>mac_offset</b> are the start of the digest we get by adding
+ * the plaintext, with those bytes zeroed, to <b>digest</b>.
+ *
+ * If the MAC matches, add the plaintext to <b>digest</b>, leave the MAC
+ * bytes zeroed, and return 1.  Otherwise, leave <b>digest</b> alone and the
+ * plaintext as we decrypted it, and return 0.
+ *
+ * This is equivalent to crypto_cipher_crypt_inplace() followed by
+ * crypto_digest_add_bytes_if_matches(), and is what every hop that might
+ * be a relay cell's destination does with it.
+ */
+int
+crypto_cipher_decrypt_and_check_inplace(crypto_cipher_t *env,
+                                        crypto_digest_t *digest,
+                                        char *buf, size_t len,
+                                        size_t zero_offset, size_t zero_len,
+                                        size_t mac_offset, size_t mac_len)
+{
+  crypto_digest_t tentative;
+  char received[DIGEST256_LEN];
+  char mac[DIGEST256_LEN];
+  size_t i;
+  int matches;
+
+  tor_assert(env);
+  tor_assert(digest);
+  tor_assert(buf);
+  tor_assert(len < SIZE_T_CEILING);
+  tor_assert(mac_len <= DIGEST256_LEN);
+  tor_assert(zero_offset + zero_len <= len);
+  tor_assert(mac_offset + mac_len <= len);
+
+  crypto_cipher_crypt_chunk(env, buf, len);
+
+  for (i = 0; i < zero_len; ++i) {
+    if (buf[zero_offset+i])
+      return 0; /* It can't be for us; no need to hash it. */
+  }
+
+  memcpy(received, buf+mac_offset, mac_len);
+  memset(buf+mac_offset, 0, mac_len);
+  memcpy(&tentative, digest, sizeof(crypto_digest_t));
+  crypto_digest_add_bytes(&tentative, buf, len);
+  crypto_digest_get_digest(&tentative, mac, mac_len);
+  matches = tor_memeq(mac, received, mac_len);
+  if (matches)
+    memcpy(digest, &tentative, sizeof(crypto_digest_t));
+  else
+    memcpy(buf+mac_offset, received, mac_len);
+
+  memset(&tentative, 0, sizeof(tentative));
+  memset(mac, 0, sizeof(mac));
+  return matches;
+}
+
 /** Allocate and return a new digest object with the same state as
  * <b>digest</b>
  */
@@ -1914,10 +2274,87 @@ crypto_get_stored_dynamic_dh_modulus(const char *fname)
   return dynamic_dh_modulus;
 }
 
+/** Return a new BIGNUM holding the static TLS DH modulus: the 1024-bit
+ * safe prime that Apache uses for its DH stuff; see
+ * modules/ssl/ssl_engine_dh.c.  Apache also uses a generator of 2 with this
+ * prime. */
+static BIGNUM *
+crypto_new_static_tls_dh_prime(void)
+{
+  BIGNUM *tls_prime = BN_new();
+  int r;
+  tor_assert(tls_prime);
+
+  r =BN_hex2bn(&tls_prime,
+               "D67DE440CBBBDC1936D693D34AFD0AD50C84D239A45F520BB88174CB98"
+               "BCE951849F912E639C72FB13B4B4D7177E16D55AC179BA420B2A29FE324A"
+               "467A635E81FF5901377BEDDCFD33168A461AAD3B72DAE8860078045B07A7"
+               "DBCA7874087D1510EA9FCC9DDD330507DD62DB88AEAA747DE0F4D6E2BD68"
+               "B0E7393E0F24218EB3");
+  tor_assert(r);
+  return tls_prime;
+}
+
+/** If we're using the static TLS DH modulus while a fresh dynamic one is
+ * generated in the background, the file to store the dynamic one in once
+ * it's ready.  Otherwise NULL.  Only the main thread touches this. */
+static char *dh_pending_fname = NULL;
+
+#ifdef TOR_IS_MULTITHREADED
+/** Protects dh_gen_running and dh_gen_result, which we share with the
+ * thread that generates dynamic DH moduli. */
+static tor_mutex_t *dh_gen_lock = NULL;
+/** True while a thread is generating a dynamic DH modulus. */
+static int dh_gen_running = 0;
+/** A dynamic DH modulus that a thread has generated, and that
+ * crypto_install_generated_tls_dh_prime() hasn't yet taken; or NULL. */
+static BIGNUM *dh_gen_result = NULL;
+
+/** Thread body: generate a dynamic DH modulus, and leave it in
+ * dh_gen_result for the main thread. */
+static void
+dh_gen_thread_main(void *arg)
+{
+  BIGNUM *p;
+  (void)arg;
+  p = crypto_generate_dynamic_dh_modulus();
+  tor_mutex_acquire(dh_gen_lock);
+  if (dh_gen_result)
+    BN_free(dh_gen_result);
+  dh_gen_result = p;
+  dh_gen_running = 0;
+  tor_mutex_release(dh_gen_lock);
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+
+/** Make sure that a thread is generating a dynamic DH modulus, or has
+ * generated one we haven't taken yet.  Return 0 on success, -1 if we
+ * couldn't start a thread. */
+static int
+crypto_start_dh_gen_thread(void)
+{
+  int r = 0;
+  if (!dh_gen_lock)
+    dh_gen_lock = tor_mutex_new();
+  tor_mutex_acquire(dh_gen_lock);
+  if (!dh_gen_running && !dh_gen_result) {
+    if (spawn_func(dh_gen_thread_main, NULL) < 0)
+      r = -1;
+    else
+      dh_gen_running = 1;
+  }
+  tor_mutex_release(dh_gen_lock);
+  return r;
+}
+#endif
+
 /** Set the global TLS Diffie-Hellman modulus.
  * If <b>dynamic_dh_modulus_fname</b> is set, try to read a dynamic DH modulus
  * off it and use it as the DH modulus. If that's not possible,
- * generate a new dynamic DH modulus.
+ * generate a new dynamic DH modulus: in a background thread if we can, in
+ * which case we use the Apache mod_ssl DH modulus until
+ * crypto_install_generated_tls_dh_prime() switches to the new one.
  * If <b>dynamic_dh_modulus_fname</b> is NULL, use the Apache mod_ssl DH
  * modulus. */
 void
@@ -1925,18 +2362,27 @@ crypto_set_tls_dh_prime(const char *dynamic_dh_modulus_fname)
 {
   BIGNUM *tls_prime = NULL;
   int store_dh_prime_afterwards = 0;
-  int r;
 
   /* If the space is occupied, free the previous TLS DH prime */
   if (dh_param_p_tls) {
     BN_free(dh_param_p_tls);
     dh_param_p_tls = NULL;
   }
+  /* Whatever we were waiting for, we don't want it any more. */
+  tor_free(dh_pending_fname);
 
   if (dynamic_dh_modulus_fname) { /* use dynamic DH modulus: */
     log_info(LD_OR, "Using stored dynamic DH modulus.");
     tls_prime = crypto_get_stored_dynamic_dh_modulus(dynamic_dh_modulus_fname);
 
+#ifdef TOR_IS_MULTITHREADED
+    if (!tls_prime && crypto_start_dh_gen_thread() == 0) {
+      log_notice(LD_OR, "Generating fresh dynamic DH modulus in the "
+                 "background. Until it's ready, we'll use the default one.");
+      dh_pending_fname = tor_strdup(dynamic_dh_modulus_fname);
+      tls_prime = crypto_new_static_tls_dh_prime();
+    }
+#endif
     if (!tls_prime) {
       log_notice(LD_OR, "Generating fresh dynamic DH modulus. "
                  "This might take a while...");
@@ -1945,20 +2391,7 @@ crypto_set_tls_dh_prime(const char *dynamic_dh_modulus_fname)
       store_dh_prime_afterwards++;
     }
   } else { /* use the static DH prime modulus used by Apache in mod_ssl: */
-    tls_prime = BN_new();
-    tor_assert(tls_prime);
-
-    /* This is the 1024-bit safe prime that Apache uses for its DH stuff; see
-     * modules/ssl/ssl_engine_dh.c; Apache also uses a generator of 2 with this
-     * prime.
-     */
-    r =BN_hex2bn(&tls_prime,
-                 "D67DE440CBBBDC1936D693D34AFD0AD50C84D239A45F520BB88174CB98"
-                 "BCE951849F912E639C72FB13B4B4D7177E16D55AC179BA420B2A29FE324A"
-                 "467A635E81FF5901377BEDDCFD33168A461AAD3B72DAE8860078045B07A7"
-                 "DBCA7874087D1510EA9FCC9DDD330507DD62DB88AEAA747DE0F4D6E2BD68"
-                 "B0E7393E0F24218EB3");
-    tor_assert(r);
+    tls_prime = crypto_new_static_tls_dh_prime();
   }
 
   tor_assert(tls_prime);
@@ -1973,6 +2406,42 @@ crypto_set_tls_dh_prime(const char *dynamic_dh_modulus_fname)
     }
 }
 
+/** If crypto_set_tls_dh_prime() left us waiting for a dynamic DH modulus,
+ * and the background thread has finished generating it, make it our TLS DH
+ * modulus, store it to disk, and return 1.  Otherwise return 0.  Callers
+ * should make a new TLS context when we return 1, so that new connections
+ * use the new modulus. */
+int
+crypto_install_generated_tls_dh_prime(void)
+{
+#ifdef TOR_IS_MULTITHREADED
+  BIGNUM *p;
+  if (!dh_pending_fname)
+    return 0;
+
+  tor_mutex_acquire(dh_gen_lock);
+  p = dh_gen_result;
+  dh_gen_result = NULL;
+  tor_mutex_release(dh_gen_lock);
+  if (!p)
+    return 0;
+
+  if (dh_param_p_tls)
+    BN_free(dh_param_p_tls);
+  dh_param_p_tls = p;
+  log_notice(LD_OR, "Finished generating dynamic DH modulus; switching to "
+             "it.");
+  if (crypto_store_dynamic_dh_modulus(dh_pending_fname)) {
+    log_notice(LD_CRYPTO, "Failed while storing dynamic DH modulus. "
+               "Make sure your data directory is sane.");
+  }
+  tor_free(dh_pending_fname);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
 /** Initialize dh_param_p and dh_param_g if they are not already
  * set. */
 static void
@@ -2998,6 +3467,25 @@ crypto_global_cleanup(void)
     BN_free(dh_param_p_tls);
   if (dh_param_g)
     BN_free(dh_param_g);
+  tor_free(dh_pending_fname);
+#ifdef TOR_IS_MULTITHREADED
+  if (dh_gen_lock) {
+    /* If a thread is still generating a modulus, it needs the lock; let it
+     * keep that, and the modulus, until we exit. */
+    int running;
+    tor_mutex_acquire(dh_gen_lock);
+    running = dh_gen_running;
+    if (dh_gen_result) {
+      BN_free(dh_gen_result);
+      dh_gen_result = NULL;
+    }
+    tor_mutex_release(dh_gen_lock);
+    if (!running) {
+      tor_mutex_free(dh_gen_lock);
+      dh_gen_lock = NULL;
+    }
+  }
+#endif
 
 #ifndef DISABLE_ENGINES
   ENGINE_cleanup();
@@ -110,6 +110,17 @@ typedef struct crypto_cipher_t crypto_cipher_t;
 typedef struct crypto_digest_t crypto_digest_t;
 typedef struct crypto_dh_t crypto_dh_t;
 
+/** One signature for crypto_pk_public_checksig_batch() to check. */
+typedef struct crypto_pk_checksig_t {
+  crypto_pk_t *key; /**< The public key that should have made the
+                     * signature. */
+  const char *sig; /**< The signature to check. */
+  size_t sig_len; /**< Length of <b>sig</b>. */
+  const char *digest; /**< The digest that <b>sig</b> should sign. */
+  size_t digest_len; /**< Length of <b>digest</b>. */
+  int good; /**< Output: true iff the signature checked out. */
+} crypto_pk_checksig_t;
+
 /* global state */
 int crypto_global_init(int hardwareAccel,
                        const char *accelName,
@@ -122,6 +133,7 @@ crypto_pk_t *crypto_pk_new(void);
 void crypto_pk_free(crypto_pk_t *env);
 
 void crypto_set_tls_dh_prime(const char *dynamic_dh_modulus_fname);
+int crypto_install_generated_tls_dh_prime(void);
 
 crypto_cipher_t *crypto_cipher_new(const char *key);
 crypto_cipher_t *crypto_cipher_new_with_iv(const char *key, const char *iv);
@@ -163,6 +175,8 @@ int crypto_pk_public_checksig(crypto_pk_t *env, char *to, size_t tolen,
                               const char *from, size_t fromlen);
 int crypto_pk_public_checksig_digest(crypto_pk_t *env, const char *data,
                                size_t datalen, const char *sig, size_t siglen);
+void crypto_pk_public_checksig_batch(crypto_pk_checksig_t *checks,
+                                     int n_checks, int max_threads);
 int crypto_pk_private_sign(crypto_pk_t *env, char *to, size_t tolen,
                            const char *from, size_t fromlen);
 int crypto_pk_private_sign_digest(crypto_pk_t *env, char *to, size_t tolen,
@@ -191,6 +205,21 @@ int crypto_cipher_encrypt(crypto_cipher_t *env, char *to,
 int crypto_cipher_decrypt(crypto_cipher_t *env, char *to,
                           const char *from, size_t fromlen);
 int crypto_cipher_crypt_inplace(crypto_cipher_t *env, char *d, size_t len);
+int crypto_cipher_crypt_inplace_multi(crypto_cipher_t *env, char **bufs,
+                                      size_t len, int n_bufs);
+size_t crypto_cipher_precompute_keystream(crypto_cipher_t *env, size_t len);
+int crypto_cipher_digest_and_encrypt_inplace(crypto_cipher_t *env,
+                                             crypto_digest_t *digest,
+                                             char *buf, size_t len,
+                                             size_t mac_offset,
+                                             size_t mac_len);
+int crypto_cipher_decrypt_and_check_inplace(crypto_cipher_t *env,
+                                            crypto_digest_t *digest,
+                                            char *buf, size_t len,
+                                            size_t zero_offset,
+                                            size_t zero_len,
+                                            size_t mac_offset,
+                                            size_t mac_len);
 
 int crypto_cipher_encrypt_with_iv(const char *key,
                                   char *to, size_t tolen,
@@ -213,6 +242,10 @@ void crypto_digest_add_bytes(crypto_digest_t *digest, const char *data,
                              size_t len);
 void crypto_digest_get_digest(crypto_digest_t *digest,
                               char *out, size_t out_len);
+int crypto_digest_add_bytes_if_matches(crypto_digest_t *digest,
+                                       const char *data, size_t len,
+                                       const char *expected,
+                                       size_t expected_len);
 crypto_digest_t *crypto_digest_dup(const crypto_digest_t *digest);
 void crypto_digest_assign(crypto_digest_t *into,
                           const crypto_digest_t *from);
@@ -9,6 +9,71 @@
 #include "orconfig.h"
 #include "di_ops.h"
 
+#include <string.h>
+
+/* On platforms with 128-bit vector registers that every CPU supports, we
+ * compare sixteen bytes at a time in tor_memeq(). */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DI_OPS_SSE2
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define DI_OPS_NEON
+#endif
+
+/** Return the 64-bit word at <b>p</b>, in host order.  <b>p</b> needn't be
+ * aligned. */
+static uint64_t
+load_u64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/** Return the 32-bit word at <b>p</b>, in host order.  <b>p</b> needn't be
+ * aligned. */
+static uint32_t
+load_u32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/** Return the 64-bit word at <b>p</b>, in big-endian order, so that words
+ * compare the same way as the bytes that make them up. */
+static uint64_t
+load_u64_be(const uint8_t *p)
+{
+  return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+         ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+         ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+         ((uint64_t)p[6] << 8)  |  (uint64_t)p[7];
+}
+
+/** Return 1 if <b>x</b> &lt; <b>y</b> and 0 otherwise, without branching
+ * on either.  (This is the unsigned less-than formula from Hacker's
+ * Delight, section 2-12: the top bit of the expression is the borrow out of
+ * x - y.) */
+static int
+ct_lt_u64(uint64_t x, uint64_t y)
+{
+  return (int)(((~x & y) | ((~x | y) & (x - y))) >> 63);
+}
+
+/** Return 1 if <b>diff</b> is zero and 0 otherwise, without branching on
+ * it.  Callers OR together the XOR of everything they compare, and pass us
+ * the result. */
+static int
+diff_is_zero(uint64_t diff)
+{
+  /* Fold the difference into the low 32 bits.  If it's now 0, subtracting
+   * 1 sets all 64 bits; otherwise it leaves the top 32 bits clear. */
+  diff = (diff | (diff >> 32)) & 0xffffffffu;
+  return 1 & (int)((diff - 1) >> 32);
+}
+
 /**
  * Timing-safe version of memcmp.  As memcmp, compare the <b>sz</b> bytes at
  * <b>a</b> with the <b>sz</b> bytes at <b>b</b>, and return less than 0 if
@@ -26,19 +91,34 @@ tor_memcmp(const void *a, const void *b, size_t len)
   const uint8_t *x = a;
   const uint8_t *y = b;
   size_t i = len;
+  size_t head = len & 7;
   int retval = 0;
 
-  /* This loop goes from the end of the arrays to the start.  At the
-   * start of every iteration, before we decrement i, we have set
-   * "retval" equal to the result of memcmp(a+i,b+i,len-i).  During the
-   * loop, we update retval by leaving it unchanged if x[i]==y[i] and
-   * setting it to x[i]-y[i] if x[i]!= y[i].
-   *
-   * The following assumes we are on a system with two's-complement
-   * arithmetic.  We check for this at configure-time with the check
-   * that sets USING_TWOS_COMPLEMENT.  If we aren't two's complement, then
-   * torint.h will stop compilation with an error.
-   */
+  /* This loop goes from the end of the arrays to the start, eight bytes at
+   * a time, until fewer than eight bytes are left.  At the start of every
+   * iteration, we have set "retval" equal to the sign of
+   * memcmp(a+i,b+i,len-i).  Loading each group of eight bytes as a
+   * big-endian word makes the words compare as the bytes do, so we can
+   * update retval the same way as in the byte loop below: leave it alone
+   * if the words are equal, and set it to the sign of their difference if
+   * they aren't. */
+  while (i > head) {
+    uint64_t w1, w2;
+    int differ_p, order;
+    i -= 8;
+    w1 = load_u64_be(x+i);
+    w2 = load_u64_be(y+i);
+    /* order is 1 if w1 > w2, -1 if w1 < w2, and 0 if they're equal. */
+    order = ct_lt_u64(w2, w1) - ct_lt_u64(w1, w2);
+    differ_p = !diff_is_zero(w1 ^ w2);
+    /* If the words differ, differ_p - 1 is 0, so this zeroes retval;
+     * otherwise it's ~0, and leaves retval unchanged.  Then we add order,
+     * which is 0 if the words are equal. */
+    retval &= differ_p - 1;
+    retval += order;
+  }
+
+  /* Now handle the first len % 8 bytes, one at a time. */
   while (i--) {
     int v1 = x[i];
     int v2 = y[i];
@@ -83,6 +163,72 @@ tor_memcmp(const void *a, const void *b, size_t len)
   return retval;
 }
 
+/** Return the bitwise OR of <b>a</b>[i] ^ <b>b</b>[i] over the
+ * 16*<b>n_blocks</b> bytes at <b>a</b> and <b>b</b>, folded into 64 bits:
+ * that is, 0 if the ranges are equal and nonzero otherwise. */
+static uint64_t
+memdiff_blocks16(const uint8_t *a, const uint8_t *b, size_t n_blocks)
+{
+#if defined(DI_OPS_SSE2)
+  __m128i acc = _mm_setzero_si128();
+  for ( ; n_blocks; --n_blocks, a += 16, b += 16) {
+    acc = _mm_or_si128(acc,
+                       _mm_xor_si128(_mm_loadu_si128((const __m128i*)a),
+                                     _mm_loadu_si128((const __m128i*)b)));
+  }
+  acc = _mm_or_si128(acc, _mm_srli_si128(acc, 8));
+  acc = _mm_or_si128(acc, _mm_srli_si128(acc, 4));
+  return (uint32_t)_mm_cvtsi128_si32(acc);
+#elif defined(DI_OPS_NEON)
+  uint8x16_t acc = vdupq_n_u8(0);
+  uint64x2_t words;
+  for ( ; n_blocks; --n_blocks, a += 16, b += 16)
+    acc = vorrq_u8(acc, veorq_u8(vld1q_u8(a), vld1q_u8(b)));
+  words = vreinterpretq_u64_u8(acc);
+  return vgetq_lane_u64(words, 0) | vgetq_lane_u64(words, 1);
+#else
+  uint64_t acc = 0;
+  for ( ; n_blocks; --n_blocks, a += 16, b += 16) {
+    acc |= load_u64(a) ^ load_u64(b);
+    acc |= load_u64(a+8) ^ load_u64(b+8);
+  }
+  return acc;
+#endif
+}
+
+/** As memdiff_blocks16(), for 20-byte ranges such as SHA1 digests. */
+static uint64_t
+memdiff_20(const uint8_t *a, const uint8_t *b)
+{
+  return memdiff_blocks16(a, b, 1) |
+    (load_u32(a+16) ^ load_u32(b+16));
+}
+
+/** As memdiff_blocks16(), for arbitrary ranges of <b>sz</b> bytes. */
+static uint64_t
+memdiff(const uint8_t *a, const uint8_t *b, size_t sz)
+{
+  uint64_t acc = memdiff_blocks16(a, b, sz >> 4);
+  a += sz & ~(size_t)15;
+  b += sz & ~(size_t)15;
+  sz &= 15;
+  if (sz >= 8) {
+    acc |= load_u64(a) ^ load_u64(b);
+    a += 8;
+    b += 8;
+    sz -= 8;
+  }
+  if (sz >= 4) {
+    acc |= load_u32(a) ^ load_u32(b);
+    a += 4;
+    b += 4;
+    sz -= 4;
+  }
+  while (sz--)
+    acc |= *a++ ^ *b++;
+  return acc;
+}
+
 /**
  * Timing-safe memory comparison.  Return true if the <b>sz</b> bytes at
  * <b>a</b> are the same as the <b>sz</b> bytes at <b>b</b>, and 0 otherwise.
@@ -91,43 +237,27 @@ tor_memcmp(const void *a, const void *b, size_t len)
  * behavior is not data-dependent: it should return in the same amount of time
  * regardless of the contents of <b>a</b> and <b>b</b>.  It differs from
  * !tor_memcmp(a,b,sz) by being faster.
+ *
+ * We compare a word or a vector at a time, and have fixed-size versions for
+ * the 20- and 32-byte digests that most of our callers compare.  Choosing
+ * among them depends only on <b>sz</b>, never on the data.
  */
 int
 tor_memeq(const void *a, const void *b, size_t sz)
 {
-  /* Treat a and b as byte ranges. */
   const uint8_t *ba = a, *bb = b;
-  uint32_t any_difference = 0;
-  while (sz--) {
-    /* Set byte_diff to all of those bits that are different in *ba and *bb,
-     * and advance both ba and bb. */
-    const uint8_t byte_diff = *ba++ ^ *bb++;
-
-    /* Set bits in any_difference if they are set in byte_diff. */
-    any_difference |= byte_diff;
-  }
+  uint64_t any_difference;
 
-  /* Now any_difference is 0 if there are no bits different between
-   * a and b, and is nonzero if there are bits different between a
-   * and b.  Now for paranoia's sake, let's convert it to 0 or 1.
-   *
-   * (If we say "!any_difference", the compiler might get smart enough
-   * to optimize-out our data-independence stuff above.)
-   *
-   * To unpack:
-   *
-   * If any_difference == 0:
-   *            any_difference - 1 == ~0
-   *     (any_difference - 1) >> 8 == 0x00ffffff
-   *     1 & ((any_difference - 1) >> 8) == 1
-   *
-   * If any_difference != 0:
-   *            0 < any_difference < 256, so
-   *            0 < any_difference - 1 < 255
-   *            (any_difference - 1) >> 8 == 0
-   *            1 & ((any_difference - 1) >> 8) == 0
-   */
-
-  return 1 & ((any_difference - 1) >> 8);
-}
+  if (sz == 20)
+    any_difference = memdiff_20(ba, bb);
+  else if (sz == 32)
+    any_difference = memdiff_blocks16(ba, bb, 2);
+  else
+    any_difference = memdiff(ba, bb, sz);
 
+  /* Now any_difference is 0 if there are no bits different between a and
+   * b, and is nonzero if there are bits different between a and b.  (If we
+   * said "!any_difference", the compiler might get smart enough to
+   * optimize-out our data-independence stuff above.) */
+  return diff_is_zero(any_difference);
+}
@@ -20,10 +20,17 @@
     unsigned hth_load_limit;                                            \
     /* Position of hth_table_length in the primes table. */             \
     int hth_prime_idx;                                                  \
+    /* While the table is growing: the previous, smaller table, whose   \
+     * buckets we are still moving into hth_table a few at a time. */   \
+    struct type **hth_old_table;                                        \
+    /* How long is hth_old_table? */                                    \
+    unsigned hth_old_table_length;                                      \
+    /* How many buckets at the start of hth_old_table have been moved? */ \
+    unsigned hth_rehash_idx;                                            \
   }
 
 #define HT_INITIALIZER()                        \
-  { NULL, 0, 0, 0, -1 }
+  { NULL, 0, 0, 0, -1, NULL, 0, 0 }
 
 #ifdef HT_NO_CACHE_HASH_VALUES
 #define HT_ENTRY(type)                          \
@@ -46,8 +53,20 @@
   ((head)->hth_n_entries)
 
 /* Return memory usage for a hashtable (not counting the entries themselves) */
-#define HT_MEM_USAGE(head)                         \
-  (sizeof(*head) + (head)->hth_table_length * sizeof(void*))
+#define HT_MEM_USAGE(head)                                              \
+  (sizeof(*head) + ((head)->hth_table_length +                          \
+                    (head)->hth_old_table_length) * sizeof(void*))
+
+/* When a table grows, we don't rehash every element at once: that would
+ * stall whatever insert happened to trigger the growth for time linear in
+ * the size of the table.  Instead, every insert, replace, or remove moves
+ * this many buckets from the old table into the new one.  Since each
+ * growth at least doubles the load limit, and the load factor is at least
+ * 1/HT_REHASH_STEP, the old table is always drained before the next
+ * growth. */
+#ifndef HT_REHASH_STEP
+#define HT_REHASH_STEP 16
+#endif
 
 #define HT_FIND(name, head, elm)     name##_HT_FIND((head), (elm))
 #define HT_INSERT(name, head, elm)   name##_HT_INSERT((head), (elm))
@@ -131,6 +150,7 @@ ht_string_hash(const char *s)
   int name##_HT_GROW(struct name *ht, unsigned min_capacity);           \
   void name##_HT_CLEAR(struct name *ht);                                \
   int name##_HT_REP_IS_BAD_(const struct name *ht);                     \
+  void name##_HT_REHASH_STEP_(struct name *ht, unsigned n_buckets);     \
   static INLINE void                                                    \
   name##_HT_INIT(struct name *head) {                                   \
     head->hth_table_length = 0;                                         \
@@ -138,13 +158,37 @@ ht_string_hash(const char *s)
     head->hth_n_entries = 0;                                            \
     head->hth_load_limit = 0;                                           \
     head->hth_prime_idx = -1;                                           \
+    head->hth_old_table = NULL;                                         \
+    head->hth_old_table_length = 0;                                     \
+    head->hth_rehash_idx = 0;                                           \
+  }                                                                     \
+  /* Helper: make sure the table 'head' has room for one more element,  \
+   * and move a few more buckets if we're in the middle of growing it. */ \
+  static INLINE void                                                    \
+  name##_HT_PREPARE_ADD_(struct name *head)                             \
+  {                                                                     \
+    if (!head->hth_table || head->hth_n_entries >= head->hth_load_limit) \
+      name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    if (head->hth_old_table)                                            \
+      name##_HT_REHASH_STEP_(head, HT_REHASH_STEP);                     \
+  }                                                                     \
+  /* Helper: if the table 'head' is still growing, finish moving its old \
+   * buckets.  Iteration calls this, so that every element it visits is \
+   * in hth_table. */                                                   \
+  static INLINE void                                                    \
+  name##_HT_FINISH_REHASH_(struct name *head)                           \
+  {                                                                     \
+    if (head->hth_old_table)                                            \
+      name##_HT_REHASH_STEP_(head, head->hth_old_table_length);         \
   }                                                                     \
   /* Helper: returns a pointer to the right location in the table       \
-   * 'head' to find or insert the element 'elm'. */                     \
+   * 'head' to find or insert the element 'elm'.  While the table is    \
+   * growing, a match may still be in the old table; new elements always \
+   * go in the new one. */                                              \
   static INLINE struct type **                                          \
   name##_HT_FIND_P_(struct name *head, struct type *elm)                \
   {                                                                     \
-    struct type **p;                                                    \
+    struct type **p, **end;                                             \
     if (!head->hth_table)                                               \
       return NULL;                                                      \
     p = &HT_BUCKET_(head, field, elm, hashfn);                          \
@@ -153,7 +197,17 @@ ht_string_hash(const char *s)
         return p;                                                       \
       p = &(*p)->field.hte_next;                                        \
     }                                                                   \
-    return p;                                                           \
+    if (!head->hth_old_table)                                           \
+      return p;                                                         \
+    end = p;                                                            \
+    p = &head->hth_old_table[HT_ELT_HASH_(elm, field, hashfn)           \
+                             % head->hth_old_table_length];             \
+    while (*p) {                                                        \
+      if (eqfn(*p, elm))                                                \
+        return p;                                                       \
+      p = &(*p)->field.hte_next;                                        \
+    }                                                                   \
+    return end;                                                         \
   }                                                                     \
   /* Return a pointer to the element in the table 'head' matching 'elm', \
    * or NULL if no such element exists */                               \
@@ -172,8 +226,7 @@ ht_string_hash(const char *s)
   name##_HT_INSERT(struct name *head, struct type *elm)                 \
   {                                                                     \
     struct type **p;                                                    \
-    if (!head->hth_table || head->hth_n_entries >= head->hth_load_limit) \
-      name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    name##_HT_PREPARE_ADD_(head);                                       \
     ++head->hth_n_entries;                                              \
     HT_SET_HASH_(elm, field, hashfn);                                   \
     p = &HT_BUCKET_(head, field, elm, hashfn);                          \
@@ -187,8 +240,7 @@ ht_string_hash(const char *s)
   name##_HT_REPLACE(struct name *head, struct type *elm)                \
   {                                                                     \
     struct type **p, *r;                                                \
-    if (!head->hth_table || head->hth_n_entries >= head->hth_load_limit) \
-      name##_HT_GROW(head, head->hth_n_entries+1);                      \
+    name##_HT_PREPARE_ADD_(head);                                       \
     HT_SET_HASH_(elm, field, hashfn);                                   \
     p = name##_HT_FIND_P_(head, elm);                                   \
     r = *p;                                                             \
@@ -208,6 +260,8 @@ ht_string_hash(const char *s)
   name##_HT_REMOVE(struct name *head, struct type *elm)                 \
   {                                                                     \
     struct type **p, *r;                                                \
+    if (head->hth_old_table)                                            \
+      name##_HT_REHASH_STEP_(head, HT_REHASH_STEP);                     \
     HT_SET_HASH_(elm, field, hashfn);                                   \
     p = name##_HT_FIND_P_(head,elm);                                    \
     if (!p || !*p)                                                      \
@@ -231,6 +285,7 @@ ht_string_hash(const char *s)
     struct type **p, **nextp, *next;                                    \
     if (!head->hth_table)                                               \
       return;                                                           \
+    name##_HT_FINISH_REHASH_(head);                                     \
     for (idx=0; idx < head->hth_table_length; ++idx) {                  \
       p = &head->hth_table[idx];                                        \
       while (*p) {                                                      \
@@ -252,6 +307,7 @@ ht_string_hash(const char *s)
   name##_HT_START(struct name *head)                                    \
   {                                                                     \
     unsigned b = 0;                                                     \
+    name##_HT_FINISH_REHASH_(head);                                     \
     while (b < head->hth_table_length) {                                \
       if (head->hth_table[b])                                           \
         return &head->hth_table[b];                                     \
@@ -325,6 +381,7 @@ ht_string_hash(const char *s)
       return 0;                                                         \
     if (head->hth_load_limit > size)                                    \
       return 0;                                                         \
+    name##_HT_FINISH_REHASH_(head);                                     \
     prime_idx = head->hth_prime_idx;                                    \
     do {                                                                \
       new_len = name##_PRIMES[++prime_idx];                             \
@@ -332,22 +389,16 @@ ht_string_hash(const char *s)
     } while (new_load_limit <= size &&                                  \
              prime_idx < (int)name##_N_PRIMES);                         \
     if ((new_table = mallocfn(new_len*sizeof(struct type*)))) {         \
-      unsigned b;                                                       \
       memset(new_table, 0, new_len*sizeof(struct type*));               \
-      for (b = 0; b < head->hth_table_length; ++b) {                    \
-        struct type *elm, *next;                                        \
-        unsigned b2;                                                    \
-        elm = head->hth_table[b];                                       \
-        while (elm) {                                                   \
-          next = elm->field.hte_next;                                   \
-          b2 = HT_ELT_HASH_(elm, field, hashfn) % new_len;              \
-          elm->field.hte_next = new_table[b2];                          \
-          new_table[b2] = elm;                                          \
-          elm = next;                                                   \
-        }                                                               \
-      }                                                                 \
-      if (head->hth_table)                                              \
+      /* Leave the old elements where they are; inserts and removes will \
+       * move them over a few buckets at a time. */                     \
+      if (head->hth_n_entries) {                                        \
+        head->hth_old_table = head->hth_table;                          \
+        head->hth_old_table_length = head->hth_table_length;            \
+        head->hth_rehash_idx = 0;                                       \
+      } else if (head->hth_table) {                                     \
         freefn(head->hth_table);                                        \
+      }                                                                 \
       head->hth_table = new_table;                                      \
     } else {                                                            \
       unsigned b, b2;                                                   \
@@ -375,6 +426,36 @@ ht_string_hash(const char *s)
     head->hth_load_limit = new_load_limit;                              \
     return 0;                                                           \
   }                                                                     \
+  /* Move up to 'n_buckets' buckets from the old table of 'head' into its \
+   * current table, and free the old table once it is empty. */         \
+  void                                                                  \
+  name##_HT_REHASH_STEP_(struct name *head, unsigned n_buckets)         \
+  {                                                                     \
+    unsigned b = head->hth_rehash_idx;                                  \
+    unsigned end = head->hth_old_table_length;                          \
+    if (n_buckets < end - b)                                            \
+      end = b + n_buckets;                                              \
+    for ( ; b < end; ++b) {                                             \
+      struct type *elm, *next;                                          \
+      unsigned b2;                                                      \
+      elm = head->hth_old_table[b];                                     \
+      while (elm) {                                                     \
+        next = elm->field.hte_next;                                     \
+        b2 = HT_ELT_HASH_(elm, field, hashfn) % head->hth_table_length; \
+        elm->field.hte_next = head->hth_table[b2];                      \
+        head->hth_table[b2] = elm;                                      \
+        elm = next;                                                     \
+      }                                                                 \
+      head->hth_old_table[b] = NULL;                                    \
+    }                                                                   \
+    head->hth_rehash_idx = b;                                           \
+    if (b == head->hth_old_table_length) {                              \
+      freefn(head->hth_old_table);                                      \
+      head->hth_old_table = NULL;                                       \
+      head->hth_old_table_length = 0;                                   \
+      head->hth_rehash_idx = 0;                                         \
+    }                                                                   \
+  }                                                                     \
   /* Free all storage held by 'head'.  Does not free 'head' itself, or  \
    * individual elements. */                                            \
   void                                                                  \
@@ -382,6 +463,8 @@ ht_string_hash(const char *s)
   {                                                                     \
     if (head->hth_table)                                                \
       freefn(head->hth_table);                                          \
+    if (head->hth_old_table)                                            \
+      freefn(head->hth_old_table);                                      \
     head->hth_table_length = 0;                                         \
     name##_HT_INIT(head);                                               \
   }                                                                     \
@@ -394,7 +477,8 @@ ht_string_hash(const char *s)
     struct type *elm;                                                   \
     if (!head->hth_table_length) {                                      \
       if (!head->hth_table && !head->hth_n_entries &&                   \
-          !head->hth_load_limit && head->hth_prime_idx == -1)           \
+          !head->hth_load_limit && head->hth_prime_idx == -1 &&         \
+          !head->hth_old_table)                                         \
         return 0;                                                       \
       else                                                              \
         return 1;                                                       \
@@ -417,6 +501,26 @@ ht_string_hash(const char *s)
         ++n;                                                            \
       }                                                                 \
     }                                                                   \
+    if (head->hth_old_table) {                                          \
+      if (head->hth_rehash_idx >= head->hth_old_table_length ||         \
+          head->hth_old_table_length >= head->hth_table_length)         \
+        return 7;                                                       \
+      for (i = 0; i < head->hth_old_table_length; ++i) {                \
+        elm = head->hth_old_table[i];                                   \
+        if (elm && i < head->hth_rehash_idx)                            \
+          return 20000 + i;                                             \
+        for ( ; elm; elm = elm->field.hte_next) {                       \
+          if (HT_ELT_HASH_(elm, field, hashfn) != hashfn(elm))          \
+            return 1000 + i;                                            \
+          if ((HT_ELT_HASH_(elm, field, hashfn) %                       \
+               head->hth_old_table_length) != i)                        \
+            return 30000 + i;                                           \
+          ++n;                                                          \
+        }                                                               \
+      }                                                                 \
+    } else if (head->hth_old_table_length || head->hth_rehash_idx) {    \
+      return 8;                                                         \
+    }                                                                   \
     if (n != head->hth_n_entries)                                       \
       return 6;                                                         \
     return 0;                                                           \
@@ -429,9 +533,7 @@ ht_string_hash(const char *s)
   {                                                                     \
     struct name *var##_head_ = head;                                    \
     struct eltype **var;                                                \
-    if (!var##_head_->hth_table ||                                      \
-        var##_head_->hth_n_entries >= var##_head_->hth_load_limit)      \
-      name##_HT_GROW(var##_head_, var##_head_->hth_n_entries+1);        \
+    name##_HT_PREPARE_ADD_(var##_head_);                                \
     HT_SET_HASH_((elm), field, hashfn);                                 \
     var = name##_HT_FIND_P_(var##_head_, (elm));                        \
     if (*var) {                                                         \
@@ -55,6 +55,9 @@ typedef struct logfile_t {
   log_callback callback; /**< If not NULL, send messages to this function. */
   log_severity_list_t *severities; /**< Which severity of messages should we
                                     * log for each log domain? */
+  unsigned int n_async_dropped; /**< How many messages have we dropped for
+                                 * this log since we last said so, because
+                                 * the log writer thread fell behind? */
 } logfile_t;
 
 static void log_free(logfile_t *victim);
@@ -129,10 +132,81 @@ static smartlist_t *pending_cb_messages = NULL;
 /** Unlock the log_mutex */
 #define UNLOCK_LOGS() STMT_BEGIN tor_mutex_release(&log_mutex); STMT_END
 
+#ifdef USE_PTHREADS
+/** Defined if we can hand log messages off to a writer thread. */
+#define HAVE_ASYNC_LOGS
+#endif
+
+#ifdef HAVE_ASYNC_LOGS
+/** How many bytes of messages may be waiting for the log writer thread
+ * before we start dropping debug and info messages. */
+#define ASYNC_LOG_BUF_SIZE (1<<20)
+
+/** Header for one message in async_log_buf; the message itself follows. */
+typedef struct async_log_record_t {
+  int fd; /**< The fd to write the message to. */
+  size_t len; /**< The length of the message. */
+} async_log_record_t;
+
+/** Boolean: should we hand debug and info messages for file logs off to
+ * the log writer thread?  Only changed while holding log_mutex and
+ * async_log_mutex. */
+static int async_logs_enabled = 0;
+/** Protects all the async_log_* variables below. */
+static tor_mutex_t *async_log_mutex = NULL;
+/** Signalled when there are messages for the writer thread, or it should
+ * exit. */
+static tor_cond_t *async_log_wakeup_cond = NULL;
+/** Signalled when the writer thread has written everything it was
+ * given, or has exited. */
+static tor_cond_t *async_log_idle_cond = NULL;
+/** Messages waiting for the writer thread, as a sequence of
+ * async_log_record_t headers each followed by its message. */
+static char *async_log_buf = NULL;
+/** The number of bytes used in async_log_buf. */
+static size_t async_log_buf_len = 0;
+/** A second buffer of ASYNC_LOG_BUF_SIZE bytes, which the writer thread
+ * swaps with async_log_buf when it takes a batch of messages; NULL while
+ * the writer thread is using it. */
+static char *async_log_spare_buf = NULL;
+/** Boolean: is the writer thread running? */
+static int async_log_writer_running = 0;
+/** Boolean: is the writer thread in the middle of writing a batch? */
+static int async_log_writer_busy = 0;
+/** Boolean: should the writer thread exit once it has written
+ * everything? */
+static int async_log_writer_should_exit = 0;
+/** The fds, cast to void pointers, that the writer thread failed to write
+ * to, and that logv() hasn't yet marked dead. */
+static smartlist_t *async_log_failed_fds = NULL;
+#endif
+
 /** What's the lowest log level anybody cares about?  Checking this lets us
  * bail out early from log_debug if we aren't debugging.  */
 int _log_global_min_severity = LOG_NOTICE;
 
+/** For each severity, the union of the domains that any log wants messages
+ * of that severity for.  Checking this lets log_debug and log_info bail
+ * out early, without a function call, when nobody wants their message. */
+log_domain_mask_t _log_global_domain_masks[LOG_DEBUG-LOG_ERR+1];
+
+/** Recompute _log_global_min_severity and _log_global_domain_masks from
+ * our list of logs.  Call this whenever the logs or their severities
+ * change. */
+static void
+update_log_global_filters(void)
+{
+  logfile_t *lf;
+  int i;
+  memset(_log_global_domain_masks, 0, sizeof(_log_global_domain_masks));
+  for (lf = logfiles; lf; lf = lf->next) {
+    for (i = LOG_ERR; i <= LOG_DEBUG; ++i)
+      _log_global_domain_masks[SEVERITY_MASK_IDX(i)] |=
+        lf->severities->masks[SEVERITY_MASK_IDX(i)];
+  }
+  _log_global_min_severity = get_min_log_level();
+}
+
 static void delete_log(logfile_t *victim);
 static void close_log(logfile_t *victim);
 
@@ -205,6 +279,172 @@ _log_prefix(char *buf, size_t buf_len, int severity)
     return n+r;
 }
 
+#ifdef HAVE_ASYNC_LOGS
+/** Main function for the log writer thread: repeatedly take every message
+ * in async_log_buf, and write each run of messages for the same fd with a
+ * single write.  This function must never log anything, since whoever is
+ * waiting for it may be holding log_mutex. */
+static void
+async_log_writer_main(void *arg)
+{
+  (void)arg;
+  tor_mutex_acquire(async_log_mutex);
+  for (;;) {
+    char *batch;
+    size_t batch_len, pos = 0;
+
+    while (!async_log_buf_len && !async_log_writer_should_exit) {
+      async_log_writer_busy = 0;
+      tor_cond_signal_all(async_log_idle_cond);
+      tor_cond_wait(async_log_wakeup_cond, async_log_mutex);
+    }
+    if (!async_log_buf_len)
+      break;
+
+    batch = async_log_buf;
+    batch_len = async_log_buf_len;
+    async_log_buf = async_log_spare_buf;
+    async_log_spare_buf = NULL;
+    async_log_buf_len = 0;
+    async_log_writer_busy = 1;
+    tor_mutex_release(async_log_mutex);
+
+    while (pos < batch_len) {
+      /* Slide each run of messages for one fd together over their
+       * headers, so that we can write them all at once.  The run starts
+       * where its first header was, and never catches up with the next
+       * header we have yet to read. */
+      async_log_record_t rec;
+      size_t run_start = pos, run_len = 0;
+      int fd;
+      memcpy(&rec, batch+pos, sizeof(rec));
+      fd = rec.fd;
+      while (pos < batch_len) {
+        memcpy(&rec, batch+pos, sizeof(rec));
+        if (rec.fd != fd)
+          break;
+        memmove(batch+run_start+run_len, batch+pos+sizeof(rec), rec.len);
+        run_len += rec.len;
+        pos += sizeof(rec) + rec.len;
+      }
+      /* We mustn't log from this thread, so if the write fails, leave a
+       * note for logv() to mark the log dead, as it would have if it had
+       * done the write itself. */
+      if (write_all(fd, batch+run_start, run_len, 0) < 0) {
+        void *fdp = (void*)(intptr_t)fd;
+        tor_mutex_acquire(async_log_mutex);
+        if (!smartlist_isin(async_log_failed_fds, fdp))
+          smartlist_add(async_log_failed_fds, fdp);
+        tor_mutex_release(async_log_mutex);
+      }
+    }
+
+    tor_mutex_acquire(async_log_mutex);
+    async_log_spare_buf = batch;
+  }
+  async_log_writer_busy = 0;
+  async_log_writer_running = 0;
+  tor_cond_signal_all(async_log_idle_cond);
+  tor_mutex_release(async_log_mutex);
+}
+
+/** If the log writer thread has failed to write to <b>fd</b>, forget that
+ * it did, and return 1.  Otherwise return 0.  Requires async_log_mutex. */
+static int
+async_log_take_failure(int fd)
+{
+  void *fdp = (void*)(intptr_t)fd;
+  if (!smartlist_isin(async_log_failed_fds, fdp))
+    return 0;
+  smartlist_remove(async_log_failed_fds, fdp);
+  return 1;
+}
+
+/** Wait until the log writer thread, if there is one, has written every
+ * message we've handed it.  Return -1 if it failed to write to <b>fd</b>
+ * since we last checked, and 0 otherwise. */
+static int
+async_log_flush(int fd)
+{
+  int r;
+  if (!async_log_mutex)
+    return 0;
+  tor_mutex_acquire(async_log_mutex);
+  while (async_log_writer_running &&
+         (async_log_buf_len || async_log_writer_busy)) {
+    tor_cond_signal_one(async_log_wakeup_cond);
+    tor_cond_wait(async_log_idle_cond, async_log_mutex);
+  }
+  r = async_log_take_failure(fd) ? -1 : 0;
+  tor_mutex_release(async_log_mutex);
+  return r;
+}
+
+/** Append a record for <b>len</b> bytes at <b>msg</b>, to be written to
+ * <b>fd</b>, to async_log_buf.  Return 0 on success, or -1 if there isn't
+ * room.  Requires async_log_mutex. */
+static int
+async_log_append(int fd, const char *msg, size_t len)
+{
+  async_log_record_t rec;
+  if (ASYNC_LOG_BUF_SIZE - async_log_buf_len < sizeof(rec) + len)
+    return -1;
+  rec.fd = fd;
+  rec.len = len;
+  memcpy(async_log_buf+async_log_buf_len, &rec, sizeof(rec));
+  memcpy(async_log_buf+async_log_buf_len+sizeof(rec), msg, len);
+  async_log_buf_len += sizeof(rec) + len;
+  return 0;
+}
+
+/** Hand the <b>len</b>-byte formatted message at <b>msg</b> off to the log
+ * writer thread, to be written to <b>lf</b>.  If the writer has fallen so
+ * far behind that there's no room, drop the message and remember that we
+ * did.  Return -1 without queueing the message if the writer has failed to
+ * write to <b>lf</b>, and 0 otherwise.  Requires log_mutex. */
+static int
+async_log_queue(logfile_t *lf, const char *msg, size_t len)
+{
+  tor_mutex_acquire(async_log_mutex);
+  if (async_log_take_failure(lf->fd)) {
+    tor_mutex_release(async_log_mutex);
+    return -1;
+  }
+  if (lf->n_async_dropped) {
+    char note[256];
+    size_t n = _log_prefix(note, sizeof(note), LOG_WARN);
+    int r = tor_snprintf(note+n, sizeof(note)-n,
+                         "Dropped %u debug/info log message(s) because "
+                         "the log writer fell behind.\n",
+                         lf->n_async_dropped);
+    if (r >= 0 && async_log_append(lf->fd, note, n+r) == 0)
+      lf->n_async_dropped = 0;
+  }
+  if (lf->n_async_dropped || async_log_append(lf->fd, msg, len) < 0)
+    ++lf->n_async_dropped;
+  tor_cond_signal_one(async_log_wakeup_cond);
+  tor_mutex_release(async_log_mutex);
+  return 0;
+}
+
+/** Stop the log writer thread, if it's running, once it has written
+ * everything it was given.  Requires log_mutex. */
+static void
+async_log_writer_stop(void)
+{
+  if (!async_log_mutex)
+    return;
+  tor_mutex_acquire(async_log_mutex);
+  async_logs_enabled = 0;
+  async_log_writer_should_exit = 1;
+  while (async_log_writer_running) {
+    tor_cond_signal_one(async_log_wakeup_cond);
+    tor_cond_wait(async_log_idle_cond, async_log_mutex);
+  }
+  tor_mutex_release(async_log_mutex);
+}
+#endif
+
 /** If lf refers to an actual file that we have just opened, and the file
  * contains no data, log an "opening new logfile" message at the top.
  *
@@ -405,6 +645,23 @@ logv(int severity, log_domain_mask_t domain, const char *funcname,
       lf = lf->next;
       continue;
     }
+#ifdef HAVE_ASYNC_LOGS
+    if (async_logs_enabled && severity > LOG_NOTICE) {
+      if (async_log_queue(lf, buf, msg_len) < 0)
+        lf->seems_dead = 1;
+      lf = lf->next;
+      continue;
+    }
+    /* Anything important gets written right away, but only after the
+     * messages that came before it.  If the writer thread couldn't write
+     * those, treat this log as dead, as we would have if we'd written them
+     * ourselves. */
+    if (async_log_mutex && async_log_flush(lf->fd) < 0) {
+      lf->seems_dead = 1;
+      lf = lf->next;
+      continue;
+    }
+#endif
     if (write_all(lf->fd, buf, msg_len, 0) < 0) { /* error */
       /* don't log the error! mark this log entry to be blown away, and
        * continue. */
@@ -469,7 +726,7 @@ _log_debug(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
   /* For GCC we do this check in the macro. */
-  if (PREDICT_LIKELY(LOG_DEBUG > _log_global_min_severity))
+  if (PREDICT_LIKELY(!log_global_domain_is_enabled(LOG_DEBUG, domain)))
     return;
   va_start(ap,format);
   logv(LOG_DEBUG, domain, _log_fn_function_name, format, ap);
@@ -480,7 +737,8 @@ void
 _log_info(log_domain_mask_t domain, const char *format, ...)
 {
   va_list ap;
-  if (LOG_INFO > _log_global_min_severity)
+  /* For GCC we do this check in the macro. */
+  if (!log_global_domain_is_enabled(LOG_INFO, domain))
     return;
   va_start(ap,format);
   logv(LOG_INFO, domain, _log_fn_function_name, format, ap);
@@ -541,6 +799,22 @@ logs_free_all(void)
   logfile_t *victim, *next;
   smartlist_t *messages;
   LOCK_LOGS();
+#ifdef HAVE_ASYNC_LOGS
+  async_log_writer_stop();
+  if (async_log_mutex) {
+    /* The writer thread has exited, so nothing else can be using these. */
+    tor_mutex_free(async_log_mutex);
+    async_log_mutex = NULL;
+    tor_cond_free(async_log_wakeup_cond);
+    tor_cond_free(async_log_idle_cond);
+    async_log_wakeup_cond = async_log_idle_cond = NULL;
+    tor_free(async_log_buf);
+    tor_free(async_log_spare_buf);
+    async_log_buf_len = 0;
+    smartlist_free(async_log_failed_fds);
+    async_log_failed_fds = NULL;
+  }
+#endif
   next = logfiles;
   logfiles = NULL;
   messages = pending_cb_messages;
@@ -594,6 +868,12 @@ delete_log(logfile_t *victim)
 static void
 close_log(logfile_t *victim)
 {
+#ifdef HAVE_ASYNC_LOGS
+  /* Don't let the writer thread write to this fd once we close it, and
+   * forget any failure it had with it, since the fd may get reused. */
+  if (victim->fd >= 0)
+    (void) async_log_flush(victim->fd);
+#endif
   if (victim->needs_close && victim->fd >= 0) {
     close(victim->fd);
     victim->fd = -1;
@@ -638,7 +918,7 @@ add_stream_log_impl(const log_severity_list_t *severity,
   lf->next = logfiles;
 
   logfiles = lf;
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
 }
 
 /** Add a log handler named <b>name</b> to send all messages in <b>severity</b>
@@ -674,6 +954,54 @@ logs_set_domain_logging(int enabled)
   UNLOCK_LOGS();
 }
 
+/** Set whether debug and info messages for file and stream logs are
+ * written by a separate thread, so that slow writes don't stall the
+ * thread that logged them.  Messages of severity notice and higher are
+ * still written immediately, after any earlier messages.  Return 0 on
+ * success, or -1 if we can't write logs from a separate thread here. */
+int
+logs_set_async(int enabled)
+{
+#ifdef HAVE_ASYNC_LOGS
+  int r = 0;
+  LOCK_LOGS();
+  if (!enabled) {
+    async_log_writer_stop();
+  } else if (!async_logs_enabled) {
+    if (!async_log_mutex) {
+      async_log_wakeup_cond = tor_cond_new();
+      async_log_idle_cond = tor_cond_new();
+      if (!async_log_wakeup_cond || !async_log_idle_cond) {
+        tor_cond_free(async_log_wakeup_cond);
+        tor_cond_free(async_log_idle_cond);
+        async_log_wakeup_cond = async_log_idle_cond = NULL;
+        UNLOCK_LOGS();
+        return -1;
+      }
+      async_log_mutex = tor_mutex_new();
+      async_log_buf = tor_malloc(ASYNC_LOG_BUF_SIZE);
+      async_log_spare_buf = tor_malloc(ASYNC_LOG_BUF_SIZE);
+      async_log_failed_fds = smartlist_new();
+    }
+    tor_mutex_acquire(async_log_mutex);
+    if (!async_log_writer_running) {
+      async_log_writer_should_exit = 0;
+      async_log_writer_running = 1;
+      if (spawn_func(async_log_writer_main, NULL) < 0) {
+        async_log_writer_running = 0;
+        r = -1;
+      }
+    }
+    async_logs_enabled = (r == 0);
+    tor_mutex_release(async_log_mutex);
+  }
+  UNLOCK_LOGS();
+  return r;
+#else
+  return enabled ? -1 : 0;
+#endif
+}
+
 /** Add a log handler to receive messages during startup (before the real
  * logs are initialized).
  */
@@ -706,7 +1034,7 @@ add_callback_log(const log_severity_list_t *severity, log_callback cb)
 
   LOCK_LOGS();
   logfiles = lf;
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
   UNLOCK_LOGS();
   return 0;
 }
@@ -726,7 +1054,7 @@ change_callback_log_severity(int loglevelMin, int loglevelMax,
       memcpy(lf->severities, &severities, sizeof(severities));
     }
   }
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
   UNLOCK_LOGS();
 }
 
@@ -792,7 +1120,7 @@ close_temp_logs(void)
     }
   }
 
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
   UNLOCK_LOGS();
 }
 
@@ -840,7 +1168,7 @@ add_file_log(const log_severity_list_t *severity, const char *filename)
   add_stream_log_impl(severity, filename, fd);
   logfiles->needs_close = 1;
   lf = logfiles;
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
 
   if (log_tor_version(lf, 0) < 0) {
     delete_log(lf);
@@ -871,7 +1199,7 @@ add_syslog_log(const log_severity_list_t *severity)
   LOCK_LOGS();
   lf->next = logfiles;
   logfiles = lf;
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
   UNLOCK_LOGS();
   return 0;
 }
@@ -1107,7 +1435,7 @@ switch_logs_debug(void)
     for (i = LOG_DEBUG; i >= LOG_ERR; --i)
       lf->severities->masks[SEVERITY_MASK_IDX(i)] = ~0u;
   }
-  _log_global_min_severity = get_min_log_level();
+  update_log_global_filters();
   UNLOCK_LOGS();
 }
 
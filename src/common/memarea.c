@@ -92,22 +92,38 @@ typedef struct memarea_chunk_t {
  * that will all be freed at once. */
 struct memarea_t {
   memarea_chunk_t *first; /**< Top of the chunk stack: never NULL. */
+  /** Most bytes that this area has ever had in use at once, as of the last
+   * memarea_clear(). */
+  size_t high_water;
+  /** A chunk that memarea_release_to_mark() freed, which we keep for the
+   * next time we need a chunk; or NULL. */
+  memarea_chunk_t *spare;
 };
 
+/** Largest chunk that memarea_clear() will allocate to hold everything
+ * that an area has needed before. */
+#define MAX_PRESIZED_CHUNK (1<<20)
+
 /** How many chunks will we put into the freelist before freeing them? */
 #define MAX_FREELIST_LEN 4
 /** The number of memarea chunks currently in our freelist. */
 static int freelist_len=0;
 /** A linked list of unused memory area chunks.  Used to prevent us from
- * spinning in malloc/free loops. */
+ * spinning in malloc/free loops.  Only the main thread uses it, so that
+ * other threads can have memareas of their own without locking. */
 static memarea_chunk_t *freelist = NULL;
+#ifdef TOR_IS_MULTITHREADED
+#define CAN_USE_FREELIST() in_main_thread()
+#else
+#define CAN_USE_FREELIST() 1
+#endif
 
 /** Helper: allocate a new memarea chunk of around <b>chunk_size</b> bytes. */
 static memarea_chunk_t *
 alloc_chunk(size_t sz, int freelist_ok)
 {
   tor_assert(sz < SIZE_T_CEILING);
-  if (freelist && freelist_ok) {
+  if (freelist && freelist_ok && CAN_USE_FREELIST()) {
     memarea_chunk_t *res = freelist;
     freelist = res->next_chunk;
     res->next_chunk = NULL;
@@ -136,7 +152,7 @@ static void
 chunk_free_unchecked(memarea_chunk_t *chunk)
 {
   CHECK_SENTINEL(chunk);
-  if (freelist_len < MAX_FREELIST_LEN) {
+  if (freelist_len < MAX_FREELIST_LEN && CAN_USE_FREELIST()) {
     ++freelist_len;
     chunk->next_chunk = freelist;
     freelist = chunk;
@@ -152,6 +168,8 @@ memarea_new(void)
 {
   memarea_t *head = tor_malloc(sizeof(memarea_t));
   head->first = alloc_chunk(CHUNK_SIZE, 1);
+  head->high_water = 0;
+  head->spare = NULL;
   return head;
 }
 
@@ -165,27 +183,99 @@ memarea_drop_all(memarea_t *area)
     next = chunk->next_chunk;
     chunk_free_unchecked(chunk);
   }
+  if (area->spare)
+    chunk_free_unchecked(area->spare);
   area->first = NULL; /*fail fast on */
   tor_free(area);
 }
 
 /** Forget about having allocated anything in <b>area</b>, and free some of
  * the backing storage associated with it, as appropriate. Invalidates all
- * pointers returned from memarea_alloc() for this area. */
+ * pointers returned from memarea_alloc() for this area.
+ *
+ * If <b>area</b> has ever needed more than one chunk, we leave it with a
+ * single chunk big enough for the most it has ever held, so that an area
+ * we reuse for one big document after another stops calling malloc. */
 void
 memarea_clear(memarea_t *area)
 {
   memarea_chunk_t *chunk, *next;
+  size_t used = 0;
   if (area->first->next_chunk) {
+    for (chunk = area->first; chunk; chunk = chunk->next_chunk)
+      used += chunk->next_mem - chunk->u.mem;
+    if (used > area->high_water)
+      area->high_water = used;
+
     for (chunk = area->first->next_chunk; chunk; chunk = next) {
       next = chunk->next_chunk;
       chunk_free_unchecked(chunk);
     }
     area->first->next_chunk = NULL;
+
+    if (area->first->mem_size < area->high_water &&
+        area->high_water <= MAX_PRESIZED_CHUNK) {
+      chunk_free_unchecked(area->first);
+      area->first = alloc_chunk(area->high_water + CHUNK_HEADER_SIZE, 0);
+    }
   }
   area->first->next_mem = area->first->u.mem;
 }
 
+/** Remember the current position in <b>area</b> in *<b>mark_out</b>. */
+void
+memarea_get_mark(const memarea_t *area, memarea_mark_t *mark_out)
+{
+  mark_out->chunk = area->first;
+  mark_out->next_chunk = area->first->next_chunk;
+  mark_out->next_mem = area->first->next_mem;
+}
+
+/** Helper for memarea_release_to_mark(): free <b>chunk</b>, or keep it as
+ * the spare chunk for <b>area</b> if it doesn't have one. */
+static void
+release_chunk(memarea_t *area, memarea_chunk_t *chunk)
+{
+  if (area->spare) {
+    chunk_free_unchecked(chunk);
+  } else {
+    CHECK_SENTINEL(chunk);
+    chunk->next_chunk = NULL;
+    chunk->next_mem = chunk->u.mem;
+    area->spare = chunk;
+  }
+}
+
+/** Free everything allocated from <b>area</b> since we saved <b>mark</b>
+ * with memarea_get_mark(), invalidating those pointers but keeping all the
+ * ones from before.  Marks nest: releasing to a mark invalidates any marks
+ * saved after it.  Don't use a mark after memarea_clear().
+ *
+ * We keep one released chunk with the area, so that a parser which marks
+ * and releases once per entry doesn't hit malloc for every entry, even in
+ * threads that can't use the chunk freelist. */
+void
+memarea_release_to_mark(memarea_t *area, const memarea_mark_t *mark)
+{
+  memarea_chunk_t *chunk, *next;
+  /* Chunks we added since the mark are either in front of the marked chunk
+   * or, if they were oversized, just behind it. */
+  for (chunk = area->first; chunk != mark->chunk; chunk = next) {
+    tor_assert(chunk);
+    next = chunk->next_chunk;
+    release_chunk(area, chunk);
+  }
+  for (chunk = mark->chunk->next_chunk; chunk != mark->next_chunk;
+       chunk = next) {
+    tor_assert(chunk);
+    next = chunk->next_chunk;
+    release_chunk(area, chunk);
+  }
+  area->first = mark->chunk;
+  area->first->next_chunk = mark->next_chunk;
+  area->first->next_mem = mark->next_mem;
+}
+
 /** Remove all unused memarea chunks from the internal freelist. */
 void
 memarea_clear_freelist(void)
@@ -235,7 +325,13 @@ memarea_alloc(memarea_t *area, size_t sz)
       chunk->next_chunk = new_chunk;
       chunk = new_chunk;
     } else {
-      memarea_chunk_t *new_chunk = alloc_chunk(CHUNK_SIZE, 1);
+      memarea_chunk_t *new_chunk;
+      if (area->spare) {
+        new_chunk = area->spare;
+        area->spare = NULL;
+      } else {
+        new_chunk = alloc_chunk(CHUNK_SIZE, 1);
+      }
       new_chunk->next_chunk = chunk;
       area->first = chunk = new_chunk;
     }
@@ -324,5 +420,9 @@ memarea_assert_ok(memarea_t *area)
     tor_assert(chunk->next_mem <=
           (char*) realign_pointer(chunk->u.mem+chunk->mem_size));
   }
+  if (area->spare) {
+    CHECK_SENTINEL(area->spare);
+    tor_assert(area->spare->next_mem == area->spare->u.mem);
+  }
 }
 
@@ -7,9 +7,20 @@
 
 typedef struct memarea_t memarea_t;
 
+/** A position in a memarea, saved with memarea_get_mark() so that we can
+ * later free everything allocated after it with memarea_release_to_mark().
+ * Treat this as opaque. */
+typedef struct memarea_mark_t {
+  struct memarea_chunk_t *chunk; /**< The area's top chunk when marked. */
+  struct memarea_chunk_t *next_chunk; /**< The chunk after that one. */
+  char *next_mem; /**< The top chunk's next_mem when marked. */
+} memarea_mark_t;
+
 memarea_t *memarea_new(void);
 void memarea_drop_all(memarea_t *area);
 void memarea_clear(memarea_t *area);
+void memarea_get_mark(const memarea_t *area, memarea_mark_t *mark_out);
+void memarea_release_to_mark(memarea_t *area, const memarea_mark_t *mark);
 int memarea_owns_ptr(const memarea_t *area, const void *ptr);
 void *memarea_alloc(memarea_t *area, size_t sz);
 void *memarea_alloc_zero(memarea_t *area, size_t sz);
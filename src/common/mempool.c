@@ -40,7 +40,8 @@
  *     since that's the one I looked at longest ago) is the pool allocator
  *     underlying Python's obmalloc code.  Major differences from obmalloc's
  *     pools are:
- *       - We don't even try to be threadsafe.
+ *       - We only try to be threadsafe for pools made with
+ *         mp_pool_make_shared(), and then only with a single lock per pool.
  *       - We only handle objects of one size.
  *       - Our list of empty chunks is doubly-linked, not singly-linked.
  *         (This could change pretty easily; it's only doubly-linked for
@@ -49,7 +50,9 @@
  *         function).  Obmalloc's pools leave full chunks to float unanchored.
  *
  * LIMITATIONS:
- *   - Not even slightly threadsafe.
+ *   - Threadsafe only for pools made with mp_pool_make_shared(), with one
+ *     lock per pool.  Threads that allocate a lot should each keep an
+ *     mp_pool_cache_t, so that they take the lock only once per many items.
  *   - Likes to have lots of items per chunks.
  *   - One pointer overhead per allocated thing.  (The alternative is
  *     something like glib's use of an RB-tree to keep track of what
@@ -67,10 +70,32 @@
 #include "torlog.h"
 #define ALLOC(x) tor_malloc(x)
 #define FREE(x) tor_free(x)
+/* Count chunks, which hold nearly all of a pool's memory, as mempool
+ * memory. */
+#define CHUNK_ALLOC(x) tor_malloc_tagged(MEMTAG_MEMPOOL, x)
+#define CHUNK_FREE(x) tor_free_tagged(x)
 #define ASSERT(x) tor_assert(x)
 #undef ALLOC_CAN_RETURN_NULL
 #define TOR
+/** Lock <b>pool</b> if it is shared between threads. */
+#define POOL_LOCK(pool) STMT_BEGIN                     \
+    if ((pool)->lock) tor_mutex_acquire((pool)->lock); \
+  STMT_END
+/** Unlock <b>pool</b> if it is shared between threads. */
+#define POOL_UNLOCK(pool) STMT_BEGIN                   \
+    if ((pool)->lock) tor_mutex_release((pool)->lock); \
+  STMT_END
 //#define ALLOC_ROUNDUP(p) tor_malloc_roundup(p)
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#if !defined(MAP_ANON) && defined(MAP_ANONYMOUS)
+#define MAP_ANON MAP_ANONYMOUS
+#endif
+#ifdef MAP_ANON
+/** Defined if we can carve chunks from a hugepage arena. */
+#define MP_USE_ARENA
+#endif
+#endif
 /* End Tor dependencies */
 #else
 /* If you're not building this as part of Tor, you'll want to define the
@@ -81,10 +106,14 @@
 #define PREDICT_LIKELY(x) (x)
 #define ALLOC(x) malloc(x)
 #define FREE(x) free(x)
+#define CHUNK_ALLOC(x) malloc(x)
+#define CHUNK_FREE(x) free(x)
 #define STRUCT_OFFSET(tp, member)                       \
   ((off_t) (((char*)&((tp*)0)->member)-(char*)0))
 #define ASSERT(x) assert(x)
 #define ALLOC_CAN_RETURN_NULL
+#define POOL_LOCK(pool) ((void)(pool))
+#define POOL_UNLOCK(pool) ((void)(pool))
 #endif
 
 /* Tuning parameters */
@@ -135,6 +164,8 @@ struct mp_chunk_t {
   int n_allocated; /**< Number of currently allocated items in this chunk. */
   int capacity; /**< Number of items that can be fit into this chunk. */
   size_t mem_size; /**< Number of usable bytes in mem. */
+  int from_arena; /**< True iff this chunk was carved from the hugepage
+                   * arena, not from ALLOC(). */
   char *next_mem; /**< Pointer into part of <b>mem</b> not yet carved up. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< Storage for this chunk. */
 };
@@ -159,17 +190,243 @@ struct mp_chunk_t {
 #define CHECK_ALLOC(x)
 #endif
 
+#ifdef MP_USE_ARENA
+/* HUGEPAGE ARENA:
+ *
+ *     When enabled with mp_arena_set_enabled(), new chunks come from large
+ *     regions that we map ourselves and ask the kernel to back with huge
+ *     pages, rather than from ALLOC().  Pools like the cell pool touch their
+ *     chunks all over, so this saves a lot of TLB misses on a busy relay.
+ *
+ *     Chunks are carved in power-of-two size classes.  A freed chunk goes on
+ *     a freelist for its class; we never give arena memory back to the
+ *     kernel.
+ */
+
+/** Size of each region that we map for the arena. */
+#define ARENA_REGION_SIZE (16*(1L<<20))
+/** Size of a huge page.  Transparent huge pages only back regions aligned
+ * to this size. */
+#define ARENA_HUGEPAGE_SIZE (2*(1L<<20))
+/** Log2 of the smallest size class in the arena. Must be at least the
+ * log2 of the system page size. */
+#define ARENA_MIN_SHIFT 12
+/** Log2 of the largest size class in the arena.  Larger chunks come from
+ * ALLOC(). */
+#define ARENA_MAX_SHIFT 21
+/** Number of size classes in the arena. */
+#define ARENA_N_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+
+/** A free block on one of the arena's freelists. */
+typedef struct arena_block_t {
+  struct arena_block_t *next; /**< Next free block of the same class. */
+} arena_block_t;
+
+/** State for the hugepage arena: there is only one, shared by all pools. */
+static struct {
+  /** True iff new chunks should come from the arena. */
+  int enabled;
+  /** Lock protecting the rest of this structure.  Created the first time
+   * the arena is enabled, and never freed. */
+  tor_mutex_t *lock;
+  /** Start of the part of the current region that we haven't carved yet. */
+  char *next_mem;
+  /** Number of bytes left at <b>next_mem</b>. */
+  size_t n_left;
+  /** For each size class, a list of freed blocks of that class. */
+  arena_block_t *free_blocks[ARENA_N_CLASSES];
+  /** Number of regions we have mapped. */
+  int n_regions;
+  /** Number of regions that we mapped with MAP_HUGETLB, rather than with
+   * a hint to use transparent huge pages. */
+  int n_hugetlb_regions;
+  /** Number of bytes handed out to chunks and not yet returned. */
+  uint64_t bytes_in_use;
+  /** Number of bytes on the freelists. */
+  uint64_t bytes_free;
+} arena;
+
+/** Return the size class of a block that can hold <b>size</b> bytes, or -1
+ * if <b>size</b> is too big for the arena. */
+static int
+arena_class_for_size(size_t size)
+{
+  int cls = 0;
+  if (size > ((size_t)1) << ARENA_MAX_SHIFT)
+    return -1;
+  while ((((size_t)1) << (cls + ARENA_MIN_SHIFT)) < size)
+    ++cls;
+  return cls;
+}
+
+/** Return the size in bytes of blocks in size class <b>cls</b>. */
+static INLINE size_t
+arena_class_size(int cls)
+{
+  return ((size_t)1) << (cls + ARENA_MIN_SHIFT);
+}
+
+/** Map a new region of ARENA_REGION_SIZE bytes, aligned to
+ * ARENA_HUGEPAGE_SIZE, and return it; or return NULL on failure.  Set
+ * *<b>hugetlb_out</b> to true iff the region is backed by MAP_HUGETLB
+ * pages. */
+static char *
+arena_map_region(int *hugetlb_out)
+{
+  char *mem;
+  uintptr_t start, aligned;
+#ifdef MAP_HUGETLB
+  /* This only works if the administrator has reserved huge pages. */
+  mem = mmap(NULL, ARENA_REGION_SIZE, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+  if (mem != MAP_FAILED) {
+    *hugetlb_out = 1;
+    return mem;
+  }
+#endif
+  *hugetlb_out = 0;
+  /* Map an extra huge page's worth, so we can trim the region to a huge
+   * page boundary. */
+  mem = mmap(NULL, ARENA_REGION_SIZE + ARENA_HUGEPAGE_SIZE,
+             PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+  if (mem == MAP_FAILED)
+    return NULL;
+  start = (uintptr_t)mem;
+  aligned = (start + ARENA_HUGEPAGE_SIZE - 1) &
+    ~(uintptr_t)(ARENA_HUGEPAGE_SIZE - 1);
+  if (aligned != start)
+    munmap(mem, aligned - start);
+  munmap((char*)aligned + ARENA_REGION_SIZE,
+         ARENA_HUGEPAGE_SIZE - (aligned - start));
+  mem = (char*)aligned;
+#ifdef MADV_HUGEPAGE
+  madvise(mem, ARENA_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+  return mem;
+}
+
+/** Put <b>size</b> bytes at <b>mem</b>, which must be aligned to
+ * 1&lt;&lt;ARENA_MIN_SHIFT, on the arena's freelists.  The caller must hold
+ * the arena lock. */
+static void
+arena_add_free_space(char *mem, size_t size)
+{
+  int cls;
+  while (size >= arena_class_size(0)) {
+    arena_block_t *block = (arena_block_t*)mem;
+    for (cls = ARENA_N_CLASSES - 1; arena_class_size(cls) > size; --cls)
+      ;
+    block->next = arena.free_blocks[cls];
+    arena.free_blocks[cls] = block;
+    arena.bytes_free += arena_class_size(cls);
+    mem += arena_class_size(cls);
+    size -= arena_class_size(cls);
+  }
+}
+
+/** Return a block of at least <b>size</b> bytes from the arena, or NULL if
+ * <b>size</b> is too large or we couldn't map a new region. */
+static void *
+arena_alloc(size_t size)
+{
+  int cls = arena_class_for_size(size);
+  void *result = NULL;
+  size_t block_size;
+  if (cls < 0)
+    return NULL;
+  block_size = arena_class_size(cls);
+
+  tor_mutex_acquire(arena.lock);
+  if (arena.free_blocks[cls]) {
+    arena_block_t *block = arena.free_blocks[cls];
+    arena.free_blocks[cls] = block->next;
+    arena.bytes_free -= block_size;
+    result = block;
+  } else {
+    if (arena.n_left < block_size) {
+      int hugetlb;
+      char *region = arena_map_region(&hugetlb);
+      if (!region)
+        goto done;
+      /* Don't waste the tail of the old region. */
+      arena_add_free_space(arena.next_mem, arena.n_left);
+      arena.next_mem = region;
+      arena.n_left = ARENA_REGION_SIZE;
+      ++arena.n_regions;
+      if (hugetlb)
+        ++arena.n_hugetlb_regions;
+    }
+    result = arena.next_mem;
+    arena.next_mem += block_size;
+    arena.n_left -= block_size;
+  }
+  arena.bytes_in_use += block_size;
+ done:
+  tor_mutex_release(arena.lock);
+  return result;
+}
+
+/** Return <b>mem</b>, a block of at least <b>size</b> bytes that we got
+ * from arena_alloc(<b>size</b>), to the arena. */
+static void
+arena_free(void *mem, size_t size)
+{
+  int cls = arena_class_for_size(size);
+  arena_block_t *block = mem;
+  ASSERT(cls >= 0);
+  tor_mutex_acquire(arena.lock);
+  block->next = arena.free_blocks[cls];
+  arena.free_blocks[cls] = block;
+  arena.bytes_in_use -= arena_class_size(cls);
+  arena.bytes_free += arena_class_size(cls);
+  tor_mutex_release(arena.lock);
+}
+#endif
+
+/** Helper: Allocate <b>size</b> bytes for a new chunk, from the hugepage
+ * arena if it's enabled and from ALLOC() otherwise.  Set
+ * *<b>from_arena_out</b> to true iff it came from the arena. */
+static INLINE mp_chunk_t *
+mp_chunk_alloc(size_t size, int *from_arena_out)
+{
+#ifdef MP_USE_ARENA
+  if (arena.enabled) {
+    mp_chunk_t *chunk = arena_alloc(size);
+    if (chunk) {
+      *from_arena_out = 1;
+      return chunk;
+    }
+  }
+#endif
+  *from_arena_out = 0;
+  return CHUNK_ALLOC(size);
+}
+
+/** Helper: Release the storage for <b>chunk</b>, wherever it came from. */
+static void
+mp_chunk_free(mp_chunk_t *chunk)
+{
+#ifdef MP_USE_ARENA
+  if (chunk->from_arena) {
+    arena_free(chunk, CHUNK_OVERHEAD + chunk->mem_size);
+    return;
+  }
+#endif
+  CHUNK_FREE(chunk);
+}
+
 /** Helper: Allocate and return a new memory chunk for <b>pool</b>.  Does not
  * link the chunk into any list. */
 static mp_chunk_t *
 mp_chunk_new(mp_pool_t *pool)
 {
   size_t sz = pool->new_chunk_capacity * pool->item_alloc_size;
+  int from_arena = 0;
 #ifdef ALLOC_ROUNDUP
   size_t alloc_size = CHUNK_OVERHEAD + sz;
   mp_chunk_t *chunk = ALLOC_ROUNDUP(&alloc_size);
 #else
-  mp_chunk_t *chunk = ALLOC(CHUNK_OVERHEAD + sz);
+  mp_chunk_t *chunk = mp_chunk_alloc(CHUNK_OVERHEAD + sz, &from_arena);
 #endif
 #ifdef MEMPOOL_STATS
   ++pool->total_chunks_allocated;
@@ -177,6 +434,7 @@ mp_chunk_new(mp_pool_t *pool)
   CHECK_ALLOC(chunk);
   memset(chunk, 0, sizeof(mp_chunk_t)); /* Doesn't clear the whole thing. */
   chunk->magic = MP_CHUNK_MAGIC;
+  chunk->from_arena = from_arena;
 #ifdef ALLOC_ROUNDUP
   chunk->mem_size = alloc_size - CHUNK_OVERHEAD;
   chunk->capacity = chunk->mem_size / pool->item_alloc_size;
@@ -202,9 +460,10 @@ add_newly_used_chunk_to_used_list(mp_pool_t *pool, mp_chunk_t *chunk)
   ASSERT(!chunk->prev);
 }
 
-/** Return a newly allocated item from <b>pool</b>. */
-void *
-mp_pool_get(mp_pool_t *pool)
+/** Helper: return a newly allocated item from <b>pool</b>, which the caller
+ * has locked if necessary. */
+static void *
+mp_pool_get_impl(mp_pool_t *pool)
 {
   mp_chunk_t *chunk;
   mp_allocated_t *allocated;
@@ -288,9 +547,10 @@ mp_pool_get(mp_pool_t *pool)
   return A2M(allocated);
 }
 
-/** Return an allocated memory item to its memory pool. */
-void
-mp_pool_release(void *item)
+/** Helper: return an allocated memory item to its memory pool, which the
+ * caller has locked if necessary. */
+static void
+mp_pool_release_impl(void *item)
 {
   mp_allocated_t *allocated = (void*) M2A(item);
   mp_chunk_t *chunk = allocated->in_chunk;
@@ -348,6 +608,131 @@ mp_pool_release(void *item)
   --chunk->n_allocated;
 }
 
+/** Return a newly allocated item from <b>pool</b>. */
+void *
+mp_pool_get(mp_pool_t *pool)
+{
+  void *item;
+  if (PREDICT_LIKELY(!pool->lock))
+    return mp_pool_get_impl(pool);
+  POOL_LOCK(pool);
+  item = mp_pool_get_impl(pool);
+  POOL_UNLOCK(pool);
+  return item;
+}
+
+/** Return an allocated memory item to its memory pool. */
+void
+mp_pool_release(void *item)
+{
+  mp_pool_t *pool = ((mp_allocated_t*) M2A(item))->in_chunk->pool;
+  if (PREDICT_LIKELY(!pool->lock)) {
+    mp_pool_release_impl(item);
+    return;
+  }
+  POOL_LOCK(pool);
+  mp_pool_release_impl(item);
+  POOL_UNLOCK(pool);
+}
+
+#ifdef TOR
+/** Make <b>pool</b> safe to use from more than one thread.  Call this
+ * before any other thread can see <b>pool</b>. */
+void
+mp_pool_make_shared(mp_pool_t *pool)
+{
+  ASSERT(!pool->lock);
+  pool->lock = tor_mutex_new();
+}
+#endif
+
+/** Largest number of items that an mp_pool_cache_t holds. */
+#define MP_CACHE_SIZE 64
+
+/** A stack of free items that one thread keeps in front of a shared
+ * mp_pool_t.  The thread moves items between the cache and the pool half a
+ * cache at a time, so it takes the pool's lock once per many items. */
+struct mp_pool_cache_t {
+  /** The pool that the cached items came from. */
+  mp_pool_t *pool;
+  /** Number of items in <b>items</b>. */
+  int n_items;
+  /** Free items, most recently released last. */
+  void *items[MP_CACHE_SIZE];
+};
+
+/** Return a new, empty cache in front of <b>pool</b>.  Only one thread may
+ * use the cache at a time. */
+mp_pool_cache_t *
+mp_pool_cache_new(mp_pool_t *pool)
+{
+  mp_pool_cache_t *cache = ALLOC(sizeof(mp_pool_cache_t));
+  CHECK_ALLOC(cache);
+  memset(cache, 0, sizeof(mp_pool_cache_t));
+  cache->pool = pool;
+  return cache;
+}
+
+/** Return an item from <b>cache</b>'s pool, refilling <b>cache</b> from the
+ * pool if it is empty. */
+void *
+mp_pool_cache_get(mp_pool_cache_t *cache)
+{
+  if (PREDICT_UNLIKELY(cache->n_items == 0)) {
+    mp_pool_t *pool = cache->pool;
+    POOL_LOCK(pool);
+    while (cache->n_items < MP_CACHE_SIZE / 2) {
+      void *item = mp_pool_get_impl(pool);
+#ifdef ALLOC_CAN_RETURN_NULL
+      if (!item)
+        break;
+#endif
+      cache->items[cache->n_items++] = item;
+    }
+    POOL_UNLOCK(pool);
+#ifdef ALLOC_CAN_RETURN_NULL
+    if (!cache->n_items)
+      return NULL;
+#endif
+  }
+  return cache->items[--cache->n_items];
+}
+
+/** Give <b>item</b>, which must have come from <b>cache</b>'s pool, back to
+ * <b>cache</b>.  If <b>cache</b> is full, first return its least recently
+ * released half to the pool. */
+void
+mp_pool_cache_release(mp_pool_cache_t *cache, void *item)
+{
+  ASSERT(((mp_allocated_t*) M2A(item))->in_chunk->pool == cache->pool);
+  if (PREDICT_UNLIKELY(cache->n_items == MP_CACHE_SIZE)) {
+    mp_pool_t *pool = cache->pool;
+    int i;
+    POOL_LOCK(pool);
+    for (i = 0; i < MP_CACHE_SIZE / 2; ++i)
+      mp_pool_release_impl(cache->items[i]);
+    POOL_UNLOCK(pool);
+    memmove(cache->items, cache->items + MP_CACHE_SIZE / 2,
+            sizeof(void*) * (MP_CACHE_SIZE - MP_CACHE_SIZE / 2));
+    cache->n_items -= MP_CACHE_SIZE / 2;
+  }
+  cache->items[cache->n_items++] = item;
+}
+
+/** Return every item in <b>cache</b> to its pool, and free <b>cache</b>. */
+void
+mp_pool_cache_free(mp_pool_cache_t *cache)
+{
+  int i;
+  if (!cache)
+    return;
+  POOL_LOCK(cache->pool);
+  for (i = 0; i < cache->n_items; ++i)
+    mp_pool_release_impl(cache->items[i]);
+  POOL_UNLOCK(cache->pool);
+  FREE(cache);
+}
+
 /** Allocate a new memory pool to hold items of size <b>item_size</b>. We'll
  * try to fit about <b>chunk_capacity</b> bytes in each chunk. */
 mp_pool_t *
@@ -461,6 +846,7 @@ mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
 {
   mp_chunk_t *chunk, **first_to_free;
 
+  POOL_LOCK(pool);
   mp_pool_sort_used_chunks(pool);
   ASSERT(n_to_keep >= 0);
 
@@ -479,6 +865,7 @@ mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
   }
   if (!*first_to_free) {
     pool->min_empty_chunks = pool->n_empty_chunks;
+    POOL_UNLOCK(pool);
     return;
   }
 
@@ -486,7 +873,7 @@ mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
   while (chunk) {
     mp_chunk_t *next = chunk->next;
     chunk->magic = 0xdeadbeef;
-    FREE(chunk);
+    mp_chunk_free(chunk);
 #ifdef MEMPOOL_STATS
     ++pool->total_chunks_freed;
 #endif
@@ -496,6 +883,7 @@ mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used)
 
   pool->min_empty_chunks = pool->n_empty_chunks;
   *first_to_free = NULL;
+  POOL_UNLOCK(pool);
 }
 
 /** Helper: Given a list of chunks, free all the chunks in the list. */
@@ -506,16 +894,22 @@ destroy_chunks(mp_chunk_t *chunk)
   while (chunk) {
     chunk->magic = 0xd3adb33f;
     next = chunk->next;
-    FREE(chunk);
+    mp_chunk_free(chunk);
     chunk = next;
   }
 }
 
 /** Free all space held in <b>pool</b>  This makes all pointers returned from
- * mp_pool_get(<b>pool</b>) invalid. */
+ * mp_pool_get(<b>pool</b>) invalid.  The caller must already have freed
+ * every cache in front of <b>pool</b>, and stopped every other thread using
+ * it. */
 void
 mp_pool_destroy(mp_pool_t *pool)
 {
+#ifdef TOR
+  if (pool->lock)
+    tor_mutex_free(pool->lock);
+#endif
   destroy_chunks(pool->empty_chunks);
   destroy_chunks(pool->used_chunks);
   destroy_chunks(pool->full_chunks);
@@ -569,11 +963,56 @@ mp_pool_assert_ok(mp_pool_t *pool)
 {
   int n_empty;
 
+  POOL_LOCK(pool);
   n_empty = assert_chunks_ok(pool, pool->empty_chunks, 1, 0);
   assert_chunks_ok(pool, pool->full_chunks, 0, 1);
   assert_chunks_ok(pool, pool->used_chunks, 0, 0);
 
   ASSERT(pool->n_empty_chunks == n_empty);
+  POOL_UNLOCK(pool);
+}
+
+/** Set *<b>n_chunks_out</b> to the number of chunks that <b>pool</b> holds,
+ * *<b>n_empty_chunks_out</b> to the number of those with no items
+ * allocated, and *<b>bytes_alloc_out</b> to the total number of bytes of
+ * storage in those chunks. */
+void
+mp_pool_get_usage(const mp_pool_t *pool, int *n_chunks_out,
+                  int *n_empty_chunks_out, uint64_t *bytes_alloc_out)
+{
+  const mp_chunk_t *chunk;
+  const mp_chunk_t *lists[3];
+  int i, n = 0;
+  uint64_t bytes = 0;
+
+  ASSERT(pool);
+  POOL_LOCK(pool);
+  lists[0] = pool->empty_chunks;
+  lists[1] = pool->used_chunks;
+  lists[2] = pool->full_chunks;
+  for (i = 0; i < 3; ++i) {
+    for (chunk = lists[i]; chunk; chunk = chunk->next) {
+      ++n;
+      bytes += chunk->mem_size + CHUNK_OVERHEAD;
+    }
+  }
+  *n_chunks_out = n;
+  *n_empty_chunks_out = pool->n_empty_chunks;
+  *bytes_alloc_out = bytes;
+  POOL_UNLOCK(pool);
+}
+
+/** Return the number of chunks that <b>pool</b> has allocated over its whole
+ * lifetime, or 0 if we aren't keeping statistics. */
+uint64_t
+mp_pool_get_n_chunks_allocated(const mp_pool_t *pool)
+{
+  ASSERT(pool);
+#ifdef MEMPOOL_STATS
+  return pool->total_chunks_allocated;
+#else
+  return 0;
+#endif
 }
 
 #ifdef TOR
@@ -590,6 +1029,7 @@ mp_pool_log_status(mp_pool_t *pool, int severity)
   int n_full = 0, n_used = 0;
 
   ASSERT(pool);
+  POOL_LOCK(pool);
 
   for (chunk = pool->empty_chunks; chunk; chunk = chunk->next) {
     bytes_allocated += chunk->mem_size;
@@ -632,6 +1072,45 @@ mp_pool_log_status(mp_pool_t *pool, int severity)
          U64_PRINTF_ARG(pool->total_chunks_allocated),
          U64_PRINTF_ARG(pool->total_chunks_freed));
 #endif
+  POOL_UNLOCK(pool);
 }
 #endif
 
+/** If <b>enabled</b> is true, carve all chunks allocated from now on out
+ * of a shared arena backed by huge pages; otherwise, allocate new chunks
+ * normally.  Chunks that already exist stay where they are.  Return 0 on
+ * success, or -1 if we can't build an arena on this platform. */
+int
+mp_arena_set_enabled(int enabled)
+{
+#ifdef MP_USE_ARENA
+  if (enabled && !arena.lock)
+    arena.lock = tor_mutex_new();
+  arena.enabled = enabled;
+  return 0;
+#else
+  return enabled ? -1 : 0;
+#endif
+}
+
+/** Dump information about the hugepage arena to the log at level
+ * <b>severity</b>. */
+void
+mp_arena_log_status(int severity)
+{
+#ifdef MP_USE_ARENA
+  if (!arena.lock)
+    return;
+  tor_mutex_acquire(arena.lock);
+  log_fn(severity, LD_MM, "Hugepage arena%s: %d regions of %lu bytes "
+         "(%d with MAP_HUGETLB); "U64_FORMAT" bytes in chunks, "
+         U64_FORMAT" bytes free, %lu bytes not yet carved.",
+         arena.enabled ? "" : " (disabled)",
+         arena.n_regions, (unsigned long)ARENA_REGION_SIZE,
+         arena.n_hugetlb_regions, U64_PRINTF_ARG(arena.bytes_in_use),
+         U64_PRINTF_ARG(arena.bytes_free), (unsigned long)arena.n_left);
+  tor_mutex_release(arena.lock);
+#else
+  (void)severity;
+#endif
+}
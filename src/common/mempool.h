@@ -13,6 +13,9 @@
 * objects can be allocated efficiently.  See mempool.c for implementation
 * details. */
 typedef struct mp_pool_t mp_pool_t;
+/** A small per-thread stack of free items in front of a shared
+ * mp_pool_t. */
+typedef struct mp_pool_cache_t mp_pool_cache_t;
 
 void *mp_pool_get(mp_pool_t *pool);
 void mp_pool_release(void *item);
@@ -21,6 +24,16 @@ void mp_pool_clean(mp_pool_t *pool, int n_to_keep, int keep_recently_used);
 void mp_pool_destroy(mp_pool_t *pool);
 void mp_pool_assert_ok(mp_pool_t *pool);
 void mp_pool_log_status(mp_pool_t *pool, int severity);
+void mp_pool_get_usage(const mp_pool_t *pool, int *n_chunks_out,
+                       int *n_empty_chunks_out, uint64_t *bytes_alloc_out);
+uint64_t mp_pool_get_n_chunks_allocated(const mp_pool_t *pool);
+void mp_pool_make_shared(mp_pool_t *pool);
+mp_pool_cache_t *mp_pool_cache_new(mp_pool_t *pool);
+void *mp_pool_cache_get(mp_pool_cache_t *cache);
+void mp_pool_cache_release(mp_pool_cache_t *cache, void *item);
+void mp_pool_cache_free(mp_pool_cache_t *cache);
+int mp_arena_set_enabled(int enabled);
+void mp_arena_log_status(int severity);
 
 #define MEMPOOL_STATS
 
@@ -48,6 +61,9 @@ struct mp_pool_t {
   /** Size to allocate for each item, including overhead and alignment
    * padding. */
   size_t item_alloc_size;
+  /** Lock protecting everything above, or NULL if this pool is not shared
+   * between threads.  See mp_pool_make_shared(). */
+  struct tor_mutex_t *lock;
 #ifdef MEMPOOL_STATS
   /** Total number of items allocated ever. */
   uint64_t total_items_allocated;
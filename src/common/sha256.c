@@ -26,6 +26,36 @@ typedef struct sha256_state {
    #define MIN(x, y) ( ((x)<(y))?(x):(y) )
 #endif
 
+/* If the compiler can target them, we also build compression functions
+ * that use the SHA extensions on x86 and x86_64, or the ARMv8 SHA2
+ * instructions on arm64.  sha256_compress_block() checks once, at runtime,
+ * whether the CPU has them and whether they give the right answer. */
+#if (defined(__i386__) || defined(__x86_64__)) &&                    \
+  (defined(__clang__) ||                                             \
+   (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#define SHA256_HW_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#ifndef bit_SHA
+#define bit_SHA (1<<29)
+#endif
+#endif
+
+#if defined(__aarch64__) &&                                          \
+  (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2)) &&  \
+  defined(HAVE_GETAUXVAL) && defined(HAVE_SYS_AUXV_H)
+#define SHA256_HW_ARM64
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1<<6)
+#endif
+#endif
+
+#if defined(SHA256_HW_X86) || defined(SHA256_HW_ARM64)
+#define SHA256_HW
+#endif
+
 
 /* LibTomCrypt, modular cryptographic library -- Tom St Denis
  *
@@ -44,7 +74,7 @@ typedef struct sha256_state {
 */
 
 
-#ifdef LTC_SMALL_CODE
+#if defined(LTC_SMALL_CODE) || defined(SHA256_HW)
 /* the K array */
 static const uint32_t K[64] = {
     0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL,
@@ -207,6 +237,158 @@ static int sha256_compress(sha256_state * md, unsigned char *buf)
 }
 #endif
 
+#ifdef SHA256_HW_X86
+/* Four rounds with the SHA extensions, on message words m (already
+ * scheduled) for rounds 4*g to 4*g+3. */
+#define SHA256_HW_ROUNDS(m, g)                                          \
+    tmp = _mm_add_epi32((m), _mm_loadu_si128((const __m128i*)(K+4*(g)))); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, tmp);                      \
+    tmp = _mm_shuffle_epi32(tmp, 0x0E);                                 \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, tmp)
+/* Compute the message words for the next group of four rounds into m0,
+ * from the four groups before it: m0 (oldest) through m3 (newest). */
+#define SHA256_HW_SCHEDULE(m0, m1, m2, m3)                              \
+    m0 = _mm_sha256msg2_epu32(                                          \
+           _mm_add_epi32(_mm_sha256msg1_epu32(m0, m1),                  \
+                         _mm_alignr_epi8(m3, m2, 4)), m3)
+
+/* Compress one 64-byte block with the x86 SHA extensions. */
+static void __attribute__((target("sha,sse4.1")))
+sha256_hw_compress(uint32_t *state, const unsigned char *buf)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, tmp, m0, m1, m2, m3;
+    int g;
+
+    /* The instructions want the state as ABEF and CDGH. */
+    tmp  = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xB1);
+    cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state+4)),
+                             0x1B);
+    abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buf+0)), bswap);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buf+16)), bswap);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buf+32)), bswap);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(buf+48)), bswap);
+    SHA256_HW_ROUNDS(m0, 0);
+    SHA256_HW_ROUNDS(m1, 1);
+    SHA256_HW_ROUNDS(m2, 2);
+    SHA256_HW_ROUNDS(m3, 3);
+    for (g = 4; g < 16; g += 4) {
+        SHA256_HW_SCHEDULE(m0, m1, m2, m3);
+        SHA256_HW_ROUNDS(m0, g);
+        SHA256_HW_SCHEDULE(m1, m2, m3, m0);
+        SHA256_HW_ROUNDS(m1, g+1);
+        SHA256_HW_SCHEDULE(m2, m3, m0, m1);
+        SHA256_HW_ROUNDS(m2, g+2);
+        SHA256_HW_SCHEDULE(m3, m0, m1, m2);
+        SHA256_HW_ROUNDS(m3, g+3);
+    }
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    tmp  = _mm_shuffle_epi32(abef, 0x1B);
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, cdgh, 0xF0));
+    _mm_storeu_si128((__m128i*)(state+4), _mm_alignr_epi8(cdgh, tmp, 8));
+}
+
+/* Return true iff this CPU has the SHA extensions, and the SSSE3 and
+ * SSE4.1 instructions that we use with them. */
+static int sha256_hw_cpu_supported(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+        !(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+        return 0;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_SHA) != 0;
+}
+#endif
+
+#ifdef SHA256_HW_ARM64
+/* Compress one 64-byte block with the ARMv8 SHA2 instructions. */
+static void sha256_hw_compress(uint32_t *state, const unsigned char *buf)
+{
+    uint32x4_t abcd = vld1q_u32(state), efgh = vld1q_u32(state+4);
+    uint32x4_t abcd_save = abcd, efgh_save = efgh, abcd_prev, tmp, m[4];
+    int g;
+
+    for (g = 0; g < 4; ++g)
+        m[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(buf + 16*g)));
+    for (g = 0; g < 16; ++g) {
+        if (g >= 4)
+            m[g&3] = vsha256su1q_u32(vsha256su0q_u32(m[g&3], m[(g+1)&3]),
+                                     m[(g+2)&3], m[(g+3)&3]);
+        tmp = vaddq_u32(m[g&3], vld1q_u32(K + 4*g));
+        abcd_prev = abcd;
+        abcd = vsha256hq_u32(abcd, efgh, tmp);
+        efgh = vsha256h2q_u32(efgh, abcd_prev, tmp);
+    }
+
+    vst1q_u32(state, vaddq_u32(abcd, abcd_save));
+    vst1q_u32(state+4, vaddq_u32(efgh, efgh_save));
+}
+
+/* Return true iff this CPU has the ARMv8 SHA2 instructions. */
+static int sha256_hw_cpu_supported(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+#endif
+
+#ifdef SHA256_HW
+/* 1 if we should use sha256_hw_compress(), 0 if we shouldn't, -1 if we
+ * haven't checked yet. */
+static int sha256_use_hw = -1;
+
+/* Return true iff sha256_hw_compress() is available and agrees with the
+ * portable compression function on a couple of blocks. */
+static int sha256_hw_self_test(void)
+{
+    sha256_state portable;
+    uint32_t hw[8];
+    unsigned char block[64];
+    int i, j;
+
+    if (!sha256_hw_cpu_supported())
+        return 0;
+    memset(&portable, 0, sizeof(portable));
+    for (i = 0; i < 8; i++) {
+        portable.state[i] = hw[i] = 0x6A09E667UL * (i+1);
+    }
+    for (j = 0; j < 2; j++) {
+        for (i = 0; i < 64; i++) {
+            block[i] = (unsigned char)(i*7 + j*13 + 3);
+        }
+        sha256_compress(&portable, block);
+        sha256_hw_compress(hw, block);
+    }
+    return memcmp(hw, portable.state, sizeof(hw)) == 0;
+}
+#endif
+
+/* Compress one 64-byte block into md, with the SHA instructions if we can
+ * use them. */
+static int sha256_compress_block(sha256_state * md, unsigned char *buf)
+{
+#ifdef SHA256_HW
+    if (sha256_use_hw < 0)
+        sha256_use_hw = sha256_hw_self_test();
+    if (sha256_use_hw) {
+        sha256_hw_compress(md->state, buf);
+        return CRYPT_OK;
+    }
+#endif
+    return sha256_compress(md, buf);
+}
+
 /**
    Initialize the hash state
    @param md   The hash state you wish to initialize
@@ -247,7 +429,7 @@ static int sha256_process (sha256_state * md, const unsigned char *in, unsigned
     }
     while (inlen > 0) {
         if (md->curlen == 0 && inlen >= 64) {
-           if ((err = sha256_compress (md, (unsigned char *)in)) != CRYPT_OK) {
+           if ((err = sha256_compress_block(md, (unsigned char *)in)) != CRYPT_OK) {
               return err;
            }
            md->length += 64 * 8;
@@ -260,7 +442,7 @@ static int sha256_process (sha256_state * md, const unsigned char *in, unsigned
            in             += n;
            inlen          -= n;
            if (md->curlen == 64) {
-              if ((err = sha256_compress (md, md->buf)) != CRYPT_OK) {
+              if ((err = sha256_compress_block(md, md->buf)) != CRYPT_OK) {
                  return err;
               }
               md->length += 8*64;
@@ -303,7 +485,7 @@ static int sha256_done(sha256_state * md, unsigned char *out)
         while (md->curlen < 64) {
             md->buf[md->curlen++] = (unsigned char)0;
         }
-        sha256_compress(md, md->buf);
+        sha256_compress_block(md, md->buf);
         md->curlen = 0;
     }
 
@@ -314,7 +496,7 @@ static int sha256_done(sha256_state * md, unsigned char *out)
 
     /* store length */
     STORE64H(md->length, md->buf+56);
-    sha256_compress(md, md->buf);
+    sha256_compress_block(md, md->buf);
 
     /* copy output */
     for (i = 0; i < 8; i++) {
@@ -68,6 +68,77 @@ is_gzip_supported(void)
   return gzip_is_supported;
 }
 
+/** Return true iff we can compress and uncompress with <b>method</b>. */
+int
+tor_compress_supports_method(compress_method_t method)
+{
+  switch (method) {
+    case NO_METHOD:
+    case ZLIB_METHOD:
+      return 1;
+    case GZIP_METHOD:
+      return is_gzip_supported();
+    case UNKNOWN_METHOD:
+    default:
+      return 0;
+  }
+}
+
+/** Table of HTTP content-coding names for each compression method.  The
+ * first name listed for a method is the one we send. */
+static const struct {
+  const char *name;
+  compress_method_t method;
+} compression_method_names[] = {
+  { "identity",  NO_METHOD },
+  { "deflate",   ZLIB_METHOD },
+  { "x-deflate", ZLIB_METHOD },
+  { "gzip",      GZIP_METHOD },
+  { "x-gzip",    GZIP_METHOD },
+  { NULL, UNKNOWN_METHOD },
+};
+
+/** Return the HTTP content-coding name for <b>method</b>, or NULL if it
+ * has none. */
+const char *
+compression_method_get_name(compress_method_t method)
+{
+  int i;
+  for (i = 0; compression_method_names[i].name; ++i) {
+    if (compression_method_names[i].method == method)
+      return compression_method_names[i].name;
+  }
+  return NULL;
+}
+
+/** Return the compression method whose HTTP content-coding name is
+ * <b>name</b>, or UNKNOWN_METHOD if we don't recognize it. */
+compress_method_t
+compression_method_get_by_name(const char *name)
+{
+  int i;
+  for (i = 0; compression_method_names[i].name; ++i) {
+    if (!strcmp(compression_method_names[i].name, name))
+      return compression_method_names[i].method;
+  }
+  return UNKNOWN_METHOD;
+}
+
+/** Return the zlib compression level to use for <b>level</b>. */
+static INLINE int
+method_level(compression_level_t level)
+{
+  switch (level) {
+    case LOW_COMPRESSION:
+      return Z_BEST_SPEED;
+    case MEDIUM_COMPRESSION:
+      return Z_DEFAULT_COMPRESSION;
+    case HIGH_COMPRESSION:
+    default:
+      return Z_BEST_COMPRESSION;
+  }
+}
+
 /** Return the 'bits' value to tell zlib to use <b>method</b>.*/
 static INLINE int
 method_bits(compress_method_t method)
@@ -398,10 +469,11 @@ struct tor_zlib_state_t {
 };
 
 /** Construct and return a tor_zlib_state_t object using <b>method</b>.  If
- * <b>compress</b>, it's for compression; otherwise it's for
- * decompression. */
+ * <b>compress</b>, it's for compression at <b>level</b>; otherwise it's for
+ * decompression, and <b>level</b> is ignored. */
 tor_zlib_state_t *
-tor_zlib_new(int compress, compress_method_t method)
+tor_zlib_new(int compress, compress_method_t method,
+             compression_level_t level)
 {
   tor_zlib_state_t *out;
 
@@ -417,7 +489,7 @@ tor_zlib_new(int compress, compress_method_t method)
  out->stream.opaque = NULL;
  out->compress = compress;
  if (compress) {
-   if (deflateInit2(&out->stream, Z_BEST_COMPRESSION, Z_DEFLATED,
+   if (deflateInit2(&out->stream, method_level(level), Z_DEFLATED,
                     method_bits(method), 8, Z_DEFAULT_STRATEGY) != Z_OK)
      goto err;
  } else {
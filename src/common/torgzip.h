@@ -19,6 +19,12 @@ typedef enum {
   NO_METHOD=0, GZIP_METHOD=1, ZLIB_METHOD=2, UNKNOWN_METHOD=3
 } compress_method_t;
 
+/** Enumeration of how hard to work when compressing.  Higher compression
+ * costs more CPU and memory for a smaller output. */
+typedef enum {
+  HIGH_COMPRESSION, MEDIUM_COMPRESSION, LOW_COMPRESSION
+} compression_level_t;
+
 int
 tor_gzip_compress(char **out, size_t *out_len,
                   const char *in, size_t in_len,
@@ -31,6 +37,9 @@ tor_gzip_uncompress(char **out, size_t *out_len,
                     int protocol_warn_level);
 
 int is_gzip_supported(void);
+int tor_compress_supports_method(compress_method_t method);
+const char *compression_method_get_name(compress_method_t method);
+compress_method_t compression_method_get_by_name(const char *name);
 
 compress_method_t detect_compression_method(const char *in, size_t in_len);
 
@@ -41,7 +50,8 @@ typedef enum {
 } tor_zlib_output_t;
 /** Internal state for an incremental zlib compression/decompression. */
 typedef struct tor_zlib_state_t tor_zlib_state_t;
-tor_zlib_state_t *tor_zlib_new(int compress, compress_method_t method);
+tor_zlib_state_t *tor_zlib_new(int compress, compress_method_t method,
+                               compression_level_t level);
 
 tor_zlib_output_t tor_zlib_process(tor_zlib_state_t *state,
                                    char **out, size_t *out_len,
@@ -136,6 +136,7 @@ int add_syslog_log(const log_severity_list_t *severity);
 #endif
 int add_callback_log(const log_severity_list_t *severity, log_callback cb);
 void logs_set_domain_logging(int enabled);
+int logs_set_async(int enabled);
 int get_min_log_level(void);
 void switch_logs_debug(void);
 void logs_free_all(void);
@@ -153,6 +154,18 @@ void tor_log(int severity, log_domain_mask_t domain, const char *format, ...)
   CHECK_PRINTF(3,4);
 #define log tor_log /* hack it so we don't conflict with log() as much */
 
+#ifndef TOR_COMPILED_LOG_LEVEL
+/** The most verbose severity for which we compile log_debug and log_info
+ * calls at all.  Set it with configure's --with-compiled-log-level. */
+#define TOR_COMPILED_LOG_LEVEL LOG_DEBUG
+#endif
+
+extern log_domain_mask_t _log_global_domain_masks[];
+/** Return nonzero iff some log wants messages of severity <b>sev</b> in
+ * some domain in <b>domain</b>. */
+#define log_global_domain_is_enabled(sev, domain)               \
+  (_log_global_domain_masks[(sev) - LOG_ERR] & (domain))
+
 #if defined(__GNUC__) || defined(RUNNING_DOXYGEN)
 extern int _log_global_min_severity;
 
@@ -165,11 +178,16 @@ void _log_fn(int severity, log_domain_mask_t domain,
   _log_fn(severity, domain, __PRETTY_FUNCTION__, args)
 #define log_debug(domain, args...)                                      \
   STMT_BEGIN                                                            \
-    if (PREDICT_UNLIKELY(_log_global_min_severity == LOG_DEBUG))        \
+    if (TOR_COMPILED_LOG_LEVEL >= LOG_DEBUG &&                          \
+        PREDICT_UNLIKELY(log_global_domain_is_enabled(LOG_DEBUG, domain))) \
       _log_fn(LOG_DEBUG, domain, __PRETTY_FUNCTION__, args);            \
   STMT_END
-#define log_info(domain, args...)                           \
-  _log_fn(LOG_INFO, domain, __PRETTY_FUNCTION__, args)
+#define log_info(domain, args...)                                       \
+  STMT_BEGIN                                                            \
+    if (TOR_COMPILED_LOG_LEVEL >= LOG_INFO &&                           \
+        PREDICT_UNLIKELY(log_global_domain_is_enabled(LOG_INFO, domain)))  \
+      _log_fn(LOG_INFO, domain, __PRETTY_FUNCTION__, args);             \
+  STMT_END
 #define log_notice(domain, args...)                         \
   _log_fn(LOG_NOTICE, domain, __PRETTY_FUNCTION__, args)
 #define log_warn(domain, args...)                           \
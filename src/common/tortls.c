@@ -233,6 +233,30 @@ static tor_tls_context_t *client_tls_context = NULL;
 /** True iff tor_tls_init() has been called. */
 static int tls_library_is_initialized = 0;
 
+/** An entry in the client-side session cache: a TLS session we negotiated
+ * with some relay, and when we stored it. */
+typedef struct tls_session_entry_t {
+  SSL_SESSION *session;
+  time_t stored_at;
+} tls_session_entry_t;
+
+/** Map from relay identity digest to the tls_session_entry_t we most
+ * recently negotiated with that relay; NULL if the cache is disabled. */
+static digestmap_t *tls_session_cache = NULL;
+/** Largest number of entries we keep in tls_session_cache. */
+static int tls_session_cache_max = 0;
+
+static void tls_session_entry_free(void *entry);
+
+/** Largest number of entries we keep in cert_verify_cache. */
+#define CERT_VERIFY_CACHE_MAX 1024
+/** Map from cert_verify_cache_key() to the time_t when we last used the
+ * entry, for each (certificate, signing certificate, check_rsa_1024) that
+ * passed the signature and key checks in tor_tls_cert_is_valid().  Peers
+ * present the same certificates on every reconnect, so this saves us the
+ * public-key operations. */
+static digestmap_t *cert_verify_cache = NULL;
+
 /* Module-internal error codes. */
 #define _TOR_TLS_SYSCALL    (_MIN_TOR_TLS_ERROR_VAL - 2)
 #define _TOR_TLS_ZERORETURN (_MIN_TOR_TLS_ERROR_VAL - 1)
@@ -525,6 +549,11 @@ tor_tls_free_all(void)
     client_tls_context = NULL;
     tor_tls_context_decref(ctx);
   }
+  tor_tls_set_session_cache_size(0);
+  if (cert_verify_cache) {
+    digestmap_free(cert_verify_cache, _tor_free);
+    cert_verify_cache = NULL;
+  }
 #ifdef V2_HANDSHAKE_CLIENT
   if (CLIENT_CIPHER_DUMMIES)
     tor_free(CLIENT_CIPHER_DUMMIES);
@@ -957,16 +986,66 @@ tor_tls_cert_matches_key(const tor_tls_t *tls, const tor_cert_t *cert)
   return result;
 }
 
-/** Check whether <b>cert</b> is well-formed, currently live, and correctly
- * signed by the public key in <b>signing_cert</b>.  If <b>check_rsa_1024</b>,
- * make sure that it has an RSA key with 1024 bits; otherwise, just check that
- * the key is long enough. Return 1 if the cert is good, and 0 if it's bad or
- * we couldn't check it. */
+/** Set <b>key_out</b> to a DIGEST_LEN-byte key for cert_verify_cache, for
+ * checking <b>cert</b> against <b>signing_cert</b> with
+ * <b>check_rsa_1024</b>. */
+static void
+cert_verify_cache_key(char *key_out, const tor_cert_t *cert,
+                      const tor_cert_t *signing_cert, int check_rsa_1024)
+{
+  crypto_digest_t *d = crypto_digest_new();
+  const char flag = check_rsa_1024 ? 1 : 0;
+  crypto_digest_add_bytes(d, cert->cert_digests.d[DIGEST_SHA256],
+                          DIGEST256_LEN);
+  crypto_digest_add_bytes(d, signing_cert->cert_digests.d[DIGEST_SHA256],
+                          DIGEST256_LEN);
+  crypto_digest_add_bytes(d, &flag, 1);
+  crypto_digest_get_digest(d, key_out, DIGEST_LEN);
+  crypto_digest_free(d);
+}
+
+/** Remember that the checks for the cert_verify_cache_key() <b>key</b>
+ * passed, evicting the least recently used entry if the cache is full. */
+static void
+cert_verify_cache_add(const char *key, time_t now)
+{
+  time_t *last_used, *old_entry;
+  if (!cert_verify_cache)
+    cert_verify_cache = digestmap_new();
+  if (digestmap_size(cert_verify_cache) >= CERT_VERIFY_CACHE_MAX) {
+    char oldest_key[DIGEST_LEN];
+    time_t oldest = TIME_MAX;
+    DIGESTMAP_FOREACH(cert_verify_cache, k, time_t *, t) {
+      if (*t < oldest) {
+        oldest = *t;
+        memcpy(oldest_key, k, DIGEST_LEN);
+      }
+    } DIGESTMAP_FOREACH_END;
+    if (oldest != TIME_MAX) {
+      old_entry = digestmap_remove(cert_verify_cache, oldest_key);
+      tor_free(old_entry);
+    }
+  }
+  last_used = tor_malloc(sizeof(time_t));
+  *last_used = now;
+  old_entry = digestmap_set(cert_verify_cache, key, last_used);
+  tor_free(old_entry);
+}
+
+/** Return how many certificate pairs we remember having checked. */
 int
-tor_tls_cert_is_valid(int severity,
-                      const tor_cert_t *cert,
-                      const tor_cert_t *signing_cert,
-                      int check_rsa_1024)
+tor_tls_cert_verify_cache_size(void)
+{
+  return cert_verify_cache ? digestmap_size(cert_verify_cache) : 0;
+}
+
+/** Return 1 if <b>cert</b> is correctly signed by the public key in
+ * <b>signing_cert</b> and has an acceptable key, as described in
+ * tor_tls_cert_is_valid(); else return 0. */
+static int
+tor_tls_cert_signature_is_ok(const tor_cert_t *cert,
+                             const tor_cert_t *signing_cert,
+                             int check_rsa_1024)
 {
   EVP_PKEY *cert_key;
   EVP_PKEY *signing_key = X509_get_pubkey(signing_cert->cert);
@@ -978,12 +1057,6 @@ tor_tls_cert_is_valid(int severity,
   if (r <= 0)
     return 0;
 
-  /* okay, the signature checked out right.  Now let's check the check the
-   * lifetime. */
-  if (check_cert_lifetime_internal(severity, cert->cert,
-                                   48*60*60, 30*24*60*60) < 0)
-    return 0;
-
   cert_key = X509_get_pubkey(cert->cert);
   if (check_rsa_1024 && cert_key) {
     RSA *rsa = EVP_PKEY_get1_RSA(cert_key);
@@ -1001,11 +1074,48 @@ tor_tls_cert_is_valid(int severity,
       key_ok = 1;
   }
   EVP_PKEY_free(cert_key);
-  if (!key_ok)
-    return 0;
 
   /* XXXX compare DNs or anything? */
 
+  return key_ok;
+}
+
+/** Check whether <b>cert</b> is well-formed, currently live, and correctly
+ * signed by the public key in <b>signing_cert</b>.  If <b>check_rsa_1024</b>,
+ * make sure that it has an RSA key with 1024 bits; otherwise, just check that
+ * the key is long enough. Return 1 if the cert is good, and 0 if it's bad or
+ * we couldn't check it.
+ *
+ * We remember which certificate pairs passed the signature and key checks,
+ * so that we only do those once per pair; the lifetime check is cheap, and
+ * we always do it. */
+int
+tor_tls_cert_is_valid(int severity,
+                      const tor_cert_t *cert,
+                      const tor_cert_t *signing_cert,
+                      int check_rsa_1024)
+{
+  char key[DIGEST_LEN];
+  time_t now = time(NULL);
+  time_t *last_used = NULL;
+
+  cert_verify_cache_key(key, cert, signing_cert, check_rsa_1024);
+  if (cert_verify_cache)
+    last_used = digestmap_get(cert_verify_cache, key);
+  if (last_used) {
+    *last_used = now;
+  } else {
+    if (!tor_tls_cert_signature_is_ok(cert, signing_cert, check_rsa_1024))
+      return 0;
+    cert_verify_cache_add(key, now);
+  }
+
+  /* okay, the signature checked out right.  Now let's check the check the
+   * lifetime. */
+  if (check_cert_lifetime_internal(severity, cert->cert,
+                                   48*60*60, 30*24*60*60) < 0)
+    return 0;
+
   return 1;
 }
 
@@ -1266,6 +1376,12 @@ tor_tls_context_new(crypto_pk_t *identity, unsigned int key_lifetime,
   }
   SSL_CTX_set_verify(result->ctx, SSL_VERIFY_PEER,
                      always_accept_verify_cb);
+  /* Since we ask for the peer's certificate, OpenSSL won't resume a
+   * session (from a ticket, for the session cache) unless it has a session
+   * ID context to check the session against. */
+  if (!is_client)
+    SSL_CTX_set_session_id_context(result->ctx,
+                                   (const unsigned char *)"tor", 3);
   /* let us realloc bufs that we're writing from */
   SSL_CTX_set_mode(result->ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 
@@ -1314,6 +1430,12 @@ tor_tls_client_is_using_v2_ciphers(const SSL *ssl, const char *address)
     log_info(LD_NET, "No session on TLS?");
     return 0;
   }
+  if (!session->ciphers && SSL_session_reused((SSL *)ssl)) {
+    /* OpenSSL doesn't keep the client's cipher list when it resumes a
+     * session.  Only relays that cache sessions resume them, and those
+     * always take part in the v2 handshake or later. */
+    return 1;
+  }
   if (!session->ciphers) {
     log_info(LD_NET, "No ciphers on session");
     return 0;
@@ -1537,11 +1659,153 @@ rectify_client_ciphers(STACK_OF(SSL_CIPHER) **ciphers)
 #endif
 }
 
+/** The state behind a BIO that sends and receives through a tor_tls_io_t.
+ */
+typedef struct tor_tls_io_bio_t {
+  const tor_tls_io_t *io;
+  void *arg;
+  tor_socket_t sock;
+} tor_tls_io_bio_t;
+
+/** BIO write method for tor_tls_io_t BIOs: hand <b>buf</b> to the
+ * transport, as the socket BIO hands it to send(). */
+static int
+tor_tls_io_bio_write(BIO *b, const char *buf, int len)
+{
+  tor_tls_io_bio_t *st = b->ptr;
+  int r;
+  if (!buf || len <= 0)
+    return 0;
+  r = st->io->send(st->arg, st->sock, buf, (size_t)len);
+  BIO_clear_retry_flags(b);
+  if (r <= 0 && BIO_sock_should_retry(r))
+    BIO_set_retry_write(b);
+  return r;
+}
+
+/** BIO read method for tor_tls_io_t BIOs. */
+static int
+tor_tls_io_bio_read(BIO *b, char *buf, int len)
+{
+  tor_tls_io_bio_t *st = b->ptr;
+  int r;
+  if (!buf || len <= 0)
+    return 0;
+  r = st->io->recv(st->arg, st->sock, buf, (size_t)len);
+  BIO_clear_retry_flags(b);
+  if (r <= 0 && BIO_sock_should_retry(r))
+    BIO_set_retry_read(b);
+  return r;
+}
+
+/** BIO puts method for tor_tls_io_t BIOs. */
+static int
+tor_tls_io_bio_puts(BIO *b, const char *str)
+{
+  return tor_tls_io_bio_write(b, str, (int)strlen(str));
+}
+
+/** BIO ctrl method for tor_tls_io_t BIOs: we have nothing buffered, so
+ * flushing always succeeds. */
+static long
+tor_tls_io_bio_ctrl(BIO *b, int cmd, long num, void *ptr)
+{
+  (void)ptr;
+  switch (cmd) {
+    case BIO_CTRL_FLUSH:
+    case BIO_CTRL_DUP:
+      return 1;
+    case BIO_CTRL_GET_CLOSE:
+      return b->shutdown;
+    case BIO_CTRL_SET_CLOSE:
+      b->shutdown = (int)num;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/** BIO create method for tor_tls_io_t BIOs. */
+static int
+tor_tls_io_bio_new(BIO *b)
+{
+  b->init = 0;
+  b->num = 0;
+  b->ptr = NULL;
+  b->flags = 0;
+  return 1;
+}
+
+/** BIO destroy method for tor_tls_io_t BIOs: let the transport release its
+ * state.  We never close the socket; the connection owns it. */
+static int
+tor_tls_io_bio_free(BIO *b)
+{
+  tor_tls_io_bio_t *st;
+  if (!b)
+    return 0;
+  st = b->ptr;
+  if (st) {
+    if (st->io->free)
+      st->io->free(st->arg);
+    tor_free(st);
+  }
+  b->ptr = NULL;
+  b->init = 0;
+  return 1;
+}
+
+/** The BIO method for BIOs that send and receive through a tor_tls_io_t. */
+static BIO_METHOD tor_tls_io_bio_method = {
+  BIO_TYPE_SOURCE_SINK | 0x60,
+  "tor transport",
+  tor_tls_io_bio_write,
+  tor_tls_io_bio_read,
+  tor_tls_io_bio_puts,
+  NULL,
+  tor_tls_io_bio_ctrl,
+  tor_tls_io_bio_new,
+  tor_tls_io_bio_free,
+  NULL,
+};
+
+/** Return a new BIO that sends and receives on <b>sock</b> through
+ * <b>io</b> with <b>io_arg</b>, or NULL on failure.  The BIO owns
+ * <b>io_arg</b> only if we succeed. */
+static BIO *
+tor_tls_io_bio_create(tor_socket_t sock, const tor_tls_io_t *io,
+                      void *io_arg)
+{
+  tor_tls_io_bio_t *st;
+  BIO *bio = BIO_new(&tor_tls_io_bio_method);
+  if (!bio)
+    return NULL;
+  st = tor_malloc_zero(sizeof(tor_tls_io_bio_t));
+  st->io = io;
+  st->arg = io_arg;
+  st->sock = sock;
+  bio->ptr = st;
+  bio->shutdown = BIO_NOCLOSE;
+  bio->init = 1;
+  return bio;
+}
+
 /** Create a new TLS object from a file descriptor, and a flag to
  * determine whether it is functioning as a server.
  */
 tor_tls_t *
 tor_tls_new(int sock, int isServer)
+{
+  return tor_tls_new_with_io(sock, isServer, NULL, NULL);
+}
+
+/** As tor_tls_new(), but if <b>io</b> is set, send and receive our TLS
+ * records through it, with <b>io_arg</b>, rather than directly on
+ * <b>sock</b>.  On success, the new object owns <b>io_arg</b>; on failure,
+ * the caller still does. */
+tor_tls_t *
+tor_tls_new_with_io(int sock, int isServer, const tor_tls_io_t *io,
+                    void *io_arg)
 {
   BIO *bio = NULL;
   tor_tls_t *result = tor_malloc_zero(sizeof(tor_tls_t));
@@ -1578,7 +1842,10 @@ tor_tls_new(int sock, int isServer)
   if (!isServer)
     rectify_client_ciphers(&result->ssl->cipher_list);
   result->socket = sock;
-  bio = BIO_new_socket(sock, BIO_NOCLOSE);
+  if (io)
+    bio = tor_tls_io_bio_create(sock, io, io_arg);
+  else
+    bio = BIO_new_socket(sock, BIO_NOCLOSE);
   if (! bio) {
     tls_log_errors(NULL, LOG_WARN, LD_NET, "opening BIO");
 #ifdef SSL_set_tlsext_host_name
@@ -1726,6 +1993,140 @@ tor_tls_free(tor_tls_t *tls)
   tor_free(tls);
 }
 
+/** Release storage held by a tls_session_entry_t. */
+static void
+tls_session_entry_free(void *_entry)
+{
+  tls_session_entry_t *entry = _entry;
+  if (!entry)
+    return;
+  SSL_SESSION_free(entry->session);
+  tor_free(entry);
+}
+
+/** Keep at most <b>n</b> client-side TLS sessions for resumption with
+ * relays we have connected to before.  If <b>n</b> is 0, disable the
+ * session cache and release everything in it. */
+void
+tor_tls_set_session_cache_size(int n)
+{
+  if (n <= 0) {
+    if (tls_session_cache)
+      digestmap_free(tls_session_cache, tls_session_entry_free);
+    tls_session_cache = NULL;
+    tls_session_cache_max = 0;
+    return;
+  }
+  if (!tls_session_cache)
+    tls_session_cache = digestmap_new();
+  tls_session_cache_max = n;
+  /* Shrinking the cache: throw entries away until we fit again. */
+  while (digestmap_size(tls_session_cache) > n) {
+    DIGESTMAP_FOREACH_MODIFY(tls_session_cache, k, tls_session_entry_t *, e) {
+      tls_session_entry_free(e);
+      MAP_DEL_CURRENT(k);
+      break;
+    } DIGESTMAP_FOREACH_END;
+  }
+}
+
+/** Remove the oldest entry from the TLS session cache. */
+static void
+tls_session_cache_evict_oldest(void)
+{
+  char oldest_key[DIGEST_LEN];
+  time_t oldest = TIME_MAX;
+  tls_session_entry_t *entry;
+
+  DIGESTMAP_FOREACH(tls_session_cache, k, tls_session_entry_t *, e) {
+    if (e->stored_at < oldest) {
+      oldest = e->stored_at;
+      memcpy(oldest_key, k, DIGEST_LEN);
+    }
+  } DIGESTMAP_FOREACH_END;
+
+  if (oldest == TIME_MAX)
+    return;
+  entry = digestmap_remove(tls_session_cache, oldest_key);
+  tls_session_entry_free(entry);
+}
+
+/** If we have a cached, unexpired TLS session for the relay whose
+ * identity digest is <b>identity_digest</b>, offer it for resumption on
+ * the client-side connection <b>tls</b>.  Must be called before the
+ * handshake starts.  Return 1 if we offered a session, else 0. */
+int
+tor_tls_resume_session(tor_tls_t *tls, const char *identity_digest)
+{
+  tls_session_entry_t *entry;
+  time_t now;
+
+  tor_assert(tls);
+  tor_assert(!tls->isServer);
+  if (!tls_session_cache || tor_digest_is_zero(identity_digest))
+    return 0;
+  if (!(entry = digestmap_get(tls_session_cache, identity_digest)))
+    return 0;
+
+  now = time(NULL);
+  if (now >= (time_t)(SSL_SESSION_get_time(entry->session) +
+                      SSL_SESSION_get_timeout(entry->session))) {
+    digestmap_remove(tls_session_cache, identity_digest);
+    tls_session_entry_free(entry);
+    return 0;
+  }
+
+  if (!SSL_set_session(tls->ssl, entry->session)) {
+    tls_log_errors(tls, LOG_INFO, LD_HANDSHAKE, "offering cached session");
+    return 0;
+  }
+  return 1;
+}
+
+/** Remember the session negotiated on the client-side connection
+ * <b>tls</b>, which we have verified belongs to the relay whose identity
+ * digest is <b>identity_digest</b>, so that we can resume it next time we
+ * connect there. */
+void
+tor_tls_save_session(tor_tls_t *tls, const char *identity_digest)
+{
+  tls_session_entry_t *entry;
+  SSL_SESSION *session;
+
+  tor_assert(tls);
+  if (!tls_session_cache || tls->isServer ||
+      tor_digest_is_zero(identity_digest))
+    return;
+  if (!(session = SSL_get1_session(tls->ssl)))
+    return;
+
+  entry = digestmap_get(tls_session_cache, identity_digest);
+  if (entry && entry->session == session) {
+    /* We resumed this very session; nothing new to remember. */
+    SSL_SESSION_free(session);
+    return;
+  }
+  if (!entry) {
+    if (digestmap_size(tls_session_cache) >= tls_session_cache_max)
+      tls_session_cache_evict_oldest();
+    entry = tor_malloc_zero(sizeof(tls_session_entry_t));
+    digestmap_set(tls_session_cache, identity_digest, entry);
+  } else {
+    SSL_SESSION_free(entry->session);
+  }
+  entry->session = session;
+  entry->stored_at = time(NULL);
+}
+
+/** Return true iff the handshake on <b>tls</b> resumed an earlier
+ * session. */
+int
+tor_tls_session_was_resumed(tor_tls_t *tls)
+{
+  tor_assert(tls);
+  return SSL_session_reused(tls->ssl) ? 1 : 0;
+}
+
 /** Underlying function for TLS reading.  Reads up to <b>len</b>
  * characters from <b>tls</b> into <b>cp</b>.  On success, returns the
  * number of characters read.  On failure, returns TOR_TLS_ERROR,
@@ -20,6 +20,20 @@ typedef struct tor_tls_t tor_tls_t;
 /* Opaque structure to hold an X509 certificate. */
 typedef struct tor_cert_t tor_cert_t;
 
+/** Functions through which a TLS connection can send and receive its
+ * records, for a transport that transforms them inside Tor rather than in a
+ * proxy.  <b>send</b> and <b>recv</b> behave like send() and recv() on
+ * <b>sock</b>: they return the number of bytes taken or given, 0 on EOF
+ * (<b>recv</b> only), or -1 with the socket error set, for instance to
+ * EAGAIN if they would block.  Once <b>send</b> has taken bytes, they must
+ * be on their way to the network: nobody calls it again just to flush. */
+typedef struct tor_tls_io_t {
+  int (*send)(void *arg, tor_socket_t sock, const char *buf, size_t len);
+  int (*recv)(void *arg, tor_socket_t sock, char *buf, size_t len);
+  /** Release <b>arg</b>; called when the TLS connection is freed. */
+  void (*free)(void *arg);
+} tor_tls_io_t;
+
 /* Possible return values for most tor_tls_* functions. */
 #define _MIN_TOR_TLS_ERROR_VAL     -9
 #define TOR_TLS_ERROR_MISC         -9
@@ -59,12 +73,17 @@ int tor_tls_context_init(int is_public_server,
                          crypto_pk_t *server_identity,
                          unsigned int key_lifetime);
 tor_tls_t *tor_tls_new(int sock, int is_server);
+tor_tls_t *tor_tls_new_with_io(int sock, int is_server,
+                               const tor_tls_io_t *io, void *io_arg);
 void tor_tls_set_logged_address(tor_tls_t *tls, const char *address);
 void tor_tls_set_renegotiate_callback(tor_tls_t *tls,
                                       void (*cb)(tor_tls_t *, void *arg),
                                       void *arg);
 int tor_tls_is_server(tor_tls_t *tls);
 void tor_tls_free(tor_tls_t *tls);
+void tor_tls_set_session_cache_size(int n);
+int tor_tls_resume_session(tor_tls_t *tls, const char *identity_digest);
+void tor_tls_save_session(tor_tls_t *tls, const char *identity_digest);
 int tor_tls_peer_has_cert(tor_tls_t *tls);
 tor_cert_t *tor_tls_get_peer_cert(tor_tls_t *tls);
 int tor_tls_verify(int severity, tor_tls_t *tls, crypto_pk_t **identity);
@@ -130,5 +149,10 @@ int tor_tls_cert_is_valid(int severity,
                           const tor_cert_t *signing_cert,
                           int check_rsa_1024);
 
+#ifdef TORTLS_PRIVATE
+int tor_tls_cert_verify_cache_size(void);
+int tor_tls_session_was_resumed(tor_tls_t *tls);
+#endif
+
 #endif
 
@@ -290,6 +290,215 @@ _tor_free(void *mem)
   tor_free(mem);
 }
 
+/** Header that tor_malloc_tagged() puts in front of each allocation, so
+ * that we know what to uncount when it's freed.  The union keeps the
+ * memory after the header aligned for any type. */
+typedef union memtag_header_t {
+  struct {
+    size_t size; /**< Number of bytes the caller asked for. */
+    uint32_t magic; /**< MEMTAG_MAGIC while the allocation is live. */
+    uint32_t tag; /**< The memtag_t that this memory counts against. */
+  } h;
+  double _align_double; /**< Dummy, to align the header like a double. */
+  uint64_t _align_u64; /**< Dummy, to align the header like a uint64_t. */
+  void *_align_ptr; /**< Dummy, to align the header like a pointer. */
+} memtag_header_t;
+
+/** Magic value in a live memtag_header_t. */
+#define MEMTAG_MAGIC 0x7a66e4d1u
+
+/** Per-tag heap counters for one thread.  Memory that one thread allocates
+ * and another frees shows up as positive counts in the first and negative
+ * ones in the second; only the sum over all threads is meaningful. */
+typedef struct memtag_counts_t {
+  int64_t live_bytes[N_MEMTAGS]; /**< Bytes allocated and not freed. */
+  int64_t live_allocs[N_MEMTAGS]; /**< Allocations not yet freed. */
+  uint64_t total_allocs[N_MEMTAGS]; /**< Allocations ever. */
+  /** Next thread's counters.  We keep a thread's counters after it exits,
+   * since memory it allocated may outlive it. */
+  struct memtag_counts_t *next;
+} memtag_counts_t;
+
+/** Counters for the main thread, and head of the list of all threads'
+ * counters. */
+static memtag_counts_t memtag_main_counts;
+
+#ifdef TOR_IS_MULTITHREADED
+/** Lock protecting the list of counters (and, if we don't have
+ * thread-local storage, the counters themselves). */
+static tor_mutex_t memtag_lock;
+/** True iff we've initialized memtag_lock. */
+static int memtag_lock_initialized = 0;
+#endif
+
+#if defined(TOR_IS_MULTITHREADED) && defined(HAVE___THREAD)
+/** Defined iff each thread updates counters of its own, without locking. */
+#define MEMTAG_THREAD_COUNTS
+/** This thread's counters, or NULL if it hasn't used them yet. */
+static __thread memtag_counts_t *memtag_thread_counts = NULL;
+
+/** Return this thread's heap counters, creating them if necessary. */
+static memtag_counts_t *
+memtag_get_thread_counts(void)
+{
+  memtag_counts_t *counts = memtag_thread_counts;
+  if (PREDICT_LIKELY(counts != NULL))
+    return counts;
+  /* Until tor_memtag_init() runs, there is only the main thread. */
+  if (!memtag_lock_initialized || in_main_thread()) {
+    counts = &memtag_main_counts;
+  } else {
+    counts = tor_malloc_zero(sizeof(memtag_counts_t));
+    tor_mutex_acquire(&memtag_lock);
+    counts->next = memtag_main_counts.next;
+    memtag_main_counts.next = counts;
+    tor_mutex_release(&memtag_lock);
+  }
+  memtag_thread_counts = counts;
+  return counts;
+}
+#endif
+
+/** Count an allocation of <b>size</b> bytes against <b>tag</b>, or, if
+ * <b>n</b> is -1, the freeing of one. */
+static INLINE void
+memtag_note(memtag_t tag, size_t size, int n)
+{
+  memtag_counts_t *counts;
+#ifdef MEMTAG_THREAD_COUNTS
+  counts = memtag_get_thread_counts();
+#else
+  counts = &memtag_main_counts;
+#ifdef TOR_IS_MULTITHREADED
+  if (memtag_lock_initialized)
+    tor_mutex_acquire(&memtag_lock);
+#endif
+#endif
+  counts->live_bytes[tag] += n * (int64_t)size;
+  counts->live_allocs[tag] += n;
+  if (n > 0)
+    ++counts->total_allocs[tag];
+#if !defined(MEMTAG_THREAD_COUNTS) && defined(TOR_IS_MULTITHREADED)
+  if (memtag_lock_initialized)
+    tor_mutex_release(&memtag_lock);
+#endif
+}
+
+/** As tor_malloc(), but count the memory against the subsystem
+ * <b>tag</b>.  Release the result with tor_free_tagged(), not
+ * tor_free(). */
+void *
+_tor_malloc_tagged(memtag_t tag, size_t size DMALLOC_PARAMS)
+{
+  memtag_header_t *hdr;
+  tor_assert((int)tag >= 0 && tag < N_MEMTAGS);
+  tor_assert(size < SIZE_T_CEILING - sizeof(memtag_header_t));
+  hdr = _tor_malloc(sizeof(memtag_header_t) + size DMALLOC_FN_ARGS);
+  hdr->h.size = size;
+  hdr->h.magic = MEMTAG_MAGIC;
+  hdr->h.tag = tag;
+  memtag_note(tag, size, 1);
+  return hdr + 1;
+}
+
+/** As tor_malloc_zero(), but count the memory against the subsystem
+ * <b>tag</b>.  Release the result with tor_free_tagged(). */
+void *
+_tor_malloc_zero_tagged(memtag_t tag, size_t size DMALLOC_PARAMS)
+{
+  void *result = _tor_malloc_tagged(tag, size DMALLOC_FN_ARGS);
+  memset(result, 0, size);
+  return result;
+}
+
+/** Release <b>mem</b>, which must have come from tor_malloc_tagged() or
+ * tor_malloc_zero_tagged(), and uncount it. */
+void
+_tor_free_tagged(void *mem)
+{
+  memtag_header_t *hdr = ((memtag_header_t *)mem) - 1;
+  tor_assert(hdr->h.magic == MEMTAG_MAGIC);
+  hdr->h.magic = 0xdeadbeefu;
+  memtag_note(hdr->h.tag, hdr->h.size, -1);
+  tor_free(hdr);
+}
+
+/** Prepare to count tagged memory from more than one thread.  Called from
+ * tor_threads_init(). */
+void
+tor_memtag_init(void)
+{
+#ifdef TOR_IS_MULTITHREADED
+  if (!memtag_lock_initialized) {
+    tor_mutex_init(&memtag_lock);
+    memtag_lock_initialized = 1;
+  }
+#endif
+}
+
+/** Return a short name for the subsystem <b>tag</b>. */
+const char *
+memtag_get_name(memtag_t tag)
+{
+  switch (tag) {
+    case MEMTAG_BUF_CHUNK: return "buf-chunk";
+    case MEMTAG_MEMPOOL: return "mempool";
+    case MEMTAG_CONNECTION: return "connection";
+    case MEMTAG_CIRCUIT: return "circuit";
+    default:
+      tor_fragile_assert();
+      return "unknown";
+  }
+}
+
+/** Set *<b>live_bytes_out</b> and *<b>live_allocs_out</b> to the number of
+ * bytes and allocations counted against <b>tag</b> that have not been
+ * freed, and *<b>total_allocs_out</b> to the number of allocations ever
+ * counted against it.  Other threads may be updating their counters as we
+ * read them, so the results are approximate. */
+void
+memtag_get_usage(memtag_t tag, int64_t *live_bytes_out,
+                 int64_t *live_allocs_out, uint64_t *total_allocs_out)
+{
+  const memtag_counts_t *counts;
+  int64_t live_bytes = 0, live_allocs = 0;
+  uint64_t total_allocs = 0;
+  tor_assert((int)tag >= 0 && tag < N_MEMTAGS);
+#ifdef TOR_IS_MULTITHREADED
+  if (memtag_lock_initialized)
+    tor_mutex_acquire(&memtag_lock);
+#endif
+  for (counts = &memtag_main_counts; counts; counts = counts->next) {
+    live_bytes += counts->live_bytes[tag];
+    live_allocs += counts->live_allocs[tag];
+    total_allocs += counts->total_allocs[tag];
+  }
+#ifdef TOR_IS_MULTITHREADED
+  if (memtag_lock_initialized)
+    tor_mutex_release(&memtag_lock);
+#endif
+  *live_bytes_out = live_bytes;
+  *live_allocs_out = live_allocs;
+  *total_allocs_out = total_allocs;
+}
+
+/** Log how much tagged memory each subsystem is using, at level
+ * <b>severity</b>. */
+void
+memtag_log_usage(int severity)
+{
+  int i;
+  for (i = 0; i < N_MEMTAGS; ++i) {
+    int64_t live_bytes, live_allocs;
+    uint64_t total_allocs;
+    memtag_get_usage(i, &live_bytes, &live_allocs, &total_allocs);
+    tor_log(severity, LD_MM, "Tagged heap for %s: "I64_FORMAT" bytes in "
+           I64_FORMAT" allocations; "U64_FORMAT" allocations ever.",
+           memtag_get_name(i), I64_PRINTF_ARG(live_bytes),
+           I64_PRINTF_ARG(live_allocs), U64_PRINTF_ARG(total_allocs));
+  }
+}
+
 #if defined(HAVE_MALLOC_GOOD_SIZE) && !defined(HAVE_MALLOC_GOOD_SIZE_PROTOTYPE)
 /* Some version of Mac OSX have malloc_good_size in their libc, but not
  * actually defined in malloc/malloc.h.  We detect this and work around it by
@@ -2258,6 +2467,287 @@ write_bytes_to_new_file(const char *fname, const char *str, size_t len,
                                   (bin?O_BINARY:O_TEXT));
 }
 
+/** A file that a background thread is writing for us; see
+ * write_bytes_to_file_in_background(). */
+struct bg_file_write_t {
+  /** Protects <b>running</b>, <b>result</b>, and <b>abandoned</b>. */
+  tor_mutex_t *lock;
+  char *fname; /**< The file to write. */
+  char *bytes; /**< What to write there. */
+  size_t len; /**< How many bytes to write. */
+  int bin; /**< True iff we should write the file in binary mode. */
+  /** True until the thread has finished writing. */
+  int running;
+  /** Once we're not running: 0 if we wrote the file, -1 if we failed. */
+  int result;
+  /** True if nobody wants the result: the thread should free us. */
+  int abandoned;
+};
+
+/** Release all storage held by <b>w</b>. */
+static void
+bg_file_write_free_impl(bg_file_write_t *w)
+{
+  tor_mutex_free(w->lock);
+  tor_free(w->fname);
+  tor_free(w->bytes);
+  tor_free(w);
+}
+
+#ifdef TOR_IS_MULTITHREADED
+/** As write_bytes_to_file(), but make sure that the bytes have reached the
+ * disk before we replace <b>fname</b>, so that a crash can't leave us with
+ * an empty or partial file. */
+static int
+write_bytes_to_file_synced(const char *fname, const char *str, size_t len,
+                           int bin)
+{
+  open_file_t *file = NULL;
+  int fd = start_writing_to_file(fname,
+                                 OPEN_FLAGS_REPLACE|(bin?O_BINARY:O_TEXT),
+                                 0600, &file);
+  if (fd < 0)
+    return -1;
+  if (write_all(fd, str, len, 0) < 0) {
+    log_warn(LD_FS, "Error writing to \"%s\": %s", fname, strerror(errno));
+    goto err;
+  }
+#ifdef _WIN32
+  if (_commit(fd) < 0) {
+#else
+  if (fsync(fd) < 0) {
+#endif
+    log_warn(LD_FS, "Error syncing \"%s\": %s", fname, strerror(errno));
+    goto err;
+  }
+  return finish_writing_to_file(file);
+ err:
+  abort_writing_to_file(file);
+  return -1;
+}
+
+/** Thread body for write_bytes_to_file_in_background(). */
+static void
+bg_file_write_thread_main(void *arg)
+{
+  bg_file_write_t *w = arg;
+  int r, abandoned;
+  r = write_bytes_to_file_synced(w->fname, w->bytes, w->len, w->bin);
+  tor_mutex_acquire(w->lock);
+  w->result = r;
+  w->running = 0;
+  abandoned = w->abandoned;
+  tor_mutex_release(w->lock);
+  if (abandoned)
+    bg_file_write_free_impl(w);
+  spawn_exit();
+}
+#endif
+
+/** Helper: as write_bytes_to_file_in_background(), but write in binary
+ * mode only if <b>bin</b> is true. */
+static bg_file_write_t *
+bg_file_write_start(const char *fname, char *str, size_t len, int bin)
+{
+#ifdef TOR_IS_MULTITHREADED
+  bg_file_write_t *w = tor_malloc_zero(sizeof(bg_file_write_t));
+  w->lock = tor_mutex_new();
+  w->fname = tor_strdup(fname);
+  w->bytes = str;
+  w->len = len;
+  w->bin = bin;
+  w->running = 1;
+  if (spawn_func(bg_file_write_thread_main, w) < 0) {
+    w->bytes = NULL;
+    bg_file_write_free_impl(w);
+    return NULL;
+  }
+  return w;
+#else
+  (void)fname;
+  (void)str;
+  (void)len;
+  (void)bin;
+  return NULL;
+#endif
+}
+
+/** Start a thread to write the <b>len</b> bytes at <b>str</b> to
+ * <b>fname</b>, as write_bytes_to_file() would in binary mode, and to
+ * sync them to disk.  On success, take ownership of <b>str</b> (which must
+ * have come from tor_malloc) and return an object to pass to
+ * bg_file_write_poll().  If we can't run threads, return NULL and leave
+ * <b>str</b> to the caller. */
+bg_file_write_t *
+write_bytes_to_file_in_background(const char *fname, char *str, size_t len)
+{
+  return bg_file_write_start(fname, str, len, 1);
+}
+
+/** Return 0 if the thread writing <b>w</b> is still running, 1 if it has
+ * written the file, and -1 if it failed to. */
+int
+bg_file_write_poll(bg_file_write_t *w)
+{
+  int r;
+  tor_mutex_acquire(w->lock);
+  r = w->running ? 0 : (w->result < 0 ? -1 : 1);
+  tor_mutex_release(w->lock);
+  return r;
+}
+
+/** Release <b>w</b>.  If its thread is still running, let it finish, and
+ * have it free <b>w</b> afterwards. */
+void
+bg_file_write_free(bg_file_write_t *w)
+{
+  int running;
+  if (!w)
+    return;
+  tor_mutex_acquire(w->lock);
+  running = w->running;
+  w->abandoned = 1;
+  tor_mutex_release(w->lock);
+  if (!running)
+    bg_file_write_free_impl(w);
+}
+
+/** A file that we're keeping up to date with write_str_to_file_behind(). */
+typedef struct write_behind_t {
+  /** The write in progress, if any. */
+  bg_file_write_t *running;
+  /** If we've been asked to write the file again since <b>running</b>
+   * started, the newest contents we were asked to write. */
+  char *pending;
+  int pending_bin; /**< True iff <b>pending</b> should be written in binary
+                    * mode. */
+  /** Function to call if a write of this file fails, or NULL. */
+  void (*failed_fn)(const char *fname);
+} write_behind_t;
+
+/** Map from filename to write_behind_t for every file we are writing
+ * behind, or NULL if there are none. */
+static strmap_t *write_behind_map = NULL;
+
+/** Write <b>str</b> to <b>fname</b> as write_str_to_file() would, but
+ * from a background thread, so that the main thread doesn't wait for the
+ * disk.  If a write of <b>fname</b> is already running, write <b>str</b>
+ * once it's done, instead of any other contents that have been waiting
+ * for it.  Return 0 if we will write <b>str</b> or have written it, and -1
+ * if we couldn't write it.
+ *
+ * If a background write fails, log a warning and call <b>failed_fn</b>,
+ * if it is set, from write_behind_poll().  <b>failed_fn</b> must not
+ * write any files behind. */
+int
+write_str_to_file_behind(const char *fname, const char *str, int bin,
+                         void (*failed_fn)(const char *fname))
+{
+  write_behind_t *ent;
+  char *copy;
+  int r;
+
+  if (!write_behind_map)
+    write_behind_map = strmap_new();
+  ent = strmap_get(write_behind_map, fname);
+  if (ent) {
+    tor_free(ent->pending);
+    ent->pending = tor_strdup(str);
+    ent->pending_bin = bin;
+    ent->failed_fn = failed_fn;
+    return 0;
+  }
+
+  copy = tor_strdup(str);
+  ent = tor_malloc_zero(sizeof(write_behind_t));
+  ent->running = bg_file_write_start(fname, copy, strlen(copy), bin);
+  if (ent->running) {
+    ent->failed_fn = failed_fn;
+    strmap_set(write_behind_map, fname, ent);
+    return 0;
+  }
+  /* No threads: write it now. */
+  tor_free(ent);
+  r = write_bytes_to_file(fname, copy, strlen(copy), bin);
+  tor_free(copy);
+  return r;
+}
+
+/** Check on the files we're writing behind: finish any writes that are
+ * done, and start any writes that have been waiting for them. */
+void
+write_behind_poll(void)
+{
+  if (!write_behind_map)
+    return;
+  STRMAP_FOREACH_MODIFY(write_behind_map, fname, write_behind_t *, ent) {
+    int r = bg_file_write_poll(ent->running);
+    if (r == 0)
+      continue;
+    bg_file_write_free(ent->running);
+    ent->running = NULL;
+    if (r < 0) {
+      log_warn(LD_FS, "Couldn't write \"%s\" in the background.", fname);
+      if (ent->failed_fn)
+        ent->failed_fn(fname);
+    }
+    if (ent->pending) {
+      size_t len = strlen(ent->pending);
+      ent->running = bg_file_write_start(fname, ent->pending, len,
+                                         ent->pending_bin);
+      if (ent->running) {
+        ent->pending = NULL;
+        continue;
+      }
+      /* We started one thread; we should be able to start another.  If not,
+       * write the file now. */
+      if (write_bytes_to_file(fname, ent->pending, len,
+                              ent->pending_bin) < 0 && ent->failed_fn)
+        ent->failed_fn(fname);
+      tor_free(ent->pending);
+    }
+    tor_free(ent);
+    MAP_DEL_CURRENT(fname);
+  } STRMAP_FOREACH_END;
+}
+
+/** Wait until any write of <b>fname</b> that we're doing behind, and any
+ * that's waiting for it, is done.  Call this before reading a file that we
+ * might be writing behind. */
+void
+write_behind_wait(const char *fname)
+{
+  while (write_behind_map && strmap_get(write_behind_map, fname)) {
+    write_behind_poll();
+    if (!strmap_get(write_behind_map, fname))
+      break;
+#ifdef _WIN32
+    Sleep(10);
+#else
+    usleep(10000);
+#endif
+  }
+}
+
+/** Wait until every file we're writing behind has been written.  Call this
+ * before exiting. */
+void
+write_behind_flush(void)
+{
+  while (write_behind_map && !strmap_isempty(write_behind_map)) {
+    write_behind_poll();
+    if (strmap_isempty(write_behind_map))
+      break;
+#ifdef _WIN32
+    Sleep(10);
+#else
+    usleep(10000);
+#endif
+  }
+  strmap_free(write_behind_map, NULL);
+  write_behind_map = NULL;
+}
+
 /** Read the contents of <b>filename</b> into a newly allocated
  * string; return the string on success or NULL on failure.
  *
@@ -119,6 +119,43 @@ extern int dmalloc_free(const char *file, const int line, void *pnt,
 #define tor_strndup(s, n)      _tor_strndup(s, n DMALLOC_ARGS)
 #define tor_memdup(s, n)       _tor_memdup(s, n DMALLOC_ARGS)
 
+/** Subsystems whose heap use we account for separately.  Memory from
+ * tor_malloc_tagged() is counted against one of these; memory from plain
+ * tor_malloc() isn't counted at all. */
+typedef enum {
+  MEMTAG_BUF_CHUNK = 0, /**< Buffer chunks too big for any chunk class. */
+  MEMTAG_MEMPOOL = 1, /**< Memory pool chunks: queued cells, buffer slabs. */
+  MEMTAG_CONNECTION = 2, /**< connection_t and its subtypes. */
+  MEMTAG_CIRCUIT = 3 /**< circuit_t and its subtypes. */
+} memtag_t;
+/** How many values of memtag_t are there? */
+#define N_MEMTAGS 4
+
+void *_tor_malloc_tagged(memtag_t tag, size_t size DMALLOC_PARAMS)
+  ATTR_MALLOC;
+void *_tor_malloc_zero_tagged(memtag_t tag, size_t size DMALLOC_PARAMS)
+  ATTR_MALLOC;
+void _tor_free_tagged(void *mem);
+/** Release memory allocated by tor_malloc_tagged() or
+ * tor_malloc_zero_tagged(), as tor_free() does for tor_malloc(). */
+#define tor_free_tagged(p) STMT_BEGIN                          \
+    if (PREDICT_LIKELY((p)!=NULL)) {                           \
+      _tor_free_tagged(p);                                     \
+      (p)=NULL;                                                \
+    }                                                          \
+  STMT_END
+
+#define tor_malloc_tagged(tag, size) \
+  _tor_malloc_tagged(tag, size DMALLOC_ARGS)
+#define tor_malloc_zero_tagged(tag, size) \
+  _tor_malloc_zero_tagged(tag, size DMALLOC_ARGS)
+
+void tor_memtag_init(void);
+const char *memtag_get_name(memtag_t tag);
+void memtag_get_usage(memtag_t tag, int64_t *live_bytes_out,
+                      int64_t *live_allocs_out, uint64_t *total_allocs_out);
+void memtag_log_usage(int severity);
+
 void tor_log_mallinfo(int severity);
 
 /** Return the offset of <b>member</b> within the type <b>tp</b>, in bytes */
@@ -349,6 +386,16 @@ int append_bytes_to_file(const char *fname, const char *str, size_t len,
                          int bin);
 int write_bytes_to_new_file(const char *fname, const char *str, size_t len,
                             int bin);
+typedef struct bg_file_write_t bg_file_write_t;
+bg_file_write_t *write_bytes_to_file_in_background(const char *fname,
+                                                   char *str, size_t len);
+int bg_file_write_poll(bg_file_write_t *w);
+void bg_file_write_free(bg_file_write_t *w);
+int write_str_to_file_behind(const char *fname, const char *str, int bin,
+                             void (*failed_fn)(const char *fname));
+void write_behind_poll(void);
+void write_behind_wait(const char *fname);
+void write_behind_flush(void);
 
 /** Flag for read_file_to_str: open the file in binary mode. */
 #define RFTS_BIN            1
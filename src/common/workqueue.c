@@ -0,0 +1,394 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file workqueue.c
+ * \brief A pool of worker threads, and a queue that hands their results
+ * back to the main thread.
+ *
+ * The main thread passes a job to threadpool_queue_work().  Some worker
+ * thread runs the job's work function, then puts the job on the pool's
+ * replyqueue_t and pokes the queue's socketpair.  That wakes the main
+ * thread's event loop, which runs each job's reply function.
+ *
+ * The jobs we have in mind (onionskins, descriptor parsing, compression)
+ * each take far longer than a mutex acquisition, so all the workers share
+ * one locked queue, as the cpuworker threads do.
+ **/
+
+#include "orconfig.h"
+#include "compat.h"
+#include "compat_libevent.h"
+#include "workqueue.h"
+
+#include "util.h"
+#include "torlog.h"
+#include "container.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#ifdef USE_PTHREADS
+
+/** A job waiting for, being handled by, or answered by a worker thread. */
+struct workqueue_entry_t {
+  /** Function to run in a worker thread, with that thread's state. */
+  void (*fn)(void *state, void *arg);
+  /** Function to run in the main thread once <b>fn</b> is done; may be
+   * NULL. */
+  void (*reply_fn)(void *arg);
+  /** Argument for <b>fn</b> and <b>reply_fn</b>. */
+  void *arg;
+};
+
+struct replyqueue_t {
+  /** Protects <b>answered</b> and <b>alert_pending</b>. */
+  tor_mutex_t *lock;
+  /** Jobs whose work function is done, oldest first. */
+  smartlist_t *answered;
+  /** True iff we have written to alert_fds[1] since the main thread last
+   * drained alert_fds[0]. */
+  int alert_pending;
+  /** Socketpair used to wake the main thread: workers write to [1], and
+   * the main thread reads from [0]. */
+  tor_socket_t alert_fds[2];
+  /** Event to call replyqueue_process() when alert_fds[0] is readable, if
+   * we've registered one. */
+  struct event *event;
+};
+
+struct threadpool_t {
+  /** Protects every field below that can change after threadpool_new(). */
+  tor_mutex_t *lock;
+  /** Signalled when there is a new pending job, or when we're shutting
+   * down. */
+  tor_cond_t *work_cond;
+  /** Signalled when a worker thread exits. */
+  tor_cond_t *exit_cond;
+  /** Jobs that no worker has taken yet, oldest first. */
+  smartlist_t *pending;
+  /** Most jobs we allow on <b>pending</b>, or 0 for no limit. */
+  int max_pending;
+  /** Number of worker threads we launched. */
+  int n_threads;
+  /** Number of worker threads that have not yet exited. */
+  int n_running;
+  /** True iff threadpool_free() has told the workers to stop. */
+  int shutting_down;
+  /** Where to put jobs once their work function is done. */
+  replyqueue_t *replies;
+  /** Functions to build and release each worker thread's private state,
+   * and the argument for new_thread_state_fn. */
+  void *(*new_thread_state_fn)(void *);
+  void (*free_thread_state_fn)(void *);
+  void *new_thread_state_arg;
+};
+
+/** Return a new, empty replyqueue_t, or NULL if we can't make the
+ * socketpair it needs. */
+replyqueue_t *
+replyqueue_new(void)
+{
+  replyqueue_t *queue;
+  tor_socket_t fds[2];
+  int err;
+
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) < 0) {
+    log_warn(LD_GENERAL, "Couldn't construct socketpair for a reply "
+             "queue: %s", tor_socket_strerror(-err));
+    return NULL;
+  }
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+
+  queue = tor_malloc_zero(sizeof(replyqueue_t));
+  queue->lock = tor_mutex_new();
+  queue->answered = smartlist_new();
+  queue->alert_fds[0] = fds[0];
+  queue->alert_fds[1] = fds[1];
+  return queue;
+}
+
+/** Release all storage held by <b>queue</b>.  Replies that were never
+ * processed are dropped without running their reply functions.  The caller
+ * must first free every threadpool_t that uses <b>queue</b>. */
+void
+replyqueue_free(replyqueue_t *queue)
+{
+  if (!queue)
+    return;
+  if (queue->event)
+    tor_event_free(queue->event);
+  tor_close_socket(queue->alert_fds[0]);
+  tor_close_socket(queue->alert_fds[1]);
+  SMARTLIST_FOREACH(queue->answered, workqueue_entry_t *, ent,
+                    tor_free(ent));
+  smartlist_free(queue->answered);
+  tor_mutex_free(queue->lock);
+  tor_free(queue);
+}
+
+/** Return a socket that becomes readable whenever <b>queue</b> has replies
+ * waiting for replyqueue_process().  For callers that don't use
+ * replyqueue_register_event(). */
+tor_socket_t
+replyqueue_get_socket(replyqueue_t *queue)
+{
+  return queue->alert_fds[0];
+}
+
+/** Libevent callback: process the replies on a replyqueue_t. */
+static void
+replyqueue_event_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  replyqueue_process(arg);
+}
+
+/** Arrange for <b>base</b> to call replyqueue_process() on <b>queue</b>
+ * whenever it has replies waiting.  Return 0 on success, -1 on failure. */
+int
+replyqueue_register_event(replyqueue_t *queue, struct event_base *base)
+{
+  tor_assert(!queue->event);
+  queue->event = tor_event_new(base, queue->alert_fds[0],
+                               EV_READ|EV_PERSIST, replyqueue_event_cb,
+                               queue);
+  if (!queue->event || event_add(queue->event, NULL) < 0) {
+    log_warn(LD_GENERAL, "Couldn't add an event for a reply queue.");
+    if (queue->event)
+      tor_event_free(queue->event);
+    queue->event = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/** In a worker thread: put the finished job <b>ent</b> on <b>queue</b>,
+ * and wake the main thread if it isn't already due to look at
+ * <b>queue</b>. */
+static void
+replyqueue_add(replyqueue_t *queue, workqueue_entry_t *ent)
+{
+  tor_mutex_acquire(queue->lock);
+  smartlist_add(queue->answered, ent);
+  if (!queue->alert_pending) {
+    queue->alert_pending = 1;
+    send(queue->alert_fds[1], "", 1, 0);
+  }
+  tor_mutex_release(queue->lock);
+}
+
+/** In the main thread: run the reply function of every job on
+ * <b>queue</b>, oldest first, and free the jobs. */
+void
+replyqueue_process(replyqueue_t *queue)
+{
+  smartlist_t *answered;
+  char buf[64];
+
+  tor_mutex_acquire(queue->lock);
+  while (recv(queue->alert_fds[0], buf, sizeof(buf), 0) > 0)
+    ;
+  queue->alert_pending = 0;
+  answered = queue->answered;
+  queue->answered = smartlist_new();
+  tor_mutex_release(queue->lock);
+
+  SMARTLIST_FOREACH_BEGIN(answered, workqueue_entry_t *, ent) {
+    if (ent->reply_fn)
+      ent->reply_fn(ent->arg);
+    tor_free(ent);
+  } SMARTLIST_FOREACH_END(ent);
+  smartlist_free(answered);
+}
+
+/** Body of each worker thread in a threadpool_t: take jobs from the front
+ * of the pending queue and run them until the pool shuts down. */
+static void
+threadpool_worker_main(void *pool_)
+{
+  threadpool_t *pool = pool_;
+  workqueue_entry_t *ent;
+  void *state = NULL;
+
+  if (pool->new_thread_state_fn)
+    state = pool->new_thread_state_fn(pool->new_thread_state_arg);
+
+  tor_mutex_acquire(pool->lock);
+  for (;;) {
+    while (!smartlist_len(pool->pending) && !pool->shutting_down)
+      tor_cond_wait(pool->work_cond, pool->lock);
+    if (pool->shutting_down)
+      break;
+    ent = smartlist_get(pool->pending, 0);
+    smartlist_del_keeporder(pool->pending, 0);
+    tor_mutex_release(pool->lock);
+
+    ent->fn(state, ent->arg);
+    replyqueue_add(pool->replies, ent);
+
+    tor_mutex_acquire(pool->lock);
+  }
+  tor_mutex_release(pool->lock);
+
+  if (pool->free_thread_state_fn)
+    pool->free_thread_state_fn(state);
+
+  /* After this, threadpool_free() may free the pool at any moment. */
+  tor_mutex_acquire(pool->lock);
+  --pool->n_running;
+  tor_cond_signal_all(pool->exit_cond);
+  tor_mutex_release(pool->lock);
+  spawn_exit();
+}
+
+/** Launch a pool of <b>n_threads</b> worker threads, and return it; or
+ * return NULL if we couldn't launch any.  Finished jobs go to
+ * <b>replies</b>.  If <b>max_pending</b> is positive, queue at most that
+ * many jobs that no worker has started.
+ *
+ * Each worker calls <b>new_thread_state_fn</b>(<b>arg</b>), if provided,
+ * when it starts, passes the result to every work function it runs, and
+ * releases it with <b>free_thread_state_fn</b> (if provided) when it
+ * exits. */
+threadpool_t *
+threadpool_new(int n_threads, int max_pending, replyqueue_t *replies,
+               void *(*new_thread_state_fn)(void *),
+               void (*free_thread_state_fn)(void *),
+               void *arg)
+{
+  threadpool_t *pool;
+  int i;
+
+  tor_assert(n_threads > 0);
+  tor_assert(replies);
+
+  pool = tor_malloc_zero(sizeof(threadpool_t));
+  pool->work_cond = tor_cond_new();
+  pool->exit_cond = tor_cond_new();
+  if (!pool->work_cond || !pool->exit_cond) {
+    log_warn(LD_GENERAL, "Couldn't create conditions for a thread pool.");
+    tor_cond_free(pool->work_cond);
+    tor_cond_free(pool->exit_cond);
+    tor_free(pool);
+    return NULL;
+  }
+  pool->lock = tor_mutex_new();
+  pool->pending = smartlist_new();
+  pool->max_pending = max_pending;
+  pool->replies = replies;
+  pool->new_thread_state_fn = new_thread_state_fn;
+  pool->free_thread_state_fn = free_thread_state_fn;
+  pool->new_thread_state_arg = arg;
+
+  tor_mutex_acquire(pool->lock);
+  for (i = 0; i < n_threads; ++i) {
+    if (spawn_func(threadpool_worker_main, pool) < 0) {
+      log_warn(LD_GENERAL, "Couldn't launch worker thread %d of %d.",
+               i+1, n_threads);
+      break;
+    }
+    ++pool->n_running;
+  }
+  pool->n_threads = pool->n_running;
+  tor_mutex_release(pool->lock);
+
+  if (!pool->n_threads) {
+    threadpool_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/** Stop all the worker threads in <b>pool</b>, waiting for any job they
+ * are running to finish, and release all storage held by <b>pool</b>.
+ * Jobs that no worker has started are dropped without running either of
+ * their functions. */
+void
+threadpool_free(threadpool_t *pool)
+{
+  if (!pool)
+    return;
+  tor_mutex_acquire(pool->lock);
+  pool->shutting_down = 1;
+  tor_cond_signal_all(pool->work_cond);
+  while (pool->n_running)
+    tor_cond_wait(pool->exit_cond, pool->lock);
+  tor_mutex_release(pool->lock);
+
+  if (smartlist_len(pool->pending))
+    log_info(LD_GENERAL, "Dropping %d unstarted jobs from a thread pool.",
+             smartlist_len(pool->pending));
+  SMARTLIST_FOREACH(pool->pending, workqueue_entry_t *, ent, tor_free(ent));
+  smartlist_free(pool->pending);
+  tor_cond_free(pool->work_cond);
+  tor_cond_free(pool->exit_cond);
+  tor_mutex_free(pool->lock);
+  tor_free(pool);
+}
+
+/** Return the number of worker threads in <b>pool</b>. */
+int
+threadpool_get_n_threads(const threadpool_t *pool)
+{
+  return pool->n_threads;
+}
+
+/** Queue a job for <b>pool</b>: some worker thread will call
+ * <b>fn</b>(<i>state</i>, <b>arg</b>), and then the main thread will call
+ * <b>reply_fn</b>(<b>arg</b>) from replyqueue_process().  Return a handle
+ * for the job, valid until its reply function has run.  Return NULL if
+ * <b>pool</b> already has as many pending jobs as it allows. */
+workqueue_entry_t *
+threadpool_queue_work(threadpool_t *pool,
+                      void (*fn)(void *state, void *arg),
+                      void (*reply_fn)(void *arg),
+                      void *arg)
+{
+  workqueue_entry_t *ent;
+  tor_assert(fn);
+
+  tor_mutex_acquire(pool->lock);
+  if (pool->max_pending > 0 &&
+      smartlist_len(pool->pending) >= pool->max_pending) {
+    tor_mutex_release(pool->lock);
+    return NULL;
+  }
+  ent = tor_malloc(sizeof(workqueue_entry_t));
+  ent->fn = fn;
+  ent->reply_fn = reply_fn;
+  ent->arg = arg;
+  smartlist_add(pool->pending, ent);
+  tor_cond_signal_one(pool->work_cond);
+  tor_mutex_release(pool->lock);
+  return ent;
+}
+
+/** If no worker in <b>pool</b> has started the job <b>ent</b>, remove it
+ * from the queue, free it, and return its argument.  Otherwise return NULL:
+ * the job will run and reply as usual. */
+void *
+workqueue_entry_cancel(threadpool_t *pool, workqueue_entry_t *ent)
+{
+  void *arg = NULL;
+
+  tor_mutex_acquire(pool->lock);
+  SMARTLIST_FOREACH_BEGIN(pool->pending, workqueue_entry_t *, e) {
+    if (e == ent) {
+      smartlist_del_keeporder(pool->pending, e_sl_idx);
+      arg = ent->arg;
+      tor_free(ent);
+      break;
+    }
+  } SMARTLIST_FOREACH_END(e);
+  tor_mutex_release(pool->lock);
+  return arg;
+}
+
+#endif
+
@@ -0,0 +1,50 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file workqueue.h
+ * \brief Header for workqueue.c
+ **/
+
+#ifndef _TOR_WORKQUEUE_H
+#define _TOR_WORKQUEUE_H
+
+#include "compat.h"
+
+/* Like conditions, which they use, thread pools are only implemented with
+ * pthreads so far. */
+#ifdef USE_PTHREADS
+
+struct event_base;
+
+/** A pool of worker threads that run queued jobs. */
+typedef struct threadpool_t threadpool_t;
+/** A queue where finished jobs wait for the main thread to handle their
+ * replies. */
+typedef struct replyqueue_t replyqueue_t;
+/** A single job, queued with threadpool_queue_work(). */
+typedef struct workqueue_entry_t workqueue_entry_t;
+
+replyqueue_t *replyqueue_new(void);
+void replyqueue_free(replyqueue_t *queue);
+tor_socket_t replyqueue_get_socket(replyqueue_t *queue);
+int replyqueue_register_event(replyqueue_t *queue, struct event_base *base);
+void replyqueue_process(replyqueue_t *queue);
+
+threadpool_t *threadpool_new(int n_threads, int max_pending,
+                             replyqueue_t *replies,
+                             void *(*new_thread_state_fn)(void *),
+                             void (*free_thread_state_fn)(void *),
+                             void *arg);
+void threadpool_free(threadpool_t *pool);
+int threadpool_get_n_threads(const threadpool_t *pool);
+workqueue_entry_t *threadpool_queue_work(threadpool_t *pool,
+                                         void (*fn)(void *state, void *arg),
+                                         void (*reply_fn)(void *arg),
+                                         void *arg);
+void *workqueue_entry_cancel(threadpool_t *pool, workqueue_entry_t *ent);
+
+#endif
+
+#endif
+
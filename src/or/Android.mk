@@ -12,6 +12,7 @@ LOCAL_SRC_FILES :=                      \
     circuituse.c			\
     command.c				\
     config.c				\
+    consdiff.c				\
     connection.c			\
     connection_edge.c			\
     connection_or.c			\
@@ -38,9 +39,11 @@ LOCAL_SRC_FILES :=                      \
     rendmid.c				\
     rendservice.c			\
     rephist.c				\
+    replaycache.c			\
     router.c				\
     routerlist.c			\
     routerparse.c			\
+    scheduler.c				\
     status.c				\
     config_codedigest.c
 
@@ -70,7 +73,7 @@ LOCAL_SRC_FILES := tor_main.c
 
 tor_main.o: micro-revision.i
 
-LOCAL_STATIC_LIBRARIES := libtor libor libor-crypto libor-event libevent_full libssl_static libcrypto_static libz libm
+LOCAL_STATIC_LIBRARIES := libtor libor libor-crypto libor-crypto-aes-hw libor-event libevent_full libssl_static libcrypto_static libz libm
 
 LOCAL_C_INCLUDES += $(TOR_LOCAL_PATH)
 LOCAL_C_INCLUDES += $(TOR_LOCAL_PATH)/src/common/
@@ -17,15 +17,29 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "mempool.h"
 #include "reasons.h"
 #include "../common/util.h"
 #include "../common/torlog.h"
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 //#define PARANOIA
 
+/* Unless told otherwise, read and write plain sockets with one readv() or
+ * writev() call across several chunks, rather than one recv() or send()
+ * per chunk.  (On Windows, WSARecv() and WSASend() do the same job.) */
+#if defined(_WIN32) || \
+  (defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV))
+#ifndef DISABLE_VECTORED_IO
+#define USE_VECTORED_IO
+#endif
+#endif
+
 #ifdef PARANOIA
 /** Helper: If PARANOIA is defined, assert that the buffer in local variable
  * <b>buf</b> is well-formed. */
@@ -49,6 +63,19 @@
  * string, use the buf_pullup function to make them so.  Don't do this more
  * than necessary.
  *
+ * A chunk can also be "external": rather than holding its data in its own
+ * mem field, it points at memory that somebody else owns, and calls a
+ * release function once the buffer is done with it.  We use this to put
+ * queued cells onto an OR connection's outbuf without copying them.  You
+ * can't append to an external chunk, and buf_pullup copies one into a
+ * regular chunk before modifying it.
+ *
+ * Several buffers can also share the memory of a regular chunk: the owner
+ * keeps the chunk, and each other buffer gets an external chunk that holds
+ * a reference to it.  The owner may keep appending to a shared chunk, but
+ * buf_pullup copies it before moving or resizing its memory.  We use this
+ * to move and copy data between buffers without copying the bytes.
+ *
  * The major free Unix kernels have handled buffers like this since, like,
  * forever.
  */
@@ -67,7 +94,19 @@ typedef struct chunk_t {
   struct chunk_t *next; /**< The next chunk on the buffer or freelist. */
   size_t datalen; /**< The number of bytes stored in this chunk */
   size_t memlen; /**< The number of usable bytes of storage in <b>mem</b>. */
-  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
+  char *data; /**< A pointer to the first byte of data stored in <b>mem</b>,
+              * or in external memory if this is an external chunk. */
+  /** If this is an external chunk, a function to call with
+   * <b>release_arg</b> once we no longer need <b>data</b>.  NULL for
+   * regular chunks. */
+  void (*release_fn)(void *arg);
+  void *release_arg; /**< Argument to pass to <b>release_fn</b>. */
+  /** For a regular chunk, the number of chunks (including this one) that
+   * refer to its mem field.  We don't release the memory until this drops
+   * to 0, and we don't move or resize it while this is above 1. */
+  int refcnt;
+  time_t inserted_time; /**< When did we allocate this chunk, or copy the
+                         * data it holds onto some earlier chunk? */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
 } chunk_t;
@@ -81,6 +120,15 @@ typedef struct chunk_t {
  * malloc(<b>memlen</b>). */
 #define CHUNK_SIZE_WITH_ALLOC(memlen) ((memlen) - CHUNK_HEADER_LEN)
 
+/** Return true iff <b>chunk</b> refers to data outside its own mem field. */
+#define CHUNK_IS_EXTERNAL(chunk) ((chunk)->release_fn != NULL)
+/** Return true iff <b>chunk</b> is a regular chunk whose memory some other
+ * chunk also refers to. */
+#define CHUNK_IS_SHARED(chunk) \
+  (!CHUNK_IS_EXTERNAL(chunk) && (chunk)->refcnt > 1)
+
+static chunk_t *chunk_copy(const chunk_t *in_chunk);
+
 /** Return the next character in <b>chunk</b> onto which data can be appended.
  * If the chunk is full, this might be off the end of chunk->mem. */
 static INLINE char *
@@ -94,6 +142,8 @@ CHUNK_WRITE_PTR(chunk_t *chunk)
 static INLINE size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (CHUNK_IS_EXTERNAL(chunk))
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
@@ -108,135 +158,233 @@ chunk_repack(chunk_t *chunk)
   chunk->data = &chunk->mem[0];
 }
 
+/** Allocate and return an external chunk holding the <b>datalen</b> bytes
+ * at <b>data</b>.  We'll call <b>release_fn</b>(<b>release_arg</b>) when
+ * the chunk is freed. */
+static INLINE chunk_t *
+chunk_external_new(const char *data, size_t datalen,
+                   void (*release_fn)(void *), void *release_arg)
+{
+  chunk_t *ch = tor_malloc(CHUNK_ALLOC_SIZE(0));
+  ch->next = NULL;
+  ch->datalen = datalen;
+  ch->memlen = 0;
+  ch->data = (char*)data;
+  ch->release_fn = release_fn;
+  ch->release_arg = release_arg;
+  ch->refcnt = 1;
+  ch->inserted_time = approx_time();
+  return ch;
+}
+
+/** Release the data referenced by the external chunk <b>chunk</b>, and
+ * free the chunk itself. */
+static INLINE void
+chunk_external_free(chunk_t *chunk)
+{
+  chunk->release_fn(chunk->release_arg);
+  tor_free(chunk);
+}
+
+/** How many bytes are allocated for regular chunks right now, counting
+ * chunk headers? */
+static size_t total_bytes_allocated_in_chunks = 0;
+
 #if defined(ENABLE_BUF_FREELISTS) || defined(RUNNING_DOXYGEN)
-/** A freelist of chunks. */
-typedef struct chunk_freelist_t {
-  size_t alloc_size; /**< What size chunks does this freelist hold? */
-  int max_length; /**< Never allow more than this number of chunks in the
-                   * freelist. */
-  int slack; /**< When trimming the freelist, leave this number of extra
-              * chunks beyond lowest_length.*/
-  int cur_length; /**< How many chunks on the freelist now? */
-  int lowest_length; /**< What's the smallest value of cur_length since the
-                      * last time we cleaned this freelist? */
-  uint64_t n_alloc;
-  uint64_t n_free;
-  uint64_t n_hit;
-  chunk_t *head; /**< First chunk on the freelist. */
-} chunk_freelist_t;
-
-/** Macro to help define freelists. */
-#define FL(a,m,s) { a, m, s, 0, 0, 0, 0, 0, NULL }
-
-/** Static array of freelists, sorted by alloc_len, terminated by an entry
- * with alloc_size of 0. */
-static chunk_freelist_t freelists[] = {
-  FL(4096, 256, 8), FL(8192, 128, 4), FL(16384, 64, 4), FL(32768, 32, 2),
-  FL(0, 0, 0)
+/** A size class of chunks.  Every chunk in a class has the same allocation
+ * size, and comes from a memory pool that carves slabs of memory into
+ * chunks of that size.  Once every chunk in a slab is free, we can give the
+ * whole slab back. */
+typedef struct chunk_class_t {
+  size_t alloc_size; /**< What size chunks does this class hold? */
+  mp_pool_t *pool; /**< Pool of slabs holding these chunks, or NULL if we
+                    * haven't needed one yet. */
+  int n_in_use; /**< How many chunks of this class exist right now? */
+  int peak_in_use; /**< What's the largest value of n_in_use since the last
+                    * time we cleaned this class? */
+  uint64_t n_alloc; /**< How many chunks have we ever allocated? */
+  uint64_t n_free; /**< How many chunks have we ever freed? */
+  uint64_t n_slabs_freed; /**< How many empty slabs have we given back? */
+} chunk_class_t;
+
+/** Try to make each slab about this many bytes long.  Slabs this big get
+ * their own mappings from most system allocators, so freeing an empty slab
+ * returns its pages to the OS. */
+#define CHUNK_SLAB_SIZE (256*1024)
+
+/** Macro to help define size classes. */
+#define CC(a) { a, NULL, 0, 0, 0, 0, 0 }
+
+/** Static array of size classes, sorted by alloc_size, terminated by an
+ * entry with alloc_size of 0.  preferred_chunk_size() only ever asks for
+ * powers of two between MIN_CHUNK_ALLOC and MAX_CHUNK_ALLOC, so these cover
+ * nearly every chunk we allocate. */
+static chunk_class_t chunk_classes[] = {
+  CC(256), CC(512), CC(1024), CC(2048), CC(4096), CC(8192), CC(16384),
+  CC(32768), CC(65536),
+  CC(0)
 };
-#undef FL
-/** How many times have we looked for a chunk of a size that no freelist
- * could help with? */
-static uint64_t n_freelist_miss = 0;
-
-static void assert_freelist_ok(chunk_freelist_t *fl);
+#undef CC
+/** How many times have we allocated a chunk of a size that no class
+ * covers? */
+static uint64_t n_unclassed_alloc = 0;
 
-/** Return the freelist to hold chunks of size <b>alloc</b>, or NULL if
- * no freelist exists for that size. */
-static INLINE chunk_freelist_t *
-get_freelist(size_t alloc)
+/** Return the size class for chunks of size <b>alloc</b>, or NULL if
+ * no class exists for that size. */
+static INLINE chunk_class_t *
+get_chunk_class(size_t alloc)
 {
   int i;
-  for (i=0; freelists[i].alloc_size <= alloc; ++i) {
-    if (freelists[i].alloc_size == alloc) {
-      return &freelists[i];
+  for (i=0; chunk_classes[i].alloc_size; ++i) {
+    if (chunk_classes[i].alloc_size > alloc)
+      break;
+    if (chunk_classes[i].alloc_size == alloc) {
+      return &chunk_classes[i];
     }
   }
   return NULL;
 }
 
-/** Deallocate a chunk or put it on a freelist */
+/** Deallocate a chunk, returning it to its size class if it has one. */
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
-  size_t alloc;
-  chunk_freelist_t *freelist;
+  chunk_class_t *cls;
 
-  alloc = CHUNK_ALLOC_SIZE(chunk->memlen);
-  freelist = get_freelist(alloc);
-  if (freelist && freelist->cur_length < freelist->max_length) {
-    chunk->next = freelist->head;
-    freelist->head = chunk;
-    ++freelist->cur_length;
+  if (CHUNK_IS_EXTERNAL(chunk)) {
+    chunk_external_free(chunk);
+    return;
+  }
+  if (--chunk->refcnt > 0)
+    return; /* Some other buffer still uses this chunk's memory. */
+  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  cls = get_chunk_class(CHUNK_ALLOC_SIZE(chunk->memlen));
+  if (cls) {
+    tor_assert(cls->n_in_use > 0);
+    --cls->n_in_use;
+    ++cls->n_free;
+    mp_pool_release(chunk);
   } else {
-    if (freelist)
-      ++freelist->n_free;
-    tor_free(chunk);
+    tor_free_tagged(chunk);
   }
 }
 
-/** Allocate a new chunk with a given allocation size, or get one from the
- * freelist.  Note that a chunk with allocation size A can actually hold only
- * CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
+/** Allocate a new chunk with a given allocation size, from its size class
+ * if it has one.  Note that a chunk with allocation size A can actually
+ * hold only CHUNK_SIZE_WITH_ALLOC(A) bytes in its mem field. */
 static INLINE chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  chunk_freelist_t *freelist;
+  chunk_class_t *cls;
   tor_assert(alloc >= sizeof(chunk_t));
-  freelist = get_freelist(alloc);
-  if (freelist && freelist->head) {
-    ch = freelist->head;
-    freelist->head = ch->next;
-    if (--freelist->cur_length < freelist->lowest_length)
-      freelist->lowest_length = freelist->cur_length;
-    ++freelist->n_hit;
+  cls = get_chunk_class(alloc);
+  if (cls) {
+    if (PREDICT_UNLIKELY(!cls->pool))
+      cls->pool = mp_pool_new(alloc, CHUNK_SLAB_SIZE);
+    ch = mp_pool_get(cls->pool);
+    ++cls->n_alloc;
+    if (++cls->n_in_use > cls->peak_in_use)
+      cls->peak_in_use = cls->n_in_use;
   } else {
-    /* XXXX take advantage of tor_malloc_roundup, once we know how that
-     * affects freelists. */
-    if (freelist)
-      ++freelist->n_alloc;
-    else
-      ++n_freelist_miss;
-    ch = tor_malloc(alloc);
+    ++n_unclassed_alloc;
+    ch = tor_malloc_tagged(MEMTAG_BUF_CHUNK, alloc);
   }
+  total_bytes_allocated_in_chunks += alloc;
   ch->next = NULL;
   ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
+  ch->refcnt = 1;
+  ch->inserted_time = approx_time();
   return ch;
 }
 #else
 static void
 chunk_free_unchecked(chunk_t *chunk)
 {
-  tor_free(chunk);
+  if (CHUNK_IS_EXTERNAL(chunk)) {
+    chunk_external_free(chunk);
+    return;
+  }
+  if (--chunk->refcnt > 0)
+    return; /* Some other buffer still uses this chunk's memory. */
+  total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  tor_free_tagged(chunk);
 }
 static INLINE chunk_t *
 chunk_new_with_alloc_size(size_t alloc)
 {
   chunk_t *ch;
-  ch = tor_malloc_roundup(&alloc);
+  ch = tor_malloc_tagged(MEMTAG_BUF_CHUNK, alloc);
+  total_bytes_allocated_in_chunks += alloc;
   ch->next = NULL;
   ch->datalen = 0;
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   ch->data = &ch->mem[0];
+  ch->release_fn = NULL;
+  ch->release_arg = NULL;
+  ch->refcnt = 1;
+  ch->inserted_time = approx_time();
   return ch;
 }
 #endif
 
+/** Release function for chunks made by chunk_share(): drop a reference to
+ * the regular chunk <b>arg</b>. */
+static void
+chunk_share_release(void *arg)
+{
+  chunk_t *owner = arg;
+  tor_assert(owner->refcnt >= 1);
+  chunk_free_unchecked(owner);
+}
+
+/** Return a new external chunk holding the first <b>datalen</b> bytes of
+ * <b>chunk</b>'s data, without copying them.  If <b>chunk</b> is a regular
+ * chunk, or itself came from chunk_share(), the new chunk shares the
+ * underlying memory; return NULL if <b>chunk</b> is some other kind of
+ * external chunk. */
+static chunk_t *
+chunk_share(chunk_t *chunk, size_t datalen)
+{
+  chunk_t *owner, *sharer;
+  tor_assert(datalen <= chunk->datalen);
+  if (!CHUNK_IS_EXTERNAL(chunk))
+    owner = chunk;
+  else if (chunk->release_fn == chunk_share_release)
+    owner = chunk->release_arg;
+  else
+    return NULL;
+  ++owner->refcnt;
+  sharer = chunk_external_new(chunk->data, datalen,
+                              chunk_share_release, owner);
+  sharer->inserted_time = chunk->inserted_time;
+  return sharer;
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
- * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
+ * new pointer to <b>chunk</b>.  Old pointers are no longer valid.  (We
+ * can't realloc() chunks that live in a slab, so we always move the data
+ * to a new chunk.) */
 static INLINE chunk_t *
 chunk_grow(chunk_t *chunk, size_t sz)
 {
+  chunk_t *newchunk;
   off_t offset;
   tor_assert(sz > chunk->memlen);
+  tor_assert(!CHUNK_IS_EXTERNAL(chunk) && !CHUNK_IS_SHARED(chunk));
   offset = chunk->data - chunk->mem;
-  chunk = tor_realloc(chunk, CHUNK_ALLOC_SIZE(sz));
-  chunk->memlen = sz;
-  chunk->data = chunk->mem + offset;
-  return chunk;
+  newchunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(sz));
+  memcpy(newchunk->mem + offset, chunk->data, chunk->datalen);
+  newchunk->next = chunk->next;
+  newchunk->datalen = chunk->datalen;
+  newchunk->data = newchunk->mem + offset;
+  newchunk->inserted_time = chunk->inserted_time;
+  chunk_free_unchecked(chunk);
+  return newchunk;
 }
 
 /** If a read onto the end of a chunk would be smaller than this number, then
@@ -259,103 +407,132 @@ preferred_chunk_size(size_t target)
   return sz;
 }
 
-/** Remove from the freelists most chunks that have not been used since the
- * last call to buf_shrink_freelists(). */
+/** Give back the memory of any chunk slabs that have been empty since the
+ * last call to buf_shrink_freelists().  If <b>free_all</b>, give back every
+ * empty slab. */
 void
 buf_shrink_freelists(int free_all)
 {
 #ifdef ENABLE_BUF_FREELISTS
   int i;
   disable_control_logging();
-  for (i = 0; freelists[i].alloc_size; ++i) {
-    int slack = freelists[i].slack;
-    assert_freelist_ok(&freelists[i]);
-    if (free_all || freelists[i].lowest_length > slack) {
-      int n_to_free = free_all ? freelists[i].cur_length :
-        (freelists[i].lowest_length - slack);
-      int n_to_skip = freelists[i].cur_length - n_to_free;
-      int orig_length = freelists[i].cur_length;
-      int orig_n_to_free = n_to_free, n_freed=0;
-      int orig_n_to_skip = n_to_skip;
-      int new_length = n_to_skip;
-      chunk_t **chp = &freelists[i].head;
-      chunk_t *chunk;
-      while (n_to_skip) {
-        if (! (*chp)->next) {
-          log_warn(LD_BUG, "I wanted to skip %d chunks in the freelist for "
-                   "%d-byte chunks, but only found %d. (Length %d)",
-                   orig_n_to_skip, (int)freelists[i].alloc_size,
-                   orig_n_to_skip-n_to_skip, freelists[i].cur_length);
-          assert_freelist_ok(&freelists[i]);
-          goto done;
-        }
-        // tor_assert((*chp)->next);
-        chp = &(*chp)->next;
-        --n_to_skip;
-      }
-      chunk = *chp;
-      *chp = NULL;
-      while (chunk) {
-        chunk_t *next = chunk->next;
-        tor_free(chunk);
-        chunk = next;
-        --n_to_free;
-        ++n_freed;
-        ++freelists[i].n_free;
-      }
-      if (n_to_free) {
-        log_warn(LD_BUG, "Freelist length for %d-byte chunks may have been "
-                 "messed up somehow.", (int)freelists[i].alloc_size);
-        log_warn(LD_BUG, "There were %d chunks at the start.  I decided to "
-                 "keep %d. I wanted to free %d.  I freed %d.  I somehow think "
-                 "I have %d left to free.",
-                 freelists[i].cur_length, n_to_skip, orig_n_to_free,
-                 n_freed, n_to_free);
-      }
-      // tor_assert(!n_to_free);
-      freelists[i].cur_length = new_length;
-      log_info(LD_MM, "Cleaned freelist for %d-byte chunks: original "
-               "length %d, kept %d, dropped %d.",
-               (int)freelists[i].alloc_size, orig_length,
-               orig_n_to_skip, orig_n_to_free);
+  for (i = 0; chunk_classes[i].alloc_size; ++i) {
+    chunk_class_t *cls = &chunk_classes[i];
+    int n_before, n_after, n_empty;
+    uint64_t bytes;
+    if (!cls->pool)
+      continue;
+    mp_pool_get_usage(cls->pool, &n_before, &n_empty, &bytes);
+    mp_pool_clean(cls->pool, 0, !free_all);
+    mp_pool_get_usage(cls->pool, &n_after, &n_empty, &bytes);
+    if (n_after < n_before) {
+      cls->n_slabs_freed += n_before - n_after;
+      log_info(LD_MM, "Cleaned slabs for %d-byte chunks: had %d, "
+               "dropped %d. (%d chunks in use; at most %d since last time.)",
+               (int)cls->alloc_size, n_before, n_before - n_after,
+               cls->n_in_use, cls->peak_in_use);
     }
-    freelists[i].lowest_length = freelists[i].cur_length;
-    assert_freelist_ok(&freelists[i]);
+    cls->peak_in_use = cls->n_in_use;
   }
- done:
   enable_control_logging();
 #else
   (void) free_all;
 #endif
 }
 
-/** Describe the current status of the freelists at log level <b>severity</b>.
+/** Describe the current status of the chunk size classes at log level
+ * <b>severity</b>.
  */
 void
 buf_dump_freelist_sizes(int severity)
 {
 #ifdef ENABLE_BUF_FREELISTS
   int i;
-  log(severity, LD_MM, "====== Buffer freelists:");
-  for (i = 0; freelists[i].alloc_size; ++i) {
-    uint64_t total = ((uint64_t)freelists[i].cur_length) *
-      freelists[i].alloc_size;
+  log(severity, LD_MM, "====== Buffer chunk classes:");
+  for (i = 0; chunk_classes[i].alloc_size; ++i) {
+    const chunk_class_t *cls = &chunk_classes[i];
+    int n_slabs = 0, n_empty = 0;
+    uint64_t slab_bytes = 0;
+    if (cls->pool)
+      mp_pool_get_usage(cls->pool, &n_slabs, &n_empty, &slab_bytes);
     log(severity, LD_MM,
-        U64_FORMAT" bytes in %d %d-byte chunks ["U64_FORMAT
-        " misses; "U64_FORMAT" frees; "U64_FORMAT" hits]",
-        U64_PRINTF_ARG(total),
-        freelists[i].cur_length, (int)freelists[i].alloc_size,
-        U64_PRINTF_ARG(freelists[i].n_alloc),
-        U64_PRINTF_ARG(freelists[i].n_free),
-        U64_PRINTF_ARG(freelists[i].n_hit));
-  }
-  log(severity, LD_MM, U64_FORMAT" allocations in non-freelist sizes",
-      U64_PRINTF_ARG(n_freelist_miss));
+        "%d %d-byte chunks in use, in "U64_FORMAT" bytes of %d slabs "
+        "(%d empty) ["U64_FORMAT" allocs; "U64_FORMAT" frees; "
+        U64_FORMAT" slabs returned]",
+        cls->n_in_use, (int)cls->alloc_size,
+        U64_PRINTF_ARG(slab_bytes), n_slabs, n_empty,
+        U64_PRINTF_ARG(cls->n_alloc),
+        U64_PRINTF_ARG(cls->n_free),
+        U64_PRINTF_ARG(cls->n_slabs_freed));
+  }
+  log(severity, LD_MM, U64_FORMAT" allocations in unclassed sizes",
+      U64_PRINTF_ARG(n_unclassed_alloc));
 #else
   (void)severity;
 #endif
 }
 
+/** Return a newly allocated string describing each chunk size class, one
+ * per line, for the controller. */
+char *
+buf_get_chunk_class_stats(void)
+{
+  smartlist_t *lines = smartlist_new();
+  char *result;
+#ifdef ENABLE_BUF_FREELISTS
+  int i;
+  for (i = 0; chunk_classes[i].alloc_size; ++i) {
+    const chunk_class_t *cls = &chunk_classes[i];
+    int n_slabs = 0, n_empty = 0;
+    uint64_t slab_bytes = 0;
+    if (cls->pool)
+      mp_pool_get_usage(cls->pool, &n_slabs, &n_empty, &slab_bytes);
+    smartlist_add_asprintf(lines,
+        "size=%d in-use=%d slabs=%d empty-slabs=%d slab-bytes="U64_FORMAT
+        " allocs="U64_FORMAT" frees="U64_FORMAT" slabs-returned="U64_FORMAT,
+        (int)cls->alloc_size, cls->n_in_use, n_slabs, n_empty,
+        U64_PRINTF_ARG(slab_bytes), U64_PRINTF_ARG(cls->n_alloc),
+        U64_PRINTF_ARG(cls->n_free), U64_PRINTF_ARG(cls->n_slabs_freed));
+  }
+  smartlist_add_asprintf(lines, "unclassed-allocs="U64_FORMAT,
+                         U64_PRINTF_ARG(n_unclassed_alloc));
+#endif
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
+}
+
+/** Set *<b>alloc_size_out</b>, *<b>n_alloc_out</b>, and
+ * *<b>n_slabs_out</b> to the allocation size of the <b>idx</b>'th chunk size
+ * class, the number of chunks we've ever allocated from it, and the number
+ * of slabs we've ever had to allocate for it.  Return 0 on success, or -1
+ * if there is no such class. */
+int
+buf_get_chunk_class_counts(int idx, size_t *alloc_size_out,
+                           uint64_t *n_alloc_out, uint64_t *n_slabs_out)
+{
+#ifdef ENABLE_BUF_FREELISTS
+  const chunk_class_t *cls;
+  int i;
+  for (i = 0; i < idx && chunk_classes[i].alloc_size; ++i)
+    ;
+  if (idx < 0 || !chunk_classes[i].alloc_size)
+    return -1;
+  cls = &chunk_classes[idx];
+  *alloc_size_out = cls->alloc_size;
+  *n_alloc_out = cls->n_alloc;
+  *n_slabs_out = cls->pool ? mp_pool_get_n_chunks_allocated(cls->pool) : 0;
+  return 0;
+#else
+  (void)idx;
+  (void)alloc_size_out;
+  (void)n_alloc_out;
+  (void)n_slabs_out;
+  return -1;
+#endif
+}
+
 /** Magic value for buf_t.magic, to catch pointer errors. */
 #define BUFFER_MAGIC 0xB0FFF312u
 /** A resizeable buffer, optimized for reading and writing. */
@@ -365,6 +542,10 @@ struct buf_t {
   size_t datalen; /**< How many bytes is this buffer holding right now? */
   size_t default_chunk_size; /**< Don't allocate any chunks smaller than
                               * this for this buffer. */
+  /** Weighted average of how many bytes each read onto this buffer has
+   * got, or 0 if we haven't read anything yet.  We use this to size the
+   * chunks we allocate for reading. */
+  size_t read_len_avg;
   chunk_t *head; /**< First chunk in the list, or NULL for none. */
   chunk_t *tail; /**< Last chunk in the list, or NULL for none. */
 };
@@ -375,7 +556,7 @@ struct buf_t {
  *
  * If <b>nulterminate</b> is true, ensure that there is a 0 byte in
  * buf->head->mem right after all the data. */
-static void
+void
 buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
 {
   chunk_t *dest, *src;
@@ -387,6 +568,19 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
   if (buf->datalen < bytes)
     bytes = buf->datalen;
 
+  if ((CHUNK_IS_EXTERNAL(buf->head) || CHUNK_IS_SHARED(buf->head)) &&
+      (nulterminate || buf->head->datalen < bytes)) {
+    /* We're about to modify the first chunk, but we don't own its memory,
+     * or other buffers are looking at it.  Replace it with a copy that we
+     * own outright. */
+    chunk_t *newhead = chunk_copy(buf->head);
+    newhead->next = buf->head->next;
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    chunk_free_unchecked(buf->head);
+    buf->head = newhead;
+  }
+
   if (nulterminate) {
     capacity = bytes + 1;
     if (buf->head->datalen >= bytes && CHUNK_REMAINING_CAPACITY(buf->head)) {
@@ -449,13 +643,75 @@ buf_pullup(buf_t *buf, size_t bytes, int nulterminate)
   check();
 }
 
+/** Return the number of bytes allocated for regular chunks on all
+ * buffers. */
+size_t
+buf_get_total_allocation(void)
+{
+  return total_bytes_allocated_in_chunks;
+}
+
 /** Resize buf so it won't hold extra memory that we haven't been
- * using lately.
+ * using lately: pull the data of each chunk that we own outright into the
+ * one before it when it fits there, drop empty chunks, and move the data
+ * of any chunk that's less than half full onto a smaller chunk.  We leave
+ * external and shared chunks alone, since copying them wouldn't give any
+ * memory back.
  */
 void
 buf_shrink(buf_t *buf)
 {
-  (void)buf;
+  chunk_t **chunkp, *chunk, *next;
+  check();
+
+  buf->tail = NULL;
+  chunkp = &buf->head;
+  while ((chunk = *chunkp)) {
+    if (!CHUNK_IS_EXTERNAL(chunk) && !CHUNK_IS_SHARED(chunk)) {
+      size_t alloc;
+      while ((next = chunk->next) &&
+             !CHUNK_IS_EXTERNAL(next) && !CHUNK_IS_SHARED(next) &&
+             next->datalen <= chunk->memlen - chunk->datalen) {
+        if (CHUNK_REMAINING_CAPACITY(chunk) < next->datalen)
+          chunk_repack(chunk);
+        memcpy(CHUNK_WRITE_PTR(chunk), next->data, next->datalen);
+        chunk->datalen += next->datalen;
+        chunk->next = next->next;
+        chunk_free_unchecked(next);
+      }
+      if (!chunk->datalen) {
+        *chunkp = chunk->next;
+        chunk_free_unchecked(chunk);
+        continue;
+      }
+      alloc = preferred_chunk_size(chunk->datalen);
+      if (alloc < buf->default_chunk_size)
+        alloc = buf->default_chunk_size;
+      if (alloc * 2 <= CHUNK_ALLOC_SIZE(chunk->memlen)) {
+        chunk_t *newch = chunk_new_with_alloc_size(alloc);
+        memcpy(newch->mem, chunk->data, chunk->datalen);
+        newch->datalen = chunk->datalen;
+        newch->next = chunk->next;
+        newch->inserted_time = chunk->inserted_time;
+        chunk_free_unchecked(chunk);
+        *chunkp = chunk = newch;
+      }
+    }
+    buf->tail = chunk;
+    chunkp = &chunk->next;
+  }
+
+  check();
+}
+
+/** Return the time at which the oldest data now on <b>buf</b> was queued,
+ * or <b>now</b> if <b>buf</b> is empty. */
+time_t
+buf_get_oldest_chunk_timestamp(const buf_t *buf, time_t now)
+{
+  if (!buf->head)
+    return now;
+  return buf->head->inserted_time;
 }
 
 /** Remove the first <b>n</b> bytes from buf. */
@@ -558,28 +814,45 @@ buf_free(buf_t *buf)
   tor_free(buf);
 }
 
-/** Return a new copy of <b>in_chunk</b> */
+/** Return a new copy of <b>in_chunk</b>.  The copy of an external chunk
+ * is a regular chunk holding its own copy of the data. */
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
-  chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
-  newch->next = NULL;
+  chunk_t *newch;
+  if (CHUNK_IS_EXTERNAL(in_chunk)) {
+    newch = chunk_new_with_alloc_size(
+                                 preferred_chunk_size(in_chunk->datalen));
+    memcpy(newch->mem, in_chunk->data, in_chunk->datalen);
+    newch->datalen = in_chunk->datalen;
+    newch->inserted_time = in_chunk->inserted_time;
+    return newch;
+  }
+  newch = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(in_chunk->memlen));
   if (in_chunk->data) {
     off_t offset = in_chunk->data - in_chunk->mem;
     newch->data = newch->mem + offset;
+    memcpy(newch->data, in_chunk->data, in_chunk->datalen);
   }
+  newch->datalen = in_chunk->datalen;
+  newch->inserted_time = in_chunk->inserted_time;
   return newch;
 }
 
-/** Return a new copy of <b>buf</b> */
+/** Return a new copy of <b>buf</b>.  Where we can, the copy shares chunk
+ * memory with <b>buf</b> rather than duplicating it. */
 buf_t *
 buf_copy(const buf_t *buf)
 {
   chunk_t *ch;
   buf_t *out = buf_new();
   out->default_chunk_size = buf->default_chunk_size;
+  out->read_len_avg = buf->read_len_avg;
   for (ch = buf->head; ch; ch = ch->next) {
-    chunk_t *newch = chunk_copy(ch);
+    /* Sharing only changes reference counts, not anything buf can see. */
+    chunk_t *newch = chunk_share((chunk_t*)ch, ch->datalen);
+    if (!newch)
+      newch = chunk_copy(ch);
     if (out->tail) {
       out->tail->next = newch;
       out->tail = newch;
@@ -591,20 +864,27 @@ buf_copy(const buf_t *buf)
   return out;
 }
 
-/** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
- * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
- * than MAX_CHUNK_ALLOC. */
+/** Return a new chunk, not yet on any buffer, suitable for holding
+ * <b>capacity</b> bytes at the end of <b>buf</b>.  If <b>capped</b>, don't
+ * allocate a chunk bigger than MAX_CHUNK_ALLOC. */
 static chunk_t *
-buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+buf_new_chunk_with_capacity(const buf_t *buf, size_t capacity, int capped)
 {
-  chunk_t *chunk;
   if (CHUNK_ALLOC_SIZE(capacity) < buf->default_chunk_size) {
-    chunk = chunk_new_with_alloc_size(buf->default_chunk_size);
+    return chunk_new_with_alloc_size(buf->default_chunk_size);
   } else if (capped && CHUNK_ALLOC_SIZE(capacity) > MAX_CHUNK_ALLOC) {
-    chunk = chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
+    return chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
   } else {
-    chunk = chunk_new_with_alloc_size(preferred_chunk_size(capacity));
+    return chunk_new_with_alloc_size(preferred_chunk_size(capacity));
   }
+}
+
+/** Link <b>chunk</b>, which must not be on any buffer, onto the tail of
+ * <b>buf</b>.  The caller is responsible for adjusting buf->datalen. */
+static INLINE void
+buf_append_chunk(buf_t *buf, chunk_t *chunk)
+{
+  chunk->next = NULL;
   if (buf->tail) {
     tor_assert(buf->head);
     buf->tail->next = chunk;
@@ -614,9 +894,106 @@ buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
     buf->head = buf->tail = chunk;
   }
   check();
+}
+
+/** Append a new chunk with enough capacity to hold <b>capacity</b> bytes to
+ * the tail of <b>buf</b>.  If <b>capped</b>, don't allocate a chunk bigger
+ * than MAX_CHUNK_ALLOC. */
+static chunk_t *
+buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped)
+{
+  chunk_t *chunk = buf_new_chunk_with_capacity(buf, capacity, capped);
+  buf_append_chunk(buf, chunk);
   return chunk;
 }
 
+/** Don't size read chunks for fewer than this many bytes. */
+#define MIN_READ_CHUNK_CAPACITY 512
+
+/** Record that a read onto <b>buf</b> just got <b>n</b> bytes. */
+static INLINE void
+buf_note_read(buf_t *buf, size_t n)
+{
+  if (!n)
+    return;
+  if (!buf->read_len_avg)
+    buf->read_len_avg = n;
+  else
+    buf->read_len_avg = (buf->read_len_avg * 7 + n) / 8;
+}
+
+/** Return a new chunk, not yet on any buffer, to read up to <b>at_most</b>
+ * bytes into at the end of <b>buf</b>.  Once we've seen a few reads, size
+ * the chunk for about twice what a read usually gets, so that connections
+ * that trickle data in don't tie up large mostly-empty chunks. */
+static chunk_t *
+buf_new_read_chunk(const buf_t *buf, size_t at_most)
+{
+  size_t target;
+  if (!buf->read_len_avg)
+    return buf_new_chunk_with_capacity(buf, at_most, 1);
+  target = buf->read_len_avg * 2;
+  if (target < MIN_READ_CHUNK_CAPACITY)
+    target = MIN_READ_CHUNK_CAPACITY;
+  if (target > at_most)
+    target = at_most;
+  if (CHUNK_ALLOC_SIZE(target) > MAX_CHUNK_ALLOC)
+    return chunk_new_with_alloc_size(MAX_CHUNK_ALLOC);
+  return chunk_new_with_alloc_size(preferred_chunk_size(target));
+}
+
+#ifdef USE_VECTORED_IO
+/** Largest number of chunks we'll offer to a single readv() or writev()
+ * call. */
+#define BUF_MAX_IOVECS 16
+
+#ifdef _WIN32
+typedef WSABUF buf_iovec_t;
+#define BUF_IOVEC_SET(iov, ptr, n)                 \
+  STMT_BEGIN                                       \
+    (iov)->buf = (ptr);                            \
+    (iov)->len = (ULONG)(n);                       \
+  STMT_END
+#else
+typedef struct iovec buf_iovec_t;
+#define BUF_IOVEC_SET(iov, ptr, n)                 \
+  STMT_BEGIN                                       \
+    (iov)->iov_base = (ptr);                       \
+    (iov)->iov_len = (n);                          \
+  STMT_END
+#endif
+
+/** Read from <b>s</b> into the <b>n_iov</b> regions of <b>iov</b>, in
+ * order.  Behaves as tor_socket_recv(). */
+static INLINE ssize_t
+tor_socket_readv(tor_socket_t s, buf_iovec_t *iov, int n_iov)
+{
+#ifdef _WIN32
+  DWORD n_read = 0, flags = 0;
+  if (WSARecv(s, iov, (DWORD)n_iov, &n_read, &flags, NULL, NULL))
+    return -1;
+  return (ssize_t)n_read;
+#else
+  return readv(s, iov, n_iov);
+#endif
+}
+
+/** Write the <b>n_iov</b> regions of <b>iov</b>, in order, onto <b>s</b>.
+ * Behaves as tor_socket_send(). */
+static INLINE ssize_t
+tor_socket_writev(tor_socket_t s, buf_iovec_t *iov, int n_iov)
+{
+#ifdef _WIN32
+  DWORD n_written = 0;
+  if (WSASend(s, iov, (DWORD)n_iov, &n_written, 0, NULL, NULL))
+    return -1;
+  return (ssize_t)n_written;
+#else
+  return writev(s, iov, n_iov);
+#endif
+}
+#endif
+
 /** Read up to <b>at_most</b> bytes from the socket <b>fd</b> into
  * <b>chunk</b> (which must be on <b>buf</b>). If we get an EOF, set
  * *<b>reached_eof</b> to 1.  Return -1 on error, 0 on eof or blocking,
@@ -685,6 +1062,95 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
   /* XXXX024 It's stupid to overload the return values for these functions:
    * "error status" and "number of bytes read" are not mutually exclusive.
    */
+#ifdef USE_VECTORED_IO
+  buf_iovec_t iov[BUF_MAX_IOVECS];
+  chunk_t *fresh[BUF_MAX_IOVECS];
+  size_t tail_len = 0, offered = 0, remaining;
+  int n_iov = 0, n_fresh = 0, i;
+  ssize_t read_result;
+
+  check();
+  tor_assert(reached_eof);
+  tor_assert(SOCKET_OK(s));
+
+  if (!at_most)
+    return 0;
+
+  /* Offer whatever room is left in the tail first, then as many new
+   * chunks as it takes to cover <b>at_most</b>.  The new chunks stay off
+   * the buffer until we know they got some data. */
+  if (buf->tail && CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN) {
+    tail_len = CHUNK_REMAINING_CAPACITY(buf->tail);
+    if (tail_len > at_most)
+      tail_len = at_most;
+    BUF_IOVEC_SET(&iov[n_iov], CHUNK_WRITE_PTR(buf->tail), tail_len);
+    ++n_iov;
+    offered = tail_len;
+  }
+  while (offered < at_most && n_iov < BUF_MAX_IOVECS) {
+    size_t len = at_most - offered;
+    /* Size the first new chunk for a typical read; if there's more than
+     * that waiting, the chunks after it can catch the rest. */
+    chunk_t *chunk = n_fresh ? buf_new_chunk_with_capacity(buf, len, 1)
+                             : buf_new_read_chunk(buf, len);
+    if (len > chunk->memlen)
+      len = chunk->memlen;
+    fresh[n_fresh++] = chunk;
+    BUF_IOVEC_SET(&iov[n_iov], CHUNK_WRITE_PTR(chunk), len);
+    ++n_iov;
+    offered += len;
+  }
+
+  read_result = tor_socket_readv(s, iov, n_iov);
+
+  if (read_result <= 0) {
+    for (i = 0; i < n_fresh; ++i)
+      chunk_free_unchecked(fresh[i]);
+    if (read_result < 0) {
+      int e = tor_socket_errno(s);
+      if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+#ifdef _WIN32
+        if (e == WSAENOBUFS)
+          log_warn(LD_NET,"recv() failed: WSAENOBUFS. Not enough ram?");
+#endif
+        *socket_error = e;
+        return -1;
+      }
+      return 0; /* would block. */
+    }
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)s);
+    *reached_eof = 1;
+    return 0;
+  }
+
+  /* Actually got bytes: hand them out to the regions in order, and throw
+   * away any new chunks that we didn't reach. */
+  remaining = (size_t)read_result;
+  if (tail_len) {
+    size_t n = remaining < tail_len ? remaining : tail_len;
+    buf->tail->datalen += n;
+    remaining -= n;
+  }
+  for (i = 0; i < n_fresh; ++i) {
+    chunk_t *chunk = fresh[i];
+    if (remaining) {
+      size_t n = remaining < chunk->memlen ? remaining : chunk->memlen;
+      chunk->datalen = n;
+      remaining -= n;
+      buf_append_chunk(buf, chunk);
+    } else {
+      chunk_free_unchecked(chunk);
+    }
+  }
+  tor_assert(remaining == 0);
+  buf->datalen += read_result;
+  buf_note_read(buf, (size_t)read_result);
+  check();
+  log_debug(LD_NET,"Read %ld bytes. %d on inbuf.", (long)read_result,
+            (int)buf->datalen);
+  tor_assert(read_result < INT_MAX);
+  return (int)read_result;
+#else
   int r = 0;
   size_t total_read = 0;
 
@@ -696,7 +1162,8 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+      chunk = buf_new_read_chunk(buf, readlen);
+      buf_append_chunk(buf, chunk);
       if (readlen > chunk->memlen)
         readlen = chunk->memlen;
     } else {
@@ -716,7 +1183,9 @@ read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
       break;
     }
   }
+  buf_note_read(buf, total_read);
   return (int)total_read;
+#endif
 }
 
 /** As read_to_buf, but reads from a TLS connection, and returns a TLS
@@ -753,7 +1222,8 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
-      chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
+      chunk = buf_new_read_chunk(buf, readlen);
+      buf_append_chunk(buf, chunk);
       if (readlen > chunk->memlen)
         readlen = chunk->memlen;
     } else {
@@ -772,6 +1242,7 @@ read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf)
     if ((size_t)r < readlen) /* eof, block, or no more to read. */
       break;
   }
+  buf_note_read(buf, total_read);
   return (int)total_read;
 }
 
@@ -858,6 +1329,60 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   /* XXXX024 It's stupid to overload the return values for these functions:
    * "error status" and "number of bytes flushed" are not mutually exclusive.
    */
+#ifdef USE_VECTORED_IO
+  buf_iovec_t iov[BUF_MAX_IOVECS];
+  size_t flushed = 0;
+  tor_assert(buf_flushlen);
+  tor_assert(SOCKET_OK(s));
+  tor_assert(*buf_flushlen <= buf->datalen);
+  tor_assert(sz <= *buf_flushlen);
+
+  check();
+  while (sz) {
+    size_t offered = 0;
+    int n_iov = 0;
+    ssize_t write_result;
+    chunk_t *chunk;
+
+    tor_assert(buf->head);
+    for (chunk = buf->head; chunk && offered < sz && n_iov < BUF_MAX_IOVECS;
+         chunk = chunk->next) {
+      size_t len = chunk->datalen;
+      if (!len)
+        continue;
+      if (len > sz - offered)
+        len = sz - offered;
+      BUF_IOVEC_SET(&iov[n_iov], chunk->data, len);
+      ++n_iov;
+      offered += len;
+    }
+    tor_assert(offered);
+
+    write_result = tor_socket_writev(s, iov, n_iov);
+
+    if (write_result < 0) {
+      int e = tor_socket_errno(s);
+      if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+#ifdef _WIN32
+        if (e == WSAENOBUFS)
+          log_warn(LD_NET,"write() failed: WSAENOBUFS. Not enough ram?");
+#endif
+        return -1;
+      }
+      log_debug(LD_NET,"write() would block, returning.");
+      break;
+    }
+    *buf_flushlen -= write_result;
+    buf_remove_from_front(buf, write_result);
+    check();
+    flushed += write_result;
+    sz -= write_result;
+    if ((size_t)write_result < offered) /* can't flush any more now. */
+      break;
+  }
+  tor_assert(flushed < INT_MAX);
+  return (int)flushed;
+#else
   int r;
   size_t flushed = 0;
   tor_assert(buf_flushlen);
@@ -885,14 +1410,19 @@ flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen)
   }
   tor_assert(flushed < INT_MAX);
   return (int)flushed;
+#endif
 }
 
 /** As flush_buf(), but writes data to a TLS connection.  Can write more than
  * <b>flushlen</b> bytes.
+ *
+ * If <b>record_size</b> is nonzero, gather up to that many bytes from the
+ * front of <b>buf</b> into one chunk before each write, so that they go out
+ * in a single TLS record rather than one record per chunk.
  */
 int
 flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
-              size_t *buf_flushlen)
+              size_t *buf_flushlen, size_t record_size)
 {
   int r;
   size_t flushed = 0;
@@ -909,6 +1439,11 @@ flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t flushlen,
   check();
   do {
     size_t flushlen0;
+    if (buf->head && buf->head->next && buf->head->datalen < record_size &&
+        (ssize_t)buf->head->datalen < sz) {
+      buf_pullup(buf, MIN(record_size, (size_t)sz), 0);
+      check();
+    }
     if (buf->head) {
       if ((ssize_t)buf->head->datalen >= sz)
         flushlen0 = sz;
@@ -963,6 +1498,51 @@ write_to_buf(const char *string, size_t string_len, buf_t *buf)
   return (int)buf->datalen;
 }
 
+/** Append <b>string_len</b> bytes from <b>string</b> to the end of
+ * <b>buf</b> without copying them: the buffer keeps a reference to
+ * <b>string</b>, which must stay valid and unchanged until we call
+ * <b>release_fn</b>(<b>release_arg</b>).
+ *
+ * We call <b>release_fn</b> exactly once for every call to this function.
+ * If <b>string</b> directly follows the data of an external chunk at the
+ * end of <b>buf</b> with the same <b>release_fn</b> and
+ * <b>release_arg</b>, we extend that chunk and release the new reference
+ * right away, so <b>release_arg</b> should be reference-counted.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+write_to_buf_external(const char *string, size_t string_len,
+                      void (*release_fn)(void *), void *release_arg,
+                      buf_t *buf)
+{
+  chunk_t *tail = buf->tail;
+  tor_assert(release_fn);
+  check();
+
+  if (tail && CHUNK_IS_EXTERNAL(tail) &&
+      tail->release_fn == release_fn && tail->release_arg == release_arg &&
+      tail->data + tail->datalen == string) {
+    tail->datalen += string_len;
+    release_fn(release_arg);
+  } else {
+    chunk_t *chunk = chunk_external_new(string, string_len,
+                                        release_fn, release_arg);
+    if (tail) {
+      tail->next = chunk;
+    } else {
+      tor_assert(!buf->head);
+      buf->head = chunk;
+    }
+    buf->tail = chunk;
+  }
+  buf->datalen += string_len;
+
+  check();
+  tor_assert(buf->datalen < INT_MAX);
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -1076,6 +1656,32 @@ fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto)
   return 1;
 }
 
+/** Check <b>buf</b> for a whole fixed-length cell.  If there is one,
+ * unpack it into <b>out</b>, remove it from <b>buf</b>, and return 1.
+ * Otherwise return 0.  The caller must already have made sure that the
+ * cell at the front of <b>buf</b> isn't a variable-length one.
+ *
+ * When the cell doesn't straddle a chunk boundary, we unpack it straight
+ * out of the chunk, so its payload only gets copied once. */
+int
+fetch_cell_from_buf(buf_t *buf, cell_t *out)
+{
+  char tmp[CELL_NETWORK_SIZE];
+  check();
+  if (buf->datalen < CELL_NETWORK_SIZE)
+    return 0;
+
+  if (PREDICT_LIKELY(buf->head->datalen >= CELL_NETWORK_SIZE)) {
+    cell_unpack(out, buf->head->data);
+  } else {
+    peek_from_buf(tmp, sizeof(tmp), buf);
+    cell_unpack(out, tmp);
+  }
+  buf_remove_from_front(buf, CELL_NETWORK_SIZE);
+  check();
+  return 1;
+}
+
 #ifdef USE_BUFFEREVENTS
 /** Try to read <b>n</b> bytes from <b>buf</b> at <b>pos</b> (which may be
  * NULL for the start of the buffer), copying the data only if necessary.  Set
@@ -1113,6 +1719,21 @@ inspect_evbuffer(struct evbuffer *buf, char **data_out, size_t n,
   }
 }
 
+/** As fetch_cell_from_buf, but works on an evbuffer. */
+int
+fetch_cell_from_evbuffer(struct evbuffer *buf, cell_t *out)
+{
+  char *data;
+  if (evbuffer_get_length(buf) < CELL_NETWORK_SIZE)
+    return 0;
+  /* This only moves data around if the cell straddles two chains. */
+  data = (char*)evbuffer_pullup(buf, CELL_NETWORK_SIZE);
+  tor_assert(data);
+  cell_unpack(out, data);
+  evbuffer_drain(buf, CELL_NETWORK_SIZE);
+  return 1;
+}
+
 /** As fetch_var_cell_from_buf, buf works on an evbuffer. */
 int
 fetch_var_cell_from_evbuffer(struct evbuffer *buf, var_cell_t **out,
@@ -1161,15 +1782,21 @@ fetch_var_cell_from_evbuffer(struct evbuffer *buf, var_cell_t **out,
 }
 #endif
 
+/** When moving data between buffers, copy runs shorter than this many bytes
+ * instead of splicing or sharing their chunks, so that we don't fill
+ * <b>buf_out</b> with tiny chunks. */
+#define MIN_SPLICE_LEN 512
+
 /** Move up to *<b>buf_flushlen</b> bytes from <b>buf_in</b> to
  * <b>buf_out</b>, and modify *<b>buf_flushlen</b> appropriately.
  * Return the number of bytes actually copied.
+ *
+ * Whole chunks move from one buffer to the other without copying; if we
+ * stop partway through a chunk, the two buffers share it.
  */
 int
 move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
-  char b[4096];
   size_t cp, len;
   len = *buf_flushlen;
   if (len > buf_in->datalen)
@@ -1178,14 +1805,42 @@ move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
   cp = len; /* Remember the number of bytes we intend to copy. */
   tor_assert(cp < INT_MAX);
   while (len) {
-    /* This isn't the most efficient implementation one could imagine, since
-     * it does two copies instead of 1, but I kinda doubt that this will be
-     * critical path. */
-    size_t n = len > sizeof(b) ? sizeof(b) : len;
-    fetch_from_buf(b, n, buf_in);
-    write_to_buf(b, n, buf_out);
+    chunk_t *chunk = buf_in->head;
+    size_t n;
+    tor_assert(chunk);
+    if (!chunk->datalen) {
+      /* An empty chunk left over from a read that got nothing. */
+      buf_in->head = chunk->next;
+      if (buf_in->tail == chunk)
+        buf_in->tail = NULL;
+      chunk_free_unchecked(chunk);
+      continue;
+    }
+    n = chunk->datalen < len ? chunk->datalen : len;
+    if (n < MIN_SPLICE_LEN) {
+      write_to_buf(chunk->data, n, buf_out);
+      buf_remove_from_front(buf_in, n);
+    } else if (n == chunk->datalen) {
+      /* Take the whole chunk. */
+      buf_in->head = chunk->next;
+      if (buf_in->tail == chunk)
+        buf_in->tail = NULL;
+      buf_in->datalen -= n;
+      buf_append_chunk(buf_out, chunk);
+      buf_out->datalen += n;
+    } else {
+      chunk_t *shared = chunk_share(chunk, n);
+      if (shared) {
+        buf_append_chunk(buf_out, shared);
+        buf_out->datalen += n;
+      } else {
+        write_to_buf(chunk->data, n, buf_out);
+      }
+      buf_remove_from_front(buf_in, n);
+    }
     len -= n;
   }
+  check();
   *buf_flushlen -= cp;
   return (int)cp;
 }
@@ -1197,104 +1852,77 @@ typedef struct buf_pos_t {
   size_t chunk_pos; /**< Total length of all previous chunks. */
 } buf_pos_t;
 
-/** Initialize <b>out</b> to point to the first character of <b>buf</b>.*/
-static void
-buf_pos_init(const buf_t *buf, buf_pos_t *out)
-{
-  out->chunk = buf->head;
-  out->pos = 0;
-  out->chunk_pos = 0;
-}
-
-/** Advance <b>out</b> to the first appearance of <b>ch</b> at the current
- * position of <b>out</b>, or later.  Return -1 if no instances are found;
- * otherwise returns the absolute position of the character. */
-static off_t
-buf_find_pos_of_char(char ch, buf_pos_t *out)
-{
-  const chunk_t *chunk;
-  int pos;
-  tor_assert(out);
-  if (out->chunk) {
-    if (out->chunk->datalen) {
-      tor_assert(out->pos < (off_t)out->chunk->datalen);
-    } else {
-      tor_assert(out->pos == 0);
-    }
-  }
-  pos = out->pos;
-  for (chunk = out->chunk; chunk; chunk = chunk->next) {
-    char *cp = memchr(chunk->data+pos, ch, chunk->datalen - pos);
-    if (cp) {
-      out->chunk = chunk;
-      tor_assert(cp - chunk->data < INT_MAX);
-      out->pos = (int)(cp - chunk->data);
-      return out->chunk_pos + out->pos;
-    } else {
-      out->chunk_pos += chunk->datalen;
-      pos = 0;
-    }
-  }
-  return -1;
-}
-
-/** Advance <b>pos</b> by a single character, if there are any more characters
- * in the buffer.  Returns 0 on success, -1 on failure. */
-static INLINE int
-buf_pos_inc(buf_pos_t *pos)
-{
-  ++pos->pos;
-  if (pos->pos == (off_t)pos->chunk->datalen) {
-    if (!pos->chunk->next)
-      return -1;
-    pos->chunk_pos += pos->chunk->datalen;
-    pos->chunk = pos->chunk->next;
-    pos->pos = 0;
-  }
-  return 0;
-}
-
 /** Return true iff the <b>n</b>-character string in <b>s</b> appears
- * (verbatim) at <b>pos</b>. */
+ * (verbatim) at <b>pos</b>.  The string may run across several chunks; we
+ * compare as much of it as each chunk holds at once. */
 static int
 buf_matches_at_pos(const buf_pos_t *pos, const char *s, size_t n)
 {
-  buf_pos_t p;
-  if (!n)
-    return 1;
-
-  memcpy(&p, pos, sizeof(p));
+  const chunk_t *chunk = pos->chunk;
+  size_t off = pos->pos;
 
-  while (1) {
-    char ch = p.chunk->data[p.pos];
-    if (ch != *s)
+  while (n) {
+    size_t avail;
+    if (!chunk)
       return 0;
-    ++s;
-    /* If we're out of characters that don't match, we match.  Check this
-     * _before_ we test incrementing pos, in case we're at the end of the
-     * string. */
-    if (--n == 0)
-      return 1;
-    if (buf_pos_inc(&p)<0)
+    tor_assert(off <= chunk->datalen);
+    avail = chunk->datalen - off;
+    if (avail > n)
+      avail = n;
+    if (memcmp(chunk->data + off, s, avail))
       return 0;
+    s += avail;
+    n -= avail;
+    chunk = chunk->next;
+    off = 0;
   }
+  return 1;
 }
 
 /** Return the first position in <b>buf</b> at which the <b>n</b>-character
- * string <b>s</b> occurs, or -1 if it does not occur. */
+ * string <b>s</b> occurs, or -1 if it does not occur.
+ *
+ * We search each chunk as a whole with tor_memmem(), which the C library
+ * can do much faster than we could byte by byte, and only fall back to
+ * comparing across chunk boundaries for the last few bytes of each chunk.
+ */
 /*private*/ int
 buf_find_string_offset(const buf_t *buf, const char *s, size_t n)
 {
-  buf_pos_t pos;
-  buf_pos_init(buf, &pos);
-  while (buf_find_pos_of_char(*s, &pos) >= 0) {
-    if (buf_matches_at_pos(&pos, s, n)) {
-      tor_assert(pos.chunk_pos + pos.pos < INT_MAX);
-      return (int)(pos.chunk_pos + pos.pos);
-    } else {
-      if (buf_pos_inc(&pos)<0)
-        return -1;
+  const chunk_t *chunk;
+  size_t chunk_pos = 0;
+  tor_assert(n);
+
+  for (chunk = buf->head; chunk; chunk = chunk->next) {
+    size_t start = 0;
+    if (chunk->datalen >= n) {
+      const char *cp = tor_memmem(chunk->data, chunk->datalen, s, n);
+      if (cp) {
+        tor_assert(chunk_pos + (cp - chunk->data) < INT_MAX);
+        return (int)(chunk_pos + (cp - chunk->data));
+      }
+      start = chunk->datalen - n + 1;
     }
+    /* Any other match must start near the end of this chunk and run into
+     * the next one. */
+    if (chunk->next) {
+      while (start < chunk->datalen) {
+        buf_pos_t pos;
+        const char *cp = memchr(chunk->data + start, *s,
+                                chunk->datalen - start);
+        if (!cp)
+          break;
+        pos.chunk = chunk;
+        pos.pos = (int)(cp - chunk->data);
+        pos.chunk_pos = chunk_pos;
+        if (buf_matches_at_pos(&pos, s, n)) {
+          tor_assert(chunk_pos + pos.pos < INT_MAX);
+          return (int)(chunk_pos + pos.pos);
+        }
+        start = pos.pos + 1;
+      }
+    }
+    chunk_pos += chunk->datalen;
   }
   return -1;
 }
@@ -1324,7 +1952,8 @@ fetch_from_buf_http(buf_t *buf,
                     char **body_out, size_t *body_used, size_t max_bodylen,
                     int force_complete)
 {
-  char *headers, *p;
+  const char *headers, *p;
+  char *headers_copy = NULL;
   size_t headerlen, bodylen, contentlen;
   int crlf_offset;
 
@@ -1341,35 +1970,44 @@ fetch_from_buf_http(buf_t *buf,
     log_debug(LD_HTTP,"headers not all here yet.");
     return 0;
   }
-  /* Okay, we have a full header.  Make sure it all appears in the first
-   * chunk. */
-  if ((int)buf->head->datalen < crlf_offset + 4)
-    buf_pullup(buf, crlf_offset+4, 0);
+  /* Okay, we have a full header.  If it all appears in the first chunk, we
+   * can look at it there; otherwise, copy it out of the chunks it spans
+   * rather than packing them together. */
   headerlen = crlf_offset + 4;
+  if (buf->head->datalen >= headerlen) {
+    headers = buf->head->data;
+  } else {
+    headers_copy = tor_malloc(headerlen+1);
+    peek_from_buf(headers_copy, headerlen, buf);
+    headers_copy[headerlen] = 0; /* NUL terminate it */
+    headers = headers_copy;
+  }
 
-  headers = buf->head->data;
   bodylen = buf->datalen - headerlen;
   log_debug(LD_HTTP,"headerlen %d, bodylen %d.", (int)headerlen, (int)bodylen);
 
   if (max_headerlen <= headerlen) {
     log_warn(LD_HTTP,"headerlen %d larger than %d. Failing.",
              (int)headerlen, (int)max_headerlen-1);
+    tor_free(headers_copy);
     return -1;
   }
   if (max_bodylen <= bodylen) {
     log_warn(LD_HTTP,"bodylen %d larger than %d. Failing.",
              (int)bodylen, (int)max_bodylen-1);
+    tor_free(headers_copy);
     return -1;
   }
 
 #define CONTENT_LENGTH "\r\nContent-Length: "
-  p = (char*) tor_memstr(headers, headerlen, CONTENT_LENGTH);
+  p = tor_memstr(headers, headerlen, CONTENT_LENGTH);
   if (p) {
     int i;
     i = atoi(p+strlen(CONTENT_LENGTH));
     if (i < 0) {
       log_warn(LD_PROTOCOL, "Content-Length is less than zero; it looks like "
                "someone is trying to crash us.");
+      tor_free(headers_copy);
       return -1;
     }
     contentlen = i;
@@ -1378,6 +2016,7 @@ fetch_from_buf_http(buf_t *buf,
     if (bodylen < contentlen) {
       if (!force_complete) {
         log_debug(LD_HTTP,"body not all here yet.");
+        tor_free(headers_copy);
         return 0; /* not all there yet */
       }
     }
@@ -1387,10 +2026,15 @@ fetch_from_buf_http(buf_t *buf,
     }
   }
   /* all happy. copy into the appropriate places, and return 1 */
-  if (headers_out) {
+  if (headers_out && headers_copy) {
+    *headers_out = headers_copy;
+    buf_remove_from_front(buf, headerlen);
+  } else if (headers_out) {
     *headers_out = tor_malloc(headerlen+1);
     fetch_from_buf(*headers_out, headerlen, buf);
     (*headers_out)[headerlen] = 0; /* NUL terminate it */
+  } else {
+    tor_free(headers_copy);
   }
   if (body_out) {
     tor_assert(body_used);
@@ -1539,20 +2183,56 @@ socks_request_new(void)
   return tor_malloc_zero(sizeof(socks_request_t));
 }
 
-/** Free all storage held in the socks_request_t <b>req</b>. */
+/** Return a copy of the <b>len</b> bytes at <b>src</b>, to use as a
+ * username or password on <b>req</b>.  The copy goes into the free part of
+ * req->auth_arena if it fits there; otherwise we allocate it. */
+static char *
+socks_request_store_auth(socks_request_t *req, const char *src, size_t len)
+{
+  char *cp;
+  if (len > sizeof(req->auth_arena) - req->auth_arena_used)
+    return tor_memdup(src, len);
+  cp = req->auth_arena + req->auth_arena_used;
+  memcpy(cp, src, len);
+  req->auth_arena_used += len;
+  return cp;
+}
+
+/** Overwrite the <b>len</b> bytes at <b>cp</b>, a username or password on
+ * <b>req</b>, with <b>junk</b>, and free them unless they live in
+ * req->auth_arena. */
+static void
+socks_request_wipe_auth(socks_request_t *req, char *cp, size_t len,
+                        char junk)
+{
+  memset(cp, junk, len);
+  if (cp < req->auth_arena || cp >= req->auth_arena + sizeof(req->auth_arena))
+    tor_free(cp);
+}
+
+/** Wipe and release the username and password on <b>req</b>, if any. */
 void
-socks_request_free(socks_request_t *req)
+socks_request_clear_auth(socks_request_t *req)
 {
-  if (!req)
-    return;
   if (req->username) {
-    memset(req->username, 0x10, req->usernamelen);
-    tor_free(req->username);
+    socks_request_wipe_auth(req, req->username, req->usernamelen, 0x10);
+    req->username = NULL;
   }
   if (req->password) {
-    memset(req->password, 0x04, req->passwordlen);
-    tor_free(req->password);
+    socks_request_wipe_auth(req, req->password, req->passwordlen, 0x04);
+    req->password = NULL;
   }
+  req->usernamelen = req->passwordlen = 0;
+  req->auth_arena_used = 0;
+}
+
+/** Free all storage held in the socks_request_t <b>req</b>. */
+void
+socks_request_free(socks_request_t *req)
+{
+  if (!req)
+    return;
+  socks_request_clear_auth(req);
   memset(req, 0xCC, sizeof(socks_request_t));
   tor_free(req);
 }
@@ -1588,11 +2268,14 @@ fetch_from_buf_socks(buf_t *buf, socks_request_t *req,
 {
   int res;
   ssize_t n_drain;
-  size_t want_length = 128;
+  size_t want_length = 2;
 
   if (buf->datalen < 2) /* version and another byte */
     return 0;
 
+  /* Parse straight out of the first chunk; we only pull up when
+   * parse_socks() tells us that it needs more bytes than that chunk has.
+   * Requests nearly always arrive in a single read, so we nearly never do. */
   do {
     n_drain = 0;
     buf_pullup(buf, want_length, 0);
@@ -1747,11 +2430,12 @@ parse_socks(const char *data, size_t datalen, socks_request_t *req,
       log_debug(LD_APP,
                "socks5: Accepted username/password without checking.");
       if (usernamelen) {
-        req->username = tor_memdup(data+2u, usernamelen);
+        req->username = socks_request_store_auth(req, data+2u, usernamelen);
         req->usernamelen = usernamelen;
       }
       if (passlen) {
-        req->password = tor_memdup(data+3u+usernamelen, passlen);
+        req->password = socks_request_store_auth(req, data+3u+usernamelen,
+                                                 passlen);
         req->passwordlen = passlen;
       }
       *drain_out = 2u + usernamelen + 1u + passlen;
@@ -2014,7 +2698,8 @@ parse_socks(const char *data, size_t datalen, socks_request_t *req,
       if (authend != authstart) {
         req->got_auth = 1;
         req->usernamelen = authend - authstart;
-        req->username = tor_memdup(authstart, authend - authstart);
+        req->username = socks_request_store_auth(req, authstart,
+                                                 authend - authstart);
       }
       /* next points to the final \0 on inbuf */
       *drain_out = next - data + 1;
@@ -2024,7 +2709,7 @@ parse_socks(const char *data, size_t datalen, socks_request_t *req,
     case 'H': /* head */
     case 'P': /* put/post */
     case 'C': /* connect */
-      strlcpy((char*)req->reply,
+      req->long_reply =
 "HTTP/1.0 501 Tor is not an HTTP Proxy\r\n"
 "Content-Type: text/html; charset=iso-8859-1\r\n\r\n"
 "<html>\n"
@@ -2048,9 +2733,8 @@ parse_socks(const char *data, size_t datalen, socks_request_t *req,
 "     comment comment comment comment comment comment comment comment.-->\n"
 "</p>\n"
 "</body>\n"
-"</html>\n"
-             , MAX_SOCKS_REPLY_LEN);
-      req->replylen = strlen((char*)req->reply)+1;
+"</html>\n";
+      req->replylen = strlen(req->long_reply)+1;
       /* fall through */
     default: /* version is not socks4 or socks5 */
       log_warn(LD_APP,
@@ -2480,34 +3164,21 @@ assert_buf_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (!ch->next)
+        tor_assert(ch == buf->tail);
+      if (CHUNK_IS_EXTERNAL(ch)) {
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->data);
+        continue;
+      }
+      tor_assert(ch->refcnt >= 1);
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data < &ch->mem[0]+ch->memlen);
       tor_assert(ch->data+ch->datalen <= &ch->mem[0] + ch->memlen);
-      if (!ch->next)
-        tor_assert(ch == buf->tail);
     }
     tor_assert(buf->datalen == total);
   }
 }
 
-#ifdef ENABLE_BUF_FREELISTS
-/** Log an error and exit if <b>fl</b> is corrupted.
- */
-static void
-assert_freelist_ok(chunk_freelist_t *fl)
-{
-  chunk_t *ch;
-  int n;
-  tor_assert(fl->alloc_size > 0);
-  n = 0;
-  for (ch = fl->head; ch; ch = ch->next) {
-    tor_assert(CHUNK_ALLOC_SIZE(ch->memlen) == fl->alloc_size);
-    ++n;
-  }
-  tor_assert(n == fl->cur_length);
-  tor_assert(n >= fl->lowest_length);
-  tor_assert(n <= fl->max_length);
-}
-#endif
 
@@ -18,8 +18,11 @@ void buf_free(buf_t *buf);
 void buf_clear(buf_t *buf);
 buf_t *buf_copy(const buf_t *buf);
 void buf_shrink(buf_t *buf);
+size_t buf_get_total_allocation(void);
+time_t buf_get_oldest_chunk_timestamp(const buf_t *buf, time_t now);
 void buf_shrink_freelists(int free_all);
 void buf_dump_freelist_sizes(int severity);
+char *buf_get_chunk_class_stats(void);
 
 size_t buf_datalen(const buf_t *buf);
 size_t buf_allocation(const buf_t *buf);
@@ -30,20 +33,26 @@ int read_to_buf(tor_socket_t s, size_t at_most, buf_t *buf, int *reached_eof,
 int read_to_buf_tls(tor_tls_t *tls, size_t at_most, buf_t *buf);
 
 int flush_buf(tor_socket_t s, buf_t *buf, size_t sz, size_t *buf_flushlen);
-int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen);
+int flush_buf_tls(tor_tls_t *tls, buf_t *buf, size_t sz, size_t *buf_flushlen,
+                  size_t record_size);
 
 int write_to_buf(const char *string, size_t string_len, buf_t *buf);
+int write_to_buf_external(const char *string, size_t string_len,
+                          void (*release_fn)(void *), void *release_arg,
+                          buf_t *buf);
 int write_to_buf_zlib(buf_t *buf, tor_zlib_state_t *state,
                       const char *data, size_t data_len, int done);
 int move_buf_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
 int fetch_from_buf(char *string, size_t string_len, buf_t *buf);
 int fetch_var_cell_from_buf(buf_t *buf, var_cell_t **out, int linkproto);
+int fetch_cell_from_buf(buf_t *buf, cell_t *out);
 int fetch_from_buf_http(buf_t *buf,
                         char **headers_out, size_t max_headerlen,
                         char **body_out, size_t *body_used, size_t max_bodylen,
                         int force_complete);
 socks_request_t *socks_request_new(void);
 void socks_request_free(socks_request_t *req);
+void socks_request_clear_auth(socks_request_t *req);
 int fetch_from_buf_socks(buf_t *buf, socks_request_t *req,
                          int log_sockstype, int safe_socks);
 int fetch_from_buf_socks_client(buf_t *buf, int state, char **reason);
@@ -54,6 +63,7 @@ int peek_buf_has_control0_command(buf_t *buf);
 #ifdef USE_BUFFEREVENTS
 int fetch_var_cell_from_evbuffer(struct evbuffer *buf, var_cell_t **out,
                                  int linkproto);
+int fetch_cell_from_evbuffer(struct evbuffer *buf, cell_t *out);
 int fetch_from_evbuffer_socks(struct evbuffer *buf, socks_request_t *req,
                               int log_sockstype, int safe_socks);
 int fetch_from_evbuffer_socks_client(struct evbuffer *buf, int state,
@@ -90,6 +100,9 @@ void assert_buf_ok(buf_t *buf);
 
 #ifdef BUFFERS_PRIVATE
 int buf_find_string_offset(const buf_t *buf, const char *s, size_t n);
+void buf_pullup(buf_t *buf, size_t bytes, int nulterminate);
+int buf_get_chunk_class_counts(int idx, size_t *alloc_size_out,
+                               uint64_t *n_alloc_out, uint64_t *n_slabs_out);
 #endif
 
 #endif
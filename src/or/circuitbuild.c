@@ -20,8 +20,10 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "main.h"
+#include "microdesc.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -86,6 +88,22 @@ typedef struct {
   unsigned first_hops; /**< Number of first hops this guard has completed */
   unsigned circuit_successes; /**< Number of successfully built circuits using
                                * this guard as first hop. */
+
+  /** The value of entry_guard_usability_generation when we last filled in
+   * the usable_* fields below, or 0 if we never have. */
+  unsigned int usable_generation;
+  /** The node for this guard, if it has a descriptor and the right purpose
+   * for our configuration; otherwise NULL. */
+  const node_t *usable_node;
+  /** If usable_node is NULL, a short explanation of why. */
+  const char *unusable_msg;
+  /** A bit for each pair of need_uptime and need_capacity values, as
+   * indexed by ENTRY_GUARD_RELIABILITY_BIT(), set if usable_node is
+   * reliable enough for that pair. */
+  unsigned int usable_reliability : 4;
+  /** Set if our ReachableORAddresses-style options let us reach
+   * usable_node. */
+  unsigned int usable_by_firewall : 1;
 } entry_guard_t;
 
 /** Information about a configured bridge. Currently this just matches the
@@ -150,8 +168,8 @@ circuit_build_times_disabled(void)
   if (unit_tests) {
     return 0;
   } else {
-    int consensus_disabled = networkstatus_get_param(NULL, "cbtdisabled",
-                                                     0, 0, 1);
+    int consensus_disabled =
+      networkstatus_get_param_by_id(NULL, NET_PARAM_CBTDISABLED, 0, 0, 1);
     int config_disabled = !get_options()->LearnCircuitBuildTimeout;
     int dirauth_disabled = get_options()->AuthoritativeDir;
     int state_disabled = did_last_state_file_write_fail() ? 1 : 0;
@@ -187,7 +205,8 @@ circuit_build_times_max_timeouts(void)
 {
   int32_t cbt_maxtimeouts;
 
-  cbt_maxtimeouts = networkstatus_get_param(NULL, "cbtmaxtimeouts",
+  cbt_maxtimeouts = networkstatus_get_param_by_id(NULL,
+                                 NET_PARAM_CBTMAXTIMEOUTS,
                                  CBT_DEFAULT_MAX_RECENT_TIMEOUT_COUNT,
                                  CBT_MIN_MAX_RECENT_TIMEOUT_COUNT,
                                  CBT_MAX_MAX_RECENT_TIMEOUT_COUNT);
@@ -214,10 +233,10 @@ circuit_build_times_max_timeouts(void)
 static int32_t
 circuit_build_times_default_num_xm_modes(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtnummodes",
-                                        CBT_DEFAULT_NUM_XM_MODES,
-                                        CBT_MIN_NUM_XM_MODES,
-                                        CBT_MAX_NUM_XM_MODES);
+  int32_t num = networkstatus_get_param_by_id(NULL, NET_PARAM_CBTNUMMODES,
+                                              CBT_DEFAULT_NUM_XM_MODES,
+                                              CBT_MIN_NUM_XM_MODES,
+                                              CBT_MAX_NUM_XM_MODES);
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -238,7 +257,7 @@ circuit_build_times_default_num_xm_modes(void)
 static int32_t
 circuit_build_times_min_circs_to_observe(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtmincircs",
+  int32_t num = networkstatus_get_param_by_id(NULL, NET_PARAM_CBTMINCIRCS,
                                         CBT_DEFAULT_MIN_CIRCUITS_TO_OBSERVE,
                                         CBT_MIN_MIN_CIRCUITS_TO_OBSERVE,
                                         CBT_MAX_MIN_CIRCUITS_TO_OBSERVE);
@@ -270,10 +289,10 @@ circuit_build_times_enough_to_compute(circuit_build_times_t *cbt)
 double
 circuit_build_times_quantile_cutoff(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtquantile",
-                                        CBT_DEFAULT_QUANTILE_CUTOFF,
-                                        CBT_MIN_QUANTILE_CUTOFF,
-                                        CBT_MAX_QUANTILE_CUTOFF);
+  int32_t num = networkstatus_get_param_by_id(NULL, NET_PARAM_CBTQUANTILE,
+                                              CBT_DEFAULT_QUANTILE_CUTOFF,
+                                              CBT_MIN_QUANTILE_CUTOFF,
+                                              CBT_MAX_QUANTILE_CUTOFF);
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -289,10 +308,10 @@ circuit_build_times_quantile_cutoff(void)
 int
 circuit_build_times_get_bw_scale(networkstatus_t *ns)
 {
-  return networkstatus_get_param(ns, "bwweightscale",
-                                 BW_WEIGHT_SCALE,
-                                 BW_MIN_WEIGHT_SCALE,
-                                 BW_MAX_WEIGHT_SCALE);
+  return networkstatus_get_param_by_id(ns, NET_PARAM_BWWEIGHTSCALE,
+                                       BW_WEIGHT_SCALE,
+                                       BW_MIN_WEIGHT_SCALE,
+                                       BW_MAX_WEIGHT_SCALE);
 }
 
 /**
@@ -308,7 +327,7 @@ circuit_build_times_close_quantile(void)
   int32_t param;
   /* Cast is safe - circuit_build_times_quantile_cutoff() is capped */
   int32_t min = (int)tor_lround(100*circuit_build_times_quantile_cutoff());
-  param = networkstatus_get_param(NULL, "cbtclosequantile",
+  param = networkstatus_get_param_by_id(NULL, NET_PARAM_CBTCLOSEQUANTILE,
              CBT_DEFAULT_CLOSE_QUANTILE,
              CBT_MIN_CLOSE_QUANTILE,
              CBT_MAX_CLOSE_QUANTILE);
@@ -337,10 +356,10 @@ circuit_build_times_close_quantile(void)
 static int32_t
 circuit_build_times_test_frequency(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbttestfreq",
-                                        CBT_DEFAULT_TEST_FREQUENCY,
-                                        CBT_MIN_TEST_FREQUENCY,
-                                        CBT_MAX_TEST_FREQUENCY);
+  int32_t num = networkstatus_get_param_by_id(NULL, NET_PARAM_CBTTESTFREQ,
+                                              CBT_DEFAULT_TEST_FREQUENCY,
+                                              CBT_MIN_TEST_FREQUENCY,
+                                              CBT_MAX_TEST_FREQUENCY);
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -361,10 +380,10 @@ circuit_build_times_test_frequency(void)
 static int32_t
 circuit_build_times_min_timeout(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "cbtmintimeout",
-                                        CBT_DEFAULT_TIMEOUT_MIN_VALUE,
-                                        CBT_MIN_TIMEOUT_MIN_VALUE,
-                                        CBT_MAX_TIMEOUT_MIN_VALUE);
+  int32_t num = networkstatus_get_param_by_id(NULL, NET_PARAM_CBTMINTIMEOUT,
+                                              CBT_DEFAULT_TIMEOUT_MIN_VALUE,
+                                              CBT_MIN_TIMEOUT_MIN_VALUE,
+                                              CBT_MAX_TIMEOUT_MIN_VALUE);
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -385,7 +404,8 @@ int32_t
 circuit_build_times_initial_timeout(void)
 {
   int32_t min = circuit_build_times_min_timeout();
-  int32_t param = networkstatus_get_param(NULL, "cbtinitialtimeout",
+  int32_t param = networkstatus_get_param_by_id(NULL,
+                                          NET_PARAM_CBTINITIALTIMEOUT,
                                           CBT_DEFAULT_TIMEOUT_INITIAL_VALUE,
                                           CBT_MIN_TIMEOUT_INITIAL_VALUE,
                                           CBT_MAX_TIMEOUT_INITIAL_VALUE);
@@ -416,10 +436,10 @@ static int32_t
 circuit_build_times_recent_circuit_count(networkstatus_t *ns)
 {
   int32_t num;
-  num = networkstatus_get_param(ns, "cbtrecentcount",
-                                CBT_DEFAULT_RECENT_CIRCUITS,
-                                CBT_MIN_RECENT_CIRCUITS,
-                                CBT_MAX_RECENT_CIRCUITS);
+  num = networkstatus_get_param_by_id(ns, NET_PARAM_CBTRECENTCOUNT,
+                                      CBT_DEFAULT_RECENT_CIRCUITS,
+                                      CBT_MIN_RECENT_CIRCUITS,
+                                      CBT_MAX_RECENT_CIRCUITS);
 
   if (!(get_options()->LearnCircuitBuildTimeout)) {
     log_debug(LD_BUG,
@@ -555,6 +575,140 @@ circuit_build_times_get_initial_timeout(void)
   return timeout;
 }
 
+/** Running totals over the recorded build times of a circuit_build_times_t.
+ * We keep these up to date as build times are added and evicted, so that
+ * estimating a new timeout needn't re-histogram every recorded time. */
+typedef struct cbt_histogram_t {
+  /** Number of recorded build times (not counting abandoned circuits) that
+   * fall into each CBT_BIN_WIDTH-millisecond bin. */
+  uint32_t *count;
+  /** Sum of the logarithms of the build times counted in each bin.  Since
+   * we add and subtract logarithms as times come and go, these can drift
+   * from a fresh sum by rounding error; circuit_build_times_add_time()
+   * rebuilds them once per pass through circuit_build_times. */
+  double *log_sum;
+  /** Number of bins allocated in count and log_sum. */
+  build_time_t n_alloc;
+  /** One more than the index of the highest nonempty bin, or 0 if every
+   * bin is empty. */
+  build_time_t nbins;
+  /** Number of recorded CBT_BUILD_ABANDONED values. */
+  int n_abandoned;
+  /** The largest recorded build time, not counting abandoned circuits.
+   * Only accurate if max_time_ok is set. */
+  build_time_t max_time;
+  /** False if we've evicted the largest build time since we last found
+   * max_time, so that we need to look for it again. */
+  unsigned int max_time_ok : 1;
+} cbt_histogram_t;
+
+/** Don't shrink a cbt_histogram_t to fewer bins than this. */
+#define CBT_HISTOGRAM_MIN_BINS 256
+
+/** Return the number of build times in bin <b>bin</b> of <b>h</b>. */
+static INLINE uint32_t
+cbt_histogram_count(const cbt_histogram_t *h, build_time_t bin)
+{
+  return bin < h->nbins ? h->count[bin] : 0;
+}
+
+/** Resize the bins of <b>h</b> to hold exactly <b>n</b> bins, keeping
+ * the first nbins of them. */
+static void
+cbt_histogram_resize(cbt_histogram_t *h, build_time_t n)
+{
+  tor_assert(n >= h->nbins);
+  h->count = tor_realloc(h->count, n*sizeof(uint32_t));
+  h->log_sum = tor_realloc(h->log_sum, n*sizeof(double));
+  if (n > h->n_alloc) {
+    memset(h->count + h->n_alloc, 0, (n - h->n_alloc)*sizeof(uint32_t));
+    memset(h->log_sum + h->n_alloc, 0, (n - h->n_alloc)*sizeof(double));
+  }
+  h->n_alloc = n;
+}
+
+/** Count the recorded build time <b>time</b> in <b>h</b>. */
+static void
+cbt_histogram_add(cbt_histogram_t *h, build_time_t time)
+{
+  build_time_t bin;
+  if (time == 0) /* 0 <-> uninitialized */
+    return;
+  if (time == CBT_BUILD_ABANDONED) {
+    ++h->n_abandoned;
+    return;
+  }
+
+  bin = time / CBT_BIN_WIDTH;
+  if (bin >= h->n_alloc)
+    cbt_histogram_resize(h, MAX(bin+1, MAX(h->n_alloc*2,
+                                           CBT_HISTOGRAM_MIN_BINS)));
+  ++h->count[bin];
+  h->log_sum[bin] += tor_mathlog(time);
+  if (bin >= h->nbins)
+    h->nbins = bin+1;
+  if (time > h->max_time)
+    h->max_time = time;
+}
+
+/** Stop counting the recorded build time <b>time</b> in <b>h</b>. */
+static void
+cbt_histogram_remove(cbt_histogram_t *h, build_time_t time)
+{
+  build_time_t bin;
+  if (time == 0)
+    return;
+  if (time == CBT_BUILD_ABANDONED) {
+    tor_assert(h->n_abandoned > 0);
+    --h->n_abandoned;
+    return;
+  }
+
+  bin = time / CBT_BIN_WIDTH;
+  tor_assert(cbt_histogram_count(h, bin) > 0);
+  if (--h->count[bin] == 0) {
+    /* Don't let rounding errors pile up in empty bins. */
+    h->log_sum[bin] = 0;
+    while (h->nbins && !h->count[h->nbins-1])
+      --h->nbins;
+    if (h->n_alloc > CBT_HISTOGRAM_MIN_BINS && h->nbins < h->n_alloc/4)
+      cbt_histogram_resize(h, MAX(h->nbins*2, CBT_HISTOGRAM_MIN_BINS));
+  } else {
+    h->log_sum[bin] -= tor_mathlog(time);
+  }
+  if (time == h->max_time)
+    h->max_time_ok = 0;
+}
+
+/** Return the running totals for the build times recorded in <b>cbt</b>,
+ * computing them from scratch if we don't have them yet. */
+static cbt_histogram_t *
+circuit_build_times_get_histogram(circuit_build_times_t *cbt)
+{
+  int i;
+  if (cbt->histogram)
+    return cbt->histogram;
+
+  cbt->histogram = tor_malloc_zero(sizeof(cbt_histogram_t));
+  cbt->histogram->max_time_ok = 1;
+  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++)
+    cbt_histogram_add(cbt->histogram, cbt->circuit_build_times[i]);
+  return cbt->histogram;
+}
+
+/** Throw away the running totals for the build times recorded in
+ * <b>cbt</b>.  Call this after changing circuit_build_times other than
+ * through circuit_build_times_add_time(). */
+static void
+circuit_build_times_forget_histogram(circuit_build_times_t *cbt)
+{
+  if (!cbt->histogram)
+    return;
+  tor_free(cbt->histogram->count);
+  tor_free(cbt->histogram->log_sum);
+  tor_free(cbt->histogram);
+}
+
 /**
  * Reset the build time state.
  *
@@ -565,6 +719,7 @@ void
 circuit_build_times_reset(circuit_build_times_t *cbt)
 {
   memset(cbt->circuit_build_times, 0, sizeof(cbt->circuit_build_times));
+  circuit_build_times_forget_histogram(cbt);
   cbt->total_build_times = 0;
   cbt->build_times_idx = 0;
   cbt->have_computed_timeout = 0;
@@ -598,8 +753,8 @@ circuit_build_times_init(circuit_build_times_t *cbt)
 }
 
 /**
- * Free the saved timeouts, if the cbtdisabled consensus parameter got turned
- * on or something.
+ * Free the saved timeouts and the running histogram totals, if the
+ * cbtdisabled consensus parameter got turned on or we're shutting down.
  */
 
 void
@@ -610,6 +765,7 @@ circuit_build_times_free_timeouts(circuit_build_times_t *cbt)
   if (cbt->liveness.timeouts_after_firsthop) {
     tor_free(cbt->liveness.timeouts_after_firsthop);
   }
+  circuit_build_times_forget_histogram(cbt);
 
   cbt->liveness.num_recent_circs = 0;
 }
@@ -662,10 +818,19 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
 
   log_debug(LD_CIRC, "Adding circuit build time %u", time);
 
+  if (cbt->histogram) {
+    cbt_histogram_remove(cbt->histogram,
+                         cbt->circuit_build_times[cbt->build_times_idx]);
+    cbt_histogram_add(cbt->histogram, time);
+  }
   cbt->circuit_build_times[cbt->build_times_idx] = time;
   cbt->build_times_idx = (cbt->build_times_idx + 1) % CBT_NCIRCUITS_TO_OBSERVE;
   if (cbt->total_build_times < CBT_NCIRCUITS_TO_OBSERVE)
     cbt->total_build_times++;
+  /* Once we've replaced every slot, start the running totals over, so that
+   * rounding errors in their log sums can't pile up indefinitely. */
+  if (cbt->build_times_idx == 0)
+    circuit_build_times_forget_histogram(cbt);
 
   if ((cbt->total_build_times % CBT_SAVE_STATE_EVERY) == 0) {
     /* Save state every n circuit builds */
@@ -682,13 +847,22 @@ circuit_build_times_add_time(circuit_build_times_t *cbt, build_time_t time)
 static build_time_t
 circuit_build_times_max(circuit_build_times_t *cbt)
 {
+  cbt_histogram_t *h = circuit_build_times_get_histogram(cbt);
   int i = 0;
   build_time_t max_build_time = 0;
+
+  if (h->max_time_ok)
+    return h->max_time;
+
+  /* We've evicted the old maximum since we last looked, so find the new
+   * one. */
   for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
     if (cbt->circuit_build_times[i] > max_build_time
             && cbt->circuit_build_times[i] != CBT_BUILD_ABANDONED)
       max_build_time = cbt->circuit_build_times[i];
   }
+  h->max_time = max_build_time;
+  h->max_time_ok = 1;
   return max_build_time;
 }
 
@@ -711,39 +885,6 @@ circuit_build_times_min(circuit_build_times_t *cbt)
 }
 #endif
 
-/**
- * Calculate and return a histogram for the set of build times.
- *
- * Returns an allocated array of histrogram bins representing
- * the frequency of index*CBT_BIN_WIDTH millisecond
- * build times. Also outputs the number of bins in nbins.
- *
- * The return value must be freed by the caller.
- */
-static uint32_t *
-circuit_build_times_create_histogram(circuit_build_times_t *cbt,
-                                     build_time_t *nbins)
-{
-  uint32_t *histogram;
-  build_time_t max_build_time = circuit_build_times_max(cbt);
-  int i, c;
-
-  *nbins = 1 + (max_build_time / CBT_BIN_WIDTH);
-  histogram = tor_malloc_zero(*nbins * sizeof(build_time_t));
-
-  // calculate histogram
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == 0
-            || cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      continue; /* 0 <-> uninitialized */
-
-    c = (cbt->circuit_build_times[i] / CBT_BIN_WIDTH);
-    histogram[c]++;
-  }
-
-  return histogram;
-}
-
 /**
  * Return the Pareto start-of-curve parameter Xm.
  *
@@ -759,11 +900,12 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   build_time_t *nth_max_bin;
   int32_t bin_counts=0;
   build_time_t ret = 0;
-  uint32_t *histogram = circuit_build_times_create_histogram(cbt, &nbins);
+  const cbt_histogram_t *h = circuit_build_times_get_histogram(cbt);
   int n=0;
   int num_modes = circuit_build_times_default_num_xm_modes();
 
-  tor_assert(nbins > 0);
+  /* Always look at bin 0, even if every bin is empty. */
+  nbins = MAX(h->nbins, 1);
   tor_assert(num_modes > 0);
 
   // Only use one mode if < 1000 buildtimes. Not enough data
@@ -775,24 +917,26 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
 
   /* Determine the N most common build times */
   for (i = 0; i < nbins; i++) {
-    if (histogram[i] >= histogram[nth_max_bin[0]]) {
+    uint32_t count = cbt_histogram_count(h, i);
+    if (count >= cbt_histogram_count(h, nth_max_bin[0])) {
       nth_max_bin[0] = i;
     }
 
     for (n = 1; n < num_modes; n++) {
-      if (histogram[i] >= histogram[nth_max_bin[n]] &&
-           (!histogram[nth_max_bin[n-1]]
-               || histogram[i] < histogram[nth_max_bin[n-1]])) {
+      if (count >= cbt_histogram_count(h, nth_max_bin[n]) &&
+           (!cbt_histogram_count(h, nth_max_bin[n-1])
+               || count < cbt_histogram_count(h, nth_max_bin[n-1]))) {
         nth_max_bin[n] = i;
       }
     }
   }
 
   for (n = 0; n < num_modes; n++) {
-    bin_counts += histogram[nth_max_bin[n]];
-    ret += CBT_BIN_TO_MS(nth_max_bin[n])*histogram[nth_max_bin[n]];
+    uint32_t count = cbt_histogram_count(h, nth_max_bin[n]);
+    bin_counts += count;
+    ret += CBT_BIN_TO_MS(nth_max_bin[n])*count;
     log_info(LD_CIRC, "Xm mode #%d: %u %u", n, CBT_BIN_TO_MS(nth_max_bin[n]),
-             histogram[nth_max_bin[n]]);
+             count);
   }
 
   /* The following assert is safe, because we don't get called when we
@@ -800,7 +944,6 @@ circuit_build_times_get_xm(circuit_build_times_t *cbt)
   tor_assert(bin_counts > 0);
 
   ret /= bin_counts;
-  tor_free(histogram);
   tor_free(nth_max_bin);
 
   return ret;
@@ -814,32 +957,25 @@ void
 circuit_build_times_update_state(circuit_build_times_t *cbt,
                                  or_state_t *state)
 {
-  uint32_t *histogram;
+  const cbt_histogram_t *h = circuit_build_times_get_histogram(cbt);
   build_time_t i = 0;
-  build_time_t nbins = 0;
   config_line_t **next, *line;
 
-  histogram = circuit_build_times_create_histogram(cbt, &nbins);
   // write to state
   config_free_lines(state->BuildtimeHistogram);
   next = &state->BuildtimeHistogram;
   *next = NULL;
 
   state->TotalBuildTimes = cbt->total_build_times;
-  state->CircuitBuildAbandonedCount = 0;
+  state->CircuitBuildAbandonedCount = h->n_abandoned;
 
-  for (i = 0; i < CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (cbt->circuit_build_times[i] == CBT_BUILD_ABANDONED)
-      state->CircuitBuildAbandonedCount++;
-  }
-
-  for (i = 0; i < nbins; i++) {
+  for (i = 0; i < h->nbins; i++) {
     // compress the histogram by skipping the blanks
-    if (histogram[i] == 0) continue;
+    if (h->count[i] == 0) continue;
     *next = line = tor_malloc_zero(sizeof(config_line_t));
     line->key = tor_strdup("CircuitBuildTimeBin");
     tor_asprintf(&line->value, "%d %d",
-            CBT_BIN_TO_MS(i), histogram[i]);
+            CBT_BIN_TO_MS(i), h->count[i]);
     next = &(line->next);
   }
 
@@ -847,8 +983,6 @@ circuit_build_times_update_state(circuit_build_times_t *cbt,
     if (!get_options()->AvoidDiskWrites)
       or_state_mark_dirty(get_or_state(), 0);
   }
-
-  tor_free(histogram);
 }
 
 /**
@@ -919,6 +1053,8 @@ circuit_build_times_filter_timeouts(circuit_build_times_t *cbt)
                cbt->circuit_build_times[i]);
     }
   }
+  if (num_filtered)
+    circuit_build_times_forget_histogram(cbt);
 
   log_info(LD_CIRC,
            "We had %d timeouts out of %d build times, "
@@ -1076,9 +1212,10 @@ int
 circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 {
   build_time_t *x=cbt->circuit_build_times;
-  double a = 0;
+  const cbt_histogram_t *h;
+  double a = 0, log_xm;
   int n=0,i=0,abandoned_count=0;
-  build_time_t max_time=0;
+  build_time_t max_time=0, bin, xm_bin;
 
   /* http://en.wikipedia.org/wiki/Pareto_distribution#Parameter_estimation */
   /* We sort of cheat here and make our samples slightly more pareto-like
@@ -1087,23 +1224,35 @@ circuit_build_times_update_alpha(circuit_build_times_t *cbt)
 
   tor_assert(cbt->Xm > 0);
 
-  for (i=0; i< CBT_NCIRCUITS_TO_OBSERVE; i++) {
-    if (!x[i]) {
-      continue;
-    }
-
-    if (x[i] < cbt->Xm) {
-      a += tor_mathlog(cbt->Xm);
-    } else if (x[i] == CBT_BUILD_ABANDONED) {
-      abandoned_count++;
-    } else {
-      a += tor_mathlog(x[i]);
-      if (x[i] > max_time)
-        max_time = x[i];
+  /* Every build time below Xm counts as Xm.  Bins below the one holding Xm
+   * are entirely below it, and bins above are entirely above it, so only
+   * the times in Xm's own bin need looking at one by one. */
+  h = circuit_build_times_get_histogram(cbt);
+  log_xm = tor_mathlog(cbt->Xm);
+  xm_bin = cbt->Xm / CBT_BIN_WIDTH;
+  abandoned_count = h->n_abandoned;
+  n = abandoned_count;
+  for (bin = 0; bin < h->nbins; bin++) {
+    n += h->count[bin];
+    if (bin < xm_bin)
+      a += h->count[bin] * log_xm;
+    else if (bin > xm_bin)
+      a += h->log_sum[bin];
+  }
+  if (cbt_histogram_count(h, xm_bin)) {
+    for (i=0; i< CBT_NCIRCUITS_TO_OBSERVE; i++) {
+      if (!x[i] || x[i] == CBT_BUILD_ABANDONED ||
+          x[i] / CBT_BIN_WIDTH != xm_bin)
+        continue;
+      a += (x[i] < cbt->Xm) ? log_xm : tor_mathlog(x[i]);
     }
-    n++;
   }
 
+  /* We only care about the largest time that isn't below Xm. */
+  max_time = circuit_build_times_max(cbt);
+  if (max_time < cbt->Xm)
+    max_time = 0;
+
   /*
    * We are erring and asserting here because this can only happen
    * in codepaths other than startup. The startup state parsing code
@@ -1670,9 +1819,9 @@ circuit_build_times_set_timeout(circuit_build_times_t *cbt)
   }
 }
 
-/** Iterate over values of circ_id, starting from conn-\>next_circ_id,
- * and with the high bit specified by conn-\>circ_id_type, until we get
- * a circ_id that is not in use by any other circuit on that conn.
+/** Find the first value of circ_id, starting from conn-\>next_circ_id,
+ * and with the high bit specified by conn-\>circ_id_type, that is not in
+ * use by any other circuit on that conn.
  *
  * Return it, or 0 if can't get a unique circ_id.
  */
@@ -1680,7 +1829,7 @@ static circid_t
 get_unique_circ_id_by_conn(or_connection_t *conn)
 {
   circid_t test_circ_id;
-  circid_t attempts=0;
+  circid_t start;
   circid_t high_bit;
 
   tor_assert(conn);
@@ -1690,23 +1839,19 @@ get_unique_circ_id_by_conn(or_connection_t *conn)
     return 0;
   }
   high_bit = (conn->circ_id_type == CIRC_ID_TYPE_HIGHER) ? 1<<15 : 0;
-  do {
-    /* Sequentially iterate over test_circ_id=1...1<<15-1 until we find a
-     * circID such that (high_bit|test_circ_id) is not already used. */
-    test_circ_id = conn->next_circ_id++;
-    if (test_circ_id == 0 || test_circ_id >= 1<<15) {
-      test_circ_id = 1;
-      conn->next_circ_id = 2;
-    }
-    if (++attempts > 1<<15) {
-      /* Make sure we don't loop forever if all circ_id's are used. This
-       * matters because it's an external DoS opportunity.
-       */
-      log_warn(LD_CIRC,"No unused circ IDs. Failing.");
-      return 0;
-    }
-    test_circ_id |= high_bit;
-  } while (circuit_id_in_use_on_orconn(test_circ_id, conn));
+  /* Keep going up from where we left off, so that we don't reuse an ID
+   * right after its circuit goes away. */
+  start = conn->next_circ_id;
+  if (start == 0 || start >= 1<<15)
+    start = 1;
+  test_circ_id = circuit_id_get_unused_on_orconn(conn, high_bit, start);
+  if (!test_circ_id) {
+    /* All circ_id's are used.  This matters because it's an external DoS
+     * opportunity. */
+    log_warn(LD_CIRC,"No unused circ IDs. Failing.");
+    return 0;
+  }
+  conn->next_circ_id = (test_circ_id & ((1<<15) - 1)) + 1;
   return test_circ_id;
 }
 
@@ -1897,7 +2042,7 @@ origin_circuit_init(uint8_t purpose, int flags)
     ((flags & CIRCLAUNCH_NEED_CAPACITY) ? 1 : 0);
   circ->build_state->is_internal =
     ((flags & CIRCLAUNCH_IS_INTERNAL) ? 1 : 0);
-  circ->_base.purpose = purpose;
+  circuit_set_purpose(TO_CIRCUIT(circ), purpose);
   return circ;
 }
 
@@ -1985,7 +2130,7 @@ circuit_handle_first_hop(origin_circuit_t *circ)
     return 0;
   } else { /* it's already open. use it. */
     tor_assert(!circ->_base.n_hop);
-    circ->_base.n_conn = n_conn;
+    circuit_set_n_conn_without_circid(TO_CIRCUIT(circ), n_conn);
     log_debug(LD_CIRC,"Conn open. Delivering first onion skin.");
     if ((err_reason = circuit_send_next_onion_skin(circ)) < 0) {
       log_info(LD_CIRC,"circuit_send_next_onion_skin failed.");
@@ -2042,7 +2187,7 @@ circuit_n_conn_done(or_connection_t *or_conn, int status)
       /* circuit_deliver_create_cell will set n_circ_id and add us to
        * orconn_circuid_circuit_map, so we don't need to call
        * set_circid_orconn here. */
-      circ->n_conn = or_conn;
+      circuit_set_n_conn_without_circid(circ, or_conn);
       extend_info_free(circ->n_hop);
       circ->n_hop = NULL;
 
@@ -2256,10 +2401,8 @@ circuit_send_next_onion_skin(origin_circuit_t *circ)
       /* done building the circuit. whew. */
       circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_OPEN);
       if (circuit_timeout_want_to_count_circ(circ)) {
-        struct timeval end;
-        long timediff;
-        tor_gettimeofday(&end);
-        timediff = tv_mdiff(&circ->_base.timestamp_created, &end);
+        long timediff = (long)((tor_monotime_nsec() -
+                               circ->_base.timestamp_created_mono) / 1000000);
 
         /*
          * If the circuit build time is much greater than we would have cut
@@ -2502,7 +2645,7 @@ circuit_extend(cell_t *cell, circuit_t *circ)
   }
 
   tor_assert(!circ->n_hop); /* Connection is already established. */
-  circ->n_conn = n_conn;
+  circuit_set_n_conn_without_circid(circ, n_conn);
   log_debug(LD_CIRC,"n_conn is %s:%u",
             n_conn->_base.address,n_conn->_base.port);
 
@@ -2570,9 +2713,9 @@ pathbias_get_min_circs(const or_options_t *options)
   if (options->PathBiasCircThreshold >= 5)
     return options->PathBiasCircThreshold;
   else
-    return networkstatus_get_param(NULL, "pb_mincircs",
-                                   DFLT_PATH_BIAS_MIN_CIRC,
-                                   5, INT32_MAX);
+    return networkstatus_get_param_by_id(NULL, NET_PARAM_PB_MINCIRCS,
+                                         DFLT_PATH_BIAS_MIN_CIRC,
+                                         5, INT32_MAX);
 }
 
 static double
@@ -2582,7 +2725,7 @@ pathbias_get_notice_rate(const or_options_t *options)
   if (options->PathBiasNoticeRate >= 0.0)
     return options->PathBiasNoticeRate;
   else
-    return networkstatus_get_param(NULL, "pb_noticepct",
+    return networkstatus_get_param_by_id(NULL, NET_PARAM_PB_NOTICEPCT,
                                    DFLT_PATH_BIAS_NOTICE_PCT, 0, 100)/100.0;
 }
 
@@ -2594,7 +2737,7 @@ pathbias_get_disable_rate(const or_options_t *options)
   if (options->PathBiasDisableRate >= 0.0)
     return options->PathBiasDisableRate;
   else
-    return networkstatus_get_param(NULL, "pb_disablepct",
+    return networkstatus_get_param_by_id(NULL, NET_PARAM_PB_DISABLEPCT,
                                    DFLT_PATH_BIAS_DISABLE_PCT, 0, 100)/100.0;
 }
 
@@ -2605,9 +2748,9 @@ pathbias_get_scale_threshold(const or_options_t *options)
   if (options->PathBiasScaleThreshold >= 2)
     return options->PathBiasScaleThreshold;
   else
-    return networkstatus_get_param(NULL, "pb_scalecircs",
-                                   DFLT_PATH_BIAS_SCALE_THRESHOLD, 10,
-                                   INT32_MAX);
+    return networkstatus_get_param_by_id(NULL, NET_PARAM_PB_SCALECIRCS,
+                                         DFLT_PATH_BIAS_SCALE_THRESHOLD, 10,
+                                         INT32_MAX);
 }
 
 static int
@@ -2617,7 +2760,7 @@ pathbias_get_scale_factor(const or_options_t *options)
   if (options->PathBiasScaleFactor >= 1)
     return options->PathBiasScaleFactor;
   else
-    return networkstatus_get_param(NULL, "pb_scalefactor",
+    return networkstatus_get_param_by_id(NULL, NET_PARAM_PB_SCALEFACTOR,
                                 DFLT_PATH_BIAS_SCALE_THRESHOLD, 1, INT32_MAX);
 }
 
@@ -2671,15 +2814,52 @@ entry_guard_inc_first_hop_count(entry_guard_t *guard)
   return 0;
 }
 
+/** Helper for circuit_finish_handshake(): we've computed <b>keys</b>
+ * for <b>hop</b> of <b>circ</b>, from a reply whose hash of the shared key
+ * is <b>reply_digest</b>.  Initialize the hop's crypto, and mark it open.
+ * Return - reason if we want to mark circ for close, else return 0.
+ */
+static int
+circuit_finish_hop(origin_circuit_t *circ, crypt_path_t *hop,
+                   uint8_t reply_type, const uint8_t *reply_digest,
+                   char *keys)
+{
+  /* Remember hash of g^xy */
+  memcpy(hop->handshake_digest, reply_digest, DIGEST_LEN);
+
+  crypto_dh_free(hop->dh_handshake_state); /* don't need it anymore */
+  hop->dh_handshake_state = NULL;
+
+  memset(hop->fast_handshake_state, 0, sizeof(hop->fast_handshake_state));
+
+  if (circuit_init_cpath_crypto(hop, keys, 0)<0) {
+    memset(keys, 0, CPATH_KEY_MATERIAL_LEN);
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+  memset(keys, 0, CPATH_KEY_MATERIAL_LEN);
+
+  hop->state = CPATH_STATE_OPEN;
+  log_info(LD_CIRC,"Finished building %scircuit hop:",
+           (reply_type == CELL_CREATED_FAST) ? "fast " : "");
+  circuit_log_path(LOG_INFO,LD_CIRC,circ);
+  control_event_circuit_status(circ, CIRC_EVENT_EXTENDED, 0);
+
+  return 0;
+}
+
 /** A created or extended cell came back to us on the circuit, and it included
  * <b>reply</b> as its body.  (If <b>reply_type</b> is CELL_CREATED, the body
  * contains (the second DH key, plus KH).  If <b>reply_type</b> is
  * CELL_CREATED_FAST, the body contains a secret y and a hash H(x|y).)
  *
  * Calculate the appropriate keys and digests, make sure KH is
- * correct, and initialize this hop of the cpath.
+ * correct, and initialize this hop of the cpath.  If we can, we let a
+ * cpuworker do the DH part of a CELL_CREATED reply, and finish up in
+ * circuit_finish_handshake_done().
  *
- * Return - reason if we want to mark circ for close, else return 0.
+ * Return - reason if we want to mark circ for close; 1 if a cpuworker is
+ * finishing the handshake, and will send the next onion skin itself; else
+ * return 0.
  */
 int
 circuit_finish_handshake(origin_circuit_t *circ, uint8_t reply_type,
@@ -2712,14 +2892,25 @@ circuit_finish_handshake(origin_circuit_t *circ, uint8_t reply_type,
   }
   tor_assert(hop->state == CPATH_STATE_AWAITING_KEYS);
 
+  if (hop->handshake_in_worker) {
+    log_warn(LD_PROTOCOL,"Got a second CREATED cell for a hop whose "
+             "handshake we're still finishing. Closing.");
+    return -END_CIRC_REASON_TORPROTOCOL;
+  }
+
   if (reply_type == CELL_CREATED && hop->dh_handshake_state) {
+    if (assign_client_handshake_to_cpuworker(circ, hop, reply) == 0) {
+      /* The worker owns hop->dh_handshake_state now. */
+      hop->dh_handshake_state = NULL;
+      hop->handshake_in_worker = 1;
+      return 1;
+    }
     if (onion_skin_client_handshake(hop->dh_handshake_state, (char*)reply,keys,
                                     DIGEST_LEN*2+CIPHER_KEY_LEN*2) < 0) {
       log_warn(LD_CIRC,"onion_skin_client_handshake failed.");
       return -END_CIRC_REASON_TORPROTOCOL;
     }
-    /* Remember hash of g^xy */
-    memcpy(hop->handshake_digest, reply+DH_KEY_LEN, DIGEST_LEN);
+    return circuit_finish_hop(circ, hop, reply_type, reply+DH_KEY_LEN, keys);
   } else if (reply_type == CELL_CREATED_FAST && !hop->dh_handshake_state) {
     if (fast_client_handshake(hop->fast_handshake_state, reply,
                               (uint8_t*)keys,
@@ -2727,28 +2918,54 @@ circuit_finish_handshake(origin_circuit_t *circ, uint8_t reply_type,
       log_warn(LD_CIRC,"fast_client_handshake failed.");
       return -END_CIRC_REASON_TORPROTOCOL;
     }
-    memcpy(hop->handshake_digest, reply+DIGEST_LEN, DIGEST_LEN);
+    return circuit_finish_hop(circ, hop, reply_type, reply+DIGEST_LEN, keys);
   } else {
     log_warn(LD_PROTOCOL,"CREATED cell type did not match CREATE cell type.");
     return -END_CIRC_REASON_TORPROTOCOL;
   }
+}
 
-  crypto_dh_free(hop->dh_handshake_state); /* don't need it anymore */
-  hop->dh_handshake_state = NULL;
-
-  memset(hop->fast_handshake_state, 0, sizeof(hop->fast_handshake_state));
+/** Called when a cpuworker has finished the DH part of a CELL_CREATED
+ * <b>reply</b> for <b>hop</b> of the origin circuit whose global
+ * identifier is <b>circ_id</b>.  If <b>result</b> is negative, the
+ * handshake failed; otherwise, the worker computed <b>keys</b>.  If the
+ * circuit and hop are still around, finish the hop, and extend the circuit
+ * further as circuit_finish_handshake()'s callers would have.
+ */
+void
+circuit_finish_handshake_done(uint32_t circ_id, crypt_path_t *hop,
+                              int result, const uint8_t *reply, char *keys)
+{
+  origin_circuit_t *circ = circuit_get_by_global_id(circ_id);
+  crypt_path_t *cp;
+  int reason;
+
+  if (!circ)
+    return; /* It closed while the worker was busy. */
+  /* Make sure <b>hop</b> hasn't been freed: it should still be in our
+   * cpath, waiting for these keys. */
+  cp = circ->cpath;
+  do {
+    if (cp == hop)
+      break;
+    cp = cp->next;
+  } while (cp && cp != circ->cpath);
+  if (cp != hop || hop->state != CPATH_STATE_AWAITING_KEYS ||
+      !hop->handshake_in_worker)
+    return;
+  hop->handshake_in_worker = 0;
 
-  if (circuit_init_cpath_crypto(hop, keys, 0)<0) {
-    return -END_CIRC_REASON_TORPROTOCOL;
+  if (result < 0) {
+    log_warn(LD_CIRC,"onion_skin_client_handshake failed.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_TORPROTOCOL);
+    return;
+  }
+  if ((reason = circuit_finish_hop(circ, hop, CELL_CREATED,
+                                   reply+DH_KEY_LEN, keys)) < 0 ||
+      (reason = circuit_send_next_onion_skin(circ)) < 0) {
+    log_info(LD_CIRC, "Couldn't extend circuit after handshake.");
+    circuit_mark_for_close(TO_CIRCUIT(circ), -reason);
   }
-
-  hop->state = CPATH_STATE_OPEN;
-  log_info(LD_CIRC,"Finished building %scircuit hop:",
-           (reply_type == CELL_CREATED_FAST) ? "fast " : "");
-  circuit_log_path(LOG_INFO,LD_CIRC,circ);
-  control_event_circuit_status(circ, CIRC_EVENT_EXTENDED, 0);
-
-  return 0;
 }
 
 /** We received a relay truncated cell on circ.
@@ -2842,7 +3059,7 @@ onionskin_answer(or_circuit_t *circ, uint8_t cell_type, const char *payload,
   else
     memcpy(circ->handshake_digest, cell.payload+DIGEST_LEN, DIGEST_LEN);
 
-  circ->is_first_hop = (cell_type == CELL_CREATED_FAST);
+  circuit_set_is_first_hop(circ, cell_type == CELL_CREATED_FAST);
 
   append_cell_to_circuit_queue(TO_CIRCUIT(circ),
                                circ->p_conn, &cell, CELL_DIRECTION_IN, 0);
@@ -2988,6 +3205,41 @@ ap_stream_wants_exit_attention(connection_t *conn)
   return 0;
 }
 
+/** Add <b>conn</b>, which we got from ap_stream_wants_exit_attention(), to
+ * the list of pending_stream_class_t in <b>classes</b>.  Two streams are in
+ * the same class when connection_ap_can_use_exit() must give the same answer
+ * for them with any exit: pending streams never have a chosen exit or use
+ * begindir, so that answer depends only on the command, the port, and the
+ * address if it's a literal. */
+void
+pending_stream_classes_add(smartlist_t *classes,
+                           const entry_connection_t *conn)
+{
+  const socks_request_t *req = conn->socks_request;
+  struct in_addr in;
+  int literal = req->command == SOCKS_COMMAND_CONNECT &&
+    tor_inet_aton(req->address, &in);
+  pending_stream_class_t *cls;
+
+  SMARTLIST_FOREACH_BEGIN(classes, pending_stream_class_t *, c) {
+    const socks_request_t *creq = c->example->socks_request;
+    if (creq->command != req->command)
+      continue;
+    if (req->command == SOCKS_COMMAND_CONNECT &&
+        (creq->port != req->port || c->addr_is_literal != literal ||
+         (literal && strcmp(creq->address, req->address))))
+      continue;
+    ++c->n;
+    return;
+  } SMARTLIST_FOREACH_END(c);
+
+  cls = tor_malloc_zero(sizeof(pending_stream_class_t));
+  cls->example = conn;
+  cls->addr_is_literal = literal;
+  cls->n = 1;
+  smartlist_add(classes, cls);
+}
+
 /** Return a pointer to a suitable router to be the exit node for the
  * general-purpose circuit we're about to build.
  *
@@ -3001,7 +3253,7 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 {
   int *n_supported;
   int n_pending_connections = 0;
-  smartlist_t *connections;
+  smartlist_t *connections, *classes;
   int best_support = -1;
   int n_best_support=0;
   const or_options_t *options = get_options();
@@ -3010,13 +3262,17 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
 
   connections = get_connection_array();
 
-  /* Count how many connections are waiting for a circuit to be built.
-   * We use this for log messages now, but in the future we may depend on it.
+  /* Count how many connections are waiting for a circuit to be built, and
+   * sort them into classes that every exit will treat alike, so that we
+   * only need to check each exit against one stream per class.
    */
+  classes = smartlist_new();
   SMARTLIST_FOREACH(connections, connection_t *, conn,
   {
-    if (ap_stream_wants_exit_attention(conn))
+    if (ap_stream_wants_exit_attention(conn)) {
       ++n_pending_connections;
+      pending_stream_classes_add(classes, TO_ENTRY_CONN(conn));
+    }
   });
 //  log_fn(LOG_DEBUG, "Choosing exit node; %d connections are pending",
 //         n_pending_connections);
@@ -3088,19 +3344,17 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
       continue; /* skip routers that reject all */
     }
     n_supported[i] = 0;
-    /* iterate over connections */
-    SMARTLIST_FOREACH_BEGIN(connections, connection_t *, conn) {
-      if (!ap_stream_wants_exit_attention(conn))
-        continue; /* Skip everything but APs in CIRCUIT_WAIT */
-      if (connection_ap_can_use_exit(TO_ENTRY_CONN(conn), node)) {
-        ++n_supported[i];
+    /* iterate over classes of pending connections */
+    SMARTLIST_FOREACH_BEGIN(classes, pending_stream_class_t *, cls) {
+      if (connection_ap_can_use_exit(cls->example, node)) {
+        n_supported[i] += cls->n;
 //        log_fn(LOG_DEBUG,"%s is supported. n_supported[%d] now %d.",
 //               router->nickname, i, n_supported[i]);
       } else {
 //        log_fn(LOG_DEBUG,"%s (index %d) would reject this stream.",
 //               router->nickname, i);
       }
-    } SMARTLIST_FOREACH_END(conn);
+    } SMARTLIST_FOREACH_END(cls);
     if (n_pending_connections > 0 && n_supported[i] == 0) {
       /* Leave best_support at -1 if that's where it is, so we can
        * distinguish it later. */
@@ -3151,6 +3405,8 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
                  need_capacity?", fast":"",
                  need_uptime?", stable":"");
         tor_free(n_supported);
+        SMARTLIST_FOREACH(classes, pending_stream_class_t *, c, tor_free(c));
+        smartlist_free(classes);
         return choose_good_exit_server_general(0, 0);
       }
       log_notice(LD_CIRC, "All routers are down or won't exit%s -- "
@@ -3186,6 +3442,8 @@ choose_good_exit_server_general(int need_uptime, int need_capacity)
   }
 
   tor_free(n_supported);
+  SMARTLIST_FOREACH(classes, pending_stream_class_t *, c, tor_free(c));
+  smartlist_free(classes);
   if (node) {
     log_info(LD_CIRC, "Chose exit server '%s'", node_describe(node));
     return node;
@@ -3689,6 +3947,7 @@ extend_info_from_node(const node_t *node, int for_direct_connect)
     return extend_info_from_router(node->ri, for_direct_connect);
   } else if (node->rs && node->md) {
     tor_addr_t addr;
+    microdesc_parse_if_needed(node->md);
     tor_addr_from_ipv4h(&addr, node->rs->addr);
     return extend_info_alloc(node->rs->nickname,
                              node->identity,
@@ -3826,6 +4085,82 @@ entry_is_time_to_retry(entry_guard_t *e, time_t now)
     return now > (e->last_attempted + 36*60*60);
 }
 
+/** Incremented whenever the directory, our options, or our bridge list
+ * may have changed in a way that affects which of our entry guards are
+ * usable.  A guard whose usable_generation doesn't match needs to have its
+ * usable_* fields filled in again. */
+static unsigned int entry_guard_usability_generation = 1;
+/** The nodelist generation when entry_guard_usability_generation was last
+ * brought up to date with it. */
+static unsigned int entry_guard_usability_nodelist_generation = 0;
+
+/** Return the bit in entry_guard_t.usable_reliability for guards that are
+ * reliable enough when we need (or don't need) uptime and capacity. */
+#define ENTRY_GUARD_RELIABILITY_BIT(need_uptime, need_capacity)     \
+  (1u << ((((need_uptime) ? 1 : 0) << 1) | ((need_capacity) ? 1 : 0)))
+
+/** Note that the directory, our options, or our bridge list may have
+ * changed, so that the usability we've cached for each entry guard may be
+ * wrong. */
+void
+entry_guards_note_usability_changed(void)
+{
+  if (++entry_guard_usability_generation == 0)
+    entry_guard_usability_generation = 1; /* 0 means "never". */
+}
+
+/** Fill in the usable_* fields of <b>e</b> from our current directory
+ * information and options. */
+static void
+entry_guard_compute_usability(entry_guard_t *e)
+{
+  const node_t *node;
+  const or_options_t *options = get_options();
+  int need_uptime, need_capacity;
+
+  e->usable_generation = entry_guard_usability_generation;
+  e->usable_node = NULL;
+  e->usable_reliability = 0;
+  e->usable_by_firewall = 0;
+
+  node = node_get_by_id(e->identity);
+  if (!node || !node_has_descriptor(node)) {
+    e->unusable_msg = "no descriptor";
+    return;
+  }
+  if (options->UseBridges) {
+    if (node_get_purpose(node) != ROUTER_PURPOSE_BRIDGE) {
+      e->unusable_msg = "not a bridge";
+      return;
+    }
+    if (!node_is_a_configured_bridge(node)) {
+      e->unusable_msg = "not a configured bridge";
+      return;
+    }
+  } else { /* !options->UseBridges */
+    if (node_get_purpose(node) != ROUTER_PURPOSE_GENERAL) {
+      e->unusable_msg = "not general-purpose";
+      return;
+    }
+  }
+
+  e->usable_node = node;
+  e->unusable_msg = NULL;
+  if (routerset_contains_node(options->EntryNodes, node)) {
+    /* they asked for it, they get it */
+    e->usable_reliability = 0xf;
+  } else {
+    for (need_uptime = 0; need_uptime <= 1; ++need_uptime) {
+      for (need_capacity = 0; need_capacity <= 1; ++need_capacity) {
+        if (!node_is_unreliable(node, need_uptime, need_capacity, 0))
+          e->usable_reliability |=
+            ENTRY_GUARD_RELIABILITY_BIT(need_uptime, need_capacity);
+      }
+    }
+  }
+  e->usable_by_firewall = fascist_firewall_allows_node(node) ? 1 : 0;
+}
+
 /** Return the node corresponding to <b>e</b>, if <b>e</b> is
  * working well enough that we are willing to use it as an entry
  * right now. (Else return NULL.) In particular, it must be
@@ -3844,8 +4179,6 @@ static INLINE const node_t *
 entry_is_live(entry_guard_t *e, int need_uptime, int need_capacity,
               int assume_reachable, const char **msg)
 {
-  const node_t *node;
-  const or_options_t *options = get_options();
   tor_assert(msg);
 
   if (e->path_bias_disabled) {
@@ -3862,43 +4195,35 @@ entry_is_live(entry_guard_t *e, int need_uptime, int need_capacity,
     *msg = "unreachable";
     return NULL;
   }
-  node = node_get_by_id(e->identity);
-  if (!node || !node_has_descriptor(node)) {
-    *msg = "no descriptor";
-    return NULL;
-  }
-  if (get_options()->UseBridges) {
-    if (node_get_purpose(node) != ROUTER_PURPOSE_BRIDGE) {
-      *msg = "not a bridge";
-      return NULL;
-    }
-    if (!node_is_a_configured_bridge(node)) {
-      *msg = "not a configured bridge";
-      return NULL;
-    }
-  } else { /* !get_options()->UseBridges */
-    if (node_get_purpose(node) != ROUTER_PURPOSE_GENERAL) {
-      *msg = "not general-purpose";
-      return NULL;
-    }
+
+  /* The rest depends only on the directory and our options, so use what
+   * we worked out last time unless one of them has changed since. */
+  if (entry_guard_usability_nodelist_generation !=
+      nodelist_get_generation()) {
+    entry_guard_usability_nodelist_generation = nodelist_get_generation();
+    entry_guards_note_usability_changed();
   }
-  if (routerset_contains_node(options->EntryNodes, node)) {
-    /* they asked for it, they get it */
-    need_uptime = need_capacity = 0;
+  if (e->usable_generation != entry_guard_usability_generation)
+    entry_guard_compute_usability(e);
+
+  if (!e->usable_node) {
+    *msg = e->unusable_msg;
+    return NULL;
   }
-  if (node_is_unreliable(node, need_uptime, need_capacity, 0)) {
+  if (!(e->usable_reliability &
+        ENTRY_GUARD_RELIABILITY_BIT(need_uptime, need_capacity))) {
     *msg = "not fast/stable";
     return NULL;
   }
-  if (!fascist_firewall_allows_node(node)) {
+  if (!e->usable_by_firewall) {
     *msg = "unreachable by config";
     return NULL;
   }
-  return node;
+  return e->usable_node;
 }
 
 /** Return the number of entry guards that we think are usable. */
-static int
+int
 num_live_entry_guards(void)
 {
   int n = 0;
@@ -3918,6 +4243,8 @@ num_live_entry_guards(void)
 static entry_guard_t *
 entry_guard_get_by_id_digest(const char *digest)
 {
+  if (!entry_guards)
+    return NULL;
   SMARTLIST_FOREACH(entry_guards, entry_guard_t *, entry,
                     if (tor_memeq(digest, entry->identity, DIGEST_LEN))
                       return entry;
@@ -3925,6 +4252,14 @@ entry_guard_get_by_id_digest(const char *digest)
   return NULL;
 }
 
+/** Return true iff <b>digest</b> is the identity of one of our entry
+ * guards. */
+int
+is_an_entry_guard(const char *digest)
+{
+  return entry_guard_get_by_id_digest(digest) != NULL;
+}
+
 /** Dump a description of our list of entry guards to the log at level
  * <b>severity</b>. */
 static void
@@ -4479,8 +4814,8 @@ const node_t *
 choose_random_entry(cpath_build_state_t *state)
 {
   const or_options_t *options = get_options();
-  smartlist_t *live_entry_guards = smartlist_new();
-  smartlist_t *exit_family = smartlist_new();
+  smartlist_t *live_entry_guards = smartlist_new_small();
+  smartlist_t *exit_family = smartlist_new_small();
   const node_t *chosen_exit =
     state?build_state_get_exit_node(state) : NULL;
   const node_t *node = NULL;
@@ -4947,6 +5282,7 @@ sweep_bridge_list(void)
       bridge_free(b);
     }
   } SMARTLIST_FOREACH_END(b);
+  entry_guards_note_usability_changed();
 }
 
 /** Initialize the bridge list to empty, creating it if needed. */
@@ -4957,6 +5293,7 @@ clear_bridge_list(void)
     bridge_list = smartlist_new();
   SMARTLIST_FOREACH(bridge_list, bridge_info_t *, b, bridge_free(b));
   smartlist_clear(bridge_list);
+  entry_guards_note_usability_changed();
 }
 
 /** Free the bridge <b>bridge</b>. */
@@ -5251,6 +5588,7 @@ learned_router_identity(const tor_addr_t *addr, uint16_t port,
     memcpy(bridge->identity, digest, DIGEST_LEN);
     log_notice(LD_DIR, "Learned fingerprint %s for bridge %s:%d",
                hex_str(digest, DIGEST_LEN), fmt_addr(addr), port);
+    entry_guards_note_usability_changed();
   }
 }
 
@@ -5344,6 +5682,7 @@ bridge_add_from_config(const tor_addr_t *addr, uint16_t port,
     bridge_list = smartlist_new();
 
   smartlist_add(bridge_list, b);
+  entry_guards_note_usability_changed();
 }
 
 /** Return true iff <b>routerset</b> contains the bridge <b>bridge</b>. */
@@ -5484,13 +5823,16 @@ fetch_bridge_descriptors(const or_options_t *options, time_t now)
   if (!bridge_list)
     return;
 
-  /* If we still have unconfigured managed proxies, don't go and
-     connect to a bridge. */
-  if (pt_proxies_configuration_pending())
-    return;
-
   SMARTLIST_FOREACH_BEGIN(bridge_list, bridge_info_t *, bridge)
     {
+      /* If this bridge's transport might still be coming from a managed
+         proxy we haven't finished configuring, don't go and connect to
+         it yet. Bridges whose transports are ready can go ahead. */
+      if (bridge->transport_name &&
+          !transport_get_by_name(bridge->transport_name) &&
+          !pt_get_inproc_transport(bridge->transport_name) &&
+          pt_proxies_configuration_pending())
+        continue;
       if (!download_status_is_ready(&bridge->fetch_status, now,
                                     IMPOSSIBLE_TO_DOWNLOAD))
         continue; /* don't bother, no need to retry yet */
@@ -5687,11 +6029,10 @@ any_bridge_descriptors_known(void)
 int
 any_pending_bridge_descriptor_fetches(void)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == CONN_TYPE_DIR &&
-        conn->purpose == DIR_PURPOSE_FETCH_SERVERDESC &&
+    if (conn->purpose == DIR_PURPOSE_FETCH_SERVERDESC &&
         TO_DIR_CONN(conn)->router_purpose == ROUTER_PURPOSE_BRIDGE &&
         !conn->marked_for_close &&
         conn->linked &&
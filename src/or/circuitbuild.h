@@ -47,6 +47,9 @@ int circuit_init_cpath_crypto(crypt_path_t *cpath, const char *key_data,
                               int reverse);
 int circuit_finish_handshake(origin_circuit_t *circ, uint8_t cell_type,
                              const uint8_t *reply);
+void circuit_finish_handshake_done(uint32_t circ_id, crypt_path_t *hop,
+                                   int result, const uint8_t *reply,
+                                   char *keys);
 int circuit_truncated(origin_circuit_t *circ, crypt_path_t *layer);
 int onionskin_answer(or_circuit_t *circ, uint8_t cell_type,
                      const char *payload, const char *keys);
@@ -68,11 +71,13 @@ void extend_info_free(extend_info_t *info);
 const node_t *build_state_get_exit_node(cpath_build_state_t *state);
 const char *build_state_get_exit_nickname(cpath_build_state_t *state);
 
+void entry_guards_note_usability_changed(void);
 void entry_guards_compute_status(const or_options_t *options, time_t now);
 int entry_guard_register_connect_status(const char *digest, int succeeded,
                                         int mark_relay_status, time_t now);
 void entry_nodes_should_be_added(void);
 int entry_list_is_constrained(const or_options_t *options);
+int is_an_entry_guard(const char *digest);
 const node_t *choose_random_entry(cpath_build_state_t *state);
 int entry_guards_parse_state(or_state_t *state, int set, char **msg);
 void entry_guards_update_state(or_state_t *state);
@@ -141,6 +146,21 @@ void circuit_build_times_reset(circuit_build_times_t *cbt);
 
 /* Network liveness functions */
 int circuit_build_times_network_check_changed(circuit_build_times_t *cbt);
+
+/** A set of pending streams that every exit node treats alike.  Used by
+ * choose_good_exit_server_general(). */
+typedef struct pending_stream_class_t {
+  /** One of the streams in this class. */
+  const entry_connection_t *example;
+  /** True iff the example is a CONNECT to an IPv4 address literal. */
+  int addr_is_literal;
+  /** How many pending streams are in this class. */
+  int n;
+} pending_stream_class_t;
+
+void pending_stream_classes_add(smartlist_t *classes,
+                                const entry_connection_t *conn);
+int num_live_entry_guards(void);
 #endif
 
 /* Network liveness functions */
@@ -18,6 +18,7 @@
 #include "connection_edge.h"
 #include "connection_or.h"
 #include "control.h"
+#include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "onion.h"
@@ -36,6 +37,26 @@ circuit_t *global_circuitlist=NULL;
 /** A list of all the circuits in CIRCUIT_STATE_OR_WAIT. */
 static smartlist_t *circuits_pending_or_conns=NULL;
 
+/** For each origin circuit purpose, a list of all the origin circuits that
+ * currently have that purpose, or NULL if there have never been any. */
+static smartlist_t *origin_circuits_by_purpose[_CIRCUIT_PURPOSE_MAX+1];
+
+/** A list of all the OR circuits that were made with a CREATE_FAST cell. */
+static smartlist_t *first_hop_or_circuits=NULL;
+
+/** Return the index in cannibalizable_circuits of the list for general
+ * circuits built with the given is_internal, need_uptime, and
+ * need_capacity flags. */
+#define CANNIBALIZE_BUCKET(internal, uptime, capacity)          \
+  ((((internal) ? 1 : 0) << 2) | (((uptime) ? 1 : 0) << 1) |    \
+   ((capacity) ? 1 : 0))
+/** For each combination of build flags, a list of the general-purpose
+ * origin circuits built with those flags that we might still be able to
+ * cannibalize.  Circuits join when they become general-purpose and leave
+ * when they stop being general-purpose; circuit_find_to_cannibalize()
+ * drops the ones that can never be cannibalized as it finds them. */
+static smartlist_t *cannibalizable_circuits[8];
+
 static void circuit_free(circuit_t *circ);
 static void circuit_free_cpath(crypt_path_t *cpath);
 static void circuit_free_cpath_node(crypt_path_t *victim);
@@ -43,47 +64,172 @@ static void cpath_ref_decref(crypt_path_reference_t *cpath_ref);
 
 /********* END VARIABLES ************/
 
-/** A map from OR connection and circuit ID to circuit.  (Lookup performance is
- * very important here, since we need to do it every time a cell arrives.) */
+/** An entry in an OR connection's circuit map, from circuit ID to the
+ * circuit using that ID on the connection.  (Lookup performance is very
+ * important here, since we need to do it every time a cell arrives.)  Each
+ * OR connection has its own map, so lookups only touch that connection's
+ * circuits, and tearing down a connection only visits its own circuits. */
 typedef struct orconn_circid_circuit_map_t {
   HT_ENTRY(orconn_circid_circuit_map_t) node;
-  or_connection_t *or_conn;
   circid_t circ_id;
   circuit_t *circuit;
 } orconn_circid_circuit_map_t;
 
-/** Helper for hash tables: compare the OR connection and circuit ID for a and
- * b, and return less than, equal to, or greater than zero appropriately.
+/** Helper for hash tables: return true iff <b>a</b> and <b>b</b> have the
+ * same circuit ID.
  */
 static INLINE int
 _orconn_circid_entries_eq(orconn_circid_circuit_map_t *a,
                           orconn_circid_circuit_map_t *b)
 {
-  return a->or_conn == b->or_conn && a->circ_id == b->circ_id;
+  return a->circ_id == b->circ_id;
 }
 
-/** Helper: return a hash based on circuit ID and the pointer value of
- * or_conn in <b>a</b>. */
+/** Helper: return a hash based on the circuit ID in <b>a</b>. */
 static INLINE unsigned int
 _orconn_circid_entry_hash(orconn_circid_circuit_map_t *a)
 {
-  return (((unsigned)a->circ_id)<<8) ^ (unsigned)(uintptr_t)(a->or_conn);
+  return (unsigned)a->circ_id;
 }
 
-/** Map from [orconn,circid] to circuit. */
-static HT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t)
-     orconn_circid_circuit_map = HT_INITIALIZER();
+/** Map from circid to circuit, for a single OR connection. */
+HT_HEAD(orconn_circid_map, orconn_circid_circuit_map_t);
 HT_PROTOTYPE(orconn_circid_map, orconn_circid_circuit_map_t, node,
              _orconn_circid_entry_hash, _orconn_circid_entries_eq)
 HT_GENERATE(orconn_circid_map, orconn_circid_circuit_map_t, node,
             _orconn_circid_entry_hash, _orconn_circid_entries_eq, 0.6,
             malloc, realloc, free)
 
-/** The most recently returned entry from circuit_get_by_circid_orconn;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-orconn_circid_circuit_map_t *_last_circid_orconn_ent = NULL;
+/** Number of 64-bit words in a circid_bitmap_t: one bit for each of the
+ * 1\<\<15 circuit IDs in our half of a connection's ID space. */
+#define CIRCID_BITMAP_N_WORDS ((1<<15) / 64)
+/** Number of 64-bit words in the summary of a circid_bitmap_t. */
+#define CIRCID_BITMAP_N_SUMMARY_WORDS (CIRCID_BITMAP_N_WORDS / 64)
+/** Once a connection has this many circuits, we keep a circid_bitmap_t for
+ * it when we pick circuit IDs.  Below that, probing the map one ID at a
+ * time is cheap enough. */
+#define CIRCID_BITMAP_MIN_CIRCUITS 64
+
+/** Which circuit IDs from the half of the ID space that we pick from
+ * (the IDs whose high bit is <b>high_bit</b>) are in use on an OR
+ * connection.  Bit <i>i</i> of the bitmap stands for the ID
+ * high_bit|<i>i</i>; the bit for 0 is always set, since we never use it.
+ * The summary has a set bit for each word of the bitmap that is full, so
+ * that we can find a free ID in a bounded number of steps. */
+typedef struct circid_bitmap_t {
+  /** The high bit of the IDs we track: 0 or 1\<\<15. */
+  circid_t high_bit;
+  /** One bit per ID: set iff the ID is in use. */
+  uint64_t used[CIRCID_BITMAP_N_WORDS];
+  /** One bit per word of <b>used</b>: set iff that word is all ones. */
+  uint64_t full[CIRCID_BITMAP_N_SUMMARY_WORDS];
+} circid_bitmap_t;
+
+/** Return the index of the lowest set bit of the nonzero <b>x</b>. */
+static INLINE unsigned
+circid_bitmap_lowest_bit(uint64_t x)
+{
+  return (unsigned) tor_log2(x & (~x + 1));
+}
+
+/** If <b>id</b> is in the half of the ID space that <b>bm</b> tracks, mark
+ * it used if <b>in_use</b> is true, or free otherwise. */
+static void
+circid_bitmap_set(circid_bitmap_t *bm, circid_t id, int in_use)
+{
+  const unsigned low = id & ((1<<15) - 1);
+  const unsigned w = low >> 6;
+  const uint64_t bit = U64_LITERAL(1) << (low & 63);
+  const uint64_t summary_bit = U64_LITERAL(1) << (w & 63);
+
+  if ((id & (1<<15)) != bm->high_bit || low == 0)
+    return;
+  if (in_use)
+    bm->used[w] |= bit;
+  else
+    bm->used[w] &= ~bit;
+  if (bm->used[w] == ~U64_LITERAL(0))
+    bm->full[w >> 6] |= summary_bit;
+  else
+    bm->full[w >> 6] &= ~summary_bit;
+}
+
+/** Return the first ID, in the low 15 bits, that <b>bm</b> says is free,
+ * starting at <b>start</b> and wrapping around; or 0 if they are all in
+ * use. */
+static unsigned
+circid_bitmap_find_free(const circid_bitmap_t *bm, unsigned start)
+{
+  unsigned w = start >> 6;
+  unsigned i;
+  uint64_t free_bits = ~bm->used[w] & (~U64_LITERAL(0) << (start & 63));
+
+  if (free_bits)
+    return (w << 6) | circid_bitmap_lowest_bit(free_bits);
+
+  /* Use the summary to find the next word after w with a free bit in it,
+   * wrapping around to w itself: its free bits, if any, come before
+   * start. */
+  for (i = 1; i <= CIRCID_BITMAP_N_WORDS; ) {
+    const unsigned cw = (w + i) % CIRCID_BITMAP_N_WORDS;
+    const uint64_t not_full =
+      ~bm->full[cw >> 6] & (~U64_LITERAL(0) << (cw & 63));
+    if (not_full) {
+      const unsigned fw = (cw & ~63u) | circid_bitmap_lowest_bit(not_full);
+      return (fw << 6) | circid_bitmap_lowest_bit(~bm->used[fw]);
+    }
+    i += 64 - (cw & 63);
+  }
+  return 0;
+}
+
+/** Make a new circid_bitmap_t for the IDs with high bit <b>high_bit</b>
+ * that are in use on <b>conn</b>, and return it. */
+static circid_bitmap_t *
+circid_bitmap_new(or_connection_t *conn, circid_t high_bit)
+{
+  circid_bitmap_t *bm = tor_malloc_zero(sizeof(circid_bitmap_t));
+  orconn_circid_circuit_map_t **ent;
+  bm->high_bit = high_bit;
+  bm->used[0] = 1; /* We never use circuit ID 0. */
+  if (conn->circid_map) {
+    HT_FOREACH(ent, orconn_circid_map, conn->circid_map)
+      circid_bitmap_set(bm, (*ent)->circ_id, 1);
+  }
+  return bm;
+}
+
+/** An entry in a circuit's stream map: a cached answer to "which attached
+ * stream has this stream ID?", so that relay_lookup_conn() needn't walk
+ * long stream lists for every cell.  See circuit_stream_map_lookup(). */
+typedef struct circuit_stream_map_entry_t {
+  HT_ENTRY(circuit_stream_map_entry_t) node;
+  streamid_t stream_id;
+  edge_connection_t *conn;
+} circuit_stream_map_entry_t;
+
+/** Helper for hash tables: return true iff <b>a</b> and <b>b</b> have the
+ * same stream ID. */
+static INLINE int
+_circuit_stream_map_entries_eq(circuit_stream_map_entry_t *a,
+                               circuit_stream_map_entry_t *b)
+{
+  return a->stream_id == b->stream_id;
+}
+
+/** Helper: return a hash based on the stream ID in <b>a</b>. */
+static INLINE unsigned int
+_circuit_stream_map_entry_hash(circuit_stream_map_entry_t *a)
+{
+  return a->stream_id;
+}
+
+HT_HEAD(circuit_stream_map, circuit_stream_map_entry_t);
+HT_PROTOTYPE(circuit_stream_map, circuit_stream_map_entry_t, node,
+             _circuit_stream_map_entry_hash, _circuit_stream_map_entries_eq)
+HT_GENERATE(circuit_stream_map, circuit_stream_map_entry_t, node,
+            _circuit_stream_map_entry_hash, _circuit_stream_map_entries_eq,
+            0.6, malloc, realloc, free)
 
 /** Implementation helper for circuit_set_{p,n}_circid_orconn: A circuit ID
  * and/or or_connection for circ has just changed from <b>old_conn, old_id</b>
@@ -118,22 +264,25 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
   if (id == old_id && conn == old_conn)
     return;
 
-  if (_last_circid_orconn_ent &&
-      ((old_id == _last_circid_orconn_ent->circ_id &&
-        old_conn == _last_circid_orconn_ent->or_conn) ||
-       (id == _last_circid_orconn_ent->circ_id &&
-        conn == _last_circid_orconn_ent->or_conn))) {
-    _last_circid_orconn_ent = NULL;
-  }
+  if (direction == CELL_DIRECTION_OUT && old_conn && !old_id &&
+      old_conn->circs_without_id)
+    smartlist_remove(old_conn->circs_without_id, circ);
 
-  if (old_conn) { /* we may need to remove it from the conn-circid map */
+  if (old_conn && old_conn->circid_map) {
+    /* we may need to remove it from the conn-circid map */
     tor_assert(old_conn->_base.magic == OR_CONNECTION_MAGIC);
     search.circ_id = old_id;
-    search.or_conn = old_conn;
-    found = HT_REMOVE(orconn_circid_map, &orconn_circid_circuit_map, &search);
+    found = HT_REMOVE(orconn_circid_map, old_conn->circid_map, &search);
     if (found) {
+      if (old_conn->last_circid_ent == found)
+        old_conn->last_circid_ent = NULL;
+      if (old_conn->circid_bitmap)
+        circid_bitmap_set(old_conn->circid_bitmap, old_id, 0);
       tor_free(found);
-      --old_conn->n_circuits;
+      if (--old_conn->n_circuits == 0) {
+        /* It might be idle now. */
+        connection_schedule_housekeeping(TO_CONN(old_conn), approx_time());
+      }
     }
     if (was_active && old_conn != conn)
       make_circuit_inactive_on_conn(circ,old_conn);
@@ -148,17 +297,21 @@ circuit_set_circid_orconn_helper(circuit_t *circ, int direction,
     return;
 
   /* now add the new one to the conn-circid map */
+  if (!conn->circid_map) {
+    conn->circid_map = tor_malloc(sizeof(struct orconn_circid_map));
+    HT_INIT(orconn_circid_map, conn->circid_map);
+  }
   search.circ_id = id;
-  search.or_conn = conn;
-  found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
+  found = HT_FIND(orconn_circid_map, conn->circid_map, &search);
   if (found) {
     found->circuit = circ;
   } else {
     found = tor_malloc_zero(sizeof(orconn_circid_circuit_map_t));
     found->circ_id = id;
-    found->or_conn = conn;
     found->circuit = circ;
-    HT_INSERT(orconn_circid_map, &orconn_circid_circuit_map, found);
+    HT_INSERT(orconn_circid_map, conn->circid_map, found);
+    if (conn->circid_bitmap)
+      circid_bitmap_set(conn->circid_bitmap, id, 1);
   }
   if (make_active && old_conn != conn)
     make_circuit_active_on_conn(circ,conn);
@@ -193,6 +346,23 @@ circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
     tor_assert(bool_eq(circ->n_conn_cells.n, circ->next_active_on_n_conn));
 }
 
+/** Set the n_conn field of a circuit <b>circ</b> that doesn't have one yet
+ * to <b>conn</b>, before we've picked a circuit ID for it there.  We keep
+ * track of such circuits on <b>conn</b>, since they aren't in its
+ * (orconn,id)-\>circuit map, so that circuit_unlink_all_from_or_conn()
+ * can find them.  Once we pick an ID, call circuit_set_n_circid_orconn().
+ */
+void
+circuit_set_n_conn_without_circid(circuit_t *circ, or_connection_t *conn)
+{
+  tor_assert(!circ->n_conn);
+  tor_assert(!circ->n_circ_id);
+  circ->n_conn = conn;
+  if (!conn->circs_without_id)
+    conn->circs_without_id = smartlist_new();
+  smartlist_add(conn->circs_without_id, circ);
+}
+
 /** Change the state of <b>circ</b> to <b>state</b>, adding it to or removing
  * it from lists as appropriate. */
 void
@@ -216,6 +386,154 @@ circuit_set_state(circuit_t *circ, uint8_t state)
   circ->state = state;
 }
 
+/** Add <b>circ</b> to the end of the index list *<b>listp</b>, allocating
+ * the list if needed. */
+static void
+circuit_index_add(smartlist_t **listp, circuit_t *circ)
+{
+  tor_assert(circ->index_idx == -1);
+  if (!*listp)
+    *listp = smartlist_new();
+  circ->index_idx = smartlist_len(*listp);
+  smartlist_add(*listp, circ);
+}
+
+/** Remove <b>circ</b> from the index list <b>list</b>, which must hold it,
+ * in constant time. */
+static void
+circuit_index_remove(smartlist_t *list, circuit_t *circ)
+{
+  int idx = circ->index_idx;
+  tor_assert(list);
+  tor_assert(idx >= 0 && idx < smartlist_len(list));
+  tor_assert(smartlist_get(list, idx) == circ);
+  smartlist_del(list, idx);
+  if (idx < smartlist_len(list)) {
+    circuit_t *moved = smartlist_get(list, idx);
+    moved->index_idx = idx;
+  }
+  circ->index_idx = -1;
+}
+
+/** Return the list in cannibalizable_circuits that <b>circ</b> belongs
+ * in, allocating it if needed. */
+static smartlist_t *
+cannibalize_bucket_for(const origin_circuit_t *circ)
+{
+  const cpath_build_state_t *state = circ->build_state;
+  smartlist_t **listp = &cannibalizable_circuits[
+           CANNIBALIZE_BUCKET(state->is_internal, state->need_uptime,
+                              state->need_capacity)];
+  if (!*listp)
+    *listp = smartlist_new();
+  return *listp;
+}
+
+/** Add <b>circ</b> to its list of circuits we might cannibalize. */
+static void
+cannibalize_index_add(origin_circuit_t *circ)
+{
+  smartlist_t *list = cannibalize_bucket_for(circ);
+  tor_assert(circ->cannibalize_idx == -1);
+  circ->cannibalize_idx = smartlist_len(list);
+  smartlist_add(list, circ);
+}
+
+/** Remove <b>circ</b> from its list of circuits we might cannibalize, if
+ * it is in one, in constant time. */
+static void
+cannibalize_index_remove(origin_circuit_t *circ)
+{
+  smartlist_t *list;
+  int idx = circ->cannibalize_idx;
+  if (idx < 0)
+    return;
+  list = cannibalize_bucket_for(circ);
+  tor_assert(idx < smartlist_len(list));
+  tor_assert(smartlist_get(list, idx) == circ);
+  smartlist_del(list, idx);
+  if (idx < smartlist_len(list)) {
+    origin_circuit_t *moved = smartlist_get(list, idx);
+    moved->cannibalize_idx = idx;
+  }
+  circ->cannibalize_idx = -1;
+}
+
+/** Set the purpose of the origin circuit <b>circ</b> to <b>purpose</b>,
+ * moving it between the lists in origin_circuits_by_purpose and
+ * cannibalizable_circuits as appropriate.  This doesn't tell the
+ * controller anything; most callers want circuit_change_purpose()
+ * instead. */
+void
+circuit_set_purpose(circuit_t *circ, uint8_t purpose)
+{
+  /* Check the magic: a fresh circuit has no purpose yet, so
+   * CIRCUIT_IS_ORIGIN() can't tell. */
+  tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+  tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
+  tor_assert(purpose <= _CIRCUIT_PURPOSE_MAX);
+
+  if (circ->purpose == purpose)
+    return;
+  if (circ->index_idx >= 0)
+    circuit_index_remove(origin_circuits_by_purpose[circ->purpose], circ);
+  circuit_index_add(&origin_circuits_by_purpose[purpose], circ);
+  if (circ->purpose == CIRCUIT_PURPOSE_C_GENERAL)
+    cannibalize_index_remove(TO_ORIGIN_CIRCUIT(circ));
+  else if (purpose == CIRCUIT_PURPOSE_C_GENERAL &&
+           TO_ORIGIN_CIRCUIT(circ)->build_state)
+    cannibalize_index_add(TO_ORIGIN_CIRCUIT(circ));
+  circ->purpose = purpose;
+}
+
+/** Set whether the OR circuit <b>circ</b> was made with a CREATE_FAST
+ * cell, adding it to or removing it from first_hop_or_circuits as
+ * appropriate. */
+void
+circuit_set_is_first_hop(or_circuit_t *circ, int is_first_hop)
+{
+  is_first_hop = !!is_first_hop;
+  if (circ->is_first_hop == (unsigned)is_first_hop)
+    return;
+  if (is_first_hop)
+    circuit_index_add(&first_hop_or_circuits, TO_CIRCUIT(circ));
+  else
+    circuit_index_remove(first_hop_or_circuits, TO_CIRCUIT(circ));
+  circ->is_first_hop = is_first_hop;
+}
+
+/** Return a list of all the origin circuits whose purpose is
+ * <b>purpose</b>, including those marked for close.  Return NULL if there
+ * are none.  The caller must not modify the list. */
+const smartlist_t *
+circuit_get_all_origin_by_purpose(uint8_t purpose)
+{
+  if (!CIRCUIT_PURPOSE_IS_ORIGIN(purpose) || purpose > _CIRCUIT_PURPOSE_MAX)
+    return NULL;
+  return origin_circuits_by_purpose[purpose];
+}
+
+/** Append to <b>out</b> every origin circuit, including those marked for
+ * close, without visiting any OR circuits. */
+void
+circuit_get_all_origin(smartlist_t *out)
+{
+  int p;
+  for (p = _CIRCUIT_PURPOSE_OR_MAX+1; p <= _CIRCUIT_PURPOSE_MAX; ++p) {
+    if (origin_circuits_by_purpose[p])
+      smartlist_add_all(out, origin_circuits_by_purpose[p]);
+  }
+}
+
+/** Return a list of all the OR circuits that were made with a CREATE_FAST
+ * cell, including those marked for close, or NULL if there are none.  The
+ * caller must not modify the list. */
+const smartlist_t *
+circuit_get_all_first_hop(void)
+{
+  return first_hop_or_circuits;
+}
+
 /** Add <b>circ</b> to the global list of circuits. This is called only from
  * within circuit_new.
  */
@@ -498,9 +816,10 @@ circuit_purpose_to_string(uint8_t purpose)
 int32_t
 circuit_initial_package_window(void)
 {
-  int32_t num = networkstatus_get_param(NULL, "circwindow", CIRCWINDOW_START,
-                                        CIRCWINDOW_START_MIN,
-                                        CIRCWINDOW_START_MAX);
+  int32_t num = networkstatus_get_param_by_id(NULL, NET_PARAM_CIRCWINDOW,
+                                              CIRCWINDOW_START,
+                                              CIRCWINDOW_START_MIN,
+                                              CIRCWINDOW_START_MAX);
   /* If the consensus tells us a negative number, we'd assert. */
   if (num < 0)
     num = CIRCWINDOW_START;
@@ -513,16 +832,19 @@ static void
 init_circuit_base(circuit_t *circ)
 {
   tor_gettimeofday(&circ->timestamp_created);
+  circ->timestamp_created_mono = tor_monotime_nsec();
 
   circ->package_window = circuit_initial_package_window();
   circ->deliver_window = CIRCWINDOW_START;
 
   /* Initialize the cell_ewma_t structure */
-  circ->n_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
-  circ->n_cell_ewma.cell_count = 0.0;
+  circ->n_cell_ewma.log_cell_count = CELL_EWMA_LOG_ZERO;
   circ->n_cell_ewma.heap_index = -1;
   circ->n_cell_ewma.is_for_p_conn = 0;
 
+  /* It's not in any index list yet. */
+  circ->index_idx = -1;
+
   circuit_add(circ);
 }
 
@@ -537,13 +859,14 @@ origin_circuit_new(void)
    * controller */
   static uint32_t n_circuits_allocated = 1;
 
-  circ = tor_malloc_zero(sizeof(origin_circuit_t));
+  circ = tor_malloc_zero_tagged(MEMTAG_CIRCUIT, sizeof(origin_circuit_t));
   circ->_base.magic = ORIGIN_CIRCUIT_MAGIC;
 
   circ->next_stream_id = crypto_rand_int(1<<16);
   circ->global_identifier = n_circuits_allocated++;
   circ->remaining_relay_early_cells = MAX_RELAY_EARLY_CELLS_PER_CIRCUIT;
   circ->remaining_relay_early_cells -= crypto_rand_int(2);
+  circ->cannibalize_idx = -1;
 
   init_circuit_base(TO_CIRCUIT(circ));
 
@@ -560,7 +883,7 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
   /* CircIDs */
   or_circuit_t *circ;
 
-  circ = tor_malloc_zero(sizeof(or_circuit_t));
+  circ = tor_malloc_zero_tagged(MEMTAG_CIRCUIT, sizeof(or_circuit_t));
   circ->_base.magic = OR_CIRCUIT_MAGIC;
 
   if (p_conn)
@@ -573,8 +896,7 @@ or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn)
   /* Initialize the cell_ewma_t structure */
 
   /* Initialize the cell counts to 0 */
-  circ->p_cell_ewma.cell_count = 0.0;
-  circ->p_cell_ewma.last_adjusted_tick = cell_ewma_get_tick();
+  circ->p_cell_ewma.log_cell_count = CELL_EWMA_LOG_ZERO;
   circ->p_cell_ewma.is_for_p_conn = 1;
 
   /* It's not in any heap yet. */
@@ -598,6 +920,7 @@ circuit_free(circuit_t *circ)
     mem = ocirc;
     memlen = sizeof(origin_circuit_t);
     tor_assert(circ->magic == ORIGIN_CIRCUIT_MAGIC);
+    cannibalize_index_remove(ocirc);
     if (ocirc->build_state) {
         extend_info_free(ocirc->build_state->chosen_exit);
         circuit_free_cpath_node(ocirc->build_state->pending_final_cpath);
@@ -605,6 +928,9 @@ circuit_free(circuit_t *circ)
     }
     tor_free(ocirc->build_state);
 
+    if (circ->index_idx >= 0)
+      circuit_index_remove(origin_circuits_by_purpose[circ->purpose], circ);
+
     circuit_free_cpath(ocirc->cpath);
 
     crypto_pk_free(ocirc->intro_key);
@@ -633,12 +959,18 @@ circuit_free(circuit_t *circ)
     crypto_cipher_free(ocirc->n_crypto);
     crypto_digest_free(ocirc->n_digest);
 
+    /* Don't leave a dangling pointer on the onion queue. */
+    if (ocirc->onionqueue_entry)
+      onion_pending_remove(ocirc);
+
     if (ocirc->rend_splice) {
       or_circuit_t *other = ocirc->rend_splice;
       tor_assert(other->_base.magic == OR_CIRCUIT_MAGIC);
       other->rend_splice = NULL;
     }
 
+    circuit_set_is_first_hop(ocirc, 0);
+
     /* remove from map. */
     circuit_set_p_circid_orconn(ocirc, 0, NULL);
 
@@ -647,6 +979,9 @@ circuit_free(circuit_t *circ)
     cell_queue_clear(&ocirc->p_conn_cells);
   }
 
+  circuit_keystream_forget(circ);
+  circuit_stream_map_clear(circ);
+  tor_free(circ->queue_delay_histogram);
   extend_info_free(circ->n_hop);
   tor_free(circ->n_conn_onionskin);
 
@@ -658,7 +993,95 @@ circuit_free(circuit_t *circ)
   cell_queue_clear(&circ->n_conn_cells);
 
   memset(mem, 0xAA, memlen); /* poison memory */
-  tor_free(mem);
+  tor_free_tagged(mem);
+}
+
+/** Return the stream that the stream map of <b>circ</b> remembers for
+ * <b>stream_id</b>, or NULL if it has no entry.  A stream returned here is
+ * attached to <b>circ</b>, and when it was remembered it was the first
+ * stream in its list with that ID; the caller must still check whether it
+ * is usable.
+ */
+edge_connection_t *
+circuit_stream_map_lookup(circuit_t *circ, streamid_t stream_id)
+{
+  circuit_stream_map_entry_t search, *found;
+
+  if (!circ->stream_map)
+    return NULL;
+
+  search.stream_id = stream_id;
+  found = HT_FIND(circuit_stream_map, circ->stream_map, &search);
+  if (!found)
+    return NULL;
+  if (PREDICT_UNLIKELY(found->conn->stream_id != stream_id ||
+                       found->conn->on_circuit != circ)) {
+    log_warn(LD_BUG, "Stale entry for stream %d in circuit stream map.",
+             stream_id);
+    HT_REMOVE(circuit_stream_map, circ->stream_map, found);
+    tor_free(found);
+    return NULL;
+  }
+  return found->conn;
+}
+
+/** Remember in the stream map of <b>circ</b> that <b>conn</b> is the stream
+ * to use for its stream ID, creating the map if <b>circ</b> doesn't have
+ * one yet.  Only call this with a stream that relay_lookup_conn() just found
+ * by walking the circuit's n_streams or p_streams list. */
+void
+circuit_stream_map_set(circuit_t *circ, edge_connection_t *conn)
+{
+  circuit_stream_map_entry_t search, *found;
+
+  if (!circ->stream_map) {
+    circ->stream_map = tor_malloc(sizeof(struct circuit_stream_map));
+    HT_INIT(circuit_stream_map, circ->stream_map);
+  }
+
+  search.stream_id = conn->stream_id;
+  found = HT_FIND(circuit_stream_map, circ->stream_map, &search);
+  if (!found) {
+    found = tor_malloc_zero(sizeof(circuit_stream_map_entry_t));
+    found->stream_id = conn->stream_id;
+    HT_INSERT(circuit_stream_map, circ->stream_map, found);
+  }
+  found->conn = conn;
+}
+
+/** Forget whatever the stream map of <b>circ</b> remembers for the stream ID
+ * of <b>conn</b>.  Call this whenever <b>conn</b> is attached to or detached
+ * from <b>circ</b>, or is about to change its stream ID, so that the map
+ * never holds a stream that a walk of the stream lists wouldn't find. */
+void
+circuit_stream_map_remove(circuit_t *circ, const edge_connection_t *conn)
+{
+  circuit_stream_map_entry_t search, *found;
+
+  if (!circ->stream_map)
+    return;
+
+  search.stream_id = conn->stream_id;
+  found = HT_REMOVE(circuit_stream_map, circ->stream_map, &search);
+  tor_free(found);
+}
+
+/** Release the stream map of <b>circ</b>, if it has one. */
+void
+circuit_stream_map_clear(circuit_t *circ)
+{
+  circuit_stream_map_entry_t **ent, **next, *this;
+
+  if (!circ->stream_map)
+    return;
+
+  for (ent = HT_START(circuit_stream_map, circ->stream_map); ent; ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(circuit_stream_map, circ->stream_map, ent);
+    tor_free(this);
+  }
+  HT_CLEAR(circuit_stream_map, circ->stream_map);
+  tor_free(circ->stream_map);
 }
 
 /** Deallocate space associated with the linked list <b>cpath</b>. */
@@ -686,6 +1109,7 @@ void
 circuit_free_all(void)
 {
   circuit_t *next;
+  int i;
   while (global_circuitlist) {
     next = global_circuitlist->next;
     if (! CIRCUIT_IS_ORIGIN(global_circuitlist)) {
@@ -704,7 +1128,18 @@ circuit_free_all(void)
   smartlist_free(circuits_pending_or_conns);
   circuits_pending_or_conns = NULL;
 
-  HT_CLEAR(orconn_circid_map, &orconn_circid_circuit_map);
+  for (i = 0; i <= _CIRCUIT_PURPOSE_MAX; ++i) {
+    smartlist_free(origin_circuits_by_purpose[i]);
+    origin_circuits_by_purpose[i] = NULL;
+  }
+  smartlist_free(first_hop_or_circuits);
+  first_hop_or_circuits = NULL;
+  for (i = 0; i < (int)(sizeof(cannibalizable_circuits)/
+                        sizeof(cannibalizable_circuits[0])); ++i) {
+    smartlist_free(cannibalizable_circuits[i]);
+    cannibalizable_circuits[i] = NULL;
+  }
+
 }
 
 /** Deallocate space associated with the cpath node <b>victim</b>. */
@@ -840,15 +1275,15 @@ circuit_get_by_circid_orconn_impl(circid_t circ_id, or_connection_t *conn)
   orconn_circid_circuit_map_t search;
   orconn_circid_circuit_map_t *found;
 
-  if (_last_circid_orconn_ent &&
-      circ_id == _last_circid_orconn_ent->circ_id &&
-      conn == _last_circid_orconn_ent->or_conn) {
-    found = _last_circid_orconn_ent;
-  } else {
+  if (conn->last_circid_ent &&
+      circ_id == conn->last_circid_ent->circ_id) {
+    found = conn->last_circid_ent;
+  } else if (conn->circid_map) {
     search.circ_id = circ_id;
-    search.or_conn = conn;
-    found = HT_FIND(orconn_circid_map, &orconn_circid_circuit_map, &search);
-    _last_circid_orconn_ent = found;
+    found = HT_FIND(orconn_circid_map, conn->circid_map, &search);
+    conn->last_circid_ent = found;
+  } else {
+    found = NULL;
   }
   if (found && found->circuit)
     return found->circuit;
@@ -901,6 +1336,39 @@ circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn)
   return circuit_get_by_circid_orconn_impl(circ_id, conn) != NULL;
 }
 
+/** Return an ID that no circuit, marked or not, is using on <b>conn</b>:
+ * the first one with high bit <b>high_bit</b> (0 or 1\<\<15) whose low 15
+ * bits are <b>start</b> or come after it, wrapping around past 1\<\<15-1
+ * to 1.  Return 0 if every such ID is in use.  Once <b>conn</b> has many
+ * circuits, this takes a bounded number of steps however full it is. */
+circid_t
+circuit_id_get_unused_on_orconn(or_connection_t *conn, circid_t high_bit,
+                                circid_t start)
+{
+  unsigned low;
+
+  tor_assert(start > 0 && start < 1<<15);
+  tor_assert(high_bit == 0 || high_bit == 1<<15);
+
+  if (!conn->circid_bitmap && conn->n_circuits < CIRCID_BITMAP_MIN_CIRCUITS) {
+    /* Few enough circuits that at most n_circuits+1 probes will do. */
+    low = start;
+    while (circuit_id_in_use_on_orconn((circid_t)(high_bit|low), conn)) {
+      if (++low >= 1<<15)
+        low = 1;
+    }
+    return (circid_t)(high_bit|low);
+  }
+
+  if (conn->circid_bitmap && conn->circid_bitmap->high_bit != high_bit)
+    tor_free(conn->circid_bitmap);
+  if (!conn->circid_bitmap)
+    conn->circid_bitmap = circid_bitmap_new(conn, high_bit);
+
+  low = circid_bitmap_find_free(conn->circid_bitmap, start);
+  return low ? (circid_t)(high_bit|low) : 0;
+}
+
 /** Return the circuit that a given edge connection is using. */
 circuit_t *
 circuit_get_by_edge_conn(edge_connection_t *conn)
@@ -922,11 +1390,26 @@ circuit_get_by_edge_conn(edge_connection_t *conn)
 void
 circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
 {
-  circuit_t *circ;
+  smartlist_t *circs;
+  orconn_circid_circuit_map_t **ent;
 
   connection_or_unlink_all_active_circs(conn);
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
+  if (!conn->circid_map && !conn->circs_without_id)
+    return;
+
+  /* Every circuit on conn is in its map, or has no ID on it yet; collect
+   * them first, since unlinking them removes them from the map and the
+   * list. */
+  circs = smartlist_new();
+  if (conn->circid_map) {
+    HT_FOREACH(ent, orconn_circid_map, conn->circid_map)
+      smartlist_add(circs, (*ent)->circuit);
+  }
+  if (conn->circs_without_id)
+    smartlist_add_all(circs, conn->circs_without_id);
+
+  SMARTLIST_FOREACH_BEGIN(circs, circuit_t *, circ) {
     int mark = 0;
     if (circ->n_conn == conn) {
         circuit_set_n_circid_orconn(circ, 0, NULL);
@@ -941,7 +1424,32 @@ circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason)
     }
     if (mark && !circ->marked_for_close)
       circuit_mark_for_close(circ, reason);
+  } SMARTLIST_FOREACH_END(circ);
+
+  smartlist_free(circs);
+}
+
+/** Release the circuit ID map of the OR connection <b>conn</b>, which is
+ * about to be freed, along with its list of circuits without IDs. */
+void
+circuit_free_orconn_circid_map(or_connection_t *conn)
+{
+  orconn_circid_circuit_map_t **ent, **next, *this;
+
+  smartlist_free(conn->circs_without_id);
+  conn->circs_without_id = NULL;
+  if (!conn->circid_map)
+    return;
+
+  for (ent = HT_START(orconn_circid_map, conn->circid_map); ent; ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(orconn_circid_map, conn->circid_map, ent);
+    tor_free(this);
   }
+  HT_CLEAR(orconn_circid_map, conn->circid_map);
+  tor_free(conn->circid_map);
+  conn->last_circid_ent = NULL;
+  tor_free(conn->circid_bitmap);
 }
 
 /** Return a circ such that
@@ -974,33 +1482,39 @@ circuit_get_ready_rend_circ_by_rend_data(const rend_data_t *rend_data)
   return NULL;
 }
 
-/** Return the first circuit originating here in global_circuitlist after
- * <b>start</b> whose purpose is <b>purpose</b>, and where
- * <b>digest</b> (if set) matches the rend_pk_digest field. Return NULL if no
- * circuit is found.  If <b>start</b> is NULL, begin at the start of the list.
+/** Return the first circuit originating here in the list of circuits with
+ * purpose <b>purpose</b> after <b>start</b>, where <b>digest</b> (if set)
+ * matches the rend_pk_digest field. Return NULL if no circuit is found, or
+ * if <b>start</b> no longer has that purpose.  If <b>start</b> is NULL,
+ * begin at the start of the list.
  */
 origin_circuit_t *
 circuit_get_next_by_pk_and_purpose(origin_circuit_t *start,
                                    const char *digest, uint8_t purpose)
 {
-  circuit_t *circ;
+  const smartlist_t *circs;
+  int idx;
   tor_assert(CIRCUIT_PURPOSE_IS_ORIGIN(purpose));
+  circs = circuit_get_all_origin_by_purpose(purpose);
+  if (!circs)
+    return NULL;
   if (start == NULL)
-    circ = global_circuitlist;
+    idx = 0;
+  else if (TO_CIRCUIT(start)->purpose != purpose)
+    return NULL;
   else
-    circ = TO_CIRCUIT(start)->next;
+    idx = TO_CIRCUIT(start)->index_idx + 1;
 
-  for ( ; circ; circ = circ->next) {
-    if (circ->marked_for_close)
-      continue;
-    if (circ->purpose != purpose)
+  for ( ; idx < smartlist_len(circs); ++idx) {
+    origin_circuit_t *circ = smartlist_get(circs, idx);
+    if (TO_CIRCUIT(circ)->marked_for_close)
       continue;
     if (!digest)
-      return TO_ORIGIN_CIRCUIT(circ);
-    else if (TO_ORIGIN_CIRCUIT(circ)->rend_data &&
-             tor_memeq(TO_ORIGIN_CIRCUIT(circ)->rend_data->rend_pk_digest,
+      return circ;
+    else if (circ->rend_data &&
+             tor_memeq(circ->rend_data->rend_pk_digest,
                      digest, DIGEST_LEN))
-      return TO_ORIGIN_CIRCUIT(circ);
+      return circ;
   }
   return NULL;
 }
@@ -1044,6 +1558,64 @@ circuit_get_intro_point(const char *digest)
                                      DIGEST_LEN);
 }
 
+/** Return true iff <b>circ</b>, from one of the lists in
+ * cannibalizable_circuits, can never again be cannibalized, and so can be
+ * dropped from its list. */
+static int
+circuit_is_never_cannibalizable(const origin_circuit_t *circ)
+{
+  const circuit_t *_circ = TO_CIRCUIT(circ);
+  return _circ->marked_for_close ||
+    _circ->timestamp_dirty ||
+    !circ->remaining_relay_early_cells ||
+    circ->build_state->onehop_tunnel ||
+    (_circ->state == CIRCUIT_STATE_OPEN &&
+     circ->build_state->desired_path_len != DEFAULT_ROUTE_LEN);
+}
+
+/** Return true iff we could cannibalize <b>circ</b> to extend to
+ * <b>info</b> (if provided), given that circuit_is_never_cannibalizable()
+ * is false for it. */
+static int
+circuit_can_cannibalize_to(const origin_circuit_t *circ,
+                           const extend_info_t *info,
+                           const or_options_t *options)
+{
+  if (TO_CIRCUIT(circ)->state != CIRCUIT_STATE_OPEN ||
+      circ->isolation_values_set)
+    return 0;
+  if (info) {
+    /* need to make sure we don't duplicate hops */
+    crypt_path_t *hop = circ->cpath;
+    const node_t *ri1 = node_get_by_id(info->identity_digest);
+    do {
+      const node_t *ri2;
+      if (tor_memeq(hop->extend_info->identity_digest,
+                  info->identity_digest, DIGEST_LEN))
+        return 0;
+      if (ri1 &&
+          (ri2 = node_get_by_id(hop->extend_info->identity_digest))
+          && nodes_in_same_family(ri1, ri2))
+        return 0;
+      hop=hop->next;
+    } while (hop!=circ->cpath);
+  }
+  if (options->ExcludeNodes) {
+    /* Make sure no existing nodes in the circuit are excluded for
+     * general use.  (This may be possible if StrictNodes is 0, and we
+     * thought we needed to use an otherwise excluded node for, say, a
+     * directory operation.) */
+    crypt_path_t *hop = circ->cpath;
+    do {
+      if (routerset_contains_extendinfo(options->ExcludeNodes,
+                                        hop->extend_info))
+        return 0;
+      hop = hop->next;
+    } while (hop != circ->cpath);
+  }
+  return 1;
+}
+
 /** Return a circuit that is open, is CIRCUIT_PURPOSE_C_GENERAL,
  * has a timestamp_dirty value of 0, has flags matching the CIRCLAUNCH_*
  * flags in <b>flags</b>, and if info is defined, does not already use info
@@ -1059,12 +1631,11 @@ origin_circuit_t *
 circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
                             int flags)
 {
-  circuit_t *_circ;
-  origin_circuit_t *best=NULL;
   int need_uptime = (flags & CIRCLAUNCH_NEED_UPTIME) != 0;
   int need_capacity = (flags & CIRCLAUNCH_NEED_CAPACITY) != 0;
   int internal = (flags & CIRCLAUNCH_IS_INTERNAL) != 0;
   const or_options_t *options = get_options();
+  int uptime, capacity;
 
   /* Make sure we're not trying to create a onehop circ by
    * cannibalization. */
@@ -1075,56 +1646,30 @@ circuit_find_to_cannibalize(uint8_t purpose, extend_info_t *info,
             "capacity %d, internal %d",
             purpose, need_uptime, need_capacity, internal);
 
-  for (_circ=global_circuitlist; _circ; _circ = _circ->next) {
-    if (CIRCUIT_IS_ORIGIN(_circ) &&
-        _circ->state == CIRCUIT_STATE_OPEN &&
-        !_circ->marked_for_close &&
-        _circ->purpose == CIRCUIT_PURPOSE_C_GENERAL &&
-        !_circ->timestamp_dirty) {
-      origin_circuit_t *circ = TO_ORIGIN_CIRCUIT(_circ);
-      if ((!need_uptime || circ->build_state->need_uptime) &&
-          (!need_capacity || circ->build_state->need_capacity) &&
-          (internal == circ->build_state->is_internal) &&
-          circ->remaining_relay_early_cells &&
-          circ->build_state->desired_path_len == DEFAULT_ROUTE_LEN &&
-          !circ->build_state->onehop_tunnel &&
-          !circ->isolation_values_set) {
-        if (info) {
-          /* need to make sure we don't duplicate hops */
-          crypt_path_t *hop = circ->cpath;
-          const node_t *ri1 = node_get_by_id(info->identity_digest);
-          do {
-            const node_t *ri2;
-            if (tor_memeq(hop->extend_info->identity_digest,
-                        info->identity_digest, DIGEST_LEN))
-              goto next;
-            if (ri1 &&
-                (ri2 = node_get_by_id(hop->extend_info->identity_digest))
-                && nodes_in_same_family(ri1, ri2))
-              goto next;
-            hop=hop->next;
-          } while (hop!=circ->cpath);
-        }
-        if (options->ExcludeNodes) {
-          /* Make sure no existing nodes in the circuit are excluded for
-           * general use.  (This may be possible if StrictNodes is 0, and we
-           * thought we needed to use an otherwise excluded node for, say, a
-           * directory operation.) */
-          crypt_path_t *hop = circ->cpath;
-          do {
-            if (routerset_contains_extendinfo(options->ExcludeNodes,
-                                              hop->extend_info))
-              goto next;
-            hop = hop->next;
-          } while (hop != circ->cpath);
+  /* Look at the lists of circuits without uptime first, if we may use
+   * them, since we'd rather save uptime circuits for streams that need
+   * them. */
+  for (uptime = need_uptime; uptime <= 1; ++uptime) {
+    for (capacity = need_capacity; capacity <= 1; ++capacity) {
+      smartlist_t *list = cannibalizable_circuits[
+                     CANNIBALIZE_BUCKET(internal, uptime, capacity)];
+      int i = 0;
+      if (!list)
+        continue;
+      while (i < smartlist_len(list)) {
+        origin_circuit_t *circ = smartlist_get(list, i);
+        if (circuit_is_never_cannibalizable(circ)) {
+          /* Some other circuit takes its place at i. */
+          cannibalize_index_remove(circ);
+          continue;
         }
-        if (!best || (best->build_state->need_uptime && !need_uptime))
-          best = circ;
-      next: ;
+        if (circuit_can_cannibalize_to(circ, info, options))
+          return circ;
+        ++i;
       }
     }
   }
-  return best;
+  return NULL;
 }
 
 /** Return the number of hops in circuit's path. */
@@ -1197,6 +1742,115 @@ circuit_expire_all_dirty_circs(void)
   }
 }
 
+/** Return the age of the oldest cell queued on <b>c</b>, in milliseconds,
+ * as of <b>now</b>.  Return 0 if no cells are queued on <b>c</b>. */
+static uint32_t
+circuit_max_queued_cell_age(circuit_t *c, uint32_t now)
+{
+  uint32_t age = 0;
+  const cell_queue_block_t *head;
+  if ((head = c->n_conn_cells.head))
+    age = now - head->inserted_time[head->first];
+
+  if (! CIRCUIT_IS_ORIGIN(c)) {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(c);
+    if ((head = orcirc->p_conn_cells.head)) {
+      uint32_t age2 = now - head->inserted_time[head->first];
+      if (age2 > age)
+        return age2;
+    }
+  }
+  return age;
+}
+
+/** Helper for sorting circuits by the age of their oldest queued cell,
+ * oldest first.  Uses the age_tmp field set by circuits_handle_oom(). */
+static int
+circuits_compare_by_oldest_queued_cell(const void **a_, const void **b_)
+{
+  const circuit_t *a = *a_;
+  const circuit_t *b = *b_;
+  if (a->age_tmp > b->age_tmp)
+    return -1;
+  else if (a->age_tmp < b->age_tmp)
+    return 1;
+  else
+    return 0;
+}
+
+/** Release all the cells queued on <b>circ</b>, which must be marked for
+ * close. */
+static void
+marked_circuit_free_cells(circuit_t *circ)
+{
+  tor_assert(circ->marked_for_close);
+  if (circ->n_conn)
+    circuit_clear_cell_queue(circ, circ->n_conn);
+  else
+    cell_queue_clear(&circ->n_conn_cells);
+  if (! CIRCUIT_IS_ORIGIN(circ)) {
+    or_circuit_t *orcirc = TO_OR_CIRCUIT(circ);
+    if (orcirc->p_conn)
+      circuit_clear_cell_queue(circ, orcirc->p_conn);
+    else
+      cell_queue_clear(&orcirc->p_conn_cells);
+  }
+}
+
+/** When we're out of memory for cell queues, shrink them to this fraction
+ * of MaxMemInCellQueues. */
+#define FRACTION_OF_CELLS_TO_RETAIN_ON_OOM 0.90
+
+/** We're out of memory for cells, having allocated
+ * <b>current_allocation</b> bytes' worth of cell queues.  Kill circuits,
+ * starting with the ones whose oldest queued cell has waited longest,
+ * until we're back under FRACTION_OF_CELLS_TO_RETAIN_ON_OOM of
+ * MaxMemInCellQueues. */
+void
+circuits_handle_oom(size_t current_allocation)
+{
+  smartlist_t *circlist;
+  circuit_t *circ;
+  size_t target;
+  int n_circuits_killed = 0;
+  uint32_t now = cell_queue_now_msec();
+
+  log_notice(LD_GENERAL, "We're low on memory.  Killing circuits with "
+             "over-long queues. (This behavior is controlled by "
+             "MaxMemInCellQueues.)");
+
+  target = (size_t)(get_options()->MaxMemInCellQueues *
+                    FRACTION_OF_CELLS_TO_RETAIN_ON_OOM);
+
+  circlist = smartlist_new();
+  for (circ = global_circuitlist; circ; circ = circ->next) {
+    int has_cells = circ->n_conn_cells.head != NULL ||
+      (!CIRCUIT_IS_ORIGIN(circ) && TO_OR_CIRCUIT(circ)->p_conn_cells.head);
+    if (!has_cells)
+      continue;
+    circ->age_tmp = circuit_max_queued_cell_age(circ, now);
+    smartlist_add(circlist, circ);
+  }
+
+  smartlist_sort(circlist, circuits_compare_by_oldest_queued_cell);
+
+  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+    if (cell_queues_get_total_allocation() <= target)
+      break;
+    if (! circ->marked_for_close)
+      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+    marked_circuit_free_cells(circ);
+    ++n_circuits_killed;
+  } SMARTLIST_FOREACH_END(circ);
+
+  log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits.",
+             U64_PRINTF_ARG((uint64_t)(current_allocation -
+                                cell_queues_get_total_allocation())),
+             n_circuits_killed);
+
+  smartlist_free(circlist);
+}
+
 /** Mark <b>circ</b> to be closed next time we call
  * circuit_close_all_marked(). Do any cleanup needed:
  *   - If state is onionskin_pending, remove circ from the onion_pending
@@ -1343,6 +1997,8 @@ _circuit_mark_for_close(circuit_t *circ, int reason, int line,
       connection_edge_destroy(circ->n_circ_id, conn);
     ocirc->p_streams = NULL;
   }
+  circuit_stream_map_clear(circ);
+  circ->next_stream_to_resume = NULL;
 
   circ->marked_for_close = line;
   circ->marked_for_close_file = file;
@@ -1478,6 +2134,21 @@ assert_circuit_ok(const circuit_t *c)
     tor_assert(!circuits_pending_or_conns ||
                !smartlist_isin(circuits_pending_or_conns, c));
   }
+  if (origin_circ) {
+    tor_assert(c->index_idx >= 0);
+    tor_assert(smartlist_get(origin_circuits_by_purpose[c->purpose],
+                             c->index_idx) == c);
+  } else if (or_circ->is_first_hop) {
+    tor_assert(c->index_idx >= 0);
+    tor_assert(smartlist_get(first_hop_or_circuits, c->index_idx) == c);
+  } else {
+    tor_assert(c->index_idx == -1);
+  }
+  if (origin_circ && origin_circ->cannibalize_idx >= 0) {
+    tor_assert(c->purpose == CIRCUIT_PURPOSE_C_GENERAL);
+    tor_assert(smartlist_get(cannibalize_bucket_for(origin_circ),
+                             origin_circ->cannibalize_idx) == origin_circ);
+  }
   if (origin_circ && origin_circ->cpath) {
     assert_cpath_ok(origin_circ->cpath);
   }
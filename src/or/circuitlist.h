@@ -22,7 +22,14 @@ void circuit_set_p_circid_orconn(or_circuit_t *circ, circid_t id,
                                  or_connection_t *conn);
 void circuit_set_n_circid_orconn(circuit_t *circ, circid_t id,
                                  or_connection_t *conn);
+void circuit_set_n_conn_without_circid(circuit_t *circ,
+                                       or_connection_t *conn);
 void circuit_set_state(circuit_t *circ, uint8_t state);
+void circuit_set_purpose(circuit_t *circ, uint8_t purpose);
+const smartlist_t *circuit_get_all_origin_by_purpose(uint8_t purpose);
+void circuit_get_all_origin(smartlist_t *out);
+void circuit_set_is_first_hop(or_circuit_t *circ, int is_first_hop);
+const smartlist_t *circuit_get_all_first_hop(void);
 void circuit_close_all_marked(void);
 int32_t circuit_initial_package_window(void);
 origin_circuit_t *origin_circuit_new(void);
@@ -30,8 +37,17 @@ or_circuit_t *or_circuit_new(circid_t p_circ_id, or_connection_t *p_conn);
 circuit_t *circuit_get_by_circid_orconn(circid_t circ_id,
                                         or_connection_t *conn);
 int circuit_id_in_use_on_orconn(circid_t circ_id, or_connection_t *conn);
+circid_t circuit_id_get_unused_on_orconn(or_connection_t *conn,
+                                         circid_t high_bit, circid_t start);
 circuit_t *circuit_get_by_edge_conn(edge_connection_t *conn);
+edge_connection_t *circuit_stream_map_lookup(circuit_t *circ,
+                                             streamid_t stream_id);
+void circuit_stream_map_set(circuit_t *circ, edge_connection_t *conn);
+void circuit_stream_map_remove(circuit_t *circ,
+                               const edge_connection_t *conn);
+void circuit_stream_map_clear(circuit_t *circ);
 void circuit_unlink_all_from_or_conn(or_connection_t *conn, int reason);
+void circuit_free_orconn_circid_map(or_connection_t *conn);
 origin_circuit_t *circuit_get_by_global_id(uint32_t id);
 origin_circuit_t *circuit_get_ready_rend_circ_by_rend_data(
   const rend_data_t *rend_data);
@@ -57,6 +73,7 @@ int circuit_count_pending_on_or_conn(or_connection_t *or_conn);
 void assert_cpath_layer_ok(const crypt_path_t *cp);
 void assert_circuit_ok(const circuit_t *c);
 void circuit_free_all(void);
+void circuits_handle_oom(size_t current_allocation);
 
 #endif
 
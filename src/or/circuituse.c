@@ -9,6 +9,7 @@
  * \brief Launch the right sort of circuits and attach streams to them.
  **/
 
+#define CIRCUITUSE_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
@@ -16,6 +17,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "connection_or.h"
 #include "control.h"
 #include "nodelist.h"
 #include "networkstatus.h"
@@ -36,6 +38,17 @@ extern circuit_t *global_circuitlist; /* from circuitlist.c */
 static void circuit_expire_old_circuits_clientside(void);
 static void circuit_increment_failure_count(void);
 
+/** Return how many msec have passed since <b>circ</b> was created, by the
+ * monotonic clock, given that the monotonic clock now reads
+ * <b>now_mono</b>. */
+static INLINE long
+circuit_age_msec(const circuit_t *circ, uint64_t now_mono)
+{
+  if (now_mono < circ->timestamp_created_mono)
+    return 0;
+  return (long)((now_mono - circ->timestamp_created_mono) / 1000000);
+}
+
 /** Return 1 if <b>circ</b> could be returned by circuit_get_best().
  * Else return 0.
  */
@@ -183,7 +196,7 @@ circuit_is_better(const origin_circuit_t *oa, const origin_circuit_t *ob,
           return 1;
       } else {
         if (a->timestamp_dirty ||
-            timercmp(&a->timestamp_created, &b->timestamp_created, >))
+            a->timestamp_created_mono > b->timestamp_created_mono)
           return 1;
         if (ob->build_state->is_internal)
           /* XXX023 what the heck is this internal thing doing here. I
@@ -251,7 +264,15 @@ circuit_get_best(const entry_connection_t *conn,
                  int must_be_open, uint8_t purpose,
                  int need_uptime, int need_internal)
 {
-  circuit_t *circ;
+  static const uint8_t rend_purposes[] = {
+    CIRCUIT_PURPOSE_C_ESTABLISH_REND, CIRCUIT_PURPOSE_C_REND_READY,
+    CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED, CIRCUIT_PURPOSE_C_REND_JOINED,
+  };
+  static const uint8_t intro_purposes[] = {
+    CIRCUIT_PURPOSE_C_INTRODUCING, CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT,
+  };
+  const uint8_t *purposes = &purpose;
+  int n_purposes = 1, i;
   origin_circuit_t *best=NULL;
   struct timeval now;
   int intro_going_on_but_too_old = 0;
@@ -264,27 +285,42 @@ circuit_get_best(const entry_connection_t *conn,
 
   tor_gettimeofday(&now);
 
-  for (circ=global_circuitlist;circ;circ = circ->next) {
-    origin_circuit_t *origin_circ;
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    origin_circ = TO_ORIGIN_CIRCUIT(circ);
-    if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
-                               need_uptime,need_internal,now.tv_sec))
-      continue;
+  /* Only look at the circuits whose purpose circuit_is_acceptable() could
+   * accept, rather than walking every circuit we have. */
+  if (!must_be_open && purpose == CIRCUIT_PURPOSE_C_REND_JOINED) {
+    purposes = rend_purposes;
+    n_purposes = (int)(sizeof(rend_purposes)/sizeof(rend_purposes[0]));
+  } else if (!must_be_open &&
+             purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT) {
+    purposes = intro_purposes;
+    n_purposes = (int)(sizeof(intro_purposes)/sizeof(intro_purposes[0]));
+  }
 
-    if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
-        !must_be_open && circ->state != CIRCUIT_STATE_OPEN &&
-        tv_mdiff(&now, &circ->timestamp_created) > circ_times.timeout_ms) {
-      intro_going_on_but_too_old = 1;
+  for (i = 0; i < n_purposes; ++i) {
+    const smartlist_t *candidates =
+      circuit_get_all_origin_by_purpose(purposes[i]);
+    if (!candidates)
       continue;
-    }
+    SMARTLIST_FOREACH_BEGIN(candidates, origin_circuit_t *, origin_circ) {
+      circuit_t *circ = TO_CIRCUIT(origin_circ);
+      if (!circuit_is_acceptable(origin_circ,conn,must_be_open,purpose,
+                                 need_uptime,need_internal,now.tv_sec))
+        continue;
 
-    /* now this is an acceptable circ to hand back. but that doesn't
-     * mean it's the *best* circ to hand back. try to decide.
-     */
-    if (!best || circuit_is_better(origin_circ,best,conn))
-      best = origin_circ;
+      if (purpose == CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT &&
+          !must_be_open && circ->state != CIRCUIT_STATE_OPEN &&
+          circuit_age_msec(circ, tor_monotime_nsec()) >
+            circ_times.timeout_ms) {
+        intro_going_on_but_too_old = 1;
+        continue;
+      }
+
+      /* now this is an acceptable circ to hand back. but that doesn't
+       * mean it's the *best* circ to hand back. try to decide.
+       */
+      if (!best || circuit_is_better(origin_circ,best,conn))
+        best = origin_circ;
+    } SMARTLIST_FOREACH_END(origin_circ);
   }
 
   if (!best && intro_going_on_but_too_old)
@@ -299,19 +335,21 @@ circuit_get_best(const entry_connection_t *conn,
 static int
 count_pending_general_client_circuits(void)
 {
-  const circuit_t *circ;
-
+  const smartlist_t *general =
+    circuit_get_all_origin_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);
   int count = 0;
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
+  if (!general)
+    return 0;
+
+  SMARTLIST_FOREACH_BEGIN(general, const origin_circuit_t *, ocirc) {
+    const circuit_t *circ = TO_CIRCUIT(ocirc);
     if (circ->marked_for_close ||
-        circ->state == CIRCUIT_STATE_OPEN ||
-        circ->purpose != CIRCUIT_PURPOSE_C_GENERAL ||
-        !CIRCUIT_IS_ORIGIN(circ))
+        circ->state == CIRCUIT_STATE_OPEN)
       continue;
 
     ++count;
-  }
+  } SMARTLIST_FOREACH_END(ocirc);
 
   return count;
 }
@@ -351,25 +389,22 @@ circuit_conforms_to_options(const origin_circuit_t *circ,
 void
 circuit_expire_building(void)
 {
-  circuit_t *victim, *next_circ = global_circuitlist;
+  smartlist_t *origin_circs;
   /* circ_times.timeout_ms and circ_times.close_ms are from
    * circuit_build_times_get_initial_timeout() if we haven't computed
-   * custom timeouts yet */
-  struct timeval general_cutoff, begindir_cutoff, fourhop_cutoff,
+   * custom timeouts yet.  Each cutoff is the age, in msec, at which we give
+   * up on a circuit. */
+  long general_cutoff, begindir_cutoff, fourhop_cutoff,
     cannibalize_cutoff, close_cutoff, extremely_old_cutoff,
     hs_extremely_old_cutoff;
   const or_options_t *options = get_options();
   struct timeval now;
+  uint64_t now_mono;
   cpath_build_state_t *build_state;
 
   tor_gettimeofday(&now);
-#define SET_CUTOFF(target, msec) do {                       \
-    long ms = tor_lround(msec);                             \
-    struct timeval diff;                                    \
-    diff.tv_sec = ms / 1000;                                \
-    diff.tv_usec = (int)((ms % 1000) * 1000);               \
-    timersub(&now, &diff, &target);                         \
-  } while (0)
+  now_mono = tor_monotime_nsec();
+#define SET_CUTOFF(target, msec) ((target) = tor_lround(msec))
 
   SET_CUTOFF(general_cutoff, circ_times.timeout_ms);
   SET_CUTOFF(begindir_cutoff, circ_times.timeout_ms / 2.0);
@@ -382,12 +417,15 @@ circuit_expire_building(void)
              MAX(circ_times.close_ms*2 + 1000,
                  options->SocksTimeout * 1000));
 
-  while (next_circ) {
-    struct timeval cutoff;
-    victim = next_circ;
-    next_circ = next_circ->next;
-    if (!CIRCUIT_IS_ORIGIN(victim) || /* didn't originate here */
-        victim->marked_for_close) /* don't mess with marked circs */
+  /* Take a copy of the origin circuits, since changing a circuit's purpose
+   * below moves it between circuitlist.c's purpose lists. */
+  origin_circs = smartlist_new();
+  circuit_get_all_origin(origin_circs);
+
+  SMARTLIST_FOREACH_BEGIN(origin_circs, origin_circuit_t *, victim_origin) {
+    circuit_t *victim = TO_CIRCUIT(victim_origin);
+    long cutoff, age_ms;
+    if (victim->marked_for_close) /* don't mess with marked circs */
       continue;
 
     build_state = TO_ORIGIN_CIRCUIT(victim)->build_state;
@@ -406,7 +444,8 @@ circuit_expire_building(void)
     if (TO_ORIGIN_CIRCUIT(victim)->hs_circ_has_timed_out)
       cutoff = hs_extremely_old_cutoff;
 
-    if (timercmp(&victim->timestamp_created, &cutoff, >))
+    age_ms = circuit_age_msec(victim, now_mono);
+    if (age_ms < cutoff)
       continue; /* it's still young, leave it alone */
 
 #if 0
@@ -446,7 +485,7 @@ circuit_expire_building(void)
            * because that's set when they switch purposes
            */
           if (TO_ORIGIN_CIRCUIT(victim)->rend_data ||
-              victim->timestamp_dirty > cutoff.tv_sec)
+              victim->timestamp_dirty > now.tv_sec - cutoff / 1000)
             continue;
           break;
         case CIRCUIT_PURPOSE_C_REND_READY_INTRO_ACKED:
@@ -455,7 +494,7 @@ circuit_expire_building(void)
            * make an introduction attempt. so timestamp_dirty
            * will reflect the time since the last attempt.
            */
-          if (victim->timestamp_dirty > cutoff.tv_sec)
+          if (victim->timestamp_dirty > now.tv_sec - cutoff / 1000)
             continue;
           break;
       }
@@ -496,15 +535,17 @@ circuit_expire_building(void)
          * it off at, we probably had a suspend event along this codepath,
          * and we should discard the value.
          */
-        if (timercmp(&victim->timestamp_created, &extremely_old_cutoff, <)) {
+        if (age_ms > extremely_old_cutoff) {
           log_notice(LD_CIRC,
                      "Extremely large value for circuit build timeout: %lds. "
                      "Assuming clock jump. Purpose %d (%s)",
-                     (long)(now.tv_sec - victim->timestamp_created.tv_sec),
+                     age_ms / 1000,
                      victim->purpose,
                      circuit_purpose_to_string(victim->purpose));
         } else if (circuit_build_times_count_close(&circ_times,
                                          first_hop_succeeded,
+                                         /* Compared with the wall-clock
+                                          * time we last saw the network. */
                                          victim->timestamp_created.tv_sec)) {
           circuit_build_times_set_timeout(&circ_times);
         }
@@ -581,7 +622,9 @@ circuit_expire_building(void)
       circuit_mark_for_close(victim, END_CIRC_REASON_MEASUREMENT_EXPIRED);
     else
       circuit_mark_for_close(victim, END_CIRC_REASON_TIMEOUT);
-  }
+  } SMARTLIST_FOREACH_END(victim_origin);
+
+  smartlist_free(origin_circs);
 }
 
 /** Remove any elements in <b>needed_ports</b> that are handled by an
@@ -616,17 +659,20 @@ int
 circuit_stream_is_being_handled(entry_connection_t *conn,
                                 uint16_t port, int min)
 {
-  circuit_t *circ;
+  const smartlist_t *general =
+    circuit_get_all_origin_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);
   const node_t *exitnode;
   int num=0;
   time_t now = time(NULL);
   int need_uptime = smartlist_string_num_isin(get_options()->LongLivedPorts,
                                    conn ? conn->socks_request->port : port);
 
-  for (circ=global_circuitlist;circ;circ = circ->next) {
-    if (CIRCUIT_IS_ORIGIN(circ) &&
-        !circ->marked_for_close &&
-        circ->purpose == CIRCUIT_PURPOSE_C_GENERAL &&
+  if (!general)
+    return 0;
+
+  SMARTLIST_FOREACH_BEGIN(general, origin_circuit_t *, ocirc) {
+    circuit_t *circ = TO_CIRCUIT(ocirc);
+    if (!circ->marked_for_close &&
         (!circ->timestamp_dirty ||
          circ->timestamp_dirty + get_options()->MaxCircuitDirtiness > now)) {
       cpath_build_state_t *build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
@@ -649,51 +695,102 @@ circuit_stream_is_being_handled(entry_connection_t *conn,
         }
       }
     }
-  }
+  } SMARTLIST_FOREACH_END(ocirc);
   return 0;
 }
 
 /** Don't keep more than this many unused open circuits around. */
 #define MAX_UNUSED_OPEN_CIRCUITS 14
 
+/** Never let preemptive building push us past more than this many
+ * general-purpose circuits under construction at once... */
+#define MAX_PREDICTIVE_CIRCS_PENDING 6
+/** ...or fewer than this many, however slowly our circuits get built. */
+#define MIN_PREDICTIVE_CIRCS_PENDING 2
+/** How many general-purpose circuits we allow under construction at once
+ * before we've learned a circuit build timeout. */
+#define DEFAULT_PREDICTIVE_CIRCS_PENDING 4
+/** With a learned circuit build timeout of T msec, allow this many msec
+ * divided by T general-purpose circuits under construction at once. */
+#define PREDICTIVE_CIRCS_PENDING_MSEC 30000
+
+/** Return the largest number of general-purpose circuits we want under
+ * construction at once when building circuits preemptively.  The quicker
+ * we've seen circuits get built, the more we're willing to build in
+ * parallel; on a slow network, we don't pile on more. */
+int
+circuit_predictive_build_concurrency(void)
+{
+  double n;
+  if (!circ_times.have_computed_timeout || circ_times.timeout_ms <= 0)
+    return DEFAULT_PREDICTIVE_CIRCS_PENDING;
+  n = PREDICTIVE_CIRCS_PENDING_MSEC / circ_times.timeout_ms;
+  if (n < MIN_PREDICTIVE_CIRCS_PENDING)
+    return MIN_PREDICTIVE_CIRCS_PENDING;
+  if (n > MAX_PREDICTIVE_CIRCS_PENDING)
+    return MAX_PREDICTIVE_CIRCS_PENDING;
+  return (int)n;
+}
+
+/** Return true iff we predict hidden service client use, and our
+ * <b>num_internal</b> clean internal circuits (<b>num_uptime_internal</b>
+ * of them with uptime) aren't enough for it.  A hidden service connection
+ * wants a rendezvous circuit and an introduction circuit; with
+ * ParallelHSConnect, the descriptor fetch wants one at the same time.  Set
+ * *<b>needs_uptime</b> and *<b>needs_capacity</b> as
+ * rep_hist_get_predicted_internal() does. */
+int
+circuit_needs_hs_client_circuits(time_t now, int num_internal,
+                                 int num_uptime_internal,
+                                 int *needs_uptime, int *needs_capacity)
+{
+  const int num_wanted = get_options()->ParallelHSConnect ? 3 : 2;
+
+  if (!rep_hist_get_predicted_internal(now, needs_uptime, needs_capacity))
+    return 0;
+  return (num_uptime_internal < num_wanted && *needs_uptime) ||
+    num_internal < num_wanted;
+}
+
 /** Figure out how many circuits we have open that are clean. Make
  * sure it's enough for all the upcoming behaviors we predict we'll have.
- * But put an upper bound on the total number of circuits.
+ * But put an upper bound on the total number of circuits.  Return 1 if we
+ * tried to launch a circuit, 0 if we don't need any more.
  */
-static void
-circuit_predict_and_launch_new(void)
+static int
+circuit_predict_and_launch_one(void)
 {
-  circuit_t *circ;
+  const smartlist_t *general =
+    circuit_get_all_origin_by_purpose(CIRCUIT_PURPOSE_C_GENERAL);
   int num=0, num_internal=0, num_uptime_internal=0;
   int hidserv_needs_uptime=0, hidserv_needs_capacity=1;
   int port_needs_uptime=0, port_needs_capacity=1;
   time_t now = time(NULL);
   int flags = 0;
 
-  /* First, count how many of each type of circuit we have already. */
-  for (circ=global_circuitlist;circ;circ = circ->next) {
-    cpath_build_state_t *build_state;
-    if (!CIRCUIT_IS_ORIGIN(circ))
-      continue;
-    if (circ->marked_for_close)
-      continue; /* don't mess with marked circs */
-    if (circ->timestamp_dirty)
-      continue; /* only count clean circs */
-    if (circ->purpose != CIRCUIT_PURPOSE_C_GENERAL)
-      continue; /* only pay attention to general-purpose circs */
-    build_state = TO_ORIGIN_CIRCUIT(circ)->build_state;
-    if (build_state->onehop_tunnel)
-      continue;
-    num++;
-    if (build_state->is_internal)
-      num_internal++;
-    if (build_state->need_uptime && build_state->is_internal)
-      num_uptime_internal++;
+  /* First, count how many of each type of circuit we have already.  Only
+   * pay attention to general-purpose circs. */
+  if (general) {
+    SMARTLIST_FOREACH_BEGIN(general, origin_circuit_t *, ocirc) {
+      cpath_build_state_t *build_state;
+      if (TO_CIRCUIT(ocirc)->marked_for_close)
+        continue; /* don't mess with marked circs */
+      if (TO_CIRCUIT(ocirc)->timestamp_dirty)
+        continue; /* only count clean circs */
+      build_state = ocirc->build_state;
+      if (build_state->onehop_tunnel)
+        continue;
+      num++;
+      if (build_state->is_internal)
+        num_internal++;
+      if (build_state->need_uptime && build_state->is_internal)
+        num_uptime_internal++;
+    } SMARTLIST_FOREACH_END(ocirc);
   }
 
   /* If that's enough, then stop now. */
   if (num >= MAX_UNUSED_OPEN_CIRCUITS)
-    return; /* we already have many, making more probably will hurt */
+    return 0; /* we already have many, making more probably will hurt */
 
   /* Second, see if we need any more exit circuits. */
   /* check if we know of a port that's been requested recently
@@ -708,7 +805,7 @@ circuit_predict_and_launch_new(void)
              "Have %d clean circs (%d internal), need another exit circ.",
              num, num_internal);
     circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
-    return;
+    return 1;
   }
 
   /* Third, see if we need any more hidden service (server) circuits. */
@@ -720,14 +817,14 @@ circuit_predict_and_launch_new(void)
              "circ for my hidden service.",
              num, num_internal);
     circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
-    return;
+    return 1;
   }
 
   /* Fourth, see if we need any more hidden service (client) circuits. */
-  if (rep_hist_get_predicted_internal(now, &hidserv_needs_uptime,
-                                      &hidserv_needs_capacity) &&
-      ((num_uptime_internal<2 && hidserv_needs_uptime) ||
-        num_internal<2)) {
+  if (circuit_needs_hs_client_circuits(now, num_internal,
+                                       num_uptime_internal,
+                                       &hidserv_needs_uptime,
+                                       &hidserv_needs_capacity)) {
     if (hidserv_needs_uptime)
       flags |= CIRCLAUNCH_NEED_UPTIME;
     if (hidserv_needs_capacity)
@@ -738,7 +835,7 @@ circuit_predict_and_launch_new(void)
              " another hidden service circ.",
              num, num_uptime_internal, num_internal);
     circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
-    return;
+    return 1;
   }
 
   /* Finally, check to see if we still need more circuits to learn
@@ -752,7 +849,32 @@ circuit_predict_and_launch_new(void)
     log_info(LD_CIRC,
              "Have %d clean circs need another buildtime test circ.", num);
     circuit_launch(CIRCUIT_PURPOSE_C_GENERAL, flags);
-    return;
+    return 1;
+  }
+  return 0;
+}
+
+/** Launch as many preemptive circuits as we're predicted to need, but
+ * don't go over circuit_predictive_build_concurrency() circuits under
+ * construction at once by launching more than one.  Since we're only
+ * called once a second, launching just one circuit per call would leave a
+ * freshly started or resumed client waiting a long time for its pool of
+ * clean circuits to fill. */
+static void
+circuit_predict_and_launch_new(void)
+{
+  int budget = circuit_predictive_build_concurrency() -
+    count_pending_general_client_circuits();
+
+  /* Always allow at least one launch per call, however many builds are
+   * pending, so that a few stalled builds can't stop us building. */
+  if (budget < 1)
+    budget = 1;
+
+  /* Each launch shows up in the counts the next decision is based on. */
+  while (budget-- > 0) {
+    if (!circuit_predict_and_launch_one())
+      break;
   }
 }
 
@@ -812,6 +934,9 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
     entry_connection_t *entry_conn = EDGE_TO_ENTRY_CONN(conn);
     entry_conn->may_use_optimistic_data = 0;
   }
+  circuit_stream_map_remove(circ, conn);
+  if (circ->next_stream_to_resume == conn)
+    circ->next_stream_to_resume = conn->next_stream;
   conn->cpath_layer = NULL; /* don't keep a stale pointer */
   conn->on_circuit = NULL;
 
@@ -876,23 +1001,30 @@ circuit_detach_stream(circuit_t *circ, edge_connection_t *conn)
 static void
 circuit_expire_old_circuits_clientside(void)
 {
-  circuit_t *circ;
-  struct timeval cutoff, now;
+  smartlist_t *origin_circs;
+  struct timeval now;
+  uint64_t now_mono;
+  /* How old, in msec, an unused circuit must be for us to close it. */
+  long cutoff;
 
   tor_gettimeofday(&now);
-  cutoff = now;
+  now_mono = tor_monotime_nsec();
 
   if (get_options()->LearnCircuitBuildTimeout &&
       circuit_build_times_needs_circuits(&circ_times)) {
     /* Circuits should be shorter lived if we need more of them
      * for learning a good build timeout */
-    cutoff.tv_sec -= IDLE_TIMEOUT_WHILE_LEARNING;
+    cutoff = IDLE_TIMEOUT_WHILE_LEARNING * 1000L;
   } else {
-    cutoff.tv_sec -= get_options()->CircuitIdleTimeout;
+    cutoff = get_options()->CircuitIdleTimeout * 1000L;
   }
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (circ->marked_for_close || !CIRCUIT_IS_ORIGIN(circ))
+  origin_circs = smartlist_new();
+  circuit_get_all_origin(origin_circs);
+
+  SMARTLIST_FOREACH_BEGIN(origin_circs, origin_circuit_t *, ocirc) {
+    circuit_t *circ = TO_CIRCUIT(ocirc);
+    if (circ->marked_for_close)
       continue;
     /* If the circuit has been dirty for too long, and there are no streams
      * on it, mark it for close.
@@ -907,7 +1039,8 @@ circuit_expire_old_circuits_clientside(void)
                 circ->purpose);
       circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
     } else if (!circ->timestamp_dirty && circ->state == CIRCUIT_STATE_OPEN) {
-      if (timercmp(&circ->timestamp_created, &cutoff, <)) {
+      long age_ms = circuit_age_msec(circ, now_mono);
+      if (age_ms > cutoff) {
         if (circ->purpose == CIRCUIT_PURPOSE_C_GENERAL ||
                 circ->purpose == CIRCUIT_PURPOSE_C_MEASURE_TIMEOUT ||
                 circ->purpose == CIRCUIT_PURPOSE_S_ESTABLISH_INTRO ||
@@ -917,7 +1050,7 @@ circuit_expire_old_circuits_clientside(void)
                 circ->purpose == CIRCUIT_PURPOSE_S_CONNECT_REND) {
           log_debug(LD_CIRC,
                     "Closing circuit that has been unused for %ld msec.",
-                    tv_mdiff(&circ->timestamp_created, &now));
+                    age_ms);
           circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
         } else if (!TO_ORIGIN_CIRCUIT(circ)->is_ancient) {
           /* Server-side rend joined circuits can end up really old, because
@@ -931,7 +1064,7 @@ circuit_expire_old_circuits_clientside(void)
                        "Ancient non-dirty circuit %d is still around after "
                        "%ld milliseconds. Purpose: %d (%s)",
                        TO_ORIGIN_CIRCUIT(circ)->global_identifier,
-                       tv_mdiff(&circ->timestamp_created, &now),
+                       age_ms,
                        circ->purpose,
                        circuit_purpose_to_string(circ->purpose));
             TO_ORIGIN_CIRCUIT(circ)->is_ancient = 1;
@@ -939,7 +1072,9 @@ circuit_expire_old_circuits_clientside(void)
         }
       }
     }
-  }
+  } SMARTLIST_FOREACH_END(ocirc);
+
+  smartlist_free(origin_circs);
 }
 
 /** How long do we wait before killing circuits with the properties
@@ -966,18 +1101,22 @@ circuit_expire_old_circuits_clientside(void)
 void
 circuit_expire_old_circuits_serverside(time_t now)
 {
-  circuit_t *circ;
-  or_circuit_t *or_circ;
+  const smartlist_t *first_hop = circuit_get_all_first_hop();
   time_t cutoff = now - IDLE_ONE_HOP_CIRC_TIMEOUT;
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (circ->marked_for_close || CIRCUIT_IS_ORIGIN(circ))
+  if (!first_hop)
+    return;
+
+  /* Only circuits that used a create_fast are candidates, so don't walk
+   * the rest of the circuits we're relaying. */
+  SMARTLIST_FOREACH_BEGIN(first_hop, or_circuit_t *, or_circ) {
+    circuit_t *circ = TO_CIRCUIT(or_circ);
+    if (circ->marked_for_close)
       continue;
-    or_circ = TO_OR_CIRCUIT(circ);
     /* If the circuit has been idle for too long, and there are no streams
-     * on it, and it ends here, and it used a create_fast, mark it for close.
+     * on it, and it ends here, mark it for close.
      */
-    if (or_circ->is_first_hop && !circ->n_conn &&
+    if (!circ->n_conn &&
         !or_circ->n_streams && !or_circ->resolving_streams &&
         or_circ->p_conn &&
         or_circ->p_conn->timestamp_last_added_nonpadding <= cutoff) {
@@ -986,7 +1125,7 @@ circuit_expire_old_circuits_serverside(time_t now)
                (int)(now - or_circ->p_conn->timestamp_last_added_nonpadding));
       circuit_mark_for_close(circ, END_CIRC_REASON_FINISHED);
     }
-  }
+  } SMARTLIST_FOREACH_END(or_circ);
 }
 
 /** Number of testing circuits we want open before testing our bandwidth. */
@@ -1011,17 +1150,18 @@ reset_bandwidth_test(void)
 int
 circuit_enough_testing_circs(void)
 {
-  circuit_t *circ;
+  const smartlist_t *testing =
+    circuit_get_all_origin_by_purpose(CIRCUIT_PURPOSE_TESTING);
   int num = 0;
 
   if (have_performed_bandwidth_test)
     return 1;
 
-  for (circ = global_circuitlist; circ; circ = circ->next) {
-    if (!circ->marked_for_close && CIRCUIT_IS_ORIGIN(circ) &&
-        circ->purpose == CIRCUIT_PURPOSE_TESTING &&
-        circ->state == CIRCUIT_STATE_OPEN)
-      num++;
+  if (testing) {
+    SMARTLIST_FOREACH(testing, const origin_circuit_t *, ocirc,
+      if (!ocirc->_base.marked_for_close &&
+          ocirc->_base.state == CIRCUIT_STATE_OPEN)
+        num++);
   }
   return num >= NUM_PARALLEL_TESTING_CIRCS;
 }
@@ -1197,7 +1337,7 @@ circuit_build_failed(origin_circuit_t *circ)
                "Our circuit failed to get a response from the first hop "
                "(%s:%d). I'm going to try to rotate to a better connection.",
                n_conn->_base.address, n_conn->_base.port);
-      n_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(n_conn);
     } else {
       log_info(LD_OR,
                "Our circuit died before the first hop with no connection");
@@ -1321,6 +1461,7 @@ circuit_launch_by_extend_info(uint8_t purpose,
        * will see it and think it's been trying to build since it
        * began. */
       tor_gettimeofday(&circ->_base.timestamp_created);
+      circ->_base.timestamp_created_mono = tor_monotime_nsec();
 
       control_event_circuit_cannibalized(circ, old_purpose,
                                          &old_timestamp_created);
@@ -1404,7 +1545,9 @@ circuit_get_open_circ_or_launch(entry_connection_t *conn,
 
   tor_assert(conn);
   tor_assert(circp);
-  tor_assert(ENTRY_TO_CONN(conn)->state == AP_CONN_STATE_CIRCUIT_WAIT);
+  tor_assert(ENTRY_TO_CONN(conn)->state == AP_CONN_STATE_CIRCUIT_WAIT ||
+             (ENTRY_TO_CONN(conn)->state == AP_CONN_STATE_RENDDESC_WAIT &&
+              desired_circuit_purpose == CIRCUIT_PURPOSE_C_REND_JOINED));
   check_exit_policy =
       conn->socks_request->command == SOCKS_COMMAND_CONNECT &&
       !conn->use_begindir &&
@@ -1680,7 +1823,8 @@ optimistic_data_enabled(void)
     /* XXX023 consider having auto default to 1 rather than 0 before
      * the 0.2.3 branch goes stable. See bug 3617. -RD */
     const int32_t enabled =
-      networkstatus_get_param(NULL, "UseOptimisticData", 0, 0, 1);
+      networkstatus_get_param_by_id(NULL, NET_PARAM_USE_OPTIMISTIC_DATA,
+                                    0, 0, 1);
     return (int)enabled;
   }
   return options->OptimisticData;
@@ -1705,6 +1849,7 @@ link_apconn_to_circ(entry_connection_t *apconn, origin_circuit_t *circ,
   ENTRY_TO_EDGE_CONN(apconn)->on_circuit = TO_CIRCUIT(circ);
   /* assert_connection_ok(conn, time(NULL)); */
   circ->p_streams = ENTRY_TO_EDGE_CONN(apconn);
+  circuit_stream_map_remove(TO_CIRCUIT(circ), ENTRY_TO_EDGE_CONN(apconn));
 
   if (connection_edge_is_rendezvous_stream(ENTRY_TO_EDGE_CONN(apconn))) {
     /* We are attaching a stream to a rendezvous circuit.  That means
@@ -2042,6 +2187,32 @@ connection_ap_handshake_attach_circuit(entry_connection_t *conn)
   }
 }
 
+/** Called when <b>conn</b>, a stream for a hidden service, has started
+ * waiting for the service's descriptor.  If ParallelHSConnect is set,
+ * start building (or cannibalizing) its rendezvous circuit now: it
+ * doesn't depend on the descriptor, so it can be ready by the time the
+ * descriptor arrives and we pick an introduction point.  Return the
+ * rendezvous circuit we found or launched, or NULL if we have none yet.
+ */
+origin_circuit_t *
+connection_ap_launch_rendezvous_early(entry_connection_t *conn)
+{
+  origin_circuit_t *rendcirc = NULL;
+
+  tor_assert(ENTRY_TO_CONN(conn)->state == AP_CONN_STATE_RENDDESC_WAIT);
+  if (!get_options()->ParallelHSConnect)
+    return NULL;
+  if (circuit_get_open_circ_or_launch(conn, CIRCUIT_PURPOSE_C_REND_JOINED,
+                                      &rendcirc) < 0)
+    return NULL; /* We'll try again once we have the descriptor. */
+  if (rendcirc)
+    log_info(LD_REND, "Using rend circ %d for '%s' while we fetch its "
+             "descriptor.", rendcirc->_base.n_circ_id,
+             safe_str_client(ENTRY_TO_EDGE_CONN(conn)->rend_data->
+                             onion_address));
+  return rendcirc;
+}
+
 /** Change <b>circ</b>'s purpose to <b>new_purpose</b>. */
 void
 circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
@@ -2070,7 +2241,10 @@ circuit_change_purpose(circuit_t *circ, uint8_t new_purpose)
   }
 
   old_purpose = circ->purpose;
-  circ->purpose = new_purpose;
+  if (CIRCUIT_IS_ORIGIN(circ))
+    circuit_set_purpose(circ, new_purpose);
+  else
+    circ->purpose = new_purpose;
 
   if (CIRCUIT_IS_ORIGIN(circ)) {
     control_event_circuit_purpose_changed(TO_ORIGIN_CIRCUIT(circ),
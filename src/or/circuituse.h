@@ -50,11 +50,20 @@ int connection_ap_handshake_attach_chosen_circuit(entry_connection_t *conn,
                                                   origin_circuit_t *circ,
                                                   crypt_path_t *cpath);
 int connection_ap_handshake_attach_circuit(entry_connection_t *conn);
+origin_circuit_t *connection_ap_launch_rendezvous_early(
+                                             entry_connection_t *conn);
 
 void circuit_change_purpose(circuit_t *circ, uint8_t new_purpose);
 
 int hostname_in_track_host_exits(const or_options_t *options,
                                  const char *address);
 
+#ifdef CIRCUITUSE_PRIVATE
+int circuit_predictive_build_concurrency(void);
+int circuit_needs_hs_client_circuits(time_t now, int num_internal,
+                                     int num_uptime_internal,
+                                     int *needs_uptime, int *needs_capacity);
+#endif
+
 #endif
 
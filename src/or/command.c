@@ -11,8 +11,8 @@
 
 /* In-points to command.c:
  *
- * - command_process_cell(), called from
- *   connection_or_process_cells_from_inbuf() in connection_or.c
+ * - command_process_cell() and command_process_relay_cell_batch(), called
+ *   from connection_or_process_cells_from_inbuf() in connection_or.c
  */
 
 #include "or.h"
@@ -28,6 +28,7 @@
 #include "nodelist.h"
 #include "onion.h"
 #include "relay.h"
+#include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
 
@@ -83,23 +84,18 @@ static void
 command_time_process_cell(cell_t *cell, or_connection_t *conn, int *time,
                                void (*func)(cell_t *, or_connection_t *))
 {
-  struct timeval start, end;
+  uint64_t start;
   long time_passed;
 
-  tor_gettimeofday(&start);
+  start = tor_monotime_nsec();
 
   (*func)(cell, conn);
 
-  tor_gettimeofday(&end);
-  time_passed = tv_udiff(&start, &end) ;
+  time_passed = (long)((tor_monotime_nsec() - start) / 1000);
 
   if (time_passed > 10000) { /* more than 10ms */
     log_debug(LD_OR,"That call just took %ld ms.",time_passed/1000);
   }
-  if (time_passed < 0) {
-    log_info(LD_GENERAL,"That call took us back in time!");
-    time_passed = 0;
-  }
   *time += time_passed;
 }
 #endif
@@ -209,6 +205,64 @@ command_process_cell(cell_t *cell, or_connection_t *conn)
   }
 }
 
+/** Process the <b>n_cells</b> relay cells in <b>cells</b>, all of which
+ * arrived back-to-back on <b>conn</b>, in order.  Whenever several of them in
+ * a row belong to the same circuit at which we're not the origin, apply our
+ * layer of crypto to all of them in one relay_crypt_cell_batch() call before
+ * handing them to command_process_cell() one at a time.
+ */
+void
+command_process_relay_cell_batch(cell_t *cells, int n_cells,
+                                 or_connection_t *conn)
+{
+  cell_t *run[RELAY_CRYPT_BATCH_MAX];
+  int i = 0, j, n_run;
+
+  tor_assert(n_cells <= RELAY_CRYPT_BATCH_MAX);
+
+  while (i < n_cells) {
+    circuit_t *circ = NULL;
+
+    /* Find the run of cells starting at i with the same circuit ID. */
+    for (n_run = 0; i + n_run < n_cells; ++n_run) {
+      cell_t *cell = &cells[i + n_run];
+      tor_assert(cell->command == CELL_RELAY ||
+                 cell->command == CELL_RELAY_EARLY);
+      if (cell->circ_id != cells[i].circ_id)
+        break;
+      run[n_run] = cell;
+    }
+
+    if (n_run > 1 && !conn->_base.marked_for_close &&
+        conn->_base.state == OR_CONN_STATE_OPEN) {
+      circ = circuit_get_by_circid_orconn(cells[i].circ_id, conn);
+      /* command_process_relay_cell() rejects these without crypting. */
+      if (circ && (CIRCUIT_IS_ORIGIN(circ) ||
+                   circ->state == CIRCUIT_STATE_ONIONSKIN_PENDING))
+        circ = NULL;
+    }
+
+    if (circ) {
+      cell_direction_t direction;
+      if (cells[i].circ_id == TO_OR_CIRCUIT(circ)->p_circ_id)
+        direction = CELL_DIRECTION_OUT;
+      else
+        direction = CELL_DIRECTION_IN;
+      if (relay_crypt_cell_batch(circ, run, n_run, direction) < 0) {
+        circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+        circ = NULL;
+      }
+    }
+
+    for (j = 0; j < n_run; ++j)
+      command_process_cell(run[j], conn);
+
+    if (circ)
+      relay_crypt_cell_batch_done(circ);
+    i += n_run;
+  }
+}
+
 /** Return true if <b>command</b> is a cell command that's allowed to start a
  * V3 handshake. */
 static int
@@ -411,6 +465,15 @@ command_process_create_cell(cell_t *cell, or_connection_t *conn)
     return;
   }
 
+  if (cell->command == CELL_CREATE && onion_pending_is_overloaded()) {
+    log_info(LD_OR, "Expected onion queue delay is too long. Sending back "
+             "destroy.");
+    rep_hist_note_onionskin_dropped(ONION_DROP_OVERLOADED);
+    connection_or_send_destroy(cell->circ_id, conn,
+                               END_CIRC_REASON_RESOURCELIMIT);
+    return;
+  }
+
   circ = or_circuit_new(cell->circ_id, conn);
   circ->_base.purpose = CIRCUIT_PURPOSE_OR;
   circuit_set_state(TO_CIRCUIT(circ), CIRCUIT_STATE_ONIONSKIN_PENDING);
@@ -497,6 +560,8 @@ command_process_created_cell(cell_t *cell, or_connection_t *conn)
       circuit_mark_for_close(circ, -err_reason);
       return;
     }
+    if (err_reason > 0)
+      return; /* a cpuworker will finish it, and send the next skin. */
     log_debug(LD_OR,"Moving to next skin.");
     if ((err_reason = circuit_send_next_onion_skin(origin_circ)) < 0) {
       log_info(LD_OR,"circuit_send_next_onion_skin failed.");
@@ -13,6 +13,8 @@
 #define _TOR_COMMAND_H
 
 void command_process_cell(cell_t *cell, or_connection_t *conn);
+void command_process_relay_cell_batch(cell_t *cells, int n_cells,
+                                      or_connection_t *conn);
 void command_process_var_cell(var_cell_t *cell, or_connection_t *conn);
 
 extern uint64_t stats_n_padding_cells_processed;
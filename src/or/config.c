@@ -26,6 +26,7 @@
 #include "geoip.h"
 #include "hibernate.h"
 #include "main.h"
+#include "mempool.h"
 #include "networkstatus.h"
 #include "policies.h"
 #include "relay.h"
@@ -175,8 +176,10 @@ typedef struct config_var_t {
 static config_var_t _option_vars[] = {
   OBSOLETE("AccountingMaxKB"),
   V(AccountingMax,               MEMUNIT,  "0 bytes"),
+  V(AccountingShaping,           BOOL,     "0"),
   V(AccountingStart,             STRING,   NULL),
   V(Address,                     STRING,   NULL),
+  V(AdaptiveCircuitWindows,      BOOL,     "0"),
   V(AllowDotExit,                BOOL,     "0"),
   V(AllowInvalidNodes,           CSV,      "middle,rendezvous"),
   V(AllowNonRFC953Hostnames,     BOOL,     "0"),
@@ -185,7 +188,9 @@ static config_var_t _option_vars[] = {
   V(AlternateBridgeAuthority,    LINELIST, NULL),
   V(AlternateDirAuthority,       LINELIST, NULL),
   V(AlternateHSAuthority,        LINELIST, NULL),
+  V(ApproximateClientCounts,     BOOL,     "0"),
   V(AssumeReachable,             BOOL,     "0"),
+  V(AsyncLogging,                BOOL,     "0"),
   V(AuthDirBadDir,               LINELIST, NULL),
   V(AuthDirBadDirCCs,            CSV,      ""),
   V(AuthDirBadExit,              LINELIST, NULL),
@@ -206,28 +211,35 @@ static config_var_t _option_vars[] = {
   V(AutomapHostsSuffixes,        CSV,      ".onion,.exit"),
   V(AvoidDiskWrites,             BOOL,     "0"),
   V(BandwidthBurst,              MEMUNIT,  "10 MB"),
+  V(BandwidthClassWeights,       CSV,      NULL),
   V(BandwidthRate,               MEMUNIT,  "5 MB"),
   V(BridgeAuthoritativeDir,      BOOL,     "0"),
   VAR("Bridge",                  LINELIST, Bridges,    NULL),
   V(BridgePassword,              STRING,   NULL),
   V(BridgeRecordUsageByCountry,  BOOL,     "1"),
   V(BridgeRelay,                 BOOL,     "0"),
+  V(CellLatencyHistograms,       BOOL,     "0"),
   V(CellStatistics,              BOOL,     "0"),
   V(LearnCircuitBuildTimeout,    BOOL,     "1"),
   V(CircuitBuildTimeout,         INTERVAL, "0"),
   V(CircuitIdleTimeout,          INTERVAL, "1 hour"),
   V(CircuitStreamTimeout,        INTERVAL, "0"),
   V(CircuitPriorityHalflife,     DOUBLE,  "-100.0"), /*negative:'Use default'*/
+  V(ClientDNSCache,              BOOL,     "1"),
+  V(ClientDNSCacheMaxTTL,        INTERVAL, "30 minutes"),
   V(ClientDNSRejectInternalAddresses, BOOL,"1"),
   V(ClientOnly,                  BOOL,     "0"),
   V(ClientRejectInternalAddresses, BOOL,   "1"),
   V(ClientTransportPlugin,       LINELIST, NULL),
+  V(CoalesceORWrites,            BOOL,     "0"),
   V(ConsensusParams,             STRING,   NULL),
   V(ConnLimit,                   UINT,     "1000"),
   V(ConnDirectionStatistics,     BOOL,     "0"),
   V(ConstrainedSockets,          BOOL,     "0"),
   V(ConstrainedSockSize,         MEMUNIT,  "8192"),
   V(ContactInfo,                 STRING,   NULL),
+  V(ControlEventMaxBacklog,      MEMUNIT,  "0"),
+  V(ControlEventRateLimit,       UINT,     "0"),
   V(ControlListenAddress,        LINELIST, NULL),
   V(ControlPort,                 LINELIST, NULL),
   V(ControlPortFileGroupReadable,BOOL,     "0"),
@@ -238,10 +250,13 @@ static config_var_t _option_vars[] = {
   V(CookieAuthFileGroupReadable, BOOL,     "0"),
   V(CookieAuthFile,              STRING,   NULL),
   V(CountPrivateBandwidth,       BOOL,     "0"),
+  V(CPUWorkerAffinity,           BOOL,     "0"),
+  V(DataCellCoalesceDelay,       MSEC_INTERVAL, "0"),
   V(DataDirectory,               FILENAME, NULL),
   OBSOLETE("DebugLogFile"),
   V(DisableNetwork,              BOOL,     "0"),
   V(DirAllowPrivateAddresses,    BOOL,     "0"),
+  V(DirCompressionLevel,         STRING,   "high"),
   V(TestingAuthDirTimeToLearnReachability, INTERVAL, "30 minutes"),
   V(DirListenAddress,            LINELIST, NULL),
   OBSOLETE("DirFetchPeriod"),
@@ -261,6 +276,7 @@ static config_var_t _option_vars[] = {
   V(DynamicDHGroups,             BOOL,     "0"),
   V(DNSPort,                     LINELIST, NULL),
   V(DNSListenAddress,            LINELIST, NULL),
+  V(DormantWakeupInterval,       INTERVAL, "1 minute"),
   V(DownloadExtraInfo,           BOOL,     "0"),
   V(EnforceDistinctSubnets,      BOOL,     "1"),
   V(EntryNodes,                  ROUTERSET,   NULL),
@@ -269,6 +285,7 @@ static config_var_t _option_vars[] = {
   V(ExcludeNodes,                ROUTERSET, NULL),
   V(ExcludeExitNodes,            ROUTERSET, NULL),
   V(ExcludeSingleHopRelays,      BOOL,     "1"),
+  V(ExitConnectFallbackTimeout,  INTERVAL, "3 seconds"),
   V(ExitNodes,                   ROUTERSET, NULL),
   V(ExitPolicy,                  LINELIST, NULL),
   V(ExitPolicyRejectPrivate,     BOOL,     "1"),
@@ -284,6 +301,7 @@ static config_var_t _option_vars[] = {
   V(FascistFirewall,             BOOL,     "0"),
   V(FirewallPorts,               CSV,      ""),
   V(FastFirstHopPK,              BOOL,     "1"),
+  V(FetchConsensusDiffs,         BOOL,     "1"),
   V(FetchDirInfoEarly,           BOOL,     "0"),
   V(FetchDirInfoExtraEarly,      BOOL,     "0"),
   V(FetchServerDescriptors,      BOOL,     "1"),
@@ -303,6 +321,7 @@ static config_var_t _option_vars[] = {
   V(AccelName,                   STRING,   NULL),
   V(AccelDir,                    FILENAME, NULL),
   V(HashedControlPassword,       LINELIST, NULL),
+  V(HidServDirectoryCacheSize,   MEMUNIT,  "32 MB"),
   V(HidServDirectoryV2,          BOOL,     "1"),
   VAR("HiddenServiceDir",    LINELIST_S, RendConfigLines,    NULL),
   OBSOLETE("HiddenServiceExcludeNodes"),
@@ -320,6 +339,7 @@ static config_var_t _option_vars[] = {
   V(HTTPProxyAuthenticator,      STRING,   NULL),
   V(HTTPSProxy,                  STRING,   NULL),
   V(HTTPSProxyAuthenticator,     STRING,   NULL),
+  V(HugePageArena,               BOOL,     "0"),
   VAR("ServerTransportPlugin",   LINELIST, ServerTransportPlugin,  NULL),
   V(Socks4Proxy,                 STRING,   NULL),
   V(Socks5Proxy,                 STRING,   NULL),
@@ -327,6 +347,7 @@ static config_var_t _option_vars[] = {
   V(Socks5ProxyPassword,         STRING,   NULL),
   OBSOLETE("IgnoreVersion"),
   V(KeepalivePeriod,             INTERVAL, "5 minutes"),
+  V(KeystreamPrecomputeCells,    UINT,     "0"),
   VAR("Log",                     LINELIST, Logs,             NULL),
   V(LogMessageDomains,           BOOL,     "0"),
   OBSOLETE("LinkPadding"),
@@ -335,10 +356,14 @@ static config_var_t _option_vars[] = {
   V(LogTimeGranularity,          MSEC_INTERVAL, "1 second"),
   V(LongLivedPorts,              CSV,
         "21,22,706,1863,5050,5190,5222,5223,6523,6667,6697,8300"),
+  V(MainLoopStallThreshold,      MSEC_INTERVAL, "500 msec"),
   VAR("MapAddress",              LINELIST, AddressMap,           NULL),
   V(MaxAdvertisedBandwidth,      MEMUNIT,  "1 GB"),
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
+  V(MaxMemInBuffers,             MEMUNIT,  "0"),
+  V(MaxMemInCellQueues,          MEMUNIT,  "256 MB"),
   V(MaxClientCircuitsPending,    UINT,     "32"),
+  V(MaxOnionQueueDelay,          MSEC_INTERVAL, "0"),
   V(MaxOnionsPending,            UINT,     "100"),
   OBSOLETE("MonthlyAccountingStart"),
   V(MyFamily,                    STRING,   NULL),
@@ -355,6 +380,8 @@ static config_var_t _option_vars[] = {
   V(ORListenAddress,             LINELIST, NULL),
   V(ORPort,                      LINELIST, NULL),
   V(OutboundBindAddress,         STRING,   NULL),
+  V(ParallelConsensusParsing,    BOOL,     "0"),
+  V(ParallelHSConnect,           BOOL,     "0"),
 
   V(PathBiasCircThreshold,       INT,      "-1"),
   V(PathBiasNoticeRate,          DOUBLE,   "-1"),
@@ -397,13 +424,17 @@ static config_var_t _option_vars[] = {
   V(SafeSocks,                   BOOL,     "0"),
   V(ServerDNSAllowBrokenConfig,  BOOL,     "1"),
   V(ServerDNSAllowNonRFC953Hostnames, BOOL,"0"),
+  V(ServerDNSBackend,            STRING,   "eventdns"),
   V(ServerDNSDetectHijacking,    BOOL,     "1"),
+  V(ServerDNSMaxThreads,         UINT,     "8"),
   V(ServerDNSRandomizeCase,      BOOL,     "1"),
+  V(ServerDNSRefreshPopular,     BOOL,     "0"),
   V(ServerDNSResolvConfFile,     STRING,   NULL),
   V(ServerDNSSearchDomains,      BOOL,     "0"),
   V(ServerDNSTestAddresses,      CSV,
       "www.google.com,www.mit.edu,www.yahoo.com,www.slashdot.org"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
+  V(SocketBufferBudget,          MEMUNIT,  "0"),
   V(SocksListenAddress,          LINELIST, NULL),
   V(SocksPolicy,                 LINELIST, NULL),
   V(SocksPort,                   LINELIST, NULL),
@@ -411,7 +442,10 @@ static config_var_t _option_vars[] = {
   OBSOLETE("StatusFetchPeriod"),
   V(StrictNodes,                 BOOL,     "0"),
   OBSOLETE("SysLog"),
+  V(TCPNotSentLowat,             MEMUNIT,  "0"),
   V(TestSocks,                   BOOL,     "0"),
+  V(TLSRecordCoalescing,         BOOL,     "0"),
+  V(TLSSessionCacheSize,         UINT,     "0"),
   OBSOLETE("TestVia"),
   V(TokenBucketRefillInterval,   MSEC_INTERVAL, "100 msec"),
   V(Tor2webMode,                 BOOL,     "0"),
@@ -573,6 +607,9 @@ typedef struct {
   /** If present, extra is a LINELIST variable for unrecognized
    * lines.  Otherwise, unrecognized lines are an error. */
   config_var_t *extra;
+  /** Map from the lowercased name of each entry in <b>vars</b> to that
+   * entry, built the first time we look up an option in this format. */
+  strmap_t *var_index;
 } config_format_t;
 
 /** Macro: assert that <b>cfg</b> has the right magic field for format
@@ -655,6 +692,7 @@ static config_format_t options_format = {
   _option_abbrevs,
   _option_vars,
   (validate_fn_t)options_validate,
+  NULL,
   NULL
 };
 
@@ -668,7 +706,7 @@ static config_var_t state_extra_var = {
 };
 
 /** Configuration format for or_state_t. */
-static const config_format_t state_format = {
+static config_format_t state_format = {
   sizeof(or_state_t),
   OR_STATE_MAGIC,
   STRUCT_OFFSET(or_state_t, _magic),
@@ -676,6 +714,7 @@ static const config_format_t state_format = {
   _state_vars,
   (validate_fn_t)or_state_validate,
   &state_extra_var,
+  NULL
 };
 
 /*
@@ -732,6 +771,152 @@ get_options(void)
   return get_options_mutable();
 }
 
+/** Change handler for CircuitPriorityHalflife. */
+static int
+options_changed_circuit_priority_halflife(const or_options_t *old_options,
+                                          const or_options_t *new_options)
+{
+  (void)old_options;
+  cell_ewma_set_scale_factor(new_options,
+                             networkstatus_get_latest_consensus());
+  return 0;
+}
+
+/** An option that we can change without calling options_act_reversible()
+ * and options_act(). */
+typedef struct option_change_handler_t {
+  const char *name; /**< The option's name. */
+  /** If not NULL, a function to call when this option has changed and no
+   * options without handlers have.  Returns 0 on success, -1 on failure. */
+  int (*fn)(const or_options_t *old_options,
+            const or_options_t *new_options);
+} option_change_handler_t;
+
+/** Options that nothing but their change handler depends on: everything
+ * else looks them up in get_options() each time it uses them.  When a
+ * SETCONF changes only options from this list, we skip the rest of
+ * options_act() and friends, which are expensive. */
+static const option_change_handler_t option_change_handlers[] = {
+  { "CircuitIdleTimeout", NULL },
+  { "CircuitPriorityHalflife", options_changed_circuit_priority_halflife },
+  { "CircuitStreamTimeout", NULL },
+  { "ControlEventMaxBacklog", NULL },
+  { "ControlEventRateLimit", NULL },
+  { "HeartbeatPeriod", NULL },
+  { "KeepalivePeriod", NULL },
+  { "LongLivedPorts", NULL },
+  { "MaxCircuitDirtiness", NULL },
+  { "NewCircuitPeriod", NULL },
+  { "RejectPlaintextPorts", NULL },
+  { "SocksTimeout", NULL },
+  { "WarnPlaintextPorts", NULL },
+  { "__DisablePredictedCircuits", NULL },
+  { "__LeaveStreamsUnattached", NULL },
+  { NULL, NULL }
+};
+
+/** Return the entry in option_change_handlers for the option called
+ * <b>name</b>, or NULL if there is none. */
+static const option_change_handler_t *
+option_get_change_handler(const char *name)
+{
+  int i;
+  for (i = 0; option_change_handlers[i].name; ++i) {
+    if (!strcmp(option_change_handlers[i].name, name))
+      return &option_change_handlers[i];
+  }
+  return NULL;
+}
+
+/** Return true iff the option <b>var</b> has the same value in <b>o1</b>
+ * and <b>o2</b>.  Like option_is_same(), but compares the common scalar
+ * types in place rather than formatting them. */
+static int
+option_var_is_same(const or_options_t *o1, const or_options_t *o2,
+                   const config_var_t *var)
+{
+  const void *v1 = STRUCT_VAR_P(o1, var->var_offset);
+  const void *v2 = STRUCT_VAR_P(o2, var->var_offset);
+  switch (var->type) {
+    case CONFIG_TYPE_STRING:
+    case CONFIG_TYPE_FILENAME:
+      return !*(char**)v1 || !*(char**)v2 ?
+        *(char**)v1 == *(char**)v2 : !strcmp(*(char**)v1, *(char**)v2);
+    case CONFIG_TYPE_INTERVAL:
+    case CONFIG_TYPE_MSEC_INTERVAL:
+    case CONFIG_TYPE_UINT:
+    case CONFIG_TYPE_INT:
+    case CONFIG_TYPE_PORT:
+    case CONFIG_TYPE_BOOL:
+    case CONFIG_TYPE_AUTOBOOL:
+      return *(int*)v1 == *(int*)v2;
+    case CONFIG_TYPE_MEMUNIT:
+      return *(uint64_t*)v1 == *(uint64_t*)v2;
+    case CONFIG_TYPE_ISOTIME:
+      return *(time_t*)v1 == *(time_t*)v2;
+    case CONFIG_TYPE_DOUBLE:
+    case CONFIG_TYPE_CSV:
+    case CONFIG_TYPE_LINELIST:
+    case CONFIG_TYPE_LINELIST_S:
+    case CONFIG_TYPE_LINELIST_V:
+    case CONFIG_TYPE_ROUTERSET:
+    case CONFIG_TYPE_OBSOLETE:
+    default:
+      return option_is_same(&options_format, o1, o2, var->name);
+  }
+}
+
+/** Return a new list of the config_var_t for every option that differs
+ * between <b>old_options</b> and <b>new_options</b>.  If
+ * <b>handled_only</b> is true and an option without a change handler
+ * differs, return NULL instead. */
+static smartlist_t *
+options_get_changed_vars(const or_options_t *old_options,
+                         const or_options_t *new_options,
+                         int handled_only)
+{
+  smartlist_t *changed = smartlist_new();
+  int i;
+  for (i=0; options_format.vars[i].name; ++i) {
+    const config_var_t *var = &options_format.vars[i];
+    if (var->type == CONFIG_TYPE_LINELIST_S ||
+        var->type == CONFIG_TYPE_OBSOLETE) {
+      continue;
+    }
+    if (option_var_is_same(new_options, old_options, var))
+      continue;
+    if (handled_only && !option_get_change_handler(var->name)) {
+      smartlist_free(changed);
+      return NULL;
+    }
+    smartlist_add(changed, (void*)var);
+  }
+  return changed;
+}
+
+/** Act on the change from <b>old_options</b> to the current options, which
+ * differ only in the options in <b>changed</b>, all of which have change
+ * handlers.  Return 0 on success, -1 on failure. */
+static int
+options_act_on_changes(const or_options_t *old_options,
+                       const smartlist_t *changed)
+{
+  or_options_t *options = get_options_mutable();
+
+  /* options_act_reversible() and options_act() would have set these. */
+  options->_ConnLimit = old_options->_ConnLimit;
+  if (old_options->_BridgePassword_AuthDigest)
+    options->_BridgePassword_AuthDigest =
+      tor_memdup(old_options->_BridgePassword_AuthDigest, DIGEST256_LEN);
+
+  SMARTLIST_FOREACH_BEGIN(changed, const config_var_t *, var) {
+    const option_change_handler_t *h = option_get_change_handler(var->name);
+    if (h->fn && h->fn(old_options, options) < 0)
+      return -1;
+  } SMARTLIST_FOREACH_END(var);
+  return 0;
+}
+
 /** Change the current global options to contain <b>new_val</b> instead of
  * their current value; take action based on the new value; free the old value
  * as necessary.  Returns 0 on success, -1 on failure.
@@ -739,50 +924,66 @@ get_options(void)
 int
 set_options(or_options_t *new_val, char **msg)
 {
-  int i;
-  smartlist_t *elements;
+  smartlist_t *elements, *changed = NULL;
   config_line_t *line;
   or_options_t *old_options = global_options;
   global_options = new_val;
-  /* Note that we pass the *old* options below, for comparison. It
-   * pulls the new options directly out of global_options. */
-  if (options_act_reversible(old_options, msg)<0) {
-    tor_assert(*msg);
-    global_options = old_options;
-    return -1;
-  }
-  if (options_act(old_options) < 0) { /* acting on the options failed. die. */
-    log_err(LD_BUG,
-            "Acting on config options left us in a broken state. Dying.");
-    exit(1);
+  /* If only options that we can handle one by one have changed, do that;
+   * otherwise, act on the options as a whole. */
+  if (old_options && old_options != global_options)
+    changed = options_get_changed_vars(old_options, new_val, 1);
+  /* If nothing changed (as on a HUP with an unchanged torrc), we still
+   * need options_act() to reopen logs, reload keys, and so on. */
+  if (changed && !smartlist_len(changed)) {
+    smartlist_free(changed);
+    changed = NULL;
+  }
+  if (changed) {
+    if (options_act_on_changes(old_options, changed) < 0) {
+      *msg = tor_strdup("Failed to act on changed options.");
+      global_options = old_options;
+      smartlist_free(changed);
+      return -1;
+    }
+  } else {
+    /* Note that we pass the *old* options below, for comparison. It
+     * pulls the new options directly out of global_options. */
+    if (options_act_reversible(old_options, msg)<0) {
+      tor_assert(*msg);
+      global_options = old_options;
+      smartlist_free(changed);
+      return -1;
+    }
+    if (options_act(old_options) < 0) {
+      /* Acting on the options failed.  Die. */
+      log_err(LD_BUG,
+              "Acting on config options left us in a broken state. Dying.");
+      exit(1);
+    }
+    /* Acting on the options can change them, so compare them now. */
+    if (old_options && old_options != global_options)
+      changed = options_get_changed_vars(old_options, new_val, 0);
   }
   /* Issues a CONF_CHANGED event to notify controller of the change. If Tor is
    * just starting up then the old_options will be undefined. */
-  if (old_options && old_options != global_options) {
+  if (changed) {
     elements = smartlist_new();
-    for (i=0; options_format.vars[i].name; ++i) {
-      const config_var_t *var = &options_format.vars[i];
-      const char *var_name = var->name;
-      if (var->type == CONFIG_TYPE_LINELIST_S ||
-          var->type == CONFIG_TYPE_OBSOLETE) {
-        continue;
-      }
-      if (!option_is_same(&options_format, new_val, old_options, var_name)) {
-        line = get_assigned_option(&options_format, new_val, var_name, 1);
+    SMARTLIST_FOREACH_BEGIN(changed, const config_var_t *, var) {
+      line = get_assigned_option(&options_format, new_val, var->name, 1);
 
-        if (line) {
-          for (; line; line = line->next) {
-            smartlist_add(elements, line->key);
-            smartlist_add(elements, line->value);
-          }
-        } else {
-          smartlist_add(elements, (char*)options_format.vars[i].name);
-          smartlist_add(elements, NULL);
+      if (line) {
+        for (; line; line = line->next) {
+          smartlist_add(elements, line->key);
+          smartlist_add(elements, line->value);
         }
+      } else {
+        smartlist_add(elements, (char*)var->name);
+        smartlist_add(elements, NULL);
       }
-    }
+    } SMARTLIST_FOREACH_END(var);
     control_event_conf_changed(elements);
     smartlist_free(elements);
+    smartlist_free(changed);
   }
 
   if (old_options != global_options)
@@ -863,6 +1064,11 @@ config_free_all(void)
   config_free_lines(global_cmdline_options);
   global_cmdline_options = NULL;
 
+  strmap_free(options_format.var_index, NULL);
+  options_format.var_index = NULL;
+  strmap_free(state_format.var_index, NULL);
+  state_format.var_index = NULL;
+
   if (configured_ports) {
     SMARTLIST_FOREACH(configured_ports,
                       port_cfg_t *, p, tor_free(p));
@@ -1077,6 +1283,30 @@ consider_adding_dir_authorities(const or_options_t *options,
   return 0;
 }
 
+/** Load the GeoIP file named by <b>options</b>-&gt;GeoIPFile.  Return 0 on
+ * success, -1 on failure. */
+int
+config_load_geoip_file(const or_options_t *options)
+{
+  /* XXXX Don't use this "<default>" junk; make our filename options
+   * understand prefixes somehow. -NM */
+  char *actual_fname = tor_strdup(options->GeoIPFile);
+  int r;
+  uint64_t phase_start;
+#ifdef _WIN32
+  if (!strcmp(actual_fname, "<default>")) {
+    const char *conf_root = get_windows_conf_root();
+    tor_free(actual_fname);
+    tor_asprintf(&actual_fname, "%s\\geoip", conf_root);
+  }
+#endif
+  phase_start = tor_monotime_nsec();
+  r = geoip_load_file(actual_fname, options);
+  startup_timeline_note("geoip", phase_start);
+  tor_free(actual_fname);
+  return r;
+}
+
 /** Fetch the active option list, and take actions based on it. All of the
  * things we do should survive being done repeatedly.  If present,
  * <b>old_options</b> contains the previous value of the options.
@@ -1156,6 +1386,8 @@ options_act_reversible(const or_options_t *old_options, char **msg)
       }
     }
     if (options->DisableNetwork) {
+      if (old_options && !old_options->DisableNetwork)
+        hibernate_save_resume_state(time(NULL));
       /* Aggressively close non-controller stuff, NOW */
       log_notice(LD_NET, "DisableNetwork is set. Tor will not make or accept "
                  "non-control network connections. Shutting down all existing "
@@ -1398,6 +1630,10 @@ options_act(const or_options_t *old_options)
   if (consider_adding_dir_authorities(options, old_options) < 0)
     return -1;
 
+  if (mp_arena_set_enabled(options->HugePageArena) < 0)
+    log_warn(LD_CONFIG, "HugePageArena is set, but we can't map memory "
+             "regions ourselves on this platform. Using malloc instead.");
+
 #ifdef NON_ANONYMOUS_MODE_ENABLED
   log(LOG_WARN, LD_GENERAL, "This copy of Tor was compiled to run in a "
       "non-anonymous mode. It will provide NO ANONYMITY.");
@@ -1446,9 +1682,11 @@ options_act(const or_options_t *old_options)
 
   /* Load state */
   if (! global_state && running_tor) {
+    uint64_t phase_start = tor_monotime_nsec();
     if (or_state_load())
       return -1;
     rep_hist_load_mtbf_data(time(NULL));
+    startup_timeline_note("state", phase_start);
   }
 
   mark_transport_list();
@@ -1506,6 +1744,8 @@ options_act(const or_options_t *old_options)
     crypto_set_tls_dh_prime(NULL);
   }
 
+  tor_tls_set_session_cache_size(options_get_tls_session_cache_size(options));
+
   /* We want to reinit keys as needed before we do much of anything else:
      keys are important, and other things can depend on them. */
   if (transition_affects_workers ||
@@ -1597,6 +1837,9 @@ options_act(const or_options_t *old_options)
   if (old_options) {
     int revise_trackexithosts = 0;
     int revise_automap_entries = 0;
+    if (old_options->DisableNetwork && !options->DisableNetwork &&
+        !we_are_hibernating())
+      hibernate_warm_resume(time(NULL));
     if ((options->UseEntryGuards && !old_options->UseEntryGuards) ||
         options->UseBridges != old_options->UseBridges ||
         (options->UseBridges &&
@@ -1623,6 +1866,9 @@ options_act(const or_options_t *old_options)
     if (revise_trackexithosts)
       addressmap_clear_excluded_trackexithosts(options);
 
+    if (!options->ClientDNSCache && old_options->ClientDNSCache)
+      addressmap_clear_dns_cache();
+
     if (!options->AutomapHostsOnResolve) {
       if (old_options->AutomapHostsOnResolve)
         revise_automap_entries = 1;
@@ -1683,26 +1929,16 @@ options_act(const or_options_t *old_options)
 
     if (options->PerConnBWRate != old_options->PerConnBWRate ||
         options->PerConnBWBurst != old_options->PerConnBWBurst)
-      connection_or_update_token_buckets(get_connection_array(), options);
+      connection_or_update_token_buckets(
+          get_connection_array_by_type(CONN_TYPE_OR), options);
   }
 
   /* Maybe load geoip file */
   if (options->GeoIPFile &&
       ((!old_options || !opt_streq(old_options->GeoIPFile, options->GeoIPFile))
        || !geoip_is_loaded())) {
-    /* XXXX Don't use this "<default>" junk; make our filename options
-     * understand prefixes somehow. -NM */
     /* XXXX024 Reload GeoIPFile on SIGHUP. -NM */
-    char *actual_fname = tor_strdup(options->GeoIPFile);
-#ifdef _WIN32
-    if (!strcmp(actual_fname, "<default>")) {
-      const char *conf_root = get_windows_conf_root();
-      tor_free(actual_fname);
-      tor_asprintf(&actual_fname, "%s\\geoip", conf_root);
-    }
-#endif
-    geoip_load_file(actual_fname, options);
-    tor_free(actual_fname);
+    config_load_geoip_file(options);
   }
 
   if (options->CellStatistics || options->DirReqStatistics ||
@@ -1799,6 +2035,9 @@ options_act(const or_options_t *old_options)
        !routerset_equal(old_options->ExcludeNodes,options->ExcludeNodes)))
     entry_nodes_should_be_added();
 
+  /* Our new options may change which of our entry guards we can use. */
+  entry_guards_note_usability_changed();
+
   /* Since our options changed, we might need to regenerate and upload our
    * server descriptor.
    */
@@ -1891,7 +2130,8 @@ config_get_commandlines(int argc, char **argv, config_line_t **result)
 
     if (!strcmp(argv[i],"-f") ||
         !strcmp(argv[i],"--defaults-torrc") ||
-        !strcmp(argv[i],"--hash-password")) {
+        !strcmp(argv[i],"--hash-password") ||
+        !strcmp(argv[i],"--dump-geoip-binary")) {
       i += 2; /* command-line option with argument. ignore them. */
       continue;
     } else if (!strcmp(argv[i],"--list-fingerprint") ||
@@ -1992,17 +2232,13 @@ config_get_lines(const char *string, config_line_t **result, int extended)
     if (k && v) {
       unsigned command = CONFIG_LINE_NORMAL;
       if (extended) {
+        /* Strip the prefix in place, rather than copying the key. */
         if (k[0] == '+') {
-          char *k_new = tor_strdup(k+1);
-          tor_free(k);
-          k = k_new;
+          memmove(k, k+1, strlen(k));
           command = CONFIG_LINE_APPEND;
         } else if (k[0] == '/') {
-          char *k_new = tor_strdup(k+1);
-          tor_free(k);
-          k = k_new;
-          tor_free(v);
-          v = tor_strdup("");
+          memmove(k, k+1, strlen(k));
+          v[0] = '\0';
           command = CONFIG_LINE_CLEAR;
         }
       }
@@ -2043,20 +2279,37 @@ config_free_lines(config_line_t *front)
   }
 }
 
+/** The longest option name we look up in a config_format_t's var_index;
+ * no option name is anywhere near this long. */
+#define MAX_INDEXED_OPTION_NAME_LEN 128
+
 /** As config_find_option, but return a non-const pointer. */
 static config_var_t *
 config_find_option_mutable(config_format_t *fmt, const char *key)
 {
   int i;
   size_t keylen = strlen(key);
+  char lowered[MAX_INDEXED_OPTION_NAME_LEN];
   if (!keylen)
     return NULL; /* if they say "--" on the command line, it's not an option */
-  /* First, check for an exact (case-insensitive) match */
-  for (i=0; fmt->vars[i].name; ++i) {
-    if (!strcasecmp(key, fmt->vars[i].name)) {
-      return &fmt->vars[i];
+  if (!fmt->var_index) {
+    fmt->var_index = strmap_new();
+    for (i=0; fmt->vars[i].name; ++i) {
+      tor_assert(strlen(fmt->vars[i].name) < sizeof(lowered));
+      strlcpy(lowered, fmt->vars[i].name, sizeof(lowered));
+      tor_strlower(lowered);
+      if (!strmap_get(fmt->var_index, lowered))
+        strmap_set(fmt->var_index, lowered, &fmt->vars[i]);
     }
   }
+  /* First, check for an exact (case-insensitive) match */
+  if (keylen < sizeof(lowered)) {
+    config_var_t *var;
+    strlcpy(lowered, key, sizeof(lowered));
+    tor_strlower(lowered);
+    if ((var = strmap_get(fmt->var_index, lowered)))
+      return var;
+  }
   /* If none, check for an abbreviated match */
   for (i=0; fmt->vars[i].name; ++i) {
     if (!strncasecmp(key, fmt->vars[i].name, keylen)) {
@@ -2705,6 +2958,8 @@ options_trial_assign(config_line_t *list, int use_defaults,
 {
   int r;
   or_options_t *trial_options = options_dup(&options_format, get_options());
+  /* options_dup() only copies the options proper. */
+  trial_options->command = get_options()->command;
 
   if ((r=config_assign(&options_format, trial_options,
                        list, use_defaults, clear_first, msg)) < 0) {
@@ -3329,10 +3584,85 @@ compute_publishserverdescriptor(or_options_t *options)
  * will generate too many circuits and potentially overload the network. */
 #define MIN_CIRCUIT_STREAM_TIMEOUT 10
 
+/** Highest allowable value for DataCellCoalesceDelay, in msec; holding
+ * data back for longer than this would hurt interactive streams more than
+ * fuller cells could help. */
+#define MAX_DATA_CELL_COALESCE_DELAY 1000
+
 /** Lowest allowable value for HeartbeatPeriod; if this is too low, we might
  * expose more information than we're comfortable with. */
 #define MIN_HEARTBEAT_PERIOD (30*60)
 
+/** Highest allowable value for TLSSessionCacheSize; each entry holds an
+ * SSL_SESSION, and we scan them all when we need to evict one. */
+#define MAX_TLS_SESSION_CACHE_SIZE 8192
+
+/** Return how many TLS sessions we should keep for resumption under
+ * <b>options</b>.  Only relays resume sessions, when they connect to other
+ * relays: a client that resumed its sessions would let its guard link
+ * each of its connections to the ones before. */
+int
+options_get_tls_session_cache_size(const or_options_t *options)
+{
+  if (!server_mode(options))
+    return 0;
+  return options->TLSSessionCacheSize;
+}
+
+/** Parse <b>entries</b>, the value of BandwidthClassWeights, into
+ * <b>weights_out</b>, which is indexed by bw_class_t.  Return 0 on success;
+ * on failure, set *<b>msg</b> and return -1. */
+int
+parse_bandwidth_class_weights(const smartlist_t *entries, int *weights_out,
+                              char **msg)
+{
+  static const char *class_names[N_BW_CLASSES] = {
+    "relay", "dir", "client", "control"
+  };
+  int total = 0;
+
+  memset(weights_out, 0, sizeof(int)*N_BW_CLASSES);
+  if (!entries)
+    return 0;
+
+  SMARTLIST_FOREACH_BEGIN(entries, const char *, entry) {
+    const char *eq = strchr(entry, '=');
+    int i, ok, found = 0;
+    long weight;
+    if (!eq) {
+      tor_asprintf(msg, "BandwidthClassWeights entry \"%s\" is not of the "
+                   "form class=weight.", entry);
+      return -1;
+    }
+    weight = tor_parse_long(eq+1, 10, 0, 1000, &ok, NULL);
+    if (!ok) {
+      tor_asprintf(msg, "BandwidthClassWeights entry \"%s\" needs a weight "
+                   "between 0 and 1000.", entry);
+      return -1;
+    }
+    for (i = 0; i < N_BW_CLASSES; ++i) {
+      if (strlen(class_names[i]) == (size_t)(eq - entry) &&
+          !strncasecmp(entry, class_names[i], eq - entry)) {
+        weights_out[i] = (int)weight;
+        found = 1;
+      }
+    }
+    if (!found) {
+      tor_asprintf(msg, "BandwidthClassWeights entry \"%s\" names an "
+                   "unrecognized class.", entry);
+      return -1;
+    }
+    total += (int)weight;
+  } SMARTLIST_FOREACH_END(entry);
+
+  if (!total) {
+    tor_asprintf(msg, "BandwidthClassWeights needs at least one nonzero "
+                 "weight.");
+    return -1;
+  }
+  return 0;
+}
+
 /** Lowest recommended value for CircuitBuildTimeout; if it is set too low
  * and LearnCircuitBuildTimeout is off, the failure rate for circuit
  * construction may be very high.  In that case, if it is set below this
@@ -3442,6 +3772,12 @@ options_validate(or_options_t *old_options, or_options_t *options,
     REJECT("TokenBucketRefillInterval must be between 1 and 1000 inclusive.");
   }
 
+  if (options->DormantWakeupInterval > MAX_DORMANT_WAKEUP_INTERVAL) {
+    tor_asprintf(msg, "DormantWakeupInterval must be at most %d seconds.",
+                 MAX_DORMANT_WAKEUP_INTERVAL);
+    return -1;
+  }
+
   if (options->ExcludeExitNodes || options->ExcludeNodes) {
     options->_ExcludeExitNodesUnion = routerset_new();
     routerset_union(options->_ExcludeExitNodesUnion,options->ExcludeExitNodes);
@@ -3679,6 +4015,20 @@ options_validate(or_options_t *old_options, or_options_t *options,
     return -1;
   }
 
+  if (!options->DirCompressionLevel ||
+      !strcasecmp(options->DirCompressionLevel, "high")) {
+    options->_DirCompressionLevel = HIGH_COMPRESSION;
+  } else if (!strcasecmp(options->DirCompressionLevel, "medium")) {
+    options->_DirCompressionLevel = MEDIUM_COMPRESSION;
+  } else if (!strcasecmp(options->DirCompressionLevel, "low")) {
+    options->_DirCompressionLevel = LOW_COMPRESSION;
+  } else {
+    tor_asprintf(msg,
+                 "Unrecognized value '%s' in DirCompressionLevel",
+                 escaped(options->DirCompressionLevel));
+    return -1;
+  }
+
   if (compute_publishserverdescriptor(options) < 0) {
     tor_asprintf(msg, "Unrecognized value in PublishServerDescriptor");
     return -1;
@@ -3770,6 +4120,18 @@ options_validate(or_options_t *old_options, or_options_t *options,
   if (options->KeepalivePeriod < 1)
     REJECT("KeepalivePeriod option must be positive.");
 
+  if (options->KeystreamPrecomputeCells > MAX_KEYSTREAM_PRECOMPUTE_CELLS) {
+    tor_asprintf(msg, "KeystreamPrecomputeCells must be at most %d.",
+                 MAX_KEYSTREAM_PRECOMPUTE_CELLS);
+    return -1;
+  }
+
+  if (options->TLSSessionCacheSize > MAX_TLS_SESSION_CACHE_SIZE) {
+    tor_asprintf(msg, "TLSSessionCacheSize must be at most %d.",
+                 MAX_TLS_SESSION_CACHE_SIZE);
+    return -1;
+  }
+
   if (ensure_bandwidth_cap(&options->BandwidthRate,
                            "BandwidthRate", msg) < 0)
     return -1;
@@ -3798,6 +4160,11 @@ options_validate(or_options_t *old_options, or_options_t *options,
                            "AuthDirGuardBWGuarantee", msg) < 0)
     return -1;
 
+  if (parse_bandwidth_class_weights(options->BandwidthClassWeights,
+                                    options->_BandwidthClassWeights,
+                                    msg) < 0)
+    return -1;
+
   if (options->RelayBandwidthRate && !options->RelayBandwidthBurst)
     options->RelayBandwidthBurst = options->RelayBandwidthRate;
   if (options->RelayBandwidthBurst && !options->RelayBandwidthRate)
@@ -4019,6 +4386,29 @@ options_validate(or_options_t *old_options, or_options_t *options,
       REJECT("Server transport line did not parse. See logs for details.");
   }
 
+  if (options->DataCellCoalesceDelay > MAX_DATA_CELL_COALESCE_DELAY) {
+    log_warn(LD_CONFIG, "DataCellCoalesceDelay is too high; clipping to %d "
+             "msec.", MAX_DATA_CELL_COALESCE_DELAY);
+    options->DataCellCoalesceDelay = MAX_DATA_CELL_COALESCE_DELAY;
+  }
+
+  if (options->MaxMemInCellQueues < (8 << 20)) {
+    log_warn(LD_CONFIG, "MaxMemInCellQueues must be at least 8 MB for now. "
+             "Ideally, have it as large as you can afford.");
+    options->MaxMemInCellQueues = (8 << 20);
+  }
+
+  if (options->HidServDirectoryCacheSize < (1 << 20)) {
+    log_warn(LD_CONFIG, "HidServDirectoryCacheSize must be at least 1 MB.");
+    options->HidServDirectoryCacheSize = (1 << 20);
+  }
+
+  if (options->MaxMemInBuffers && options->MaxMemInBuffers < (8 << 20)) {
+    log_warn(LD_CONFIG, "MaxMemInBuffers must be 0 or at least 8 MB for "
+             "now.");
+    options->MaxMemInBuffers = (8 << 20);
+  }
+
   if (options->ConstrainedSockets) {
     /* If the user wants to constrain socket buffer use, make sure the desired
      * limit is between MIN|MAX_TCPSOCK_BUFFER in k increments. */
@@ -4041,6 +4431,28 @@ options_validate(or_options_t *old_options, or_options_t *options,
     }
   }
 
+  if (options->ClientDNSCacheMaxTTL < 1)
+    REJECT("ClientDNSCacheMaxTTL must be at least 1 second.  To stop caching "
+           "DNS answers, set ClientDNSCache to 0.");
+
+  if (options->TCPNotSentLowat > INT_MAX)
+    REJECT("TCPNotSentLowat is absurdly large.");
+
+  if (options->SocketBufferBudget) {
+    if (options->ConstrainedSockets)
+      REJECT("SocketBufferBudget and ConstrainedSockets can't both be set.");
+    if (options->SocketBufferBudget < (256<<10))
+      REJECT("SocketBufferBudget must be 0 or at least 256 KB.");
+  }
+
+  if (!dns_backend_is_available(options->ServerDNSBackend)) {
+    tor_asprintf(msg, "ServerDNSBackend '%s' is not supported on this "
+                 "platform; try 'eventdns'.", options->ServerDNSBackend);
+    return -1;
+  }
+  if (options->ServerDNSMaxThreads < 1 || options->ServerDNSMaxThreads > 256)
+    REJECT("ServerDNSMaxThreads must be between 1 and 256.");
+
   if (options->V3AuthVoteDelay + options->V3AuthDistDelay >=
       options->V3AuthVotingInterval/2) {
     REJECT("V3AuthVoteDelay plus V3AuthDistDelay must be less than half "
@@ -4628,6 +5040,10 @@ options_init_from_torrc(int argc, char **argv)
       ++i;
     } else if (!strcmp(argv[i],"--verify-config")) {
       command = CMD_VERIFY_CONFIG;
+    } else if (!strcmp(argv[i],"--dump-geoip-binary")) {
+      command = CMD_DUMP_GEOIP_BINARY;
+      command_arg = tor_strdup( (i < argc-1) ? argv[i+1] : "");
+      ++i;
     }
   }
 
@@ -5007,8 +5423,13 @@ options_init_logs(or_options_t *options, int validate_only)
   }
   smartlist_free(elts);
 
-  if (ok && !validate_only)
+  if (ok && !validate_only) {
     logs_set_domain_logging(options->LogMessageDomains);
+    if (logs_set_async(options->AsyncLogging) < 0)
+      log_warn(LD_CONFIG, "AsyncLogging is set, but we can't write logs "
+               "from a separate thread on this platform. Writing them "
+               "directly instead.");
+  }
 
   return ok?0:-1;
 }
@@ -6905,7 +7326,23 @@ did_last_state_file_write_fail(void)
  * bandwidth used, per-country user stats, etc. */
 #define STATE_RELAY_CHECKPOINT_INTERVAL (12*60*60)
 
-/** Write the persistent state to disk. Return 0 for success, <0 on failure. */
+/** Called when we fail to write the state file in the background: try
+ * again after STATE_WRITE_RETRY_INTERVAL. */
+static void
+or_state_write_failed(const char *fname)
+{
+  time_t now = time(NULL);
+  (void)fname;
+  last_state_file_write_failed = 1;
+  if (global_state &&
+      global_state->next_write > now + STATE_WRITE_RETRY_INTERVAL)
+    global_state->next_write = now + STATE_WRITE_RETRY_INTERVAL;
+}
+
+/** Write the persistent state to disk. Return 0 for success, <0 on failure.
+ *
+ * We serialize the state here, but write it from a background thread
+ * where we can; see write_str_to_file_behind(). */
 int
 or_state_save(time_t now)
 {
@@ -6940,7 +7377,8 @@ or_state_save(time_t now)
                tbuf, state);
   tor_free(state);
   fname = get_datadir_fname("state");
-  if (write_str_to_file(fname, contents, 0)<0) {
+  if (write_str_to_file_behind(fname, contents, 0,
+                               or_state_write_failed)<0) {
     log_warn(LD_FS, "Unable to write state to file \"%s\"; "
              "will try again later", fname);
     last_state_file_write_failed = 1;
@@ -77,6 +77,7 @@ char *get_first_listener_addrport_string(int listener_type);
 
 int options_need_geoip_info(const or_options_t *options,
                             const char **reason_out);
+int config_load_geoip_file(const or_options_t *options);
 
 void save_transport_to_state(const char *transport_name,
                              const tor_addr_t *addr, uint16_t port);
@@ -91,8 +92,11 @@ uint32_t get_effective_bwrate(const or_options_t *options);
 uint32_t get_effective_bwburst(const or_options_t *options);
 
 #ifdef CONFIG_PRIVATE
-/* Used only by config.c and test.c */
+/* Used only by config.c, test.c, and bench.c */
 or_options_t *options_new(void);
+int options_get_tls_session_cache_size(const or_options_t *options);
+int parse_bandwidth_class_weights(const smartlist_t *entries,
+                                  int *weights_out, char **msg);
 #endif
 
 void config_register_addressmaps(const or_options_t *options);
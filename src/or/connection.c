@@ -10,6 +10,7 @@
  * on connections.
  **/
 
+#define CONNECTION_PRIVATE
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
@@ -26,6 +27,7 @@
 #include "dns.h"
 #include "dnsserv.h"
 #include "geoip.h"
+#include "hibernate.h"
 #include "main.h"
 #include "policies.h"
 #include "reasons.h"
@@ -35,6 +37,8 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerparse.h"
+#include "scheduler.h"
+#include "transports.h"
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/event.h>
@@ -44,6 +48,16 @@
 #include <pwd.h>
 #endif
 
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_SYS_IOCTL_H
+#include <sys/ioctl.h>
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h>
+#endif
+
 static connection_t *connection_listener_new(
                                const struct sockaddr *listensockaddr,
                                socklen_t listensocklen, int type,
@@ -57,6 +71,7 @@ static int connection_handle_listener_read(connection_t *conn, int new_type);
 #ifndef USE_BUFFEREVENTS
 static int connection_bucket_should_increase(int bucket,
                                              or_connection_t *conn);
+static void connection_forget_blocked_on_bw(connection_t *conn);
 #endif
 static int connection_finished_flushing(connection_t *conn);
 static int connection_flushed_some(connection_t *conn);
@@ -65,8 +80,13 @@ static int connection_reached_eof(connection_t *conn);
 static int connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
                                   int *socket_error);
 static int connection_process_inbuf(connection_t *conn, int package_partial);
+static void connection_write_to_buf_helper(const char *string, size_t len,
+                                           connection_t *conn, int zlib,
+                                           void (*release_fn)(void *),
+                                           void *arg);
 static void client_check_address_changed(tor_socket_t sock);
 static void set_constrained_socket_buffers(tor_socket_t sock, int size);
+static void connection_set_notsent_lowat(connection_t *conn);
 
 static const char *connection_proxy_state_to_string(int state);
 static int connection_read_https_proxy_response(connection_t *conn);
@@ -232,7 +252,8 @@ connection_type_uses_bufferevent(connection_t *conn)
 dir_connection_t *
 dir_connection_new(int socket_family)
 {
-  dir_connection_t *dir_conn = tor_malloc_zero(sizeof(dir_connection_t));
+  dir_connection_t *dir_conn =
+    tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(dir_connection_t));
   connection_init(time(NULL), TO_CONN(dir_conn), CONN_TYPE_DIR, socket_family);
   return dir_conn;
 }
@@ -242,15 +263,15 @@ dir_connection_new(int socket_family)
 or_connection_t *
 or_connection_new(int socket_family)
 {
-  or_connection_t *or_conn = tor_malloc_zero(sizeof(or_connection_t));
+  or_connection_t *or_conn =
+    tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(or_connection_t));
   time_t now = time(NULL);
   connection_init(now, TO_CONN(or_conn), CONN_TYPE_OR, socket_family);
 
   or_conn->timestamp_last_added_nonpadding = time(NULL);
   or_conn->next_circ_id = crypto_rand_int(1<<15);
 
-  or_conn->active_circuit_pqueue = smartlist_new();
-  or_conn->active_circuit_pqueue_last_recalibrated = cell_ewma_get_tick();
+  or_conn->sched_heap_idx = -1;
 
   return or_conn;
 }
@@ -260,7 +281,8 @@ or_connection_new(int socket_family)
 entry_connection_t *
 entry_connection_new(int type, int socket_family)
 {
-  entry_connection_t *entry_conn = tor_malloc_zero(sizeof(entry_connection_t));
+  entry_connection_t *entry_conn =
+    tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(entry_connection_t));
   tor_assert(type == CONN_TYPE_AP);
   connection_init(time(NULL), ENTRY_TO_CONN(entry_conn), type, socket_family);
   entry_conn->socks_request = socks_request_new();
@@ -272,7 +294,8 @@ entry_connection_new(int type, int socket_family)
 edge_connection_t *
 edge_connection_new(int type, int socket_family)
 {
-  edge_connection_t *edge_conn = tor_malloc_zero(sizeof(edge_connection_t));
+  edge_connection_t *edge_conn =
+    tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(edge_connection_t));
   tor_assert(type == CONN_TYPE_EXIT);
   connection_init(time(NULL), TO_CONN(edge_conn), type, socket_family);
   return edge_conn;
@@ -284,7 +307,7 @@ control_connection_t *
 control_connection_new(int socket_family)
 {
   control_connection_t *control_conn =
-    tor_malloc_zero(sizeof(control_connection_t));
+    tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(control_connection_t));
   connection_init(time(NULL),
                   TO_CONN(control_conn), CONN_TYPE_CONTROL, socket_family);
   log_notice(LD_CONTROL, "New control connection opened.");
@@ -297,7 +320,7 @@ listener_connection_t *
 listener_connection_new(int type, int socket_family)
 {
   listener_connection_t *listener_conn =
-    tor_malloc_zero(sizeof(listener_connection_t));
+    tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(listener_connection_t));
   connection_init(time(NULL), TO_CONN(listener_conn), type, socket_family);
   return listener_conn;
 }
@@ -328,7 +351,8 @@ connection_new(int type, int socket_family)
       return TO_CONN(listener_connection_new(type, socket_family));
 
     default: {
-      connection_t *conn = tor_malloc_zero(sizeof(connection_t));
+      connection_t *conn =
+        tor_malloc_zero_tagged(MEMTAG_CONNECTION, sizeof(connection_t));
       connection_init(time(NULL), conn, type, socket_family);
       return conn;
     }
@@ -379,6 +403,9 @@ connection_init(time_t now, connection_t *conn, int type, int socket_family)
 
   conn->s = TOR_INVALID_SOCKET; /* give it a default of 'not used' */
   conn->conn_array_index = -1; /* also default to 'not used' */
+  conn->conn_type_index = -1;
+  conn->bw_blocked_idx = -1;
+  conn->housekeeping_idx = -1;
   conn->global_identifier = n_connections_allocated++;
 
   conn->type = type;
@@ -486,17 +513,29 @@ _connection_free(connection_t *conn)
 
   tor_free(conn->address);
 
+#ifndef USE_BUFFEREVENTS
+  connection_forget_blocked_on_bw(conn);
+#endif
+
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
     tor_tls_free(or_conn->tls);
     or_conn->tls = NULL;
     or_handshake_state_free(or_conn->handshake_state);
     or_conn->handshake_state = NULL;
+    scheduler_conn_release(or_conn);
+    circuit_free_orconn_circid_map(or_conn);
     smartlist_free(or_conn->active_circuit_pqueue);
     tor_free(or_conn->nickname);
   }
+  if (CONN_IS_EDGE(conn))
+    connection_edge_cancel_coalescing(TO_EDGE_CONN(conn));
+  if (conn->type == CONN_TYPE_EXIT)
+    connection_exit_cancel_reconnect(TO_EDGE_CONN(conn));
   if (conn->type == CONN_TYPE_AP) {
     entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
+    if (TO_EDGE_CONN(conn)->stream_bw_dirty)
+      control_forget_stream_bandwidth(TO_EDGE_CONN(conn));
     tor_free(entry_conn->chosen_exit_name);
     tor_free(entry_conn->original_dest_address);
     if (entry_conn->socks_request)
@@ -507,6 +546,7 @@ _connection_free(connection_t *conn)
     if (entry_conn->sending_optimistic_data) {
       generic_buffer_free(entry_conn->sending_optimistic_data);
     }
+    smartlist_free(entry_conn->dns_server_extra_requests);
   }
   if (CONN_IS_EDGE(conn)) {
     rend_data_free(TO_EDGE_CONN(conn)->rend_data);
@@ -515,6 +555,15 @@ _connection_free(connection_t *conn)
     control_connection_t *control_conn = TO_CONTROL_CONN(conn);
     tor_free(control_conn->safecookie_client_hash);
     tor_free(control_conn->incoming_cmd);
+    if (control_conn->getinfo_spool) {
+      SMARTLIST_FOREACH(control_conn->getinfo_spool, char *, cp,
+                        tor_free(cp));
+      smartlist_free(control_conn->getinfo_spool);
+    }
+    if (control_conn->held_events) {
+      SMARTLIST_FOREACH(control_conn->held_events, char *, cp, tor_free(cp));
+      smartlist_free(control_conn->held_events);
+    }
   }
 
   tor_free(conn->read_event); /* Probably already freed by connection_free. */
@@ -534,6 +583,9 @@ _connection_free(connection_t *conn)
     tor_free(dir_conn->requested_resource);
 
     tor_zlib_free(dir_conn->zlib_state);
+    tor_free(dir_conn->response_headers);
+    tor_zlib_free(dir_conn->response_zlib_state);
+    tor_free(dir_conn->response_body);
     if (dir_conn->fingerprint_stack) {
       SMARTLIST_FOREACH(dir_conn->fingerprint_stack, char *, cp, tor_free(cp));
       smartlist_free(dir_conn->fingerprint_stack);
@@ -562,7 +614,7 @@ _connection_free(connection_t *conn)
 #endif
 
   memset(mem, 0xCC, memlen); /* poison memory */
-  tor_free(mem);
+  tor_free_tagged(mem);
 }
 
 /** Make sure <b>conn</b> isn't in any of the global conn lists; then free it.
@@ -655,6 +707,15 @@ connection_close_immediate(connection_t *conn)
 
   connection_unregister_events(conn);
 
+  if (conn->type == CONN_TYPE_OR &&
+      TO_OR_CONN(conn)->tls_handshake_in_worker) {
+    /* A cpuworker is using the socket right now; closing it could let the
+     * fd get reused under the worker's feet.
+     * connection_or_tls_handshake_done() will call us again. */
+    TO_OR_CONN(conn)->close_after_worker = 1;
+    return;
+  }
+
   if (SOCKET_OK(conn->s))
     tor_close_socket(conn->s);
   conn->s = TOR_INVALID_SOCKET;
@@ -1145,11 +1206,14 @@ check_sockaddr_family_match(sa_family_t got, connection_t *listener)
   return 0;
 }
 
-/** The listener connection <b>conn</b> told poll() it wanted to read.
- * Call accept() on conn-\>s, and add the new connection if necessary.
+/** Helper for connection_handle_listener_read(): call accept() once on
+ * the listener <b>conn</b>, and add the new connection if necessary.
+ * Return 0 if we accepted (or turned away) a connection, and might find
+ * another; 1 if there are no more to accept for now; and -1 if we closed
+ * the listener.
  */
 static int
-connection_handle_listener_read(connection_t *conn, int new_type)
+connection_accept_one(connection_t *conn, int new_type)
 {
   tor_socket_t news; /* the new socket */
   connection_t *newconn;
@@ -1163,14 +1227,15 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   tor_assert((size_t)remotelen >= sizeof(struct sockaddr_in));
   memset(&addrbuf, 0, sizeof(addrbuf));
 
-  news = tor_accept_socket(conn->s,remote,&remotelen);
+  news = tor_accept_socket_nonblocking(conn->s,remote,&remotelen);
   if (!SOCKET_OK(news)) { /* accept() error */
     int e = tor_socket_errno(conn->s);
     if (ERRNO_IS_ACCEPT_EAGAIN(e)) {
-      return 0; /* he hung up before we could accept(). that's fine. */
+      return 1; /* nobody else is waiting, or he hung up before we could
+                 * accept(). that's fine. */
     } else if (ERRNO_IS_ACCEPT_RESOURCE_LIMIT(e)) {
       warn_too_many_conns();
-      return 0;
+      return 1;
     }
     /* else there was a real error. */
     log_warn(LD_NET,"accept() failed: %s. Closing listener.",
@@ -1183,7 +1248,6 @@ connection_handle_listener_read(connection_t *conn, int new_type)
             (int)news,(int)conn->s);
 
   make_socket_reuseable(news);
-  set_socket_nonblocking(news);
 
   if (options->ConstrainedSockets)
     set_constrained_socket_buffers(news, (int)options->ConstrainedSockSize);
@@ -1238,6 +1302,7 @@ connection_handle_listener_read(connection_t *conn, int new_type)
     tor_addr_copy(&newconn->addr, &addr);
     newconn->port = port;
     newconn->address = tor_dup_addr(&addr);
+    connection_set_notsent_lowat(newconn);
 
   } else if (conn->socket_family == AF_UNIX) {
     /* For now only control ports can be Unix domain sockets
@@ -1268,6 +1333,31 @@ connection_handle_listener_read(connection_t *conn, int new_type)
   return 0;
 }
 
+/** The most connections we'll accept from one listener each time it
+ * becomes readable.  Draining the accept queue in batches keeps us from
+ * falling behind in a burst of new connections; bounding the batch keeps
+ * the burst from starving everything else. */
+#define MAX_ACCEPTS_PER_LISTENER_READ 64
+
+/** The listener connection <b>conn</b> told poll() it wanted to read.
+ * Accept as many of its pending connections as we can, up to
+ * MAX_ACCEPTS_PER_LISTENER_READ, and add the new connections as
+ * necessary.
+ */
+static int
+connection_handle_listener_read(connection_t *conn, int new_type)
+{
+  int i, r;
+  for (i = 0; i < MAX_ACCEPTS_PER_LISTENER_READ; ++i) {
+    r = connection_accept_one(conn, new_type);
+    if (r < 0)
+      return -1;
+    if (r > 0)
+      break;
+  }
+  return 0;
+}
+
 /** Initialize states for newly accepted connection <b>conn</b>.
  * If conn is an OR, start the TLS handshake.
  * If conn is a transparent AP, get its original destination
@@ -1313,18 +1403,17 @@ connection_init_accepted_conn(connection_t *conn,
   return 0;
 }
 
-/** Take conn, make a nonblocking socket; try to connect to
- * addr:port (they arrive in *host order*). If fail, return -1 and if
- * applicable put your best guess about errno into *<b>socket_error</b>.
- * Else assign s to conn-\>s: if connected return 1, if EAGAIN return 0.
+/** Make a nonblocking socket and try to connect it to addr:port (they
+ * arrive in *host order*). If fail, return -1 and if applicable put your
+ * best guess about errno into *<b>socket_error</b>.  Else set *<b>s_out</b>
+ * to the socket: if connected return 1, if EAGAIN return 0.
  *
  * address is used to make the logs useful.
- *
- * On success, add conn to the list of polled connections.
  */
-int
-connection_connect(connection_t *conn, const char *address,
-                   const tor_addr_t *addr, uint16_t port, int *socket_error)
+static int
+connection_open_connecting_socket(const char *address,
+                                  const tor_addr_t *addr, uint16_t port,
+                                  int *socket_error, tor_socket_t *s_out)
 {
   tor_socket_t s;
   int inprogress = 0;
@@ -1428,15 +1517,69 @@ connection_connect(connection_t *conn, const char *address,
          "Connection to %s:%u %s (sock %d).",
          escaped_safe_str_client(address),
          port, inprogress?"in progress":"established", s);
+  *s_out = s;
+  return inprogress ? 0 : 1;
+}
+
+/** Take conn, make a nonblocking socket; try to connect to
+ * addr:port (they arrive in *host order*). If fail, return -1 and if
+ * applicable put your best guess about errno into *<b>socket_error</b>.
+ * Else assign s to conn-\>s: if connected return 1, if EAGAIN return 0.
+ *
+ * address is used to make the logs useful.
+ *
+ * On success, add conn to the list of polled connections.
+ */
+int
+connection_connect(connection_t *conn, const char *address,
+                   const tor_addr_t *addr, uint16_t port, int *socket_error)
+{
+  tor_socket_t s = TOR_INVALID_SOCKET;
+  int r = connection_open_connecting_socket(address, addr, port,
+                                            socket_error, &s);
+  if (r < 0)
+    return -1;
   conn->s = s;
+  connection_set_notsent_lowat(conn);
   if (connection_add_connecting(conn) < 0) {
     /* no space, forget it */
     *socket_error = ENOBUFS;
     return -1;
   }
-  return inprogress ? 0 : 1;
+  return r;
 }
 
+#ifndef USE_BUFFEREVENTS
+/** Given <b>conn</b>, a polled connection whose connect() hasn't worked
+ * out, try connecting to <b>addr</b>:<b>port</b> instead.  Return as for
+ * connection_connect(); on success, conn's old socket is closed and its new
+ * one takes its place among the polled connections.  On failure, conn is
+ * unchanged. */
+int
+connection_reconnect(connection_t *conn, const tor_addr_t *addr,
+                     uint16_t port, int *socket_error)
+{
+  tor_socket_t s = TOR_INVALID_SOCKET;
+  int r = connection_open_connecting_socket(conn->address, addr, port,
+                                            socket_error, &s);
+  if (r < 0)
+    return -1;
+
+  connection_remove(conn);
+  conn->conn_array_index = -1;
+  tor_close_socket(conn->s);
+  conn->s = s;
+  connection_set_notsent_lowat(conn);
+  tor_addr_copy(&conn->addr, addr);
+  conn->port = port;
+  if (connection_add_connecting(conn) < 0) {
+    /* Without bufferevents, connection_add can't fail. */
+    tor_assert(0);
+  }
+  return r;
+}
+#endif
+
 /** Convert state number to string representation for logging purposes.
  */
 static const char *
@@ -2061,6 +2204,26 @@ extern int global_relayed_read_bucket, global_relayed_write_bucket;
  * we are likely to run dry again this second, so be stingy with the
  * tokens we just put in. */
 static int write_buckets_empty_last_second = 0;
+
+/** How many milliseconds of refill time connection_bucket_refill() has
+ * accounted for since we started.  Per-connection token buckets record
+ * where this clock stood when they were last refilled. */
+static uint64_t bucket_clock_msec = 0;
+
+/** The connections that have read_blocked_on_bw or write_blocked_on_bw set,
+ * so that connection_bucket_refill() can wake them without looking at
+ * every connection.  Each one's bw_blocked_idx is its index here. */
+static smartlist_t *conns_blocked_on_bw = NULL;
+
+/** For each bandwidth class, how many bytes of the global read and write
+ * buckets are set aside for it?  See BandwidthClassWeights. */
+static int bw_class_read_credit[N_BW_CLASSES];
+/** See bw_class_read_credit. */
+static int bw_class_write_credit[N_BW_CLASSES];
+/** For each bandwidth class, when did a connection in that class last want
+ * bandwidth?  Only recently active classes have their credit held back
+ * from the others. */
+static time_t bw_class_active_at[N_BW_CLASSES];
 #endif
 
 /** How many seconds of no active local circuits will make the
@@ -2083,6 +2246,58 @@ connection_counts_as_relayed_traffic(connection_t *conn, time_t now)
   return 0;
 }
 
+/** Return the bandwidth class that <b>conn</b>'s traffic belongs to. */
+static bw_class_t
+connection_get_bw_class(connection_t *conn, time_t now)
+{
+  switch (conn->type) {
+    case CONN_TYPE_OR:
+      return connection_counts_as_relayed_traffic(conn, now) ?
+        BW_CLASS_RELAY : BW_CLASS_CLIENT;
+    case CONN_TYPE_EXIT:
+      return BW_CLASS_RELAY;
+    case CONN_TYPE_DIR:
+      return BW_CLASS_DIR;
+    case CONN_TYPE_CONTROL:
+      return BW_CLASS_CONTROL;
+    default:
+      return BW_CLASS_CLIENT;
+  }
+}
+
+/** Return how many bytes of <b>global_bucket</b> (drawn from the global
+ * read buckets if <b>is_read</b>, else from the write buckets) <b>conn</b>
+ * may use once every other recently active bandwidth class has had its
+ * credit set aside.  A class can always use its own credit, and can borrow
+ * whatever no active class has a claim on. */
+int
+connection_bw_class_allowance(connection_t *conn, int is_read,
+                              int global_bucket, time_t now)
+{
+  const or_options_t *options = get_options();
+  const int *credit = is_read ? bw_class_read_credit : bw_class_write_credit;
+  int64_t reserved = 0;
+  int allowance;
+  bw_class_t cls;
+  int i;
+
+  if (!options->BandwidthClassWeights)
+    return global_bucket;
+
+  cls = connection_get_bw_class(conn, now);
+  bw_class_active_at[cls] = now;
+  for (i = 0; i < N_BW_CLASSES; ++i) {
+    if (i != (int)cls && options->_BandwidthClassWeights[i] &&
+        bw_class_active_at[i] + 1 >= now)
+      reserved += credit[i];
+  }
+
+  allowance = reserved < global_bucket ? (int)(global_bucket - reserved) : 0;
+  if (allowance < credit[cls])
+    allowance = credit[cls];
+  return allowance < global_bucket ? allowance : global_bucket;
+}
+
 /** Helper function to decide how many bytes out of <b>global_bucket</b>
  * we're willing to use for this transaction. <b>base</b> is the size
  * of a cell on the network; <b>priority</b> says whether we should
@@ -2129,6 +2344,7 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
 
   if (connection_speaks_cells(conn)) {
     or_connection_t *or_conn = TO_OR_CONN(conn);
+    connection_or_buckets_catch_up(or_conn);
     if (conn->state == OR_CONN_STATE_OPEN)
       conn_bucket = or_conn->read_bucket;
   }
@@ -2141,6 +2357,7 @@ connection_bucket_read_limit(connection_t *conn, time_t now)
   if (connection_counts_as_relayed_traffic(conn, now) &&
       global_relayed_read_bucket <= global_read_bucket)
     global_bucket = global_relayed_read_bucket;
+  global_bucket = connection_bw_class_allowance(conn, 1, global_bucket, now);
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
@@ -2165,6 +2382,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
     /* use the per-conn write limit if it's lower, but if it's less
      * than zero just use zero */
     or_connection_t *or_conn = TO_OR_CONN(conn);
+    connection_or_buckets_catch_up(or_conn);
     if (conn->state == OR_CONN_STATE_OPEN)
       if (or_conn->write_bucket < conn_bucket)
         conn_bucket = or_conn->write_bucket >= 0 ?
@@ -2174,6 +2392,7 @@ connection_bucket_write_limit(connection_t *conn, time_t now)
   if (connection_counts_as_relayed_traffic(conn, now) &&
       global_relayed_write_bucket <= global_write_bucket)
     global_bucket = global_relayed_write_bucket;
+  global_bucket = connection_bw_class_allowance(conn, 0, global_bucket, now);
 
   return connection_bucket_round_robin(base, priority,
                                        global_bucket, conn_bucket);
@@ -2228,6 +2447,11 @@ global_write_bucket_low(connection_t *conn, size_t attempt, int priority)
   if (!connection_is_rate_limited(conn))
     return 0; /* local conns don't get limited */
 
+#ifndef USE_BUFFEREVENTS
+  smaller_bucket = connection_bw_class_allowance(conn, 0, smaller_bucket,
+                                                 approx_time());
+#endif
+
   if (smaller_bucket < (int)attempt)
     return 1; /* not enough space no matter the priority */
 
@@ -2268,9 +2492,13 @@ record_num_bytes_transferred_impl(connection_t *conn,
   if (!connection_is_rate_limited(conn))
     return; /* local IPs are free */
 
-  if (conn->type == CONN_TYPE_OR)
+  if (conn->type == CONN_TYPE_OR) {
+    or_connection_t *or_conn = TO_OR_CONN(conn);
     rep_hist_note_or_conn_bytes(conn->global_identifier, num_read,
                                 num_written, now);
+    or_conn->sockbuf_n_read += (uint32_t)num_read;
+    or_conn->sockbuf_n_written += (uint32_t)num_written;
+  }
 
   if (num_read > 0) {
     rep_hist_note_bytes_read(num_read, now);
@@ -2334,7 +2562,17 @@ connection_buckets_decrement(connection_t *conn, time_t now,
   }
   global_read_bucket -= (int)num_read;
   global_write_bucket -= (int)num_written;
+  if (get_options()->BandwidthClassWeights) {
+    bw_class_t cls = connection_get_bw_class(conn, now);
+    bw_class_active_at[cls] = now;
+    /* Bytes beyond a class's credit were borrowed, not owed. */
+    bw_class_read_credit[cls] -= MIN(bw_class_read_credit[cls],
+                                     (int)num_read);
+    bw_class_write_credit[cls] -= MIN(bw_class_write_credit[cls],
+                                      (int)num_written);
+  }
   if (connection_speaks_cells(conn) && conn->state == OR_CONN_STATE_OPEN) {
+    connection_or_buckets_catch_up(TO_OR_CONN(conn));
     TO_OR_CONN(conn)->read_bucket -= (int)num_read;
     TO_OR_CONN(conn)->write_bucket -= (int)num_written;
   }
@@ -2356,11 +2594,16 @@ connection_consider_empty_read_buckets(connection_t *conn)
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->read_bucket <= 0) {
     reason = "connection read bucket exhausted. Pausing.";
+  } else if (connection_is_rate_limited(conn) &&
+             connection_bw_class_allowance(conn, 1, global_read_bucket,
+                                           approx_time()) <= 0) {
+    reason = "bandwidth class read share exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->read_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(conn);
   connection_stop_reading(conn);
 }
 
@@ -2380,11 +2623,16 @@ connection_consider_empty_write_buckets(connection_t *conn)
              conn->state == OR_CONN_STATE_OPEN &&
              TO_OR_CONN(conn)->write_bucket <= 0) {
     reason = "connection write bucket exhausted. Pausing.";
+  } else if (connection_is_rate_limited(conn) &&
+             connection_bw_class_allowance(conn, 0, global_write_bucket,
+                                           approx_time()) <= 0) {
+    reason = "bandwidth class write share exhausted. Pausing.";
   } else
     return; /* all good, no need to stop it */
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "%s", reason));
   conn->write_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(conn);
   connection_stop_writing(conn);
 }
 
@@ -2439,12 +2687,22 @@ void
 connection_bucket_refill(int milliseconds_elapsed, time_t now)
 {
   const or_options_t *options = get_options();
-  smartlist_t *conns = get_connection_array();
   int bandwidthrate, bandwidthburst, relayrate, relayburst;
+  int i;
 
   bandwidthrate = (int)options->BandwidthRate;
   bandwidthburst = (int)options->BandwidthBurst;
 
+  if (accounting_is_enabled(options)) {
+    /* If we're shaping our bandwidth to make AccountingMax last, don't let
+     * the buckets save up a burst at the old rate either. */
+    int shaped = accounting_shape_bandwidth_rate(bandwidthrate);
+    if (shaped < bandwidthrate) {
+      bandwidthrate = shaped;
+      bandwidthburst = MIN(bandwidthburst, shaped);
+    }
+  }
+
   if (options->RelayBandwidthRate) {
     relayrate = (int)options->RelayBandwidthRate;
     relayburst = (int)options->RelayBandwidthBurst;
@@ -2476,28 +2734,53 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
                                   milliseconds_elapsed,
                                   "global_relayed_write_bucket");
 
-  /* refill the per-connection buckets */
-  SMARTLIST_FOREACH(conns, connection_t *, conn,
-  {
-    if (connection_speaks_cells(conn)) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      int orbandwidthrate = or_conn->bandwidthrate;
-      int orbandwidthburst = or_conn->bandwidthburst;
-      if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->read_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->read_bucket");
-      }
-      if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
-        connection_bucket_refill_helper(&or_conn->write_bucket,
-                                        orbandwidthrate,
-                                        orbandwidthburst,
-                                        milliseconds_elapsed,
-                                        "or_conn->write_bucket");
+  if (accounting_is_enabled(options)) {
+    /* Never hand out more than we have left of AccountingMax. */
+    global_read_bucket = MIN(global_read_bucket,
+                             accounting_get_bytes_left(0));
+    global_write_bucket = MIN(global_write_bucket,
+                              accounting_get_bytes_left(1));
+  }
+
+  if (options->BandwidthClassWeights) {
+    /* Give each weighted class its share of the global rate and burst. */
+    int total = 0;
+    for (i = 0; i < N_BW_CLASSES; ++i)
+      total += options->_BandwidthClassWeights[i];
+    for (i = 0; i < N_BW_CLASSES; ++i) {
+      int weight = options->_BandwidthClassWeights[i];
+      int rate = (int)(((int64_t)bandwidthrate) * weight / total);
+      int burst = (int)(((int64_t)bandwidthburst) * weight / total);
+      if (!weight) {
+        bw_class_read_credit[i] = bw_class_write_credit[i] = 0;
+        continue;
       }
+      connection_bucket_refill_helper(&bw_class_read_credit[i], rate,
+                                      burst, milliseconds_elapsed,
+                                      "bw_class_read_credit");
+      connection_bucket_refill_helper(&bw_class_write_credit[i], rate,
+                                      burst, milliseconds_elapsed,
+                                      "bw_class_write_credit");
     }
+  }
+
+  /* The per-connection buckets catch up on this time whenever we next look
+   * at them, so we only need to visit the connections that are waiting for
+   * tokens. */
+  bucket_clock_msec += milliseconds_elapsed;
+
+  if (!conns_blocked_on_bw)
+    return;
+  /* Walk backwards, so that removing the current connection doesn't make
+   * us skip any. */
+  for (i = smartlist_len(conns_blocked_on_bw) - 1; i >= 0; --i) {
+    connection_t *conn = smartlist_get(conns_blocked_on_bw, i);
+    if (conn->conn_array_index < 0) {
+      /* It's on its way to being freed; leave it asleep. */
+      continue;
+    }
+    if (connection_speaks_cells(conn))
+      connection_or_buckets_catch_up(TO_OR_CONN(conn));
 
     if (conn->read_blocked_on_bw == 1 /* marked to turn reading back on now */
         && global_read_bucket > 0 /* and we're allowed to read */
@@ -2505,8 +2788,12 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
             global_relayed_read_bucket > 0) /* even if we're relayed traffic */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->read_bucket > 0)) {
+            TO_OR_CONN(conn)->read_bucket > 0)
         /* and either a non-cell conn or a cell conn with non-empty bucket */
+        && (!connection_is_rate_limited(conn) ||
+            connection_bw_class_allowance(conn, 1, global_read_bucket,
+                                          now) > 0)) {
+        /* and its bandwidth class has a share left for it */
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for read", (int)conn->s));
       conn->read_blocked_on_bw = 0;
@@ -2519,13 +2806,80 @@ connection_bucket_refill(int milliseconds_elapsed, time_t now)
             global_relayed_write_bucket > 0) /* even if it's relayed traffic */
         && (!connection_speaks_cells(conn) ||
             conn->state != OR_CONN_STATE_OPEN ||
-            TO_OR_CONN(conn)->write_bucket > 0)) {
+            TO_OR_CONN(conn)->write_bucket > 0)
+        && (!connection_is_rate_limited(conn) ||
+            connection_bw_class_allowance(conn, 0, global_write_bucket,
+                                          now) > 0)) {
       LOG_FN_CONN(conn, (LOG_DEBUG,LD_NET,
                          "waking up conn (fd %d) for write", (int)conn->s));
       conn->write_blocked_on_bw = 0;
       connection_start_writing(conn);
     }
-  });
+
+    if (!conn->read_blocked_on_bw && !conn->write_blocked_on_bw)
+      connection_forget_blocked_on_bw(conn);
+  }
+}
+
+/** Add the tokens that <b>or_conn</b>'s read and write buckets have earned
+ * since we last refilled them.  Call this before looking at either
+ * bucket. */
+void
+connection_or_buckets_catch_up(or_connection_t *or_conn)
+{
+  uint64_t elapsed = bucket_clock_msec - or_conn->bucket_refilled_at;
+  int milliseconds_elapsed;
+  if (!elapsed)
+    return;
+  or_conn->bucket_refilled_at = bucket_clock_msec;
+  milliseconds_elapsed = elapsed > INT_MAX ? INT_MAX : (int)elapsed;
+
+  if (connection_bucket_should_increase(or_conn->read_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->read_bucket,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->read_bucket");
+  }
+  if (connection_bucket_should_increase(or_conn->write_bucket, or_conn)) {
+    connection_bucket_refill_helper(&or_conn->write_bucket,
+                                    or_conn->bandwidthrate,
+                                    or_conn->bandwidthburst,
+                                    milliseconds_elapsed,
+                                    "or_conn->write_bucket");
+  }
+}
+
+/** Note that <b>conn</b> has just had read_blocked_on_bw or
+ * write_blocked_on_bw set, so that connection_bucket_refill() will wake it
+ * once it has tokens again. */
+void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  if (conn->bw_blocked_idx != -1)
+    return;
+  if (!conns_blocked_on_bw)
+    conns_blocked_on_bw = smartlist_new();
+  conn->bw_blocked_idx = smartlist_len(conns_blocked_on_bw);
+  smartlist_add(conns_blocked_on_bw, conn);
+}
+
+/** Remove <b>conn</b> from the list of connections blocked on bandwidth, if
+ * it's there. */
+static void
+connection_forget_blocked_on_bw(connection_t *conn)
+{
+  int idx = conn->bw_blocked_idx;
+  connection_t *last;
+  if (idx == -1)
+    return;
+  tor_assert(smartlist_get(conns_blocked_on_bw, idx) == conn);
+  last = smartlist_pop_last(conns_blocked_on_bw);
+  if (last != conn) {
+    smartlist_set(conns_blocked_on_bw, idx, last);
+    last->bw_blocked_idx = idx;
+  }
+  conn->bw_blocked_idx = -1;
 }
 
 /** Is the <b>bucket</b> for connection <b>conn</b> low enough that we
@@ -2563,6 +2917,11 @@ connection_bucket_refill(int seconds_elapsed, time_t now)
   /* Libevent does this for us. */
 }
 void
+connection_note_blocked_on_bw(connection_t *conn)
+{
+  (void) conn;
+}
+void
 connection_bucket_init(void)
 {
   const or_options_t *options = get_options();
@@ -2893,6 +3252,8 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
         edge_conn->n_read += (int)n_read;
       else
         edge_conn->n_read = UINT32_MAX;
+      if (!edge_conn->stream_bw_dirty)
+        control_note_stream_bandwidth(edge_conn);
     }
   }
 
@@ -2918,6 +3279,19 @@ connection_read_to_buf(connection_t *conn, ssize_t *max_to_read,
 /* XXXX These generic versions could be simplified by making them
    type-specific */
 
+/** Helper for the evbuffer callbacks: note that <b>num_read</b> and
+ * <b>num_written</b> bytes just moved through <b>conn</b>'s evbuffers.
+ * Those are cleartext counts; on a TLS connection, record the bytes that
+ * actually crossed the socket instead, as the buf_t code does. */
+static void
+record_evbuffer_bytes_transferred(connection_t *conn, time_t now,
+                                  size_t num_read, size_t num_written)
+{
+  if (conn->type == CONN_TYPE_OR && TO_OR_CONN(conn)->tls)
+    tor_tls_get_n_raw_bytes(TO_OR_CONN(conn)->tls, &num_read, &num_written);
+  record_num_bytes_transferred(conn, now, num_read, num_written);
+}
+
 /** Callback: Invoked whenever bytes are added to or drained from an input
  * evbuffer.  Used to track the number of bytes read. */
 static void
@@ -2926,16 +3300,20 @@ evbuffer_inbuf_callback(struct evbuffer *buf,
 {
   connection_t *conn = arg;
   (void) buf;
-  /* XXXX These need to get real counts on the non-nested TLS case. - NM */
   if (info->n_added) {
     time_t now = approx_time();
     conn->timestamp_lastread = now;
-    record_num_bytes_transferred(conn, now, info->n_added, 0);
+    record_evbuffer_bytes_transferred(conn, now, info->n_added, 0);
     connection_consider_empty_read_buckets(conn);
     if (conn->type == CONN_TYPE_AP) {
       edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
-      /*XXXX024 check for overflow*/
-      edge_conn->n_read += (int)info->n_added;
+      /* Check for overflow: */
+      if (PREDICT_LIKELY(UINT32_MAX - edge_conn->n_read > info->n_added))
+        edge_conn->n_read += (int)info->n_added;
+      else
+        edge_conn->n_read = UINT32_MAX;
+      if (!edge_conn->stream_bw_dirty)
+        control_note_stream_bandwidth(edge_conn);
     }
   }
 }
@@ -2951,12 +3329,17 @@ evbuffer_outbuf_callback(struct evbuffer *buf,
   if (info->n_deleted) {
     time_t now = approx_time();
     conn->timestamp_lastwritten = now;
-    record_num_bytes_transferred(conn, now, 0, info->n_deleted);
+    record_evbuffer_bytes_transferred(conn, now, 0, info->n_deleted);
     connection_consider_empty_write_buckets(conn);
     if (conn->type == CONN_TYPE_AP) {
       edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
-      /*XXXX024 check for overflow*/
-      edge_conn->n_written += (int)info->n_deleted;
+      /* Check for overflow: */
+      if (PREDICT_LIKELY(UINT32_MAX - edge_conn->n_written > info->n_deleted))
+        edge_conn->n_written += (int)info->n_deleted;
+      else
+        edge_conn->n_written = UINT32_MAX;
+      if (!edge_conn->stream_bw_dirty)
+        control_note_stream_bandwidth(edge_conn);
     }
   }
 }
@@ -3140,7 +3523,10 @@ connection_wants_to_flush(connection_t *conn)
 int
 connection_outbuf_too_full(connection_t *conn)
 {
-  return (conn->outbuf_flushlen > 10*CELL_PAYLOAD_SIZE);
+  /* Bytes the kernel is still sitting on count too: they'll go out no
+   * sooner than the ones on our outbuf. */
+  return (conn->outbuf_flushlen + connection_get_kernel_unsent(conn) >
+          10*CELL_PAYLOAD_SIZE);
 }
 
 /** Try to flush more bytes onto <b>conn</b>-\>s.
@@ -3170,6 +3556,7 @@ connection_handle_write_impl(connection_t *conn, int force)
   ssize_t max_to_write;
   time_t now = approx_time();
   size_t n_read = 0, n_written = 0;
+  int corked_here;
 
   tor_assert(!connection_is_listener(conn));
 
@@ -3195,6 +3582,9 @@ connection_handle_write_impl(connection_t *conn, int force)
     if (e) {
       /* some sort of error, but maybe just inprogress still */
       if (!ERRNO_IS_CONN_EINPROGRESS(e)) {
+        if (conn->type == CONN_TYPE_EXIT &&
+            connection_exit_try_next_addr(TO_EDGE_CONN(conn)))
+          return 0; /* trying another address for it */
         log_info(LD_NET,"in-progress connect failed. Removing. (%s)",
                  tor_socket_strerror(e));
         if (CONN_IS_EDGE(conn))
@@ -3237,8 +3627,20 @@ connection_handle_write_impl(connection_t *conn, int force)
     }
 
     /* else open, or closing */
+    /* If we have more than one cell to write, cork the socket so that the
+     * TLS records we're about to write can share TCP segments. (If we're
+     * in the middle of a scheduler burst, it's already corked.) */
+    corked_here = !or_conn->is_corked &&
+      conn->outbuf_flushlen > CELL_NETWORK_SIZE;
+    if (corked_here) {
+      connection_or_set_corked(or_conn, 1);
+      corked_here = or_conn->is_corked;
+    }
     result = flush_buf_tls(or_conn->tls, conn->outbuf,
-                           max_to_write, &conn->outbuf_flushlen);
+                           max_to_write, &conn->outbuf_flushlen,
+                           connection_or_get_tls_record_size(or_conn));
+    if (corked_here)
+      connection_or_set_corked(or_conn, 0);
 
     /* If we just flushed the last bytes, check if this tunneled dir
      * request is done. */
@@ -3266,6 +3668,7 @@ connection_handle_write_impl(connection_t *conn, int force)
         if (!connection_is_reading(conn)) {
           connection_stop_writing(conn);
           conn->write_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           /* we'll start reading again when we get more tokens in our
            * read bucket; then we'll start writing again too.
            */
@@ -3304,6 +3707,8 @@ connection_handle_write_impl(connection_t *conn, int force)
       edge_conn->n_written += (int)n_written;
     else
       edge_conn->n_written = UINT32_MAX;
+    if (!edge_conn->stream_bw_dirty)
+      control_note_stream_bandwidth(edge_conn);
   }
 
   connection_buckets_decrement(conn, approx_time(), n_read, n_written);
@@ -3385,6 +3790,38 @@ connection_flush(connection_t *conn)
 void
 _connection_write_to_buf_impl(const char *string, size_t len,
                               connection_t *conn, int zlib)
+{
+  connection_write_to_buf_helper(string, len, conn, zlib, NULL, NULL);
+}
+
+/** As connection_write_to_buf(), but try to put a reference to
+ * <b>string</b> on <b>conn</b>'s outbuf rather than a copy, as with
+ * write_to_buf_external().  Either way, <b>release_fn</b>(<b>arg</b>) is
+ * called exactly once, when <b>string</b> is no longer needed.
+ */
+void
+connection_write_to_buf_external(const char *string, size_t len,
+                                 connection_t *conn,
+                                 void (*release_fn)(void *), void *arg)
+{
+  int by_ref = len > 0 &&
+    !(conn->marked_for_close && !conn->hold_open_until_flushed);
+  IF_HAS_BUFFEREVENT(conn, by_ref = 0;);
+  if (!by_ref) {
+    _connection_write_to_buf_impl(string, len, conn, 0);
+    release_fn(arg);
+    return;
+  }
+  connection_write_to_buf_helper(string, len, conn, 0, release_fn, arg);
+}
+
+/** Helper: implements _connection_write_to_buf_impl() and
+ * connection_write_to_buf_external().  If <b>release_fn</b> is set, add
+ * <b>string</b> to the outbuf by reference. */
+static void
+connection_write_to_buf_helper(const char *string, size_t len,
+                               connection_t *conn, int zlib,
+                               void (*release_fn)(void *), void *arg)
 {
   /* XXXX This function really needs to return -1 on failure. */
   int r;
@@ -3418,6 +3855,10 @@ _connection_write_to_buf_impl(const char *string, size_t len,
     CONN_LOG_PROTECT(conn, r = write_to_buf_zlib(conn->outbuf,
                                                  dir_conn->zlib_state,
                                                  string, len, done));
+  } else if (release_fn) {
+    CONN_LOG_PROTECT(conn, r = write_to_buf_external(string, len,
+                                                     release_fn, arg,
+                                                     conn->outbuf));
   } else {
     CONN_LOG_PROTECT(conn, r = write_to_buf(string, len, conn->outbuf));
   }
@@ -3499,11 +3940,10 @@ connection_get_by_type_addr_port_purpose(int type,
                                          const tor_addr_t *addr, uint16_t port,
                                          int purpose)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type &&
-        tor_addr_eq(&conn->addr, addr) &&
+    if (tor_addr_eq(&conn->addr, addr) &&
         conn->port == port &&
         conn->purpose == purpose &&
         !conn->marked_for_close)
@@ -3532,10 +3972,10 @@ connection_get_by_global_id(uint64_t id)
 connection_t *
 connection_get_by_type(int type)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type && !conn->marked_for_close)
+    if (!conn->marked_for_close)
       return conn;
   });
   return NULL;
@@ -3547,10 +3987,10 @@ connection_get_by_type(int type)
 connection_t *
 connection_get_by_type_state(int type, int state)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type && conn->state == state && !conn->marked_for_close)
+    if (conn->state == state && !conn->marked_for_close)
       return conn;
   });
   return NULL;
@@ -3564,15 +4004,14 @@ connection_t *
 connection_get_by_type_state_rendquery(int type, int state,
                                        const char *rendquery)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(type);
 
   tor_assert(type == CONN_TYPE_DIR ||
              type == CONN_TYPE_AP || type == CONN_TYPE_EXIT);
   tor_assert(rendquery);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == type &&
-        !conn->marked_for_close &&
+    if (!conn->marked_for_close &&
         (!state || state == conn->state)) {
       if (type == CONN_TYPE_DIR &&
           TO_DIR_CONN(conn)->rend_data &&
@@ -3595,11 +4034,11 @@ dir_connection_t *
 connection_dir_get_by_purpose_and_resource(int purpose,
                                            const char *resource)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     dir_connection_t *dirconn;
-    if (conn->type != CONN_TYPE_DIR || conn->marked_for_close ||
+    if (conn->marked_for_close ||
         conn->purpose != purpose)
       continue;
     dirconn = TO_DIR_CONN(conn);
@@ -3620,11 +4059,10 @@ connection_dir_get_by_purpose_and_resource(int purpose,
 connection_t *
 connection_get_by_type_purpose(int type, int purpose)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(type);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == type &&
-        !conn->marked_for_close &&
+    if (!conn->marked_for_close &&
         (purpose == conn->purpose))
       return conn;
   });
@@ -3789,6 +4227,47 @@ client_check_address_changed(tor_socket_t sock)
   }
 }
 
+/** If TCPNotSentLowat is set and <b>conn</b> is an OR or edge connection,
+ * tell the kernel to keep no more than that many not-yet-sent bytes queued
+ * on its socket, so the rest wait in conn's outbuf where we can see them.
+ */
+static void
+connection_set_notsent_lowat(connection_t *conn)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  int lowat = (int)get_options()->TCPNotSentLowat;
+  if (!lowat || !SOCKET_OK(conn->s) ||
+      !(conn->type == CONN_TYPE_OR || CONN_IS_EDGE(conn)))
+    return;
+  if (setsockopt(conn->s, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void*)&lowat,
+                 (socklen_t)sizeof(lowat)) < 0) {
+    int e = tor_socket_errno(conn->s);
+    log_info(LD_NET, "setsockopt() to set TCP_NOTSENT_LOWAT to %d bytes "
+             "failed: %s", lowat, tor_socket_strerror(e));
+  }
+#else
+  (void) conn;
+#endif
+}
+
+/** Return how many bytes the kernel has queued on <b>conn</b>'s socket that
+ * it hasn't sent yet, or 0 if TCPNotSentLowat is off or we can't tell. */
+size_t
+connection_get_kernel_unsent(connection_t *conn)
+{
+#ifdef SIOCOUTQNSD
+  int n = 0;
+  if (!get_options()->TCPNotSentLowat || !SOCKET_OK(conn->s) || conn->linked)
+    return 0;
+  if (ioctl(conn->s, SIOCOUTQNSD, &n) < 0 || n < 0)
+    return 0;
+  return (size_t)n;
+#else
+  (void) conn;
+  return 0;
+#endif
+}
+
 /** Some systems have limited system buffers for recv and xmit on
  * sockets allocated in a virtual server or similar environment. For a Tor
  * server this can produce the "Error creating network socket: No buffer
@@ -3813,6 +4292,160 @@ set_constrained_socket_buffers(tor_socket_t sock, int size)
   }
 }
 
+/** Try to set the <b>optname</b> (SO_SNDBUF or SO_RCVBUF) buffer size of
+ * <b>sock</b> to <b>size</b>.  Return 0 on success, -1 on failure. */
+static int
+set_socket_buffer(tor_socket_t sock, int optname, int size)
+{
+  if (setsockopt(sock, SOL_SOCKET, optname, (void*)&size,
+                 (socklen_t)sizeof(size)) < 0) {
+    int e = tor_socket_errno(sock);
+    log_info(LD_NET, "setsockopt() to set %s buffer to %d bytes failed: %s",
+             optname == SO_SNDBUF ? "send" : "recv", size,
+             tor_socket_strerror(e));
+    return -1;
+  }
+  return 0;
+}
+
+/** Return the kernel's smoothed estimate of the round-trip time on the TCP
+ * connection <b>sock</b>, in microseconds, or -1 if we can't tell. */
+static int
+get_socket_rtt_usec(tor_socket_t sock)
+{
+#if defined(TCP_INFO) && defined(__linux__)
+  struct tcp_info ti;
+  socklen_t ti_len = (socklen_t) sizeof(ti);
+  memset(&ti, 0, sizeof(ti));
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, (void*)&ti, &ti_len) == 0 &&
+      ti.tcpi_rtt > 0 && ti.tcpi_rtt < INT_MAX)
+    return (int)ti.tcpi_rtt;
+#else
+  (void) sock;
+#endif
+  return -1;
+}
+
+/** How long to assume a round trip takes when the kernel won't tell us. */
+#define DEFAULT_SOCKBUF_RTT_USEC 100000
+
+/** Helper: return the buffer size we'd like for a direction of a
+ * connection that moved <b>n_bytes</b> in the last <b>elapsed</b> seconds
+ * over a path with a round-trip time of <b>rtt_usec</b>: twice the
+ * bandwidth-delay product, so the window can stay open, within
+ * MIN|MAX_AUTO_TCP_BUFFER. */
+static uint64_t
+sockbuf_wanted_size(uint32_t n_bytes, int elapsed, int rtt_usec)
+{
+  uint64_t want = ((uint64_t)n_bytes * rtt_usec * 2) /
+    ((uint64_t)elapsed * 1000000);
+  if (want < MIN_AUTO_TCP_BUFFER)
+    want = MIN_AUTO_TCP_BUFFER;
+  if (want > MAX_AUTO_TCP_BUFFER)
+    want = MAX_AUTO_TCP_BUFFER;
+  return want;
+}
+
+/** Return the buffer size to set for a direction of a connection that
+ * wants <b>want</b> bytes of buffer, when all our connections together
+ * want <b>total</b> bytes out of a budget of <b>budget</b>, and we last set
+ * this buffer to <b>cur</b> bytes (or never, if <b>cur</b> is 0).  Return 0
+ * if we should leave the buffer alone.
+ *
+ * Setting a buffer size turns off the kernel's own autotuning for that
+ * buffer for good, so we leave every buffer to the kernel until we're over
+ * budget. */
+int
+connection_sockbuf_target_size(uint64_t want, uint64_t total,
+                               uint64_t budget, int cur)
+{
+  int size;
+  if (total <= budget && !cur)
+    return 0;
+  if (total > budget)
+    want = want * budget / total;
+  if (want < MIN_AUTO_TCP_BUFFER)
+    want = MIN_AUTO_TCP_BUFFER;
+  size = (int)want;
+  /* Don't bother the kernel over changes of less than a quarter. */
+  if (cur && size > cur - cur/4 && size < cur + cur/4)
+    return 0;
+  return size;
+}
+
+/** Helper: set the <b>optname</b> buffer size of <b>or_conn</b>'s socket,
+ * which we last set to <b>*cur</b>, as connection_sockbuf_target_size()
+ * advises for <b>want</b>, <b>total</b> and <b>budget</b>. */
+static void
+sockbuf_apply(or_connection_t *or_conn, int optname, int *cur,
+              uint64_t want, uint64_t total, uint64_t budget)
+{
+  int size = connection_sockbuf_target_size(want, total, budget, *cur);
+  if (size && set_socket_buffer(or_conn->_base.s, optname, size) == 0)
+    *cur = size;
+}
+
+/** Once the socket buffers that our open OR connections want, given their
+ * recent throughput and round-trip times, add up to more than
+ * SocketBufferBudget, resize them all to fit.  Called periodically from the
+ * main loop; does nothing unless SocketBufferBudget is set. */
+void
+connection_tune_socket_buffers(time_t now)
+{
+  static time_t last_tuned = 0;
+  const uint64_t budget = get_options()->SocketBufferBudget;
+  smartlist_t *conns;
+  uint64_t *want, total = 0;
+  int i, n;
+
+  if (!budget) {
+    last_tuned = 0;
+    return;
+  }
+
+  conns = smartlist_new();
+  SMARTLIST_FOREACH(get_connection_array(), connection_t *, conn, {
+    if (conn->type == CONN_TYPE_OR && conn->state == OR_CONN_STATE_OPEN &&
+        !conn->marked_for_close && !conn->linked && SOCKET_OK(conn->s))
+      smartlist_add(conns, conn);
+  });
+  n = smartlist_len(conns);
+  want = tor_malloc_zero(sizeof(uint64_t)*2*(n ? n : 1));
+
+  for (i = 0; i < n; ++i) {
+    or_connection_t *or_conn = TO_OR_CONN(smartlist_get(conns, i));
+    time_t since = MAX(last_tuned, or_conn->_base.timestamp_created);
+    int elapsed = (int)(now - since);
+    int rtt = get_socket_rtt_usec(or_conn->_base.s);
+    if (elapsed < 1)
+      elapsed = 1;
+    if (rtt < 0)
+      rtt = DEFAULT_SOCKBUF_RTT_USEC;
+    want[2*i] = sockbuf_wanted_size(or_conn->sockbuf_n_read, elapsed, rtt);
+    want[2*i+1] = sockbuf_wanted_size(or_conn->sockbuf_n_written, elapsed,
+                                      rtt);
+    or_conn->sockbuf_n_read = or_conn->sockbuf_n_written = 0;
+    total += want[2*i] + want[2*i+1];
+  }
+
+  for (i = 0; i < n; ++i) {
+    or_connection_t *or_conn = TO_OR_CONN(smartlist_get(conns, i));
+    sockbuf_apply(or_conn, SO_RCVBUF, &or_conn->sockbuf_rcv_size,
+                  want[2*i], total, budget);
+    sockbuf_apply(or_conn, SO_SNDBUF, &or_conn->sockbuf_snd_size,
+                  want[2*i+1], total, budget);
+  }
+
+  if (n)
+    log_debug(LD_NET, "Tuned socket buffers on %d OR connections; they want "
+              U64_FORMAT" bytes out of a budget of "U64_FORMAT".", n,
+              U64_PRINTF_ARG(total), U64_PRINTF_ARG(budget));
+
+  tor_free(want);
+  smartlist_free(conns);
+  last_tuned = now;
+}
+
 /** Process new bytes that have arrived on conn-\>inbuf.
  *
  * This function just passes conn to the connection-specific
@@ -3858,6 +4491,8 @@ connection_flushed_some(connection_t *conn)
     r = connection_or_flushed_some(TO_OR_CONN(conn));
   } else if (CONN_IS_EDGE(conn)) {
     r = connection_edge_flushed_some(TO_EDGE_CONN(conn));
+  } else if (conn->type == CONN_TYPE_CONTROL) {
+    r = connection_control_flushed_some(TO_CONTROL_CONN(conn));
   }
   conn->in_flushed_some = 0;
   return r;
@@ -4006,6 +4641,88 @@ connection_dump_buffer_mem_stats(int severity)
   }
 }
 
+/** Return roughly how many bytes <b>conn</b> takes up apart from its
+ * buffers' contents: its own structure and the substructures it has
+ * allocated so far. */
+static size_t
+connection_get_struct_mem_usage(connection_t *conn)
+{
+  size_t n;
+  switch (conn->type) {
+    case CONN_TYPE_OR: {
+      or_connection_t *or_conn = TO_OR_CONN(conn);
+      n = sizeof(or_connection_t);
+      if (or_conn->handshake_state)
+        n += sizeof(or_handshake_state_t);
+      if (or_conn->active_circuit_pqueue)
+        n += sizeof(smartlist_t) +
+          or_conn->active_circuit_pqueue->capacity * sizeof(void*);
+      break;
+    }
+    case CONN_TYPE_AP: {
+      entry_connection_t *entry_conn = TO_ENTRY_CONN(conn);
+      n = sizeof(entry_connection_t);
+      if (entry_conn->socks_request)
+        n += sizeof(socks_request_t);
+      break;
+    }
+    case CONN_TYPE_EXIT:
+      n = sizeof(edge_connection_t);
+      break;
+    case CONN_TYPE_DIR:
+      n = sizeof(dir_connection_t);
+      break;
+    case CONN_TYPE_CONTROL:
+      n = sizeof(control_connection_t);
+      break;
+    CASE_ANY_LISTENER_TYPE:
+      n = sizeof(listener_connection_t);
+      break;
+    default:
+      n = sizeof(connection_t);
+      break;
+  }
+  if (conn->address)
+    n += strlen(conn->address) + 1;
+  return n;
+}
+
+/** Log how many bytes connections of each type use for their structures
+ * and substructures, not counting their buffers. */
+void
+connection_dump_struct_mem_stats(int severity)
+{
+  uint64_t bytes_by_type[_CONN_TYPE_MAX+1];
+  int n_conns_by_type[_CONN_TYPE_MAX+1];
+  uint64_t total = 0;
+  int i;
+  smartlist_t *conns = get_connection_array();
+
+  memset(bytes_by_type, 0, sizeof(bytes_by_type));
+  memset(n_conns_by_type, 0, sizeof(n_conns_by_type));
+
+  SMARTLIST_FOREACH(conns, connection_t *, c,
+  {
+    size_t n = connection_get_struct_mem_usage(c);
+    ++n_conns_by_type[c->type];
+    bytes_by_type[c->type] += n;
+    total += n;
+  });
+
+  log(severity, LD_GENERAL,
+      "In structures for %d connections: "U64_FORMAT" bytes",
+      smartlist_len(conns), U64_PRINTF_ARG(total));
+  for (i=_CONN_TYPE_MIN; i <= _CONN_TYPE_MAX; ++i) {
+    if (!n_conns_by_type[i])
+      continue;
+    log(severity, LD_GENERAL,
+        "  For %d %s connections: "U64_FORMAT" bytes (%d each)",
+        n_conns_by_type[i], conn_type_to_string(i),
+        U64_PRINTF_ARG(bytes_by_type[i]),
+        (int)(bytes_by_type[i] / n_conns_by_type[i]));
+  }
+}
+
 /** Verify that connection <b>conn</b> has all of its invariants
  * correct. Trigger an assert if anything is invalid.
  */
@@ -4195,6 +4912,11 @@ get_proxy_addrport(tor_addr_t *addr, uint16_t *port, int *proxy_type,
              options->Bridges) {
     const transport_t *transport = NULL;
     int r;
+    /* Transports that run inside Tor need no proxy. */
+    if (pt_get_inproc_transport_for_bridge(&conn->addr, conn->port)) {
+      *proxy_type = PROXY_NONE;
+      return 0;
+    }
     r = find_transport_by_bridge_addrport(&conn->addr, conn->port, &transport);
     if (r<0)
       return -1;
@@ -4290,6 +5012,11 @@ connection_free_all(void)
 
   SMARTLIST_FOREACH(conns, connection_t *, conn, _connection_free(conn));
 
+#ifndef USE_BUFFEREVENTS
+  smartlist_free(conns_blocked_on_bw);
+  conns_blocked_on_bw = NULL;
+#endif
+
   if (outgoing_addrs) {
     SMARTLIST_FOREACH(outgoing_addrs, tor_addr_t *, addr, tor_free(addr));
     smartlist_free(outgoing_addrs);
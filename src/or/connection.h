@@ -56,6 +56,10 @@ void connection_expire_held_open(void);
 int connection_connect(connection_t *conn, const char *address,
                        const tor_addr_t *addr,
                        uint16_t port, int *socket_error);
+#ifndef USE_BUFFEREVENTS
+int connection_reconnect(connection_t *conn, const tor_addr_t *addr,
+                         uint16_t port, int *socket_error);
+#endif
 
 int connection_proxy_connect(connection_t *conn, int type);
 int connection_read_proxy_handshake(connection_t *conn);
@@ -74,6 +78,9 @@ ssize_t connection_bucket_write_limit(connection_t *conn, time_t now);
 int global_write_bucket_low(connection_t *conn, size_t attempt, int priority);
 void connection_bucket_init(void);
 void connection_bucket_refill(int seconds_elapsed, time_t now);
+void connection_tune_socket_buffers(time_t now);
+void connection_or_buckets_catch_up(or_connection_t *or_conn);
+void connection_note_blocked_on_bw(connection_t *conn);
 
 int connection_handle_read(connection_t *conn);
 
@@ -87,11 +94,16 @@ int connection_fetch_from_buf_http(connection_t *conn,
 
 int connection_wants_to_flush(connection_t *conn);
 int connection_outbuf_too_full(connection_t *conn);
+size_t connection_get_kernel_unsent(connection_t *conn);
 int connection_handle_write(connection_t *conn, int force);
 int connection_flush(connection_t *conn);
 
 void _connection_write_to_buf_impl(const char *string, size_t len,
                                    connection_t *conn, int zlib);
+void connection_write_to_buf_external(const char *string, size_t len,
+                                      connection_t *conn,
+                                      void (*release_fn)(void *),
+                                      void *arg);
 /* DOCDOC connection_write_to_buf */
 static void connection_write_to_buf(const char *string, size_t len,
                                     connection_t *conn);
@@ -158,6 +170,7 @@ char *alloc_http_authenticator(const char *authenticator);
 void assert_connection_ok(connection_t *conn, time_t now);
 int connection_or_nonopen_was_started_here(or_connection_t *conn);
 void connection_dump_buffer_mem_stats(int severity);
+void connection_dump_struct_mem_stats(int severity);
 void remove_file_if_very_old(const char *fname, time_t now);
 
 #ifdef USE_BUFFEREVENTS
@@ -174,5 +187,12 @@ void connection_enable_rate_limiting(connection_t *conn);
 #define connection_type_uses_bufferevent(c) (0)
 #endif
 
+#ifdef CONNECTION_PRIVATE
+int connection_sockbuf_target_size(uint64_t want, uint64_t total,
+                                   uint64_t budget, int cur);
+int connection_bw_class_allowance(connection_t *conn, int is_read,
+                                  int global_bucket, time_t now);
+#endif
+
 #endif
 
@@ -9,6 +9,8 @@
  * \brief Handle edge streams.
  **/
 
+#define CONNECTION_EDGE_PRIVATE
+
 #include "or.h"
 #include "buffers.h"
 #include "circuitlist.h"
@@ -34,6 +36,12 @@
 #include "router.h"
 #include "routerlist.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 #ifdef HAVE_LINUX_TYPES_H
 #include <linux/types.h>
 #endif
@@ -58,6 +66,8 @@ static int address_is_in_virtual_range(const char *addr);
 static int consider_plaintext_ports(entry_connection_t *conn, uint16_t port);
 static void clear_trackexithost_mappings(const char *exitname);
 static int connection_ap_supports_optimistic_data(const entry_connection_t *);
+static int connection_exit_pop_alt_addr(edge_connection_t *edge_conn,
+                                        tor_addr_t *addr_out);
 
 /** An AP stream has failed/finished. If it hasn't already sent back
  * a socks reply, send one now (based on endreason). Also set
@@ -408,6 +418,7 @@ connection_edge_finished_connecting(edge_connection_t *edge_conn)
            safe_str(fmt_addr(&conn->addr)));
 
   rep_hist_note_exit_stream_opened(conn->port);
+  dns_note_exit_connect_result(edge_conn, 1);
 
   conn->state = EXIT_CONN_STATE_OPEN;
   IF_HAS_NO_BUFFEREVENT(conn)
@@ -546,10 +557,10 @@ connection_ap_expire_beginning(void)
   int severity;
   int cutoff;
   int seconds_idle, seconds_since_born;
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
-    if (base_conn->type != CONN_TYPE_AP || base_conn->marked_for_close)
+    if (base_conn->marked_for_close)
       continue;
     entry_conn = TO_ENTRY_CONN(base_conn);
     conn = ENTRY_TO_EDGE_CONN(entry_conn);
@@ -646,11 +657,10 @@ void
 connection_ap_attach_pending(void)
 {
   entry_connection_t *entry_conn;
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
     entry_conn = TO_ENTRY_CONN(conn);
@@ -673,10 +683,9 @@ connection_ap_fail_onehop(const char *failed_digest,
 {
   entry_connection_t *entry_conn;
   char digest[DIGEST_LEN];
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
     entry_conn = TO_ENTRY_CONN(conn);
@@ -713,10 +722,9 @@ circuit_discard_optional_exit_enclaves(extend_info_t *info)
   entry_connection_t *entry_conn;
   const node_t *r1, *r2;
 
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
     if (conn->marked_for_close ||
-        conn->type != CONN_TYPE_AP ||
         conn->state != AP_CONN_STATE_CIRCUIT_WAIT)
       continue;
     entry_conn = TO_ENTRY_CONN(conn);
@@ -1037,6 +1045,22 @@ addressmap_clear_transient(void)
   addressmap_get_mappings(NULL, 2, TIME_MAX, 0);
 }
 
+/** Remove all entries from the addressmap that we learned from exit
+ * nodes' DNS answers. */
+void
+addressmap_clear_dns_cache(void)
+{
+  if (!addressmap)
+    return;
+
+  STRMAP_FOREACH_MODIFY(addressmap, address, addressmap_entry_t *, ent) {
+    if (ent->source == ADDRMAPSRC_DNS && ent->new_address) {
+      addressmap_ent_remove(address, ent);
+      MAP_DEL_CURRENT(address);
+    }
+  } STRMAP_FOREACH_END;
+}
+
 /** Clean out entries from the addressmap cache that were
  * added long enough ago that they are no longer valid.
  */
@@ -1165,7 +1189,7 @@ addressmap_rewrite(char *address, size_t maxlen, time_t *expires_out,
   if (exit_source_out)
     *exit_source_out = exit_source;
   if (expires_out)
-    *expires_out = TIME_MAX;
+    *expires_out = expires;
   return (rewrites > 0);
 }
 
@@ -1334,13 +1358,16 @@ client_dns_clear_failures(const char *address)
  * ".exitname.exit" before registering the mapping.
  *
  * If <b>ttl</b> is nonnegative, the mapping will be valid for
- * <b>ttl</b>seconds; otherwise, we use the default.
+ * <b>ttl</b>seconds; otherwise, we use the default.  Either way, it lasts
+ * no longer than ClientDNSCacheMaxTTL; and if ClientDNSCache is off, we
+ * don't record it at all.
  */
 static void
 client_dns_set_addressmap_impl(const char *address, const char *name,
                                const char *exitname,
                                int ttl)
 {
+  const or_options_t *options = get_options();
   /* <address>.<hex or nickname>.exit\0  or just  <address>\0 */
   char extendedaddress[MAX_SOCKS_ADDR_LEN+MAX_VERBOSE_NICKNAME_LEN+10];
   /* 123.123.123.123.<hex or nickname>.exit\0  or just  123.123.123.123\0 */
@@ -1349,10 +1376,15 @@ client_dns_set_addressmap_impl(const char *address, const char *name,
   tor_assert(address);
   tor_assert(name);
 
+  if (!options->ClientDNSCache)
+    return;
+
   if (ttl<0)
     ttl = DEFAULT_DNS_TTL;
   else
     ttl = dns_clip_ttl(ttl);
+  if (ttl > options->ClientDNSCacheMaxTTL)
+    ttl = options->ClientDNSCacheMaxTTL;
 
   if (exitname) {
     /* XXXX fails to ever get attempts to get an exit address of
@@ -2182,6 +2214,10 @@ connection_ap_handshake_rewrite_and_attach(entry_connection_t *conn,
       log_info(LD_REND, "Unknown descriptor %s. Fetching.",
                safe_str_client(rend_data->onion_address));
       rend_client_refetch_v2_renddesc(rend_data);
+      /* The fetch may have failed at once and closed us. */
+      if (!base_conn->marked_for_close &&
+          base_conn->state == AP_CONN_STATE_RENDDESC_WAIT)
+        connection_ap_launch_rendezvous_early(conn);
     } else { /* r > 0 */
       base_conn->state = AP_CONN_STATE_CIRCUIT_WAIT;
       log_info(LD_REND, "Descriptor is here. Great.");
@@ -2361,9 +2397,11 @@ connection_ap_handshake_process_socks(entry_connection_t *conn)
 
   if (socks->replylen) {
     had_reply = 1;
-    connection_write_to_buf((const char*)socks->reply, socks->replylen,
+    connection_write_to_buf(socks->long_reply ? socks->long_reply :
+                            (const char*)socks->reply, socks->replylen,
                             base_conn);
     socks->replylen = 0;
+    socks->long_reply = NULL;
     if (sockshere == -1) {
       /* An invalid request just got a reply, no additional
        * one is necessary. */
@@ -2570,6 +2608,7 @@ connection_ap_handshake_send_begin(entry_connection_t *ap_conn)
   tor_assert(ap_conn->socks_request);
   tor_assert(SOCKS_COMMAND_IS_CONNECT(ap_conn->socks_request->command));
 
+  circuit_stream_map_remove(TO_CIRCUIT(circ), edge_conn);
   edge_conn->stream_id = get_unique_stream_id_by_circ(circ);
   if (edge_conn->stream_id==0) {
     /* XXXX024 Instead of closing this stream, we should make it get
@@ -2655,6 +2694,7 @@ connection_ap_handshake_send_resolve(entry_connection_t *ap_conn)
   command = ap_conn->socks_request->command;
   tor_assert(SOCKS_COMMAND_IS_RESOLVE(command));
 
+  circuit_stream_map_remove(TO_CIRCUIT(circ), edge_conn);
   edge_conn->stream_id = get_unique_stream_id_by_circ(circ);
   if (edge_conn->stream_id==0) {
     /* XXXX024 Instead of closing this stream, we should make it get
@@ -2864,7 +2904,12 @@ connection_ap_handshake_socks_resolved(entry_connection_t *conn,
 
   if (ENTRY_TO_EDGE_CONN(conn)->is_dns_request) {
     if (conn->dns_server_request) {
-      /* We had a request on our DNS port: answer it. */
+      /* We had a request on our DNS port: answer it.  If the answer came
+       * from our cache, tell the client how much longer it's good for. */
+      if (ttl < 0 && expires > 0 && expires < TIME_MAX) {
+        time_t now = time(NULL);
+        ttl = expires > now ? (int)MIN(expires - now, INT_MAX) : 0;
+      }
       dnsserv_resolved(conn, answer_type, answer_len, (char*)answer, ttl);
       conn->socks_request->has_finished = 1;
       return;
@@ -3148,6 +3193,7 @@ connection_exit_begin_conn(cell_t *cell, circuit_t *circ)
     n_stream->next_stream = origin_circ->p_streams;
     n_stream->on_circuit = circ;
     origin_circ->p_streams = n_stream;
+    circuit_stream_map_remove(circ, n_stream);
     assert_circuit_ok(circ);
 
     connection_exit_connect(n_stream);
@@ -3260,6 +3306,7 @@ connection_exit_connect(edge_connection_t *edge_conn)
   uint16_t port;
   connection_t *conn = TO_CONN(edge_conn);
   int socket_error = 0;
+  int r;
 
   if (!connection_edge_is_rendezvous_stream(edge_conn) &&
       router_compare_to_my_exit_policy(edge_conn)) {
@@ -3275,7 +3322,20 @@ connection_exit_connect(edge_connection_t *edge_conn)
   port = conn->port;
 
   log_debug(LD_EXIT,"about to try connecting");
-  switch (connection_connect(conn, conn->address, addr, port, &socket_error)) {
+  for (;;) {
+    tor_addr_t next_addr;
+    edge_conn->exit_connect_started = approx_time();
+    r = connection_connect(conn, conn->address, addr, port, &socket_error);
+    if (r >= 0 || SOCKET_OK(conn->s) ||
+        !connection_exit_pop_alt_addr(edge_conn, &next_addr))
+      break;
+    log_info(LD_EXIT, "Couldn't connect to %s:%u; trying %s instead.",
+             escaped_safe_str(conn->address), port,
+             safe_str(fmt_addr(&next_addr)));
+    dns_note_exit_connect_result(edge_conn, 0);
+    tor_addr_copy(&conn->addr, &next_addr);
+  }
+  switch (r) {
     case -1: {
       int reason = errno_to_stream_end_reason(socket_error);
       connection_edge_end(edge_conn, reason);
@@ -3328,6 +3388,192 @@ connection_exit_connect(edge_connection_t *edge_conn)
   }
 }
 
+/** Remove the first of <b>edge_conn</b>'s fallback addresses that our exit
+ * policy allows from its list, along with any before it that our exit
+ * policy rejects, and store it in *<b>addr_out</b>.  Return 1 if we found
+ * one, else 0. */
+static int
+connection_exit_pop_alt_addr(edge_connection_t *edge_conn,
+                             tor_addr_t *addr_out)
+{
+  connection_t *conn = TO_CONN(edge_conn);
+  tor_addr_t orig_addr;
+  int found = 0;
+
+  if (connection_edge_is_rendezvous_stream(edge_conn))
+    return 0;
+
+  /* router_compare_to_my_exit_policy() looks at conn->addr. */
+  tor_addr_copy(&orig_addr, &conn->addr);
+  while (!found && edge_conn->n_exit_alt_addrs) {
+    tor_addr_from_ipv4h(&conn->addr, edge_conn->exit_alt_addrs[0]);
+    --edge_conn->n_exit_alt_addrs;
+    memmove(edge_conn->exit_alt_addrs, edge_conn->exit_alt_addrs+1,
+            edge_conn->n_exit_alt_addrs * sizeof(uint32_t));
+    found = !router_compare_to_my_exit_policy(edge_conn);
+  }
+  tor_addr_copy(addr_out, &conn->addr);
+  tor_addr_copy(&conn->addr, &orig_addr);
+  return found;
+}
+
+#ifndef USE_BUFFEREVENTS
+/** Exit connections waiting for connection_exit_reconnect_cb() to move
+ * them to their next address, oldest first.  Each has its
+ * exit_reconnect_pending flag set. */
+static smartlist_t *exit_conns_reconnecting = NULL;
+/** Event that runs connection_exit_reconnect_cb(). */
+static struct event *exit_reconnect_event = NULL;
+
+/** Try to connect <b>edge_conn</b> to its address, or else to each of the
+ * fallback addresses that follow in turn.  If none of them works, end the
+ * stream. */
+static void
+connection_exit_reconnect(edge_connection_t *edge_conn)
+{
+  connection_t *conn = TO_CONN(edge_conn);
+  tor_addr_t addr;
+  int socket_error = 0;
+
+  if (conn->marked_for_close || conn->state != EXIT_CONN_STATE_CONNECTING)
+    return;
+
+  tor_addr_copy(&addr, &conn->addr);
+  do {
+    edge_conn->exit_connect_started = approx_time();
+    switch (connection_reconnect(conn, &addr, conn->port, &socket_error)) {
+      case -1:
+        log_info(LD_EXIT, "Couldn't connect to %s either.",
+                 safe_str(fmt_addr(&addr)));
+        break;
+      case 0:
+        connection_watch_events(conn, READ_EVENT | WRITE_EVENT);
+        return;
+      default:
+        connection_edge_finished_connecting(edge_conn);
+        return;
+    }
+  } while (connection_exit_pop_alt_addr(edge_conn, &addr));
+
+  connection_edge_end(edge_conn, errno_to_stream_end_reason(socket_error));
+  connection_mark_for_close(conn);
+}
+
+/** Libevent callback: move each exit connection in
+ * exit_conns_reconnecting to its next address. */
+static void
+connection_exit_reconnect_cb(evutil_socket_t fd, short what, void *arg)
+{
+  (void)fd;
+  (void)what;
+  (void)arg;
+  while (exit_conns_reconnecting && smartlist_len(exit_conns_reconnecting)) {
+    edge_connection_t *edge_conn = smartlist_get(exit_conns_reconnecting, 0);
+    smartlist_del_keeporder(exit_conns_reconnecting, 0);
+    edge_conn->exit_reconnect_pending = 0;
+    connection_exit_reconnect(edge_conn);
+  }
+}
+
+/** Arrange for the exit connection <b>edge_conn</b> to give up on its
+ * connect() and connect to <b>addr</b> instead, once we're back in the main
+ * loop.  We don't swap its socket right away, since we're usually inside
+ * one of its own event callbacks, and that would free the event that
+ * libevent is running. */
+void
+connection_exit_reconnect_later(edge_connection_t *edge_conn,
+                                const tor_addr_t *addr)
+{
+  connection_t *conn = TO_CONN(edge_conn);
+
+  tor_addr_copy(&conn->addr, addr);
+  connection_stop_reading(conn);
+  connection_stop_writing(conn);
+  if (edge_conn->exit_reconnect_pending)
+    return;
+  edge_conn->exit_reconnect_pending = 1;
+  if (!exit_conns_reconnecting)
+    exit_conns_reconnecting = smartlist_new();
+  smartlist_add(exit_conns_reconnecting, edge_conn);
+
+  if (!exit_reconnect_event)
+    exit_reconnect_event = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                         connection_exit_reconnect_cb, NULL);
+  event_active(exit_reconnect_event, EV_TIMEOUT, 1);
+}
+#endif
+
+/** Forget that <b>edge_conn</b> is waiting to move to its next address.
+ * Must be called before <b>edge_conn</b> is freed. */
+void
+connection_exit_cancel_reconnect(edge_connection_t *edge_conn)
+{
+#ifdef USE_BUFFEREVENTS
+  (void)edge_conn;
+#else
+  if (!edge_conn->exit_reconnect_pending)
+    return;
+  SMARTLIST_FOREACH_BEGIN(exit_conns_reconnecting, edge_connection_t *, c) {
+    if (c == edge_conn) {
+      smartlist_del_keeporder(exit_conns_reconnecting, c_sl_idx);
+      break;
+    }
+  } SMARTLIST_FOREACH_END(c);
+  edge_conn->exit_reconnect_pending = 0;
+#endif
+}
+
+/** Release all storage held for exit connections that are waiting to move
+ * to their next address. */
+void
+connection_exit_reconnect_free_all(void)
+{
+#ifndef USE_BUFFEREVENTS
+  if (exit_conns_reconnecting) {
+    SMARTLIST_FOREACH(exit_conns_reconnecting, edge_connection_t *, conn,
+                      conn->exit_reconnect_pending = 0);
+    smartlist_free(exit_conns_reconnecting);
+    exit_conns_reconnecting = NULL;
+  }
+  if (exit_reconnect_event) {
+    tor_event_free(exit_reconnect_event);
+    exit_reconnect_event = NULL;
+  }
+#endif
+}
+
+/** The connect() for the exit connection <b>edge_conn</b> has failed, or
+ * has taken longer than ExitConnectFallbackTimeout.  If the hostname we're
+ * connecting to had other addresses, abandon this attempt, arrange to
+ * connect to the next one from the main loop, and return 1.  Otherwise
+ * leave <b>edge_conn</b> alone and return 0. */
+int
+connection_exit_try_next_addr(edge_connection_t *edge_conn)
+{
+#ifdef USE_BUFFEREVENTS
+  (void)edge_conn;
+  return 0;
+#else
+  connection_t *conn = TO_CONN(edge_conn);
+  tor_addr_t next_addr;
+
+  tor_assert(conn->type == CONN_TYPE_EXIT);
+  tor_assert(conn->state == EXIT_CONN_STATE_CONNECTING);
+
+  if (edge_conn->exit_reconnect_pending)
+    return 1; /* We're already moving it along. */
+  dns_note_exit_connect_result(edge_conn, 0);
+  if (!connection_exit_pop_alt_addr(edge_conn, &next_addr))
+    return 0;
+  log_info(LD_EXIT, "Connection to %s:%u (%s) isn't working; trying %s "
+           "instead.", escaped_safe_str(conn->address), conn->port,
+           safe_str(fmt_addr(&conn->addr)),
+           safe_str(fmt_addr(&next_addr)));
+  connection_exit_reconnect_later(edge_conn, &next_addr);
+  return 1;
+#endif
+}
+
 /** Given an exit conn that should attach to us as a directory server, open a
  * bridge connection with a linked connection pair, create a new directory
  * conn, and join them together.  Return 0 on success (or if there was an
@@ -3370,6 +3616,7 @@ connection_exit_connect_dir(edge_connection_t *exitconn)
   /* link exitconn to circ, now that we know we can use it. */
   exitconn->next_stream = circ->n_streams;
   circ->n_streams = exitconn;
+  circuit_stream_map_remove(TO_CIRCUIT(circ), exitconn);
 
   if (connection_add(TO_CONN(dirconn))<0) {
     connection_edge_end(exitconn, END_STREAM_REASON_RESOURCELIMIT);
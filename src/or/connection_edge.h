@@ -52,6 +52,9 @@ void connection_ap_handshake_socks_resolved(entry_connection_t *conn,
 int connection_exit_begin_conn(cell_t *cell, circuit_t *circ);
 int connection_exit_begin_resolve(cell_t *cell, or_circuit_t *circ);
 void connection_exit_connect(edge_connection_t *conn);
+int connection_exit_try_next_addr(edge_connection_t *edge_conn);
+void connection_exit_cancel_reconnect(edge_connection_t *edge_conn);
+void connection_exit_reconnect_free_all(void);
 int connection_edge_is_rendezvous_stream(edge_connection_t *conn);
 int connection_ap_can_use_exit(const entry_connection_t *conn,
                                const node_t *exit);
@@ -73,6 +76,7 @@ void addressmap_clear_invalid_automaps(const or_options_t *options);
 void addressmap_clean(time_t now);
 void addressmap_clear_configured(void);
 void addressmap_clear_transient(void);
+void addressmap_clear_dns_cache(void);
 void addressmap_free_all(void);
 int addressmap_rewrite(char *address, size_t maxlen, time_t *expires_out,
                        addressmap_entry_source_t *exit_source_out);
@@ -115,5 +119,11 @@ int connection_edge_update_circuit_isolation(const entry_connection_t *conn,
                                              int dry_run);
 void circuit_clear_isolation(origin_circuit_t *circ);
 
+#ifdef CONNECTION_EDGE_PRIVATE
+/* Used only by connection_edge.c and test.c */
+void connection_exit_reconnect_later(edge_connection_t *edge_conn,
+                                     const tor_addr_t *addr);
+#endif
+
 #endif
 
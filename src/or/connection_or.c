@@ -19,6 +19,7 @@
 #include "connection.h"
 #include "connection_or.h"
 #include "control.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "geoip.h"
 #include "main.h"
@@ -29,6 +30,8 @@
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
+#include "scheduler.h"
+#include "transports.h"
 
 #ifdef USE_BUFFEREVENTS
 #include <event2/bufferevent_ssl.h>
@@ -42,6 +45,8 @@ static int connection_or_check_valid_tls_handshake(or_connection_t *conn,
                                                    char *digest_rcvd_out);
 
 static void connection_or_tls_renegotiated_cb(tor_tls_t *tls, void *_conn);
+static int connection_tls_handle_handshake_result(or_connection_t *conn,
+                                                  int result);
 
 #ifdef USE_BUFFEREVENTS
 static void connection_or_handle_event_cb(struct bufferevent *bufev,
@@ -98,14 +103,12 @@ connection_or_remove_from_identity_map(or_connection_t *conn)
 void
 connection_or_clear_identity_map(void)
 {
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_OR);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
-    if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      memset(or_conn->identity_digest, 0, DIGEST_LEN);
-      or_conn->next_with_same_id = NULL;
-    }
+    or_connection_t *or_conn = TO_OR_CONN(conn);
+    memset(or_conn->identity_digest, 0, DIGEST_LEN);
+    or_conn->next_with_same_id = NULL;
   });
 
   digestmap_free(orconn_identity_map, NULL);
@@ -287,9 +290,6 @@ connection_or_report_broken_states(int severity, int domain)
 /** Pack the cell_t host-order structure <b>src</b> into network-order
  * in the buffer <b>dest</b>. See tor-spec.txt for details about the
  * wire format.
- *
- * Note that this function doesn't touch <b>dst</b>-\>next: the caller
- * should set it or clear it as appropriate.
  */
 void
 cell_pack(packed_cell_t *dst, const cell_t *src)
@@ -303,7 +303,7 @@ cell_pack(packed_cell_t *dst, const cell_t *src)
 /** Unpack the network-order buffer <b>src</b> into a host-order
  * cell_t structure <b>dest</b>.
  */
-static void
+void
 cell_unpack(cell_t *dest, const char *src)
 {
   dest->circ_id = ntohs(get_uint16(src));
@@ -417,31 +417,17 @@ connection_or_process_inbuf(or_connection_t *conn)
   return ret;
 }
 
-/** When adding cells to an OR connection's outbuf, keep adding until the
- * outbuf is at least this long, or we run out of cells. */
-#define OR_CONN_HIGHWATER (32*1024)
-
-/** Add cells to an OR connection's outbuf whenever the outbuf's data length
- * drops below this size. */
-#define OR_CONN_LOWWATER (16*1024)
-
-/** Called whenever we have flushed some data on an or_conn: add more data
- * from active circuits. */
+/** Called whenever we have flushed some data on an or_conn: ask the
+ * scheduler to add more data from active circuits. */
 int
 connection_or_flushed_some(or_connection_t *conn)
 {
-  size_t datalen = connection_get_outbuf_len(TO_CONN(conn));
-  /* If we're under the low water mark, add cells until we're just over the
-   * high water mark. */
-  if (datalen < OR_CONN_LOWWATER) {
-    ssize_t n = CEIL_DIV(OR_CONN_HIGHWATER - datalen, CELL_NETWORK_SIZE);
-    time_t now = approx_time();
-    while (conn->active_circuits && n > 0) {
-      int flushed;
-      flushed = connection_or_flush_from_first_active_circuit(conn, 1, now);
-      n -= flushed;
-    }
-  }
+  size_t datalen = connection_get_outbuf_len(TO_CONN(conn)) +
+    connection_get_kernel_unsent(TO_CONN(conn));
+  /* If we're under the low water mark, the scheduler will add cells until
+   * we're just over the high water mark. */
+  if (datalen < OR_CONN_LOWWATER && conn->active_circuits)
+    scheduler_conn_wants_to_write(conn);
   return 0;
 }
 
@@ -591,13 +577,19 @@ connection_or_update_token_buckets_helper(or_connection_t *conn, int reset,
      * bandwidth parameters in the consensus, but allow local config
      * options to override. */
     rate = options->PerConnBWRate ? (int)options->PerConnBWRate :
-        networkstatus_get_param(NULL, "perconnbwrate",
-                                (int)options->BandwidthRate, 1, INT32_MAX);
+        networkstatus_get_param_by_id(NULL, NET_PARAM_PERCONNBWRATE,
+                                      (int)options->BandwidthRate,
+                                      1, INT32_MAX);
     burst = options->PerConnBWBurst ? (int)options->PerConnBWBurst :
-        networkstatus_get_param(NULL, "perconnbwburst",
-                                (int)options->BandwidthBurst, 1, INT32_MAX);
+        networkstatus_get_param_by_id(NULL, NET_PARAM_PERCONNBWBURST,
+                                      (int)options->BandwidthBurst,
+                                      1, INT32_MAX);
   }
 
+#ifndef USE_BUFFEREVENTS
+  /* Give the buckets what they've earned at the old rate first. */
+  connection_or_buckets_catch_up(conn);
+#endif
   conn->bandwidthrate = rate;
   conn->bandwidthburst = burst;
 #ifdef USE_BUFFEREVENTS
@@ -860,6 +852,17 @@ connection_or_get_for_extend(const char *digest,
  * too old for new circuits? */
 #define TIME_BEFORE_OR_CONN_IS_TOO_OLD (60*60*24*7)
 
+/** Set the is_bad_for_new_circs flag on <b>or_conn</b>, and make sure
+ * we'll soon check whether that lets us close it. */
+void
+connection_or_mark_bad_for_new_circs(or_connection_t *or_conn)
+{
+  if (or_conn->is_bad_for_new_circs)
+    return;
+  or_conn->is_bad_for_new_circs = 1;
+  connection_schedule_housekeeping(TO_CONN(or_conn), approx_time());
+}
+
 /** Given the head of the linked list for all the or_connections with a given
  * identity, set elements of that list as is_bad_for_new_circs as
  * appropriate. Helper for connection_or_set_bad_connections().
@@ -898,7 +901,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                "(fd %d, %d secs old).",
                or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                (int)(now - or_conn->_base.timestamp_created));
-      or_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(or_conn);
     }
 
     if (or_conn->is_bad_for_new_circs) {
@@ -930,7 +933,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                "another connection to that OR that is.",
                or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                (int)(now - or_conn->_base.timestamp_created));
-      or_conn->is_bad_for_new_circs = 1;
+      connection_or_mark_bad_for_new_circs(or_conn);
       continue;
     }
 
@@ -971,7 +974,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                  or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                  (int)(now - or_conn->_base.timestamp_created),
                  best->_base.s, (int)(now - best->_base.timestamp_created));
-        or_conn->is_bad_for_new_circs = 1;
+        connection_or_mark_bad_for_new_circs(or_conn);
       } else if (!tor_addr_compare(&or_conn->real_addr,
                                    &best->real_addr, CMP_EXACT)) {
         log_info(LD_OR,
@@ -981,7 +984,7 @@ connection_or_group_set_badness(or_connection_t *head, int force)
                  or_conn->_base.address, or_conn->_base.port, or_conn->_base.s,
                  (int)(now - or_conn->_base.timestamp_created),
                  best->_base.s, (int)(now - best->_base.timestamp_created));
-        or_conn->is_bad_for_new_circs = 1;
+        connection_or_mark_bad_for_new_circs(or_conn);
       }
     }
   }
@@ -1073,6 +1076,11 @@ connection_or_connect(const tor_addr_t *_addr, uint16_t port,
       tor_addr_copy(&addr, &proxy_addr);
       port = proxy_port;
       conn->_base.proxy_state = PROXY_INFANT;
+    } else {
+      /* Maybe we talk to this bridge through a transport that's built
+       * in. */
+      conn->inproc_transport =
+        pt_get_inproc_transport_for_bridge(&addr, port);
     }
   } else {
     /* get_proxy_addrport() might fail if we have a Bridge line that
@@ -1142,11 +1150,35 @@ connection_tls_start_handshake(or_connection_t *conn, int receiving)
 {
   conn->_base.state = OR_CONN_STATE_TLS_HANDSHAKING;
   tor_assert(!conn->tls);
-  conn->tls = tor_tls_new(conn->_base.s, receiving);
+  if (conn->inproc_transport) {
+    const inproc_transport_t *t = conn->inproc_transport;
+    void *state;
+#ifdef USE_BUFFEREVENTS
+    if (connection_type_uses_bufferevent(TO_CONN(conn))) {
+      log_warn(LD_GENERAL, "Can't use in-process transport '%s' with "
+               "bufferevents. Closing.", t->name);
+      return -1;
+    }
+#endif
+    state = t->conn_new(&conn->_base.addr, conn->_base.port);
+    if (!state) {
+      log_warn(LD_GENERAL, "In-process transport '%s' couldn't handle a "
+               "connection to %s:%d. Closing.", t->name,
+               fmt_addr(&conn->_base.addr), conn->_base.port);
+      return -1;
+    }
+    conn->tls = tor_tls_new_with_io(conn->_base.s, receiving, &t->io, state);
+    if (!conn->tls && t->io.free)
+      t->io.free(state);
+  } else {
+    conn->tls = tor_tls_new(conn->_base.s, receiving);
+  }
   if (!conn->tls) {
     log_warn(LD_BUG,"tor_tls_new failed. Closing.");
     return -1;
   }
+  if (!receiving)
+    tor_tls_resume_session(conn->tls, conn->identity_digest);
   tor_tls_set_logged_address(conn->tls, // XXX client and relay?
       escaped_safe_str(conn->_base.address));
 
@@ -1206,7 +1238,10 @@ connection_or_tls_renegotiated_cb(tor_tls_t *tls, void *_conn)
 }
 
 /** Move forward with the tls handshake. If it finishes, hand
- * <b>conn</b> to connection_tls_finish_handshake().
+ * <b>conn</b> to connection_tls_finish_handshake().  If we can, we let a
+ * cpuworker thread run the initial handshake, since that's where the
+ * expensive public key operations happen; connection_or_tls_handshake_done()
+ * picks up from there.
  *
  * Return -1 if <b>conn</b> is broken, else return 0.
  */
@@ -1214,18 +1249,62 @@ int
 connection_tls_continue_handshake(or_connection_t *conn)
 {
   int result;
+  if (conn->tls_handshake_in_worker)
+    return 0; /* A cpuworker has it; we'll hear back. */
   check_no_tls_errors();
- again:
   if (conn->_base.state == OR_CONN_STATE_TLS_CLIENT_RENEGOTIATING) {
     // log_notice(LD_OR, "Renegotiate with %p", conn->tls);
     result = tor_tls_renegotiate(conn->tls);
     // log_notice(LD_OR, "Result: %d", result);
   } else {
     tor_assert(conn->_base.state == OR_CONN_STATE_TLS_HANDSHAKING);
+    if (assign_tls_handshake_to_cpuworker(conn) == 0) {
+      /* Leave the socket alone until the worker is done with it. */
+      conn->tls_handshake_in_worker = 1;
+      connection_stop_reading(TO_CONN(conn));
+      connection_stop_writing(TO_CONN(conn));
+      return 0;
+    }
     // log_notice(LD_OR, "Continue handshake with %p", conn->tls);
     result = tor_tls_handshake(conn->tls);
     // log_notice(LD_OR, "Result: %d", result);
   }
+  return connection_tls_handle_handshake_result(conn, result);
+}
+
+/** Called when a cpuworker has finished running tor_tls_handshake() on
+ * <b>conn</b>, with the return value <b>result</b>.  Give the connection
+ * back to the main loop, and carry on with the handshake as
+ * connection_tls_continue_handshake() would have.
+ */
+void
+connection_or_tls_handshake_done(or_connection_t *conn, int result)
+{
+  connection_t *c = TO_CONN(conn);
+  tor_assert(conn->tls_handshake_in_worker);
+  conn->tls_handshake_in_worker = 0;
+
+  if (conn->close_after_worker) {
+    conn->close_after_worker = 0;
+    connection_close_immediate(c);
+  }
+  if (c->marked_for_close)
+    return; /* We'll free it next time through the main loop. */
+
+  /* handshaking conns are *always* reading */
+  connection_start_reading(c);
+  if (connection_tls_handle_handshake_result(conn, result) < 0) {
+    connection_close_immediate(c);
+    connection_mark_for_close(c);
+  }
+}
+
+/** Helper: act on <b>result</b>, the return value of a step of the tls
+ * handshake on <b>conn</b>.  Return -1 if <b>conn</b> is broken, else
+ * return 0. */
+static int
+connection_tls_handle_handshake_result(or_connection_t *conn, int result)
+{
   switch (result) {
     CASE_TOR_TLS_ERROR_ANY:
     log_info(LD_OR,"tls error [%s]. breaking connection.",
@@ -1243,7 +1322,7 @@ connection_tls_continue_handshake(or_connection_t *conn)
               log_debug(LD_OR, "Done with initial SSL handshake (client-side)."
                         " Requesting renegotiation.");
               conn->_base.state = OR_CONN_STATE_TLS_CLIENT_RENEGOTIATING;
-              goto again;
+              return connection_tls_continue_handshake(conn);
             }
           }
           // log_notice(LD_OR,"Done. state was %d.", conn->_base.state);
@@ -1726,6 +1805,49 @@ or_handshake_state_record_var_cell(or_handshake_state_t *state,
   memset(buf, 0, sizeof(buf));
 }
 
+/** If <b>corked</b> and CoalesceORWrites is set, tell the kernel to hold
+ * back partial segments on <b>conn</b>'s socket until we uncork it.  If not
+ * <b>corked</b>, uncork the socket if we corked it, sending whatever it has
+ * held back. */
+void
+connection_or_set_corked(or_connection_t *conn, int corked)
+{
+  corked = corked ? 1 : 0;
+  if (conn->is_corked == (unsigned)corked)
+    return;
+  if (corked && !get_options()->CoalesceORWrites)
+    return;
+  if (!SOCKET_OK(conn->_base.s))
+    return;
+  if (tor_socket_set_cork(conn->_base.s, corked) < 0) {
+    log_debug(LD_NET, "Couldn't %scork OR connection socket %d: %s",
+              corked ? "" : "un", (int)conn->_base.s,
+              tor_socket_strerror(tor_socket_errno(conn->_base.s)));
+    return;
+  }
+  conn->is_corked = corked;
+}
+
+/** Return how many bytes of <b>conn</b>'s outbuf we should gather into each
+ * TLS record we write, or 0 if we should write each outbuf chunk as it
+ * stands.
+ *
+ * If the scheduler still has cells waiting on <b>conn</b>'s circuits, the
+ * connection is sending in bulk, and full-sized records cost the least in
+ * framing and MAC overhead.  Otherwise, what's on the outbuf is all there
+ * is for now, and the peer can't read any cell in a record until the whole
+ * record has arrived: so keep records small, and let the first cells go as
+ * soon as they can. */
+size_t
+connection_or_get_tls_record_size(const or_connection_t *conn)
+{
+  if (!get_options()->TLSRecordCoalescing)
+    return 0;
+  if (!conn->active_circuits)
+    return 0;
+  return OR_CONN_TLS_RECORD_MAX;
+}
+
 /** Set <b>conn</b>'s state to OR_CONN_STATE_OPEN, and tell other subsystems
  * as appropriate.  Called when we are done with all TLS and OR handshaking.
  */
@@ -1740,6 +1862,8 @@ connection_or_set_state_open(or_connection_t *conn)
   if (started_here) {
     circuit_build_times_network_is_live(&circ_times);
     rep_hist_note_connect_succeeded(conn->identity_digest, now);
+    /* The identity is verified now, so the session is safe to resume. */
+    tor_tls_save_session(conn->tls, conn->identity_digest);
     if (entry_guard_register_connect_status(conn->identity_digest,
                                             1, 0, now) < 0) {
       /* Close any circuits pending on this conn. We leave it in state
@@ -1832,6 +1956,20 @@ connection_fetch_var_cell_from_buf(or_connection_t *or_conn, var_cell_t **out)
   }
 }
 
+/** See whether there's a whole fixed-length cell waiting on
+ * <b>or_conn</b>'s inbuf.  Return values as for fetch_cell_from_buf(). */
+static int
+connection_fetch_cell_from_buf(or_connection_t *or_conn, cell_t *out)
+{
+  connection_t *conn = TO_CONN(or_conn);
+  IF_HAS_BUFFEREVENT(conn, {
+    struct evbuffer *input = bufferevent_get_input(conn->bufev);
+    return fetch_cell_from_evbuffer(input, out);
+  }) ELSE_IF_NO_BUFFEREVENT {
+    return fetch_cell_from_buf(conn->inbuf, out);
+  }
+}
+
 /** Process cells from <b>conn</b>'s inbuf.
  *
  * Loop: while inbuf contains a cell, pull it off the inbuf, unpack it,
@@ -1843,6 +1981,11 @@ static int
 connection_or_process_cells_from_inbuf(or_connection_t *conn)
 {
   var_cell_t *var_cell;
+  /* Relay cells that we've fetched but not yet processed; we hand them to
+   * command_process_relay_cell_batch() together so that runs of cells on
+   * one circuit can share a single crypto call. */
+  cell_t batch[RELAY_CRYPT_BATCH_MAX];
+  int n_batched = 0;
 
   while (1) {
     log_debug(LD_OR,
@@ -1851,27 +1994,46 @@ connection_or_process_cells_from_inbuf(or_connection_t *conn)
               tor_tls_get_pending_bytes(conn->tls));
     if (connection_fetch_var_cell_from_buf(conn, &var_cell)) {
       if (!var_cell)
-        return 0; /* not yet. */
+        break; /* not yet. */
+      if (n_batched) {
+        command_process_relay_cell_batch(batch, n_batched, conn);
+        n_batched = 0;
+      }
       circuit_build_times_network_is_live(&circ_times);
       command_process_var_cell(var_cell, conn);
       var_cell_free(var_cell);
     } else {
-      char buf[CELL_NETWORK_SIZE];
-      cell_t cell;
-      if (connection_get_inbuf_len(TO_CONN(conn))
-          < CELL_NETWORK_SIZE) /* whole response available? */
-        return 0; /* not yet */
+      cell_t *cell = &batch[n_batched];
+      /* Unpack the cell straight from the inbuf into the batch (creating
+       * the host-order struct from the network-order bytes). */
+      if (!connection_fetch_cell_from_buf(conn, cell))
+        break; /* not yet */
 
       circuit_build_times_network_is_live(&circ_times);
-      connection_fetch_from_buf(buf, CELL_NETWORK_SIZE, TO_CONN(conn));
 
-      /* retrieve cell info from buf (create the host-order struct from the
-       * network-order string) */
-      cell_unpack(&cell, buf);
+      if (conn->_base.state == OR_CONN_STATE_OPEN &&
+          (cell->command == CELL_RELAY ||
+           cell->command == CELL_RELAY_EARLY)) {
+        if (++n_batched == RELAY_CRYPT_BATCH_MAX) {
+          command_process_relay_cell_batch(batch, n_batched, conn);
+          n_batched = 0;
+        }
+        continue;
+      }
 
-      command_process_cell(&cell, conn);
+      /* Anything else has to wait until the cells before it are done.  (The
+       * batch doesn't include <b>cell</b>, so it's left alone.) */
+      if (n_batched) {
+        command_process_relay_cell_batch(batch, n_batched, conn);
+        n_batched = 0;
+      }
+      command_process_cell(cell, conn);
     }
   }
+
+  if (n_batched)
+    command_process_relay_cell_batch(batch, n_batched, conn);
+  return 0;
 }
 
 /** Write a destroy cell with circ ID <b>circ_id</b> and reason <b>reason</b>
@@ -12,6 +12,17 @@
 #ifndef _TOR_CONNECTION_OR_H
 #define _TOR_CONNECTION_OR_H
 
+/** When adding cells to an OR connection's outbuf, keep adding until the
+ * outbuf is at least this long, or we run out of cells. */
+#define OR_CONN_HIGHWATER (32*1024)
+
+/** Add cells to an OR connection's outbuf whenever the outbuf's data length
+ * drops below this size. */
+#define OR_CONN_LOWWATER (16*1024)
+
+/** The largest amount of data that fits in one TLS record. */
+#define OR_CONN_TLS_RECORD_MAX (16*1024)
+
 void connection_or_remove_from_identity_map(or_connection_t *conn);
 void connection_or_clear_identity_map(void);
 void clear_broken_connection_map(int disable);
@@ -20,6 +31,7 @@ or_connection_t *connection_or_get_for_extend(const char *digest,
                                               const char **msg_out,
                                               int *launch_out);
 void connection_or_set_bad_connections(const char *digest, int force);
+void connection_or_mark_bad_for_new_circs(or_connection_t *or_conn);
 
 int connection_or_reached_eof(or_connection_t *conn);
 int connection_or_process_inbuf(or_connection_t *conn);
@@ -40,6 +52,7 @@ void connection_or_report_broken_states(int severity, int domain);
 
 int connection_tls_start_handshake(or_connection_t *conn, int receiving);
 int connection_tls_continue_handshake(or_connection_t *conn);
+void connection_or_tls_handshake_done(or_connection_t *conn, int result);
 
 int connection_init_or_handshake_state(or_connection_t *conn,
                                        int started_here);
@@ -61,6 +74,8 @@ void or_handshake_state_record_var_cell(or_handshake_state_t *state,
                                         int incoming);
 
 int connection_or_set_state_open(or_connection_t *conn);
+void connection_or_set_corked(or_connection_t *conn, int corked);
+size_t connection_or_get_tls_record_size(const or_connection_t *conn);
 void connection_or_write_cell_to_buf(const cell_t *cell,
                                      or_connection_t *conn);
 void connection_or_write_var_cell_to_buf(const var_cell_t *cell,
@@ -80,6 +95,7 @@ int connection_or_send_authenticate_cell(or_connection_t *conn, int type);
 int is_or_protocol_version_known(uint16_t version);
 
 void cell_pack(packed_cell_t *dest, const cell_t *src);
+void cell_unpack(cell_t *dest, const char *src);
 void var_cell_pack_header(const var_cell_t *cell, char *hdr_out);
 var_cell_t *var_cell_new(uint16_t payload_len);
 void var_cell_free(var_cell_t *cell);
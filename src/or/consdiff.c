@@ -0,0 +1,538 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.c
+ * \brief Generate and apply ed-style diffs between consensus documents.
+ *
+ * A consensus diff lets a client that already holds one consensus fetch the
+ * next one as a short list of edits.  A diff looks like:
+ *
+ *   network-status-diff-version 1
+ *   hash <hex sha256 of base document> <hex sha256 of target document>
+ *   <ed commands>
+ *
+ * The ed commands ("Na", "N[,M]c" and "N[,M]d") run from the bottom of the
+ * base document to the top, so every line number refers to the unmodified
+ * base document.  Text for "a" and "c" ends with a line holding only ".".
+ *
+ * We don't run a general LCS over the whole document: router entries are
+ * sorted by identity digest, so we walk the entries of both documents in
+ * step and only compare lines within the header, the footer, and pairs of
+ * entries for the same relay.
+ **/
+
+#include "or.h"
+#include "consdiff.h"
+
+/** One line of a document, not counting its terminating newline. */
+typedef struct cdline_t {
+  const char *s;
+  size_t len;
+} cdline_t;
+
+/** Replace base lines [old_lo, old_hi) with target lines [new_lo, new_hi).
+ * Indices are 0-based. */
+typedef struct cdhunk_t {
+  int old_lo, old_hi;
+  int new_lo, new_hi;
+} cdhunk_t;
+
+/** A growable list of hunks, in increasing order of position. */
+typedef struct cdhunks_t {
+  cdhunk_t *h;
+  int n, cap;
+} cdhunks_t;
+
+/** Where the router entries of a document start and end, and the identity
+ * digest of each. */
+typedef struct cdentries_t {
+  int n;
+  int *lo; /**< n+1 elements: entry i is lines [lo[i], lo[i+1]). */
+  char *ids; /**< n*DIGEST_LEN bytes of identity digests. */
+} cdentries_t;
+
+/** Don't run LCS on sections whose lines can't fit in a table this many
+ * cells big; replace the whole section instead. */
+#define CONSDIFF_MAX_LCS_CELLS (1<<18)
+
+/** Return true iff <b>s</b> looks like the start of a consensus diff. */
+int
+consdiff_looks_like_diff(const char *s)
+{
+  return !strcmpstart(s, CONSDIFF_VERSION_LINE "\n");
+}
+
+/** Set <b>digest_out</b> to the SHA256 digest of the entire document
+ * <b>doc</b>: this is how consensus diffs name their base and target. */
+void
+consdiff_get_digest(char *digest_out, const char *doc)
+{
+  crypto_digest256(digest_out, doc, strlen(doc), DIGEST_SHA256);
+}
+
+/** Split <b>s</b> into lines, store a newly allocated array of them in
+ * *<b>lines_out</b>, and return the number of lines.  Return -1 if <b>s</b>
+ * is empty or doesn't end with a newline. */
+static int
+split_lines(const char *s, cdline_t **lines_out)
+{
+  size_t len = strlen(s);
+  const char *cp, *eos = s + len;
+  int n = 0, i = 0;
+  cdline_t *lines;
+
+  *lines_out = NULL;
+  if (!len || s[len-1] != '\n')
+    return -1;
+  for (cp = s; cp < eos; ++cp) {
+    if (*cp == '\n')
+      ++n;
+  }
+  lines = tor_malloc(sizeof(cdline_t)*n);
+  for (cp = s; cp < eos; ) {
+    const char *eol = memchr(cp, '\n', eos-cp);
+    lines[i].s = cp;
+    lines[i].len = eol - cp;
+    ++i;
+    cp = eol + 1;
+  }
+  *lines_out = lines;
+  return n;
+}
+
+/** Return true iff <b>a</b> and <b>b</b> hold the same text. */
+static INLINE int
+lines_eq(const cdline_t *a, const cdline_t *b)
+{
+  return a->len == b->len && fast_memeq(a->s, b->s, a->len);
+}
+
+/** Return true iff the line <b>l</b> starts with <b>prefix</b>. */
+static INLINE int
+line_startswith(const cdline_t *l, const char *prefix)
+{
+  size_t n = strlen(prefix);
+  return l->len >= n && fast_memeq(l->s, prefix, n);
+}
+
+/** Note that base lines [old_lo, old_hi) become target lines
+ * [new_lo, new_hi), merging with the previous hunk if they touch. */
+static void
+hunks_add(cdhunks_t *hunks, int old_lo, int old_hi, int new_lo, int new_hi)
+{
+  cdhunk_t *h;
+  if (old_lo == old_hi && new_lo == new_hi)
+    return;
+  if (hunks->n) {
+    h = &hunks->h[hunks->n-1];
+    if (h->old_hi == old_lo && h->new_hi == new_lo) {
+      h->old_hi = old_hi;
+      h->new_hi = new_hi;
+      return;
+    }
+  }
+  if (hunks->n == hunks->cap) {
+    hunks->cap = hunks->cap ? hunks->cap * 2 : 64;
+    hunks->h = tor_realloc(hunks->h, sizeof(cdhunk_t)*hunks->cap);
+  }
+  h = &hunks->h[hunks->n++];
+  h->old_lo = old_lo;
+  h->old_hi = old_hi;
+  h->new_lo = new_lo;
+  h->new_hi = new_hi;
+}
+
+/** Add to <b>hunks</b> the edits that turn base lines [a_lo, a_hi) of
+ * <b>a</b> into target lines [b_lo, b_hi) of <b>b</b>, using a longest
+ * common subsequence on the lines. */
+static void
+diff_range(const cdline_t *a, int a_lo, int a_hi,
+           const cdline_t *b, int b_lo, int b_hi, cdhunks_t *hunks)
+{
+  int n, m, i, j, pi, pj;
+  int *lcs;
+
+  /* Common prefixes and suffixes are the usual case; skip them first. */
+  while (a_lo < a_hi && b_lo < b_hi && lines_eq(&a[a_lo], &b[b_lo])) {
+    ++a_lo;
+    ++b_lo;
+  }
+  while (a_lo < a_hi && b_lo < b_hi && lines_eq(&a[a_hi-1], &b[b_hi-1])) {
+    --a_hi;
+    --b_hi;
+  }
+  n = a_hi - a_lo;
+  m = b_hi - b_lo;
+  if (!n || !m || (uint64_t)(n+1)*(m+1) > CONSDIFF_MAX_LCS_CELLS) {
+    hunks_add(hunks, a_lo, a_hi, b_lo, b_hi);
+    return;
+  }
+
+  /* lcs[i*(m+1)+j] is the LCS length of a[a_lo+i..] and b[b_lo+j..]. */
+#define LCS(i,j) lcs[(i)*(m+1)+(j)]
+  lcs = tor_malloc(sizeof(int)*(n+1)*(m+1));
+  for (i = n; i >= 0; --i) {
+    for (j = m; j >= 0; --j) {
+      if (i == n || j == m)
+        LCS(i,j) = 0;
+      else if (lines_eq(&a[a_lo+i], &b[b_lo+j]))
+        LCS(i,j) = 1 + LCS(i+1,j+1);
+      else
+        LCS(i,j) = MAX(LCS(i+1,j), LCS(i,j+1));
+    }
+  }
+
+  i = j = pi = pj = 0;
+  while (i < n && j < m) {
+    if (lines_eq(&a[a_lo+i], &b[b_lo+j])) {
+      hunks_add(hunks, a_lo+pi, a_lo+i, b_lo+pj, b_lo+j);
+      pi = ++i;
+      pj = ++j;
+    } else if (LCS(i+1,j) >= LCS(i,j+1)) {
+      ++i;
+    } else {
+      ++j;
+    }
+  }
+  hunks_add(hunks, a_lo+pi, a_hi, b_lo+pj, b_hi);
+#undef LCS
+  tor_free(lcs);
+}
+
+/** Find the router entries in <b>lines</b> (of length <b>n_lines</b>), and
+ * store them in <b>out</b>.  Every line before the first entry is header;
+ * every line from <b>out</b>-&gt;lo[<b>out</b>-&gt;n] on is footer.  Return 0
+ * on success, or -1 if an entry is malformed or the entries aren't sorted
+ * by identity digest. */
+static int
+find_entries(const cdline_t *lines, int n_lines, cdentries_t *out)
+{
+  int i, n = 0, footer;
+
+  memset(out, 0, sizeof(cdentries_t));
+  for (i = 0; i < n_lines; ++i) {
+    if (line_startswith(&lines[i], "r "))
+      ++n;
+  }
+  out->lo = tor_malloc(sizeof(int)*(n+1));
+  out->ids = tor_malloc(DIGEST_LEN*(n ? n : 1));
+
+  for (i = 0; i < n_lines && !line_startswith(&lines[i], "r "); ++i)
+    ;
+  footer = n_lines;
+  while (i < n_lines) {
+    const cdline_t *l = &lines[i];
+    char b64[BASE64_DIGEST_LEN+1];
+    const char *id, *end;
+    if (line_startswith(l, "directory-footer") ||
+        line_startswith(l, "directory-signature ")) {
+      footer = i;
+      break;
+    }
+    if (line_startswith(l, "r ")) {
+      /* "r" SP nickname SP identity SP ... */
+      end = l->s + l->len;
+      id = memchr(l->s + 2, ' ', l->len - 2);
+      if (!id)
+        return -1;
+      ++id;
+      end = memchr(id, ' ', end - id);
+      if (!end || end - id != BASE64_DIGEST_LEN)
+        return -1;
+      memcpy(b64, id, BASE64_DIGEST_LEN);
+      b64[BASE64_DIGEST_LEN] = '\0';
+      if (digest_from_base64(out->ids + DIGEST_LEN*out->n, b64) < 0)
+        return -1;
+      if (out->n && tor_memcmp(out->ids + DIGEST_LEN*(out->n-1),
+                               out->ids + DIGEST_LEN*out->n, DIGEST_LEN) >= 0)
+        return -1;
+      out->lo[out->n++] = i;
+    }
+    ++i;
+  }
+  if (!out->n)
+    footer = n_lines;
+  out->lo[out->n] = footer;
+  return 0;
+}
+
+/** Release storage held by <b>e</b>. */
+static void
+entries_clear(cdentries_t *e)
+{
+  tor_free(e->lo);
+  tor_free(e->ids);
+}
+
+/** Return a newly allocated diff that turns the consensus <b>base</b> into
+ * the consensus <b>target</b>, or NULL if we can't express one. */
+char *
+consdiff_gen_diff(const char *base, const char *target)
+{
+  cdline_t *a = NULL, *b = NULL;
+  int na, nb, i, j, k;
+  cdentries_t ea, eb;
+  cdhunks_t hunks;
+  char d_base[DIGEST256_LEN], d_target[DIGEST256_LEN];
+  char hex_base[HEX_DIGEST256_LEN+1], hex_target[HEX_DIGEST256_LEN+1];
+  smartlist_t *chunks = NULL;
+  char *result = NULL;
+
+  memset(&ea, 0, sizeof(ea));
+  memset(&eb, 0, sizeof(eb));
+  memset(&hunks, 0, sizeof(hunks));
+
+  if ((na = split_lines(base, &a)) < 0 || (nb = split_lines(target, &b)) < 0)
+    goto done;
+  if (find_entries(a, na, &ea) < 0 || find_entries(b, nb, &eb) < 0)
+    goto done;
+
+  /* Header: everything before the first entry. */
+  diff_range(a, 0, ea.lo[0], b, 0, eb.lo[0], &hunks);
+
+  /* Entries: merge the two sorted lists by identity. */
+  i = j = 0;
+  while (i < ea.n || j < eb.n) {
+    int c;
+    if (i == ea.n)
+      c = 1;
+    else if (j == eb.n)
+      c = -1;
+    else
+      c = tor_memcmp(ea.ids + DIGEST_LEN*i, eb.ids + DIGEST_LEN*j,
+                     DIGEST_LEN);
+    if (c < 0) {
+      hunks_add(&hunks, ea.lo[i], ea.lo[i+1], eb.lo[j], eb.lo[j]);
+      ++i;
+    } else if (c > 0) {
+      hunks_add(&hunks, ea.lo[i], ea.lo[i], eb.lo[j], eb.lo[j+1]);
+      ++j;
+    } else {
+      diff_range(a, ea.lo[i], ea.lo[i+1], b, eb.lo[j], eb.lo[j+1], &hunks);
+      ++i;
+      ++j;
+    }
+  }
+
+  /* Footer: everything after the last entry. */
+  diff_range(a, ea.lo[ea.n], na, b, eb.lo[eb.n], nb, &hunks);
+
+  consdiff_get_digest(d_base, base);
+  consdiff_get_digest(d_target, target);
+  base16_encode(hex_base, sizeof(hex_base), d_base, DIGEST256_LEN);
+  base16_encode(hex_target, sizeof(hex_target), d_target, DIGEST256_LEN);
+
+  chunks = smartlist_new();
+  smartlist_add_asprintf(chunks, "%s\nhash %s %s\n",
+                         CONSDIFF_VERSION_LINE, hex_base, hex_target);
+  for (k = hunks.n - 1; k >= 0; --k) {
+    const cdhunk_t *h = &hunks.h[k];
+    char cmd;
+    if (h->new_lo == h->new_hi)
+      cmd = 'd';
+    else if (h->old_lo == h->old_hi)
+      cmd = 'a';
+    else
+      cmd = 'c';
+
+    if (cmd == 'a')
+      smartlist_add_asprintf(chunks, "%da\n", h->old_lo);
+    else if (h->old_hi == h->old_lo + 1)
+      smartlist_add_asprintf(chunks, "%d%c\n", h->old_hi, cmd);
+    else
+      smartlist_add_asprintf(chunks, "%d,%d%c\n",
+                             h->old_lo + 1, h->old_hi, cmd);
+    if (cmd == 'd')
+      continue;
+    for (i = h->new_lo; i < h->new_hi; ++i) {
+      if (b[i].len == 1 && b[i].s[0] == '.') {
+        /* We'd need escaping to insert this line; don't bother. */
+        log_info(LD_DIR, "Can't generate a diff for a consensus containing "
+                 "a line with only a period.");
+        goto done;
+      }
+      smartlist_add(chunks, tor_strndup(b[i].s, b[i].len + 1));
+    }
+    smartlist_add(chunks, tor_strdup(".\n"));
+  }
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+
+ done:
+  if (chunks) {
+    SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+    smartlist_free(chunks);
+  }
+  tor_free(hunks.h);
+  entries_clear(&ea);
+  entries_clear(&eb);
+  tor_free(a);
+  tor_free(b);
+  return result;
+}
+
+/** Parse a decimal line number from the start of *<b>cp</b> (which must
+ * stop before <b>eol</b>), advancing *<b>cp</b> past it.  Return the number,
+ * or -1 if there is none or it's absurdly large. */
+static int
+parse_line_number(const char **cp, const char *eol)
+{
+  int v = 0;
+  if (*cp >= eol || !TOR_ISDIGIT(**cp))
+    return -1;
+  while (*cp < eol && TOR_ISDIGIT(**cp)) {
+    if (v > INT_MAX / 10 - 1)
+      return -1;
+    v = v*10 + (**cp - '0');
+    ++*cp;
+  }
+  return v;
+}
+
+/** An ed command from a diff, in terms of the base document: replace base
+ * lines [lo, hi) with diff lines [text_lo, text_hi). */
+typedef struct cdcommand_t {
+  int lo, hi;
+  int text_lo, text_hi;
+} cdcommand_t;
+
+/** Apply the consensus diff <b>diff</b> to the document <b>base</b>, and
+ * return the resulting document as a newly allocated string.  Return NULL
+ * if the diff is malformed, if it wasn't made from <b>base</b>, or if the
+ * result isn't the document the diff promised. */
+char *
+consdiff_apply_diff(const char *base, const char *diff)
+{
+  cdline_t *a = NULL, *d = NULL;
+  int na, nd, k, n_cmds = 0, prev_lo, pos;
+  cdcommand_t *cmds = NULL;
+  char want_base[DIGEST256_LEN], want_target[DIGEST256_LEN];
+  char digest[DIGEST256_LEN];
+  size_t total = 0;
+  char *result = NULL, *out;
+
+  if ((na = split_lines(base, &a)) < 0 || (nd = split_lines(diff, &d)) < 0) {
+    log_info(LD_DIR, "Consensus or diff doesn't end with a newline.");
+    goto err;
+  }
+  if (nd < 2 || !line_startswith(&d[0], CONSDIFF_VERSION_LINE) ||
+      d[0].len != strlen(CONSDIFF_VERSION_LINE)) {
+    log_info(LD_DIR, "Unrecognized consensus diff version.");
+    goto err;
+  }
+  if (d[1].len != 5 + 2*HEX_DIGEST256_LEN + 1 ||
+      !line_startswith(&d[1], "hash ") ||
+      d[1].s[5+HEX_DIGEST256_LEN] != ' ' ||
+      base16_decode(want_base, DIGEST256_LEN, d[1].s+5,
+                    HEX_DIGEST256_LEN) < 0 ||
+      base16_decode(want_target, DIGEST256_LEN, d[1].s+6+HEX_DIGEST256_LEN,
+                    HEX_DIGEST256_LEN) < 0) {
+    log_info(LD_DIR, "Malformed hash line in consensus diff.");
+    goto err;
+  }
+  consdiff_get_digest(digest, base);
+  if (tor_memneq(digest, want_base, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Consensus diff was not made from the consensus we "
+             "have.");
+    goto err;
+  }
+
+  cmds = tor_malloc(sizeof(cdcommand_t)*nd);
+  prev_lo = na;
+  k = 2;
+  while (k < nd) {
+    const char *cp = d[k].s, *eol = d[k].s + d[k].len;
+    int n1, n2;
+    cdcommand_t *c = &cmds[n_cmds];
+    if ((n1 = parse_line_number(&cp, eol)) < 0)
+      goto malformed;
+    n2 = n1;
+    if (cp < eol && *cp == ',') {
+      ++cp;
+      if ((n2 = parse_line_number(&cp, eol)) < 0 || n2 < n1)
+        goto malformed;
+    }
+    if (cp + 1 != eol)
+      goto malformed;
+    switch (*cp) {
+      case 'a':
+        if (n2 != n1)
+          goto malformed;
+        c->lo = c->hi = n1;
+        break;
+      case 'c':
+      case 'd':
+        if (n1 < 1)
+          goto malformed;
+        c->lo = n1 - 1;
+        c->hi = n2;
+        break;
+      default:
+        goto malformed;
+    }
+    /* Commands must run bottom to top, and stay inside the document. */
+    if (c->hi > prev_lo)
+      goto malformed;
+    prev_lo = c->lo;
+    ++k;
+    c->text_lo = c->text_hi = k;
+    if (*cp != 'd') {
+      while (k < nd && !(d[k].len == 1 && d[k].s[0] == '.'))
+        ++k;
+      if (k == nd)
+        goto malformed;
+      c->text_hi = k++;
+    }
+    ++n_cmds;
+  }
+
+  /* Work out how big the result is, then build it top to bottom. */
+  pos = 0;
+  for (k = n_cmds - 1; k >= -1; --k) {
+    int lo = k >= 0 ? cmds[k].lo : na, i;
+    for (i = pos; i < lo; ++i)
+      total += a[i].len + 1;
+    if (k < 0)
+      break;
+    for (i = cmds[k].text_lo; i < cmds[k].text_hi; ++i)
+      total += d[i].len + 1;
+    pos = cmds[k].hi;
+  }
+  out = result = tor_malloc(total + 1);
+  pos = 0;
+  for (k = n_cmds - 1; k >= -1; --k) {
+    int lo = k >= 0 ? cmds[k].lo : na, i;
+    for (i = pos; i < lo; ++i) {
+      memcpy(out, a[i].s, a[i].len + 1);
+      out += a[i].len + 1;
+    }
+    if (k < 0)
+      break;
+    for (i = cmds[k].text_lo; i < cmds[k].text_hi; ++i) {
+      memcpy(out, d[i].s, d[i].len + 1);
+      out += d[i].len + 1;
+    }
+    pos = cmds[k].hi;
+  }
+  *out = '\0';
+  tor_assert(out == result + total);
+
+  consdiff_get_digest(digest, result);
+  if (tor_memneq(digest, want_target, DIGEST256_LEN)) {
+    log_info(LD_DIR, "Applying a consensus diff didn't give the consensus "
+             "it promised.");
+    tor_free(result);
+  }
+  goto done;
+
+ malformed:
+  log_info(LD_DIR, "Malformed command on line %d of consensus diff.", k+1);
+ err:
+  tor_free(result);
+ done:
+  tor_free(cmds);
+  tor_free(a);
+  tor_free(d);
+  return result;
+}
+
@@ -0,0 +1,21 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file consdiff.h
+ * \brief Header file for consdiff.c.
+ **/
+
+#ifndef _TOR_CONSDIFF_H
+#define _TOR_CONSDIFF_H
+
+/** First line of every consensus diff we generate or accept. */
+#define CONSDIFF_VERSION_LINE "network-status-diff-version 1"
+
+int consdiff_looks_like_diff(const char *s);
+void consdiff_get_digest(char *digest_out, const char *doc);
+char *consdiff_gen_diff(const char *base, const char *target);
+char *consdiff_apply_diff(const char *base, const char *diff);
+
+#endif
+
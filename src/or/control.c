@@ -22,6 +22,7 @@
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
+#include "dns.h"
 #include "dnsserv.h"
 #include "geoip.h"
 #include "hibernate.h"
@@ -30,6 +31,8 @@
 #include "nodelist.h"
 #include "policies.h"
 #include "reasons.h"
+#include "relay.h"
+#include "rendcommon.h"
 #include "rephist.h"
 #include "router.h"
 #include "routerlist.h"
@@ -42,6 +45,12 @@
 
 #include "procmon.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 /** Yield true iff <b>s</b> is the state of a control_connection_t that has
  * finished authentication and is accepting commands. */
 #define STATE_IS_OPEN(s) ((s) == CONTROL_CONN_STATE_OPEN)
@@ -76,7 +85,8 @@
 #define EVENT_BUILDTIMEOUT_SET     0x0017
 #define EVENT_SIGNAL           0x0018
 #define EVENT_CONF_CHANGED     0x0019
-#define _EVENT_MAX             0x0019
+#define EVENT_ONION_PIPELINE   0x001A
+#define _EVENT_MAX             0x001A
 /* If _EVENT_MAX ever hits 0x0020, we need to make the mask wider. */
 
 /** Bitfield: The bit 1&lt;&lt;e is set if <b>any</b> open control
@@ -90,6 +100,12 @@ typedef uint32_t event_mask_t;
 /** An event mask of all the events that any controller is interested in
  * receiving. */
 static event_mask_t global_event_mask = 0;
+/** Bitfield: The bitwise OR of the event masks of the live control
+ * connections that have asked for COMPACT_EVENTS. */
+static event_mask_t global_compact_event_mask = 0;
+/** Bitfield: The bitwise OR of the event masks of the other live control
+ * connections. */
+static event_mask_t global_text_event_mask = 0;
 
 /** True iff we have disabled log messages from being sent to the controller */
 static int disable_log_messages = 0;
@@ -98,6 +114,65 @@ static int disable_log_messages = 0;
  * <b>e</b>. */
 #define EVENT_IS_INTERESTING(e) \
   (global_event_mask & (1<<(e)))
+/** Macro: true if any control connection that hasn't asked for
+ * COMPACT_EVENTS is interested in events of type <b>e</b>. */
+#define EVENT_IS_INTERESTING_TEXT(e) \
+  (global_text_event_mask & (1<<(e)))
+/** Macro: true if any control connection that has asked for
+ * COMPACT_EVENTS is interested in events of type <b>e</b>. */
+#define EVENT_IS_INTERESTING_COMPACT(e) \
+  (global_compact_event_mask & (1<<(e)))
+
+/** Flag for event_format_t.  Indicates that we should use the one standard
+    format.
+ */
+#define ALL_FORMATS 1
+/** Flag for event_format_t.  Indicates that the event is in the regular text
+ * format, for controllers that haven't asked for COMPACT_EVENTS. */
+#define TEXT_FORMAT 2
+/** Flag for event_format_t.  Indicates that the event is in the compact
+ * format, for controllers that have asked for COMPACT_EVENTS. */
+#define COMPACT_FORMAT 4
+
+/** Bit field of flags to select how to format a controller event.  Recognized
+ * flags are ALL_FORMATS, TEXT_FORMAT, and COMPACT_FORMAT. */
+typedef int event_format_t;
+
+/** Events that we may drop for a controller that can't keep up with them,
+ * or that has used up its ControlEventRateLimit: the high-volume ones,
+ * which a controller can miss a few of without losing track of state. */
+#define DROPPABLE_EVENTS ((1<<EVENT_BANDWIDTH_USED) |               \
+                          (1<<EVENT_CIRCUIT_STATUS_MINOR) |          \
+                          (1<<EVENT_DEBUG_MSG) |                     \
+                          (1<<EVENT_INFO_MSG) |                      \
+                          (1<<EVENT_NOTICE_MSG) |                    \
+                          (1<<EVENT_STREAM_BANDWIDTH_USED) |         \
+                          (1<<EVENT_ONION_PIPELINE))
+
+/** An event that we have formatted, but not yet sent to the controllers. */
+typedef struct queued_event_t {
+  uint16_t event; /**< Which type of event this is. */
+  /** True iff we should flush this event to controllers right away. */
+  unsigned int flush : 1;
+  char *msg; /**< The formatted event. */
+  /** The global_identifier of each controller that wanted this event when
+   * we generated it.  We send it to these controllers only, so that none
+   * gets an event from before it subscribed. */
+  uint64_t *conn_ids;
+  int n_conn_ids; /**< How many entries are in conn_ids? */
+} queued_event_t;
+
+/** List of queued_event_t, in the order we generated them, that we'll send
+ * on the next call to queued_events_flush_all(). */
+static smartlist_t *queued_control_events = NULL;
+/** Event that runs queued_events_flush_all() once we're back in the main
+ * loop. */
+static struct event *flush_queued_events_event = NULL;
+
+/** List of the AP edge_connection_t whose n_read or n_written have grown
+ * since the last control_event_stream_bandwidth_used(), so that we don't
+ * have to look at every connection once a second. */
+static smartlist_t *stream_bw_dirty_conns = NULL;
 
 /** If we're using cookie-type authentication, how long should our cookies be?
  */
@@ -124,15 +199,6 @@ static char authentication_cookie[AUTHENTICATION_COOKIE_LEN];
  * of this so we can respond to getinfo status/bootstrap-phase queries. */
 static char last_sent_bootstrap_message[BOOTSTRAP_MSG_LEN];
 
-/** Flag for event_format_t.  Indicates that we should use the one standard
-    format.
- */
-#define ALL_FORMATS 1
-
-/** Bit field of flags to select how to format a controller event.  Recognized
- * flag is ALL_FORMATS. */
-typedef int event_format_t;
-
 static void connection_printf_to_buf(control_connection_t *conn,
                                      const char *format, ...)
   CHECK_PRINTF(2,3);
@@ -144,6 +210,8 @@ static int control_event_status(int type, int severity, const char *format,
   CHECK_PRINTF(3,0);
 
 static void send_control_done(control_connection_t *conn);
+static void connection_control_add_spool_to_outbuf(
+                                       control_connection_t *conn);
 static void send_control_event(uint16_t event, event_format_t which,
                                const char *format, ...)
   CHECK_PRINTF(3,4);
@@ -236,12 +304,17 @@ control_update_global_event_mask(void)
   old_mask = global_event_mask;
 
   global_event_mask = 0;
+  global_compact_event_mask = global_text_event_mask = 0;
   SMARTLIST_FOREACH(conns, connection_t *, _conn,
   {
     if (_conn->type == CONN_TYPE_CONTROL &&
         STATE_IS_OPEN(_conn->state)) {
       control_connection_t *conn = TO_CONTROL_CONN(_conn);
       global_event_mask |= conn->event_mask;
+      if (conn->use_compact_events)
+        global_compact_event_mask |= conn->event_mask;
+      else
+        global_text_event_mask |= conn->event_mask;
     }
   });
 
@@ -311,6 +384,16 @@ control_event_is_interesting(int event)
   return EVENT_IS_INTERESTING(event);
 }
 
+/** Return true iff any control connection wants one of the events we send
+ * once a second from second_elapsed_callback(). */
+int
+control_event_wants_per_second_events(void)
+{
+  return EVENT_IS_INTERESTING(EVENT_BANDWIDTH_USED) ||
+         EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED) ||
+         EVENT_IS_INTERESTING(EVENT_ONION_PIPELINE);
+}
+
 /** Append a NUL-terminated string <b>s</b> to the end of
  * <b>conn</b>-\>outbuf.
  */
@@ -576,46 +659,241 @@ send_control_done(control_connection_t *conn)
   connection_write_str_to_buf("250 OK\r\n", conn);
 }
 
+/** Release all storage held by the queued event <b>ev</b>. */
+static void
+queued_event_free(queued_event_t *ev)
+{
+  if (!ev)
+    return;
+  tor_free(ev->msg);
+  tor_free(ev->conn_ids);
+  tor_free(ev);
+}
+
+/** Return true iff <b>conn</b> wanted <b>ev</b> when we generated it. */
+static INLINE int
+queued_event_is_for(const queued_event_t *ev,
+                    const control_connection_t *conn)
+{
+  int i;
+  for (i = 0; i < ev->n_conn_ids; ++i) {
+    if (ev->conn_ids[i] == TO_CONN(conn)->global_identifier)
+      return 1;
+  }
+  return 0;
+}
+
+/** Release all storage held by the control-event queue. */
+void
+control_free_all(void)
+{
+  if (queued_control_events) {
+    SMARTLIST_FOREACH(queued_control_events, queued_event_t *, ev,
+                      queued_event_free(ev));
+    smartlist_free(queued_control_events);
+    queued_control_events = NULL;
+  }
+  smartlist_free(stream_bw_dirty_conns);
+  stream_bw_dirty_conns = NULL;
+  if (flush_queued_events_event) {
+    tor_event_free(flush_queued_events_event);
+    flush_queued_events_event = NULL;
+  }
+}
+
+/** Send every queued event to each open controller that listens for it,
+ * with one write per controller.  Drop droppable events for controllers
+ * whose outbuf is over ControlEventMaxBacklog or that have used up this
+ * second's ControlEventRateLimit, and tell them how many we dropped once
+ * they've caught up.  Hold back the events for controllers that we're
+ * spooling a GETINFO answer onto. */
+static void
+queued_events_flush_all(void)
+{
+  smartlist_t *queued = queued_control_events;
+  smartlist_t *chunks;
+  const or_options_t *options = get_options();
+  time_t now = approx_time();
+
+  if (!queued || !smartlist_len(queued))
+    return;
+  /* Anything we log while flushing goes in the next batch. */
+  queued_control_events = smartlist_new();
+  chunks = smartlist_new();
+
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    control_connection_t *control_conn;
+    char report[64];
+    int behind, flush = 0;
+    size_t len;
+    if (conn->type != CONN_TYPE_CONTROL ||
+        conn->marked_for_close ||
+        conn->state != CONTROL_CONN_STATE_OPEN)
+      continue;
+    control_conn = TO_CONTROL_CONN(conn);
+
+    /* A controller that's being spooled a GETINFO answer counts as
+     * behind. */
+    behind = control_conn->getinfo_spool ||
+      (options->ControlEventMaxBacklog &&
+       connection_get_outbuf_len(conn) > options->ControlEventMaxBacklog);
+    if (control_conn->event_bucket_second != now) {
+      control_conn->event_bucket_second = now;
+      control_conn->event_bucket = options->ControlEventRateLimit;
+      if (control_conn->n_events_dropped && !behind) {
+        if (control_conn->event_mask & (1<<EVENT_STATUS_GENERAL)) {
+          tor_snprintf(report, sizeof(report),
+                       "650 STATUS_GENERAL NOTICE EVENTS_DROPPED COUNT=%u\r\n",
+                       (unsigned) control_conn->n_events_dropped);
+          smartlist_add(chunks, report);
+        }
+        control_conn->n_events_dropped = 0;
+      }
+    }
+
+    SMARTLIST_FOREACH_BEGIN(queued, queued_event_t *, ev) {
+      if (!queued_event_is_for(ev, control_conn))
+        continue;
+      if (DROPPABLE_EVENTS & (1<<ev->event)) {
+        if (behind ||
+            (options->ControlEventRateLimit && !control_conn->event_bucket)) {
+          ++control_conn->n_events_dropped;
+          continue;
+        }
+        if (control_conn->event_bucket)
+          --control_conn->event_bucket;
+      }
+      smartlist_add(chunks, ev->msg);
+      flush |= ev->flush;
+    } SMARTLIST_FOREACH_END(ev);
+
+    if (smartlist_len(chunks) && control_conn->getinfo_spool) {
+      if (!control_conn->held_events)
+        control_conn->held_events = smartlist_new();
+      smartlist_add(control_conn->held_events,
+                    smartlist_join_strings(chunks, "", 0, NULL));
+      smartlist_clear(chunks);
+      if (flush) {
+        /* Don't keep an error waiting for the controller to read the rest
+         * of a long answer: write the rest now, and the error after it. */
+        control_conn->held_events_urgent = 1;
+        connection_control_add_spool_to_outbuf(control_conn);
+      }
+    } else if (smartlist_len(chunks)) {
+      char *joined = smartlist_join_strings(chunks, "", 0, &len);
+      connection_write_to_buf(joined, len, conn);
+      tor_free(joined);
+      smartlist_clear(chunks);
+    }
+    if (flush)
+      connection_flush(conn);
+  } SMARTLIST_FOREACH_END(conn);
+
+  SMARTLIST_FOREACH(queued, queued_event_t *, ev, queued_event_free(ev));
+  smartlist_free(queued);
+  smartlist_free(chunks);
+}
+
+/** Send every event we've queued to the controllers that wanted it, and
+ * try to flush what we can to them.  Called when we're about to exit, so
+ * that controllers hear about whatever happened last. */
+void
+control_flush_event_queue(void)
+{
+  ++disable_log_messages;
+  queued_events_flush_all();
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type == CONN_TYPE_CONTROL &&
+        !conn->marked_for_close &&
+        SOCKET_OK(conn->s) &&
+        connection_get_outbuf_len(conn))
+      connection_flush(conn);
+  } SMARTLIST_FOREACH_END(conn);
+  --disable_log_messages;
+}
+
+/** Libevent callback: send all the events we've queued. */
+static void
+flush_queued_events_cb(evutil_socket_t fd, short what, void *arg)
+{
+  (void)fd;
+  (void)what;
+  (void)arg;
+  ++disable_log_messages;
+  queued_events_flush_all();
+  --disable_log_messages;
+}
+
 /** Send an event to all v1 controllers that are listening for code
  * <b>event</b>.  The event's body is given by <b>msg</b>.
  *
- * If <b>which</b> & SHORT_NAMES, the event contains short-format names: send
- * it to controllers that haven't enabled the VERBOSE_NAMES feature.  If
- * <b>which</b> & LONG_NAMES, the event contains long-format names: send it
- * to controllers that <em>have</em> enabled VERBOSE_NAMES.
+ * If <b>which</b> & ALL_FORMATS, send the event to every such controller.
+ * Otherwise, if <b>which</b> & TEXT_FORMAT, send it to the ones that haven't
+ * enabled the COMPACT_EVENTS feature, and if <b>which</b> & COMPACT_FORMAT,
+ * send it to the ones that <em>have</em> enabled COMPACT_EVENTS.
  *
- * The EXTENDED_FORMAT and NONEXTENDED_FORMAT flags behave similarly with
- * respect to the EXTENDED_EVENTS feature. */
+ * We don't send the event right away: we queue it, and send all the events
+ * we've queued together once we're back in the main loop, so that each
+ * controller gets one write per batch.  Error events go out at once, along
+ * with any events queued before them. */
 static void
 send_control_event_string(uint16_t event, event_format_t which,
                           const char *msg)
 {
+  queued_event_t *ev;
+  struct event_base *base = tor_libevent_get_base();
   smartlist_t *conns = get_connection_array();
-  (void)which;
+  int n = 0;
   tor_assert(event >= _EVENT_MIN && event <= _EVENT_MAX);
 
+  /* Decide now who gets this event, while their event masks are the ones
+   * that were in force when it happened. */
+  ev = tor_malloc_zero(sizeof(queued_event_t));
+  ev->conn_ids = tor_malloc(sizeof(uint64_t) *
+                            (smartlist_len(conns) ? smartlist_len(conns) : 1));
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_CONTROL &&
-        !conn->marked_for_close &&
-        conn->state == CONTROL_CONN_STATE_OPEN) {
-      control_connection_t *control_conn = TO_CONTROL_CONN(conn);
-
-      if (control_conn->event_mask & (1<<event)) {
-        int is_err = 0;
-        connection_write_to_buf(msg, strlen(msg), TO_CONN(control_conn));
-        if (event == EVENT_ERR_MSG)
-          is_err = 1;
-        else if (event == EVENT_STATUS_GENERAL)
-          is_err = !strcmpstart(msg, "STATUS_GENERAL ERR ");
-        else if (event == EVENT_STATUS_CLIENT)
-          is_err = !strcmpstart(msg, "STATUS_CLIENT ERR ");
-        else if (event == EVENT_STATUS_SERVER)
-          is_err = !strcmpstart(msg, "STATUS_SERVER ERR ");
-        if (is_err)
-          connection_flush(TO_CONN(control_conn));
-      }
-    }
+    control_connection_t *control_conn;
+    if (conn->type != CONN_TYPE_CONTROL ||
+        conn->marked_for_close ||
+        conn->state != CONTROL_CONN_STATE_OPEN)
+      continue;
+    control_conn = TO_CONTROL_CONN(conn);
+    if (!(control_conn->event_mask & (1<<event)))
+      continue;
+    if (!(which & ALL_FORMATS) &&
+        !(which & (control_conn->use_compact_events ?
+                   COMPACT_FORMAT : TEXT_FORMAT)))
+      continue;
+    ev->conn_ids[n++] = conn->global_identifier;
   } SMARTLIST_FOREACH_END(conn);
+  if (!n) {
+    queued_event_free(ev);
+    return;
+  }
+  ev->n_conn_ids = n;
+  ev->event = event;
+  ev->msg = tor_strdup(msg);
+  if (event == EVENT_ERR_MSG)
+    ev->flush = 1;
+  else if (event == EVENT_STATUS_GENERAL)
+    ev->flush = !strcmpstart(msg, "650 STATUS_GENERAL ERR ");
+  else if (event == EVENT_STATUS_CLIENT)
+    ev->flush = !strcmpstart(msg, "650 STATUS_CLIENT ERR ");
+  else if (event == EVENT_STATUS_SERVER)
+    ev->flush = !strcmpstart(msg, "650 STATUS_SERVER ERR ");
+
+  if (!queued_control_events)
+    queued_control_events = smartlist_new();
+  smartlist_add(queued_control_events, ev);
+
+  if (ev->flush || !base) {
+    queued_events_flush_all();
+    return;
+  }
+  if (!flush_queued_events_event)
+    flush_queued_events_event = tor_event_new(base, -1, 0,
+                                              flush_queued_events_cb, NULL);
+  event_active(flush_queued_events_event, EV_TIMEOUT, 1);
 }
 
 /** Helper for send_control_event and control_event_status:
@@ -635,7 +913,7 @@ send_control_event_impl(uint16_t event, event_format_t which,
     return;
   }
 
-  send_control_event_string(event, which|ALL_FORMATS, buf);
+  send_control_event_string(event, which, buf);
 
   tor_free(buf);
 }
@@ -953,6 +1231,7 @@ static const struct control_event_t control_event_table[] = {
   { EVENT_BUILDTIMEOUT_SET, "BUILDTIMEOUT_SET" },
   { EVENT_SIGNAL, "SIGNAL" },
   { EVENT_CONF_CHANGED, "CONF_CHANGED"},
+  { EVENT_ONION_PIPELINE, "ONION_PIPELINE" },
   { 0, NULL },
 };
 
@@ -1423,7 +1702,7 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
 
     smartlist_free(event_names);
   } else if (!strcmp(question, "features/names")) {
-    *answer = tor_strdup("VERBOSE_NAMES EXTENDED_EVENTS");
+    *answer = tor_strdup("VERBOSE_NAMES EXTENDED_EVENTS COMPACT_EVENTS");
   } else if (!strcmp(question, "address")) {
     uint32_t addr;
     if (router_pick_published_address(get_options(), &addr) < 0) {
@@ -1471,6 +1750,24 @@ getinfo_helper_misc(control_connection_t *conn, const char *question,
     tor_asprintf(answer, "%d", max_fds);
   } else if (!strcmp(question, "dir-usage")) {
     *answer = directory_dump_request_log();
+  } else if (!strcmp(question, "buffer-chunks")) {
+    *answer = buf_get_chunk_class_stats();
+  } else if (!strcmp(question, "memory/tagged")) {
+    smartlist_t *lines = smartlist_new();
+    int i;
+    for (i = 0; i < N_MEMTAGS; ++i) {
+      int64_t live_bytes, live_allocs;
+      uint64_t total_allocs;
+      memtag_get_usage(i, &live_bytes, &live_allocs, &total_allocs);
+      smartlist_add_asprintf(lines, "%s live-bytes="I64_FORMAT
+                             " live-allocs="I64_FORMAT" allocs="U64_FORMAT,
+                             memtag_get_name(i), I64_PRINTF_ARG(live_bytes),
+                             I64_PRINTF_ARG(live_allocs),
+                             U64_PRINTF_ARG(total_allocs));
+    }
+    *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
   } else if (!strcmp(question, "fingerprint")) {
     crypto_pk_t *server_key;
     if (!server_mode(get_options())) {
@@ -1745,7 +2042,7 @@ getinfo_helper_dir(control_connection_t *control_conn,
   } else if (!strcmp(question, "dir/status-vote/current/consensus")) { /* v3 */
     if (directory_caches_dir_info(get_options())) {
       const cached_dir_t *consensus = dirserv_get_consensus("ns");
-      if (consensus)
+      if (consensus && consensus->dir)
         *answer = tor_strdup(consensus->dir);
     }
     if (!*answer) { /* try loading it from disk */
@@ -2106,6 +2403,9 @@ static const getinfo_item_t getinfo_items[] = {
        "Time when the accounting period ends."),
   ITEM("accounting/interval-wake", accounting,
        "Time to wake up in this accounting period."),
+  ITEM("accounting/shaped-rate", accounting,
+       "Bytes per second we're limiting ourselves to under AccountingShaping, "
+       "or 0."),
   ITEM("helper-nodes", entry_guards, NULL), /* deprecated */
   ITEM("entry-guards", entry_guards,
        "Which nodes are we using as entry guards?"),
@@ -2148,6 +2448,8 @@ static const getinfo_item_t getinfo_items[] = {
   DOC("address-mappings/config",
       "Current address mappings from configuration."),
   DOC("address-mappings/control", "Current address mappings from controller."),
+  ITEM("status/startup-timeline", startup,
+       "How long each phase of startup took, in microseconds."),
   PREFIX("status/", events, NULL),
   DOC("status/circuit-established",
       "Whether we think client functionality is working."),
@@ -2174,6 +2476,10 @@ static const getinfo_item_t getinfo_items[] = {
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("dir-usage", misc, "Breakdown of bytes transferred over DirPort."),
+  ITEM("buffer-chunks", misc,
+       "Memory used by buffer chunks, by size class."),
+  ITEM("memory/tagged", misc,
+       "Heap memory in use by each subsystem that tags its allocations."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -2183,6 +2489,30 @@ static const getinfo_item_t getinfo_items[] = {
   ITEM("exit-policy/default", policies,
        "The default value appended to the configured exit policy."),
   PREFIX("ip-to-country/", geoip, "Perform a GEOIP lookup"),
+  ITEM("cell-latency/queue-delay", cell_latency,
+       "Histogram of how long cells have waited in circuit queues."),
+  ITEM("cell-latency/processing", cell_latency,
+       "Histograms of how long processing each relay command has taken."),
+  PREFIX("cell-latency/circuit/", cell_latency,
+       "Histogram of how long cells have waited in a circuit's queues."),
+  ITEM("onion-pipeline/last-second", onion_pipeline,
+       "Onionskin queue and cpuworker statistics for the last second."),
+  ITEM("onion-pipeline/totals", onion_pipeline,
+       "Onionskin queue and cpuworker statistics since we started."),
+  ITEM("main-loop/callbacks", main_loop,
+       "Histograms of how long each kind of main-loop callback has taken."),
+  ITEM("main-loop/conn-callbacks", main_loop,
+       "Histograms of how long connection callbacks have taken, by type."),
+  ITEM("main-loop/stalls", main_loop,
+       "How often each callback has exceeded MainLoopStallThreshold."),
+  ITEM("dns/cache", dns, "Exit DNS cache size and hit counts."),
+  ITEM("dns/resolves", dns,
+       "How many exit DNS resolves we've launched, and how they went."),
+  ITEM("dns/latency", dns, "Histogram of how long exit DNS resolves take."),
+  ITEM("dns/nameservers", dns, "State and counters for each nameserver."),
+  ITEM("hs-dir/cache", rend_cache,
+       "Size, memory use and hit counts of our hidden service directory "
+       "cache."),
   { NULL, NULL, NULL, 0 }
 };
 
@@ -2238,6 +2568,117 @@ handle_getinfo_helper(control_connection_t *control_conn,
   return 0; /* unrecognized */
 }
 
+/** Stop spooling a GETINFO answer onto a control connection while its
+ * outbuf holds at least this many bytes. */
+#define CONTROL_SPOOL_BUFFER_MIN 16384
+
+/** Value for control_connection_t.getinfo_spool_src: we're spooling
+ * ns/all, and the spool holds router identity digests. */
+#define CONTROL_SPOOL_NS 1
+/** Value for control_connection_t.getinfo_spool_src: we're spooling
+ * desc/all-recent, and the spool holds descriptor digests. */
+#define CONTROL_SPOOL_DESC 2
+
+/** Write the <b>len</b> bytes of complete lines in <b>data</b> to
+ * <b>conn</b>, escaped as part of the data reply we're spooling. */
+static void
+connection_write_spooled_lines(control_connection_t *conn,
+                               const char *data, size_t len)
+{
+  char *esc = NULL;
+  size_t esc_len = write_escaped_data(data, len, &esc);
+  /* Leave off the ".\r\n": we send that once the spool is empty. */
+  connection_write_to_buf(esc, esc_len-3, TO_CONN(conn));
+  tor_free(esc);
+}
+
+/** Write entries from the GETINFO spool on <b>conn</b> until its outbuf
+ * holds CONTROL_SPOOL_BUFFER_MIN bytes or the spool runs out; or, if we're
+ * holding an error event for <b>conn</b>, until the spool runs out.  If the
+ * spool runs out, end the reply, free the spool, and write the events we
+ * held. */
+static void
+connection_control_add_spool_to_outbuf(control_connection_t *conn)
+{
+  while (smartlist_len(conn->getinfo_spool) &&
+         (conn->held_events_urgent ||
+          connection_get_outbuf_len(TO_CONN(conn)) <
+            CONTROL_SPOOL_BUFFER_MIN)) {
+    char *digest = smartlist_pop_last(conn->getinfo_spool);
+    if (conn->getinfo_spool_src == CONTROL_SPOOL_NS) {
+      const routerstatus_t *rs = router_get_consensus_status_by_id(digest);
+      if (rs) {
+        char *s = networkstatus_getinfo_helper_single(rs);
+        connection_write_spooled_lines(conn, s, strlen(s));
+        tor_free(s);
+      }
+    } else {
+      const signed_descriptor_t *sd = router_get_by_descriptor_digest(digest);
+      const char *body = sd ? signed_descriptor_get_body(sd) : NULL;
+      if (body)
+        connection_write_spooled_lines(conn, body, sd->signed_descriptor_len);
+    }
+    tor_free(digest);
+  }
+
+  if (!smartlist_len(conn->getinfo_spool)) {
+    smartlist_free(conn->getinfo_spool);
+    conn->getinfo_spool = NULL;
+    connection_write_str_to_buf(".\r\n250 OK\r\n", conn);
+    if (conn->held_events) {
+      SMARTLIST_FOREACH(conn->held_events, char *, cp, {
+          connection_write_str_to_buf(cp, conn);
+          tor_free(cp);
+        });
+      smartlist_free(conn->held_events);
+      conn->held_events = NULL;
+    }
+    conn->held_events_urgent = 0;
+  }
+}
+
+/** If <b>question</b> is a GETINFO key whose answer can be large enough
+ * that we'd rather not build it all in memory, start spooling its answer
+ * onto <b>conn</b> and return 1.  Otherwise return 0. */
+static int
+control_getinfo_spool_start(control_connection_t *conn, const char *question)
+{
+  smartlist_t *spool;
+  if (!strcmp(question, "ns/all")) {
+    networkstatus_t *ns = networkstatus_get_latest_consensus();
+    if (!ns)
+      return 0;
+    spool = smartlist_new();
+    SMARTLIST_FOREACH(ns->routerstatus_list, const routerstatus_t *, rs,
+        smartlist_add(spool, tor_memdup(rs->identity_digest, DIGEST_LEN)));
+    conn->getinfo_spool_src = CONTROL_SPOOL_NS;
+  } else if (!strcmp(question, "desc/all-recent")) {
+    routerlist_t *routerlist = router_get_routerlist();
+    if (!routerlist || !routerlist->routers)
+      return 0;
+    spool = smartlist_new();
+    SMARTLIST_FOREACH(routerlist->routers, const routerinfo_t *, ri,
+        smartlist_add(spool,
+                      tor_memdup(ri->cache_info.signed_descriptor_digest,
+                                 DIGEST_LEN)));
+    conn->getinfo_spool_src = CONTROL_SPOOL_DESC;
+  } else {
+    return 0;
+  }
+
+  if (!smartlist_len(spool)) {
+    /* Let the regular code send the empty answer. */
+    smartlist_free(spool);
+    return 0;
+  }
+  /* We pop entries off the end, so reverse them to keep the usual order. */
+  smartlist_reverse(spool);
+  conn->getinfo_spool = spool;
+  connection_printf_to_buf(conn, "250+%s=\r\n", question);
+  connection_control_add_spool_to_outbuf(conn);
+  return 1;
+}
+
 /** Called when we receive a GETINFO command.  Try to fetch all requested
  * information, and reply with information or error message. */
 static int
@@ -2253,6 +2694,9 @@ handle_control_getinfo(control_connection_t *conn, uint32_t len,
 
   smartlist_split_string(questions, body, " ",
                          SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 0);
+  if (smartlist_len(questions) == 1 &&
+      control_getinfo_spool_start(conn, smartlist_get(questions, 0)))
+    goto done;
   SMARTLIST_FOREACH_BEGIN(questions, const char *, q) {
     const char *errmsg = NULL;
     if (handle_getinfo_helper(conn, q, &ans, &errmsg) < 0) {
@@ -3105,6 +3549,8 @@ handle_control_usefeature(control_connection_t *conn,
         ;
       else if (!strcasecmp(arg, "EXTENDED_EVENTS"))
         ;
+      else if (!strcasecmp(arg, "COMPACT_EVENTS"))
+        conn->use_compact_events = 1;
       else {
         connection_printf_to_buf(conn, "552 Unrecognized feature \"%s\"\r\n",
                                  arg);
@@ -3116,6 +3562,7 @@ handle_control_usefeature(control_connection_t *conn,
   if (!bad) {
     send_control_done(conn);
   }
+  control_update_global_event_mask();
 
   SMARTLIST_FOREACH(args, char *, cp, tor_free(cp));
   smartlist_free(args);
@@ -3127,6 +3574,22 @@ int
 connection_control_finished_flushing(control_connection_t *conn)
 {
   tor_assert(conn);
+  /* Handle any commands that arrived while we were spooling a GETINFO
+   * answer. */
+  if (!conn->getinfo_spool && !TO_CONN(conn)->marked_for_close &&
+      connection_get_inbuf_len(TO_CONN(conn)))
+    return connection_control_process_inbuf(conn);
+  return 0;
+}
+
+/** Called when we've flushed some of <b>conn</b>'s outbuf: if we're
+ * spooling a GETINFO answer onto it, add more. */
+int
+connection_control_flushed_some(control_connection_t *conn)
+{
+  if (conn->getinfo_spool &&
+      connection_get_outbuf_len(TO_CONN(conn)) < CONTROL_SPOOL_BUFFER_MIN)
+    connection_control_add_spool_to_outbuf(conn);
   return 0;
 }
 
@@ -3256,6 +3719,9 @@ connection_control_process_inbuf(control_connection_t *conn)
   }
 
  again:
+  /* Don't answer anything else until we're done spooling. */
+  if (conn->getinfo_spool)
+    return 0;
   while (1) {
     size_t last_idx;
     int r;
@@ -3471,10 +3937,10 @@ control_event_circuit_status(origin_circuit_t *circ, circuit_status_event_t tp,
     }
   }
 
-  {
+  if (EVENT_IS_INTERESTING_TEXT(EVENT_CIRCUIT_STATUS)) {
     char *circdesc = circuit_describe_status_for_controller(circ);
     const char *sp = strlen(circdesc) ? " " : "";
-    send_control_event(EVENT_CIRCUIT_STATUS, ALL_FORMATS,
+    send_control_event(EVENT_CIRCUIT_STATUS, TEXT_FORMAT,
                                 "650 CIRC %lu %s%s%s%s\r\n",
                                 (unsigned long)circ->global_identifier,
                                 status, sp,
@@ -3482,6 +3948,12 @@ control_event_circuit_status(origin_circuit_t *circ, circuit_status_event_t tp,
                                 reasons);
     tor_free(circdesc);
   }
+  /* Compact controllers ask for the path with GETINFO if they want it. */
+  if (EVENT_IS_INTERESTING_COMPACT(EVENT_CIRCUIT_STATUS))
+    send_control_event(EVENT_CIRCUIT_STATUS, COMPACT_FORMAT,
+                       "650 CIRC %lu %s%s\r\n",
+                       (unsigned long)circ->global_identifier,
+                       status, reasons);
 
   return 0;
 }
@@ -3542,10 +4014,10 @@ control_event_circuit_status_minor(origin_circuit_t *circ,
       return 0;
     }
 
-  {
+  if (EVENT_IS_INTERESTING_TEXT(EVENT_CIRCUIT_STATUS_MINOR)) {
     char *circdesc = circuit_describe_status_for_controller(circ);
     const char *sp = strlen(circdesc) ? " " : "";
-    send_control_event(EVENT_CIRCUIT_STATUS_MINOR, ALL_FORMATS,
+    send_control_event(EVENT_CIRCUIT_STATUS_MINOR, TEXT_FORMAT,
                        "650 CIRC_MINOR %lu %s%s%s%s\r\n",
                        (unsigned long)circ->global_identifier,
                        event_desc, sp,
@@ -3553,6 +4025,11 @@ control_event_circuit_status_minor(origin_circuit_t *circ,
                        event_tail);
     tor_free(circdesc);
   }
+  if (EVENT_IS_INTERESTING_COMPACT(EVENT_CIRCUIT_STATUS_MINOR))
+    send_control_event(EVENT_CIRCUIT_STATUS_MINOR, COMPACT_FORMAT,
+                       "650 CIRC_MINOR %lu %s%s\r\n",
+                       (unsigned long)circ->global_identifier,
+                       event_desc, event_tail);
 
   return 0;
 }
@@ -3711,13 +4188,22 @@ control_event_stream_status(entry_connection_t *conn, stream_status_event_t tp,
   circ = circuit_get_by_edge_conn(ENTRY_TO_EDGE_CONN(conn));
   if (circ && CIRCUIT_IS_ORIGIN(circ))
     origin_circ = TO_ORIGIN_CIRCUIT(circ);
-  send_control_event(EVENT_STREAM_STATUS, ALL_FORMATS,
+  if (EVENT_IS_INTERESTING_TEXT(EVENT_STREAM_STATUS))
+    send_control_event(EVENT_STREAM_STATUS, TEXT_FORMAT,
                         "650 STREAM "U64_FORMAT" %s %lu %s%s%s%s\r\n",
                      U64_PRINTF_ARG(ENTRY_TO_CONN(conn)->global_identifier),
                      status,
                         origin_circ?
                            (unsigned long)origin_circ->global_identifier : 0ul,
                         buf, reason_buf, addrport_buf, purpose);
+  if (EVENT_IS_INTERESTING_COMPACT(EVENT_STREAM_STATUS))
+    send_control_event(EVENT_STREAM_STATUS, COMPACT_FORMAT,
+                       "650 STREAM "U64_FORMAT" %s %lu %s%s\r\n",
+                       U64_PRINTF_ARG(ENTRY_TO_CONN(conn)->global_identifier),
+                       status,
+                       origin_circ?
+                         (unsigned long)origin_circ->global_identifier : 0ul,
+                       buf, reason_buf);
 
   /* XXX need to specify its intended exit, etc? */
 
@@ -3800,11 +4286,18 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
     if (!edge_conn->n_read && !edge_conn->n_written)
       return 0;
 
-    send_control_event(EVENT_STREAM_BANDWIDTH_USED, ALL_FORMATS,
-                       "650 STREAM_BW "U64_FORMAT" %lu %lu\r\n",
-                       U64_PRINTF_ARG(edge_conn->_base.global_identifier),
-                       (unsigned long)edge_conn->n_read,
-                       (unsigned long)edge_conn->n_written);
+    if (EVENT_IS_INTERESTING_TEXT(EVENT_STREAM_BANDWIDTH_USED))
+      send_control_event(EVENT_STREAM_BANDWIDTH_USED, TEXT_FORMAT,
+                         "650 STREAM_BW "U64_FORMAT" %lu %lu\r\n",
+                         U64_PRINTF_ARG(edge_conn->_base.global_identifier),
+                         (unsigned long)edge_conn->n_read,
+                         (unsigned long)edge_conn->n_written);
+    if (EVENT_IS_INTERESTING_COMPACT(EVENT_STREAM_BANDWIDTH_USED))
+      send_control_event(EVENT_STREAM_BANDWIDTH_USED, COMPACT_FORMAT,
+                         "650 STREAM_BW "U64_FORMAT",%lu,%lu\r\n",
+                         U64_PRINTF_ARG(edge_conn->_base.global_identifier),
+                         (unsigned long)edge_conn->n_read,
+                         (unsigned long)edge_conn->n_written);
 
     edge_conn->n_written = edge_conn->n_read = 0;
   }
@@ -3812,32 +4305,77 @@ control_event_stream_bandwidth(edge_connection_t *edge_conn)
   return 0;
 }
 
+/** Called when <b>edge_conn</b>, an AP connection that isn't on the
+ * STREAM_BW dirty list, has read or written some bytes: if any controller
+ * wants STREAM_BW events, put it on the list. */
+void
+control_note_stream_bandwidth(edge_connection_t *edge_conn)
+{
+  if (!EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED))
+    return;
+  if (!stream_bw_dirty_conns)
+    stream_bw_dirty_conns = smartlist_new();
+  smartlist_add(stream_bw_dirty_conns, edge_conn);
+  edge_conn->stream_bw_dirty = 1;
+}
+
+/** Called when we're about to free <b>edge_conn</b>, which is on the
+ * STREAM_BW dirty list: take it off. */
+void
+control_forget_stream_bandwidth(edge_connection_t *edge_conn)
+{
+  if (stream_bw_dirty_conns)
+    smartlist_remove(stream_bw_dirty_conns, edge_conn);
+  edge_conn->stream_bw_dirty = 0;
+}
+
 /** A second or more has elapsed: tell any interested control
  * connections how much bandwidth streams have used. */
 int
 control_event_stream_bandwidth_used(void)
 {
-  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED)) {
-    smartlist_t *conns = get_connection_array();
-    edge_connection_t *edge_conn;
+  if (EVENT_IS_INTERESTING(EVENT_STREAM_BANDWIDTH_USED) &&
+      stream_bw_dirty_conns) {
+    /* Compact controllers get every stream's counts in one event. */
+    smartlist_t *compact = NULL;
+
+    if (EVENT_IS_INTERESTING_COMPACT(EVENT_STREAM_BANDWIDTH_USED))
+      compact = smartlist_new();
 
-    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn)
+    SMARTLIST_FOREACH_BEGIN(stream_bw_dirty_conns, edge_connection_t *,
+                            edge_conn)
     {
-        if (conn->type != CONN_TYPE_AP)
-          continue;
-        edge_conn = TO_EDGE_CONN(conn);
+        edge_conn->stream_bw_dirty = 0;
         if (!edge_conn->n_read && !edge_conn->n_written)
           continue;
 
-        send_control_event(EVENT_STREAM_BANDWIDTH_USED, ALL_FORMATS,
+        if (EVENT_IS_INTERESTING_TEXT(EVENT_STREAM_BANDWIDTH_USED))
+          send_control_event(EVENT_STREAM_BANDWIDTH_USED, TEXT_FORMAT,
                            "650 STREAM_BW "U64_FORMAT" %lu %lu\r\n",
                            U64_PRINTF_ARG(edge_conn->_base.global_identifier),
                            (unsigned long)edge_conn->n_read,
                            (unsigned long)edge_conn->n_written);
+        if (compact)
+          smartlist_add_asprintf(compact, " "U64_FORMAT",%lu,%lu",
+                           U64_PRINTF_ARG(edge_conn->_base.global_identifier),
+                           (unsigned long)edge_conn->n_read,
+                           (unsigned long)edge_conn->n_written);
 
         edge_conn->n_written = edge_conn->n_read = 0;
     }
-    SMARTLIST_FOREACH_END(conn);
+    SMARTLIST_FOREACH_END(edge_conn);
+    smartlist_clear(stream_bw_dirty_conns);
+
+    if (compact) {
+      if (smartlist_len(compact)) {
+        char *streams = smartlist_join_strings(compact, "", 0, NULL);
+        send_control_event(EVENT_STREAM_BANDWIDTH_USED, COMPACT_FORMAT,
+                           "650 STREAM_BW%s\r\n", streams);
+        tor_free(streams);
+      }
+      SMARTLIST_FOREACH(compact, char *, cp, tor_free(cp));
+      smartlist_free(compact);
+    }
   }
 
   return 0;
@@ -3858,6 +4396,21 @@ control_event_bandwidth_used(uint32_t n_read, uint32_t n_written)
   return 0;
 }
 
+/** A second or more has elapsed: tell any interested control connections
+ * how the onionskin pipeline did over it. */
+int
+control_event_onion_pipeline(void)
+{
+  if (EVENT_IS_INTERESTING(EVENT_ONION_PIPELINE)) {
+    char *stats = rep_hist_format_onion_pipeline(1);
+    send_control_event(EVENT_ONION_PIPELINE, ALL_FORMATS,
+                       "650 ONION_PIPELINE %s\r\n", stats);
+    tor_free(stats);
+  }
+
+  return 0;
+}
+
 /** Called when we are sending a log message to the controllers: suspend
  * sending further log messages to the controllers until we're done.  Used by
  * CONN_LOG_PROTECT. */
@@ -4350,7 +4903,7 @@ control_event_conf_changed(smartlist_t *elements)
     }
   }
   result = smartlist_join_strings(lines, "\r\n", 0, NULL);
-  send_control_event(EVENT_CONF_CHANGED, 0,
+  send_control_event(EVENT_CONF_CHANGED, ALL_FORMATS,
     "650-CONF_CHANGED\r\n%s\r\n650 OK\r\n", result);
   tor_free(result);
   SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
@@ -4611,6 +5164,7 @@ control_event_bootstrap(bootstrap_status_t status, int progress)
     control_event_client_status(LOG_NOTICE, "%s", buf);
     if (status > bootstrap_percent) {
       bootstrap_percent = status; /* new milestone reached */
+      startup_timeline_note_bootstrap(tag, status == BOOTSTRAP_STATUS_DONE);
     }
     if (progress > bootstrap_percent) {
       /* incremental progress within a milestone */
@@ -4685,7 +5239,7 @@ control_event_bootstrap_problem(const char *warn, int reason)
 void
 control_event_clients_seen(const char *controller_str)
 {
-  send_control_event(EVENT_CLIENTS_SEEN, 0,
+  send_control_event(EVENT_CLIENTS_SEEN, ALL_FORMATS,
     "650 CLIENTS_SEEN %s\r\n", controller_str);
 }
 
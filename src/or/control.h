@@ -14,6 +14,8 @@
 
 void control_update_global_event_mask(void);
 void control_adjust_event_log_severity(void);
+void control_free_all(void);
+void control_flush_event_queue(void);
 
 void control_ports_write_to_file(void);
 
@@ -26,6 +28,7 @@ void control_ports_write_to_file(void);
   CONN_LOG_PROTECT(conn, log_fn args)
 
 int connection_control_finished_flushing(control_connection_t *conn);
+int connection_control_flushed_some(control_connection_t *conn);
 int connection_control_reached_eof(control_connection_t *conn);
 void connection_control_closed(control_connection_t *conn);
 
@@ -34,6 +37,7 @@ int connection_control_process_inbuf(control_connection_t *conn);
 #define EVENT_AUTHDIR_NEWDESCS 0x000D
 #define EVENT_NS 0x000F
 int control_event_is_interesting(int event);
+int control_event_wants_per_second_events(void);
 
 int control_event_circuit_status(origin_circuit_t *circ,
                                  circuit_status_event_t e, int reason);
@@ -48,8 +52,11 @@ int control_event_stream_status(entry_connection_t *conn,
 int control_event_or_conn_status(or_connection_t *conn,
                                  or_conn_status_event_t e, int reason);
 int control_event_bandwidth_used(uint32_t n_read, uint32_t n_written);
+int control_event_onion_pipeline(void);
 int control_event_stream_bandwidth(edge_connection_t *edge_conn);
 int control_event_stream_bandwidth_used(void);
+void control_note_stream_bandwidth(edge_connection_t *edge_conn);
+void control_forget_stream_bandwidth(edge_connection_t *edge_conn);
 void control_event_logmsg(int severity, uint32_t domain, const char *msg);
 int control_event_descriptors_changed(smartlist_t *routers);
 int control_event_address_mapped(const char *from, const char *to,
@@ -9,7 +9,17 @@
  * CPU-intensive tasks in another thread or process, to not
  * interrupt the main thread.
  *
- * Right now, we only use this for processing onionskins.
+ * We use this for processing onionskins, and, with the thread pool, for
+ * TLS handshakes, clients' circuit handshakes, and the public-key part of
+ * hidden services' INTRODUCE2 cells.
+ *
+ * With pthreads, the workers are a pool of threads inside the Tor process:
+ * the main thread puts jobs (batches of onionskins) on a lock-protected
+ * queue, whichever worker is free takes the next one, and finished jobs
+ * come back on a reply queue.
+ * A single socketpair wakes the main loop when replies are waiting.
+ * Elsewhere, each worker is a separate thread or process that we talk to
+ * over its own socketpair, as a CONN_TYPE_CPUWORKER connection.
  **/
 
 #include "or.h"
@@ -18,13 +28,22 @@
 #include "circuitlist.h"
 #include "config.h"
 #include "connection.h"
+#include "connection_or.h"
 #include "cpuworker.h"
 #include "main.h"
 #include "onion.h"
+#include "rendservice.h"
+#include "rephist.h"
 #include "router.h"
 
-/** The maximum number of cpuworker processes we will keep around. */
-#define MAX_CPUWORKERS 16
+#ifdef USE_PTHREADS
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+#endif
+
 /** The minimum number of cpuworker processes we will keep around. */
 #define MIN_CPUWORKERS 1
 
@@ -34,10 +53,20 @@
 #define LEN_ONION_RESPONSE \
   (1+TAG_LEN+ONIONSKIN_REPLY_LEN+CPATH_KEY_MATERIAL_LEN)
 
-/** How many cpuworkers we have running right now. */
+/** How many cpuworkers we have running right now.  (With the thread pool,
+ * this is protected by cpuworker_lock.) */
 static int num_cpuworkers=0;
-/** How many of the running cpuworkers have an assigned task right now. */
+/** How many of the running cpuworkers have an assigned task right now.
+ * (With the thread pool: how many jobs we have handed out and not yet
+ * gotten answers for.) */
 static int num_cpuworkers_busy=0;
+
+static void spawn_enough_cpuworkers(void);
+
+#ifdef USE_PTHREADS
+static void process_pending_tasks(void);
+static void process_pending_intros(void);
+#else
 /** We need to spawn new cpuworkers whenever we rotate the onion keys
  * on platforms where execution contexts==processes.  This variable stores
  * the last time we got a key rotation event. */
@@ -45,8 +74,8 @@ static time_t last_rotation_time=0;
 
 static void cpuworker_main(void *data) ATTR_NORETURN;
 static int spawn_cpuworker(void);
-static void spawn_enough_cpuworkers(void);
 static void process_pending_task(connection_t *cpuworker);
+#endif
 
 /** Initialize the cpuworker subsystem.
  */
@@ -84,6 +113,940 @@ tag_unpack(const char *tag, uint64_t *conn_id, circid_t *circ_id)
   *circ_id = get_uint16(tag+8);
 }
 
+/** Do the server side of the onion handshake for <b>question</b>, an
+ * onionskin from the circuit described by <b>tag</b>, and write an answer
+ * of LEN_ONION_RESPONSE bytes to <b>response</b>.  (See note on
+ * cpuworker_main for the format.) */
+static void
+cpuworker_answer_onionskin(const char *tag, const char *question,
+                           crypto_pk_t *onion_key,
+                           crypto_pk_t *last_onion_key,
+                           char *response)
+{
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  char reply_to_proxy[ONIONSKIN_REPLY_LEN];
+
+  if (onion_skin_server_handshake(question, onion_key, last_onion_key,
+      reply_to_proxy, keys, CPATH_KEY_MATERIAL_LEN) < 0) {
+    /* failure */
+    log_debug(LD_OR,"onion_skin_server_handshake failed.");
+    *response = 0; /* indicate failure in first byte */
+    memcpy(response+1,tag,TAG_LEN);
+    /* send all zeros as answer */
+    memset(response+1+TAG_LEN, 0, LEN_ONION_RESPONSE-(1+TAG_LEN));
+  } else {
+    /* success */
+    log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
+    response[0] = 1; /* 1 means success */
+    memcpy(response+1,tag,TAG_LEN);
+    memcpy(response+1+TAG_LEN,reply_to_proxy,ONIONSKIN_REPLY_LEN);
+    memcpy(response+1+TAG_LEN+ONIONSKIN_REPLY_LEN,keys,
+           CPATH_KEY_MATERIAL_LEN);
+  }
+}
+
+/** In the main thread, handle <b>response</b>, an answer of
+ * LEN_ONION_RESPONSE bytes from a cpuworker: find the circuit it was for,
+ * if that's still around, and send the CREATED cell. */
+static void
+cpuworker_handle_response(const char *response)
+{
+  uint64_t conn_id;
+  circid_t circ_id;
+  connection_t *tmp_conn;
+  or_connection_t *p_conn = NULL;
+  circuit_t *circ = NULL;
+  const char *buf = response+1;
+
+  /* parse out the circ it was talking about */
+  tag_unpack(buf, &conn_id, &circ_id);
+  tmp_conn = connection_get_by_global_id(conn_id);
+  if (tmp_conn && !tmp_conn->marked_for_close &&
+      tmp_conn->type == CONN_TYPE_OR)
+    p_conn = TO_OR_CONN(tmp_conn);
+
+  if (p_conn)
+    circ = circuit_get_by_circid_orconn(circ_id, p_conn);
+
+  if (response[0] == 0) {
+    log_debug(LD_OR,
+              "decoding onionskin failed. "
+              "(Old key or bad software.) Closing.");
+    rep_hist_note_onionskin_dropped(ONION_DROP_FAILED);
+    if (circ)
+      circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
+    return;
+  }
+  if (!circ) {
+    /* This happens because somebody sends us a destroy cell and the
+     * circuit goes away, while the cpuworker is working. This is also
+     * why our tag doesn't include a pointer to the circ, because we'd
+     * never know if it's still valid.
+     */
+    log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
+    rep_hist_note_onionskin_dropped(ONION_DROP_CIRCUIT_CLOSED);
+    return;
+  }
+  tor_assert(! CIRCUIT_IS_ORIGIN(circ));
+  if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, buf+TAG_LEN,
+                       buf+TAG_LEN+ONIONSKIN_REPLY_LEN) < 0) {
+    log_warn(LD_OR,"onionskin_answer failed. Closing.");
+    circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    return;
+  }
+  log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+  rep_hist_note_onionskin_answered();
+}
+
+/** Return how many cpuworkers our configuration asks for. */
+static int
+get_num_cpuworkers_needed(void)
+{
+  int num_cpuworkers_needed = get_num_cpus(get_options());
+
+  if (num_cpuworkers_needed < MIN_CPUWORKERS)
+    num_cpuworkers_needed = MIN_CPUWORKERS;
+  if (num_cpuworkers_needed > MAX_CPUWORKERS)
+    num_cpuworkers_needed = MAX_CPUWORKERS;
+  return num_cpuworkers_needed;
+}
+
+#ifdef USE_PTHREADS
+
+/** The largest number of onionskins we hand to one worker at a time. */
+#define CPUWORKER_MAX_BATCH 8
+
+/** An onionskin that the main thread has handed to the worker threads,
+ * along with its answer once a worker has computed it. */
+typedef struct cpuworker_onion_t {
+  /** Which circuit the onionskin came from; see tag_pack(). */
+  char tag[TAG_LEN];
+  /** The onionskin itself. */
+  char onionskin[ONIONSKIN_CHALLENGE_LEN];
+  /** The answer, in the format of cpuworker_answer_onionskin(). */
+  char response[LEN_ONION_RESPONSE];
+  /** When we received the onionskin, from tor_monotime_nsec(). */
+  uint64_t received;
+  /** How many usec the onionskin waited before a worker started on it, and
+   * how many the worker then spent on it. */
+  long queue_usec;
+  long worker_usec;
+} cpuworker_onion_t;
+
+/** A copy of our onion keys that worker threads share.  The main thread
+ * makes a new one after each rotation, and each onionskin job holds a
+ * reference to the one that was current when we queued it, so rotating
+ * never disturbs a job in flight. */
+typedef struct cpuworker_keys_t {
+  /** How many jobs, plus one if this is cpuworker_keys, refer to this
+   * object.  Protected by cpuworker_lock. */
+  int refcnt;
+  /** Our current and previous onion keys.  Never modified once set. */
+  crypto_pk_t *onion_key;
+  crypto_pk_t *last_onion_key;
+} cpuworker_keys_t;
+
+/** Task type for a job that runs a step of a TLS handshake.  (Jobs that
+ * answer onionskins use CPUWORKER_TASK_ONION.) */
+#define CPUWORKER_TASK_TLS_HANDSHAKE 3
+/** Task type for a job that does the client's half of the DH in a
+ * CELL_CREATED or EXTENDED reply. */
+#define CPUWORKER_TASK_CLIENT_HANDSHAKE 4
+/** Task type for a job that decrypts an INTRODUCE2 cell for one of our
+ * hidden services and does the service's half of its DH handshake. */
+#define CPUWORKER_TASK_REND_INTRODUCE 5
+
+/** The part of a CPUWORKER_TASK_REND_INTRODUCE job that only that task
+ * needs. */
+typedef struct cpuworker_intro_t {
+  /** Which service the cell is for. */
+  char rend_pk_digest[DIGEST_LEN];
+  /** A reference to the introduction key to decrypt with.  Only the main
+   * thread changes its reference count. */
+  crypto_pk_t *intro_key;
+  /** The body of the INTRODUCE2 cell. */
+  uint8_t request[RELAY_PAYLOAD_SIZE];
+  size_t request_len;
+  /** What rend_service_introduce_decrypt() gave us: the plaintext, our DH
+   * state (which the job owns), and the key material. */
+  char plaintext[RELAY_PAYLOAD_SIZE];
+  crypto_dh_t *dh;
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN];
+  /** How loudly to log protocol warnings: LOG_PROTOCOL_WARN, as the main
+   * thread saw it, since the worker mustn't read the options. */
+  int severity;
+} cpuworker_intro_t;
+
+/** A piece of work that one worker does in one go, and that comes back to
+ * the main thread in one piece: a batch of onionskins, a step of a TLS
+ * handshake, a client's circuit handshake, or an INTRODUCE2 cell. */
+typedef struct cpuworker_job_t {
+  /** CPUWORKER_TASK_ONION, CPUWORKER_TASK_TLS_HANDSHAKE,
+   * CPUWORKER_TASK_CLIENT_HANDSHAKE, or CPUWORKER_TASK_REND_INTRODUCE. */
+  uint8_t task;
+  /** For TLS handshakes, client handshakes, and introductions: the return
+   * value of the handshake or decryption function. */
+  int result;
+  /** For TLS handshakes: the connection whose handshake this is.  It has
+   * tls_handshake_in_worker set, so it won't go away until the main thread
+   * gets this job back.  The worker itself only touches <b>tls</b>. */
+  or_connection_t *tls_conn;
+  /** For TLS handshakes: the TLS object to run tor_tls_handshake() on. */
+  tor_tls_t *tls;
+  /** For client handshakes: the global identifier of the origin circuit,
+   * and the hop we're finishing.  The worker touches neither. */
+  uint32_t client_circ_id;
+  crypt_path_t *client_hop;
+  /** For client handshakes: the hop's DH state, which the job owns. */
+  crypto_dh_t *client_dh;
+  /** For client handshakes: the body of the CREATED or EXTENDED cell. */
+  uint8_t client_reply[ONIONSKIN_REPLY_LEN];
+  /** For client handshakes: the keys the worker computed. */
+  char client_keys[CPATH_KEY_MATERIAL_LEN];
+  /** For onionskins: a reference to the keys to answer them with. */
+  cpuworker_keys_t *keys;
+  /** For introductions: everything else about the cell. */
+  cpuworker_intro_t *intro;
+  /** The slot of the worker thread that did this job, and how many usec
+   * it took. */
+  int worker_slot;
+  long busy_usec;
+  /** How many entries of <b>onions</b> are in use. */
+  int n_onions;
+  /** The onionskins; allocated to hold as many as we need (at most
+   * CPUWORKER_MAX_BATCH). */
+  cpuworker_onion_t onions[1];
+} cpuworker_job_t;
+
+/** Protects every other cpuworker_* variable below, and num_cpuworkers.
+ * NULL until we first start the thread pool. */
+static tor_mutex_t *cpuworker_lock = NULL;
+/** Signalled when we add a job, or want some workers to exit. */
+static tor_cond_t *cpuworker_job_cond = NULL;
+/** Jobs that no worker has picked up yet, oldest first. */
+static smartlist_t *cpuworker_jobs = NULL;
+/** Answered jobs that the main thread hasn't handled yet. */
+static smartlist_t *cpuworker_replies = NULL;
+/** How many TLS handshake jobs workers are running right now. */
+static int cpuworker_tls_jobs_running = 0;
+/** Signalled when cpuworker_tls_jobs_running drops to 0. */
+static tor_cond_t *cpuworker_tls_done_cond = NULL;
+/** How many worker threads we want to have.  Idle workers above this
+ * number exit.  This grows when work has to queue, and shrinks when the
+ * workers have been idle; see cpuworker_maybe_resize(). */
+static int cpuworker_threads_wanted = 0;
+/** The onion keys to give the next onionskin job, or NULL if we haven't
+ * copied them since we started or last rotated.  Only the main thread
+ * reads or replaces this pointer. */
+static cpuworker_keys_t *cpuworker_keys = NULL;
+/** True iff we have written a byte to cpuworker_alert_fds[1] that the
+ * main thread hasn't read yet. */
+static int cpuworker_alert_pending = 0;
+/** A socketpair: workers write to [1] to wake the main thread, which
+ * reads from [0]. */
+static tor_socket_t cpuworker_alert_fds[2];
+/** Read event for cpuworker_alert_fds[0]. */
+static struct event *cpuworker_alert_event = NULL;
+
+/** How often, in seconds, do we consider shrinking the thread pool? */
+#define CPUWORKER_SHRINK_INTERVAL 60
+/** The largest value of num_cpuworkers_busy since we last considered
+ * shrinking the thread pool.  Main thread only. */
+static int cpuworker_peak_busy = 0;
+/** When did we last consider shrinking the thread pool?  Main thread
+ * only. */
+static time_t cpuworker_last_shrink_check = 0;
+/** The most introduction jobs we keep waiting for a worker.  Past this, we
+ * drop the oldest waiting introduction for whichever service has the most
+ * of them waiting, so that a flood against one service can't push out
+ * everyone else's. */
+#define CPUWORKER_MAX_PENDING_INTROS 128
+/** Introduction jobs that we haven't handed to a worker yet, oldest
+ * first.  Main thread only. */
+static smartlist_t *cpuworker_intros_pending = NULL;
+/** How many introduction jobs we've handed to workers and not yet gotten
+ * back.  We keep this to at most half the worker threads, so that
+ * INTRODUCE2 cells can't starve onionskins and our own circuits.  Main
+ * thread only. */
+static int cpuworker_intros_running = 0;
+
+/** Which CPU should the next worker thread we launch pin itself to, if
+ * CPUWorkerAffinity is set?  Main thread only. */
+static int cpuworker_next_cpu = 0;
+/** True for each worker slot that a running thread holds.  Each thread
+ * keeps its slot for its whole life, so that we can keep statistics per
+ * worker. */
+static uint8_t cpuworker_slot_in_use[MAX_CPUWORKERS];
+
+/** What we pass to each new worker thread. */
+typedef struct cpuworker_thread_arg_t {
+  /** The thread's slot in cpuworker_slot_in_use. */
+  int slot;
+  /** The CPU the thread should pin itself to, or -1 for none. */
+  int cpu;
+} cpuworker_thread_arg_t;
+
+/** Return a new job for <b>task</b>, with room for <b>max_onions</b>
+ * onionskins. */
+static cpuworker_job_t *
+cpuworker_job_new(uint8_t task, int max_onions)
+{
+  size_t size = STRUCT_OFFSET(cpuworker_job_t, onions) +
+    max_onions * sizeof(cpuworker_onion_t);
+  cpuworker_job_t *job = tor_malloc_zero(size);
+  tor_assert(max_onions >= 0 && max_onions <= CPUWORKER_MAX_BATCH);
+  job->task = task;
+  return job;
+}
+
+/** Release all storage held by <b>job</b>, wiping its keys first. */
+static void
+cpuworker_job_free(cpuworker_job_t *job)
+{
+  if (job->client_dh)
+    crypto_dh_free(job->client_dh);
+  if (job->intro) {
+    if (job->intro->dh)
+      crypto_dh_free(job->intro->dh);
+    crypto_pk_free(job->intro->intro_key);
+    memset(job->intro, 0, sizeof(cpuworker_intro_t));
+    tor_free(job->intro);
+  }
+  memset(job->client_keys, 0, sizeof(job->client_keys));
+  memset(job->onions, 0, job->n_onions * sizeof(cpuworker_onion_t));
+  tor_free(job);
+}
+
+/** Return a new cpuworker_keys_t holding copies of our onion keys, with
+ * one reference. */
+static cpuworker_keys_t *
+cpuworker_keys_new(void)
+{
+  cpuworker_keys_t *keys = tor_malloc_zero(sizeof(cpuworker_keys_t));
+  keys->refcnt = 1;
+  dup_onion_keys(&keys->onion_key, &keys->last_onion_key);
+  return keys;
+}
+
+/** Drop a reference to <b>keys</b>, and free them if that was the last
+ * one.  The caller must hold cpuworker_lock. */
+static void
+cpuworker_keys_decref(cpuworker_keys_t *keys)
+{
+  tor_assert(keys->refcnt > 0);
+  if (--keys->refcnt)
+    return;
+  crypto_pk_free(keys->onion_key);
+  if (keys->last_onion_key)
+    crypto_pk_free(keys->last_onion_key);
+  tor_free(keys);
+}
+
+/** Add <b>onionskin</b>, which we got from <b>circ</b> at
+ * <b>received</b>, to <b>job</b>, which must have room for it, and free
+ * <b>onionskin</b>.  Return 0 on success, or -1 if the circuit has lost its
+ * connection. */
+static int
+cpuworker_job_add_onion(cpuworker_job_t *job, or_circuit_t *circ,
+                        char *onionskin, uint64_t received)
+{
+  cpuworker_onion_t *onion;
+  if (!circ->p_conn) {
+    log_info(LD_OR,"circ->p_conn gone. Failing circ.");
+    rep_hist_note_onionskin_dropped(ONION_DROP_CIRCUIT_CLOSED);
+    tor_free(onionskin);
+    return -1;
+  }
+  onion = &job->onions[job->n_onions++];
+  onion->received = received;
+  tag_pack(onion->tag, circ->p_conn->_base.global_identifier,
+           circ->p_circ_id);
+  memcpy(onion->onionskin, onionskin, ONIONSKIN_CHALLENGE_LEN);
+  tor_free(onionskin);
+  return 0;
+}
+
+/** Give <b>job</b> to the next free worker thread.  If it has onionskins,
+ * it gets a reference to our current onion keys. */
+static void
+cpuworker_queue_job(cpuworker_job_t *job)
+{
+  num_cpuworkers_busy++;
+  if (num_cpuworkers_busy > cpuworker_peak_busy)
+    cpuworker_peak_busy = num_cpuworkers_busy;
+  if (job->n_onions && !cpuworker_keys)
+    cpuworker_keys = cpuworker_keys_new();
+  tor_mutex_acquire(cpuworker_lock);
+  if (job->n_onions) {
+    job->keys = cpuworker_keys;
+    ++job->keys->refcnt;
+  }
+  smartlist_add(cpuworker_jobs, job);
+  tor_cond_signal_one(cpuworker_job_cond);
+  tor_mutex_release(cpuworker_lock);
+}
+
+/** Body of each worker thread: take jobs from cpuworker_jobs, answer them,
+ * and put them on cpuworker_replies, until there are more workers than
+ * cpuworker_threads_wanted and nothing left to do.  <b>arg</b> is a
+ * cpuworker_thread_arg_t, which we free. */
+static void
+cpuworker_thread_main(void *arg)
+{
+  cpuworker_thread_arg_t *thread_arg = arg;
+  int slot = thread_arg->slot;
+
+  if (thread_arg->cpu >= 0 &&
+      tor_set_thread_cpu_affinity(thread_arg->cpu) < 0)
+    log_info(LD_OR, "Couldn't pin CPU worker thread to CPU %d.",
+             thread_arg->cpu);
+  tor_free(thread_arg);
+
+  tor_mutex_acquire(cpuworker_lock);
+  for (;;) {
+    cpuworker_job_t *job;
+    uint64_t start, end;
+    int i;
+
+    while (!smartlist_len(cpuworker_jobs) &&
+           num_cpuworkers <= cpuworker_threads_wanted)
+      tor_cond_wait(cpuworker_job_cond, cpuworker_lock);
+    if (!smartlist_len(cpuworker_jobs))
+      break; /* We're surplus. */
+
+    job = smartlist_get(cpuworker_jobs, 0);
+    smartlist_del_keeporder(cpuworker_jobs, 0);
+    if (job->task == CPUWORKER_TASK_TLS_HANDSHAKE)
+      ++cpuworker_tls_jobs_running;
+    tor_mutex_release(cpuworker_lock);
+
+    start = tor_monotime_nsec();
+    if (job->task == CPUWORKER_TASK_TLS_HANDSHAKE) {
+      job->result = tor_tls_handshake(job->tls);
+    } else if (job->task == CPUWORKER_TASK_CLIENT_HANDSHAKE) {
+      job->result = onion_skin_client_handshake(job->client_dh,
+                                                (char*)job->client_reply,
+                                                job->client_keys,
+                                                CPATH_KEY_MATERIAL_LEN);
+    } else if (job->task == CPUWORKER_TASK_REND_INTRODUCE) {
+      cpuworker_intro_t *intro = job->intro;
+      job->result = rend_service_introduce_decrypt(intro->intro_key,
+                                                   intro->request,
+                                                   intro->request_len,
+                                                   intro->plaintext,
+                                                   sizeof(intro->plaintext),
+                                                   &intro->dh, intro->keys,
+                                                   intro->severity);
+    } else {
+      end = start;
+      for (i = 0; i < job->n_onions; ++i) {
+        cpuworker_onion_t *onion = &job->onions[i];
+        uint64_t onion_start = end;
+        onion->queue_usec = (long)((onion_start - onion->received) / 1000);
+        cpuworker_answer_onionskin(onion->tag, onion->onionskin,
+                                   job->keys->onion_key,
+                                   job->keys->last_onion_key,
+                                   onion->response);
+        end = tor_monotime_nsec();
+        onion->worker_usec = (long)((end - onion_start) / 1000);
+      }
+    }
+    end = tor_monotime_nsec();
+    job->worker_slot = slot;
+    job->busy_usec = (long)((end - start) / 1000);
+
+    tor_mutex_acquire(cpuworker_lock);
+    if (job->keys) {
+      cpuworker_keys_decref(job->keys);
+      job->keys = NULL;
+    }
+    if (job->task == CPUWORKER_TASK_TLS_HANDSHAKE &&
+        !--cpuworker_tls_jobs_running)
+      tor_cond_signal_all(cpuworker_tls_done_cond);
+    smartlist_add(cpuworker_replies, job);
+    if (!cpuworker_alert_pending) {
+      cpuworker_alert_pending = 1;
+      send(cpuworker_alert_fds[1], "", 1, 0);
+    }
+  }
+  --num_cpuworkers;
+  cpuworker_slot_in_use[slot] = 0;
+  tor_mutex_release(cpuworker_lock);
+
+  log_info(LD_OR, "CPU worker thread exiting.");
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+
+/** Called from the main loop when a worker has woken us up: handle every
+ * answered batch on cpuworker_replies, then hand out more work if any is
+ * pending. */
+static void
+cpuworker_alert_cb(evutil_socket_t fd, short events, void *arg)
+{
+  smartlist_t *replies;
+  char buf[64];
+  (void)events;
+  (void)arg;
+
+  tor_mutex_acquire(cpuworker_lock);
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+  cpuworker_alert_pending = 0;
+  replies = cpuworker_replies;
+  cpuworker_replies = smartlist_new();
+  tor_mutex_release(cpuworker_lock);
+
+  SMARTLIST_FOREACH_BEGIN(replies, cpuworker_job_t *, job) {
+    int i;
+    --num_cpuworkers_busy;
+    rep_hist_note_cpuworker_busy(job->worker_slot, job->busy_usec);
+    if (job->task == CPUWORKER_TASK_TLS_HANDSHAKE)
+      connection_or_tls_handshake_done(job->tls_conn, job->result);
+    else if (job->task == CPUWORKER_TASK_CLIENT_HANDSHAKE)
+      circuit_finish_handshake_done(job->client_circ_id, job->client_hop,
+                                    job->result, job->client_reply,
+                                    job->client_keys);
+    else if (job->task == CPUWORKER_TASK_REND_INTRODUCE) {
+      --cpuworker_intros_running;
+      rend_service_introduce_done(job->intro->rend_pk_digest, job->result,
+                                  job->intro->plaintext, job->intro->dh,
+                                  job->intro->keys);
+      job->intro->dh = NULL;
+    }
+    for (i = 0; i < job->n_onions; ++i) {
+      rep_hist_note_onionskin_timing(job->onions[i].queue_usec,
+                                     job->onions[i].worker_usec);
+      cpuworker_handle_response(job->onions[i].response);
+    }
+    cpuworker_job_free(job);
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(replies);
+
+  process_pending_tasks();
+  process_pending_intros();
+}
+
+/** Set up the locks, queues, and wakeup socketpair for the thread pool, if
+ * we haven't already.  Return 0 on success, -1 on failure. */
+static int
+cpuworker_threadpool_init(void)
+{
+  int err;
+  if (cpuworker_lock)
+    return 0;
+
+  if ((err = tor_socketpair(AF_UNIX, SOCK_STREAM, 0,
+                            cpuworker_alert_fds)) < 0) {
+    log_warn(LD_NET, "Couldn't construct socketpair for cpuworkers: %s",
+             tor_socket_strerror(-err));
+    return -1;
+  }
+  set_socket_nonblocking(cpuworker_alert_fds[0]);
+  set_socket_nonblocking(cpuworker_alert_fds[1]);
+
+  if (!(cpuworker_job_cond = tor_cond_new()) ||
+      !(cpuworker_tls_done_cond = tor_cond_new())) {
+    log_warn(LD_GENERAL, "Couldn't create condition for cpuworkers.");
+    if (cpuworker_job_cond)
+      tor_cond_free(cpuworker_job_cond);
+    cpuworker_job_cond = NULL;
+    tor_close_socket(cpuworker_alert_fds[0]);
+    tor_close_socket(cpuworker_alert_fds[1]);
+    return -1;
+  }
+  cpuworker_jobs = smartlist_new();
+  cpuworker_replies = smartlist_new();
+  cpuworker_alert_event = tor_event_new(tor_libevent_get_base(),
+                                        cpuworker_alert_fds[0],
+                                        EV_READ|EV_PERSIST,
+                                        cpuworker_alert_cb, NULL);
+  event_add(cpuworker_alert_event, NULL);
+  cpuworker_lock = tor_mutex_new();
+  return 0;
+}
+
+/** Called when the onion key has changed: forget our copy of the old
+ * keys, so that the next onionskin job gets a fresh copy.  Jobs already
+ * queued keep the keys they have.  Also start or stop workers as our
+ * configuration requires.  (Clients run the thread pool too, for their
+ * half of circuit handshakes.)
+ */
+void
+cpuworkers_rotate(void)
+{
+  if (cpuworker_keys) {
+    tor_mutex_acquire(cpuworker_lock);
+    cpuworker_keys_decref(cpuworker_keys);
+    tor_mutex_release(cpuworker_lock);
+    cpuworker_keys = NULL;
+  }
+  spawn_enough_cpuworkers();
+}
+
+/** With the thread pool, we never make CONN_TYPE_CPUWORKER connections. */
+int
+connection_cpu_reached_eof(connection_t *conn)
+{
+  log_warn(LD_BUG, "Read eof on a cpuworker connection we never made.");
+  connection_mark_for_close(conn);
+  return 0;
+}
+
+/** With the thread pool, we never make CONN_TYPE_CPUWORKER connections. */
+int
+connection_cpu_process_inbuf(connection_t *conn)
+{
+  (void)conn;
+  return 0;
+}
+
+/** Launch or stop worker threads until we have <b>n</b> of them. */
+static void
+cpuworker_set_threads_wanted(int n)
+{
+  const or_options_t *options = get_options();
+  int n_cpus = compute_num_cpus();
+
+  if (n_cpus < 1)
+    n_cpus = 1;
+  tor_mutex_acquire(cpuworker_lock);
+  cpuworker_threads_wanted = n;
+  while (num_cpuworkers < n) {
+    cpuworker_thread_arg_t *arg = tor_malloc(sizeof(cpuworker_thread_arg_t));
+    arg->slot = 0;
+    while (cpuworker_slot_in_use[arg->slot])
+      ++arg->slot;
+    arg->cpu = -1;
+    if (options->CPUWorkerAffinity) {
+      arg->cpu = cpuworker_next_cpu;
+      cpuworker_next_cpu = (cpuworker_next_cpu + 1) % n_cpus;
+    }
+    cpuworker_slot_in_use[arg->slot] = 1;
+    if (spawn_func(cpuworker_thread_main, arg) < 0) {
+      log_warn(LD_GENERAL,"Cpuworker spawn failed. Will try again later.");
+      cpuworker_slot_in_use[arg->slot] = 0;
+      tor_free(arg);
+      break;
+    }
+    log_debug(LD_OR,"just spawned a cpu worker.");
+    num_cpuworkers++;
+  }
+  if (num_cpuworkers > n)
+    tor_cond_signal_all(cpuworker_job_cond);
+  tor_mutex_release(cpuworker_lock);
+}
+
+/** Make sure the number of worker threads we want is between
+ * MIN_CPUWORKERS and what our configuration allows, and launch or stop
+ * threads to match.  We start out with the fewest, and let
+ * cpuworker_maybe_resize() add more as they're needed.
+ */
+static void
+spawn_enough_cpuworkers(void)
+{
+  int n = cpuworker_threads_wanted;
+  int num_cpuworkers_needed = get_num_cpuworkers_needed();
+
+  if (cpuworker_threadpool_init() < 0)
+    return;
+
+  if (n < MIN_CPUWORKERS)
+    n = MIN_CPUWORKERS;
+  if (n > num_cpuworkers_needed)
+    n = num_cpuworkers_needed;
+  cpuworker_set_threads_wanted(n);
+}
+
+/** Resize the thread pool to fit the load.  If every worker is busy and
+ * there's more work to give out, launch another worker, up to as many as
+ * our configuration allows.  Otherwise, once every
+ * CPUWORKER_SHRINK_INTERVAL seconds, if nothing is queued, stop the workers
+ * that have stayed idle.  Return true iff we added a worker.
+ */
+static int
+cpuworker_maybe_resize(int have_work)
+{
+  time_t now = approx_time();
+
+  if (!cpuworker_lock)
+    return 0; /* We haven't started the thread pool. */
+
+  if (have_work && num_cpuworkers_busy >= cpuworker_threads_wanted &&
+      cpuworker_threads_wanted < get_num_cpuworkers_needed()) {
+    log_info(LD_OR, "All %d CPU workers are busy; launching another.",
+             cpuworker_threads_wanted);
+    cpuworker_set_threads_wanted(cpuworker_threads_wanted + 1);
+    return 1;
+  }
+
+  if (cpuworker_last_shrink_check + CPUWORKER_SHRINK_INTERVAL <= now) {
+    int n = MAX(cpuworker_peak_busy, MIN_CPUWORKERS);
+    cpuworker_last_shrink_check = now;
+    cpuworker_peak_busy = num_cpuworkers_busy;
+    if (n < cpuworker_threads_wanted && !onion_pending_len()) {
+      log_info(LD_OR, "Only %d of %d CPU workers were needed lately; "
+               "stopping the rest.", n, cpuworker_threads_wanted);
+      cpuworker_set_threads_wanted(n);
+    }
+  }
+  return 0;
+}
+
+/** Hand pending onionskins to the workers until they're all busy or
+ * there are no more.  Rather than one onionskin per worker, we split the
+ * pending ones evenly among the idle workers, in batches of up to
+ * CPUWORKER_MAX_BATCH, so that a burst costs fewer wakeups. */
+static void
+process_pending_tasks(void)
+{
+  or_circuit_t *circ;
+  char *onionskin = NULL;
+  uint64_t received;
+
+  cpuworker_maybe_resize(onion_pending_len() > 0);
+
+  while (num_cpuworkers_busy < cpuworker_threads_wanted) {
+    int n_idle = cpuworker_threads_wanted - num_cpuworkers_busy;
+    int n_pending = onion_pending_len();
+    int batch_size;
+    cpuworker_job_t *job;
+
+    if (!n_pending)
+      return;
+    batch_size = CEIL_DIV(n_pending, n_idle);
+    if (batch_size > CPUWORKER_MAX_BATCH)
+      batch_size = CPUWORKER_MAX_BATCH;
+
+    job = cpuworker_job_new(CPUWORKER_TASK_ONION, batch_size);
+    while (job->n_onions < batch_size &&
+           (circ = onion_next_task(&onionskin, &received))) {
+      if (cpuworker_job_add_onion(job, circ, onionskin, received) < 0)
+        log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+    }
+    if (!job->n_onions) {
+      tor_free(job);
+      continue;
+    }
+    cpuworker_queue_job(job);
+  }
+}
+
+/** Try to have a worker thread perform the public key operations necessary
+ * to respond to <b>onionskin</b> for the circuit <b>circ</b>.
+ *
+ * <b>cpuworker</b> must be NULL: we don't pick workers ourselves.  If every
+ * worker is already busy, queue task onto the pending onion list and
+ * return.  Return 0 if we successfully assign the task, or -1 on failure.
+ */
+int
+assign_onionskin_to_cpuworker(connection_t *cpuworker,
+                              or_circuit_t *circ, char *onionskin)
+{
+  cpuworker_job_t *job;
+  tor_assert(!cpuworker);
+
+  if (!cpuworker_maybe_resize(1) &&
+      num_cpuworkers_busy >= cpuworker_threads_wanted) {
+    log_debug(LD_OR,"No idle cpuworkers. Queuing.");
+    if (onion_pending_add(circ, onionskin) < 0) {
+      tor_free(onionskin);
+      return -1;
+    }
+    return 0;
+  }
+
+  job = cpuworker_job_new(CPUWORKER_TASK_ONION, 1);
+  if (cpuworker_job_add_onion(job, circ, onionskin,
+                              tor_monotime_nsec()) < 0) {
+    tor_free(job);
+    return -1;
+  }
+  cpuworker_queue_job(job);
+  return 0;
+}
+
+/** Try to have a worker thread run the next step of the TLS handshake on
+ * <b>conn</b>; when it's done, we'll call
+ * connection_or_tls_handshake_done().  Return 0 if we handed it off, or -1
+ * if the caller should do the step itself.
+ */
+int
+assign_tls_handshake_to_cpuworker(or_connection_t *conn)
+{
+  cpuworker_job_t *job;
+
+  if (!cpuworker_lock || !cpuworker_threads_wanted)
+    return -1; /* We aren't running the thread pool. */
+  tor_assert(conn->tls);
+
+  cpuworker_maybe_resize(1);
+  job = cpuworker_job_new(CPUWORKER_TASK_TLS_HANDSHAKE, 0);
+  job->tls_conn = conn;
+  job->tls = conn->tls;
+  cpuworker_queue_job(job);
+  return 0;
+}
+
+/** Take the TLS handshake jobs out of <b>jobs</b>, a list protected by
+ * cpuworker_lock, and give their connections back to the main thread. */
+static void
+cpuworker_take_back_tls_jobs(smartlist_t *jobs)
+{
+  SMARTLIST_FOREACH_BEGIN(jobs, cpuworker_job_t *, job) {
+    if (job->task == CPUWORKER_TASK_TLS_HANDSHAKE) {
+      job->tls_conn->tls_handshake_in_worker = 0;
+      --num_cpuworkers_busy;
+      cpuworker_job_free(job);
+      SMARTLIST_DEL_CURRENT(jobs, job);
+    }
+  } SMARTLIST_FOREACH_END(job);
+}
+
+/** Called when we're shutting down: wait for the workers to finish the
+ * TLS handshake steps they've started, and take back every connection
+ * whose handshake is still with the thread pool, so that we can free those
+ * connections and their TLS objects. */
+void
+cpuworkers_reclaim_tls_handshakes(void)
+{
+  if (!cpuworker_lock)
+    return;
+  tor_mutex_acquire(cpuworker_lock);
+  while (cpuworker_tls_jobs_running)
+    tor_cond_wait(cpuworker_tls_done_cond, cpuworker_lock);
+  cpuworker_take_back_tls_jobs(cpuworker_jobs);
+  cpuworker_take_back_tls_jobs(cpuworker_replies);
+  tor_mutex_release(cpuworker_lock);
+}
+
+/** Try to have a worker thread do the DH part of <b>reply</b>, the body of
+ * a CELL_CREATED or EXTENDED cell for <b>hop</b> of <b>circ</b>.  On
+ * success, the job takes over hop->dh_handshake_state (the caller must
+ * forget it), we'll call circuit_finish_handshake_done() when it's done,
+ * and we return 0.  Return -1 if the caller should do the handshake
+ * itself.
+ */
+int
+assign_client_handshake_to_cpuworker(origin_circuit_t *circ,
+                                     crypt_path_t *hop,
+                                     const uint8_t *reply)
+{
+  cpuworker_job_t *job;
+
+  if (!cpuworker_lock || !cpuworker_threads_wanted)
+    return -1; /* We aren't running the thread pool. */
+  tor_assert(hop->dh_handshake_state);
+
+  cpuworker_maybe_resize(1);
+  job = cpuworker_job_new(CPUWORKER_TASK_CLIENT_HANDSHAKE, 0);
+  job->client_circ_id = circ->global_identifier;
+  job->client_hop = hop;
+  job->client_dh = hop->dh_handshake_state;
+  memcpy(job->client_reply, reply, ONIONSKIN_REPLY_LEN);
+  cpuworker_queue_job(job);
+  return 0;
+}
+
+/** Hand waiting introduction jobs to the workers, oldest first, while
+ * fewer than half the workers (but at least one) are on introductions. */
+static void
+process_pending_intros(void)
+{
+  int max_running = MAX(cpuworker_threads_wanted / 2, 1);
+
+  while (cpuworker_intros_pending &&
+         smartlist_len(cpuworker_intros_pending) &&
+         cpuworker_intros_running < max_running) {
+    cpuworker_job_t *job = smartlist_get(cpuworker_intros_pending, 0);
+    smartlist_del_keeporder(cpuworker_intros_pending, 0);
+    ++cpuworker_intros_running;
+    cpuworker_queue_job(job);
+  }
+}
+
+/** Make room on cpuworker_intros_pending by dropping the oldest waiting
+ * introduction for the service that has the most of them waiting. */
+static void
+cpuworker_drop_pending_intro(void)
+{
+  digestmap_t *counts = digestmap_new();
+  const char *busiest = NULL;
+  intptr_t busiest_count = 0;
+  int idx = -1;
+  cpuworker_job_t *victim;
+
+  SMARTLIST_FOREACH_BEGIN(cpuworker_intros_pending, cpuworker_job_t *, job) {
+    const char *digest = job->intro->rend_pk_digest;
+    void *val = digestmap_get(counts, digest);
+    intptr_t n = (intptr_t)val + 1;
+    digestmap_set(counts, digest, (void*)n);
+    if (n > busiest_count) {
+      busiest_count = n;
+      busiest = digest;
+    }
+  } SMARTLIST_FOREACH_END(job);
+  digestmap_free(counts, NULL);
+
+  SMARTLIST_FOREACH_BEGIN(cpuworker_intros_pending, cpuworker_job_t *, job) {
+    if (tor_memeq(job->intro->rend_pk_digest, busiest, DIGEST_LEN)) {
+      idx = job_sl_idx;
+      break;
+    }
+  } SMARTLIST_FOREACH_END(job);
+  tor_assert(idx >= 0);
+
+  victim = smartlist_get(cpuworker_intros_pending, idx);
+  smartlist_del_keeporder(cpuworker_intros_pending, idx);
+  log_info(LD_REND, "Too many INTRODUCE2 cells waiting for a CPU worker; "
+           "dropping the oldest of the %d for the busiest service.",
+           (int)busiest_count);
+  cpuworker_job_free(victim);
+}
+
+/** Try to have a worker thread decrypt <b>request</b>, an INTRODUCE2 cell
+ * body of <b>request_len</b> bytes (at most RELAY_PAYLOAD_SIZE), with
+ * <b>intro_key</b>, for the service whose public key has digest
+ * <b>rend_pk_digest</b>.  When it's done, we'll call
+ * rend_service_introduce_done().  Return 0 if we queued it, or -1 if the
+ * caller should do the work itself.  Queuing may drop some other waiting
+ * introduction; see CPUWORKER_MAX_PENDING_INTROS.
+ */
+int
+assign_rend_introduce_to_cpuworker(const char *rend_pk_digest,
+                                   crypto_pk_t *intro_key,
+                                   const uint8_t *request,
+                                   size_t request_len)
+{
+  cpuworker_job_t *job;
+  cpuworker_intro_t *intro;
+
+  if (!cpuworker_lock || !cpuworker_threads_wanted)
+    return -1; /* We aren't running the thread pool. */
+  tor_assert(request_len <= RELAY_PAYLOAD_SIZE);
+
+  if (!cpuworker_intros_pending)
+    cpuworker_intros_pending = smartlist_new();
+  if (smartlist_len(cpuworker_intros_pending) >=
+      CPUWORKER_MAX_PENDING_INTROS)
+    cpuworker_drop_pending_intro();
+
+  job = cpuworker_job_new(CPUWORKER_TASK_REND_INTRODUCE, 0);
+  job->intro = intro = tor_malloc_zero(sizeof(cpuworker_intro_t));
+  memcpy(intro->rend_pk_digest, rend_pk_digest, DIGEST_LEN);
+  intro->intro_key = crypto_pk_dup_key(intro_key);
+  memcpy(intro->request, request, request_len);
+  intro->request_len = request_len;
+  intro->severity = LOG_PROTOCOL_WARN;
+  smartlist_add(cpuworker_intros_pending, job);
+
+  cpuworker_maybe_resize(1);
+  process_pending_intros();
+  return 0;
+}
+
+#else
+
 /** Called when the onion key has changed and we need to spawn new
  * cpuworkers.  Close all currently idle cpuworkers, and mark the last
  * rotation time as now.
@@ -129,13 +1092,7 @@ connection_cpu_reached_eof(connection_t *conn)
 int
 connection_cpu_process_inbuf(connection_t *conn)
 {
-  char success;
   char buf[LEN_ONION_RESPONSE];
-  uint64_t conn_id;
-  circid_t circ_id;
-  connection_t *tmp_conn;
-  or_connection_t *p_conn = NULL;
-  circuit_t *circ;
 
   tor_assert(conn);
   tor_assert(conn->type == CONN_TYPE_CPUWORKER);
@@ -148,50 +1105,12 @@ connection_cpu_process_inbuf(connection_t *conn)
       return 0; /* not yet */
     tor_assert(connection_get_inbuf_len(conn) == LEN_ONION_RESPONSE);
 
-    connection_fetch_from_buf(&success,1,conn);
-    connection_fetch_from_buf(buf,LEN_ONION_RESPONSE-1,conn);
-
-    /* parse out the circ it was talking about */
-    tag_unpack(buf, &conn_id, &circ_id);
-    circ = NULL;
-    tmp_conn = connection_get_by_global_id(conn_id);
-    if (tmp_conn && !tmp_conn->marked_for_close &&
-        tmp_conn->type == CONN_TYPE_OR)
-      p_conn = TO_OR_CONN(tmp_conn);
-
-    if (p_conn)
-      circ = circuit_get_by_circid_orconn(circ_id, p_conn);
-
-    if (success == 0) {
-      log_debug(LD_OR,
-                "decoding onionskin failed. "
-                "(Old key or bad software.) Closing.");
-      if (circ)
-        circuit_mark_for_close(circ, END_CIRC_REASON_TORPROTOCOL);
-      goto done_processing;
-    }
-    if (!circ) {
-      /* This happens because somebody sends us a destroy cell and the
-       * circuit goes away, while the cpuworker is working. This is also
-       * why our tag doesn't include a pointer to the circ, because we'd
-       * never know if it's still valid.
-       */
-      log_debug(LD_OR,"processed onion for a circ that's gone. Dropping.");
-      goto done_processing;
-    }
-    tor_assert(! CIRCUIT_IS_ORIGIN(circ));
-    if (onionskin_answer(TO_OR_CIRCUIT(circ), CELL_CREATED, buf+TAG_LEN,
-                         buf+TAG_LEN+ONIONSKIN_REPLY_LEN) < 0) {
-      log_warn(LD_OR,"onionskin_answer failed. Closing.");
-      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
-      goto done_processing;
-    }
-    log_debug(LD_OR,"onionskin_answer succeeded. Yay.");
+    connection_fetch_from_buf(buf,LEN_ONION_RESPONSE,conn);
+    cpuworker_handle_response(buf);
   } else {
     tor_assert(0); /* don't ask me to do handshakes yet */
   }
 
- done_processing:
   conn->state = CPUWORKER_STATE_IDLE;
   num_cpuworkers_busy--;
   if (conn->timestamp_created < last_rotation_time) {
@@ -229,8 +1148,6 @@ cpuworker_main(void *data)
   tor_socket_t fd;
 
   /* variables for onion processing */
-  char keys[CPATH_KEY_MATERIAL_LEN];
-  char reply_to_proxy[ONIONSKIN_REPLY_LEN];
   char buf[LEN_ONION_RESPONSE];
   char tag[TAG_LEN];
   crypto_pk_t *onion_key = NULL, *last_onion_key = NULL;
@@ -278,22 +1195,8 @@ cpuworker_main(void *data)
     }
 
     if (question_type == CPUWORKER_TASK_ONION) {
-      if (onion_skin_server_handshake(question, onion_key, last_onion_key,
-          reply_to_proxy, keys, CPATH_KEY_MATERIAL_LEN) < 0) {
-        /* failure */
-        log_debug(LD_OR,"onion_skin_server_handshake failed.");
-        *buf = 0; /* indicate failure in first byte */
-        memcpy(buf+1,tag,TAG_LEN);
-        /* send all zeros as answer */
-        memset(buf+1+TAG_LEN, 0, LEN_ONION_RESPONSE-(1+TAG_LEN));
-      } else {
-        /* success */
-        log_debug(LD_OR,"onion_skin_server_handshake succeeded.");
-        buf[0] = 1; /* 1 means success */
-        memcpy(buf+1,tag,TAG_LEN);
-        memcpy(buf+1+TAG_LEN,reply_to_proxy,ONIONSKIN_REPLY_LEN);
-        memcpy(buf+1+TAG_LEN+ONIONSKIN_REPLY_LEN,keys,CPATH_KEY_MATERIAL_LEN);
-      }
+      cpuworker_answer_onionskin(tag, question, onion_key, last_onion_key,
+                                 buf);
       if (write_all(fd, buf, LEN_ONION_RESPONSE, 1) != LEN_ONION_RESPONSE) {
         log_err(LD_BUG,"writing response buf failed. Exiting.");
         goto end;
@@ -367,12 +1270,7 @@ spawn_cpuworker(void)
 static void
 spawn_enough_cpuworkers(void)
 {
-  int num_cpuworkers_needed = get_num_cpus(get_options());
-
-  if (num_cpuworkers_needed < MIN_CPUWORKERS)
-    num_cpuworkers_needed = MIN_CPUWORKERS;
-  if (num_cpuworkers_needed > MAX_CPUWORKERS)
-    num_cpuworkers_needed = MAX_CPUWORKERS;
+  int num_cpuworkers_needed = get_num_cpuworkers_needed();
 
   while (num_cpuworkers < num_cpuworkers_needed) {
     if (spawn_cpuworker() < 0) {
@@ -389,14 +1287,17 @@ process_pending_task(connection_t *cpuworker)
 {
   or_circuit_t *circ;
   char *onionskin = NULL;
+  uint64_t received;
 
   tor_assert(cpuworker);
 
   /* for now only process onion tasks */
 
-  circ = onion_next_task(&onionskin);
+  circ = onion_next_task(&onionskin, &received);
   if (!circ)
     return;
+  rep_hist_note_onionskin_timing(
+                         (long)((tor_monotime_nsec() - received) / 1000), -1);
   if (assign_onionskin_to_cpuworker(cpuworker, circ, onionskin))
     log_warn(LD_OR,"assign_to_cpuworker failed. Ignoring.");
 }
@@ -416,11 +1317,10 @@ static void
 cull_wedged_cpuworkers(void)
 {
   time_t now = time(NULL);
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_CPUWORKER);
   SMARTLIST_FOREACH(conns, connection_t *, conn,
   {
     if (!conn->marked_for_close &&
-        conn->type == CONN_TYPE_CPUWORKER &&
         conn->state == CPUWORKER_STATE_BUSY_ONION &&
         conn->timestamp_lastwritten + CPUWORKER_BUSY_TIMEOUT < now) {
       log_notice(LD_BUG,
@@ -500,3 +1400,46 @@ assign_onionskin_to_cpuworker(connection_t *cpuworker,
   return 0;
 }
 
+/** Without the thread pool, we do TLS handshakes in the main thread. */
+int
+assign_tls_handshake_to_cpuworker(or_connection_t *conn)
+{
+  (void)conn;
+  return -1;
+}
+
+/** Without the thread pool, no worker has any connection's TLS. */
+void
+cpuworkers_reclaim_tls_handshakes(void)
+{
+}
+
+/** Without the thread pool, clients do circuit handshakes in the main
+ * thread. */
+int
+assign_client_handshake_to_cpuworker(origin_circuit_t *circ,
+                                     crypt_path_t *hop,
+                                     const uint8_t *reply)
+{
+  (void)circ;
+  (void)hop;
+  (void)reply;
+  return -1;
+}
+
+/** Without the thread pool, hidden services decrypt INTRODUCE2 cells in
+ * the main thread. */
+int
+assign_rend_introduce_to_cpuworker(const char *rend_pk_digest,
+                                   crypto_pk_t *intro_key,
+                                   const uint8_t *request,
+                                   size_t request_len)
+{
+  (void)rend_pk_digest;
+  (void)intro_key;
+  (void)request;
+  (void)request_len;
+  return -1;
+}
+
+#endif
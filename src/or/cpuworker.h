@@ -12,6 +12,9 @@
 #ifndef _TOR_CPUWORKER_H
 #define _TOR_CPUWORKER_H
 
+/** The maximum number of cpuworker processes we will keep around. */
+#define MAX_CPUWORKERS 128
+
 void cpu_init(void);
 void cpuworkers_rotate(void);
 int connection_cpu_finished_flushing(connection_t *conn);
@@ -20,6 +23,15 @@ int connection_cpu_process_inbuf(connection_t *conn);
 int assign_onionskin_to_cpuworker(connection_t *cpuworker,
                                   or_circuit_t *circ,
                                   char *onionskin);
+int assign_tls_handshake_to_cpuworker(or_connection_t *conn);
+void cpuworkers_reclaim_tls_handshakes(void);
+int assign_client_handshake_to_cpuworker(origin_circuit_t *circ,
+                                         crypt_path_t *hop,
+                                         const uint8_t *reply);
+int assign_rend_introduce_to_cpuworker(const char *rend_pk_digest,
+                                       crypto_pk_t *intro_key,
+                                       const uint8_t *request,
+                                       size_t request_len);
 
 #endif
 
@@ -3,12 +3,15 @@
  * Copyright (c) 2007-2012, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define DIRECTORY_PRIVATE
+
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -108,6 +111,9 @@ static void directory_initiate_command_rend(const char *address,
 #define ALLOW_DIRECTORY_TIME_SKEW (30*60)
 
 #define X_ADDRESS_HEADER "X-Your-Address-Is: "
+/** HTTP header listing the hex SHA256 digests of the consensuses a client
+ * would accept a diff from. */
+#define X_DIFF_FROM_HEADER "X-Or-Diff-From-Consensus: "
 
 /** HTTP cache control: how long do we tell proxies they can cache each
  * kind of document we serve? */
@@ -1195,6 +1201,15 @@ directory_send_command(dir_connection_t *conn,
                                         resource);
       log_info(LD_DIR, "Downloading consensus from %s using %s",
                hoststring, url);
+      {
+        const char *diff_base =
+          networkstatus_get_consensus_diff_base(resource ? resource : "ns");
+        if (diff_base) {
+          char hex[HEX_DIGEST256_LEN+1];
+          base16_encode(hex, sizeof(hex), diff_base, DIGEST256_LEN);
+          smartlist_add_asprintf(headers, X_DIFF_FROM_HEADER "%s\r\n", hex);
+        }
+      }
       break;
     case DIR_PURPOSE_FETCH_CERTIFICATE:
       tor_assert(resource);
@@ -1479,16 +1494,13 @@ parse_http_response(const char *headers, int *code, time_t *date,
       if (!strcmpstart(s, "Content-Encoding: ")) {
         enc = s+18; break;
       });
-    if (!enc || !strcmp(enc, "identity")) {
+    if (!enc) {
       *compression = NO_METHOD;
-    } else if (!strcmp(enc, "deflate") || !strcmp(enc, "x-deflate")) {
-      *compression = ZLIB_METHOD;
-    } else if (!strcmp(enc, "gzip") || !strcmp(enc, "x-gzip")) {
-      *compression = GZIP_METHOD;
     } else {
-      log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to deal.",
-               escaped(enc));
-      *compression = UNKNOWN_METHOD;
+      *compression = compression_method_get_by_name(enc);
+      if (*compression == UNKNOWN_METHOD)
+        log_info(LD_HTTP, "Unrecognized content encoding: %s. Trying to "
+                 "deal.", escaped(enc));
     }
   }
   SMARTLIST_FOREACH(parsed_headers, char *, s, tor_free(s));
@@ -1564,6 +1576,210 @@ load_downloaded_routers(const char *body, smartlist_t *which,
   return added;
 }
 
+/** Return true iff a client fetch with purpose <b>purpose</b> can use a
+ * partial body: we'd rather have some descriptors than none. */
+static int
+dir_purpose_allows_partial(int purpose)
+{
+  return (purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
+          purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
+          purpose == DIR_PURPOSE_FETCH_MICRODESC);
+}
+
+/** Return true iff, for a client fetch with purpose <b>purpose</b>, we
+ * should take the response body off the inbuf (and decompress it) as it
+ * arrives, rather than waiting for EOF.  These are the fetches big enough
+ * for it to matter. */
+static int
+dir_purpose_reads_body_early(int purpose)
+{
+  return (purpose == DIR_PURPOSE_FETCH_CONSENSUS ||
+          dir_purpose_allows_partial(purpose));
+}
+
+/** Make sure that <b>conn</b>'s response body has room for <b>n</b> more
+ * bytes plus a terminating NUL. */
+static void
+dir_response_body_reserve(dir_connection_t *conn, size_t n)
+{
+  size_t want = conn->response_body_len + n + 1;
+  size_t alloc = conn->response_body_alloc;
+  if (want <= alloc)
+    return;
+  if (alloc < 4096)
+    alloc = 4096;
+  while (alloc < want)
+    alloc *= 2;
+  conn->response_body = tor_realloc(conn->response_body, alloc);
+  conn->response_body_alloc = alloc;
+}
+
+/** Run the <b>in_len</b> compressed bytes at <b>in</b> through
+ * <b>conn</b>'s response zlib object, appending the output to its response
+ * body.  Return 0 on success, -1 if the data is corrupt. */
+static int
+dir_response_body_uncompress(dir_connection_t *conn,
+                             const char *in, size_t in_len)
+{
+  tor_zlib_output_t r;
+  char *out;
+  size_t out_len;
+
+  while (1) {
+    if (conn->response_zlib_done) {
+      if (!in_len)
+        return 0;
+      /* There may be more compressed data here, as tor_gzip_uncompress()
+       * allows. */
+      tor_zlib_free(conn->response_zlib_state);
+      conn->response_zlib_state =
+        tor_zlib_new(0, conn->response_compression, HIGH_COMPRESSION);
+      if (!conn->response_zlib_state)
+        return -1;
+      conn->response_zlib_done = 0;
+    }
+    dir_response_body_reserve(conn, in_len < 1024 ? 1024 : in_len*2);
+    out = conn->response_body + conn->response_body_len;
+    out_len = conn->response_body_alloc - conn->response_body_len - 1;
+    r = tor_zlib_process(conn->response_zlib_state, &out, &out_len,
+                         &in, &in_len, 0);
+    conn->response_body_len = out - conn->response_body;
+    switch (r) {
+      case TOR_ZLIB_DONE:
+        conn->response_zlib_done = 1;
+        break;
+      case TOR_ZLIB_ERR:
+        return -1;
+      case TOR_ZLIB_OK:
+        if (!in_len)
+          return 0;
+        break;
+      case TOR_ZLIB_BUF_FULL:
+        break;
+    }
+  }
+}
+
+/** We are a client fetching a large object on <b>conn</b>: take the HTTP
+ * headers and as much of the body as has arrived off its inbuf.  If the
+ * server says the body is compressed, and it looks that way, decompress it
+ * as we go, so that the decompression overlaps the rest of the download and
+ * we never hold the whole compressed body.  Otherwise, just collect the body
+ * for connection_dir_client_reached_eof() to handle as before.  If
+ * <b>finish</b>, we've reached EOF and there is no more data coming.
+ *
+ * Return 0 on success (including "headers not all here yet"), or -1 if the
+ * response is too large or corrupt and the caller should close the
+ * connection. */
+int
+connection_dir_client_read_body(dir_connection_t *conn, int finish)
+{
+  char chunk[4096];
+  size_t n;
+
+  if (!conn->response_headers) {
+    int status_code;
+    compress_method_t compression;
+    char *content_length;
+    switch (connection_fetch_from_buf_http(TO_CONN(conn),
+                                &conn->response_headers, MAX_HEADERS_SIZE,
+                                NULL, NULL, MAX_DIR_DL_SIZE, 1)) {
+      case -1:
+        log_warn(LD_PROTOCOL,
+                 "'fetch' response too large (server '%s:%d'). Closing.",
+                 conn->_base.address, conn->_base.port);
+        return -1;
+      case 0:
+        return 0;
+    }
+    conn->response_content_length = -1;
+    content_length = http_get_header(conn->response_headers,
+                                     "Content-Length: ");
+    if (content_length) {
+      int i = atoi(content_length);
+      tor_free(content_length);
+      if (i < 0) {
+        log_warn(LD_PROTOCOL, "Content-Length is less than zero; it looks "
+                 "like someone is trying to crash us.");
+        return -1;
+      }
+      conn->response_content_length = i;
+    }
+    /* Only decompress successful answers; we leave everything else for
+     * connection_dir_client_reached_eof() to judge. */
+    conn->response_compression = NO_METHOD;
+    if (parse_http_response(conn->response_headers, &status_code, NULL,
+                            &compression, NULL) == 0 &&
+        status_code == 200 &&
+        (compression == ZLIB_METHOD || compression == GZIP_METHOD))
+      conn->response_compression = compression;
+  }
+
+  while ((n = connection_get_inbuf_len(TO_CONN(conn)))) {
+    if (conn->response_content_length >= 0) {
+      size_t left = conn->response_content_length - conn->response_raw_len;
+      if (!left)
+        break; /* Ignore anything past the declared length. */
+      n = MIN(n, left);
+    }
+    /* Don't commit to a compression method until we can look at the first
+     * bytes of the body. */
+    if (conn->response_compression != NO_METHOD &&
+        !conn->response_zlib_state && n < 3 && !finish)
+      return 0;
+    n = MIN(n, sizeof(chunk));
+    if (conn->response_raw_len + n >= MAX_DIR_DL_SIZE) {
+      log_warn(LD_PROTOCOL,
+               "'fetch' response too large (server '%s:%d'). Closing.",
+               conn->_base.address, conn->_base.port);
+      return -1;
+    }
+    connection_fetch_from_buf(chunk, n, TO_CONN(conn));
+    if (conn->response_compression != NO_METHOD &&
+        !conn->response_zlib_state) {
+      if (!conn->response_raw_len &&
+          detect_compression_method(chunk, n) == conn->response_compression)
+        conn->response_zlib_state =
+          tor_zlib_new(0, conn->response_compression, HIGH_COMPRESSION);
+      if (!conn->response_zlib_state)
+        conn->response_compression = NO_METHOD;
+    }
+    conn->response_raw_len += n;
+    if (conn->response_zlib_state) {
+      if (dir_response_body_uncompress(conn, chunk, n) < 0) {
+        log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+               "Unable to decompress HTTP body (server '%s:%d').",
+               conn->_base.address, conn->_base.port);
+        return -1;
+      }
+    } else {
+      dir_response_body_reserve(conn, n);
+      memcpy(conn->response_body + conn->response_body_len, chunk, n);
+      conn->response_body_len += n;
+    }
+  }
+
+  if (finish) {
+    if (conn->response_zlib_state && !conn->response_zlib_done &&
+        !dir_purpose_allows_partial(conn->_base.purpose)) {
+      log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+             "Truncated compressed HTTP body (server '%s:%d').",
+             conn->_base.address, conn->_base.port);
+      return -1;
+    }
+    if (conn->response_content_length >= 0 &&
+        conn->response_raw_len < (size_t)conn->response_content_length &&
+        !dir_purpose_allows_partial(conn->_base.purpose)) {
+      log_info(LD_HTTP,
+               "'fetch' response not all here, but we're at eof. Closing.");
+      return -1;
+    }
+    dir_response_body_reserve(conn, 0);
+    conn->response_body[conn->response_body_len] = '\0';
+  }
+  return 0;
+}
+
 /** We are a client, and we've finished reading the server's
  * response. Parse it and act appropriately.
  *
@@ -1586,28 +1802,41 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   compress_method_t compression;
   int plausible;
   int skewed=0;
-  int allow_partial = (conn->_base.purpose == DIR_PURPOSE_FETCH_SERVERDESC ||
-                       conn->_base.purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
-                       conn->_base.purpose == DIR_PURPOSE_FETCH_MICRODESC);
-  int was_compressed=0;
+  int allow_partial = dir_purpose_allows_partial(conn->_base.purpose);
+  int was_compressed=0, streamed=0;
   time_t now = time(NULL);
 
-  switch (connection_fetch_from_buf_http(TO_CONN(conn),
-                              &headers, MAX_HEADERS_SIZE,
-                              &body, &body_len, MAX_DIR_DL_SIZE,
-                              allow_partial)) {
-    case -1: /* overflow */
-      log_warn(LD_PROTOCOL,
-               "'fetch' response too large (server '%s:%d'). Closing.",
-               conn->_base.address, conn->_base.port);
-      return -1;
-    case 0:
-      log_info(LD_HTTP,
-               "'fetch' response not all here, but we're at eof. Closing.");
+  if (conn->response_headers) {
+    /* We've been taking the body off the inbuf as it arrived. */
+    if (connection_dir_client_read_body(conn, 1) < 0)
       return -1;
-    /* case 1, fall through */
+    headers = conn->response_headers;
+    body = conn->response_body;
+    body_len = conn->response_body_len;
+    orig_len = conn->response_raw_len;
+    streamed = conn->response_zlib_state != NULL;
+    conn->response_headers = conn->response_body = NULL;
+    conn->response_body_len = conn->response_body_alloc = 0;
+    tor_zlib_free(conn->response_zlib_state);
+    conn->response_zlib_state = NULL;
+  } else {
+    switch (connection_fetch_from_buf_http(TO_CONN(conn),
+                                &headers, MAX_HEADERS_SIZE,
+                                &body, &body_len, MAX_DIR_DL_SIZE,
+                                allow_partial)) {
+      case -1: /* overflow */
+        log_warn(LD_PROTOCOL,
+                 "'fetch' response too large (server '%s:%d'). Closing.",
+                 conn->_base.address, conn->_base.port);
+        return -1;
+      case 0:
+        log_info(LD_HTTP,
+                 "'fetch' response not all here, but we're at eof. Closing.");
+        return -1;
+      /* case 1, fall through */
+    }
+    orig_len = body_len;
   }
-  orig_len = body_len;
 
   if (parse_http_response(headers, &status_code, &date_header,
                           &compression, &reason) < 0) {
@@ -1684,7 +1913,9 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
   }
 
   plausible = body_is_plausible(body, body_len, conn->_base.purpose);
-  if (compression != NO_METHOD || !plausible) {
+  if (streamed) {
+    was_compressed = 1;
+  } else if (compression != NO_METHOD || !plausible) {
     char *new_body = NULL;
     size_t new_len = 0;
     compress_method_t guessed = detect_compression_method(body, body_len);
@@ -1827,6 +2058,23 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       networkstatus_consensus_download_failed(status_code, flavname);
       return -1;
     }
+    if (consdiff_looks_like_diff(body)) {
+      char *full = networkstatus_apply_consensus_diff(flavname, body);
+      if (!full) {
+        log_info(LD_DIR, "Unable to apply %s consensus diff from server "
+                 "'%s:%d'. I'll fetch the full consensus.",
+                 flavname, conn->_base.address, conn->_base.port);
+        tor_free(body); tor_free(headers); tor_free(reason);
+        networkstatus_consensus_download_failed(0, flavname);
+        return -1;
+      }
+      log_info(LD_DIR, "Received %s consensus diff (size %d) from server "
+               "'%s:%d'", flavname, (int)body_len, conn->_base.address,
+               conn->_base.port);
+      tor_free(body);
+      body = full;
+      body_len = strlen(body);
+    }
     log_info(LD_DIR,"Received consensus directory (size %d) from server "
              "'%s:%d'", (int)body_len, conn->_base.address, conn->_base.port);
     if ((r=networkstatus_set_current_consensus(body, flavname, 0))<0) {
@@ -1950,6 +2198,8 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       tor_free(body); tor_free(headers); tor_free(reason);
       return dir_okay ? 0 : -1;
     }
+    if (descriptor_digests && !was_ei)
+      router_note_descriptor_request_time(now - conn->_base.timestamp_created);
     /* Learn the routers, assuming we requested by fingerprint or "all"
      * or "authority".
      *
@@ -2016,6 +2266,7 @@ connection_dir_client_reached_eof(dir_connection_t *conn)
       return 0;
     } else {
       smartlist_t *mds;
+      router_note_descriptor_request_time(now - conn->_base.timestamp_created);
       mds = microdescs_add_to_cache(get_microdesc_cache(),
                                     body, body+body_len, SAVED_NOWHERE, 0,
                                     now, which);
@@ -2309,6 +2560,16 @@ connection_dir_process_inbuf(dir_connection_t *conn)
     return -1;
   }
 
+  /* Clients fetching large objects handle the body as it arrives. */
+  if (conn->_base.state == DIR_CONN_STATE_CLIENT_READING &&
+      dir_purpose_reads_body_early(conn->_base.purpose)) {
+    if (connection_dir_client_read_body(conn, 0) < 0) {
+      connection_mark_for_close(TO_CONN(conn));
+      return -1;
+    }
+    return 0;
+  }
+
   if (!conn->_base.inbuf_reached_eof)
     log_debug(LD_HTTP,"Got data, not eof. Leaving on inbuf.");
   return 0;
@@ -2425,6 +2686,14 @@ write_http_response_header_impl(dir_connection_t *conn, ssize_t length,
   connection_write_to_buf(tmp, strlen(tmp), TO_CONN(conn));
 }
 
+/** Return the compression level to use for a response that we compress on
+ * the fly. */
+static compression_level_t
+choose_compression_level(void)
+{
+  return get_options()->_DirCompressionLevel;
+}
+
 /** As write_http_response_header_impl, but sets encoding and content-typed
  * based on whether the response will be <b>compressed</b> or not. */
 static void
@@ -2433,7 +2702,8 @@ write_http_response_header(dir_connection_t *conn, ssize_t length,
 {
   write_http_response_header_impl(conn, length,
                           compressed?"application/octet-stream":"text/plain",
-                          compressed?"deflate":"identity",
+                          compression_method_get_name(
+                                     compressed ? ZLIB_METHOD : NO_METHOD),
                              NULL,
                              cache_lifetime);
 }
@@ -2617,608 +2887,670 @@ client_likes_consensus(networkstatus_t *v, const char *want_url)
   return (have >= need_at_least);
 }
 
-/** Helper function: called when a dirserver gets a complete HTTP GET
- * request.  Look for a request for a directory or for a rendezvous
- * service descriptor.  On finding one, write a response into
- * conn-\>outbuf.  If the request is unrecognized, send a 400.
- * Always return 0. */
-static int
-directory_handle_command_get(dir_connection_t *conn, const char *headers,
-                             const char *req_body, size_t req_body_len)
+/** If <b>headers</b> ask for a diff from a consensus of type
+ * <b>flavor_name</b> that we still remember, return that diff.  Otherwise
+ * return NULL. */
+static cached_dir_t *
+lookup_requested_consensus_diff(const char *headers, const char *flavor_name)
 {
-  size_t dlen;
-  char *url, *url_mem, *header;
-  const or_options_t *options = get_options();
-  time_t if_modified_since = 0;
-  int compressed;
-  size_t url_len;
-
-  /* We ignore the body of a GET request. */
-  (void)req_body;
-  (void)req_body_len;
+  char *header;
+  smartlist_t *hexes;
+  cached_dir_t *diff = NULL;
+  char digest[DIGEST256_LEN];
+
+  if (!(header = http_get_header(headers, X_DIFF_FROM_HEADER)))
+    return NULL;
+  hexes = smartlist_new();
+  smartlist_split_string(hexes, header, ",",
+                         SPLIT_SKIP_SPACE|SPLIT_IGNORE_BLANK, 8);
+  SMARTLIST_FOREACH(hexes, char *, hex, {
+      if (!diff && strlen(hex) == HEX_DIGEST256_LEN &&
+          base16_decode(digest, sizeof(digest), hex, HEX_DIGEST256_LEN) == 0)
+        diff = dirserv_get_consensus_diff(flavor_name, digest);
+      tor_free(hex);
+    });
+  smartlist_free(hexes);
+  tor_free(header);
+  return diff;
+}
 
-  log_debug(LD_DIRSERV,"Received GET command.");
+/** Arguments for each of the handlers that directory_handle_command_get()
+ * dispatches to. */
+typedef struct get_handler_args_t {
+  /** The requested URL, with any ".z" suffix removed. */
+  const char *url;
+  /** The headers of the request. */
+  const char *headers;
+  /** The time given in the If-Modified-Since header, or 0. */
+  time_t if_modified_since;
+  /** True iff the client asked for a compressed answer. */
+  int compressed;
+} get_handler_args_t;
 
-  conn->_base.state = DIR_CONN_STATE_SERVER_WRITING;
+/** Helper for directory_handle_command_get: answer a GET request for
+ * a v1 directory ("/tor/" or "/tor/dir"). */
+static int
+handle_get_v1_dir(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  int compressed = args->compressed;
+  time_t if_modified_since = args->if_modified_since;
+  size_t dlen;
+  cached_dir_t *d = dirserv_get_directory();
 
-  if (parse_http_url(headers, &url) < 0) {
-    write_http_status_line(conn, 400, "Bad request");
+  if (!d) {
+    log_info(LD_DIRSERV,"Client asked for the mirrored directory, but we "
+             "don't have a good one yet. Sending 503 Dir not available.");
+    write_http_status_line(conn, 503, "Directory unavailable");
     return 0;
   }
-  if ((header = http_get_header(headers, "If-Modified-Since: "))) {
-    struct tm tm;
-    if (parse_http_time(header, &tm) == 0) {
-      if_modified_since = tor_timegm(&tm);
-    }
-    /* The correct behavior on a malformed If-Modified-Since header is to
-     * act as if no If-Modified-Since header had been given. */
-    tor_free(header);
+  if (d->published < if_modified_since) {
+    write_http_status_line(conn, 304, "Not modified");
+    return 0;
   }
-  log_debug(LD_DIRSERV,"rewritten url as '%s'.", url);
 
-  url_mem = url;
-  url_len = strlen(url);
-  compressed = url_len > 2 && !strcmp(url+url_len-2, ".z");
-  if (compressed) {
-    url[url_len-2] = '\0';
-    url_len -= 2;
+  dlen = compressed ? d->dir_z_len : d->dir_len;
+
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
+    log_debug(LD_DIRSERV,
+             "Client asked for the mirrored directory, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    return 0;
   }
 
-  if (!strcmp(url,"/tor/")) {
-    const char *frontpage = get_dirportfrontpage();
+  note_request(url, dlen);
+
+  log_debug(LD_DIRSERV,"Dumping %sdirectory to client.",
+            compressed?"compressed ":"");
+  write_http_response_header(conn, dlen, compressed,
+                        FULL_DIR_CACHE_LIFETIME);
+  conn->cached_dir = d;
+  conn->cached_dir_offset = 0;
+  if (!compressed)
+    conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+  ++d->refcnt;
+
+  /* Prime the connection with some data. */
+  conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+  connection_dirserv_flushed_some(conn);
+  return 0;
+}
 
-    if (frontpage) {
-      dlen = strlen(frontpage);
-      /* Let's return a disclaimer page (users shouldn't use V1 anymore,
-         and caches don't fetch '/', so this is safe). */
+/** Helper for directory_handle_command_get: answer a GET request for
+ * "/tor/" with our DirPortFrontPage, or with a v1 directory if we don't
+ * have one. */
+static int
+handle_get_frontpage(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *frontpage = get_dirportfrontpage();
+
+  if (frontpage) {
+    size_t dlen = strlen(frontpage);
+    /* Let's return a disclaimer page (users shouldn't use V1 anymore,
+       and caches don't fetch '/', so this is safe). */
+
+    /* [We don't check for write_bucket_low here, since we want to serve
+     *  this page no matter what.] */
+    note_request(args->url, dlen);
+    write_http_response_header_impl(conn, dlen, "text/html", "identity",
+                                    NULL, DIRPORTFRONTPAGE_CACHE_LIFETIME);
+    connection_write_to_buf(frontpage, dlen, TO_CONN(conn));
+    return 0;
+  }
+  /* if no disclaimer file, serve the v1 directory instead. */
+  return handle_get_v1_dir(conn, args);
+}
 
-      /* [We don't check for write_bucket_low here, since we want to serve
-       *  this page no matter what.] */
-      note_request(url, dlen);
-      write_http_response_header_impl(conn, dlen, "text/html", "identity",
-                                      NULL, DIRPORTFRONTPAGE_CACHE_LIFETIME);
-      connection_write_to_buf(frontpage, dlen, TO_CONN(conn));
-      goto done;
-    }
-    /* if no disclaimer file, fall through and continue */
+/** Helper for directory_handle_command_get: answer a GET request for
+ * the running-routers list. */
+static int
+handle_get_running_routers(dir_connection_t *conn,
+                           const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  int compressed = args->compressed;
+  time_t if_modified_since = args->if_modified_since;
+  size_t dlen;
+  cached_dir_t *d = dirserv_get_runningrouters();
+  if (!d) {
+    write_http_status_line(conn, 503, "Directory unavailable");
+    return 0;
+  }
+  if (d->published < if_modified_since) {
+    write_http_status_line(conn, 304, "Not modified");
+    return 0;
   }
+  dlen = compressed ? d->dir_z_len : d->dir_len;
 
-  if (!strcmp(url,"/tor/") || !strcmp(url,"/tor/dir")) { /* v1 dir fetch */
-    cached_dir_t *d = dirserv_get_directory();
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
+    log_info(LD_DIRSERV,
+             "Client asked for running-routers, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    return 0;
+  }
+  note_request(url, dlen);
+  write_http_response_header(conn, dlen, compressed,
+               RUNNINGROUTERS_CACHE_LIFETIME);
+  connection_write_to_buf(compressed ? d->dir_z : d->dir, dlen,
+                          TO_CONN(conn));
+  return 0;
+}
 
-    if (!d) {
-      log_info(LD_DIRSERV,"Client asked for the mirrored directory, but we "
-               "don't have a good one yet. Sending 503 Dir not available.");
-      write_http_status_line(conn, 503, "Directory unavailable");
-      goto done;
-    }
-    if (d->published < if_modified_since) {
-      write_http_status_line(conn, 304, "Not modified");
-      goto done;
+/** Helper for directory_handle_command_get: answer a GET request for
+ * a v2 networkstatus or the current v3 consensus. */
+static int
+handle_get_networkstatus(dir_connection_t *conn,
+                         const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  const char *headers = args->headers;
+  int compressed = args->compressed;
+  time_t if_modified_since = args->if_modified_since;
+  size_t dlen;
+  /* v2 or v3 network status fetch. */
+  smartlist_t *dir_fps = smartlist_new();
+  int is_v3 = !strcmpstart(url, "/tor/status-vote");
+  geoip_client_action_t act =
+      is_v3 ? GEOIP_CLIENT_NETWORKSTATUS : GEOIP_CLIENT_NETWORKSTATUS_V2;
+  const char *request_type = NULL;
+  const char *key = url + strlen("/tor/status/");
+  long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
+  int diff_flav = -1;
+  cached_dir_t *diff = NULL;
+
+  if (!is_v3) {
+    dirserv_get_networkstatus_v2_fingerprints(dir_fps, key);
+    if (!strcmpstart(key, "fp/"))
+      request_type = compressed?"/tor/status/fp.z":"/tor/status/fp";
+    else if (!strcmpstart(key, "authority"))
+      request_type = compressed?"/tor/status/authority.z":
+        "/tor/status/authority";
+    else if (!strcmpstart(key, "all"))
+      request_type = compressed?"/tor/status/all.z":"/tor/status/all";
+    else
+      request_type = "/tor/status/?";
+  } else {
+    networkstatus_t *v;
+    time_t now = time(NULL);
+    const char *want_fps = NULL;
+    char *flavor = NULL;
+    int flav = FLAV_NS;
+    #define CONSENSUS_URL_PREFIX "/tor/status-vote/current/consensus/"
+    #define CONSENSUS_FLAVORED_PREFIX "/tor/status-vote/current/consensus-"
+    /* figure out the flavor if any, and who we wanted to sign the thing */
+    if (!strcmpstart(url, CONSENSUS_FLAVORED_PREFIX)) {
+      const char *f, *cp;
+      f = url + strlen(CONSENSUS_FLAVORED_PREFIX);
+      cp = strchr(f, '/');
+      if (cp) {
+        want_fps = cp+1;
+        flavor = tor_strndup(f, cp-f);
+      } else {
+        flavor = tor_strdup(f);
+      }
+      flav = networkstatus_parse_flavor_name(flavor);
+      if (flav < 0)
+        flav = FLAV_NS;
+      else
+        diff_flav = flav;
+    } else {
+      diff_flav = FLAV_NS;
+      if (!strcmpstart(url, CONSENSUS_URL_PREFIX))
+        want_fps = url+strlen(CONSENSUS_URL_PREFIX);
     }
 
-    dlen = compressed ? d->dir_z_len : d->dir_len;
+    v = networkstatus_get_latest_consensus_by_flavor(flav);
 
-    if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
-      log_debug(LD_DIRSERV,
-               "Client asked for the mirrored directory, but we've been "
-               "writing too many bytes lately. Sending 503 Dir busy.");
-      write_http_status_line(conn, 503, "Directory busy, try again later");
-      goto done;
+    if (v && want_fps &&
+        !client_likes_consensus(v, want_fps)) {
+      write_http_status_line(conn, 404, "Consensus not signed by sufficient "
+                                        "number of requested authorities");
+      smartlist_free(dir_fps);
+      geoip_note_ns_response(act, GEOIP_REJECT_NOT_ENOUGH_SIGS);
+      tor_free(flavor);
+      return 0;
     }
 
-    note_request(url, dlen);
+    {
+      char *fp = tor_malloc_zero(DIGEST_LEN);
+      if (flavor)
+        strlcpy(fp, flavor, DIGEST_LEN);
+      tor_free(flavor);
+      smartlist_add(dir_fps, fp);
+    }
+    request_type = compressed?"v3.z":"v3";
+    lifetime = (v && v->fresh_until > now) ? v->fresh_until - now : 0;
+  }
 
-    log_debug(LD_DIRSERV,"Dumping %sdirectory to client.",
-              compressed?"compressed ":"");
-    write_http_response_header(conn, dlen, compressed,
-                          FULL_DIR_CACHE_LIFETIME);
-    conn->cached_dir = d;
-    conn->cached_dir_offset = 0;
-    if (!compressed)
-      conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
-    ++d->refcnt;
+  if (!smartlist_len(dir_fps)) { /* we failed to create/cache cp */
+    write_http_status_line(conn, 503, "Network status object unavailable");
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_UNAVAILABLE);
+    return 0;
+  }
 
-    /* Prime the connection with some data. */
-    conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
-    connection_dirserv_flushed_some(conn);
-    goto done;
+  if (!dirserv_remove_old_statuses(dir_fps, if_modified_since)) {
+    write_http_status_line(conn, 404, "Not found");
+    SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_NOT_FOUND);
+    return 0;
+  } else if (!smartlist_len(dir_fps)) {
+    write_http_status_line(conn, 304, "Not modified");
+    SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_NOT_MODIFIED);
+    return 0;
   }
 
-  if (!strcmp(url,"/tor/running-routers")) { /* running-routers fetch */
-    cached_dir_t *d = dirserv_get_runningrouters();
-    if (!d) {
-      write_http_status_line(conn, 503, "Directory unavailable");
-      goto done;
-    }
-    if (d->published < if_modified_since) {
-      write_http_status_line(conn, 304, "Not modified");
-      goto done;
-    }
-    dlen = compressed ? d->dir_z_len : d->dir_len;
+  if (diff_flav >= 0)
+    diff = lookup_requested_consensus_diff(headers,
+                                   networkstatus_get_flavor_name(diff_flav));
+  if (diff)
+    dlen = compressed ? diff->dir_z_len : diff->dir_len;
+  else
+    dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
+    log_debug(LD_DIRSERV,
+             "Client asked for network status lists, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+    smartlist_free(dir_fps);
+    geoip_note_ns_response(act, GEOIP_REJECT_BUSY);
+    return 0;
+  }
 
-    if (global_write_bucket_low(TO_CONN(conn), dlen, 1)) {
-      log_info(LD_DIRSERV,
-               "Client asked for running-routers, but we've been "
-               "writing too many bytes lately. Sending 503 Dir busy.");
-      write_http_status_line(conn, 503, "Directory busy, try again later");
-      goto done;
+  {
+    struct in_addr in;
+    tor_addr_t addr;
+    if (tor_inet_aton((TO_CONN(conn))->address, &in)) {
+      tor_addr_from_ipv4h(&addr, ntohl(in.s_addr));
+      geoip_note_client_seen(act, &addr, time(NULL));
+      geoip_note_ns_response(act, GEOIP_SUCCESS);
+      /* Note that a request for a network status has started, so that we
+       * can measure the download time later on. */
+      if (TO_CONN(conn)->dirreq_id)
+        geoip_start_dirreq(TO_CONN(conn)->dirreq_id, dlen, act,
+                           DIRREQ_TUNNELED);
+      else
+        geoip_start_dirreq(TO_CONN(conn)->global_identifier, dlen, act,
+                           DIRREQ_DIRECT);
     }
-    note_request(url, dlen);
-    write_http_response_header(conn, dlen, compressed,
-                 RUNNINGROUTERS_CACHE_LIFETIME);
-    connection_write_to_buf(compressed ? d->dir_z : d->dir, dlen,
+  }
+
+  if (diff) {
+    /* Diffs are small: send the whole thing now. */
+    write_http_response_header(conn, dlen, compressed, lifetime);
+    connection_write_to_buf(compressed ? diff->dir_z : diff->dir, dlen,
                             TO_CONN(conn));
-    goto done;
+    SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
+    smartlist_free(dir_fps);
+    return 0;
   }
 
-  if (!strcmpstart(url,"/tor/status/")
-      || !strcmpstart(url, "/tor/status-vote/current/consensus")) {
-    /* v2 or v3 network status fetch. */
-    smartlist_t *dir_fps = smartlist_new();
-    int is_v3 = !strcmpstart(url, "/tor/status-vote");
-    geoip_client_action_t act =
-        is_v3 ? GEOIP_CLIENT_NETWORKSTATUS : GEOIP_CLIENT_NETWORKSTATUS_V2;
-    const char *request_type = NULL;
-    const char *key = url + strlen("/tor/status/");
-    long lifetime = NETWORKSTATUS_CACHE_LIFETIME;
-
-    if (!is_v3) {
-      dirserv_get_networkstatus_v2_fingerprints(dir_fps, key);
-      if (!strcmpstart(key, "fp/"))
-        request_type = compressed?"/tor/status/fp.z":"/tor/status/fp";
-      else if (!strcmpstart(key, "authority"))
-        request_type = compressed?"/tor/status/authority.z":
-          "/tor/status/authority";
-      else if (!strcmpstart(key, "all"))
-        request_type = compressed?"/tor/status/all.z":"/tor/status/all";
-      else
-        request_type = "/tor/status/?";
+  // note_request(request_type,dlen);
+  (void) request_type;
+  write_http_response_header(conn, -1, compressed,
+                             smartlist_len(dir_fps) == 1 ? lifetime : 0);
+  conn->fingerprint_stack = dir_fps;
+  if (! compressed)
+    conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD, HIGH_COMPRESSION);
+
+  /* Prime the connection with some data. */
+  conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
+  connection_dirserv_flushed_some(conn);
+  return 0;
+}
+
+/** Helper for directory_handle_command_get: answer a GET request for
+ * a vote, or a pending consensus or set of signatures. */
+static int
+handle_get_status_vote(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  int compressed = args->compressed;
+  /* XXXX If-modified-since is only implemented for the current
+   * consensus: that's probably fine, since it's the only vote document
+   * people fetch much. */
+  int current;
+  ssize_t body_len = 0;
+  ssize_t estimated_len = 0;
+  smartlist_t *items = smartlist_new();
+  smartlist_t *dir_items = smartlist_new();
+  int lifetime = 60; /* XXXX023 should actually use vote intervals. */
+  url += strlen("/tor/status-vote/");
+  current = !strcmpstart(url, "current/");
+  url = strchr(url, '/');
+  tor_assert(url);
+  ++url;
+  if (!strcmp(url, "consensus")) {
+    const char *item;
+    tor_assert(!current); /* handle_get_networkstatus() handles the current
+                           * consensus, since it wants to be spooled. */
+    if ((item = dirvote_get_pending_consensus(FLAV_NS)))
+      smartlist_add(items, (char*)item);
+  } else if (!current && !strcmp(url, "consensus-signatures")) {
+    /* XXXX the spec says that we should implement
+     * current/consensus-signatures too.  It doesn't seem to be needed,
+     * though. */
+    const char *item;
+    if ((item=dirvote_get_pending_detached_signatures()))
+      smartlist_add(items, (char*)item);
+  } else if (!strcmp(url, "authority")) {
+    const cached_dir_t *d;
+    int flags = DGV_BY_ID |
+      (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
+    if ((d=dirvote_get_vote(NULL, flags)))
+      smartlist_add(dir_items, (cached_dir_t*)d);
+  } else {
+    const cached_dir_t *d;
+    smartlist_t *fps = smartlist_new();
+    int flags;
+    if (!strcmpstart(url, "d/")) {
+      url += 2;
+      flags = DGV_INCLUDE_PENDING | DGV_INCLUDE_PREVIOUS;
     } else {
-      networkstatus_t *v;
-      time_t now = time(NULL);
-      const char *want_fps = NULL;
-      char *flavor = NULL;
-      int flav = FLAV_NS;
-      #define CONSENSUS_URL_PREFIX "/tor/status-vote/current/consensus/"
-      #define CONSENSUS_FLAVORED_PREFIX "/tor/status-vote/current/consensus-"
-      /* figure out the flavor if any, and who we wanted to sign the thing */
-      if (!strcmpstart(url, CONSENSUS_FLAVORED_PREFIX)) {
-        const char *f, *cp;
-        f = url + strlen(CONSENSUS_FLAVORED_PREFIX);
-        cp = strchr(f, '/');
-        if (cp) {
-          want_fps = cp+1;
-          flavor = tor_strndup(f, cp-f);
-        } else {
-          flavor = tor_strdup(f);
-        }
-        flav = networkstatus_parse_flavor_name(flavor);
-        if (flav < 0)
-          flav = FLAV_NS;
+      flags = DGV_BY_ID |
+        (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
+    }
+    dir_split_resource_into_fingerprints(url, fps, NULL,
+                                         DSR_HEX|DSR_SORT_UNIQ);
+    SMARTLIST_FOREACH(fps, char *, fp, {
+        if ((d = dirvote_get_vote(fp, flags)))
+          smartlist_add(dir_items, (cached_dir_t*)d);
+        tor_free(fp);
+      });
+    smartlist_free(fps);
+  }
+  if (!smartlist_len(dir_items) && !smartlist_len(items)) {
+    write_http_status_line(conn, 404, "Not found");
+    goto vote_done;
+  }
+  SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
+                    body_len += compressed ? d->dir_z_len : d->dir_len);
+  estimated_len += body_len;
+  SMARTLIST_FOREACH(items, const char *, item, {
+      size_t ln = strlen(item);
+      if (compressed) {
+        estimated_len += ln/2;
       } else {
-        if (!strcmpstart(url, CONSENSUS_URL_PREFIX))
-          want_fps = url+strlen(CONSENSUS_URL_PREFIX);
+        body_len += ln; estimated_len += ln;
       }
+    });
 
-      v = networkstatus_get_latest_consensus_by_flavor(flav);
-
-      if (v && want_fps &&
-          !client_likes_consensus(v, want_fps)) {
-        write_http_status_line(conn, 404, "Consensus not signed by sufficient "
-                                          "number of requested authorities");
-        smartlist_free(dir_fps);
-        geoip_note_ns_response(act, GEOIP_REJECT_NOT_ENOUGH_SIGS);
-        tor_free(flavor);
-        goto done;
-      }
+  if (global_write_bucket_low(TO_CONN(conn), estimated_len, 2)) {
+    write_http_status_line(conn, 503, "Directory busy, try again later.");
+    goto vote_done;
+  }
+  write_http_response_header(conn, body_len ? body_len : -1, compressed,
+               lifetime);
 
-      {
-        char *fp = tor_malloc_zero(DIGEST_LEN);
-        if (flavor)
-          strlcpy(fp, flavor, DIGEST_LEN);
-        tor_free(flavor);
-        smartlist_add(dir_fps, fp);
-      }
-      request_type = compressed?"v3.z":"v3";
-      lifetime = (v && v->fresh_until > now) ? v->fresh_until - now : 0;
+  if (smartlist_len(items)) {
+    if (compressed) {
+      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                      choose_compression_level());
+      SMARTLIST_FOREACH(items, const char *, c,
+               connection_write_to_buf_zlib(c, strlen(c), conn, 0));
+      connection_write_to_buf_zlib("", 0, conn, 1);
+    } else {
+      SMARTLIST_FOREACH(items, const char *, c,
+                       connection_write_to_buf(c, strlen(c), TO_CONN(conn)));
     }
+  } else {
+    SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
+        connection_write_to_buf(compressed ? d->dir_z : d->dir,
+                                compressed ? d->dir_z_len : d->dir_len,
+                                TO_CONN(conn)));
+  }
+ vote_done:
+  smartlist_free(items);
+  smartlist_free(dir_items);
+  return 0;
+}
 
-    if (!smartlist_len(dir_fps)) { /* we failed to create/cache cp */
-      write_http_status_line(conn, 503, "Network status object unavailable");
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_UNAVAILABLE);
-      goto done;
-    }
+/** Helper for directory_handle_command_get: answer a GET request for
+ * microdescriptors by digest. */
+static int
+handle_get_microdesc(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  int compressed = args->compressed;
+  size_t dlen;
+  smartlist_t *fps = smartlist_new();
 
-    if (!dirserv_remove_old_statuses(dir_fps, if_modified_since)) {
-      write_http_status_line(conn, 404, "Not found");
-      SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_NOT_FOUND);
-      goto done;
-    } else if (!smartlist_len(dir_fps)) {
-      write_http_status_line(conn, 304, "Not modified");
-      SMARTLIST_FOREACH(dir_fps, char *, cp, tor_free(cp));
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_NOT_MODIFIED);
-      goto done;
-    }
+  dir_split_resource_into_fingerprints(url+strlen("/tor/micro/d/"),
+                                    fps, NULL,
+                                    DSR_DIGEST256|DSR_BASE64|DSR_SORT_UNIQ);
 
-    dlen = dirserv_estimate_data_size(dir_fps, 0, compressed);
-    if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
-      log_debug(LD_DIRSERV,
-               "Client asked for network status lists, but we've been "
-               "writing too many bytes lately. Sending 503 Dir busy.");
-      write_http_status_line(conn, 503, "Directory busy, try again later");
-      SMARTLIST_FOREACH(dir_fps, char *, fp, tor_free(fp));
-      smartlist_free(dir_fps);
-      geoip_note_ns_response(act, GEOIP_REJECT_BUSY);
-      goto done;
-    }
+  if (!dirserv_have_any_microdesc(fps)) {
+    write_http_status_line(conn, 404, "Not found");
+    SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
+    smartlist_free(fps);
+    return 0;
+  }
+  dlen = dirserv_estimate_microdesc_size(fps, compressed);
+  if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
+    log_info(LD_DIRSERV,
+             "Client asked for server descriptors, but we've been "
+             "writing too many bytes lately. Sending 503 Dir busy.");
+    write_http_status_line(conn, 503, "Directory busy, try again later");
+    SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
+    smartlist_free(fps);
+    return 0;
+  }
 
-    {
-      struct in_addr in;
-      tor_addr_t addr;
-      if (tor_inet_aton((TO_CONN(conn))->address, &in)) {
-        tor_addr_from_ipv4h(&addr, ntohl(in.s_addr));
-        geoip_note_client_seen(act, &addr, time(NULL));
-        geoip_note_ns_response(act, GEOIP_SUCCESS);
-        /* Note that a request for a network status has started, so that we
-         * can measure the download time later on. */
-        if (TO_CONN(conn)->dirreq_id)
-          geoip_start_dirreq(TO_CONN(conn)->dirreq_id, dlen, act,
-                             DIRREQ_TUNNELED);
-        else
-          geoip_start_dirreq(TO_CONN(conn)->global_identifier, dlen, act,
-                             DIRREQ_DIRECT);
-      }
-    }
+  write_http_response_header(conn, -1, compressed, MICRODESC_CACHE_LIFETIME);
+  conn->dir_spool_src = DIR_SPOOL_MICRODESC;
+  conn->fingerprint_stack = fps;
 
-    // note_request(request_type,dlen);
-    (void) request_type;
-    write_http_response_header(conn, -1, compressed,
-                               smartlist_len(dir_fps) == 1 ? lifetime : 0);
-    conn->fingerprint_stack = dir_fps;
-    if (! compressed)
-      conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
+  if (compressed && !connection_dirserv_spool_precompressed(conn))
+    conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                      choose_compression_level());
 
-    /* Prime the connection with some data. */
-    conn->dir_spool_src = DIR_SPOOL_NETWORKSTATUS;
-    connection_dirserv_flushed_some(conn);
-    goto done;
-  }
+  connection_dirserv_flushed_some(conn);
+  return 0;
+}
 
-  if (!strcmpstart(url,"/tor/status-vote/current/") ||
-      !strcmpstart(url,"/tor/status-vote/next/")) {
-    /* XXXX If-modified-since is only implemented for the current
-     * consensus: that's probably fine, since it's the only vote document
-     * people fetch much. */
-    int current;
-    ssize_t body_len = 0;
-    ssize_t estimated_len = 0;
-    smartlist_t *items = smartlist_new();
-    smartlist_t *dir_items = smartlist_new();
-    int lifetime = 60; /* XXXX023 should actually use vote intervals. */
-    url += strlen("/tor/status-vote/");
-    current = !strcmpstart(url, "current/");
-    url = strchr(url, '/');
-    tor_assert(url);
-    ++url;
-    if (!strcmp(url, "consensus")) {
-      const char *item;
-      tor_assert(!current); /* we handle current consensus specially above,
-                             * since it wants to be spooled. */
-      if ((item = dirvote_get_pending_consensus(FLAV_NS)))
-        smartlist_add(items, (char*)item);
-    } else if (!current && !strcmp(url, "consensus-signatures")) {
-      /* XXXX the spec says that we should implement
-       * current/consensus-signatures too.  It doesn't seem to be needed,
-       * though. */
-      const char *item;
-      if ((item=dirvote_get_pending_detached_signatures()))
-        smartlist_add(items, (char*)item);
-    } else if (!strcmp(url, "authority")) {
-      const cached_dir_t *d;
-      int flags = DGV_BY_ID |
-        (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
-      if ((d=dirvote_get_vote(NULL, flags)))
-        smartlist_add(dir_items, (cached_dir_t*)d);
-    } else {
-      const cached_dir_t *d;
-      smartlist_t *fps = smartlist_new();
-      int flags;
-      if (!strcmpstart(url, "d/")) {
-        url += 2;
-        flags = DGV_INCLUDE_PENDING | DGV_INCLUDE_PREVIOUS;
-      } else {
-        flags = DGV_BY_ID |
-          (current ? DGV_INCLUDE_PREVIOUS : DGV_INCLUDE_PENDING);
-      }
-      dir_split_resource_into_fingerprints(url, fps, NULL,
-                                           DSR_HEX|DSR_SORT_UNIQ);
-      SMARTLIST_FOREACH(fps, char *, fp, {
-          if ((d = dirvote_get_vote(fp, flags)))
-            smartlist_add(dir_items, (cached_dir_t*)d);
-          tor_free(fp);
-        });
-      smartlist_free(fps);
-    }
-    if (!smartlist_len(dir_items) && !smartlist_len(items)) {
-      write_http_status_line(conn, 404, "Not found");
-      goto vote_done;
-    }
-    SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
-                      body_len += compressed ? d->dir_z_len : d->dir_len);
-    estimated_len += body_len;
-    SMARTLIST_FOREACH(items, const char *, item, {
-        size_t ln = strlen(item);
-        if (compressed) {
-          estimated_len += ln/2;
-        } else {
-          body_len += ln; estimated_len += ln;
-        }
-      });
+/** Helper for directory_handle_command_get: answer a GET request for
+ * server descriptors or extra-info documents. */
+static int
+handle_get_descriptor(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  const char *url = args->url;
+  int compressed = args->compressed;
+  size_t dlen;
+  int res;
+  const char *msg;
+  const char *request_type = NULL;
+  int cache_lifetime = 0;
+  int is_extra = !strcmpstart(url,"/tor/extra/");
+
+  if (is_extra && (options->BridgeAuthoritativeDir || options->BridgeRelay)) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
+  }
 
-    if (global_write_bucket_low(TO_CONN(conn), estimated_len, 2)) {
-      write_http_status_line(conn, 503, "Directory busy, try again later.");
-      goto vote_done;
-    }
-    write_http_response_header(conn, body_len ? body_len : -1, compressed,
-                 lifetime);
+  url += is_extra ? strlen("/tor/extra/") : strlen("/tor/server/");
+  conn->fingerprint_stack = smartlist_new();
+  res = dirserv_get_routerdesc_fingerprints(conn->fingerprint_stack, url,
+                                        &msg,
+                                        !connection_dir_is_encrypted(conn),
+                                        is_extra);
 
-    if (smartlist_len(items)) {
-      if (compressed) {
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-        SMARTLIST_FOREACH(items, const char *, c,
-                 connection_write_to_buf_zlib(c, strlen(c), conn, 0));
-        connection_write_to_buf_zlib("", 0, conn, 1);
-      } else {
-        SMARTLIST_FOREACH(items, const char *, c,
-                         connection_write_to_buf(c, strlen(c), TO_CONN(conn)));
-      }
-    } else {
-      SMARTLIST_FOREACH(dir_items, cached_dir_t *, d,
-          connection_write_to_buf(compressed ? d->dir_z : d->dir,
-                                  compressed ? d->dir_z_len : d->dir_len,
-                                  TO_CONN(conn)));
-    }
-  vote_done:
-    smartlist_free(items);
-    smartlist_free(dir_items);
-    goto done;
+  if (!strcmpstart(url, "fp/")) {
+    request_type = compressed?"/tor/server/fp.z":"/tor/server/fp";
+    if (smartlist_len(conn->fingerprint_stack) == 1)
+      cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
+  } else if (!strcmpstart(url, "authority")) {
+    request_type = compressed?"/tor/server/authority.z":
+      "/tor/server/authority";
+    cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
+  } else if (!strcmpstart(url, "all")) {
+    request_type = compressed?"/tor/server/all.z":"/tor/server/all";
+    cache_lifetime = FULL_DIR_CACHE_LIFETIME;
+  } else if (!strcmpstart(url, "d/")) {
+    request_type = compressed?"/tor/server/d.z":"/tor/server/d";
+    if (smartlist_len(conn->fingerprint_stack) == 1)
+      cache_lifetime = ROUTERDESC_BY_DIGEST_CACHE_LIFETIME;
+  } else {
+    request_type = "/tor/server/?";
   }
+  (void) request_type; /* usable for note_request. */
+  if (!strcmpstart(url, "d/"))
+    conn->dir_spool_src =
+      is_extra ? DIR_SPOOL_EXTRA_BY_DIGEST : DIR_SPOOL_SERVER_BY_DIGEST;
+  else
+    conn->dir_spool_src =
+      is_extra ? DIR_SPOOL_EXTRA_BY_FP : DIR_SPOOL_SERVER_BY_FP;
 
-  if (!strcmpstart(url, "/tor/micro/d/")) {
-    smartlist_t *fps = smartlist_new();
-
-    dir_split_resource_into_fingerprints(url+strlen("/tor/micro/d/"),
-                                      fps, NULL,
-                                      DSR_DIGEST256|DSR_BASE64|DSR_SORT_UNIQ);
+  if (!dirserv_have_any_serverdesc(conn->fingerprint_stack,
+                                   conn->dir_spool_src)) {
+    res = -1;
+    msg = "Not found";
+  }
 
-    if (!dirserv_have_any_microdesc(fps)) {
-      write_http_status_line(conn, 404, "Not found");
-      SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
-      smartlist_free(fps);
-      goto done;
-    }
-    dlen = dirserv_estimate_microdesc_size(fps, compressed);
+  if (res < 0)
+    write_http_status_line(conn, 404, msg);
+  else {
+    dlen = dirserv_estimate_data_size(conn->fingerprint_stack,
+                                      1, compressed);
     if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
       log_info(LD_DIRSERV,
                "Client asked for server descriptors, but we've been "
                "writing too many bytes lately. Sending 503 Dir busy.");
       write_http_status_line(conn, 503, "Directory busy, try again later");
-      SMARTLIST_FOREACH(fps, char *, fp, tor_free(fp));
-      smartlist_free(fps);
-      goto done;
+      conn->dir_spool_src = DIR_SPOOL_NONE;
+      return 0;
     }
-
-    write_http_response_header(conn, -1, compressed, MICRODESC_CACHE_LIFETIME);
-    conn->dir_spool_src = DIR_SPOOL_MICRODESC;
-    conn->fingerprint_stack = fps;
-
-    if (compressed)
-      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-
+    write_http_response_header(conn, -1, compressed, cache_lifetime);
+    if (compressed && !connection_dirserv_spool_precompressed(conn))
+      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                      choose_compression_level());
+    /* Prime the connection with some data. */
     connection_dirserv_flushed_some(conn);
-    goto done;
   }
+  return 0;
+}
 
-  if (!strcmpstart(url,"/tor/server/") ||
-      (!options->BridgeAuthoritativeDir &&
-       !options->BridgeRelay && !strcmpstart(url,"/tor/extra/"))) {
-    int res;
-    const char *msg;
-    const char *request_type = NULL;
-    int cache_lifetime = 0;
-    int is_extra = !strcmpstart(url,"/tor/extra/");
-    url += is_extra ? strlen("/tor/extra/") : strlen("/tor/server/");
-    conn->fingerprint_stack = smartlist_new();
-    res = dirserv_get_routerdesc_fingerprints(conn->fingerprint_stack, url,
-                                          &msg,
-                                          !connection_dir_is_encrypted(conn),
-                                          is_extra);
-
-    if (!strcmpstart(url, "fp/")) {
-      request_type = compressed?"/tor/server/fp.z":"/tor/server/fp";
-      if (smartlist_len(conn->fingerprint_stack) == 1)
-        cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
-    } else if (!strcmpstart(url, "authority")) {
-      request_type = compressed?"/tor/server/authority.z":
-        "/tor/server/authority";
-      cache_lifetime = ROUTERDESC_CACHE_LIFETIME;
-    } else if (!strcmpstart(url, "all")) {
-      request_type = compressed?"/tor/server/all.z":"/tor/server/all";
-      cache_lifetime = FULL_DIR_CACHE_LIFETIME;
-    } else if (!strcmpstart(url, "d/")) {
-      request_type = compressed?"/tor/server/d.z":"/tor/server/d";
-      if (smartlist_len(conn->fingerprint_stack) == 1)
-        cache_lifetime = ROUTERDESC_BY_DIGEST_CACHE_LIFETIME;
-    } else {
-      request_type = "/tor/server/?";
-    }
-    (void) request_type; /* usable for note_request. */
-    if (!strcmpstart(url, "d/"))
-      conn->dir_spool_src =
-        is_extra ? DIR_SPOOL_EXTRA_BY_DIGEST : DIR_SPOOL_SERVER_BY_DIGEST;
-    else
-      conn->dir_spool_src =
-        is_extra ? DIR_SPOOL_EXTRA_BY_FP : DIR_SPOOL_SERVER_BY_FP;
-
-    if (!dirserv_have_any_serverdesc(conn->fingerprint_stack,
-                                     conn->dir_spool_src)) {
-      res = -1;
-      msg = "Not found";
-    }
-
-    if (res < 0)
-      write_http_status_line(conn, 404, msg);
-    else {
-      dlen = dirserv_estimate_data_size(conn->fingerprint_stack,
-                                        1, compressed);
-      if (global_write_bucket_low(TO_CONN(conn), dlen, 2)) {
-        log_info(LD_DIRSERV,
-                 "Client asked for server descriptors, but we've been "
-                 "writing too many bytes lately. Sending 503 Dir busy.");
-        write_http_status_line(conn, 503, "Directory busy, try again later");
-        conn->dir_spool_src = DIR_SPOOL_NONE;
-        goto done;
-      }
-      write_http_response_header(conn, -1, compressed, cache_lifetime);
-      if (compressed)
-        conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-      /* Prime the connection with some data. */
-      connection_dirserv_flushed_some(conn);
-    }
-    goto done;
+/** Helper for directory_handle_command_get: answer a GET request for
+ * authority certificates. */
+static int
+handle_get_keys(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const char *url = args->url;
+  int compressed = args->compressed;
+  time_t if_modified_since = args->if_modified_since;
+  smartlist_t *certs = smartlist_new();
+  ssize_t len = -1;
+  if (!strcmp(url, "/tor/keys/all")) {
+    authority_cert_get_all(certs);
+  } else if (!strcmp(url, "/tor/keys/authority")) {
+    authority_cert_t *cert = get_my_v3_authority_cert();
+    if (cert)
+      smartlist_add(certs, cert);
+  } else if (!strcmpstart(url, "/tor/keys/fp/")) {
+    smartlist_t *fps = smartlist_new();
+    dir_split_resource_into_fingerprints(url+strlen("/tor/keys/fp/"),
+                                         fps, NULL,
+                                         DSR_HEX|DSR_SORT_UNIQ);
+    SMARTLIST_FOREACH(fps, char *, d, {
+        authority_cert_t *c = authority_cert_get_newest_by_id(d);
+        if (c) smartlist_add(certs, c);
+        tor_free(d);
+    });
+    smartlist_free(fps);
+  } else if (!strcmpstart(url, "/tor/keys/sk/")) {
+    smartlist_t *fps = smartlist_new();
+    dir_split_resource_into_fingerprints(url+strlen("/tor/keys/sk/"),
+                                         fps, NULL,
+                                         DSR_HEX|DSR_SORT_UNIQ);
+    SMARTLIST_FOREACH(fps, char *, d, {
+        authority_cert_t *c = authority_cert_get_by_sk_digest(d);
+        if (c) smartlist_add(certs, c);
+        tor_free(d);
+    });
+    smartlist_free(fps);
+  } else if (!strcmpstart(url, "/tor/keys/fp-sk/")) {
+    smartlist_t *fp_sks = smartlist_new();
+    dir_split_resource_into_fingerprint_pairs(url+strlen("/tor/keys/fp-sk/"),
+                                              fp_sks);
+    SMARTLIST_FOREACH(fp_sks, fp_pair_t *, pair, {
+        authority_cert_t *c = authority_cert_get_by_digests(pair->first,
+                                                            pair->second);
+        if (c) smartlist_add(certs, c);
+        tor_free(pair);
+    });
+    smartlist_free(fp_sks);
+  } else {
+    write_http_status_line(conn, 400, "Bad request");
+    goto keys_done;
   }
+  if (!smartlist_len(certs)) {
+    write_http_status_line(conn, 404, "Not found");
+    goto keys_done;
+  }
+  SMARTLIST_FOREACH(certs, authority_cert_t *, c,
+    if (c->cache_info.published_on < if_modified_since)
+      SMARTLIST_DEL_CURRENT(certs, c));
+  if (!smartlist_len(certs)) {
+    write_http_status_line(conn, 304, "Not modified");
+    goto keys_done;
+  }
+  len = 0;
+  SMARTLIST_FOREACH(certs, authority_cert_t *, c,
+                    len += c->cache_info.signed_descriptor_len);
 
-  if (!strcmpstart(url,"/tor/keys/")) {
-    smartlist_t *certs = smartlist_new();
-    ssize_t len = -1;
-    if (!strcmp(url, "/tor/keys/all")) {
-      authority_cert_get_all(certs);
-    } else if (!strcmp(url, "/tor/keys/authority")) {
-      authority_cert_t *cert = get_my_v3_authority_cert();
-      if (cert)
-        smartlist_add(certs, cert);
-    } else if (!strcmpstart(url, "/tor/keys/fp/")) {
-      smartlist_t *fps = smartlist_new();
-      dir_split_resource_into_fingerprints(url+strlen("/tor/keys/fp/"),
-                                           fps, NULL,
-                                           DSR_HEX|DSR_SORT_UNIQ);
-      SMARTLIST_FOREACH(fps, char *, d, {
-          authority_cert_t *c = authority_cert_get_newest_by_id(d);
-          if (c) smartlist_add(certs, c);
-          tor_free(d);
-      });
-      smartlist_free(fps);
-    } else if (!strcmpstart(url, "/tor/keys/sk/")) {
-      smartlist_t *fps = smartlist_new();
-      dir_split_resource_into_fingerprints(url+strlen("/tor/keys/sk/"),
-                                           fps, NULL,
-                                           DSR_HEX|DSR_SORT_UNIQ);
-      SMARTLIST_FOREACH(fps, char *, d, {
-          authority_cert_t *c = authority_cert_get_by_sk_digest(d);
-          if (c) smartlist_add(certs, c);
-          tor_free(d);
-      });
-      smartlist_free(fps);
-    } else if (!strcmpstart(url, "/tor/keys/fp-sk/")) {
-      smartlist_t *fp_sks = smartlist_new();
-      dir_split_resource_into_fingerprint_pairs(url+strlen("/tor/keys/fp-sk/"),
-                                                fp_sks);
-      SMARTLIST_FOREACH(fp_sks, fp_pair_t *, pair, {
-          authority_cert_t *c = authority_cert_get_by_digests(pair->first,
-                                                              pair->second);
-          if (c) smartlist_add(certs, c);
-          tor_free(pair);
-      });
-      smartlist_free(fp_sks);
-    } else {
-      write_http_status_line(conn, 400, "Bad request");
-      goto keys_done;
-    }
-    if (!smartlist_len(certs)) {
-      write_http_status_line(conn, 404, "Not found");
-      goto keys_done;
-    }
+  if (global_write_bucket_low(TO_CONN(conn), compressed?len/2:len, 2)) {
+    write_http_status_line(conn, 503, "Directory busy, try again later.");
+    goto keys_done;
+  }
+
+  write_http_response_header(conn, compressed?-1:len, compressed, 60*60);
+  if (compressed) {
+    conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD,
+                                      choose_compression_level());
     SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-      if (c->cache_info.published_on < if_modified_since)
-        SMARTLIST_DEL_CURRENT(certs, c));
-    if (!smartlist_len(certs)) {
-      write_http_status_line(conn, 304, "Not modified");
-      goto keys_done;
-    }
-    len = 0;
+          connection_write_to_buf_zlib(c->cache_info.signed_descriptor_body,
+                                       c->cache_info.signed_descriptor_len,
+                                       conn, 0));
+    connection_write_to_buf_zlib("", 0, conn, 1);
+  } else {
     SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-                      len += c->cache_info.signed_descriptor_len);
-
-    if (global_write_bucket_low(TO_CONN(conn), compressed?len/2:len, 2)) {
-      write_http_status_line(conn, 503, "Directory busy, try again later.");
-      goto keys_done;
-    }
-
-    write_http_response_header(conn, compressed?-1:len, compressed, 60*60);
-    if (compressed) {
-      conn->zlib_state = tor_zlib_new(1, ZLIB_METHOD);
-      SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-            connection_write_to_buf_zlib(c->cache_info.signed_descriptor_body,
-                                         c->cache_info.signed_descriptor_len,
-                                         conn, 0));
-      connection_write_to_buf_zlib("", 0, conn, 1);
-    } else {
-      SMARTLIST_FOREACH(certs, authority_cert_t *, c,
-            connection_write_to_buf(c->cache_info.signed_descriptor_body,
-                                    c->cache_info.signed_descriptor_len,
-                                    TO_CONN(conn)));
-    }
-  keys_done:
-    smartlist_free(certs);
-    goto done;
+          connection_write_to_buf(c->cache_info.signed_descriptor_body,
+                                  c->cache_info.signed_descriptor_len,
+                                  TO_CONN(conn)));
   }
+ keys_done:
+  smartlist_free(certs);
+  return 0;
+}
 
-  if (options->HidServDirectoryV2 &&
-       !strcmpstart(url,"/tor/rendezvous2/")) {
-    /* Handle v2 rendezvous descriptor fetch request. */
-    const char *descp;
-    const char *query = url + strlen("/tor/rendezvous2/");
-    if (strlen(query) == REND_DESC_ID_V2_LEN_BASE32) {
-      log_info(LD_REND, "Got a v2 rendezvous descriptor request for ID '%s'",
-               safe_str(query));
-      switch (rend_cache_lookup_v2_desc_as_dir(query, &descp)) {
-        case 1: /* valid */
-          write_http_response_header(conn, strlen(descp), 0, 0);
-          connection_write_to_buf(descp, strlen(descp), TO_CONN(conn));
-          break;
-        case 0: /* well-formed but not present */
-          write_http_status_line(conn, 404, "Not found");
-          break;
-        case -1: /* not well-formed */
-          write_http_status_line(conn, 400, "Bad request");
-          break;
-      }
-    } else { /* not well-formed */
-      write_http_status_line(conn, 400, "Bad request");
-    }
-    goto done;
-  }
+/** Helper for directory_handle_command_get: answer a GET request for
+ * a v2 rendezvous descriptor. */
+static int
+handle_get_rendezvous2(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  const char *url = args->url;
+  const char *descp;
+  const char *query = url + strlen("/tor/rendezvous2/");
 
-  if (options->HSAuthoritativeDir && !strcmpstart(url,"/tor/rendezvous/")) {
-    /* rendezvous descriptor fetch */
-    const char *descp;
-    size_t desc_len;
-    const char *query = url+strlen("/tor/rendezvous/");
+  if (!options->HidServDirectoryV2) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
+  }
 
-    log_info(LD_REND, "Handling rendezvous descriptor get");
-    switch (rend_cache_lookup_desc(query, 0, &descp, &desc_len)) {
+  if (strlen(query) == REND_DESC_ID_V2_LEN_BASE32) {
+    log_info(LD_REND, "Got a v2 rendezvous descriptor request for ID '%s'",
+             safe_str(query));
+    switch (rend_cache_lookup_v2_desc_as_dir(query, &descp)) {
       case 1: /* valid */
-        write_http_response_header_impl(conn, desc_len,
-                                        "application/octet-stream",
-                                        NULL, NULL, 0);
-        note_request("/tor/rendezvous?/", desc_len);
-        /* need to send descp separately, because it may include NULs */
-        connection_write_to_buf(descp, desc_len, TO_CONN(conn));
+        write_http_response_header(conn, strlen(descp), 0, 0);
+        connection_write_to_buf(descp, strlen(descp), TO_CONN(conn));
         break;
       case 0: /* well-formed but not present */
         write_http_status_line(conn, 404, "Not found");
@@ -3227,111 +3559,294 @@ directory_handle_command_get(dir_connection_t *conn, const char *headers,
         write_http_status_line(conn, 400, "Bad request");
         break;
     }
-    goto done;
+  } else { /* not well-formed */
+    write_http_status_line(conn, 400, "Bad request");
   }
+  return 0;
+}
 
-  if (options->BridgeAuthoritativeDir &&
-      options->_BridgePassword_AuthDigest &&
-      connection_dir_is_encrypted(conn) &&
-      !strcmp(url,"/tor/networkstatus-bridges")) {
-    char *status;
-    char digest[DIGEST256_LEN];
+/** Helper for directory_handle_command_get: answer a GET request for
+ * a v0 rendezvous descriptor. */
+static int
+handle_get_rendezvous(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  const char *url = args->url;
+  const char *descp;
+  size_t desc_len;
+  const char *query = url+strlen("/tor/rendezvous/");
 
-    header = http_get_header(headers, "Authorization: Basic ");
-    if (header)
-      crypto_digest256(digest, header, strlen(header), DIGEST_SHA256);
+  if (!options->HSAuthoritativeDir) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
+  }
 
-    /* now make sure the password is there and right */
-    if (!header ||
-        tor_memneq(digest,
-                   options->_BridgePassword_AuthDigest, DIGEST256_LEN)) {
+  /* rendezvous descriptor fetch */
+
+  log_info(LD_REND, "Handling rendezvous descriptor get");
+  switch (rend_cache_lookup_desc(query, 0, &descp, &desc_len)) {
+    case 1: /* valid */
+      write_http_response_header_impl(conn, desc_len,
+                                      "application/octet-stream",
+                                      NULL, NULL, 0);
+      note_request("/tor/rendezvous?/", desc_len);
+      /* need to send descp separately, because it may include NULs */
+      connection_write_to_buf(descp, desc_len, TO_CONN(conn));
+      break;
+    case 0: /* well-formed but not present */
       write_http_status_line(conn, 404, "Not found");
-      tor_free(header);
-      goto done;
-    }
-    tor_free(header);
-
-    /* all happy now. send an answer. */
-    status = networkstatus_getinfo_by_purpose("bridge", time(NULL));
-    dlen = strlen(status);
-    write_http_response_header(conn, dlen, 0, 0);
-    connection_write_to_buf(status, dlen, TO_CONN(conn));
-    tor_free(status);
-    goto done;
+      break;
+    case -1: /* not well-formed */
+      write_http_status_line(conn, 400, "Bad request");
+      break;
   }
+  return 0;
+}
 
-  if (!strcmpstart(url,"/tor/bytes.txt")) {
-    char *bytes = directory_dump_request_log();
-    size_t len = strlen(bytes);
-    write_http_response_header(conn, len, 0, 0);
-    connection_write_to_buf(bytes, len, TO_CONN(conn));
-    tor_free(bytes);
-    goto done;
+/** Helper for directory_handle_command_get: answer a GET request for
+ * the bridge networkstatus. */
+static int
+handle_get_networkstatus_bridges(dir_connection_t *conn,
+                                 const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  const char *headers = args->headers;
+  size_t dlen;
+  char *header;
+  char *status;
+  char digest[DIGEST256_LEN];
+
+  if (!options->BridgeAuthoritativeDir ||
+      !options->_BridgePassword_AuthDigest ||
+      !connection_dir_is_encrypted(conn)) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
   }
 
-  if (!strcmp(url,"/tor/robots.txt")) { /* /robots.txt will have been
-                                           rewritten to /tor/robots.txt */
-    char robots[] = "User-agent: *\r\nDisallow: /\r\n";
-    size_t len = strlen(robots);
-    write_http_response_header(conn, len, 0, ROBOTS_CACHE_LIFETIME);
-    connection_write_to_buf(robots, len, TO_CONN(conn));
-    goto done;
+  header = http_get_header(headers, "Authorization: Basic ");
+  if (header)
+    crypto_digest256(digest, header, strlen(header), DIGEST_SHA256);
+
+  /* now make sure the password is there and right */
+  if (!header ||
+      tor_memneq(digest,
+                 options->_BridgePassword_AuthDigest, DIGEST256_LEN)) {
+    write_http_status_line(conn, 404, "Not found");
+    tor_free(header);
+    return 0;
   }
+  tor_free(header);
+
+  /* all happy now. send an answer. */
+  status = networkstatus_getinfo_by_purpose("bridge", time(NULL));
+  dlen = strlen(status);
+  write_http_response_header(conn, dlen, 0, 0);
+  connection_write_to_buf(status, dlen, TO_CONN(conn));
+  tor_free(status);
+  return 0;
+}
 
-  if (!strcmp(url,"/tor/dbg-stability.txt")) {
-    const char *stability;
-    size_t len;
-    if (options->BridgeAuthoritativeDir ||
-        ! authdir_mode_tests_reachability(options) ||
-        ! (stability = rep_hist_get_router_stability_doc(time(NULL)))) {
-      write_http_status_line(conn, 404, "Not found.");
-      goto done;
-    }
+/** Helper for directory_handle_command_get: answer a GET request for
+ * our per-request bandwidth log. */
+static int
+handle_get_bytes(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  char *bytes = directory_dump_request_log();
+  size_t len = strlen(bytes);
+  (void)args;
+  write_http_response_header(conn, len, 0, 0);
+  connection_write_to_buf(bytes, len, TO_CONN(conn));
+  tor_free(bytes);
+  return 0;
+}
 
-    len = strlen(stability);
-    write_http_response_header(conn, len, 0, 0);
-    connection_write_to_buf(stability, len, TO_CONN(conn));
-    goto done;
+/** Helper for directory_handle_command_get: answer a GET request for
+ * robots.txt. */
+static int
+handle_get_robots(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  char robots[] = "User-agent: *\r\nDisallow: /\r\n";
+  size_t len = strlen(robots);
+  (void)args;
+  write_http_response_header(conn, len, 0, ROBOTS_CACHE_LIFETIME);
+  connection_write_to_buf(robots, len, TO_CONN(conn));
+  return 0;
+}
+
+/** Helper for directory_handle_command_get: answer a GET request for
+ * our router stability document. */
+static int
+handle_get_dbg_stability(dir_connection_t *conn,
+                         const get_handler_args_t *args)
+{
+  const or_options_t *options = get_options();
+  const char *stability;
+  size_t len;
+  (void)args;
+
+  if (options->BridgeAuthoritativeDir ||
+      ! authdir_mode_tests_reachability(options) ||
+      ! (stability = rep_hist_get_router_stability_doc(time(NULL)))) {
+    write_http_status_line(conn, 404, "Not found.");
+    return 0;
   }
 
+  len = strlen(stability);
+  write_http_response_header(conn, len, 0, 0);
+  connection_write_to_buf(stability, len, TO_CONN(conn));
+  return 0;
+}
+
 #if defined(EXPORTMALLINFO) && defined(HAVE_MALLOC_H) && defined(HAVE_MALLINFO)
 #define ADD_MALLINFO_LINE(x) do {                               \
     smartlist_add_asprintf(lines, "%s %d\n", #x, mi.x);        \
   }while(0);
 
-  if (!strcmp(url,"/tor/mallinfo.txt") &&
-      (tor_addr_eq_ipv4h(&conn->_base.addr, 0x7f000001ul))) {
-    char *result;
-    size_t len;
-    struct mallinfo mi;
-    smartlist_t *lines;
-
-    memset(&mi, 0, sizeof(mi));
-    mi = mallinfo();
-    lines = smartlist_new();
-
-    ADD_MALLINFO_LINE(arena)
-    ADD_MALLINFO_LINE(ordblks)
-    ADD_MALLINFO_LINE(smblks)
-    ADD_MALLINFO_LINE(hblks)
-    ADD_MALLINFO_LINE(hblkhd)
-    ADD_MALLINFO_LINE(usmblks)
-    ADD_MALLINFO_LINE(fsmblks)
-    ADD_MALLINFO_LINE(uordblks)
-    ADD_MALLINFO_LINE(fordblks)
-    ADD_MALLINFO_LINE(keepcost)
-
-    result = smartlist_join_strings(lines, "", 0, NULL);
-    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
-    smartlist_free(lines);
-
-    len = strlen(result);
-    write_http_response_header(conn, len, 0, 0);
-    connection_write_to_buf(result, len, TO_CONN(conn));
-    tor_free(result);
-    goto done;
+/** Helper for directory_handle_command_get: answer a GET request for
+ * our malloc statistics. */
+static int
+handle_get_mallinfo(dir_connection_t *conn, const get_handler_args_t *args)
+{
+  char *result;
+  size_t len;
+  struct mallinfo mi;
+  smartlist_t *lines;
+  (void)args;
+
+  if (!tor_addr_eq_ipv4h(&conn->_base.addr, 0x7f000001ul)) {
+    write_http_status_line(conn, 404, "Not found");
+    return 0;
   }
+
+  memset(&mi, 0, sizeof(mi));
+  mi = mallinfo();
+  lines = smartlist_new();
+
+  ADD_MALLINFO_LINE(arena)
+  ADD_MALLINFO_LINE(ordblks)
+  ADD_MALLINFO_LINE(smblks)
+  ADD_MALLINFO_LINE(hblks)
+  ADD_MALLINFO_LINE(hblkhd)
+  ADD_MALLINFO_LINE(usmblks)
+  ADD_MALLINFO_LINE(fsmblks)
+  ADD_MALLINFO_LINE(uordblks)
+  ADD_MALLINFO_LINE(fordblks)
+  ADD_MALLINFO_LINE(keepcost)
+
+  result = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+
+  len = strlen(result);
+  write_http_response_header(conn, len, 0, 0);
+  connection_write_to_buf(result, len, TO_CONN(conn));
+  tor_free(result);
+  return 0;
+}
+#endif
+
+/** An entry in the table of GET URLs that directory_handle_command_get()
+ * knows how to answer. */
+typedef struct url_table_ent_t {
+  /** The URL, or the URL prefix if <b>is_prefix</b> is set. */
+  const char *string;
+  /** strlen(string), so that matching needs no scan of it. */
+  size_t len;
+  int is_prefix;
+  /** Function to answer the request. */
+  int (*handler)(dir_connection_t *conn, const get_handler_args_t *args);
+} url_table_ent_t;
+
+/** Helper: declare a url_table_t entry for <b>str</b>. */
+#define URL_ENT(str, is_prefix, handler) \
+  { str, sizeof(str)-1, is_prefix, handler }
+
+/** Every GET URL we answer, with the ones that busy caches see most often
+ * first.  A URL goes to the first entry that it matches. */
+static const url_table_ent_t url_table[] = {
+  URL_ENT("/tor/status-vote/current/consensus", 1, handle_get_networkstatus),
+  URL_ENT("/tor/micro/d/", 1, handle_get_microdesc),
+  URL_ENT("/tor/server/", 1, handle_get_descriptor),
+  URL_ENT("/tor/keys/", 1, handle_get_keys),
+  URL_ENT("/tor/rendezvous2/", 1, handle_get_rendezvous2),
+  URL_ENT("/tor/extra/", 1, handle_get_descriptor),
+  URL_ENT("/tor/status-vote/current/", 1, handle_get_status_vote),
+  URL_ENT("/tor/status-vote/next/", 1, handle_get_status_vote),
+  URL_ENT("/tor/status/", 1, handle_get_networkstatus),
+  URL_ENT("/tor/", 0, handle_get_frontpage),
+  URL_ENT("/tor/dir", 0, handle_get_v1_dir),
+  URL_ENT("/tor/running-routers", 0, handle_get_running_routers),
+  URL_ENT("/tor/rendezvous/", 1, handle_get_rendezvous),
+  URL_ENT("/tor/networkstatus-bridges", 0, handle_get_networkstatus_bridges),
+  URL_ENT("/tor/bytes.txt", 1, handle_get_bytes),
+  URL_ENT("/tor/robots.txt", 0, handle_get_robots),
+  URL_ENT("/tor/dbg-stability.txt", 0, handle_get_dbg_stability),
+#if defined(EXPORTMALLINFO) && defined(HAVE_MALLOC_H) && defined(HAVE_MALLINFO)
+  URL_ENT("/tor/mallinfo.txt", 0, handle_get_mallinfo),
 #endif
+  { NULL, 0, 0, NULL },
+};
+
+/** Helper function: called when a dirserver gets a complete HTTP GET
+ * request.  Look for a request for a directory or for a rendezvous
+ * service descriptor.  On finding one, write a response into
+ * conn-\>outbuf.  If the request is unrecognized, send a 400.
+ * Always return 0. */
+int
+directory_handle_command_get(dir_connection_t *conn, const char *headers,
+                             const char *req_body, size_t req_body_len)
+{
+  char *url, *url_mem, *header;
+  time_t if_modified_since = 0;
+  int compressed;
+  size_t url_len;
+  get_handler_args_t args;
+  const url_table_ent_t *ent;
+
+  /* We ignore the body of a GET request. */
+  (void)req_body;
+  (void)req_body_len;
+
+  log_debug(LD_DIRSERV,"Received GET command.");
+
+  conn->_base.state = DIR_CONN_STATE_SERVER_WRITING;
+
+  if (parse_http_url(headers, &url) < 0) {
+    write_http_status_line(conn, 400, "Bad request");
+    return 0;
+  }
+  if ((header = http_get_header(headers, "If-Modified-Since: "))) {
+    struct tm tm;
+    if (parse_http_time(header, &tm) == 0) {
+      if_modified_since = tor_timegm(&tm);
+    }
+    /* The correct behavior on a malformed If-Modified-Since header is to
+     * act as if no If-Modified-Since header had been given. */
+    tor_free(header);
+  }
+  log_debug(LD_DIRSERV,"rewritten url as '%s'.", url);
+
+  url_mem = url;
+  url_len = strlen(url);
+  compressed = url_len > 2 && !strcmp(url+url_len-2, ".z");
+  if (compressed) {
+    url[url_len-2] = '\0';
+    url_len -= 2;
+  }
+
+  args.url = url;
+  args.headers = headers;
+  args.if_modified_since = if_modified_since;
+  args.compressed = compressed;
+
+  for (ent = url_table; ent->string; ++ent) {
+    if (ent->is_prefix ? !strncmp(url, ent->string, ent->len)
+                       : (url_len == ent->len &&
+                          !memcmp(url, ent->string, url_len))) {
+      ent->handler(conn, &args);
+      goto done;
+    }
+  }
 
   /* we didn't recognize the url */
   write_http_status_line(conn, 404, "Not found");
@@ -105,5 +105,11 @@ download_status_mark_impossible(download_status_t *dl)
 
 int download_status_get_n_failures(const download_status_t *dls);
 
+#ifdef DIRECTORY_PRIVATE
+int connection_dir_client_read_body(dir_connection_t *conn, int finish);
+int directory_handle_command_get(dir_connection_t *conn, const char *headers,
+                                 const char *req_body, size_t req_body_len);
+#endif
+
 #endif
 
@@ -9,6 +9,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -1329,6 +1330,30 @@ static digestmap_t *cached_v2_networkstatus = NULL;
  * currently serving. */
 static strmap_t *cached_consensuses = NULL;
 
+/** How many earlier consensuses of each flavor do we remember so that we can
+ * serve diffs from them? */
+#define MAX_CONSENSUS_DIFF_SOURCES 4
+/** Forget an earlier consensus once it's this much older than the one we're
+ * serving: clients that old are better off with the full document. */
+#define MAX_CONSENSUS_DIFF_SOURCE_AGE (6*60*60)
+
+/** An earlier consensus that we can serve diffs from. */
+typedef struct consensus_diff_source_t {
+  char digest[DIGEST256_LEN]; /**< SHA256 of the earlier consensus. */
+  /** The earlier consensus, as we were serving it.  We hold a reference. */
+  cached_dir_t *consensus;
+  time_t valid_after; /**< When did the earlier consensus become valid? */
+  /** A diff from <b>consensus</b> to the one we're serving now, or NULL if
+   * we haven't made one yet. */
+  cached_dir_t *diff;
+  /** True iff we tried to make <b>diff</b> and got nothing worth serving. */
+  unsigned int diff_failed : 1;
+} consensus_diff_source_t;
+
+/** Map from flavor name to a smartlist of consensus_diff_source_t, newest
+ * first. */
+static strmap_t *consensus_diff_sources = NULL;
+
 /** Possibly replace the contents of <b>d</b> with the value of
  * <b>directory</b> published on <b>when</b>, unless <b>when</b> is older than
  * the last value, or too far in the future.
@@ -1393,10 +1418,63 @@ static void
 clear_cached_dir(cached_dir_t *d)
 {
   tor_free(d->dir);
-  tor_free(d->dir_z);
+  if (d->dir_z_mmap)
+    tor_munmap_file(d->dir_z_mmap);
+  else
+    tor_free(d->dir_z);
   memset(d, 0, sizeof(cached_dir_t));
 }
 
+/** Return a newly allocated copy of the uncompressed contents of <b>d</b>,
+ * or NULL if we can't recover them. */
+static char *
+cached_dir_get_text(const cached_dir_t *d)
+{
+  char *text = NULL;
+  size_t len = 0;
+  if (d->dir)
+    return tor_strdup(d->dir);
+  if (!d->dir_z ||
+      tor_gzip_uncompress(&text, &len, d->dir_z, d->dir_z_len,
+                          ZLIB_METHOD, 1, LOG_WARN) < 0)
+    return NULL;
+  return text;
+}
+
+/** Write the compressed contents of <b>d</b> to <b>fname</b> and serve them
+ * from a mapping of that file, so that <b>d</b> holds no copy of its own on
+ * the heap.  Also forget the uncompressed contents of <b>d</b>: we spool
+ * directly from the compressed bytes.  If the file can't be written or
+ * mapped, keep the compressed bytes on the heap. */
+static void
+cached_dir_move_to_file(cached_dir_t *d, const char *fname)
+{
+  tor_mmap_t *m;
+  if (!d->dir_z)
+    return;
+  tor_free(d->dir);
+#ifdef _WIN32
+  /* Windows won't let us replace a file while it's mapped, and we keep
+   * earlier consensuses around for diffs. */
+  (void)m;
+  (void)fname;
+#else
+  if (write_bytes_to_file(fname, d->dir_z, d->dir_z_len, 1) < 0)
+    return;
+  if (!(m = tor_mmap_file(fname)))
+    return;
+  if (m->size != d->dir_z_len ||
+      tor_memneq(m->data, d->dir_z, d->dir_z_len)) {
+    log_warn(LD_FS, "\"%s\" changed while we were mapping it.", fname);
+    tor_munmap_file(m);
+    return;
+  }
+  tor_free(d->dir_z);
+  d->dir_z = (char *)m->data;
+  d->dir_z_mmap = m;
+#endif
+}
+
 /** Free all storage held by the cached_dir_t in <b>d</b>. */
 static void
 _free_cached_dir(void *_d)
@@ -1499,6 +1577,73 @@ dirserv_set_cached_networkstatus_v2(const char *networkstatus,
   }
 }
 
+/** Release all storage held by the consensus_diff_source_t <b>_src</b>. */
+static void
+consensus_diff_source_free(void *_src)
+{
+  consensus_diff_source_t *src = _src;
+  if (!src)
+    return;
+  cached_dir_decref(src->consensus);
+  cached_dir_decref(src->diff);
+  tor_free(src);
+}
+
+/** Free a smartlist of consensus_diff_source_t. */
+static void
+consensus_diff_sources_free(void *_sources)
+{
+  smartlist_t *sources = _sources;
+  SMARTLIST_FOREACH(sources, consensus_diff_source_t *, src,
+                    consensus_diff_source_free(src));
+  smartlist_free(sources);
+}
+
+/** We're about to replace <b>old</b>, our consensus of type
+ * <b>flavor_name</b>, with one published at <b>published</b>: remember
+ * <b>old</b> so we can serve diffs from it, and forget any diffs we made to
+ * <b>old</b> itself. */
+static void
+remember_consensus_for_diffs(const char *flavor_name,
+                             cached_dir_t *old, time_t published)
+{
+  smartlist_t *sources;
+  consensus_diff_source_t *src;
+  char *text;
+
+  if (!consensus_diff_sources)
+    consensus_diff_sources = strmap_new();
+  if (!(sources = strmap_get(consensus_diff_sources, flavor_name))) {
+    sources = smartlist_new();
+    strmap_set(consensus_diff_sources, flavor_name, sources);
+  }
+
+  SMARTLIST_FOREACH(sources, consensus_diff_source_t *, s, {
+      cached_dir_decref(s->diff);
+      s->diff = NULL;
+      s->diff_failed = 0;
+    });
+
+  if (old->published < published && (text = cached_dir_get_text(old))) {
+    src = tor_malloc_zero(sizeof(consensus_diff_source_t));
+    consdiff_get_digest(src->digest, text);
+    tor_free(text);
+    ++old->refcnt;
+    src->consensus = old;
+    src->valid_after = old->published;
+    smartlist_insert(sources, 0, src);
+  }
+
+  while (smartlist_len(sources) > MAX_CONSENSUS_DIFF_SOURCES)
+    consensus_diff_source_free(smartlist_pop_last(sources));
+  SMARTLIST_FOREACH(sources, consensus_diff_source_t *, s, {
+      if (s->valid_after < published - MAX_CONSENSUS_DIFF_SOURCE_AGE) {
+        consensus_diff_source_free(s);
+        SMARTLIST_DEL_CURRENT(sources, s);
+      }
+    });
+}
+
 /** Replace the v3 consensus networkstatus of type <b>flavor_name</b> that
  * we're serving with <b>networkstatus</b>, published at <b>published</b>.  No
  * validation is performed. */
@@ -1515,10 +1660,23 @@ dirserv_set_cached_consensus_networkstatus(const char *networkstatus,
 
   new_networkstatus = new_cached_dir(tor_strdup(networkstatus), published);
   memcpy(&new_networkstatus->digests, digests, sizeof(digests_t));
+  {
+    char buf[128];
+    char *fname;
+    if (!strcmp(flavor_name, "ns"))
+      strlcpy(buf, "cached-consensus.z", sizeof(buf));
+    else
+      tor_snprintf(buf, sizeof(buf), "cached-%s-consensus.z", flavor_name);
+    fname = get_datadir_fname(buf);
+    cached_dir_move_to_file(new_networkstatus, fname);
+    tor_free(fname);
+  }
   old_networkstatus = strmap_set(cached_consensuses, flavor_name,
                                  new_networkstatus);
-  if (old_networkstatus)
+  if (old_networkstatus) {
+    remember_consensus_for_diffs(flavor_name, old_networkstatus, published);
     cached_dir_decref(old_networkstatus);
+  }
 }
 
 /** Remove any v2 networkstatus from the directory cache that was published
@@ -1709,6 +1867,50 @@ dirserv_get_consensus(const char *flavor_name)
   return strmap_get(cached_consensuses, flavor_name);
 }
 
+/** If we remember an earlier consensus of type <b>flavor_name</b> whose
+ * SHA256 digest is <b>digest</b>, return a diff from it to the consensus
+ * we're serving now, making the diff if we haven't yet.  Return NULL if we
+ * don't remember that consensus, or if a diff wouldn't be smaller than the
+ * full document. */
+cached_dir_t *
+dirserv_get_consensus_diff(const char *flavor_name, const char *digest)
+{
+  cached_dir_t *cur = dirserv_get_consensus(flavor_name);
+  smartlist_t *sources;
+  consensus_diff_source_t *src = NULL;
+
+  if (!cur || !consensus_diff_sources ||
+      !(sources = strmap_get(consensus_diff_sources, flavor_name)))
+    return NULL;
+  SMARTLIST_FOREACH(sources, consensus_diff_source_t *, s,
+                    if (tor_memeq(s->digest, digest, DIGEST256_LEN)) {
+                      src = s;
+                      break;
+                    });
+  if (!src)
+    return NULL;
+
+  if (!src->diff && !src->diff_failed) {
+    char *base = cached_dir_get_text(src->consensus);
+    char *target = cached_dir_get_text(cur);
+    char *diff = NULL;
+    if (base && target)
+      diff = consdiff_gen_diff(base, target);
+    tor_free(base);
+    tor_free(target);
+    if (diff)
+      src->diff = new_cached_dir(diff, cur->published);
+    if (!src->diff || src->diff->dir_z_len >= cur->dir_z_len) {
+      log_info(LD_DIRSERV, "No useful %s consensus diff from the one "
+               "published at %ld.", flavor_name, (long)src->valid_after);
+      cached_dir_decref(src->diff);
+      src->diff = NULL;
+      src->diff_failed = 1;
+    }
+  }
+  return src->diff;
+}
+
 /** For authoritative directories: the current (v2) network status. */
 static cached_dir_t *the_v2_networkstatus = NULL;
 
@@ -1913,6 +2115,7 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
     if (ri && router_is_active(ri, node, now)) {
       const char *id = ri->cache_info.identity_digest;
       uint32_t bw;
+      router_parse_exit_policy_if_needed(ri);
       node->is_exit = (!router_exit_policy_rejects_all(ri) &&
                        exit_policy_is_general_exit(ri->exit_policy));
       uptimes[n_active] = (uint32_t)real_uptime(ri, now);
@@ -1951,10 +2154,12 @@ dirserv_compute_performance_thresholds(routerlist_t *rl)
   {
     /* We can vote on a parameter for the minimum and maximum. */
     int32_t min_fast, max_fast;
-    min_fast = networkstatus_get_param(NULL, "FastFlagMinThreshold",
-                                       0, 0, INT32_MAX);
-    max_fast = networkstatus_get_param(NULL, "FastFlagMaxThreshold",
-                                       INT32_MAX, min_fast, INT32_MAX);
+    min_fast = networkstatus_get_param_by_id(NULL,
+                                         NET_PARAM_FAST_FLAG_MIN_THRESHOLD,
+                                         0, 0, INT32_MAX);
+    max_fast = networkstatus_get_param_by_id(NULL,
+                                         NET_PARAM_FAST_FLAG_MAX_THRESHOLD,
+                                         INT32_MAX, min_fast, INT32_MAX);
     if (fast_bandwidth < (uint32_t)min_fast)
       fast_bandwidth = min_fast;
     if (fast_bandwidth > (uint32_t)max_fast)
@@ -2060,10 +2265,16 @@ routerstatus_format_entry(char *buf, size_t buf_len,
   char published[ISO_TIME_LEN+1];
   char identity64[BASE64_DIGEST_LEN+1];
   char digest64[BASE64_DIGEST_LEN+1];
+  char addrbuf[INET_NTOA_BUF_LEN];
+  struct in_addr in;
 
   format_iso_time(published, rs->published_on);
   digest_to_base64(identity64, rs->identity_digest);
   digest_to_base64(digest64, rs->descriptor_digest);
+  /* Not fmt_addr32(): consensus entries can be formatted in a worker
+   * thread. */
+  in.s_addr = htonl(rs->addr);
+  tor_inet_ntoa(&in, addrbuf, sizeof(addrbuf));
 
   r = tor_snprintf(buf, buf_len,
                    "r %s %s %s%s%s %s %d %d\n",
@@ -2072,7 +2283,7 @@ routerstatus_format_entry(char *buf, size_t buf_len,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":digest64,
                    (format==NS_V3_CONSENSUS_MICRODESC)?"":" ",
                    published,
-                   fmt_addr32(rs->addr),
+                   addrbuf,
                    (int)rs->or_port,
                    (int)rs->dir_port);
   if (r<0) {
@@ -2192,6 +2403,7 @@ routerstatus_format_entry(char *buf, size_t buf_len,
     }
 
     if (desc) {
+      router_parse_exit_policy_if_needed(desc);
       summary = policy_summarize(desc->exit_policy);
       r = tor_snprintf(cp, buf_len - (cp-buf), "p %s\n", summary);
       if (r<0) {
@@ -3741,7 +3953,8 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
         if (uncompressing && ! conn->zlib_state &&
             conn->fingerprint_stack &&
             smartlist_len(conn->fingerprint_stack)) {
-          conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD);
+          conn->zlib_state = tor_zlib_new(0, ZLIB_METHOD,
+                                         HIGH_COMPRESSION);
         }
       }
       if (r) return r;
@@ -3766,6 +3979,170 @@ connection_dirserv_add_networkstatus_bytes_to_outbuf(dir_connection_t *conn)
   return 0;
 }
 
+/** Don't precompress a response whose uncompressed body would be more than
+ * this many bytes: requests that big are rare, and seldom repeated. */
+#define PRECOMPRESSED_RESPONSE_MAX_LEN (1<<20)
+/** Keep no more than this many bytes of precompressed responses. */
+#define PRECOMPRESSED_CACHE_MAX_BYTES (8<<20)
+/** Forget a precompressed response this many seconds after making it. */
+#define PRECOMPRESSED_RESPONSE_LIFETIME (30*60)
+
+/** Map from digest of a request (its spool source, whether it came over an
+ * encrypted connection, and its sorted list of descriptor digests) to a
+ * cached_dir_t holding the compressed response.  The cached_dir_t's
+ * <b>published</b> field is when we made it. */
+static digestmap_t *precompressed_responses = NULL;
+/** Keys of precompressed_responses, least recently used first. */
+static smartlist_t *precompressed_lru = NULL;
+/** Total compressed bytes held in precompressed_responses. */
+static size_t precompressed_bytes = 0;
+
+/** Remove the precompressed response stored under the key at position
+ * <b>idx</b> of precompressed_lru. */
+static void
+precompressed_response_remove(int idx)
+{
+  char *key = smartlist_get(precompressed_lru, idx);
+  cached_dir_t *d = digestmap_remove(precompressed_responses, key);
+  if (d) {
+    precompressed_bytes -= d->dir_z_len;
+    cached_dir_decref(d);
+  }
+  smartlist_del_keeporder(precompressed_lru, idx);
+  tor_free(key);
+}
+
+/** Set <b>key_out</b> to the key under which we keep the compressed response
+ * to the descriptor request spooling on <b>conn</b>. */
+static void
+precompressed_response_key(char *key_out, dir_connection_t *conn)
+{
+  crypto_digest_t *d = crypto_digest_new();
+  size_t fp_len = conn->dir_spool_src == DIR_SPOOL_MICRODESC ?
+    DIGEST256_LEN : DIGEST_LEN;
+  char prefix[2];
+  prefix[0] = (char)conn->dir_spool_src;
+  prefix[1] = (char)connection_dir_is_encrypted(conn);
+  crypto_digest_add_bytes(d, prefix, sizeof(prefix));
+  SMARTLIST_FOREACH(conn->fingerprint_stack, const char *, fp,
+                    crypto_digest_add_bytes(d, fp, fp_len));
+  crypto_digest_get_digest(d, key_out, DIGEST_LEN);
+  crypto_digest_free(d);
+}
+
+/** Return the uncompressed body of the descriptor request spooling on
+ * <b>conn</b>, or NULL if we're missing any of the descriptors, may not send
+ * one of them on <b>conn</b>, or the body would be too big to precompress.
+ */
+static char *
+precompressed_response_build_body(dir_connection_t *conn)
+{
+  smartlist_t *chunks = smartlist_new();
+  microdesc_cache_t *cache = get_microdesc_cache();
+  int extra = conn->dir_spool_src == DIR_SPOOL_EXTRA_BY_DIGEST;
+  size_t total = 0;
+  char *body = NULL;
+  int i;
+
+  /* We spool from the end of fingerprint_stack, so build in that order. */
+  for (i = smartlist_len(conn->fingerprint_stack) - 1; i >= 0; --i) {
+    const char *fp = smartlist_get(conn->fingerprint_stack, i);
+    if (conn->dir_spool_src == DIR_SPOOL_MICRODESC) {
+      microdesc_t *md = microdesc_cache_lookup_by_digest256(cache, fp);
+      if (!md)
+        goto done;
+      smartlist_add(chunks, tor_strndup(md->body, md->bodylen));
+      total += md->bodylen;
+    } else {
+      const signed_descriptor_t *sd = extra ?
+        extrainfo_get_by_descriptor_digest(fp) :
+        router_get_by_descriptor_digest(fp);
+      if (!sd ||
+          (!connection_dir_is_encrypted(conn) && !sd->send_unencrypted))
+        goto done;
+      smartlist_add(chunks, tor_strndup(signed_descriptor_get_body(sd),
+                                        sd->signed_descriptor_len));
+      total += sd->signed_descriptor_len;
+    }
+    if (total > PRECOMPRESSED_RESPONSE_MAX_LEN)
+      goto done;
+  }
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+
+ done:
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return body;
+}
+
+/** Called when <b>conn</b> is about to spool a compressed answer to a
+ * request for descriptors by digest.  If we have already compressed the same
+ * answer, or can compress it once for everybody who asks, arrange for
+ * <b>conn</b> to spool the precompressed bytes and return 1.  Otherwise
+ * return 0, and the caller should compress as it spools. */
+int
+connection_dirserv_spool_precompressed(dir_connection_t *conn)
+{
+  char key[DIGEST_LEN];
+  cached_dir_t *d;
+  time_t now = time(NULL);
+
+  if (conn->dir_spool_src != DIR_SPOOL_MICRODESC &&
+      conn->dir_spool_src != DIR_SPOOL_SERVER_BY_DIGEST &&
+      conn->dir_spool_src != DIR_SPOOL_EXTRA_BY_DIGEST)
+    return 0;
+  if (!conn->fingerprint_stack || !smartlist_len(conn->fingerprint_stack))
+    return 0;
+  if (!precompressed_responses) {
+    precompressed_responses = digestmap_new();
+    precompressed_lru = smartlist_new();
+  }
+
+  precompressed_response_key(key, conn);
+  d = digestmap_get(precompressed_responses, key);
+  SMARTLIST_FOREACH_BEGIN(precompressed_lru, char *, k) {
+    if (tor_memeq(k, key, DIGEST_LEN)) {
+      if (d && d->published + PRECOMPRESSED_RESPONSE_LIFETIME > now) {
+        /* Most recently used now. */
+        smartlist_del_keeporder(precompressed_lru, k_sl_idx);
+        smartlist_add(precompressed_lru, k);
+      } else {
+        precompressed_response_remove(k_sl_idx);
+        d = NULL;
+      }
+      break;
+    }
+  } SMARTLIST_FOREACH_END(k);
+
+  if (!d) {
+    char *body = precompressed_response_build_body(conn);
+    if (!body)
+      return 0;
+    d = new_cached_dir(body, now);
+    if (!d->dir_z) {
+      cached_dir_decref(d);
+      return 0;
+    }
+    /* We only ever spool the compressed form. */
+    tor_free(d->dir);
+    digestmap_set(precompressed_responses, key, d);
+    smartlist_add(precompressed_lru, tor_memdup(key, DIGEST_LEN));
+    precompressed_bytes += d->dir_z_len;
+    while (precompressed_bytes > PRECOMPRESSED_CACHE_MAX_BYTES &&
+           smartlist_len(precompressed_lru) > 1)
+      precompressed_response_remove(0);
+  }
+
+  SMARTLIST_FOREACH(conn->fingerprint_stack, char *, fp, tor_free(fp));
+  smartlist_free(conn->fingerprint_stack);
+  conn->fingerprint_stack = NULL;
+  ++d->refcnt;
+  conn->cached_dir = d;
+  conn->cached_dir_offset = 0;
+  conn->dir_spool_src = DIR_SPOOL_CACHED_DIR;
+  return 1;
+}
+
 /** Called whenever we have flushed some directory data in state
  * SERVER_WRITING. */
 int
@@ -3810,5 +4187,15 @@ dirserv_free_all(void)
   cached_v2_networkstatus = NULL;
   strmap_free(cached_consensuses, _free_cached_dir);
   cached_consensuses = NULL;
+  strmap_free(consensus_diff_sources, consensus_diff_sources_free);
+  consensus_diff_sources = NULL;
+  if (precompressed_lru) {
+    while (smartlist_len(precompressed_lru))
+      precompressed_response_remove(smartlist_len(precompressed_lru) - 1);
+    smartlist_free(precompressed_lru);
+    precompressed_lru = NULL;
+  }
+  digestmap_free(precompressed_responses, NULL);
+  precompressed_responses = NULL;
 }
 
@@ -53,6 +53,7 @@
    )
 
 int connection_dirserv_flushed_some(dir_connection_t *conn);
+int connection_dirserv_spool_precompressed(dir_connection_t *conn);
 
 int dirserv_add_own_fingerprint(const char *nickname, crypto_pk_t *pk);
 int dirserv_load_fingerprint_file(void);
@@ -87,6 +88,8 @@ void directory_set_dirty(void);
 cached_dir_t *dirserv_get_directory(void);
 cached_dir_t *dirserv_get_runningrouters(void);
 cached_dir_t *dirserv_get_consensus(const char *flavor_name);
+cached_dir_t *dirserv_get_consensus_diff(const char *flavor_name,
+                                         const char *digest);
 void dirserv_set_cached_directory(const char *directory, time_t when,
                                   int is_running_routers);
 void dirserv_set_cached_networkstatus_v2(const char *directory,
@@ -52,6 +52,14 @@ static void dirvote_clear_votes(int all_votes);
 static int dirvote_compute_consensuses(void);
 static int dirvote_publish_consensus(void);
 static char *make_consensus_method_list(int low, int high, const char *sep);
+static char *compute_consensus_impl(smartlist_t *votes,
+                                    int total_authorities,
+                                    crypto_pk_t *identity_key,
+                                    crypto_pk_t *signing_key,
+                                    const char *legacy_id_key_digest,
+                                    crypto_pk_t *legacy_signing_key,
+                                    consensus_flavor_t flavor,
+                                    networkstatus_t **consensus_out);
 
 /** The highest consensus method that we currently support. */
 #define MAX_SUPPORTED_CONSENSUS_METHOD 12
@@ -427,6 +435,59 @@ _compare_vote_rs(const void **_a, const void **_b)
   return compare_vote_rs(a,b);
 }
 
+/** A growable string, for writing the router entries of a consensus in
+ * one piece rather than as a chunk per line. */
+typedef struct consensus_text_t {
+  char *mem; /**< The text so far, NUL-terminated. */
+  size_t len; /**< strlen(mem) */
+  size_t alloc; /**< Bytes allocated at mem. */
+} consensus_text_t;
+
+/** Make sure that <b>t</b> has room for <b>n</b> more bytes of text and a
+ * terminating NUL. */
+static void
+consensus_text_reserve(consensus_text_t *t, size_t n)
+{
+  if (t->len + n < t->alloc)
+    return;
+  if (!t->alloc)
+    t->alloc = 1024;
+  while (t->len + n >= t->alloc)
+    t->alloc *= 2;
+  t->mem = tor_realloc(t->mem, t->alloc);
+}
+
+/** Append the <b>n</b> bytes at <b>s</b> to <b>t</b>. */
+static void
+consensus_text_add(consensus_text_t *t, const char *s, size_t n)
+{
+  consensus_text_reserve(t, n);
+  memcpy(t->mem + t->len, s, n);
+  t->len += n;
+  t->mem[t->len] = '\0';
+}
+
+/** Append printf-style <b>format</b> and its arguments to <b>t</b>. */
+static void
+consensus_text_add_printf(consensus_text_t *t, const char *format, ...)
+  CHECK_PRINTF(2, 3);
+static void
+consensus_text_add_printf(consensus_text_t *t, const char *format, ...)
+{
+  va_list ap;
+  int r;
+  consensus_text_reserve(t, 128);
+  while (1) {
+    va_start(ap, format);
+    r = tor_vsnprintf(t->mem + t->len, t->alloc - t->len, format, ap);
+    va_end(ap);
+    if (r >= 0)
+      break;
+    consensus_text_reserve(t, t->alloc - t->len);
+  }
+  t->len += r;
+}
+
 /** Given a list of vote_routerstatus_t, all for the same router identity,
  * return whichever is most frequent, breaking ties in favor of more
  * recently published vote_routerstatus_t and in case of ties there,
@@ -475,19 +536,21 @@ compute_routerstatus_consensus(smartlist_t *votes, int consensus_method,
       microdesc_digest256_out) {
     smartlist_t *digests = smartlist_new();
     const char *best_microdesc_digest;
+    /* One digest per vote at most; keep them all in one allocation. */
+    char *digest_mem = tor_malloc(DIGEST256_LEN * smartlist_len(votes));
     SMARTLIST_FOREACH_BEGIN(votes, vote_routerstatus_t *, rs) {
-        char d[DIGEST256_LEN];
+        char *d = digest_mem + DIGEST256_LEN * smartlist_len(digests);
         if (compare_vote_rs(rs, most))
           continue;
         if (!vote_routerstatus_find_microdesc_hash(d, rs, consensus_method,
                                                    DIGEST_SHA256))
-          smartlist_add(digests, tor_memdup(d, sizeof(d)));
+          smartlist_add(digests, d);
     } SMARTLIST_FOREACH_END(rs);
     smartlist_sort_digests256(digests);
     best_microdesc_digest = smartlist_get_most_frequent_digest256(digests);
     if (best_microdesc_digest)
       memcpy(microdesc_digest256_out, best_microdesc_digest, DIGEST256_LEN);
-    SMARTLIST_FOREACH(digests, char *, cp, tor_free(cp));
+    tor_free(digest_mem);
     smartlist_free(digests);
   }
 
@@ -1347,6 +1410,28 @@ networkstatus_compute_consensus(smartlist_t *votes,
                                 const char *legacy_id_key_digest,
                                 crypto_pk_t *legacy_signing_key,
                                 consensus_flavor_t flavor)
+{
+  return compute_consensus_impl(votes, total_authorities, identity_key,
+                                signing_key, legacy_id_key_digest,
+                                legacy_signing_key, flavor, NULL);
+}
+
+/** As networkstatus_compute_consensus(), but if <b>consensus_out</b> is
+ * provided, set *<b>consensus_out</b> to the parsed consensus (which we
+ * parse anyway to check it) instead of freeing it.
+ *
+ * This function must not touch global state other than by logging: the
+ * flavors of a consensus may be computed in parallel.  <b>votes</b> gets
+ * sorted, so each concurrent call needs its own list. */
+static char *
+compute_consensus_impl(smartlist_t *votes,
+                       int total_authorities,
+                       crypto_pk_t *identity_key,
+                       crypto_pk_t *signing_key,
+                       const char *legacy_id_key_digest,
+                       crypto_pk_t *legacy_signing_key,
+                       consensus_flavor_t flavor,
+                       networkstatus_t **consensus_out)
 {
   smartlist_t *chunks;
   char *result = NULL;
@@ -1526,6 +1611,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
     SMARTLIST_FOREACH_BEGIN(dir_sources, const dir_src_ent_t *, e) {
       char fingerprint[HEX_DIGEST_LEN+1];
       char votedigest[HEX_DIGEST_LEN+1];
+      char addrbuf[INET_NTOA_BUF_LEN];
+      struct in_addr in;
       networkstatus_t *v = e->v;
       networkstatus_voter_info_t *voter = get_voter(v);
 
@@ -1535,11 +1622,14 @@ networkstatus_compute_consensus(smartlist_t *votes,
       base16_encode(fingerprint, sizeof(fingerprint), e->digest, DIGEST_LEN);
       base16_encode(votedigest, sizeof(votedigest), voter->vote_digest,
                     DIGEST_LEN);
+      /* Not fmt_addr32(): we may be running in a worker thread. */
+      in.s_addr = htonl(voter->addr);
+      tor_inet_ntoa(&in, addrbuf, sizeof(addrbuf));
 
       smartlist_add_asprintf(chunks,
                    "dir-source %s%s %s %s %s %d %d\n",
                    voter->nickname, e->is_legacy ? "-legacy" : "",
-                   fingerprint, voter->address, fmt_addr32(voter->addr),
+                   fingerprint, voter->address, addrbuf,
                    voter->dir_port,
                    voter->or_port);
       if (! e->is_legacy) {
@@ -1558,11 +1648,14 @@ networkstatus_compute_consensus(smartlist_t *votes,
   {
     int *index; /* index[j] is the current index into votes[j]. */
     int *size; /* size[j] is the number of routerstatuses in votes[j]. */
+    vote_routerstatus_t **cur_rs; /* cur_rs[j] is votes[j]'s entry at
+                                   * index[j], or NULL if there are no more. */
     int *flag_counts; /* The number of voters that list flag[j] for the
                        * currently considered router. */
+    int *chosen_flag; /* chosen_flag[j] is true iff we list flag[j] for the
+                       * currently considered router. */
     int i;
     smartlist_t *matching_descs = smartlist_new();
-    smartlist_t *chosen_flags = smartlist_new();
     smartlist_t *versions = smartlist_new();
     smartlist_t *exitsummaries = smartlist_new();
     uint32_t *bandwidths = tor_malloc(sizeof(uint32_t) * smartlist_len(votes));
@@ -1579,7 +1672,10 @@ networkstatus_compute_consensus(smartlist_t *votes,
                      * is the same flag as votes[j]->known_flags[b]. */
     int *named_flag; /* Index of the flag "Named" for votes[j] */
     int *unnamed_flag; /* Index of the flag "Unnamed" for votes[j] */
-    int chosen_named_idx;
+    int chosen_named_idx, chosen_unnamed_idx, exit_idx, guard_idx;
+    int running_idx, bad_exit_idx;
+    int max_size = 0;
+    consensus_text_t entries;
 
     strmap_t *name_to_id_map = strmap_new();
     char conflict[DIGEST_LEN];
@@ -1597,6 +1693,11 @@ networkstatus_compute_consensus(smartlist_t *votes,
     for (i = 0; i < smartlist_len(votes); ++i)
       unnamed_flag[i] = named_flag[i] = -1;
     chosen_named_idx = smartlist_string_pos(flags, "Named");
+    chosen_unnamed_idx = smartlist_string_pos(flags, "Unnamed");
+    exit_idx = smartlist_string_pos(flags, "Exit");
+    guard_idx = smartlist_string_pos(flags, "Guard");
+    running_idx = smartlist_string_pos(flags, "Running");
+    bad_exit_idx = smartlist_string_pos(flags, "BadExit");
 
     /* Build the flag index. */
     SMARTLIST_FOREACH(votes, networkstatus_t *, v,
@@ -1616,7 +1717,21 @@ networkstatus_compute_consensus(smartlist_t *votes,
       });
       n_voter_flags[v_sl_idx] = smartlist_len(v->known_flags);
       size[v_sl_idx] = smartlist_len(v->routerstatus_list);
+      if (size[v_sl_idx] > max_size)
+        max_size = size[v_sl_idx];
+    });
+
+    /* Every vote's routerstatus_list is sorted by identity digest, so we
+     * can merge them in one pass, writing the entries into one buffer that
+     * starts out big enough for a typical entry per router. */
+    cur_rs = tor_malloc_zero(sizeof(vote_routerstatus_t*) *
+                             smartlist_len(votes));
+    SMARTLIST_FOREACH(votes, networkstatus_t *, v, {
+      if (size[v_sl_idx])
+        cur_rs[v_sl_idx] = smartlist_get(v->routerstatus_list, 0);
     });
+    memset(&entries, 0, sizeof(entries));
+    consensus_text_reserve(&entries, (size_t)max_size * 256);
 
     /* Named and Unnamed get treated specially */
     if (consensus_method >= 2) {
@@ -1672,6 +1787,7 @@ networkstatus_compute_consensus(smartlist_t *votes,
 
     /* Now go through all the votes */
     flag_counts = tor_malloc(sizeof(int) * smartlist_len(flags));
+    chosen_flag = tor_malloc(sizeof(int) * smartlist_len(flags));
     while (1) {
       vote_routerstatus_t *rs;
       routerstatus_t rs_out;
@@ -1687,36 +1803,37 @@ networkstatus_compute_consensus(smartlist_t *votes,
       char microdesc_digest[DIGEST256_LEN];
 
       /* Of the next-to-be-considered digest in each voter, which is first? */
-      SMARTLIST_FOREACH(votes, networkstatus_t *, v, {
-        if (index[v_sl_idx] < size[v_sl_idx]) {
-          rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
-          if (!lowest_id ||
-              fast_memcmp(rs->status.identity_digest,
-                          lowest_id, DIGEST_LEN) < 0)
-            lowest_id = rs->status.identity_digest;
-        }
-      });
+      for (i = 0; i < smartlist_len(votes); ++i) {
+        rs = cur_rs[i];
+        if (rs && (!lowest_id ||
+                   fast_memcmp(rs->status.identity_digest,
+                               lowest_id, DIGEST_LEN) < 0))
+          lowest_id = rs->status.identity_digest;
+      }
       if (!lowest_id) /* we're out of routers. */
         break;
 
       memset(flag_counts, 0, sizeof(int)*smartlist_len(flags));
       smartlist_clear(matching_descs);
-      smartlist_clear(chosen_flags);
       smartlist_clear(versions);
       num_bandwidths = 0;
       num_mbws = 0;
 
       /* Okay, go through all the entries for this digest. */
       SMARTLIST_FOREACH_BEGIN(votes, networkstatus_t *, v) {
-        if (index[v_sl_idx] >= size[v_sl_idx])
+        rs = cur_rs[v_sl_idx];
+        if (!rs)
           continue; /* out of entries. */
-        rs = smartlist_get(v->routerstatus_list, index[v_sl_idx]);
         if (fast_memcmp(rs->status.identity_digest, lowest_id, DIGEST_LEN))
           continue; /* doesn't include this router. */
         /* At this point, we know that we're looking at a routerstatus with
          * identity "lowest".
          */
-        ++index[v_sl_idx];
+        if (++index[v_sl_idx] < size[v_sl_idx])
+          cur_rs[v_sl_idx] = smartlist_get(v->routerstatus_list,
+                                           index[v_sl_idx]);
+        else
+          cur_rs[v_sl_idx] = NULL;
         ++n_listing;
 
         smartlist_add(matching_descs, rs);
@@ -1754,7 +1871,8 @@ networkstatus_compute_consensus(smartlist_t *votes,
        * routerinfo and its contents are. */
       memset(microdesc_digest, 0, sizeof(microdesc_digest));
       rs = compute_routerstatus_consensus(matching_descs, consensus_method,
-                                          microdesc_digest);
+                                          flavor == FLAV_MICRODESC ?
+                                          microdesc_digest : NULL);
       /* Copy bits of that into rs_out. */
       tor_assert(fast_memeq(lowest_id, rs->status.identity_digest,DIGEST_LEN));
       memcpy(rs_out.identity_digest, lowest_id, DIGEST_LEN);
@@ -1777,7 +1895,10 @@ networkstatus_compute_consensus(smartlist_t *votes,
         is_named = chosen_named_idx >= 0 &&
           (!naming_conflict && flag_counts[chosen_named_idx]);
       } else {
-        const char *d = strmap_get_lc(name_to_id_map, rs_out.nickname);
+        /* Most networks have no Named routers at all: don't bother
+         * lowercasing every nickname to find that out. */
+        const char *d = strmap_isempty(name_to_id_map) ? NULL :
+          strmap_get_lc(name_to_id_map, rs_out.nickname);
         if (!d) {
           is_named = is_unnamed = 0;
         } else if (fast_memeq(d, lowest_id, DIGEST_LEN)) {
@@ -1787,40 +1908,36 @@ networkstatus_compute_consensus(smartlist_t *votes,
         }
       }
 
-      /* Set the flags. */
-      smartlist_add(chosen_flags, (char*)"s"); /* for the start of the line. */
-      SMARTLIST_FOREACH(flags, const char *, fl,
-      {
-        if (!strcmp(fl, "Named")) {
-          if (is_named)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else if (!strcmp(fl, "Unnamed") && consensus_method >= 2) {
-          if (is_unnamed)
-            smartlist_add(chosen_flags, (char*)fl);
-        } else {
-          if (flag_counts[fl_sl_idx] > n_flag_voters[fl_sl_idx]/2) {
-            smartlist_add(chosen_flags, (char*)fl);
-            if (!strcmp(fl, "Exit"))
-              is_exit = 1;
-            else if (!strcmp(fl, "Guard"))
-              is_guard = 1;
-            else if (!strcmp(fl, "Running"))
-              is_running = 1;
-            else if (!strcmp(fl, "BadExit"))
-              is_bad_exit = 1;
-          }
-        }
-      });
+      /* Set the flags.  chosen_flag[f] is true iff we list flags[f]. */
+      for (i = 0; i < smartlist_len(flags); ++i) {
+        if (i == chosen_named_idx)
+          chosen_flag[i] = is_named;
+        else if (i == chosen_unnamed_idx && consensus_method >= 2)
+          chosen_flag[i] = is_unnamed;
+        else
+          chosen_flag[i] = flag_counts[i] > n_flag_voters[i]/2;
+      }
+      is_exit = exit_idx >= 0 && chosen_flag[exit_idx];
+      is_guard = guard_idx >= 0 && chosen_flag[guard_idx];
+      is_running = running_idx >= 0 && chosen_flag[running_idx];
+      is_bad_exit = bad_exit_idx >= 0 && chosen_flag[bad_exit_idx];
 
       /* Starting with consensus method 4 we do not list servers
        * that are not running in a consensus.  See Proposal 138 */
       if (consensus_method >= 4 && !is_running)
         continue;
 
-      /* Pick the version. */
+      /* Pick the version.  Usually every voter agrees, and we can skip
+       * sorting, which parses each version several times. */
       if (smartlist_len(versions)) {
-        sort_version_list(versions, 0);
-        chosen_version = get_most_frequent_member(versions);
+        int all_same = 1;
+        chosen_version = smartlist_get(versions, 0);
+        SMARTLIST_FOREACH(versions, const char *, ver,
+                          if (strcmp(ver, chosen_version)) all_same = 0);
+        if (!all_same) {
+          sort_version_list(versions, 0);
+          chosen_version = get_most_frequent_member(versions);
+        }
       } else {
         chosen_version = NULL;
       }
@@ -1940,45 +2057,57 @@ networkstatus_compute_consensus(smartlist_t *votes,
         }
       }
 
-      {
-        char buf[4096];
-        /* Okay!! Now we can write the descriptor... */
-        /*     First line goes into "buf". */
-        routerstatus_format_entry(buf, sizeof(buf), &rs_out, NULL,
-                                  rs_format);
-        smartlist_add(chunks, tor_strdup(buf));
-      }
+      /* Okay!! Now we can write the descriptor... */
+      /*     First line is the "r" line. */
+#define MAX_CONSENSUS_R_LINE_LEN 256
+      consensus_text_reserve(&entries, MAX_CONSENSUS_R_LINE_LEN);
+      routerstatus_format_entry(entries.mem + entries.len,
+                                entries.alloc - entries.len, &rs_out, NULL,
+                                rs_format);
+      entries.len += strlen(entries.mem + entries.len);
       /*     Now an m line, if applicable. */
       if (flavor == FLAV_MICRODESC &&
           !tor_digest256_is_zero(microdesc_digest)) {
         char m[BASE64_DIGEST256_LEN+1];
         digest256_to_base64(m, microdesc_digest);
-        smartlist_add_asprintf(chunks, "m %s\n", m);
+        consensus_text_add_printf(&entries, "m %s\n", m);
       }
-      /*     Next line is all flags.  The "\n" is missing. */
-      smartlist_add(chunks,
-                    smartlist_join_strings(chosen_flags, " ", 0, NULL));
+      /*     Next line is all flags. */
+      consensus_text_add(&entries, "s", 1);
+      SMARTLIST_FOREACH_BEGIN(flags, const char *, fl) {
+        if (chosen_flag[fl_sl_idx]) {
+          consensus_text_add(&entries, " ", 1);
+          consensus_text_add(&entries, fl, strlen(fl));
+        }
+      } SMARTLIST_FOREACH_END(fl);
+      consensus_text_add(&entries, "\n", 1);
       /*     Now the version line. */
       if (chosen_version) {
-        smartlist_add(chunks, tor_strdup("\nv "));
-        smartlist_add(chunks, tor_strdup(chosen_version));
+        consensus_text_add_printf(&entries, "v %s\n", chosen_version);
       }
-      smartlist_add(chunks, tor_strdup("\n"));
       /*     Now the weight line. */
       if (rs_out.has_bandwidth) {
-        smartlist_add_asprintf(chunks, "w Bandwidth=%d\n", rs_out.bandwidth);
+        consensus_text_add_printf(&entries, "w Bandwidth=%d\n",
+                                  rs_out.bandwidth);
       }
 
       /*     Now the exitpolicy summary line. */
       if (rs_out.has_exitsummary && flavor == FLAV_NS) {
-        smartlist_add_asprintf(chunks, "p %s\n", rs_out.exitsummary);
+        consensus_text_add_printf(&entries, "p %s\n", rs_out.exitsummary);
       }
 
       /* And the loop is over and we move on to the next router */
     }
 
+    if (entries.len)
+      smartlist_add(chunks, entries.mem);
+    else
+      tor_free(entries.mem);
+
     tor_free(index);
     tor_free(size);
+    tor_free(cur_rs);
+    tor_free(chosen_flag);
     tor_free(n_voter_flags);
     tor_free(n_flag_voters);
     for (i = 0; i < smartlist_len(votes); ++i)
@@ -1989,7 +2118,6 @@ networkstatus_compute_consensus(smartlist_t *votes,
     tor_free(unnamed_flag);
     strmap_free(name_to_id_map, NULL);
     smartlist_free(matching_descs);
-    smartlist_free(chosen_flags);
     smartlist_free(versions);
     smartlist_free(exitsummaries);
     tor_free(bandwidths);
@@ -2023,13 +2151,15 @@ networkstatus_compute_consensus(smartlist_t *votes,
         weight_scale = tor_parse_long(eq+1, 10, 1, INT32_MAX, &ok,
                                          NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-              escaped(bw_weight_param));
+          char *esc = esc_for_log(bw_weight_param);
+          log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+          tor_free(esc);
           weight_scale = BW_WEIGHT_SCALE;
         }
       } else {
-        log_warn(LD_DIR, "Bad element '%s' in bw weight param",
-            escaped(bw_weight_param));
+        char *esc = esc_for_log(bw_weight_param);
+        log_warn(LD_DIR, "Bad element '%s' in bw weight param", esc);
+        tor_free(esc);
         weight_scale = BW_WEIGHT_SCALE;
       }
     }
@@ -2130,7 +2260,10 @@ networkstatus_compute_consensus(smartlist_t *votes,
     if (consensus_method >= MIN_METHOD_FOR_BW_WEIGHTS && added_weights) {
       networkstatus_verify_bw_weights(c);
     }
-    networkstatus_vote_free(c);
+    if (consensus_out)
+      *consensus_out = c;
+    else
+      networkstatus_vote_free(c);
   }
 
   return result;
@@ -3042,6 +3175,141 @@ dirvote_add_vote(const char *vote_body, const char **msg_out, int *status_out)
   return any_failed ? NULL : pending_vote;
 }
 
+/** The inputs and outputs of one call to compute_consensus_impl(), for
+ * compute_consensus_jobs(). */
+typedef struct consensus_job_t {
+  smartlist_t *votes; /**< This job's own list of the votes. */
+  int total_authorities;
+  crypto_pk_t *identity_key;
+  crypto_pk_t *signing_key;
+  const char *legacy_id_digest;
+  crypto_pk_t *legacy_signing_key;
+  consensus_flavor_t flavor;
+  char *body; /**< The consensus we generated, or NULL on failure. */
+  networkstatus_t *consensus; /**< body, parsed, or NULL on failure. */
+  int spawned; /**< True iff a worker thread is running this job. */
+#ifdef USE_PTHREADS
+  tor_mutex_t *lock; /**< Protects *<b>n_running</b>. */
+  tor_cond_t *done_cond; /**< Signalled when *<b>n_running</b> hits 0. */
+  int *n_running; /**< How many worker threads haven't finished yet. */
+#endif
+} consensus_job_t;
+
+/** Compute the consensus described by <b>job</b>. */
+static void
+consensus_job_run(consensus_job_t *job)
+{
+  job->body = compute_consensus_impl(job->votes, job->total_authorities,
+                                     job->identity_key, job->signing_key,
+                                     job->legacy_id_digest,
+                                     job->legacy_signing_key, job->flavor,
+                                     &job->consensus);
+}
+
+#ifdef USE_PTHREADS
+/** Main function for a worker thread computing the consensus_job_t
+ * <b>arg</b>. */
+static void
+consensus_worker_main(void *arg)
+{
+  consensus_job_t *job = arg;
+  consensus_job_run(job);
+  tor_mutex_acquire(job->lock);
+  if (--*job->n_running == 0)
+    tor_cond_signal_all(job->done_cond);
+  tor_mutex_release(job->lock);
+  spawn_exit();
+}
+#endif
+
+/** Run the <b>n_jobs</b> consensus computations in <b>jobs</b>.  If we have
+ * threads and <b>n_cpus</b> is more than 1, run all but the first in worker
+ * threads at the same time as we run the first one here, and return once
+ * they have all finished. */
+static void
+compute_consensus_jobs(consensus_job_t *jobs, int n_jobs, int n_cpus)
+{
+  int i;
+#ifdef USE_PTHREADS
+  tor_mutex_t *lock = NULL;
+  tor_cond_t *done_cond = NULL;
+  int n_running = 0;
+
+  if (n_cpus > 1 && n_jobs > 1) {
+    lock = tor_mutex_new();
+    done_cond = tor_cond_new();
+    tor_mutex_acquire(lock);
+    for (i = 1; i < n_jobs && i < n_cpus; ++i) {
+      jobs[i].lock = lock;
+      jobs[i].done_cond = done_cond;
+      jobs[i].n_running = &n_running;
+      ++n_running;
+      if (spawn_func(consensus_worker_main, &jobs[i]) == 0)
+        jobs[i].spawned = 1;
+      else
+        --n_running;
+    }
+    tor_mutex_release(lock);
+  }
+#else
+  (void) n_cpus;
+#endif
+
+  for (i = 0; i < n_jobs; ++i) {
+    if (!jobs[i].spawned)
+      consensus_job_run(&jobs[i]);
+  }
+
+#ifdef USE_PTHREADS
+  if (lock) {
+    tor_mutex_acquire(lock);
+    while (n_running)
+      tor_cond_wait(done_cond, lock);
+    tor_mutex_release(lock);
+    tor_cond_free(done_cond);
+    tor_mutex_free(lock);
+  }
+#endif
+}
+
+/** Compute every flavor of consensus from <b>votes</b>, as
+ * networkstatus_compute_consensus() would, using up to <b>n_cpus</b>
+ * threads.  Set <b>bodies_out</b>[flav] to the text of each flavor and
+ * <b>consensuses_out</b>[flav] to its parsed form, or to NULL on failure. */
+void
+dirvote_compute_all_flavors(smartlist_t *votes, int total_authorities,
+                            crypto_pk_t *identity_key,
+                            crypto_pk_t *signing_key,
+                            const char *legacy_id_digest,
+                            crypto_pk_t *legacy_signing_key, int n_cpus,
+                            char **bodies_out,
+                            networkstatus_t **consensuses_out)
+{
+  consensus_job_t jobs[N_CONSENSUS_FLAVORS];
+  int flav;
+
+  memset(jobs, 0, sizeof(jobs));
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    consensus_job_t *job = &jobs[flav];
+    job->votes = smartlist_new();
+    smartlist_add_all(job->votes, votes);
+    job->total_authorities = total_authorities;
+    job->identity_key = identity_key;
+    job->signing_key = signing_key;
+    job->legacy_id_digest = legacy_id_digest;
+    job->legacy_signing_key = legacy_signing_key;
+    job->flavor = flav;
+  }
+
+  compute_consensus_jobs(jobs, N_CONSENSUS_FLAVORS, n_cpus);
+
+  for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+    bodies_out[flav] = jobs[flav].body;
+    consensuses_out[flav] = jobs[flav].consensus;
+    smartlist_free(jobs[flav].votes);
+  }
+}
+
 /** Try to compute a v3 networkstatus consensus from the currently pending
  * votes.  Return 0 on success, -1 on failure.  Store the consensus in
  * pending_consensus: it won't be ready to be published until we have
@@ -3112,6 +3380,8 @@ dirvote_compute_consensuses(void)
     crypto_pk_t *legacy_sign=NULL;
     char *legacy_id_digest = NULL;
     int n_generated = 0;
+    char *bodies[N_CONSENSUS_FLAVORS];
+    networkstatus_t *consensuses[N_CONSENSUS_FLAVORS];
     if (get_options()->V3AuthUseLegacyKey) {
       authority_cert_t *cert = get_my_v3_legacy_cert();
       legacy_sign = get_my_v3_legacy_signing_key();
@@ -3125,21 +3395,22 @@ dirvote_compute_consensuses(void)
       }
     }
 
+    dirvote_compute_all_flavors(votes, n_voters, my_cert->identity_key,
+                                get_my_v3_authority_signing_key(),
+                                legacy_id_digest, legacy_sign,
+                                get_num_cpus(get_options()),
+                                bodies, consensuses);
+
     for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
       const char *flavor_name = networkstatus_get_flavor_name(flav);
-      consensus_body = networkstatus_compute_consensus(
-        votes, n_voters,
-        my_cert->identity_key,
-        get_my_v3_authority_signing_key(), legacy_id_digest, legacy_sign,
-        flav);
+      consensus_body = bodies[flav];
+      consensus = consensuses[flav];
 
       if (!consensus_body) {
         log_warn(LD_DIR, "Couldn't generate a %s consensus at all!",
                  flavor_name);
         continue;
       }
-      consensus = networkstatus_parse_vote_from_string(consensus_body, NULL,
-                                                       NS_TYPE_CONSENSUS);
       if (!consensus) {
         log_warn(LD_DIR, "Couldn't parse %s consensus we generated!",
                  flavor_name);
@@ -3515,6 +3786,7 @@ dirvote_create_microdescriptor(const routerinfo_t *ri)
 
   if (crypto_pk_write_public_key_to_string(ri->onion_pkey, &key, &keylen)<0)
     goto done;
+  router_parse_exit_policy_if_needed(ri);
   summary = policy_summarize(ri->exit_policy);
   if (ri->declared_family)
     family = smartlist_join_strings(ri->declared_family, " ", 0, NULL);
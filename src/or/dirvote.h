@@ -87,6 +87,13 @@ char *format_networkstatus_vote(crypto_pk_t *private_key,
                                  networkstatus_t *v3_ns);
 char *dirvote_compute_params(smartlist_t *votes, int method,
                              int total_authorities);
+void dirvote_compute_all_flavors(smartlist_t *votes, int total_authorities,
+                                 crypto_pk_t *identity_key,
+                                 crypto_pk_t *signing_key,
+                                 const char *legacy_id_digest,
+                                 crypto_pk_t *legacy_signing_key, int n_cpus,
+                                 char **bodies_out,
+                                 networkstatus_t **consensuses_out);
 #endif
 
 #endif
@@ -6,11 +6,14 @@
 /**
  * \file dns.c
  * \brief Implements a local cache for DNS results for Tor servers.
- * This is implemented as a wrapper around Adam Langley's eventdns.c code.
- * (We can't just use gethostbyname() and friends because we really need to
- * be nonblocking.)
+ * By default this is implemented as a wrapper around Adam Langley's
+ * eventdns.c code.  (We can't just call gethostbyname() and friends from
+ * the main thread because we really need to be nonblocking.)  Servers that
+ * would rather use the system resolver can set ServerDNSBackend to
+ * getaddrinfo, which calls getaddrinfo() from a small pool of threads.
  **/
 
+#define DNS_PRIVATE
 #include "or.h"
 #include "circuitlist.h"
 #include "circuituse.h"
@@ -24,6 +27,9 @@
 #include "relay.h"
 #include "router.h"
 #include "ht.h"
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
 #ifdef HAVE_EVENT2_DNS_H
 #include <event2/event.h>
 #include <event2/dns.h>
@@ -84,11 +90,16 @@ struct evdns_request;
  * that the resolver is wedged? */
 #define RESOLVE_MAX_TIMEOUT 300
 
-/** Possible outcomes from hostname lookup: permanent failure,
- * transient (retryable) failure, and success. */
-#define DNS_RESOLVE_FAILED_TRANSIENT 1
-#define DNS_RESOLVE_FAILED_PERMANENT 2
-#define DNS_RESOLVE_SUCCEEDED 3
+/** How many requests may libevent's evdns have in flight to the
+ * nameservers at once, per configured nameserver? */
+#define DNS_MAX_INFLIGHT_PER_NAMESERVER 256
+
+
+#if defined(USE_PTHREADS) && defined(HAVE_GETADDRINFO)
+/** Defined iff we can offer the thread-pool getaddrinfo backend.  (It needs
+ * condition variables, which we only have with pthreads.) */
+#define USE_GETADDRINFO_BACKEND
+#endif
 
 /** Our evdns_base; this structure handles all our name lookups. */
 static struct evdns_base *the_evdns_base = NULL;
@@ -104,6 +115,13 @@ static char *resolv_conf_fname = NULL;
  * the nameservers?  Used to check whether we need to reconfigure. */
 static time_t resolv_conf_mtime = 0;
 
+static const dns_backend_t evdns_backend;
+#ifdef USE_GETADDRINFO_BACKEND
+static const dns_backend_t getaddrinfo_backend;
+#endif
+/** The backend we are using to resolve names. */
+static const dns_backend_t *dns_backend = &evdns_backend;
+
 /** Linked list of connections waiting for a DNS answer. */
 typedef struct pending_connection_t {
   edge_connection_t *conn;
@@ -136,37 +154,100 @@ typedef struct pending_connection_t {
 /** A DNS request: possibly completed, possibly pending; cached_resolve
  * structs are stored at the OR side in a hash table, and as a linked
  * list from oldest to newest.
+ *
+ * Entries are allocated by cached_resolve_new() to be only as large as they
+ * need: the hostname goes right after the entry, and only entries in state
+ * CACHE_STATE_CACHED_VALID have room for <b>result</b>.
  */
 typedef struct cached_resolve_t {
   HT_ENTRY(cached_resolve_t) node;
   uint32_t magic;
-  char address[MAX_ADDRESSLEN]; /**< The hostname to be resolved. */
-  union {
-    struct {
-      struct in6_addr addr6; /**< IPv6 addr for <b>address</b>. */
-      uint32_t addr;  /**< IPv4 addr for <b>address</b>. */
-    } a;
-    char *hostname; /**< Hostname for <b>address</b> (if a reverse lookup) */
-  } result;
+  char *address; /**< The hostname to be resolved. */
+  /** ht_string_hash() of <b>address</b>, so that we never need to hash it
+   * again. */
+  unsigned int hash;
   uint8_t state; /**< Is this cached entry pending/done/valid/failed? */
   uint8_t is_reverse; /**< Is this a reverse (addr-to-hostname) lookup? */
+  /** Where is this answer in the ServerDNSRefreshPopular cycle?  One of the
+   * DNS_REFRESH_* values. */
+  uint8_t refresh_state;
+  /** How many streams have used this answer since we cached it? */
+  uint16_t n_hits;
+  /** When did we last ask our nameservers about <b>address</b>, as a
+   * dns_now_msec() value? */
+  uint32_t launched_msec;
   time_t expire; /**< Remove items from cache after this time. */
   uint32_t ttl; /**< What TTL did the nameserver tell us? */
   /** Connections that want to know when we get an answer for this resolve. */
   pending_connection_t *pending_connections;
-  /** Position of this element in the heap*/
-  int minheap_idx;
+  /** The next entry in this entry's slot of the expiry wheel. */
+  struct cached_resolve_t *expiry_next;
+  /** The pointer that points to this entry in its slot of the expiry wheel,
+   * or NULL if it isn't on the wheel. */
+  struct cached_resolve_t **expiry_prevp;
+  /** The answer we got; present only in CACHE_STATE_CACHED_VALID entries.
+   * This must stay the last member. */
+  union {
+    struct {
+      uint32_t addr;  /**< IPv4 addr for <b>address</b>. */
+      /** The other IPv4 addrs for <b>address</b>. */
+      uint32_t alt_addrs[MAX_CACHED_RESOLVE_ADDRS-1];
+      uint8_t n_alt_addrs; /**< How many alt_addrs are set? */
+      /** Which address (0 for addr, i for alt_addrs[i-1]) should the next
+       * stream that finds this answer try first? */
+      uint8_t next_addr;
+      /** Bit i is set if the last stream that tried address i (numbered as
+       * for next_addr) couldn't connect to it. */
+      uint8_t failed_addrs;
+    } a;
+    char *hostname; /**< Hostname for <b>address</b> (if a reverse lookup) */
+  } result;
 } cached_resolve_t;
 
-static void purge_expired_resolves(time_t now);
-static void dns_found_answer(const char *address, uint8_t is_reverse,
-                             uint32_t addr, const char *hostname, char outcome,
-                             uint32_t ttl);
+/** Possible values for cached_resolve_t.refresh_state. */
+/** The answer will just expire. */
+#define DNS_REFRESH_NONE 0
+/** When <b>expire</b> comes, the answer still has DNS_REFRESH_LEAD seconds
+ * to live; decide then whether it's popular enough to re-resolve. */
+#define DNS_REFRESH_DUE 1
+/** We're re-resolving this answer, and will serve it, stale if need be,
+ * until the new one comes in or <b>expire</b> arrives. */
+#define DNS_REFRESH_IN_FLIGHT 2
+
+/** How long before an answer expires do we re-resolve it, if it's
+ * popular? */
+#define DNS_REFRESH_LEAD 10
+/** How long past its expiry will we keep serving an answer we're
+ * re-resolving? */
+#define DNS_STALE_GRACE 60
+/** How many streams must have used an answer for it to count as popular? */
+#define DNS_REFRESH_MIN_HITS 2
+
+/** How many bytes does a cached_resolve_t in state <b>state</b> take,
+ * not counting its hostname? */
+#define CACHED_RESOLVE_BASE_LEN(state)                          \
+  ((state) == CACHE_STATE_CACHED_VALID ? sizeof(cached_resolve_t) : \
+   STRUCT_OFFSET(cached_resolve_t, result))
+
 static void send_resolved_cell(edge_connection_t *conn, uint8_t answer_type);
 static int launch_resolve(edge_connection_t *exitconn);
+static int launch_resolve_address(const char *address);
+static void set_answer_expiry(cached_resolve_t *resolve, time_t now);
+static void consider_refreshing_answer(cached_resolve_t *resolve,
+                                       time_t now);
+static void refresh_cached_answer(cached_resolve_t *resolve,
+                                  uint8_t is_reverse, uint32_t addr,
+                                  const uint32_t *alt_addrs, int n_alt_addrs,
+                                  char outcome, uint32_t ttl);
 static void add_wildcarded_test_address(const char *address);
+static uint32_t dns_now_msec(void);
+static void note_resolve_finished(cached_resolve_t *resolve, char outcome);
+static void dns_correctness_checks_free_all(void);
 static int configure_nameservers(int force);
-static int answer_is_wildcarded(const char *ip);
+static void evdns_suspend(void);
+static int evdns_launch_resolve(const char *address);
+static void evdns_callback(int result, char type, int count, int ttl,
+                           void *addresses, void *arg);
 static int dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
                             or_circuit_t *oncirc, char **resolved_to_hostname);
 #ifdef DEBUG_DNS_CACHE
@@ -180,6 +261,18 @@ static void assert_resolve_ok(cached_resolve_t *resolve);
 /** Hash table of cached_resolve objects. */
 static HT_HEAD(cache_map, cached_resolve_t) cache_root;
 
+/** Counters for GETINFO dns/cache: how many exit streams found a cached
+ * answer, a cached failure, or a resolve already under way, and how many
+ * had to launch a new resolve? */
+static uint64_t n_cache_hits = 0, n_cache_negative_hits = 0,
+  n_cache_pending_hits = 0, n_cache_misses = 0;
+/** Counters for GETINFO dns/resolves: how many resolves have we launched,
+ * and how have the ones we launched for the cache turned out? */
+static uint64_t n_resolves_launched = 0, n_resolves_succeeded = 0,
+  n_resolves_failed = 0, n_resolves_failed_transient = 0;
+/** How many msec our resolves have taken, from launch to answer. */
+static latency_histogram_t resolve_latency_histogram;
+
 /** Function to compare hashed resolves on their addresses; used to
  * implement hash tables. */
 static INLINE int
@@ -194,7 +287,7 @@ cached_resolves_eq(cached_resolve_t *a, cached_resolve_t *b)
 static INLINE unsigned int
 cached_resolve_hash(cached_resolve_t *a)
 {
-  return ht_string_hash(a->address);
+  return a->hash;
 }
 
 HT_PROTOTYPE(cache_map, cached_resolve_t, node, cached_resolve_hash,
@@ -202,6 +295,38 @@ HT_PROTOTYPE(cache_map, cached_resolve_t, node, cached_resolve_hash,
 HT_GENERATE(cache_map, cached_resolve_t, node, cached_resolve_hash,
             cached_resolves_eq, 0.6, malloc, realloc, free)
 
+/** Allocate and return a new cache entry in state <b>state</b> for
+ * <b>address</b> (truncated to MAX_ADDRESSLEN-1 characters), with the name
+ * stored just past the end of the entry. */
+static cached_resolve_t *
+cached_resolve_new(const char *address, uint8_t state)
+{
+  size_t base_len = CACHED_RESOLVE_BASE_LEN(state);
+  size_t addr_len = strlen(address);
+  cached_resolve_t *resolve;
+  if (addr_len > MAX_ADDRESSLEN-1)
+    addr_len = MAX_ADDRESSLEN-1;
+  resolve = tor_malloc_zero(base_len + addr_len + 1);
+  resolve->magic = CACHED_RESOLVE_MAGIC;
+  resolve->state = state;
+  resolve->address = ((char*)resolve) + base_len;
+  memcpy(resolve->address, address, addr_len);
+  resolve->hash = ht_string_hash(resolve->address);
+  return resolve;
+}
+
+/** Set up <b>search</b> as a key for looking up <b>address</b> in the
+ * cache, using <b>buf</b>, of MAX_ADDRESSLEN bytes, to hold the name as
+ * cached_resolve_new() would have stored it. */
+static INLINE void
+cached_resolve_set_key(cached_resolve_t *search, char *buf,
+                       const char *address)
+{
+  strlcpy(buf, address, MAX_ADDRESSLEN);
+  search->address = buf;
+  search->hash = ht_string_hash(buf);
+}
+
 /** Initialize the DNS cache. */
 static void
 init_cache_map(void)
@@ -258,6 +383,56 @@ _dns_randfn(char *b, size_t n)
   crypto_rand(b,n);
 }
 
+/** Return the resolver backend called <b>name</b>, or NULL if we have no
+ * such backend.  A NULL <b>name</b> means the default backend. */
+const dns_backend_t *
+dns_backend_get_by_name(const char *name)
+{
+  if (!name || !strcasecmp(name, evdns_backend.name))
+    return &evdns_backend;
+#ifdef USE_GETADDRINFO_BACKEND
+  if (!strcasecmp(name, getaddrinfo_backend.name))
+    return &getaddrinfo_backend;
+#endif
+  return NULL;
+}
+
+/** Return true iff we can resolve names with the backend called
+ * <b>name</b>. */
+int
+dns_backend_is_available(const char *name)
+{
+  return dns_backend_get_by_name(name) != NULL;
+}
+
+/** Switch to the resolver backend that our options ask for.  Return true
+ * iff that's a different backend from the one we were using. */
+static int
+dns_choose_backend(void)
+{
+  const dns_backend_t *backend =
+    dns_backend_get_by_name(get_options()->ServerDNSBackend);
+  tor_assert(backend); /* options_validate() checked this. */
+  if (backend == dns_backend)
+    return 0;
+  log_notice(LD_EXIT, "Resolving names with %s instead of %s.",
+             backend->name, dns_backend->name);
+  if (dns_backend->suspend)
+    dns_backend->suspend();
+  dns_backend = backend;
+  nameservers_configured = 0;
+  return 1;
+}
+
+/** Resolve names with <b>backend</b> from now on, as if its nameservers were
+ * already configured.  Private; used only by the unit tests. */
+void
+dns_set_backend_for_testing_(const dns_backend_t *backend)
+{
+  dns_backend = backend;
+  nameservers_configured = 1;
+}
+
 /** Initialize the DNS subsystem; called by the OR process. */
 int
 dns_init(void)
@@ -265,7 +440,9 @@ dns_init(void)
   init_cache_map();
   evdns_set_random_bytes_fn(_dns_randfn);
   if (server_mode(get_options())) {
-    int r = configure_nameservers(1);
+    int r;
+    dns_choose_backend();
+    r = dns_backend->configure(1);
     return r;
   }
   return 0;
@@ -278,21 +455,12 @@ dns_reset(void)
 {
   const or_options_t *options = get_options();
   if (! server_mode(options)) {
-
-    if (!the_evdns_base) {
-      if (!(the_evdns_base = evdns_base_new(tor_libevent_get_base(), 0))) {
-        log_err(LD_BUG, "Couldn't create an evdns_base");
-        return -1;
-      }
-    }
-
-    evdns_base_clear_nameservers_and_suspend(the_evdns_base);
-    evdns_base_search_clear(the_evdns_base);
+    if (dns_backend->suspend)
+      dns_backend->suspend();
     nameservers_configured = 0;
-    tor_free(resolv_conf_fname);
-    resolv_conf_mtime = 0;
   } else {
-    if (configure_nameservers(0) < 0) {
+    int changed = dns_choose_backend();
+    if (dns_backend->configure(changed) < 0) {
       return -1;
     }
   }
@@ -344,44 +512,60 @@ _free_cached_resolve(cached_resolve_t *r)
     r->pending_connections = victim->next;
     tor_free(victim);
   }
-  if (r->is_reverse)
+  if (r->is_reverse && r->state == CACHE_STATE_CACHED_VALID)
     tor_free(r->result.hostname);
   r->magic = 0xFF00FF00;
   tor_free(r);
 }
 
-/** Compare two cached_resolve_t pointers by expiry time, and return
- * less-than-zero, zero, or greater-than-zero as appropriate. Used for
- * the priority queue implementation. */
-static int
-_compare_cached_resolves_by_expiry(const void *_a, const void *_b)
+/** How many one-second slots are there in the expiry wheel?  Must be a
+ * power of two.  An entry that expires further ahead than this shares its
+ * slot with nearer ones, and is just passed over until its time comes. */
+#define EXPIRY_WHEEL_SLOTS 1024
+/** Which slot of the expiry wheel holds entries that expire at <b>t</b>? */
+#define EXPIRY_WHEEL_SLOT(t) ((unsigned)(t) & (EXPIRY_WHEEL_SLOTS-1))
+
+/** Timer wheel of cached_resolve_t objects to let us know when they will
+ * expire: slot EXPIRY_WHEEL_SLOT(t) lists, in no particular order, the
+ * entries whose <b>expire</b> is t, t+EXPIRY_WHEEL_SLOTS, .... */
+static cached_resolve_t *expiry_wheel[EXPIRY_WHEEL_SLOTS];
+/** The last second for which purge_expired_resolves() has looked at the
+ * expiry wheel, or 0 if it never has. */
+static time_t expiry_wheel_purged = 0;
+
+/** Add <b>resolve</b> to the front of <b>*listp</b>. */
+static INLINE void
+expiry_list_add(cached_resolve_t **listp, cached_resolve_t *resolve)
 {
-  const cached_resolve_t *a = _a, *b = _b;
-  if (a->expire < b->expire)
-    return -1;
-  else if (a->expire == b->expire)
-    return 0;
-  else
-    return 1;
+  tor_assert(!resolve->expiry_prevp);
+  resolve->expiry_next = *listp;
+  if (*listp)
+    (*listp)->expiry_prevp = &resolve->expiry_next;
+  *listp = resolve;
+  resolve->expiry_prevp = listp;
 }
 
-/** Priority queue of cached_resolve_t objects to let us know when they
- * will expire. */
-static smartlist_t *cached_resolve_pqueue = NULL;
+/** Take <b>resolve</b> off whatever expiry list it's on, if any. */
+static INLINE void
+expiry_list_remove(cached_resolve_t *resolve)
+{
+  if (!resolve->expiry_prevp)
+    return;
+  *resolve->expiry_prevp = resolve->expiry_next;
+  if (resolve->expiry_next)
+    resolve->expiry_next->expiry_prevp = resolve->expiry_prevp;
+  resolve->expiry_next = NULL;
+  resolve->expiry_prevp = NULL;
+}
 
 /** Set an expiry time for a cached_resolve_t, and add it to the expiry
- * priority queue */
+ * wheel */
 static void
 set_expiry(cached_resolve_t *resolve, time_t expires)
 {
   tor_assert(resolve && resolve->expire == 0);
-  if (!cached_resolve_pqueue)
-    cached_resolve_pqueue = smartlist_new();
   resolve->expire = expires;
-  smartlist_pqueue_add(cached_resolve_pqueue,
-                       _compare_cached_resolves_by_expiry,
-                       STRUCT_OFFSET(cached_resolve_t, minheap_idx),
-                       resolve);
+  expiry_list_add(&expiry_wheel[EXPIRY_WHEEL_SLOT(expires)], resolve);
 }
 
 /** Free all storage held in the DNS cache and related structures. */
@@ -389,100 +573,139 @@ void
 dns_free_all(void)
 {
   cached_resolve_t **ptr, **next, *item;
+  unsigned slot;
   assert_cache_ok();
-  if (cached_resolve_pqueue) {
-    SMARTLIST_FOREACH(cached_resolve_pqueue, cached_resolve_t *, res,
-      {
-        if (res->state == CACHE_STATE_DONE)
-          _free_cached_resolve(res);
-      });
+  for (slot = 0; slot < EXPIRY_WHEEL_SLOTS; ++slot) {
+    while ((item = expiry_wheel[slot])) {
+      expiry_list_remove(item);
+      if (item->state == CACHE_STATE_DONE)
+        _free_cached_resolve(item);
+    }
   }
+  expiry_wheel_purged = 0;
   for (ptr = HT_START(cache_map, &cache_root); ptr != NULL; ptr = next) {
     item = *ptr;
     next = HT_NEXT_RMV(cache_map, &cache_root, ptr);
     _free_cached_resolve(item);
   }
   HT_CLEAR(cache_map, &cache_root);
-  smartlist_free(cached_resolve_pqueue);
-  cached_resolve_pqueue = NULL;
   tor_free(resolv_conf_fname);
+  dns_correctness_checks_free_all();
+  if (dns_backend->free_all)
+    dns_backend->free_all();
 }
 
-/** Remove every cached_resolve whose <b>expire</b> time is before or
- * equal to <b>now</b> from the cache. */
+/** <b>resolve</b>, just taken off the expiry wheel, has expired as of
+ * <b>now</b>: remove it from the cache and free it, or put it back on the
+ * wheel if it's a popular answer we might re-resolve. */
 static void
-purge_expired_resolves(time_t now)
+expire_cached_resolve(cached_resolve_t *resolve, time_t now)
 {
-  cached_resolve_t *resolve, *removed;
+  cached_resolve_t *removed;
   pending_connection_t *pend;
   edge_connection_t *pendconn;
 
-  assert_cache_ok();
-  if (!cached_resolve_pqueue)
+  if (resolve->state == CACHE_STATE_CACHED_VALID &&
+      resolve->refresh_state == DNS_REFRESH_DUE) {
+    consider_refreshing_answer(resolve, now);
     return;
+  }
 
-  while (smartlist_len(cached_resolve_pqueue)) {
-    resolve = smartlist_get(cached_resolve_pqueue, 0);
-    if (resolve->expire > now)
-      break;
-    smartlist_pqueue_pop(cached_resolve_pqueue,
-                         _compare_cached_resolves_by_expiry,
-                         STRUCT_OFFSET(cached_resolve_t, minheap_idx));
-
-    if (resolve->state == CACHE_STATE_PENDING) {
-      log_debug(LD_EXIT,
-                "Expiring a dns resolve %s that's still pending. Forgot to "
-                "cull it? DNS resolve didn't tell us about the timeout?",
-                escaped_safe_str(resolve->address));
-    } else if (resolve->state == CACHE_STATE_CACHED_VALID ||
-               resolve->state == CACHE_STATE_CACHED_FAILED) {
-      log_debug(LD_EXIT,
-                "Forgetting old cached resolve (address %s, expires %lu)",
-                escaped_safe_str(resolve->address),
-                (unsigned long)resolve->expire);
-      tor_assert(!resolve->pending_connections);
-    } else {
-      tor_assert(resolve->state == CACHE_STATE_DONE);
-      tor_assert(!resolve->pending_connections);
+  if (resolve->state == CACHE_STATE_PENDING) {
+    log_debug(LD_EXIT,
+              "Expiring a dns resolve %s that's still pending. Forgot to "
+              "cull it? DNS resolve didn't tell us about the timeout?",
+              escaped_safe_str(resolve->address));
+  } else if (resolve->state == CACHE_STATE_CACHED_VALID ||
+             resolve->state == CACHE_STATE_CACHED_FAILED) {
+    log_debug(LD_EXIT,
+              "Forgetting old cached resolve (address %s, expires %lu)",
+              escaped_safe_str(resolve->address),
+              (unsigned long)resolve->expire);
+    tor_assert(!resolve->pending_connections);
+  } else {
+    tor_assert(resolve->state == CACHE_STATE_DONE);
+    tor_assert(!resolve->pending_connections);
+  }
+
+  if (resolve->pending_connections) {
+    log_debug(LD_EXIT,
+              "Closing pending connections on timed-out DNS resolve!");
+    tor_fragile_assert();
+    while (resolve->pending_connections) {
+      pend = resolve->pending_connections;
+      resolve->pending_connections = pend->next;
+      /* Connections should only be pending if they have no socket. */
+      tor_assert(!SOCKET_OK(pend->conn->_base.s));
+      pendconn = pend->conn;
+      connection_edge_end(pendconn, END_STREAM_REASON_TIMEOUT);
+      circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
+      connection_free(TO_CONN(pendconn));
+      tor_free(pend);
     }
+  }
 
-    if (resolve->pending_connections) {
-      log_debug(LD_EXIT,
-                "Closing pending connections on timed-out DNS resolve!");
-      tor_fragile_assert();
-      while (resolve->pending_connections) {
-        pend = resolve->pending_connections;
-        resolve->pending_connections = pend->next;
-        /* Connections should only be pending if they have no socket. */
-        tor_assert(!SOCKET_OK(pend->conn->_base.s));
-        pendconn = pend->conn;
-        connection_edge_end(pendconn, END_STREAM_REASON_TIMEOUT);
-        circuit_detach_stream(circuit_get_by_edge_conn(pendconn), pendconn);
-        connection_free(TO_CONN(pendconn));
-        tor_free(pend);
-      }
+  if (resolve->state == CACHE_STATE_CACHED_VALID ||
+      resolve->state == CACHE_STATE_CACHED_FAILED ||
+      resolve->state == CACHE_STATE_PENDING) {
+    removed = HT_REMOVE(cache_map, &cache_root, resolve);
+    if (removed != resolve) {
+      log_err(LD_BUG, "The expired resolve we purged didn't match any in"
+              " the cache. Tried to purge %s (%p); instead got %s (%p).",
+              resolve->address, (void*)resolve,
+              removed ? removed->address : "NULL", (void*)removed);
     }
+    tor_assert(removed == resolve);
+  } else {
+    /* This should be in state DONE. Make sure it's not in the cache. */
+    cached_resolve_t *tmp = HT_FIND(cache_map, &cache_root, resolve);
+    tor_assert(tmp != resolve);
+  }
+  if (resolve->is_reverse && resolve->state == CACHE_STATE_CACHED_VALID)
+    tor_free(resolve->result.hostname);
+  resolve->magic = 0xF0BBF0BB;
+  tor_free(resolve);
+}
+
+/** Remove every cached_resolve whose <b>expire</b> time is before or
+ * equal to <b>now</b> from the cache. */
+void
+purge_expired_resolves(time_t now)
+{
+  cached_resolve_t *resolve, *slot_list;
+  time_t t;
 
-    if (resolve->state == CACHE_STATE_CACHED_VALID ||
-        resolve->state == CACHE_STATE_CACHED_FAILED ||
-        resolve->state == CACHE_STATE_PENDING) {
-      removed = HT_REMOVE(cache_map, &cache_root, resolve);
-      if (removed != resolve) {
-        log_err(LD_BUG, "The expired resolve we purged didn't match any in"
-                " the cache. Tried to purge %s (%p); instead got %s (%p).",
-                resolve->address, (void*)resolve,
-                removed ? removed->address : "NULL", (void*)removed);
+  assert_cache_ok();
+  if (now < expiry_wheel_purged) {
+    /* The clock jumped back; start again from here. */
+    expiry_wheel_purged = now;
+    return;
+  }
+  if (!expiry_wheel_purged || now - expiry_wheel_purged > EXPIRY_WHEEL_SLOTS)
+    t = now - EXPIRY_WHEEL_SLOTS + 1;
+  else
+    t = expiry_wheel_purged + 1;
+  expiry_wheel_purged = now;
+
+  for ( ; t <= now; ++t) {
+    /* Take the whole slot off the wheel first: expiring an entry can put it
+     * back on the wheel, or take others off. */
+    slot_list = expiry_wheel[EXPIRY_WHEEL_SLOT(t)];
+    if (!slot_list)
+      continue;
+    expiry_wheel[EXPIRY_WHEEL_SLOT(t)] = NULL;
+    slot_list->expiry_prevp = &slot_list;
+
+    while ((resolve = slot_list)) {
+      expiry_list_remove(resolve);
+      if (resolve->expire > now) {
+        /* Not this time around the wheel. */
+        expiry_list_add(&expiry_wheel[EXPIRY_WHEEL_SLOT(resolve->expire)],
+                        resolve);
+      } else {
+        expire_cached_resolve(resolve, now);
       }
-      tor_assert(removed == resolve);
-    } else {
-      /* This should be in state DONE. Make sure it's not in the cache. */
-      cached_resolve_t *tmp = HT_FIND(cache_map, &cache_root, resolve);
-      tor_assert(tmp != resolve);
     }
-    if (resolve->is_reverse)
-      tor_free(resolve->result.hostname);
-    resolve->magic = 0xF0BBF0BB;
-    tor_free(resolve);
   }
 
   assert_cache_ok();
@@ -617,6 +840,7 @@ dns_resolve(edge_connection_t *exitconn)
          * connected cell. */
         exitconn->next_stream = oncirc->n_streams;
         oncirc->n_streams = exitconn;
+        circuit_stream_map_remove(TO_CIRCUIT(oncirc), exitconn);
       }
       break;
     case 0:
@@ -625,6 +849,7 @@ dns_resolve(edge_connection_t *exitconn)
       exitconn->_base.state = EXIT_CONN_STATE_RESOLVING;
       exitconn->next_stream = oncirc->resolving_streams;
       oncirc->resolving_streams = exitconn;
+      circuit_stream_map_remove(TO_CIRCUIT(oncirc), exitconn);
       break;
     case -2:
     case -1:
@@ -672,9 +897,6 @@ static int
 dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
                  or_circuit_t *oncirc, char **hostname_out)
 {
-  cached_resolve_t *resolve;
-  cached_resolve_t search;
-  pending_connection_t *pending_connection;
   const routerinfo_t *me;
   tor_addr_t addr;
   time_t now = time(NULL);
@@ -745,12 +967,31 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
     //exitconn->_base.address);
   }
 
+  return dns_resolve_hostname(exitconn, is_resolve, is_reverse,
+                              hostname_out, now);
+}
+
+/** Helper for dns_resolve_impl(): <b>exitconn</b>'s address is a hostname
+ * (or, if <b>is_reverse</b>, an in-addr.arpa name) that we're willing to
+ * look up at <b>now</b>.  Answer it from the cache if we can; otherwise add
+ * a pending entry for it and launch a resolve.  Returns as for
+ * dns_resolve_impl(). */
+int
+dns_resolve_hostname(edge_connection_t *exitconn, int is_resolve,
+                     uint8_t is_reverse, char **hostname_out, time_t now)
+{
+  cached_resolve_t *resolve;
+  cached_resolve_t search;
+  char search_buf[MAX_ADDRESSLEN];
+  pending_connection_t *pending_connection;
+
   /* now check the hash table to see if 'address' is already there. */
-  strlcpy(search.address, exitconn->_base.address, sizeof(search.address));
+  cached_resolve_set_key(&search, search_buf, exitconn->_base.address);
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (resolve && resolve->expire > now) { /* already there */
     switch (resolve->state) {
       case CACHE_STATE_PENDING:
+        ++n_cache_pending_hits;
         /* add us to the pending list */
         pending_connection = tor_malloc_zero(
                                       sizeof(pending_connection_t));
@@ -766,14 +1007,25 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
                   exitconn->_base.s,
                   escaped_safe_str(resolve->address));
         exitconn->address_ttl = resolve->ttl;
+        ++n_cache_hits;
+        if (resolve->n_hits < UINT16_MAX)
+          ++resolve->n_hits;
         if (resolve->is_reverse) {
           tor_assert(is_resolve);
           *hostname_out = tor_strdup(resolve->result.hostname);
         } else {
-          tor_addr_from_ipv4h(&exitconn->_base.addr, resolve->result.a.addr);
+          /* Spread streams over all the addresses we got, round-robin. */
+          int first = resolve->result.a.next_addr;
+          set_exitconn_addrs(exitconn, resolve->result.a.addr,
+                             resolve->result.a.alt_addrs,
+                             resolve->result.a.n_alt_addrs, first,
+                             resolve->result.a.failed_addrs);
+          resolve->result.a.next_addr =
+            (first + 1) % (resolve->result.a.n_alt_addrs + 1);
         }
         return 1;
       case CACHE_STATE_CACHED_FAILED:
+        ++n_cache_negative_hits;
         log_debug(LD_EXIT,"Connection (fd %d) found cached error for %s",
                   exitconn->_base.s,
                   escaped_safe_str(exitconn->_base.address));
@@ -786,12 +1038,10 @@ dns_resolve_impl(edge_connection_t *exitconn, int is_resolve,
   }
   tor_assert(!resolve);
   /* not there, need to add it */
-  resolve = tor_malloc_zero(sizeof(cached_resolve_t));
-  resolve->magic = CACHED_RESOLVE_MAGIC;
-  resolve->state = CACHE_STATE_PENDING;
-  resolve->minheap_idx = -1;
+  ++n_cache_misses;
+  resolve = cached_resolve_new(exitconn->_base.address, CACHE_STATE_PENDING);
   resolve->is_reverse = is_reverse;
-  strlcpy(resolve->address, exitconn->_base.address, sizeof(resolve->address));
+  resolve->launched_msec = dns_now_msec();
 
   /* add this connection to the pending list */
   pending_connection = tor_malloc_zero(sizeof(pending_connection_t));
@@ -816,10 +1066,11 @@ assert_connection_edge_not_dns_pending(edge_connection_t *conn)
 {
   pending_connection_t *pend;
   cached_resolve_t search;
+  char search_buf[MAX_ADDRESSLEN];
 
 #if 1
   cached_resolve_t *resolve;
-  strlcpy(search.address, conn->_base.address, sizeof(search.address));
+  cached_resolve_set_key(&search, search_buf, conn->_base.address);
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve)
     return;
@@ -862,12 +1113,13 @@ connection_dns_remove(edge_connection_t *conn)
 {
   pending_connection_t *pend, *victim;
   cached_resolve_t search;
+  char search_buf[MAX_ADDRESSLEN];
   cached_resolve_t *resolve;
 
   tor_assert(conn->_base.type == CONN_TYPE_EXIT);
   tor_assert(conn->_base.state == EXIT_CONN_STATE_RESOLVING);
 
-  strlcpy(search.address, conn->_base.address, sizeof(search.address));
+  cached_resolve_set_key(&search, search_buf, conn->_base.address);
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve) {
@@ -914,11 +1166,12 @@ dns_cancel_pending_resolve(const char *address)
 {
   pending_connection_t *pend;
   cached_resolve_t search;
+  char search_buf[MAX_ADDRESSLEN];
   cached_resolve_t *resolve, *tmp;
   edge_connection_t *pendconn;
   circuit_t *circ;
 
-  strlcpy(search.address, address, sizeof(search.address));
+  cached_resolve_set_key(&search, search_buf, address);
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve)
@@ -946,6 +1199,9 @@ dns_cancel_pending_resolve(const char *address)
   }
   tor_assert(resolve->pending_connections);
 
+  if (dns_backend->cancel)
+    dns_backend->cancel(address);
+
   /* mark all pending connections to fail */
   log_debug(LD_EXIT,
              "Failing all connections waiting on DNS resolve of %s",
@@ -980,45 +1236,191 @@ dns_cancel_pending_resolve(const char *address)
   resolve->state = CACHE_STATE_DONE;
 }
 
+/** Of the answers <b>addr</b> and the <b>n_alt_addrs</b> addresses in
+ * <b>alt_addrs</b>, numbered from 0, point <b>exitconn</b> at number
+ * <b>first</b>, and give it as many of the ones after it (wrapping around)
+ * as it can hold to fall back on if it can't connect.  Answers whose bit is
+ * set in <b>failed</b> go after all the others. */
+void
+set_exitconn_addrs(edge_connection_t *exitconn, uint32_t addr,
+                   const uint32_t *alt_addrs, int n_alt_addrs,
+                   int first, unsigned failed)
+{
+  uint32_t order[MAX_CACHED_RESOLVE_ADDRS];
+  int n = n_alt_addrs + 1, n_ordered = 0, i, pass;
+
+  tor_assert(n <= MAX_CACHED_RESOLVE_ADDRS);
+  for (pass = 0; pass < 2; ++pass) {
+    for (i = 0; i < n; ++i) {
+      int idx = (first + i) % n;
+      if ((int)((failed >> idx) & 1) != pass)
+        continue;
+      order[n_ordered++] = idx ? alt_addrs[idx-1] : addr;
+    }
+  }
+
+  tor_addr_from_ipv4h(&exitconn->_base.addr, order[0]);
+  n = MIN(n-1, MAX_EXIT_ALT_ADDRS);
+  if (n)
+    memcpy(exitconn->exit_alt_addrs, order+1, n * sizeof(uint32_t));
+  exitconn->n_exit_alt_addrs = (uint8_t)n;
+}
+
+/** Remember whether the exit connection <b>exitconn</b> managed to connect
+ * to its current address (<b>succeeded</b>), so that later streams to the
+ * same hostname try addresses that are working first. */
+void
+dns_note_exit_connect_result(edge_connection_t *exitconn, int succeeded)
+{
+  cached_resolve_t search;
+  char search_buf[MAX_ADDRESSLEN];
+  cached_resolve_t *resolve;
+  uint32_t addr;
+  int i;
+
+  if (tor_addr_family(&exitconn->_base.addr) != AF_INET ||
+      !exitconn->_base.address)
+    return;
+  addr = tor_addr_to_ipv4h(&exitconn->_base.addr);
+  cached_resolve_set_key(&search, search_buf, exitconn->_base.address);
+  resolve = HT_FIND(cache_map, &cache_root, &search);
+  if (!resolve || resolve->state != CACHE_STATE_CACHED_VALID ||
+      resolve->is_reverse || !resolve->result.a.n_alt_addrs)
+    return;
+
+  for (i = 0; i <= resolve->result.a.n_alt_addrs; ++i) {
+    if ((i ? resolve->result.a.alt_addrs[i-1] : resolve->result.a.addr)
+        != addr)
+      continue;
+    if (succeeded)
+      resolve->result.a.failed_addrs &= ~(1u << i);
+    else
+      resolve->result.a.failed_addrs |= (1u << i);
+    break;
+  }
+  /* If none of them work, we have nothing to go on; start over. */
+  if (resolve->result.a.failed_addrs ==
+      (1u << (resolve->result.a.n_alt_addrs + 1)) - 1)
+    resolve->result.a.failed_addrs = 0;
+}
+
 /** Helper: adds an entry to the DNS cache mapping <b>address</b> to the ipv4
  * address <b>addr</b> (if is_reverse is 0) or the hostname <b>hostname</b> (if
  * is_reverse is 1).  <b>ttl</b> is a cache ttl; <b>outcome</b> is one of
  * DNS_RESOLVE_{FAILED_TRANSIENT|FAILED_PERMANENT|SUCCEEDED}.
  **/
-static void
+cached_resolve_t *
 add_answer_to_cache(const char *address, uint8_t is_reverse, uint32_t addr,
+                    const uint32_t *alt_addrs, int n_alt_addrs,
                     const char *hostname, char outcome, uint32_t ttl)
 {
   cached_resolve_t *resolve;
   if (outcome == DNS_RESOLVE_FAILED_TRANSIENT)
-    return;
+    return NULL;
 
   //log_notice(LD_EXIT, "Adding to cache: %s -> %s (%lx, %s), %d",
   //           address, is_reverse?"(reverse)":"", (unsigned long)addr,
   //           hostname?hostname:"NULL",(int)outcome);
 
-  resolve = tor_malloc_zero(sizeof(cached_resolve_t));
-  resolve->magic = CACHED_RESOLVE_MAGIC;
-  resolve->state = (outcome == DNS_RESOLVE_SUCCEEDED) ?
-    CACHE_STATE_CACHED_VALID : CACHE_STATE_CACHED_FAILED;
-  strlcpy(resolve->address, address, sizeof(resolve->address));
+  resolve = cached_resolve_new(address, (outcome == DNS_RESOLVE_SUCCEEDED) ?
+                        CACHE_STATE_CACHED_VALID : CACHE_STATE_CACHED_FAILED);
   resolve->is_reverse = is_reverse;
-  if (is_reverse) {
-    if (outcome == DNS_RESOLVE_SUCCEEDED) {
-      tor_assert(hostname);
-      resolve->result.hostname = tor_strdup(hostname);
-    } else {
-      tor_assert(! hostname);
-      resolve->result.hostname = NULL;
-    }
+  if (outcome != DNS_RESOLVE_SUCCEEDED) {
+    /* Failed entries have no room for a result. */
+    tor_assert(!hostname);
+  } else if (is_reverse) {
+    tor_assert(hostname);
+    resolve->result.hostname = tor_strdup(hostname);
   } else {
     tor_assert(!hostname);
     resolve->result.a.addr = addr;
+    tor_assert(n_alt_addrs < MAX_CACHED_RESOLVE_ADDRS);
+    if (n_alt_addrs)
+      memcpy(resolve->result.a.alt_addrs, alt_addrs,
+             n_alt_addrs * sizeof(uint32_t));
+    resolve->result.a.n_alt_addrs = (uint8_t)n_alt_addrs;
   }
   resolve->ttl = ttl;
   assert_resolve_ok(resolve);
   HT_INSERT(cache_map, &cache_root, resolve);
-  set_expiry(resolve, time(NULL) + dns_get_expiry_ttl(ttl));
+  set_answer_expiry(resolve, time(NULL));
+  return resolve;
+}
+
+/** Put <b>resolve</b>, which isn't on the expiry queue, back on it for
+ * when its TTL runs out -- or, if ServerDNSRefreshPopular is set and it's a
+ * successful forward lookup, for a little before then, so that we can
+ * re-resolve it in time if it's popular. */
+static void
+set_answer_expiry(cached_resolve_t *resolve, time_t now)
+{
+  uint32_t expiry_ttl = dns_get_expiry_ttl(resolve->ttl);
+  resolve->expire = 0;
+  resolve->n_hits = 0;
+  if (resolve->state == CACHE_STATE_CACHED_VALID && !resolve->is_reverse &&
+      get_options()->ServerDNSRefreshPopular &&
+      expiry_ttl > 2*DNS_REFRESH_LEAD) {
+    resolve->refresh_state = DNS_REFRESH_DUE;
+    set_expiry(resolve, now + expiry_ttl - DNS_REFRESH_LEAD);
+  } else {
+    resolve->refresh_state = DNS_REFRESH_NONE;
+    set_expiry(resolve, now + expiry_ttl);
+  }
+}
+
+/** The answer <b>resolve</b>, just taken off the expiry queue, is
+ * DNS_REFRESH_LEAD seconds from expiring.  If enough streams have used it,
+ * start re-resolving it, and keep serving it until the new answer comes in
+ * or DNS_STALE_GRACE seconds after it expires.  Either way, put it back on
+ * the expiry queue. */
+static void
+consider_refreshing_answer(cached_resolve_t *resolve, time_t now)
+{
+  resolve->expire = 0;
+  if (resolve->n_hits < DNS_REFRESH_MIN_HITS) {
+    resolve->refresh_state = DNS_REFRESH_NONE;
+    set_expiry(resolve, now + DNS_REFRESH_LEAD);
+    return;
+  }
+  log_debug(LD_EXIT, "Re-resolving popular address %s before it expires.",
+            escaped_safe_str(resolve->address));
+  resolve->refresh_state = DNS_REFRESH_IN_FLIGHT;
+  resolve->launched_msec = dns_now_msec();
+  if (launch_resolve_address(resolve->address) < 0) {
+    resolve->refresh_state = DNS_REFRESH_NONE;
+    set_expiry(resolve, now + DNS_REFRESH_LEAD);
+  } else if (resolve->expire == 0) {
+    /* (Unless the answer already came back and requeued it.) */
+    set_expiry(resolve, now + DNS_REFRESH_LEAD + DNS_STALE_GRACE);
+  }
+}
+
+/** We got a new answer for <b>resolve</b>, a cached answer we were
+ * re-resolving.  If the lookup worked, replace the answer in place, and
+ * start its expiry over; otherwise, keep serving the old answer until it
+ * runs out. */
+static void
+refresh_cached_answer(cached_resolve_t *resolve, uint8_t is_reverse,
+                      uint32_t addr, const uint32_t *alt_addrs,
+                      int n_alt_addrs, char outcome, uint32_t ttl)
+{
+  if (outcome != DNS_RESOLVE_SUCCEEDED || is_reverse) {
+    log_info(LD_EXIT, "Couldn't re-resolve %s; serving the old answer until "
+             "it runs out.", escaped_safe_str(resolve->address));
+    resolve->refresh_state = DNS_REFRESH_NONE;
+    return;
+  }
+  tor_assert(n_alt_addrs < MAX_CACHED_RESOLVE_ADDRS);
+  resolve->result.a.addr = addr;
+  if (n_alt_addrs)
+    memcpy(resolve->result.a.alt_addrs, alt_addrs,
+           n_alt_addrs * sizeof(uint32_t));
+  resolve->result.a.n_alt_addrs = (uint8_t)n_alt_addrs;
+  resolve->result.a.next_addr = 0;
+  resolve->result.a.failed_addrs = 0;
+  resolve->ttl = ttl;
+  expiry_list_remove(resolve);
+  set_answer_expiry(resolve, time(NULL));
 }
 
 /** Return true iff <b>address</b> is one of the addresses we use to verify
@@ -1035,22 +1437,26 @@ is_test_address(const char *address)
  * the outcome of a DNS resolve: tell all pending connections about the result
  * of the lookup, and cache the value.  (<b>address</b> is a NUL-terminated
  * string containing the address to look up; <b>addr</b> is an IPv4 address in
- * host order; <b>outcome</b> is one of
+ * host order, and <b>alt_addrs</b> holds any other addresses we got;
+ * <b>outcome</b> is one of
  * DNS_RESOLVE_{FAILED_TRANSIENT|FAILED_PERMANENT|SUCCEEDED}.
  */
-static void
+void
 dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
+                 const uint32_t *alt_addrs, int n_alt_addrs,
                  const char *hostname, char outcome, uint32_t ttl)
 {
   pending_connection_t *pend;
   cached_resolve_t search;
+  char search_buf[MAX_ADDRESSLEN];
   cached_resolve_t *resolve, *removed;
   edge_connection_t *pendconn;
   circuit_t *circ;
+  int n_pending = 0;
 
   assert_cache_ok();
 
-  strlcpy(search.address, address, sizeof(search.address));
+  cached_resolve_set_key(&search, search_buf, address);
 
   resolve = HT_FIND(cache_map, &cache_root, &search);
   if (!resolve) {
@@ -1058,11 +1464,24 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
     if (!is_test_addr)
       log_info(LD_EXIT,"Resolved unasked address %s; caching anyway.",
                escaped_safe_str(address));
-    add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl);
+    add_answer_to_cache(address, is_reverse, addr, alt_addrs, n_alt_addrs,
+                        hostname, outcome, ttl);
     return;
   }
   assert_resolve_ok(resolve);
 
+  if (resolve->state == CACHE_STATE_PENDING ||
+      (resolve->state == CACHE_STATE_CACHED_VALID &&
+       resolve->refresh_state == DNS_REFRESH_IN_FLIGHT))
+    note_resolve_finished(resolve, outcome);
+
+  if (resolve->state == CACHE_STATE_CACHED_VALID &&
+      resolve->refresh_state == DNS_REFRESH_IN_FLIGHT) {
+    refresh_cached_answer(resolve, is_reverse, addr, alt_addrs, n_alt_addrs,
+                          outcome, ttl);
+    return;
+  }
+
   if (resolve->state != CACHE_STATE_PENDING) {
     /* XXXX Maybe update addr? or check addr for consistency? Or let
      * VALID replace FAILED? */
@@ -1085,7 +1504,8 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
     pendconn = pend->conn; /* don't pass complex things to the
                               connection_mark_for_close macro */
     assert_connection_ok(TO_CONN(pendconn),time(NULL));
-    tor_addr_from_ipv4h(&pendconn->_base.addr, addr);
+    set_exitconn_addrs(pendconn, addr, alt_addrs, n_alt_addrs,
+                       n_pending++ % (n_alt_addrs + 1), 0);
     pendconn->address_ttl = ttl;
 
     if (outcome != DNS_RESOLVE_SUCCEEDED) {
@@ -1117,6 +1537,7 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
         pend->conn->next_stream = TO_OR_CIRCUIT(circ)->n_streams;
         pend->conn->on_circuit = circ;
         TO_OR_CIRCUIT(circ)->n_streams = pend->conn;
+        circuit_stream_map_remove(circ, pend->conn);
 
         connection_exit_connect(pend->conn);
       } else {
@@ -1148,7 +1569,10 @@ dns_found_answer(const char *address, uint8_t is_reverse, uint32_t addr,
   assert_resolve_ok(resolve);
   assert_cache_ok();
 
-  add_answer_to_cache(address, is_reverse, addr, hostname, outcome, ttl);
+  resolve = add_answer_to_cache(address, is_reverse, addr, alt_addrs,
+                                n_alt_addrs, hostname, outcome, ttl);
+  if (resolve && resolve->state == CACHE_STATE_CACHED_VALID && !is_reverse)
+    resolve->result.a.next_addr = n_pending % (n_alt_addrs + 1);
   assert_cache_ok();
 }
 
@@ -1168,6 +1592,19 @@ evdns_err_is_transient(int err)
   }
 }
 
+/** Return the max-inflight value to give libevent's evdns when it has
+ * <b>n_nameservers</b> nameservers: a full share for each of them, rather
+ * than one fixed-size window for them all to split. */
+int
+dns_max_inflight_for_nameservers(int n_nameservers)
+{
+  if (n_nameservers < 1)
+    n_nameservers = 1;
+  if (n_nameservers > 65000 / DNS_MAX_INFLIGHT_PER_NAMESERVER)
+    return 65000;
+  return n_nameservers * DNS_MAX_INFLIGHT_PER_NAMESERVER;
+}
+
 /** Configure eventdns nameservers if force is true, or if the configuration
  * has changed since the last time we called this function, or if we failed on
  * our last attempt.  On Unix, this reads from /etc/resolv.conf or
@@ -1283,6 +1720,18 @@ configure_nameservers(int force)
     SET("timeout:", "5");
   }
 
+#ifdef HAVE_EVENT2_DNS_H
+  {
+    /* libevent's evdns has one fixed-size window for all its nameservers.
+     * Our own eventdns.c sizes each nameserver's window as it goes, so we
+     * leave its global cap alone. */
+    char buf[16];
+    tor_snprintf(buf, sizeof(buf), "%d", dns_max_inflight_for_nameservers(
+                     evdns_base_count_nameservers(the_evdns_base)));
+    SET("max-inflight:", buf);
+  }
+#endif
+
   if (options->ServerDNSRandomizeCase)
     SET("randomize-case:", "1");
   else
@@ -1321,8 +1770,11 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
   uint8_t is_reverse = 0;
   int status = DNS_RESOLVE_FAILED_PERMANENT;
   uint32_t addr = 0;
+  uint32_t alt_addrs[MAX_CACHED_RESOLVE_ADDRS-1];
+  int n_alt_addrs = 0;
   const char *hostname = NULL;
   int was_wildcarded = 0;
+  const uint64_t start_nsec = tor_monotime_nsec();
 
   if (result == DNS_ERR_NONE) {
     if (type == DNS_IPv4_A && count) {
@@ -1336,7 +1788,7 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
       tor_inet_ntoa(&in, answer_buf, sizeof(answer_buf));
       escaped_address = esc_for_log(string_address);
 
-      if (answer_is_wildcarded(answer_buf)) {
+      if (answer_is_wildcarded(addr)) {
         log_debug(LD_EXIT, "eventdns said that %s resolves to ISP-hijacked "
                   "address %s; treating as a failure.",
                   safe_str(escaped_address),
@@ -1345,9 +1797,18 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
         addr = 0;
         status = DNS_RESOLVE_FAILED_PERMANENT;
       } else {
+        int i;
         log_debug(LD_EXIT, "eventdns said that %s resolves to %s",
                   safe_str(escaped_address),
                   escaped_safe_str(answer_buf));
+        /* Remember the other answers too, so that we can spread streams
+         * over them and fall back to them. */
+        for (i = 1; i < count && n_alt_addrs < MAX_CACHED_RESOLVE_ADDRS-1;
+             ++i) {
+          if (ntohl(addrs[i]) != addr &&
+              !answer_is_wildcarded(ntohl(addrs[i])))
+            alt_addrs[n_alt_addrs++] = ntohl(addrs[i]);
+        }
       }
       tor_free(escaped_address);
     } else if (type == DNS_PTR && count) {
@@ -1379,8 +1840,10 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
     }
   }
   if (result != DNS_ERR_SHUTDOWN)
-    dns_found_answer(string_address, is_reverse, addr, hostname, status, ttl);
+    dns_found_answer(string_address, is_reverse, addr, alt_addrs,
+                     n_alt_addrs, hostname, status, ttl);
   tor_free(string_address);
+  main_loop_profile_callback(MAIN_LOOP_CB_DNS_ANSWER, 0, start_nsec);
 }
 
 /** For eventdns: start resolving as necessary to find the target for
@@ -1389,13 +1852,14 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
 static int
 launch_resolve(edge_connection_t *exitconn)
 {
-  char *addr;
-  struct evdns_request *req = NULL;
-  tor_addr_t a;
-  int r;
-  int options = get_options()->ServerDNSSearchDomains ? 0
-    : DNS_QUERY_NO_SEARCH;
+  return launch_resolve_address(exitconn->_base.address);
+}
 
+/** Start resolving <b>address</b>, a hostname or an in-addr.arpa name,
+ * with our current backend.  Returns as for launch_resolve(). */
+static int
+launch_resolve_address(const char *address)
+{
   if (get_options()->DisableNetwork)
     return -1;
 
@@ -1403,26 +1867,44 @@ launch_resolve(edge_connection_t *exitconn)
   if (!nameservers_configured) {
     log_warn(LD_EXIT, "(Harmless.) Nameservers not configured, but resolve "
              "launched.  Configuring.");
-    if (configure_nameservers(1) < 0) {
+    if (dns_backend->configure(1) < 0) {
       return -1;
     }
   }
 
-  addr = tor_strdup(exitconn->_base.address);
+  if (dns_backend->launch(address) < 0)
+    return -1;
+  ++n_resolves_launched;
+  return 0;
+}
+
+/** For eventdns: start resolving <b>address</b>.  Returns as for
+ * launch_resolve(). */
+static int
+evdns_launch_resolve(const char *address)
+{
+  char *addr;
+  struct evdns_request *req = NULL;
+  tor_addr_t a;
+  int r;
+  int options = get_options()->ServerDNSSearchDomains ? 0
+    : DNS_QUERY_NO_SEARCH;
+
+  addr = tor_strdup(address);
 
   r = tor_addr_parse_PTR_name(
-                            &a, exitconn->_base.address, AF_UNSPEC, 0);
+                            &a, address, AF_UNSPEC, 0);
 
   tor_assert(the_evdns_base);
   if (r == 0) {
     log_info(LD_EXIT, "Launching eventdns request for %s",
-             escaped_safe_str(exitconn->_base.address));
+             escaped_safe_str(address));
     req = evdns_base_resolve_ipv4(the_evdns_base,
-                                exitconn->_base.address, options,
+                                address, options,
                                 evdns_callback, addr);
   } else if (r == 1) {
     log_info(LD_EXIT, "Launching eventdns reverse request for %s",
-             escaped_safe_str(exitconn->_base.address));
+             escaped_safe_str(address));
     if (tor_addr_family(&a) == AF_INET)
       req = evdns_base_resolve_reverse(the_evdns_base,
                                 tor_addr_to_in(&a), DNS_QUERY_NO_SEARCH,
@@ -1446,19 +1928,466 @@ launch_resolve(edge_connection_t *exitconn)
   return r;
 }
 
+/** For eventdns: stop resolving names, and forget our nameservers. */
+static void
+evdns_suspend(void)
+{
+  if (!the_evdns_base) {
+    if (!(the_evdns_base = evdns_base_new(tor_libevent_get_base(), 0))) {
+      log_err(LD_BUG, "Couldn't create an evdns_base");
+      return;
+    }
+  }
+
+  evdns_base_clear_nameservers_and_suspend(the_evdns_base);
+  evdns_base_search_clear(the_evdns_base);
+  tor_free(resolv_conf_fname);
+  resolv_conf_mtime = 0;
+}
+
+/** Resolve names by sending DNS requests to the nameservers in our
+ * resolv.conf with eventdns. */
+static const dns_backend_t evdns_backend = {
+  "eventdns",
+  configure_nameservers,
+  evdns_suspend,
+  evdns_launch_resolve,
+  NULL,
+  NULL,
+};
+
+#ifdef USE_GETADDRINFO_BACKEND
+/* The getaddrinfo backend: the main thread queues up names to resolve, and
+ * a pool of worker threads takes them one at a time, calls getaddrinfo()
+ * or getnameinfo() on them, and queues up the answers.  A worker that
+ * queues an answer writes a byte to a socketpair so that the main thread
+ * will wake up and report it. */
+
+/** A name for the getaddrinfo backend to resolve, and its answer. */
+typedef struct gai_job_t {
+  /** The name we were asked to resolve, as passed to launch_resolve(). */
+  char *address;
+  /** If this is a reverse lookup, the address we want the name of. */
+  tor_addr_t reverse_addr;
+  /** True iff this is a reverse lookup. */
+  unsigned int is_reverse : 1;
+  /** True iff nobody wants the answer any more. */
+  unsigned int cancelled : 1;
+  /** A DNS_ERR_* code saying how the lookup went. */
+  int result;
+  /** For a forward lookup: how many of <b>addrs</b> we found. */
+  int n_addrs;
+  /** For a forward lookup: the IPv4 addresses we found, in network
+   * order. */
+  uint32_t addrs[MAX_CACHED_RESOLVE_ADDRS];
+  /** For a reverse lookup: the name we found. */
+  char *hostname;
+} gai_job_t;
+
+/** Protects all of the gai_* variables below, which the workers share. */
+static tor_mutex_t *gai_lock = NULL;
+/** Signalled whenever a job is added to gai_queue, or when the workers
+ * should check whether to exit. */
+static tor_cond_t *gai_cond = NULL;
+/** Jobs that no worker has picked up yet, oldest first. */
+static smartlist_t *gai_queue = NULL;
+/** Jobs that a worker is resolving right now. */
+static smartlist_t *gai_running = NULL;
+/** Jobs that are done, for the main thread to report. */
+static smartlist_t *gai_answers = NULL;
+/** How many worker threads are there? */
+static int gai_n_threads = 0;
+/** How many worker threads are waiting for a job? */
+static int gai_n_idle = 0;
+/** The most worker threads we may have: ServerDNSMaxThreads. */
+static int gai_max_threads = 0;
+/** True iff we're shutting down, and the workers should exit. */
+static int gai_shutting_down = 0;
+/** Workers write to gai_notify_fd[1] when they have an answer for the main
+ * thread, which listens on gai_notify_fd[0]. */
+static tor_socket_t gai_notify_fd[2] = { TOR_INVALID_SOCKET,
+                                         TOR_INVALID_SOCKET };
+/** Event that fires when gai_notify_fd[0] is readable. */
+static struct event *gai_notify_event = NULL;
+
+/** By default, how many names may be waiting for a worker at once?  Beyond
+ * this, new names fail, so we can't pile up without bound when the system
+ * resolver is slow. */
+#define GAI_MAX_QUEUED 4096
+/** What TTL do we give answers from getaddrinfo(), which won't tell us the
+ * real one?  This should be short: the system resolver is supposed to do
+ * the caching. */
+#define GAI_ANSWER_TTL MIN_DNS_TTL
+
+/** Release all storage held by <b>job</b>. */
+static void
+gai_job_free(gai_job_t *job)
+{
+  if (!job)
+    return;
+  tor_free(job->address);
+  tor_free(job->hostname);
+  tor_free(job);
+}
+
+/** Return the DNS_ERR_* code closest to the getaddrinfo() error
+ * <b>err</b>. */
+static int
+gai_err_to_dns_err(int err)
+{
+  switch (err) {
+    case EAI_NONAME:
+#if defined(EAI_NODATA) && EAI_NODATA != EAI_NONAME
+    case EAI_NODATA:
+#endif
+      return DNS_ERR_NOTEXIST;
+    case EAI_AGAIN:
+      return DNS_ERR_TIMEOUT;
+    default:
+      return DNS_ERR_UNKNOWN;
+  }
+}
+
+/** In a worker thread: look up the name or address in <b>job</b>, and
+ * record the answer in it. */
+static void
+gai_job_run(gai_job_t *job)
+{
+  int r;
+  if (job->is_reverse) {
+    struct sockaddr_storage ss;
+    char hostname[MAX_ADDRESSLEN];
+    socklen_t len = tor_addr_to_sockaddr(&job->reverse_addr, 0,
+                                         (struct sockaddr *)&ss, sizeof(ss));
+    if (!len) {
+      job->result = DNS_ERR_FORMAT;
+      return;
+    }
+    r = getnameinfo((struct sockaddr *)&ss, len, hostname, sizeof(hostname),
+                    NULL, 0, NI_NAMEREQD);
+    if (r) {
+      job->result = gai_err_to_dns_err(r);
+      return;
+    }
+    job->hostname = tor_strdup(hostname);
+    job->result = DNS_ERR_NONE;
+  } else {
+    struct addrinfo hints, *res = NULL, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    r = getaddrinfo(job->address, NULL, &hints, &res);
+    if (r) {
+      job->result = gai_err_to_dns_err(r);
+      return;
+    }
+    for (ai = res; ai && job->n_addrs < MAX_CACHED_RESOLVE_ADDRS;
+         ai = ai->ai_next) {
+      if (ai->ai_family == AF_INET) {
+        const struct sockaddr_in *sin = (struct sockaddr_in *)ai->ai_addr;
+        job->addrs[job->n_addrs++] = sin->sin_addr.s_addr;
+      }
+    }
+    freeaddrinfo(res);
+    job->result = job->n_addrs ? DNS_ERR_NONE : DNS_ERR_NOTEXIST;
+  }
+}
+
+/** Main function for a getaddrinfo worker thread: resolve jobs from
+ * gai_queue until we're told to exit. */
+static void
+gai_worker_main(void *arg)
+{
+  (void)arg;
+  tor_mutex_acquire(gai_lock);
+  for (;;) {
+    gai_job_t *job;
+    while (!gai_shutting_down && gai_n_threads <= gai_max_threads &&
+           !smartlist_len(gai_queue)) {
+      ++gai_n_idle;
+      tor_cond_wait(gai_cond, gai_lock);
+      --gai_n_idle;
+    }
+    if (gai_shutting_down || gai_n_threads > gai_max_threads)
+      break;
+    job = smartlist_get(gai_queue, 0);
+    smartlist_del_keeporder(gai_queue, 0);
+    smartlist_add(gai_running, job);
+    tor_mutex_release(gai_lock);
+
+    gai_job_run(job);
+
+    tor_mutex_acquire(gai_lock);
+    smartlist_remove(gai_running, job);
+    if (gai_shutting_down) {
+      gai_job_free(job);
+      break;
+    }
+    smartlist_add(gai_answers, job);
+    /* If the socket is full, the main thread already has a wakeup coming,
+     * so it's fine for this send to fail. */
+    send(gai_notify_fd[1], "", 1, 0);
+  }
+  --gai_n_threads;
+  tor_mutex_release(gai_lock);
+  spawn_exit();
+}
+
+/** Called when a getaddrinfo worker tells us it has answers: report each
+ * answer that somebody still wants. */
+static void
+gai_answers_ready_cb(evutil_socket_t fd, short event, void *arg)
+{
+  smartlist_t *answers;
+  char buf[64];
+  const uint64_t start_nsec = tor_monotime_nsec();
+  (void)event;
+  (void)arg;
+
+  while (recv(fd, buf, sizeof(buf), 0) > 0)
+    ;
+
+  tor_mutex_acquire(gai_lock);
+  answers = gai_answers;
+  gai_answers = smartlist_new();
+  tor_mutex_release(gai_lock);
+
+  SMARTLIST_FOREACH_BEGIN(answers, gai_job_t *, job) {
+    char *address = job->address;
+    if (job->cancelled) {
+      gai_job_free(job);
+      continue;
+    }
+    job->address = NULL; /* evdns_callback() frees it. */
+    if (job->result != DNS_ERR_NONE)
+      evdns_callback(job->result, 0, 0, 0, NULL, address);
+    else if (job->is_reverse)
+      evdns_callback(DNS_ERR_NONE, DNS_PTR, 1, GAI_ANSWER_TTL,
+                     &job->hostname, address);
+    else
+      evdns_callback(DNS_ERR_NONE, DNS_IPv4_A, job->n_addrs, GAI_ANSWER_TTL,
+                     job->addrs, address);
+    gai_job_free(job);
+  } SMARTLIST_FOREACH_END(job);
+  smartlist_free(answers);
+  main_loop_profile_callback(MAIN_LOOP_CB_DNS_GAI_ANSWERS, 0, start_nsec);
+}
+
+/** For the getaddrinfo backend: set up the socketpair and the shared state
+ * that the workers need, if we haven't already, and remember how many
+ * workers we may run.  Return 0 on success, -1 on failure. */
+static int
+gai_configure(int force)
+{
+  (void)force;
+  if (!gai_lock) {
+    int r;
+    if ((r = tor_socketpair(AF_UNIX, SOCK_STREAM, 0, gai_notify_fd)) < 0) {
+      log_warn(LD_EXIT, "Couldn't make a socketpair for our getaddrinfo "
+               "workers: %s", tor_socket_strerror(-r));
+      goto err;
+    }
+    set_socket_nonblocking(gai_notify_fd[0]);
+    set_socket_nonblocking(gai_notify_fd[1]);
+    gai_notify_event = tor_event_new(tor_libevent_get_base(),
+                                     gai_notify_fd[0], EV_READ|EV_PERSIST,
+                                     gai_answers_ready_cb, NULL);
+    if (event_add(gai_notify_event, NULL) < 0) {
+      log_warn(LD_BUG, "Couldn't add event for our getaddrinfo workers.");
+      tor_event_free(gai_notify_event);
+      gai_notify_event = NULL;
+      tor_close_socket(gai_notify_fd[0]);
+      tor_close_socket(gai_notify_fd[1]);
+      gai_notify_fd[0] = gai_notify_fd[1] = TOR_INVALID_SOCKET;
+      goto err;
+    }
+    gai_queue = smartlist_new();
+    gai_running = smartlist_new();
+    gai_answers = smartlist_new();
+    gai_cond = tor_cond_new();
+    gai_lock = tor_mutex_new();
+  }
+
+  tor_mutex_acquire(gai_lock);
+  gai_max_threads = (int)get_options()->ServerDNSMaxThreads;
+  /* Wake everybody up, in case some of them should exit now. */
+  tor_cond_signal_all(gai_cond);
+  tor_mutex_release(gai_lock);
+
+  nameservers_configured = 1;
+  if (nameserver_config_failed) {
+    nameserver_config_failed = 0;
+    mark_my_descriptor_dirty("dns resolvers back");
+  }
+  return 0;
+ err:
+  nameservers_configured = 0;
+  if (! nameserver_config_failed) {
+    nameserver_config_failed = 1;
+    mark_my_descriptor_dirty("dns resolvers failed");
+  }
+  return -1;
+}
+
+/** For the getaddrinfo backend: queue <b>address</b> for a worker to
+ * resolve, starting a new worker if none is free and we have room for
+ * one.  Returns as for launch_resolve(). */
+static int
+gai_launch_resolve(const char *address)
+{
+  gai_job_t *job;
+  int r = 0;
+
+  tor_assert(gai_lock);
+  job = tor_malloc_zero(sizeof(gai_job_t));
+  switch (tor_addr_parse_PTR_name(&job->reverse_addr, address,
+                                  AF_UNSPEC, 0)) {
+    case 0:
+      log_info(LD_EXIT, "Queueing getaddrinfo request for %s",
+               escaped_safe_str(address));
+      break;
+    case 1:
+      log_info(LD_EXIT, "Queueing getnameinfo request for %s",
+               escaped_safe_str(address));
+      job->is_reverse = 1;
+      break;
+    default:
+      log_warn(LD_BUG, "Somehow a malformed in-addr.arpa address reached "
+               "here.");
+      tor_free(job);
+      return -1;
+  }
+  job->address = tor_strdup(address);
+
+  tor_mutex_acquire(gai_lock);
+  if (smartlist_len(gai_queue) >= GAI_MAX_QUEUED) {
+    r = -1;
+  } else {
+    smartlist_add(gai_queue, job);
+    if (gai_n_idle) {
+      tor_cond_signal_one(gai_cond);
+    } else if (gai_n_threads < gai_max_threads) {
+      if (spawn_func(gai_worker_main, NULL) == 0)
+        ++gai_n_threads;
+      else if (!gai_n_threads)
+        r = -1;
+      if (r < 0)
+        smartlist_remove(gai_queue, job);
+    }
+  }
+  tor_mutex_release(gai_lock);
+
+  if (r < 0) {
+    log_fn(LOG_PROTOCOL_WARN, LD_EXIT, "Too many names to resolve; "
+           "rejecting %s.", escaped_safe_str(address));
+    gai_job_free(job);
+  }
+  return r;
+}
+
+/** For the getaddrinfo backend: drop any queued lookups of <b>address</b>,
+ * and ignore the answers to any lookups of it that are under way. */
+static void
+gai_cancel(const char *address)
+{
+  int i;
+  if (!gai_lock)
+    return;
+  tor_mutex_acquire(gai_lock);
+  for (i = 0; i < smartlist_len(gai_queue); ) {
+    gai_job_t *job = smartlist_get(gai_queue, i);
+    if (!strcasecmp(job->address, address)) {
+      gai_job_free(job);
+      smartlist_del_keeporder(gai_queue, i);
+    } else {
+      ++i;
+    }
+  }
+  SMARTLIST_FOREACH(gai_running, gai_job_t *, job,
+                    if (!strcasecmp(job->address, address))
+                      job->cancelled = 1);
+  tor_mutex_release(gai_lock);
+}
+
+/** For the getaddrinfo backend: tell the workers to exit, and free every
+ * job they haven't started.  Workers that are in the middle of a lookup
+ * still need the lock and the socketpair, so we leave those alone. */
+static void
+gai_free_all(void)
+{
+  if (!gai_lock)
+    return;
+  if (gai_notify_event) {
+    tor_event_free(gai_notify_event);
+    gai_notify_event = NULL;
+  }
+  tor_mutex_acquire(gai_lock);
+  gai_shutting_down = 1;
+  SMARTLIST_FOREACH(gai_queue, gai_job_t *, job, gai_job_free(job));
+  smartlist_clear(gai_queue);
+  SMARTLIST_FOREACH(gai_answers, gai_job_t *, job, gai_job_free(job));
+  smartlist_clear(gai_answers);
+  tor_cond_signal_all(gai_cond);
+  tor_mutex_release(gai_lock);
+}
+
+/** Resolve names with the system resolver, by calling getaddrinfo() from a
+ * pool of threads. */
+static const dns_backend_t getaddrinfo_backend = {
+  "getaddrinfo",
+  gai_configure,
+  NULL,
+  gai_launch_resolve,
+  gai_cancel,
+  gai_free_all,
+};
+#endif
+
 /** How many requests for bogus addresses have we launched so far? */
 static int n_wildcard_requests = 0;
 
-/** Map from dotted-quad IP address in response to an int holding how many
- * times we've seen it for a randomly generated (hopefully bogus) address.  It
- * would be easier to use definitely-invalid addresses (as specified by
- * RFC2606), but see comment in dns_launch_wildcard_checks(). */
-static strmap_t *dns_wildcard_response_count = NULL;
+/** An IPv4 address that our nameservers have given in response to a
+ * request for a randomly generated (hopefully bogus) address.  It would be
+ * easier to use definitely-invalid addresses (as specified by RFC2606), but
+ * see comment in dns_launch_wildcard_checks(). */
+typedef struct wildcard_answer_t {
+  HT_ENTRY(wildcard_answer_t) node;
+  /** The address, in host order. */
+  uint32_t addr;
+  /** How many times have we seen it for a bogus address? */
+  int count;
+  /** The most recent round of correctness checks in which we saw it. */
+  int last_round;
+  /** True iff we are pretty sure that our nameserver wants to return this
+   * address in response to requests for nonexistent domains. */
+  unsigned int is_wildcard : 1;
+} wildcard_answer_t;
+
+/** Hashtable helper: compute a hash of a wildcard_answer_t. */
+static INLINE unsigned
+wildcard_answer_hash(const wildcard_answer_t *a)
+{
+  return ht_improve_hash((unsigned)a->addr);
+}
+/** Hashtable helper: compare two wildcard_answer_t values for equality. */
+static INLINE int
+wildcard_answers_eq(const wildcard_answer_t *a, const wildcard_answer_t *b)
+{
+  return a->addr == b->addr;
+}
 
-/** If present, a list of dotted-quad IP addresses that we are pretty sure our
- * nameserver wants to return in response to requests for nonexistent domains.
- */
-static smartlist_t *dns_wildcard_list = NULL;
+/** Map from address to what we know about it as an answer for bogus
+ * addresses. */
+static HT_HEAD(wildcard_answer_map, wildcard_answer_t) wildcard_answers =
+     HT_INITIALIZER();
+HT_PROTOTYPE(wildcard_answer_map, wildcard_answer_t, node,
+             wildcard_answer_hash, wildcard_answers_eq);
+HT_GENERATE(wildcard_answer_map, wildcard_answer_t, node,
+            wildcard_answer_hash, wildcard_answers_eq, 0.6,
+            malloc, realloc, free);
+
+/** How many entries in wildcard_answers have is_wildcard set? */
+static int n_wildcard_answers = 0;
 /** True iff we've logged about a single address getting wildcarded.
  * Subsequent warnings will be less severe.  */
 static int dns_wildcard_one_notice_given = 0;
@@ -1474,31 +2403,40 @@ static int dns_wildcarded_test_address_notice_given = 0;
 /** True iff all addresses seem to be getting wildcarded. */
 static int dns_is_completely_invalid = 0;
 
-/** Called when we see <b>id</b> (a dotted quad) in response to a request for
- * a hopefully bogus address. */
+/** How many rounds of correctness checks have we started? */
+static int dns_check_round = 0;
+/** How many steps of the current round of correctness checks have we taken,
+ * or -1 if no round is under way?  See dns_check_step_cb(). */
+static int dns_check_step = -1;
+/** Timer that takes the next step of the current round of checks. */
+static struct event *dns_check_event = NULL;
+
+/** Called when we see <b>addr</b> (in host order) in response to a request
+ * for a hopefully bogus address. */
 static void
-wildcard_increment_answer(const char *id)
-{
-  int *ip;
-  if (!dns_wildcard_response_count)
-    dns_wildcard_response_count = strmap_new();
-
-  ip = strmap_get(dns_wildcard_response_count, id); // may be null (0)
-  if (!ip) {
-    ip = tor_malloc_zero(sizeof(int));
-    strmap_set(dns_wildcard_response_count, id, ip);
-  }
-  ++*ip;
-
-  if (*ip > 5 && n_wildcard_requests > 10) {
-    if (!dns_wildcard_list) dns_wildcard_list = smartlist_new();
-    if (!smartlist_string_isin(dns_wildcard_list, id)) {
-    log(dns_wildcard_notice_given ? LOG_INFO : LOG_NOTICE, LD_EXIT,
-        "Your DNS provider has given \"%s\" as an answer for %d different "
-        "invalid addresses. Apparently they are hijacking DNS failures. "
-        "I'll try to correct for this by treating future occurrences of "
-        "\"%s\" as 'not found'.", id, *ip, id);
-      smartlist_add(dns_wildcard_list, tor_strdup(id));
+wildcard_increment_answer(uint32_t addr)
+{
+  wildcard_answer_t search, *ent;
+  search.addr = addr;
+  ent = HT_FIND(wildcard_answer_map, &wildcard_answers, &search);
+  if (!ent) {
+    ent = tor_malloc_zero(sizeof(wildcard_answer_t));
+    ent->addr = addr;
+    HT_INSERT(wildcard_answer_map, &wildcard_answers, ent);
+  }
+  ++ent->count;
+  ent->last_round = dns_check_round;
+
+  if (ent->count > 5 && n_wildcard_requests > 10) {
+    if (!ent->is_wildcard) {
+      const char *id = fmt_addr32(addr);
+      log(dns_wildcard_notice_given ? LOG_INFO : LOG_NOTICE, LD_EXIT,
+          "Your DNS provider has given \"%s\" as an answer for %d different "
+          "invalid addresses. Apparently they are hijacking DNS failures. "
+          "I'll try to correct for this by treating future occurrences of "
+          "\"%s\" as 'not found'.", id, ent->count, id);
+      ent->is_wildcard = 1;
+      ++n_wildcard_answers;
     }
     if (!dns_wildcard_notice_given)
       control_event_server_status(LOG_NOTICE, "DNS_HIJACKED");
@@ -1506,6 +2444,21 @@ wildcard_increment_answer(const char *id)
   }
 }
 
+/** Forget every answer we've seen for bogus addresses. */
+static void
+wildcard_answers_clear(void)
+{
+  wildcard_answer_t **ent, **next, *this;
+  for (ent = HT_START(wildcard_answer_map, &wildcard_answers); ent;
+       ent = next) {
+    this = *ent;
+    next = HT_NEXT_RMV(wildcard_answer_map, &wildcard_answers, ent);
+    tor_free(this);
+  }
+  HT_CLEAR(wildcard_answer_map, &wildcard_answers);
+  n_wildcard_answers = 0;
+}
+
 /** Note that a single test address (one believed to be good) seems to be
  * getting redirected to the same IP as failures are. */
 static void
@@ -1541,7 +2494,7 @@ add_wildcarded_test_address(const char *address)
 
 /** Callback function when we get an answer (possibly failing) for a request
  * for a (hopefully) nonexistent domain. */
-static void
+void
 evdns_wildcard_check_callback(int result, char type, int count, int ttl,
                               void *addresses, void *arg)
 {
@@ -1551,20 +2504,15 @@ evdns_wildcard_check_callback(int result, char type, int count, int ttl,
     uint32_t *addrs = addresses;
     int i;
     char *string_address = arg;
-    for (i = 0; i < count; ++i) {
-      char answer_buf[INET_NTOA_BUF_LEN+1];
-      struct in_addr in;
-      in.s_addr = addrs[i];
-      tor_inet_ntoa(&in, answer_buf, sizeof(answer_buf));
-      wildcard_increment_answer(answer_buf);
-    }
+    for (i = 0; i < count; ++i)
+      wildcard_increment_answer(ntohl(addrs[i]));
     log(dns_wildcard_one_notice_given ? LOG_INFO : LOG_NOTICE, LD_EXIT,
         "Your DNS provider gave an answer for \"%s\", which "
         "is not supposed to exist. Apparently they are hijacking "
         "DNS failures. Trying to correct for this. We've noticed %d "
         "possibly bad address%s so far.",
-        string_address, strmap_size(dns_wildcard_response_count),
-        (strmap_size(dns_wildcard_response_count) == 1) ? "" : "es");
+        string_address, (int)HT_SIZE(&wildcard_answers),
+        (HT_SIZE(&wildcard_answers) == 1) ? "" : "es");
     dns_wildcard_one_notice_given = 1;
   }
   tor_free(arg);
@@ -1597,18 +2545,12 @@ launch_wildcard_check(int min_len, int max_len, const char *suffix)
 }
 
 /** Launch attempts to resolve a bunch of known-good addresses (configured in
- * ServerDNSTestAddresses).  [Callback for a libevent timer] */
+ * ServerDNSTestAddresses). */
 static void
-launch_test_addresses(int fd, short event, void *args)
+launch_test_addresses(void)
 {
   const or_options_t *options = get_options();
   struct evdns_request *req;
-  (void)fd;
-  (void)event;
-  (void)args;
-
-  if (options->DisableNetwork)
-    return;
 
   log_info(LD_EXIT, "Launching checks to see whether our nameservers like to "
            "hijack *everything*.");
@@ -1634,58 +2576,172 @@ launch_test_addresses(int fd, short event, void *args)
 
 #define N_WILDCARD_CHECKS 2
 
-/** Launch DNS requests for a few nonexistent hostnames and a few well-known
- * hostnames, and see if we can catch our nameserver trying to hijack them and
- * map them to a stupid "I couldn't find ggoogle.com but maybe you'd like to
- * buy these lovely encyclopedias" page. */
+/** The kinds of nonexistent hostname we ask for, in order: each is a
+ * minimum length, a maximum length and a suffix for launch_wildcard_check().
+ */
+static const struct {
+  int min_len, max_len;
+  const char *suffix;
+} wildcard_check_kinds[] = {
+  /* RFC2606 reserves these.  Sadly, some DNS hijackers, in a silly attempt
+   * to 'comply' with rfc2606, refrain from giving A records for these.
+   * This is the standards-compliance equivalent of making sure that your
+   * crackhouse's elevator inspection certificate is up to date.
+   */
+  { 2, 16, ".invalid" },
+  { 2, 16, ".test" },
+  /* These will break specs if there are ever any number of
+   * 8+-character top-level domains. */
+  { 8, 16, "" },
+  /* Try some random .com/org/net domains. This will work fine so long as
+   * not too many resolve to the same place. */
+  { 8, 16, ".com" },
+  { 8, 16, ".org" },
+  { 8, 16, ".net" },
+};
+#define N_WILDCARD_CHECK_KINDS \
+  ((int)(sizeof(wildcard_check_kinds)/sizeof(wildcard_check_kinds[0])))
+
+/** How many seconds apart are the steps of a round of correctness checks? */
+#define DNS_CHECK_STEP_INTERVAL 2
+/** At which step of a round do we stop asking for nonexistent hostnames? */
+#define DNS_CHECK_N_WILDCARD_STEPS (N_WILDCARD_CHECKS*N_WILDCARD_CHECK_KINDS)
+/** At which step of a round do we ask for our test addresses?  This leaves
+ * a few seconds for the last wildcard checks to come back. */
+#define DNS_CHECK_TEST_ADDRESS_STEP (DNS_CHECK_N_WILDCARD_STEPS + 3)
+/** At which step of a round do we look at what we learned? By then every
+ * request has either been answered or timed out. */
+#define DNS_CHECK_FINAL_STEP (DNS_CHECK_TEST_ADDRESS_STEP + 30)
+
+/** Stop the current round of correctness checks, if there is one. */
+void
+dns_stop_correctness_checks(void)
+{
+  if (dns_check_event)
+    event_del(dns_check_event);
+  dns_check_step = -1;
+}
+
+/** Finish a round of correctness checks: forget hijacked answers that we
+ * haven't seen for a whole round, and decide again whether our nameservers
+ * are hopeless. */
+void
+dns_finish_correctness_checks(void)
+{
+  wildcard_answer_t **ent, **next, *this;
+  int n_test_addrs, n_redirected;
+
+  for (ent = HT_START(wildcard_answer_map, &wildcard_answers); ent;
+       ent = next) {
+    this = *ent;
+    if (this->last_round < dns_check_round - 1) {
+      if (this->is_wildcard) {
+        log_info(LD_EXIT, "Our nameservers have stopped giving \"%s\" "
+                 "for nonexistent addresses.", fmt_addr32(this->addr));
+        --n_wildcard_answers;
+      }
+      next = HT_NEXT_RMV(wildcard_answer_map, &wildcard_answers, ent);
+      tor_free(this);
+    } else {
+      next = HT_NEXT(wildcard_answer_map, &wildcard_answers, ent);
+    }
+  }
+
+  n_test_addrs = get_options()->ServerDNSTestAddresses ?
+    smartlist_len(get_options()->ServerDNSTestAddresses) : 0;
+  n_redirected = dns_wildcarded_test_address_list ?
+    smartlist_len(dns_wildcarded_test_address_list) : 0;
+  if (dns_is_completely_invalid && n_redirected <= n_test_addrs/2) {
+    log_notice(LD_EXIT, "Our nameservers seem to have stopped redirecting "
+               "our test addresses.  Offering exit service again.");
+    dns_is_completely_invalid = 0;
+    mark_my_descriptor_dirty("dns hijacking stopped");
+  }
+  log_info(LD_EXIT, "Finished DNS hijacking checks: %d hijacked answer%s "
+           "known; %d of %d test addresses redirected.",
+           n_wildcard_answers, n_wildcard_answers == 1 ? "" : "s",
+           n_redirected, n_test_addrs);
+}
+
+/** Take the next step of the current round of correctness checks.  We
+ * spread a round over about a minute so that it never competes with client
+ * requests for our nameservers' attention: first a single request for a
+ * nonexistent hostname per step, then our test addresses, then a look at
+ * the results.  [Callback for a libevent timer] */
 static void
-dns_launch_wildcard_checks(void)
+dns_check_step_cb(evutil_socket_t fd, short event, void *args)
 {
-  int i;
-  log_info(LD_EXIT, "Launching checks to see whether our nameservers like "
-           "to hijack DNS failures.");
-  for (i = 0; i < N_WILDCARD_CHECKS; ++i) {
-    /* RFC2606 reserves these.  Sadly, some DNS hijackers, in a silly attempt
-     * to 'comply' with rfc2606, refrain from giving A records for these.
-     * This is the standards-compliance equivalent of making sure that your
-     * crackhouse's elevator inspection certificate is up to date.
-     */
-    launch_wildcard_check(2, 16, ".invalid");
-    launch_wildcard_check(2, 16, ".test");
+  const or_options_t *options = get_options();
+  int step;
+  (void)fd;
+  (void)event;
+  (void)args;
 
-    /* These will break specs if there are ever any number of
-     * 8+-character top-level domains. */
-    launch_wildcard_check(8, 16, "");
+  if (dns_check_step < 0)
+    return;
+  if (options->DisableNetwork || !options->ServerDNSDetectHijacking ||
+      dns_backend != &evdns_backend || !the_evdns_base) {
+    dns_stop_correctness_checks();
+    return;
+  }
 
-    /* Try some random .com/org/net domains. This will work fine so long as
-     * not too many resolve to the same place. */
-    launch_wildcard_check(8, 16, ".com");
-    launch_wildcard_check(8, 16, ".org");
-    launch_wildcard_check(8, 16, ".net");
+  step = dns_check_step++;
+  if (step < DNS_CHECK_N_WILDCARD_STEPS) {
+    int kind = step % N_WILDCARD_CHECK_KINDS;
+    launch_wildcard_check(wildcard_check_kinds[kind].min_len,
+                          wildcard_check_kinds[kind].max_len,
+                          wildcard_check_kinds[kind].suffix);
+  } else if (step == DNS_CHECK_TEST_ADDRESS_STEP) {
+    /* Count redirected test addresses afresh each round, so that we notice
+     * when our nameservers get better. */
+    if (dns_wildcarded_test_address_list) {
+      SMARTLIST_FOREACH(dns_wildcarded_test_address_list, char *, cp,
+                        tor_free(cp));
+      smartlist_clear(dns_wildcarded_test_address_list);
+    }
+    launch_test_addresses();
+  } else if (step == DNS_CHECK_FINAL_STEP) {
+    dns_finish_correctness_checks();
+    dns_stop_correctness_checks();
   }
 }
 
 /** If appropriate, start testing whether our DNS servers tend to lie to
- * us. */
+ * us: launch DNS requests for a few nonexistent hostnames and a few
+ * well-known hostnames, and see if we can catch our nameserver trying to
+ * hijack them and map them to a stupid "I couldn't find ggoogle.com but
+ * maybe you'd like to buy these lovely encyclopedias" page.  The requests
+ * go out a few at a time in the background; see dns_check_step_cb(). */
 void
 dns_launch_correctness_checks(void)
 {
-  static struct event *launch_event = NULL;
-  struct timeval timeout;
+  struct timeval interval;
   if (!get_options()->ServerDNSDetectHijacking)
     return;
-  dns_launch_wildcard_checks();
-
-  /* Wait a while before launching requests for test addresses, so we can
-   * get the results from checking for wildcarding. */
-  if (! launch_event)
-    launch_event = tor_evtimer_new(tor_libevent_get_base(),
-                                   launch_test_addresses, NULL);
-  timeout.tv_sec = 30;
-  timeout.tv_usec = 0;
-  if (evtimer_add(launch_event, &timeout)<0) {
+  /* Only eventdns lets us send the test requests straight to our
+   * nameservers. */
+  if (dns_backend != &evdns_backend)
+    return;
+  if (dns_check_step >= 0) {
+    log_info(LD_EXIT, "Still checking whether our nameservers hijack DNS; "
+             "not starting another round.");
+    return;
+  }
+
+  if (!dns_check_event) {
+    dns_check_event = tor_event_new(tor_libevent_get_base(), -1, EV_PERSIST,
+                                    dns_check_step_cb, NULL);
+  }
+  interval.tv_sec = DNS_CHECK_STEP_INTERVAL;
+  interval.tv_usec = 0;
+  if (event_add(dns_check_event, &interval)<0) {
     log_warn(LD_BUG, "Couldn't add timer for checking for dns hijacking");
+    return;
   }
+  log_info(LD_EXIT, "Launching checks to see whether our nameservers like "
+           "to hijack DNS failures.");
+  ++dns_check_round;
+  dns_check_step = 0;
 }
 
 /** Return true iff our DNS servers lie to us too much to be trusted. */
@@ -1699,15 +2755,11 @@ dns_seems_to_be_broken(void)
 void
 dns_reset_correctness_checks(void)
 {
-  strmap_free(dns_wildcard_response_count, _tor_free);
-  dns_wildcard_response_count = NULL;
+  dns_stop_correctness_checks();
+  wildcard_answers_clear();
 
   n_wildcard_requests = 0;
 
-  if (dns_wildcard_list) {
-    SMARTLIST_FOREACH(dns_wildcard_list, char *, cp, tor_free(cp));
-    smartlist_clear(dns_wildcard_list);
-  }
   if (dns_wildcarded_test_address_list) {
     SMARTLIST_FOREACH(dns_wildcarded_test_address_list, char *, cp,
                       tor_free(cp));
@@ -1717,12 +2769,30 @@ dns_reset_correctness_checks(void)
     dns_wildcarded_test_address_notice_given = dns_is_completely_invalid = 0;
 }
 
-/** Return true iff we have noticed that the dotted-quad <b>ip</b> has been
+/** Release all storage held by the correctness checks. */
+static void
+dns_correctness_checks_free_all(void)
+{
+  dns_reset_correctness_checks();
+  if (dns_check_event) {
+    tor_event_free(dns_check_event);
+    dns_check_event = NULL;
+  }
+  smartlist_free(dns_wildcarded_test_address_list);
+  dns_wildcarded_test_address_list = NULL;
+}
+
+/** Return true iff we have noticed that <b>addr</b> (in host order) has been
  * returned in response to requests for nonexistent hostnames. */
-static int
-answer_is_wildcarded(const char *ip)
+int
+answer_is_wildcarded(uint32_t addr)
 {
-  return dns_wildcard_list && smartlist_string_isin(dns_wildcard_list, ip);
+  wildcard_answer_t search, *ent;
+  if (!n_wildcard_answers)
+    return 0;
+  search.addr = addr;
+  ent = HT_FIND(wildcard_answer_map, &wildcard_answers, &search);
+  return ent && ent->is_wildcard;
 }
 
 /** Exit with an assertion if <b>resolve</b> is corrupt. */
@@ -1739,11 +2809,36 @@ assert_resolve_ok(cached_resolve_t *resolve)
   if (resolve->state == CACHE_STATE_PENDING ||
       resolve->state == CACHE_STATE_DONE) {
     tor_assert(!resolve->ttl);
-    if (resolve->is_reverse)
-      tor_assert(!resolve->result.hostname);
-    else
-      tor_assert(!resolve->result.a.addr);
   }
+  /* Pending entries only ever become DONE, which is the same size. */
+  tor_assert(resolve->address == ((char*)resolve) +
+             CACHED_RESOLVE_BASE_LEN(resolve->state));
+}
+
+/** Return the current time in milliseconds, for
+ * cached_resolve_t.launched_msec.  The origin is arbitrary, and the value
+ * wraps; only differences between values are meaningful. */
+static uint32_t
+dns_now_msec(void)
+{
+  struct timeval now;
+  tor_gettimeofday(&now);
+  return (uint32_t)(((uint64_t)now.tv_sec) * 1000 + now.tv_usec / 1000);
+}
+
+/** Note that the resolve we launched for <b>resolve</b> has finished
+ * with <b>outcome</b>, one of the DNS_RESOLVE_* values. */
+static void
+note_resolve_finished(cached_resolve_t *resolve, char outcome)
+{
+  latency_histogram_add(&resolve_latency_histogram,
+                        (uint32_t)(dns_now_msec() - resolve->launched_msec));
+  if (outcome == DNS_RESOLVE_SUCCEEDED)
+    ++n_resolves_succeeded;
+  else if (outcome == DNS_RESOLVE_FAILED_TRANSIENT)
+    ++n_resolves_failed_transient;
+  else
+    ++n_resolves_failed;
 }
 
 /** Return the number of DNS cache entries as an int */
@@ -1753,21 +2848,68 @@ dns_cache_entry_count(void)
    return HT_SIZE(&cache_root);
 }
 
+/** Return how many bytes <b>r</b> takes, counting its hostname and the
+ * answer to a reverse lookup. */
+static size_t
+cached_resolve_mem_usage(const cached_resolve_t *r)
+{
+  size_t n = CACHED_RESOLVE_BASE_LEN(r->state) + strlen(r->address) + 1;
+  if (r->state == CACHE_STATE_CACHED_VALID && r->is_reverse &&
+      r->result.hostname)
+    n += strlen(r->result.hostname) + 1;
+  return n;
+}
+
+/** Return how many bytes the cache entry for <b>address</b> takes, or 0 if
+ * there isn't one. */
+size_t
+dns_cache_entry_mem_usage(const char *address)
+{
+  cached_resolve_t search, *resolve;
+  char search_buf[MAX_ADDRESSLEN];
+  cached_resolve_set_key(&search, search_buf, address);
+  resolve = HT_FIND(cache_map, &cache_root, &search);
+  return resolve ? cached_resolve_mem_usage(resolve) : 0;
+}
+
 /** Log memory information about our internal DNS cache at level 'severity'. */
 void
 dump_dns_mem_usage(int severity)
 {
   /* This should never be larger than INT_MAX. */
   int hash_count = dns_cache_entry_count();
-  size_t hash_mem = sizeof(struct cached_resolve_t) * hash_count;
-  hash_mem += HT_MEM_USAGE(&cache_root);
+  size_t hash_mem = HT_MEM_USAGE(&cache_root);
+  int n_valid = 0, n_failed = 0, n_pending = 0;
+  size_t valid_mem = 0, failed_mem = 0, pending_mem = 0;
+  cached_resolve_t **resolve;
 
-  /* Print out the count and estimated size of our &cache_root.  It undercounts
-     hostnames in cached reverse resolves.
-   */
+  HT_FOREACH(resolve, cache_map, &cache_root) {
+    cached_resolve_t *r = *resolve;
+    size_t n = cached_resolve_mem_usage(r);
+    switch (r->state) {
+      case CACHE_STATE_CACHED_VALID:
+        ++n_valid;
+        valid_mem += n;
+        break;
+      case CACHE_STATE_CACHED_FAILED:
+        ++n_failed;
+        failed_mem += n;
+        break;
+      default:
+        ++n_pending;
+        pending_mem += n;
+        break;
+    }
+  }
+  hash_mem += valid_mem + failed_mem + pending_mem;
+
+  /* Print out the count and estimated size of our &cache_root. */
   log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
   log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
+  log(severity, LD_MM, "  %d answers in %u bytes; %d failures in %u bytes; "
+      "%d pending in %u bytes.", n_valid, (unsigned)valid_mem,
+      n_failed, (unsigned)failed_mem, n_pending, (unsigned)pending_mem);
 }
 
 #ifdef DEBUG_DNS_CACHE
@@ -1776,6 +2918,7 @@ static void
 _assert_cache_ok(void)
 {
   cached_resolve_t **resolve;
+  unsigned slot;
   int bad_rep = _cache_map_HT_REP_IS_BAD(&cache_root);
   if (bad_rep) {
     log_err(LD_BUG, "Bad rep type %d on dns cache hash table", bad_rep);
@@ -1786,23 +2929,112 @@ _assert_cache_ok(void)
     assert_resolve_ok(*resolve);
     tor_assert((*resolve)->state != CACHE_STATE_DONE);
   }
-  if (!cached_resolve_pqueue)
-    return;
-
-  smartlist_pqueue_assert_ok(cached_resolve_pqueue,
-                             _compare_cached_resolves_by_expiry,
-                             STRUCT_OFFSET(cached_resolve_t, minheap_idx));
-
-  SMARTLIST_FOREACH(cached_resolve_pqueue, cached_resolve_t *, res,
-    {
-      if (res->state == CACHE_STATE_DONE) {
-        cached_resolve_t *found = HT_FIND(cache_map, &cache_root, res);
+  for (slot = 0; slot < EXPIRY_WHEEL_SLOTS; ++slot) {
+    cached_resolve_t *res, **prevp = &expiry_wheel[slot];
+    for (res = expiry_wheel[slot]; res; res = res->expiry_next) {
+      cached_resolve_t *found = HT_FIND(cache_map, &cache_root, res);
+      tor_assert(res->expiry_prevp == prevp);
+      tor_assert(EXPIRY_WHEEL_SLOT(res->expire) == slot);
+      if (res->state == CACHE_STATE_DONE)
         tor_assert(!found || found != res);
-      } else {
-        cached_resolve_t *found = HT_FIND(cache_map, &cache_root, res);
+      else
         tor_assert(found);
-      }
-    });
+      prevp = &res->expiry_next;
+    }
+  }
+}
+#endif
+
+#ifndef HAVE_EVENT2_DNS_H
+/** Most nameservers we report on in GETINFO dns/nameservers. */
+#define DNS_MAX_REPORTED_NAMESERVERS 64
+
+/** Return a newly allocated string describing each of our nameservers, one
+ * per line, for GETINFO dns/nameservers. */
+static char *
+dns_nameservers_describe(void)
+{
+  struct evdns_nameserver_stats *stats;
+  smartlist_t *lines = smartlist_new();
+  latency_histogram_t hist;
+  char *result;
+  int i, j, n;
+
+  stats = tor_malloc_zero(sizeof(struct evdns_nameserver_stats) *
+                          DNS_MAX_REPORTED_NAMESERVERS);
+  n = evdns_get_nameserver_stats(stats, DNS_MAX_REPORTED_NAMESERVERS);
+  for (i = 0; i < n; ++i) {
+    tor_addr_t addr;
+    uint16_t port;
+    char *counts;
+    tor_addr_from_sockaddr(&addr, (const struct sockaddr *)&stats[i].address,
+                           &port);
+    memset(&hist, 0, sizeof(hist));
+    for (j = 0; j < LATENCY_HISTOGRAM_N_BUCKETS &&
+           j < EVDNS_LATENCY_HIST_BUCKETS; ++j)
+      hist.counts[j] = stats[i].latency_hist[j];
+    counts = latency_histogram_format(&hist);
+    smartlist_add_asprintf(lines, "%s:%d state=%s inflight=%d "
+                           "max-inflight=%d latency=%d sent=%lu "
+                           "answered=%lu timeouts=%lu reissues=%lu "
+                           "latency-histogram=%s",
+                           fmt_addr(&addr), (int)port,
+                           stats[i].up ? "up" : "down", stats[i].inflight,
+                           stats[i].max_inflight, stats[i].latency_msec,
+                           stats[i].n_sent, stats[i].n_answered,
+                           stats[i].n_timeouts, stats[i].n_reissues, counts);
+    tor_free(counts);
+  }
+  tor_free(stats);
+  result = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return result;
 }
 #endif
 
+/** Helper used to implement GETINFO dns/... controller commands. */
+int
+getinfo_helper_dns(control_connection_t *control_conn,
+                   const char *question, char **answer,
+                   const char **errmsg)
+{
+  (void)control_conn;
+  if (!strcmp(question, "dns/cache")) {
+    tor_asprintf(answer, "entries=%d hits="U64_FORMAT" negative-hits="
+                 U64_FORMAT" pending-hits="U64_FORMAT" misses="U64_FORMAT,
+                 dns_cache_entry_count(), U64_PRINTF_ARG(n_cache_hits),
+                 U64_PRINTF_ARG(n_cache_negative_hits),
+                 U64_PRINTF_ARG(n_cache_pending_hits),
+                 U64_PRINTF_ARG(n_cache_misses));
+  } else if (!strcmp(question, "dns/resolves")) {
+    cached_resolve_t **resolve;
+    int n_pending = 0;
+    HT_FOREACH(resolve, cache_map, &cache_root) {
+      if ((*resolve)->state == CACHE_STATE_PENDING ||
+          (*resolve)->refresh_state == DNS_REFRESH_IN_FLIGHT)
+        ++n_pending;
+    }
+    tor_asprintf(answer, "launched="U64_FORMAT" succeeded="U64_FORMAT
+                 " failed="U64_FORMAT" failed-transient="U64_FORMAT
+                 " pending=%d",
+                 U64_PRINTF_ARG(n_resolves_launched),
+                 U64_PRINTF_ARG(n_resolves_succeeded),
+                 U64_PRINTF_ARG(n_resolves_failed),
+                 U64_PRINTF_ARG(n_resolves_failed_transient), n_pending);
+  } else if (!strcmp(question, "dns/latency")) {
+    *answer = latency_histogram_format(&resolve_latency_histogram);
+  } else if (!strcmp(question, "dns/nameservers")) {
+#ifdef HAVE_EVENT2_DNS_H
+    *errmsg = "Nameserver statistics need Tor's own eventdns";
+    return -1;
+#else
+    if (dns_backend != &evdns_backend) {
+      *errmsg = "Not resolving with eventdns";
+      return -1;
+    }
+    *answer = dns_nameservers_describe();
+#endif
+  }
+  return 0;
+}
@@ -17,15 +17,75 @@ int has_dns_init_failed(void);
 void dns_free_all(void);
 uint32_t dns_clip_ttl(uint32_t ttl);
 int dns_reset(void);
+int dns_backend_is_available(const char *name);
 void connection_dns_remove(edge_connection_t *conn);
 void assert_connection_edge_not_dns_pending(edge_connection_t *conn);
 void assert_all_pending_dns_resolves_ok(void);
 void dns_cancel_pending_resolve(const char *question);
 int dns_resolve(edge_connection_t *exitconn);
+void dns_note_exit_connect_result(edge_connection_t *exitconn, int succeeded);
 void dns_launch_correctness_checks(void);
 int dns_seems_to_be_broken(void);
 void dns_reset_correctness_checks(void);
 void dump_dns_mem_usage(int severity);
+int getinfo_helper_dns(control_connection_t *control_conn,
+                       const char *question, char **answer,
+                       const char **errmsg);
+
+#ifdef DNS_PRIVATE
+/** Possible outcomes from hostname lookup: permanent failure,
+ * transient (retryable) failure, and success. */
+#define DNS_RESOLVE_FAILED_TRANSIENT 1
+#define DNS_RESOLVE_FAILED_PERMANENT 2
+#define DNS_RESOLVE_SUCCEEDED 3
+
+/** A way of looking up the names that exit connections ask for.  Every
+ * backend reports its answers by calling evdns_callback(). */
+typedef struct dns_backend_t {
+  /** The name that picks this backend in ServerDNSBackend. */
+  const char *name;
+  /** Get ready to resolve names, rereading our configuration if
+   * <b>force</b> is true or if it has changed.  Return 0 on success, -1 on
+   * failure. */
+  int (*configure)(int force);
+  /** Stop resolving names, since we aren't a server any more.  May be
+   * NULL. */
+  void (*suspend)(void);
+  /** Start resolving <b>address</b>, a hostname or an in-addr.arpa name.
+   * Return 0 if a resolve is under way, or -1 on error. */
+  int (*launch)(const char *address);
+  /** We no longer want to hear the answer for <b>address</b>.  May be
+   * NULL. */
+  void (*cancel)(const char *address);
+  /** Release all storage held by this backend.  May be NULL. */
+  void (*free_all)(void);
+} dns_backend_t;
+
+int dns_max_inflight_for_nameservers(int n_nameservers);
+struct cached_resolve_t *add_answer_to_cache(const char *address,
+                         uint8_t is_reverse, uint32_t addr,
+                         const uint32_t *alt_addrs, int n_alt_addrs,
+                         const char *hostname, char outcome, uint32_t ttl);
+size_t dns_cache_entry_mem_usage(const char *address);
+void set_exitconn_addrs(edge_connection_t *exitconn, uint32_t addr,
+                        const uint32_t *alt_addrs, int n_alt_addrs,
+                        int first, unsigned failed);
+int dns_resolve_hostname(edge_connection_t *exitconn, int is_resolve,
+                         uint8_t is_reverse, char **hostname_out,
+                         time_t now);
+void purge_expired_resolves(time_t now);
+void dns_found_answer(const char *address, uint8_t is_reverse,
+                      uint32_t addr, const uint32_t *alt_addrs,
+                      int n_alt_addrs, const char *hostname,
+                      char outcome, uint32_t ttl);
+const dns_backend_t *dns_backend_get_by_name(const char *name);
+void dns_set_backend_for_testing_(const dns_backend_t *backend);
+void evdns_wildcard_check_callback(int result, char type, int count, int ttl,
+                                   void *addresses, void *arg);
+int answer_is_wildcarded(uint32_t addr);
+void dns_stop_correctness_checks(void);
+void dns_finish_correctness_checks(void);
+#endif
 
 #endif
 
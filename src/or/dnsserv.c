@@ -8,6 +8,7 @@
  * other hand, runs on Tor servers, and acts as a DNS client.
  **/
 
+#define DNSSERV_PRIVATE
 #include "or.h"
 #include "dnsserv.h"
 #include "config.h"
@@ -25,6 +26,44 @@
 #include "eventdns.h"
 #endif
 
+/** Return a connection that is still waiting for the answer to a DNSPort
+ * request on <b>listener</b> from <b>client_addr</b>, where the request
+ * had <b>command</b> for <b>name</b>, and whose stream a new request like
+ * that one could use without crossing any isolation boundary.  Return NULL
+ * if there is none. */
+entry_connection_t *
+dnsserv_find_shareable_request(const listener_connection_t *listener,
+                               const tor_addr_t *client_addr,
+                               uint8_t command, const char *name)
+{
+  smartlist_t *conns = get_connection_array();
+  unsigned nym_epoch = get_signewnym_epoch();
+
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    entry_connection_t *entry_conn;
+    const char *conn_name;
+    if (conn->type != CONN_TYPE_AP || conn->marked_for_close)
+      continue;
+    entry_conn = TO_ENTRY_CONN(conn);
+    if (!entry_conn->dns_server_request ||
+        entry_conn->socks_request->command != command ||
+        entry_conn->socks_request->listener_type != listener->_base.type ||
+        entry_conn->isolation_flags != listener->isolation_flags ||
+        entry_conn->session_group != listener->session_group ||
+        entry_conn->nym_epoch != nym_epoch)
+      continue;
+    if ((listener->isolation_flags & ISO_CLIENTADDR) &&
+        !tor_addr_eq(&conn->addr, client_addr))
+      continue;
+    /* The socks address may have been rewritten by now. */
+    conn_name = entry_conn->original_dest_address ?
+      entry_conn->original_dest_address : entry_conn->socks_request->address;
+    if (!strcasecmp(conn_name, name))
+      return entry_conn;
+  } SMARTLIST_FOREACH_END(conn);
+  return NULL;
+}
+
 /** Helper function: called by evdns whenever the client sends a request to our
  * DNSPort.  We need to eventually answer the request <b>req</b>.
  */
@@ -34,6 +73,7 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
   const listener_connection_t *listener = data_;
   entry_connection_t *entry_conn;
   edge_connection_t *conn;
+  uint8_t command;
   int i = 0;
   struct evdns_server_question *q = NULL;
   struct sockaddr_storage addr;
@@ -115,6 +155,25 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
     return;
   }
 
+  command = (q->type == EVDNS_TYPE_A) ? SOCKS_COMMAND_RESOLVE
+    : SOCKS_COMMAND_RESOLVE_PTR;
+
+  /* If we're already asking the same question for a request that could
+   * have shared a circuit with this one anyway, don't open another stream
+   * for it: just answer both at once.  (Resolvers resend questions they
+   * don't get a quick answer to, and applications often ask for the same
+   * name several times in a row.) */
+  entry_conn = dnsserv_find_shareable_request(listener, &tor_addr, command,
+                                              q->name);
+  if (entry_conn) {
+    log_info(LD_APP, "Already waiting for an answer about %s; this request "
+             "will share it.", escaped_safe_str_client(q->name));
+    if (!entry_conn->dns_server_extra_requests)
+      entry_conn->dns_server_extra_requests = smartlist_new();
+    smartlist_add(entry_conn->dns_server_extra_requests, req);
+    return;
+  }
+
   /* Make a new dummy AP connection, and attach the request to it. */
   entry_conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
   conn = ENTRY_TO_EDGE_CONN(entry_conn);
@@ -125,10 +184,7 @@ evdns_server_callback(struct evdns_server_request *req, void *data_)
   TO_CONN(conn)->port = port;
   TO_CONN(conn)->address = tor_dup_addr(&tor_addr);
 
-  if (q->type == EVDNS_TYPE_A)
-    entry_conn->socks_request->command = SOCKS_COMMAND_RESOLVE;
-  else
-    entry_conn->socks_request->command = SOCKS_COMMAND_RESOLVE_PTR;
+  entry_conn->socks_request->command = command;
 
   strlcpy(entry_conn->socks_request->address, q->name,
           sizeof(entry_conn->socks_request->address));
@@ -228,6 +284,14 @@ dnsserv_reject_request(entry_connection_t *conn)
                                  DNS_ERR_SERVERFAILED);
     conn->dns_server_request = NULL;
   }
+  if (conn->dns_server_extra_requests) {
+    SMARTLIST_FOREACH(conn->dns_server_extra_requests,
+                      struct evdns_server_request *, req,
+                      evdns_server_request_respond(req,
+                                                   DNS_ERR_SERVERFAILED));
+    smartlist_free(conn->dns_server_extra_requests);
+    conn->dns_server_extra_requests = NULL;
+  }
 }
 
 /** Look up the original name that corresponds to 'addr' in req.  We use this
@@ -262,22 +326,18 @@ evdns_get_orig_address(const struct evdns_server_request *req,
   return addr;
 }
 
-/** Tell the dns request waiting for an answer on <b>conn</b> that we have an
- * answer of type <b>answer_type</b> (RESOLVE_TYPE_IPV4/IPV6/ERR), of length
- * <b>answer_len</b>, in <b>answer</b>, with TTL <b>ttl</b>.  Doesn't do
- * any caching; that's handled elsewhere. */
-void
-dnsserv_resolved(entry_connection_t *conn,
-                 int answer_type,
-                 size_t answer_len,
-                 const char *answer,
-                 int ttl)
+/** Helper: send DNSPort request <b>req</b>, which was waiting for the
+ * answer on <b>conn</b>, the answer described in dnsserv_resolved(). */
+static void
+dnsserv_answer_request(struct evdns_server_request *req,
+                       const entry_connection_t *conn,
+                       int answer_type,
+                       size_t answer_len,
+                       const char *answer,
+                       int ttl)
 {
-  struct evdns_server_request *req = conn->dns_server_request;
   const char *name;
   int err = DNS_ERR_NONE;
-  if (!req)
-    return;
   name = evdns_get_orig_address(req, answer_type,
                                 conn->socks_request->address);
 
@@ -311,8 +371,34 @@ dnsserv_resolved(entry_connection_t *conn,
   }
 
   evdns_server_request_respond(req, err);
+}
 
+/** Tell the dns request waiting for an answer on <b>conn</b>, and any
+ * other requests sharing it, that we have an answer of type
+ * <b>answer_type</b> (RESOLVE_TYPE_IPV4/IPV6/ERR), of length
+ * <b>answer_len</b>, in <b>answer</b>, with TTL <b>ttl</b>.  Doesn't do
+ * any caching; that's handled elsewhere. */
+void
+dnsserv_resolved(entry_connection_t *conn,
+                 int answer_type,
+                 size_t answer_len,
+                 const char *answer,
+                 int ttl)
+{
+  if (!conn->dns_server_request)
+    return;
+  dnsserv_answer_request(conn->dns_server_request, conn, answer_type,
+                         answer_len, answer, ttl);
   conn->dns_server_request = NULL;
+
+  if (conn->dns_server_extra_requests) {
+    SMARTLIST_FOREACH(conn->dns_server_extra_requests,
+                      struct evdns_server_request *, req,
+                      dnsserv_answer_request(req, conn, answer_type,
+                                             answer_len, answer, ttl));
+    smartlist_free(conn->dns_server_extra_requests);
+    conn->dns_server_extra_requests = NULL;
+  }
 }
 
 /** Set up the evdns server port for the UDP socket on <b>conn</b>, which
@@ -22,5 +22,12 @@ void dnsserv_resolved(entry_connection_t *conn,
 void dnsserv_reject_request(entry_connection_t *conn);
 int dnsserv_launch_request(const char *name, int is_reverse);
 
+#ifdef DNSSERV_PRIVATE
+entry_connection_t *dnsserv_find_shareable_request(
+                               const listener_connection_t *listener,
+                               const tor_addr_t *client_addr,
+                               uint8_t command, const char *name);
+#endif
+
 #endif
 
@@ -170,6 +170,7 @@ struct evdns_request {
 	void *user_pointer;	 /* the pointer given to us for this request */
 	evdns_callback_type user_callback;
 	struct nameserver *ns;	/* the server which we last sent it */
+	struct timeval tx_time;	 /* when we last sent it */
 
 	/* elements used by the searching code */
 	int search_index;
@@ -222,6 +223,12 @@ struct nameserver {
 	struct event timeout_event; /* used to keep the timeout for */
 								/* when we next probe this server. */
 								/* Valid if state == 0 */
+	int inflight;  /* number of inflight requests assigned to this server */
+	int max_inflight;  /* how many inflight requests we allow it right now */
+	int latency_msec;  /* moving average of how long it takes to answer */
+	/* counters for evdns_get_nameserver_stats() */
+	unsigned long n_sent, n_answered, n_timeouts, n_reissues;
+	unsigned long latency_hist[EVDNS_LATENCY_HIST_BUCKETS];
 	char state;	 /* zero if we think that this server is down */
 	char choked;  /* true if we have an EAGAIN from this server's socket */
 	char write_waiting;	 /* true if we are waiting for EV_WRITE events */
@@ -306,7 +313,17 @@ static int global_requests_inflight = 0;
 /* and are counted here */
 static int global_requests_waiting = 0;
 
-static int global_max_requests_inflight = 64;
+static int global_max_requests_inflight = 1024;
+
+/* Each nameserver gets its own inflight limit as well, which we adjust */
+/* as we go: it grows by one for every prompt answer we get while the */
+/* limit is the thing holding us back, shrinks by one whenever an answer */
+/* takes much longer than usual, and halves whenever a request times out. */
+#define NS_INITIAL_INFLIGHT 32
+#define NS_MIN_INFLIGHT 4
+#define NS_MAX_INFLIGHT 512
+/* Answers quicker than this never count as slow. */
+#define NS_SLOW_FLOOR_MSEC 50
 
 static struct timeval global_timeout = {5, 0};	/* 5 seconds */
 static int global_max_reissues = 1;	/* a reissue occurs when we get some errors from the server */
@@ -323,6 +340,8 @@ static const struct timeval global_nameserver_timeouts[] = {{10, 0}, {60, 0}, {3
 static const int global_nameserver_timeouts_length = (int)(sizeof(global_nameserver_timeouts)/sizeof(struct timeval));
 
 static struct nameserver *nameserver_pick(void);
+static int nameservers_have_room(void);
+static void request_set_ns(struct evdns_request *const req, struct nameserver *const ns);
 static void evdns_request_insert(struct evdns_request *req, struct evdns_request **head);
 static void nameserver_ready_callback(int fd, short events, void *arg);
 static int evdns_transmit(void);
@@ -579,7 +598,7 @@ nameserver_failed(struct nameserver *const ns, const char *msg) {
 			if (req->tx_count == 0 && req->ns == ns) {
 				/* still waiting to go out, can be moved */
 				/* to another server */
-				req->ns = nameserver_pick();
+				request_set_ns(req, nameserver_pick());
 			}
 			req = req->next;
 		} while (req != started_at);
@@ -598,6 +617,58 @@ nameserver_up(struct nameserver *const ns) {
 	global_good_nameservers++;
 }
 
+/* change the nameserver a request is assigned to, keeping the */
+/* per-server inflight counts straight. */
+static void
+request_set_ns(struct evdns_request *const req, struct nameserver *const ns) {
+	if (req->ns) req->ns->inflight--;
+	req->ns = ns;
+	if (ns) ns->inflight++;
+}
+
+/* called when ns answers req: update its latency estimate and */
+/* inflight limit. */
+static void
+nameserver_note_answer(struct nameserver *const ns,
+					   const struct evdns_request *const req) {
+	struct timeval now;
+	long msec;
+	int bucket;
+	ns->n_answered++;
+	/* We can't tell which transmission a retransmitted request's */
+	/* answer belongs to, so only time first tries. */
+	if (req->tx_count != 1) return;
+	gettimeofday(&now, NULL);
+	msec = (now.tv_sec - req->tx_time.tv_sec) * 1000 +
+		(now.tv_usec - req->tx_time.tv_usec) / 1000;
+	if (msec < 0) msec = 0;
+	/* bucket 0 is 0 msec; bucket i holds [2^(i-1), 2^i) msec. */
+	bucket = msec ? tor_log2((uint64_t)msec) + 1 : 0;
+	if (bucket >= EVDNS_LATENCY_HIST_BUCKETS)
+		bucket = EVDNS_LATENCY_HIST_BUCKETS - 1;
+	ns->latency_hist[bucket]++;
+	if (!ns->latency_msec) {
+		ns->latency_msec = (int)msec + 1;
+		return;
+	}
+	if (msec > 2*ns->latency_msec && msec > NS_SLOW_FLOOR_MSEC) {
+		if (ns->max_inflight > NS_MIN_INFLIGHT)
+			ns->max_inflight--;
+	} else if (ns->inflight >= ns->max_inflight &&
+			   ns->max_inflight < NS_MAX_INFLIGHT) {
+		ns->max_inflight++;
+	}
+	ns->latency_msec = (int)((7*(long)ns->latency_msec + msec) / 8) + 1;
+}
+
+/* called when a request to ns has timed out. */
+static void
+nameserver_note_timeout(struct nameserver *const ns) {
+	ns->max_inflight /= 2;
+	if (ns->max_inflight < NS_MIN_INFLIGHT)
+		ns->max_inflight = NS_MIN_INFLIGHT;
+}
+
 static void
 request_trans_id_set(struct evdns_request *const req, const u16 trans_id) {
 	req->trans_id = trans_id;
@@ -626,6 +697,7 @@ request_finished(struct evdns_request *const req, struct evdns_request **head) {
 
 	search_request_finished(req);
 	global_requests_inflight--;
+	if (req->ns) req->ns->inflight--;
 
 	if (!req->request_appended) {
 		/* need to free the request data on it's own */
@@ -649,11 +721,11 @@ request_finished(struct evdns_request *const req, struct evdns_request **head) {
 /* 1 failed/reissue is pointless */
 static int
 request_reissue(struct evdns_request *req) {
-	const struct nameserver *const last_ns = req->ns;
+	struct nameserver *const last_ns = req->ns;
 	/* the last nameserver should have been marked as failing */
 	/* by the caller of this function, therefore pick will try */
 	/* not to return it */
-	req->ns = nameserver_pick();
+	request_set_ns(req, nameserver_pick());
 	if (req->ns == last_ns) {
 		/* ... but pick did return it */
 		/* not a lot of point in trying again with the */
@@ -661,6 +733,7 @@ request_reissue(struct evdns_request *req) {
 		return 1;
 	}
 
+	if (last_ns) last_ns->n_reissues++;
 	req->reissue_count++;
 	req->tx_count = 0;
 	req->transmit_me = 1;
@@ -673,7 +746,7 @@ request_reissue(struct evdns_request *req) {
 static void
 evdns_requests_pump_waiting_queue(void) {
 	while (global_requests_inflight < global_max_requests_inflight &&
-		global_requests_waiting) {
+		global_requests_waiting && nameservers_have_room()) {
 		struct evdns_request *req;
 		/* move a request from the waiting queue to the inflight queue */
 		assert(req_waiting_head);
@@ -691,7 +764,7 @@ evdns_requests_pump_waiting_queue(void) {
 		global_requests_waiting--;
 		global_requests_inflight++;
 
-		req->ns = nameserver_pick();
+		request_set_ns(req, nameserver_pick());
 		request_trans_id_set(req, transaction_id_pick());
 
 		evdns_request_insert(req, &req_head);
@@ -741,6 +814,8 @@ reply_handle(struct evdns_request *const req, u16 flags, u32 ttl, struct reply *
 	int error;
 	static const int error_codes[] = {DNS_ERR_FORMAT, DNS_ERR_SERVERFAILED, DNS_ERR_NOTEXIST, DNS_ERR_NOTIMPL, DNS_ERR_REFUSED};
 
+	nameserver_note_answer(req->ns, req);
+
 	if (flags & 0x020f || !reply || !reply->have_answer) {
 		/* there was an error */
 		if (flags & 0x0200) {
@@ -1206,12 +1281,37 @@ transaction_id_pick(void) {
 	}
 }
 
+/* return the share of its inflight limit which ns is using, scaled */
+/* up by 1000 so that we can compare the result as an integer. */
+static INLINE int
+nameserver_load(const struct nameserver *const ns) {
+	return (int)(ns->inflight * 1000L / ns->max_inflight);
+}
+
+/* return true iff we have a good nameserver that can take another */
+/* request without going over its inflight limit.  If every nameserver */
+/* is down, we have nothing to go on, so say yes and let the global */
+/* limit hold things back. */
+static int
+nameservers_have_room(void) {
+	struct nameserver *ns = server_head;
+	if (!server_head) return 1;
+	if (!global_good_nameservers) return 1;
+	do {
+		if (ns->state && ns->inflight < ns->max_inflight)
+			return 1;
+		ns = ns->next;
+	} while (ns != server_head);
+	return 0;
+}
+
 /* choose a namesever to use. This function will try to ignore */
 /* nameservers which we think are down and load balance across the rest */
-/* by updating the server_head global each time. */
+/* by picking the one using the smallest share of its inflight limit. */
+/* Ties go round-robin, by updating the server_head global each time. */
 static struct nameserver *
 nameserver_pick(void) {
-	struct nameserver *started_at = server_head, *picked;
+	struct nameserver *ns, *picked = NULL;
 	if (!server_head) return NULL;
 
 	/* if we don't have any good nameservers then there's no */
@@ -1222,25 +1322,18 @@ nameserver_pick(void) {
 	}
 
 	/* remember that nameservers are in a circular list */
-	for (;;) {
-		if (server_head->state) {
-			/* we think this server is currently good */
-			picked = server_head;
-			server_head = server_head->next;
-			return picked;
-		}
+	ns = server_head;
+	do {
+		if (ns->state &&
+			(!picked || nameserver_load(ns) < nameserver_load(picked)))
+			picked = ns;
+		ns = ns->next;
+	} while (ns != server_head);
 
-		server_head = server_head->next;
-		if (server_head == started_at) {
-			/* all the nameservers seem to be down */
-			/* so we just return this one and hope for the */
-			/* best */
-			assert(global_good_nameservers == 0);
-			picked = server_head;
-			server_head = server_head->next;
-			return picked;
-		}
-	}
+	/* we think this server is currently good */
+	assert(picked);
+	server_head = picked->next;
+	return picked;
 }
 
 /* this is called when a namesever socket is ready for reading */
@@ -1993,6 +2086,8 @@ evdns_request_timeout_callback(int fd, short events, void *arg) {
 
 	log(EVDNS_LOG_DEBUG, "Request %lx timed out", (unsigned long) arg);
 
+	nameserver_note_timeout(req->ns);
+	req->ns->n_timeouts++;
 	req->ns->timedout++;
 	if (req->ns->timedout > global_max_nameserver_timeout) {
 		req->ns->timedout = 0;
@@ -2079,7 +2174,9 @@ evdns_request_transmit(struct evdns_request *req) {
 				(unsigned long) req);
 			/* ???? Do more? */
 		}
+		gettimeofday(&req->tx_time, NULL);
 		req->tx_count++;
+		req->ns->n_sent++;
 		req->transmit_me = 0;
 		return retcode;
 	}
@@ -2131,7 +2228,7 @@ nameserver_send_probe(struct nameserver *const ns) {
 	}
 	/* we force this into the inflight queue no matter what */
 	request_trans_id_set(req, transaction_id_pick());
-	req->ns = ns;
+	request_set_ns(req, ns);
 	request_submit(req);
 }
 
@@ -2173,6 +2270,33 @@ evdns_count_nameservers(void)
 	return n;
 }
 
+/* exported function */
+int
+evdns_get_nameserver_stats(struct evdns_nameserver_stats *out, int max)
+{
+	const struct nameserver *server = server_head;
+	int n = 0;
+	if (!server)
+		return 0;
+	do {
+		struct evdns_nameserver_stats *const st = &out[n];
+		memcpy(&st->address, &server->address, sizeof(st->address));
+		st->up = server->state != 0;
+		st->inflight = server->inflight;
+		st->max_inflight = server->max_inflight;
+		st->latency_msec = server->latency_msec ? server->latency_msec - 1 : 0;
+		st->n_sent = server->n_sent;
+		st->n_answered = server->n_answered;
+		st->n_timeouts = server->n_timeouts;
+		st->n_reissues = server->n_reissues;
+		memcpy(st->latency_hist, server->latency_hist,
+			   sizeof(st->latency_hist));
+		++n;
+		server = server->next;
+	} while (server != server_head && n < max);
+	return n;
+}
+
 /* exported function */
 int
 evdns_clear_nameservers_and_suspend(void)
@@ -2324,6 +2448,7 @@ _evdns_nameserver_add_impl(const struct sockaddr *address,
 	}
 
 	memcpy(&ns->address, address, addrlen);
+	ns->max_inflight = NS_INITIAL_INFLIGHT;
 	ns->state = 1;
 	event_set(&ns->event, ns->socket, EV_READ | EV_PERSIST, nameserver_ready_callback, ns);
 	if (event_add(&ns->event, NULL) < 0) {
@@ -2510,7 +2635,8 @@ static struct evdns_request *
 request_new(int type, const char *name, int flags,
 	evdns_callback_type callback, void *user_ptr) {
 	const char issuing_now =
-		(global_requests_inflight < global_max_requests_inflight) ? 1 : 0;
+		(global_requests_inflight < global_max_requests_inflight &&
+		 nameservers_have_room()) ? 1 : 0;
 
 	const size_t name_len = strlen(name);
 	const size_t request_max_len = evdns_request_len(name_len);
@@ -2563,7 +2689,7 @@ request_new(int type, const char *name, int flags,
 	req->request_type = type;
 	req->user_pointer = user_ptr;
 	req->user_callback = callback;
-	req->ns = issuing_now ? nameserver_pick() : NULL;
+	request_set_ns(req, issuing_now ? nameserver_pick() : NULL);
 	req->next = req->prev = NULL;
 
 	return req;
@@ -153,6 +153,10 @@
  *	 whether our calls to the various nameserver configuration functions
  *	 have been successful.
  *
+ * int evdns_get_nameserver_stats(struct evdns_nameserver_stats *out, int max)
+ *	 Fill in out[0] .. out[max-1] with the state of, and counters for, up to
+ *	 max configured nameservers, and return how many were filled in.
+ *
  * int evdns_clear_nameservers_and_suspend(void)
  *	 Remove all currently configured nameservers, and suspend all pending
  *	 resolves.	Resolves will not necessarily be re-attempted until
@@ -260,6 +264,24 @@ void evdns_shutdown(int fail_requests);
 const char *evdns_err_to_string(int err);
 int evdns_nameserver_add(uint32_t address);
 int evdns_count_nameservers(void);
+
+/* How many buckets does an evdns_nameserver_stats latency histogram have? */
+/* Bucket 0 counts answers in 0 msec; bucket i counts answers that took */
+/* between 2^(i-1) and 2^i - 1 msec; the last bucket is unbounded. */
+#define EVDNS_LATENCY_HIST_BUCKETS 24
+struct evdns_nameserver_stats {
+	struct sockaddr_storage address;
+	int up;  /* true unless we think this server is down */
+	int inflight, max_inflight;  /* current and allowed inflight requests */
+	int latency_msec;  /* moving average of first-try answer times */
+	unsigned long n_sent;  /* packets sent, retransmissions included */
+	unsigned long n_answered;  /* replies received */
+	unsigned long n_timeouts;  /* transmissions that timed out */
+	unsigned long n_reissues;  /* requests moved away after a bad reply */
+	/* first-try answer times, as described above */
+	unsigned long latency_hist[EVDNS_LATENCY_HIST_BUCKETS];
+};
+int evdns_get_nameserver_stats(struct evdns_nameserver_stats *out, int max);
 int evdns_clear_nameservers_and_suspend(void);
 int evdns_resume(void);
 int evdns_nameserver_ip_add(const char *ip_as_string);
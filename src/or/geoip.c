@@ -35,18 +35,71 @@ typedef struct geoip_country_t {
   uint32_t n_v3_ns_requests;
 } geoip_country_t;
 
+/** A compact, searchable table of address ranges.  Range <b>k</b> starts at
+ * the network-order address at <b>starts</b> + k*addr_len, runs up to the
+ * start of range k+1 (or to the end of the address space), and belongs to
+ * the country whose network-order 16-bit index is at <b>countries</b> +
+ * 2*k.  The first range always starts at the lowest address, so that every
+ * address falls in exactly one range.  We use the same layout whether the
+ * table is on the heap or mapped straight from a binary GeoIP file. */
+typedef struct geoip_ranges_t {
+  const uint8_t *starts;
+  const uint8_t *countries;
+  unsigned n;
+} geoip_ranges_t;
+
 /** A list of geoip_country_t */
 static smartlist_t *geoip_countries = NULL;
 /** A map from lowercased country codes to their position in geoip_countries.
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** A list of all known geoip_entry_t, sorted by ip_low. */
+/** A list of all geoip_entry_t parsed from a text GeoIP file that we have
+ * not yet folded into geoip_ipv4_ranges. */
 static smartlist_t *geoip_entries = NULL;
+/** True iff geoip_entries has changed since we last built
+ * geoip_ipv4_ranges from it. */
+static int geoip_entries_dirty = 0;
+/** True iff we have loaded a GeoIP database, of either format. */
+static int geoip_loaded = 0;
+/** Incremented whenever the answers that the GeoIP database gives might
+ * change: whenever we load a file, and so whenever geoip_db_digest()
+ * changes, and whenever we rebuild the ranges.  Never 0, so that 0 can
+ * mean "never looked up". */
+static unsigned geoip_generation = 1;
+/** IPv4 ranges, in the order we search them. */
+static geoip_ranges_t geoip_ipv4_ranges = { NULL, NULL, 0 };
+/** IPv6 ranges, in the order we search them.  Only binary GeoIP files can
+ * have these. */
+static geoip_ranges_t geoip_ipv6_ranges = { NULL, NULL, 0 };
+/** Heap storage for geoip_ipv4_ranges, when we built it from text. */
+static uint8_t *geoip_ranges_mem = NULL;
+/** The mapping that holds the ranges, when we loaded a binary GeoIP file. */
+static tor_mmap_t *geoip_mmap = NULL;
+/** When we loaded a binary GeoIP file: a map from the country indices in
+ * that file to indices in geoip_countries, and its length.  NULL when the
+ * ranges hold indices into geoip_countries directly. */
+static country_t *geoip_mmap_country_map = NULL;
+static unsigned geoip_mmap_n_countries = 0;
 
 /** SHA1 digest of the GeoIP file to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
 
+/** Magic string that starts every binary GeoIP file.
+ *
+ * A binary GeoIP file holds a header of GEOIP_BINARY_HEADER_LEN bytes: the
+ * magic string, then the number of countries, the number of IPv4 ranges,
+ * and the number of IPv6 ranges, each as a 4-byte network-order integer.
+ * Then come, with no padding: the 2-byte country codes; the 4-byte IPv4
+ * range starts and their 2-byte country indices, as in geoip_ranges_t; and
+ * the 16-byte IPv6 range starts and their 2-byte country indices.  Write
+ * one with "tor --dump-geoip-binary". */
+#define GEOIP_BINARY_MAGIC "TORGEOB1"
+/** Length of GEOIP_BINARY_MAGIC. */
+#define GEOIP_BINARY_MAGIC_LEN 8
+/** Length of the fixed header of a binary GeoIP file. */
+#define GEOIP_BINARY_HEADER_LEN (GEOIP_BINARY_MAGIC_LEN + 12)
+
 /** Return the index of the <b>country</b>'s entry in the GeoIP DB
  * if it is a valid 2-letter country code, otherwise return -1.
  */
@@ -64,19 +117,14 @@ geoip_get_country(const char *country)
   return (country_t)idx;
 }
 
-/** Add an entry to the GeoIP table, mapping all IPs between <b>low</b> and
- * <b>high</b>, inclusive, to the 2-letter country code <b>country</b>.
- */
-static void
-geoip_add_entry(uint32_t low, uint32_t high, const char *country)
+/** Return the index of the 2-letter country code <b>country</b> in
+ * geoip_countries, adding it if it isn't there yet. */
+static intptr_t
+geoip_get_or_add_country(const char *country)
 {
   intptr_t idx;
-  geoip_entry_t *ent;
   void *_idxplus1;
 
-  if (high < low)
-    return;
-
   _idxplus1 = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!_idxplus1) {
@@ -93,11 +141,27 @@ geoip_add_entry(uint32_t low, uint32_t high, const char *country)
     geoip_country_t *c = smartlist_get(geoip_countries, idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Add an entry to the GeoIP table, mapping all IPs between <b>low</b> and
+ * <b>high</b>, inclusive, to the 2-letter country code <b>country</b>.
+ */
+static void
+geoip_add_entry(uint32_t low, uint32_t high, const char *country)
+{
+  geoip_entry_t *ent;
+
+  if (high < low)
+    return;
+
   ent = tor_malloc_zero(sizeof(geoip_entry_t));
   ent->ip_low = low;
   ent->ip_high = high;
-  ent->country = idx;
+  ent->country = geoip_get_or_add_country(country);
   smartlist_add(geoip_entries, ent);
+  geoip_entries_dirty = 1;
+  geoip_loaded = 1;
 }
 
 /** Add an entry to the GeoIP table, parsing it from <b>line</b>.  The
@@ -129,6 +193,24 @@ geoip_parse_entry(const char *line)
   }
 }
 
+/** Note that lookups might now give different answers, so that cached
+ * countries are stale. */
+static void
+geoip_note_changed(void)
+{
+  if (++geoip_generation == 0)
+    geoip_generation = 1;
+}
+
+/** Return a number that changes whenever the answers of
+ * geoip_get_country_by_ip() and geoip_get_country_by_addr() might change,
+ * for use in caching their results. */
+unsigned
+geoip_db_generation(void)
+{
+  return geoip_generation;
+}
+
 /** Sorting helper: return -1, 1, or 0 based on comparison of two
  * geoip_entry_t */
 static int
@@ -143,20 +225,121 @@ _geoip_compare_entries(const void **_a, const void **_b)
     return 0;
 }
 
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_entry_t */
+/** Helper for geoip_build_ipv4_ranges(): append a range starting at
+ * <b>start</b> for <b>country</b> to the <b>n_out</b> ranges at
+ * <b>starts</b> and <b>countries</b>, unless it just continues the last
+ * one. */
+static void
+geoip_append_range(uint8_t *starts, uint8_t *countries, unsigned *n_out,
+                   uint32_t start, intptr_t country)
+{
+  if (*n_out &&
+      get_uint16(countries + 2*(*n_out-1)) == htons((uint16_t)country))
+    return;
+  set_uint32(starts + 4*(*n_out), htonl(start));
+  set_uint16(countries + 2*(*n_out), htons((uint16_t)country));
+  ++*n_out;
+}
+
+/** Sort geoip_entries, and replace geoip_ipv4_ranges with a compact table
+ * built from them.  Where entries overlap, the one that starts first wins;
+ * addresses in no entry belong to the unknown country. */
+static void
+geoip_build_ipv4_ranges(void)
+{
+  uint8_t *starts, *countries;
+  unsigned n = 0, max_n;
+  uint64_t next_addr = 0;
+
+  tor_free(geoip_ranges_mem);
+  memset(&geoip_ipv4_ranges, 0, sizeof(geoip_ipv4_ranges));
+  geoip_entries_dirty = 0;
+  geoip_note_changed();
+  if (!geoip_entries)
+    return;
+
+  smartlist_sort(geoip_entries, _geoip_compare_entries);
+  /* Each entry yields at most itself and the gap before it; then there may
+   * be a gap at the end. */
+  max_n = 2*smartlist_len(geoip_entries) + 1;
+  geoip_ranges_mem = tor_malloc(max_n * 6);
+  starts = geoip_ranges_mem;
+  countries = geoip_ranges_mem + 4*max_n;
+
+  SMARTLIST_FOREACH_BEGIN(geoip_entries, const geoip_entry_t *, ent) {
+    if (ent->ip_high < next_addr)
+      continue;
+    if (ent->ip_low > next_addr)
+      geoip_append_range(starts, countries, &n, (uint32_t)next_addr, 0);
+    geoip_append_range(starts, countries, &n,
+                       ent->ip_low > next_addr ? ent->ip_low :
+                       (uint32_t)next_addr, ent->country);
+    next_addr = ((uint64_t)ent->ip_high) + 1;
+  } SMARTLIST_FOREACH_END(ent);
+  if (next_addr <= UINT32_MAX)
+    geoip_append_range(starts, countries, &n, (uint32_t)next_addr, 0);
+
+  geoip_ipv4_ranges.starts = starts;
+  geoip_ipv4_ranges.countries = countries;
+  geoip_ipv4_ranges.n = n;
+}
+
+/** Return the index into geoip_countries for range <b>idx</b> of
+ * <b>ranges</b>. */
+static INLINE int
+geoip_ranges_get_country(const geoip_ranges_t *ranges, unsigned idx)
+{
+  unsigned c = ntohs(get_uint16(ranges->countries + 2*idx));
+  if (geoip_mmap_country_map)
+    return c < geoip_mmap_n_countries ? geoip_mmap_country_map[c] : 0;
+  return (int)c;
+}
+
+/** Return the index into geoip_countries for the IPv4 address
+ * <b>addr</b>, in host order, according to <b>ranges</b>.
+ *
+ * This is a binary search without data-dependent branches: each step
+ * keeps either the lower or the upper half of what's left by masking, so
+ * the CPU never mispredicts, and the first few probes hit the same few
+ * cache lines on every lookup. */
+static int
+geoip_ranges_lookup_ipv4(const geoip_ranges_t *ranges, uint32_t addr)
+{
+  const uint8_t *starts = ranges->starts;
+  unsigned lo = 0, len = ranges->n, half;
+  if (!len)
+    return 0;
+  while (len > 1) {
+    half = len / 2;
+    /* Step forward by half iff the range at lo+half starts at or below
+     * addr. */
+    lo += half & -(unsigned)(ntohl(get_uint32(starts + 4*(lo+half)))
+                             <= addr);
+    len -= half;
+  }
+  if (ntohl(get_uint32(starts + 4*lo)) > addr)
+    return 0;
+  return geoip_ranges_get_country(ranges, lo);
+}
+
+/** As geoip_ranges_lookup_ipv4(), but for the 16-byte IPv6 address
+ * <b>addr</b>. */
 static int
-_geoip_compare_key_to_entry(const void *_key, const void **_member)
+geoip_ranges_lookup_ipv6(const geoip_ranges_t *ranges, const uint8_t *addr)
 {
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
+  const uint8_t *starts = ranges->starts;
+  unsigned lo = 0, len = ranges->n, half;
+  if (!len)
+    return 0;
+  while (len > 1) {
+    half = len / 2;
+    lo += half & -(unsigned)(fast_memcmp(starts + 16*(lo+half), addr, 16)
+                             <= 0);
+    len -= half;
+  }
+  if (fast_memcmp(starts + 16*lo, addr, 16) > 0)
     return 0;
+  return geoip_ranges_get_country(ranges, lo);
 }
 
 /** Return 1 if we should collect geoip stats on bridge users, and
@@ -185,6 +368,89 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Return 0 if the <b>n</b> range starts of <b>width</b> bytes each at
+ * <b>starts</b> are in strictly increasing order, with the first at the
+ * lowest address, as our lookups assume.  Otherwise return -1. */
+static int
+geoip_ranges_check_starts(const uint8_t *starts, unsigned n, size_t width)
+{
+  static const uint8_t zero[16] = { 0 };
+  unsigned i;
+  tor_assert(width <= sizeof(zero));
+  if (n && tor_memneq(starts, zero, width))
+    return -1;
+  for (i = 1; i < n; ++i) {
+    if (memcmp(starts + (i-1)*width, starts + i*width, width) >= 0)
+      return -1;
+  }
+  return 0;
+}
+
+/** Try to use the binary GeoIP file mapped at <b>map</b>, as described at
+ * GEOIP_BINARY_MAGIC.  On success, take ownership of <b>map</b> and return
+ * 0.  On failure, return -1. */
+static int
+geoip_load_binary(tor_mmap_t *map, const char *filename)
+{
+  const uint8_t *data = (const uint8_t *)map->data;
+  uint64_t n_countries, n_v4, n_v6, expected_len;
+  const uint8_t *cc;
+  unsigned i;
+
+  n_countries = ntohl(get_uint32(data + GEOIP_BINARY_MAGIC_LEN));
+  n_v4 = ntohl(get_uint32(data + GEOIP_BINARY_MAGIC_LEN + 4));
+  n_v6 = ntohl(get_uint32(data + GEOIP_BINARY_MAGIC_LEN + 8));
+  expected_len = GEOIP_BINARY_HEADER_LEN + 2*n_countries + 6*n_v4 +
+    18*n_v6;
+  if (expected_len != map->size || n_countries > UINT16_MAX+1) {
+    log_warn(LD_GENERAL, "Binary GEOIP file %s is truncated or corrupt.",
+             filename);
+    return -1;
+  }
+
+  cc = data + GEOIP_BINARY_HEADER_LEN;
+  if (geoip_ranges_check_starts(cc + 2*n_countries, (unsigned)n_v4, 4) < 0 ||
+      geoip_ranges_check_starts(cc + 2*n_countries + 6*n_v4,
+                                (unsigned)n_v6, 16) < 0) {
+    log_warn(LD_GENERAL, "Binary GEOIP file %s has ranges that are out of "
+             "order or don't start at the lowest address.", filename);
+    return -1;
+  }
+
+  geoip_mmap_country_map = tor_malloc(sizeof(country_t) *
+                                      (n_countries ? n_countries : 1));
+  for (i = 0; i < n_countries; ++i) {
+    char code[3];
+    code[0] = (char)cc[2*i];
+    code[1] = (char)cc[2*i+1];
+    code[2] = '\0';
+    if (strcmp(code, "??") &&
+        (!TOR_ISALNUM(code[0]) || !TOR_ISALNUM(code[1]))) {
+      log_warn(LD_GENERAL, "Binary GEOIP file %s has a bad country code %s.",
+               filename, escaped(code));
+      tor_free(geoip_mmap_country_map);
+      return -1;
+    }
+    geoip_mmap_country_map[i] = (country_t)geoip_get_or_add_country(code);
+  }
+  geoip_mmap_n_countries = (unsigned)n_countries;
+
+  geoip_ipv4_ranges.starts = cc + 2*n_countries;
+  geoip_ipv4_ranges.countries = geoip_ipv4_ranges.starts + 4*n_v4;
+  geoip_ipv4_ranges.n = (unsigned)n_v4;
+  geoip_ipv6_ranges.starts = geoip_ipv4_ranges.countries + 2*n_v4;
+  geoip_ipv6_ranges.countries = geoip_ipv6_ranges.starts + 16*n_v6;
+  geoip_ipv6_ranges.n = (unsigned)n_v6;
+  geoip_mmap = map;
+  geoip_loaded = 1;
+  geoip_note_changed();
+
+  crypto_digest(geoip_digest, map->data, map->size);
+  log_info(LD_GENERAL, "Mapped %u IPv4 and %u IPv6 ranges from binary "
+           "GEOIP file.", geoip_ipv4_ranges.n, geoip_ipv6_ranges.n);
+  return 0;
+}
+
 /** Clear the GeoIP database and reload it from the file
  * <b>filename</b>. Return 0 on success, -1 on failure.
  *
@@ -197,6 +463,9 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If the file is instead in the binary format described at
+ * GEOIP_BINARY_MAGIC, we map it into memory and search it in place.
  */
 int
 geoip_load_file(const char *filename, const or_options_t *options)
@@ -205,18 +474,31 @@ geoip_load_file(const char *filename, const or_options_t *options)
   const char *msg = "";
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
   crypto_digest_t *geoip_digest_env = NULL;
+  tor_mmap_t *map;
   clear_geoip_db();
+  if (!geoip_countries)
+    init_geoip_countries();
+
+  if ((map = tor_mmap_file(filename))) {
+    if (map->size >= GEOIP_BINARY_HEADER_LEN &&
+        fast_memeq(map->data, GEOIP_BINARY_MAGIC, GEOIP_BINARY_MAGIC_LEN)) {
+      log_notice(LD_GENERAL, "Loading binary GEOIP file %s.", filename);
+      if (geoip_load_binary(map, filename) < 0) {
+        tor_munmap_file(map);
+        clear_geoip_db();
+        return -1;
+      }
+      refresh_all_country_info();
+      return 0;
+    }
+    tor_munmap_file(map);
+  }
+
   if (!(f = tor_fopen_cloexec(filename, "r"))) {
     log_fn(severity, LD_GENERAL, "Failed to open GEOIP file %s.  %s",
            filename, msg);
     return -1;
   }
-  if (!geoip_countries)
-    init_geoip_countries();
-  if (geoip_entries) {
-    SMARTLIST_FOREACH(geoip_entries, geoip_entry_t *, e, tor_free(e));
-    smartlist_free(geoip_entries);
-  }
   geoip_entries = smartlist_new();
   geoip_digest_env = crypto_digest_new();
   log_notice(LD_GENERAL, "Parsing GEOIP file %s.", filename);
@@ -231,7 +513,12 @@ geoip_load_file(const char *filename, const or_options_t *options)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  smartlist_sort(geoip_entries, _geoip_compare_entries);
+  /* We only need the compact table from here on. */
+  geoip_build_ipv4_ranges();
+  SMARTLIST_FOREACH(geoip_entries, geoip_entry_t *, e, tor_free(e));
+  smartlist_free(geoip_entries);
+  geoip_entries = NULL;
+  geoip_loaded = 1;
 
   /* Okay, now we need to maybe change our mind about what is in which
    * country. */
@@ -245,6 +532,62 @@ geoip_load_file(const char *filename, const or_options_t *options)
   return 0;
 }
 
+/** Encode <b>ranges</b>, with <b>addr_len</b>-byte addresses, into
+ * <b>out</b> in the binary GeoIP format, and return the number of bytes
+ * written. */
+static size_t
+geoip_ranges_encode(uint8_t *out, const geoip_ranges_t *ranges,
+                    size_t addr_len)
+{
+  unsigned i;
+  if (!ranges->n)
+    return 0;
+  memcpy(out, ranges->starts, addr_len*ranges->n);
+  out += addr_len*ranges->n;
+  /* Store indices into geoip_countries, which is the country table we
+   * write. */
+  for (i = 0; i < ranges->n; ++i)
+    set_uint16(out + 2*i,
+               htons((uint16_t)geoip_ranges_get_country(ranges, i)));
+  return (addr_len + 2) * ranges->n;
+}
+
+/** Write the loaded GeoIP database to <b>filename</b> in the binary format
+ * described at GEOIP_BINARY_MAGIC.  Return 0 on success, -1 on failure. */
+int
+geoip_write_binary_file(const char *filename)
+{
+  uint8_t *body, *cp;
+  size_t body_len;
+  int r, n_countries;
+
+  if (!geoip_is_loaded())
+    return -1;
+  if (geoip_entries_dirty)
+    geoip_build_ipv4_ranges();
+
+  n_countries = smartlist_len(geoip_countries);
+  body_len = GEOIP_BINARY_HEADER_LEN + 2*n_countries +
+    6*geoip_ipv4_ranges.n + 18*geoip_ipv6_ranges.n;
+  cp = body = tor_malloc(body_len);
+
+  memcpy(cp, GEOIP_BINARY_MAGIC, GEOIP_BINARY_MAGIC_LEN);
+  set_uint32(cp + GEOIP_BINARY_MAGIC_LEN, htonl(n_countries));
+  set_uint32(cp + GEOIP_BINARY_MAGIC_LEN + 4, htonl(geoip_ipv4_ranges.n));
+  set_uint32(cp + GEOIP_BINARY_MAGIC_LEN + 8, htonl(geoip_ipv6_ranges.n));
+  cp += GEOIP_BINARY_HEADER_LEN;
+  SMARTLIST_FOREACH(geoip_countries, const geoip_country_t *, c,
+                    memcpy(cp + 2*c_sl_idx, c->countrycode, 2));
+  cp += 2*n_countries;
+  cp += geoip_ranges_encode(cp, &geoip_ipv4_ranges, 4);
+  cp += geoip_ranges_encode(cp, &geoip_ipv6_ranges, 16);
+  tor_assert(cp == body + body_len);
+
+  r = write_bytes_to_file(filename, (const char *)body, body_len, 1);
+  tor_free(body);
+  return r;
+}
+
 /** Given an IP address in host order, return a number representing the
  * country to which that address belongs, -1 for "No geoip information
  * available", or 0 for the 'unknown country'.  The return value will always
@@ -254,11 +597,11 @@ geoip_load_file(const char *filename, const or_options_t *options)
 int
 geoip_get_country_by_ip(uint32_t ipaddr)
 {
-  geoip_entry_t *ent;
-  if (!geoip_entries)
+  if (!geoip_loaded)
     return -1;
-  ent = smartlist_bsearch(geoip_entries, &ipaddr, _geoip_compare_key_to_entry);
-  return ent ? (int)ent->country : 0;
+  if (PREDICT_UNLIKELY(geoip_entries_dirty))
+    geoip_build_ipv4_ranges();
+  return geoip_ranges_lookup_ipv4(&geoip_ipv4_ranges, ipaddr);
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -269,10 +612,15 @@ geoip_get_country_by_ip(uint32_t ipaddr)
 int
 geoip_get_country_by_addr(const tor_addr_t *addr)
 {
-  if (tor_addr_family(addr) != AF_INET) {
-    /*XXXX IP6 support ipv6 geoip.*/
-    return -1;
+  if (tor_addr_family(addr) == AF_INET6) {
+    /* Only binary GeoIP files carry IPv6 ranges so far. */
+    if (!geoip_ipv6_ranges.n)
+      return -1;
+    return geoip_ranges_lookup_ipv6(&geoip_ipv6_ranges,
+                                    tor_addr_to_in6_addr8(addr));
   }
+  if (tor_addr_family(addr) != AF_INET)
+    return -1;
   return geoip_get_country_by_ip(tor_addr_to_ipv4h(addr));
 }
 
@@ -301,7 +649,7 @@ geoip_get_country_name(country_t num)
 int
 geoip_is_loaded(void)
 {
-  return geoip_countries != NULL && geoip_entries != NULL;
+  return geoip_countries != NULL && geoip_loaded;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -325,6 +673,10 @@ typedef struct clientmap_entry_t {
    * 4000 CE, please remember to add more bits to last_seen_in_minutes.) */
   unsigned int last_seen_in_minutes:30;
   unsigned int action:2;
+  /** The country of addr, as of GeoIP database generation
+   * country_generation; see clientmap_entry_get_country(). */
+  country_t country;
+  unsigned country_generation;
 } clientmap_entry_t;
 
 /** Largest allowable value for last_seen_in_minutes.  (It's a 30-bit field,
@@ -355,11 +707,177 @@ HT_PROTOTYPE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
 HT_GENERATE(clientmap, clientmap_entry_t, node, clientmap_entry_hash,
             clientmap_entries_eq, 0.6, malloc, realloc, free);
 
+/** Return the country of <b>ent</b>'s address, as from
+ * geoip_get_country_by_addr().  We remember the answer until the GeoIP
+ * database changes, since the stats code asks about the same clients over
+ * and over. */
+static int
+clientmap_entry_get_country(clientmap_entry_t *ent)
+{
+  unsigned generation = geoip_db_generation();
+  if (ent->country_generation != generation) {
+    ent->country = geoip_get_country_by_addr(&ent->addr);
+    /* The lookup may have rebuilt the database. */
+    ent->country_generation = geoip_db_generation();
+  }
+  return ent->country;
+}
+
+/** How many seconds of client connections each approx_client_bucket_t
+ * covers.  When we forget old clients, we keep any bucket that isn't
+ * entirely older than the cutoff, so approximate counts can include
+ * clients seen up to this long before it. */
+#define APPROX_CLIENT_BUCKET_LEN 3600
+
+/** An hour or so of connecting clients, for the ApproximateClientCounts
+ * option: a sketch of the distinct client addresses from each country. */
+typedef struct approx_client_bucket_t {
+  /** When this bucket starts. */
+  time_t start;
+  /** Sketches, indexed by country; NULL for countries we haven't seen. */
+  hll_t **sketches;
+  /** Length of <b>sketches</b>. */
+  int n_sketches;
+} approx_client_bucket_t;
+
+/** List of approx_client_bucket_t, oldest first. */
+static smartlist_t *approx_client_buckets = NULL;
+/** Secret keys for approx_client_hash(), so that nobody can choose
+ * addresses that collide in our sketches. */
+static uint64_t approx_client_hash_key[2];
+
+/** Helper: mix the bits of <b>h</b> thoroughly, so that each output bit
+ * depends on every input bit.  (This is the finalizer from MurmurHash3.) */
+static INLINE uint64_t
+approx_client_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= U64_LITERAL(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= U64_LITERAL(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+
+/** Return a keyed 64-bit hash of <b>addr</b>, for adding to a hll_t. */
+static uint64_t
+approx_client_hash(const tor_addr_t *addr)
+{
+  uint64_t hi, lo;
+  if (tor_addr_family(addr) == AF_INET6) {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    memcpy(&hi, a, 8);
+    memcpy(&lo, a+8, 8);
+  } else {
+    hi = 0;
+    lo = tor_addr_to_ipv4h(addr);
+  }
+  return approx_client_mix(approx_client_mix(approx_client_hash_key[0] ^ hi)
+                           ^ lo ^ approx_client_hash_key[1]);
+}
+
+/** Free <b>bucket</b> and all its sketches. */
+static void
+approx_client_bucket_free(approx_client_bucket_t *bucket)
+{
+  int i;
+  for (i = 0; i < bucket->n_sketches; ++i)
+    hll_free(bucket->sketches[i]);
+  tor_free(bucket->sketches);
+  tor_free(bucket);
+}
+
+/** Note that a client connected from <b>addr</b> at <b>now</b>, for the
+ * ApproximateClientCounts option. */
+static void
+approx_client_note_seen(const tor_addr_t *addr, time_t now)
+{
+  approx_client_bucket_t *bucket = NULL;
+  int country = geoip_get_country_by_addr(addr);
+  if (country < 0)
+    country = 0; /* unresolved clients are counted at index 0. */
+
+  if (!approx_client_buckets) {
+    approx_client_buckets = smartlist_new();
+    crypto_rand((char*)approx_client_hash_key,
+                sizeof(approx_client_hash_key));
+  }
+  if (smartlist_len(approx_client_buckets))
+    bucket = smartlist_get(approx_client_buckets,
+                           smartlist_len(approx_client_buckets)-1);
+  if (!bucket || now >= bucket->start + APPROX_CLIENT_BUCKET_LEN) {
+    bucket = tor_malloc_zero(sizeof(approx_client_bucket_t));
+    bucket->start = now - (now % APPROX_CLIENT_BUCKET_LEN);
+    smartlist_add(approx_client_buckets, bucket);
+  }
+  if (country >= bucket->n_sketches) {
+    int n = geoip_get_n_countries();
+    if (n <= country)
+      n = country + 1;
+    bucket->sketches = tor_realloc(bucket->sketches, n * sizeof(hll_t *));
+    memset(bucket->sketches + bucket->n_sketches, 0,
+           (n - bucket->n_sketches) * sizeof(hll_t *));
+    bucket->n_sketches = n;
+  }
+  if (!bucket->sketches[country])
+    bucket->sketches[country] = hll_new();
+  hll_add(bucket->sketches[country], approx_client_hash(addr));
+}
+
+/** Set <b>counts</b>[i], for each of the <b>n_countries</b> countries, to
+ * our estimate of how many distinct clients we have seen from country i
+ * in all of approx_client_buckets.  Return the sum of the counts. */
+static unsigned
+approx_client_get_counts(unsigned *counts, int n_countries)
+{
+  hll_t merged;
+  unsigned total = 0;
+  int i;
+  if (!approx_client_buckets)
+    return 0;
+  for (i = 0; i < n_countries; ++i) {
+    int any = 0;
+    memset(&merged, 0, sizeof(merged));
+    SMARTLIST_FOREACH(approx_client_buckets, approx_client_bucket_t *, b, {
+      if (i < b->n_sketches && b->sketches[i]) {
+        hll_merge(&merged, b->sketches[i]);
+        any = 1;
+      }
+    });
+    if (any) {
+      counts[i] = (unsigned) (hll_estimate(&merged) + 0.5);
+      total += counts[i];
+    }
+  }
+  return total;
+}
+
+/** Forget every bucket that ended at or before <b>cutoff</b>.  If
+ * <b>cutoff</b> is 0, forget them all, and free the list. */
+static void
+approx_client_remove_old(time_t cutoff)
+{
+  if (!approx_client_buckets)
+    return;
+  while (smartlist_len(approx_client_buckets)) {
+    approx_client_bucket_t *b = smartlist_get(approx_client_buckets, 0);
+    if (cutoff && b->start + APPROX_CLIENT_BUCKET_LEN > cutoff)
+      break;
+    approx_client_bucket_free(b);
+    smartlist_del_keeporder(approx_client_buckets, 0);
+  }
+  if (!cutoff) {
+    smartlist_free(approx_client_buckets);
+    approx_client_buckets = NULL;
+  }
+}
+
 /** Clear history of connecting clients used by entry and bridge stats. */
 static void
 client_history_clear(void)
 {
   clientmap_entry_t **ent, **next, *this;
+  approx_client_remove_old(0);
   for (ent = HT_START(clientmap, &client_history); ent != NULL;
        ent = next) {
     if ((*ent)->action == GEOIP_CLIENT_CONNECT) {
@@ -453,6 +971,11 @@ geoip_note_client_seen(geoip_client_action_t action,
       return;
   }
 
+  if (action == GEOIP_CLIENT_CONNECT && options->ApproximateClientCounts) {
+    approx_client_note_seen(addr, now);
+    return;
+  }
+
   tor_addr_copy(&lookup.addr, addr);
   lookup.action = (int)action;
   ent = HT_FIND(clientmap, &client_history, &lookup);
@@ -469,7 +992,7 @@ geoip_note_client_seen(geoip_client_action_t action,
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS ||
       action == GEOIP_CLIENT_NETWORKSTATUS_V2) {
-    int country_idx = geoip_get_country_by_addr(addr);
+    int country_idx = clientmap_entry_get_country(ent);
     if (country_idx < 0)
       country_idx = 0; /** unresolved requests are stored at index 0. */
     if (country_idx >= 0 && country_idx < smartlist_len(geoip_countries)) {
@@ -507,6 +1030,7 @@ geoip_remove_old_clients(time_t cutoff)
   clientmap_HT_FOREACH_FN(&client_history,
                           _remove_old_client_helper,
                           &cutoff);
+  approx_client_remove_old(cutoff);
 }
 
 /** How many responses are we giving to clients requesting v2 network
@@ -836,16 +1360,21 @@ geoip_get_client_history(geoip_client_action_t action)
     return NULL;
 
   counts = tor_malloc_zero(sizeof(unsigned)*n_countries);
-  HT_FOREACH(ent, clientmap, &client_history) {
-    int country;
-    if ((*ent)->action != (int)action)
-      continue;
-    country = geoip_get_country_by_addr(&(*ent)->addr);
-    if (country < 0)
-      country = 0; /** unresolved requests are stored at index 0. */
-    tor_assert(0 <= country && country < n_countries);
-    ++counts[country];
-    ++total;
+  if (action == GEOIP_CLIENT_CONNECT &&
+      get_options()->ApproximateClientCounts) {
+    total = approx_client_get_counts(counts, n_countries);
+  } else {
+    HT_FOREACH(ent, clientmap, &client_history) {
+      int country;
+      if ((*ent)->action != (int)action)
+        continue;
+      country = clientmap_entry_get_country(*ent);
+      if (country < 0)
+        country = 0; /** unresolved requests are stored at index 0. */
+      tor_assert(0 <= country && country < n_countries);
+      ++counts[country];
+      ++total;
+    }
   }
   /* Don't record anything if we haven't seen enough IPs. */
   if (total < MIN_IPS_TO_NOTE_ANYTHING)
@@ -1124,7 +1653,7 @@ geoip_dirreq_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "dirreq-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_behind(filename, str, 0, NULL) < 0)
     log_warn(LD_HIST, "Unable to write dirreq statistics to disk!");
 
   /* Reset measurement interval start. */
@@ -1288,7 +1817,7 @@ geoip_bridge_stats_write(time_t now)
     goto done;
   filename = get_datadir_fname2("stats", "bridge-stats");
 
-  write_str_to_file(filename, bridge_stats_extrainfo, 0);
+  write_str_to_file_behind(filename, bridge_stats_extrainfo, 0, NULL);
 
   /* Tell the controller, "hey, there are clients!" */
   {
@@ -1417,7 +1946,7 @@ geoip_entry_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "entry-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_behind(filename, str, 0, NULL) < 0)
     log_warn(LD_HIST, "Unable to write entry statistics to disk!");
 
   /* Reset measurement interval start. */
@@ -1469,9 +1998,21 @@ clear_geoip_db(void)
     SMARTLIST_FOREACH(geoip_entries, geoip_entry_t *, ent, tor_free(ent));
     smartlist_free(geoip_entries);
   }
+  if (geoip_mmap) {
+    tor_munmap_file(geoip_mmap);
+    geoip_mmap = NULL;
+  }
+  tor_free(geoip_ranges_mem);
+  tor_free(geoip_mmap_country_map);
+  geoip_mmap_n_countries = 0;
+  memset(&geoip_ipv4_ranges, 0, sizeof(geoip_ipv4_ranges));
+  memset(&geoip_ipv6_ranges, 0, sizeof(geoip_ipv6_ranges));
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
   geoip_entries = NULL;
+  geoip_entries_dirty = 0;
+  geoip_loaded = 0;
+  geoip_note_changed();
 }
 
 /** Release all storage held in this file. */
@@ -1486,6 +2027,7 @@ geoip_free_all(void)
       tor_free(this);
     }
     HT_CLEAR(clientmap, &client_history);
+    approx_client_remove_old(0);
   }
   {
     dirreq_map_entry_t **ent, **next, *this;
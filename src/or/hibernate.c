@@ -23,12 +23,19 @@ hibernating, phase 2:
 
 #define HIBERNATE_PRIVATE
 #include "or.h"
+#include "circuitbuild.h"
 #include "config.h"
 #include "connection.h"
 #include "connection_edge.h"
+#include "connection_or.h"
 #include "hibernate.h"
 #include "main.h"
+#include "microdesc.h"
+#include "networkstatus.h"
+#include "nodelist.h"
+#include "rephist.h"
 #include "router.h"
+#include "routerlist.h"
 
 extern long stats_n_seconds_working; /* published uptime */
 
@@ -42,6 +49,20 @@ static time_t hibernate_end_time = 0;
  * we aren't shutting down. */
 static time_t shutdown_time = 0;
 
+/** When we stop using the network, the identity digests of the entry guards
+ * we had open connections to, so that we can reconnect to them all at once
+ * when we come back; or NULL if we haven't saved any resume state. */
+static smartlist_t *resume_guard_ids = NULL;
+/** When we stop using the network, the ports we were predicting we'd
+ * need, as uint16_t *, so that we can build circuits for them straight
+ * away when we come back even if we've been gone for longer than
+ * predictions last. */
+static smartlist_t *resume_ports = NULL;
+/** When we stopped using the network, were we predicting that we'd need
+ * internal circuits, and did they need uptime? */
+static int resume_want_internal = 0;
+static int resume_internal_uptime = 0;
+
 /** Possible accounting periods. */
 typedef enum {
   UNIT_MONTH=1, UNIT_WEEK=2, UNIT_DAY=3,
@@ -100,6 +121,18 @@ static uint64_t expected_bandwidth_usage = 0;
 /** What unit are we using for our accounting? */
 static time_unit_t cfg_unit = UNIT_MONTH;
 
+/** If AccountingShaping is set: how many bytes per second have we recently
+ * been using in our busier direction, as a moving average? */
+static double recent_bandwidth_usage = 0.0;
+/** How many bytes had we used in our busier direction when we last updated
+ * recent_bandwidth_usage, and when was that? */
+static uint64_t n_bytes_at_last_usage_update = 0;
+static time_t last_usage_update = 0;
+/** If nonzero, we are limiting our global token buckets to this many bytes
+ * per second, so that what's left of AccountingMax lasts until the end of
+ * the interval. */
+static int shaped_bandwidth_rate = 0;
+
 /** How many days,hours,minutes into each unit does our accounting interval
  * start? */
 /** @{ */
@@ -108,7 +141,6 @@ static int cfg_start_day = 0,
            cfg_start_min = 0;
 /** @} */
 
-static void reset_accounting(time_t now);
 static int read_bandwidth_usage(void);
 static time_t start_of_accounting_period_after(time_t now);
 static time_t start_of_accounting_period_containing(time_t now);
@@ -449,7 +481,7 @@ update_expected_bandwidth(void)
  * expected bandwidth usage based on what happened last time, set up
  * the start and end of the interval, and clear byte/time totals.
  */
-static void
+void
 reset_accounting(time_t now)
 {
   log_info(LD_ACCT, "Starting new accounting interval.");
@@ -462,6 +494,8 @@ reset_accounting(time_t now)
   n_bytes_at_soft_limit = 0;
   soft_limit_hit_at = 0;
   n_seconds_to_hit_soft_limit = 0;
+  n_bytes_at_last_usage_update = 0;
+  shaped_bandwidth_rate = 0;
 }
 
 /** Return true iff we should save our bandwidth usage to disk. */
@@ -488,6 +522,106 @@ time_to_record_bandwidth_usage(time_t now)
   return 0;
 }
 
+/** How much weight does each second's bandwidth use get in
+ * recent_bandwidth_usage? */
+#define USAGE_EWMA_WEIGHT (1.0/60)
+/** Start shaping once we expect to hit AccountingMax within this many
+ * seconds at our recent rate, and before the interval ends. */
+#define SHAPING_HORIZON (60*60)
+/** Never shape our bandwidth to fewer than this many bytes per second. */
+#define MIN_SHAPED_BANDWIDTH_RATE 1024
+
+/** If AccountingShaping is set, update our estimate of how fast we are
+ * using up AccountingMax, and decide whether, and how much, to slow down
+ * so that we don't run out before the end of the interval. */
+void
+accounting_update_shaping(time_t now)
+{
+  const uint64_t acct_max = get_options()->AccountingMax;
+  uint64_t used = MAX(n_bytes_read_in_interval, n_bytes_written_in_interval);
+  uint64_t left = used < acct_max ? acct_max - used : 0;
+  time_t time_left = interval_end_time - now;
+  uint64_t rate;
+
+  if (!get_options()->AccountingShaping || time_left <= 0 ||
+      (hibernate_state != HIBERNATE_STATE_LIVE &&
+       hibernate_state != HIBERNATE_STATE_LOWBANDWIDTH)) {
+    shaped_bandwidth_rate = 0;
+    last_usage_update = 0;
+    return;
+  }
+
+  if (last_usage_update && now > last_usage_update &&
+      used >= n_bytes_at_last_usage_update) {
+    double usage = U64_TO_DBL(used - n_bytes_at_last_usage_update) /
+      (double)(now - last_usage_update);
+    recent_bandwidth_usage +=
+      (usage - recent_bandwidth_usage) * USAGE_EWMA_WEIGHT;
+  }
+  n_bytes_at_last_usage_update = used;
+  last_usage_update = now;
+
+  if (!shaped_bandwidth_rate) {
+    /* Forecast when we'll hit the limit; if it's soon, and before the
+     * interval ends, start shaping.  Once we start, we keep on shaping
+     * until the interval is over: our usage will have dropped because we
+     * are shaping, not because the demand went away. */
+    double time_to_limit;
+    if (recent_bandwidth_usage < 1.0)
+      return;
+    time_to_limit = U64_TO_DBL(left) / recent_bandwidth_usage;
+    if (time_to_limit >= (double)time_left ||
+        time_to_limit >= SHAPING_HORIZON)
+      return;
+    log_notice(LD_ACCT, "At our recent rate of %d bytes per second, we "
+               "would use up the rest of AccountingMax in %d seconds. "
+               "Slowing down so that it lasts until the end of the "
+               "accounting period.",
+               (int)recent_bandwidth_usage, (int)time_to_limit);
+  }
+
+  rate = left / time_left;
+  if (rate < MIN_SHAPED_BANDWIDTH_RATE)
+    rate = MIN_SHAPED_BANDWIDTH_RATE;
+  if (rate > INT_MAX)
+    rate = INT_MAX;
+  shaped_bandwidth_rate = (int)rate;
+}
+
+/** Return the rate, in bytes per second, at which the global token buckets
+ * should refill, given that we'd otherwise refill them at <b>rate</b>. */
+int
+accounting_shape_bandwidth_rate(int rate)
+{
+  if (shaped_bandwidth_rate && shaped_bandwidth_rate < rate)
+    return shaped_bandwidth_rate;
+  return rate;
+}
+
+/** Return the most bytes we can still read (if <b>is_write</b> is false) or
+ * write (if it's true) this interval without going over AccountingMax, or
+ * INT_MAX if that's more than INT_MAX or we needn't care.  The token buckets
+ * use this to keep us from overshooting the limit before the next time
+ * consider_hibernation() checks it. */
+int
+accounting_get_bytes_left(int is_write)
+{
+  const uint64_t acct_max = get_options()->AccountingMax;
+  uint64_t used = is_write ? n_bytes_written_in_interval :
+    n_bytes_read_in_interval;
+  /* While dormant, we keep our directory connections, and don't count
+   * what they use against the limit. */
+  if (!acct_max ||
+      (hibernate_state != HIBERNATE_STATE_LIVE &&
+       hibernate_state != HIBERNATE_STATE_LOWBANDWIDTH))
+    return INT_MAX;
+  if (used >= acct_max)
+    return 0;
+  if (acct_max - used > INT_MAX)
+    return INT_MAX;
+  return (int)(acct_max - used);
+}
+
 /** Invoked once per second.  Checks whether it is time to hibernate,
  * record bandwidth used, etc.  */
 void
@@ -496,6 +630,7 @@ accounting_run_housekeeping(time_t now)
   if (now >= interval_end_time) {
     configure_accounting(now);
   }
+  accounting_update_shaping(now);
   if (time_to_record_bandwidth_usage(now)) {
     if (accounting_record_bandwidth_usage(now, get_or_state())) {
       log_warn(LD_FS, "Couldn't record bandwidth usage to disk.");
@@ -784,21 +919,136 @@ hibernate_begin(hibernate_state_t new_state, time_t now)
                       get_options()->AvoidDiskWrites ? now+600 : 0);
 }
 
+/** Forget whatever hibernate_save_resume_state() saved. */
+static void
+hibernate_clear_resume_state(void)
+{
+  if (resume_guard_ids) {
+    SMARTLIST_FOREACH(resume_guard_ids, char *, cp, tor_free(cp));
+    smartlist_free(resume_guard_ids);
+    resume_guard_ids = NULL;
+  }
+  if (resume_ports) {
+    SMARTLIST_FOREACH(resume_ports, uint16_t *, p, tor_free(p));
+    smartlist_free(resume_ports);
+    resume_ports = NULL;
+  }
+  resume_want_internal = resume_internal_uptime = 0;
+}
+
+/** We're about to stop using the network, because we're going dormant or
+ * because DisableNetwork got set: remember which entry guards we're
+ * connected to and what circuits we expect to need, so that
+ * hibernate_warm_resume() can get us going again quickly. */
+void
+hibernate_save_resume_state(time_t now)
+{
+  int need_capacity = 1;
+  hibernate_clear_resume_state();
+
+  resume_guard_ids = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    or_connection_t *or_conn;
+    if (conn->type != CONN_TYPE_OR || conn->marked_for_close ||
+        conn->state != OR_CONN_STATE_OPEN)
+      continue;
+    or_conn = TO_OR_CONN(conn);
+    if (!or_conn->is_outgoing || !is_an_entry_guard(or_conn->identity_digest))
+      continue;
+    if (smartlist_digest_isin(resume_guard_ids, or_conn->identity_digest))
+      continue;
+    smartlist_add(resume_guard_ids,
+                  tor_memdup(or_conn->identity_digest, DIGEST_LEN));
+  } SMARTLIST_FOREACH_END(conn);
+
+  resume_ports = rep_hist_get_predicted_ports(now);
+  resume_want_internal =
+    rep_hist_get_predicted_internal(now, &resume_internal_uptime,
+                                    &need_capacity);
+}
+
+/** We've started using the network again after hibernating or having
+ * DisableNetwork set.  Rather than waiting for our scheduled events to
+ * notice, reopen our listeners, reconnect to every entry guard we were
+ * connected to, bring back the predictions that we'll build preemptive
+ * circuits from, and fetch a new consensus if ours has gone stale. */
+void
+hibernate_warm_resume(time_t now)
+{
+  int n_guards = 0;
+
+  if (!net_is_disabled())
+    retry_all_listeners(NULL, NULL, 0);
+
+  if (!router_have_minimum_dir_info() ||
+      !networkstatus_get_reasonably_live_consensus(now,
+                                                  usable_consensus_flavor()))
+    routerlist_retry_directory_downloads(now);
+
+  if (resume_ports) {
+    SMARTLIST_FOREACH(resume_ports, uint16_t *, p,
+                      rep_hist_note_used_port(now, *p));
+  }
+  if (resume_want_internal)
+    rep_hist_note_used_internal(now, resume_internal_uptime, 1);
+
+  if (resume_guard_ids) {
+    SMARTLIST_FOREACH_BEGIN(resume_guard_ids, const char *, id) {
+      const node_t *node;
+      extend_info_t *ei;
+      const char *msg = NULL;
+      int should_launch = 0;
+      if (!is_an_entry_guard(id) || !(node = node_get_by_id(id)))
+        continue;
+      if (!(ei = extend_info_from_node(node, 1)))
+        continue;
+      if (!connection_or_get_for_extend(id, &ei->addr, &msg,
+                                        &should_launch) &&
+          should_launch &&
+          connection_or_connect(&ei->addr, ei->port, id))
+        ++n_guards;
+      extend_info_free(ei);
+    } SMARTLIST_FOREACH_END(id);
+  }
+
+  log_info(LD_GENERAL, "Resuming: reconnecting to %d entry guard%s, and "
+           "building circuits for %d predicted port%s.", n_guards,
+           n_guards == 1 ? "" : "s",
+           resume_ports ? smartlist_len(resume_ports) : 0,
+           resume_ports && smartlist_len(resume_ports) == 1 ? "" : "s");
+  hibernate_clear_resume_state();
+
+  /* Clean circuits for the predictions get launched by
+   * circuit_build_needed_circs() later in this same pass through
+   * run_scheduled_events(); their first hops will find the guard
+   * connections we've just launched. */
+}
+
 /** Called when we've been hibernating and our timeout is reached. */
 static void
 hibernate_end(hibernate_state_t new_state)
 {
+  hibernate_state_t old_state = hibernate_state;
   tor_assert(hibernate_state == HIBERNATE_STATE_LOWBANDWIDTH ||
              hibernate_state == HIBERNATE_STATE_DORMANT ||
              hibernate_state == HIBERNATE_STATE_INITIAL);
 
-  /* listeners will be relaunched in run_scheduled_events() in main.c */
   if (hibernate_state != HIBERNATE_STATE_INITIAL)
     log_notice(LD_ACCT,"Hibernation period ended. Resuming normal activity.");
 
   hibernate_state = new_state;
   hibernate_end_time = 0; /* no longer hibernating */
   stats_n_seconds_working = 0; /* reset published uptime */
+
+  if (old_state != HIBERNATE_STATE_INITIAL)
+    hibernate_warm_resume(time(NULL));
+}
+
+/** Release all storage held by the hibernation module. */
+void
+hibernate_free_all(void)
+{
+  hibernate_clear_resume_state();
 }
 
 /** A wrapper around hibernate_begin, for when we get SIGINT. */
@@ -830,6 +1080,7 @@ hibernate_go_dormant(time_t now)
     hibernate_begin(HIBERNATE_STATE_DORMANT, now);
 
   log_notice(LD_ACCT,"Going dormant. Blowing away remaining connections.");
+  hibernate_save_resume_state(now);
 
   /* Close all OR/AP/exit conns. Leave dir conns because we still want
    * to be able to upload server descriptors so people know we're still
@@ -996,6 +1247,8 @@ getinfo_helper_accounting(control_connection_t *conn,
   } else if (!strcmp(question, "accounting/interval-wake")) {
     *answer = tor_malloc(ISO_TIME_LEN+1);
     format_iso_time(*answer, interval_wakeup_time);
+  } else if (!strcmp(question, "accounting/shaped-rate")) {
+    tor_asprintf(answer, "%d", shaped_bandwidth_rate);
   } else if (!strcmp(question, "accounting/interval-end")) {
     *answer = tor_malloc(ISO_TIME_LEN+1);
     format_iso_time(*answer, interval_end_time);
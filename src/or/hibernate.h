@@ -18,8 +18,13 @@ int accounting_get_interval_length(void);
 void configure_accounting(time_t now);
 void accounting_run_housekeeping(time_t now);
 void accounting_add_bytes(size_t n_read, size_t n_written, int seconds);
+int accounting_shape_bandwidth_rate(int rate);
+int accounting_get_bytes_left(int is_write);
 int accounting_record_bandwidth_usage(time_t now, or_state_t *state);
 void hibernate_begin_shutdown(void);
+void hibernate_save_resume_state(time_t now);
+void hibernate_warm_resume(time_t now);
+void hibernate_free_all(void);
 int we_are_hibernating(void);
 void consider_hibernation(time_t now);
 int getinfo_helper_accounting(control_connection_t *conn,
@@ -46,6 +51,8 @@ typedef enum {
 } hibernate_state_t;
 
 void hibernate_set_state_for_testing_(hibernate_state_t newstate);
+void reset_accounting(time_t now);
+void accounting_update_shaping(time_t now);
 #endif
 
 #endif
@@ -31,6 +31,7 @@
 #include "geoip.h"
 #include "hibernate.h"
 #include "main.h"
+#include "mempool.h"
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -46,6 +47,7 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "scheduler.h"
 #include "status.h"
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
@@ -75,6 +77,16 @@ static void second_elapsed_callback(periodic_timer_t *timer, void *args);
 static int conn_close_if_marked(int i);
 static void connection_start_reading_from_linked_conn(connection_t *conn);
 static int connection_should_read_from_linked_conn(connection_t *conn);
+static void main_loop_update_dormancy(time_t now);
+static void main_loop_note_activity(void);
+static void startup_timeline_free_all(void);
+#ifdef USE_PTHREADS
+static void startup_prefetch_caches(void);
+static void startup_prefetch_join(void);
+#else
+#define startup_prefetch_caches() STMT_NIL
+#define startup_prefetch_join() STMT_NIL
+#endif
 
 /********* START VARIABLES **********/
 
@@ -122,6 +134,17 @@ static unsigned newnym_epoch = 0;
 
 /** Smartlist of all open connections. */
 static smartlist_t *connection_array = NULL;
+/** For each connection type, a smartlist of the connections in
+ * connection_array that have that type, in no particular order.  Each
+ * connection's conn_type_index is its index in its list.  (A connection's
+ * type never changes once we've added it.) */
+static smartlist_t *connections_by_type[_CONN_TYPE_MAX+1];
+/** Priority queue of the connections in connection_array that
+ * run_connection_housekeeping() will need to look at, ordered by
+ * housekeeping_due.  Each connection's housekeeping_idx is its index here.
+ * Connections that are nowhere near a keepalive or an expiry time stay in
+ * the queue untouched, so each second we only visit the ones that are. */
+static smartlist_t *housekeeping_queue = NULL;
 /** List of connections that have been marked for close and need to be freed
  * and removed from connection_array. */
 static smartlist_t *closeable_connection_lst = NULL;
@@ -218,6 +241,64 @@ set_buffer_lengths_to_zero(tor_socket_t s)
 }
 #endif
 
+/** Add <b>conn</b> to the list of connections of its type. */
+static void
+connection_add_to_type_list(connection_t *conn)
+{
+  smartlist_t *lst = get_connection_array_by_type(conn->type);
+  conn->conn_type_index = smartlist_len(lst);
+  smartlist_add(lst, conn);
+}
+
+/** Remove <b>conn</b> from the list of connections of its type, replacing
+ * it with the last connection on that list. */
+static void
+connection_remove_from_type_list(connection_t *conn)
+{
+  smartlist_t *lst = get_connection_array_by_type(conn->type);
+  int idx = conn->conn_type_index;
+  tor_assert(idx >= 0 && smartlist_get(lst, idx) == conn);
+  smartlist_del(lst, idx);
+  if (idx < smartlist_len(lst))
+    ((connection_t*)smartlist_get(lst, idx))->conn_type_index = idx;
+  conn->conn_type_index = -1;
+}
+
+/** Helper for the housekeeping queue: order connections by when they next
+ * need to be looked at. */
+static int
+compare_housekeeping_due_(const void *a, const void *b)
+{
+  const connection_t *conn_a = a, *conn_b = b;
+  if (conn_a->housekeeping_due < conn_b->housekeeping_due)
+    return -1;
+  else if (conn_a->housekeeping_due > conn_b->housekeeping_due)
+    return 1;
+  else
+    return 0;
+}
+
+/** Arrange for run_connection_housekeeping() to look at <b>conn</b> once
+ * <b>due</b> has arrived, replacing any earlier schedule; if <b>due</b> is 0,
+ * don't look at it at all.  Anything that can make a connection expire
+ * sooner than the passage of time alone would should call this with the
+ * current time. */
+void
+connection_schedule_housekeeping(connection_t *conn, time_t due)
+{
+  const int idx_offset = STRUCT_OFFSET(connection_t, housekeeping_idx);
+  if (!housekeeping_queue)
+    housekeeping_queue = smartlist_new();
+  if (conn->housekeeping_idx >= 0)
+    smartlist_pqueue_remove(housekeeping_queue, compare_housekeeping_due_,
+                            idx_offset, conn);
+  if (!due || conn->conn_array_index < 0 || conn->marked_for_close)
+    return;
+  conn->housekeeping_due = due;
+  smartlist_pqueue_add(housekeeping_queue, compare_housekeeping_due_,
+                       idx_offset, conn);
+}
+
 /** Add <b>conn</b> to the array of connections that we can poll on.  The
  * connection's socket must be set; the connection starts out
  * non-reading and non-writing.
@@ -232,8 +313,11 @@ connection_add_impl(connection_t *conn, int is_connecting)
               TO_EDGE_CONN(conn)->is_dns_request));
 
   tor_assert(conn->conn_array_index == -1); /* can only connection_add once */
+  main_loop_note_activity();
   conn->conn_array_index = smartlist_len(connection_array);
   smartlist_add(connection_array, conn);
+  connection_add_to_type_list(conn);
+  connection_schedule_housekeeping(conn, approx_time());
 
 #ifdef USE_BUFFEREVENTS
   if (connection_type_uses_bufferevent(conn)) {
@@ -252,6 +336,8 @@ connection_add_impl(connection_t *conn, int is_connecting)
                          BEV_OPT_DEFER_CALLBACKS);
       if (!conn->bufev) {
         log_warn(LD_BUG, "Unable to create socket bufferevent");
+        connection_remove_from_type_list(conn);
+        connection_schedule_housekeeping(conn, 0);
         smartlist_del(connection_array, conn->conn_array_index);
         conn->conn_array_index = -1;
         return -1;
@@ -353,6 +439,8 @@ connection_remove(connection_t *conn)
   tor_assert(conn->conn_array_index >= 0);
   current_index = conn->conn_array_index;
   connection_unregister_events(conn); /* This is redundant, but cheap. */
+  connection_remove_from_type_list(conn);
+  connection_schedule_housekeeping(conn, 0);
   if (current_index == smartlist_len(connection_array)-1) { /* at the end */
     smartlist_del(connection_array, current_index);
     return 0;
@@ -415,28 +503,45 @@ add_connection_to_closeable_list(connection_t *conn)
 int
 connection_is_on_closeable_list(connection_t *conn)
 {
-  return smartlist_isin(closeable_connection_lst, conn);
+  /* (The list doesn't exist before tor_init(), as in the benchmarks.) */
+  return closeable_connection_lst &&
+    smartlist_isin(closeable_connection_lst, conn);
 }
 
 /** Return true iff conn is in the current poll array. */
 int
 connection_in_array(connection_t *conn)
 {
-  return smartlist_isin(connection_array, conn);
+  return connection_array && smartlist_isin(connection_array, conn);
 }
 
 /** Set <b>*array</b> to an array of all connections, and <b>*n</b>
  * to the length of the array. <b>*array</b> and <b>*n</b> must not
- * be modified.
+ * be modified.  Creates the connection lists if tor_init() hasn't.
  */
 smartlist_t *
 get_connection_array(void)
 {
   if (!connection_array)
     connection_array = smartlist_new();
+  if (!closeable_connection_lst)
+    closeable_connection_lst = smartlist_new();
+  if (!active_linked_connection_lst)
+    active_linked_connection_lst = smartlist_new();
   return connection_array;
 }
 
+/** Return a list of all the connections in connection_array that have type
+ * <b>type</b>.  The list must not be modified. */
+smartlist_t *
+get_connection_array_by_type(int type)
+{
+  tor_assert(type >= _CONN_TYPE_MIN && type <= _CONN_TYPE_MAX);
+  if (!connections_by_type[type])
+    connections_by_type[type] = smartlist_new();
+  return connections_by_type[type];
+}
+
 /** Provides the traffic read and written over the life of the process. */
 
 uint64_t
@@ -673,6 +778,61 @@ connection_stop_reading_from_linked_conn(connection_t *conn)
   }
 }
 
+/** Most data we'll move straight into a linked connection's inbuf from
+ * deliver_linked_data_directly(); past this, we let the main loop pace it. */
+#define MAX_LINKED_DIRECT_INBUF (64*1024)
+/** Most passes deliver_linked_data_directly() will make over the active
+ * linked connections before leaving the rest to the main loop. */
+#define MAX_LINKED_DIRECT_ROUNDS 8
+
+/** Instead of waiting for the next time around the main loop, let every
+ * linked connection whose partner has data for it read that data now, as
+ * long as its inbuf has room.  Since reading can make more linked
+ * connections active (a directory request goes out over a BEGIN_DIR stream
+ * and its answer comes back), repeat a few times.  Called at the end of
+ * each read or write callback, when nothing further up the stack is in the
+ * middle of handling a connection. */
+void
+deliver_linked_data_directly(void)
+{
+  static int in_delivery = 0;
+  smartlist_t *active;
+  int round;
+
+  if (in_delivery || !smartlist_len(active_linked_connection_lst))
+    return;
+  in_delivery = 1;
+  active = smartlist_new();
+
+  for (round = 0; round < MAX_LINKED_DIRECT_ROUNDS &&
+         smartlist_len(active_linked_connection_lst); ++round) {
+    int n_read = 0;
+    smartlist_add_all(active, active_linked_connection_lst);
+    /* Nothing on this list gets freed until close_closeable_connections()
+     * runs, so we don't have to worry about conns going away under us. */
+    SMARTLIST_FOREACH_BEGIN(active, connection_t *, conn) {
+      if (!conn->active_on_link || conn->marked_for_close ||
+          buf_datalen(conn->inbuf) >= MAX_LINKED_DIRECT_INBUF)
+        continue;
+      ++n_read;
+      if (connection_handle_read(conn) < 0 && !conn->marked_for_close) {
+        log_warn(LD_BUG, "Unhandled error on read for linked %s connection; "
+                 "removing", conn_type_to_string(conn->type));
+        tor_fragile_assert();
+        if (CONN_IS_EDGE(conn))
+          connection_edge_end_errno(TO_EDGE_CONN(conn));
+        connection_mark_for_close(conn);
+      }
+    } SMARTLIST_FOREACH_END(conn);
+    smartlist_clear(active);
+    if (!n_read)
+      break;
+  }
+
+  smartlist_free(active);
+  in_delivery = 0;
+}
+
 /** Close all connections that have been scheduled to get closed. */
 static void
 close_closeable_connections(void)
@@ -689,16 +849,151 @@ close_closeable_connections(void)
   }
 }
 
+/** When we're out of memory for buffers, shrink them to this fraction of
+ * MaxMemInBuffers. */
+#define FRACTION_OF_BUFFERS_TO_RETAIN_ON_OOM 0.90
+
+/** Return the time at which the oldest data on either of <b>conn</b>'s
+ * buffers was queued, or <b>now</b> if they're empty. */
+static time_t
+connection_oldest_queued_data_time(const connection_t *conn, time_t now)
+{
+  time_t t = now, t2;
+  if (conn->inbuf)
+    t = buf_get_oldest_chunk_timestamp(conn->inbuf, now);
+  if (conn->outbuf) {
+    t2 = buf_get_oldest_chunk_timestamp(conn->outbuf, now);
+    if (t2 < t)
+      t = t2;
+  }
+  return t;
+}
+
+/** Helper for sorting connections by the age of their oldest queued data,
+ * oldest first. */
+static int
+conns_compare_by_oldest_queued_data(const void **a_, const void **b_)
+{
+  time_t now = approx_time();
+  time_t a = connection_oldest_queued_data_time(*a_, now);
+  time_t b = connection_oldest_queued_data_time(*b_, now);
+  if (a < b)
+    return -1;
+  else if (a > b)
+    return 1;
+  else
+    return 0;
+}
+
+/** Close <b>conn</b> because we're out of memory for buffers, and throw
+ * away whatever it has queued rather than waiting to flush it. */
+static void
+connection_close_for_oom(connection_t *conn)
+{
+  if (!conn->marked_for_close) {
+    if (conn->type == CONN_TYPE_AP &&
+        !TO_ENTRY_CONN(conn)->socks_request->has_finished) {
+      connection_mark_unattached_ap(TO_ENTRY_CONN(conn),
+                                    END_STREAM_REASON_RESOURCELIMIT);
+    } else {
+      if (CONN_IS_EDGE(conn) && !TO_EDGE_CONN(conn)->edge_has_sent_end)
+        connection_edge_end(TO_EDGE_CONN(conn),
+                            END_STREAM_REASON_RESOURCELIMIT);
+      connection_mark_for_close(conn);
+    }
+  }
+  conn->hold_open_until_flushed = 0;
+  if (conn->inbuf)
+    buf_clear(conn->inbuf);
+  if (conn->outbuf)
+    buf_clear(conn->outbuf);
+  conn->outbuf_flushlen = 0;
+}
+
+/** We're out of memory for buffers, having allocated
+ * <b>current_allocation</b> bytes' worth of buffer chunks.  Compact every
+ * connection's buffers; if that isn't enough, close connections, starting
+ * with the ones whose oldest queued data has waited longest, until we're
+ * back under FRACTION_OF_BUFFERS_TO_RETAIN_ON_OOM of MaxMemInBuffers.
+ * Controller connections are never closed. */
+static void
+connections_handle_oom(size_t current_allocation)
+{
+  size_t target;
+  int n_conns_killed = 0;
+
+  log_notice(LD_GENERAL, "We're low on memory.  Compacting buffers and "
+             "closing connections with old queued data. (This behavior is "
+             "controlled by MaxMemInBuffers.)");
+
+  target = (size_t)(get_options()->MaxMemInBuffers *
+                    FRACTION_OF_BUFFERS_TO_RETAIN_ON_OOM);
+
+  SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
+      if (conn->outbuf)
+        buf_shrink(conn->outbuf);
+      if (conn->inbuf)
+        buf_shrink(conn->inbuf);
+    });
+
+  if (buf_get_total_allocation() > target) {
+    smartlist_t *conns = smartlist_new();
+    SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
+      if (conn->type == CONN_TYPE_CONTROL)
+        continue;
+      if ((conn->inbuf && buf_datalen(conn->inbuf)) ||
+          (conn->outbuf && buf_datalen(conn->outbuf)))
+        smartlist_add(conns, conn);
+    } SMARTLIST_FOREACH_END(conn);
+
+    smartlist_sort(conns, conns_compare_by_oldest_queued_data);
+
+    SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+      if (buf_get_total_allocation() <= target)
+        break;
+      connection_close_for_oom(conn);
+      ++n_conns_killed;
+    } SMARTLIST_FOREACH_END(conn);
+    smartlist_free(conns);
+  }
+
+  /* Give the emptied slabs back to the OS. */
+  buf_shrink_freelists(1);
+
+  log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by compacting buffers "
+             "and closing %d connections.",
+             U64_PRINTF_ARG((uint64_t)(current_allocation -
+                                       buf_get_total_allocation())),
+             n_conns_killed);
+}
+
+/** Check whether we've got too much memory used for buffers.  If so, call
+ * the OOM handler and return 1.  Otherwise, return 0. */
+int
+buffers_check_size(void)
+{
+  uint64_t limit = get_options()->MaxMemInBuffers;
+  size_t alloc = buf_get_total_allocation();
+  if (PREDICT_UNLIKELY(limit && alloc >= limit)) {
+    connections_handle_oom(alloc);
+    return 1;
+  }
+  return 0;
+}
+
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
  * some data to read. */
 static void
 conn_read_callback(evutil_socket_t fd, short event, void *_conn)
 {
   connection_t *conn = _conn;
+  const int conn_type = conn->type;
+  const uint64_t start_nsec = tor_monotime_nsec();
   (void)fd;
   (void)event;
 
   log_debug(LD_NET,"socket %d wants to read.",(int)conn->s);
+  main_loop_note_activity();
 
   /* assert_connection_ok(conn, time(NULL)); */
 
@@ -717,8 +1012,14 @@ conn_read_callback(evutil_socket_t fd, short event, void *_conn)
   }
   assert_connection_ok(conn, time(NULL));
 
+  buffers_check_size();
+
+  deliver_linked_data_directly();
+
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+
+  main_loop_profile_callback(MAIN_LOOP_CB_CONN_READ, conn_type, start_nsec);
 }
 
 /** Libevent callback: this gets invoked when (connection_t*)<b>conn</b> has
@@ -727,11 +1028,14 @@ static void
 conn_write_callback(evutil_socket_t fd, short events, void *_conn)
 {
   connection_t *conn = _conn;
+  const int conn_type = conn->type;
+  const uint64_t start_nsec = tor_monotime_nsec();
   (void)fd;
   (void)events;
 
   LOG_FN_CONN(conn, (LOG_DEBUG, LD_NET, "socket %d wants to write.",
                      (int)conn->s));
+  main_loop_note_activity();
 
   /* assert_connection_ok(conn, time(NULL)); */
 
@@ -755,8 +1059,12 @@ conn_write_callback(evutil_socket_t fd, short events, void *_conn)
   }
   assert_connection_ok(conn, time(NULL));
 
+  deliver_linked_data_directly();
+
   if (smartlist_len(closeable_connection_lst))
     close_closeable_connections();
+
+  main_loop_profile_callback(MAIN_LOOP_CB_CONN_WRITE, conn_type, start_nsec);
 }
 
 /** If the connection at connection_array[i] is marked for close, then:
@@ -777,6 +1085,9 @@ conn_close_if_marked(int i)
   conn = smartlist_get(connection_array, i);
   if (!conn->marked_for_close)
     return 0; /* nothing to see here, move along */
+  if (conn->type == CONN_TYPE_OR &&
+      TO_OR_CONN(conn)->tls_handshake_in_worker)
+    return 0; /* a cpuworker still has its tls; wait till it's done. */
   now = time(NULL);
   assert_connection_ok(conn, now);
   /* assert_all_pending_dns_resolves_ok(); */
@@ -833,8 +1144,10 @@ conn_close_if_marked(int i)
                 connection_wants_to_flush(conn));
     } else if (connection_speaks_cells(conn)) {
       if (conn->state == OR_CONN_STATE_OPEN) {
-        retval = flush_buf_tls(TO_OR_CONN(conn)->tls, conn->outbuf, sz,
-                               &conn->outbuf_flushlen);
+        or_connection_t *or_conn = TO_OR_CONN(conn);
+        retval = flush_buf_tls(or_conn->tls, conn->outbuf, sz,
+                               &conn->outbuf_flushlen,
+                               connection_or_get_tls_record_size(or_conn));
       } else
         retval = -1; /* never flush non-open broken tls connections */
     } else {
@@ -857,6 +1170,7 @@ conn_close_if_marked(int i)
          */
         if (connection_is_writing(conn)) {
           conn->write_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           connection_stop_writing(conn);
         }
         if (connection_is_reading(conn)) {
@@ -871,6 +1185,7 @@ conn_close_if_marked(int i)
             tor_free(m);
           }
           conn->read_blocked_on_bw = 1;
+          connection_note_blocked_on_bw(conn);
           connection_stop_reading(conn);
         }
       }
@@ -977,13 +1292,13 @@ directory_info_has_arrived(time_t now, int from_cache)
 #define IDLE_OR_CONN_TIMEOUT 180
 
 /** Perform regular maintenance tasks for a single connection.  This
- * function gets run once per second per connection by run_scheduled_events.
+ * function gets run by run_due_connection_housekeeping() whenever
+ * <b>conn</b>'s housekeeping deadline has passed.
  */
 static void
-run_connection_housekeeping(int i, time_t now)
+run_connection_housekeeping(connection_t *conn, time_t now)
 {
   cell_t cell;
-  connection_t *conn = smartlist_get(connection_array, i);
   const or_options_t *options = get_options();
   or_connection_t *or_conn;
   int past_keepalive =
@@ -1020,6 +1335,16 @@ run_connection_housekeeping(int i, time_t now)
     return;
   }
 
+  if (conn->type == CONN_TYPE_EXIT) {
+    /* Give up on slow connect()s if there are other addresses to try. */
+    if (conn->state == EXIT_CONN_STATE_CONNECTING &&
+        options->ExitConnectFallbackTimeout &&
+        now >= TO_EDGE_CONN(conn)->exit_connect_started +
+               options->ExitConnectFallbackTimeout)
+      connection_exit_try_next_addr(TO_EDGE_CONN(conn));
+    return;
+  }
+
   if (!connection_speaks_cells(conn))
     return; /* we're all done here, the rest is just for OR conns */
 
@@ -1085,6 +1410,87 @@ run_connection_housekeeping(int i, time_t now)
   }
 }
 
+/** Return the next time at which run_connection_housekeeping() could
+ * have anything to do for <b>conn</b>, given that it has just looked at it
+ * at <b>now</b>, or 0 if it never will.  Being early is harmless, since we
+ * just look again; being late is not, so anything that can make a
+ * connection expire other than the passage of time needs to call
+ * connection_schedule_housekeeping() itself. */
+time_t
+connection_next_housekeeping(connection_t *conn, time_t now)
+{
+  const or_options_t *options = get_options();
+  or_connection_t *or_conn;
+  time_t due;
+
+  if (conn->marked_for_close)
+    return 0;
+
+  if (conn->type == CONN_TYPE_DIR) {
+    due = (DIR_CONN_IS_SERVER(conn) ? conn->timestamp_lastwritten :
+           conn->timestamp_lastread) + DIR_CONN_MAX_STALL + 1;
+    return MAX(due, now + 1);
+  }
+
+  if (conn->type == CONN_TYPE_EXIT) {
+    const edge_connection_t *edge_conn = TO_EDGE_CONN(conn);
+    if (conn->state != EXIT_CONN_STATE_CONNECTING ||
+        !edge_conn->n_exit_alt_addrs || !options->ExitConnectFallbackTimeout)
+      return 0;
+    due = edge_conn->exit_connect_started +
+      options->ExitConnectFallbackTimeout;
+    return MAX(due, now + 1);
+  }
+
+  if (!connection_speaks_cells(conn))
+    return 0;
+
+  or_conn = TO_OR_CONN(conn);
+  if (we_are_hibernating() && !or_conn->n_circuits)
+    return now + 1; /* We're waiting for the outbuf to drain. */
+
+  /* Once the keepalive period has passed, we keep looking every second
+   * until we manage to write something.  That also covers stuck
+   * connections, which can't be stuck until well after this. */
+  due = conn->timestamp_lastwritten + options->KeepalivePeriod;
+  if (!or_conn->n_circuits)
+    due = MIN(due, or_conn->timestamp_last_added_nonpadding +
+                   IDLE_OR_CONN_TIMEOUT);
+  return MAX(due, now + 1);
+}
+
+/** Run run_connection_housekeeping() on every connection whose
+ * housekeeping deadline has arrived, and work out its next one. */
+void
+run_due_connection_housekeeping(time_t now)
+{
+  static int was_hibernating = 0;
+  static int keepalive_period = 0;
+  const or_options_t *options = get_options();
+  connection_t *conn;
+
+  if (we_are_hibernating() != was_hibernating ||
+      options->KeepalivePeriod != keepalive_period) {
+    /* Either of these can make connections expire sooner than we
+     * planned: look at all of them again. */
+    was_hibernating = we_are_hibernating();
+    keepalive_period = options->KeepalivePeriod;
+    SMARTLIST_FOREACH(connection_array, connection_t *, c,
+                      connection_schedule_housekeeping(c, now));
+  }
+
+  while (housekeeping_queue && smartlist_len(housekeeping_queue)) {
+    conn = smartlist_get(housekeeping_queue, 0);
+    if (conn->housekeeping_due > now)
+      break;
+    smartlist_pqueue_pop(housekeeping_queue, compare_housekeeping_due_,
+                         STRUCT_OFFSET(connection_t, housekeeping_idx));
+    run_connection_housekeeping(conn, now);
+    connection_schedule_housekeeping(conn,
+                                     connection_next_housekeeping(conn, now));
+  }
+}
+
 /** Honor a NEWNYM request: make future requests unlinkable to past
  * requests. */
 static void
@@ -1134,6 +1540,7 @@ run_scheduled_events(time_t now)
   static time_t time_to_downrate_stability = 0;
   static time_t time_to_save_stability = 0;
   static time_t time_to_clean_caches = 0;
+  static time_t time_to_tune_socket_buffers = 0;
   static time_t time_to_recheck_bandwidth = 0;
   static time_t time_to_check_for_expired_networkstatus = 0;
   static time_t time_to_write_stats_files = 0;
@@ -1146,7 +1553,6 @@ run_scheduled_events(time_t now)
   const or_options_t *options = get_options();
 
   int is_server = server_mode(options);
-  int i;
   int have_dir_info;
 
   /** 0. See if we've been asked to shut down and our timeout has
@@ -1176,6 +1582,11 @@ run_scheduled_events(time_t now)
   /* 0c. If we've deferred log messages for the controller, handle them now */
   flush_pending_log_callbacks();
 
+  /* Switch to any descriptor stores that threads have finished rebuilding
+   * in the background. */
+  router_finish_store_rebuilds();
+  microdesc_cache_finish_rebuild(NULL);
+
   /** 1a. Every MIN_ONION_KEY_LIFETIME seconds, rotate the onion keys,
    *  shut down and restart all cpuworkers, and update the directory if
    *  necessary.
@@ -1210,11 +1621,13 @@ run_scheduled_events(time_t now)
   if (options->UseBridges)
     fetch_bridge_descriptors(options, now);
 
-  /** 1b. Every MAX_SSL_KEY_LIFETIME_INTERNAL seconds, we change our
-   * TLS context. */
+  /** 1b. Every MAX_SSL_KEY_LIFETIME_INTERNAL seconds, and as soon as a
+   * dynamic DH modulus we've been generating in the background is ready,
+   * we change our TLS context. */
   if (!last_rotated_x509_certificate)
     last_rotated_x509_certificate = now;
-  if (last_rotated_x509_certificate+MAX_SSL_KEY_LIFETIME_INTERNAL < now) {
+  if (crypto_install_generated_tls_dh_prime() ||
+      last_rotated_x509_certificate+MAX_SSL_KEY_LIFETIME_INTERNAL < now) {
     log_info(LD_GENERAL,"Rotating tls context.");
     if (router_initialize_tls_context() < 0) {
       log_warn(LD_BUG, "Error reinitializing TLS context");
@@ -1360,6 +1773,13 @@ run_scheduled_events(time_t now)
     time_to_clean_caches = now + CLEAN_CACHES_INTERVAL;
   }
 
+  /* Fit OR connections' socket buffers to what they've been carrying. */
+  if (time_to_tune_socket_buffers < now) {
+    connection_tune_socket_buffers(now);
+#define TUNE_SOCKET_BUFFERS_INTERVAL 10
+    time_to_tune_socket_buffers = now + TUNE_SOCKET_BUFFERS_INTERVAL;
+  }
+
 #define RETRY_DNS_INTERVAL (10*60)
   /* If we're a server and initializing dns failed, retry periodically. */
   if (time_to_retry_dns_init < now) {
@@ -1469,13 +1889,19 @@ run_scheduled_events(time_t now)
   if (now % 10 == 5)
     circuit_expire_old_circuits_serverside(now);
 
-  /** 5. We do housekeeping for each connection... */
+  /** 5. We do housekeeping for each connection that needs it... */
   connection_or_set_bad_connections(NULL, 0);
-  for (i=0;i<smartlist_len(connection_array);i++) {
-    run_connection_housekeeping(i, now);
-  }
+  run_due_connection_housekeeping(now);
+/** How often do we check buffers and pools for empty space that can be
+ * deallocated? */
+#define MEM_SHRINK_INTERVAL (60)
   if (time_to_shrink_memory < now) {
     SMARTLIST_FOREACH(connection_array, connection_t *, conn, {
+        /* Busy buffers drain on their own; only compact the ones on
+         * connections that have been idle since the last pass. */
+        if (conn->timestamp_lastread + MEM_SHRINK_INTERVAL >= now ||
+            conn->timestamp_lastwritten + MEM_SHRINK_INTERVAL >= now)
+          continue;
         if (conn->outbuf)
           buf_shrink(conn->outbuf);
         if (conn->inbuf)
@@ -1483,9 +1909,6 @@ run_scheduled_events(time_t now)
       });
     clean_cell_pool();
     buf_shrink_freelists(0);
-/** How often do we check buffers and pools for empty space that can be
- * deallocated? */
-#define MEM_SHRINK_INTERVAL (60)
     time_to_shrink_memory = now + MEM_SHRINK_INTERVAL;
   }
 
@@ -1516,8 +1939,8 @@ run_scheduled_events(time_t now)
       time_to_check_for_correct_dns = now + 60 + crypto_rand_int(120);
     } else {
       dns_launch_correctness_checks();
-      time_to_check_for_correct_dns = now + 12*3600 +
-        crypto_rand_int(12*3600);
+      time_to_check_for_correct_dns = now + 3*3600 +
+        crypto_rand_int(3*3600);
     }
   }
 
@@ -1573,6 +1996,7 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   size_t bytes_read;
   int seconds_elapsed;
   const or_options_t *options = get_options();
+  const uint64_t start_nsec = tor_monotime_nsec();
   (void)timer;
   (void)arg;
 
@@ -1606,6 +2030,12 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
 
   control_event_bandwidth_used((uint32_t)bytes_read,(uint32_t)bytes_written);
   control_event_stream_bandwidth_used();
+  write_behind_poll();
+  if (seconds_elapsed > 0) {
+    rep_hist_onion_pipeline_second_elapsed(seconds_elapsed,
+                                           onion_pending_len());
+    control_event_onion_pipeline();
+  }
 
   if (server_mode(options) &&
       !net_is_disabled() &&
@@ -1652,6 +2082,10 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   run_scheduled_events(now);
 
   current_second = now; /* remember which second it is, for next time */
+
+  main_loop_update_dormancy(now);
+
+  main_loop_profile_callback(MAIN_LOOP_CB_SECOND_ELAPSED, 0, start_nsec);
 }
 
 #ifndef USE_BUFFEREVENTS
@@ -1670,6 +2104,7 @@ refill_callback(periodic_timer_t *timer, void *arg)
   size_t bytes_read;
   int milliseconds_elapsed = 0;
   int seconds_rolled_over = 0;
+  const uint64_t start_nsec = tor_monotime_nsec();
 
   const or_options_t *options = get_options();
 
@@ -1702,9 +2137,274 @@ refill_callback(periodic_timer_t *timer, void *arg)
   stats_prev_global_write_bucket = global_write_bucket;
 
   current_millisecond = now; /* remember what time it is, for next time */
+
+  main_loop_profile_callback(MAIN_LOOP_CB_REFILL, 0, start_nsec);
 }
 #endif
 
+/** Start the timers that invoke second_elapsed_callback() once a second and
+ * (without bufferevents) refill_callback() every TokenBucketRefillInterval,
+ * if they aren't running already. */
+static void
+start_periodic_timers(void)
+{
+  if (! second_timer) {
+    struct timeval one_second;
+    one_second.tv_sec = 1;
+    one_second.tv_usec = 0;
+
+    second_timer = periodic_timer_new(tor_libevent_get_base(),
+                                      &one_second,
+                                      second_elapsed_callback,
+                                      NULL);
+    tor_assert(second_timer);
+  }
+
+#ifndef USE_BUFFEREVENTS
+  if (!refill_timer) {
+    struct timeval refill_interval;
+    int msecs = get_options()->TokenBucketRefillInterval;
+
+    refill_interval.tv_sec =  msecs/1000;
+    refill_interval.tv_usec = (msecs%1000)*1000;
+
+    refill_timer = periodic_timer_new(tor_libevent_get_base(),
+                                      &refill_interval,
+                                      refill_callback,
+                                      NULL);
+    tor_assert(refill_timer);
+  }
+#endif
+}
+
+/** True iff the main loop is dormant: the periodic timers are stopped, and
+ * dormant_wakeup_event will call second_elapsed_callback() when something
+ * might next need doing. */
+static int main_loop_is_dormant = 0;
+/** Timer: used to wake up from dormancy when something is due. */
+static struct event *dormant_wakeup_event = NULL;
+
+/** Return true iff there is nothing for us to do at <b>now</b> but wait
+ * for a connection to become active or a housekeeping deadline to arrive,
+ * so that there's no point in ticking once a second. */
+int
+main_loop_can_go_dormant(time_t now)
+{
+  const or_options_t *options = get_options();
+  circuit_t *circ;
+
+  if (!options->DormantWakeupInterval)
+    return 0;
+  /* Relays need to test and publish themselves, and accounting counts
+   * bytes every second. */
+  if (server_mode(options) || accounting_is_enabled(options))
+    return 0;
+  if (control_event_wants_per_second_events())
+    return 0;
+  /* With the network disabled, only a controller can give us work. */
+  if (!net_is_disabled() &&
+      (!rep_hist_circbuilding_dormant(now) ||
+       !router_have_minimum_dir_info()))
+    return 0;
+  if (smartlist_len(get_connection_array_by_type(CONN_TYPE_AP)) ||
+      smartlist_len(get_connection_array_by_type(CONN_TYPE_DIR)) ||
+      (closeable_connection_lst &&
+       smartlist_len(closeable_connection_lst)) ||
+      (active_linked_connection_lst &&
+       smartlist_len(active_linked_connection_lst)))
+    return 0;
+  for (circ = _circuit_get_global_list(); circ; circ = circ->next) {
+    /* Building circuits need circuit_expire_building() every second. */
+    if (CIRCUIT_IS_ORIGIN(circ) && !circ->marked_for_close &&
+        circ->state != CIRCUIT_STATE_OPEN)
+      return 0;
+  }
+  return 1;
+}
+
+/** Libevent callback: we're dormant, and something may be due. */
+static void
+dormant_wakeup_callback(evutil_socket_t fd, short event, void *arg)
+{
+  (void)fd;
+  (void)event;
+  (void)arg;
+  second_elapsed_callback(NULL, NULL);
+}
+
+/** Called at the end of every tick of the main loop.  If there's nothing
+ * for us to do but wait, stop the periodic timers, and arrange to tick
+ * again only when the next housekeeping deadline arrives or after
+ * DormantWakeupInterval, whichever is first.  Otherwise make sure the
+ * periodic timers are running. */
+static void
+main_loop_update_dormancy(time_t now)
+{
+  struct timeval tv;
+  time_t next;
+
+  if (!main_loop_can_go_dormant(now)) {
+    main_loop_note_activity();
+    return;
+  }
+
+  if (!main_loop_is_dormant) {
+    log_info(LD_GENERAL, "Nothing to do: stopping the once-a-second timer.");
+    periodic_timer_free(second_timer);
+    second_timer = NULL;
+#ifndef USE_BUFFEREVENTS
+    periodic_timer_free(refill_timer);
+    refill_timer = NULL;
+#endif
+    main_loop_is_dormant = 1;
+  }
+
+  next = now + get_options()->DormantWakeupInterval;
+  if (housekeeping_queue && smartlist_len(housekeeping_queue)) {
+    connection_t *conn = smartlist_get(housekeeping_queue, 0);
+    next = MIN(next, conn->housekeeping_due);
+  }
+  tv.tv_sec = next > now ? (long)(next - now) : 1;
+  tv.tv_usec = 0;
+  if (!dormant_wakeup_event)
+    dormant_wakeup_event = tor_evtimer_new(tor_libevent_get_base(),
+                                           dormant_wakeup_callback, NULL);
+  event_add(dormant_wakeup_event, &tv);
+}
+
+/** Something has happened that might need the periodic timers: if we're
+ * dormant, start them again. */
+static void
+main_loop_note_activity(void)
+{
+  if (!main_loop_is_dormant)
+    return;
+  log_info(LD_GENERAL, "Restarting the once-a-second timer.");
+  main_loop_is_dormant = 0;
+  if (dormant_wakeup_event)
+    event_del(dormant_wakeup_event);
+  start_periodic_timers();
+}
+
+/** For each main_loop_callback_t, a histogram of how long that callback
+ * has taken to run, in usec. */
+static latency_histogram_t main_loop_callback_histograms[
+                                                     N_MAIN_LOOP_CALLBACKS];
+/** For MAIN_LOOP_CB_CONN_READ and MAIN_LOOP_CB_CONN_WRITE, a histogram of
+ * how long the callback has taken to run on each type of connection, in
+ * usec. */
+static latency_histogram_t conn_callback_histograms[2][_CONN_TYPE_MAX+1];
+/** For each main_loop_callback_t, how many times has it taken longer than
+ * MainLoopStallThreshold? */
+static uint64_t main_loop_callback_n_stalls[N_MAIN_LOOP_CALLBACKS];
+
+/** Return a name for the main-loop callback <b>cb</b>. */
+static const char *
+main_loop_callback_name(main_loop_callback_t cb)
+{
+  switch (cb) {
+    case MAIN_LOOP_CB_CONN_READ: return "conn_read";
+    case MAIN_LOOP_CB_CONN_WRITE: return "conn_write";
+    case MAIN_LOOP_CB_SECOND_ELAPSED: return "second_elapsed";
+    case MAIN_LOOP_CB_REFILL: return "refill";
+    case MAIN_LOOP_CB_DNS_ANSWER: return "dns_answer";
+    case MAIN_LOOP_CB_DNS_GAI_ANSWERS: return "dns_gai_answers";
+  }
+  return "unknown";
+}
+
+/** Record that the main-loop callback <b>cb</b>, which began at
+ * <b>start_nsec</b> (from tor_monotime_nsec()), has just finished.  If it
+ * was handling a connection, <b>conn_type</b> is that connection's type;
+ * otherwise it is 0.  If it ran for longer than MainLoopStallThreshold, say
+ * so. */
+void
+main_loop_profile_callback(main_loop_callback_t cb, int conn_type,
+                           uint64_t start_nsec)
+{
+  uint64_t now = tor_monotime_nsec();
+  uint64_t usec = now > start_nsec ? (now - start_nsec) / 1000 : 0;
+  int threshold;
+
+  tor_assert((int)cb >= 0 && cb < N_MAIN_LOOP_CALLBACKS);
+  latency_histogram_add(&main_loop_callback_histograms[cb], usec);
+  if ((cb == MAIN_LOOP_CB_CONN_READ || cb == MAIN_LOOP_CB_CONN_WRITE) &&
+      conn_type > 0 && conn_type <= _CONN_TYPE_MAX)
+    latency_histogram_add(&conn_callback_histograms[cb][conn_type], usec);
+
+  threshold = get_options()->MainLoopStallThreshold;
+  if (threshold > 0 && usec >= (uint64_t)threshold * 1000) {
+    static ratelim_t stall_limit = RATELIM_INIT(60);
+    char *m;
+    ++main_loop_callback_n_stalls[cb];
+    if ((m = rate_limit_log(&stall_limit, approx_time()))) {
+      log_notice(LD_GENERAL, "The %s callback%s%s took %d msec, blocking "
+                 "the main loop.%s", main_loop_callback_name(cb),
+                 conn_type ? " for a connection of type " : "",
+                 conn_type ? conn_type_to_string(conn_type) : "",
+                 (int)(usec / 1000), m);
+      tor_free(m);
+    }
+  }
+}
+
+/** Add a NAME=COUNTS line for the histogram <b>h</b> to <b>lines</b>, if
+ * it isn't empty. */
+static void
+main_loop_add_histogram_line(smartlist_t *lines, const char *name,
+                             const latency_histogram_t *h)
+{
+  char *counts;
+  if (!latency_histogram_get_total(h))
+    return;
+  counts = latency_histogram_format(h);
+  smartlist_add_asprintf(lines, "%s=%s", name, counts);
+  tor_free(counts);
+}
+
+/** Helper used to implement GETINFO main-loop/... controller commands. */
+int
+getinfo_helper_main_loop(control_connection_t *control_conn,
+                         const char *question, char **answer,
+                         const char **errmsg)
+{
+  smartlist_t *lines;
+  int i, t;
+  (void)control_conn;
+  (void)errmsg;
+
+  lines = smartlist_new();
+  if (!strcmp(question, "main-loop/callbacks")) {
+    for (i = 0; i < N_MAIN_LOOP_CALLBACKS; ++i)
+      main_loop_add_histogram_line(lines, main_loop_callback_name(i),
+                                   &main_loop_callback_histograms[i]);
+  } else if (!strcmp(question, "main-loop/conn-callbacks")) {
+    for (i = MAIN_LOOP_CB_CONN_READ; i <= MAIN_LOOP_CB_CONN_WRITE; ++i) {
+      for (t = _CONN_TYPE_MIN; t <= _CONN_TYPE_MAX; ++t) {
+        char *name, *cp;
+        tor_asprintf(&name, "%s/%s", main_loop_callback_name(i),
+                     conn_type_to_string(t));
+        for (cp = name; *cp; ++cp) {
+          if (*cp == ' ')
+            *cp = '_';
+        }
+        main_loop_add_histogram_line(lines, name,
+                                     &conn_callback_histograms[i][t]);
+        tor_free(name);
+      }
+    }
+  } else if (!strcmp(question, "main-loop/stalls")) {
+    for (i = 0; i < N_MAIN_LOOP_CALLBACKS; ++i)
+      smartlist_add_asprintf(lines, "%s="U64_FORMAT,
+                             main_loop_callback_name(i),
+                             U64_PRINTF_ARG(main_loop_callback_n_stalls[i]));
+  }
+  *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return 0;
+}
+
 #ifndef _WIN32
 /** Called when a possibly ignorable libevent error occurs; ensures that we
  * don't get into an infinite loop by ignoring too many errors from
@@ -1838,6 +2538,10 @@ do_main_loop(void)
 {
   int loop_result;
   time_t now;
+  uint64_t phase_start;
+
+  /* Get the directory caches we're about to parse off the disk. */
+  startup_prefetch_caches();
 
   /* initialize dns resolve map, spawn workers if needed */
   if (dns_init() < 0) {
@@ -1855,10 +2559,12 @@ do_main_loop(void)
   /* load the private keys, if we're supposed to have them, and set up the
    * TLS context. */
   if (! client_identity_key_is_set()) {
+    phase_start = tor_monotime_nsec();
     if (init_keys() < 0) {
       log_err(LD_BUG,"Error initializing keys; exiting");
       return -1;
     }
+    startup_timeline_note("keys", phase_start);
   }
 
   /* Set up the packed_cell_t memory pool. */
@@ -1874,59 +2580,47 @@ do_main_loop(void)
   /* initialize the bootstrap status events to know we're starting up */
   control_event_bootstrap(BOOTSTRAP_STATUS_STARTING, 0);
 
+  phase_start = tor_monotime_nsec();
   if (trusted_dirs_reload_certs()) {
     log_warn(LD_DIR,
              "Couldn't load all cached v3 certificates. Starting anyway.");
   }
+  startup_timeline_note("certs", phase_start);
+  phase_start = tor_monotime_nsec();
   if (router_reload_v2_networkstatus()) {
     return -1;
   }
   if (router_reload_consensus_networkstatus()) {
     return -1;
   }
+  startup_timeline_note("consensus", phase_start);
   /* load the routers file, or assign the defaults. */
+  phase_start = tor_monotime_nsec();
   if (router_reload_router_list()) {
     return -1;
   }
+  startup_timeline_note("descriptors", phase_start);
   /* load the networkstatuses. (This launches a download for new routers as
    * appropriate.)
    */
+  phase_start = tor_monotime_nsec();
   now = time(NULL);
   directory_info_has_arrived(now, 1);
+  startup_timeline_note("dir-info", phase_start);
 
-  if (server_mode(get_options())) {
-    /* launch cpuworkers. Need to do this *after* we've read the onion key. */
-    cpu_init();
-  }
-
-  /* set up once-a-second callback. */
-  if (! second_timer) {
-    struct timeval one_second;
-    one_second.tv_sec = 1;
-    one_second.tv_usec = 0;
-
-    second_timer = periodic_timer_new(tor_libevent_get_base(),
-                                      &one_second,
-                                      second_elapsed_callback,
-                                      NULL);
-    tor_assert(second_timer);
-  }
-
-#ifndef USE_BUFFEREVENTS
-  if (!refill_timer) {
-    struct timeval refill_interval;
-    int msecs = get_options()->TokenBucketRefillInterval;
+  /* launch cpuworkers. Need to do this *after* we've read the onion key.
+   * (Without threads, only servers get any cpuworkers.) */
+  phase_start = tor_monotime_nsec();
+  cpu_init();
+  /* Start precomputing DH keypairs for circuit handshakes. */
+  onion_dh_pool_init();
+  startup_timeline_note("cpuworkers", phase_start);
 
-    refill_interval.tv_sec =  msecs/1000;
-    refill_interval.tv_usec = (msecs%1000)*1000;
+  /* We're done with the files the prefetch threads were reading. */
+  startup_prefetch_join();
 
-    refill_timer = periodic_timer_new(tor_libevent_get_base(),
-                                      &refill_interval,
-                                      refill_callback,
-                                      NULL);
-    tor_assert(refill_timer);
-  }
-#endif
+  /* set up once-a-second callback. */
+  start_periodic_timers();
 
   for (;;) {
     if (nt_service_is_stopping())
@@ -2057,6 +2751,209 @@ process_signal(uintptr_t sig)
   }
 }
 
+/** One entry in the startup timeline. */
+typedef struct startup_phase_t {
+  char *name; /**< What we were doing. */
+  uint64_t usec; /**< How long it took. */
+} startup_phase_t;
+
+/** The phases of startup we've timed so far, in order, as
+ * startup_phase_t. */
+static smartlist_t *startup_phases = NULL;
+/** When tor_init() started, as a tor_monotime_nsec() value. */
+static uint64_t startup_began_nsec = 0;
+/** When the latest startup phase (or bootstrap milestone) ended. */
+static uint64_t startup_last_nsec = 0;
+/** The tag of the latest bootstrap milestone we've reached, if any. */
+static const char *startup_last_bootstrap_tag = NULL;
+/** True once we've finished bootstrapping and reported the timeline. */
+static int startup_timeline_finished = 0;
+
+/** Add a phase called <b>name</b> to the startup timeline: it began at
+ * <b>start_nsec</b> (from tor_monotime_nsec()) and just ended. */
+void
+startup_timeline_note(const char *name, uint64_t start_nsec)
+{
+  startup_phase_t *phase;
+  uint64_t now = tor_monotime_nsec();
+  if (startup_timeline_finished)
+    return;
+  if (!startup_phases)
+    startup_phases = smartlist_new();
+  phase = tor_malloc(sizeof(startup_phase_t));
+  phase->name = tor_strdup(name);
+  phase->usec = now > start_nsec ? (now - start_nsec) / 1000 : 0;
+  smartlist_add(startup_phases, phase);
+  startup_last_nsec = now;
+  log_info(LD_GENERAL, "Startup phase %s took %d msec.", name,
+           (int)(phase->usec / 1000));
+}
+
+/** Return a newly allocated string listing the startup timeline as
+ * space-separated NAME=USEC entries. */
+static char *
+startup_timeline_format(void)
+{
+  smartlist_t *items = smartlist_new();
+  char *result;
+  if (startup_phases) {
+    SMARTLIST_FOREACH(startup_phases, const startup_phase_t *, phase,
+      smartlist_add_asprintf(items, "%s="U64_FORMAT, phase->name,
+                             U64_PRINTF_ARG(phase->usec)));
+  }
+  result = smartlist_join_strings(items, " ", 0, NULL);
+  SMARTLIST_FOREACH(items, char *, cp, tor_free(cp));
+  smartlist_free(items);
+  return result;
+}
+
+/** Called when we reach the bootstrap milestone called <b>tag</b>: add how
+ * long we spent on the one before it to the startup timeline.  Once
+ * <b>done</b> is true, finish the timeline and tell the controller. */
+void
+startup_timeline_note_bootstrap(const char *tag, int done)
+{
+  char *timeline;
+  if (startup_timeline_finished)
+    return;
+  if (startup_last_bootstrap_tag) {
+    char *name;
+    tor_asprintf(&name, "bootstrap_%s", startup_last_bootstrap_tag);
+    startup_timeline_note(name, startup_last_nsec);
+    tor_free(name);
+  }
+  startup_last_bootstrap_tag = tag;
+  startup_last_nsec = tor_monotime_nsec();
+  if (!done)
+    return;
+
+  startup_timeline_note("total", startup_began_nsec);
+  startup_timeline_finished = 1;
+  timeline = startup_timeline_format();
+  log_info(LD_GENERAL, "Startup timeline (usec): %s", timeline);
+  control_event_client_status(LOG_NOTICE, "STARTUP_TIMELINE %s", timeline);
+  tor_free(timeline);
+}
+
+/** Helper for GETINFO: answer status/startup-timeline. */
+int
+getinfo_helper_startup(control_connection_t *control_conn,
+                       const char *question, char **answer,
+                       const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+  if (!strcmp(question, "status/startup-timeline"))
+    *answer = startup_timeline_format();
+  return 0;
+}
+
+/** Free everything in the startup timeline. */
+static void
+startup_timeline_free_all(void)
+{
+  if (!startup_phases)
+    return;
+  SMARTLIST_FOREACH(startup_phases, startup_phase_t *, phase, {
+      tor_free(phase->name);
+      tor_free(phase);
+    });
+  smartlist_free(startup_phases);
+  startup_phases = NULL;
+}
+
+#ifdef USE_PTHREADS
+/** Files in the data directory that we'll read and parse during startup,
+ * roughly in the order we'll get to them.  We read them all at once in
+ * the background while we start parsing the first, so that by the time we
+ * get to each later one it's already in the OS's page cache. */
+static const char *startup_cache_files[] = {
+  "cached-certs",
+  "cached-microdesc-consensus",
+  "cached-consensus",
+  "cached-microdescs",
+  "cached-microdescs.new",
+  "cached-descriptors",
+  "cached-descriptors.new",
+  NULL
+};
+/** Protects startup_prefetches_pending. */
+static tor_mutex_t *startup_prefetch_lock = NULL;
+/** Signalled when a prefetch thread finishes. */
+static tor_cond_t *startup_prefetch_cond = NULL;
+/** How many prefetch threads are still reading? */
+static int startup_prefetches_pending = 0;
+
+/** Thread function: read all of the file named <b>arg</b>, which we
+ * own, and throw its contents away. */
+static void
+startup_prefetch_file(void *arg)
+{
+  char *fname = arg;
+  char buf[8192];
+  int fd = tor_open_cloexec(fname, O_RDONLY, 0);
+  if (fd >= 0) {
+    while (read(fd, buf, sizeof(buf)) > 0)
+      ;
+    close(fd);
+  }
+  tor_free(fname);
+
+  tor_mutex_acquire(startup_prefetch_lock);
+  --startup_prefetches_pending;
+  tor_cond_signal_all(startup_prefetch_cond);
+  tor_mutex_release(startup_prefetch_lock);
+  spawn_exit();
+}
+
+/** Start reading our cached directory files in the background. */
+static void
+startup_prefetch_caches(void)
+{
+  int i;
+  startup_prefetch_lock = tor_mutex_new();
+  startup_prefetch_cond = tor_cond_new();
+  if (!startup_prefetch_cond) {
+    tor_mutex_free(startup_prefetch_lock);
+    startup_prefetch_lock = NULL;
+    return;
+  }
+  for (i = 0; startup_cache_files[i]; ++i) {
+    char *fname = get_datadir_fname(startup_cache_files[i]);
+    if (file_status(fname) != FN_FILE) {
+      tor_free(fname);
+      continue;
+    }
+    tor_mutex_acquire(startup_prefetch_lock);
+    ++startup_prefetches_pending;
+    tor_mutex_release(startup_prefetch_lock);
+    if (spawn_func(startup_prefetch_file, fname) < 0) {
+      tor_free(fname);
+      tor_mutex_acquire(startup_prefetch_lock);
+      --startup_prefetches_pending;
+      tor_mutex_release(startup_prefetch_lock);
+    }
+  }
+}
+
+/** Wait for every thread that startup_prefetch_caches() launched to
+ * finish, and release the storage it used. */
+static void
+startup_prefetch_join(void)
+{
+  if (!startup_prefetch_lock)
+    return;
+  tor_mutex_acquire(startup_prefetch_lock);
+  while (startup_prefetches_pending)
+    tor_cond_wait(startup_prefetch_cond, startup_prefetch_lock);
+  tor_mutex_release(startup_prefetch_lock);
+  tor_cond_free(startup_prefetch_cond);
+  startup_prefetch_cond = NULL;
+  tor_mutex_free(startup_prefetch_lock);
+  startup_prefetch_lock = NULL;
+}
+#endif
+
 /** Returns Tor's uptime. */
 long
 get_uptime(void)
@@ -2074,12 +2971,15 @@ static void
 dumpmemusage(int severity)
 {
   connection_dump_buffer_mem_stats(severity);
+  connection_dump_struct_mem_stats(severity);
   log(severity, LD_GENERAL, "In rephist: "U64_FORMAT" used by %d Tors.",
       U64_PRINTF_ARG(rephist_total_alloc), rephist_total_num);
   dump_routerlist_mem_usage(severity);
   dump_cell_pool_usage(severity);
   dump_dns_mem_usage(severity);
   buf_dump_freelist_sizes(severity);
+  mp_arena_log_status(severity);
+  memtag_log_usage(severity);
   tor_log_mallinfo(severity);
 }
 
@@ -2252,7 +3152,9 @@ tor_init(int argc, char *argv[])
 {
   char buf[256];
   int i, quiet = 0;
+  uint64_t phase_start;
   time_of_process_start = time(NULL);
+  startup_began_nsec = startup_last_nsec = tor_monotime_nsec();
   if (!connection_array)
     connection_array = smartlist_new();
   if (!closeable_connection_lst)
@@ -2319,10 +3221,12 @@ tor_init(int argc, char *argv[])
   }
   atexit(exit_function);
 
+  phase_start = tor_monotime_nsec();
   if (options_init_from_torrc(argc,argv) < 0) {
     log_err(LD_CONFIG,"Reading config failed--see warnings above.");
     return -1;
   }
+  startup_timeline_note("config", phase_start);
 
 #ifndef _WIN32
   if (geteuid()==0)
@@ -2413,10 +3317,12 @@ release_lockfile(void)
 void
 tor_free_all(int postfork)
 {
+  int i;
   if (!postfork) {
     evdns_shutdown(1);
   }
   geoip_free_all();
+  startup_timeline_free_all();
   dirvote_free_all();
   routerlist_free_all();
   networkstatus_free_all();
@@ -2425,21 +3331,36 @@ tor_free_all(int postfork)
   rend_service_free_all();
   rend_cache_free_all();
   rend_service_authorization_free_all();
+  rend_client_purge_desc_failures();
   rep_hist_free_all();
+  hibernate_free_all();
   dns_free_all();
   clear_pending_onions();
+  onion_dh_pool_free_all();
   circuit_free_all();
+  circuit_build_times_free_timeouts(&circ_times);
   entry_guards_free_all();
   pt_free_all();
+  if (!postfork) {
+    /* Don't free any connection whose TLS a cpuworker is still using. */
+    cpuworkers_reclaim_tls_handshakes();
+  }
   connection_free_all();
+  scheduler_free_all();
+  control_free_all();
+  connection_edge_coalescing_free_all();
+  connection_exit_reconnect_free_all();
+  relay_keystream_free_all();
   buf_shrink_freelists(1);
   memarea_clear_freelist();
   nodelist_free_all();
   microdesc_free_all();
+  routerparse_free_all();
   if (!postfork) {
     config_free_all();
     router_free_all();
     policies_free_all();
+    string_intern_free_all();
   }
   free_cell_pool();
   if (!postfork) {
@@ -2448,9 +3369,21 @@ tor_free_all(int postfork)
   /* stuff in main.c */
 
   smartlist_free(connection_array);
+  for (i = 0; i <= _CONN_TYPE_MAX; ++i) {
+    smartlist_free(connections_by_type[i]);
+    connections_by_type[i] = NULL;
+  }
+  smartlist_free(housekeeping_queue);
   smartlist_free(closeable_connection_lst);
   smartlist_free(active_linked_connection_lst);
   periodic_timer_free(second_timer);
+#ifndef USE_BUFFEREVENTS
+  periodic_timer_free(refill_timer);
+#endif
+  if (dormant_wakeup_event) {
+    tor_event_free(dormant_wakeup_event);
+    dormant_wakeup_event = NULL;
+  }
   if (!postfork) {
     release_lockfile();
   }
@@ -2482,6 +3415,8 @@ tor_cleanup(void)
     if (authdir_mode_tests_reachability(options))
       rep_hist_record_mtbf_data(now, 0);
   }
+  write_behind_flush();
+  control_flush_event_queue();
 #ifdef USE_DMALLOC
   dmalloc_log_stats();
 #endif
@@ -2543,6 +3478,31 @@ do_hash_password(void)
   printf("16:%s\n",output);
 }
 
+/** Entry point for --dump-geoip-binary: load our GeoIP file, and write it
+ * in the binary format to the file named on the command line. */
+/* static */ int
+do_dump_geoip_binary(void)
+{
+  const or_options_t *options = get_options();
+  const char *fname = options->command_arg;
+
+  if (!strlen(fname)) {
+    log_err(LD_CONFIG, "--dump-geoip-binary needs a file name.");
+    return -1;
+  }
+  if (!options->GeoIPFile || config_load_geoip_file(options) < 0 ||
+      !geoip_is_loaded()) {
+    log_err(LD_CONFIG, "Couldn't load a GeoIP file to convert.");
+    return -1;
+  }
+  if (geoip_write_binary_file(fname) < 0) {
+    log_err(LD_FS, "Couldn't write binary GeoIP file to %s.", escaped(fname));
+    return -1;
+  }
+  printf("Wrote binary GeoIP file to %s\n", fname);
+  return 0;
+}
+
 #if defined (WINCE)
 int
 find_flashcard_path(PWCHAR path, size_t size)
@@ -2653,6 +3613,9 @@ tor_main(int argc, char *argv[])
     printf("Configuration was valid\n");
     result = 0;
     break;
+  case CMD_DUMP_GEOIP_BINARY:
+    result = do_dump_geoip_binary();
+    break;
   case CMD_RUN_UNITTESTS: /* only set by test.c */
   default:
     log_warn(LD_BUG,"Illegal command number %d: internal error.",
@@ -24,6 +24,12 @@ void add_connection_to_closeable_list(connection_t *conn);
 int connection_is_on_closeable_list(connection_t *conn);
 
 smartlist_t *get_connection_array(void);
+smartlist_t *get_connection_array_by_type(int type);
+void connection_schedule_housekeeping(connection_t *conn, time_t due);
+/** The largest allowable DormantWakeupInterval.  Waking up after longer than
+ * this would look like a clock jump to second_elapsed_callback(). */
+#define MAX_DORMANT_WAKEUP_INTERVAL 90
+
 uint64_t get_bytes_read(void);
 uint64_t get_bytes_written(void);
 
@@ -45,6 +51,8 @@ void connection_start_writing(connection_t *conn);
 
 void connection_stop_reading_from_linked_conn(connection_t *conn);
 
+int buffers_check_size(void);
+
 void directory_all_unreachable(time_t now);
 void directory_info_has_arrived(time_t now, int from_cache);
 
@@ -52,6 +60,31 @@ void ip_address_changed(int at_interface);
 void dns_servers_relaunch_checks(void);
 
 long get_uptime(void);
+
+/** Kinds of libevent callback whose running time we profile; see
+ * main_loop_profile_callback(). */
+typedef enum main_loop_callback_t {
+  MAIN_LOOP_CB_CONN_READ = 0,
+  MAIN_LOOP_CB_CONN_WRITE,
+  MAIN_LOOP_CB_SECOND_ELAPSED,
+  MAIN_LOOP_CB_REFILL,
+  MAIN_LOOP_CB_DNS_ANSWER,
+  MAIN_LOOP_CB_DNS_GAI_ANSWERS,
+} main_loop_callback_t;
+/** How many values of main_loop_callback_t are there? */
+#define N_MAIN_LOOP_CALLBACKS 6
+
+void main_loop_profile_callback(main_loop_callback_t cb, int conn_type,
+                                uint64_t start_nsec);
+int getinfo_helper_main_loop(control_connection_t *control_conn,
+                             const char *question, char **answer,
+                             const char **errmsg);
+
+void startup_timeline_note(const char *name, uint64_t start_nsec);
+void startup_timeline_note_bootstrap(const char *tag, int done);
+int getinfo_helper_startup(control_connection_t *control_conn,
+                           const char *question, char **answer,
+                           const char **errmsg);
 unsigned get_signewnym_epoch(void);
 
 void handle_signals(int is_parent);
@@ -70,7 +103,12 @@ int tor_main(int argc, char *argv[]);
 int do_main_loop(void);
 int do_list_fingerprint(void);
 void do_hash_password(void);
+int do_dump_geoip_binary(void);
 int tor_init(int argc, char **argv);
+time_t connection_next_housekeeping(connection_t *conn, time_t now);
+void run_due_connection_housekeeping(time_t now);
+int main_loop_can_go_dormant(time_t now);
+void deliver_linked_data_directly(void);
 #endif
 
 #endif
@@ -14,6 +14,13 @@
 #include "routerlist.h"
 #include "routerparse.h"
 
+/** Where one microdescriptor will live in a cache file that a background
+ * thread is writing. */
+typedef struct md_rebuild_ent_t {
+  char digest[DIGEST256_LEN]; /**< The microdescriptor's digest. */
+  off_t off; /**< The offset of its body in the new cache file. */
+} md_rebuild_ent_t;
+
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
@@ -27,6 +34,9 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file, which lists where each microdescriptor lives
+   * in the cache file so that we needn't parse it at startup. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -38,6 +48,20 @@ struct microdesc_cache_t {
   uint64_t total_len_seen;
   /** Total number of microdescriptors we have added to this cache */
   unsigned n_seen;
+
+  /** Name of the file that a background thread writes when rebuilding the
+   * cache file. */
+  char *rebuild_fname;
+  /** If a thread is writing a new cache file for us, the write in progress;
+   * else NULL. */
+  bg_file_write_t *rebuild_write;
+  /** If rebuild_write is set, where each microdescriptor will be in the new
+   * cache file. */
+  md_rebuild_ent_t *rebuild_ents;
+  /** Number of elements in rebuild_ents. */
+  int n_rebuild_ents;
+  /** True if we no longer want the file that rebuild_write is writing. */
+  unsigned int rebuild_cancelled : 1;
 };
 
 /** Helper: computes a hash of <b>md</b> to place it in a hash table. */
@@ -65,6 +89,25 @@ HT_GENERATE(microdesc_map, microdesc_t, node,
              _microdesc_hash, _microdesc_eq, 0.6,
              malloc, realloc, free);
 
+/** Longest annotations that format_microdesc_annotations() can generate,
+ * including the NUL. */
+#define MD_ANNOTATION_MAXLEN (ISO_TIME_LEN+32)
+
+/** Write the annotations that we store along with <b>md</b> into the
+ * MD_ANNOTATION_MAXLEN-byte buffer at <b>out</b>, and return their length.
+ * Return 0 if there are none. */
+static size_t
+format_microdesc_annotations(char *out, const microdesc_t *md)
+{
+  char buf[ISO_TIME_LEN+1];
+  out[0] = '\0';
+  if (!md->last_listed)
+    return 0;
+  format_iso_time(buf, md->last_listed);
+  tor_snprintf(out, MD_ANNOTATION_MAXLEN, "@last-listed %s\n", buf);
+  return strlen(out);
+}
+
 /** Write the body of <b>md</b> into <b>f</b>, with appropriate annotations.
  * On success, return the total number of bytes written, and set
  * *<b>annotation_len_out</b> to the number of bytes written as
@@ -74,12 +117,9 @@ dump_microdescriptor(FILE *f, microdesc_t *md, size_t *annotation_len_out)
 {
   ssize_t r = 0;
   size_t written;
+  char annotation[MD_ANNOTATION_MAXLEN];
   /* XXXX drops unkown annotations. */
-  if (md->last_listed) {
-    char buf[ISO_TIME_LEN+1];
-    char annotation[ISO_TIME_LEN+32];
-    format_iso_time(buf, md->last_listed);
-    tor_snprintf(annotation, sizeof(annotation), "@last-listed %s\n", buf);
+  if (format_microdesc_annotations(annotation, md)) {
     if (fputs(annotation, f) < 0) {
       log_warn(LD_DIR,
                "Couldn't write microdescriptor annotation: %s",
@@ -109,6 +149,10 @@ dump_microdescriptor(FILE *f, microdesc_t *md, size_t *annotation_len_out)
  * such object has been allocated. */
 static microdesc_cache_t *the_microdesc_cache = NULL;
 
+/** Incremented whenever we remove any microdescriptor from a cache, so that
+ * lists of missing microdescriptors know when they need to be rebuilt. */
+static unsigned microdesc_removal_generation = 0;
+
 /** Return a pointer to the microdescriptor cache, loading it if necessary. */
 microdesc_cache_t *
 get_microdesc_cache(void)
@@ -118,6 +162,8 @@ get_microdesc_cache(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->index_fname = get_datadir_fname("cached-microdescs.idx");
+    cache->rebuild_fname = get_datadir_fname("cached-microdescs.rebuild");
     microdesc_cache_reload(cache);
     the_microdesc_cache = cache;
   }
@@ -266,11 +312,26 @@ microdescs_add_list_to_cache(microdesc_cache_t *cache,
   return added;
 }
 
+/** If a thread is writing a new cache file for <b>cache</b>, make sure we
+ * don't use it.  We keep track of the thread until it's done, so that we
+ * don't start another one writing the same file. */
+static void
+microdesc_cache_cancel_rebuild(microdesc_cache_t *cache)
+{
+  if (!cache->rebuild_write)
+    return;
+  tor_free(cache->rebuild_ents);
+  cache->n_rebuild_ents = 0;
+  cache->rebuild_cancelled = 1;
+}
+
 /** Remove every microdescriptor in <b>cache</b>. */
 void
 microdesc_cache_clear(microdesc_cache_t *cache)
 {
   microdesc_t **entry, **next;
+  microdesc_cache_cancel_rebuild(cache);
+  ++microdesc_removal_generation;
   for (entry = HT_START(microdesc_map, &cache->map); entry; entry = next) {
     microdesc_t *md = *entry;
     next = HT_NEXT_RMV(microdesc_map, &cache->map, entry);
@@ -287,6 +348,166 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->bytes_dropped = 0;
 }
 
+/** First line of a microdescriptor cache index, followed by the size of
+ * the cache file and the hex SHA256 digest of its contents. */
+#define MD_INDEX_HEADER "microdesc-index 1"
+
+/** Write an index of every microdescriptor in the cache file of
+ * <b>cache</b>: one line per descriptor giving its digest, the offset and
+ * length of its body, and when it was last listed.  The index starts with
+ * the size and digest of the cache file, so that we never trust it for any
+ * other cache file.  Return 0 on success, -1 on failure. */
+static int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  smartlist_t *chunks;
+  microdesc_t **mdp;
+  char digest[DIGEST256_LEN], hex[HEX_DIGEST256_LEN+1];
+  char *index;
+  int r;
+
+  if (!cache->cache_content) {
+    unlink(cache->index_fname);
+    return 0;
+  }
+  crypto_digest256(digest, cache->cache_content->data,
+                   cache->cache_content->size, DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+
+  chunks = smartlist_new();
+  smartlist_add_asprintf(chunks, "%s %lu %s\n", MD_INDEX_HEADER,
+                         (unsigned long)cache->cache_content->size, hex);
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    char d64[BASE64_DIGEST256_LEN+1];
+    if (md->saved_location != SAVED_IN_CACHE)
+      continue;
+    digest256_to_base64(d64, md->digest);
+    smartlist_add_asprintf(chunks, "%s %lu %lu %lu\n", d64,
+                           (unsigned long)md->off, (unsigned long)md->bodylen,
+                           (unsigned long)MAX(md->last_listed, 0));
+  }
+  index = smartlist_join_strings(chunks, "", 0, NULL);
+  r = write_str_to_file(cache->index_fname, index, 0);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  tor_free(index);
+  return r;
+}
+
+/** Try to load the microdescriptors in the cache file of <b>cache</b> from
+ * its index, without parsing them: their bodies get parsed on first use.
+ * On success, set *<b>n_out</b> to the number loaded and return 0.  Return
+ * -1 if there is no index, or if it doesn't match the cache file; in that
+ * case, add nothing to <b>cache</b>. */
+static int
+microdesc_cache_load_index(microdesc_cache_t *cache, int *n_out)
+{
+  const tor_mmap_t *mm = cache->cache_content;
+  char *index, *line, *eol;
+  char digest[DIGEST256_LEN], hex[HEX_DIGEST256_LEN+1];
+  char want_hex[HEX_DIGEST256_LEN+1];
+  unsigned size;
+  smartlist_t *mds = NULL, *added;
+  int r = -1;
+
+  if (!(index = read_file_to_str(cache->index_fname,
+                                 RFTS_IGNORE_MISSING, NULL)))
+    return -1;
+
+  /* Does the index describe the cache file we have? */
+  if (!(eol = strchr(index, '\n')))
+    goto done;
+  *eol = '\0';
+  if (strcmpstart(index, MD_INDEX_HEADER " ") ||
+      tor_sscanf(index + strlen(MD_INDEX_HEADER " "), "%u %64s",
+                 &size, want_hex) != 2 ||
+      size != mm->size)
+    goto done;
+  crypto_digest256(digest, mm->data, mm->size, DIGEST_SHA256);
+  base16_encode(hex, sizeof(hex), digest, DIGEST256_LEN);
+  if (strcasecmp(hex, want_hex))
+    goto done;
+
+  mds = smartlist_new();
+  for (line = eol + 1; *line; line = eol + 1) {
+    char d64[BASE64_DIGEST256_LEN+1];
+    unsigned off, len, last_listed;
+    microdesc_t *md;
+    if (!(eol = strchr(line, '\n')))
+      goto done;
+    *eol = '\0';
+    if (tor_sscanf(line, "%43s %u %u %u", d64, &off, &len,
+                   &last_listed) != 4 ||
+        (size_t)off + len > mm->size || len < 9 ||
+        fast_memneq(mm->data + off, "onion-key", 9))
+      goto done;
+    md = tor_malloc_zero(sizeof(microdesc_t));
+    smartlist_add(mds, md);
+    if (digest256_from_base64(md->digest, d64) < 0)
+      goto done;
+    md->body = (char *)mm->data + off;
+    md->bodylen = len;
+    md->off = off;
+    md->last_listed = last_listed;
+    md->saved_location = SAVED_IN_CACHE;
+    md->is_unparsed = 1;
+  }
+
+  added = microdescs_add_list_to_cache(cache, mds, SAVED_IN_CACHE, 0);
+  smartlist_free(mds);
+  mds = NULL;
+  if (!added)
+    goto done;
+  *n_out = smartlist_len(added);
+  smartlist_free(added);
+  r = 0;
+
+ done:
+  if (r < 0)
+    log_info(LD_DIR, "Microdescriptor cache index is missing or stale; "
+             "parsing the whole cache.");
+  if (mds) {
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+    smartlist_free(mds);
+  }
+  tor_free(index);
+  return r;
+}
+
+/** If <b>md</b> was loaded from the cache index and hasn't been parsed yet,
+ * parse its body now to fill in its fields. */
+void
+microdesc_parse_if_needed(microdesc_t *md)
+{
+  smartlist_t *parsed;
+  microdesc_t *p;
+
+  if (PREDICT_LIKELY(!md->is_unparsed))
+    return;
+  md->is_unparsed = 0;
+
+  parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen,
+                                        0, 0);
+  p = smartlist_len(parsed) == 1 ? smartlist_get(parsed, 0) : NULL;
+  if (p && tor_memeq(p->digest, md->digest, DIGEST256_LEN)) {
+    md->onion_pkey = p->onion_pkey;
+    md->family = p->family;
+    md->exit_policy = p->exit_policy;
+    p->onion_pkey = NULL;
+    p->family = NULL;
+    p->exit_policy = NULL;
+  } else {
+    log_warn(LD_BUG, "Microdescriptor at offset %ld in the cache doesn't "
+             "match the cache index.", (long)md->off);
+  }
+  SMARTLIST_FOREACH(parsed, microdesc_t *, m, {
+      m->body = NULL; /* It points into the cache file. */
+      microdesc_free(m);
+    });
+  smartlist_free(parsed);
+}
+
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
  * for the first time.  Return 0 on success, -1 on failure. */
 int
@@ -302,11 +523,18 @@ microdesc_cache_reload(microdesc_cache_t *cache)
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
   if (mm) {
-    added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
-                                    SAVED_IN_CACHE, 0, -1, NULL);
-    if (added) {
-      total += smartlist_len(added);
-      smartlist_free(added);
+    int n = 0;
+    if (microdesc_cache_load_index(cache, &n) == 0) {
+      total += n;
+    } else {
+      added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
+                                      SAVED_IN_CACHE, 0, -1, NULL);
+      if (added) {
+        total += smartlist_len(added);
+        smartlist_free(added);
+      }
+      /* Next time, we won't need to parse all of that. */
+      microdesc_cache_write_index(cache);
     }
   }
 
@@ -373,6 +601,7 @@ microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force)
   }
 
   if (dropped) {
+    ++microdesc_removal_generation;
     log_notice(LD_DIR, "Removed %d/%d microdescriptors as old.",
                dropped,dropped+kept);
     cache->bytes_dropped += bytes_dropped;
@@ -397,10 +626,178 @@ should_rebuild_md_cache(microdesc_cache_t *cache)
     return 0;
 }
 
+/** Build the contents of a new cache file for <b>cache</b> in memory, and
+ * start a thread to write them to disk; microdesc_cache_finish_rebuild()
+ * switches to the new file once it's written.  Return 0 on success, or -1
+ * if we can't start a thread. */
+static int
+microdesc_cache_start_background_rebuild(microdesc_cache_t *cache)
+{
+  microdesc_t **mdp;
+  char *buf, *cp;
+  size_t alloc = 0, annotation_len;
+  md_rebuild_ent_t *ents;
+  int n = 0;
+
+  if (cache->rebuild_write)
+    return -1; /* A cancelled rebuild is still writing. */
+
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if (!(*mdp)->no_save) {
+      alloc += MD_ANNOTATION_MAXLEN + (*mdp)->bodylen;
+      ++n;
+    }
+  }
+  cp = buf = tor_malloc(alloc ? alloc : 1);
+  ents = tor_malloc(sizeof(md_rebuild_ent_t) * (n ? n : 1));
+  n = 0;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    if (md->no_save)
+      continue;
+    annotation_len = format_microdesc_annotations(cp, md);
+    cp += annotation_len;
+    memcpy(ents[n].digest, md->digest, DIGEST256_LEN);
+    ents[n].off = cp - buf;
+    ++n;
+    memcpy(cp, md->body, md->bodylen);
+    cp += md->bodylen;
+  }
+
+  cache->rebuild_write =
+    write_bytes_to_file_in_background(cache->rebuild_fname, buf, cp - buf);
+  if (!cache->rebuild_write) {
+    tor_free(buf);
+    tor_free(ents);
+    return -1;
+  }
+  cache->rebuild_ents = ents;
+  cache->n_rebuild_ents = n;
+  log_info(LD_DIR, "Rebuilding the microdescriptor cache in the "
+           "background...");
+  return 0;
+}
+
+/** Replace the journal of <b>cache</b> with one holding only the
+ * microdescriptors that are saved in the journal.  Return 0 on success, -1
+ * on failure. */
+static int
+microdesc_cache_rewrite_journal(microdesc_cache_t *cache)
+{
+  open_file_t *open_file;
+  FILE *f;
+  microdesc_t **mdp;
+  size_t len = 0, annotation_len;
+
+  f = start_writing_to_stdio_file(cache->journal_fname,
+                                  OPEN_FLAGS_REPLACE|O_BINARY,
+                                  0600, &open_file);
+  if (!f)
+    return -1;
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    microdesc_t *md = *mdp;
+    ssize_t size;
+    if (md->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    size = dump_microdescriptor(f, md, &annotation_len);
+    if (size < 0) {
+      abort_writing_to_file(open_file);
+      return -1;
+    }
+    len += size;
+  }
+  if (finish_writing_to_file(open_file) < 0)
+    return -1;
+  cache->journal_len = len;
+  return 0;
+}
+
+/** If a thread has finished writing a new cache file for <b>cache</b> (or
+ * for the current cache, if <b>cache</b> is NULL), switch to the new file,
+ * point every microdesc_t it holds at its new location, and drop those
+ * microdescriptors from the journal.  Return 1 if we switched, 0 if there was
+ * nothing to do yet, and -1 on failure. */
+int
+microdesc_cache_finish_rebuild(microdesc_cache_t *cache)
+{
+  tor_mmap_t *old_content;
+  int i, r;
+
+  if (cache == NULL)
+    cache = the_microdesc_cache;
+  if (cache == NULL || cache->rebuild_write == NULL)
+    return 0;
+  r = bg_file_write_poll(cache->rebuild_write);
+  if (r == 0)
+    return 0;
+  bg_file_write_free(cache->rebuild_write);
+  cache->rebuild_write = NULL;
+  if (cache->rebuild_cancelled) {
+    cache->rebuild_cancelled = 0;
+    return 0;
+  }
+  if (r < 0) {
+    log_warn(LD_DIR, "Couldn't write rebuilt microdescriptor cache to %s.",
+             cache->rebuild_fname);
+    goto err;
+  }
+  if (replace_file(cache->rebuild_fname, cache->cache_fname) < 0) {
+    log_warn(LD_DIR, "Couldn't replace %s with rebuilt microdescriptor "
+             "cache: %s", cache->cache_fname, strerror(errno));
+    goto err;
+  }
+
+  old_content = cache->cache_content;
+  cache->cache_content = tor_mmap_file(cache->cache_fname);
+  if (!cache->cache_content && cache->n_rebuild_ents) {
+    /* Keep using the old mapping: it stays valid. */
+    log_err(LD_DIR, "Couldn't map file that we just wrote to %s!",
+            cache->cache_fname);
+    cache->cache_content = old_content;
+    goto err;
+  }
+
+  for (i = 0; i < cache->n_rebuild_ents; ++i) {
+    microdesc_t *md = microdesc_cache_lookup_by_digest256(cache,
+                                             cache->rebuild_ents[i].digest);
+    if (!md)
+      continue; /* We dropped it in the meantime. */
+    if (md->saved_location != SAVED_IN_CACHE)
+      tor_free(md->body);
+    md->saved_location = SAVED_IN_CACHE;
+    md->off = cache->rebuild_ents[i].off;
+    md->body = (char*)cache->cache_content->data + md->off;
+    tor_assert((size_t)md->off + md->bodylen <= cache->cache_content->size);
+    tor_assert(fast_memeq(md->body, "onion-key", 9));
+  }
+  if (old_content)
+    tor_munmap_file(old_content);
+  tor_free(cache->rebuild_ents);
+  cache->n_rebuild_ents = 0;
+
+  /* Anything that arrived while the thread was writing is still only in
+   * the journal. */
+  if (microdesc_cache_rewrite_journal(cache) < 0)
+    log_warn(LD_DIR, "Couldn't rewrite microdescriptor journal in %s.",
+             cache->journal_fname);
+  cache->bytes_dropped = 0;
+  microdesc_cache_write_index(cache);
+
+  log_info(LD_DIR, "Done rebuilding microdesc cache in the background; "
+           "%d bytes still used.",
+           (int)(cache->cache_content ? cache->cache_content->size : 0));
+  return 1;
+ err:
+  tor_free(cache->rebuild_ents);
+  cache->n_rebuild_ents = 0;
+  return -1;
+}
+
 /** Regenerate the main cache file for <b>cache</b>, clear the journal file,
  * and update every microdesc_t in the cache with pointers to its new
  * location.  If <b>force</b> is true, do this unconditionally.  If
- * <b>force</b> is false, do it only if we expect to save space on disk. */
+ * <b>force</b> is false, do it only if we expect to save space on disk, and
+ * if we can, let a background thread write the new file. */
 int
 microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 {
@@ -418,12 +815,21 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
       return 0;
   }
 
+  if (cache->rebuild_write && !cache->rebuild_cancelled) {
+    if (!force)
+      return 0; /* We're already rebuilding it. */
+    microdesc_cache_cancel_rebuild(cache);
+  }
+
   /* Remove dead descriptors */
   microdesc_cache_clean(cache, 0/*cutoff*/, 0/*force*/);
 
   if (!force && !should_rebuild_md_cache(cache))
     return 0;
 
+  if (!force && microdesc_cache_start_background_rebuild(cache) == 0)
+    return 0;
+
   log_info(LD_DIR, "Rebuilding the microdescriptor cache...");
 
   orig_size = (int)(cache->cache_content ? cache->cache_content->size : 0);
@@ -494,6 +900,7 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
 
   smartlist_free(wrote);
 
+  microdesc_cache_write_index(cache);
   write_str_to_file(cache->journal_fname, "", 1);
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
@@ -592,8 +999,12 @@ microdesc_free_all(void)
 {
   if (the_microdesc_cache) {
     microdesc_cache_clear(the_microdesc_cache);
+    /* If a thread is still writing, let it finish on its own. */
+    bg_file_write_free(the_microdesc_cache->rebuild_write);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
+    tor_free(the_microdesc_cache->rebuild_fname);
     tor_free(the_microdesc_cache);
   }
 }
@@ -623,6 +1034,46 @@ microdesc_average_size(microdesc_cache_t *cache)
   return (size_t)(cache->total_len_seen / cache->n_seen);
 }
 
+/** Return the routerstatus entries in <b>ns</b> whose microdescriptors are
+ * not present in <b>cache</b>.  The first time we're called for <b>ns</b>,
+ * and whenever microdescriptors have been removed since, we scan the whole
+ * consensus; otherwise we only recheck the entries that were missing last
+ * time.  The result belongs to <b>ns</b>. */
+static smartlist_t *
+microdesc_get_missing_list(networkstatus_t *ns, microdesc_cache_t *cache)
+{
+  smartlist_t *missing = ns->missing_microdescs;
+
+  if (missing &&
+      ns->missing_microdescs_generation == microdesc_removal_generation) {
+    SMARTLIST_FOREACH_BEGIN(missing, routerstatus_t *, rs) {
+      if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
+        SMARTLIST_DEL_CURRENT(missing, rs);
+    } SMARTLIST_FOREACH_END(rs);
+    return missing;
+  }
+
+  if (missing)
+    smartlist_clear(missing);
+  else
+    missing = ns->missing_microdescs = smartlist_new();
+  ns->missing_microdescs_generation = microdesc_removal_generation;
+
+  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+    if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
+      continue;
+    if (tor_mem_is_zero(rs->descriptor_digest, DIGEST256_LEN)) {
+      log_info(LD_BUG, "Found an entry in networkstatus with no "
+               "microdescriptor digest. (Router %s=%s at %s:%d.)",
+               rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
+               fmt_addr32(rs->addr), rs->or_port);
+      continue;
+    }
+    smartlist_add(missing, rs);
+  } SMARTLIST_FOREACH_END(rs);
+  return missing;
+}
+
 /** Return a smartlist of all the sha256 digest of the microdescriptors that
  * are listed in <b>ns</b> but not present in <b>cache</b>. Returns pointers
  * to internals of <b>ns</b>; you should not free the members of the resulting
@@ -634,22 +1085,16 @@ microdesc_list_missing_digest256(networkstatus_t *ns, microdesc_cache_t *cache,
   smartlist_t *result = smartlist_new();
   time_t now = time(NULL);
   tor_assert(ns->flavor == FLAV_MICRODESC);
-  SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
-    if (microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest))
-      continue;
+  if (!cache)
+    cache = get_microdesc_cache();
+  SMARTLIST_FOREACH_BEGIN(microdesc_get_missing_list(ns, cache),
+                          routerstatus_t *, rs) {
     if (downloadable_only &&
         !download_status_is_ready(&rs->dl_status, now,
                                   MAX_MICRODESC_DOWNLOAD_FAILURES))
       continue;
     if (skip && digestmap_get(skip, rs->descriptor_digest))
       continue;
-    if (tor_mem_is_zero(rs->descriptor_digest, DIGEST256_LEN)) {
-      log_info(LD_BUG, "Found an entry in networkstatus with no "
-               "microdescriptor digest. (Router %s=%s at %s:%d.)",
-               rs->nickname, hex_str(rs->identity_digest, DIGEST_LEN),
-               fmt_addr32(rs->addr), rs->or_port);
-      continue;
-    }
     /* XXXX Also skip if we're a noncache and wouldn't use this router.
      * XXXX NM Microdesc
      */
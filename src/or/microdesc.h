@@ -26,6 +26,7 @@ smartlist_t *microdescs_add_list_to_cache(microdesc_cache_t *cache,
 
 void microdesc_cache_clean(microdesc_cache_t *cache, time_t cutoff, int force);
 int microdesc_cache_rebuild(microdesc_cache_t *cache, int force);
+int microdesc_cache_finish_rebuild(microdesc_cache_t *cache);
 int microdesc_cache_reload(microdesc_cache_t *cache);
 void microdesc_cache_clear(microdesc_cache_t *cache);
 
@@ -39,6 +40,7 @@ smartlist_t *microdesc_list_missing_digest256(networkstatus_t *ns,
                                               int downloadable_only,
                                               digestmap_t *skip);
 
+void microdesc_parse_if_needed(microdesc_t *md);
 void microdesc_free(microdesc_t *md);
 void microdesc_free_all(void);
 
@@ -15,6 +15,7 @@
 #include "config.h"
 #include "connection.h"
 #include "connection_or.h"
+#include "consdiff.h"
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
@@ -95,6 +96,12 @@ static time_t last_networkstatus_download_attempted = 0;
 static time_t time_to_download_next_consensus[N_CONSENSUS_FLAVORS];
 /** Download status for the current consensus networkstatus. */
 static download_status_t consensus_dl_status[N_CONSENSUS_FLAVORS];
+/** SHA256 digest of the full text of our current consensus of each flavor,
+ * or all zero if we have none: this is what we ask for diffs from. */
+static char consensus_text_digest[N_CONSENSUS_FLAVORS][DIGEST256_LEN];
+/** True iff the last consensus diff we got for a flavor didn't apply, so we
+ * should fetch the next one in full. */
+static int consensus_diff_failed[N_CONSENSUS_FLAVORS];
 
 /** True iff we have logged a warning about this OR's version being older than
  * listed by the authorities. */
@@ -410,6 +417,8 @@ networkstatus_vote_free(networkstatus_t *ns)
 
     smartlist_free(ns->routerstatus_list);
   }
+  smartlist_free(ns->hs_dir_ring);
+  smartlist_free(ns->missing_microdescs);
 
   digestmap_free(ns->desc_digest_map, NULL);
 
@@ -432,19 +441,16 @@ networkstatus_get_voter_by_id(networkstatus_t *vote,
   return NULL;
 }
 
-/** Check whether the signature <b>sig</b> is correctly signed with the
- * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
- * signing key; otherwise set the good_signature or bad_signature flag on
- * <b>voter</b>, and return 0. */
-int
-networkstatus_check_document_signature(const networkstatus_t *consensus,
-                                       document_signature_t *sig,
-                                       const authority_cert_t *cert)
+/** Helper: if <b>sig</b> on <b>consensus</b> claims to be made with the
+ * signing key in <b>cert</b>, set up <b>check</b> to check it and return 0.
+ * Otherwise return -1. */
+static int
+networkstatus_prepare_signature_check(const networkstatus_t *consensus,
+                                      const document_signature_t *sig,
+                                      const authority_cert_t *cert,
+                                      crypto_pk_checksig_t *check)
 {
   char key_digest[DIGEST_LEN];
-  const int dlen = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
-  char *signed_digest;
-  size_t signed_digest_len;
 
   if (crypto_pk_get_digest(cert->signing_key, key_digest)<0)
     return -1;
@@ -453,23 +459,95 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
                  DIGEST_LEN))
     return -1;
 
-  signed_digest_len = crypto_pk_keysize(cert->signing_key);
-  signed_digest = tor_malloc(signed_digest_len);
-  if (crypto_pk_public_checksig(cert->signing_key,
-                                signed_digest,
-                                signed_digest_len,
-                                sig->signature,
-                                sig->signature_len) < dlen ||
-      tor_memneq(signed_digest, consensus->digests.d[sig->alg], dlen)) {
+  memset(check, 0, sizeof(crypto_pk_checksig_t));
+  check->key = cert->signing_key;
+  check->sig = sig->signature;
+  check->sig_len = sig->signature_len;
+  check->digest = consensus->digests.d[sig->alg];
+  check->digest_len = sig->alg == DIGEST_SHA1 ? DIGEST_LEN : DIGEST256_LEN;
+  return 0;
+}
+
+/** Helper: set the good_signature or bad_signature flag on <b>sig</b>
+ * according to the outcome of <b>check</b>. */
+static void
+networkstatus_note_signature_check(document_signature_t *sig,
+                                   const crypto_pk_checksig_t *check)
+{
+  if (check->good) {
+    sig->good_signature = 1;
+  } else {
     log_warn(LD_DIR, "Got a bad signature on a networkstatus vote");
     sig->bad_signature = 1;
-  } else {
-    sig->good_signature = 1;
   }
-  tor_free(signed_digest);
+}
+
+/** Check whether the signature <b>sig</b> is correctly signed with the
+ * signing key in <b>cert</b>.  Return -1 if <b>cert</b> doesn't match the
+ * signing key; otherwise set the good_signature or bad_signature flag on
+ * <b>voter</b>, and return 0. */
+int
+networkstatus_check_document_signature(const networkstatus_t *consensus,
+                                       document_signature_t *sig,
+                                       const authority_cert_t *cert)
+{
+  crypto_pk_checksig_t check;
+
+  if (networkstatus_prepare_signature_check(consensus, sig, cert, &check)<0)
+    return -1;
+  crypto_pk_public_checksig_batch(&check, 1, 1);
+  networkstatus_note_signature_check(sig, &check);
   return 0;
 }
 
+/** Check, all at once, every as-yet-unchecked signature on
+ * <b>consensus</b> from a recognized authority whose certificate we have,
+ * using as many threads as we have CPUs.  Signatures that we can't check
+ * yet are left for networkstatus_check_consensus_signature() to sort
+ * out. */
+static void
+networkstatus_check_consensus_signatures_batch(networkstatus_t *consensus,
+                                               time_t now)
+{
+  crypto_pk_checksig_t *checks;
+  document_signature_t **sigs;
+  int n_sigs = 0, n_checks = 0, i;
+
+  SMARTLIST_FOREACH(consensus->voters, networkstatus_voter_info_t *, voter,
+                    n_sigs += smartlist_len(voter->sigs));
+  if (!n_sigs)
+    return;
+  checks = tor_malloc(sizeof(crypto_pk_checksig_t) * n_sigs);
+  sigs = tor_malloc(sizeof(document_signature_t *) * n_sigs);
+
+  SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
+                          voter) {
+    SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
+      authority_cert_t *cert;
+      if (sig->good_signature || sig->bad_signature || !sig->signature)
+        continue;
+      if (!trusteddirserver_get_by_v3_auth_digest(sig->identity_digest))
+        continue;
+      cert = authority_cert_get_by_digests(sig->identity_digest,
+                                           sig->signing_key_digest);
+      if (!cert || cert->expires < now)
+        continue;
+      if (networkstatus_prepare_signature_check(consensus, sig, cert,
+                                                &checks[n_checks]) < 0)
+        continue;
+      sigs[n_checks++] = sig;
+    } SMARTLIST_FOREACH_END(sig);
+  } SMARTLIST_FOREACH_END(voter);
+
+  crypto_pk_public_checksig_batch(checks, n_checks,
+                                  get_num_cpus(get_options()));
+  for (i = 0; i < n_checks; ++i)
+    networkstatus_note_signature_check(sigs[i], &checks[i]);
+
+  tor_free(checks);
+  tor_free(sigs);
+}
+
 /** Given a v3 networkstatus consensus in <b>consensus</b>, check every
  * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
  * signature from every recognized authority on it, 0 if there are
@@ -499,6 +577,8 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  networkstatus_check_consensus_signatures_batch(consensus, now);
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
@@ -1288,6 +1368,50 @@ networkstatus_consensus_download_failed(int status_code, const char *flavname)
   }
 }
 
+/** If we should ask for a diff rather than a full consensus of flavor
+ * <b>flavname</b>, return the SHA256 digest of the consensus we want the
+ * diff from.  Otherwise return NULL. */
+const char *
+networkstatus_get_consensus_diff_base(const char *flavname)
+{
+  int flav = networkstatus_parse_flavor_name(flavname);
+  if (flav < 0 || !get_options()->FetchConsensusDiffs ||
+      consensus_diff_failed[flav] ||
+      !networkstatus_get_latest_consensus_by_flavor(flav) ||
+      tor_digest256_is_zero(consensus_text_digest[flav]))
+    return NULL;
+  return consensus_text_digest[flav];
+}
+
+/** Apply the consensus diff <b>diff</b> to our current consensus of flavor
+ * <b>flavname</b>, and return the resulting consensus as a newly allocated
+ * string.  On failure, return NULL, and fetch the next consensus of this
+ * flavor in full. */
+char *
+networkstatus_apply_consensus_diff(const char *flavname, const char *diff)
+{
+  int flav = networkstatus_parse_flavor_name(flavname);
+  char *fname, *base, *result = NULL;
+
+  if (flav < 0)
+    return NULL;
+  if (flav == FLAV_NS) {
+    fname = get_datadir_fname("cached-consensus");
+  } else {
+    char buf[128];
+    tor_snprintf(buf, sizeof(buf), "cached-%s-consensus", flavname);
+    fname = get_datadir_fname(buf);
+  }
+  base = read_file_to_str(fname, RFTS_IGNORE_MISSING, NULL);
+  if (base)
+    result = consdiff_apply_diff(base, diff);
+  if (!result)
+    consensus_diff_failed[flav] = 1;
+  tor_free(base);
+  tor_free(fname);
+  return result;
+}
+
 /** How long do we (as a cache) wait after a consensus becomes non-fresh
  * before trying to fetch another? */
 #define CONSENSUS_MIN_SECONDS_BEFORE_CACHING 120
@@ -1595,6 +1719,12 @@ networkstatus_copy_old_consensus_info(networkstatus_t *new_c,
                          STMT_NIL) {
     /* Okay, so we're looking at the same identity. */
     rs_new->last_dir_503_at = rs_old->last_dir_503_at;
+    /* routerstatus_has_changed() only checks the first DIGEST_LEN bytes of
+     * the descriptor digest. */
+    rs_new->is_unchanged = !routerstatus_has_changed(rs_old, rs_new) &&
+      (new_c->flavor != FLAV_MICRODESC ||
+       tor_memeq(rs_old->descriptor_digest, rs_new->descriptor_digest,
+                 DIGEST256_LEN));
 
     if (tor_memeq(rs_old->descriptor_digest, rs_new->descriptor_digest,
                 DIGEST_LEN)) {
@@ -1641,6 +1771,7 @@ networkstatus_set_current_consensus(const char *consensus,
   consensus_waiting_for_certs_t *waiting = NULL;
   time_t current_valid_after = 0;
   int free_consensus = 1; /* Free 'c' at the end of the function */
+  int ewma_param_changed = 0;
 
   if (flav < 0) {
     /* XXXX we don't handle unrecognized flavors yet. */
@@ -1781,6 +1912,9 @@ networkstatus_set_current_consensus(const char *consensus,
 
   if (flav == usable_consensus_flavor()) {
     notify_control_networkstatus_changed(current_consensus, c);
+    ewma_param_changed =
+      networkstatus_param_changed(current_consensus, c,
+                                  NET_PARAM_CIRCUIT_PRIORITY_HALFLIFE_MSEC);
   }
   if (flav == FLAV_NS) {
     if (current_ns_consensus) {
@@ -1803,6 +1937,8 @@ networkstatus_set_current_consensus(const char *consensus,
     current_md_consensus = c;
     free_consensus = 0; /* avoid free */
   }
+  consdiff_get_digest(consensus_text_digest[flav], consensus);
+  consensus_diff_failed[flav] = 0;
 
   waiting = &consensus_waiting_for_certs[flav];
   if (waiting->consensus &&
@@ -1834,11 +1970,13 @@ networkstatus_set_current_consensus(const char *consensus,
 
     dirvote_recalculate_timing(options, now);
     routerstatus_list_update_named_server_map();
-    cell_ewma_set_scale_factor(options, current_consensus);
+    if (ewma_param_changed)
+      cell_ewma_set_scale_factor(options, current_consensus);
 
     /* XXXX024 this call might be unnecessary here: can changing the
      * current consensus really alter our view of any OR's rate limits? */
-    connection_or_update_token_buckets(get_connection_array(), options);
+    connection_or_update_token_buckets(
+        get_connection_array_by_type(CONN_TYPE_OR), options);
 
     circuit_build_times_new_consensus_params(&circ_times, current_consensus);
   }
@@ -2197,7 +2335,127 @@ networkstatus_dump_bridge_status_to_file(time_t now)
   tor_free(status);
 }
 
-/* DOCDOC get_net_param_from_list */
+/** Names of the consensus parameters that we know by identifier, indexed
+ * by net_param_t. */
+static const char *net_param_names[N_NET_PARAMS] = {
+  "AllowNonearlyExtend",
+  "CircuitPriorityHalflifeMsec",
+  "FastFlagMaxThreshold",
+  "FastFlagMinThreshold",
+  "UseOptimisticData",
+  "adaptive_circwindow_max",
+  "adaptive_circwindow_min",
+  "bwweightscale",
+  "cbtclosequantile",
+  "cbtdisabled",
+  "cbtinitialtimeout",
+  "cbtmaxtimeouts",
+  "cbtmincircs",
+  "cbtmintimeout",
+  "cbtnummodes",
+  "cbtquantile",
+  "cbtrecentcount",
+  "cbttestfreq",
+  "circwindow",
+  "pb_disablepct",
+  "pb_mincircs",
+  "pb_noticepct",
+  "pb_scalecircs",
+  "pb_scalefactor",
+  "perconnbwburst",
+  "perconnbwrate",
+  "refuseunknownexits",
+};
+
+/** Names of the bandwidth-weights in a consensus, indexed by
+ * bw_weight_t. */
+static const char *bw_weight_names[N_BW_WEIGHTS] = {
+  "Wbd", "Wbe", "Wbg", "Wbm", "Wdb", "Web", "Wed", "Wee", "Weg", "Wem",
+  "Wgb", "Wgd", "Wgg", "Wgm", "Wmb", "Wmd", "Wme", "Wmg", "Wmm",
+};
+
+/** Return the index of <b>name</b> within the <b>n</b>-element array
+ * <b>names</b>, or -1 if it isn't there. */
+static int
+find_param_name(const char **names, int n, const char *name, size_t len)
+{
+  int i;
+  for (i = 0; i < n; ++i) {
+    if (!strncmp(names[i], name, len) && names[i][len] == '\0')
+      return i;
+  }
+  return -1;
+}
+
+/** Parse every key=value string in <b>params</b> whose key is one of the
+ * <b>n</b> entries of <b>names</b>, storing its value in the matching slot
+ * of <b>values</b> and setting the matching flag in <b>present</b>.  If a
+ * key appears more than once, the first parseable value wins. */
+static void
+compile_param_list(const smartlist_t *params, const char **names, int n,
+                   int32_t *values, uint8_t *present)
+{
+  memset(values, 0, sizeof(int32_t)*n);
+  memset(present, 0, n);
+  if (!params)
+    return;
+  SMARTLIST_FOREACH_BEGIN(params, const char *, p) {
+    const char *eq = strchr(p, '=');
+    int idx, ok = 0;
+    long v;
+    if (!eq)
+      continue;
+    idx = find_param_name(names, n, p, eq-p);
+    if (idx < 0 || present[idx])
+      continue;
+    v = tor_parse_long(eq+1, 10, INT32_MIN, INT32_MAX, &ok, NULL);
+    if (ok) {
+      values[idx] = (int32_t) v;
+      present[idx] = 1;
+    }
+  } SMARTLIST_FOREACH_END(p);
+}
+
+/** Fill in the typed parameter tables of <b>ns</b> from its net_params and
+ * weight_params lists, so that later lookups by net_param_t or bw_weight_t
+ * don't need to scan and parse the lists.  Call this whenever either list
+ * changes. */
+void
+networkstatus_compile_params(networkstatus_t *ns)
+{
+  /* Catch a name table that has fallen out of step with its enum. */
+  tor_assert(net_param_names[N_NET_PARAMS-1]);
+  tor_assert(bw_weight_names[N_BW_WEIGHTS-1]);
+
+  compile_param_list(ns->net_params, net_param_names, N_NET_PARAMS,
+                     ns->net_param_values, ns->net_param_present);
+  compile_param_list(ns->weight_params, bw_weight_names, N_BW_WEIGHTS,
+                     ns->bw_weight_values, ns->bw_weight_present);
+  ns->params_compiled = 1;
+}
+
+/** Make sure that the value <b>res</b> of the parameter called
+ * <b>param_name</b> is at least <b>min_val</b> and at most <b>max_val</b>,
+ * warning and raising or capping it if necessary.  Return the result. */
+static int32_t
+clamp_net_param(const char *param_name, int32_t res,
+                int32_t min_val, int32_t max_val)
+{
+  if (res < min_val) {
+    log_warn(LD_DIR, "Consensus parameter %s is too small. Got %d, raising to "
+             "%d.", param_name, res, min_val);
+    res = min_val;
+  } else if (res > max_val) {
+    log_warn(LD_DIR, "Consensus parameter %s is too large. Got %d, capping to "
+             "%d.", param_name, res, max_val);
+    res = max_val;
+  }
+  return res;
+}
+
+/** Return the value of the parameter called <b>param_name</b> in the list
+ * of key=value strings <b>net_params</b>, or <b>default_val</b> if there is
+ * none, clamped to lie between <b>min_val</b> and <b>max_val</b>. */
 static int32_t
 get_net_param_from_list(smartlist_t *net_params, const char *param_name,
                         int32_t default_val, int32_t min_val, int32_t max_val)
@@ -2221,17 +2479,7 @@ get_net_param_from_list(smartlist_t *net_params, const char *param_name,
     }
   } SMARTLIST_FOREACH_END(p);
 
-  if (res < min_val) {
-    log_warn(LD_DIR, "Consensus parameter %s is too small. Got %d, raising to "
-             "%d.", param_name, res, min_val);
-    res = min_val;
-  } else if (res > max_val) {
-    log_warn(LD_DIR, "Consensus parameter %s is too large. Got %d, capping to "
-             "%d.", param_name, res, max_val);
-    res = max_val;
-  }
-
-  return res;
+  return clamp_net_param(param_name, res, min_val, max_val);
 }
 
 /** Return the value of a integer parameter from the networkstatus <b>ns</b>
@@ -2240,31 +2488,96 @@ get_net_param_from_list(smartlist_t *net_params, const char *param_name,
  * consensus, or if it has no parameter called <b>param_name</b>.
  * Make sure the value parsed from the consensus is at least
  * <b>min_val</b> and at most <b>max_val</b> and raise/cap the parsed value
- * if necessary. */
+ * if necessary.
+ *
+ * Parameters that Tor uses itself should be looked up with
+ * networkstatus_get_param_by_id() instead. */
 int32_t
 networkstatus_get_param(const networkstatus_t *ns, const char *param_name,
                         int32_t default_val, int32_t min_val, int32_t max_val)
 {
+  int idx;
   if (!ns) /* if they pass in null, go find it ourselves */
     ns = networkstatus_get_latest_consensus();
 
   if (!ns || !ns->net_params)
     return default_val;
 
+  if (ns->params_compiled &&
+      (idx = find_param_name(net_param_names, N_NET_PARAMS, param_name,
+                             strlen(param_name))) >= 0)
+    return networkstatus_get_param_by_id(ns, idx, default_val,
+                                         min_val, max_val);
+
   return get_net_param_from_list(ns->net_params, param_name,
                                  default_val, min_val, max_val);
 }
 
+/** As networkstatus_get_param(), but look up the parameter <b>param</b> in
+ * the compiled parameter table of <b>ns</b>. */
+int32_t
+networkstatus_get_param_by_id(const networkstatus_t *ns, net_param_t param,
+                              int32_t default_val, int32_t min_val,
+                              int32_t max_val)
+{
+  tor_assert((int)param >= 0 && (int)param < N_NET_PARAMS);
+  tor_assert(max_val > min_val);
+  tor_assert(min_val <= default_val);
+  tor_assert(max_val >= default_val);
+
+  if (!ns) /* if they pass in null, go find it ourselves */
+    ns = networkstatus_get_latest_consensus();
+
+  if (!ns || !ns->net_params)
+    return default_val;
+
+  if (!ns->params_compiled)
+    return get_net_param_from_list(ns->net_params, net_param_names[param],
+                                   default_val, min_val, max_val);
+
+  if (!ns->net_param_present[param])
+    return default_val;
+
+  return clamp_net_param(net_param_names[param],
+                         ns->net_param_values[param], min_val, max_val);
+}
+
+/** Return true iff the consensus parameter <b>param</b> has a different
+ * value (or presence) in <b>new_ns</b> than in <b>old_ns</b>.  Either
+ * argument may be NULL.  Consumers that cache state derived from a
+ * parameter can use this to skip recomputing it on a new consensus. */
+int
+networkstatus_param_changed(const networkstatus_t *old_ns,
+                            const networkstatus_t *new_ns,
+                            net_param_t param)
+{
+  int old_present, new_present;
+  tor_assert((int)param >= 0 && (int)param < N_NET_PARAMS);
+  if (!old_ns || !new_ns)
+    return old_ns != new_ns;
+  if (!old_ns->params_compiled || !new_ns->params_compiled)
+    return 1;
+  old_present = old_ns->net_params && old_ns->net_param_present[param];
+  new_present = new_ns->net_params && new_ns->net_param_present[param];
+  if (old_present != new_present)
+    return 1;
+  return old_present &&
+    old_ns->net_param_values[param] != new_ns->net_param_values[param];
+}
+
 /** Return the value of a integer bw weight parameter from the networkstatus
- * <b>ns</b> whose name is <b>weight_name</b>.  If <b>ns</b> is NULL, try
+ * <b>ns</b> whose identifier is <b>weight</b>.  If <b>ns</b> is NULL, try
  * loading the latest consensus ourselves. Return <b>default_val</b> if no
- * latest consensus, or if it has no parameter called <b>weight_name</b>. */
+ * latest consensus, or if it has no such weight. */
 int32_t
-networkstatus_get_bw_weight(networkstatus_t *ns, const char *weight_name,
+networkstatus_get_bw_weight(networkstatus_t *ns, bw_weight_t weight,
                             int32_t default_val)
 {
   int32_t param;
   int max;
+  const char *weight_name;
+  tor_assert((int)weight >= 0 && (int)weight < N_BW_WEIGHTS);
+  weight_name = bw_weight_names[weight];
   if (!ns) /* if they pass in null, go find it ourselves */
     ns = networkstatus_get_latest_consensus();
 
@@ -2272,9 +2585,16 @@ networkstatus_get_bw_weight(networkstatus_t *ns, const char *weight_name,
     return default_val;
 
   max = circuit_build_times_get_bw_scale(ns);
-  param = get_net_param_from_list(ns->weight_params, weight_name,
-                                  default_val, -1,
-                                  BW_MAX_WEIGHT_SCALE);
+  if (!ns->params_compiled) {
+    param = get_net_param_from_list(ns->weight_params, weight_name,
+                                    default_val, -1,
+                                    BW_MAX_WEIGHT_SCALE);
+  } else if (ns->bw_weight_present[weight]) {
+    param = clamp_net_param(weight_name, ns->bw_weight_values[weight],
+                            -1, BW_MAX_WEIGHT_SCALE);
+  } else {
+    param = default_val;
+  }
   if (param > max) {
     log_warn(LD_DIR, "Value of consensus weight %s was too large, capping "
              "to %d", weight_name, max);
@@ -64,6 +64,9 @@ const routerstatus_t *router_get_consensus_status_by_nickname(
                                    int warn_if_unnamed);
 const char *networkstatus_get_router_digest_by_nickname(const char *nickname);
 int networkstatus_nickname_is_unnamed(const char *nickname);
+const char *networkstatus_get_consensus_diff_base(const char *flavname);
+char *networkstatus_apply_consensus_diff(const char *flavname,
+                                         const char *diff);
 void networkstatus_consensus_download_failed(int status_code,
                                              const char *flavname);
 void update_consensus_networkstatus_fetch_time(time_t now);
@@ -100,10 +103,18 @@ int32_t networkstatus_get_param(const networkstatus_t *ns,
                                 const char *param_name,
                                 int32_t default_val, int32_t min_val,
                                 int32_t max_val);
+void networkstatus_compile_params(networkstatus_t *ns);
+int32_t networkstatus_get_param_by_id(const networkstatus_t *ns,
+                                      net_param_t param,
+                                      int32_t default_val, int32_t min_val,
+                                      int32_t max_val);
+int networkstatus_param_changed(const networkstatus_t *old_ns,
+                                const networkstatus_t *new_ns,
+                                net_param_t param);
 int getinfo_helper_networkstatus(control_connection_t *conn,
                                  const char *question, char **answer,
                                  const char **errmsg);
-int32_t networkstatus_get_bw_weight(networkstatus_t *ns, const char *weight,
+int32_t networkstatus_get_bw_weight(networkstatus_t *ns, bw_weight_t weight,
                                     int32_t default_val);
 const char *networkstatus_get_flavor_name(consensus_flavor_t flav);
 int networkstatus_parse_flavor_name(const char *flavname);
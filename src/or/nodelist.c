@@ -16,9 +16,23 @@
 
 #include <string.h>
 
-static void nodelist_drop_node(node_t *node, int remove_from_ht);
+static void nodelist_drop_node(node_t *node);
 static void node_free(node_t *node);
 
+/** One slot in the open-addressed table that maps node ID digests to
+ * nodes.  We keep the first four bytes of the digest next to the pointer,
+ * so that a probe can almost always skip a slot without dereferencing the
+ * node it holds. */
+typedef struct node_id_slot_t {
+  /** The first four bytes of the identity digest of node, if it is set. */
+  uint32_t id_prefix;
+  /** The node in this slot, or NULL if the slot is empty. */
+  node_t *node;
+} node_id_slot_t;
+
+/** The fewest slots we'll allocate for the node ID table. */
+#define NODE_ID_TABLE_MIN_SLOTS 64
+
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
  * is currently in the routerlist, or currently in the consensus we're using.
@@ -26,36 +40,128 @@ static void node_free(node_t *node);
 typedef struct nodelist_t {
   /* A list of all the nodes. */
   smartlist_t *nodes;
-  /* Hash table to map from node ID digest to node. */
-  HT_HEAD(nodelist_map, node_t) nodes_by_id;
+  /* Open-addressed table, with linear probing, to map from node ID digest
+   * to node.  Its size is a power of two, and we keep it at most half
+   * full. */
+  node_id_slot_t *nodes_by_id;
+  /* The number of slots in nodes_by_id. */
+  unsigned int n_id_slots;
+  /* Flavor of the last consensus we gave the nodes routerstatuses from, or
+   * -1 if there hasn't been one. */
+  int consensus_flavor;
 
 } nodelist_t;
 
-static INLINE unsigned int
-node_id_hash(const node_t *node)
+/** The global nodelist. */
+static nodelist_t *the_nodelist=NULL;
+
+/** Return the prefix we store in the node ID table for the identity
+ * <b>digest</b>.  Identity digests are SHA1 outputs, so their leading bits
+ * are already as well mixed as any hash we could compute from them. */
+static INLINE uint32_t
+node_id_prefix(const char *digest)
 {
-#if SIZEOF_INT == 4
-  const uint32_t *p = (const uint32_t*)node->identity;
-  return p[0] ^ p[1] ^ p[2] ^ p[3] ^ p[4];
-#elif SIZEOF_INT == 8
-  const uint64_t *p = (const uint32_t*)node->identity;
-  const uint32_t *p32 = (const uint32_t*)node->identity;
-  return p[0] ^ p[1] ^ p32[4];
-#endif
+  return get_uint32(digest);
 }
 
-static INLINE unsigned int
-node_id_eq(const node_t *node1, const node_t *node2)
+/** Return the slot in the node ID table that holds the node with identity
+ * <b>digest</b>, or the empty slot where it would go if there is none. */
+static node_id_slot_t *
+node_id_table_find_slot(const char *digest)
 {
-  return tor_memeq(node1->identity, node2->identity, DIGEST_LEN);
+  const uint32_t prefix = node_id_prefix(digest);
+  const unsigned int mask = the_nodelist->n_id_slots - 1;
+  unsigned int i = prefix & mask;
+  node_id_slot_t *slot;
+
+  for (;;) {
+    slot = &the_nodelist->nodes_by_id[i];
+    if (!slot->node ||
+        (slot->id_prefix == prefix &&
+         tor_memeq(slot->node->identity, digest, DIGEST_LEN)))
+      return slot;
+    i = (i + 1) & mask;
+  }
 }
 
-HT_PROTOTYPE(nodelist_map, node_t, ht_ent, node_id_hash, node_id_eq);
-HT_GENERATE(nodelist_map, node_t, ht_ent, node_id_hash, node_id_eq,
-            0.6, malloc, realloc, free);
+/** Make the node ID table have room for at least <b>n_nodes</b> nodes
+ * while staying at most half full, rehashing it if it needs to grow. */
+static void
+node_id_table_reserve(int n_nodes)
+{
+  node_id_slot_t *old_slots = the_nodelist->nodes_by_id;
+  unsigned int old_n_slots = the_nodelist->n_id_slots;
+  unsigned int n_slots = old_n_slots ? old_n_slots : NODE_ID_TABLE_MIN_SLOTS;
+  unsigned int i;
 
-/** The global nodelist. */
-static nodelist_t *the_nodelist=NULL;
+  tor_assert(n_nodes >= 0);
+  while (n_slots / 2 < (unsigned int)n_nodes)
+    n_slots *= 2;
+  if (n_slots == old_n_slots)
+    return;
+
+  the_nodelist->nodes_by_id = tor_malloc_zero(n_slots*sizeof(node_id_slot_t));
+  the_nodelist->n_id_slots = n_slots;
+  for (i = 0; i < old_n_slots; ++i) {
+    if (old_slots[i].node)
+      *node_id_table_find_slot(old_slots[i].node->identity) = old_slots[i];
+  }
+  tor_free(old_slots);
+}
+
+/** Remove <b>node</b>, which must be present, from the node ID table. */
+static void
+node_id_table_remove(const node_t *node)
+{
+  const unsigned int mask = the_nodelist->n_id_slots - 1;
+  node_id_slot_t *slots = the_nodelist->nodes_by_id;
+  node_id_slot_t *slot = node_id_table_find_slot(node->identity);
+  unsigned int hole, i, home;
+
+  tor_assert(slot->node == node);
+  hole = i = (unsigned int)(slot - slots);
+
+  /* Rather than leaving a tombstone, move back any later entry in this
+   * run of full slots that would be unreachable with a hole in front of
+   * it.  An entry at i can move to the hole iff its home slot doesn't
+   * lie cyclically in (hole, i]. */
+  for (;;) {
+    i = (i + 1) & mask;
+    if (!slots[i].node)
+      break;
+    home = slots[i].id_prefix & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      slots[hole] = slots[i];
+      hole = i;
+    }
+  }
+  slots[hole].node = NULL;
+  slots[hole].id_prefix = 0;
+}
+
+
+/** Incremented whenever the consensus information about our nodes, their
+ * countries, or their positions in the nodelist change.  Used to tell when
+ * caches indexed by nodelist position are out of date. */
+static unsigned int nodelist_generation = 1;
+
+/** Return the current nodelist generation.  While it stays the same, every
+ * node with a routerstatus keeps that routerstatus, its country, and its
+ * nodelist_idx. */
+unsigned int
+nodelist_get_generation(void)
+{
+  return nodelist_generation;
+}
+
+/** Note that the consensus information about our nodes, or their countries,
+ * or their positions in the nodelist, may have changed. */
+void
+nodelist_note_changed(void)
+{
+  if (++nodelist_generation == 0)
+    nodelist_generation = 1; /* 0 means "never" to our callers. */
+}
 
 /** Create an empty nodelist if we haven't done so already. */
 static void
@@ -63,8 +169,9 @@ init_nodelist(void)
 {
   if (PREDICT_UNLIKELY(the_nodelist == NULL)) {
     the_nodelist = tor_malloc_zero(sizeof(nodelist_t));
-    HT_INIT(nodelist_map, &the_nodelist->nodes_by_id);
+    node_id_table_reserve(0);
     the_nodelist->nodes = smartlist_new();
+    the_nodelist->consensus_flavor = -1;
   }
 }
 
@@ -72,13 +179,10 @@ init_nodelist(void)
 node_t *
 node_get_mutable_by_id(const char *identity_digest)
 {
-  node_t search, *node;
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return NULL;
 
-  memcpy(&search.identity, identity_digest, DIGEST_LEN);
-  node = HT_FIND(nodelist_map, &the_nodelist->nodes_by_id, &search);
-  return node;
+  return node_id_table_find_slot(identity_digest)->node;
 }
 
 /** Return the node_t whose identity is <b>identity_digest</b>, or NULL
@@ -99,13 +203,18 @@ static node_t *
 node_get_or_create(const char *identity_digest)
 {
   node_t *node;
+  node_id_slot_t *slot = node_id_table_find_slot(identity_digest);
 
-  if ((node = node_get_mutable_by_id(identity_digest)))
-    return node;
+  if (slot->node)
+    return slot->node;
 
   node = tor_malloc_zero(sizeof(node_t));
   memcpy(node->identity, identity_digest, DIGEST_LEN);
-  HT_INSERT(nodelist_map, &the_nodelist->nodes_by_id, node);
+  slot->id_prefix = node_id_prefix(identity_digest);
+  slot->node = node;
+  /* Grow after inserting, so that the slot we found stays valid and the
+   * table never becomes more than half full. */
+  node_id_table_reserve(smartlist_len(the_nodelist->nodes) + 1);
 
   smartlist_add(the_nodelist->nodes, node);
   node->nodelist_idx = smartlist_len(the_nodelist->nodes) - 1;
@@ -124,8 +233,8 @@ nodelist_add_routerinfo(routerinfo_t *ri)
   node = node_get_or_create(ri->cache_info.identity_digest);
   node->ri = ri;
 
-  if (node->country == -1)
-    node_set_country(node);
+  /* Cheap unless this node is new or its address has changed. */
+  node_set_country(node);
 
   if (authdir_mode(get_options())) {
     const char *discard=NULL;
@@ -177,18 +286,33 @@ nodelist_set_consensus(networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v2(options) || authdir_mode_v3(options);
+  int same_flavor;
+  int n_changed = 0;
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
+  /* Routerstatuses marked is_unchanged are only unchanged with respect to
+   * the last consensus of their own flavor. */
+  same_flavor = the_nodelist->consensus_flavor == (int)ns->flavor;
+  the_nodelist->consensus_flavor = ns->flavor;
 
   SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
                     node->rs = NULL);
 
+  /* Make room for every node in the consensus up front, so that we
+   * rehash the ID table at most once while adding them. */
+  node_id_table_reserve(smartlist_len(the_nodelist->nodes) +
+                        smartlist_len(ns->routerstatus_list));
+
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    /* If this router is listed just as it was last time, its address and
+     * descriptor are the same, so its microdescriptor and country are
+     * already right: we only need to point it at the new entry. */
+    int unchanged = same_flavor && rs->is_unchanged;
     node->rs = rs;
-    if (ns->flavor == FLAV_MICRODESC) {
+    if (ns->flavor == FLAV_MICRODESC && (!unchanged || !node->md)) {
       if (node->md == NULL ||
           tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
         if (node->md)
@@ -200,9 +324,14 @@ nodelist_set_consensus(networkstatus_t *ns)
       }
     }
 
-    node_set_country(node);
+    if (!unchanged) {
+      node_set_country(node);
+      ++n_changed;
+    }
 
-    /* If we're not an authdir, believe others. */
+    /* If we're not an authdir, believe others.  We do this even for
+     * unchanged entries, since we may have changed our minds about some of
+     * these flags locally since the last consensus. */
     if (!authdir) {
       node->is_valid = rs->is_valid;
       node->is_running = rs->is_flagged_running;
@@ -217,7 +346,11 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   } SMARTLIST_FOREACH_END(rs);
 
+  log_info(LD_DIR, "%d of %d routerstatus entries changed since the last "
+           "consensus.", n_changed, smartlist_len(ns->routerstatus_list));
+
   nodelist_purge();
+  nodelist_note_changed();
 
   if (! authdir) {
     SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
@@ -265,7 +398,7 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
   if (node && node->ri == ri) {
     node->ri = NULL;
     if (! node_is_usable(node)) {
-      nodelist_drop_node(node, 1);
+      nodelist_drop_node(node);
       node_free(node);
     }
   }
@@ -274,14 +407,11 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
 /** Remove <b>node</b> from the nodelist.  (Asserts that it was there to begin
  * with.) */
 static void
-nodelist_drop_node(node_t *node, int remove_from_ht)
+nodelist_drop_node(node_t *node)
 {
   node_t *tmp;
   int idx;
-  if (remove_from_ht) {
-    tmp = HT_REMOVE(nodelist_map, &the_nodelist->nodes_by_id, node);
-    tor_assert(tmp == node);
-  }
+  node_id_table_remove(node);
 
   idx = node->nodelist_idx;
   tor_assert(idx >= 0);
@@ -293,6 +423,7 @@ nodelist_drop_node(node_t *node, int remove_from_ht)
     tmp->nodelist_idx = idx;
   }
   node->nodelist_idx = -1;
+  nodelist_note_changed();
 }
 
 /** Release storage held by <b>node</b>  */
@@ -312,13 +443,14 @@ node_free(node_t *node)
 void
 nodelist_purge(void)
 {
-  node_t **iter;
+  int i;
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
-  /* Remove the non-usable nodes. */
-  for (iter = HT_START(nodelist_map, &the_nodelist->nodes_by_id); iter; ) {
-    node_t *node = *iter;
+  /* Remove the non-usable nodes.  We walk the list backwards, since
+   * dropping a node moves the last node into its place. */
+  for (i = smartlist_len(the_nodelist->nodes) - 1; i >= 0; --i) {
+    node_t *node = smartlist_get(the_nodelist->nodes, i);
 
     if (node->md && !node->rs) {
       /* An md is only useful if there is an rs. */
@@ -326,11 +458,8 @@ nodelist_purge(void)
       node->md = NULL;
     }
 
-    if (node_is_usable(node)) {
-      iter = HT_NEXT(nodelist_map, &the_nodelist->nodes_by_id, iter);
-    } else {
-      iter = HT_NEXT_RMV(nodelist_map, &the_nodelist->nodes_by_id, iter);
-      nodelist_drop_node(node, 0);
+    if (!node_is_usable(node)) {
+      nodelist_drop_node(node);
       node_free(node);
     }
   }
@@ -344,7 +473,7 @@ nodelist_free_all(void)
   if (PREDICT_UNLIKELY(the_nodelist == NULL))
     return;
 
-  HT_CLEAR(nodelist_map, &the_nodelist->nodes_by_id);
+  tor_free(the_nodelist->nodes_by_id);
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
     node->nodelist_idx = -1;
     node_free(node);
@@ -353,6 +482,7 @@ nodelist_free_all(void)
   smartlist_free(the_nodelist->nodes);
 
   tor_free(the_nodelist);
+  nodelist_note_changed();
 }
 
 /** Check that the nodelist is internally consistent, and consistent with
@@ -407,10 +537,21 @@ nodelist_assert_ok(void)
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
     tor_assert(digestmap_get(dm, node->identity) != NULL);
     tor_assert(node_sl_idx == node->nodelist_idx);
+    tor_assert(node_id_table_find_slot(node->identity)->node == node);
   } SMARTLIST_FOREACH_END(node);
 
-  tor_assert((long)smartlist_len(the_nodelist->nodes) ==
-             (long)HT_SIZE(&the_nodelist->nodes_by_id));
+  {
+    unsigned int i, n_full = 0;
+    for (i = 0; i < the_nodelist->n_id_slots; ++i) {
+      const node_id_slot_t *slot = &the_nodelist->nodes_by_id[i];
+      if (slot->node) {
+        tor_assert(slot->id_prefix == node_id_prefix(slot->node->identity));
+        ++n_full;
+      }
+    }
+    tor_assert((long)smartlist_len(the_nodelist->nodes) == (long)n_full);
+    tor_assert(n_full <= the_nodelist->n_id_slots / 2);
+  }
 
   digestmap_free(dm, NULL);
 }
@@ -638,12 +779,13 @@ node_exit_policy_rejects_all(const node_t *node)
     return 1;
 
   if (node->ri)
-    return node->ri->policy_is_reject_star;
-  else if (node->md)
+    return router_exit_policy_rejects_all(node->ri);
+  if (node->md) {
+    microdesc_parse_if_needed(node->md);
     return node->md->exit_policy == NULL ||
       short_policy_is_reject_star(node->md->exit_policy);
-  else
-    return 1;
+  }
+  return 1;
 }
 
 /** Return list of tor_addr_port_t with all OR ports (in the sense IP
@@ -657,7 +799,7 @@ node_exit_policy_rejects_all(const node_t *node)
 smartlist_t *
 node_get_all_orports(const node_t *node)
 {
-  smartlist_t *sl = smartlist_new();
+  smartlist_t *sl = smartlist_new_small();
 
   if (node->ri != NULL) {
     if (node->ri->addr != 0) {
@@ -813,9 +955,10 @@ node_get_declared_family(const node_t *node)
 {
   if (node->ri && node->ri->declared_family)
     return node->ri->declared_family;
-  else if (node->md && node->md->family)
+  if (node->md) {
+    microdesc_parse_if_needed(node->md);
     return node->md->family;
-  else
-    return NULL;
+  }
+  return NULL;
 }
 
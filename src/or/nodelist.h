@@ -25,6 +25,8 @@ void nodelist_purge(void);
 
 void nodelist_free_all(void);
 void nodelist_assert_ok(void);
+unsigned int nodelist_get_generation(void);
+void nodelist_note_changed(void);
 
 const node_t *node_get_by_nickname(const char *nickname, int warn_if_unnamed);
 void node_get_verbose_nickname(const node_t *node,
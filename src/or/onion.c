@@ -10,7 +10,9 @@
  * parsing and creation.
  **/
 
+#define ONION_PRIVATE
 #include "or.h"
+#include "circuitbuild.h"
 #include "circuitlist.h"
 #include "config.h"
 #include "onion.h"
@@ -21,15 +23,59 @@
 typedef struct onion_queue_t {
   or_circuit_t *circ;
   char *onionskin;
-  time_t when_added;
+  /** When we queued this request, from tor_monotime_nsec(). */
+  uint64_t when_added;
   struct onion_queue_t *next;
+  struct onion_queue_t *prev;
 } onion_queue_t;
 
+/** If nonzero, the monotonic time in nsec that the onion queue uses
+ * instead of the real clock.  Only unit tests set this. */
+static uint64_t onion_queue_fake_now_nsec = 0;
+
+/** Make the onion queue believe that the monotonic time is
+ * <b>now_nsec</b>, or use the real clock again if it is 0. */
+void
+onion_queue_set_time_for_testing_(uint64_t now_nsec)
+{
+  onion_queue_fake_now_nsec = now_nsec;
+}
+
+/** Return the current monotonic time, in nsec, for the onion queue. */
+static INLINE uint64_t
+onion_queue_now_nsec(void)
+{
+  if (PREDICT_UNLIKELY(onion_queue_fake_now_nsec))
+    return onion_queue_fake_now_nsec;
+  return tor_monotime_nsec();
+}
+
+/** Return the current monotonic time, in whole seconds, for aging queued
+ * requests and measuring ol_drain_rate.  Using the monotonic clock keeps a
+ * jump in the system clock from culling the whole queue at once. */
+static INLINE time_t
+onion_queue_now_sec(void)
+{
+  return (time_t)(onion_queue_now_nsec() / 1000000000);
+}
+
+/** Return how many whole seconds <b>q</b> has been queued, as of the
+ * monotonic second <b>now</b>. */
+static INLINE int
+onion_queue_entry_age(const onion_queue_t *q, time_t now)
+{
+  return (int)(now - (time_t)(q->when_added / 1000000000));
+}
+
 /** 5 seconds on the onion queue til we just send back a destroy */
 #define ONIONQUEUE_WAIT_CUTOFF 5
+/** If the oldest request on the onion queue has waited this long, we're
+ * overloaded: answer the newest requests first, since the client is likely
+ * to have given up on the oldest ones before we'd get to them. */
+#define ONIONQUEUE_OVERLOAD_AGE 2
 
-/** First and last elements in the linked list of circuits waiting for CPU
- * workers, or NULL if the list is empty.
+/** First and last elements in the doubly linked list of circuits waiting
+ * for CPU workers, oldest first, or NULL if the list is empty.
  * @{ */
 static onion_queue_t *ol_list=NULL;
 static onion_queue_t *ol_tail=NULL;
@@ -37,33 +83,108 @@ static onion_queue_t *ol_tail=NULL;
 /** Length of ol_list */
 static int ol_length=0;
 
-/** Add <b>circ</b> to the end of ol_list and return 0, except
- * if ol_list is too long, in which case do nothing and return -1.
+/** How much weight do we give the old estimate of ol_drain_rate when we
+ * fold in a new second's worth of data? */
+#define ONIONQUEUE_RATE_ALPHA 0.7
+/** Our estimate of how many requests a second the cpuworkers take off
+ * ol_list when there's always something on it; meaningless unless
+ * ol_drain_rate_known is set. */
+static double ol_drain_rate = 0.0;
+static int ol_drain_rate_known = 0;
+/** The second for which we're counting how many requests we take off
+ * ol_list; how many we've taken so far; and whether ol_list has been
+ * nonempty for the whole second. */
+static time_t ol_rate_second = 0;
+static int ol_rate_n_taken = 0;
+static int ol_rate_saturated = 0;
+
+/** If <b>now</b> (as from onion_queue_now_sec()) starts a new second,
+ * finish measuring the last one: fold it into ol_drain_rate if the queue
+ * stayed nonempty all through it, since only then do its numbers say how
+ * fast the workers can go. */
+static void
+onion_queue_update_rate(time_t now)
+{
+  if (now == ol_rate_second)
+    return;
+  if (ol_rate_saturated && now == ol_rate_second + 1) {
+    if (ol_drain_rate_known)
+      ol_drain_rate = ONIONQUEUE_RATE_ALPHA * ol_drain_rate +
+        (1.0 - ONIONQUEUE_RATE_ALPHA) * ol_rate_n_taken;
+    else
+      ol_drain_rate = ol_rate_n_taken;
+    ol_drain_rate_known = 1;
+  }
+  ol_rate_second = now;
+  ol_rate_n_taken = 0;
+  ol_rate_saturated = ol_length > 0;
+}
+
+/** Remove <b>victim</b> from ol_list and free it.  Leave its circuit
+ * alone. */
+static void
+onion_queue_entry_remove(onion_queue_t *victim)
+{
+  if (victim->prev)
+    victim->prev->next = victim->next;
+  else
+    ol_list = victim->next;
+  if (victim->next)
+    victim->next->prev = victim->prev;
+  else
+    ol_tail = victim->prev;
+  --ol_length;
+  tor_assert(ol_length >= 0);
+  if (!ol_length)
+    ol_rate_saturated = 0;
+
+  victim->circ->onionqueue_entry = NULL;
+  tor_free(victim->onionskin);
+  tor_free(victim);
+}
+
+/** Remove the oldest request from ol_list, and close its circuit; count it
+ * as dropped for <b>reason</b>. */
+static void
+onion_queue_drop_oldest(onion_drop_reason_t reason)
+{
+  or_circuit_t *circ = ol_list->circ;
+  rep_hist_note_onionskin_dropped(reason);
+  onion_queue_entry_remove(ol_list);
+  circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
+}
+
+/** Close every circuit whose request has been on ol_list for
+ * ONIONQUEUE_WAIT_CUTOFF seconds or more, as of the monotonic second
+ * <b>now</b>. */
+static void
+onion_queue_cull_expired(time_t now)
+{
+  while (ol_list &&
+         onion_queue_entry_age(ol_list, now) >= ONIONQUEUE_WAIT_CUTOFF) {
+    log_info(LD_CIRC,
+             "Circuit create request is too old; canceling due to overload.");
+    onion_queue_drop_oldest(ONION_DROP_EXPIRED);
+  }
+}
+
+/** Add <b>circ</b> to the end of ol_list and return 0.  If ol_list is
+ * already as long as we allow, drop its oldest request to make room: that
+ * one is closest to timing out at its client anyway.  If MaxOnionsPending
+ * is 0, we queue nothing: return -1, and leave <b>circ</b> alone.
  */
 int
 onion_pending_add(or_circuit_t *circ, char *onionskin)
 {
   onion_queue_t *tmp;
-  time_t now = time(NULL);
+  uint64_t now_nsec = onion_queue_now_nsec();
+  time_t now = (time_t)(now_nsec / 1000000000);
 
-  tmp = tor_malloc_zero(sizeof(onion_queue_t));
-  tmp->circ = circ;
-  tmp->onionskin = onionskin;
-  tmp->when_added = now;
+  tor_assert(!circ->onionqueue_entry);
+  onion_queue_update_rate(now);
+  onion_queue_cull_expired(now);
 
-  if (!ol_tail) {
-    tor_assert(!ol_list);
-    tor_assert(!ol_length);
-    ol_list = tmp;
-    ol_tail = tmp;
-    ol_length++;
-    return 0;
-  }
-
-  tor_assert(ol_list);
-  tor_assert(!ol_tail->next);
-
-  if (ol_length >= get_options()->MaxOnionsPending) {
+  if (ol_length >= (int)get_options()->MaxOnionsPending) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
@@ -76,88 +197,262 @@ onion_pending_add(or_circuit_t *circ, char *onionskin)
                "restricted exit policy.%s",m);
       tor_free(m);
     }
-    tor_free(tmp);
-    return -1;
+    /* MaxOnionsPending may have shrunk since we queued these. */
+    while (ol_length && ol_length >= (int)get_options()->MaxOnionsPending)
+      onion_queue_drop_oldest(ONION_DROP_QUEUE_FULL);
+    if (!get_options()->MaxOnionsPending) {
+      rep_hist_note_onionskin_dropped(ONION_DROP_QUEUE_FULL);
+      return -1;
+    }
   }
 
-  ol_length++;
-  ol_tail->next = tmp;
+  tmp = tor_malloc_zero(sizeof(onion_queue_t));
+  tmp->circ = circ;
+  tmp->onionskin = onionskin;
+  tmp->when_added = now_nsec;
+  circ->onionqueue_entry = tmp;
+
+  tmp->prev = ol_tail;
+  if (ol_tail)
+    ol_tail->next = tmp;
+  else
+    ol_list = tmp;
   ol_tail = tmp;
-  while ((int)(now - ol_list->when_added) >= ONIONQUEUE_WAIT_CUTOFF) {
-    /* cull elderly requests. */
-    circ = ol_list->circ;
-    onion_pending_remove(ol_list->circ);
-    log_info(LD_CIRC,
-             "Circuit create request is too old; canceling due to overload.");
-    circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_RESOURCELIMIT);
-  }
+  ol_length++;
   return 0;
 }
 
-/** Remove the first item from ol_list and return it, or return
- * NULL if the list is empty.
+/** Return the number of circuits waiting for a CPU worker. */
+int
+onion_pending_len(void)
+{
+  return ol_length;
+}
+
+/** Return how many msec we expect a new request to wait on ol_list, or 0
+ * if the list is empty or we don't know yet how fast it drains. */
+int
+onion_pending_estimated_wait_msec(void)
+{
+  double msec;
+  onion_queue_update_rate(onion_queue_now_sec());
+  if (!ol_length || !ol_drain_rate_known)
+    return 0;
+  if (ol_drain_rate < 1.0 / ONIONQUEUE_WAIT_CUTOFF)
+    return ONIONQUEUE_WAIT_CUTOFF * 1000;
+  msec = (ol_length + 1) * 1000.0 / ol_drain_rate;
+  if (msec > ONIONQUEUE_WAIT_CUTOFF * 1000)
+    return ONIONQUEUE_WAIT_CUTOFF * 1000;
+  return (int)msec;
+}
+
+/** Return true iff we should refuse a new CREATE request right away,
+ * because we expect it to wait on ol_list longer than MaxOnionQueueDelay
+ * (or, if that's 0, half our circuit build timeout: any longer at one hop,
+ * and the client would likely give up on the circuit anyway). */
+int
+onion_pending_is_overloaded(void)
+{
+  int limit = get_options()->MaxOnionQueueDelay;
+  int wait = onion_pending_estimated_wait_msec();
+
+  if (!wait)
+    return 0;
+  if (!limit) {
+    limit = (int) (circ_times.timeout_ms / 2);
+    if (limit > ONIONQUEUE_WAIT_CUTOFF * 1000)
+      limit = ONIONQUEUE_WAIT_CUTOFF * 1000;
+  }
+  return wait > limit;
+}
+
+/** Remove the next item to process from ol_list and return it, or return
+ * NULL if the list is empty.  Requests that have waited too long are
+ * dropped rather than returned.  Normally we return the oldest request;
+ * but if even the oldest has waited ONIONQUEUE_OVERLOAD_AGE seconds, we
+ * return the newest.  Set *<b>when_added_out</b> to when we queued the
+ * request we return, as from tor_monotime_nsec().
  */
 or_circuit_t *
-onion_next_task(char **onionskin_out)
+onion_next_task(char **onionskin_out, uint64_t *when_added_out)
 {
   or_circuit_t *circ;
+  onion_queue_t *next;
+  time_t now = onion_queue_now_sec();
 
+  onion_queue_update_rate(now);
+  onion_queue_cull_expired(now);
   if (!ol_list)
     return NULL; /* no onions pending, we're done */
 
-  tor_assert(ol_list->circ);
-  tor_assert(ol_list->circ->p_conn); /* make sure it's still valid */
   tor_assert(ol_length > 0);
-  circ = ol_list->circ;
-  *onionskin_out = ol_list->onionskin;
-  ol_list->onionskin = NULL; /* prevent free. */
-  onion_pending_remove(ol_list->circ);
+  if (onion_queue_entry_age(ol_list, now) >= ONIONQUEUE_OVERLOAD_AGE)
+    next = ol_tail;
+  else
+    next = ol_list;
+
+  tor_assert(next->circ);
+  tor_assert(next->circ->p_conn); /* make sure it's still valid */
+  circ = next->circ;
+  *onionskin_out = next->onionskin;
+  *when_added_out = next->when_added;
+  next->onionskin = NULL; /* prevent free. */
+  ++ol_rate_n_taken;
+  onion_queue_entry_remove(next);
   return circ;
 }
 
-/** Go through ol_list, find the onion_queue_t element which points to
- * circ, remove and free that element. Leave circ itself alone.
+/** If <b>circ</b> is on ol_list, remove and free its onion_queue_t
+ * element. Leave circ itself alone.
  */
 void
 onion_pending_remove(or_circuit_t *circ)
 {
-  onion_queue_t *tmpo, *victim;
+  if (!circ->onionqueue_entry) {
+    log_debug(LD_GENERAL,
+              "circ (p_circ_id %d) not in list, probably at cpuworker.",
+              circ->p_circ_id);
+    return;
+  }
+  rep_hist_note_onionskin_dropped(ONION_DROP_CIRCUIT_CLOSED);
+  onion_queue_entry_remove(circ->onionqueue_entry);
+}
 
-  if (!ol_list)
-    return; /* nothing here. */
-
-  /* first check to see if it's the first entry */
-  tmpo = ol_list;
-  if (tmpo->circ == circ) {
-    /* it's the first one. remove it from the list. */
-    ol_list = tmpo->next;
-    if (!ol_list)
-      ol_tail = NULL;
-    ol_length--;
-    victim = tmpo;
-  } else { /* we need to hunt through the rest of the list */
-    for ( ;tmpo->next && tmpo->next->circ != circ; tmpo=tmpo->next) ;
-    if (!tmpo->next) {
-      log_debug(LD_GENERAL,
-                "circ (p_circ_id %d) not in list, probably at cpuworker.",
-                circ->p_circ_id);
-      return;
+/*----------------------------------------------------------------------*/
+
+/** How many DH keypairs for circuit handshakes do we try to keep ready? */
+#define DH_POOL_SIZE 16
+
+/** Return a new DH_TYPE_CIRCUIT object with its keypair already generated,
+ * or NULL on failure. */
+static crypto_dh_t *
+onion_dh_new_keypair(void)
+{
+  crypto_dh_t *dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  if (dh && crypto_dh_generate_public(dh) < 0) {
+    crypto_dh_free(dh);
+    dh = NULL;
+  }
+  return dh;
+}
+
+#ifdef USE_PTHREADS
+/** Protects dh_pool and dh_pool_shutting_down.  NULL until we start the
+ * thread that fills dh_pool. */
+static tor_mutex_t *dh_pool_lock = NULL;
+/** Signalled when we take a keypair from dh_pool, or want its thread to
+ * exit. */
+static tor_cond_t *dh_pool_cond = NULL;
+/** Ready-to-use DH_TYPE_CIRCUIT objects, each with a fresh keypair. */
+static smartlist_t *dh_pool = NULL;
+/** True iff the pool's thread should exit. */
+static int dh_pool_shutting_down = 0;
+
+/** Body of the thread that keeps dh_pool full. */
+static void
+dh_pool_thread_main(void *arg)
+{
+  (void)arg;
+  tor_mutex_acquire(dh_pool_lock);
+  while (!dh_pool_shutting_down) {
+    crypto_dh_t *dh;
+    if (smartlist_len(dh_pool) >= DH_POOL_SIZE) {
+      tor_cond_wait(dh_pool_cond, dh_pool_lock);
+      continue;
+    }
+    tor_mutex_release(dh_pool_lock);
+    dh = onion_dh_new_keypair();
+    tor_mutex_acquire(dh_pool_lock);
+    if (!dh) {
+      log_warn(LD_CRYPTO, "Couldn't generate a DH keypair; no longer "
+               "precomputing them.");
+      break;
     }
-    /* now we know tmpo->next->circ == circ */
-    victim = tmpo->next;
-    tmpo->next = victim->next;
-    if (ol_tail == victim)
-      ol_tail = tmpo;
-    ol_length--;
+    if (dh_pool_shutting_down) {
+      crypto_dh_free(dh);
+      break;
+    }
+    smartlist_add(dh_pool, dh);
   }
+  tor_mutex_release(dh_pool_lock);
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+#endif
 
-  /* now victim points to the element that needs to be removed */
+/** Start precomputing DH keypairs for circuit handshakes in the
+ * background, if we can.  Until we call this, and where we have no
+ * threads, we generate each keypair when we need it. */
+void
+onion_dh_pool_init(void)
+{
+#ifdef USE_PTHREADS
+  crypto_dh_t *dh;
+  if (dh_pool_lock)
+    return;
+  /* Make the first one here, so that the DH parameters get initialized in
+   * the main thread. */
+  if (!(dh = onion_dh_new_keypair()))
+    return;
+  if (!(dh_pool_cond = tor_cond_new())) {
+    log_warn(LD_GENERAL, "Couldn't create condition for the DH pool.");
+    crypto_dh_free(dh);
+    return;
+  }
+  dh_pool = smartlist_new();
+  smartlist_add(dh_pool, dh);
+  dh_pool_lock = tor_mutex_new();
+  if (spawn_func(dh_pool_thread_main, NULL) < 0) {
+    log_warn(LD_GENERAL, "Couldn't launch the DH pool thread.");
+    tor_mutex_free(dh_pool_lock);
+    tor_cond_free(dh_pool_cond);
+    SMARTLIST_FOREACH(dh_pool, crypto_dh_t *, d, crypto_dh_free(d));
+    smartlist_free(dh_pool);
+    dh_pool_lock = NULL;
+    dh_pool_cond = NULL;
+    dh_pool = NULL;
+  }
+#endif
+}
 
-  tor_free(victim->onionskin);
-  tor_free(victim);
+/** Tell the DH pool's thread to stop, and free every keypair in the pool.
+ * (We leave the lock and condition alone, in case the thread is still
+ * using them.) */
+void
+onion_dh_pool_free_all(void)
+{
+#ifdef USE_PTHREADS
+  if (!dh_pool_lock)
+    return;
+  tor_mutex_acquire(dh_pool_lock);
+  dh_pool_shutting_down = 1;
+  SMARTLIST_FOREACH(dh_pool, crypto_dh_t *, dh, crypto_dh_free(dh));
+  smartlist_clear(dh_pool);
+  tor_cond_signal_all(dh_pool_cond);
+  tor_mutex_release(dh_pool_lock);
+#endif
 }
 
-/*----------------------------------------------------------------------*/
+/** Return a DH_TYPE_CIRCUIT object with a fresh keypair that nobody else
+ * has used: from the pool if we can, or else generated now.  Return NULL
+ * on failure. */
+static crypto_dh_t *
+onion_dh_take(void)
+{
+#ifdef USE_PTHREADS
+  if (dh_pool_lock) {
+    crypto_dh_t *dh = NULL;
+    tor_mutex_acquire(dh_pool_lock);
+    if (smartlist_len(dh_pool))
+      dh = smartlist_pop_last(dh_pool);
+    tor_cond_signal_one(dh_pool_cond);
+    tor_mutex_release(dh_pool_lock);
+    if (dh)
+      return dh;
+  }
+#endif
+  return onion_dh_new_keypair();
+}
 
 /** Given a router's 128 byte public key,
  * stores the following in onion_skin_out:
@@ -186,7 +481,7 @@ onion_skin_create(crypto_pk_t *dest_router_key,
   *handshake_state_out = NULL;
   memset(onion_skin_out, 0, ONIONSKIN_CHALLENGE_LEN);
 
-  if (!(dh = crypto_dh_new(DH_TYPE_CIRCUIT)))
+  if (!(dh = onion_dh_take()))
     goto err;
 
   dhbytes = crypto_dh_get_bytes(dh);
@@ -260,7 +555,7 @@ onion_skin_server_handshake(const char *onion_skin, /*ONIONSKIN_CHALLENGE_LEN*/
     goto err;
   }
 
-  dh = crypto_dh_new(DH_TYPE_CIRCUIT);
+  dh = onion_dh_take();
   if (!dh) {
     log_warn(LD_BUG, "Couldn't allocate DH key");
     goto err;
@@ -436,13 +731,9 @@ fast_client_handshake(const uint8_t *handshake_state,/*DIGEST_LEN bytes*/
 void
 clear_pending_onions(void)
 {
-  while (ol_list) {
-    onion_queue_t *victim = ol_list;
-    ol_list = victim->next;
-    tor_free(victim->onionskin);
-    tor_free(victim);
-  }
-  ol_list = ol_tail = NULL;
-  ol_length = 0;
+  while (ol_list)
+    onion_queue_entry_remove(ol_list);
+  tor_assert(!ol_tail);
+  tor_assert(!ol_length);
 }
 
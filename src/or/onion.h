@@ -13,9 +13,20 @@
 #define _TOR_ONION_H
 
 int onion_pending_add(or_circuit_t *circ, char *onionskin);
-or_circuit_t *onion_next_task(char **onionskin_out);
+or_circuit_t *onion_next_task(char **onionskin_out,
+                               uint64_t *when_added_out);
+int onion_pending_len(void);
+int onion_pending_estimated_wait_msec(void);
+int onion_pending_is_overloaded(void);
 void onion_pending_remove(or_circuit_t *circ);
 
+#ifdef ONION_PRIVATE
+void onion_queue_set_time_for_testing_(uint64_t now_nsec);
+#endif
+
+void onion_dh_pool_init(void);
+void onion_dh_pool_free_all(void);
+
 int onion_skin_create(crypto_pk_t *router_key,
                       crypto_dh_t **handshake_state_out,
                       char *onion_skin_out);
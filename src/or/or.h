@@ -901,10 +901,42 @@ typedef struct var_cell_t {
 
 /** A cell as packed for writing to the network. */
 typedef struct packed_cell_t {
-  struct packed_cell_t *next; /**< Next cell queued on this circuit. */
   char body[CELL_NETWORK_SIZE]; /**< Cell as packed for network. */
 } packed_cell_t;
 
+/** How many packed cells do we store in each cell_queue_block_t? */
+#define CELL_QUEUE_BLOCK_N_CELLS 8
+
+/** A block of packed cells stored back to back, as part of a cell_queue_t.
+ * Cells are appended at <b>last</b> and removed from <b>first</b>; once
+ * every slot has been used and drained, the block is released. */
+typedef struct cell_queue_block_t {
+  struct cell_queue_block_t *next; /**< Next block in the queue. */
+  uint16_t first; /**< Index of the first queued cell in <b>cells</b>. */
+  uint16_t last; /**< Index one past the last queued cell in <b>cells</b>. */
+  /** When was each cell added to this block?  In milliseconds, from an
+   * arbitrary origin; see cell_queue_now_msec(). */
+  uint32_t inserted_time[CELL_QUEUE_BLOCK_N_CELLS];
+  /** How many outbuf chunks still refer to cells in this block? */
+  uint16_t n_buf_refs;
+  /** True iff the queue is done with this block, and we should release it
+   * as soon as n_buf_refs drops to zero. */
+  unsigned int released : 1;
+  packed_cell_t cells[CELL_QUEUE_BLOCK_N_CELLS]; /**< Cell storage. */
+} cell_queue_block_t;
+
+/** How many buckets are there in a latency_histogram_t? */
+#define LATENCY_HISTOGRAM_N_BUCKETS 24
+
+/** A histogram of latencies, with buckets of exponentially growing width.
+ * Bucket 0 counts latencies of 0; bucket i, for 0 < i < N_BUCKETS-1,
+ * counts latencies from 2^(i-1) up to 2^i - 1; and the last bucket counts
+ * everything larger.  The units depend on the user; see
+ * latency_histogram_add(). */
+typedef struct latency_histogram_t {
+  uint64_t counts[LATENCY_HISTOGRAM_N_BUCKETS];
+} latency_histogram_t;
+
 /** Number of cells added to a circuit queue including their insertion
  * time on 10 millisecond detail; used for buffer statistics. */
 typedef struct insertion_time_elem_t {
@@ -923,8 +955,10 @@ typedef struct insertion_time_queue_t {
 /** A queue of cells on a circuit, waiting to be added to the
  * or_connection_t's outbuf. */
 typedef struct cell_queue_t {
-  packed_cell_t *head; /**< The first cell, or NULL if the queue is empty. */
-  packed_cell_t *tail; /**< The last cell, or NULL if the queue is empty. */
+  /** The block holding the first cell, or NULL if the queue is empty. */
+  cell_queue_block_t *head;
+  /** The block holding the last cell, or NULL if the queue is empty. */
+  cell_queue_block_t *tail;
   int n; /**< The number of cells in the queue. */
   insertion_time_queue_t *insertion_times; /**< Insertion times of cells. */
 } cell_queue_t;
@@ -1021,6 +1055,18 @@ typedef struct connection_t {
    * or has no socket. */
   tor_socket_t s;
   int conn_array_index; /**< Index into the global connection array. */
+  /** Index into the list of connections with this one's type; see
+   * get_connection_array_by_type(). */
+  int conn_type_index;
+  /** Index into the list of connections blocked on bandwidth, or -1 if
+   * this connection isn't there.  See connection_note_blocked_on_bw(). */
+  int bw_blocked_idx;
+  /** When should run_connection_housekeeping() next look at this
+   * connection?  0 if it never needs to. */
+  time_t housekeeping_due;
+  /** Index into the housekeeping priority queue, or -1 if this connection
+   * isn't there.  See connection_schedule_housekeeping(). */
+  int housekeeping_idx;
 
   struct event *read_event; /**< Libevent event structure. */
   struct event *write_event; /**< Libevent event structure. */
@@ -1230,12 +1276,26 @@ typedef struct or_connection_t {
   unsigned int is_connection_with_client:1;
   /** True iff this is an outgoing connection. */
   unsigned int is_outgoing:1;
+  /** True iff we've told the kernel to hold back partial segments on this
+   * connection's socket.  See connection_or_set_corked(). */
+  unsigned int is_corked:1;
+  /** True iff a cpuworker thread is running a step of our TLS handshake.
+   * Until it's done, it owns <b>tls</b> and our socket: the main thread
+   * must not touch either, or free this connection. */
+  unsigned int tls_handshake_in_worker:1;
+  /** True iff we were asked to close our socket while
+   * tls_handshake_in_worker was set, and must do so once it's clear. */
+  unsigned int close_after_worker:1;
   unsigned int proxy_type:2; /**< One of PROXY_NONE...PROXY_SOCKS5 */
   uint8_t link_proto; /**< What protocol version are we using? 0 for
                        * "none negotiated yet." */
   circid_t next_circ_id; /**< Which circ_id do we try to use next on
                           * this connection?  This is always in the
                           * range 0..1<<15-1. */
+  /** If we're connecting to a bridge through a pluggable transport that
+   * runs inside Tor, that transport.  Our TLS sends and receives through
+   * it, rather than on the socket directly. */
+  const struct inproc_transport_t *inproc_transport;
 
   or_handshake_state_t *handshake_state; /**< If we are setting this connection
                                           * up, state information to do so. */
@@ -1251,6 +1311,11 @@ typedef struct or_connection_t {
                     * add 'bandwidthrate' to this, capping it at
                     * bandwidthburst. (OPEN ORs only) */
   int write_bucket; /**< When this hits 0, stop writing. Like read_bucket. */
+  /** The value of the token bucket clock when we last added tokens to
+   * read_bucket and write_bucket.  We add the tokens for each stretch of
+   * time when we next look at the buckets: see
+   * connection_or_buckets_catch_up(). */
+  uint64_t bucket_refilled_at;
 #else
   /** A rate-limiting configuration object to determine how this connection
    * set its read- and write- limits. */
@@ -1259,6 +1324,22 @@ typedef struct or_connection_t {
 #endif
   int n_circuits; /**< How many circuits use this connection as p_conn or
                    * n_conn ? */
+  /** Map from circuit ID to each circuit using this connection as p_conn or
+   * n_conn, or NULL if no circuit has used it yet.  See
+   * circuit_get_by_circid_orconn(). */
+  struct orconn_circid_map *circid_map;
+  /** The entry of circid_map most recently returned by a lookup; used to
+   * improve performance when many cells arrive in a row for the same
+   * circuit. */
+  struct orconn_circid_circuit_map_t *last_circid_ent;
+  /** Which circuit IDs in the half of the ID space we pick from are in use
+   * on this connection, or NULL if we haven't needed to know yet.  See
+   * circuit_id_get_unused_on_orconn(). */
+  struct circid_bitmap_t *circid_bitmap;
+  /** Circuits that have this connection as their n_conn, but no circuit ID
+   * on it yet, or NULL if there have never been any.  See
+   * circuit_set_n_conn_without_circid(). */
+  smartlist_t *circs_without_id;
 
   /** Double-linked ring of circuits with queued cells waiting for room to
    * free up on this connection's outbuf.  Every time we pull cells from a
@@ -1270,15 +1351,35 @@ typedef struct or_connection_t {
    *
    * This is redundant with active_circuits; if we ever decide only to use the
    * cell_ewma algorithm for choosing circuits, we can remove active_circuits.
+   *
+   * NULL until a circuit first becomes active on this connection.
    */
   smartlist_t *active_circuit_pqueue;
-  /** The tick on which the cell_ewma_ts in active_circuit_pqueue last had
-   * their ewma values rescaled. */
-  unsigned active_circuit_pqueue_last_recalibrated;
+  /** The position of this connection within the scheduler's priority queue
+   * of connections waiting to write cells, or -1 if it isn't there. */
+  int sched_heap_idx;
+  /** The value of connection_or_get_circuit_priority() when this
+   * connection was added to the scheduler's priority queue. */
+  double sched_priority;
+  /** Sequence number for breaking ties in the scheduler's priority queue. */
+  uint64_t sched_seq;
+  /** Bytes read and written since connection_tune_socket_buffers() last
+   * looked at this connection. */
+  uint32_t sockbuf_n_read, sockbuf_n_written;
+  /** Receive and send buffer sizes connection_tune_socket_buffers() last
+   * set on our socket, or 0 if we've left the kernel defaults in place. */
+  int sockbuf_rcv_size, sockbuf_snd_size;
   struct or_connection_t *next_with_same_id; /**< Next connection with same
                                               * identity digest as this one. */
 } or_connection_t;
 
+/** How many addresses besides the first can an exit connection fall back
+ * to if it can't connect? */
+#define MAX_EXIT_ALT_ADDRS 3
+/** How many addresses from each DNS answer do we keep in the exit's DNS
+ * cache?  No more than 8, since we track them in a byte-sized bitfield. */
+#define MAX_CACHED_RESOLVE_ADDRS 8
+
 /** Subtype of connection_t for an "edge connection" -- that is, an entry (ap)
  * connection, or an exit. */
 typedef struct edge_connection_t {
@@ -1302,6 +1403,14 @@ typedef struct edge_connection_t {
 
   uint32_t address_ttl; /**< TTL for address-to-addr mapping on exit
                          * connection.  Exit connections only. */
+  /** Other IPv4 addresses, in host order, that this exit connection's
+   * hostname resolved to: we try them in turn if connecting to _base.addr
+   * fails or stalls.  Exit connections only. */
+  uint32_t exit_alt_addrs[MAX_EXIT_ALT_ADDRS];
+  uint8_t n_exit_alt_addrs; /**< How many exit_alt_addrs are set? */
+  /** When did we start our current connect() attempt?  Exit connections
+   * only. */
+  time_t exit_connect_started;
 
   streamid_t stream_id; /**< The stream ID used for this edge connection on its
                          * circuit */
@@ -1317,6 +1426,9 @@ typedef struct edge_connection_t {
 
   /** True iff this connection is for a DNS request only. */
   unsigned int is_dns_request:1;
+  /** True iff this stream is on the list of streams whose n_read or
+   * n_written we'll report in the next STREAM_BW events. */
+  unsigned int stream_bw_dirty:1;
 
   unsigned int edge_has_sent_end:1; /**< For debugging; only used on edge
                          * connections.  Set once we've set the stream end,
@@ -1326,6 +1438,19 @@ typedef struct edge_connection_t {
    * cells. */
   unsigned int edge_blocked_on_circ:1;
 
+  /** True iff we're holding back a partial cell's worth of data on our
+   * inbuf, in the hope that more arrives; see DataCellCoalesceDelay. */
+  unsigned int coalescing_data:1;
+  /** True iff we've held back a partial cell for long enough, and should
+   * package it the next time we're asked to. */
+  unsigned int coalesce_due:1;
+  /** True iff this exit connection is waiting for the main loop to move it
+   * to its next address; see connection_exit_reconnect_later(). */
+  unsigned int exit_reconnect_pending:1;
+  /** If coalescing_data is set, when should we give up waiting?  (As from
+   * cell_queue_now_msec().) */
+  uint32_t coalesce_until_msec;
+
 } edge_connection_t;
 
 /** Subtype of edge_connection_t for an "entry connection" -- that is, a SOCKS
@@ -1370,6 +1495,10 @@ typedef struct entry_connection_t {
   /** If this is a DNSPort connection, this field holds the pending DNS
    * request that we're going to try to answer.  */
   struct evdns_server_request *dns_server_request;
+  /** If this is a DNSPort connection: other DNSPort requests for the same
+   * question, which could share our stream without breaking isolation, and
+   * which are waiting for our answer too. */
+  smartlist_t *dns_server_extra_requests;
 
 #define NUM_CIRCUITS_LAUNCHED_THRESHOLD 10
   /** Number of times we've launched a circuit to handle this stream. If
@@ -1442,6 +1571,28 @@ typedef struct dir_connection_t {
   /** The zlib object doing on-the-fly compression for spooled data. */
   tor_zlib_state_t *zlib_state;
 
+  /** As a client: the headers of the HTTP response, once we've taken them
+   * off the inbuf so that we can handle the body as it arrives. */
+  char *response_headers;
+  /** As a client: the zlib object decompressing the response body as it
+   * arrives, or NULL if we're collecting the body as-is. */
+  tor_zlib_state_t *response_zlib_state;
+  /** As a client: the compression we expect on the response body, or
+   * NO_METHOD if we're collecting it as-is. */
+  compress_method_t response_compression;
+  /** As a client: the body collected so far (decompressed, if
+   * response_zlib_state is set), its length, and its allocated size. */
+  char *response_body;
+  size_t response_body_len;
+  size_t response_body_alloc;
+  /** As a client: number of body bytes we've taken off the inbuf. */
+  size_t response_raw_len;
+  /** As a client: the declared Content-Length of the response, or -1. */
+  ssize_t response_content_length;
+  /** As a client: true iff response_zlib_state has finished a compressed
+   * object. */
+  unsigned int response_zlib_done:1;
+
   /** What rendezvous service are we querying for? */
   rend_data_t *rend_data;
 
@@ -1462,6 +1613,8 @@ typedef struct control_connection_t {
   /** True if we have received a takeownership command on this
    * connection. */
   unsigned int is_owning_control_connection:1;
+  /** True if this controller has asked for the COMPACT_EVENTS feature. */
+  unsigned int use_compact_events:1;
 
   /** If we have sent an AUTHCHALLENGE reply on this connection and
    * have not received a successful AUTHENTICATE command, points to
@@ -1469,6 +1622,29 @@ typedef struct control_connection_t {
    * otherwise, NULL. */
   char *safecookie_client_hash;
 
+  /** How many more droppable events may we send this controller during
+   * the second <b>event_bucket_second</b>?  Only meaningful if
+   * ControlEventRateLimit is set. */
+  uint32_t event_bucket;
+  /** The second for which <b>event_bucket</b> was last refilled. */
+  time_t event_bucket_second;
+  /** How many events have we dropped for this controller since we last
+   * told it about dropping them? */
+  uint32_t n_events_dropped;
+
+  /** If we're spooling a large GETINFO answer onto this connection, a stack
+   * of the digests of the entries we have yet to write; otherwise NULL. */
+  smartlist_t *getinfo_spool;
+  /** What the digests on <b>getinfo_spool</b> identify: one of the
+   * CONTROL_SPOOL_* values in control.c. */
+  uint8_t getinfo_spool_src;
+  /** Events that we're holding back until we finish spooling, so that
+   * they don't end up inside the spooled answer; or NULL. */
+  smartlist_t *held_events;
+  /** True iff one of the held_events is an error, so that we should write
+   * the rest of the spooled answer at once rather than keep it waiting. */
+  unsigned int held_events_urgent:1;
+
   /** Amount of space allocated in incoming_cmd. */
   uint32_t incoming_cmd_len;
   /** Number of bytes currently stored in incoming_cmd. */
@@ -1620,6 +1796,9 @@ typedef struct addr_policy_t {
 typedef struct cached_dir_t {
   char *dir; /**< Contents of this object, NUL-terminated. */
   char *dir_z; /**< Compressed contents of this object. */
+  /** If set, <b>dir_z</b> points into this mapping of a file, and not into
+   * the heap. */
+  tor_mmap_t *dir_z_mmap;
   size_t dir_len; /**< Length of <b>dir</b> (not counting its NUL). */
   size_t dir_z_len; /**< Length of <b>dir_z</b>. */
   time_t published; /**< When was this object published. */
@@ -1725,7 +1904,9 @@ typedef int16_t country_t;
 typedef struct {
   signed_descriptor_t cache_info;
   char *address; /**< Location of OR: either a hostname or an IP address. */
-  char *nickname; /**< Human-readable OR name. */
+  /** Human-readable OR name.  Like platform, contact_info, and the entries of
+   * declared_family, this comes from string_intern(). */
+  const char *nickname;
 
   uint32_t addr; /**< IPv4 address of OR, in host order. */
   uint16_t or_port; /**< Port for TLS connections. */
@@ -1741,7 +1922,8 @@ typedef struct {
   crypto_pk_t *onion_pkey; /**< Public RSA key for onions. */
   crypto_pk_t *identity_pkey;  /**< Public RSA key for signing. */
 
-  char *platform; /**< What software/operating system is this OR using? */
+  /** What software/operating system is this OR using? */
+  const char *platform;
 
   /* link info */
   uint32_t bandwidthrate; /**< How many bytes does this OR add to its token
@@ -1754,7 +1936,7 @@ typedef struct {
   long uptime; /**< How many seconds the router claims to have been up */
   smartlist_t *declared_family; /**< Nicknames of router which this router
                                  * claims are its family. */
-  char *contact_info; /**< Declared contact info for this router. */
+  const char *contact_info; /**< Declared contact info for this router. */
   unsigned int is_hibernating:1; /**< Whether the router claims to be
                                   * hibernating */
   unsigned int caches_extra_info:1; /**< Whether the router says it caches and
@@ -1771,6 +1953,10 @@ typedef struct {
   unsigned int needs_retest_if_added:1;
   /** True if ipv6_addr:ipv6_orport is preferred.  */
   unsigned int ipv6_preferred:1;
+  /** True iff we loaded this router from disk and haven't parsed its exit
+   * policy yet: exit_policy and policy_is_reject_star are not set until
+   * router_parse_exit_policy_if_needed() is called. */
+  unsigned int policy_is_unparsed:1;
 
 /** Tor can use this router for general positions in circuits; we got it
  * from a directory server as usual, or we're an authority and a server
@@ -1899,6 +2085,9 @@ typedef struct routerstatus_t {
    * from this authority.)  Applies in v2 networkstatus document only.
    */
   unsigned int need_to_mirror:1;
+  /** True iff this entry is a consensus entry with the same contents as the
+   * entry for the same router in the consensus that this one replaced. */
+  unsigned int is_unchanged:1;
   time_t last_dir_503_at; /**< When did this router last tell us that it
                            * was too busy to serve directory info? */
   download_status_t dl_status;
@@ -1945,6 +2134,10 @@ typedef struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, we loaded this microdesc from the cache index and have not yet
+   * parsed <b>body</b>: call microdesc_parse_if_needed() before looking at
+   * the fields below. */
+  unsigned int is_unparsed : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -1992,8 +2185,6 @@ typedef struct microdesc_t {
 typedef struct node_t {
   /* Indexing information */
 
-  /** Used to look up the node_t by its identity digest. */
-  HT_ENTRY(node_t) ht_ent;
   /** Position of the node within the list of nodes */
   int nodelist_idx;
 
@@ -2037,6 +2228,10 @@ typedef struct node_t {
 
   /** According to the geoip db what country is this router in? */
   country_t country;
+  /** The address for which we last computed <b>country</b>, and the GeoIP
+   * database generation we computed it with; see node_set_country(). */
+  uint32_t country_addr;
+  unsigned country_generation;
 } node_t;
 
 /** How many times will we try to download a router's descriptor before giving
@@ -2163,6 +2358,55 @@ typedef enum {
 /** How many different consensus flavors are there? */
 #define N_CONSENSUS_FLAVORS ((int)(FLAV_MICRODESC)+1)
 
+/** Identifiers for the consensus parameters that Tor itself consults.  The
+ * names that go with them are in net_param_names in networkstatus.c; keep
+ * the two in the same order. */
+typedef enum {
+  NET_PARAM_ALLOW_NONEARLY_EXTEND = 0,
+  NET_PARAM_CIRCUIT_PRIORITY_HALFLIFE_MSEC,
+  NET_PARAM_FAST_FLAG_MAX_THRESHOLD,
+  NET_PARAM_FAST_FLAG_MIN_THRESHOLD,
+  NET_PARAM_USE_OPTIMISTIC_DATA,
+  NET_PARAM_ADAPTIVE_CIRCWINDOW_MAX,
+  NET_PARAM_ADAPTIVE_CIRCWINDOW_MIN,
+  NET_PARAM_BWWEIGHTSCALE,
+  NET_PARAM_CBTCLOSEQUANTILE,
+  NET_PARAM_CBTDISABLED,
+  NET_PARAM_CBTINITIALTIMEOUT,
+  NET_PARAM_CBTMAXTIMEOUTS,
+  NET_PARAM_CBTMINCIRCS,
+  NET_PARAM_CBTMINTIMEOUT,
+  NET_PARAM_CBTNUMMODES,
+  NET_PARAM_CBTQUANTILE,
+  NET_PARAM_CBTRECENTCOUNT,
+  NET_PARAM_CBTTESTFREQ,
+  NET_PARAM_CIRCWINDOW,
+  NET_PARAM_PB_DISABLEPCT,
+  NET_PARAM_PB_MINCIRCS,
+  NET_PARAM_PB_NOTICEPCT,
+  NET_PARAM_PB_SCALECIRCS,
+  NET_PARAM_PB_SCALEFACTOR,
+  NET_PARAM_PERCONNBWBURST,
+  NET_PARAM_PERCONNBWRATE,
+  NET_PARAM_REFUSEUNKNOWNEXITS,
+} net_param_t;
+
+/** How many different net_param_t values are there? */
+#define N_NET_PARAMS ((int)(NET_PARAM_REFUSEUNKNOWNEXITS)+1)
+
+/** Identifiers for the bandwidth-weights in a consensus.  The names that go
+ * with them are in bw_weight_names in networkstatus.c. */
+typedef enum {
+  BW_WEIGHT_WBD = 0, BW_WEIGHT_WBE, BW_WEIGHT_WBG, BW_WEIGHT_WBM,
+  BW_WEIGHT_WDB, BW_WEIGHT_WEB, BW_WEIGHT_WED, BW_WEIGHT_WEE,
+  BW_WEIGHT_WEG, BW_WEIGHT_WEM, BW_WEIGHT_WGB, BW_WEIGHT_WGD,
+  BW_WEIGHT_WGG, BW_WEIGHT_WGM, BW_WEIGHT_WMB, BW_WEIGHT_WMD,
+  BW_WEIGHT_WME, BW_WEIGHT_WMG, BW_WEIGHT_WMM,
+} bw_weight_t;
+
+/** How many different bw_weight_t values are there? */
+#define N_BW_WEIGHTS ((int)(BW_WEIGHT_WMM)+1)
+
 /** A common structure to hold a v3 network status vote, or a v3 network
  * status consensus. */
 typedef struct networkstatus_t {
@@ -2203,6 +2447,17 @@ typedef struct networkstatus_t {
    * consensus. */
   smartlist_t *weight_params;
 
+  /** Values of the entries in net_params and weight_params that we know by
+   * identifier, as compiled by networkstatus_compile_params().  An entry
+   * whose <b>_present</b> flag is 0 was missing or unparseable. */
+  int32_t net_param_values[N_NET_PARAMS];
+  uint8_t net_param_present[N_NET_PARAMS];
+  int32_t bw_weight_values[N_BW_WEIGHTS];
+  uint8_t bw_weight_present[N_BW_WEIGHTS];
+  /** True iff networkstatus_compile_params() has been run on this
+   * document. */
+  unsigned int params_compiled : 1;
+
   /** List of networkstatus_voter_info_t.  For a vote, only one element
    * is included.  For a consensus, one element is included for every voter
    * whose vote contributed to the consensus. */
@@ -2218,6 +2473,19 @@ typedef struct networkstatus_t {
    * are routerstatus_t. */
   smartlist_t *routerstatus_list;
 
+  /** Consensus only: the elements of routerstatus_list that have the HSDir
+   * flag, in the same order, or NULL if we haven't needed them yet. */
+  smartlist_t *hs_dir_ring;
+
+  /** Microdesc consensus only: the elements of routerstatus_list whose
+   * microdescriptors we lacked when we last looked, or NULL if we haven't
+   * looked yet.  May include entries whose microdescriptors have since
+   * arrived. */
+  smartlist_t *missing_microdescs;
+  /** The microdescriptor removal generation at which we built
+   * missing_microdescs. */
+  unsigned missing_microdescs_generation;
+
   /** If present, a map from descriptor digest to elements of
    * routerstatus_list. */
   digestmap_t *desc_digest_map;
@@ -2265,6 +2533,19 @@ typedef struct desc_store_t {
   /** Total bytes dropped since last rebuild: this is space currently
    * used in the cache and the journal that could be freed by a rebuild. */
   size_t bytes_dropped;
+
+  /** If a thread is writing a new store file for us, the write in progress;
+   * else NULL. */
+  bg_file_write_t *rebuild_write;
+  /** If rebuild_write is set, where each descriptor will be in the new
+   * store file. */
+  struct desc_rebuild_ent_t *rebuild_ents;
+  /** Number of elements in rebuild_ents. */
+  int n_rebuild_ents;
+  /** Length of the store file that rebuild_write is writing. */
+  size_t rebuild_len;
+  /** True if we no longer want the file that rebuild_write is writing. */
+  unsigned int rebuild_cancelled : 1;
 } desc_store_t;
 
 /** Contents of a directory of onion routers. */
@@ -2359,6 +2640,34 @@ typedef enum {
 
 #define CRYPT_PATH_MAGIC 0x70127012u
 
+/** State used to grow or shrink the circuit-level deliver window for one
+ * hop, when AdaptiveCircuitWindows is set.  We estimate the
+ * bandwidth-delay product of the hop from the rate at which we deliver
+ * cells, and from the time it takes the sender to respond to our SENDMEs;
+ * then we send SENDMEs early (or late) enough that the sender may have that
+ * many cells in flight.  See relay.c. */
+typedef struct adaptive_window_t {
+  /** The deliver window we are currently aiming for, in cells; 0 if we
+   * have not adapted it yet and are still using CIRCWINDOW_START. */
+  int target;
+  /** Smoothed rate at which we have delivered cells, in cells per
+   * second. */
+  double rate;
+  /** The smallest SENDME round-trip time we have seen, in msec; 0 if we
+   * have no sample yet. */
+  uint32_t rtt_min_msec;
+  /** When did we last send a SENDME? (As from cell_queue_now_msec().) */
+  uint32_t last_sendme_msec;
+  /** How many cells have we delivered since we last sent a SENDME? */
+  int n_delivered;
+  /** When did we send the SENDME that we are currently timing? */
+  uint32_t rtt_sample_start_msec;
+  /** How many more cells must we deliver before the sender could only have
+   * sent the next one in response to the SENDME we are timing?  0 if we
+   * are not timing a SENDME. */
+  int cells_until_rtt_sample;
+} adaptive_window_t;
+
 /** Holds accounting information for a single step in the layered encryption
  * performed by a circuit.  Used only at the client edge of a circuit. */
 typedef struct crypt_path_t {
@@ -2401,6 +2710,9 @@ typedef struct crypt_path_t {
 #define CPATH_STATE_CLOSED 0
 #define CPATH_STATE_AWAITING_KEYS 1
 #define CPATH_STATE_OPEN 2
+  /** True iff a cpuworker is finishing the DH handshake for this step.  We
+   * accept no CREATED or CREATED_FAST reply for this step while it is. */
+  unsigned int handshake_in_worker : 1;
   struct crypt_path_t *next; /**< Link to next crypt_path_t in the circuit.
                               * (The list is circular, so the last node
                               * links to the first.) */
@@ -2411,6 +2723,8 @@ typedef struct crypt_path_t {
                        * at this step? */
   int deliver_window; /**< How many cells are we willing to deliver originating
                        * at this step? */
+  /** State for adapting deliver_window to this hop. */
+  adaptive_window_t adaptive_window;
 } crypt_path_t;
 
 /** A reference-counted pointer to a crypt_path_t, used only to share
@@ -2467,14 +2781,14 @@ typedef struct {
  * connection in connection_or_flush_from_first_active_circuit().
  */
 typedef struct {
-  /** The last 'tick' at which we recalibrated cell_count.
+  /** The natural log of the EWMA of the cell count.
    *
-   * A cell sent at exactly the start of this tick has weight 1.0. Cells sent
-   * since the start of this tick have weight greater than 1.0; ones sent
-   * earlier have less weight. */
-  unsigned last_adjusted_tick;
-  /** The EWMA of the cell count. */
-  double cell_count;
+   * A cell sent at exactly the start of cell-ewma tick 0 has weight 1.0;
+   * cells sent later have exponentially greater weight.  We keep the log of
+   * the sum so that it never overflows, and so that we never need to rescale
+   * it as time passes: see the comment on cell_ewma_t scaling in relay.c.
+   * An empty count is CELL_EWMA_LOG_ZERO. */
+  double log_cell_count;
   /** True iff this is the cell count for a circuit's previous
    * connection. */
   unsigned int is_for_p_conn : 1;
@@ -2483,6 +2797,10 @@ typedef struct {
   int heap_index;
 } cell_ewma_t;
 
+/** Value of cell_ewma_t.log_cell_count for a circuit that hasn't sent any
+ * cells: small enough to stand for log(0) in any comparison or sum. */
+#define CELL_EWMA_LOG_ZERO (-1.0e300)
+
 #define ORIGIN_CIRCUIT_MAGIC 0x35315243u
 #define OR_CIRCUIT_MAGIC 0x98ABC04Fu
 
@@ -2530,10 +2848,33 @@ typedef struct circuit_t {
   /** True iff we are waiting for p_conn_cells to become less full before
    * allowing n_streams to add any more cells. (OR circuit only.) */
   unsigned int streams_blocked_on_p_conn : 1;
+  /** True iff this circuit is in the list of circuits whose keystream
+   * we're going to top up.  See circuit_note_keystream_used(). */
+  unsigned int keystream_refill_pending : 1;
 
   uint8_t state; /**< Current status of this circuit. */
   uint8_t purpose; /**< Why are we creating this circuit? */
 
+  /** This circuit's position in whichever circuitlist.c index holds it:
+   * the list for its purpose if it is an origin circuit, or the list of
+   * CREATE_FAST circuits if it is an OR circuit.  -1 if it is in neither. */
+  int index_idx;
+
+  /** If this circuit has had enough streams that walking its stream lists
+   * for every cell got expensive, a map from stream ID to the attached
+   * edge connection with that ID.  See circuit_stream_map_lookup(). */
+  struct circuit_stream_map *stream_map;
+
+  /** The edge stream at which circuit_resume_edge_reading() should start
+   * giving streams a turn, or NULL to start at the head of the list.  Always
+   * NULL or an attached stream in n_streams (OR circuits) or p_streams
+   * (origin circuits). */
+  struct edge_connection_t *next_stream_to_resume;
+
+  /** If CellLatencyHistograms is set, and we've flushed any cells from this
+   * circuit since, how long did they wait in its cell queues?  In msec. */
+  latency_histogram_t *queue_delay_histogram;
+
   /** How many relay data cells can we package (read from edge streams)
    * on this circuit before we receive a circuit-level sendme cell asking
    * for more? */
@@ -2543,6 +2884,8 @@ typedef struct circuit_t {
    * circuit-level sendme cells to indicate that we're willing to accept
    * more. */
   int deliver_window;
+  /** State for adapting deliver_window, if we're not the origin. */
+  adaptive_window_t adaptive_window;
 
   /** For storage while n_conn is pending
     * (state CIRCUIT_STATE_OR_WAIT). When defined, it is always
@@ -2553,6 +2896,9 @@ typedef struct circuit_t {
    * resolution than most so that the circuit-build-time tracking code can
    * get millisecond resolution. */
   struct timeval timestamp_created;
+  /** The same moment as timestamp_created, from tor_monotime_nsec(), so that
+   * circuit build times are immune to jumps in the system clock. */
+  uint64_t timestamp_created_mono;
   /** When the circuit was first used, or 0 if the circuit is clean.
    *
    * XXXX023 Note that some code will artifically adjust this value backward
@@ -2586,6 +2932,9 @@ typedef struct circuit_t {
   /** Unique ID for measuring tunneled network status requests. */
   uint64_t dirreq_id;
 
+  /** Temporary field used during circuits_handle_oom. */
+  uint32_t age_tmp;
+
   /** The EWMA count for the number of cells flushed from the
    * n_conn_cells queue.  Used to determine which circuit to flush from next.
    */
@@ -2618,6 +2967,10 @@ typedef struct origin_circuit_t {
   /** Holds all rendezvous data on either client or service side. */
   rend_data_t *rend_data;
 
+  /** This circuit's position in its circuitlist.c list of circuits we might
+   * cannibalize, or -1 if it is in none. */
+  int cannibalize_idx;
+
   /** How many more relay_early cells can we send on this circuit, according
    * to the specification? */
   unsigned int remaining_relay_early_cells : 4;
@@ -2745,6 +3098,9 @@ typedef struct or_circuit_t {
   cell_queue_t p_conn_cells;
   /** The OR connection that is previous in this circuit. */
   or_connection_t *p_conn;
+  /** If this circuit is waiting for a CPU worker, its entry in onion.c's
+   * queue of pending onionskins; otherwise NULL. */
+  struct onion_queue_t *onionqueue_entry;
   /** Linked list of Exit streams associated with this circuit. */
   edge_connection_t *n_streams;
   /** Linked list of Exit streams associated with this circuit that are
@@ -2756,6 +3112,14 @@ typedef struct or_circuit_t {
   /** The cipher used by intermediate hops for cells heading away from
    * the OP. */
   crypto_cipher_t *n_crypto;
+  /** How many cells heading toward the OP have already had p_crypto
+   * applied by relay_crypt_cell_batch(), but have not yet been handled by
+   * relay_crypt()? */
+  uint16_t p_crypto_n_ahead;
+  /** How many cells heading away from the OP have already had n_crypto
+   * applied by relay_crypt_cell_batch(), but have not yet been handled by
+   * relay_crypt()? */
+  uint16_t n_crypto_n_ahead;
 
   /** The integrity-checking digest used by intermediate hops, for
    * cells packaged here and heading towards the OP.
@@ -2841,6 +3205,10 @@ typedef enum invalid_router_usage_t {
 #define MIN_CONSTRAINED_TCP_BUFFER 2048
 #define MAX_CONSTRAINED_TCP_BUFFER 262144  /* 256k */
 
+/* limits for TCP send and recv buffer size picked by SocketBufferBudget */
+#define MIN_AUTO_TCP_BUFFER 8192
+#define MAX_AUTO_TCP_BUFFER (4*1024*1024)
+
 /** @name Isolation flags
 
     Ways to isolate client streams
@@ -2929,6 +3297,17 @@ typedef struct routerset_t routerset_t;
  * to pick its own port. */
 #define CFG_AUTO_PORT 0xc4005e
 
+/** Classes of traffic that can be given a weighted share of the global
+ * bandwidth buckets; see BandwidthClassWeights. */
+typedef enum {
+  BW_CLASS_RELAY = 0, /**< Relayed cells, and exit streams. */
+  BW_CLASS_DIR = 1, /**< Directory connections. */
+  BW_CLASS_CLIENT = 2, /**< Our own streams, and OR conns we use for them. */
+  BW_CLASS_CONTROL = 3, /**< Controller connections. */
+} bw_class_t;
+/** How many values of bw_class_t are there? */
+#define N_BW_CLASSES 4
+
 /** Configuration options for a Tor process. */
 typedef struct {
   uint32_t _magic;
@@ -2936,7 +3315,7 @@ typedef struct {
   /** What should the tor process actually do? */
   enum {
     CMD_RUN_TOR=0, CMD_LIST_FINGERPRINT, CMD_HASH_PASSWORD,
-    CMD_VERIFY_CONFIG, CMD_RUN_UNITTESTS
+    CMD_VERIFY_CONFIG, CMD_DUMP_GEOIP_BINARY, CMD_RUN_UNITTESTS
   } command;
   const char *command_arg; /**< Argument for command-line option. */
 
@@ -2946,6 +3325,8 @@ typedef struct {
 
   int LogMessageDomains; /**< Boolean: Should we log the domain(s) in which
                           * each log message occurs? */
+  int AsyncLogging; /**< Boolean: Should a separate thread write our debug-
+                     * and info-level messages to log files? */
 
   char *DebugLogFile; /**< Where to send verbose log messages. */
   char *DataDirectory; /**< OR only: where to store long-term data. */
@@ -3023,6 +3404,12 @@ typedef struct {
   config_line_t *ControlSocket; /**< List of Unix Domain Sockets to listen on
                                  * for control connections. */
   int ControlSocketsGroupWritable; /**< Boolean: Are control sockets g+rw? */
+  /** If nonzero, the most high-volume events (see DROPPABLE_EVENTS in
+   * control.c) we send each controller per second. */
+  int ControlEventRateLimit;
+  /** If nonzero, drop high-volume events for any controller with more than
+   * this many bytes waiting to be sent to it. */
+  uint64_t ControlEventMaxBacklog;
   config_line_t *DirPort; /**< Port to listen on for directory connections. */
   config_line_t *DNSPort; /**< Port to listen on for DNS requests. */
   int AssumeReachable; /**< Whether to publish our descriptor regardless. */
@@ -3082,6 +3469,9 @@ typedef struct {
   int FetchV2Networkstatus; /**< Do we fetch v2 networkstatus documents when
                              * we don't need to? */
   int HidServDirectoryV2; /**< Do we participate in the HS DHT? */
+  /** How much memory may the descriptors we store as a hidden service
+   * directory take up before we drop the least recently used ones? */
+  uint64_t HidServDirectoryCacheSize;
 
   int VoteOnHidServDirectoriesV2; /**< As a directory authority, vote on
                                    * assignment of the HSDir flag? */
@@ -3117,7 +3507,29 @@ typedef struct {
   config_line_t *ReachableDirAddresses; /**< IP:ports for Dir conns. */
 
   int ConstrainedSockets; /**< Shrink xmit and recv socket buffers. */
+  /** Should we cork OR connection sockets while we write bursts of cells
+   * to them, so that they go out in full-sized segments? */
+  int CoalesceORWrites;
+  /** Should we gather the cells we flush to busy OR connections into
+   * full-sized TLS records? */
+  int TLSRecordCoalescing;
   uint64_t ConstrainedSockSize; /**< Size of constrained buffers. */
+  /** If nonzero, size the socket buffers of open OR connections from their
+   * throughput and round-trip time, using no more than this many bytes for
+   * all of them together. */
+  uint64_t SocketBufferBudget;
+  /** If nonzero, keep no more than this many unsent bytes in the kernel
+   * send queue of each OR and edge connection socket. */
+  uint64_t TCPNotSentLowat;
+
+  /** If we have more memory than this allocated for circuit cell queues,
+   * kill circuits until we're back under the limit. */
+  uint64_t MaxMemInCellQueues;
+
+  /** If we have more memory than this allocated for connection buffers,
+   * compact them, and then close connections until we're back under the
+   * limit.  0 for no limit. */
+  uint64_t MaxMemInBuffers;
 
   /** Whether we should drop exit streams from Tors that we don't know are
    * relays.  One of "0" (never refuse), "1" (always refuse), or "-1" (do
@@ -3152,6 +3564,15 @@ typedef struct {
                        * descriptor? Remember to publish them independently. */
   int KeepalivePeriod; /**< How often do we send padding cells to keep
                         * connections alive? */
+  /** If nonzero, how long do we let an exit connection's connect() run
+   * before trying the next address its hostname resolved to? */
+  int ExitConnectFallbackTimeout;
+  /** If nonzero, how long can we go without a tick of the main loop when
+   * we have nothing to do?  See main_loop_update_dormancy(). */
+  int DormantWakeupInterval;
+  /** If nonzero, how many cells' worth of keystream do we try to keep
+   * precomputed for each cipher on each circuit that's in use? */
+  int KeystreamPrecomputeCells;
   int SocksTimeout; /**< How long do we let a socks connection wait
                      * unattached before we fail it? */
   int LearnCircuitBuildTimeout; /**< If non-zero, we attempt to learn a value
@@ -3169,6 +3590,10 @@ typedef struct {
   int MaxOnionsPending; /**< How many circuit CREATE requests do we allow
                          * to wait simultaneously before we start dropping
                          * them? */
+  int MaxOnionQueueDelay; /**< If we expect a new CREATE request to wait
+                           * longer than this many msec for a cpuworker,
+                           * refuse it.  If 0, pick a limit based on our
+                           * circuit build timeout. */
   int NewCircuitPeriod; /**< How long do we use a circuit before building
                          * a new one? */
   int MaxCircuitDirtiness; /**< Never use circs that were first used more than
@@ -3183,9 +3608,21 @@ typedef struct {
                                  * willing to use for all relayed conns? */
   uint64_t RelayBandwidthBurst; /**< How much bandwidth, at maximum, will we
                                  * use in a second for all relayed conns? */
+  /** List of class=weight entries: if set, each listed bandwidth class is
+   * guaranteed its weighted share of the global buckets whenever it wants
+   * it, and borrows from the others while they're idle. */
+  smartlist_t *BandwidthClassWeights;
+  /** BandwidthClassWeights, parsed and indexed by bw_class_t. */
+  int _BandwidthClassWeights[N_BW_CLASSES];
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, pin each cpuworker thread to its own CPU, where we know
+   * how. */
+  int CPUWorkerAffinity;
+  /** If true, parse the router entries of large consensus documents on up
+   * to NumCPUs threads at once. */
+  int ParallelConsensusParsing;
 //int RunTesting; /**< If true, create testing circuits to measure how well the
 //                 * other ORs are running. */
   config_line_t *RendConfigLines; /**< List of configuration lines
@@ -3282,6 +3719,9 @@ typedef struct {
   uint64_t AccountingMax; /**< How many bytes do we allow per accounting
                            * interval before hibernation?  0 for "never
                            * hibernate." */
+  /** If true, slow down when we're about to run out of AccountingMax, so
+   * that it lasts until the end of the interval. */
+  int AccountingShaping;
 
   /** Base64-encoded hash of accepted passwords for the control system. */
   config_line_t *HashedControlPassword;
@@ -3322,8 +3762,13 @@ typedef struct {
                   * log whether it was DNS-leaking or not? */
   int HardwareAccel; /**< Boolean: Should we enable OpenSSL hardware
                       * acceleration where available? */
+  int HugePageArena; /**< Boolean: Should memory pools carve their chunks
+                      * from regions backed by huge pages? */
   /** Token Bucket Refill resolution in milliseconds. */
   int TokenBucketRefillInterval;
+  /** How many TLS sessions with relays do we remember so that we can
+   * resume them on our next connection?  0 for none. */
+  int TLSSessionCacheSize;
   char *AccelName; /**< Optional hardware acceleration engine name. */
   char *AccelDir; /**< Optional hardware acceleration engine search dir. */
   int UseEntryGuards; /**< Boolean: Do we try to enter from a smallish number
@@ -3336,6 +3781,10 @@ typedef struct {
    * means directly from the authorities) no matter our other config? */
   int FetchDirInfoEarly;
 
+  /** Should we ask for a diff from the consensus we have, rather than
+   * fetching each new consensus in full? */
+  int FetchConsensusDiffs;
+
   /** Should we fetch our dir info at the start of the consensus period? */
   int FetchDirInfoExtraEarly;
 
@@ -3351,6 +3800,11 @@ typedef struct {
   char *ServerDNSResolvConfFile; /**< If provided, we configure our internal
                      * resolver from the file here rather than from
                      * /etc/resolv.conf (Unix) or the registry (Windows). */
+  /** How hard to work when compressing directory responses on the fly:
+   * "high", "medium", or "low". */
+  char *DirCompressionLevel;
+  compression_level_t _DirCompressionLevel; /**< Derived from
+                                             * DirCompressionLevel. */
   char *DirPortFrontPage; /**< This is a full path to a file with an html
                     disclaimer. This allows a server administrator to show
                     that they're running Tor and anyone visiting their server
@@ -3380,6 +3834,15 @@ typedef struct {
                                 * with weird characters. */
   /** If true, we try resolving hostnames with weird characters. */
   int ServerDNSAllowNonRFC953Hostnames;
+  /** If true, we re-resolve cached hostnames that streams keep using just
+   * before they expire, and serve the old answer while we wait. */
+  int ServerDNSRefreshPopular;
+  /** How we resolve hostnames for exit connections: "eventdns" or
+   * "getaddrinfo". */
+  char *ServerDNSBackend;
+  /** If we resolve hostnames with getaddrinfo, how many threads may call
+   * it at once? */
+  int ServerDNSMaxThreads;
 
   /** If true, we try to download extra-info documents (and we serve them,
    * if we are a cache).  For authorities, this is always true. */
@@ -3430,6 +3893,12 @@ typedef struct {
    * Helps avoid some cross-site attacks. */
   int ClientDNSRejectInternalAddresses;
 
+  /** If true, remember the answers that exits give us to DNS lookups, and
+   * use them for later streams and resolves until they expire. */
+  int ClientDNSCache;
+  /** The longest we keep a remembered DNS answer, whatever its TTL. */
+  int ClientDNSCacheMaxTTL;
+
   /** If true, do not accept any requests to connect to internal addresses
    * over randomly chosen exits. */
   int ClientRejectInternalAddresses;
@@ -3490,6 +3959,11 @@ typedef struct {
    * the bridge authority guess which countries have blocked access to us. */
   int BridgeRecordUsageByCountry;
 
+  /** If true, count the clients we report in bridge and entry statistics
+   * with per-country HyperLogLog sketches rather than remembering each
+   * client address. */
+  int ApproximateClientCounts;
+
   /** Optionally, a file with GeoIP data. */
   char *GeoIPFile;
 
@@ -3512,6 +3986,23 @@ typedef struct {
    */
   double CircuitPriorityHalflife;
 
+  /** If true, grow and shrink the circuit and stream deliver windows at our
+   * edges of circuits according to the measured bandwidth-delay product,
+   * within the bounds given in the consensus. */
+  int AdaptiveCircuitWindows;
+
+  /** If positive, how many msec do we wait for more data before packaging a
+   * partial RELAY_DATA cell from an edge connection? */
+  int DataCellCoalesceDelay;
+
+  /** If positive, log a notice whenever a main-loop callback runs for at
+   * least this many msec. */
+  int MainLoopStallThreshold;
+
+  /** If true, keep histograms of how long cells wait in circuit queues, and
+   * of how long we take to process each kind of relay cell. */
+  int CellLatencyHistograms;
+
   /** If true, do not enable IOCP on windows with bufferevents, even if
    * we think we could. */
   int DisableIOCP;
@@ -3541,6 +4032,11 @@ typedef struct {
    * never use it.  If -1, we do what the consensus says. */
   int OptimisticData;
 
+  /** If 1, we start building the rendezvous circuit for a hidden service
+   * while we fetch its descriptor, and keep an extra clean internal circuit
+   * around when we predict hidden service use. */
+  int ParallelHSConnect;
+
   /** If 1, and we are using IOCP, we set the kernel socket SNDBUF and RCVBUF
    * to 0 to try to save kernel memory and avoid the dread "Out of buffers"
    * issue. */
@@ -3639,8 +4135,13 @@ static INLINE void or_state_mark_dirty(or_state_t *state, time_t when)
     state->next_write = when;
 }
 
-#define MAX_SOCKS_REPLY_LEN 1024
+/** How long a SOCKS reply can we build in a socks_request_t?  The socks5
+ * handshake only needs two bytes; see long_reply for anything bigger. */
+#define MAX_SOCKS_REPLY_LEN 8
 #define MAX_SOCKS_ADDR_LEN 256
+/** How many bytes of SOCKS usernames and passwords can we store inside a
+ * socks_request_t, without allocating? */
+#define SOCKS_AUTH_ARENA_LEN 64
 #define SOCKS_NO_AUTH 0x00
 #define SOCKS_USER_PASS 0x02
 
@@ -3671,13 +4172,17 @@ struct socks_request_t {
   uint8_t command;
   /** Which kind of listener created this stream? */
   uint8_t listener_type;
-  size_t replylen; /**< Length of <b>reply</b>. */
+  size_t replylen; /**< Length of <b>reply</b> or <b>long_reply</b>. */
   uint8_t reply[MAX_SOCKS_REPLY_LEN]; /**< Write an entry into this string if
                                     * we want to specify our own socks reply,
                                     * rather than using the default socks4 or
                                     * socks5 socks reply. We use this for the
                                     * two-stage socks5 handshake.
                                     */
+  /** If set, a canned reply too long for <b>reply</b> that we want to send
+   * instead, such as our "not an HTTP proxy" page.  Points to static
+   * storage, so that requests don't all carry room for it. */
+  const char *long_reply;
   char address[MAX_SOCKS_ADDR_LEN]; /**< What address did the client ask to
                                        connect to/resolve? */
   uint16_t port; /**< What port did the client ask to connect to? */
@@ -3697,6 +4202,12 @@ struct socks_request_t {
   /** The negotiated password value if any (for socks5). This value is NOT
    * nul-terminated; see passwordlen for its length. */
   char *password;
+  /** Storage for <b>username</b> and <b>password</b> when they're short
+   * enough, so that most requests that carry them don't need to allocate.
+   * See socks_request_store_auth(). */
+  char auth_arena[SOCKS_AUTH_ARENA_LEN];
+  /** How many bytes at the start of <b>auth_arena</b> are in use? */
+  uint8_t auth_arena_used;
 };
 
 /********************************* circuitbuild.c **********************/
@@ -3835,6 +4346,10 @@ typedef struct {
   double timeout_ms;
   /** How long we wait before actually closing the circuit. */
   double close_ms;
+  /** Running totals over circuit_build_times, kept up to date as times are
+   * added and evicted; NULL until we next need them.  See
+   * circuit_build_times_get_histogram(). */
+  struct cbt_histogram_t *histogram;
 } circuit_build_times_t;
 
 /********************************* config.c ***************************/
@@ -4138,6 +4653,24 @@ typedef enum {
   REND_CLIENT, REND_MID, REND_SERVER,
 } pk_op_t;
 
+/** Reasons we might give up on a create request without answering it: used
+ * to keep track of where onionskins go. */
+typedef enum {
+  /** The pending onion queue was full, and this was its oldest request. */
+  ONION_DROP_QUEUE_FULL,
+  /** The request waited on the onion queue too long. */
+  ONION_DROP_EXPIRED,
+  /** The circuit closed before we could answer. */
+  ONION_DROP_CIRCUIT_CLOSED,
+  /** We couldn't decode the onionskin. */
+  ONION_DROP_FAILED,
+  /** We refused the request, since it would have had to wait longer than
+   * MaxOnionQueueDelay. */
+  ONION_DROP_OVERLOADED,
+} onion_drop_reason_t;
+/** How many onion_drop_reason_t values are there? */
+#define N_ONION_DROP_REASONS 5
+
 /********************************* rendcommon.c ***************************/
 
 /** Hidden-service side configuration of client authorization. */
@@ -4207,12 +4740,15 @@ typedef struct rend_intro_point_t {
    * intro point. */
   unsigned int rend_service_note_removing_intro_point_called : 1;
 
-  /** (Service side only) A digestmap recording the INTRODUCE2 cells
-   * this intro point's circuit has received.  Each key is the digest
-   * of the RSA-encrypted part of a received INTRODUCE2 cell; each
-   * value is a pointer to the time_t at which the cell was received.
-   * This digestmap is used to prevent replay attacks. */
-  digestmap_t *accepted_intro_rsa_parts;
+  /** (Service side only) A replay cache recording the INTRODUCE2 cells
+   * this intro point's circuit has received: it holds the digest of the
+   * RSA-encrypted part of each one.  This is used to prevent replay
+   * attacks. */
+  struct replaycache_t *accepted_intro_rsa_parts;
+
+  /** (Service side only) How many INTRODUCE2 cells this intro point's
+   * circuit has given us that weren't replays. */
+  int accepted_introduce2_count;
 
   /** (Service side only) The time at which this intro point was first
    * published, or -1 if this intro point has not yet been
@@ -4253,6 +4789,12 @@ typedef struct rend_service_descriptor_t {
    * of the previous upload requests failed (otherwise it's not important
    * to know which uploads succeeded and which not). */
   smartlist_t *successful_uploads;
+  /** The introduction points section of this descriptor before any
+   * encryption, once we've encoded it. */
+  char *encoded_intro_points;
+  /** The signed descriptors we've encoded from this one so far, as
+   * rend_encoded_set_t's.  See rend_encode_v2_descriptors(). */
+  smartlist_t *encoded_descs;
 } rend_service_descriptor_t;
 
 /** A cached rendezvous descriptor. */
@@ -11,6 +11,7 @@
 #include "or.h"
 #include "config.h"
 #include "dirserv.h"
+#include "microdesc.h"
 #include "nodelist.h"
 #include "policies.h"
 #include "routerparse.h"
@@ -723,6 +724,242 @@ compare_tor_addr_to_addr_policy(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** One range of ports in the compiled form of an interned_policy_t: it
+ * covers every port after the previous range's last_port, up to and
+ * including this one.  Every entry of the policy either matches all of
+ * these ports or none of them. */
+typedef struct policy_port_range_t {
+  uint16_t last_port;
+  /** What the policy says about an unknown address on these ports. */
+  addr_policy_result_t result;
+  /** Index in the range_entries of the first policy entry matching these
+   * ports; the entries that match them follow it, in policy order. */
+  int first_entry;
+  /** How many entries match these ports? */
+  int n_entries;
+} policy_port_range_t;
+
+/** Most entry pointers we'll store in the compiled form of one policy.  A
+ * policy with many overlapping port ranges gets only the unknown-address
+ * verdicts. */
+#define MAX_POLICY_RANGE_ENTRIES 16384
+
+/** A whole address policy shared by every router that declares an
+ * identical one.  See addr_policy_list_intern(). */
+typedef struct interned_policy_t {
+  /** The policy itself; callers hold pointers to this member. */
+  smartlist_t policy;
+  /** SHA1 digest of the policy's (canonical) entry pointers. */
+  char digest[DIGEST_LEN];
+  /** How many callers hold this policy? */
+  int refcnt;
+  /** Number of elements in port_ranges, or 0 if we haven't compiled the
+   * policy yet. */
+  int n_port_ranges;
+  /** The compiled policy: the ports from 1 through 65535, split into
+   * ranges, in order. */
+  policy_port_range_t *port_ranges;
+  /** The policy entries matching each port range, or NULL if there were
+   * too many to store. */
+  addr_policy_t **range_entries;
+  /** The policy as it appears in a router descriptor, or NULL if we haven't
+   * rendered it yet.  See addr_policy_list_get_descriptor_lines(). */
+  char *descriptor_lines;
+} interned_policy_t;
+
+/** Map from policy digest to interned_policy_t. */
+static digestmap_t *interned_policies = NULL;
+
+/** Take ownership of <b>policy</b>, and return a shared copy of an
+ * identical policy: either <b>policy</b> itself, or one we had already
+ * interned, in which case free <b>policy</b>.  The result must not be
+ * modified, and must be released with addr_policy_list_release().
+ * Return NULL if <b>policy</b> is NULL. */
+smartlist_t *
+addr_policy_list_intern(smartlist_t *policy)
+{
+  interned_policy_t *ip;
+  char digest[DIGEST_LEN];
+
+  if (!policy)
+    return NULL;
+
+  /* Identical policies made of canonical entries have identical arrays of
+   * entry pointers, so we can compare them by digesting those arrays. */
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, e) {
+    if (!e->is_canonical) {
+      addr_policy_t *c = addr_policy_get_canonical_entry(e);
+      addr_policy_free(e);
+      SMARTLIST_REPLACE_CURRENT(policy, e, c);
+    }
+  } SMARTLIST_FOREACH_END(e);
+  crypto_digest(digest, (const char *)policy->list,
+                sizeof(void *) * smartlist_len(policy));
+
+  if (!interned_policies)
+    interned_policies = digestmap_new();
+  if ((ip = digestmap_get(interned_policies, digest))) {
+    tor_assert(smartlist_len(&ip->policy) == smartlist_len(policy));
+    ++ip->refcnt;
+    addr_policy_list_free(policy);
+    return &ip->policy;
+  }
+
+  ip = tor_malloc_zero(sizeof(interned_policy_t));
+  memcpy(&ip->policy, policy, sizeof(smartlist_t));
+  tor_free(policy); /* ip->policy has taken over its storage. */
+  memcpy(ip->digest, digest, DIGEST_LEN);
+  ip->refcnt = 1;
+  digestmap_set(interned_policies, digest, ip);
+  return &ip->policy;
+}
+
+/** Drop one reference to <b>policy</b>, which must have come from
+ * addr_policy_list_intern(), and free it once nobody holds it. */
+void
+addr_policy_list_release(smartlist_t *policy)
+{
+  interned_policy_t *ip;
+  if (!policy)
+    return;
+  ip = SUBTYPE_P(policy, interned_policy_t, policy);
+  tor_assert(ip->refcnt > 0);
+  if (--ip->refcnt)
+    return;
+  digestmap_remove(interned_policies, ip->digest);
+  SMARTLIST_FOREACH(&ip->policy, addr_policy_t *, e, addr_policy_free(e));
+  tor_free(ip->policy.list);
+  tor_free(ip->port_ranges);
+  tor_free(ip->range_entries);
+  tor_free(ip->descriptor_lines);
+  tor_free(ip);
+}
+
+/** Return the entries of <b>policy</b>, which must have come from
+ * addr_policy_list_intern(), formatted for a router descriptor with one
+ * newline-terminated line per entry; or NULL if we couldn't format one.
+ * We format each interned policy only once, so relays that rebuild their
+ * descriptor don't have to redo it every time.  The result belongs to
+ * <b>policy</b>. */
+const char *
+addr_policy_list_get_descriptor_lines(const smartlist_t *policy)
+{
+  interned_policy_t *ip;
+  smartlist_t *lines;
+  int ok = 1;
+
+  tor_assert(policy);
+  ip = SUBTYPE_P(policy, interned_policy_t, policy);
+  if (ip->descriptor_lines)
+    return ip->descriptor_lines;
+
+  lines = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, e) {
+    char buf[POLICY_BUF_LEN];
+    if (policy_write_item(buf, sizeof(buf), e, 1) < 0) {
+      ok = 0;
+      break;
+    }
+    smartlist_add_asprintf(lines, "%s\n", buf);
+  } SMARTLIST_FOREACH_END(e);
+  if (ok)
+    ip->descriptor_lines = smartlist_join_strings(lines, "", 0, NULL);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  return ip->descriptor_lines;
+}
+
+/** Compile the policy of <b>ip</b>: split the ports into the ranges over
+ * which every entry either matches or doesn't, and record for each one
+ * what the policy says about an unknown address, and which entries can
+ * match a known address. */
+static void
+interned_policy_compile(interned_policy_t *ip)
+{
+  const smartlist_t *policy = &ip->policy;
+  policy_port_range_t *r;
+  smartlist_t *entries = smartlist_new();
+  unsigned start = 1;
+  int n = 0;
+
+  /* Each entry adds at most two boundaries between ranges. */
+  r = tor_malloc(sizeof(policy_port_range_t) *
+                 (2 * smartlist_len(policy) + 1));
+  while (start <= 65535) {
+    unsigned end = 65535;
+    SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, e) {
+      if (e->prt_min > start) {
+        if (e->prt_min - 1u < end)
+          end = e->prt_min - 1u;
+      } else if (e->prt_max >= start && e->prt_max < end) {
+        end = e->prt_max;
+      }
+    } SMARTLIST_FOREACH_END(e);
+
+    r[n].last_port = end;
+    r[n].result = compare_unknown_tor_addr_to_addr_policy(start, policy);
+    r[n].first_entry = smartlist_len(entries);
+    SMARTLIST_FOREACH(policy, addr_policy_t *, e,
+                      if (e->prt_min <= start && start <= e->prt_max)
+                        smartlist_add(entries, e));
+    r[n].n_entries = smartlist_len(entries) - r[n].first_entry;
+    ++n;
+    start = end + 1;
+  }
+
+  ip->port_ranges = r;
+  ip->n_port_ranges = n;
+  if (smartlist_len(entries) <= MAX_POLICY_RANGE_ENTRIES) {
+    ip->range_entries = (addr_policy_t **)entries->list;
+    entries->list = NULL;
+  }
+  smartlist_free(entries);
+}
+
+/** As compare_tor_addr_to_addr_policy(), but <b>policy</b> must come from
+ * addr_policy_list_intern().  Find the port's range in the compiled
+ * policy, which all routers sharing <b>policy</b> have in common: it gives
+ * the answer for an unknown address, and the few entries that a known
+ * address could match. */
+addr_policy_result_t
+compare_tor_addr_to_interned_policy(const tor_addr_t *addr, uint16_t port,
+                                    const smartlist_t *policy)
+{
+  interned_policy_t *ip;
+  const policy_port_range_t *range;
+  int lo = 0, hi, i;
+
+  if (!policy || port == 0)
+    return compare_tor_addr_to_addr_policy(addr, port, policy);
+
+  ip = SUBTYPE_P(policy, interned_policy_t, policy);
+  if (!ip->n_port_ranges)
+    interned_policy_compile(ip);
+  hi = ip->n_port_ranges - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ip->port_ranges[mid].last_port < port)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  range = &ip->port_ranges[lo];
+
+  if (addr == NULL || tor_addr_is_null(addr))
+    return range->result;
+  if (!ip->range_entries)
+    return compare_tor_addr_to_addr_policy(addr, port, policy);
+  for (i = range->first_entry; i < range->first_entry + range->n_entries;
+       ++i) {
+    const addr_policy_t *e = ip->range_entries[i];
+    if (!tor_addr_compare_masked(addr, &e->addr, e->maskbits, CMP_EXACT))
+      return e->policy_type == ADDR_POLICY_ACCEPT ?
+        ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+  }
+  /* accept all by default. */
+  return ADDR_POLICY_ACCEPTED;
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -1495,9 +1732,12 @@ compare_tor_addr_to_node_policy(const tor_addr_t *addr, uint16_t port,
   if (node->rejects_all)
     return ADDR_POLICY_REJECTED;
 
-  if (node->ri)
-    return compare_tor_addr_to_addr_policy(addr, port, node->ri->exit_policy);
-  else if (node->md) {
+  if (node->ri) {
+    router_parse_exit_policy_if_needed(node->ri);
+    return compare_tor_addr_to_interned_policy(addr, port,
+                                               node->ri->exit_policy);
+  } else if (node->md) {
+    microdesc_parse_if_needed(node->md);
     if (node->md->exit_policy == NULL)
       return ADDR_POLICY_REJECTED;
     else
@@ -1574,6 +1814,14 @@ policies_free_all(void)
   addr_policy_list_free(authdir_badexit_policy);
   authdir_badexit_policy = NULL;
 
+  if (interned_policies) {
+    if (!digestmap_isempty(interned_policies))
+      log_warn(LD_MM, "Still had %d exit policies interned at shutdown.",
+               digestmap_size(interned_policies));
+    digestmap_free(interned_policies, NULL);
+    interned_policies = NULL;
+  }
+
   if (!HT_EMPTY(&policy_root)) {
     policy_map_ent_t **ent;
     int n = 0;
@@ -54,6 +54,12 @@ int getinfo_helper_policies(control_connection_t *conn,
 int policy_write_item(char *buf, size_t buflen, addr_policy_t *item,
                       int format_for_desc);
 
+smartlist_t *addr_policy_list_intern(smartlist_t *policy);
+void addr_policy_list_release(smartlist_t *policy);
+const char *addr_policy_list_get_descriptor_lines(const smartlist_t *policy);
+addr_policy_result_t compare_tor_addr_to_interned_policy(
+                                    const tor_addr_t *addr, uint16_t port,
+                                    const smartlist_t *policy);
 void addr_policy_list_free(smartlist_t *p);
 void addr_policy_free(addr_policy_t *p);
 void policies_free_all(void);
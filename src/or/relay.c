@@ -33,16 +33,25 @@
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
+#include "scheduler.h"
 
-static edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
-                                            cell_direction_t cell_direction,
-                                            crypt_path_t *layer_hint);
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+static int circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
+                                           cell_direction_t cell_direction,
+                                           uint8_t *command_out);
 
 static int connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
                                               edge_connection_t *conn,
                                               crypt_path_t *layer_hint);
 static void circuit_consider_sending_sendme(circuit_t *circ,
                                             crypt_path_t *layer_hint);
+static adaptive_window_t *circuit_get_adaptive_window(circuit_t *circ,
+                                                 crypt_path_t *layer_hint);
 static void circuit_resume_edge_reading(circuit_t *circ,
                                         crypt_path_t *layer_hint);
 static int circuit_resume_edge_reading_helper(edge_connection_t *conn,
@@ -59,6 +68,19 @@ static int circuit_queue_streams_are_blocked(circuit_t *circ);
  * cells. */
 #define CELL_QUEUE_LOWWATER_SIZE 64
 
+/** How many relay_processing_histograms are there? */
+#define N_RELAY_PROCESSING_HISTOGRAMS (RELAY_COMMAND_INTRODUCE_ACK+1)
+
+/** If CellLatencyHistograms is set, histograms of how long
+ * circuit_receive_relay_cell() takes for each relay command, in usec.
+ * Index 0 is for cells that we relay without recognizing them. */
+static latency_histogram_t
+relay_processing_histograms[N_RELAY_PROCESSING_HISTOGRAMS];
+
+/** If CellLatencyHistograms is set, a histogram of how long cells wait in
+ * circuit queues before we flush them to an OR connection, in msec. */
+static latency_histogram_t queue_delay_histogram;
+
 /** Stats: how many relay cells have originated at this hop, or have
  * been relayed onward (not recognized at this hop)?
  */
@@ -68,38 +90,71 @@ uint64_t stats_n_relay_cells_relayed = 0;
  */
 uint64_t stats_n_relay_cells_delivered = 0;
 
+/** Offset and length of the 'recognized' field in a packed relay header. */
+#define RELAY_RECOGNIZED_OFFSET 1
+#define RELAY_RECOGNIZED_LEN 2
+/** Offset and length of the integrity field in a packed relay header. */
+#define RELAY_INTEGRITY_OFFSET 5
+#define RELAY_INTEGRITY_LEN 4
+
 /** Update digest from the payload of cell. Assign integrity part to
- * cell.
+ * cell, and then encrypt it with <b>cipher</b>, all in one pass over the
+ * payload.
+ *
+ * Return -1 if the crypto fails, else return 0.
  */
-static void
-relay_set_digest(crypto_digest_t *digest, cell_t *cell)
+static int
+relay_set_digest_and_encrypt(crypto_cipher_t *cipher,
+                             crypto_digest_t *digest, cell_t *cell)
 {
-  char integrity[4];
-  relay_header_t rh;
+  if (crypto_cipher_digest_and_encrypt_inplace(cipher, digest,
+                                               (char*) cell->payload,
+                                               CELL_PAYLOAD_SIZE,
+                                               RELAY_INTEGRITY_OFFSET,
+                                               RELAY_INTEGRITY_LEN) < 0) {
+    log_warn(LD_BUG,"Error during relay encryption");
+    return -1;
+  }
+  return 0;
+}
 
-  crypto_digest_add_bytes(digest, (char*)cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, integrity, 4);
-//  log_fn(LOG_DEBUG,"Putting digest of %u %u %u %u into relay cell.",
-//    integrity[0], integrity[1], integrity[2], integrity[3]);
-  relay_header_unpack(&rh, cell->payload);
-  memcpy(rh.integrity, integrity, 4);
-  relay_header_pack(cell->payload, &rh);
+/** Decrypt <b>cell</b> with <b>cipher</b>, and return true iff it's
+ * recognized at this hop: that is, iff its 'recognized' field is zero and
+ * its digest matches <b>digest</b>.  If it is, update <b>digest</b>, and
+ * leave the integrity part zeroed, as relay_digest_matches() would. */
+static INLINE int
+relay_decrypt_and_recognize(crypto_cipher_t *cipher,
+                            crypto_digest_t *digest, cell_t *cell)
+{
+  return crypto_cipher_decrypt_and_check_inplace(cipher, digest,
+                                                 (char*) cell->payload,
+                                                 CELL_PAYLOAD_SIZE,
+                                                 RELAY_RECOGNIZED_OFFSET,
+                                                 RELAY_RECOGNIZED_LEN,
+                                                 RELAY_INTEGRITY_OFFSET,
+                                                 RELAY_INTEGRITY_LEN);
+}
+
+/** Return true iff the (decrypted) relay cell <b>cell</b> could possibly
+ * be recognized at this hop: that is, iff its 'recognized' field is zero.
+ * If it isn't, there's no point in checking the digest. */
+static INLINE int
+relay_cell_may_be_recognized(const cell_t *cell)
+{
+  return get_uint16(cell->payload+RELAY_RECOGNIZED_OFFSET) == 0;
 }
 
 /** Does the digest for this circuit indicate that this cell is for us?
  *
  * Update digest from the payload of cell (with the integrity part set
- * to 0). If the integrity part is valid, return 1, else restore digest
- * and cell to their original state and return 0.
+ * to 0). If the integrity part is valid, return 1, else restore
+ * the cell to its original state and return 0, leaving digest untouched.
  */
 static int
 relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 {
-  char received_integrity[4], calculated_integrity[4];
+  char received_integrity[4];
   relay_header_t rh;
-  crypto_digest_t *backup_digest=NULL;
-
-  backup_digest = crypto_digest_dup(digest);
 
   relay_header_unpack(&rh, cell->payload);
   memcpy(received_integrity, rh.integrity, 4);
@@ -110,24 +165,156 @@ relay_digest_matches(crypto_digest_t *digest, cell_t *cell)
 //    received_integrity[0], received_integrity[1],
 //    received_integrity[2], received_integrity[3]);
 
-  crypto_digest_add_bytes(digest, (char*) cell->payload, CELL_PAYLOAD_SIZE);
-  crypto_digest_get_digest(digest, calculated_integrity, 4);
-
-  if (tor_memneq(received_integrity, calculated_integrity, 4)) {
+  if (!crypto_digest_add_bytes_if_matches(digest, (char*) cell->payload,
+                                          CELL_PAYLOAD_SIZE,
+                                          received_integrity, 4)) {
 //    log_fn(LOG_INFO,"Recognized=0 but bad digest. Not recognizing.");
-// (%d vs %d).", received_integrity, calculated_integrity);
-    /* restore digest to its old form */
-    crypto_digest_assign(digest, backup_digest);
     /* restore the relay header */
     memcpy(rh.integrity, received_integrity, 4);
     relay_header_pack(cell->payload, &rh);
-    crypto_digest_free(backup_digest);
     return 0;
   }
-  crypto_digest_free(backup_digest);
   return 1;
 }
 
+/** How long do we wait after a circuit uses keystream before topping it
+ * up again, in msec?  (This lets a burst of cells finish first.) */
+#define KEYSTREAM_REFILL_DELAY_MSEC 10
+/** How many bytes of keystream do we generate in one go, at most, before
+ * letting the rest of the event loop run? */
+#define KEYSTREAM_REFILL_BUDGET (64*CELL_PAYLOAD_SIZE)
+
+/** If KeystreamPrecomputeCells is set, the circuits that have used up some
+ * of their precomputed keystream since we last topped them up.  Each one
+ * has its keystream_refill_pending flag set. */
+static smartlist_t *circuits_pending_keystream = NULL;
+/** Timer event to top up the keystream of circuits_pending_keystream. */
+static struct event *keystream_refill_timer = NULL;
+/** True iff keystream_refill_timer is scheduled. */
+static int keystream_refill_scheduled = 0;
+
+static void keystream_refill_cb(evutil_socket_t fd, short what, void *arg);
+
+/** Make sure keystream_refill_timer is scheduled. */
+static void
+keystream_refill_schedule(void)
+{
+  struct timeval tv;
+  if (keystream_refill_scheduled)
+    return;
+  tv.tv_sec = 0;
+  tv.tv_usec = KEYSTREAM_REFILL_DELAY_MSEC * 1000;
+  if (!keystream_refill_timer)
+    keystream_refill_timer = tor_evtimer_new(tor_libevent_get_base(),
+                                             keystream_refill_cb, NULL);
+  if (evtimer_add(keystream_refill_timer, &tv) < 0) {
+    log_warn(LD_BUG, "Couldn't add timer for precomputing keystream");
+    return;
+  }
+  keystream_refill_scheduled = 1;
+}
+
+/** Called whenever we crypt a relay cell on <b>circ</b>.  If we're
+ * precomputing keystream, remember to top up <b>circ</b>'s ciphers once
+ * we're idle. */
+static void
+circuit_note_keystream_used(circuit_t *circ)
+{
+  if (PREDICT_LIKELY(!get_options()->KeystreamPrecomputeCells))
+    return;
+  if (circ->keystream_refill_pending || circ->marked_for_close)
+    return;
+  if (!circuits_pending_keystream)
+    circuits_pending_keystream = smartlist_new();
+  smartlist_add(circuits_pending_keystream, circ);
+  circ->keystream_refill_pending = 1;
+  keystream_refill_schedule();
+}
+
+/** Make sure each of the ciphers on <b>circ</b> has <b>len</b> bytes of
+ * keystream precomputed.  Return the number of bytes we generated. */
+static size_t
+circuit_precompute_keystream(circuit_t *circ, size_t len)
+{
+  size_t n = 0;
+  if (CIRCUIT_IS_ORIGIN(circ)) {
+    crypt_path_t *cpath = TO_ORIGIN_CIRCUIT(circ)->cpath, *hop = cpath;
+    if (!hop)
+      return 0;
+    do {
+      if (hop->state != CPATH_STATE_OPEN)
+        break;
+      n += crypto_cipher_precompute_keystream(hop->f_crypto, len);
+      n += crypto_cipher_precompute_keystream(hop->b_crypto, len);
+      hop = hop->next;
+    } while (hop != cpath);
+  } else {
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+    if (or_circ->p_crypto)
+      n += crypto_cipher_precompute_keystream(or_circ->p_crypto, len);
+    if (or_circ->n_crypto)
+      n += crypto_cipher_precompute_keystream(or_circ->n_crypto, len);
+  }
+  return n;
+}
+
+/** Libevent callback: top up the keystream of the circuits in
+ * circuits_pending_keystream, most recently used first, until we run out
+ * of circuits or of KEYSTREAM_REFILL_BUDGET. */
+static void
+keystream_refill_cb(evutil_socket_t fd, short what, void *arg)
+{
+  size_t len = get_options()->KeystreamPrecomputeCells * CELL_PAYLOAD_SIZE;
+  size_t done = 0;
+  (void) fd;
+  (void) what;
+  (void) arg;
+
+  keystream_refill_scheduled = 0;
+  while (circuits_pending_keystream &&
+         smartlist_len(circuits_pending_keystream)) {
+    circuit_t *circ = smartlist_pop_last(circuits_pending_keystream);
+    circ->keystream_refill_pending = 0;
+    if (!len || circ->marked_for_close)
+      continue;
+    done += circuit_precompute_keystream(circ, len);
+    if (done >= KEYSTREAM_REFILL_BUDGET)
+      break;
+  }
+  if (circuits_pending_keystream && smartlist_len(circuits_pending_keystream))
+    keystream_refill_schedule();
+}
+
+/** Called when <b>circ</b> is about to be freed: stop planning to top up
+ * its keystream. */
+void
+circuit_keystream_forget(circuit_t *circ)
+{
+  if (!circ->keystream_refill_pending)
+    return;
+  if (circuits_pending_keystream)
+    smartlist_remove(circuits_pending_keystream, circ);
+  circ->keystream_refill_pending = 0;
+}
+
+/** Release all storage held for precomputing keystream. (The keystream
+ * itself belongs to the circuits' ciphers.) */
+void
+relay_keystream_free_all(void)
+{
+  if (circuits_pending_keystream) {
+    SMARTLIST_FOREACH(circuits_pending_keystream, circuit_t *, circ,
+                      circ->keystream_refill_pending = 0);
+    smartlist_free(circuits_pending_keystream);
+    circuits_pending_keystream = NULL;
+  }
+  if (keystream_refill_timer) {
+    tor_event_free(keystream_refill_timer);
+    keystream_refill_timer = NULL;
+  }
+  keystream_refill_scheduled = 0;
+}
+
 /** Apply <b>cipher</b> to CELL_PAYLOAD_SIZE bytes of <b>in</b>
  * (in place).
  *
@@ -160,11 +347,37 @@ relay_crypt_one_payload(crypto_cipher_t *cipher, uint8_t *in,
  *  - If not recognized, then we need to relay it: append it to the appropriate
  *    cell_queue on <b>circ</b>.
  *
+ * If CellLatencyHistograms is set, note how long all this took.
+ *
  * Return -<b>reason</b> on failure.
  */
 int
 circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                            cell_direction_t cell_direction)
+{
+  uint64_t start, usec;
+  uint8_t command = 0;
+  int r;
+
+  if (PREDICT_LIKELY(!get_options()->CellLatencyHistograms))
+    return circuit_receive_relay_cell_impl(cell, circ, cell_direction,
+                                           &command);
+
+  start = tor_monotime_nsec();
+  r = circuit_receive_relay_cell_impl(cell, circ, cell_direction, &command);
+  usec = (tor_monotime_nsec() - start) / 1000;
+  if (command < N_RELAY_PROCESSING_HISTOGRAMS)
+    latency_histogram_add(&relay_processing_histograms[command], usec);
+  return r;
+}
+
+/** Helper for circuit_receive_relay_cell(): do all of its work.  If the
+ * cell turns out to be for us, set *<b>command_out</b> to its relay
+ * command. */
+static int
+circuit_receive_relay_cell_impl(cell_t *cell, circuit_t *circ,
+                                cell_direction_t cell_direction,
+                                uint8_t *command_out)
 {
   or_connection_t *or_conn=NULL;
   crypt_path_t *layer_hint=NULL;
@@ -182,10 +395,12 @@ circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
     log_warn(LD_BUG,"relay crypt failed. Dropping connection.");
     return -END_CIRC_REASON_INTERNAL;
   }
+  circuit_note_keystream_used(circ);
 
   if (recognized) {
     edge_connection_t *conn = relay_lookup_conn(circ, cell, cell_direction,
                                                 layer_hint);
+    *command_out = get_uint8(cell->payload);
     if (cell_direction == CELL_DIRECTION_OUT) {
       ++stats_n_relay_cells_delivered;
       log_debug(LD_OR,"Sending away from origin.");
@@ -279,8 +494,6 @@ int
 relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
             crypt_path_t **layer_hint, char *recognized)
 {
-  relay_header_t rh;
-
   tor_assert(circ);
   tor_assert(cell);
   tor_assert(recognized);
@@ -300,17 +513,11 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
       do { /* Remember: cpath is in forward order, that is, first hop first. */
         tor_assert(thishop);
 
-        if (relay_crypt_one_payload(thishop->b_crypto, cell->payload, 0) < 0)
-          return -1;
-
-        relay_header_unpack(&rh, cell->payload);
-        if (rh.recognized == 0) {
-          /* it's possibly recognized. have to check digest to be sure. */
-          if (relay_digest_matches(thishop->b_digest, cell)) {
-            *recognized = 1;
-            *layer_hint = thishop;
-            return 0;
-          }
+        if (relay_decrypt_and_recognize(thishop->b_crypto,
+                                        thishop->b_digest, cell)) {
+          *recognized = 1;
+          *layer_hint = thishop;
+          return 0;
         }
 
         thishop = thishop->next;
@@ -319,31 +526,113 @@ relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
              "Incoming cell at client not recognized. Closing.");
       return -1;
     } else { /* we're in the middle. Just one crypt. */
-      if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->p_crypto,
-                                  cell->payload, 1) < 0)
+      or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
+      if (or_circ->p_crypto_n_ahead) {
+        /* relay_crypt_cell_batch() already did this cell's crypt. */
+        --or_circ->p_crypto_n_ahead;
+      } else if (relay_crypt_one_payload(or_circ->p_crypto,
+                                         cell->payload, 1) < 0) {
         return -1;
+      }
 //      log_fn(LOG_DEBUG,"Skipping recognized check, because we're not "
 //             "the client.");
     }
   } else /* cell_direction == CELL_DIRECTION_OUT */ {
     /* we're in the middle. Just one crypt. */
+    or_circuit_t *or_circ = TO_OR_CIRCUIT(circ);
 
-    if (relay_crypt_one_payload(TO_OR_CIRCUIT(circ)->n_crypto,
-                                cell->payload, 0) < 0)
-      return -1;
-
-    relay_header_unpack(&rh, cell->payload);
-    if (rh.recognized == 0) {
-      /* it's possibly recognized. have to check digest to be sure. */
-      if (relay_digest_matches(TO_OR_CIRCUIT(circ)->n_digest, cell)) {
+    if (or_circ->n_crypto_n_ahead) {
+      /* relay_crypt_cell_batch() already did this cell's crypt. */
+      --or_circ->n_crypto_n_ahead;
+      if (relay_cell_may_be_recognized(cell) &&
+          relay_digest_matches(or_circ->n_digest, cell)) {
         *recognized = 1;
         return 0;
       }
+    } else if (relay_decrypt_and_recognize(or_circ->n_crypto,
+                                           or_circ->n_digest, cell)) {
+      *recognized = 1;
+      return 0;
     }
   }
   return 0;
 }
 
+/** Apply this hop's layer of crypto, in one call, to each of the
+ * <b>n_cells</b> relay cells in <b>cells</b>, all of which arrived on the
+ * non-origin circuit <b>circ</b> in direction <b>cell_direction</b> and
+ * are about to be handed to circuit_receive_relay_cell() in order.  Each
+ * cell is then skipped by relay_crypt(), which still does the recognized
+ * check.  Callers must call relay_crypt_cell_batch_done() once the cells
+ * have been processed.
+ *
+ * Return -1 if the crypto fails, else return 0.
+ */
+int
+relay_crypt_cell_batch(circuit_t *circ, cell_t **cells, int n_cells,
+                       cell_direction_t cell_direction)
+{
+  or_circuit_t *or_circ;
+  crypto_cipher_t *cipher;
+  uint16_t *n_ahead;
+  char *payloads[RELAY_CRYPT_BATCH_MAX];
+  int i;
+
+  tor_assert(circ);
+  tor_assert(cells);
+  tor_assert(!CIRCUIT_IS_ORIGIN(circ));
+  tor_assert(n_cells >= 0 && n_cells <= RELAY_CRYPT_BATCH_MAX);
+  tor_assert(cell_direction == CELL_DIRECTION_IN ||
+             cell_direction == CELL_DIRECTION_OUT);
+
+  or_circ = TO_OR_CIRCUIT(circ);
+  if (cell_direction == CELL_DIRECTION_IN) {
+    cipher = or_circ->p_crypto;
+    n_ahead = &or_circ->p_crypto_n_ahead;
+  } else {
+    cipher = or_circ->n_crypto;
+    n_ahead = &or_circ->n_crypto_n_ahead;
+  }
+  tor_assert(*n_ahead == 0);
+
+  if (!cipher || circ->marked_for_close || !n_cells)
+    return 0;
+
+  for (i = 0; i < n_cells; ++i)
+    payloads[i] = (char*) cells[i]->payload;
+
+  if (crypto_cipher_crypt_inplace_multi(cipher, payloads,
+                                        CELL_PAYLOAD_SIZE, n_cells) < 0) {
+    log_warn(LD_BUG,"Error during batched relay encryption");
+    return -1;
+  }
+  *n_ahead = (uint16_t) n_cells;
+  return 0;
+}
+
+/** Called after the cells passed to relay_crypt_cell_batch() for
+ * <b>circ</b> have all been handed to circuit_receive_relay_cell().  If
+ * any of them never reached relay_crypt(), our cipher state is now ahead of
+ * the cells we've handled, so the circuit can't be used any longer. */
+void
+relay_crypt_cell_batch_done(circuit_t *circ)
+{
+  or_circuit_t *or_circ;
+  tor_assert(circ);
+  tor_assert(!CIRCUIT_IS_ORIGIN(circ));
+  or_circ = TO_OR_CIRCUIT(circ);
+
+  if (PREDICT_UNLIKELY(or_circ->p_crypto_n_ahead ||
+                       or_circ->n_crypto_n_ahead)) {
+    or_circ->p_crypto_n_ahead = or_circ->n_crypto_n_ahead = 0;
+    if (!circ->marked_for_close) {
+      log_warn(LD_BUG, "Batched relay cells were crypted but never "
+               "processed on an open circuit. Closing it.");
+      circuit_mark_for_close(circ, END_CIRC_REASON_INTERNAL);
+    }
+  }
+}
+
 /** Package a relay cell from an edge:
  *  - Encrypt it to the right layer
  *  - Append it to the appropriate cell_queue on <b>circ</b>.
@@ -363,20 +652,21 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
       return 0; /* just drop it */
     }
 
-    relay_set_digest(layer_hint->f_digest, cell);
+    if (relay_set_digest_and_encrypt(layer_hint->f_crypto,
+                                     layer_hint->f_digest, cell) < 0)
+      return -1;
 
     thishop = layer_hint;
     /* moving from farthest to nearest hop */
-    do {
+    while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath) {
+      thishop = thishop->prev;
       tor_assert(thishop);
       /* XXXX RD This is a bug, right? */
       log_debug(LD_OR,"crypting a layer of the relay cell.");
       if (relay_crypt_one_payload(thishop->f_crypto, cell->payload, 1) < 0) {
         return -1;
       }
-
-      thishop = thishop->prev;
-    } while (thishop != TO_ORIGIN_CIRCUIT(circ)->cpath->prev);
+    }
 
   } else { /* incoming cell */
     or_circuit_t *or_circ;
@@ -389,31 +679,53 @@ circuit_package_relay_cell(cell_t *cell, circuit_t *circ,
     }
     or_circ = TO_OR_CIRCUIT(circ);
     conn = or_circ->p_conn;
-    relay_set_digest(or_circ->p_digest, cell);
-    if (relay_crypt_one_payload(or_circ->p_crypto, cell->payload, 1) < 0)
+    if (PREDICT_UNLIKELY(or_circ->p_crypto_n_ahead)) {
+      /* We'd use keystream that already belongs to a batched cell. */
+      log_warn(LD_BUG, "Tried to package a cell in the middle of a batch "
+               "of relay cells on the same circuit.");
+      return -1;
+    }
+    if (relay_set_digest_and_encrypt(or_circ->p_crypto, or_circ->p_digest,
+                                     cell) < 0)
       return -1;
   }
+  circuit_note_keystream_used(circ);
   ++stats_n_relay_cells_relayed;
 
   append_cell_to_circuit_queue(circ, conn, cell, cell_direction, on_stream);
   return 0;
 }
 
+/** Once relay_lookup_conn() has to walk past this many streams to find the
+ * one it wants, start remembering streams in the circuit's stream map. */
+#define STREAM_MAP_THRESHOLD 16
+
 /** If cell's stream_id matches the stream_id of any conn that's
  * attached to circ, return that conn, else return NULL.
  */
-static edge_connection_t *
+edge_connection_t *
 relay_lookup_conn(circuit_t *circ, cell_t *cell,
                   cell_direction_t cell_direction, crypt_path_t *layer_hint)
 {
   edge_connection_t *tmpconn;
   relay_header_t rh;
+  int n_scanned = 0;
 
   relay_header_unpack(&rh, cell->payload);
 
   if (!rh.stream_id)
     return NULL;
 
+  /* If we've remembered which stream has this ID, and it's one that the
+   * walk below would accept, skip the walk. */
+  tmpconn = circuit_stream_map_lookup(circ, rh.stream_id);
+  if (tmpconn && !tmpconn->_base.marked_for_close) {
+    if (CIRCUIT_IS_ORIGIN(circ) ? tmpconn->cpath_layer == layer_hint :
+        (cell_direction == CELL_DIRECTION_OUT ||
+         connection_edge_is_rendezvous_stream(tmpconn)))
+      return tmpconn;
+  }
+
   /* IN or OUT cells could have come from either direction, now
    * that we allow rendezvous *to* an OP.
    */
@@ -421,19 +733,25 @@ relay_lookup_conn(circuit_t *circ, cell_t *cell,
   if (CIRCUIT_IS_ORIGIN(circ)) {
     for (tmpconn = TO_ORIGIN_CIRCUIT(circ)->p_streams; tmpconn;
          tmpconn=tmpconn->next_stream) {
+      ++n_scanned;
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->_base.marked_for_close &&
           tmpconn->cpath_layer == layer_hint) {
         log_debug(LD_APP,"found conn for stream %d.", rh.stream_id);
+        if (circ->stream_map || n_scanned >= STREAM_MAP_THRESHOLD)
+          circuit_stream_map_set(circ, tmpconn);
         return tmpconn;
       }
     }
   } else {
     for (tmpconn = TO_OR_CIRCUIT(circ)->n_streams; tmpconn;
          tmpconn=tmpconn->next_stream) {
+      ++n_scanned;
       if (rh.stream_id == tmpconn->stream_id &&
           !tmpconn->_base.marked_for_close) {
         log_debug(LD_EXIT,"found conn for stream %d.", rh.stream_id);
+        if (circ->stream_map || n_scanned >= STREAM_MAP_THRESHOLD)
+          circuit_stream_map_set(circ, tmpconn);
         if (cell_direction == CELL_DIRECTION_OUT ||
             connection_edge_is_rendezvous_stream(tmpconn))
           return tmpconn;
@@ -1115,6 +1433,8 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
       }
       log_debug(domain,"circ deliver_window now %d.", layer_hint ?
                 layer_hint->deliver_window : circ->deliver_window);
+      adaptive_window_note_cell_delivered(
+                            circuit_get_adaptive_window(circ, layer_hint));
 
       circuit_consider_sending_sendme(circ, layer_hint);
 
@@ -1181,7 +1501,9 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
         return 0;
       }
       if (cell->command != CELL_RELAY_EARLY &&
-          !networkstatus_get_param(NULL,"AllowNonearlyExtend",0,0,1)) {
+          !networkstatus_get_param_by_id(NULL,
+                                         NET_PARAM_ALLOW_NONEARLY_EXTEND,
+                                         0, 0, 1)) {
 #define EARLY_WARNING_INTERVAL 3600
         static ratelim_t early_warning_limit =
           RATELIM_INIT(EARLY_WARNING_INTERVAL);
@@ -1219,6 +1541,8 @@ connection_edge_process_relay_cell(cell_t *cell, circuit_t *circ,
         log_warn(domain,"circuit_finish_handshake failed.");
         return reason;
       }
+      if (reason > 0)
+        return 0; /* a cpuworker will finish it, and send the next skin. */
       if ((reason=circuit_send_next_onion_skin(TO_ORIGIN_CIRCUIT(circ)))<0) {
         log_info(domain,"circuit_send_next_onion_skin() failed.");
         return reason;
@@ -1353,6 +1677,128 @@ uint64_t stats_n_data_cells_received = 0;
  * ever received were completely full of data. */
 uint64_t stats_n_data_bytes_received = 0;
 
+/** List of all edge connections whose coalescing_data flag is set, in the
+ * order in which they started waiting.  Since everybody waits for the same
+ * DataCellCoalesceDelay, this is also the order in which they're due. */
+static smartlist_t *conns_coalescing = NULL;
+/** Timer event to package the partial cells of the first connections in
+ * conns_coalescing once they are due. */
+static struct event *coalesce_timer = NULL;
+
+static void coalesce_timer_cb(evutil_socket_t fd, short what, void *arg);
+
+/** Set coalesce_timer to fire when the first connection in
+ * conns_coalescing is due. */
+static void
+coalesce_timer_schedule(void)
+{
+  edge_connection_t *conn;
+  struct timeval tv;
+  int32_t msec;
+
+  if (!conns_coalescing || !smartlist_len(conns_coalescing))
+    return;
+  conn = smartlist_get(conns_coalescing, 0);
+  msec = (int32_t)(conn->coalesce_until_msec - cell_queue_now_msec());
+  if (msec < 0)
+    msec = 0;
+  tv.tv_sec = msec / 1000;
+  tv.tv_usec = (msec % 1000) * 1000;
+
+  if (!coalesce_timer)
+    coalesce_timer = tor_evtimer_new(tor_libevent_get_base(),
+                                     coalesce_timer_cb, NULL);
+  if (evtimer_add(coalesce_timer, &tv) < 0)
+    log_warn(LD_BUG, "Couldn't add timer for coalescing data cells");
+}
+
+/** Libevent callback: package the partial cells of every connection in
+ * conns_coalescing that has waited long enough. */
+static void
+coalesce_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+  uint32_t now;
+  (void) fd;
+  (void) what;
+  (void) arg;
+
+  tor_gettimeofday_cache_clear();
+  now = cell_queue_now_msec();
+  while (conns_coalescing && smartlist_len(conns_coalescing)) {
+    edge_connection_t *conn = smartlist_get(conns_coalescing, 0);
+    if ((int32_t)(conn->coalesce_until_msec - now) > 0)
+      break;
+    smartlist_del_keeporder(conns_coalescing, 0);
+    conn->coalescing_data = 0;
+    if (conn->_base.marked_for_close)
+      continue;
+    conn->coalesce_due = 1;
+    if (connection_edge_package_raw_inbuf(conn, 1, NULL) < 0) {
+      /* (We already sent an end cell if possible) */
+      connection_mark_for_close(TO_CONN(conn));
+    }
+  }
+  coalesce_timer_schedule();
+}
+
+/** Return true iff we should hold back the partial cell's worth of data on
+ * the inbuf of <b>conn</b> for now, to see if more data arrives. */
+int
+connection_edge_should_coalesce(edge_connection_t *conn)
+{
+  const int delay = get_options()->DataCellCoalesceDelay;
+
+  if (conn->coalesce_due) {
+    conn->coalesce_due = 0;
+    return 0;
+  }
+  if (delay <= 0 || conn->_base.inbuf_reached_eof)
+    return 0;
+  if (conn->coalescing_data)
+    return 1;
+
+  conn->coalescing_data = 1;
+  conn->coalesce_until_msec = cell_queue_now_msec() + delay;
+  if (!conns_coalescing)
+    conns_coalescing = smartlist_new();
+  smartlist_add(conns_coalescing, conn);
+  if (smartlist_len(conns_coalescing) == 1)
+    coalesce_timer_schedule();
+  return 1;
+}
+
+/** Stop holding back partial cells on <b>conn</b>: called when it's about
+ * to be freed. */
+void
+connection_edge_cancel_coalescing(edge_connection_t *conn)
+{
+  if (!conn->coalescing_data)
+    return;
+  SMARTLIST_FOREACH_BEGIN(conns_coalescing, edge_connection_t *, c) {
+    if (c == conn) {
+      smartlist_del_keeporder(conns_coalescing, c_sl_idx);
+      break;
+    }
+  } SMARTLIST_FOREACH_END(c);
+  conn->coalescing_data = 0;
+}
+
+/** Release all storage held for coalescing partial data cells. */
+void
+connection_edge_coalescing_free_all(void)
+{
+  if (conns_coalescing) {
+    SMARTLIST_FOREACH(conns_coalescing, edge_connection_t *, conn,
+                      conn->coalescing_data = 0);
+    smartlist_free(conns_coalescing);
+    conns_coalescing = NULL;
+  }
+  if (coalesce_timer) {
+    tor_event_free(coalesce_timer);
+    coalesce_timer = NULL;
+  }
+}
+
 /** If <b>conn</b> has an entire relay payload of bytes on its inbuf (or
  * <b>package_partial</b> is true), and the appropriate package windows aren't
  * empty, grab a cell and send it down the circuit.
@@ -1362,6 +1808,13 @@ uint64_t stats_n_data_bytes_received = 0;
  *
  * Return -1 (and send a RELAY_COMMAND_END cell if necessary) if conn should
  * be marked for close, else return 0.
+ *
+ * XXXX Every cell for a stream goes down the single circuit in
+ * conn->on_circuit, so a bulk stream is only as fast as the slowest hop
+ * on that path.  Striping DATA cells over several linked circuits to the
+ * same exit would need a new relay command, per-cell sequence numbers and
+ * a reorder buffer at the exit: that's a protocol change, and needs a
+ * proposal before it can live here.
  */
 int
 connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
@@ -1427,7 +1880,9 @@ connection_edge_package_raw_inbuf(edge_connection_t *conn, int package_partial,
   if (!bytes_to_process)
     return 0;
 
-  if (!package_partial && bytes_to_process < RELAY_PAYLOAD_SIZE)
+  if (bytes_to_process < RELAY_PAYLOAD_SIZE &&
+      (!package_partial ||
+       (!sending_from_optimistic && connection_edge_should_coalesce(conn))))
     return 0;
 
   if (bytes_to_process > RELAY_PAYLOAD_SIZE) {
@@ -1504,6 +1959,7 @@ void
 connection_edge_consider_sending_sendme(edge_connection_t *conn)
 {
   circuit_t *circ;
+  int window;
 
   if (connection_outbuf_too_full(TO_CONN(conn)))
     return;
@@ -1516,7 +1972,13 @@ connection_edge_consider_sending_sendme(edge_connection_t *conn)
     return;
   }
 
-  while (conn->deliver_window <= STREAMWINDOW_START - STREAMWINDOW_INCREMENT) {
+  /* Scale the stream window along with the circuit window, so that a single
+   * stream can still fill the circuit. */
+  window = adaptive_window_get_target(
+                   circuit_get_adaptive_window(circ, conn->cpath_layer)) *
+    STREAMWINDOW_START / CIRCWINDOW_START;
+
+  while (conn->deliver_window <= window - STREAMWINDOW_INCREMENT) {
     log_debug(conn->_base.type == CONN_TYPE_AP ?LD_APP:LD_EXIT,
               "Outbuf %d, Queuing stream sendme.",
               (int)conn->_base.outbuf_flushlen);
@@ -1560,12 +2022,12 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
                                    circuit_t *circ,
                                    crypt_path_t *layer_hint)
 {
-  edge_connection_t *conn;
-  int n_packaging_streams, n_streams_left;
+  edge_connection_t *conn, *start_conn, *last_served = NULL;
+  smartlist_t *ready, *still_ready;
   int packaged_this_round;
   int cells_on_queue;
   int cells_per_conn;
-  edge_connection_t *chosen_stream = NULL;
+  int result = 0;
 
   /* How many cells do we have space for?  It will be the minimum of
    * the number needed to exhaust the package window, and the minimum
@@ -1583,110 +2045,100 @@ circuit_resume_edge_reading_helper(edge_connection_t *first_conn,
   /* Once we used to start listening on the streams in the order they
    * appeared in the linked list.  That leads to starvation on the
    * streams that appeared later on the list, since the first streams
-   * would always get to read first.  Instead, we just pick a random
-   * stream on the list, and enable reading for streams starting at that
-   * point (and wrapping around as if the list were circular).  It would
-   * probably be better to actually remember which streams we've
-   * serviced in the past, but this is simple and effective. */
-
-  /* Select a stream uniformly at random from the linked list.  We
-   * don't need cryptographic randomness here. */
-  {
-    int num_streams = 0;
-    for (conn = first_conn; conn; conn = conn->next_stream) {
-      num_streams++;
-      if ((tor_weak_random() % num_streams)==0)
-        chosen_stream = conn;
-      /* Invariant: chosen_stream has been chosen uniformly at random from
-       * among the first num_streams streams on first_conn. */
-    }
-  }
-
-  /* Count how many non-marked streams there are that have anything on
-   * their inbuf, and enable reading on all of the connections. */
-  n_packaging_streams = 0;
-  /* Activate reading starting from the chosen stream */
-  for (conn=chosen_stream; conn; conn = conn->next_stream) {
-    /* Start reading for the streams starting from here */
-    if (conn->_base.marked_for_close || conn->package_window <= 0)
-      continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
+   * would always get to read first.  Instead, we remember on the circuit
+   * which stream comes after the last one we serviced, and start there
+   * (wrapping around as if the list were circular). */
+  start_conn = circ->next_stream_to_resume;
+  if (!start_conn)
+    start_conn = first_conn;
+
+  /* Enable reading on all of the connections that can package, and list the
+   * ones that have anything on their inbuf, in the order we'll serve them.
+   * Only those get looked at again below. */
+  ready = smartlist_new_small();
+  still_ready = smartlist_new_small();
+  for (conn = start_conn; conn; ) {
+    if (!conn->_base.marked_for_close && conn->package_window > 0 &&
+        (!layer_hint || conn->cpath_layer == layer_hint)) {
       connection_start_reading(TO_CONN(conn));
 
       if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
-        ++n_packaging_streams;
-    }
-  }
-  /* Go back and do the ones we skipped, circular-style */
-  for (conn = first_conn; conn != chosen_stream; conn = conn->next_stream) {
-    if (conn->_base.marked_for_close || conn->package_window <= 0)
-      continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
-      connection_start_reading(TO_CONN(conn));
-
-      if (connection_get_inbuf_len(TO_CONN(conn)) > 0)
-        ++n_packaging_streams;
+        smartlist_add(ready, conn);
     }
+    conn = conn->next_stream ? conn->next_stream : first_conn;
+    if (conn == start_conn)
+      break;
   }
 
-  if (n_packaging_streams == 0) /* avoid divide-by-zero */
-    return 0;
-
  again:
+  if (!smartlist_len(ready)) /* avoid divide-by-zero */
+    goto done;
 
-  cells_per_conn = CEIL_DIV(max_to_package, n_packaging_streams);
+  cells_per_conn = CEIL_DIV(max_to_package, smartlist_len(ready));
 
   packaged_this_round = 0;
-  n_streams_left = 0;
 
-  /* Iterate over all connections.  Package up to cells_per_conn cells on
-   * each.  Update packaged_this_round with the total number of cells
-   * packaged, and n_streams_left with the number that still have data to
-   * package.
+  /* Iterate over the connections with data.  Package up to cells_per_conn
+   * cells on each.  Update packaged_this_round with the total number of
+   * cells packaged, and still_ready with the streams that still have data
+   * to package.
    */
-  for (conn=first_conn; conn; conn=conn->next_stream) {
-    if (conn->_base.marked_for_close || conn->package_window <= 0)
+  SMARTLIST_FOREACH_BEGIN(ready, edge_connection_t *, c) {
+    int n = cells_per_conn, r;
+    if (c->_base.marked_for_close || c->package_window <= 0)
       continue;
-    if (!layer_hint || conn->cpath_layer == layer_hint) {
-      int n = cells_per_conn, r;
-      /* handle whatever might still be on the inbuf */
-      r = connection_edge_package_raw_inbuf(conn, 1, &n);
+    /* handle whatever might still be on the inbuf */
+    r = connection_edge_package_raw_inbuf(c, 1, &n);
+    last_served = c;
 
-      /* Note how many we packaged */
-      packaged_this_round += (cells_per_conn-n);
+    /* Note how many we packaged */
+    packaged_this_round += (cells_per_conn-n);
 
-      if (r<0) {
-        /* Problem while packaging. (We already sent an end cell if
-         * possible) */
-        connection_mark_for_close(TO_CONN(conn));
-        continue;
-      }
+    if (r<0) {
+      /* Problem while packaging. (We already sent an end cell if
+       * possible) */
+      connection_mark_for_close(TO_CONN(c));
+      continue;
+    }
 
-      /* If there's still data to read, we'll be coming back to this stream. */
-      if (connection_get_inbuf_len(TO_CONN(conn)))
-          ++n_streams_left;
+    /* If there's still data to read, we'll be coming back to this stream. */
+    if (connection_get_inbuf_len(TO_CONN(c)))
+      smartlist_add(still_ready, c);
 
-      /* If the circuit won't accept any more data, return without looking
-       * at any more of the streams. Any connections that should be stopped
-       * have already been stopped by connection_edge_package_raw_inbuf. */
-      if (circuit_consider_stop_edge_reading(circ, layer_hint))
-        return -1;
-      /* XXXX should we also stop immediately if we fill up the cell queue?
-       * Probably. */
+    if (circ->marked_for_close)
+      goto done;
+
+    /* If the circuit won't accept any more data, return without looking
+     * at any more of the streams. Any connections that should be stopped
+     * have already been stopped by connection_edge_package_raw_inbuf. */
+    if (circuit_consider_stop_edge_reading(circ, layer_hint)) {
+      result = -1;
+      goto done;
     }
-  }
+    /* XXXX should we also stop immediately if we fill up the cell queue?
+     * Probably. */
+  } SMARTLIST_FOREACH_END(c);
 
   /* If we made progress, and we are willing to package more, and there are
    * any streams left that want to package stuff... try again!
    */
   if (packaged_this_round && packaged_this_round < max_to_package &&
-      n_streams_left) {
+      smartlist_len(still_ready)) {
+    smartlist_t *tmp = ready;
+    ready = still_ready;
+    still_ready = tmp;
+    smartlist_clear(still_ready);
     max_to_package -= packaged_this_round;
-    n_packaging_streams = n_streams_left;
     goto again;
   }
 
-  return 0;
+ done:
+  if (last_served && !circ->marked_for_close &&
+      last_served->on_circuit == circ)
+    circ->next_stream_to_resume = last_served->next_stream;
+  smartlist_free(ready);
+  smartlist_free(still_ready);
+  return result;
 }
 
 /** Check if the package window for <b>circ</b> is empty (at
@@ -1728,6 +2180,133 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
   return 0;
 }
 
+/** Default and maximum values for the consensus parameters that bound the
+ * circuit-level deliver window when AdaptiveCircuitWindows is set. */
+#define ADAPTIVE_CIRCWINDOW_MIN_DEFAULT CIRCWINDOW_START
+#define ADAPTIVE_CIRCWINDOW_MAX_DEFAULT 4000
+#define ADAPTIVE_CIRCWINDOW_MAX_MAX 20000
+
+/** How much larger than our estimate of the bandwidth-delay product do we
+ * make an adaptive window?  Because the rate we measure is limited by the
+ * window itself, a gain above 1 is what lets the window grow until the
+ * network, rather than the window, limits the rate. */
+#define ADAPTIVE_WINDOW_GAIN 1.25
+
+/*
+ * Adaptive deliver windows.
+ *
+ * A sender may have at most as many cells in flight as the receiver's
+ * deliver window allows, so a fixed window caps each circuit at
+ * CIRCWINDOW_START cells per round trip.  When AdaptiveCircuitWindows is
+ * set, we estimate the bandwidth-delay product of each hop whose cells we
+ * deliver, and send SENDMEs early or late enough that the deliver window
+ * tracks it.  The sender does not need to know: it already accepts any
+ * number of SENDMEs.
+ *
+ * For the rate, we count the cells delivered between the SENDMEs we send.
+ * For the round-trip time, note that if our deliver window is D just before
+ * we send a SENDME, the sender cannot have sent the D+1'th cell after that
+ * until the SENDME reached it.  So the time until that cell arrives is at
+ * least one round trip, and about one round trip when the window is what
+ * limits the sender; we keep the smallest such sample.
+ */
+
+/** Return the adaptive window state for hop <b>layer_hint</b> of
+ * <b>circ</b>, or for <b>circ</b> itself if <b>layer_hint</b> is NULL. */
+static adaptive_window_t *
+circuit_get_adaptive_window(circuit_t *circ, crypt_path_t *layer_hint)
+{
+  return layer_hint ? &layer_hint->adaptive_window : &circ->adaptive_window;
+}
+
+/** Return the circuit-level deliver window we're aiming for at the hop
+ * whose adaptive state is <b>aw</b>. */
+int
+adaptive_window_get_target(const adaptive_window_t *aw)
+{
+  if (!get_options()->AdaptiveCircuitWindows || !aw->target)
+    return CIRCWINDOW_START;
+  return aw->target;
+}
+
+/** Recompute the window target of <b>aw</b> from its current rate and
+ * round-trip time estimates, within the bounds from the consensus. */
+static void
+adaptive_window_update_target(adaptive_window_t *aw)
+{
+  int32_t lo, hi;
+  double target;
+
+  if (!aw->rtt_min_msec || aw->rate <= 0.0)
+    return;
+
+  lo = networkstatus_get_param_by_id(NULL, NET_PARAM_ADAPTIVE_CIRCWINDOW_MIN,
+                                     ADAPTIVE_CIRCWINDOW_MIN_DEFAULT,
+                                     CIRCWINDOW_START_MIN, CIRCWINDOW_START);
+  hi = networkstatus_get_param_by_id(NULL, NET_PARAM_ADAPTIVE_CIRCWINDOW_MAX,
+                                     ADAPTIVE_CIRCWINDOW_MAX_DEFAULT,
+                                     CIRCWINDOW_START,
+                                     ADAPTIVE_CIRCWINDOW_MAX_MAX);
+
+  target = aw->rate * aw->rtt_min_msec / 1000.0 * ADAPTIVE_WINDOW_GAIN;
+  if (target < lo)
+    target = lo;
+  else if (target > hi)
+    target = hi;
+  aw->target = (int)target;
+}
+
+/** Note that we have delivered a cell from the hop whose adaptive state is
+ * <b>aw</b>, and finish the round-trip time sample if this is the cell
+ * we were waiting for. */
+void
+adaptive_window_note_cell_delivered(adaptive_window_t *aw)
+{
+  uint32_t rtt;
+
+  if (!get_options()->AdaptiveCircuitWindows)
+    return;
+
+  ++aw->n_delivered;
+  if (!aw->cells_until_rtt_sample || --aw->cells_until_rtt_sample)
+    return;
+
+  rtt = cell_queue_now_msec() - aw->rtt_sample_start_msec;
+  if (rtt < 1)
+    rtt = 1;
+  if (!aw->rtt_min_msec || rtt < aw->rtt_min_msec)
+    aw->rtt_min_msec = rtt;
+  adaptive_window_update_target(aw);
+}
+
+/** Note that we are about to send a SENDME to the hop whose adaptive state
+ * is <b>aw</b>, while our deliver window for it is
+ * <b>deliver_window</b>. */
+void
+adaptive_window_note_sendme(adaptive_window_t *aw, int deliver_window)
+{
+  uint32_t now;
+
+  if (!get_options()->AdaptiveCircuitWindows)
+    return;
+
+  now = cell_queue_now_msec();
+  if (!aw->last_sendme_msec || now != aw->last_sendme_msec) {
+    if (aw->last_sendme_msec && aw->n_delivered) {
+      double sample = aw->n_delivered * 1000.0 /
+        (uint32_t)(now - aw->last_sendme_msec);
+      aw->rate = aw->rate > 0.0 ? (3*aw->rate + sample) / 4 : sample;
+    }
+    aw->last_sendme_msec = now;
+    aw->n_delivered = 0;
+  }
+
+  if (!aw->cells_until_rtt_sample) {
+    aw->rtt_sample_start_msec = now;
+    aw->cells_until_rtt_sample = (deliver_window > 0 ? deliver_window : 0) + 1;
+  }
+}
+
 /** Check if the deliver_window for circuit <b>circ</b> (at hop
  * <b>layer_hint</b> if it's defined) is low enough that we should
  * send a circuit-level sendme back down the circuit. If so, send
@@ -1737,11 +2316,15 @@ circuit_consider_stop_edge_reading(circuit_t *circ, crypt_path_t *layer_hint)
 static void
 circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 {
+  adaptive_window_t *aw = circuit_get_adaptive_window(circ, layer_hint);
+  const int window = adaptive_window_get_target(aw);
 //  log_fn(LOG_INFO,"Considering: layer_hint is %s",
 //         layer_hint ? "defined" : "null");
   while ((layer_hint ? layer_hint->deliver_window : circ->deliver_window) <=
-          CIRCWINDOW_START - CIRCWINDOW_INCREMENT) {
+          window - CIRCWINDOW_INCREMENT) {
     log_debug(LD_CIRC,"Queuing circuit sendme.");
+    adaptive_window_note_sendme(aw, layer_hint ? layer_hint->deliver_window
+                                               : circ->deliver_window);
     if (layer_hint)
       layer_hint->deliver_window += CIRCWINDOW_INCREMENT;
     else
@@ -1762,11 +2345,21 @@ circuit_consider_sending_sendme(circuit_t *circ, crypt_path_t *layer_hint)
 #define assert_active_circuits_ok_paranoid(conn)
 #endif
 
-/** The total number of cells we have allocated from the memory pool. */
+/** The total number of cells stored in all cell queues. */
 static int total_cells_allocated = 0;
 
-/** A memory pool to allocate packed_cell_t objects. */
-static mp_pool_t *cell_pool = NULL;
+/** The total number of cell_queue_block_t that are part of some cell
+ * queue. */
+static int total_cell_blocks_in_queues = 0;
+
+/** A memory pool to allocate cell_queue_block_t objects. */
+static mp_pool_t *cell_block_pool = NULL;
+
+/** The most recently emptied cell_queue_block_t, if any.  We hold on to it
+ * (rather than returning it to cell_block_pool right away) so that the cell
+ * returned by the last call to cell_queue_pop() stays readable for a
+ * moment, and so that the next queue to need a block can reuse it. */
+static cell_queue_block_t *spare_cell_block = NULL;
 
 /** Memory pool to allocate insertion_time_elem_t objects used for cell
  * statistics. */
@@ -1776,8 +2369,8 @@ static mp_pool_t *it_pool = NULL;
 void
 init_cell_pool(void)
 {
-  tor_assert(!cell_pool);
-  cell_pool = mp_pool_new(sizeof(packed_cell_t), 128*1024);
+  tor_assert(!cell_block_pool);
+  cell_block_pool = mp_pool_new(sizeof(cell_queue_block_t), 128*1024);
 }
 
 /** Free all storage used to hold cells (and insertion times if we measure
@@ -1786,9 +2379,10 @@ void
 free_cell_pool(void)
 {
   /* Maybe we haven't called init_cell_pool yet; need to check for it. */
-  if (cell_pool) {
-    mp_pool_destroy(cell_pool);
-    cell_pool = NULL;
+  if (cell_block_pool) {
+    mp_pool_destroy(cell_block_pool);
+    cell_block_pool = NULL;
+    spare_cell_block = NULL;
   }
   if (it_pool) {
     mp_pool_destroy(it_pool);
@@ -1800,24 +2394,55 @@ free_cell_pool(void)
 void
 clean_cell_pool(void)
 {
-  tor_assert(cell_pool);
-  mp_pool_clean(cell_pool, 0, 1);
+  tor_assert(cell_block_pool);
+  mp_pool_clean(cell_block_pool, 0, 1);
 }
 
-/** Release storage held by <b>cell</b>. */
+/** Return a new, empty cell_queue_block_t. */
+static INLINE cell_queue_block_t *
+cell_queue_block_new(void)
+{
+  cell_queue_block_t *block;
+  if (spare_cell_block) {
+    block = spare_cell_block;
+    spare_cell_block = NULL;
+  } else {
+    block = mp_pool_get(cell_block_pool);
+  }
+  block->next = NULL;
+  block->first = block->last = 0;
+  block->n_buf_refs = 0;
+  block->released = 0;
+  return block;
+}
+
+/** Release <b>block</b>, which no longer holds any queued cells.  The cells
+ * in it stay readable for as long as an outbuf still refers to them.
+ * Otherwise, they stay readable only until the next call to
+ * cell_queue_block_release() frees the block, or the next call to
+ * cell_queue_block_new() reuses it. */
 static INLINE void
-packed_cell_free_unchecked(packed_cell_t *cell)
+cell_queue_block_release(cell_queue_block_t *block)
 {
-  --total_cells_allocated;
-  mp_pool_release(cell);
+  if (block->n_buf_refs) {
+    block->released = 1;
+    return;
+  }
+  if (spare_cell_block)
+    mp_pool_release(spare_cell_block);
+  spare_cell_block = block;
 }
 
-/** Allocate and return a new packed_cell_t. */
-static INLINE packed_cell_t *
-packed_cell_alloc(void)
+/** Release function for outbuf chunks that refer to cells in a
+ * cell_queue_block_t: drop one reference to the block <b>arg</b>, and
+ * release it if the queue is already done with it. */
+static void
+cell_queue_block_unref(void *arg)
 {
-  ++total_cells_allocated;
-  return mp_pool_get(cell_pool);
+  cell_queue_block_t *block = arg;
+  tor_assert(block->n_buf_refs);
+  if (--block->n_buf_refs == 0 && block->released)
+    cell_queue_block_release(block);
 }
 
 /** Log current statistics for cell pool allocation at log level
@@ -1836,39 +2461,228 @@ dump_cell_pool_usage(int severity)
   }
   log(severity, LD_MM, "%d cells allocated on %d circuits. %d cells leaked.",
       n_cells, n_circs, total_cells_allocated - n_cells);
-  mp_pool_log_status(cell_pool, severity);
+  mp_pool_log_status(cell_block_pool, severity);
 }
 
-/** Allocate a new copy of packed <b>cell</b>. */
-static INLINE packed_cell_t *
-packed_cell_copy(const cell_t *cell)
+/** Return the current time in milliseconds, for cell_queue_block_t
+ * inserted_time values.  The origin is arbitrary, and the value wraps; only
+ * differences between values are meaningful. */
+uint32_t
+cell_queue_now_msec(void)
 {
-  packed_cell_t *c = packed_cell_alloc();
-  cell_pack(c, cell);
-  c->next = NULL;
-  return c;
+  return (uint32_t)(tor_monotime_cached_nsec() / 1000000);
 }
 
-/** Append <b>cell</b> to the end of <b>queue</b>. */
+/** Add one observation of <b>value</b> to the histogram <b>h</b>. */
 void
-cell_queue_append(cell_queue_t *queue, packed_cell_t *cell)
+latency_histogram_add(latency_histogram_t *h, uint64_t value)
 {
-  if (queue->tail) {
-    tor_assert(!queue->tail->next);
-    queue->tail->next = cell;
-  } else {
-    queue->head = cell;
+  int idx = value ? tor_log2(value) + 1 : 0;
+  if (idx >= LATENCY_HISTOGRAM_N_BUCKETS)
+    idx = LATENCY_HISTOGRAM_N_BUCKETS - 1;
+  ++h->counts[idx];
+}
+
+/** Return the number of observations in the histogram <b>h</b>. */
+uint64_t
+latency_histogram_get_total(const latency_histogram_t *h)
+{
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; ++i)
+    total += h->counts[i];
+  return total;
+}
+
+/** Return an upper bound for the <b>q</b>'th quantile (0 \< q \<= 1) of
+ * the observations in <b>h</b>: the largest value that falls in the bucket
+ * holding that quantile.  If that is the last bucket, which is unbounded,
+ * return the smallest value that falls in it instead.  Return 0 if <b>h</b>
+ * is empty. */
+uint64_t
+latency_histogram_get_quantile(const latency_histogram_t *h, double q)
+{
+  const uint64_t total = latency_histogram_get_total(h);
+  uint64_t target, seen = 0;
+  double target_dbl;
+  int i;
+
+  if (!total)
+    return 0;
+  target_dbl = ceil(q * U64_TO_DBL(total));
+  target = DBL_TO_U64(target_dbl);
+  if (target < 1)
+    target = 1;
+
+  for (i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS - 1; ++i) {
+    seen += h->counts[i];
+    if (seen >= target)
+      return i ? (U64_LITERAL(1) << i) - 1 : 0;
+  }
+  return U64_LITERAL(1) << (LATENCY_HISTOGRAM_N_BUCKETS - 2);
+}
+
+/** Return a newly allocated string holding the bucket counts of <b>h</b>,
+ * comma-separated, smallest bucket first. */
+char *
+latency_histogram_format(const latency_histogram_t *h)
+{
+  smartlist_t *elements = smartlist_new();
+  char *result;
+  int i;
+  for (i = 0; i < LATENCY_HISTOGRAM_N_BUCKETS; ++i)
+    smartlist_add_asprintf(elements, U64_FORMAT,
+                           U64_PRINTF_ARG(h->counts[i]));
+  result = smartlist_join_strings(elements, ",", 0, NULL);
+  SMARTLIST_FOREACH(elements, char *, cp, tor_free(cp));
+  smartlist_free(elements);
+  return result;
+}
+
+/** Return the histogram of how long cells have waited in circuit queues on
+ * all circuits, in msec. */
+const latency_histogram_t *
+relay_get_queue_delay_histogram(void)
+{
+  return &queue_delay_histogram;
+}
+
+/** Return the histogram of how long we've taken to process relay cells
+ * with the relay command <b>command</b>, in usec; or of how long we've taken
+ * to relay cells that weren't for us, if <b>command</b> is 0.  Return NULL
+ * if we don't keep a histogram for <b>command</b>. */
+const latency_histogram_t *
+relay_get_processing_histogram(uint8_t command)
+{
+  if (command >= N_RELAY_PROCESSING_HISTOGRAMS)
+    return NULL;
+  return &relay_processing_histograms[command];
+}
+
+/** Return a name for the processing histogram of relay command
+ * <b>command</b>, as passed to relay_get_processing_histogram(). */
+const char *
+relay_processing_histogram_name(uint8_t command)
+{
+  return command ? relay_command_to_string(command) : "RELAYED";
+}
+
+/** Helper used to implement GETINFO cell-latency/... controller commands. */
+int
+getinfo_helper_cell_latency(control_connection_t *control_conn,
+                            const char *question, char **answer,
+                            const char **errmsg)
+{
+  (void)control_conn;
+  if (!get_options()->CellLatencyHistograms) {
+    *errmsg = "CellLatencyHistograms is not enabled";
+    return -1;
+  }
+  if (!strcmp(question, "cell-latency/queue-delay")) {
+    *answer = latency_histogram_format(&queue_delay_histogram);
+  } else if (!strcmp(question, "cell-latency/processing")) {
+    smartlist_t *lines = smartlist_new();
+    int i;
+    for (i = 0; i < N_RELAY_PROCESSING_HISTOGRAMS; ++i) {
+      const latency_histogram_t *h = &relay_processing_histograms[i];
+      char *counts;
+      if (!latency_histogram_get_total(h))
+        continue;
+      counts = latency_histogram_format(h);
+      smartlist_add_asprintf(lines, "%s=%s",
+                             relay_processing_histogram_name(i), counts);
+      tor_free(counts);
+    }
+    *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  } else if (!strcmpstart(question, "cell-latency/circuit/")) {
+    origin_circuit_t *circ;
+    int ok;
+    uint32_t id;
+    question += strlen("cell-latency/circuit/");
+    id = (uint32_t) tor_parse_ulong(question, 10, 0, UINT32_MAX, &ok, NULL);
+    if (!ok || !(circ = circuit_get_by_global_id(id))) {
+      *errmsg = "Unknown circuit";
+      return -1;
+    }
+    if (circ->_base.queue_delay_histogram) {
+      *answer = latency_histogram_format(circ->_base.queue_delay_histogram);
+    } else {
+      latency_histogram_t empty;
+      memset(&empty, 0, sizeof(empty));
+      *answer = latency_histogram_format(&empty);
+    }
+  }
+  return 0;
+}
+
+/** Note that a cell from <b>circ</b> waited <b>msec</b> milliseconds in a
+ * cell queue before we flushed it. */
+static void
+circuit_note_queue_delay(circuit_t *circ, uint32_t msec)
+{
+  latency_histogram_add(&queue_delay_histogram, msec);
+  if (!circ->queue_delay_histogram)
+    circ->queue_delay_histogram = tor_malloc_zero(sizeof(latency_histogram_t));
+  latency_histogram_add(circ->queue_delay_histogram, msec);
+}
+
+/** Return the total number of bytes used for storing cells in all cell
+ * queues. */
+size_t
+cell_queues_get_total_allocation(void)
+{
+  return total_cell_blocks_in_queues * sizeof(cell_queue_block_t);
+}
+
+/** Check whether we've got too much space used for cells.  If so,
+ * call the OOM handler and return 1.  Otherwise, return 0. */
+static int
+cell_queues_check_size(void)
+{
+  size_t alloc = cell_queues_get_total_allocation();
+  if (PREDICT_UNLIKELY(alloc >= get_options()->MaxMemInCellQueues)) {
+    circuits_handle_oom(alloc);
+    return 1;
+  }
+  return 0;
+}
+
+/** Make room for one more cell at the end of <b>queue</b>, and return a
+ * pointer to the (uninitialized) slot for it. */
+static INLINE packed_cell_t *
+cell_queue_append_slot(cell_queue_t *queue)
+{
+  cell_queue_block_t *tail = queue->tail;
+  if (!tail || tail->last == CELL_QUEUE_BLOCK_N_CELLS) {
+    cell_queue_block_t *block = cell_queue_block_new();
+    ++total_cell_blocks_in_queues;
+    if (tail) {
+      tor_assert(!tail->next);
+      tail->next = block;
+    } else {
+      queue->head = block;
+    }
+    queue->tail = tail = block;
   }
-  queue->tail = cell;
-  cell->next = NULL;
   ++queue->n;
+  ++total_cells_allocated;
+  tail->inserted_time[tail->last] = cell_queue_now_msec();
+  return &tail->cells[tail->last++];
 }
 
-/** Append a newly allocated copy of <b>cell</b> to the end of <b>queue</b> */
+/** Append a copy of <b>cell</b> to the end of <b>queue</b>. */
+void
+cell_queue_append(cell_queue_t *queue, const packed_cell_t *cell)
+{
+  memcpy(cell_queue_append_slot(queue), cell, sizeof(packed_cell_t));
+}
+
+/** Append a newly packed copy of <b>cell</b> to the end of <b>queue</b> */
 void
 cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
 {
-  packed_cell_t *copy = packed_cell_copy(cell);
   /* Remember the time when this cell was put in the queue. */
   if (get_options()->CellStatistics) {
     struct timeval now;
@@ -1899,19 +2713,21 @@ cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell)
       }
     }
   }
-  cell_queue_append(queue, copy);
+  cell_pack(cell_queue_append_slot(queue), cell);
 }
 
 /** Remove and free every cell in <b>queue</b>. */
 void
 cell_queue_clear(cell_queue_t *queue)
 {
-  packed_cell_t *cell, *next;
-  cell = queue->head;
-  while (cell) {
-    next = cell->next;
-    packed_cell_free_unchecked(cell);
-    cell = next;
+  cell_queue_block_t *block, *next;
+  block = queue->head;
+  while (block) {
+    next = block->next;
+    total_cells_allocated -= block->last - block->first;
+    --total_cell_blocks_in_queues;
+    cell_queue_block_release(block);
+    block = next;
   }
   queue->head = queue->tail = NULL;
   queue->n = 0;
@@ -1926,19 +2742,33 @@ cell_queue_clear(cell_queue_t *queue)
 }
 
 /** Extract and return the cell at the head of <b>queue</b>; return NULL if
- * <b>queue</b> is empty. */
-static INLINE packed_cell_t *
+ * <b>queue</b> is empty.  The returned cell is still owned by the queue
+ * code.  It stays valid only until the next time we add a cell to, pop a
+ * cell from, or clear any queue, since any of those may free or reuse its
+ * block.  A caller that needs it for longer must either copy it or take a
+ * reference to queue->head before popping, as
+ * connection_or_flush_from_first_active_circuit() does. */
+packed_cell_t *
 cell_queue_pop(cell_queue_t *queue)
 {
-  packed_cell_t *cell = queue->head;
-  if (!cell)
+  cell_queue_block_t *head = queue->head;
+  packed_cell_t *cell;
+  if (!head)
     return NULL;
-  queue->head = cell->next;
-  if (cell == queue->tail) {
-    tor_assert(!queue->head);
-    queue->tail = NULL;
+  tor_assert(head->first < head->last);
+  cell = &head->cells[head->first++];
+  if (head->first == head->last) {
+    /* That was the last cell in this block; let it go. */
+    queue->head = head->next;
+    if (head == queue->tail) {
+      tor_assert(!queue->head);
+      queue->tail = NULL;
+    }
+    --total_cell_blocks_in_queues;
+    cell_queue_block_release(head);
   }
   --queue->n;
+  --total_cells_allocated;
   return cell;
 }
 
@@ -1979,9 +2809,9 @@ static int
 compare_cell_ewma_counts(const void *p1, const void *p2)
 {
   const cell_ewma_t *e1=p1, *e2=p2;
-  if (e1->cell_count < e2->cell_count)
+  if (e1->log_cell_count < e2->log_cell_count)
     return -1;
-  else if (e1->cell_count > e2->cell_count)
+  else if (e1->log_cell_count > e2->log_cell_count)
     return 1;
   else
     return 0;
@@ -2024,12 +2854,16 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
    This, however, would mean we'd need to re-scale *ALL* old circuits every
    time we wanted to send a cell.
 
-   So as a compromise, we divide time into 'ticks' (currently, 10-second
-   increments) and say that a cell sent at the start of a current tick is
-   worth 1.0, a cell sent N seconds before the start of the current tick is
-   worth F^N, and a cell sent N seconds after the start of the current tick is
-   worth F^-N.  This way we don't overflow, and we don't need to constantly
-   rescale.
+   We used to compromise by dividing time into 'ticks' and rescaling every
+   active circuit on a connection whenever the tick changed.  On connections
+   with hundreds of active circuits, that rescale got expensive.
+
+   Instead, we keep the natural log of each count.  A cell sent N ticks
+   after the start of tick 0 adds F^-N to the count, which is to say it adds
+   N*-log(F) in the log domain.  That grows linearly with time rather than
+   exponentially, so it never overflows; we combine values with log_add(),
+   and since every count is relative to the same fixed origin, no count ever
+   needs to be rescaled.
  */
 
 /** How long does a tick last (seconds)? */
@@ -2039,45 +2873,36 @@ cell_ewma_to_circuit(cell_ewma_t *ewma)
  * consensus or a configuration setting.  zero means "disabled". */
 #define EWMA_DEFAULT_HALFLIFE 0.0
 
-/** Given a timeval <b>now</b>, compute the cell_ewma tick in which it occurs
+/*DOCDOC*/
+#define EPSILON 0.00001
+/*DOCDOC*/
+#define LOG_ONEHALF -0.69314718055994529
+
+/** Given a monotonic time <b>now_nsec</b>, as returned by
+ * tor_monotime_cached_nsec(), compute the cell_ewma tick in which it occurs
  * and the fraction of the tick that has elapsed between the start of the tick
- * and <b>now</b>.  Return the former and store the latter in
+ * and <b>now_nsec</b>.  Return the former and store the latter in
  * *<b>remainder_out</b>.
  *
  * These tick values are not meant to be shared between Tor instances, or used
  * for other purposes. */
 static unsigned
-cell_ewma_tick_from_timeval(const struct timeval *now,
-                            double *remainder_out)
-{
-  unsigned res = (unsigned) (now->tv_sec / EWMA_TICK_LEN);
-  /* rem */
-  double rem = (now->tv_sec % EWMA_TICK_LEN) +
-    ((double)(now->tv_usec)) / 1.0e6;
-  *remainder_out = rem / EWMA_TICK_LEN;
-  return res;
-}
-
-/** Compute and return the current cell_ewma tick. */
-unsigned
-cell_ewma_get_tick(void)
+cell_ewma_tick_from_monotime(uint64_t now_nsec, double *remainder_out)
 {
-  return ((unsigned)approx_time() / EWMA_TICK_LEN);
+  const uint64_t tick_nsec = ((uint64_t)EWMA_TICK_LEN) * 1000000000;
+  unsigned res = (unsigned) (now_nsec / tick_nsec);
+  *remainder_out = ((double)(now_nsec % tick_nsec)) / tick_nsec;
+  return res;
 }
 
-/** The per-tick scale factor to be used when computing cell-count EWMA
- * values.  (A cell sent N ticks before the start of the current tick
- * has value ewma_scale_factor ** N.)
+/** The natural log of the per-tick scale factor to be used when computing
+ * cell-count EWMA values.  (A cell sent N ticks before another has
+ * exp(ewma_log_scale_factor * N) times its weight.)
  */
-static double ewma_scale_factor = 0.1;
+static double ewma_log_scale_factor = LOG_ONEHALF;
 /* DOCDOC ewma_enabled */
 static int ewma_enabled = 0;
 
-/*DOCDOC*/
-#define EPSILON 0.00001
-/*DOCDOC*/
-#define LOG_ONEHALF -0.69314718055994529
-
 /** Adjust the global cell scale factor based on <b>options</b> */
 void
 cell_ewma_set_scale_factor(const or_options_t *options,
@@ -2089,8 +2914,8 @@ cell_ewma_set_scale_factor(const or_options_t *options,
   if (options && options->CircuitPriorityHalflife >= -EPSILON) {
     halflife = options->CircuitPriorityHalflife;
     source = "CircuitPriorityHalflife in configuration";
-  } else if (consensus && (halflife_ms = networkstatus_get_param(
-                 consensus, "CircuitPriorityHalflifeMsec",
+  } else if (consensus && (halflife_ms = networkstatus_get_param_by_id(
+                 consensus, NET_PARAM_CIRCUIT_PRIORITY_HALFLIFE_MSEC,
                  -1, -1, INT32_MAX)) >= 0) {
     halflife = ((double)halflife_ms)/1000.0;
     source = "CircuitPriorityHalflifeMsec in consensus";
@@ -2101,7 +2926,7 @@ cell_ewma_set_scale_factor(const or_options_t *options,
 
   if (halflife <= EPSILON) {
     /* The cell EWMA algorithm is disabled. */
-    ewma_scale_factor = 0.1;
+    ewma_log_scale_factor = LOG_ONEHALF;
     ewma_enabled = 0;
     log_info(LD_OR,
              "Disabled cell_ewma algorithm because of value in %s",
@@ -2110,65 +2935,47 @@ cell_ewma_set_scale_factor(const or_options_t *options,
     /* convert halflife into halflife-per-tick. */
     halflife /= EWMA_TICK_LEN;
     /* compute per-tick scale factor. */
-    ewma_scale_factor = exp( LOG_ONEHALF / halflife );
+    ewma_log_scale_factor = LOG_ONEHALF / halflife;
     ewma_enabled = 1;
     log_info(LD_OR,
              "Enabled cell_ewma algorithm because of value in %s; "
              "scale factor is %f per %d seconds",
-             source, ewma_scale_factor, EWMA_TICK_LEN);
+             source, exp(ewma_log_scale_factor), EWMA_TICK_LEN);
   }
 }
 
-/** Return the multiplier necessary to convert the value of a cell sent in
- * 'from_tick' to one sent in 'to_tick'. */
+/** Return the weight, in the log domain, of a cell sent at the monotonic
+ * time <b>now_nsec</b>. */
 static INLINE double
-get_scale_factor(unsigned from_tick, unsigned to_tick)
+cell_ewma_log_weight_from_monotime(uint64_t now_nsec)
 {
-  /* This math can wrap around, but that's okay: unsigned overflow is
-     well-defined */
-  int diff = (int)(to_tick - from_tick);
-  return pow(ewma_scale_factor, diff);
+  double fractional_tick;
+  unsigned tick = cell_ewma_tick_from_monotime(now_nsec, &fractional_tick);
+  return -ewma_log_scale_factor * (tick + fractional_tick);
 }
 
-/** Adjust the cell count of <b>ewma</b> so that it is scaled with respect to
- * <b>cur_tick</b> */
-static void
-scale_single_cell_ewma(cell_ewma_t *ewma, unsigned cur_tick)
-{
-  double factor = get_scale_factor(ewma->last_adjusted_tick, cur_tick);
-  ewma->cell_count *= factor;
-  ewma->last_adjusted_tick = cur_tick;
-}
-
-/** Adjust the cell count of every active circuit on <b>conn</b> so
- * that they are scaled with respect to <b>cur_tick</b> */
-static void
-scale_active_circuits(or_connection_t *conn, unsigned cur_tick)
+/** Return log(exp(<b>a</b>) + exp(<b>b</b>)), computed so that it doesn't
+ * overflow when <b>a</b> and <b>b</b> are large. */
+static INLINE double
+log_add(double a, double b)
 {
-
-  double factor = get_scale_factor(
-              conn->active_circuit_pqueue_last_recalibrated,
-              cur_tick);
-  /** Ordinarily it isn't okay to change the value of an element in a heap,
-   * but it's okay here, since we are preserving the order. */
-  SMARTLIST_FOREACH(conn->active_circuit_pqueue, cell_ewma_t *, e, {
-      tor_assert(e->last_adjusted_tick ==
-                 conn->active_circuit_pqueue_last_recalibrated);
-      e->cell_count *= factor;
-      e->last_adjusted_tick = cur_tick;
-  });
-  conn->active_circuit_pqueue_last_recalibrated = cur_tick;
+  if (a < b) {
+    double tmp = a;
+    a = b;
+    b = tmp;
+  }
+  return a + tor_mathlog(1.0 + exp(b - a));
 }
 
-/** Rescale <b>ewma</b> to the same scale as <b>conn</b>, and add it to
- * <b>conn</b>'s priority queue of active circuits */
+/** Add <b>ewma</b> to <b>conn</b>'s priority queue of active circuits */
 static void
 add_cell_ewma_to_conn(or_connection_t *conn, cell_ewma_t *ewma)
 {
   tor_assert(ewma->heap_index == -1);
-  scale_single_cell_ewma(ewma,
-                         conn->active_circuit_pqueue_last_recalibrated);
-
+  /* Most connections never have an active circuit; don't make them carry
+   * a queue until they do. */
+  if (!conn->active_circuit_pqueue)
+    conn->active_circuit_pqueue = smartlist_new();
   smartlist_pqueue_add(conn->active_circuit_pqueue,
                        compare_cell_ewma_counts,
                        STRUCT_OFFSET(cell_ewma_t, heap_index),
@@ -2186,6 +2993,21 @@ remove_cell_ewma_from_conn(or_connection_t *conn, cell_ewma_t *ewma)
                           ewma);
 }
 
+/** Return a value that orders <b>conn</b> against other connections with
+ * active circuits: the scheduler should serve connections with lower
+ * values first.  With the cell-EWMA algorithm, this is the log of the EWMA
+ * count of <b>conn</b>'s quietest active circuit; otherwise, it's 0. */
+double
+connection_or_get_circuit_priority(or_connection_t *conn)
+{
+  cell_ewma_t *ewma;
+  if (!ewma_enabled || !conn->active_circuit_pqueue ||
+      !smartlist_len(conn->active_circuit_pqueue))
+    return 0.0;
+  ewma = smartlist_get(conn->active_circuit_pqueue, 0);
+  return ewma->log_cell_count;
+}
+
 /** Remove and return the first cell_ewma_t from conn's priority queue of
  * active circuits.  Requires that the priority queue is nonempty. */
 static cell_ewma_t *
@@ -2292,9 +3114,11 @@ connection_or_unlink_all_active_circs(or_connection_t *orconn)
   } while (cur != head);
   orconn->active_circuits = NULL;
 
-  SMARTLIST_FOREACH(orconn->active_circuit_pqueue, cell_ewma_t *, e,
-                    e->heap_index = -1);
-  smartlist_clear(orconn->active_circuit_pqueue);
+  if (orconn->active_circuit_pqueue) {
+    SMARTLIST_FOREACH(orconn->active_circuit_pqueue, cell_ewma_t *, e,
+                      e->heap_index = -1);
+    smartlist_clear(orconn->active_circuit_pqueue);
+  }
 }
 
 /** Block (if <b>block</b> is true) or unblock (if <b>block</b> is false)
@@ -2363,13 +3187,13 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   cell_queue_t *queue;
   circuit_t *circ;
   int streams_blocked;
+  const int histograms = get_options()->CellLatencyHistograms;
 
   /* The current (hi-res) time */
-  struct timeval now_hires;
 
   /* The EWMA cell counter for the circuit we're flushing. */
   cell_ewma_t *cell_ewma = NULL;
-  double ewma_increment = -1;
+  double ewma_increment = CELL_EWMA_LOG_ZERO;
 
   circ = conn->active_circuits;
   if (!circ) return 0;
@@ -2377,16 +3201,8 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
 
   /* See if we're doing the ewma circuit selection algorithm. */
   if (ewma_enabled) {
-    unsigned tick;
-    double fractional_tick;
-    tor_gettimeofday_cached(&now_hires);
-    tick = cell_ewma_tick_from_timeval(&now_hires, &fractional_tick);
-
-    if (tick != conn->active_circuit_pqueue_last_recalibrated) {
-      scale_active_circuits(conn, tick);
-    }
-
-    ewma_increment = pow(ewma_scale_factor, -fractional_tick);
+    ewma_increment =
+      cell_ewma_log_weight_from_monotime(tor_monotime_cached_nsec());
 
     cell_ewma = smartlist_get(conn->active_circuit_pqueue, 0);
     circ = cell_ewma_to_circuit(cell_ewma);
@@ -2401,8 +3217,16 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
   }
   tor_assert(*next_circ_on_conn_p(circ,conn));
 
-  for (n_flushed = 0; n_flushed < max && queue->head; ) {
-    packed_cell_t *cell = cell_queue_pop(queue);
+  for (n_flushed = 0; n_flushed < max && queue->n; ) {
+    /* Pin the head block before popping, so that the cell stays put until
+     * the outbuf is done with it. */
+    cell_queue_block_t *block = queue->head;
+    packed_cell_t *cell;
+    ++block->n_buf_refs;
+    if (PREDICT_UNLIKELY(histograms))
+      circuit_note_queue_delay(circ, cell_queue_now_msec() -
+                                     block->inserted_time[block->first]);
+    cell = cell_queue_pop(queue);
     tor_assert(*next_circ_on_conn_p(circ,conn));
 
     /* Calculate the exact time that this cell has spent in the queue. */
@@ -2445,13 +3269,15 @@ connection_or_flush_from_first_active_circuit(or_connection_t *conn, int max,
                                 DIRREQ_TUNNELED,
                                 DIRREQ_CIRC_QUEUE_FLUSHED);
 
-    connection_write_to_buf(cell->body, CELL_NETWORK_SIZE, TO_CONN(conn));
+    connection_write_to_buf_external(cell->body, CELL_NETWORK_SIZE,
+                                     TO_CONN(conn),
+                                     cell_queue_block_unref, block);
 
-    packed_cell_free_unchecked(cell);
     ++n_flushed;
     if (cell_ewma) {
       cell_ewma_t *tmp;
-      cell_ewma->cell_count += ewma_increment;
+      cell_ewma->log_cell_count =
+        log_add(cell_ewma->log_cell_count, ewma_increment);
       /* We pop and re-add the cell_ewma_t here, not above, since we need to
        * re-add it immediately to keep the priority queue consistent with
        * the linked-list implementation */
@@ -2512,6 +3338,12 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
 
   cell_queue_append_packed_copy(queue, cell);
 
+  if (PREDICT_UNLIKELY(cell_queues_check_size())) {
+    /* We ran the OOM handler, which may have killed this circuit. */
+    if (circ->marked_for_close)
+      return;
+  }
+
   /* If we have too many cells on the circuit, we should stop reading from
    * the edge streams for a while. */
   if (!streams_blocked && queue->n >= CELL_QUEUE_HIGHWATER_SIZE)
@@ -2529,13 +3361,10 @@ append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
     make_circuit_active_on_conn(circ, orconn);
   }
 
-  if (! connection_get_outbuf_len(TO_CONN(orconn))) {
-    /* There is no data at all waiting to be sent on the outbuf.  Add a
-     * cell, so that we can notice when it gets flushed, flushed_some can
-     * get called, and we can start putting more data onto the buffer then.
-     */
-    log_debug(LD_GENERAL, "Primed a buffer.");
-    connection_or_flush_from_first_active_circuit(orconn, 1, approx_time());
+  if (connection_get_outbuf_len(TO_CONN(orconn)) < OR_CONN_LOWWATER) {
+    /* There's room on the outbuf.  Let the scheduler put cells there the
+     * next time it runs. */
+    scheduler_conn_wants_to_write(orconn);
   }
 }
 
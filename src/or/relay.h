@@ -18,6 +18,18 @@ extern uint64_t stats_n_relay_cells_delivered;
 int circuit_receive_relay_cell(cell_t *cell, circuit_t *circ,
                                cell_direction_t cell_direction);
 
+/** Largest value we allow for KeystreamPrecomputeCells. */
+#define MAX_KEYSTREAM_PRECOMPUTE_CELLS 32
+void circuit_keystream_forget(circuit_t *circ);
+void relay_keystream_free_all(void);
+
+/** Largest number of cells that we'll hand to relay_crypt_cell_batch() at
+ * once. */
+#define RELAY_CRYPT_BATCH_MAX 16
+int relay_crypt_cell_batch(circuit_t *circ, cell_t **cells, int n_cells,
+                           cell_direction_t cell_direction);
+void relay_crypt_cell_batch_done(circuit_t *circ);
+
 void relay_header_pack(uint8_t *dest, const relay_header_t *src);
 void relay_header_unpack(relay_header_t *dest, const uint8_t *src);
 int relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
@@ -26,6 +38,8 @@ int relay_send_command_from_edge(streamid_t stream_id, circuit_t *circ,
 int connection_edge_send_command(edge_connection_t *fromconn,
                                  uint8_t relay_command, const char *payload,
                                  size_t payload_len);
+void connection_edge_cancel_coalescing(edge_connection_t *conn);
+void connection_edge_coalescing_free_all(void);
 int connection_edge_package_raw_inbuf(edge_connection_t *conn,
                                       int package_partial,
                                       int *max_cells);
@@ -42,7 +56,7 @@ void clean_cell_pool(void);
 void dump_cell_pool_usage(int severity);
 
 void cell_queue_clear(cell_queue_t *queue);
-void cell_queue_append(cell_queue_t *queue, packed_cell_t *cell);
+void cell_queue_append(cell_queue_t *queue, const packed_cell_t *cell);
 void cell_queue_append_packed_copy(cell_queue_t *queue, const cell_t *cell);
 
 void append_cell_to_circuit_queue(circuit_t *circ, or_connection_t *orconn,
@@ -54,19 +68,41 @@ int connection_or_flush_from_first_active_circuit(or_connection_t *conn,
 void assert_active_circuits_ok(or_connection_t *orconn);
 void make_circuit_inactive_on_conn(circuit_t *circ, or_connection_t *conn);
 void make_circuit_active_on_conn(circuit_t *circ, or_connection_t *conn);
+double connection_or_get_circuit_priority(or_connection_t *conn);
 
 int append_address_to_payload(uint8_t *payload_out, const tor_addr_t *addr);
 const uint8_t *decode_address_from_payload(tor_addr_t *addr_out,
                                         const uint8_t *payload,
                                         int payload_len);
-unsigned cell_ewma_get_tick(void);
 void cell_ewma_set_scale_factor(const or_options_t *options,
                                 const networkstatus_t *consensus);
 void circuit_clear_cell_queue(circuit_t *circ, or_connection_t *orconn);
+uint32_t cell_queue_now_msec(void);
+
+void latency_histogram_add(latency_histogram_t *h, uint64_t value);
+uint64_t latency_histogram_get_total(const latency_histogram_t *h);
+uint64_t latency_histogram_get_quantile(const latency_histogram_t *h,
+                                        double q);
+char *latency_histogram_format(const latency_histogram_t *h);
+const latency_histogram_t *relay_get_queue_delay_histogram(void);
+const latency_histogram_t *relay_get_processing_histogram(uint8_t command);
+const char *relay_processing_histogram_name(uint8_t command);
+int getinfo_helper_cell_latency(control_connection_t *control_conn,
+                                const char *question, char **answer,
+                                const char **errmsg);
+size_t cell_queues_get_total_allocation(void);
 
 #ifdef RELAY_PRIVATE
 int relay_crypt(circuit_t *circ, cell_t *cell, cell_direction_t cell_direction,
                 crypt_path_t **layer_hint, char *recognized);
+packed_cell_t *cell_queue_pop(cell_queue_t *queue);
+edge_connection_t *relay_lookup_conn(circuit_t *circ, cell_t *cell,
+                                     cell_direction_t cell_direction,
+                                     crypt_path_t *layer_hint);
+int connection_edge_should_coalesce(edge_connection_t *conn);
+int adaptive_window_get_target(const adaptive_window_t *aw);
+void adaptive_window_note_cell_delivered(adaptive_window_t *aw);
+void adaptive_window_note_sendme(adaptive_window_t *aw, int deliver_window);
 #endif
 
 #endif
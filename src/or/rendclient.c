@@ -7,6 +7,7 @@
  * \brief Client code to access location-hidden services.
  **/
 
+#define RENDCLIENT_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
@@ -36,6 +37,7 @@ rend_client_purge_state(void)
   rend_cache_purge();
   rend_client_cancel_descriptor_fetches();
   rend_client_purge_last_hid_serv_requests();
+  rend_client_purge_desc_failures();
 }
 
 /** Called when we've established a circuit to an introduction point:
@@ -529,14 +531,93 @@ rend_client_purge_last_hid_serv_requests(void)
   }
 }
 
+/** A hidden service whose descriptor we recently failed to fetch. */
+typedef struct rend_desc_failure_t {
+  /** Until when we refuse to fetch the descriptor again. */
+  time_t retry_after;
+  /** How long we waited after the last failure. */
+  int backoff;
+} rend_desc_failure_t;
+
+/** Map from service ID to rend_desc_failure_t, for the hidden services
+ * whose descriptors we've lately failed to fetch from every responsible
+ * directory.  Without this, an application that keeps retrying a dead
+ * onion address makes us ask all of its directories again each time,
+ * since each failed connection attempt clears last_hid_serv_requests_. */
+static strmap_t *rend_desc_failures = NULL;
+
+/** Remember that we just failed to fetch the descriptor for
+ * <b>onion_address</b> from any of its directories, and back off. */
+void
+rend_client_note_desc_failure(const char *onion_address, time_t now)
+{
+  rend_desc_failure_t *failure;
+  if (!rend_desc_failures)
+    rend_desc_failures = strmap_new();
+  failure = strmap_get_lc(rend_desc_failures, onion_address);
+  if (!failure) {
+    failure = tor_malloc_zero(sizeof(rend_desc_failure_t));
+    strmap_set_lc(rend_desc_failures, onion_address, failure);
+  }
+  if (failure->retry_after + failure->backoff < now) {
+    /* It's been a while since the last failure; start over. */
+    failure->backoff = REND_DESC_FAILURE_MIN_BACKOFF;
+  } else {
+    failure->backoff = MIN(failure->backoff * 2,
+                           REND_DESC_FAILURE_MAX_BACKOFF);
+  }
+  failure->retry_after = now + failure->backoff;
+  log_info(LD_REND, "Not fetching the descriptor for %s again for %d "
+           "seconds.", safe_str_client(onion_address), failure->backoff);
+}
+
+/** Return how many more seconds we're backing off from fetching the
+ * descriptor for <b>onion_address</b>, or 0 if we aren't. */
+int
+rend_client_desc_failure_wait(const char *onion_address, time_t now)
+{
+  rend_desc_failure_t *failure;
+  if (!rend_desc_failures)
+    return 0;
+  failure = strmap_get_lc(rend_desc_failures, onion_address);
+  if (!failure || failure->retry_after <= now)
+    return 0;
+  return (int)(failure->retry_after - now);
+}
+
+/** Forget any failures to fetch the descriptor for <b>onion_address</b>. */
+void
+rend_client_forget_desc_failure(const char *onion_address)
+{
+  rend_desc_failure_t *failure;
+  if (!rend_desc_failures)
+    return;
+  failure = strmap_remove_lc(rend_desc_failures, onion_address);
+  tor_free(failure);
+}
+
+/** Forget all our failures to fetch descriptors, so that we'll try fetching
+ * any of them again right away. */
+void
+rend_client_purge_desc_failures(void)
+{
+  if (rend_desc_failures) {
+    strmap_free(rend_desc_failures, _tor_free);
+    rend_desc_failures = NULL;
+  }
+}
+
 /** Determine the responsible hidden service directories for <b>desc_id</b>
  * and fetch the descriptor with that ID from one of them. Only
  * send a request to a hidden service directory that we have not yet tried
  * during this attempt to connect to this hidden service; on success, return 1,
  * in the case that no hidden service directory is left to ask for the
- * descriptor, return 0, and in case of a failure -1.  */
+ * descriptor, return 0, and in case of a failure -1.  If we return 0 and
+ * we've asked any of the responsible directories for the descriptor
+ * recently, set *<b>tried_out</b> to 1.  */
 static int
-directory_get_from_hs_dir(const char *desc_id, const rend_data_t *rend_query)
+directory_get_from_hs_dir(const char *desc_id, const rend_data_t *rend_query,
+                          int *tried_out)
 {
   smartlist_t *responsible_dirs = smartlist_new();
   routerstatus_t *hs_dir;
@@ -563,9 +644,12 @@ directory_get_from_hs_dir(const char *desc_id, const rend_data_t *rend_query)
       time_t last = lookup_last_hid_serv_request(
                             dir, desc_id_base32, rend_query, 0, 0);
       const node_t *node = node_get_by_id(dir->identity_digest);
-      if (last + REND_HID_SERV_DIR_REQUERY_PERIOD >= now ||
-          !node || !node_has_descriptor(node))
-      SMARTLIST_DEL_CURRENT(responsible_dirs, dir);
+      if (last + REND_HID_SERV_DIR_REQUERY_PERIOD >= now) {
+        *tried_out = 1;
+        SMARTLIST_DEL_CURRENT(responsible_dirs, dir);
+      } else if (!node || !node_has_descriptor(node)) {
+        SMARTLIST_DEL_CURRENT(responsible_dirs, dir);
+      }
   });
 
   hs_dir = smartlist_choose(responsible_dirs);
@@ -573,7 +657,7 @@ directory_get_from_hs_dir(const char *desc_id, const rend_data_t *rend_query)
   if (!hs_dir) {
     log_info(LD_REND, "Could not pick one of the responsible hidden "
                       "service directories, because we requested them all "
-                      "recently without success.");
+                      "recently without success, or don't know them yet.");
     return 0;
   }
 
@@ -625,8 +709,9 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
 {
   char descriptor_id[DIGEST_LEN];
   int replicas_left_to_try[REND_NUMBER_OF_NON_CONSECUTIVE_REPLICAS];
-  int i, tries_left;
+  int i, tries_left, wait, tried = 0;
   rend_cache_entry_t *e = NULL;
+  time_t now = time(NULL);
   tor_assert(rend_query);
   /* Are we configured to fetch descriptors? */
   if (!get_options()->FetchHidServDescriptors) {
@@ -641,6 +726,15 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
                       "already have a usable descriptor here. Not fetching.");
     return;
   }
+  /* Did every directory fail to give it to us just now? */
+  if ((wait = rend_client_desc_failure_wait(rend_query->onion_address,
+                                            now))) {
+    log_info(LD_REND, "We failed to fetch the descriptor for %s recently; "
+             "not trying again for %d seconds.",
+             safe_str_client(rend_query->onion_address), wait);
+    rend_client_desc_trynow(rend_query->onion_address);
+    return;
+  }
   log_debug(LD_REND, "Fetching v2 rendezvous descriptor for service %s",
             safe_str_client(rend_query->onion_address));
   /* Randomly iterate over the replicas until a descriptor can be fetched
@@ -661,13 +755,22 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
                         "descriptor ID did not succeed.");
       return;
     }
-    if (directory_get_from_hs_dir(descriptor_id, rend_query) != 0)
+    if (directory_get_from_hs_dir(descriptor_id, rend_query, &tried) != 0)
       return; /* either success or failure, but we're done */
   }
   /* If we come here, there are no hidden service directories left. */
-  log_info(LD_REND, "Could not pick one of the responsible hidden "
-                    "service directories to fetch descriptors, because "
-                    "we already tried them all unsuccessfully.");
+  if (tried) {
+    log_info(LD_REND, "Could not pick one of the responsible hidden "
+                      "service directories to fetch descriptors, because "
+                      "we already tried them all unsuccessfully.");
+    rend_client_note_desc_failure(rend_query->onion_address, now);
+  } else {
+    /* We haven't asked anybody yet, so there's nothing to back off from:
+     * we'll try again as soon as we know some directories. */
+    log_info(LD_REND, "Could not pick one of the responsible hidden "
+                      "service directories to fetch descriptors, because "
+                      "we don't know any yet.");
+  }
   /* Close pending connections. */
   rend_client_desc_trynow(rend_query->onion_address);
   return;
@@ -678,12 +781,11 @@ rend_client_refetch_v2_renddesc(const rend_data_t *rend_query)
 void
 rend_client_cancel_descriptor_fetches(void)
 {
-  smartlist_t *connection_array = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR);
 
-  SMARTLIST_FOREACH_BEGIN(connection_array, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_DIR &&
-        (conn->purpose == DIR_PURPOSE_FETCH_RENDDESC ||
-         conn->purpose == DIR_PURPOSE_FETCH_RENDDESC_V2)) {
+  SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
+    if (conn->purpose == DIR_PURPOSE_FETCH_RENDDESC ||
+        conn->purpose == DIR_PURPOSE_FETCH_RENDDESC_V2) {
       /* It's a rendezvous descriptor fetch in progress -- cancel it
        * by marking the connection for close.
        *
@@ -927,10 +1029,14 @@ rend_client_desc_trynow(const char *query)
   const rend_data_t *rend_data;
   time_t now = time(NULL);
 
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_AP);
+
+  /* If we were backing off from fetching this descriptor, we have it now. */
+  if (rend_cache_lookup_entry(query, -1, &entry) == 1)
+    rend_client_forget_desc_failure(query);
+
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, base_conn) {
-    if (base_conn->type != CONN_TYPE_AP ||
-        base_conn->state != AP_CONN_STATE_RENDDESC_WAIT ||
+    if (base_conn->state != AP_CONN_STATE_RENDDESC_WAIT ||
         base_conn->marked_for_close)
       continue;
     conn = TO_ENTRY_CONN(base_conn);
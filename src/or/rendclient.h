@@ -13,6 +13,7 @@
 #define _TOR_RENDCLIENT_H
 
 void rend_client_purge_state(void);
+void rend_client_purge_desc_failures(void);
 
 void rend_client_introcirc_has_opened(origin_circuit_t *circ);
 void rend_client_rendcirc_has_opened(origin_circuit_t *circ);
@@ -53,5 +54,21 @@ rend_service_authorization_t *rend_client_lookup_service_authorization(
 void rend_service_authorization_free_all(void);
 rend_data_t *rend_data_dup(const rend_data_t *request);
 
+#ifdef RENDCLIENT_PRIVATE
+/** How long, in seconds, we wait before fetching a hidden service's
+ * descriptor again after every responsible hidden service directory has
+ * failed to give it to us.  Each further failure doubles the wait, up to
+ * REND_DESC_FAILURE_MAX_BACKOFF. */
+#define REND_DESC_FAILURE_MIN_BACKOFF 30
+/** The longest we wait before fetching a descriptor again after failures;
+ * see REND_DESC_FAILURE_MIN_BACKOFF.  This matches
+ * REND_HID_SERV_DIR_REQUERY_PERIOD in rendclient.c. */
+#define REND_DESC_FAILURE_MAX_BACKOFF (15 * 60)
+
+void rend_client_note_desc_failure(const char *onion_address, time_t now);
+int rend_client_desc_failure_wait(const char *onion_address, time_t now);
+void rend_client_forget_desc_failure(const char *onion_address);
+#endif
+
 #endif
 
@@ -8,6 +8,7 @@
  * introducers, services, clients, and rendezvous points.
  **/
 
+#define RENDCOMMON_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
@@ -16,6 +17,7 @@
 #include "rendmid.h"
 #include "rendservice.h"
 #include "rephist.h"
+#include "replaycache.h"
 #include "routerlist.h"
 #include "routerparse.h"
 
@@ -26,6 +28,33 @@ rend_cmp_service_ids(const char *one, const char *two)
   return strcasecmp(one,two);
 }
 
+/** A set of signed v2 descriptors that rend_encode_v2_descriptors() built
+ * from a rend_service_descriptor_t, so that encoding the same descriptor for
+ * the same time period and clients again can hand out copies instead of
+ * encrypting and signing everything anew. */
+typedef struct rend_encoded_set_t {
+  /** Digest of everything besides the descriptor that went into these
+   * descriptors: time period, authorization type and client cookies. */
+  char key[DIGEST_LEN];
+  /** The service ID and time period they were encoded for. */
+  char service_id[DIGEST_LEN];
+  uint32_t time_period;
+  /** The rend_encoded_v2_service_descriptor_t's themselves. */
+  smartlist_t *descs;
+} rend_encoded_set_t;
+
+/** Free <b>set</b> and every descriptor in it. */
+static void
+rend_encoded_set_free(rend_encoded_set_t *set)
+{
+  if (!set)
+    return;
+  SMARTLIST_FOREACH(set->descs, rend_encoded_v2_service_descriptor_t *, d,
+                    rend_encoded_v2_service_descriptor_free(d));
+  smartlist_free(set->descs);
+  tor_free(set);
+}
+
 /** Free the storage held by the service descriptor <b>desc</b>.
  */
 void
@@ -44,6 +73,12 @@ rend_service_descriptor_free(rend_service_descriptor_t *desc)
     SMARTLIST_FOREACH(desc->successful_uploads, char *, c, tor_free(c););
     smartlist_free(desc->successful_uploads);
   }
+  if (desc->encoded_descs) {
+    SMARTLIST_FOREACH(desc->encoded_descs, rend_encoded_set_t *, set,
+                      rend_encoded_set_free(set));
+    smartlist_free(desc->encoded_descs);
+  }
+  tor_free(desc->encoded_intro_points);
   tor_free(desc);
 }
 
@@ -165,7 +200,8 @@ rend_compute_v2_desc_id(char *desc_id_out, const char *service_id,
 
 /** Encode the introduction points in <b>desc</b> and write the result to a
  * newly allocated string pointed to by <b>encoded</b>. Return 0 for
- * success, -1 otherwise. */
+ * success, -1 otherwise.  We remember the result in <b>desc</b>, so that
+ * encoding it for each period and authorized client only does this once. */
 static int
 rend_encode_v2_intro_points(char **encoded, rend_service_descriptor_t *desc)
 {
@@ -174,6 +210,10 @@ rend_encode_v2_intro_points(char **encoded, rend_service_descriptor_t *desc)
   size_t unenc_written = 0;
   int i;
   int r = -1;
+  if (desc->encoded_intro_points) {
+    *encoded = tor_strdup(desc->encoded_intro_points);
+    return 0;
+  }
   /* Assemble unencrypted list of introduction points. */
   unenc_len = smartlist_len(desc->intro_nodes) * 1000; /* too long, but ok. */
   unenc = tor_malloc_zero(unenc_len);
@@ -240,6 +280,7 @@ rend_encode_v2_intro_points(char **encoded, rend_service_descriptor_t *desc)
   unenc[unenc_written++] = '\n';
   unenc[unenc_written++] = 0;
   *encoded = unenc;
+  desc->encoded_intro_points = tor_strdup(unenc);
   r = 0;
  done:
   if (r<0)
@@ -438,13 +479,46 @@ rend_intro_point_free(rend_intro_point_t *intro)
   extend_info_free(intro->extend_info);
   crypto_pk_free(intro->intro_key);
 
-  if (intro->accepted_intro_rsa_parts != NULL) {
-    digestmap_free(intro->accepted_intro_rsa_parts, _tor_free);
-  }
+  replaycache_free(intro->accepted_intro_rsa_parts);
 
   tor_free(intro);
 }
 
+/** Return a newly allocated copy of <b>desc</b>. */
+static rend_encoded_v2_service_descriptor_t *
+rend_encoded_v2_service_descriptor_dup(
+                          const rend_encoded_v2_service_descriptor_t *desc)
+{
+  rend_encoded_v2_service_descriptor_t *dup =
+    tor_memdup(desc, sizeof(rend_encoded_v2_service_descriptor_t));
+  dup->desc_str = tor_strdup(desc->desc_str);
+  return dup;
+}
+
+/** Compute into <b>key_out</b> the key under which we remember the
+ * descriptors that rend_encode_v2_descriptors() encodes for
+ * <b>service_id</b>, <b>time_period</b>, <b>auth_type</b> and
+ * <b>client_cookies</b>. */
+static void
+rend_encoded_set_compute_key(char *key_out, const char *service_id,
+                             uint32_t time_period,
+                             rend_auth_type_t auth_type,
+                             smartlist_t *client_cookies)
+{
+  crypto_digest_t *digest = crypto_digest_new();
+  char buf[5];
+  set_uint32(buf, htonl(time_period));
+  buf[4] = (char)auth_type;
+  crypto_digest_add_bytes(digest, buf, sizeof(buf));
+  crypto_digest_add_bytes(digest, service_id, DIGEST_LEN);
+  if (auth_type != REND_NO_AUTH && client_cookies) {
+    SMARTLIST_FOREACH(client_cookies, const char *, cookie,
+        crypto_digest_add_bytes(digest, cookie, REND_DESC_COOKIE_LEN));
+  }
+  crypto_digest_get_digest(digest, key_out, DIGEST_LEN);
+  crypto_digest_free(digest);
+}
+
 /** Encode a set of rend_encoded_v2_service_descriptor_t's for <b>desc</b>
  * at time <b>now</b> using <b>service_key</b>, depending on
  * <b>auth_type</b> a <b>descriptor_cookie</b> and a list of
@@ -452,7 +526,11 @@ rend_intro_point_free(rend_intro_point_t *intro)
  * authorization is performed), and <b>period</b> (e.g. 0 for the current
  * period, 1 for the next period, etc.) and add them to the existing list
  * <b>descs_out</b>; return the number of seconds that the descriptors will
- * be found by clients, or -1 if the encoding was not successful. */
+ * be found by clients, or -1 if the encoding was not successful.
+ *
+ * We remember what we encode in <b>desc</b>, and hand out copies when asked
+ * for the same period and clients again, so <b>desc</b> must not change
+ * once it has been encoded. */
 int
 rend_encode_v2_descriptors(smartlist_t *descs_out,
                            rend_service_descriptor_t *desc, time_t now,
@@ -465,9 +543,11 @@ rend_encode_v2_descriptors(smartlist_t *descs_out,
   char *ipos_base64 = NULL, *ipos = NULL, *ipos_encrypted = NULL,
        *descriptor_cookie = NULL;
   size_t ipos_len = 0, ipos_encrypted_len = 0;
-  int k;
+  int k, n_before = smartlist_len(descs_out);
   uint32_t seconds_valid;
   crypto_pk_t *service_key;
+  char set_key[DIGEST_LEN];
+  rend_encoded_set_t *set;
   if (!desc) {
     log_warn(LD_BUG, "Could not encode v2 descriptor: No desc given.");
     return -1;
@@ -485,6 +565,24 @@ rend_encode_v2_descriptors(smartlist_t *descs_out,
   /* Determine how many seconds the descriptor will be valid. */
   seconds_valid = period * REND_TIME_PERIOD_V2_DESC_VALIDITY +
                   get_seconds_valid(now, service_id);
+  /* Have we encoded these already? Forget whatever we encoded for periods
+   * that are over. */
+  rend_encoded_set_compute_key(set_key, service_id, time_period, auth_type,
+                               client_cookies);
+  if (!desc->encoded_descs)
+    desc->encoded_descs = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(desc->encoded_descs, rend_encoded_set_t *, s) {
+    if (tor_memeq(s->key, set_key, DIGEST_LEN)) {
+      SMARTLIST_FOREACH(s->descs, rend_encoded_v2_service_descriptor_t *, d,
+        smartlist_add(descs_out, rend_encoded_v2_service_descriptor_dup(d)));
+      log_info(LD_REND, "Reusing the v2 descriptors we already encoded.");
+      return seconds_valid;
+    }
+    if (s->time_period < get_time_period(now, 0, s->service_id)) {
+      rend_encoded_set_free(s);
+      SMARTLIST_DEL_CURRENT(desc->encoded_descs, s);
+    }
+  } SMARTLIST_FOREACH_END(s);
   /* Assemble, possibly encrypt, and encode introduction points. */
   if (smartlist_len(desc->intro_nodes) > 0) {
     if (rend_encode_v2_intro_points(&ipos, desc) < 0) {
@@ -659,6 +757,15 @@ rend_encode_v2_descriptors(smartlist_t *descs_out,
 
   log_info(LD_REND, "Successfully encoded a v2 descriptor and "
                     "confirmed that it is parsable.");
+  set = tor_malloc_zero(sizeof(rend_encoded_set_t));
+  memcpy(set->key, set_key, DIGEST_LEN);
+  memcpy(set->service_id, service_id, DIGEST_LEN);
+  set->time_period = time_period;
+  set->descs = smartlist_new();
+  for (k = n_before; k < smartlist_len(descs_out); ++k)
+    smartlist_add(set->descs,
+        rend_encoded_v2_service_descriptor_dup(smartlist_get(descs_out, k)));
+  smartlist_add(desc->encoded_descs, set);
   goto done;
 
  err:
@@ -773,9 +880,38 @@ rend_get_service_id(crypto_pk_t *pk, char *out)
  * rend_cache_entry_t. */
 static strmap_t *rend_cache = NULL;
 
-/** Map from descriptor id to rend_cache_entry_t; only for hidden service
- * directories. */
+/** A v2 descriptor that we store as a hidden service directory.  We only
+ * ever serve these verbatim, so unlike a rend_cache_entry_t, we don't keep
+ * the parsed descriptor around: just its timestamp. */
+typedef struct rend_cache_dir_entry_t {
+  /** The descriptor ID, which is also this entry's key. */
+  char desc_id[DIGEST_LEN];
+  /** When the descriptor says it was published. */
+  time_t published;
+  /** When did we last store or serve it? */
+  time_t last_used;
+  /** The descriptor itself, NUL-terminated, and its length. */
+  char *desc;
+  size_t len;
+  /** Neighbours in rend_cache_v2_dir_lru. */
+  struct rend_cache_dir_entry_t *lru_prev, *lru_next;
+} rend_cache_dir_entry_t;
+
+/** Map from descriptor id to rend_cache_dir_entry_t; only for hidden
+ * service directories. */
 static digestmap_t *rend_cache_v2_dir = NULL;
+/** Every entry of rend_cache_v2_dir, most recently stored or served first,
+ * so that when the cache is too big we can drop the least recently used
+ * descriptor in O(1). */
+static rend_cache_dir_entry_t *rend_cache_v2_dir_lru_head = NULL;
+static rend_cache_dir_entry_t *rend_cache_v2_dir_lru_tail = NULL;
+/** How many bytes the entries of rend_cache_v2_dir take up, roughly. */
+static size_t rend_cache_v2_dir_bytes = 0;
+/** How many descriptors we've dropped from rend_cache_v2_dir to stay within
+ * HidServDirectoryCacheSize, and how many lookups found or missed one. */
+static uint64_t rend_cache_v2_dir_n_evicted = 0;
+static uint64_t rend_cache_v2_dir_n_hits = 0;
+static uint64_t rend_cache_v2_dir_n_misses = 0;
 
 /** Initializes the service descriptor cache.
  */
@@ -786,6 +922,107 @@ rend_cache_init(void)
   rend_cache_v2_dir = digestmap_new();
 }
 
+/** Return roughly how much memory <b>e</b> takes up. */
+static INLINE size_t
+rend_cache_dir_entry_size(const rend_cache_dir_entry_t *e)
+{
+  return sizeof(rend_cache_dir_entry_t) + e->len + 1;
+}
+
+/** Remove <b>e</b> from rend_cache_v2_dir_lru. */
+static void
+rend_cache_dir_lru_remove(rend_cache_dir_entry_t *e)
+{
+  if (e->lru_prev)
+    e->lru_prev->lru_next = e->lru_next;
+  else
+    rend_cache_v2_dir_lru_head = e->lru_next;
+  if (e->lru_next)
+    e->lru_next->lru_prev = e->lru_prev;
+  else
+    rend_cache_v2_dir_lru_tail = e->lru_prev;
+  e->lru_prev = e->lru_next = NULL;
+}
+
+/** Put <b>e</b>, which must not be on rend_cache_v2_dir_lru, at its
+ * head, and note that we used it at <b>now</b>. */
+static void
+rend_cache_dir_lru_push(rend_cache_dir_entry_t *e, time_t now)
+{
+  e->last_used = now;
+  e->lru_prev = NULL;
+  e->lru_next = rend_cache_v2_dir_lru_head;
+  if (rend_cache_v2_dir_lru_head)
+    rend_cache_v2_dir_lru_head->lru_prev = e;
+  else
+    rend_cache_v2_dir_lru_tail = e;
+  rend_cache_v2_dir_lru_head = e;
+}
+
+/** Remove <b>e</b> from rend_cache_v2_dir and free it. */
+static void
+rend_cache_dir_entry_remove(rend_cache_dir_entry_t *e)
+{
+  digestmap_remove(rend_cache_v2_dir, e->desc_id);
+  rend_cache_dir_lru_remove(e);
+  rend_cache_v2_dir_bytes -= rend_cache_dir_entry_size(e);
+  tor_free(e->desc);
+  tor_free(e);
+}
+
+/** Store the <b>len</b>-byte descriptor <b>desc</b>, published at
+ * <b>published</b>, in rend_cache_v2_dir under <b>desc_id</b>, replacing
+ * any descriptor we had there, and note that we used it at <b>now</b>. */
+void
+rend_cache_dir_store(const char *desc_id, time_t published,
+                     const char *desc, size_t len, time_t now)
+{
+  rend_cache_dir_entry_t *e = digestmap_get(rend_cache_v2_dir, desc_id);
+  if (!e) {
+    e = tor_malloc_zero(sizeof(rend_cache_dir_entry_t));
+    memcpy(e->desc_id, desc_id, DIGEST_LEN);
+    digestmap_set(rend_cache_v2_dir, desc_id, e);
+  } else {
+    rend_cache_dir_lru_remove(e);
+    rend_cache_v2_dir_bytes -= rend_cache_dir_entry_size(e);
+    tor_free(e->desc);
+  }
+  e->published = published;
+  e->desc = tor_strndup(desc, len);
+  e->len = len;
+  rend_cache_v2_dir_bytes += rend_cache_dir_entry_size(e);
+  rend_cache_dir_lru_push(e, now);
+}
+
+/** Drop least recently used descriptors from rend_cache_v2_dir until it
+ * fits in HidServDirectoryCacheSize. */
+void
+rend_cache_dir_enforce_size_limit(void)
+{
+  uint64_t limit = get_options()->HidServDirectoryCacheSize;
+  int n_evicted = 0;
+  while (rend_cache_v2_dir_bytes > limit && rend_cache_v2_dir_lru_tail) {
+    rend_cache_dir_entry_remove(rend_cache_v2_dir_lru_tail);
+    ++n_evicted;
+  }
+  if (n_evicted) {
+    rend_cache_v2_dir_n_evicted += n_evicted;
+    log_info(LD_REND, "Hidden service directory cache is full; dropped %d "
+             "least recently used descriptor%s.", n_evicted,
+             n_evicted == 1 ? "" : "s");
+  }
+}
+
+/** Free every entry of rend_cache_v2_dir, and the map itself. */
+static void
+rend_cache_dir_free_all(void)
+{
+  while (rend_cache_v2_dir_lru_head)
+    rend_cache_dir_entry_remove(rend_cache_v2_dir_lru_head);
+  digestmap_free(rend_cache_v2_dir, NULL);
+  rend_cache_v2_dir = NULL;
+}
+
 /** Helper: free storage held by a single service descriptor cache entry. */
 static void
 rend_cache_entry_free(rend_cache_entry_t *e)
@@ -810,9 +1047,9 @@ void
 rend_cache_free_all(void)
 {
   strmap_free(rend_cache, _rend_cache_entry_free);
-  digestmap_free(rend_cache_v2_dir, _rend_cache_entry_free);
+  if (rend_cache_v2_dir)
+    rend_cache_dir_free_all();
   rend_cache = NULL;
-  rend_cache_v2_dir = NULL;
 }
 
 /** Removes all old entries from the service descriptor cache.
@@ -854,25 +1091,18 @@ rend_cache_purge(void)
 void
 rend_cache_clean_v2_descs_as_dir(time_t now)
 {
-  digestmap_iter_t *iter;
+  rend_cache_dir_entry_t *ent, *next;
   time_t cutoff = now - REND_CACHE_MAX_AGE - REND_CACHE_MAX_SKEW;
-  for (iter = digestmap_iter_init(rend_cache_v2_dir);
-       !digestmap_iter_done(iter); ) {
-    const char *key;
-    void *val;
-    rend_cache_entry_t *ent;
-    digestmap_iter_get(iter, &key, &val);
-    ent = val;
-    if (ent->parsed->timestamp < cutoff ||
-        !hid_serv_responsible_for_desc_id(key)) {
+  for (ent = rend_cache_v2_dir_lru_head; ent; ent = next) {
+    next = ent->lru_next;
+    if (ent->published < cutoff ||
+        !hid_serv_responsible_for_desc_id(ent->desc_id)) {
       char key_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
-      base32_encode(key_base32, sizeof(key_base32), key, DIGEST_LEN);
+      base32_encode(key_base32, sizeof(key_base32), ent->desc_id,
+                    DIGEST_LEN);
       log_info(LD_REND, "Removing descriptor with ID '%s' from cache",
                safe_str_client(key_base32));
-      iter = digestmap_iter_next_rmv(rend_cache_v2_dir, iter);
-      rend_cache_entry_free(ent);
-    } else {
-      iter = digestmap_iter_next(rend_cache_v2_dir, iter);
+      rend_cache_dir_entry_remove(ent);
     }
   }
 }
@@ -982,7 +1212,7 @@ rend_cache_lookup_desc(const char *query, int version, const char **desc,
 int
 rend_cache_lookup_v2_desc_as_dir(const char *desc_id, const char **desc)
 {
-  rend_cache_entry_t *e;
+  rend_cache_dir_entry_t *e;
   char desc_id_digest[DIGEST_LEN];
   tor_assert(rend_cache_v2_dir);
   if (base32_decode(desc_id_digest, DIGEST_LEN,
@@ -996,9 +1226,13 @@ rend_cache_lookup_v2_desc_as_dir(const char *desc_id, const char **desc)
   /* Lookup descriptor and return. */
   e = digestmap_get(rend_cache_v2_dir, desc_id_digest);
   if (e) {
+    rend_cache_dir_lru_remove(e);
+    rend_cache_dir_lru_push(e, time(NULL));
+    ++rend_cache_v2_dir_n_hits;
     *desc = e->desc;
     return 1;
   }
+  ++rend_cache_v2_dir_n_misses;
   return 0;
 }
 
@@ -1127,7 +1361,7 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
   int number_parsed = 0, number_stored = 0;
   const char *current_desc = desc;
   const char *next_desc;
-  rend_cache_entry_t *e;
+  rend_cache_dir_entry_t *e;
   time_t now = time(NULL);
   tor_assert(rend_cache_v2_dir);
   tor_assert(desc);
@@ -1169,31 +1403,25 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
     }
     /* Do we already have a newer descriptor? */
     e = digestmap_get(rend_cache_v2_dir, desc_id);
-    if (e && e->parsed->timestamp > parsed->timestamp) {
+    if (e && e->published > parsed->timestamp) {
       log_info(LD_REND, "We already have a newer service descriptor with the "
                         "same desc ID %s and version.",
                safe_str(desc_id_base32));
       goto skip;
     }
     /* Do we already have this descriptor? */
-    if (e && !strcmp(desc, e->desc)) {
+    if (e && e->len == encoded_size &&
+        tor_memeq(current_desc, e->desc, encoded_size)) {
       log_info(LD_REND, "We already have this service descriptor with desc "
                         "ID %s.", safe_str(desc_id_base32));
-      e->received = time(NULL);
+      rend_cache_dir_lru_remove(e);
+      rend_cache_dir_lru_push(e, now);
       goto skip;
     }
     /* Store received descriptor. */
-    if (!e) {
-      e = tor_malloc_zero(sizeof(rend_cache_entry_t));
-      digestmap_set(rend_cache_v2_dir, desc_id, e);
-    } else {
-      rend_service_descriptor_free(e->parsed);
-      tor_free(e->desc);
-    }
-    e->received = time(NULL);
-    e->parsed = parsed;
-    e->desc = tor_strndup(current_desc, encoded_size);
-    e->len = encoded_size;
+    rend_cache_dir_store(desc_id, parsed->timestamp, current_desc,
+                         encoded_size, now);
+    rend_service_descriptor_free(parsed);
     log_info(LD_REND, "Successfully stored service descriptor with desc ID "
                       "'%s' and len %d.",
              safe_str(desc_id_base32), (int)encoded_size);
@@ -1215,6 +1443,8 @@ rend_cache_store_v2_desc_as_dir(const char *desc)
   }
   log_info(LD_REND, "Parsed %d and added %d descriptor%s.",
            number_parsed, number_stored, number_stored != 1 ? "s" : "");
+  if (number_stored)
+    rend_cache_dir_enforce_size_limit();
   return number_stored;
 }
 
@@ -1265,6 +1495,19 @@ rend_cache_store_v2_desc_as_client(const char *desc,
   int retval;
   tor_assert(rend_cache);
   tor_assert(desc);
+  /* Do we already have exactly this descriptor?  Then we already have it
+   * parsed, intro points and all; don't check its signature and decrypt
+   * its intro points all over again. */
+  if (rend_valid_service_id(rend_query->onion_address)) {
+    tor_snprintf(key, sizeof(key), "2%s", rend_query->onion_address);
+    e = (rend_cache_entry_t*) strmap_get_lc(rend_cache, key);
+    if (e && !strcmp(desc, e->desc)) {
+      log_info(LD_REND,"We already have this service descriptor %s.",
+               safe_str_client(rend_query->onion_address));
+      e->received = now;
+      return 0;
+    }
+  }
   /* Parse the descriptor. */
   if (rend_parse_v2_service_descriptor(&parsed, desc_id, &intro_content,
                                        &intro_size, &encoded_size,
@@ -1459,6 +1702,32 @@ rend_cache_size(void)
   return strmap_size(rend_cache);
 }
 
+/** Implementation helper for GETINFO: answers queries about the
+ * descriptors we store as a hidden service directory. */
+int
+getinfo_helper_rend_cache(control_connection_t *control_conn,
+                          const char *question, char **answer,
+                          const char **errmsg)
+{
+  (void)control_conn;
+  (void)errmsg;
+  if (!strcmp(question, "hs-dir/cache")) {
+    time_t oldest = rend_cache_v2_dir_lru_tail ?
+      rend_cache_v2_dir_lru_tail->last_used : 0;
+    tor_asprintf(answer, "entries=%d bytes="U64_FORMAT" max-bytes="U64_FORMAT
+                 " evicted="U64_FORMAT" hits="U64_FORMAT" misses="U64_FORMAT
+                 " oldest-use=%ld",
+                 rend_cache_v2_dir ? digestmap_size(rend_cache_v2_dir) : 0,
+                 U64_PRINTF_ARG(rend_cache_v2_dir_bytes),
+                 U64_PRINTF_ARG(get_options()->HidServDirectoryCacheSize),
+                 U64_PRINTF_ARG(rend_cache_v2_dir_n_evicted),
+                 U64_PRINTF_ARG(rend_cache_v2_dir_n_hits),
+                 U64_PRINTF_ARG(rend_cache_v2_dir_n_misses),
+                 oldest ? (long)(time(NULL) - oldest) : -1L);
+  }
+  return 0;
+}
+
 /** Allocate and return a new rend_data_t with the same
  * contents as <b>query</b>. */
 rend_data_t *
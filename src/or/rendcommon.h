@@ -50,6 +50,9 @@ int rend_cache_store_v2_desc_as_client(const char *desc,
                                        const rend_data_t *rend_query);
 int rend_cache_store_v2_desc_as_dir(const char *desc);
 int rend_cache_size(void);
+int getinfo_helper_rend_cache(control_connection_t *control_conn,
+                              const char *question, char **answer,
+                              const char **errmsg);
 int rend_encode_v2_descriptors(smartlist_t *descs_out,
                                rend_service_descriptor_t *desc, time_t now,
                                uint8_t period, rend_auth_type_t auth_type,
@@ -63,5 +66,11 @@ void rend_get_descriptor_id_bytes(char *descriptor_id_out,
                                   const char *service_id,
                                   const char *secret_id_part);
 
+#ifdef RENDCOMMON_PRIVATE
+void rend_cache_dir_store(const char *desc_id, time_t published,
+                          const char *desc, size_t len, time_t now);
+void rend_cache_dir_enforce_size_limit(void);
+#endif
+
 #endif
 
@@ -7,11 +7,13 @@
  * \brief The hidden-service side of rendezvous functionality.
  **/
 
+#define RENDSERVICE_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "directory.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -21,6 +23,7 @@
 #include "router.h"
 #include "relay.h"
 #include "rephist.h"
+#include "replaycache.h"
 #include "routerlist.h"
 #include "routerparse.h"
 
@@ -32,15 +35,6 @@ static int intro_point_accepted_intro_count(rend_intro_point_t *intro);
 static int intro_point_should_expire_now(rend_intro_point_t *intro,
                                          time_t now);
 
-/** Represents the mapping from a virtual port of a rendezvous service to
- * a real port on some IP.
- */
-typedef struct rend_service_port_config_t {
-  uint16_t virtual_port;
-  uint16_t real_port;
-  tor_addr_t real_addr;
-} rend_service_port_config_t;
-
 /** Try to maintain this many intro points per service by default. */
 #define NUM_INTRO_POINTS_DEFAULT 3
 /** Maintain no more than this many intro points per hidden service. */
@@ -62,47 +56,6 @@ typedef struct rend_service_port_config_t {
  * our clients before we close an expiring intro point? */
 #define INTRO_POINT_EXPIRATION_GRACE_PERIOD 5*60
 
-/** Represents a single hidden service running at this OP. */
-typedef struct rend_service_t {
-  /* Fields specified in config file */
-  char *directory; /**< where in the filesystem it stores it */
-  smartlist_t *ports; /**< List of rend_service_port_config_t */
-  rend_auth_type_t auth_type; /**< Client authorization type or 0 if no client
-                               * authorization is performed. */
-  smartlist_t *clients; /**< List of rend_authorized_client_t's of
-                         * clients that may access our service. Can be NULL
-                         * if no client authorization is performed. */
-  /* Other fields */
-  crypto_pk_t *private_key; /**< Permanent hidden-service key. */
-  char service_id[REND_SERVICE_ID_LEN_BASE32+1]; /**< Onion address without
-                                                  * '.onion' */
-  char pk_digest[DIGEST_LEN]; /**< Hash of permanent hidden-service key. */
-  smartlist_t *intro_nodes; /**< List of rend_intro_point_t's we have,
-                             * or are trying to establish. */
-  time_t intro_period_started; /**< Start of the current period to build
-                                * introduction points. */
-  int n_intro_circuits_launched; /**< Count of intro circuits we have
-                                  * established in this period. */
-  unsigned int n_intro_points_wanted; /**< Number of intro points this
-                                       * service wants to have open. */
-  rend_service_descriptor_t *desc; /**< Current hidden service descriptor. */
-  time_t desc_is_dirty; /**< Time at which changes to the hidden service
-                         * descriptor content occurred, or 0 if it's
-                         * up-to-date. */
-  time_t next_upload_time; /**< Scheduled next hidden service descriptor
-                            * upload time. */
-  /** Map from digests of Diffie-Hellman values INTRODUCE2 to time_t
-   * of when they were received.  Clients may send INTRODUCE1 cells
-   * for the same rendezvous point through two or more different
-   * introduction points; when they do, this digestmap keeps us from
-   * launching multiple simultaneous attempts to connect to the same
-   * rend point. */
-  digestmap_t *accepted_intro_dh_parts;
-  /** Time at which we last removed expired values from
-   * accepted_intro_dh_parts. */
-  time_t last_cleaned_accepted_intro_dh_parts;
-} rend_service_t;
-
 /** A list of rend_service_t's for services run on this OP.
  */
 static smartlist_t *rend_service_list = NULL;
@@ -171,7 +124,7 @@ rend_service_free(rend_service_t *service)
       rend_authorized_client_free(c););
     smartlist_free(service->clients);
   }
-  digestmap_free(service->accepted_intro_dh_parts, _tor_free);
+  replaycache_free(service->accepted_intro_dh_parts);
   tor_free(service);
 }
 
@@ -191,12 +144,14 @@ rend_service_free_all(void)
 
 /** Validate <b>service</b> and add it to rend_service_list if possible.
  */
-static void
+void
 rend_add_service(rend_service_t *service)
 {
   int i;
   rend_service_port_config_t *p;
 
+  if (!rend_service_list)
+    rend_service_list = smartlist_new();
   service->intro_nodes = smartlist_new();
 
   if (service->auth_type != REND_NO_AUTH &&
@@ -906,26 +861,6 @@ rend_check_authorization(rend_service_t *service,
   return 1;
 }
 
-/** Remove elements from <b>service</b>'s replay cache that are old enough to
- * be noticed by timestamp checking. */
-static void
-clean_accepted_intro_dh_parts(rend_service_t *service, time_t now)
-{
-  const time_t cutoff = now - REND_REPLAY_TIME_INTERVAL;
-
-  service->last_cleaned_accepted_intro_dh_parts = now;
-  if (!service->accepted_intro_dh_parts)
-    return;
-
-  DIGESTMAP_FOREACH_MODIFY(service->accepted_intro_dh_parts, digest,
-                           time_t *, t) {
-    if (*t < cutoff) {
-      tor_free(t);
-      MAP_DEL_CURRENT(digest);
-    }
-  } DIGESTMAP_FOREACH_END;
-}
-
 /** Called when <b>intro</b> will soon be removed from
  * <b>service</b>'s list of intro points. */
 static void
@@ -1030,138 +965,100 @@ rend_service_note_removing_intro_point(rend_service_t *service,
  * Handle cells
  ******/
 
-/** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
- * rendezvous point.
+/** Decrypt the PK-encrypted part of <b>request</b>, an INTRODUCE2 cell body
+ * of <b>request_len</b> bytes, with <b>intro_key</b>, into <b>buf</b> of
+ * <b>buf_len</b> bytes.  Then, if the plaintext is long enough to hold a
+ * rendezvous cookie and the client's half of the DH handshake (which
+ * always come last), do our half of the handshake: set *<b>dh_out</b> to
+ * our DH state and fill <b>keys_out</b> with DIGEST_LEN+
+ * CPATH_KEY_MATERIAL_LEN bytes of key material.  If the handshake fails,
+ * leave *<b>dh_out</b> NULL.  Return the length of the plaintext, or -1 if
+ * we couldn't decrypt it.  Log protocol warnings at <b>severity</b>.
+ *
+ * Apart from logging, this doesn't touch any global state, so worker
+ * threads can call it.  (That's why the caller picks the severity: we
+ * mustn't read the options here.)
  */
- /* XXXX024 this function sure could use some organizing. -RD */
 int
-rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
-                       size_t request_len)
+rend_service_introduce_decrypt(crypto_pk_t *intro_key,
+                               const uint8_t *request, size_t request_len,
+                               char *buf, size_t buf_len,
+                               crypto_dh_t **dh_out, char *keys_out,
+                               int severity)
+{
+  int r;
+  crypto_dh_t *dh;
+  const char *dh_part;
+
+  *dh_out = NULL;
+  r = crypto_pk_private_hybrid_decrypt(
+       intro_key,buf,buf_len,
+       (char*)(request+DIGEST_LEN),request_len-DIGEST_LEN,
+       PK_PKCS1_OAEP_PADDING,1);
+  if (r < 0)
+    return -1;
+  if (r < REND_COOKIE_LEN+DH_KEY_LEN)
+    return r; /* We'll reject it once we parse it. */
+
+  dh_part = buf + r - DH_KEY_LEN;
+  dh = crypto_dh_new(DH_TYPE_REND);
+  if (!dh || crypto_dh_generate_public(dh)<0) {
+    log_warn(LD_BUG,"Internal error: couldn't build DH state "
+             "or generate public key.");
+  } else if (crypto_dh_compute_secret(severity, dh, dh_part,
+                                      DH_KEY_LEN, keys_out,
+                                      DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
+    log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
+  } else {
+    *dh_out = dh;
+    return r;
+  }
+  if (dh)
+    crypto_dh_free(dh);
+  return r;
+}
+
+/** Finish answering an INTRODUCE2 cell for the service whose public key
+ * has digest <b>rend_pk_digest</b>: parse <b>buf</b>, the <b>len</b> bytes
+ * of plaintext from rend_service_introduce_decrypt(), check it for replays
+ * and authorization, and launch a circuit to the chosen rendezvous point.
+ * <b>dh</b> and <b>keys</b> are our half of the DH handshake, as computed
+ * by rend_service_introduce_decrypt(); we take ownership of <b>dh</b>.
+ * Return 0 on success, -1 on failure.
+ */
+static int
+rend_service_introduce_finish(const char *rend_pk_digest, char *buf,
+                              size_t len, crypto_dh_t *dh, char *keys)
 {
   char *ptr, *r_cookie;
   extend_info_t *extend_info = NULL;
-  char buf[RELAY_PAYLOAD_SIZE];
-  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
   rend_service_t *service;
-  rend_intro_point_t *intro_point;
-  int r, i, v3_shift = 0;
-  size_t len, keylen;
-  crypto_dh_t *dh = NULL;
+  int i, v3_shift = 0;
   origin_circuit_t *launched = NULL;
   crypt_path_t *cpath = NULL;
   char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
   char hexcookie[9];
   int circ_needs_uptime;
   int reason = END_CIRC_REASON_TORPROTOCOL;
-  crypto_pk_t *intro_key;
-  char intro_key_digest[DIGEST_LEN];
   int auth_type;
   size_t auth_len = 0;
   char auth_data[REND_DESC_COOKIE_LEN];
   crypto_digest_t *digest = NULL;
   time_t now = time(NULL);
   char diffie_hellman_hash[DIGEST_LEN];
-  time_t *access_time;
   const or_options_t *options = get_options();
 
-  if (circuit->_base.purpose != CIRCUIT_PURPOSE_S_INTRO) {
-    log_warn(LD_PROTOCOL,
-             "Got an INTRODUCE2 over a non-introduction circuit %d.",
-             circuit->_base.n_circ_id);
-    return -1;
-  }
-
-#ifndef NON_ANONYMOUS_MODE_ENABLED
-  tor_assert(!(circuit->build_state->onehop_tunnel));
-#endif
-  tor_assert(circuit->rend_data);
-
   base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
-                circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
-  log_info(LD_REND, "Received INTRODUCE2 cell for service %s on circ %d.",
-           escaped(serviceid), circuit->_base.n_circ_id);
+                rend_pk_digest, REND_SERVICE_ID_LEN);
 
-  /* min key length plus digest length plus nickname length */
-  if (request_len < DIGEST_LEN+REND_COOKIE_LEN+(MAX_NICKNAME_LEN+1)+
-      DH_KEY_LEN+42) {
-    log_warn(LD_PROTOCOL, "Got a truncated INTRODUCE2 cell on circ %d.",
-             circuit->_base.n_circ_id);
-    return -1;
-  }
-
-  /* look up service depending on circuit. */
-  service = rend_service_get_by_pk_digest(
-                circuit->rend_data->rend_pk_digest);
+  /* The service may have gone away while a worker decrypted the cell. */
+  service = rend_service_get_by_pk_digest(rend_pk_digest);
   if (!service) {
-    log_warn(LD_BUG, "Internal error: Got an INTRODUCE2 cell on an intro "
-             "circ for an unrecognized service %s.",
-             escaped(serviceid));
-    return -1;
-  }
-
-  /* use intro key instead of service key. */
-  intro_key = circuit->intro_key;
-
-  /* first DIGEST_LEN bytes of request is intro or service pk digest */
-  crypto_pk_get_digest(intro_key, intro_key_digest);
-  if (tor_memneq(intro_key_digest, request, DIGEST_LEN)) {
-    base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
-                  (char*)request, REND_SERVICE_ID_LEN);
-    log_warn(LD_REND, "Got an INTRODUCE2 cell for the wrong service (%s).",
-             escaped(serviceid));
-    return -1;
-  }
-
-  keylen = crypto_pk_keysize(intro_key);
-  if (request_len < keylen+DIGEST_LEN) {
-    log_warn(LD_PROTOCOL,
-             "PK-encrypted portion of INTRODUCE2 cell was truncated.");
-    return -1;
-  }
-
-  intro_point = find_intro_point(circuit);
-  if (intro_point == NULL) {
-    log_warn(LD_BUG, "Internal error: Got an INTRODUCE2 cell on an intro circ "
-             "(for service %s) with no corresponding rend_intro_point_t.",
-             escaped(serviceid));
-    return -1;
-  }
-
-  if (!service->accepted_intro_dh_parts)
-    service->accepted_intro_dh_parts = digestmap_new();
-
-  if (!intro_point->accepted_intro_rsa_parts)
-    intro_point->accepted_intro_rsa_parts = digestmap_new();
-
-  {
-    char pkpart_digest[DIGEST_LEN];
-    /* Check for replay of PK-encrypted portion. */
-    crypto_digest(pkpart_digest, (char*)request+DIGEST_LEN, keylen);
-    access_time = digestmap_get(intro_point->accepted_intro_rsa_parts,
-                                pkpart_digest);
-    if (access_time != NULL) {
-      log_warn(LD_REND, "Possible replay detected! We received an "
-               "INTRODUCE2 cell with same PK-encrypted part %d seconds ago. "
-               "Dropping cell.", (int)(now-*access_time));
-      return -1;
-    }
-    access_time = tor_malloc(sizeof(time_t));
-    *access_time = now;
-    digestmap_set(intro_point->accepted_intro_rsa_parts,
-                  pkpart_digest, access_time);
+    log_info(LD_REND, "Service %s went away while we were answering an "
+             "INTRODUCE2 cell for it.", escaped(serviceid));
+    goto err;
   }
 
-  /* Next N bytes is encrypted with service key */
-  note_crypto_pk_op(REND_SERVER);
-  r = crypto_pk_private_hybrid_decrypt(
-       intro_key,buf,sizeof(buf),
-       (char*)(request+DIGEST_LEN),request_len-DIGEST_LEN,
-       PK_PKCS1_OAEP_PADDING,1);
-  if (r<0) {
-    log_warn(LD_PROTOCOL, "Couldn't decrypt INTRODUCE2 cell.");
-    return -1;
-  }
-  len = r;
   if (*buf == 3) {
     /* Version 3 INTRODUCE2 cell. */
     v3_shift = 1;
@@ -1174,7 +1071,7 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
         if (auth_len != REND_DESC_COOKIE_LEN) {
           log_info(LD_REND, "Wrong auth data size %d, should be %d.",
                    (int)auth_len, REND_DESC_COOKIE_LEN);
-          return -1;
+          goto err;
         }
         memcpy(auth_data, buf+4, sizeof(auth_data));
         v3_shift += 2+REND_DESC_COOKIE_LEN;
@@ -1235,12 +1132,12 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
     if (!ptr || ptr == rp_nickname) {
       log_warn(LD_PROTOCOL,
                "Couldn't find a nul-padded nickname in INTRODUCE2 cell.");
-      return -1;
+      goto err;
     }
     if ((version == 0 && !is_legal_nickname(rp_nickname)) ||
         (version == 1 && !is_legal_nickname_or_hexdigest(rp_nickname))) {
       log_warn(LD_PROTOCOL, "Bad nickname in INTRODUCE2 cell.");
-      return -1;
+      goto err;
     }
     /* Okay, now we know that a nickname is at the start of the buffer. */
     ptr = rp_nickname+nickname_field_len;
@@ -1285,9 +1182,11 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
 
   /* Check whether there is a past request with the same Diffie-Hellman,
    * part 1. */
-  access_time = digestmap_get(service->accepted_intro_dh_parts,
-                              diffie_hellman_hash);
-  if (access_time != NULL) {
+  if (!service->accepted_intro_dh_parts)
+    service->accepted_intro_dh_parts =
+      replaycache_new(REND_REPLAY_TIME_INTERVAL);
+  if (replaycache_add_and_test(service->accepted_intro_dh_parts,
+                               diffie_hellman_hash, now)) {
     /* A Tor client will send a new INTRODUCE1 cell with the same rend
      * cookie and DH public key as its previous one if its intro circ
      * times out while in state CIRCUIT_PURPOSE_C_INTRODUCE_ACK_WAIT .
@@ -1297,23 +1196,10 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
      * drop this cell. */
     log_info(LD_REND, "We received an "
              "INTRODUCE2 cell with same first part of "
-             "Diffie-Hellman handshake %d seconds ago. Dropping "
-             "cell.",
-             (int) (now - *access_time));
+             "Diffie-Hellman handshake recently. Dropping cell.");
     goto err;
   }
 
-  /* Add request to access history, including time and hash of Diffie-Hellman,
-   * part 1, and possibly remove requests from the history that are older than
-   * one hour. */
-  access_time = tor_malloc(sizeof(time_t));
-  *access_time = now;
-  digestmap_set(service->accepted_intro_dh_parts,
-                diffie_hellman_hash, access_time);
-  if (service->last_cleaned_accepted_intro_dh_parts + REND_REPLAY_TIME_INTERVAL
-      < now)
-    clean_accepted_intro_dh_parts(service, now);
-
   /* If the service performs client authorization, check included auth data. */
   if (service->clients) {
     if (auth_len > 0) {
@@ -1333,18 +1219,8 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
     }
   }
 
-  /* Try DH handshake... */
-  dh = crypto_dh_new(DH_TYPE_REND);
-  if (!dh || crypto_dh_generate_public(dh)<0) {
-    log_warn(LD_BUG,"Internal error: couldn't build DH state "
-             "or generate public key.");
-    reason = END_CIRC_REASON_INTERNAL;
-    goto err;
-  }
-  if (crypto_dh_compute_secret(LOG_PROTOCOL_WARN, dh, ptr+REND_COOKIE_LEN,
-                               DH_KEY_LEN, keys,
-                               DIGEST_LEN+CPATH_KEY_MATERIAL_LEN)<0) {
-    log_warn(LD_BUG, "Internal error: couldn't complete DH handshake");
+  /* We did the DH handshake in rend_service_introduce_decrypt(). */
+  if (!dh) {
     reason = END_CIRC_REASON_INTERNAL;
     goto err;
   }
@@ -1382,8 +1258,7 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
   /* Fill in the circuit's state. */
   launched->rend_data = tor_malloc_zero(sizeof(rend_data_t));
   memcpy(launched->rend_data->rend_pk_digest,
-         circuit->rend_data->rend_pk_digest,
-         DIGEST_LEN);
+         rend_pk_digest, DIGEST_LEN);
   memcpy(launched->rend_data->rend_cookie, r_cookie, REND_COOKIE_LEN);
   strlcpy(launched->rend_data->onion_address, service->service_id,
           sizeof(launched->rend_data->onion_address));
@@ -1404,10 +1279,10 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
   memcpy(cpath->handshake_digest, keys, DIGEST_LEN);
   if (extend_info) extend_info_free(extend_info);
 
-  memset(keys, 0, sizeof(keys));
+  memset(keys, 0, DIGEST_LEN+CPATH_KEY_MATERIAL_LEN);
   return 0;
  err:
-  memset(keys, 0, sizeof(keys));
+  memset(keys, 0, DIGEST_LEN+CPATH_KEY_MATERIAL_LEN);
   if (dh) crypto_dh_free(dh);
   if (launched)
     circuit_mark_for_close(TO_CIRCUIT(launched), reason);
@@ -1415,6 +1290,149 @@ rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
   return -1;
 }
 
+/** Respond to an INTRODUCE2 cell by launching a circuit to the chosen
+ * rendezvous point.  We do the cheap checks here; the public-key work
+ * goes to a worker thread if we can find one, and
+ * rend_service_introduce_done() finishes up when it's done.
+ */
+int
+rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
+                       size_t request_len)
+{
+  char buf[RELAY_PAYLOAD_SIZE];
+  char keys[DIGEST_LEN+CPATH_KEY_MATERIAL_LEN]; /* Holds KH, Df, Db, Kf, Kb */
+  rend_service_t *service;
+  rend_intro_point_t *intro_point;
+  int r;
+  size_t keylen;
+  crypto_dh_t *dh = NULL;
+  char serviceid[REND_SERVICE_ID_LEN_BASE32+1];
+  crypto_pk_t *intro_key;
+  char intro_key_digest[DIGEST_LEN];
+  time_t now = time(NULL);
+
+  if (circuit->_base.purpose != CIRCUIT_PURPOSE_S_INTRO) {
+    log_warn(LD_PROTOCOL,
+             "Got an INTRODUCE2 over a non-introduction circuit %d.",
+             circuit->_base.n_circ_id);
+    return -1;
+  }
+
+#ifndef NON_ANONYMOUS_MODE_ENABLED
+  tor_assert(!(circuit->build_state->onehop_tunnel));
+#endif
+  tor_assert(circuit->rend_data);
+
+  base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
+                circuit->rend_data->rend_pk_digest, REND_SERVICE_ID_LEN);
+  log_info(LD_REND, "Received INTRODUCE2 cell for service %s on circ %d.",
+           escaped(serviceid), circuit->_base.n_circ_id);
+
+  /* min key length plus digest length plus nickname length */
+  if (request_len < DIGEST_LEN+REND_COOKIE_LEN+(MAX_NICKNAME_LEN+1)+
+      DH_KEY_LEN+42) {
+    log_warn(LD_PROTOCOL, "Got a truncated INTRODUCE2 cell on circ %d.",
+             circuit->_base.n_circ_id);
+    return -1;
+  }
+
+  /* look up service depending on circuit. */
+  service = rend_service_get_by_pk_digest(
+                circuit->rend_data->rend_pk_digest);
+  if (!service) {
+    log_warn(LD_BUG, "Internal error: Got an INTRODUCE2 cell on an intro "
+             "circ for an unrecognized service %s.",
+             escaped(serviceid));
+    return -1;
+  }
+
+  /* use intro key instead of service key. */
+  intro_key = circuit->intro_key;
+
+  /* first DIGEST_LEN bytes of request is intro or service pk digest */
+  crypto_pk_get_digest(intro_key, intro_key_digest);
+  if (tor_memneq(intro_key_digest, request, DIGEST_LEN)) {
+    base32_encode(serviceid, REND_SERVICE_ID_LEN_BASE32+1,
+                  (char*)request, REND_SERVICE_ID_LEN);
+    log_warn(LD_REND, "Got an INTRODUCE2 cell for the wrong service (%s).",
+             escaped(serviceid));
+    return -1;
+  }
+
+  keylen = crypto_pk_keysize(intro_key);
+  if (request_len < keylen+DIGEST_LEN) {
+    log_warn(LD_PROTOCOL,
+             "PK-encrypted portion of INTRODUCE2 cell was truncated.");
+    return -1;
+  }
+
+  intro_point = find_intro_point(circuit);
+  if (intro_point == NULL) {
+    log_warn(LD_BUG, "Internal error: Got an INTRODUCE2 cell on an intro circ "
+             "(for service %s) with no corresponding rend_intro_point_t.",
+             escaped(serviceid));
+    return -1;
+  }
+
+  /* We remember PK-encrypted parts for as long as the intro point lasts,
+   * which isn't long: see INTRO_POINT_LIFETIME_INTRODUCTIONS. */
+  if (!intro_point->accepted_intro_rsa_parts)
+    intro_point->accepted_intro_rsa_parts = replaycache_new(0);
+
+  {
+    char pkpart_digest[DIGEST_LEN];
+    /* Check for replay of PK-encrypted portion. */
+    crypto_digest(pkpart_digest, (char*)request+DIGEST_LEN, keylen);
+    if (replaycache_add_and_test(intro_point->accepted_intro_rsa_parts,
+                                 pkpart_digest, now)) {
+      log_warn(LD_REND, "Possible replay detected! We received an "
+               "INTRODUCE2 cell with same PK-encrypted part before. "
+               "Dropping cell.");
+      return -1;
+    }
+    ++intro_point->accepted_introduce2_count;
+  }
+
+  /* Next N bytes is encrypted with service key */
+  note_crypto_pk_op(REND_SERVER);
+  if (request_len <= RELAY_PAYLOAD_SIZE &&
+      assign_rend_introduce_to_cpuworker(circuit->rend_data->rend_pk_digest,
+                                         intro_key, request,
+                                         request_len) == 0)
+    return 0;
+
+  r = rend_service_introduce_decrypt(intro_key, request, request_len,
+                                     buf, sizeof(buf), &dh, keys,
+                                     LOG_PROTOCOL_WARN);
+  if (r<0) {
+    log_warn(LD_PROTOCOL, "Couldn't decrypt INTRODUCE2 cell.");
+    return -1;
+  }
+  r = rend_service_introduce_finish(circuit->rend_data->rend_pk_digest,
+                                    buf, r, dh, keys);
+  memset(buf, 0, sizeof(buf));
+  return r;
+}
+
+/** Called when a worker thread has run rend_service_introduce_decrypt()
+ * on an INTRODUCE2 cell for the service whose public key has digest
+ * <b>rend_pk_digest</b>: <b>result</b>, <b>buf</b>, <b>dh</b>, and
+ * <b>keys</b> are what it returned or set.  We take ownership of
+ * <b>dh</b>.  The introduction circuit may have closed by now; we don't
+ * need it any more.
+ */
+void
+rend_service_introduce_done(const char *rend_pk_digest, int result,
+                            char *buf, crypto_dh_t *dh, char *keys)
+{
+  if (result < 0) {
+    log_warn(LD_PROTOCOL, "Couldn't decrypt INTRODUCE2 cell.");
+    tor_assert(!dh);
+    return;
+  }
+  rend_service_introduce_finish(rend_pk_digest, buf, result, dh, keys);
+}
+
 /** Called when we fail building a rendezvous circuit at some point other
  * than the last hop: launches a new circuit to the same rendezvous point.
  */
@@ -1883,10 +1901,97 @@ find_intro_point(origin_circuit_t *circ)
   return NULL;
 }
 
+/** Descriptors for one hidden service that we're about to upload to one
+ * hidden service directory.  HSDirs accept several concatenated descriptors
+ * in a single post, so when an HSDir is responsible for more than one of a
+ * service's descriptors (its replicas, or its current and next periods), we
+ * send it one request rather than one per descriptor.  We never put two
+ * services' descriptors in one request: that would tell the HSDir that
+ * both services have the same operator. */
+typedef struct hs_dir_upload_batch_t {
+  /** The directory to upload to. */
+  routerstatus_t *hs_dir;
+  /** The descriptor strings to send it. */
+  smartlist_t *descs;
+} hs_dir_upload_batch_t;
+
+/** Map from HSDir identity digest to its hs_dir_upload_batch_t. */
+static digestmap_t *hs_dir_upload_batches = NULL;
+
+/** Never put more than this many descriptors in a single upload. */
+#define MAX_DESCS_PER_HS_DIR_UPLOAD 16
+
+/** Post every descriptor in <b>batch</b> in one request, and empty it. */
+static void
+hs_dir_upload_batch_launch(hs_dir_upload_batch_t *batch)
+{
+  size_t len;
+  char *body;
+  if (!smartlist_len(batch->descs))
+    return;
+  body = smartlist_join_strings(batch->descs, "", 0, &len);
+  log_info(LD_REND, "Uploading %d v2 descriptor%s to hidden service "
+           "directory '%s'.", smartlist_len(batch->descs),
+           smartlist_len(batch->descs) == 1 ? "" : "s",
+           batch->hs_dir->nickname);
+  directory_initiate_command_routerstatus(batch->hs_dir,
+                                          DIR_PURPOSE_UPLOAD_RENDDESC_V2,
+                                          ROUTER_PURPOSE_GENERAL,
+                                          1, NULL, body, len, 0);
+  tor_free(body);
+  SMARTLIST_FOREACH(batch->descs, char *, cp, tor_free(cp));
+  smartlist_clear(batch->descs);
+}
+
+/** Arrange to upload a copy of <b>desc_str</b> to <b>hs_dir</b> at the
+ * next hs_dir_upload_batches_flush(). */
+static void
+hs_dir_upload_batch_add(routerstatus_t *hs_dir, const char *desc_str)
+{
+  hs_dir_upload_batch_t *batch;
+  if (!hs_dir_upload_batches)
+    hs_dir_upload_batches = digestmap_new();
+  batch = digestmap_get(hs_dir_upload_batches, hs_dir->identity_digest);
+  if (!batch) {
+    batch = tor_malloc_zero(sizeof(hs_dir_upload_batch_t));
+    batch->descs = smartlist_new();
+    digestmap_set(hs_dir_upload_batches, hs_dir->identity_digest, batch);
+  }
+  batch->hs_dir = hs_dir;
+  smartlist_add(batch->descs, tor_strdup(desc_str));
+  if (smartlist_len(batch->descs) >= MAX_DESCS_PER_HS_DIR_UPLOAD)
+    hs_dir_upload_batch_launch(batch);
+}
+
+/** Helper: free an hs_dir_upload_batch_t. */
+static void
+hs_dir_upload_batch_free_(void *b)
+{
+  hs_dir_upload_batch_t *batch = b;
+  SMARTLIST_FOREACH(batch->descs, char *, cp, tor_free(cp));
+  smartlist_free(batch->descs);
+  tor_free(batch);
+}
+
+/** Launch every upload that hs_dir_upload_batch_add() has queued.  Call
+ * this after queueing each service's descriptors, before moving on to the
+ * next service. */
+static void
+hs_dir_upload_batches_flush(void)
+{
+  if (!hs_dir_upload_batches)
+    return;
+  DIGESTMAP_FOREACH(hs_dir_upload_batches, k, hs_dir_upload_batch_t *, b) {
+    hs_dir_upload_batch_launch(b);
+  } DIGESTMAP_FOREACH_END;
+  digestmap_free(hs_dir_upload_batches, hs_dir_upload_batch_free_);
+  hs_dir_upload_batches = NULL;
+}
+
 /** Determine the responsible hidden service directories for the
- * rend_encoded_v2_service_descriptor_t's in <b>descs</b> and upload them;
- * <b>service_id</b> and <b>seconds_valid</b> are only passed for logging
- * purposes. */
+ * rend_encoded_v2_service_descriptor_t's in <b>descs</b> and queue them
+ * for upload with hs_dir_upload_batch_add(); <b>service_id</b> and
+ * <b>seconds_valid</b> are only passed for logging purposes. */
 static void
 directory_post_to_hs_dir(rend_service_descriptor_t *renddesc,
                          smartlist_t *descs, const char *service_id,
@@ -1925,12 +2030,8 @@ directory_post_to_hs_dir(rend_service_descriptor_t *renddesc,
         failed_upload = -1;
         continue;
       }
-      /* Send publish request. */
-      directory_initiate_command_routerstatus(hs_dir,
-                                              DIR_PURPOSE_UPLOAD_RENDDESC_V2,
-                                              ROUTER_PURPOSE_GENERAL,
-                                              1, NULL, desc->desc_str,
-                                              strlen(desc->desc_str), 0);
+      /* Queue publish request. */
+      hs_dir_upload_batch_add(hs_dir, desc->desc_str);
       base32_encode(desc_id_base32, sizeof(desc_id_base32),
                     desc->desc_id, DIGEST_LEN);
       hs_dir_ip = tor_dup_ip(hs_dir->addr);
@@ -2091,11 +2192,7 @@ upload_service_descriptor(rend_service_t *service)
 static int
 intro_point_accepted_intro_count(rend_intro_point_t *intro)
 {
-  if (intro->accepted_intro_rsa_parts == NULL) {
-    return 0;
-  } else {
-    return digestmap_size(intro->accepted_intro_rsa_parts);
-  }
+  return intro->accepted_introduce2_count;
 }
 
 /** Return non-zero iff <b>intro</b> should 'expire' now (i.e. we
@@ -2378,6 +2475,7 @@ rend_consider_services_upload(time_t now)
        * new one of each format. */
       rend_service_update_descriptor(service);
       upload_service_descriptor(service);
+      hs_dir_upload_batches_flush();
     }
   }
 }
@@ -2418,6 +2516,7 @@ rend_consider_descriptor_republication(void)
       /* If we failed in uploading a descriptor last time, try again *without*
        * updating the descriptor's contents. */
       upload_service_descriptor(service);
+      hs_dir_upload_batches_flush();
     }
   }
 }
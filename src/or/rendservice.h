@@ -27,11 +27,70 @@ int rend_service_intro_established(origin_circuit_t *circuit,
 void rend_service_rendezvous_has_opened(origin_circuit_t *circuit);
 int rend_service_introduce(origin_circuit_t *circuit, const uint8_t *request,
                            size_t request_len);
+int rend_service_introduce_decrypt(crypto_pk_t *intro_key,
+                                   const uint8_t *request,
+                                   size_t request_len,
+                                   char *buf, size_t buf_len,
+                                   crypto_dh_t **dh_out, char *keys_out,
+                                   int severity);
+void rend_service_introduce_done(const char *rend_pk_digest, int result,
+                                 char *buf, crypto_dh_t *dh, char *keys);
 void rend_service_relaunch_rendezvous(origin_circuit_t *oldcirc);
 int rend_service_set_connection_addr_port(edge_connection_t *conn,
                                           origin_circuit_t *circ);
 void rend_service_dump_stats(int severity);
 void rend_service_free_all(void);
 
+#ifdef RENDSERVICE_PRIVATE
+/** Represents the mapping from a virtual port of a rendezvous service to
+ * a real port on some IP.
+ */
+typedef struct rend_service_port_config_t {
+  uint16_t virtual_port;
+  uint16_t real_port;
+  tor_addr_t real_addr;
+} rend_service_port_config_t;
+
+/** Represents a single hidden service running at this OP. */
+typedef struct rend_service_t {
+  /* Fields specified in config file */
+  char *directory; /**< where in the filesystem it stores it */
+  smartlist_t *ports; /**< List of rend_service_port_config_t */
+  rend_auth_type_t auth_type; /**< Client authorization type or 0 if no client
+                               * authorization is performed. */
+  smartlist_t *clients; /**< List of rend_authorized_client_t's of
+                         * clients that may access our service. Can be NULL
+                         * if no client authorization is performed. */
+  /* Other fields */
+  crypto_pk_t *private_key; /**< Permanent hidden-service key. */
+  char service_id[REND_SERVICE_ID_LEN_BASE32+1]; /**< Onion address without
+                                                  * '.onion' */
+  char pk_digest[DIGEST_LEN]; /**< Hash of permanent hidden-service key. */
+  smartlist_t *intro_nodes; /**< List of rend_intro_point_t's we have,
+                             * or are trying to establish. */
+  time_t intro_period_started; /**< Start of the current period to build
+                                * introduction points. */
+  int n_intro_circuits_launched; /**< Count of intro circuits we have
+                                  * established in this period. */
+  unsigned int n_intro_points_wanted; /**< Number of intro points this
+                                       * service wants to have open. */
+  rend_service_descriptor_t *desc; /**< Current hidden service descriptor. */
+  time_t desc_is_dirty; /**< Time at which changes to the hidden service
+                         * descriptor content occurred, or 0 if it's
+                         * up-to-date. */
+  time_t next_upload_time; /**< Scheduled next hidden service descriptor
+                            * upload time. */
+  /** Digests of the Diffie-Hellman values in the INTRODUCE2 cells we've
+   * received in the last REND_REPLAY_TIME_INTERVAL seconds or so.  Clients
+   * may send INTRODUCE1 cells for the same rendezvous point through two or
+   * more different introduction points; when they do, this keeps us from
+   * launching multiple simultaneous attempts to connect to the same rend
+   * point. */
+  struct replaycache_t *accepted_intro_dh_parts;
+} rend_service_t;
+
+void rend_add_service(rend_service_t *service);
+#endif
+
 #endif
 
@@ -14,6 +14,7 @@
 #include "circuitlist.h"
 #include "circuituse.h"
 #include "config.h"
+#include "cpuworker.h"
 #include "networkstatus.h"
 #include "nodelist.h"
 #include "rephist.h"
@@ -22,6 +23,7 @@
 #include "ht.h"
 
 static void bw_arrays_init(void);
+static void bw_pending_flush(void);
 static void predicted_ports_init(void);
 
 /** Total number of bytes currently allocated in fields used by rephist.c. */
@@ -95,6 +97,12 @@ typedef struct or_history_t {
   time_t start_of_downtime;
   unsigned long weighted_uptime;
   unsigned long total_weighted_time;
+  /** The value of stability_n_downrates when we last discounted this
+   * router's MTBF and fractional uptime data. */
+  unsigned int n_downrates;
+  /** True iff this router's MTBF or fractional uptime data has changed
+   * since we last wrote it to disk. */
+  unsigned int mtbf_dirty : 1;
 
   /** Map from hex OR2 identity digest to a link_history_t for the link
    * from this OR to OR2. */
@@ -104,6 +112,10 @@ typedef struct or_history_t {
 /** When did we last multiply all routers' weighted_run_length and
  * total_run_weights by STABILITY_ALPHA? */
 static time_t stability_last_downrated = 0;
+/** How many times have we discounted stability info since we started?
+ * Each or_history_t is brought up to date lazily; see
+ * or_history_apply_downrates(). */
+static unsigned int stability_n_downrates = 0;
 
 /**  */
 static time_t started_tracking_stability = 0;
@@ -111,6 +123,70 @@ static time_t started_tracking_stability = 0;
 /** Map from hex OR identity digest to or_history_t. */
 static digestmap_t *history_map = NULL;
 
+/** If nonzero, a random number naming the router-stability file that we
+ * last wrote or read.  Records in router-stability-journal apply only to
+ * the router-stability file with the same generation. */
+static uint32_t mtbf_journal_generation = 0;
+/** How many records have we appended to router-stability-journal since
+ * we last wrote router-stability? */
+static int mtbf_journal_n_records = 0;
+/** Identity digests of the routers whose MTBF data has changed, or which
+ * we have forgotten, since we last wrote MTBF data to disk. */
+static smartlist_t *mtbf_journal_changed = NULL;
+
+/** Remember that we need to record the MTBF data for the router with
+ * identity digest <b>id</b>, whose history is <b>hist</b>, or NULL if we
+ * are about to forget it. */
+static void
+mtbf_journal_note_changed(const char *id, or_history_t *hist)
+{
+  if (!mtbf_journal_generation)
+    return; /* Our next write will be of the whole router-stability file. */
+  if (hist && hist->mtbf_dirty)
+    return;
+  if (!mtbf_journal_changed)
+    mtbf_journal_changed = smartlist_new();
+  smartlist_add(mtbf_journal_changed, tor_memdup(id, DIGEST_LEN));
+  if (hist)
+    hist->mtbf_dirty = 1;
+}
+
+/** Forget which routers' MTBF data has changed: we've just written it. */
+static void
+mtbf_journal_clear_changed(void)
+{
+  if (!mtbf_journal_changed)
+    return;
+  SMARTLIST_FOREACH_BEGIN(mtbf_journal_changed, char *, id) {
+    or_history_t *hist = digestmap_get(history_map, id);
+    if (hist)
+      hist->mtbf_dirty = 0;
+    tor_free(id);
+  } SMARTLIST_FOREACH_END(id);
+  smartlist_clear(mtbf_journal_changed);
+}
+
+/** Discount the MTBF and fractional uptime data in <b>hist</b> by
+ * STABILITY_ALPHA for every time that rep_hist_downrate_old_runs() has
+ * discounted stability info since we last looked at <b>hist</b>. */
+static void
+or_history_apply_downrates(or_history_t *hist)
+{
+  double alpha = 1.0;
+  if (hist->n_downrates == stability_n_downrates)
+    return;
+  for ( ; hist->n_downrates != stability_n_downrates; ++hist->n_downrates)
+    alpha *= STABILITY_ALPHA;
+
+  hist->weighted_run_length =
+    (unsigned long)(hist->weighted_run_length * alpha);
+  hist->total_run_weights *= alpha;
+
+  hist->weighted_uptime = (unsigned long)(hist->weighted_uptime * alpha);
+  hist->total_weighted_time = (unsigned long)
+    (hist->total_weighted_time * alpha);
+}
+
 /** Return the or_history_t for the OR with identity digest <b>id</b>,
  * creating it if necessary. */
 static or_history_t *
@@ -128,8 +204,11 @@ get_or_history(const char* id)
     rephist_total_num++;
     hist->link_history_map = digestmap_new();
     hist->since = hist->changed = time(NULL);
+    hist->n_downrates = stability_n_downrates;
     tor_addr_make_unspec(&hist->last_reached_addr);
     digestmap_set(history_map, id, hist);
+  } else {
+    or_history_apply_downrates(hist);
   }
   return hist;
 }
@@ -309,6 +388,7 @@ rep_hist_note_router_reachable(const char *id, const tor_addr_t *at_addr,
 
   tor_assert(hist);
   tor_assert((!at_addr && !at_port) || (at_addr && at_port));
+  mtbf_journal_note_changed(id, hist);
 
   addr_changed = at_addr &&
     tor_addr_compare(at_addr, &hist->last_reached_addr, CMP_EXACT) != 0;
@@ -380,6 +460,7 @@ rep_hist_note_router_unreachable(const char *id, time_t when)
     started_tracking_stability = time(NULL);
 
   tor_assert(hist);
+  mtbf_journal_note_changed(id, hist);
   if (hist->start_of_run) {
     /*XXXX We could treat failed connections differently from failed
      * connect attempts. */
@@ -423,14 +504,13 @@ rep_hist_note_router_unreachable(const char *id, time_t when)
 }
 
 /** Helper: Discount all old MTBF data, if it is time to do so.  Return
- * the time at which we should next discount MTBF data. */
+ * the time at which we should next discount MTBF data.
+ *
+ * We only count the discount here; each router's data is discounted the
+ * next time we look at it. */
 time_t
 rep_hist_downrate_old_runs(time_t now)
 {
-  digestmap_iter_t *orhist_it;
-  const char *digest1;
-  or_history_t *hist;
-  void *hist_p;
   double alpha = 1.0;
 
   if (!history_map)
@@ -443,28 +523,13 @@ rep_hist_downrate_old_runs(time_t now)
   /* Okay, we should downrate the data.  By how much? */
   while (stability_last_downrated + STABILITY_INTERVAL < now) {
     stability_last_downrated += STABILITY_INTERVAL;
+    ++stability_n_downrates;
     alpha *= STABILITY_ALPHA;
   }
 
   log_info(LD_HIST, "Discounting all old stability info by a factor of %f",
            alpha);
 
-  /* Multiply every w_r_l, t_r_w pair by alpha. */
-  for (orhist_it = digestmap_iter_init(history_map);
-       !digestmap_iter_done(orhist_it);
-       orhist_it = digestmap_iter_next(history_map,orhist_it)) {
-    digestmap_iter_get(orhist_it, &digest1, &hist_p);
-    hist = hist_p;
-
-    hist->weighted_run_length =
-      (unsigned long)(hist->weighted_run_length * alpha);
-    hist->total_run_weights *= alpha;
-
-    hist->weighted_uptime = (unsigned long)(hist->weighted_uptime * alpha);
-    hist->total_weighted_time = (unsigned long)
-      (hist->total_weighted_time * alpha);
-  }
-
   return stability_last_downrated + STABILITY_INTERVAL;
 }
 
@@ -730,11 +795,13 @@ rep_history_clean(time_t before)
     int remove;
     digestmap_iter_get(orhist_it, &d1, &or_history_p);
     or_history = or_history_p;
+    or_history_apply_downrates(or_history);
 
     remove = authority ? (or_history->total_run_weights < STABILITY_EPSILON &&
                           !or_history->start_of_run)
                        : (or_history->changed < before);
     if (remove) {
+      mtbf_journal_note_changed(d1, NULL);
       orhist_it = digestmap_iter_next_rmv(history_map, orhist_it);
       free_or_history(or_history);
       continue;
@@ -756,13 +823,110 @@ rep_history_clean(time_t before)
   }
 }
 
-/** Write MTBF data to disk. Return 0 on success, negative on failure.
- *
- * If <b>missing_means_down</b>, then if we're about to write an entry
- * that is still considered up but isn't in our routerlist, consider it
- * to be down. */
-int
-rep_hist_record_mtbf_data(time_t now, int missing_means_down)
+/** Length of each record in router-stability-journal: a type byte, an
+ * identity digest, and six 64-bit big endian fields.  A MTBF_JOURNAL_BATCH
+ * record starts each batch of records that we appended at once; its
+ * fields are the generation of the router-stability file it applies to,
+ * when we stored it, when we last discounted stability info, and when we
+ * started tracking stability.  Each MTBF_JOURNAL_ROUTER record that follows
+ * holds weighted run length, total run weights times 100000, start of run,
+ * weighted uptime, total weighted time and start of downtime for one
+ * router, discounted as of the batch's time.  A MTBF_JOURNAL_FORGET record
+ * tells us to forget a router. */
+#define MTBF_JOURNAL_RECORD_LEN (1+DIGEST_LEN+6*8)
+/** Types of record in router-stability-journal. */
+#define MTBF_JOURNAL_BATCH 1
+#define MTBF_JOURNAL_ROUTER 2
+#define MTBF_JOURNAL_FORGET 3
+
+/** Helper: store <b>v</b> at <b>cp</b> in network order. */
+static INLINE void
+mtbf_journal_set_u64(uint8_t *cp, uint64_t v)
+{
+  set_uint32(cp, htonl((uint32_t)(v >> 32)));
+  set_uint32(cp+4, htonl((uint32_t)v));
+}
+
+/** Helper: return the network-order 64-bit value at <b>cp</b>. */
+static INLINE uint64_t
+mtbf_journal_get_u64(const uint8_t *cp)
+{
+  return (((uint64_t)ntohl(get_uint32(cp))) << 32) | ntohl(get_uint32(cp+4));
+}
+
+/** Treat every router that we think is up, but that isn't in our
+ * routerlist, as having gone down at <b>now</b>. */
+static void
+rep_hist_correct_missing_routers(time_t now)
+{
+  DIGESTMAP_FOREACH(history_map, digest, or_history_t *, hist) {
+    if (hist->start_of_run && !router_get_by_id_digest(digest)) {
+      /* We think this relay is running, but it's not listed in our
+       * routerlist. Somehow it fell out without telling us it went
+       * down. Complain and also correct it. */
+      log_info(LD_HIST,
+               "Relay '%s' is listed as up in rephist, but it's not in "
+               "our routerlist. Correcting.", hex_str(digest, DIGEST_LEN));
+      rep_hist_note_router_unreachable(digest, now);
+    }
+  } DIGESTMAP_FOREACH_END;
+}
+
+/** Append the MTBF data for every router whose data has changed since we
+ * last wrote it to router-stability-journal.  Return 0 on success,
+ * negative on failure. */
+static int
+rep_hist_append_mtbf_journal(time_t now)
+{
+  char *filename;
+  uint8_t *buf, *cp;
+  int n = 1 + smartlist_len(mtbf_journal_changed);
+  int r;
+
+  cp = buf = tor_malloc_zero(n * MTBF_JOURNAL_RECORD_LEN);
+  cp[0] = MTBF_JOURNAL_BATCH;
+  cp += 1+DIGEST_LEN;
+  mtbf_journal_set_u64(cp, mtbf_journal_generation);
+  mtbf_journal_set_u64(cp+8, (uint64_t)now);
+  mtbf_journal_set_u64(cp+16, (uint64_t)stability_last_downrated);
+  mtbf_journal_set_u64(cp+24, (uint64_t)started_tracking_stability);
+  cp += 6*8;
+
+  SMARTLIST_FOREACH_BEGIN(mtbf_journal_changed, const char *, id) {
+    or_history_t *hist = digestmap_get(history_map, id);
+    memcpy(cp+1, id, DIGEST_LEN);
+    if (!hist) {
+      cp[0] = MTBF_JOURNAL_FORGET;
+    } else {
+      cp[0] = MTBF_JOURNAL_ROUTER;
+      or_history_apply_downrates(hist);
+      mtbf_journal_set_u64(cp+21, hist->weighted_run_length);
+      mtbf_journal_set_u64(cp+29,
+                           (uint64_t)(hist->total_run_weights*100000.0+0.5));
+      mtbf_journal_set_u64(cp+37, (uint64_t)hist->start_of_run);
+      mtbf_journal_set_u64(cp+45, hist->weighted_uptime);
+      mtbf_journal_set_u64(cp+53, hist->total_weighted_time);
+      mtbf_journal_set_u64(cp+61, (uint64_t)hist->start_of_downtime);
+    }
+    cp += MTBF_JOURNAL_RECORD_LEN;
+  } SMARTLIST_FOREACH_END(id);
+
+  filename = get_datadir_fname("router-stability-journal");
+  r = append_bytes_to_file(filename, (const char *)buf,
+                           n * MTBF_JOURNAL_RECORD_LEN, 1);
+  tor_free(filename);
+  tor_free(buf);
+  if (r < 0)
+    return -1;
+  mtbf_journal_n_records += n;
+  mtbf_journal_clear_changed();
+  return 0;
+}
+
+/** Write all MTBF data to router-stability, and remove
+ * router-stability-journal.  Return 0 on success, negative on failure. */
+static int
+rep_hist_write_mtbf_file(void)
 {
   char time_buf[ISO_TIME_LEN+1];
 
@@ -772,6 +936,7 @@ rep_hist_record_mtbf_data(time_t now, int missing_means_down)
   or_history_t *hist;
   open_file_t *open_file = NULL;
   FILE *f;
+  uint32_t generation;
 
   {
     char *filename = get_datadir_fname("router-stability");
@@ -807,6 +972,10 @@ rep_hist_record_mtbf_data(time_t now, int missing_means_down)
     format_iso_time(time_buf, stability_last_downrated);
     PRINTF((f, "last-downrated %s\n", time_buf));
   }
+  do {
+    generation = crypto_rand_int(INT_MAX);
+  } while (!generation || generation == mtbf_journal_generation);
+  PRINTF((f, "journal-generation %u\n", (unsigned)generation));
 
   PUT("data\n");
 
@@ -820,20 +989,10 @@ rep_hist_record_mtbf_data(time_t now, int missing_means_down)
     const char *t = NULL;
     digestmap_iter_get(orhist_it, &digest, &or_history_p);
     hist = (or_history_t*) or_history_p;
+    or_history_apply_downrates(hist);
 
     base16_encode(dbuf, sizeof(dbuf), digest, DIGEST_LEN);
 
-    if (missing_means_down && hist->start_of_run &&
-        !router_get_by_id_digest(digest)) {
-      /* We think this relay is running, but it's not listed in our
-       * routerlist. Somehow it fell out without telling us it went
-       * down. Complain and also correct it. */
-      log_info(LD_HIST,
-               "Relay '%s' is listed as up in rephist, but it's not in "
-               "our routerlist. Correcting.", dbuf);
-      rep_hist_note_router_unreachable(digest, now);
-    }
-
     PRINTF((f, "R %s\n", dbuf));
     if (hist->start_of_run > 0) {
       format_iso_time(time_buf, hist->start_of_run);
@@ -857,12 +1016,52 @@ rep_hist_record_mtbf_data(time_t now, int missing_means_down)
 #undef PUT
 #undef PRINTF
 
-  return finish_writing_to_file(open_file);
+  if (finish_writing_to_file(open_file) < 0)
+    return -1;
+
+  /* The journal, if any, applied to the file we just replaced. */
+  {
+    char *filename = get_datadir_fname("router-stability-journal");
+    if (unlink(filename) < 0 && errno != ENOENT)
+      log_warn(LD_FS, "Couldn't remove %s: %s", filename, strerror(errno));
+    tor_free(filename);
+  }
+  mtbf_journal_generation = generation;
+  mtbf_journal_n_records = 0;
+  mtbf_journal_clear_changed();
+  return 0;
  err:
   abort_writing_to_file(open_file);
   return -1;
 }
 
+/** Write MTBF data to disk. Return 0 on success, negative on failure.
+ *
+ * If <b>missing_means_down</b>, then if we're about to write an entry
+ * that is still considered up but isn't in our routerlist, consider it
+ * to be down.
+ *
+ * Usually, we only append the routers whose data has changed to
+ * router-stability-journal; once the journal holds more records than we
+ * have routers, we rewrite router-stability instead. */
+int
+rep_hist_record_mtbf_data(time_t now, int missing_means_down)
+{
+  if (missing_means_down)
+    rep_hist_correct_missing_routers(now);
+
+  if (mtbf_journal_generation &&
+      mtbf_journal_n_records < digestmap_size(history_map)) {
+    if (!mtbf_journal_changed || !smartlist_len(mtbf_journal_changed))
+      return 0;
+    if (rep_hist_append_mtbf_journal(now) == 0)
+      return 0;
+    log_info(LD_HIST, "Couldn't append to MTBF journal; rewriting the "
+             "whole MTBF file instead.");
+  }
+  return rep_hist_write_mtbf_file();
+}
+
 /** Format the current tracked status of the router in <b>hist</b> at time
  * <b>now</b> for analysis; return it in a newly allocated string. */
 static char *
@@ -875,6 +1074,7 @@ rep_hist_format_router_status(or_history_t *hist, time_t now)
   int up = 0, down = 0;
   char *cp = NULL;
 
+  or_history_apply_downrates(hist);
   if (hist->start_of_run) {
     format_iso_time(sor_buf, hist->start_of_run);
     up = 1;
@@ -1042,6 +1242,81 @@ correct_time(time_t t, time_t now, time_t stored_at, time_t started_measuring)
   }
 }
 
+/** Apply the records in router-stability-journal that belong to the
+ * router-stability file we just loaded at <b>now</b>. */
+static void
+rep_hist_load_mtbf_journal(time_t now)
+{
+  char *filename = get_datadir_fname("router-stability-journal");
+  struct stat st;
+  char *body = read_file_to_str(filename, RFTS_BIN|RFTS_IGNORE_MISSING, &st);
+  const uint8_t *cp, *end;
+  time_t stored_at = 0;
+  int in_batch = 0, n_routers = 0;
+
+  tor_free(filename);
+  if (!body)
+    return;
+  cp = (const uint8_t *)body;
+  end = cp + (st.st_size / MTBF_JOURNAL_RECORD_LEN) * MTBF_JOURNAL_RECORD_LEN;
+  if (end - cp != st.st_size)
+    log_warn(LD_HIST, "Truncated MTBF journal.");
+
+  for ( ; cp < end; cp += MTBF_JOURNAL_RECORD_LEN) {
+    const char *id = (const char *)cp + 1;
+    const uint8_t *field = cp + 1 + DIGEST_LEN;
+    or_history_t *hist;
+    if (cp[0] == MTBF_JOURNAL_BATCH) {
+      time_t downrated, tracked;
+      in_batch = mtbf_journal_get_u64(field) == mtbf_journal_generation;
+      if (!in_batch)
+        continue;
+      stored_at = (time_t) mtbf_journal_get_u64(field+8);
+      downrated = (time_t) mtbf_journal_get_u64(field+16);
+      tracked = (time_t) mtbf_journal_get_u64(field+24);
+      if (!stability_last_downrated)
+        stability_last_downrated = downrated;
+      /* Routers in this batch are discounted as of its time; everybody
+       * else still needs discounting to catch up. */
+      while (stability_last_downrated < downrated) {
+        stability_last_downrated += STABILITY_INTERVAL;
+        ++stability_n_downrates;
+      }
+      if (!started_tracking_stability)
+        started_tracking_stability = tracked;
+      ++mtbf_journal_n_records;
+    } else if (!in_batch) {
+      continue;
+    } else if (cp[0] == MTBF_JOURNAL_ROUTER) {
+      if (!(hist = get_or_history(id)))
+        continue;
+      hist->weighted_run_length =
+        (unsigned long) mtbf_journal_get_u64(field);
+      hist->total_run_weights =
+        U64_TO_DBL(mtbf_journal_get_u64(field+8)) / 100000.0;
+      hist->start_of_run =
+        correct_time((time_t) mtbf_journal_get_u64(field+16), now,
+                     stored_at, started_tracking_stability);
+      hist->weighted_uptime = (unsigned long) mtbf_journal_get_u64(field+24);
+      hist->total_weighted_time =
+        (unsigned long) mtbf_journal_get_u64(field+32);
+      hist->start_of_downtime =
+        correct_time((time_t) mtbf_journal_get_u64(field+40), now,
+                     stored_at, started_tracking_stability);
+      hist->n_downrates = stability_n_downrates;
+      ++mtbf_journal_n_records;
+      ++n_routers;
+    } else if (cp[0] == MTBF_JOURNAL_FORGET) {
+      if ((hist = digestmap_remove(history_map, id)))
+        free_or_history(hist);
+      ++mtbf_journal_n_records;
+    }
+  }
+  log_info(LD_HIST, "Loaded %d router MTBF records from the MTBF journal.",
+           n_routers);
+  tor_free(body);
+}
+
 /** Load MTBF data from disk.  Returns 0 on success or recoverable error, -1
  * on failure. */
 int
@@ -1054,6 +1329,7 @@ rep_hist_load_mtbf_data(time_t now)
   time_t last_downrated = 0, stored_at = 0, tracked_since = 0;
   time_t latest_possible_start = now;
   long format = -1;
+  long generation = 0;
 
   {
     char *filename = get_datadir_fname("router-stability");
@@ -1099,6 +1375,9 @@ rep_hist_load_mtbf_data(time_t now)
         log_warn(LD_HIST,"Couldn't parse started-tracking time in mtbf "
                  "history file.");
     }
+    if (!strcmpstart(line, "journal-generation "))
+      generation = tor_parse_long(line+strlen("journal-generation "),
+                                  10, 0, INT_MAX, NULL, NULL);
   }
   if (last_downrated > now)
     last_downrated = now;
@@ -1222,6 +1501,11 @@ rep_hist_load_mtbf_data(time_t now)
   stability_last_downrated = last_downrated;
   started_tracking_stability = tracked_since;
 
+  if (generation > 0) {
+    mtbf_journal_generation = (uint32_t)generation;
+    rep_hist_load_mtbf_journal(now);
+  }
+
   goto done;
  err:
   r = -1;
@@ -1367,11 +1651,57 @@ static bw_array_t *dir_read_array = NULL;
     directory protocol. */
 static bw_array_t *dir_write_array = NULL;
 
+/** How many exit ports' byte counts a bw_pending_t holds at once. */
+#define BW_PENDING_N_EXIT_PORTS 16
+
+/** Bytes we have transferred to or from one exit port, not yet added to
+ * exit_bytes_read and exit_bytes_written. */
+typedef struct bw_pending_exit_t {
+  uint16_t port; /**< Which port these bytes were for. */
+  uint64_t read; /**< Bytes read from exit connections to <b>port</b>. */
+  uint64_t written; /**< Bytes written to exit connections to <b>port</b>. */
+} bw_pending_exit_t;
+
+/** Byte counts that we have noted during a single second, but not yet
+ * added to the bandwidth history arrays or the exit port stats.  Noting
+ * bytes only adds to these; bw_pending_flush() adds them to the shared
+ * history once the second is over, or when somebody wants to read the
+ * history.  Every thread that moves data would need its own bw_pending_t;
+ * so far, that is only the main thread. */
+typedef struct bw_pending_t {
+  time_t when; /**< Which second the read and write counts are for. */
+  uint64_t read; /**< Bytes for read_array. */
+  uint64_t written; /**< Bytes for write_array. */
+  uint64_t dir_read; /**< Bytes for dir_read_array. */
+  uint64_t dir_written; /**< Bytes for dir_write_array. */
+  /** A small cache of exit port byte counts, indexed by port modulo
+   * BW_PENDING_N_EXIT_PORTS, so that busy ports don't each need an update
+   * to the large exit port arrays for every read or write. */
+  bw_pending_exit_t exits[BW_PENDING_N_EXIT_PORTS];
+} bw_pending_t;
+
+/** The main thread's not-yet-flushed byte counts. */
+static bw_pending_t bw_pending;
+
+/** Return the pending byte counts for the current second <b>when</b>,
+ * first flushing the counts for any earlier second. */
+static INLINE bw_pending_t *
+bw_pending_get(time_t when)
+{
+  if (when != bw_pending.when) {
+    bw_pending_flush();
+    bw_pending.when = when;
+  }
+  return &bw_pending;
+}
+
 /** Set up [dir-]read_array and [dir-]write_array, freeing them if they
  * already exist. */
 static void
 bw_arrays_init(void)
 {
+  bw_pending.read = bw_pending.written = 0;
+  bw_pending.dir_read = bw_pending.dir_written = 0;
   tor_free(read_array);
   tor_free(write_array);
   tor_free(dir_read_array);
@@ -1400,7 +1730,7 @@ rep_hist_note_bytes_written(size_t num_bytes, time_t when)
  * seen over when-1 to when-1-NUM_SECS_ROLLING_MEASURE, and stick it
  * somewhere. See rep_hist_bandwidth_assess() below.
  */
-  add_obs(write_array, when, num_bytes);
+  bw_pending_get(when)->written += num_bytes;
 }
 
 /** Remember that we wrote <b>num_bytes</b> bytes in second <b>when</b>.
@@ -1409,8 +1739,7 @@ rep_hist_note_bytes_written(size_t num_bytes, time_t when)
 void
 rep_hist_note_bytes_read(size_t num_bytes, time_t when)
 {
-/* if we're smart, we can make this func and the one above share code */
-  add_obs(read_array, when, num_bytes);
+  bw_pending_get(when)->read += num_bytes;
 }
 
 /** Remember that we wrote <b>num_bytes</b> directory bytes in second
@@ -1419,7 +1748,7 @@ rep_hist_note_bytes_read(size_t num_bytes, time_t when)
 void
 rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when)
 {
-  add_obs(dir_write_array, when, num_bytes);
+  bw_pending_get(when)->dir_written += num_bytes;
 }
 
 /** Remember that we read <b>num_bytes</b> directory bytes in second
@@ -1428,7 +1757,7 @@ rep_hist_note_dir_bytes_written(size_t num_bytes, time_t when)
 void
 rep_hist_note_dir_bytes_read(size_t num_bytes, time_t when)
 {
-  add_obs(dir_read_array, when, num_bytes);
+  bw_pending_get(when)->dir_read += num_bytes;
 }
 
 /** Helper: Return the largest value in b->maxima.  (This is equal to the
@@ -1458,6 +1787,7 @@ int
 rep_hist_bandwidth_assess(void)
 {
   uint64_t w,r;
+  bw_pending_flush();
   r = find_largest_max(read_array);
   w = find_largest_max(write_array);
   if (r>w)
@@ -1537,6 +1867,7 @@ rep_hist_get_bandwidth_lines(void)
 #define MAX_HIST_VALUE_LEN 21*NUM_TOTALS
   len = (67+MAX_HIST_VALUE_LEN)*4;
   buf = tor_malloc_zero(len);
+  bw_pending_flush();
   cp = buf;
   for (r=0;r<4;++r) {
     char tmp[MAX_HIST_VALUE_LEN];
@@ -1649,6 +1980,7 @@ rep_hist_update_state(or_state_t *state)
                                        &state->BWHistory ## st ## Ends, \
                                        &state->BWHistory ## st ## Interval)
 
+  bw_pending_flush();
   UPDATE(write_array, Write);
   UPDATE(read_array, Read);
   UPDATE(dir_write_array, DirWrite);
@@ -2066,6 +2398,178 @@ dump_pk_ops(int severity)
       pk_op_counts.n_rend_server_ops);
 }
 
+/*** Onionskin pipeline statistics ***/
+
+/** Counts and timings for onionskins, and for the cpuworkers that answer
+ * them, over some interval. */
+typedef struct onion_pipeline_stats_t {
+  /** How many onionskins did we answer? */
+  uint64_t n_answered;
+  /** How many onionskins' time waiting for a worker did we measure, and
+   * how many usec did they wait in total? */
+  uint64_t n_queue_timed;
+  uint64_t queue_usec;
+  /** How many onionskins did we time in a worker, and how many usec did
+   * the workers spend on them in total? */
+  uint64_t n_worker_timed;
+  uint64_t worker_usec;
+  /** How many create requests did we give up on, by onion_drop_reason_t? */
+  uint64_t n_dropped[N_ONION_DROP_REASONS];
+  /** How many usec did each worker thread spend doing any kind of job? */
+  uint64_t worker_busy_usec[MAX_CPUWORKERS];
+} onion_pipeline_stats_t;
+
+/** Onionskin statistics for the current second, the last full second, and
+ * everything up to the last full second. */
+static onion_pipeline_stats_t onion_stats_current, onion_stats_last,
+  onion_stats_total;
+/** How many seconds onion_stats_last and onion_stats_total cover. */
+static int onion_stats_last_seconds = 0;
+static uint64_t onion_stats_total_seconds = 0;
+/** How long was the pending onion queue at the end of the last second? */
+static int onion_stats_queue_depth = 0;
+/** One more than the highest worker slot we've heard from. */
+static int onion_stats_n_worker_slots = 0;
+
+/** Remember that an onionskin waited <b>queue_usec</b> for a worker to
+ * start on it, and then took the worker <b>worker_usec</b>.  Either may
+ * be negative if we don't know it. */
+void
+rep_hist_note_onionskin_timing(long queue_usec, long worker_usec)
+{
+  if (queue_usec >= 0) {
+    ++onion_stats_current.n_queue_timed;
+    onion_stats_current.queue_usec += queue_usec;
+  }
+  if (worker_usec >= 0) {
+    ++onion_stats_current.n_worker_timed;
+    onion_stats_current.worker_usec += worker_usec;
+  }
+}
+
+/** Remember that we answered an onionskin. */
+void
+rep_hist_note_onionskin_answered(void)
+{
+  ++onion_stats_current.n_answered;
+}
+
+/** Remember that we gave up on a create request for <b>reason</b>. */
+void
+rep_hist_note_onionskin_dropped(onion_drop_reason_t reason)
+{
+  tor_assert(reason < N_ONION_DROP_REASONS);
+  ++onion_stats_current.n_dropped[reason];
+}
+
+/** Remember that the cpuworker thread in slot <b>worker</b> spent
+ * <b>usec</b> on a job. */
+void
+rep_hist_note_cpuworker_busy(int worker, long usec)
+{
+  if (worker < 0 || worker >= MAX_CPUWORKERS || usec < 0)
+    return;
+  onion_stats_current.worker_busy_usec[worker] += usec;
+  if (worker >= onion_stats_n_worker_slots)
+    onion_stats_n_worker_slots = worker + 1;
+}
+
+/** Called once a second, when <b>seconds</b> seconds have passed since the
+ * last call and the pending onion queue holds <b>queue_depth</b> requests:
+ * start a new second of onionskin statistics. */
+void
+rep_hist_onion_pipeline_second_elapsed(int seconds, int queue_depth)
+{
+  onion_pipeline_stats_t *cur = &onion_stats_current;
+  onion_pipeline_stats_t *tot = &onion_stats_total;
+  int i;
+
+  if (seconds < 1)
+    seconds = 1;
+  tot->n_answered += cur->n_answered;
+  tot->n_queue_timed += cur->n_queue_timed;
+  tot->queue_usec += cur->queue_usec;
+  tot->n_worker_timed += cur->n_worker_timed;
+  tot->worker_usec += cur->worker_usec;
+  for (i = 0; i < N_ONION_DROP_REASONS; ++i)
+    tot->n_dropped[i] += cur->n_dropped[i];
+  for (i = 0; i < onion_stats_n_worker_slots; ++i)
+    tot->worker_busy_usec[i] += cur->worker_busy_usec[i];
+  onion_stats_total_seconds += seconds;
+
+  memcpy(&onion_stats_last, cur, sizeof(onion_stats_last));
+  memset(cur, 0, sizeof(*cur));
+  onion_stats_last_seconds = seconds;
+  onion_stats_queue_depth = queue_depth;
+}
+
+/** Return a newly allocated string describing the onionskin statistics
+ * for the last full second if <b>last_second</b> is true, or else for
+ * everything up to it.  The format is a series of space-separated
+ * Keyword=Value pairs: the length of the pending onion queue; how many
+ * onionskins we answered; the mean usec each onionskin waited for a
+ * worker, and spent in one; each worker thread's busy time as a percentage
+ * of the interval; and how many create requests we gave up on, by
+ * reason. */
+char *
+rep_hist_format_onion_pipeline(int last_second)
+{
+  const onion_pipeline_stats_t *s =
+    last_second ? &onion_stats_last : &onion_stats_total;
+  uint64_t interval_usec = (last_second ? (uint64_t)onion_stats_last_seconds
+                            : onion_stats_total_seconds) * 1000000;
+  smartlist_t *util = smartlist_new();
+  char *util_str, *result;
+  int i;
+
+  for (i = 0; i < onion_stats_n_worker_slots; ++i) {
+    uint64_t pct = interval_usec ?
+      s->worker_busy_usec[i] * 100 / interval_usec : 0;
+    smartlist_add_asprintf(util, U64_FORMAT, U64_PRINTF_ARG(pct));
+  }
+  util_str = smartlist_join_strings(util, ",", 0, NULL);
+
+  tor_asprintf(&result,
+               "QueueDepth=%d Answered="U64_FORMAT" QueueUsec="U64_FORMAT
+               " WorkerUsec="U64_FORMAT" WorkerUtil=%s "
+               "Dropped=QUEUEFULL:"U64_FORMAT",EXPIRED:"U64_FORMAT
+               ",CLOSED:"U64_FORMAT",FAILED:"U64_FORMAT
+               ",OVERLOADED:"U64_FORMAT,
+               onion_stats_queue_depth,
+               U64_PRINTF_ARG(s->n_answered),
+               U64_PRINTF_ARG(s->n_queue_timed ?
+                              s->queue_usec / s->n_queue_timed : 0),
+               U64_PRINTF_ARG(s->n_worker_timed ?
+                              s->worker_usec / s->n_worker_timed : 0),
+               util_str,
+               U64_PRINTF_ARG(s->n_dropped[ONION_DROP_QUEUE_FULL]),
+               U64_PRINTF_ARG(s->n_dropped[ONION_DROP_EXPIRED]),
+               U64_PRINTF_ARG(s->n_dropped[ONION_DROP_CIRCUIT_CLOSED]),
+               U64_PRINTF_ARG(s->n_dropped[ONION_DROP_FAILED]),
+               U64_PRINTF_ARG(s->n_dropped[ONION_DROP_OVERLOADED]));
+
+  SMARTLIST_FOREACH(util, char *, cp, tor_free(cp));
+  smartlist_free(util);
+  tor_free(util_str);
+  return result;
+}
+
+/** Helper used to implement GETINFO onion-pipeline/... controller
+ * commands. */
+int
+getinfo_helper_onion_pipeline(control_connection_t *control_conn,
+                              const char *question, char **answer,
+                              const char **errmsg)
+{
+  (void)control_conn;
+  (void)errmsg;
+  if (!strcmp(question, "onion-pipeline/last-second"))
+    *answer = rep_hist_format_onion_pipeline(1);
+  else if (!strcmp(question, "onion-pipeline/totals"))
+    *answer = rep_hist_format_onion_pipeline(0);
+  return 0;
+}
+
 /*** Exit port statistics ***/
 
 /* Some constants */
@@ -2105,11 +2609,48 @@ rep_hist_exit_stats_init(time_t now)
                                  sizeof(uint32_t));
 }
 
+/** Add all the exit port byte counts in bw_pending to the exit port
+ * stats, if we're collecting them, and forget them. */
+static void
+bw_pending_flush_exits(void)
+{
+  int i;
+  for (i = 0; i < BW_PENDING_N_EXIT_PORTS; ++i) {
+    bw_pending_exit_t *ent = &bw_pending.exits[i];
+    if (exit_bytes_read) {
+      exit_bytes_read[ent->port] += ent->read;
+      exit_bytes_written[ent->port] += ent->written;
+    }
+    ent->read = ent->written = 0;
+  }
+}
+
+/** Add all the byte counts in bw_pending to the bandwidth history arrays
+ * and the exit port stats, and reset them. */
+static void
+bw_pending_flush(void)
+{
+  time_t when = bw_pending.when;
+  if (bw_pending.read)
+    add_obs(read_array, when, bw_pending.read);
+  if (bw_pending.written)
+    add_obs(write_array, when, bw_pending.written);
+  if (bw_pending.dir_read)
+    add_obs(dir_read_array, when, bw_pending.dir_read);
+  if (bw_pending.dir_written)
+    add_obs(dir_write_array, when, bw_pending.dir_written);
+  bw_pending.read = bw_pending.written = 0;
+  bw_pending.dir_read = bw_pending.dir_written = 0;
+  bw_pending_flush_exits();
+}
+
 /** Reset counters for exit port statistics. */
 void
 rep_hist_reset_exit_stats(time_t now)
 {
   start_of_exit_stats_interval = now;
+  memset(bw_pending.exits, 0, sizeof(bw_pending.exits));
+
   memset(exit_bytes_read, 0, EXIT_STATS_NUM_PORTS * sizeof(uint64_t));
   memset(exit_bytes_written, 0, EXIT_STATS_NUM_PORTS * sizeof(uint64_t));
   memset(exit_streams, 0, EXIT_STATS_NUM_PORTS * sizeof(uint32_t));
@@ -2121,6 +2662,7 @@ void
 rep_hist_exit_stats_term(void)
 {
   start_of_exit_stats_interval = 0;
+  memset(bw_pending.exits, 0, sizeof(bw_pending.exits));
   tor_free(exit_bytes_read);
   tor_free(exit_bytes_written);
   tor_free(exit_streams);
@@ -2156,6 +2698,7 @@ rep_hist_format_exit_stats(time_t now)
     return NULL; /* Not initialized. */
 
   tor_assert(now >= start_of_exit_stats_interval);
+  bw_pending_flush_exits();
 
   /* Go through all ports to find the n ports that saw most written and
    * read bytes.
@@ -2318,7 +2861,7 @@ rep_hist_exit_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "exit-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_behind(filename, str, 0, NULL) < 0)
     log_warn(LD_HIST, "Unable to write exit port statistics to disk!");
 
  done:
@@ -2334,10 +2877,20 @@ void
 rep_hist_note_exit_bytes(uint16_t port, size_t num_written,
                          size_t num_read)
 {
+  bw_pending_exit_t *ent;
   if (!start_of_exit_stats_interval)
     return; /* Not initialized. */
-  exit_bytes_written[port] += num_written;
-  exit_bytes_read[port] += num_read;
+  ent = &bw_pending.exits[port % BW_PENDING_N_EXIT_PORTS];
+  if (ent->port != port) {
+    if (ent->read || ent->written) {
+      exit_bytes_read[ent->port] += ent->read;
+      exit_bytes_written[ent->port] += ent->written;
+      ent->read = ent->written = 0;
+    }
+    ent->port = port;
+  }
+  ent->written += num_written;
+  ent->read += num_read;
   log_debug(LD_HIST, "Written %lu bytes and read %lu bytes to/from an "
             "exit connection to port %d.",
             (unsigned long)num_written, (unsigned long)num_read, port);
@@ -2606,7 +3159,7 @@ rep_hist_buffer_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "buffer-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_behind(filename, str, 0, NULL) < 0)
     log_warn(LD_HIST, "Unable to write buffer stats to disk!");
 
  done:
@@ -2984,7 +3537,7 @@ rep_hist_conn_stats_write(time_t now)
     goto done;
   }
   filename = get_datadir_fname2("stats", "conn-stats");
-  if (write_str_to_file(filename, str, 0) < 0)
+  if (write_str_to_file_behind(filename, str, 0, NULL) < 0)
     log_warn(LD_HIST, "Unable to write conn stats to disk!");
 
  done:
@@ -3000,6 +3553,13 @@ void
 rep_hist_free_all(void)
 {
   digestmap_free(history_map, free_or_history);
+  if (mtbf_journal_changed) {
+    SMARTLIST_FOREACH(mtbf_journal_changed, char *, cp, tor_free(cp));
+    smartlist_free(mtbf_journal_changed);
+    mtbf_journal_changed = NULL;
+  }
+  mtbf_journal_generation = 0;
+  mtbf_journal_n_records = 0;
   tor_free(read_array);
   tor_free(write_array);
   tor_free(last_stability_doc);
@@ -3018,5 +3578,13 @@ rep_hist_free_all(void)
   }
   rep_hist_desc_stats_term();
   total_descriptor_downloads = 0;
+
+  memset(&onion_stats_current, 0, sizeof(onion_stats_current));
+  memset(&onion_stats_last, 0, sizeof(onion_stats_last));
+  memset(&onion_stats_total, 0, sizeof(onion_stats_total));
+  onion_stats_last_seconds = 0;
+  onion_stats_total_seconds = 0;
+  onion_stats_queue_depth = 0;
+  onion_stats_n_worker_slots = 0;
 }
 
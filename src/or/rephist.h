@@ -62,6 +62,16 @@ int rep_hist_circbuilding_dormant(time_t now);
 void note_crypto_pk_op(pk_op_t operation);
 void dump_pk_ops(int severity);
 
+void rep_hist_note_onionskin_timing(long queue_usec, long worker_usec);
+void rep_hist_note_onionskin_answered(void);
+void rep_hist_note_onionskin_dropped(onion_drop_reason_t reason);
+void rep_hist_note_cpuworker_busy(int worker, long usec);
+void rep_hist_onion_pipeline_second_elapsed(int seconds, int queue_depth);
+char *rep_hist_format_onion_pipeline(int last_second);
+int getinfo_helper_onion_pipeline(control_connection_t *control_conn,
+                                  const char *question, char **answer,
+                                  const char **errmsg);
+
 void rep_hist_free_all(void);
 
 void rep_hist_exit_stats_init(time_t now);
@@ -0,0 +1,164 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file replaycache.c
+ * \brief Remember which digests we've seen lately, to notice replays.
+ *
+ * Hidden services used to keep each replay cache as a digestmap from
+ * digests to malloc'd timestamps, and to forget old entries by walking
+ * the whole map.  Instead, a replaycache_t keeps two generations of
+ * entries: new digests go into the current one, and once every
+ * <b>interval</b> seconds the current generation becomes the previous
+ * one and we throw the old previous one away.  A digest is a replay if
+ * either generation has it, so we remember each digest for at least
+ * <b>interval</b> seconds and at most about twice that, and both checking
+ * and forgetting cost O(1) per entry.
+ *
+ * Each generation is an open-addressed hash table holding 8 bytes per
+ * digest.  Our peers choose what we digest, so they could grind out
+ * digests that all land in the same few slots, and make every lookup walk
+ * the whole table.  So rather than the digest's own bytes, we store the
+ * first 8 bytes of a digest of it keyed with a secret we pick at random
+ * for each process.  Two different digests will share those bytes only by
+ * accident, and nobody who doesn't know the secret can tell which slot a
+ * digest will use.
+ **/
+
+#include "or.h"
+#include "replaycache.h"
+
+/** How many slots a generation gets when we first add to it. */
+#define REPLAYCACHE_MIN_SLOTS 16
+
+/** One generation of a replaycache_t. */
+typedef struct replaycache_gen_t {
+  /** The replaycache_key() of each digest, or 0 for an empty slot. */
+  uint64_t *slots;
+  /** How many slots there are: 0, or a power of 2. */
+  unsigned int n_slots;
+  /** How many slots are full.  We grow the table before this reaches half
+   * of n_slots. */
+  unsigned int n_used;
+} replaycache_gen_t;
+
+/** A set of recently seen digests. */
+struct replaycache_t {
+  /** How long each generation lasts, or 0 if we never forget anything. */
+  time_t interval;
+  /** When the current generation started. */
+  time_t cur_started;
+  /** The current and previous generations. */
+  replaycache_gen_t gen[2];
+};
+
+/** The secret we key every replaycache_t's hash with. */
+static char replaycache_secret[DIGEST_LEN];
+/** Boolean: have we picked replaycache_secret yet? */
+static int replaycache_secret_set = 0;
+
+/** Return a new empty replaycache_t that remembers each digest for at least
+ * <b>interval</b> seconds, or forever if <b>interval</b> is 0. */
+replaycache_t *
+replaycache_new(time_t interval)
+{
+  replaycache_t *rc = tor_malloc_zero(sizeof(replaycache_t));
+  tor_assert(interval >= 0);
+  if (!replaycache_secret_set) {
+    crypto_rand(replaycache_secret, sizeof(replaycache_secret));
+    replaycache_secret_set = 1;
+  }
+  rc->interval = interval;
+  rc->cur_started = time(NULL);
+  return rc;
+}
+
+/** Release all storage held by <b>rc</b>. */
+void
+replaycache_free(replaycache_t *rc)
+{
+  if (!rc)
+    return;
+  tor_free(rc->gen[0].slots);
+  tor_free(rc->gen[1].slots);
+  tor_free(rc);
+}
+
+/** Return the key we store for <b>digest</b>, a DIGEST_LEN-byte digest:
+ * the first 8 bytes of its digest keyed with replaycache_secret. */
+static uint64_t
+replaycache_key(const char *digest)
+{
+  char buf[DIGEST_LEN*2], keyed[DIGEST_LEN];
+  uint64_t key;
+  memcpy(buf, replaycache_secret, DIGEST_LEN);
+  memcpy(buf+DIGEST_LEN, digest, DIGEST_LEN);
+  crypto_digest(keyed, buf, sizeof(buf));
+  key = get_uint64(keyed);
+  return key ? key : 1;
+}
+
+/** Return true iff <b>gen</b> holds <b>key</b>.  If it doesn't, and
+ * <b>add</b> is true, add it. */
+static int
+replaycache_gen_lookup(replaycache_gen_t *gen, uint64_t key, int add)
+{
+  unsigned int mask, i;
+
+  if (add && (gen->n_used+1)*2 > gen->n_slots) {
+    replaycache_gen_t bigger;
+    bigger.n_slots = gen->n_slots ? gen->n_slots*2 : REPLAYCACHE_MIN_SLOTS;
+    bigger.n_used = 0;
+    bigger.slots = tor_malloc_zero(bigger.n_slots * sizeof(uint64_t));
+    for (i = 0; i < gen->n_slots; ++i) {
+      if (gen->slots[i])
+        replaycache_gen_lookup(&bigger, gen->slots[i], 1);
+    }
+    tor_free(gen->slots);
+    *gen = bigger;
+  }
+  if (!gen->n_slots)
+    return 0;
+
+  mask = gen->n_slots - 1;
+  for (i = (unsigned int)key & mask; gen->slots[i]; i = (i+1) & mask) {
+    if (gen->slots[i] == key)
+      return 1;
+  }
+  if (add) {
+    gen->slots[i] = key;
+    ++gen->n_used;
+  }
+  return 0;
+}
+
+/** Return true iff <b>rc</b> has seen <b>digest</b>, a DIGEST_LEN-byte
+ * digest, recently.  If it hasn't, remember that we saw it at
+ * <b>now</b>. */
+int
+replaycache_add_and_test(replaycache_t *rc, const char *digest, time_t now)
+{
+  uint64_t key = replaycache_key(digest);
+
+  if (rc->interval && now >= rc->cur_started + rc->interval) {
+    /* Start a new generation, and forget the old previous one. */
+    tor_free(rc->gen[1].slots);
+    rc->gen[1] = rc->gen[0];
+    memset(&rc->gen[0], 0, sizeof(rc->gen[0]));
+    rc->cur_started = now;
+  } else if (now < rc->cur_started) {
+    /* The clock jumped back; don't wait for it to catch up. */
+    rc->cur_started = now;
+  }
+
+  if (replaycache_gen_lookup(&rc->gen[1], key, 0))
+    return 1;
+  return replaycache_gen_lookup(&rc->gen[0], key, 1);
+}
+
+/** Return how many digests <b>rc</b> remembers right now. */
+int
+replaycache_size(const replaycache_t *rc)
+{
+  return (int)(rc->gen[0].n_used + rc->gen[1].n_used);
+}
@@ -0,0 +1,20 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file replaycache.h
+ * \brief Header file for replaycache.c.
+ **/
+
+#ifndef _TOR_REPLAYCACHE_H
+#define _TOR_REPLAYCACHE_H
+
+typedef struct replaycache_t replaycache_t;
+
+replaycache_t *replaycache_new(time_t interval);
+void replaycache_free(replaycache_t *rc);
+int replaycache_add_and_test(replaycache_t *rc, const char *digest,
+                             time_t now);
+int replaycache_size(const replaycache_t *rc);
+
+#endif
@@ -1136,7 +1136,8 @@ should_refuse_unknown_exits(const or_options_t *options)
   if (options->RefuseUnknownExits != -1) {
     return options->RefuseUnknownExits;
   } else {
-    return networkstatus_get_param(NULL, "refuseunknownexits", 1, 0, 1);
+    return networkstatus_get_param_by_id(NULL, NET_PARAM_REFUSEUNKNOWNEXITS,
+                                         1, 0, 1);
   }
 }
 
@@ -1368,7 +1369,8 @@ router_compare_to_my_exit_policy(edge_connection_t *conn)
   if (tor_addr_family(&conn->_base.addr) != AF_INET)
     return -1;
 
-  return compare_tor_addr_to_addr_policy(&conn->_base.addr, conn->_base.port,
+  return compare_tor_addr_to_interned_policy(&conn->_base.addr,
+                   conn->_base.port,
                    desc_routerinfo->exit_policy) != ADDR_POLICY_ACCEPTED;
 }
 
@@ -1531,7 +1533,7 @@ router_rebuild_descriptor(int force)
   ri = tor_malloc_zero(sizeof(routerinfo_t));
   ri->cache_info.routerlist_index = -1;
   ri->address = tor_dup_ip(addr);
-  ri->nickname = tor_strdup(options->Nickname);
+  ri->nickname = string_intern(options->Nickname);
   ri->addr = addr;
   ri->or_port = router_get_advertised_or_port(options);
   ri->dir_port = router_get_advertised_dir_port(options, 0);
@@ -1571,7 +1573,7 @@ router_rebuild_descriptor(int force)
     return -1;
   }
   get_platform_str(platform, sizeof(platform));
-  ri->platform = tor_strdup(platform);
+  ri->platform = string_intern(platform);
 
   /* compute ri->bandwidthrate as the min of various options */
   ri->bandwidthrate = get_effective_bwrate(options);
@@ -1589,6 +1591,7 @@ router_rebuild_descriptor(int force)
                                options->ExitPolicyRejectPrivate,
                                ri->address, !options->BridgeRelay);
   }
+  ri->exit_policy = addr_policy_list_intern(ri->exit_policy);
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy);
 
@@ -1650,6 +1653,11 @@ router_rebuild_descriptor(int force)
     /* remove duplicates from the list */
     smartlist_sort_strings(ri->declared_family);
     smartlist_uniq_strings(ri->declared_family);
+    SMARTLIST_FOREACH_BEGIN(ri->declared_family, char *, name) {
+      const char *interned = string_intern(name);
+      tor_free(name);
+      SMARTLIST_REPLACE_CURRENT(ri->declared_family, name, (char*)interned);
+    } SMARTLIST_FOREACH_END(name);
 
     smartlist_free(family);
   }
@@ -1964,6 +1972,47 @@ get_platform_str(char *platform, size_t len)
  */
 #define DEBUG_ROUTER_DUMP_ROUTER_TO_STRING
 
+/** A public key and its PEM encoding.  We remember the encodings of the
+ * keys in our descriptor, which rarely change, so that we don't redo them
+ * every time we rebuild it. */
+typedef struct pem_key_cache_t {
+  crypto_pk_t *key; /**< The key we encoded, or NULL. */
+  char *pem; /**< The PEM encoding of <b>key</b>. */
+} pem_key_cache_t;
+
+/** The PEM encoding of the onion key in our latest descriptor. */
+static pem_key_cache_t desc_onion_pkey_pem = { NULL, NULL };
+/** The PEM encoding of the identity key in our latest descriptor. */
+static pem_key_cache_t desc_identity_pkey_pem = { NULL, NULL };
+
+/** Return the PEM encoding of the public part of <b>key</b>, using the one
+ * in <b>cache</b> if it is for the same key, and replacing it otherwise.
+ * The result belongs to <b>cache</b>.  Return NULL on failure. */
+static const char *
+pem_key_cache_get(pem_key_cache_t *cache, crypto_pk_t *key)
+{
+  char *pem;
+  size_t pem_len;
+  if (cache->key && !crypto_pk_cmp_keys(cache->key, key))
+    return cache->pem;
+  if (crypto_pk_write_public_key_to_string(key, &pem, &pem_len) < 0)
+    return NULL;
+  crypto_pk_free(cache->key);
+  tor_free(cache->pem);
+  cache->key = crypto_pk_dup_key(key);
+  cache->pem = pem;
+  return pem;
+}
+
+/** Release everything held in <b>cache</b>. */
+static void
+pem_key_cache_clear(pem_key_cache_t *cache)
+{
+  crypto_pk_free(cache->key);
+  cache->key = NULL;
+  tor_free(cache->pem);
+}
+
 /** OR only: Given a routerinfo for this router, and an identity key to sign
  * with, encode the routerinfo as a signed server descriptor and write the
  * result into <b>s</b>, using at most <b>maxlen</b> bytes.  Return -1 on
@@ -1973,17 +2022,15 @@ int
 router_dump_router_to_string(char *s, size_t maxlen, routerinfo_t *router,
                              crypto_pk_t *ident_key)
 {
-  char *onion_pkey; /* Onion key, PEM-encoded. */
-  char *identity_pkey; /* Identity key, PEM-encoded. */
+  const char *onion_pkey; /* Onion key, PEM-encoded. */
+  const char *identity_pkey; /* Identity key, PEM-encoded. */
   char digest[DIGEST_LEN];
   char published[ISO_TIME_LEN+1];
   char fingerprint[FINGERPRINT_LEN+1];
   int has_extra_info_digest;
   char extra_info_digest[HEX_DIGEST_LEN+1];
-  size_t onion_pkeylen, identity_pkeylen;
   size_t written;
   int result=0;
-  addr_policy_t *tmpe;
   char *family_line;
   char *extra_or_address = NULL;
   const or_options_t *options = get_options();
@@ -2002,17 +2049,17 @@ router_dump_router_to_string(char *s, size_t maxlen, routerinfo_t *router,
   }
 
   /* PEM-encode the onion key */
-  if (crypto_pk_write_public_key_to_string(router->onion_pkey,
-                                           &onion_pkey,&onion_pkeylen)<0) {
+  onion_pkey = pem_key_cache_get(&desc_onion_pkey_pem, router->onion_pkey);
+  if (!onion_pkey) {
     log_warn(LD_BUG,"write onion_pkey to string failed!");
     return -1;
   }
 
   /* PEM-encode the identity key */
-  if (crypto_pk_write_public_key_to_string(router->identity_pkey,
-                                        &identity_pkey,&identity_pkeylen)<0) {
+  identity_pkey = pem_key_cache_get(&desc_identity_pkey_pem,
+                                    router->identity_pkey);
+  if (!identity_pkey) {
     log_warn(LD_BUG,"write identity_pkey to string failed!");
-    tor_free(onion_pkey);
     return -1;
   }
 
@@ -2085,8 +2132,6 @@ router_dump_router_to_string(char *s, size_t maxlen, routerinfo_t *router,
     options->AllowSingleHopExits ? "opt allow-single-hop-exits\n" : "");
 
   tor_free(family_line);
-  tor_free(onion_pkey);
-  tor_free(identity_pkey);
   tor_free(extra_or_address);
 
   if (result < 0) {
@@ -2109,27 +2154,24 @@ router_dump_router_to_string(char *s, size_t maxlen, routerinfo_t *router,
   }
 
   /* Write the exit policy to the end of 's'. */
-  if (!router->exit_policy || !smartlist_len(router->exit_policy)) {
-    strlcat(s+written, "reject *:*\n", maxlen-written);
-    written += strlen("reject *:*\n");
-    tmpe = NULL;
-  } else if (router->exit_policy) {
-    int i;
-    for (i = 0; i < smartlist_len(router->exit_policy); ++i) {
-      tmpe = smartlist_get(router->exit_policy, i);
-      result = policy_write_item(s+written, maxlen-written, tmpe, 1);
-      if (result < 0) {
-        log_warn(LD_BUG,"descriptor policy_write_item ran out of room!");
-        return -1;
-      }
-      tor_assert(result == (int)strlen(s+written));
-      written += result;
-      if (written+2 > maxlen) {
-        log_warn(LD_BUG,"descriptor policy_write_item ran out of room (2)!");
+  {
+    const char *policy_lines = "reject *:*\n";
+    size_t policy_len;
+    if (router->exit_policy && smartlist_len(router->exit_policy)) {
+      policy_lines =
+        addr_policy_list_get_descriptor_lines(router->exit_policy);
+      if (!policy_lines) {
+        log_warn(LD_BUG,"Couldn't format descriptor exit policy!");
         return -1;
       }
-      s[written++] = '\n';
     }
+    policy_len = strlen(policy_lines);
+    if (written + policy_len + 1 > maxlen) {
+      log_warn(LD_BUG,"descriptor exit policy ran out of room!");
+      return -1;
+    }
+    memcpy(s+written, policy_lines, policy_len+1);
+    written += policy_len;
   }
 
   if (written + DIROBJ_MAX_SIG_LEN > maxlen) {
@@ -2243,6 +2285,9 @@ load_stats_file(const char *filename, const char *end_line, time_t now,
   char *fname = get_datadir_fname(filename);
   char *contents, *start = NULL, *tmp, timestr[ISO_TIME_LEN+1];
   time_t written;
+  /* We may still be writing the last stats we took; read those, not
+   * whatever was there before. */
+  write_behind_wait(fname);
   switch (file_status(fname)) {
     case FN_FILE:
       /* X022 Find an alternative to reading the whole file to memory. */
@@ -2742,6 +2787,8 @@ router_free_all(void)
   tor_mutex_free(key_lock);
   routerinfo_free(desc_routerinfo);
   extrainfo_free(desc_extrainfo);
+  pem_key_cache_clear(&desc_onion_pkey_pem);
+  pem_key_cache_clear(&desc_identity_pkey_pem);
   crypto_pk_free(authority_signing_key);
   authority_cert_free(authority_key_certificate);
   crypto_pk_free(legacy_signing_key);
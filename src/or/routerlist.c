@@ -11,6 +11,7 @@
  * servers.
  **/
 
+#define ROUTERLIST_PRIVATE
 #include "or.h"
 #include "circuitbuild.h"
 #include "config.h"
@@ -655,11 +656,288 @@ _compare_signed_descriptors_by_age(const void **_a, const void **_b)
 #define RRS_FORCE 1
 #define RRS_DONT_REMOVE_OLD 2
 
+/** Where one descriptor will live in a store file that a background thread
+ * is writing. */
+typedef struct desc_rebuild_ent_t {
+  /** The descriptor's signed_descriptor_digest. */
+  char digest[DIGEST_LEN];
+  off_t offset; /**< Its saved_offset in the new store file. */
+} desc_rebuild_ent_t;
+
+/** Return a new list of every signed_descriptor_t in the routerlist that
+ * belongs in <b>store</b>. */
+static smartlist_t *
+desc_store_list_descriptors(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = smartlist_new();
+  if (store->type == EXTRAINFO_STORE) {
+    eimap_iter_t *iter;
+    for (iter = eimap_iter_init(routerlist->extra_info_map);
+         !eimap_iter_done(iter);
+         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
+      const char *key;
+      extrainfo_t *ei;
+      eimap_iter_get(iter, &key, &ei);
+      smartlist_add(signed_descriptors, &ei->cache_info);
+    }
+  } else {
+    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
+                      smartlist_add(signed_descriptors, sd));
+    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
+                      smartlist_add(signed_descriptors, &ri->cache_info));
+  }
+  return signed_descriptors;
+}
+
+/** If a thread is writing a new store file for <b>store</b>, make sure we
+ * don't use it.  We keep track of the thread until it's done, so that we
+ * don't start another one writing the same file. */
+static void
+desc_store_cancel_rebuild(desc_store_t *store)
+{
+  if (!store->rebuild_write)
+    return;
+  tor_free(store->rebuild_ents);
+  store->n_rebuild_ents = 0;
+  store->rebuild_cancelled = 1;
+}
+
+/** Start a thread to write the descriptors in <b>chunks</b>, which hold the
+ * bodies of the cacheable members of <b>signed_descriptors</b> in order,
+ * into a new store file for <b>store</b>.  Return 0 on success, or -1 if we
+ * can't start a thread. */
+static int
+desc_store_start_background_rebuild(desc_store_t *store,
+                                    const smartlist_t *signed_descriptors,
+                                    const smartlist_t *chunks,
+                                    size_t total_len)
+{
+  char *buf, *cp, *fname;
+  desc_rebuild_ent_t *ents;
+  int n = 0;
+
+  if (store->rebuild_write)
+    return -1; /* A cancelled rebuild is still writing. */
+
+  cp = buf = tor_malloc(total_len ? total_len : 1);
+  SMARTLIST_FOREACH(chunks, const sized_chunk_t *, c, {
+      memcpy(cp, c->bytes, c->len);
+      cp += c->len;
+    });
+  tor_assert((size_t)(cp - buf) == total_len);
+
+  ents = tor_malloc(sizeof(desc_rebuild_ent_t) *
+                    (smartlist_len(chunks) ? smartlist_len(chunks) : 1));
+  cp = buf;
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    if (sd->do_not_cache)
+      continue;
+    memcpy(ents[n].digest, sd->signed_descriptor_digest, DIGEST_LEN);
+    ents[n].offset = cp - buf;
+    cp += sd->signed_descriptor_len + sd->annotations_len;
+    ++n;
+  } SMARTLIST_FOREACH_END(sd);
+  tor_assert(n == smartlist_len(chunks));
+
+  fname = get_datadir_fname_suffix(store->fname_base, ".rebuild");
+  store->rebuild_write = write_bytes_to_file_in_background(fname, buf,
+                                                           total_len);
+  tor_free(fname);
+  if (!store->rebuild_write) {
+    tor_free(buf);
+    tor_free(ents);
+    return -1;
+  }
+  store->rebuild_ents = ents;
+  store->n_rebuild_ents = n;
+  store->rebuild_len = total_len;
+  log_info(LD_DIR, "Rebuilding %s cache in the background",
+           store->description);
+  return 0;
+}
+
+/** Replace the journal of <b>store</b> with one holding only the
+ * descriptors that are saved in the journal.  Return 0 on success, -1 on
+ * failure. */
+static int
+desc_store_rewrite_journal(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = desc_store_list_descriptors(store);
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *journaled = smartlist_new();
+  char *fname = get_datadir_fname_suffix(store->fname_base, ".new");
+  off_t offset = 0;
+  int r;
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    sized_chunk_t *c;
+    if (sd->saved_location != SAVED_IN_JOURNAL)
+      continue;
+    c = tor_malloc(sizeof(sized_chunk_t));
+    c->bytes = signed_descriptor_get_body_impl(sd, 1);
+    c->len = sd->signed_descriptor_len + sd->annotations_len;
+    smartlist_add(chunks, c);
+    smartlist_add(journaled, sd);
+  } SMARTLIST_FOREACH_END(sd);
+
+  r = write_chunks_to_file(fname, chunks, 1);
+  if (r == 0) {
+    SMARTLIST_FOREACH_BEGIN(journaled, signed_descriptor_t *, sd) {
+      sd->saved_offset = offset;
+      offset += sd->signed_descriptor_len + sd->annotations_len;
+    } SMARTLIST_FOREACH_END(sd);
+    store->journal_len = (size_t) offset;
+  }
+
+  SMARTLIST_FOREACH(chunks, sized_chunk_t *, c, tor_free(c));
+  smartlist_free(chunks);
+  smartlist_free(journaled);
+  smartlist_free(signed_descriptors);
+  tor_free(fname);
+  return r;
+}
+
+/** Give every descriptor in <b>store</b> that is saved in its current
+ * store file, but that we won't find in the new store file a background
+ * thread just wrote, a copy of its body, so that it doesn't point into the
+ * old mapping once we unmap it.  The new file holds the descriptors in
+ * store-\>rebuild_ents, except for those we've since marked do_not_cache.
+ */
+static void
+desc_store_copy_unrelocated_bodies(desc_store_t *store)
+{
+  smartlist_t *signed_descriptors = desc_store_list_descriptors(store);
+  digestmap_t *relocated = digestmap_new();
+  int i;
+
+  for (i = 0; i < store->n_rebuild_ents; ++i)
+    digestmap_set(relocated, store->rebuild_ents[i].digest, (void*)1);
+
+  SMARTLIST_FOREACH_BEGIN(signed_descriptors, signed_descriptor_t *, sd) {
+    size_t len;
+    char *body;
+    if (sd->saved_location != SAVED_IN_CACHE)
+      continue;
+    if (!sd->do_not_cache &&
+        digestmap_get(relocated, sd->signed_descriptor_digest))
+      continue;
+    len = sd->signed_descriptor_len + sd->annotations_len;
+    body = tor_malloc(len+1);
+    memcpy(body, signed_descriptor_get_body_impl(sd, 1), len);
+    body[len] = '\0';
+    tor_free(sd->signed_descriptor_body);
+    sd->signed_descriptor_body = body;
+    sd->saved_location = SAVED_NOWHERE;
+  } SMARTLIST_FOREACH_END(sd);
+
+  digestmap_free(relocated, NULL);
+  smartlist_free(signed_descriptors);
+}
+
+/** If a thread has finished writing a new store file for <b>store</b>,
+ * switch to the new file, point every descriptor it holds at its new
+ * location, and drop those descriptors from the journal.  Return 1 if we
+ * switched, 0 if there was nothing to do yet, and -1 on failure. */
+static int
+desc_store_finish_rebuild(desc_store_t *store)
+{
+  char *fname = NULL, *fname_rebuild = NULL;
+  tor_mmap_t *old_mmap;
+  int i, r;
+
+  if (!store->rebuild_write)
+    return 0;
+  r = bg_file_write_poll(store->rebuild_write);
+  if (r == 0)
+    return 0;
+  bg_file_write_free(store->rebuild_write);
+  store->rebuild_write = NULL;
+  if (store->rebuild_cancelled) {
+    store->rebuild_cancelled = 0;
+    return 0;
+  }
+
+  fname = get_datadir_fname(store->fname_base);
+  fname_rebuild = get_datadir_fname_suffix(store->fname_base, ".rebuild");
+  if (r < 0) {
+    log_warn(LD_FS, "Error writing router store to disk.");
+    goto err;
+  }
+  if (replace_file(fname_rebuild, fname)<0) {
+    log_warn(LD_FS, "Error replacing old router store: %s", strerror(errno));
+    goto err;
+  }
+
+  /* This needs the old mapping, so do it before we switch. */
+  desc_store_copy_unrelocated_bodies(store);
+
+  old_mmap = store->mmap;
+  store->mmap = tor_mmap_file(fname);
+  if (!store->mmap && store->rebuild_len) {
+    /* Keep using the old mapping: it stays valid. */
+    log_warn(LD_FS, "Unable to mmap new descriptor file at '%s'.",fname);
+    store->mmap = old_mmap;
+    goto err;
+  }
+
+  for (i = 0; i < store->n_rebuild_ents; ++i) {
+    const char *digest = store->rebuild_ents[i].digest;
+    signed_descriptor_t *sd;
+    if (store->type == EXTRAINFO_STORE) {
+      extrainfo_t *ei = eimap_get(routerlist->extra_info_map, digest);
+      sd = ei ? &ei->cache_info : NULL;
+    } else {
+      sd = sdmap_get(routerlist->desc_digest_map, digest);
+    }
+    if (!sd || sd->do_not_cache)
+      continue; /* We dropped it in the meantime. */
+    sd->saved_location = SAVED_IN_CACHE;
+    tor_free(sd->signed_descriptor_body); // sets it to null
+    sd->saved_offset = store->rebuild_ents[i].offset;
+    signed_descriptor_get_body(sd); /* reconstruct and assert */
+  }
+  if (old_mmap)
+    tor_munmap_file(old_mmap);
+  tor_free(store->rebuild_ents);
+  store->n_rebuild_ents = 0;
+  store->store_len = store->rebuild_len;
+  store->bytes_dropped = 0;
+
+  /* Anything that arrived while the thread was writing is still only in
+   * the journal. */
+  if (desc_store_rewrite_journal(store) < 0)
+    log_warn(LD_FS, "Unable to rewrite %s journal.", store->description);
+
+  log_info(LD_DIR, "Done rebuilding %s cache in the background",
+           store->description);
+  tor_free(fname);
+  tor_free(fname_rebuild);
+  return 1;
+ err:
+  tor_free(store->rebuild_ents);
+  store->n_rebuild_ents = 0;
+  tor_free(fname);
+  tor_free(fname_rebuild);
+  return -1;
+}
+
+/** Switch to any store files that background threads have finished
+ * rebuilding.  Called once a second. */
+void
+router_finish_store_rebuilds(void)
+{
+  if (!routerlist)
+    return;
+  desc_store_finish_rebuild(&routerlist->desc_store);
+  desc_store_finish_rebuild(&routerlist->extrainfo_store);
+}
+
 /** If the journal of <b>store</b> is too long, or if RRS_FORCE is set in
  * <b>flags</b>, then atomically replace the saved router store with the
  * routers currently in our routerlist, and clear the journal.  Unless
  * RRS_DONT_REMOVE_OLD is set in <b>flags</b>, delete expired routers before
- * rebuilding the store.  Return 0 on success, -1 on failure.
+ * rebuilding the store.  Unless RRS_FORCE is set, let a background thread
+ * write the new store if we can.  Return 0 on success, -1 on failure.
  */
 static int
 router_rebuild_store(int flags, desc_store_t *store)
@@ -674,6 +952,14 @@ router_rebuild_store(int flags, desc_store_t *store)
   int had_any;
   int force = flags & RRS_FORCE;
 
+  if (store->rebuild_write && !store->rebuild_cancelled) {
+    if (!force) {
+      r = 0; /* We're already rebuilding it. */
+      goto done;
+    }
+    desc_store_cancel_rebuild(store);
+  }
+
   if (!force && !router_should_rebuild_store(store)) {
     r = 0;
     goto done;
@@ -701,24 +987,7 @@ router_rebuild_store(int flags, desc_store_t *store)
   chunk_list = smartlist_new();
 
   /* We sort the routers by age to enhance locality on disk. */
-  signed_descriptors = smartlist_new();
-  if (store->type == EXTRAINFO_STORE) {
-    eimap_iter_t *iter;
-    for (iter = eimap_iter_init(routerlist->extra_info_map);
-         !eimap_iter_done(iter);
-         iter = eimap_iter_next(routerlist->extra_info_map, iter)) {
-      const char *key;
-      extrainfo_t *ei;
-      eimap_iter_get(iter, &key, &ei);
-      smartlist_add(signed_descriptors, &ei->cache_info);
-    }
-  } else {
-    SMARTLIST_FOREACH(routerlist->old_routers, signed_descriptor_t *, sd,
-                      smartlist_add(signed_descriptors, sd));
-    SMARTLIST_FOREACH(routerlist->routers, routerinfo_t *, ri,
-                      smartlist_add(signed_descriptors, &ri->cache_info));
-  }
-
+  signed_descriptors = desc_store_list_descriptors(store);
   smartlist_sort(signed_descriptors, _compare_signed_descriptors_by_age);
 
   /* Now, add the appropriate members to chunk_list */
@@ -741,6 +1010,14 @@ router_rebuild_store(int flags, desc_store_t *store)
       smartlist_add(chunk_list, c);
     });
 
+  if (!force &&
+      desc_store_start_background_rebuild(store, signed_descriptors,
+                                          chunk_list,
+                                          total_expected_len) == 0) {
+    r = 0;
+    goto done;
+  }
+
   if (write_chunks_to_file(fname_tmp, chunk_list, 1)<0) {
     log_warn(LD_FS, "Error writing router store to disk.");
     goto done;
@@ -828,6 +1105,7 @@ router_reload_router_list_impl(desc_store_t *store)
   if (store->fname_alt_base)
     altname = get_datadir_fname(store->fname_alt_base);
 
+  desc_store_cancel_rebuild(store);
   if (store->mmap) /* get rid of it first */
     tor_munmap_file(store->mmap);
   store->mmap = NULL;
@@ -1099,10 +1377,10 @@ router_pick_directory_server_impl(dirinfo_type_t type, int flags)
 
   direct = smartlist_new();
   tunnel = smartlist_new();
-  trusted_direct = smartlist_new();
-  trusted_tunnel = smartlist_new();
-  overloaded_direct = smartlist_new();
-  overloaded_tunnel = smartlist_new();
+  trusted_direct = smartlist_new_small();
+  trusted_tunnel = smartlist_new_small();
+  overloaded_direct = smartlist_new_small();
+  overloaded_tunnel = smartlist_new_small();
 
   /* Find all the running dirservers we know about. */
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
@@ -1360,6 +1638,136 @@ addrs_in_same_network_family(const tor_addr_t *a1,
   return 0 == tor_addr_compare_masked(a1, a2, 16, CMP_SEMANTIC);
 }
 
+/** Incremented by router_dir_info_changed(), so that we can tell when the
+ * family information we have cached may be stale. */
+static unsigned int family_cache_dir_generation = 1;
+/** The values of family_cache_dir_generation and the nodelist generation
+ * when we last emptied our family caches. */
+static unsigned int family_cache_built_dir_generation = 0;
+static unsigned int family_cache_built_nodelist_generation = 0;
+/** Map from the identity of each node we've looked at to a smartlist of
+ * the node_t for every node that it declares to be in its family and that
+ * declares it right back.  Emptied whenever our directory info changes. */
+static digestmap_t *mutual_family_map = NULL;
+/** Every node with an IPv4 address, sorted by the /16 it is in, or NULL if
+ * we haven't built the list since our directory info last changed. */
+static smartlist_t *nodes_by_subnet = NULL;
+
+/** Helper for emptying mutual_family_map. */
+static void
+mutual_family_list_free_(void *sl)
+{
+  smartlist_free(sl);
+}
+
+/** Discard our cached family information. */
+static void
+family_cache_clear(void)
+{
+  if (mutual_family_map) {
+    digestmap_free(mutual_family_map, mutual_family_list_free_);
+    mutual_family_map = NULL;
+  }
+  smartlist_free(nodes_by_subnet);
+  nodes_by_subnet = NULL;
+}
+
+/** Discard our cached family information if our directory info or the
+ * nodelist has changed since we built it. */
+static void
+family_cache_check(void)
+{
+  if (family_cache_built_dir_generation != family_cache_dir_generation ||
+      family_cache_built_nodelist_generation != nodelist_get_generation()) {
+    family_cache_clear();
+    family_cache_built_dir_generation = family_cache_dir_generation;
+    family_cache_built_nodelist_generation = nodelist_get_generation();
+  }
+}
+
+/** Return the /16 that nodes_by_subnet sorts <b>node</b> by, or -1 if it
+ * has no IPv4 address. */
+static INLINE int
+node_get_ipv4_subnet(const node_t *node)
+{
+  tor_addr_t a;
+  node_get_addr(node, &a);
+  if (tor_addr_family(&a) != AF_INET)
+    return -1;
+  return (int)(tor_addr_to_ipv4h(&a) >> 16);
+}
+
+/** Helper for sorting nodes_by_subnet. */
+static int
+compare_nodes_by_subnet_(const void **a, const void **b)
+{
+  int sa = node_get_ipv4_subnet(*a), sb = node_get_ipv4_subnet(*b);
+  if (sa < sb)
+    return -1;
+  else if (sa > sb)
+    return 1;
+  else
+    return 0;
+}
+
+/** Add to <b>sl</b> every node whose IPv4 address is in the /16
+ * <b>subnet</b>. */
+static void
+nodelist_add_nodes_in_subnet(smartlist_t *sl, int subnet)
+{
+  int lo, hi;
+  if (!nodes_by_subnet) {
+    nodes_by_subnet = smartlist_new();
+    SMARTLIST_FOREACH(nodelist_get_list(), node_t *, node,
+                      if (node_get_ipv4_subnet(node) >= 0)
+                        smartlist_add(nodes_by_subnet, node));
+    smartlist_sort(nodes_by_subnet, compare_nodes_by_subnet_);
+  }
+
+  /* Find the first node in the subnet, if there is one. */
+  lo = 0;
+  hi = smartlist_len(nodes_by_subnet);
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (node_get_ipv4_subnet(smartlist_get(nodes_by_subnet, mid)) < subnet)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for ( ; lo < smartlist_len(nodes_by_subnet); ++lo) {
+    node_t *node2 = smartlist_get(nodes_by_subnet, lo);
+    if (node_get_ipv4_subnet(node2) != subnet)
+      break;
+    smartlist_add(sl, node2);
+  }
+}
+
+/** Add to <b>sl</b> every node that <b>node</b> declares to be in its
+ * family, and that declares <b>node</b> to be in its family too. */
+static void
+node_add_mutual_family(smartlist_t *sl, const node_t *node)
+{
+  const smartlist_t *declared_family = node_get_declared_family(node);
+  if (!declared_family)
+    return;
+  /* Add every r such that router declares familyness with node, and node
+   * declares familyhood with router. */
+  SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
+    const node_t *node2;
+    const smartlist_t *family2;
+    if (!(node2 = node_get_by_nickname(name, 0)))
+      continue;
+    if (!(family2 = node_get_declared_family(node2)))
+      continue;
+    SMARTLIST_FOREACH_BEGIN(family2, const char *, name2) {
+        if (node_nickname_matches(node, name2)) {
+          smartlist_add(sl, (void*)node2);
+          break;
+        }
+    } SMARTLIST_FOREACH_END(name2);
+  } SMARTLIST_FOREACH_END(name);
+}
+
 /**
  * Add all the family of <b>node</b>, including <b>node</b> itself, to
  * the smartlist <b>sl</b>.
@@ -1373,53 +1781,53 @@ void
 nodelist_add_node_and_family(smartlist_t *sl, const node_t *node)
 {
   /* XXXX MOVE */
-  const smartlist_t *all_nodes = nodelist_get_list();
-  const smartlist_t *declared_family;
   const or_options_t *options = get_options();
+  const node_t *real_node;
 
   tor_assert(node);
 
-  declared_family = node_get_declared_family(node);
+  family_cache_check();
 
   /* Let's make sure that we have the node itself, if it's a real node. */
-  {
-    const node_t *real_node = node_get_by_id(node->identity);
-    if (real_node)
-      smartlist_add(sl, (node_t*)real_node);
-  }
+  real_node = node_get_by_id(node->identity);
+  if (real_node)
+    smartlist_add(sl, (node_t*)real_node);
 
   /* First, add any nodes with similar network addresses. */
   if (options->EnforceDistinctSubnets) {
-    tor_addr_t node_addr;
-    node_get_addr(node, &node_addr);
-
-    SMARTLIST_FOREACH_BEGIN(all_nodes, const node_t *, node2) {
-      tor_addr_t a;
-      node_get_addr(node2, &a);
-      if (addrs_in_same_network_family(&a, &node_addr))
-        smartlist_add(sl, (void*)node2);
-    } SMARTLIST_FOREACH_END(node2);
+    int subnet = node_get_ipv4_subnet(node);
+    if (subnet >= 0) {
+      nodelist_add_nodes_in_subnet(sl, subnet);
+    } else {
+      tor_addr_t node_addr;
+      node_get_addr(node, &node_addr);
+      SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node2) {
+        tor_addr_t a;
+        node_get_addr(node2, &a);
+        if (addrs_in_same_network_family(&a, &node_addr))
+          smartlist_add(sl, (void*)node2);
+      } SMARTLIST_FOREACH_END(node2);
+    }
   }
 
   /* Now, add all nodes in the declared_family of this node, if they
-   * also declare this node to be in their family. */
-  if (declared_family) {
-    /* Add every r such that router declares familyness with node, and node
-     * declares familyhood with router. */
-    SMARTLIST_FOREACH_BEGIN(declared_family, const char *, name) {
-      const node_t *node2;
-      const smartlist_t *family2;
-      if (!(node2 = node_get_by_nickname(name, 0)))
-        continue;
-      if (!(family2 = node_get_declared_family(node2)))
-        continue;
-      SMARTLIST_FOREACH_BEGIN(family2, const char *, name2) {
-          if (node_nickname_matches(node, name2)) {
-            smartlist_add(sl, (void*)node2);
-            break;
-          }
-      } SMARTLIST_FOREACH_END(name2);
-    } SMARTLIST_FOREACH_END(name);
+   * also declare this node to be in their family.  For a real node, we
+   * remember the answer until our directory info changes; a routerinfo
+   * that isn't in the nodelist might not declare the same family as the
+   * node that is. */
+  if (real_node == node) {
+    smartlist_t *family;
+    if (!mutual_family_map)
+      mutual_family_map = digestmap_new();
+    family = digestmap_get(mutual_family_map, node->identity);
+    if (!family) {
+      family = smartlist_new();
+      node_add_mutual_family(family, node);
+      digestmap_set(mutual_family_map, node->identity, family);
+    }
+    smartlist_add_all(sl, family);
+  } else {
+    node_add_mutual_family(sl, node);
   }
 
   /* If the user declared any families locally, honor those too. */
@@ -1538,6 +1946,8 @@ router_add_running_nodes_to_smartlist(smartlist_t *sl, int allow_invalid,
                                       int need_uptime, int need_capacity,
                                       int need_guard, int need_desc)
 { /* XXXX MOVE */
+  /* Most nodes are usually running; make room for them all at once. */
+  smartlist_reserve(sl, smartlist_len(nodelist_get_list()));
   SMARTLIST_FOREACH_BEGIN(nodelist_get_list(), const node_t *, node) {
     if (!node->is_running ||
         (!node->is_valid && !allow_invalid))
@@ -1677,6 +2087,136 @@ kb_to_bytes(uint32_t bw)
   return (bw > (INT32_MAX/1000)) ? INT32_MAX : bw*1000;
 }
 
+/** The number of distinct bandwidth_weight_rule_t values. */
+#define N_BW_WEIGHT_RULES (WEIGHT_FOR_DIR+1)
+
+/** The bandwidth weights that smartlist_choose_node_by_bandwidth_weights()
+ * uses for one bandwidth_weight_rule_t, already divided by the weight
+ * scale. */
+typedef struct bw_weights_t {
+  /** The consensus and nodelist generation for which we computed these
+   * weights.  (A generation of 0 means we haven't computed them.) */
+  const networkstatus_t *consensus;
+  unsigned generation;
+  /** False if the consensus gave us negative weights. */
+  int ok;
+  double Wg, Wm, We, Wd; /**< Weights for guard, middle, exit, and both. */
+  double Wgb, Wmb, Web, Wdb; /**< Extra weights for directory caches. */
+} bw_weights_t;
+
+/** Bandwidth weights for each rule, recomputed when the nodelist (and so
+ * the consensus) changes. */
+static bw_weights_t cached_bw_weights[N_BW_WEIGHT_RULES];
+
+/** Scratch space for smartlist_choose_node_by_bandwidth_weights(): the
+ * running total of each candidate's weighted bandwidth. */
+static double *cumulative_bw = NULL;
+/** Number of elements allocated in cumulative_bw. */
+static int cumulative_bw_len = 0;
+
+/** Return the bandwidth weights to use when choosing a node for
+ * <b>rule</b> from the current consensus. */
+static const bw_weights_t *
+get_bw_weights_for_rule(bandwidth_weight_rule_t rule)
+{
+  bw_weights_t *w = &cached_bw_weights[rule];
+  int64_t weight_scale;
+  double Wg = -1, Wm = -1, We = -1, Wd = -1;
+  double Wgb = -1, Wmb = -1, Web = -1, Wdb = -1;
+
+  if (w->generation == nodelist_get_generation() &&
+      w->consensus == networkstatus_get_latest_consensus())
+    return w;
+  w->generation = nodelist_get_generation();
+  w->consensus = networkstatus_get_latest_consensus();
+
+  weight_scale = circuit_build_times_get_bw_scale(NULL);
+
+  if (rule == WEIGHT_FOR_GUARD) {
+    Wg = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WGG, -1);
+    Wm = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WGM, -1); /* Bridges */
+    We = 0;
+    Wd = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WGD, -1);
+
+    Wgb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WGB, -1);
+    Wmb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WMB, -1);
+    Web = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WEB, -1);
+    Wdb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WDB, -1);
+  } else if (rule == WEIGHT_FOR_MID) {
+    Wg = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WMG, -1);
+    Wm = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WMM, -1);
+    We = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WME, -1);
+    Wd = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WMD, -1);
+
+    Wgb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WGB, -1);
+    Wmb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WMB, -1);
+    Web = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WEB, -1);
+    Wdb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WDB, -1);
+  } else if (rule == WEIGHT_FOR_EXIT) {
+    // Guards CAN be exits if they have weird exit policies
+    // They are d then I guess...
+    We = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WEE, -1);
+    /* Odd exit policies */
+    Wm = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WEM, -1);
+    Wd = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WED, -1);
+    /* Odd exit policies */
+    Wg = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WEG, -1);
+
+    Wgb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WGB, -1);
+    Wmb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WMB, -1);
+    Web = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WEB, -1);
+    Wdb = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WDB, -1);
+  } else if (rule == WEIGHT_FOR_DIR) {
+    We = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WBE, -1);
+    Wm = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WBM, -1);
+    Wd = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WBD, -1);
+    Wg = networkstatus_get_bw_weight(NULL, BW_WEIGHT_WBG, -1);
+
+    Wgb = Wmb = Web = Wdb = weight_scale;
+  } else if (rule == NO_WEIGHTING) {
+    Wg = Wm = We = Wd = weight_scale;
+    Wgb = Wmb = Web = Wdb = weight_scale;
+  }
+
+  if (Wg < 0 || Wm < 0 || We < 0 || Wd < 0 || Wgb < 0 || Wmb < 0 || Wdb < 0
+      || Web < 0) {
+    w->ok = 0;
+    return w;
+  }
+
+  Wg /= weight_scale;
+  Wm /= weight_scale;
+  We /= weight_scale;
+  Wd /= weight_scale;
+
+  Wgb /= weight_scale;
+  Wmb /= weight_scale;
+  Web /= weight_scale;
+  Wdb /= weight_scale;
+
+  w->Wg = Wg; w->Wm = Wm; w->We = We; w->Wd = Wd;
+  w->Wgb = Wgb; w->Wmb = Wmb; w->Web = Web; w->Wdb = Wdb;
+  w->ok = 1;
+  return w;
+}
+
+/** Given the <b>n</b> nondecreasing running totals in <b>cumulative</b>,
+ * return the index of the first one that is at least <b>target</b>, or
+ * <b>n</b> if none is. */
+int
+find_cumulative_bw_index(const double *cumulative, int n, double target)
+{
+  int lo = 0, hi = n;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (cumulative[mid] >= target)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo;
+}
+
 /** Helper function:
  * choose a random element of smartlist <b>sl</b> of nodes, weighted by
  * the advertised bandwidth of each element using the consensus
@@ -1695,14 +2235,12 @@ static const node_t *
 smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
                                            bandwidth_weight_rule_t rule)
 {
-  int64_t weight_scale;
+  const bw_weights_t *w;
   int64_t rand_bw;
-  double Wg = -1, Wm = -1, We = -1, Wd = -1;
-  double Wgb = -1, Wmb = -1, Web = -1, Wdb = -1;
+  double Wg, Wm, We, Wd;
+  double Wgb, Wmb, Web, Wdb;
   double weighted_bw = 0, unweighted_bw = 0;
-  double *bandwidths;
-  double tmp = 0;
-  unsigned int i;
+  int i, n = smartlist_len(sl);
   int have_unknown = 0; /* true iff sl contains element not in consensus. */
 
   /* Can't choose exit and guard at same time */
@@ -1720,71 +2258,21 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
     return NULL;
   }
 
-  weight_scale = circuit_build_times_get_bw_scale(NULL);
-
-  if (rule == WEIGHT_FOR_GUARD) {
-    Wg = networkstatus_get_bw_weight(NULL, "Wgg", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wgm", -1); /* Bridges */
-    We = 0;
-    Wd = networkstatus_get_bw_weight(NULL, "Wgd", -1);
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_MID) {
-    Wg = networkstatus_get_bw_weight(NULL, "Wmg", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wmm", -1);
-    We = networkstatus_get_bw_weight(NULL, "Wme", -1);
-    Wd = networkstatus_get_bw_weight(NULL, "Wmd", -1);
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_EXIT) {
-    // Guards CAN be exits if they have weird exit policies
-    // They are d then I guess...
-    We = networkstatus_get_bw_weight(NULL, "Wee", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wem", -1); /* Odd exit policies */
-    Wd = networkstatus_get_bw_weight(NULL, "Wed", -1);
-    Wg = networkstatus_get_bw_weight(NULL, "Weg", -1); /* Odd exit policies */
-
-    Wgb = networkstatus_get_bw_weight(NULL, "Wgb", -1);
-    Wmb = networkstatus_get_bw_weight(NULL, "Wmb", -1);
-    Web = networkstatus_get_bw_weight(NULL, "Web", -1);
-    Wdb = networkstatus_get_bw_weight(NULL, "Wdb", -1);
-  } else if (rule == WEIGHT_FOR_DIR) {
-    We = networkstatus_get_bw_weight(NULL, "Wbe", -1);
-    Wm = networkstatus_get_bw_weight(NULL, "Wbm", -1);
-    Wd = networkstatus_get_bw_weight(NULL, "Wbd", -1);
-    Wg = networkstatus_get_bw_weight(NULL, "Wbg", -1);
-
-    Wgb = Wmb = Web = Wdb = weight_scale;
-  } else if (rule == NO_WEIGHTING) {
-    Wg = Wm = We = Wd = weight_scale;
-    Wgb = Wmb = Web = Wdb = weight_scale;
-  }
-
-  if (Wg < 0 || Wm < 0 || We < 0 || Wd < 0 || Wgb < 0 || Wmb < 0 || Wdb < 0
-      || Web < 0) {
+  w = get_bw_weights_for_rule(rule);
+  if (!w->ok) {
     log_debug(LD_CIRC,
               "Got negative bandwidth weights. Defaulting to old selection"
               " algorithm.");
     return NULL; // Use old algorithm.
   }
+  Wg = w->Wg; Wm = w->Wm; We = w->We; Wd = w->Wd;
+  Wgb = w->Wgb; Wmb = w->Wmb; Web = w->Web; Wdb = w->Wdb;
 
-  Wg /= weight_scale;
-  Wm /= weight_scale;
-  We /= weight_scale;
-  Wd /= weight_scale;
-
-  Wgb /= weight_scale;
-  Wmb /= weight_scale;
-  Web /= weight_scale;
-  Wdb /= weight_scale;
-
-  bandwidths = tor_malloc_zero(sizeof(double)*smartlist_len(sl));
+  if (n > cumulative_bw_len) {
+    cumulative_bw_len = MAX(n, cumulative_bw_len*2);
+    cumulative_bw = tor_realloc(cumulative_bw,
+                                sizeof(double)*cumulative_bw_len);
+  }
 
   // Cycle through smartlist and total the bandwidth.
   SMARTLIST_FOREACH_BEGIN(sl, const node_t *, node) {
@@ -1795,7 +2283,6 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
     is_dir = node_is_dir(node);
     if (node->rs) {
       if (!node->rs->has_bandwidth) {
-        tor_free(bandwidths);
         /* This should never happen, unless all the authorites downgrade
          * to 0.2.0 or rogue routerstatuses get inserted into our consensus. */
         log_warn(LD_BUG,
@@ -1810,6 +2297,7 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
       have_unknown = 1;
     } else {
       /* We can't use this one. */
+      cumulative_bw[node_sl_idx] = weighted_bw;
       continue;
     }
     is_me = router_digest_is_me(node->identity);
@@ -1824,8 +2312,8 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
       weight = (is_dir ? Wmb*Wm : Wm);
     }
 
-    bandwidths[node_sl_idx] = weight*this_bw;
     weighted_bw += weight*this_bw;
+    cumulative_bw[node_sl_idx] = weighted_bw;
     unweighted_bw += this_bw;
     if (is_me)
       sl_last_weighted_bw_of_me = weight*this_bw;
@@ -1856,7 +2344,6 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
                  unweighted_bw, msg);
       }
     }
-    tor_free(bandwidths);
     return smartlist_choose(sl);
   }
 
@@ -1864,25 +2351,20 @@ smartlist_choose_node_by_bandwidth_weights(smartlist_t *sl,
   rand_bw++; /* crypto_rand_uint64() counts from 0, and we need to count
               * from 1 below. See bug 1203 for details. */
 
-  /* Last, count through sl until we get to the element we picked */
-  tmp = 0.0;
-  for (i=0; i < (unsigned)smartlist_len(sl); i++) {
-    tmp += bandwidths[i];
-    if (tmp >= rand_bw)
-      break;
-  }
+  /* Last, find the first element of sl whose running total reaches the
+   * value we picked. */
+  i = find_cumulative_bw_index(cumulative_bw, n, (double)rand_bw);
 
-  if (i == (unsigned)smartlist_len(sl)) {
+  if (i == n) {
     /* This was once possible due to round-off error, but shouldn't be able
      * to occur any longer. */
     tor_fragile_assert();
     --i;
     log_warn(LD_BUG, "Round-off error in computing bandwidth had an effect on "
              " which router we chose. Please tell the developers. "
-             "%f " U64_FORMAT " %f", tmp, U64_PRINTF_ARG(rand_bw),
-             weighted_bw);
+             "%f " U64_FORMAT " %f", cumulative_bw[i],
+             U64_PRINTF_ARG(rand_bw), weighted_bw);
   }
-  tor_free(bandwidths);
   return smartlist_get(sl, i);
 }
 
@@ -2180,7 +2662,7 @@ router_choose_random_node(smartlist_t *excludedsmartlist,
   const int need_desc = (flags & CRN_NEED_DESC) != 0;
 
   smartlist_t *sl=smartlist_new(),
-    *excludednodes=smartlist_new();
+    *excludednodes=smartlist_new_small();
   const node_t *choice = NULL;
   const routerinfo_t *r;
   bandwidth_weight_rule_t rule;
@@ -2695,18 +3177,19 @@ routerinfo_free(routerinfo_t *router)
 
   tor_free(router->cache_info.signed_descriptor_body);
   tor_free(router->address);
-  tor_free(router->nickname);
-  tor_free(router->platform);
-  tor_free(router->contact_info);
+  string_intern_release(router->nickname);
+  string_intern_release(router->platform);
+  string_intern_release(router->contact_info);
   if (router->onion_pkey)
     crypto_pk_free(router->onion_pkey);
   if (router->identity_pkey)
     crypto_pk_free(router->identity_pkey);
   if (router->declared_family) {
-    SMARTLIST_FOREACH(router->declared_family, char *, s, tor_free(s));
+    SMARTLIST_FOREACH(router->declared_family, const char *, s,
+                      string_intern_release(s));
     smartlist_free(router->declared_family);
   }
-  addr_policy_list_free(router->exit_policy);
+  addr_policy_list_release(router->exit_policy);
 
   memset(router, 77, sizeof(routerinfo_t));
 
@@ -2782,6 +3265,11 @@ routerlist_free(routerlist_t *rl)
     tor_munmap_file(routerlist->desc_store.mmap);
   if (routerlist->extrainfo_store.mmap)
     tor_munmap_file(routerlist->extrainfo_store.mmap);
+  /* If threads are still writing stores, let them finish on their own. */
+  bg_file_write_free(rl->desc_store.rebuild_write);
+  tor_free(rl->desc_store.rebuild_ents);
+  bg_file_write_free(rl->extrainfo_store.rebuild_write);
+  tor_free(rl->extrainfo_store.rebuild_ents);
   tor_free(rl);
 
   router_dir_info_changed();
@@ -3206,6 +3694,10 @@ routerlist_free_all(void)
 {
   routerlist_free(routerlist);
   routerlist = NULL;
+  tor_free(cumulative_bw);
+  cumulative_bw_len = 0;
+  memset(cached_bw_weights, 0, sizeof(cached_bw_weights));
+  family_cache_clear();
   if (warned_nicknames) {
     SMARTLIST_FOREACH(warned_nicknames, char *, cp, tor_free(cp));
     smartlist_free(warned_nicknames);
@@ -4073,6 +4565,7 @@ router_exit_policy_all_nodes_reject(const tor_addr_t *addr, uint16_t port,
 int
 router_exit_policy_rejects_all(const routerinfo_t *router)
 {
+  router_parse_exit_policy_if_needed(router);
   return router->policy_is_reject_star;
 }
 
@@ -4212,7 +4705,7 @@ list_pending_downloads(digestmap_t *result,
 {
   const size_t p_len = strlen(prefix);
   smartlist_t *tmp = smartlist_new();
-  smartlist_t *conns = get_connection_array();
+  smartlist_t *conns = get_connection_array_by_type(CONN_TYPE_DIR);
   int flags = DSR_HEX;
   if (purpose == DIR_PURPOSE_FETCH_MICRODESC)
     flags = DSR_DIGEST256|DSR_BASE64;
@@ -4220,8 +4713,7 @@ list_pending_downloads(digestmap_t *result,
   tor_assert(result);
 
   SMARTLIST_FOREACH_BEGIN(conns, connection_t *, conn) {
-    if (conn->type == CONN_TYPE_DIR &&
-        conn->purpose == purpose &&
+    if (conn->purpose == purpose &&
         !conn->marked_for_close) {
       const char *resource = TO_DIR_CONN(conn)->requested_resource;
       if (!strcmpstart(resource, prefix))
@@ -4371,6 +4863,103 @@ client_would_use_router(const routerstatus_t *rs, time_t now,
 /** When directory clients have only a few servers to request, they batch
  * them until they have more, or until this amount of time has passed. */
 #define MAX_CLIENT_INTERVAL_WITHOUT_REQUEST (10*60)
+/** Never send more than this many descriptor requests to one mirror in a
+ * single round of downloads. */
+#define MAX_DL_REQUESTS_PER_MIRROR 4
+/** Weight of each new sample in descriptor_request_time_estimate. */
+#define DL_REQUEST_TIME_ALPHA 0.25
+
+/** Moving average of how many seconds our recent successful descriptor
+ * requests to mirrors took, from launch until the answer was complete. */
+static double descriptor_request_time_estimate = 0.0;
+
+/** Note that a descriptor request that we launched <b>elapsed</b> seconds
+ * ago has just been answered. */
+void
+router_note_descriptor_request_time(time_t elapsed)
+{
+  if (elapsed < 0)
+    elapsed = 0;
+  descriptor_request_time_estimate +=
+    DL_REQUEST_TIME_ALPHA *
+    ((double)elapsed - descriptor_request_time_estimate);
+}
+
+/** Return how many of our <b>n_requests</b> descriptor requests to send to
+ * each mirror.  Every request to a new mirror may need a new one-hop tunnel,
+ * which costs several round trips before the request is even sent; the
+ * slower our requests have been, the more those round trips dominate, so
+ * the more requests we have share each tunnel.  We still use MIN_REQUESTS
+ * different mirrors if we can. */
+int
+descriptor_requests_per_mirror(int n_requests)
+{
+  int per_mirror = 1 + (int)(descriptor_request_time_estimate / 2);
+  if (per_mirror > MAX_DL_REQUESTS_PER_MIRROR)
+    per_mirror = MAX_DL_REQUESTS_PER_MIRROR;
+  if (per_mirror > CEIL_DIV(n_requests, MIN_REQUESTS))
+    per_mirror = CEIL_DIV(n_requests, MIN_REQUESTS);
+  return per_mirror < 1 ? 1 : per_mirror;
+}
+
+/** Return true iff we want the descriptor for <b>rs</b> sooner than most:
+ * because it's one of our entry guards or entry nodes, and so we can't
+ * build circuits without it. */
+int
+routerstatus_download_is_urgent(const routerstatus_t *rs)
+{
+  const or_options_t *options = get_options();
+  const node_t *node;
+  if (is_an_entry_guard(rs->identity_digest))
+    return 1;
+  if (options->EntryNodes) {
+    /* Use the node's cached country if we have one, so that {cc} entries
+     * in EntryNodes match without a fresh GeoIP lookup for every digest. */
+    node = node_get_by_id(rs->identity_digest);
+    if (routerset_contains_routerstatus(options->EntryNodes, rs,
+                                        node ? node->country : -1))
+      return 1;
+  }
+  return 0;
+}
+
+/** Sort the descriptor digests in <b>downloadable</b>, putting those of
+ * urgent descriptors (see routerstatus_download_is_urgent()) first.  Use the
+ * latest consensus of the flavor that <b>purpose</b> fetches to find out
+ * whose descriptors they are.  Return the number of urgent ones. */
+static int
+sort_descriptor_downloads_by_urgency(int purpose, smartlist_t *downloadable)
+{
+  networkstatus_t *consensus;
+  smartlist_t *urgent;
+  int n_urgent;
+
+  consensus = networkstatus_get_latest_consensus_by_flavor(
+      purpose == DIR_PURPOSE_FETCH_MICRODESC ? FLAV_MICRODESC : FLAV_NS);
+  if (!consensus) {
+    smartlist_sort_digests(downloadable);
+    return 0;
+  }
+
+  urgent = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(downloadable, char *, d) {
+    const routerstatus_t *rs =
+      router_get_mutable_consensus_status_by_descriptor_digest(consensus, d);
+    if (rs && routerstatus_download_is_urgent(rs)) {
+      smartlist_add(urgent, d);
+      SMARTLIST_DEL_CURRENT(downloadable, d);
+    }
+  } SMARTLIST_FOREACH_END(d);
+
+  n_urgent = smartlist_len(urgent);
+  smartlist_sort_digests(urgent);
+  smartlist_sort_digests(downloadable);
+  smartlist_add_all(urgent, downloadable);
+  smartlist_clear(downloadable);
+  smartlist_add_all(downloadable, urgent);
+  smartlist_free(urgent);
+  return n_urgent;
+}
 
 /** Given a <b>purpose</b> (FETCH_MICRODESC or FETCH_SERVERDESC) and a list of
  * router descriptor digests or microdescriptor digest256s in
@@ -4383,7 +4972,7 @@ launch_descriptor_downloads(int purpose,
                             smartlist_t *downloadable,
                             const routerstatus_t *source, time_t now)
 {
-  int should_delay = 0, n_downloadable;
+  int should_delay = 0, n_downloadable, n_urgent = 0, n_fetch;
   const or_options_t *options = get_options();
   const char *descname;
 
@@ -4394,6 +4983,10 @@ launch_descriptor_downloads(int purpose,
     "routerdesc" : "microdesc";
 
   n_downloadable = smartlist_len(downloadable);
+  if (source)
+    smartlist_sort_digests(downloadable);
+  else
+    n_urgent = sort_descriptor_downloads_by_urgency(purpose, downloadable);
   if (!directory_fetches_dir_info_early(options)) {
     if (n_downloadable >= MAX_DL_TO_DELAY) {
       log_debug(LD_DIR,
@@ -4425,8 +5018,19 @@ launch_descriptor_downloads(int purpose,
    * not actually find them if the caches haven't got them yet. -NM
    */
 
-  if (! should_delay && n_downloadable) {
-    int i, n_per_request;
+  /* Even when we're waiting to collect a bigger batch, fetch the urgent
+   * descriptors now; the rest can wait. */
+  n_fetch = n_downloadable;
+  if (should_delay && n_urgent) {
+    log_info(LD_DIR, "We need %d %s%s for our entry guards. Downloading "
+             "just those.", n_urgent, descname, n_urgent > 1 ? "s" : "");
+    n_fetch = n_urgent;
+    should_delay = 0;
+  }
+
+  if (! should_delay && n_fetch) {
+    int i, j, end, n_per_request, n_requests, per_mirror = 1;
+    const routerstatus_t *mirror = NULL;
     const char *req_plural = "", *rtr_plural = "";
     int pds_flags = PDS_RETRY_IF_NO_SERVERS;
     if (! authdir_mode_any_nonhidserv(options)) {
@@ -4446,7 +5050,7 @@ launch_descriptor_downloads(int purpose,
         PDS_NO_EXISTING_SERVERDESC_FETCH;
     }
 
-    n_per_request = CEIL_DIV(n_downloadable, MIN_REQUESTS);
+    n_per_request = CEIL_DIV(n_fetch, MIN_REQUESTS);
     if (purpose == DIR_PURPOSE_FETCH_MICRODESC) {
       if (n_per_request > MAX_MICRODESC_DL_PER_REQUEST)
         n_per_request = MAX_MICRODESC_DL_PER_REQUEST;
@@ -4457,22 +5061,42 @@ launch_descriptor_downloads(int purpose,
     if (n_per_request < MIN_DL_PER_REQUEST)
       n_per_request = MIN_DL_PER_REQUEST;
 
-    if (n_downloadable > n_per_request)
+    if (n_fetch > n_per_request)
       req_plural = rtr_plural = "s";
-    else if (n_downloadable > 1)
+    else if (n_fetch > 1)
       rtr_plural = "s";
 
+    /* Urgent descriptors get requests of their own, so that slow bulk
+     * downloads don't hold them up. */
+    n_requests = CEIL_DIV(n_urgent, n_per_request) +
+      CEIL_DIV(n_fetch - n_urgent, n_per_request);
+    /* When we'd pick a random mirror for each request anyway, pick one for
+     * each group of requests instead, so they share its tunnel. */
+    if (!source && !options->UseBridges &&
+        !directory_fetches_from_authorities(options))
+      per_mirror = descriptor_requests_per_mirror(n_requests);
+
     log_info(LD_DIR,
-             "Launching %d request%s for %d router%s, %d at a time",
-             CEIL_DIV(n_downloadable, n_per_request),
-             req_plural, n_downloadable, rtr_plural, n_per_request);
-    smartlist_sort_digests(downloadable);
-    for (i=0; i < n_downloadable; i += n_per_request) {
-      initiate_descriptor_downloads(source, purpose,
-                                    downloadable, i, i+n_per_request,
+             "Launching %d request%s for %d router%s, %d at a time, "
+             "%d per mirror",
+             n_requests, req_plural, n_fetch, rtr_plural,
+             n_per_request, per_mirror);
+    for (i=0, j=0; i < n_fetch; i = end, ++j) {
+      end = i + n_per_request;
+      if (i < n_urgent && end > n_urgent)
+        end = n_urgent;
+      if (per_mirror > 1 && j % per_mirror == 0)
+        mirror = router_pick_directory_server(
+                     purpose == DIR_PURPOSE_FETCH_MICRODESC ?
+                     MICRODESC_DIRINFO : V3_DIRINFO, pds_flags);
+      initiate_descriptor_downloads(mirror ? mirror : source, purpose,
+                                    downloadable, i, end,
                                     pds_flags);
     }
-    last_descriptor_download_attempted = now;
+    /* An urgent-only fetch doesn't count: the batch we're collecting
+     * is still due when it would have been. */
+    if (n_fetch == n_downloadable)
+      last_descriptor_download_attempted = now;
   }
 }
 
@@ -4903,6 +5527,9 @@ router_dir_info_changed(void)
 {
   need_to_update_have_min_dir_info = 1;
   rend_hsdir_routers_changed();
+  entry_guards_note_usability_changed();
+  if (++family_cache_dir_generation == 0)
+    family_cache_dir_generation = 1;
 }
 
 /** Return a string describing what we're missing before we have enough
@@ -5137,6 +5764,9 @@ router_differences_are_cosmetic(const routerinfo_t *r1, const routerinfo_t *r2)
     r1 = ri_tmp;
   }
 
+  router_parse_exit_policy_if_needed(r1);
+  router_parse_exit_policy_if_needed(r2);
+
   /* If any key fields differ, they're different. */
   if (strcasecmp(r1->address, r2->address) ||
       strcasecmp(r1->nickname, r2->nickname) ||
@@ -5437,6 +6067,15 @@ struct routerset_t {
    * routerset_refresh_countries() whenever the geoip country list is
    * reloaded. */
   bitarray_t *countries;
+
+  /** Bit array mapping the nodelist_idx of each node that has a
+   * routerstatus to 1 iff that node is a member of this routerset.  It
+   * covers the first <b>n_node_bits</b> nodes, and is only valid while
+   * <b>node_bits_generation</b> is the current nodelist generation; 0 means
+   * it has never been built. */
+  bitarray_t *node_bits;
+  int n_node_bits;
+  unsigned int node_bits_generation;
 };
 
 /** Return a new empty routerset. */
@@ -5475,6 +6114,7 @@ routerset_refresh_countries(routerset_t *target)
 {
   int cc;
   bitarray_free(target->countries);
+  target->node_bits_generation = 0;
 
   if (!geoip_is_loaded()) {
     target->countries = NULL;
@@ -5544,6 +6184,7 @@ routerset_parse(routerset_t *target, const char *s, const char *description)
   } SMARTLIST_FOREACH_END(nick);
   smartlist_add_all(target->list, list);
   smartlist_free(list);
+  target->node_bits_generation = 0;
   if (added_countries)
     routerset_refresh_countries(target);
   return r;
@@ -5686,13 +6327,40 @@ routerset_contains_routerstatus(const routerset_t *set,
                             country);
 }
 
+/** Rebuild the node_bits of <b>set</b> for the current nodelist
+ * generation.  Only nodes with a routerstatus can use it: their membership
+ * can't change until the nodelist generation does. */
+static void
+routerset_compile_nodes(routerset_t *set)
+{
+  smartlist_t *nodes = nodelist_get_list();
+  bitarray_free(set->node_bits);
+  set->n_node_bits = smartlist_len(nodes);
+  set->node_bits = bitarray_init_zero(set->n_node_bits);
+  SMARTLIST_FOREACH_BEGIN(nodes, const node_t *, node) {
+    if (node->rs &&
+        routerset_contains_routerstatus(set, node->rs, node->country))
+      bitarray_set(set->node_bits, node_sl_idx);
+  } SMARTLIST_FOREACH_END(node);
+  set->node_bits_generation = nodelist_get_generation();
+}
+
 /** Return true iff <b>node</b> is in <b>set</b>. */
 int
 routerset_contains_node(const routerset_t *set, const node_t *node)
 {
-  if (node->rs)
+  if (!set || !set->list)
+    return 0;
+  if (node->rs) {
+    if (set->node_bits_generation != nodelist_get_generation()) {
+      /* The compiled form is a cache; building it doesn't change which
+       * nodes are in the set. */
+      routerset_compile_nodes((routerset_t *)set);
+    }
+    if (node->nodelist_idx >= 0 && node->nodelist_idx < set->n_node_bits)
+      return bitarray_is_set(set->node_bits, node->nodelist_idx) != 0;
     return routerset_contains_routerstatus(set, node->rs, node->country);
-  else if (node->ri)
+  } else if (node->ri)
     return routerset_contains_router(set, node->ri, node->country);
   else
     return 0;
@@ -5837,20 +6505,33 @@ routerset_free(routerset_t *routerset)
   strmap_free(routerset->names, NULL);
   digestmap_free(routerset->digests, NULL);
   bitarray_free(routerset->countries);
+  bitarray_free(routerset->node_bits);
   tor_free(routerset);
 }
 
 /** Refresh the country code of <b>ri</b>.  This function MUST be called on
- * each router when the GeoIP database is reloaded, and on all new routers. */
+ * each router when the GeoIP database is reloaded, and on all new routers.
+ * It's cheap when neither the node's address nor the GeoIP database has
+ * changed since the last call: then we keep the country we have. */
 void
 node_set_country(node_t *node)
 {
+  uint32_t addr;
   if (node->rs)
-    node->country = geoip_get_country_by_ip(node->rs->addr);
+    addr = node->rs->addr;
   else if (node->ri)
-    node->country = geoip_get_country_by_ip(node->ri->addr);
-  else
+    addr = node->ri->addr;
+  else {
     node->country = -1;
+    node->country_generation = 0;
+    return;
+  }
+  if (node->country_generation == geoip_db_generation() &&
+      node->country_addr == addr)
+    return;
+  node->country = geoip_get_country_by_ip(addr);
+  node->country_addr = addr;
+  node->country_generation = geoip_db_generation();
 }
 
 /** Set the country code of all routers in the routerlist. */
@@ -5860,6 +6541,42 @@ nodelist_refresh_countries(void) /* MOVE */
   smartlist_t *nodes = nodelist_get_list();
   SMARTLIST_FOREACH(nodes, node_t *, node,
                     node_set_country(node));
+  nodelist_note_changed();
+}
+
+/** Return the routerstatus entries in the consensus <b>c</b> that have the
+ * HSDir flag, sorted by identity digest.  We build the list the first time
+ * we need it for each consensus. */
+static smartlist_t *
+hid_serv_get_ring(networkstatus_t *c)
+{
+  if (!c->hs_dir_ring) {
+    c->hs_dir_ring = smartlist_new();
+    SMARTLIST_FOREACH(c->routerstatus_list, routerstatus_t *, rs,
+                      if (rs->is_hs_dir)
+                        smartlist_add(c->hs_dir_ring, rs));
+  }
+  return c->hs_dir_ring;
+}
+
+/** Add pointers to the routerstatus_t of each router in the consensus
+ * <b>c</b> that is responsible for <b>id</b> (binary) to
+ * <b>responsible_dirs</b>.  Helper for
+ * hid_serv_get_responsible_directories(). */
+void
+hid_serv_find_responsible_in_consensus(networkstatus_t *c,
+                                       smartlist_t *responsible_dirs,
+                                       const char *id)
+{
+  int start, found, n, i;
+  smartlist_t *ring = hid_serv_get_ring(c);
+  n = smartlist_len(ring);
+  start = smartlist_bsearch_idx(ring, id,
+                                compare_digest_to_routerstatus_entry, &found);
+  /* Even if we don't have the desired number of hidden service directories,
+   * be happy if we get any. */
+  for (i = 0; i < n && i < REND_NUMBER_OF_CONSECUTIVE_REPLICAS; ++i)
+    smartlist_add(responsible_dirs, smartlist_get(ring, (start + i) % n));
 }
 
 /** Determine the routers that are responsible for <b>id</b> (binary) and
@@ -5870,7 +6587,6 @@ int
 hid_serv_get_responsible_directories(smartlist_t *responsible_dirs,
                                      const char *id)
 {
-  int start, found, n_added = 0, i;
   networkstatus_t *c = networkstatus_get_latest_consensus();
   if (!c || !smartlist_len(c->routerstatus_list)) {
     log_warn(LD_REND, "We don't have a consensus, so we can't perform v2 "
@@ -5878,22 +6594,7 @@ hid_serv_get_responsible_directories(smartlist_t *responsible_dirs,
     return -1;
   }
   tor_assert(id);
-  start = networkstatus_vote_find_entry_idx(c, id, &found);
-  if (start == smartlist_len(c->routerstatus_list)) start = 0;
-  i = start;
-  do {
-    routerstatus_t *r = smartlist_get(c->routerstatus_list, i);
-    if (r->is_hs_dir) {
-      smartlist_add(responsible_dirs, r);
-      if (++n_added == REND_NUMBER_OF_CONSECUTIVE_REPLICAS)
-        return 0;
-    }
-    if (++i == smartlist_len(c->routerstatus_list))
-      i = 0;
-  } while (i != start);
-
-  /* Even though we don't have the desired number of hidden service
-   * directories, be happy if we got any. */
+  hid_serv_find_responsible_in_consensus(c, responsible_dirs, id);
   return smartlist_len(responsible_dirs) ? 0 : -1;
 }
 
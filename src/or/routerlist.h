@@ -24,9 +24,11 @@ void authority_cert_get_all(smartlist_t *certs_out);
 void authority_cert_dl_failed(const char *id_digest, int status);
 void authority_certs_fetch_missing(networkstatus_t *status, time_t now);
 int router_reload_router_list(void);
+void router_finish_store_rebuilds(void);
 int authority_cert_dl_looks_uncertain(const char *id_digest);
 smartlist_t *router_get_trusted_dir_servers(void);
 
+void router_note_descriptor_request_time(time_t elapsed);
 const routerstatus_t *router_pick_directory_server(dirinfo_type_t type,
                                                    int flags);
 trusted_dir_server_t *router_get_trusteddirserver_by_digest(const char *d);
@@ -216,5 +218,14 @@ int hex_digest_nickname_decode(const char *hexdigest,
                                char *nickname_qualifier_out,
                                char *nickname_out);
 
+#ifdef ROUTERLIST_PRIVATE
+int routerstatus_download_is_urgent(const routerstatus_t *rs);
+int descriptor_requests_per_mirror(int n_requests);
+void hid_serv_find_responsible_in_consensus(networkstatus_t *c,
+                                            smartlist_t *responsible_dirs,
+                                            const char *id);
+int find_cumulative_bw_index(const double *cumulative, int n, double target);
+#endif
+
 #endif
 
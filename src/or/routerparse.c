@@ -546,6 +546,11 @@ static int router_get_hashes_impl(const char *s, size_t s_len,
 static void token_clear(directory_token_t *tok);
 static smartlist_t *find_all_by_keyword(smartlist_t *s, directory_keyword k);
 static smartlist_t *find_all_exitpolicy(smartlist_t *s);
+static routerinfo_t *router_parse_entry_impl(const char *s, const char *end,
+                                             int cache_copy,
+                                             int allow_annotations,
+                                             const char *prepend_annotations,
+                                             int defer_exit_policy);
 static directory_token_t *_find_by_keyword(smartlist_t *s,
                                            directory_keyword keyword,
                                            const char *keyword_str);
@@ -1046,6 +1051,117 @@ dir_signing_key_is_trusted(crypto_pk_t *key)
   return 1;
 }
 
+/** An entry in the signature verification cache: a record that some
+ * signature checked out. */
+typedef struct sig_cache_entry_t {
+  /** Digest of the signing key, the signed digest, and the signature; see
+   * sig_cache_get_key(). */
+  char key[DIGEST_LEN];
+  /** Neighbors of this entry, from most to least recently used. */
+  struct sig_cache_entry_t *prev, *next;
+} sig_cache_entry_t;
+
+/** Largest number of good signatures we remember at a time. */
+#define SIG_CACHE_MAX_ENTRIES 8192
+
+/** Map from key to sig_cache_entry_t for every good signature that we have
+ * checked recently, so that we don't redo RSA operations when we see the
+ * same signed document again. */
+static digestmap_t *sig_cache = NULL;
+/** Most and least recently used entries in sig_cache. */
+static sig_cache_entry_t *sig_cache_head = NULL, *sig_cache_tail = NULL;
+/** Number of entries in sig_cache. */
+static int sig_cache_n_entries = 0;
+
+/** Set <b>key_out</b> to the key under which sig_cache remembers that
+ * <b>tok</b> holds a good signature by <b>pkey</b> for the
+ * <b>digest_len</b>-byte <b>digest</b>.  Return 0 on success, -1 on
+ * failure. */
+static int
+sig_cache_get_key(char *key_out, const char *digest, ssize_t digest_len,
+                  const directory_token_t *tok, crypto_pk_t *pkey)
+{
+  char pk_digest[DIGEST_LEN];
+  uint8_t len = (uint8_t) digest_len;
+  crypto_digest_t *d;
+
+  if (crypto_pk_get_digest(pkey, pk_digest) < 0)
+    return -1;
+  d = crypto_digest_new();
+  crypto_digest_add_bytes(d, pk_digest, DIGEST_LEN);
+  crypto_digest_add_bytes(d, (const char*)&len, 1);
+  crypto_digest_add_bytes(d, digest, digest_len);
+  crypto_digest_add_bytes(d, tok->object_body, tok->object_size);
+  crypto_digest_get_digest(d, key_out, DIGEST_LEN);
+  crypto_digest_free(d);
+  return 0;
+}
+
+/** Remove <b>ent</b> from the recently-used list of sig_cache. */
+static void
+sig_cache_unlink(sig_cache_entry_t *ent)
+{
+  if (ent->prev)
+    ent->prev->next = ent->next;
+  else
+    sig_cache_head = ent->next;
+  if (ent->next)
+    ent->next->prev = ent->prev;
+  else
+    sig_cache_tail = ent->prev;
+  ent->prev = ent->next = NULL;
+}
+
+/** Put <b>ent</b> at the most recently used end of sig_cache's list. */
+static void
+sig_cache_push_front(sig_cache_entry_t *ent)
+{
+  ent->prev = NULL;
+  ent->next = sig_cache_head;
+  if (sig_cache_head)
+    sig_cache_head->prev = ent;
+  sig_cache_head = ent;
+  if (!sig_cache_tail)
+    sig_cache_tail = ent;
+}
+
+/** Return true iff we have recently checked the signature described by
+ * <b>key</b> and found it good. */
+static int
+sig_cache_lookup(const char *key)
+{
+  sig_cache_entry_t *ent;
+  if (!sig_cache || !(ent = digestmap_get(sig_cache, key)))
+    return 0;
+  if (ent != sig_cache_head) {
+    sig_cache_unlink(ent);
+    sig_cache_push_front(ent);
+  }
+  return 1;
+}
+
+/** Remember that the signature described by <b>key</b> is good, forgetting
+ * the least recently used one if we have too many. */
+static void
+sig_cache_add(const char *key)
+{
+  sig_cache_entry_t *ent;
+  if (!sig_cache)
+    sig_cache = digestmap_new();
+  if (sig_cache_n_entries >= SIG_CACHE_MAX_ENTRIES) {
+    ent = sig_cache_tail;
+    sig_cache_unlink(ent);
+    digestmap_remove(sig_cache, ent->key);
+    tor_free(ent);
+    --sig_cache_n_entries;
+  }
+  ent = tor_malloc_zero(sizeof(sig_cache_entry_t));
+  memcpy(ent->key, key, DIGEST_LEN);
+  digestmap_set(sig_cache, key, ent);
+  sig_cache_push_front(ent);
+  ++sig_cache_n_entries;
+}
+
 /** Check whether the object body of the token in <b>tok</b> has a good
  * signature for <b>digest</b> using key <b>pkey</b>.  If
  * <b>CST_CHECK_AUTHORITY</b> is set, make sure that <b>pkey</b> is the key of
@@ -1064,6 +1180,8 @@ check_signature_token(const char *digest,
 {
   char *signed_digest;
   size_t keysize;
+  char cache_key[DIGEST_LEN];
+  int have_cache_key;
   const int check_authority = (flags & CST_CHECK_AUTHORITY);
   const int check_objtype = ! (flags & CST_NO_CHECK_OBJTYPE);
 
@@ -1085,6 +1203,11 @@ check_signature_token(const char *digest,
     }
   }
 
+  have_cache_key =
+    sig_cache_get_key(cache_key, digest, digest_len, tok, pkey) == 0;
+  if (have_cache_key && sig_cache_lookup(cache_key))
+    return 0;
+
   keysize = crypto_pk_keysize(pkey);
   signed_digest = tor_malloc(keysize);
   if (crypto_pk_public_checksig(pkey, signed_digest, keysize,
@@ -1102,6 +1225,8 @@ check_signature_token(const char *digest,
     return -1;
   }
   tor_free(signed_digest);
+  if (have_cache_key)
+    sig_cache_add(cache_key);
   return 0;
 }
 
@@ -1151,7 +1276,8 @@ find_start_of_next_router_or_extrainfo(const char **s_ptr,
  *
  * If <b>saved_location</b> isn't SAVED_IN_CACHE, make a local copy of each
  * descriptor in the signed_descriptor_body field of each routerinfo_t.  If it
- * isn't SAVED_NOWHERE, remember the offset of each descriptor.
+ * isn't SAVED_NOWHERE, remember the offset of each descriptor, and don't
+ * parse router exit policies until they are needed.
  *
  * Returns 0 on success and -1 on failure.
  */
@@ -1205,10 +1331,11 @@ router_parse_list_from_string(const char **s, const char *eos,
         elt = extrainfo;
       }
     } else if (!have_extrainfo && !want_extrainfo) {
-      router = router_parse_entry_from_string(*s, end,
-                                              saved_location != SAVED_IN_CACHE,
-                                              allow_annotations,
-                                              prepend_annotations);
+      router = router_parse_entry_impl(*s, end,
+                                       saved_location != SAVED_IN_CACHE,
+                                       allow_annotations,
+                                       prepend_annotations,
+                                       saved_location != SAVED_NOWHERE);
       if (router) {
         log_debug(LD_DIR, "Read router '%s', purpose '%s'",
                   router_describe(router),
@@ -1277,6 +1404,20 @@ routerinfo_t *
 router_parse_entry_from_string(const char *s, const char *end,
                                int cache_copy, int allow_annotations,
                                const char *prepend_annotations)
+{
+  return router_parse_entry_impl(s, end, cache_copy, allow_annotations,
+                                 prepend_annotations, 0);
+}
+
+/** Helper: as router_parse_entry_from_string(), but if
+ * <b>defer_exit_policy</b> is true, only check that the descriptor has an
+ * exit policy, and leave it for router_parse_exit_policy_if_needed() to
+ * parse. */
+static routerinfo_t *
+router_parse_entry_impl(const char *s, const char *end,
+                        int cache_copy, int allow_annotations,
+                        const char *prepend_annotations,
+                        int defer_exit_policy)
 {
   routerinfo_t *router = NULL;
   char digest[128];
@@ -1385,7 +1526,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   }
   memcpy(router->cache_info.signed_descriptor_digest, digest, DIGEST_LEN);
 
-  router->nickname = tor_strdup(tok->args[0]);
+  router->nickname = string_intern(tok->args[0]);
   if (!is_legal_nickname(router->nickname)) {
     log_warn(LD_DIR,"Router nickname is invalid");
     goto err;
@@ -1497,11 +1638,11 @@ router_parse_entry_from_string(const char *s, const char *end,
   }
 
   if ((tok = find_opt_by_keyword(tokens, K_PLATFORM))) {
-    router->platform = tor_strdup(tok->args[0]);
+    router->platform = string_intern(tok->args[0]);
   }
 
   if ((tok = find_opt_by_keyword(tokens, K_CONTACT))) {
-    router->contact_info = tor_strdup(tok->args[0]);
+    router->contact_info = string_intern(tok->args[0]);
   }
 
   if (find_opt_by_keyword(tokens, K_REJECT6) ||
@@ -1536,14 +1677,22 @@ router_parse_entry_from_string(const char *s, const char *end,
     log_warn(LD_DIR, "No exit policy tokens in descriptor.");
     goto err;
   }
-  SMARTLIST_FOREACH(exit_policy_tokens, directory_token_t *, t,
-                    if (router_add_exit_policy(router,t)<0) {
-                      log_warn(LD_DIR,"Error in exit policy");
-                      goto err;
-                    });
-  policy_expand_private(&router->exit_policy);
-  if (policy_is_reject_star(router->exit_policy))
-    router->policy_is_reject_star = 1;
+  if (defer_exit_policy) {
+    router->policy_is_unparsed = 1;
+  } else {
+    SMARTLIST_FOREACH(exit_policy_tokens, directory_token_t *, t,
+                      if (router_add_exit_policy(router,t)<0) {
+                        log_warn(LD_DIR,"Error in exit policy");
+                        /* It isn't interned yet. */
+                        addr_policy_list_free(router->exit_policy);
+                        router->exit_policy = NULL;
+                        goto err;
+                      });
+    policy_expand_private(&router->exit_policy);
+    router->exit_policy = addr_policy_list_intern(router->exit_policy);
+    if (policy_is_reject_star(router->exit_policy))
+      router->policy_is_reject_star = 1;
+  }
 
   if ((tok = find_opt_by_keyword(tokens, K_FAMILY)) && tok->n_args) {
     int i;
@@ -1554,7 +1703,8 @@ router_parse_entry_from_string(const char *s, const char *end,
                  escaped(tok->args[i]));
         goto err;
       }
-      smartlist_add(router->declared_family, tor_strdup(tok->args[i]));
+      smartlist_add(router->declared_family,
+                    (char*)string_intern(tok->args[i]));
     }
   }
 
@@ -1595,7 +1745,7 @@ router_parse_entry_from_string(const char *s, const char *end,
   }
 
   if (!router->platform) {
-    router->platform = tor_strdup("<unknown>");
+    router->platform = string_intern("<unknown>");
   }
 
   goto done;
@@ -1617,6 +1767,60 @@ router_parse_entry_from_string(const char *s, const char *end,
   return router;
 }
 
+/** If we haven't yet parsed the exit policy of <b>ri</b>, parse it now
+ * from the router's descriptor body.  We checked the signature on that body
+ * when we loaded the router, so we only need to tokenize it here.  On
+ * failure, give the router a reject-everything policy.
+ *
+ * The exit policy is logically part of <b>ri</b>; we only fill it in late,
+ * so this takes a const pointer like the functions that need the policy. */
+void
+router_parse_exit_policy_if_needed(const routerinfo_t *ri)
+{
+  routerinfo_t *router = (routerinfo_t *)ri;
+  const char *body, *end;
+  smartlist_t *tokens, *exit_policy_tokens = NULL;
+  memarea_t *area;
+  int ok = 0;
+
+  if (PREDICT_LIKELY(!router->policy_is_unparsed))
+    return;
+  router->policy_is_unparsed = 0;
+
+  body = signed_descriptor_get_body(&router->cache_info);
+  end = body + router->cache_info.signed_descriptor_len;
+  area = memarea_new();
+  tokens = smartlist_new();
+  if (tokenize_string(area, body, end, tokens, routerdesc_token_table, 0)) {
+    log_warn(LD_BUG, "Couldn't re-tokenize the descriptor for %s.",
+             router_describe(router));
+    goto done;
+  }
+  exit_policy_tokens = find_all_exitpolicy(tokens);
+  SMARTLIST_FOREACH_BEGIN(exit_policy_tokens, directory_token_t *, t) {
+    if (router_add_exit_policy(router, t) < 0) {
+      log_warn(LD_BUG, "Error in the exit policy for %s.",
+               router_describe(router));
+      goto done;
+    }
+  } SMARTLIST_FOREACH_END(t);
+  policy_expand_private(&router->exit_policy);
+  ok = 1;
+
+ done:
+  if (!ok) {
+    addr_policy_list_free(router->exit_policy);
+    router->exit_policy = NULL;
+    policies_exit_policy_append_reject_star(&router->exit_policy);
+  }
+  router->exit_policy = addr_policy_list_intern(router->exit_policy);
+  router->policy_is_reject_star = policy_is_reject_star(router->exit_policy);
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  smartlist_free(exit_policy_tokens);
+  memarea_drop_all(area);
+}
+
 /** Parse a single extrainfo entry from the string <b>s</b>, ending at
  * <b>end</b>.  (If <b>end</b> is NULL, parse up to the end of <b>s</b>.)  If
  * <b>cache_copy</b> is true, make a copy of the extra-info document in the
@@ -1955,6 +2159,17 @@ find_start_of_next_routerstatus(const char *s)
     return eos;
 }
 
+/** As escaped(), but keep the result in *<b>buf</b>, freeing whatever was
+ * there, instead of in a static buffer: routerstatus entries can be parsed
+ * in worker threads. */
+static const char *
+escaped_into(char **buf, const char *s)
+{
+  tor_free(*buf);
+  *buf = esc_for_log(s);
+  return *buf;
+}
+
 /** Given a string at *<b>s</b>, containing a routerstatus object, and an
  * empty smartlist at <b>tokens</b>, parse and return the first router status
  * object in the string, and advance *<b>s</b> to just after the end of the
@@ -1968,6 +2183,9 @@ find_start_of_next_routerstatus(const char *s)
  * make that consensus.
  *
  * Parse according to the syntax used by the consensus flavor <b>flav</b>.
+ *
+ * We tokenize into <b>area</b>, and release everything we allocated there
+ * before returning, so the caller can parse a whole document from one area.
  **/
 static routerstatus_t *
 routerstatus_parse_entry_from_string(memarea_t *area,
@@ -1983,9 +2201,13 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   char timebuf[ISO_TIME_LEN+1];
   struct in_addr in;
   int offset = 0;
+  char *esc = NULL;
+  memarea_mark_t mark;
   tor_assert(tokens);
   tor_assert(bool_eq(vote, vote_rs));
 
+  memarea_get_mark(area, &mark);
+
   if (!consensus_method)
     flav = FLAV_NS;
   tor_assert(flav == FLAV_NS || flav == FLAV_MICRODESC);
@@ -2020,21 +2242,21 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   if (!is_legal_nickname(tok->args[0])) {
     log_warn(LD_DIR,
              "Invalid nickname %s in router status; skipping.",
-             escaped(tok->args[0]));
+             escaped_into(&esc, tok->args[0]));
     goto err;
   }
   strlcpy(rs->nickname, tok->args[0], sizeof(rs->nickname));
 
   if (digest_from_base64(rs->identity_digest, tok->args[1])) {
     log_warn(LD_DIR, "Error decoding identity digest %s",
-             escaped(tok->args[1]));
+             escaped_into(&esc, tok->args[1]));
     goto err;
   }
 
   if (flav == FLAV_NS) {
     if (digest_from_base64(rs->descriptor_digest, tok->args[2])) {
       log_warn(LD_DIR, "Error decoding descriptor digest %s",
-               escaped(tok->args[2]));
+               escaped_into(&esc, tok->args[2]));
       goto err;
     }
   }
@@ -2050,7 +2272,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   if (tor_inet_aton(tok->args[5+offset], &in) == 0) {
     log_warn(LD_DIR, "Error parsing router address in network-status %s",
-             escaped(tok->args[5+offset]));
+             escaped_into(&esc, tok->args[5+offset]));
     goto err;
   }
   rs->addr = ntohl(in.s_addr);
@@ -2070,7 +2292,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
         vote_rs->flags |= (1<<p);
       } else {
         log_warn(LD_DIR, "Flags line had a flag %s not listed in known_flags.",
-                 escaped(tok->args[i]));
+                 escaped_into(&esc, tok->args[i]));
         goto err;
       }
     }
@@ -2146,7 +2368,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                                   10, 0, UINT32_MAX,
                                                   &ok, NULL);
         if (!ok) {
-          log_warn(LD_DIR, "Invalid Bandwidth %s", escaped(tok->args[i]));
+          log_warn(LD_DIR, "Invalid Bandwidth %s",
+                   escaped_into(&esc, tok->args[i]));
           goto err;
         }
         rs->has_bandwidth = 1;
@@ -2157,7 +2380,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                       10, 0, UINT32_MAX, &ok, NULL);
         if (!ok) {
           log_warn(LD_DIR, "Invalid Measured Bandwidth %s",
-                   escaped(tok->args[i]));
+                   escaped_into(&esc, tok->args[i]));
           goto err;
         }
         rs->has_measured_bw = 1;
@@ -2171,7 +2394,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
     if (strcmpstart(tok->args[0], "accept ") &&
         strcmpstart(tok->args[0], "reject ")) {
       log_warn(LD_DIR, "Unknown exit policy summary type %s.",
-               escaped(tok->args[0]));
+               escaped_into(&esc, tok->args[0]));
       goto err;
     }
     /* XXX weasel: parse this into ports and represent them somehow smart,
@@ -2198,7 +2421,7 @@ routerstatus_parse_entry_from_string(memarea_t *area,
       tor_assert(tok->n_args);
       if (digest256_from_base64(rs->descriptor_digest, tok->args[0])) {
         log_warn(LD_DIR, "Error decoding microdescriptor digest %s",
-                 escaped(tok->args[0]));
+                 escaped_into(&esc, tok->args[0]));
         goto err;
       }
     }
@@ -2209,7 +2432,11 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   goto done;
  err:
-  dump_desc(s_dup, "routerstatus entry");
+#ifdef TOR_IS_MULTITHREADED
+  /* Leave writing files to the main thread. */
+  if (in_main_thread())
+#endif
+    dump_desc(s_dup, "routerstatus entry");
   if (rs && !vote_rs)
     routerstatus_free(rs);
   rs = NULL;
@@ -2218,9 +2445,10 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   smartlist_clear(tokens);
   if (area) {
     DUMP_AREA(area, "routerstatus entry");
-    memarea_clear(area);
+    memarea_release_to_mark(area, &mark);
   }
   *s = eos;
+  tor_free(esc);
 
   return rs;
 }
@@ -2427,17 +2655,17 @@ networkstatus_verify_bw_weights(networkstatus_t *ns)
   int valid = 1;
 
   weight_scale = circuit_build_times_get_bw_scale(ns);
-  Wgg = networkstatus_get_bw_weight(ns, "Wgg", -1);
-  Wgm = networkstatus_get_bw_weight(ns, "Wgm", -1);
-  Wgd = networkstatus_get_bw_weight(ns, "Wgd", -1);
-  Wmg = networkstatus_get_bw_weight(ns, "Wmg", -1);
-  Wmm = networkstatus_get_bw_weight(ns, "Wmm", -1);
-  Wme = networkstatus_get_bw_weight(ns, "Wme", -1);
-  Wmd = networkstatus_get_bw_weight(ns, "Wmd", -1);
-  Weg = networkstatus_get_bw_weight(ns, "Weg", -1);
-  Wem = networkstatus_get_bw_weight(ns, "Wem", -1);
-  Wee = networkstatus_get_bw_weight(ns, "Wee", -1);
-  Wed = networkstatus_get_bw_weight(ns, "Wed", -1);
+  Wgg = networkstatus_get_bw_weight(ns, BW_WEIGHT_WGG, -1);
+  Wgm = networkstatus_get_bw_weight(ns, BW_WEIGHT_WGM, -1);
+  Wgd = networkstatus_get_bw_weight(ns, BW_WEIGHT_WGD, -1);
+  Wmg = networkstatus_get_bw_weight(ns, BW_WEIGHT_WMG, -1);
+  Wmm = networkstatus_get_bw_weight(ns, BW_WEIGHT_WMM, -1);
+  Wme = networkstatus_get_bw_weight(ns, BW_WEIGHT_WME, -1);
+  Wmd = networkstatus_get_bw_weight(ns, BW_WEIGHT_WMD, -1);
+  Weg = networkstatus_get_bw_weight(ns, BW_WEIGHT_WEG, -1);
+  Wem = networkstatus_get_bw_weight(ns, BW_WEIGHT_WEM, -1);
+  Wee = networkstatus_get_bw_weight(ns, BW_WEIGHT_WEE, -1);
+  Wed = networkstatus_get_bw_weight(ns, BW_WEIGHT_WED, -1);
 
   if (Wgg<0 || Wgm<0 || Wgd<0 || Wmg<0 || Wmm<0 || Wme<0 || Wmd<0 || Weg<0
           || Wem<0 || Wee<0 || Wed<0) {
@@ -2804,6 +3032,139 @@ networkstatus_verify_bw_weights(networkstatus_t *ns)
   return valid;
 }
 
+#ifdef USE_PTHREADS
+/** Fewest routerstatus entries we'll give each thread when we parse a
+ * consensus in parallel: smaller runs aren't worth a thread. */
+#define MIN_ENTRIES_PER_PARSE_THREAD 256
+
+/** A run of consecutive routerstatus entries in a consensus, for one thread
+ * to parse. */
+typedef struct rs_parse_job_t {
+  const char *start; /**< The first entry. */
+  int n_entries; /**< How many entries to parse. */
+  int consensus_method; /**< The consensus method the entries were made by. */
+  consensus_flavor_t flav; /**< The flavor of the consensus. */
+  smartlist_t *result; /**< The routerstatus_t objects parsed, in order. */
+  int spawned; /**< True iff a worker thread is running this job. */
+  tor_mutex_t *lock; /**< Protects *<b>n_running</b>. */
+  tor_cond_t *done_cond; /**< Signalled when *<b>n_running</b> hits 0. */
+  int *n_running; /**< How many worker threads haven't finished yet. */
+} rs_parse_job_t;
+
+/** Parse the entries of <b>job</b> into job-\>result. */
+static void
+rs_parse_job_run(rs_parse_job_t *job)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  const char *s = job->start;
+  int i;
+  for (i = 0; i < job->n_entries; ++i) {
+    routerstatus_t *rs;
+    if ((rs = routerstatus_parse_entry_from_string(area, &s, tokens,
+                                                   NULL, NULL,
+                                                   job->consensus_method,
+                                                   job->flav)))
+      smartlist_add(job->result, rs);
+  }
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+}
+
+/** Main function for a worker thread parsing the rs_parse_job_t
+ * <b>arg</b>. */
+static void
+rs_parse_worker_main(void *arg)
+{
+  rs_parse_job_t *job = arg;
+  rs_parse_job_run(job);
+  tor_mutex_acquire(job->lock);
+  if (--*job->n_running == 0)
+    tor_cond_signal_all(job->done_cond);
+  tor_mutex_release(job->lock);
+  spawn_exit();
+}
+
+/** Parse the consensus routerstatus entries starting at *<b>s</b> onto the
+ * end of <b>ns</b>-\>routerstatus_list, splitting them into runs of
+ * consecutive entries and parsing each run in its own thread, this one
+ * included, up to <b>n_threads</b> threads at once.  Advance *<b>s</b> past
+ * the last entry.  If there are too few entries to be worth it, do nothing,
+ * and leave the entries for our caller to parse. */
+static void
+routerstatus_parse_entries_in_parallel(const char **s, networkstatus_t *ns,
+                                       consensus_flavor_t flav,
+                                       int n_threads)
+{
+  smartlist_t *starts = smartlist_new();
+  const char *cp = *s;
+  rs_parse_job_t *jobs;
+  tor_mutex_t *lock;
+  tor_cond_t *done_cond;
+  int n_running = 0, n_entries, per_job, i;
+
+  while (!strcmpstart(cp, "r ")) {
+    smartlist_add(starts, (char*)cp);
+    cp = find_start_of_next_routerstatus(cp);
+  }
+  n_entries = smartlist_len(starts);
+  if (n_threads > n_entries / MIN_ENTRIES_PER_PARSE_THREAD)
+    n_threads = n_entries / MIN_ENTRIES_PER_PARSE_THREAD;
+  if (n_threads < 2) {
+    smartlist_free(starts);
+    return;
+  }
+
+  per_job = CEIL_DIV(n_entries, n_threads);
+  jobs = tor_malloc_zero(sizeof(rs_parse_job_t) * n_threads);
+  lock = tor_mutex_new();
+  done_cond = tor_cond_new();
+  for (i = 0; i < n_threads; ++i) {
+    rs_parse_job_t *job = &jobs[i];
+    job->start = smartlist_get(starts, i * per_job);
+    job->n_entries = MIN(per_job, n_entries - i * per_job);
+    job->consensus_method = ns->consensus_method;
+    job->flav = flav;
+    job->result = smartlist_new();
+    job->lock = lock;
+    job->done_cond = done_cond;
+    job->n_running = &n_running;
+  }
+
+  /* Keep the first run for ourself. */
+  tor_mutex_acquire(lock);
+  for (i = 1; i < n_threads; ++i) {
+    ++n_running;
+    if (spawn_func(rs_parse_worker_main, &jobs[i]) == 0) {
+      jobs[i].spawned = 1;
+    } else {
+      --n_running;
+    }
+  }
+  tor_mutex_release(lock);
+
+  for (i = 0; i < n_threads; ++i) {
+    if (!jobs[i].spawned)
+      rs_parse_job_run(&jobs[i]);
+  }
+
+  tor_mutex_acquire(lock);
+  while (n_running)
+    tor_cond_wait(done_cond, lock);
+  tor_mutex_release(lock);
+
+  for (i = 0; i < n_threads; ++i) {
+    smartlist_add_all(ns->routerstatus_list, jobs[i].result);
+    smartlist_free(jobs[i].result);
+  }
+  tor_cond_free(done_cond);
+  tor_mutex_free(lock);
+  tor_free(jobs);
+  smartlist_free(starts);
+  *s = cp;
+}
+#endif
+
 /** Parse a v3 networkstatus vote, opinion, or consensus (depending on
  * ns_type), from <b>s</b>, and return the result.  Return NULL on failure. */
 networkstatus_t *
@@ -2820,7 +3181,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   int ok;
   struct in_addr in;
   int i, inorder, n_signatures = 0;
-  memarea_t *area = NULL, *rs_area = NULL;
+  memarea_t *area = NULL;
   consensus_flavor_t flav = FLAV_NS;
   char *last_kwd=NULL;
 
@@ -3116,14 +3477,19 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
 
   /* Parse routerstatus lines. */
   rs_tokens = smartlist_new();
-  rs_area = memarea_new();
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
+#ifdef USE_PTHREADS
+  if (ns->type == NS_TYPE_CONSENSUS &&
+      get_options()->ParallelConsensusParsing)
+    routerstatus_parse_entries_in_parallel(&s, ns, flav,
+                                           get_num_cpus(get_options()));
+#endif
   while (!strcmpstart(s, "r ")) {
     if (ns->type != NS_TYPE_CONSENSUS) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
-      if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
+      if (routerstatus_parse_entry_from_string(area, &s, rs_tokens, ns,
                                                rs, 0, 0))
         smartlist_add(ns->routerstatus_list, rs);
       else {
@@ -3132,7 +3498,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       }
     } else {
       routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens,
+      if ((rs = routerstatus_parse_entry_from_string(area, &s, rs_tokens,
                                                      NULL, NULL,
                                                      ns->consensus_method,
                                                      flav)))
@@ -3208,6 +3574,7 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       smartlist_add(ns->weight_params, tor_strdup(tok->args[i]));
     }
   }
+  networkstatus_compile_params(ns);
 
   SMARTLIST_FOREACH_BEGIN(footer_tokens, directory_token_t *, _tok) {
     char declared_identity[DIGEST_LEN];
@@ -3354,8 +3721,6 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
     DUMP_AREA(area, "v3 networkstatus");
     memarea_drop_all(area);
   }
-  if (rs_area)
-    memarea_drop_all(rs_area);
   tor_free(last_kwd);
 
   return ns;
@@ -3846,34 +4211,62 @@ token_check_object(memarea_t *area, const char *kwd,
   return tok;
 }
 
-/** Helper: parse space-separated arguments from the string <b>s</b> ending at
- * <b>eol</b>, and store them in the args field of <b>tok</b>.  Store the
- * number of parsed elements into the n_args field of <b>tok</b>.  Allocate
- * all storage in <b>area</b>.  Return the number of arguments parsed, or
- * return -1 if there was an insanely high number of arguments. */
-static INLINE int
-get_token_arguments(memarea_t *area, directory_token_t *tok,
-                    const char *s, const char *eol)
+/** Helper: allocate and return a new token of type <b>tp</b> in
+ * <b>area</b>, whose arguments are the space-separated words of the string
+ * <b>s</b> ending at <b>eol</b> -- or, if <b>concat_args</b> is set, that
+ * whole string as a single argument.  The token, its args array and the
+ * argument text all share a single allocation.  Return NULL if there was an
+ * insanely high number of arguments. */
+static INLINE directory_token_t *
+token_new_with_args(memarea_t *area, directory_keyword tp,
+                    const char *s, const char *eol, int concat_args)
 {
 /** Largest number of arguments we'll accept to any token, ever. */
 #define MAX_ARGS 512
-  char *mem = memarea_strndup(area, s, eol-s);
-  char *cp = mem;
-  int j = 0;
-  char *args[MAX_ARGS];
-  while (*cp) {
-    if (j == MAX_ARGS)
-      return -1;
-    args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
-      break; /* End of the line. */
-    *cp++ = '\0';
-    cp = (char*)eat_whitespace(cp);
+  const char *starts[MAX_ARGS], *ends[MAX_ARGS];
+  const char *cp, *end;
+  directory_token_t *tok;
+  char *text;
+  size_t len;
+  int i, j = 0;
+
+  /* Like memarea_strndup(), stop at a NUL. */
+  end = memchr(s, '\0', eol-s);
+  if (!end)
+    end = eol;
+  len = end-s;
+
+  if (concat_args) {
+    starts[j] = s;
+    ends[j++] = end;
+  } else {
+    cp = s;
+    while (cp < end) {
+      if (j == MAX_ARGS)
+        return NULL;
+      starts[j] = cp;
+      cp = find_whitespace_eos(cp, end);
+      ends[j++] = cp;
+      if (cp == end)
+        break; /* End of the line. */
+      cp = eat_whitespace_eos(cp+1, end);
+    }
   }
+
+  tok = memarea_alloc(area, sizeof(directory_token_t) + j*sizeof(char*) +
+                      len + 1);
+  memset(tok, 0, sizeof(directory_token_t));
+  tok->tp = tp;
   tok->n_args = j;
-  tok->args = memarea_memdup(area, args, j*sizeof(char*));
-  return j;
+  tok->args = (char**)(tok+1);
+  text = (char*)(tok->args + j);
+  memcpy(text, s, len);
+  text[len] = '\0';
+  for (i = 0; i < j; ++i) {
+    tok->args[i] = text + (starts[i]-s);
+    text[ends[i]-s] = '\0';
+  }
+  return tok;
 #undef MAX_ARGS
 }
 
@@ -3895,14 +4288,12 @@ get_next_token(memarea_t *area,
   const char *next, *eol, *obstart;
   size_t obname_len;
   int i;
-  directory_token_t *tok;
+  directory_token_t *tok = NULL;
   obj_syntax o_syn = NO_OBJ;
   char ebuf[128];
   const char *kwd = "";
 
   tor_assert(area);
-  tok = ALLOC_ZERO(sizeof(directory_token_t));
-  tok->tp = _ERR;
 
   /* Set *s to first token, eol to end-of-line, next to after first token */
   *s = eat_whitespace_eos(*s, eos); /* eat multi-line whitespace */
@@ -3930,23 +4321,16 @@ get_next_token(memarea_t *area,
     if (!strcmp_len(*s, table[i].t, next-*s)) {
       /* We've found the keyword. */
       kwd = table[i].t;
-      tok->tp = table[i].v;
       o_syn = table[i].os;
       *s = eat_whitespace_eos_no_nl(next, eol);
       /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
+       * always set if we want arguments.  If concat_args is set, the keyword
+       * takes the line as a single argument. */
+      tok = token_new_with_args(area, table[i].v, *s, eol,
+                                table[i].concat_args);
+      if (!tok) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
+        RET_ERR(ebuf);
       }
       if (tok->n_args < table[i].min_args) {
         tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
@@ -3959,15 +4343,10 @@ get_next_token(memarea_t *area,
     }
   }
 
-  if (tok->tp == _ERR) {
+  if (!tok) {
     /* No keyword matched; call it an "K_opt" or "A_unrecognized" */
-    if (**s == '@')
-      tok->tp = _A_UNKNOWN;
-    else
-      tok->tp = K_OPT;
-    tok->args = ALLOC(sizeof(char*));
-    tok->args[0] = STRNDUP(*s, eol-*s);
-    tok->n_args = 1;
+    tok = token_new_with_args(area, **s == '@' ? _A_UNKNOWN : K_OPT,
+                              *s, eol, 1);
     o_syn = OBJ_OK;
   }
 
@@ -5222,3 +5601,18 @@ rend_parse_client_keys(strmap_t *parsed_clients, const char *ckstr)
   return result;
 }
 
+
+/** Free all storage held by the signature verification cache. */
+void
+routerparse_free_all(void)
+{
+  sig_cache_entry_t *ent, *next;
+  for (ent = sig_cache_head; ent; ent = next) {
+    next = ent->next;
+    tor_free(ent);
+  }
+  sig_cache_head = sig_cache_tail = NULL;
+  sig_cache_n_entries = 0;
+  digestmap_free(sig_cache, NULL);
+  sig_cache = NULL;
+}
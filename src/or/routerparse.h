@@ -34,6 +34,7 @@ int router_parse_list_from_string(const char **s, const char *eos,
 int router_parse_runningrouters(const char *str);
 int router_parse_directory(const char *str);
 
+void router_parse_exit_policy_if_needed(const routerinfo_t *ri);
 routerinfo_t *router_parse_entry_from_string(const char *s, const char *end,
                                              int cache_copy,
                                              int allow_annotations,
@@ -52,6 +53,7 @@ int tor_version_same_series(tor_version_t *a, tor_version_t *b);
 void sort_version_list(smartlist_t *lst, int remove_duplicates);
 void assert_addr_policy_ok(smartlist_t *t);
 void dump_distinct_digest_count(int severity);
+void routerparse_free_all(void);
 
 int compare_routerstatus_entries(const void **_a, const void **_b);
 networkstatus_v2_t *networkstatus_v2_parse_from_string(const char *s);
@@ -0,0 +1,185 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.c
+ * \brief Decide which OR connection gets to move cells from its circuit
+ * queues onto its outbuf next.
+ *
+ * We used to fill each OR connection's outbuf from its own active circuits
+ * as soon as that connection had room, so whichever socket happened to
+ * become writable first got to send its cells first, regardless of what
+ * kind of circuits the other connections were carrying.
+ *
+ * Instead, connections that have active circuits and room on their outbufs
+ * tell the scheduler so with scheduler_conn_wants_to_write().  Once per
+ * pass through the event loop, we handle all of them together: we keep
+ * them in a priority queue ordered by the cell-EWMA count of each
+ * connection's quietest active circuit, and move one cell at a time from
+ * whichever connection is first, until every outbuf is full or every
+ * queue is empty.  Since cell-EWMA counts all share one origin (see
+ * relay.c), they are comparable across connections.  If the EWMA
+ * algorithm is disabled, every connection has the same priority, and we
+ * serve them round-robin.
+ **/
+
+#include "or.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "relay.h"
+#include "scheduler.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+/** Priority queue of or_connection_t that have active circuits and room on
+ * their outbufs, ordered by compare_conns_by_priority(). */
+static smartlist_t *conns_pending = NULL;
+
+/** Event that runs the scheduler once the current pass through the event
+ * loop is done. */
+static struct event *run_sched_ev = NULL;
+
+/** Incremented each time a connection is added to conns_pending; breaks
+ * ties between connections with equal priority. */
+static uint64_t sched_seq = 0;
+
+/** Helper for ordering or_connection_t in conns_pending: the connection
+ * whose quietest circuit has sent the fewest cells goes first, and among
+ * equals, the connection that has waited longest. */
+static int
+compare_conns_by_priority(const void *p1, const void *p2)
+{
+  const or_connection_t *c1 = p1, *c2 = p2;
+  if (c1->sched_priority < c2->sched_priority)
+    return -1;
+  else if (c1->sched_priority > c2->sched_priority)
+    return 1;
+  else if (c1->sched_seq < c2->sched_seq)
+    return -1;
+  else if (c1->sched_seq > c2->sched_seq)
+    return 1;
+  else
+    return 0;
+}
+
+/** Return true iff we should move more cells onto <b>conn</b>'s outbuf. */
+static INLINE int
+conn_can_take_cells(or_connection_t *conn)
+{
+  return conn->active_circuits && !conn->_base.marked_for_close &&
+    connection_get_outbuf_len(TO_CONN(conn)) < OR_CONN_HIGHWATER;
+}
+
+/** Add <b>conn</b> to conns_pending, using its current priority. */
+static void
+scheduler_add_conn(or_connection_t *conn)
+{
+  tor_assert(conn->sched_heap_idx == -1);
+  conn->sched_priority = connection_or_get_circuit_priority(conn);
+  conn->sched_seq = ++sched_seq;
+  smartlist_pqueue_add(conns_pending, compare_conns_by_priority,
+                       STRUCT_OFFSET(or_connection_t, sched_heap_idx), conn);
+}
+
+/** Move cells from the circuits of every pending connection onto their
+ * outbufs, one cell at a time, in priority order.  If CoalesceORWrites is
+ * set, keep each connection we write to corked until we're done, so that
+ * the TLS records we flush along the way share TCP segments. */
+static void
+scheduler_run(void)
+{
+  time_t now = approx_time();
+  smartlist_t *corked = NULL;
+  const int cork = get_options()->CoalesceORWrites;
+  while (smartlist_len(conns_pending)) {
+    or_connection_t *conn = smartlist_pqueue_pop(conns_pending,
+                            compare_conns_by_priority,
+                            STRUCT_OFFSET(or_connection_t, sched_heap_idx));
+    if (!conn_can_take_cells(conn))
+      continue;
+    if (cork && !conn->is_corked) {
+      connection_or_set_corked(conn, 1);
+      if (conn->is_corked) {
+        if (!corked)
+          corked = smartlist_new();
+        smartlist_add(corked, conn);
+      }
+    }
+    connection_or_flush_from_first_active_circuit(conn, 1, now);
+    /* Writing that cell may have flushed the outbuf and put conn right
+     * back on the queue; either way, requeue it with its new priority. */
+    if (conn->sched_heap_idx != -1)
+      scheduler_conn_release(conn);
+    if (conn_can_take_cells(conn))
+      scheduler_add_conn(conn);
+  }
+
+  if (corked) {
+    SMARTLIST_FOREACH(corked, or_connection_t *, conn,
+                      connection_or_set_corked(conn, 0));
+    smartlist_free(corked);
+  }
+}
+
+/** Libevent callback: run the scheduler. */
+static void
+scheduler_run_cb(evutil_socket_t fd, short events, void *arg)
+{
+  (void)fd;
+  (void)events;
+  (void)arg;
+  scheduler_run();
+}
+
+/** Note that <b>conn</b> has active circuits and room on its outbuf, and
+ * should get cells from them once the scheduler next runs. */
+void
+scheduler_conn_wants_to_write(or_connection_t *conn)
+{
+  if (!conns_pending)
+    conns_pending = smartlist_new();
+  if (conn->sched_heap_idx != -1)
+    return; /* Already pending. */
+  if (!conn_can_take_cells(conn))
+    return;
+  scheduler_add_conn(conn);
+
+  if (!run_sched_ev)
+    run_sched_ev = tor_event_new(tor_libevent_get_base(), -1, 0,
+                                 scheduler_run_cb, NULL);
+  event_active(run_sched_ev, EV_TIMEOUT, 1);
+}
+
+/** Remove <b>conn</b> from the scheduler, if it's pending.  Must be called
+ * before <b>conn</b> is freed. */
+void
+scheduler_conn_release(or_connection_t *conn)
+{
+  if (conn->sched_heap_idx == -1)
+    return;
+  smartlist_pqueue_remove(conns_pending, compare_conns_by_priority,
+                          STRUCT_OFFSET(or_connection_t, sched_heap_idx),
+                          conn);
+}
+
+/** Release all storage held by the scheduler. */
+void
+scheduler_free_all(void)
+{
+  if (conns_pending) {
+    SMARTLIST_FOREACH(conns_pending, or_connection_t *, conn,
+                      conn->sched_heap_idx = -1);
+    smartlist_free(conns_pending);
+    conns_pending = NULL;
+  }
+  if (run_sched_ev) {
+    tor_event_free(run_sched_ev);
+    run_sched_ev = NULL;
+  }
+}
+
@@ -0,0 +1,17 @@
+/* Copyright (c) 2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/**
+ * \file scheduler.h
+ * \brief Header file for scheduler.c.
+ **/
+
+#ifndef _TOR_SCHEDULER_H
+#define _TOR_SCHEDULER_H
+
+void scheduler_conn_wants_to_write(or_connection_t *conn);
+void scheduler_conn_release(or_connection_t *conn);
+void scheduler_free_all(void);
+
+#endif
+
@@ -13,6 +13,7 @@
 #include "router.h"
 #include "circuitlist.h"
 #include "main.h"
+#include "relay.h"
 
 /** Return the total number of circuits. */
 static int
@@ -74,6 +75,41 @@ bytes_to_usage(uint64_t bytes)
   return bw_string;
 }
 
+/** Log heartbeat lines summarizing how long cells have waited in circuit
+ * queues, and how long we've taken to process each relay command. */
+static void
+log_cell_latency_heartbeat(void)
+{
+  const latency_histogram_t *h = relay_get_queue_delay_histogram();
+  smartlist_t *elements;
+  int i;
+
+  log_fn(LOG_NOTICE, LD_HEARTBEAT, "Heartbeat: "U64_FORMAT" cells have "
+         "waited in circuit queues. Median wait: at most "U64_FORMAT" msec. "
+         "99th percentile: at most "U64_FORMAT" msec.",
+         U64_PRINTF_ARG(latency_histogram_get_total(h)),
+         U64_PRINTF_ARG(latency_histogram_get_quantile(h, 0.5)),
+         U64_PRINTF_ARG(latency_histogram_get_quantile(h, 0.99)));
+
+  elements = smartlist_new();
+  for (i = 0; (h = relay_get_processing_histogram(i)); ++i) {
+    if (!latency_histogram_get_total(h))
+      continue;
+    smartlist_add_asprintf(elements, "%s "U64_FORMAT,
+                           relay_processing_histogram_name(i),
+                           U64_PRINTF_ARG(latency_histogram_get_quantile(h,
+                                                                  0.99)));
+  }
+  if (smartlist_len(elements)) {
+    char *times = smartlist_join_strings(elements, ", ", 0, NULL);
+    log_fn(LOG_NOTICE, LD_HEARTBEAT, "Heartbeat: 99th percentile relay cell "
+           "processing times are at most (in usec): %s.", times);
+    tor_free(times);
+  }
+  SMARTLIST_FOREACH(elements, char *, cp, tor_free(cp));
+  smartlist_free(elements);
+}
+
 /** Log a "heartbeat" message describing Tor's status and history so that the
  * user can know that there is indeed a running Tor.  Return 0 on success and
  * -1 on failure. */
@@ -106,6 +142,9 @@ log_heartbeat(time_t now)
          "circuits open. I've sent %s and received %s.",
          uptime, count_circuits(),bw_sent,bw_rcvd);
 
+  if (options->CellLatencyHistograms)
+    log_cell_latency_heartbeat();
+
   tor_free(uptime);
   tor_free(bw_sent);
   tor_free(bw_rcvd);
@@ -15,10 +15,12 @@
  * In the ::managed_proxy_list there are ::unconfigured_proxies_n
  * managed proxies that are still unconfigured.
  *
- * In every run_scheduled_event() tick, we attempt to launch and then
- * configure the unconfiged managed proxies, using the configuration
- * protocol defined in the 180_pluggable_transport.txt proposal. A
- * managed proxy might need several ticks to get fully configured.
+ * In every run_scheduled_event() tick, we launch all the unconfigured
+ * managed proxies at once, and then configure them using the
+ * configuration protocol defined in the 180_pluggable_transport.txt
+ * proposal. Where we can, we read a proxy's output as soon as it
+ * arrives rather than on the next tick, so that its transports (and
+ * the bridges that use them) don't have to wait for the slowest proxy.
  *
  * When a managed proxy is fully configured, we register all its
  * transports to the circuitbuild.c subsystem. At that point the
@@ -91,6 +93,14 @@
 #include "util.h"
 #include "router.h"
 
+#ifndef _WIN32
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+#endif
+
 static process_environment_t *
 create_managed_proxy_environment(const managed_proxy_t *mp);
 
@@ -134,6 +144,62 @@ static int unconfigured_proxies_n = 0;
 /** Boolean: True iff we might need to restart some proxies. */
 static int check_if_restarts_needed = 0;
 
+/** List of the inproc_transport_t's that have been registered with
+ * pt_register_inproc_transport(). */
+static smartlist_t *inproc_transport_list = NULL;
+
+/** Register <b>transport</b>, which must stay valid until pt_free_all(),
+ * so that connections to bridges that use a transport with its name use
+ * it instead of a transport proxy.  Return 0 on success, or -1 if a
+ * transport with that name is already registered. */
+int
+pt_register_inproc_transport(const inproc_transport_t *transport)
+{
+  tor_assert(transport);
+  tor_assert(transport->name);
+  tor_assert(transport->conn_new);
+  tor_assert(transport->io.send && transport->io.recv);
+
+  if (pt_get_inproc_transport(transport->name)) {
+    log_warn(LD_GENERAL, "Tried to register in-process transport '%s' "
+             "twice.", transport->name);
+    return -1;
+  }
+  if (!inproc_transport_list)
+    inproc_transport_list = smartlist_new();
+  smartlist_add(inproc_transport_list, (void *)transport);
+  log_info(LD_GENERAL, "Registered in-process transport '%s'.",
+           transport->name);
+  return 0;
+}
+
+/** Return the in-process transport called <b>name</b>, or NULL if there
+ * is none. */
+const inproc_transport_t *
+pt_get_inproc_transport(const char *name)
+{
+  tor_assert(name);
+  if (!inproc_transport_list)
+    return NULL;
+  SMARTLIST_FOREACH(inproc_transport_list, const inproc_transport_t *, t,
+                    if (!strcmp(t->name, name))
+                      return t);
+  return NULL;
+}
+
+/** If <b>addr</b>:<b>port</b> is one of our bridges, and it uses a
+ * transport that we have in-process, return that transport; else return
+ * NULL. */
+const inproc_transport_t *
+pt_get_inproc_transport_for_bridge(const tor_addr_t *addr, uint16_t port)
+{
+  const char *name;
+  if (!inproc_transport_list)
+    return NULL;
+  name = find_transport_name_by_bridge_addrport(addr, port);
+  return name ? pt_get_inproc_transport(name) : NULL;
+}
+
 /** Return true if there are still unconfigured managed proxies, or proxies
  * that need restarting. */
 int
@@ -272,6 +338,35 @@ proxy_prepare_for_restart(managed_proxy_t *mp)
   unconfigured_proxies_n++;
 }
 
+#ifndef _WIN32
+/** Called by libevent when managed proxy <b>arg</b> has written
+ * something to its stdout: continue configuring it. */
+static void
+managed_proxy_stdout_cb(evutil_socket_t fd, short what, void *arg)
+{
+  managed_proxy_t *mp = arg;
+  (void)fd;
+  (void)what;
+
+  tor_assert(!proxy_configuration_finished(mp));
+  configure_proxy(mp);
+}
+#endif
+
+/** Stop listening for output from managed proxy <b>mp</b>. */
+static void
+managed_proxy_stop_reading(managed_proxy_t *mp)
+{
+#ifndef _WIN32
+  if (mp->stdout_event) {
+    tor_event_free(mp->stdout_event);
+    mp->stdout_event = NULL;
+  }
+#else
+  (void)mp;
+#endif
+}
+
 /** Launch managed proxy <b>mp</b>. */
 static int
 launch_managed_proxy(managed_proxy_t *mp)
@@ -306,6 +401,20 @@ launch_managed_proxy(managed_proxy_t *mp)
 
   mp->conf_state = PT_PROTO_LAUNCHED;
 
+#ifndef _WIN32
+  /* Handle the proxy's output as soon as it arrives. If we can't, we'll
+   * still poll it once per second from pt_configure_remaining_proxies(). */
+  tor_assert(!mp->stdout_event);
+  mp->stdout_event = tor_event_new(tor_libevent_get_base(),
+                   fileno(tor_process_get_stdout_pipe(mp->process_handle)),
+                   EV_READ|EV_PERSIST, managed_proxy_stdout_cb, mp);
+  if (!mp->stdout_event || event_add(mp->stdout_event, NULL) < 0) {
+    log_info(LD_GENERAL, "Couldn't listen for output from managed proxy "
+             "'%s'; polling it instead.", mp->argv[0]);
+    managed_proxy_stop_reading(mp);
+  }
+#endif
+
   return 0;
 }
 
@@ -426,13 +535,14 @@ configure_proxy(managed_proxy_t *mp)
   enum stream_status r;
   char stdout_buf[200];
 
-  /* if we haven't launched the proxy yet, do it now */
+  /* if we haven't launched the proxy yet, do it now; then see whether it
+     has already said anything. */
   if (mp->conf_state == PT_PROTO_INFANT) {
     if (launch_managed_proxy(mp) < 0) { /* launch fail */
       mp->conf_state = PT_PROTO_FAILED_LAUNCH;
       handle_finished_proxy(mp);
+      return;
     }
-    return;
   }
 
   tor_assert(mp->conf_state != PT_PROTO_INFANT);
@@ -560,6 +670,7 @@ managed_proxy_destroy(managed_proxy_t *mp,
   /* free the argv */
   free_execve_args(mp->argv);
 
+  managed_proxy_stop_reading(mp);
   tor_process_handle_destroy(mp->process_handle, also_terminate_process);
   mp->process_handle = NULL;
 
@@ -570,6 +681,8 @@ managed_proxy_destroy(managed_proxy_t *mp,
 static void
 handle_finished_proxy(managed_proxy_t *mp)
 {
+  managed_proxy_stop_reading(mp);
+
   switch (mp->conf_state) {
   case PT_PROTO_BROKEN: /* if broken: */
     managed_proxy_destroy(mp, 1); /* annihilate it. */
@@ -580,6 +693,11 @@ handle_finished_proxy(managed_proxy_t *mp)
   case PT_PROTO_CONFIGURED: /* if configured correctly: */
     register_proxy(mp); /* register its transports */
     mp->conf_state = PT_PROTO_COMPLETED; /* and mark it as completed. */
+    /* Bridges that use these transports needn't wait for other
+       proxies. */
+    if (!mp->is_server && get_options()->UseBridges &&
+        !net_is_disabled())
+      fetch_bridge_descriptors(get_options(), time(NULL));
     break;
   case PT_PROTO_INFANT:
   case PT_PROTO_LAUNCHED:
@@ -1191,5 +1309,8 @@ pt_free_all(void)
     smartlist_free(managed_proxy_list);
     managed_proxy_list=NULL;
   }
+
+  smartlist_free(inproc_transport_list);
+  inproc_transport_list = NULL;
 }
 
@@ -28,6 +28,30 @@ void pt_free_all(void);
 void pt_prepare_proxy_list_for_config_read(void);
 void sweep_proxy_list(void);
 
+/** A pluggable transport that runs inside Tor.  Rather than sending our
+ * connections to a bridge through a managed proxy's SOCKS port, which costs
+ * every byte two more trips through loopback sockets, we connect to the
+ * bridge directly and have the transport transform our TLS records as they
+ * go to and from the socket. */
+typedef struct inproc_transport_t {
+  /** The name that Bridge lines use for this transport. */
+  const char *name;
+  /** Return the transport's state for a new connection to the bridge at
+   * <b>addr</b>:<b>port</b>, or NULL if it can't handle one.  The
+   * connection hands the state to <b>io</b>'s functions, and frees it with
+   * io.free. */
+  void *(*conn_new)(const tor_addr_t *addr, uint16_t port);
+  /** How connections using this transport send and receive.  These may
+   * be called from a cpuworker thread while the connection's TLS handshake
+   * is running there, though never for the same connection at once. */
+  tor_tls_io_t io;
+} inproc_transport_t;
+
+int pt_register_inproc_transport(const inproc_transport_t *transport);
+const inproc_transport_t *pt_get_inproc_transport(const char *name);
+const inproc_transport_t *pt_get_inproc_transport_for_bridge(
+                                   const tor_addr_t *addr, uint16_t port);
+
 #ifdef PT_PRIVATE
 /** State of the managed proxy configuration protocol. */
 enum pt_proto_state {
@@ -51,6 +75,12 @@ typedef struct {
   /* A pointer to the process handle of this managed proxy. */
   process_handle_t *process_handle;
 
+#ifndef _WIN32
+  /** While we're configuring this proxy, an event that fires when there's
+   * something to read on its stdout. */
+  struct event *stdout_event;
+#endif
+
   int pid; /* The Process ID this managed proxy is using. */
 
   /** Boolean: We are re-parsing our config, and we are going to
@@ -14,10 +14,28 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define BUFFERS_PRIVATE
+#define CONFIG_PRIVATE
+#define DIRVOTE_PRIVATE
 #define RELAY_PRIVATE
 
 #include "or.h"
+#include "buffers.h"
+#include "circuitbuild.h"
+#include "circuitlist.h"
+#include "config.h"
+#include "connection.h"
+#include "connection_or.h"
+#include "dirvote.h"
+#include "networkstatus.h"
+#include "onion.h"
 #include "relay.h"
+#include "workqueue.h"
+
+/* Our built-in SHA256, which crypto.c uses only with OpenSSLs that lack
+ * one; we include it here so that we can compare it to OpenSSL's. */
+#define LTC_ARGCHK(x) tor_assert(x)
+#include "sha256.c"
 
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
@@ -67,6 +85,24 @@ perftime(void)
 #define NANOCOUNT(start,end,iters) \
   ( ((double)((end)-(start))) / (iters) )
 
+/** True iff we should print results as tab-separated lines, for scripts to
+ * compare, rather than as prose. */
+static int machine_output = 0;
+/** Name of the benchmark that is running now. */
+static const char *current_benchmark = NULL;
+
+/** Report that the measurement called <b>what</b> came out at <b>value</b>
+ * <b>unit</b>.  With --machine, print the benchmark name, <b>what</b>,
+ * <b>value</b> and <b>unit</b> separated by tabs. */
+static void
+bench_report(const char *what, double value, const char *unit)
+{
+  if (machine_output)
+    printf("%s\t%s\t%.2f\t%s\n", current_benchmark, what, value, unit);
+  else
+    printf("%s: %.2f %s\n", what, value, unit);
+}
+
 /** Run AES performance benchmarks. */
 static void
 bench_aes(void)
@@ -76,6 +112,7 @@ bench_aes(void)
   crypto_cipher_t *c;
   uint64_t start, end;
   const int bytes_per_iter = (1<<24);
+  char label[32];
   reset_perftime();
   c = crypto_cipher_new(NULL);
 
@@ -90,8 +127,8 @@ bench_aes(void)
     end = perftime();
     tor_free(b1);
     tor_free(b2);
-    printf("%d bytes: %.2f nsec per byte\n", len,
-           NANOCOUNT(start, end, iters*len));
+    tor_snprintf(label, sizeof(label), "%d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
   }
   crypto_cipher_free(c);
 }
@@ -106,6 +143,7 @@ bench_cell_aes(void)
   char *b = tor_malloc(len+max_misalign);
   crypto_cipher_t *c;
   int i, misalign;
+  char label[64];
 
   c = crypto_cipher_new(NULL);
 
@@ -116,14 +154,441 @@ bench_cell_aes(void)
       crypto_cipher_crypt_inplace(c, b+misalign, len);
     }
     end = perftime();
-    printf("%d bytes, misaligned by %d: %.2f nsec per byte\n", len, misalign,
-           NANOCOUNT(start, end, iters*len));
+    tor_snprintf(label, sizeof(label), "%d bytes, misaligned by %d",
+                 len, misalign);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
   }
 
   crypto_cipher_free(c);
   tor_free(b);
 }
 
+/** Compare digesting and crypting a relay cell payload in separate passes
+ * to doing it with one call to the crypto_cipher_*_inplace() functions. */
+static void
+bench_cell_digest(void)
+{
+  uint64_t start, end;
+  const int len = 509;
+  const int iters = (1<<16);
+  char b[509], mac[4];
+  crypto_cipher_t *c = crypto_cipher_new(NULL);
+  crypto_digest_t *d = crypto_digest_new();
+  int i;
+
+  crypto_rand(b, sizeof(b));
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_digest_add_bytes(d, b, len);
+    crypto_digest_get_digest(d, mac, 4);
+    memcpy(b+5, mac, 4);
+    crypto_cipher_crypt_inplace(c, b, len);
+  }
+  end = perftime();
+  bench_report("Digest, then encrypt", NANOCOUNT(start, end, iters),
+               "ns per cell");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    crypto_cipher_digest_and_encrypt_inplace(c, d, b, len, 5, 4);
+  end = perftime();
+  bench_report("Digest and encrypt in one call", NANOCOUNT(start, end, iters),
+               "ns per cell");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    crypto_cipher_crypt_inplace(c, b, len);
+    memcpy(mac, b+5, 4);
+    memset(b+5, 0, 4);
+    crypto_digest_add_bytes_if_matches(d, b, len, mac, 4);
+  }
+  end = perftime();
+  bench_report("Decrypt, then check digest", NANOCOUNT(start, end, iters),
+               "ns per cell");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    /* (Pretend that every cell might be recognized.) */
+    crypto_cipher_decrypt_and_check_inplace(c, d, b, len, 1, 0, 5, 4);
+  }
+  end = perftime();
+  bench_report("Decrypt and check digest in one call",
+               NANOCOUNT(start, end, iters), "ns per cell");
+
+  crypto_cipher_free(c);
+  crypto_digest_free(d);
+}
+
+/** Run benchmarks for our random number generator. */
+static void
+bench_rand(void)
+{
+  uint64_t start, end;
+  const int iters = (1<<18);
+  char b[20];
+  volatile double d = 0;
+  int i, total = 0;
+
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    total += crypto_rand_int(1000);
+  end = perftime();
+  bench_report("crypto_rand_int", NANOCOUNT(start, end, iters),
+               "ns per call");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    d += crypto_rand_double();
+  end = perftime();
+  bench_report("crypto_rand_double", NANOCOUNT(start, end, iters),
+               "ns per call");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    crypto_rand(b, sizeof(b));
+  end = perftime();
+  bench_report("crypto_rand, 20 bytes", NANOCOUNT(start, end, iters),
+               "ns per call");
+  (void)total;
+}
+
+/** Run RSA signing and signature checking benchmarks. */
+static void
+bench_rsa(void)
+{
+  static const int key_bits[] = { 1024, 2048 };
+  uint64_t start, end;
+  char digest[DIGEST_LEN], sig[256], out[256], label[64];
+  int i, k;
+
+  crypto_rand(digest, sizeof(digest));
+  for (k = 0; k < 2; ++k) {
+    const int bits = key_bits[k];
+    const int iters = (1<<16) / bits;
+    crypto_pk_t *pk = crypto_pk_new();
+    if (crypto_pk_generate_key_with_bits(pk, bits) < 0) {
+      printf("Couldn't generate a %d-bit key.\n", bits);
+      crypto_pk_free(pk);
+      continue;
+    }
+    reset_perftime();
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      crypto_pk_private_sign(pk, sig, sizeof(sig), digest, DIGEST_LEN);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "RSA-%d sign", bits);
+    bench_report(label, NANOCOUNT(start, end, iters) / 1000, "usec per op");
+
+    start = perftime();
+    for (i = 0; i < iters * 16; ++i)
+      crypto_pk_public_checksig(pk, out, sizeof(out), sig, bits / 8);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "RSA-%d verify", bits);
+    bench_report(label, NANOCOUNT(start, end, iters * 16) / 1000,
+                 "usec per op");
+
+    crypto_pk_free(pk);
+  }
+}
+
+/** Run Diffie-Hellman benchmarks. */
+static void
+bench_dh(void)
+{
+  uint64_t start, end;
+  const int iters = 1<<8;
+  char pub[DH_BYTES], secret[DIGEST_LEN];
+  crypto_dh_t *dh_a, *dh_b = crypto_dh_new(DH_TYPE_CIRCUIT);
+  int i;
+
+  crypto_dh_get_public(dh_b, pub, sizeof(pub));
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    dh_a = crypto_dh_new(DH_TYPE_CIRCUIT);
+    crypto_dh_generate_public(dh_a);
+    crypto_dh_free(dh_a);
+  }
+  end = perftime();
+  bench_report("DH generate", NANOCOUNT(start, end, iters) / 1000,
+               "usec per op");
+
+  dh_a = crypto_dh_new(DH_TYPE_CIRCUIT);
+  crypto_dh_generate_public(dh_a);
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    crypto_dh_compute_secret(LOG_WARN, dh_a, pub, sizeof(pub),
+                             secret, sizeof(secret));
+  end = perftime();
+  bench_report("DH compute", NANOCOUNT(start, end, iters) / 1000,
+               "usec per op");
+
+  crypto_dh_free(dh_a);
+  crypto_dh_free(dh_b);
+}
+
+/** Run SHA1, SHA256 and HMAC benchmarks over a range of input sizes. */
+static void
+bench_digest(void)
+{
+  static const int lens[] = { 20, 64, 509, 4096, 65536 };
+  const int bytes_per_iter = (1<<24);
+  char out[DIGEST256_LEN], key[DIGEST_LEN], label[64];
+  char *buf = tor_malloc(65536);
+  uint64_t start, end;
+  int i, l;
+
+  crypto_rand(buf, 65536);
+  crypto_rand(key, sizeof(key));
+  reset_perftime();
+
+  for (l = 0; l < (int)(sizeof(lens)/sizeof(lens[0])); ++l) {
+    const int len = lens[l];
+    const int iters = bytes_per_iter / len;
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      crypto_digest(out, buf, len);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "SHA1, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      crypto_digest256(out, buf, len, DIGEST_SHA256);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "SHA256, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      sha256_state st;
+      sha256_init(&st);
+      sha256_process(&st, (const unsigned char*)buf, len);
+      sha256_done(&st, (unsigned char*)out);
+    }
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "Built-in SHA256, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      crypto_hmac_sha1(out, key, sizeof(key), buf, len);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "HMAC-SHA1, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      crypto_hmac_sha256(out, key, sizeof(key), buf, len);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "HMAC-SHA256, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters*len), "nsec per byte");
+  }
+
+  tor_free(buf);
+}
+
+/** Run benchmarks for the data-independent comparison functions. */
+static void
+bench_di_ops(void)
+{
+  static const int lens[] = { 4, 20, 32, 509 };
+  const int iters = 1<<22;
+  char buf1[512], buf2[512], label[64];
+  uint64_t start, end;
+  int i, l, total = 0;
+
+  crypto_rand(buf1, sizeof(buf1));
+  memcpy(buf2, buf1, sizeof(buf2));
+  reset_perftime();
+
+  for (l = 0; l < (int)(sizeof(lens)/sizeof(lens[0])); ++l) {
+    const int len = lens[l];
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      total += tor_memeq(buf1, buf2, len);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "tor_memeq, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters), "nsec per call");
+
+    start = perftime();
+    for (i = 0; i < iters; ++i)
+      total += tor_memcmp(buf1, buf2, len);
+    end = perftime();
+    tor_snprintf(label, sizeof(label), "tor_memcmp, %d bytes", len);
+    bench_report(label, NANOCOUNT(start, end, iters), "nsec per call");
+  }
+  /* Keep the compiler from throwing the calls away. */
+  if (total == 42)
+    puts("");
+}
+
+/** Run base64 and base32 encoding and decoding benchmarks. */
+static void
+bench_encoding(void)
+{
+  /* A multiple of 5 bytes, so that base32 needs no padding. */
+  const int len = 1000;
+  const int iters = 1<<12;
+  char raw[1000], back[2048], encoded[2048];
+  uint64_t start, end;
+  int i, enc_len = 0;
+
+  crypto_rand(raw, sizeof(raw));
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    enc_len = base64_encode(encoded, sizeof(encoded), raw, len);
+  end = perftime();
+  bench_report("base64 encode", NANOCOUNT(start, end, iters*len),
+               "nsec per byte");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    base64_decode(back, sizeof(back), encoded, enc_len);
+  end = perftime();
+  bench_report("base64 decode", NANOCOUNT(start, end, iters*len),
+               "nsec per byte");
+
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    base32_encode(encoded, sizeof(encoded), raw, len);
+  end = perftime();
+  bench_report("base32 encode", NANOCOUNT(start, end, iters*len),
+               "nsec per byte");
+
+  enc_len = len * 8 / 5;
+  start = perftime();
+  for (i = 0; i < iters; ++i)
+    base32_decode(back, sizeof(back), encoded, enc_len);
+  end = perftime();
+  bench_report("base32 decode", NANOCOUNT(start, end, iters*len),
+               "nsec per byte");
+}
+
+/** Make a connected pair of tor_tls_t objects over a socketpair, and run
+ * their handshake.  Return 0 on success, -1 on failure. */
+static int
+bench_tls_open_pair(tor_socket_t *fds, tor_tls_t **client_out,
+                    tor_tls_t **server_out)
+{
+  tor_tls_t *client = NULL, *server = NULL;
+  int c = TOR_TLS_WANTREAD, s = TOR_TLS_WANTREAD, i;
+
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+    goto err;
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  if (!(client = tor_tls_new(fds[0], 0)) ||
+      !(server = tor_tls_new(fds[1], 1)))
+    goto err;
+
+  for (i = 0; i < 100 && (c != TOR_TLS_DONE || s != TOR_TLS_DONE); ++i) {
+    if (c != TOR_TLS_DONE)
+      c = tor_tls_handshake(client);
+    if (s != TOR_TLS_DONE)
+      s = tor_tls_handshake(server);
+    if (c < TOR_TLS_WANTREAD || s < TOR_TLS_WANTREAD)
+      goto err;
+  }
+  if (c != TOR_TLS_DONE || s != TOR_TLS_DONE)
+    goto err;
+
+  *client_out = client;
+  *server_out = server;
+  return 0;
+ err:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (fds[0] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[0]);
+  if (fds[1] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[1]);
+  return -1;
+}
+
+/** Run benchmarks for TLS handshakes, and for sending cells as TLS records,
+ * between two tor_tls_t objects in this process. */
+static void
+bench_tls(void)
+{
+  const int n_handshakes = 32;
+  const size_t total_bytes = (1<<24);
+  crypto_pk_t *identity = crypto_pk_new();
+  tor_socket_t fds[2];
+  tor_tls_t *client = NULL, *server = NULL;
+  char cell[CELL_NETWORK_SIZE], buf[4096];
+  uint64_t start, end;
+  size_t n_read = 0;
+  int i, r;
+
+  if (crypto_pk_generate_key(identity) < 0 ||
+      tor_tls_context_init(1, identity, identity, 86400) < 0) {
+    printf("Couldn't set up TLS contexts.\n");
+    goto done;
+  }
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < n_handshakes; ++i) {
+    if (bench_tls_open_pair(fds, &client, &server) < 0) {
+      printf("Couldn't complete a TLS handshake.\n");
+      goto done;
+    }
+    if (i == n_handshakes - 1)
+      break; /* Keep the last pair for the throughput test. */
+    tor_tls_free(client);
+    tor_tls_free(server);
+    client = server = NULL;
+    tor_close_socket(fds[0]);
+    tor_close_socket(fds[1]);
+  }
+  end = perftime();
+  bench_report("TLS handshake, both sides",
+               NANOCOUNT(start, end, n_handshakes) / 1000, "usec per op");
+
+  crypto_rand(cell, sizeof(cell));
+  start = perftime();
+  while (n_read < total_bytes) {
+    /* Fill the socket with cells, then drain it. */
+    for (i = 0; i < 32; ++i) {
+      r = tor_tls_write(client, cell, sizeof(cell));
+      if (r == TOR_TLS_WANTWRITE)
+        break;
+      if (r < 0)
+        goto io_err;
+    }
+    while ((r = tor_tls_read(server, buf, sizeof(buf))) > 0)
+      n_read += r;
+    if (r != TOR_TLS_WANTREAD)
+      goto io_err;
+  }
+  end = perftime();
+  bench_report("TLS records, one cell each", NANOCOUNT(start, end, n_read),
+               "nsec per byte");
+  goto close;
+
+ io_err:
+  printf("TLS connection failed while sending cells.\n");
+ close:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+ done:
+  crypto_pk_free(identity);
+}
+
 /** Run digestmap_t performance benchmarks. */
 static void
 bench_dmap(void)
@@ -147,7 +612,7 @@ bench_dmap(void)
     crypto_rand(d, 20);
     smartlist_add(sl2, tor_memdup(d, 20));
   }
-  printf("nbits=%d\n", ds->mask+1);
+  printf("nbits=%d\n", (int)ds->n_blocks * DIGESTSET_BLOCK_WORDS * 32);
 
   reset_perftime();
 
@@ -248,6 +713,1003 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Number of relays on the circuit that bench_relay_path() builds. */
+#define BENCH_N_HOPS 3
+/** Number of nodes on that circuit: the client, then each relay. */
+#define BENCH_N_NODES (BENCH_N_HOPS+1)
+/** Most cells we flush onto an outbuf between moving it to the peer's
+ * inbuf: few enough that connection_write_to_buf() never decides to flush
+ * the outbuf to the (nonexistent) socket itself. */
+#define BENCH_FLUSH_CELLS 16
+
+/** The simulated network that bench_relay_path() runs over.  Node 0 is the
+ * client, and node BENCH_N_HOPS is the exit.  Node <b>k</b> talks to node
+ * <b>k</b>+1 over toward_exit[k], and node <b>k</b>+1 hears it on
+ * toward_client[k+1], and vice versa.  Nothing reads or writes a socket:
+ * we move bytes from each outbuf to the peer's inbuf ourselves. */
+typedef struct bench_net_t {
+  or_connection_t *toward_exit[BENCH_N_NODES];
+  or_connection_t *toward_client[BENCH_N_NODES];
+  origin_circuit_t *client;
+  or_circuit_t *hops[BENCH_N_NODES];
+  /** CPU time spent at each node so far, in nsec. */
+  uint64_t node_nsec[BENCH_N_NODES];
+} bench_net_t;
+
+/** Return a new open OR connection that isn't attached to any socket. */
+static or_connection_t *
+bench_orconn_new(void)
+{
+  or_connection_t *conn = or_connection_new(AF_INET);
+  conn->_base.state = OR_CONN_STATE_OPEN;
+  conn->link_proto = 3;
+  return conn;
+}
+
+/** Give <b>circ</b> the relay crypto state for <b>keys</b>, as
+ * onionskin_answer() would. */
+static void
+bench_or_circuit_init_crypto(or_circuit_t *circ, const char *keys)
+{
+  crypt_path_t tmp;
+  memset(&tmp, 0, sizeof(tmp));
+  tor_assert(circuit_init_cpath_crypto(&tmp, keys, 0) == 0);
+  circ->n_digest = tmp.f_digest;
+  circ->n_crypto = tmp.f_crypto;
+  circ->p_digest = tmp.b_digest;
+  circ->p_crypto = tmp.b_crypto;
+}
+
+/** Build the circuit for bench_relay_path() in <b>net</b>. */
+static void
+bench_net_setup(bench_net_t *net)
+{
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  crypt_path_t *prev = NULL;
+  int k;
+
+  memset(net, 0, sizeof(*net));
+  for (k = 0; k < BENCH_N_HOPS; ++k) {
+    net->toward_exit[k] = bench_orconn_new();
+    net->toward_client[k+1] = bench_orconn_new();
+  }
+
+  net->client = origin_circuit_new();
+  net->client->_base.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  net->client->_base.state = CIRCUIT_STATE_OPEN;
+  /* Every cell we send should be a plain RELAY cell. */
+  net->client->remaining_relay_early_cells = 0;
+  circuit_set_n_circid_orconn(TO_CIRCUIT(net->client), 100,
+                              net->toward_exit[0]);
+
+  for (k = 1; k <= BENCH_N_HOPS; ++k) {
+    crypt_path_t *hop = tor_malloc_zero(sizeof(crypt_path_t));
+    or_circuit_t *circ;
+
+    crypto_rand(keys, sizeof(keys));
+    hop->magic = CRYPT_PATH_MAGIC;
+    hop->state = CPATH_STATE_OPEN;
+    hop->package_window = circuit_initial_package_window();
+    hop->deliver_window = CIRCWINDOW_START;
+    tor_assert(circuit_init_cpath_crypto(hop, keys, 0) == 0);
+    if (prev) {
+      prev->next = hop;
+      hop->prev = prev;
+    } else {
+      net->client->cpath = hop;
+    }
+    prev = hop;
+
+    circ = or_circuit_new(99+k, net->toward_client[k]);
+    circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+    circ->_base.state = CIRCUIT_STATE_OPEN;
+    bench_or_circuit_init_crypto(circ, keys);
+    if (k < BENCH_N_HOPS)
+      circuit_set_n_circid_orconn(TO_CIRCUIT(circ), 100+k,
+                                  net->toward_exit[k]);
+    net->hops[k] = circ;
+  }
+  /* Close the cpath ring. */
+  prev->next = net->client->cpath;
+  net->client->cpath->prev = prev;
+  memset(keys, 0, sizeof(keys));
+}
+
+/** Free everything in <b>net</b>. */
+static void
+bench_net_free(bench_net_t *net)
+{
+  int k;
+  circuit_free_all();
+  for (k = 0; k < BENCH_N_NODES; ++k) {
+    if (net->toward_exit[k])
+      connection_free(TO_CONN(net->toward_exit[k]));
+    if (net->toward_client[k])
+      connection_free(TO_CONN(net->toward_client[k]));
+  }
+}
+
+/** Move every cell queued on the circuits of <b>conn</b> onto the inbuf of
+ * <b>peer</b>, by way of <b>conn</b>'s outbuf. */
+static void
+bench_net_flush(or_connection_t *conn, or_connection_t *peer)
+{
+  time_t now = approx_time();
+  do {
+    size_t len;
+    connection_or_flush_from_first_active_circuit(conn, BENCH_FLUSH_CELLS,
+                                                  now);
+    len = buf_datalen(conn->_base.outbuf);
+    move_buf_to_buf(peer->_base.inbuf, conn->_base.outbuf, &len);
+    conn->_base.outbuf_flushlen = 0;
+  } while (conn->active_circuits);
+}
+
+/** Carry every cell that's waiting at the client (if <b>outbound</b>) or at
+ * the exit all the way to the other end of the circuit in <b>net</b>, one
+ * node at a time. */
+static void
+bench_net_pump(bench_net_t *net, int outbound)
+{
+  int i;
+  for (i = 0; i < BENCH_N_NODES; ++i) {
+    int k = outbound ? i : BENCH_N_HOPS - i;
+    uint64_t start = perftime();
+    if (outbound) {
+      if (k > 0)
+        connection_or_process_inbuf(net->toward_client[k]);
+      if (k < BENCH_N_HOPS)
+        bench_net_flush(net->toward_exit[k], net->toward_client[k+1]);
+    } else {
+      if (k < BENCH_N_HOPS)
+        connection_or_process_inbuf(net->toward_exit[k]);
+      if (k > 0)
+        bench_net_flush(net->toward_client[k], net->toward_exit[k-1]);
+    }
+    net->node_nsec[k] += perftime() - start;
+  }
+}
+
+/** Run cells end to end through a 3-hop circuit, from the OR connection
+ * inbuf at each relay through command_process_cell(), relay crypto, the
+ * circuit cell queues and the flush to the next outbuf.  Report
+ * throughput, CPU per cell at each node, and the time from when a batch
+ * of cells is queued at one end until the last of it arrives at the
+ * other. */
+static void
+bench_relay_path(void)
+{
+  static const struct {
+    const char *name;
+    int outbound; /* true to send from the client; false, from the exit */
+    int batch; /* how many cells we queue before we carry them across */
+    int n_cells;
+  } scenarios[] = {
+    { "bulk upload", 1, 256, 1<<15 },
+    { "bulk download", 0, 256, 1<<15 },
+    { "interactive", 1, 1, 1<<12 },
+    { "interactive download", 0, 1, 1<<12 },
+  };
+  static const char *node_names[BENCH_N_NODES] = {
+    "client", "guard", "middle", "exit"
+  };
+  char payload[RELAY_PAYLOAD_SIZE];
+  int i, j, k;
+
+  if (!tor_libevent_get_base()) {
+    /* The scheduler wants an event base to schedule its run on, even
+     * though we never run it. */
+    tor_libevent_cfg cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    tor_libevent_initialize(&cfg);
+  }
+  init_cell_pool();
+  crypto_rand(payload, sizeof(payload));
+  update_approx_time(time(NULL));
+  reset_perftime();
+
+  for (i = 0; i < (int)(sizeof(scenarios)/sizeof(scenarios[0])); ++i) {
+    bench_net_t net;
+    circuit_t *sender;
+    crypt_path_t *layer;
+    uint64_t delivered_before = stats_n_relay_cells_delivered;
+    uint64_t total_nsec = 0, elapsed;
+    int n_batches = scenarios[i].n_cells / scenarios[i].batch;
+    char *label;
+
+    bench_net_setup(&net);
+    if (scenarios[i].outbound) {
+      sender = TO_CIRCUIT(net.client);
+      layer = net.client->cpath->prev;
+    } else {
+      sender = TO_CIRCUIT(net.hops[BENCH_N_HOPS]);
+      layer = NULL;
+    }
+
+    for (j = 0; j < n_batches; ++j) {
+      uint64_t start = perftime();
+      for (k = 0; k < scenarios[i].batch; ++k)
+        relay_send_command_from_edge(0, sender, RELAY_COMMAND_DROP,
+                                     payload, sizeof(payload), layer);
+      elapsed = perftime() - start;
+      net.node_nsec[scenarios[i].outbound ? 0 : BENCH_N_HOPS] += elapsed;
+      bench_net_pump(&net, scenarios[i].outbound);
+      total_nsec += perftime() - start;
+    }
+
+    if (stats_n_relay_cells_delivered - delivered_before !=
+        (uint64_t)scenarios[i].n_cells)
+      printf("%s: only %d of %d cells arrived!\n", scenarios[i].name,
+             (int)(stats_n_relay_cells_delivered - delivered_before),
+             scenarios[i].n_cells);
+
+    tor_asprintf(&label, "%s, %d-cell batches: throughput",
+                 scenarios[i].name, scenarios[i].batch);
+    bench_report(label,
+                 scenarios[i].n_cells / (total_nsec / 1e9), "cells/sec");
+    tor_free(label);
+    for (k = 0; k < BENCH_N_NODES; ++k) {
+      tor_asprintf(&label, "%s, %d-cell batches: %s CPU",
+                   scenarios[i].name, scenarios[i].batch, node_names[k]);
+      bench_report(label,
+                   NANOCOUNT(0, net.node_nsec[k], scenarios[i].n_cells),
+                   "ns/cell");
+      tor_free(label);
+    }
+    tor_asprintf(&label, "%s, %d-cell batches: latency",
+                 scenarios[i].name, scenarios[i].batch);
+    bench_report(label, NANOCOUNT(0, total_nsec, n_batches)/1e3,
+                 "usec/batch");
+    tor_free(label);
+
+    bench_net_free(&net);
+  }
+  free_cell_pool();
+}
+
+/** Print how long each of <b>iters</b> handshakes named <b>name</b> took,
+ * given that they ran from <b>start</b> to <b>end</b> nsec. */
+static void
+print_handshake_rate(const char *name, uint64_t start, uint64_t end,
+                     int iters)
+{
+  double nsec = NANOCOUNT(start, end, iters);
+  printf("%s: %.2f usec per handshake, %.0f handshakes per second\n",
+         name, nsec / 1000, 1e9 / nsec);
+}
+
+/** Run circuit handshake benchmarks in this thread: make a batch of
+ * onionskins, answer them, and finish them, as a client, a relay, and then
+ * the client again would.  Also time CREATE_FAST handshakes. */
+static void
+bench_onion_handshakes(void)
+{
+  const int iters = 1<<8;
+  const int fast_iters = 1<<16;
+  crypto_pk_t *key = crypto_pk_new();
+  crypto_dh_t **states = tor_malloc_zero(iters * sizeof(crypto_dh_t *));
+  char *skins = tor_malloc(iters * ONIONSKIN_CHALLENGE_LEN);
+  char *replies = tor_malloc(iters * ONIONSKIN_REPLY_LEN);
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  uint8_t fast_key[DIGEST_LEN], fast_reply[DIGEST_LEN*2];
+  uint64_t start, end;
+  int i;
+
+  tor_assert(crypto_pk_generate_key(key) == 0);
+  crypto_rand((char*)fast_key, sizeof(fast_key));
+  reset_perftime();
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_assert(onion_skin_create(key, &states[i],
+                                 skins + i*ONIONSKIN_CHALLENGE_LEN) == 0);
+  }
+  end = perftime();
+  print_handshake_rate("onion_skin_create", start, end, iters);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_assert(onion_skin_server_handshake(skins + i*ONIONSKIN_CHALLENGE_LEN,
+                                           key, NULL,
+                                           replies + i*ONIONSKIN_REPLY_LEN,
+                                           keys, sizeof(keys)) == 0);
+  }
+  end = perftime();
+  print_handshake_rate("onion_skin_server_handshake", start, end, iters);
+
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    tor_assert(onion_skin_client_handshake(states[i],
+                                           replies + i*ONIONSKIN_REPLY_LEN,
+                                           keys, sizeof(keys)) == 0);
+  }
+  end = perftime();
+  print_handshake_rate("onion_skin_client_handshake", start, end, iters);
+
+  start = perftime();
+  for (i = 0; i < fast_iters; ++i) {
+    tor_assert(fast_server_handshake(fast_key, fast_reply,
+                                     (uint8_t*)keys, sizeof(keys)) == 0);
+  }
+  end = perftime();
+  print_handshake_rate("fast_server_handshake", start, end, fast_iters);
+
+  for (i = 0; i < iters; ++i)
+    crypto_dh_free(states[i]);
+  tor_free(states);
+  tor_free(skins);
+  tor_free(replies);
+  crypto_pk_free(key);
+}
+
+#ifdef USE_PTHREADS
+/** Shared state for bench_onion_handshake_threads().  The lock protects
+ * handshake_threads_running; the rest is read-only while threads run.
+ * @{ */
+static tor_mutex_t *handshake_threads_lock = NULL;
+static tor_cond_t *handshake_threads_cond = NULL;
+static int handshake_threads_running = 0;
+static crypto_pk_t *handshake_threads_key = NULL;
+static const char *handshake_threads_skin = NULL;
+static int handshake_threads_iters = 0;
+/**@}*/
+
+/** Body of each thread in bench_onion_handshake_threads(): answer the
+ * same onionskin handshake_threads_iters times, as a cpuworker thread
+ * would. */
+static void
+handshake_thread_main(void *arg)
+{
+  char reply[ONIONSKIN_REPLY_LEN];
+  char keys[CPATH_KEY_MATERIAL_LEN];
+  int i;
+  (void)arg;
+
+  for (i = 0; i < handshake_threads_iters; ++i) {
+    tor_assert(onion_skin_server_handshake(handshake_threads_skin,
+                                           handshake_threads_key, NULL,
+                                           reply, keys, sizeof(keys)) == 0);
+  }
+  tor_mutex_acquire(handshake_threads_lock);
+  --handshake_threads_running;
+  tor_cond_signal_one(handshake_threads_cond);
+  tor_mutex_release(handshake_threads_lock);
+  crypto_thread_cleanup();
+  spawn_exit();
+}
+
+/** Measure how onion_skin_server_handshake() throughput scales when we run
+ * it in 1, 2, 4, ... threads, up to the number of CPUs, sharing one onion
+ * key the way the cpuworker threads do.  Unlike the other benchmarks, this
+ * reports wall-clock rates. */
+static void
+bench_onion_handshake_threads(void)
+{
+  const int iters = 1<<7;
+  int n_cpus = compute_num_cpus();
+  char skin[ONIONSKIN_CHALLENGE_LEN];
+  crypto_dh_t *state = NULL;
+  int n_threads, i;
+
+  if (n_cpus < 1)
+    n_cpus = 1;
+  handshake_threads_key = crypto_pk_new();
+  tor_assert(crypto_pk_generate_key(handshake_threads_key) == 0);
+  tor_assert(onion_skin_create(handshake_threads_key, &state, skin) == 0);
+  handshake_threads_skin = skin;
+  handshake_threads_iters = iters;
+  handshake_threads_lock = tor_mutex_new();
+  handshake_threads_cond = tor_cond_new();
+
+  for (n_threads = 1; ; n_threads *= 2) {
+    struct timeval start, end;
+    long usec;
+    if (n_threads > n_cpus)
+      n_threads = n_cpus;
+
+    tor_gettimeofday(&start);
+    tor_mutex_acquire(handshake_threads_lock);
+    for (i = 0; i < n_threads; ++i) {
+      tor_assert(spawn_func(handshake_thread_main, NULL) == 0);
+      ++handshake_threads_running;
+    }
+    while (handshake_threads_running)
+      tor_cond_wait(handshake_threads_cond, handshake_threads_lock);
+    tor_mutex_release(handshake_threads_lock);
+    tor_gettimeofday(&end);
+
+    usec = tv_udiff(&start, &end);
+    printf("%d threads: %.0f onion_skin_server_handshakes per second\n",
+           n_threads, 1e6 * n_threads * iters / usec);
+    if (n_threads == n_cpus)
+      break;
+  }
+
+  tor_cond_free(handshake_threads_cond);
+  tor_mutex_free(handshake_threads_lock);
+  crypto_pk_free(handshake_threads_key);
+  crypto_dh_free(state);
+}
+
+/** Work function for bench_workqueue(): almost nothing, so that we measure
+ * the cost of the queues themselves. */
+static void
+bench_workqueue_work(void *state, void *arg)
+{
+  (void)state;
+  ++*(int*)arg;
+}
+
+/** Number of replies bench_workqueue() has seen. */
+static int bench_workqueue_n_replies = 0;
+
+/** Reply function for bench_workqueue(). */
+static void
+bench_workqueue_reply(void *arg)
+{
+  (void)arg;
+  ++bench_workqueue_n_replies;
+}
+
+/** Measure how many trivial jobs per second make the round trip through a
+ * threadpool_t and back to the main thread, keeping up to 64 jobs in
+ * flight. */
+static void
+bench_workqueue(void)
+{
+  const int n_jobs = 100000;
+  const int max_pending = 64;
+  int counters[64];
+  int n_threads, n_queued;
+  replyqueue_t *rq = replyqueue_new();
+  tor_assert(rq);
+
+  for (n_threads = 1; n_threads <= 4; n_threads *= 2) {
+    struct timeval start, end;
+    long usec;
+    threadpool_t *pool = threadpool_new(n_threads, max_pending, rq,
+                                        NULL, NULL, NULL);
+    tor_assert(pool);
+    bench_workqueue_n_replies = n_queued = 0;
+
+    tor_gettimeofday(&start);
+    while (bench_workqueue_n_replies < n_jobs) {
+      while (n_queued < n_jobs &&
+             n_queued - bench_workqueue_n_replies < max_pending &&
+             threadpool_queue_work(pool, bench_workqueue_work,
+                                   bench_workqueue_reply,
+                                   &counters[n_queued % max_pending]))
+        ++n_queued;
+      replyqueue_process(rq);
+    }
+    tor_gettimeofday(&end);
+    threadpool_free(pool);
+
+    usec = tv_udiff(&start, &end);
+    printf("%d threads: %.0f jobs per second\n",
+           n_threads, 1e6 * n_jobs / usec);
+  }
+  replyqueue_free(rq);
+}
+#endif
+
+/** Run the same relay-like workload through buf_t and (when built with
+ * bufferevents) evbuffer: fill an inbuf a cell at a time, move its contents
+ * to an outbuf as a linked connection would, then drain the outbuf in
+ * large reads. */
+static void
+bench_buffers(void)
+{
+  const int iters = 1<<10;
+  const int cells_per_iter = 64;
+  const size_t drain_len = 4096;
+  char cell[CELL_NETWORK_SIZE];
+  char *drain = tor_malloc(drain_len);
+  uint64_t start, end;
+  int i, j;
+  buf_t *inbuf, *outbuf;
+#ifdef USE_BUFFEREVENTS
+  struct evbuffer *ev_in, *ev_out;
+#endif
+
+  crypto_rand(cell, sizeof(cell));
+
+  inbuf = buf_new();
+  outbuf = buf_new();
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    size_t len;
+    for (j = 0; j < cells_per_iter; ++j)
+      write_to_buf(cell, sizeof(cell), inbuf);
+    len = buf_datalen(inbuf);
+    move_buf_to_buf(outbuf, inbuf, &len);
+    while (buf_datalen(outbuf))
+      fetch_from_buf(drain, drain_len, outbuf);
+  }
+  end = perftime();
+  printf("buf_t: %.2f ns per cell (%.2f ns per byte)\n",
+         NANOCOUNT(start, end, iters*cells_per_iter),
+         NANOCOUNT(start, end, iters*cells_per_iter*CELL_NETWORK_SIZE));
+  buf_free(inbuf);
+  buf_free(outbuf);
+
+#ifdef USE_BUFFEREVENTS
+  ev_in = evbuffer_new();
+  ev_out = evbuffer_new();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    for (j = 0; j < cells_per_iter; ++j)
+      evbuffer_add(ev_in, cell, sizeof(cell));
+    evbuffer_add_buffer(ev_out, ev_in);
+    while (evbuffer_get_length(ev_out))
+      evbuffer_remove(ev_out, drain, drain_len);
+  }
+  end = perftime();
+  printf("evbuffer: %.2f ns per cell (%.2f ns per byte)\n",
+         NANOCOUNT(start, end, iters*cells_per_iter),
+         NANOCOUNT(start, end, iters*cells_per_iter*CELL_NETWORK_SIZE));
+  evbuffer_free(ev_in);
+  evbuffer_free(ev_out);
+#else
+  puts("evbuffer: not built with --enable-bufferevents; skipped.");
+#endif
+
+  tor_free(drain);
+}
+
+/** Print how often each buffer chunk size class has been able to hand out
+ * a chunk without allocating a new slab. */
+static void
+print_chunk_class_hit_ratios(void)
+{
+  int i;
+  size_t alloc_size;
+  uint64_t n_alloc, n_slabs;
+  for (i = 0;
+       buf_get_chunk_class_counts(i, &alloc_size, &n_alloc, &n_slabs) == 0;
+       ++i) {
+    if (!n_alloc)
+      continue;
+    printf("  %5d-byte chunks: "U64_FORMAT" allocations, "U64_FORMAT
+           " new slabs, %.2f%% hit ratio\n",
+           (int)alloc_size, U64_PRINTF_ARG(n_alloc), U64_PRINTF_ARG(n_slabs),
+           100.0 * (double)(n_alloc - n_slabs) / (double)n_alloc);
+  }
+}
+
+/** Measure write_to_buf() and fetch_from_buf() throughput, and their
+ * evbuffer equivalents, for several write sizes. */
+static void
+bench_buffer_rw(void)
+{
+  static const size_t sizes[] = { 64, 512, 4096, 16384, 0 };
+  const size_t total = 1<<20;
+  const int iters = 64;
+  char *data = tor_malloc(16384);
+  uint64_t start, end;
+  int i, s;
+  size_t n;
+
+  crypto_rand(data, 16384);
+  reset_perftime();
+  for (s = 0; sizes[s]; ++s) {
+    const size_t sz = sizes[s];
+    buf_t *buf = buf_new();
+#ifdef USE_BUFFEREVENTS
+    struct evbuffer *ev = evbuffer_new();
+#endif
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (n = 0; n < total; n += sz)
+        write_to_buf(data, sz, buf);
+      for (n = 0; n < total; n += sz)
+        fetch_from_buf(data, sz, buf);
+    }
+    end = perftime();
+    printf("buf_t, %5d-byte writes and reads: %.3f ns per byte\n",
+           (int)sz, NANOCOUNT(start, end, ((double)iters)*total));
+    buf_free(buf);
+#ifdef USE_BUFFEREVENTS
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (n = 0; n < total; n += sz)
+        evbuffer_add(ev, data, sz);
+      for (n = 0; n < total; n += sz)
+        evbuffer_remove(ev, data, sz);
+    }
+    end = perftime();
+    printf("evbuffer, %5d-byte writes and reads: %.3f ns per byte\n",
+           (int)sz, NANOCOUNT(start, end, ((double)iters)*total));
+    evbuffer_free(ev);
+#endif
+  }
+  print_chunk_class_hit_ratios();
+  tor_free(data);
+}
+
+/** Measure how long buf_pullup() (and evbuffer_pullup()) take to make the
+ * first N bytes of a buffer contiguous, when those bytes arrived in small
+ * writes. */
+static void
+bench_buffer_pullup(void)
+{
+  static const size_t spans[] = { 512, 4096, 16384, 0 };
+  const size_t piece = 200;
+  const int iters = 1<<12;
+  char data[200];
+  uint64_t start, end, fill_ns;
+  int i, s;
+  size_t n;
+
+  memset(data, 'x', sizeof(data));
+  reset_perftime();
+  for (s = 0; spans[s]; ++s) {
+    const size_t span = spans[s];
+    /* Small chunks, so that the span covers many of them. */
+    buf_t *buf = buf_new_with_capacity(256);
+#ifdef USE_BUFFEREVENTS
+    struct evbuffer *ev = evbuffer_new();
+#endif
+
+    /* Time filling and clearing the buffer alone, so that we can take it
+     * back out below. */
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (n = 0; n < span; n += piece)
+        write_to_buf(data, piece, buf);
+      buf_clear(buf);
+    }
+    end = perftime();
+    fill_ns = end - start;
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (n = 0; n < span; n += piece)
+        write_to_buf(data, piece, buf);
+      buf_pullup(buf, span, 0);
+      buf_clear(buf);
+    }
+    end = perftime();
+    printf("buf_t, pull up %5d bytes: %.2f ns per pullup\n", (int)span,
+           NANOCOUNT(start + fill_ns, end, iters));
+    buf_free(buf);
+
+#ifdef USE_BUFFEREVENTS
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (n = 0; n < span; n += piece)
+        evbuffer_add(ev, data, piece);
+      evbuffer_drain(ev, evbuffer_get_length(ev));
+    }
+    end = perftime();
+    fill_ns = end - start;
+
+    start = perftime();
+    for (i = 0; i < iters; ++i) {
+      for (n = 0; n < span; n += piece)
+        evbuffer_add(ev, data, piece);
+      evbuffer_pullup(ev, span);
+      evbuffer_drain(ev, evbuffer_get_length(ev));
+    }
+    end = perftime();
+    printf("evbuffer, pull up %5d bytes: %.2f ns per pullup\n", (int)span,
+           NANOCOUNT(start + fill_ns, end, iters));
+    evbuffer_free(ev);
+#endif
+  }
+}
+
+/** Measure how fast we can parse HTTP requests and responses, and SOCKS
+ * requests, out of a buffer.  Each iteration includes writing the request
+ * onto the buffer. */
+static void
+bench_buffer_parse(void)
+{
+  static const char http_req[] =
+    "GET /tor/status-vote/current/consensus-microdesc/D586D1+14C131 HTTP/1.0"
+    "\r\nHost: 127.0.0.1\r\nAccept-Encoding: deflate, gzip\r\n"
+    "X-Or-Diff-From-Consensus: 0123456789abcdef0123456789abcdef\r\n\r\n";
+  /* SOCKS5, with negotiation and a CONNECT to a hostname sent together. */
+  static const char socks5_req[] =
+    "\x05\x01\x00"
+    "\x05\x01\x00\x03\x0fwww.example.com\x00\x50";
+  static const char socks4a_req[] =
+    "\x04\x01\x00\x50\x00\x00\x00\x01user\x00www.example.com\x00";
+  const int iters = 1<<16;
+  char *http_resp;
+  size_t http_resp_len;
+  char *headers, *body;
+  size_t body_len;
+  uint64_t start, end;
+  int i;
+  buf_t *buf = buf_new();
+#ifdef USE_BUFFEREVENTS
+  struct evbuffer *ev = evbuffer_new();
+#endif
+
+  {
+    char body_buf[2048];
+    memset(body_buf, 'b', sizeof(body_buf));
+    tor_asprintf(&http_resp, "HTTP/1.0 200 OK\r\nDate: Mon, 01 Oct 2012 "
+                 "00:00:00 GMT\r\nContent-Type: text/plain\r\n"
+                 "Content-Length: %d\r\n\r\n%.*s",
+                 (int)sizeof(body_buf), (int)sizeof(body_buf), body_buf);
+    http_resp_len = strlen(http_resp);
+  }
+
+  reset_perftime();
+
+#define BENCH_HTTP(name, msg, msglen, bufname, addfn, fetchfn)           \
+  do {                                                                  \
+    start = perftime();                                                 \
+    for (i = 0; i < iters; ++i) {                                       \
+      addfn(bufname, msg, msglen);                                      \
+      tor_assert(fetchfn(bufname, &headers, 8192, &body, &body_len,     \
+                         1<<20, 0) == 1);                               \
+      tor_free(headers);                                                \
+      tor_free(body);                                                   \
+    }                                                                   \
+    end = perftime();                                                   \
+    printf("%s: %.2f ns per message\n", name,                           \
+           NANOCOUNT(start, end, iters));                               \
+  } while (0)
+
+#define buf_add(b, m, l) write_to_buf((m), (l), (b))
+  BENCH_HTTP("buf_t, HTTP request", http_req, sizeof(http_req)-1,
+             buf, buf_add, fetch_from_buf_http);
+  BENCH_HTTP("buf_t, HTTP response", http_resp, http_resp_len,
+             buf, buf_add, fetch_from_buf_http);
+#ifdef USE_BUFFEREVENTS
+  BENCH_HTTP("evbuffer, HTTP request", http_req, sizeof(http_req)-1,
+             ev, evbuffer_add, fetch_from_evbuffer_http);
+  BENCH_HTTP("evbuffer, HTTP response", http_resp, http_resp_len,
+             ev, evbuffer_add, fetch_from_evbuffer_http);
+#endif
+
+#define BENCH_SOCKS(name, msg, bufname, addfn, fetchfn)                  \
+  do {                                                                  \
+    start = perftime();                                                 \
+    for (i = 0; i < iters; ++i) {                                       \
+      socks_request_t *req = socks_request_new();                       \
+      addfn(bufname, msg, sizeof(msg)-1);                               \
+      tor_assert(fetchfn(bufname, req, 0, 0) == 1);                     \
+      socks_request_free(req);                                          \
+    }                                                                   \
+    end = perftime();                                                   \
+    printf("%s: %.2f ns per request\n", name,                           \
+           NANOCOUNT(start, end, iters));                               \
+  } while (0)
+
+  BENCH_SOCKS("buf_t, SOCKS5 request", socks5_req,
+              buf, buf_add, fetch_from_buf_socks);
+  BENCH_SOCKS("buf_t, SOCKS4a request", socks4a_req,
+              buf, buf_add, fetch_from_buf_socks);
+#ifdef USE_BUFFEREVENTS
+  BENCH_SOCKS("evbuffer, SOCKS5 request", socks5_req,
+              ev, evbuffer_add, fetch_from_evbuffer_socks);
+  BENCH_SOCKS("evbuffer, SOCKS4a request", socks4a_req,
+              ev, evbuffer_add, fetch_from_evbuffer_socks);
+  evbuffer_free(ev);
+#endif
+#undef buf_add
+#undef BENCH_HTTP
+#undef BENCH_SOCKS
+
+  print_chunk_class_hit_ratios();
+  buf_free(buf);
+  tor_free(http_resp);
+}
+
+/** Build a synthetic vote from authority number <b>auth</b>, whose
+ * identity digest is <b>auth_id</b>, listing most of the routers whose
+ * sorted identity digests are in <b>ids</b>. */
+static networkstatus_t *
+bench_make_vote(int auth, const char *auth_id, const smartlist_t *ids,
+                time_t now)
+{
+  networkstatus_t *v = tor_malloc_zero(sizeof(networkstatus_t));
+  networkstatus_voter_info_t *voter =
+    tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  int i;
+
+  v->type = NS_TYPE_VOTE;
+  v->published = now;
+  v->valid_after = now;
+  v->fresh_until = now + 3600;
+  v->valid_until = now + 3*3600;
+  v->vote_seconds = v->dist_seconds = 300;
+  v->supported_methods = smartlist_new();
+  for (i = 1; i <= 12; ++i)
+    smartlist_add_asprintf(v->supported_methods, "%d", i);
+  v->known_flags = smartlist_new();
+  smartlist_split_string(v->known_flags,
+                         "Exit Fast Guard Running Stable Valid", NULL, 0, 0);
+  v->net_params = smartlist_new();
+  smartlist_split_string(v->net_params, "circwindow=1000", NULL, 0, 0);
+  v->client_versions = tor_strdup("0.2.3.25");
+  v->server_versions = tor_strdup("0.2.3.25");
+
+  tor_asprintf(&voter->nickname, "auth%d", auth);
+  voter->address = tor_strdup("10.0.0.1");
+  voter->addr = 0x0a000000 + auth;
+  voter->dir_port = 80;
+  voter->or_port = 443;
+  voter->contact = tor_strdup("nobody@example.com");
+  memcpy(voter->identity_digest, auth_id, DIGEST_LEN);
+  crypto_rand(voter->vote_digest, DIGEST_LEN);
+  v->voters = smartlist_new();
+  smartlist_add(v->voters, voter);
+
+  v->routerstatus_list = smartlist_new();
+  SMARTLIST_FOREACH_BEGIN(ids, const char *, id) {
+    vote_routerstatus_t *vrs;
+    routerstatus_t *rs;
+    char d64[BASE64_DIGEST256_LEN+1];
+    char md[DIGEST256_LEN];
+    /* Every authority misses a different few routers. */
+    if ((id_sl_idx + auth) % 20 == 0)
+      continue;
+    vrs = tor_malloc_zero(sizeof(vote_routerstatus_t));
+    rs = &vrs->status;
+    memcpy(rs->identity_digest, id, DIGEST_LEN);
+    memset(rs->descriptor_digest, id_sl_idx & 0xff, DIGEST_LEN);
+    tor_snprintf(rs->nickname, sizeof(rs->nickname), "router%d", id_sl_idx);
+    rs->published_on = now - 3600;
+    rs->addr = 0x0b000000 + id_sl_idx;
+    rs->or_port = 9001;
+    rs->dir_port = (id_sl_idx & 1) ? 9030 : 0;
+    rs->has_bandwidth = 1;
+    rs->bandwidth = 100 + (id_sl_idx % 1000) + auth;
+    if (auth < 3) {
+      rs->has_measured_bw = 1;
+      rs->measured_bw = rs->bandwidth * 2;
+    }
+    rs->has_exitsummary = 1;
+    rs->exitsummary = tor_strdup((id_sl_idx % 4) ? "reject 1-65535" :
+                                 "accept 20-23,43,53,79-81,88,110,143,194,"
+                                 "220,389,443,464,531,543-544,554,563");
+    vrs->version = tor_strdup("Tor 0.2.3.25");
+    /* Exit Fast Guard Running Stable Valid */
+    vrs->flags = 2|8|32;
+    if (id_sl_idx % 4 == 0)
+      vrs->flags |= 1;
+    if (id_sl_idx % 3 == 0)
+      vrs->flags |= 4;
+    if ((id_sl_idx + auth) % 2 == 0)
+      vrs->flags |= 16;
+    memset(md, id_sl_idx & 0xff, sizeof(md));
+    digest256_to_base64(d64, md);
+    vrs->microdesc = tor_malloc_zero(sizeof(vote_microdesc_hash_t));
+    tor_asprintf(&vrs->microdesc->microdesc_hash_line,
+                 "8,9,10,11,12 sha256=%s", d64);
+    smartlist_add(v->routerstatus_list, vrs);
+  } SMARTLIST_FOREACH_END(id);
+
+  return v;
+}
+
+/** Compute consensuses from synthetic votes by nine authorities about an
+ * increasing number of routers, one flavor at a time and then with the
+ * flavors in parallel.  The parallel figures are wall-clock times. */
+static void
+bench_consensus(void)
+{
+  const int n_votes = 9;
+  crypto_pk_t *identity_key = crypto_pk_new();
+  crypto_pk_t *signing_key = crypto_pk_new();
+  time_t now = time(NULL);
+  char auth_id[DIGEST_LEN];
+  int n_routers, i, flav;
+
+  tor_assert(crypto_pk_generate_key(identity_key) == 0);
+  tor_assert(crypto_pk_generate_key(signing_key) == 0);
+
+  for (n_routers = 1000; n_routers <= 16000; n_routers *= 4) {
+    smartlist_t *ids = smartlist_new();
+    smartlist_t *votes = smartlist_new();
+    char *bodies[N_CONSENSUS_FLAVORS];
+    networkstatus_t *consensuses[N_CONSENSUS_FLAVORS];
+    struct timeval tv_start, tv_end;
+    uint64_t start, end;
+    char label[64];
+
+    for (i = 0; i < n_routers; ++i) {
+      char *id = tor_malloc(DIGEST_LEN);
+      crypto_rand(id, DIGEST_LEN);
+      smartlist_add(ids, id);
+    }
+    smartlist_sort_digests(ids);
+    /* Our consensus is signed with identity_key, so the first vote is ours;
+     * the other authorities get random identities. */
+    for (i = 0; i < n_votes; ++i) {
+      if (i == 0)
+        tor_assert(crypto_pk_get_digest(identity_key, auth_id) == 0);
+      else
+        crypto_rand(auth_id, DIGEST_LEN);
+      smartlist_add(votes, bench_make_vote(i, auth_id, ids, now));
+    }
+
+    reset_perftime();
+    for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+      char *body;
+      start = perftime();
+      body = networkstatus_compute_consensus(votes, n_votes, identity_key,
+                                             signing_key, NULL, NULL, flav);
+      end = perftime();
+      tor_assert(body);
+      tor_snprintf(label, sizeof(label), "%d routers, %s consensus",
+                   n_routers, networkstatus_get_flavor_name(flav));
+      bench_report(label, NANOCOUNT(start, end, 1)/1e6, "msec");
+      tor_free(body);
+    }
+
+    tor_gettimeofday(&tv_start);
+    dirvote_compute_all_flavors(votes, n_votes, identity_key, signing_key,
+                                NULL, NULL, MAX(1, compute_num_cpus()),
+                                bodies, consensuses);
+    tor_gettimeofday(&tv_end);
+    tor_snprintf(label, sizeof(label), "%d routers, all flavors", n_routers);
+    bench_report(label, tv_udiff(&tv_start, &tv_end)/1e3, "msec (wall)");
+    for (flav = 0; flav < N_CONSENSUS_FLAVORS; ++flav) {
+      tor_assert(bodies[flav] && consensuses[flav]);
+      tor_free(bodies[flav]);
+      networkstatus_vote_free(consensuses[flav]);
+    }
+
+    SMARTLIST_FOREACH(votes, networkstatus_t *, v, networkstatus_vote_free(v));
+    smartlist_free(votes);
+    SMARTLIST_FOREACH(ids, char *, id, tor_free(id));
+    smartlist_free(ids);
+  }
+
+  crypto_pk_free(identity_key);
+  crypto_pk_free(signing_key);
+}
+
+/** Time SETCONF-style round trips through options_trial_assign(), for an
+ * option that has a change handler and for one that needs options_act(). */
+static void
+bench_config(void)
+{
+  const char *settings[][2] = {
+    { "MaxCircuitDirtiness 600", "MaxCircuitDirtiness 660" },
+    { "SafeSocks 0", "SafeSocks 1" },
+  };
+  const int iters = 1000;
+  int i, j;
+  uint64_t start, end;
+  or_options_t *options = get_options_mutable();
+
+  /* Validating the trial options wants a real DataDirectory. */
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(".");
+
+  reset_perftime();
+  for (i = 0; i < (int)(sizeof(settings)/sizeof(settings[0])); ++i) {
+    config_line_t *lines[2] = { NULL, NULL };
+    char *msg = NULL;
+    char *label;
+    for (j = 0; j < 2; ++j)
+      tor_assert(config_get_lines(settings[i][j], &lines[j], 0) == 0);
+    start = perftime();
+    for (j = 0; j < iters; ++j) {
+      setopt_err_t r = options_trial_assign(lines[j&1], 1, 1, &msg);
+      if (r != SETOPT_OK) {
+        printf("Couldn't set \"%s\": %s\n", settings[i][j&1], msg);
+        tor_free(msg);
+        break;
+      }
+    }
+    end = perftime();
+    tor_asprintf(&label, "SETCONF %s", lines[0]->key);
+    bench_report(label, NANOCOUNT(start, end, iters)/1e3, "usec");
+    tor_free(label);
+    config_free_lines(lines[0]);
+    config_free_lines(lines[1]);
+  }
+}
+
 typedef void (*bench_fn)(void);
 
 typedef struct benchmark_t {
@@ -262,7 +1724,27 @@ static struct benchmark_t benchmarks[] = {
   ENT(dmap),
   ENT(aes),
   ENT(cell_aes),
+  ENT(cell_digest),
+  ENT(rand),
+  ENT(rsa),
+  ENT(dh),
+  ENT(digest),
+  ENT(encoding),
+  ENT(di_ops),
+  ENT(tls),
   ENT(cell_ops),
+  ENT(relay_path),
+  ENT(buffers),
+  ENT(buffer_rw),
+  ENT(buffer_pullup),
+  ENT(buffer_parse),
+  ENT(consensus),
+  ENT(config),
+  ENT(onion_handshakes),
+#ifdef USE_PTHREADS
+  ENT(onion_handshake_threads),
+  ENT(workqueue),
+#endif
   {NULL,NULL,0}
 };
 
@@ -286,12 +1768,17 @@ main(int argc, const char **argv)
   int i;
   int list=0, n_enabled=0;
   benchmark_t *b;
+  char *errmsg;
+  or_options_t *options;
 
   tor_threads_init();
+  init_logging();
 
   for (i = 1; i < argc; ++i) {
     if (!strcmp(argv[i], "--list")) {
       list = 1;
+    } else if (!strcmp(argv[i], "--machine")) {
+      machine_output = 1;
     } else {
       benchmark_t *b = find_benchmark(argv[i]);
       ++n_enabled;
@@ -305,11 +1792,28 @@ main(int argc, const char **argv)
 
   reset_perftime();
 
+  if (crypto_global_init(0, NULL, NULL)) {
+    printf("Can't initialize crypto subsystem; exiting.\n");
+    return 1;
+  }
   crypto_seed_rng(1);
 
+  /* The handshake code wants options to exist. */
+  options = options_new();
+  options_init(options);
+  options->command = CMD_RUN_UNITTESTS;
+  options->DataDirectory = tor_strdup("");
+  if (set_options(options, &errmsg) < 0) {
+    printf("Failed to set initial options: %s\n", errmsg);
+    tor_free(errmsg);
+    return 1;
+  }
+
   for (b = benchmarks; b->name; ++b) {
     if (b->enabled || n_enabled == 0) {
-      printf("===== %s =====\n", b->name);
+      current_benchmark = b->name;
+      if (list || !machine_output)
+        printf("===== %s =====\n", b->name);
       if (!list)
         b->fn();
     }
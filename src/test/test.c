@@ -33,6 +33,20 @@ const char tor_git_revision[] = "";
 #define GEOIP_PRIVATE
 #define ROUTER_PRIVATE
 #define CIRCUIT_PRIVATE
+#define CIRCUITUSE_PRIVATE
+#define RELAY_PRIVATE
+#define CONNECTION_PRIVATE
+#define CONNECTION_EDGE_PRIVATE
+#define DNS_PRIVATE
+#define DNSSERV_PRIVATE
+#define ROUTERLIST_PRIVATE
+#define RENDCLIENT_PRIVATE
+#define RENDSERVICE_PRIVATE
+#define RENDCOMMON_PRIVATE
+#define HIBERNATE_PRIVATE
+#define MAIN_PRIVATE
+#define ONION_PRIVATE
+#define TORTLS_PRIVATE
 
 /*
  * Linux doesn't provide lround in math.h by default, but mac os does...
@@ -45,23 +59,48 @@ double fabs(double x);
 #include "or.h"
 #include "buffers.h"
 #include "circuitbuild.h"
+#include "circuitlist.h"
+#include "circuituse.h"
 #include "config.h"
+#include "connection.h"
 #include "connection_edge.h"
+#include "connection_or.h"
+#include "cpuworker.h"
+#include "dns.h"
+#include "dnsserv.h"
 #include "geoip.h"
+#include "hibernate.h"
+#include "main.h"
+#include "rendclient.h"
 #include "rendcommon.h"
+#include "rendservice.h"
 #include "test.h"
 #include "torgzip.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "nodelist.h"
 #include "onion.h"
 #include "policies.h"
+#include "relay.h"
 #include "rephist.h"
+#include "replaycache.h"
+#include "routerlist.h"
 #include "routerparse.h"
 
 #ifdef USE_DMALLOC
 #include <dmalloc.h>
 #include <openssl/crypto.h>
-#include "main.h"
+#endif
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+#ifdef HAVE_EVENT2_DNS_H
+#include <event2/dns.h>
+#else
+#include "eventdns.h"
 #endif
 
 /** Set to true if any unit test has failed.  Mostly, this is set by the macros
@@ -246,8 +285,7 @@ const struct testcase_setup_t socks_setup = {
 static void
 socks_request_clear(socks_request_t *socks)
 {
-  tor_free(socks->username);
-  tor_free(socks->password);
+  socks_request_clear_auth(socks);
   memset(socks, 0, sizeof(socks_request_t));
 }
 
@@ -500,141 +538,3417 @@ test_socks_5_authenticate(void *ptr)
   test_eq(5, socks->reply[0]);
   test_eq(0, socks->reply[1]);
 
-  test_eq(2, socks->usernamelen);
-  test_eq(8, socks->passwordlen);
+  test_eq(2, socks->usernamelen);
+  test_eq(8, socks->passwordlen);
+
+  test_memeq("me", socks->username, 2);
+  test_memeq("mypasswd", socks->password, 8);
+
+ done:
+  ;
+}
+
+/** Perform SOCKS 5 authentication with a password too long to store
+ * inside the socks_request_t */
+static void
+test_socks_5_authenticate_long_password(void *ptr)
+{
+  char password[100];
+  char msg[8 + sizeof(password)];
+  SOCKS_TEST_INIT();
+
+  memset(password, 'p', sizeof(password));
+  memcpy(msg, "\x05\x01\x02", 3);
+  memcpy(msg+3, "\x01\x02me", 4);
+  msg[7] = (char)sizeof(password);
+  memcpy(msg+8, password, sizeof(password));
+
+  /* Negotiation and authentication arrive in one go. */
+  write_to_buf(msg, sizeof(msg), buf);
+  test_assert(!fetch_from_buf_socks(buf, socks,
+                                   get_options()->TestSocks,
+                                   get_options()->SafeSocks));
+  test_eq(0, buf_datalen(buf));
+  test_eq(5, socks->socks_version);
+  test_eq(2, socks->usernamelen);
+  test_eq(sizeof(password), socks->passwordlen);
+  test_memeq("me", socks->username, 2);
+  test_memeq(password, socks->password, sizeof(password));
+
+ done:
+  ;
+}
+
+/** Perform SOCKS 5 authentication and send data all in one go */
+static void
+test_socks_5_authenticate_with_data(void *ptr)
+{
+  SOCKS_TEST_INIT();
+
+  /* SOCKS 5 Negotiate username/password authentication */
+  ADD_DATA(buf, "\x05\x01\x02");
+
+  test_assert(!fetch_from_buf_socks(buf, socks,
+                                   get_options()->TestSocks,
+                                   get_options()->SafeSocks));
+  test_eq(2, socks->replylen);
+  test_eq(5, socks->reply[0]);
+  test_eq(SOCKS_USER_PASS, socks->reply[1]);
+  test_eq(5, socks->socks_version);
+
+  test_eq(0, buf_datalen(buf));
+
+  /* SOCKS 5 Send username/password */
+  /* SOCKS 5 Send CONNECT [01] to IP address 2.2.2.2:4369 */
+  ADD_DATA(buf, "\x01\x02me\x03you\x05\x01\x00\x01\x02\x02\x02\x02\x11\x11");
+  test_assert(fetch_from_buf_socks(buf, socks,
+                                   get_options()->TestSocks,
+                                   get_options()->SafeSocks) == 1);
+  test_eq(5, socks->socks_version);
+  test_eq(2, socks->replylen);
+  test_eq(5, socks->reply[0]);
+  test_eq(0, socks->reply[1]);
+
+  test_streq("2.2.2.2", socks->address);
+  test_eq(4369, socks->port);
+
+  test_eq(2, socks->usernamelen);
+  test_eq(3, socks->passwordlen);
+  test_memeq("me", socks->username, 2);
+  test_memeq("you", socks->password, 3);
+
+ done:
+  ;
+}
+
+/** Perform SOCKS 5 authentication before method negotiated */
+static void
+test_socks_5_auth_before_negotiation(void *ptr)
+{
+  SOCKS_TEST_INIT();
+
+  /* SOCKS 5 Send username/password */
+  ADD_DATA(buf, "\x01\x02me\x02me");
+  test_assert(fetch_from_buf_socks(buf, socks,
+                                   get_options()->TestSocks,
+                                   get_options()->SafeSocks) == -1);
+  test_eq(0, socks->socks_version);
+  test_eq(0, socks->replylen);
+  test_eq(0, socks->reply[0]);
+  test_eq(0, socks->reply[1]);
+
+ done:
+  ;
+}
+
+/** Perform an HTTP request on a SOCKS port */
+static void
+test_socks_http_request(void *ptr)
+{
+  SOCKS_TEST_INIT();
+
+  /* We answer with a page saying we're not an HTTP proxy, too long for the
+   * inline reply buffer. */
+  ADD_DATA(buf, "GET / HTTP/1.0\r\n\r\n");
+  test_eq(fetch_from_buf_socks(buf, socks, get_options()->TestSocks,
+                               get_options()->SafeSocks), -1);
+  test_assert(socks->long_reply);
+  test_assert(!strcmpstart(socks->long_reply,
+                           "HTTP/1.0 501 Tor is not an HTTP Proxy\r\n"));
+  test_eq(strlen(socks->long_reply)+1, socks->replylen);
+  test_assert(socks->replylen > MAX_SOCKS_REPLY_LEN);
+
+ done:
+  ;
+}
+
+static void
+test_buffer_copy(void *arg)
+{
+  generic_buffer_t *buf=NULL, *buf2=NULL;
+  const char *s;
+  size_t len;
+  char b[256];
+  int i;
+  (void)arg;
+
+  buf = generic_buffer_new();
+  tt_assert(buf);
+
+  /* Copy an empty buffer. */
+  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
+  tt_assert(buf2);
+  tt_int_op(0, ==, generic_buffer_len(buf2));
+
+  /* Now try with a short buffer. */
+  s = "And now comes an act of enormous enormance!";
+  len = strlen(s);
+  generic_buffer_add(buf, s, len);
+  tt_int_op(len, ==, generic_buffer_len(buf));
+  /* Add junk to buf2 so we can test replacing.*/
+  generic_buffer_add(buf2, "BLARG", 5);
+  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
+  tt_int_op(len, ==, generic_buffer_len(buf2));
+  generic_buffer_get(buf2, b, len);
+  test_mem_op(b, ==, s, len);
+  /* Now free buf2 and retry so we can test allocating */
+  generic_buffer_free(buf2);
+  buf2 = NULL;
+  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
+  tt_int_op(len, ==, generic_buffer_len(buf2));
+  generic_buffer_get(buf2, b, len);
+  test_mem_op(b, ==, s, len);
+  /* Clear buf for next test */
+  generic_buffer_get(buf, b, len);
+  tt_int_op(generic_buffer_len(buf),==,0);
+
+  /* Okay, now let's try a bigger buffer. */
+  s = "Quis autem vel eum iure reprehenderit qui in ea voluptate velit "
+    "esse quam nihil molestiae consequatur, vel illum qui dolorem eum "
+    "fugiat quo voluptas nulla pariatur?";
+  len = strlen(s);
+  for (i = 0; i < 256; ++i) {
+    b[0]=i;
+    generic_buffer_add(buf, b, 1);
+    generic_buffer_add(buf, s, len);
+  }
+  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
+  tt_int_op(generic_buffer_len(buf2), ==, generic_buffer_len(buf));
+  for (i = 0; i < 256; ++i) {
+    generic_buffer_get(buf2, b, len+1);
+    tt_int_op((unsigned char)b[0],==,i);
+    test_mem_op(b+1, ==, s, len);
+  }
+
+ done:
+  if (buf)
+    generic_buffer_free(buf);
+  if (buf2)
+    generic_buffer_free(buf2);
+}
+
+/** Make sure that move_buf_to_buf() and buf_copy() give the right data
+ * when they splice or share chunks, and that changing a shared chunk on
+ * one buffer doesn't change the others. */
+static void
+test_buffer_move_shared(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL, *buf3 = NULL;
+  char *in = NULL, *out = NULL, *reason = NULL;
+  const size_t len = 10000;
+  size_t flushlen;
+  int i;
+  (void)arg;
+
+  in = tor_malloc(len);
+  out = tor_malloc(len);
+  for (i = 0; i < (int)len; ++i)
+    in[i] = (char)(i * 13 + i / 256);
+
+  buf = buf_new();
+  buf2 = buf_new();
+  for (i = 0; i < (int)len; i += 1000)
+    write_to_buf(in + i, 1000, buf);
+
+  /* Take the first chunk whole and most of the second. */
+  flushlen = 7800;
+  tt_int_op(7800, ==, move_buf_to_buf(buf2, buf, &flushlen));
+  tt_int_op(flushlen, ==, 0);
+  tt_int_op(buf_datalen(buf), ==, len - 7800);
+  tt_int_op(buf_datalen(buf2), ==, 7800);
+
+  /* A copy of buf2 shares its memory too. */
+  buf3 = buf_copy(buf2);
+  tt_int_op(buf_datalen(buf3), ==, 7800);
+
+  /* Make buf repack its shared head chunk: the few bytes left at the end
+   * of it are too short for a SOCKS reply, so it gets pulled up. */
+  fetch_from_buf_socks_client(buf, PROXY_SOCKS4_WANT_CONNECT_OK, &reason);
+  tor_free(reason);
+  buf_free(buf);
+  buf = buf_new();
+
+  /* The data we moved out of buf is still intact. */
+  fetch_from_buf(out, 7800, buf2);
+  test_memeq(out, in, 7800);
+  tt_int_op(buf_datalen(buf2), ==, 0);
+  buf_free(buf2);
+  buf2 = NULL;
+  fetch_from_buf(out, 7800, buf3);
+  test_memeq(out, in, 7800);
+  tt_int_op(buf_datalen(buf3), ==, 0);
+
+  /* Short moves still work when they can't share anything. */
+  write_to_buf(in, 100, buf);
+  flushlen = 200;
+  tt_int_op(100, ==, move_buf_to_buf(buf3, buf, &flushlen));
+  tt_int_op(flushlen, ==, 100);
+  fetch_from_buf(out, 100, buf3);
+  test_memeq(out, in, 100);
+
+ done:
+  if (buf)
+    buf_free(buf);
+  if (buf2)
+    buf_free(buf2);
+  if (buf3)
+    buf_free(buf3);
+  tor_free(in);
+  tor_free(out);
+}
+
+/** Make sure that fetch_from_buf_http() handles headers that span several
+ * chunks, and waits for the whole body. */
+static void
+test_buffer_http_across_chunks(void *arg)
+{
+  buf_t *buf = NULL;
+  smartlist_t *lines = smartlist_new();
+  char *request = NULL, *headers = NULL, *body = NULL;
+  size_t request_len, off, body_used = 0;
+  int i;
+  (void)arg;
+
+  smartlist_add(lines, tor_strdup("POST /tor/ HTTP/1.0\r\n"
+                                  "Content-Length: 10\r\n"));
+  for (i = 0; i < 100; ++i)
+    smartlist_add_asprintf(lines, "X-Padding-%d: %s\r\n", i,
+                           "yyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyyy");
+  smartlist_add(lines, tor_strdup("\r\n"));
+  request = smartlist_join_strings(lines, "", 0, &request_len);
+
+  buf = buf_new();
+  for (off = 0; off < request_len; off += 1000) {
+    size_t n = request_len - off < 1000 ? request_len - off : 1000;
+    tt_int_op(0, ==, fetch_from_buf_http(buf, &headers, 50000, &body,
+                                         &body_used, 1000, 0));
+    write_to_buf(request + off, n, buf);
+  }
+  /* Headers, but only part of the body. */
+  write_to_buf("0123", 4, buf);
+  tt_int_op(0, ==, fetch_from_buf_http(buf, &headers, 50000, &body,
+                                       &body_used, 1000, 0));
+  tt_ptr_op(headers, ==, NULL);
+  tt_int_op(buf_datalen(buf), ==, request_len + 4);
+
+  write_to_buf("456789extra", 11, buf);
+  tt_int_op(1, ==, fetch_from_buf_http(buf, &headers, 50000, &body,
+                                       &body_used, 1000, 0));
+  test_streq(headers, request);
+  tt_int_op(body_used, ==, 10);
+  test_streq(body, "0123456789");
+  tt_int_op(buf_datalen(buf), ==, 5);
+
+ done:
+  if (buf)
+    buf_free(buf);
+  SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+  smartlist_free(lines);
+  tor_free(request);
+  tor_free(headers);
+  tor_free(body);
+}
+
+/** Make sure that reads onto a buffer that only ever gets a little data at
+ * a time use small chunks, and that big reads still get everything. */
+static void
+test_buffer_read_size_tuning(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *buf = NULL;
+  char *data = NULL;
+  const size_t len = 30000;
+  size_t total;
+  int eof = 0, err = 0, r, i;
+  (void)arg;
+
+  tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  data = tor_malloc_zero(len);
+  buf = buf_new();
+
+  /* The first read has nothing to go on, so it gets a full-sized chunk. */
+  tt_int_op(100, ==, send(fds[0], data, 100, 0));
+  tt_int_op(100, ==, read_to_buf(fds[1], 16384, buf, &eof, &err));
+  tt_int_op(buf_allocation(buf), >=, 4000);
+  fetch_from_buf(data, 100, buf);
+
+  /* After a few small reads, we use small chunks. */
+  for (i = 0; i < 10; ++i) {
+    tt_int_op(100, ==, send(fds[0], data, 100, 0));
+    tt_int_op(100, ==, read_to_buf(fds[1], 16384, buf, &eof, &err));
+    fetch_from_buf(data, 100, buf);
+  }
+  tt_int_op(100, ==, send(fds[0], data, 100, 0));
+  tt_int_op(100, ==, read_to_buf(fds[1], 16384, buf, &eof, &err));
+  tt_int_op(buf_allocation(buf), <, 1024);
+  fetch_from_buf(data, 100, buf);
+
+  /* A burst still comes in all at once. */
+  tt_int_op(len, ==, send(fds[0], data, len, 0));
+  total = 0;
+  while (total < len) {
+    r = read_to_buf(fds[1], len - total, buf, &eof, &err);
+    tt_int_op(r, >, 0);
+    total += r;
+  }
+  tt_int_op(buf_datalen(buf), ==, len);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  if (buf)
+    buf_free(buf);
+  tor_free(data);
+}
+
+/** Make sure that fetch_cell_from_buf() unpacks cells correctly, whether
+ * or not they straddle a chunk boundary. */
+static void
+test_buffer_fetch_cell(void *arg)
+{
+  buf_t *buf = NULL;
+  char packed[CELL_NETWORK_SIZE];
+  cell_t cell;
+  int i;
+  (void)arg;
+
+  buf = buf_new();
+  /* Eight cells don't fit in one 4096-byte chunk, so one of them
+   * straddles two chunks. */
+  for (i = 0; i < 8; ++i) {
+    set_uint16(packed, htons(100 + i));
+    set_uint8(packed+2, CELL_RELAY);
+    memset(packed+3, 'a' + i, CELL_PAYLOAD_SIZE);
+    write_to_buf(packed, sizeof(packed), buf);
+  }
+  write_to_buf(packed, 10, buf);
+
+  for (i = 0; i < 8; ++i) {
+    tt_int_op(1, ==, fetch_cell_from_buf(buf, &cell));
+    tt_int_op(cell.circ_id, ==, 100 + i);
+    tt_int_op(cell.command, ==, CELL_RELAY);
+    memset(packed, 'a' + i, CELL_PAYLOAD_SIZE);
+    test_memeq(cell.payload, packed, CELL_PAYLOAD_SIZE);
+  }
+  /* A partial cell stays where it is. */
+  tt_int_op(0, ==, fetch_cell_from_buf(buf, &cell));
+  tt_int_op(buf_datalen(buf), ==, 10);
+
+ done:
+  if (buf)
+    buf_free(buf);
+}
+
+/** Make sure that buf_shrink() packs sparse chunks together without
+ * losing or reordering any data. */
+static void
+test_buffer_shrink(void *arg)
+{
+  buf_t *buf = NULL, *src = NULL;
+  char data[6000], out[6000];
+  size_t before, total_before, len;
+  time_t now = time(NULL);
+  int i;
+  (void)arg;
+
+  for (i = 0; i < (int)sizeof(data); ++i)
+    data[i] = (char)(i * 7 + i / 256);
+  buf = buf_new();
+  src = buf_new();
+  tt_int_op(now, ==, buf_get_oldest_chunk_timestamp(buf, now));
+
+  /* Moving whole chunks splices them, so we wind up with five chunks that
+   * are mostly empty. */
+  for (i = 0; i < 5; ++i) {
+    write_to_buf(data + i*600, 600, src);
+    len = buf_datalen(src);
+    move_buf_to_buf(buf, src, &len);
+  }
+  tt_int_op(buf_datalen(buf), ==, 3000);
+  tt_int_op(buf_get_oldest_chunk_timestamp(buf, now + 100), <=, now + 1);
+  before = buf_allocation(buf);
+  total_before = buf_get_total_allocation();
+
+  buf_shrink(buf);
+  assert_buf_ok(buf);
+  tt_int_op(buf_datalen(buf), ==, 3000);
+  tt_int_op(buf_allocation(buf) * 2, <, before);
+  tt_int_op(buf_get_total_allocation(), <, total_before);
+  fetch_from_buf(out, 3000, buf);
+  test_memeq(out, data, 3000);
+
+  /* A big chunk with a little data moves onto a smaller one, but not one
+   * smaller than the buffer's default chunk size. */
+  write_to_buf(data, sizeof(data), buf);
+  fetch_from_buf(out, 5900, buf);
+  tt_int_op(buf_allocation(buf), >, 4096);
+  buf_shrink(buf);
+  assert_buf_ok(buf);
+  tt_int_op(buf_datalen(buf), ==, 100);
+  tt_int_op(buf_allocation(buf), <=, 4096);
+  tt_int_op(buf_allocation(buf), >, 2048);
+  fetch_from_buf(out, 100, buf);
+  test_memeq(out, data + 5900, 100);
+
+ done:
+  if (buf)
+    buf_free(buf);
+  if (src)
+    buf_free(src);
+}
+
+/** Make sure that chunk size classes count their chunks, and give back
+ * their slabs once the chunks are gone. */
+static void
+test_buffer_chunk_classes(void *arg)
+{
+  buf_t *buf = NULL;
+  char *stats = NULL;
+  char data[1000];
+  int i;
+  (void)arg;
+
+  memset(data, 'x', sizeof(data));
+  buf = buf_new();
+  /* About 100 4096-byte chunks: more than one slab's worth. */
+  for (i = 0; i < 400; ++i)
+    write_to_buf(data, sizeof(data), buf);
+  stats = buf_get_chunk_class_stats();
+  tt_assert(stats);
+#ifdef ENABLE_BUF_FREELISTS
+  tt_assert(strstr(stats, "size=4096 in-use=100 slabs=2 empty-slabs=0 "));
+#endif
+  tor_free(stats);
+
+  buf_free(buf);
+  buf = NULL;
+  buf_shrink_freelists(1);
+  stats = buf_get_chunk_class_stats();
+  tt_assert(stats);
+#ifdef ENABLE_BUF_FREELISTS
+  tt_assert(strstr(stats, "size=4096 in-use=0 slabs=0 empty-slabs=0 "));
+  tt_assert(strstr(stats, " slabs-returned=2\n"));
+#endif
+
+ done:
+  if (buf)
+    buf_free(buf);
+  tor_free(stats);
+}
+
+/** Make sure that read_to_buf() and flush_buf() move data that spans many
+ * chunks across a socket intact and in order. */
+static void
+test_buffer_socket_io(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *in = NULL, *out = NULL;
+  const size_t len = 20000;
+  size_t flushlen, total = 0;
+  int eof = 0, err = 0, r, i;
+  (void)arg;
+
+  tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+
+  in = tor_malloc(len);
+  out = tor_malloc(len);
+  for (i = 0; i < (int)len; ++i)
+    in[i] = (char)(i * 7 + i / 256);
+
+  buf = buf_new_with_capacity(512);
+  buf2 = buf_new_with_capacity(512);
+  /* Leave a little data in the tail of buf2, so that the read has to fill
+   * out a partial chunk before it starts on new ones. */
+  write_to_buf(in, 10, buf2);
+  tt_int_op(buf_datalen(buf2), ==, 10);
+
+  /* Load buf with many small chunks. */
+  for (i = 0; i < (int)len; i += 1000)
+    write_to_buf(in + i, 1000, buf);
+  tt_int_op(buf_datalen(buf), ==, len);
+
+  /* Flush all but the last 100 bytes. */
+  flushlen = len;
+  r = flush_buf(fds[0], buf, len - 100, &flushlen);
+  tt_int_op(r, ==, len - 100);
+  tt_int_op(flushlen, ==, 100);
+  tt_int_op(buf_datalen(buf), ==, 100);
+  r = flush_buf(fds[0], buf, 100, &flushlen);
+  tt_int_op(r, ==, 100);
+  tt_int_op(flushlen, ==, 0);
+  tt_int_op(buf_datalen(buf), ==, 0);
+
+  while (total < len) {
+    r = read_to_buf(fds[1], len - total, buf2, &eof, &err);
+    tt_int_op(r, >, 0);
+    total += r;
+  }
+  tt_int_op(buf_datalen(buf2), ==, len + 10);
+  fetch_from_buf(out, 10, buf2);
+  test_memeq(out, in, 10);
+  fetch_from_buf(out, len, buf2);
+  test_memeq(out, in, len);
+  tt_int_op(buf_datalen(buf2), ==, 0);
+
+  /* Now check that we notice EOF. */
+  tor_close_socket(fds[0]);
+  fds[0] = TOR_INVALID_SOCKET;
+  r = read_to_buf(fds[1], 4096, buf2, &eof, &err);
+  tt_int_op(r, ==, 0);
+  tt_int_op(eof, ==, 1);
+  tt_int_op(buf_datalen(buf2), ==, 0);
+
+ done:
+  if (SOCKET_OK(fds[0]))
+    tor_close_socket(fds[0]);
+  if (SOCKET_OK(fds[1]))
+    tor_close_socket(fds[1]);
+  if (buf)
+    buf_free(buf);
+  if (buf2)
+    buf_free(buf2);
+  tor_free(in);
+  tor_free(out);
+}
+
+/** Run unit tests for the latency_histogram_t functions in relay.c */
+static void
+test_latency_histogram(void *arg)
+{
+  latency_histogram_t h;
+  char *s = NULL;
+  int i;
+  (void)arg;
+
+  memset(&h, 0, sizeof(h));
+  tt_assert(latency_histogram_get_total(&h) == 0);
+  tt_assert(latency_histogram_get_quantile(&h, 0.5) == 0);
+
+  latency_histogram_add(&h, 0);
+  latency_histogram_add(&h, 1);
+  latency_histogram_add(&h, 2);
+  latency_histogram_add(&h, 3);
+  latency_histogram_add(&h, 4);
+  latency_histogram_add(&h, U64_LITERAL(1) << 40);
+  tt_assert(h.counts[0] == 1);
+  tt_assert(h.counts[1] == 1);
+  tt_assert(h.counts[2] == 2);
+  tt_assert(h.counts[3] == 1);
+  tt_assert(h.counts[LATENCY_HISTOGRAM_N_BUCKETS-1] == 1);
+  tt_assert(latency_histogram_get_total(&h) == 6);
+
+  s = latency_histogram_format(&h);
+  tt_str_op(s, ==, "1,1,2,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1");
+
+  /* Quantiles are reported as the top of the bucket that holds them. */
+  tt_assert(latency_histogram_get_quantile(&h, 0.1) == 0);
+  tt_assert(latency_histogram_get_quantile(&h, 0.5) == 3);
+  tt_assert(latency_histogram_get_quantile(&h, 0.8) == 7);
+  tt_assert(latency_histogram_get_quantile(&h, 1.0) ==
+            U64_LITERAL(1) << (LATENCY_HISTOGRAM_N_BUCKETS-2));
+
+  for (i = 0; i < 94; ++i)
+    latency_histogram_add(&h, 1);
+  tt_assert(latency_histogram_get_quantile(&h, 0.9) == 1);
+
+ done:
+  tor_free(s);
+}
+
+/** Run unit tests for the onionskin pipeline statistics in rephist.c */
+static void
+test_onion_pipeline_stats(void *arg)
+{
+  char *s = NULL;
+  (void)arg;
+
+  rep_hist_onion_pipeline_second_elapsed(1, 0);
+  s = rep_hist_format_onion_pipeline(1);
+  tt_str_op(s, ==, "QueueDepth=0 Answered=0 QueueUsec=0 WorkerUsec=0 "
+            "WorkerUtil= Dropped=QUEUEFULL:0,EXPIRED:0,CLOSED:0,FAILED:0,"
+            "OVERLOADED:0");
+  tor_free(s);
+
+  rep_hist_note_onionskin_timing(1000, 3000);
+  rep_hist_note_onionskin_timing(3000, 5000);
+  rep_hist_note_onionskin_timing(2000, -1);
+  rep_hist_note_onionskin_answered();
+  rep_hist_note_onionskin_answered();
+  rep_hist_note_onionskin_dropped(ONION_DROP_EXPIRED);
+  rep_hist_note_onionskin_dropped(ONION_DROP_FAILED);
+  rep_hist_note_cpuworker_busy(1, 500000);
+  rep_hist_note_cpuworker_busy(1, 250000);
+  rep_hist_note_cpuworker_busy(MAX_CPUWORKERS, 1); /* ignored */
+  rep_hist_onion_pipeline_second_elapsed(1, 7);
+  s = rep_hist_format_onion_pipeline(1);
+  tt_str_op(s, ==, "QueueDepth=7 Answered=2 QueueUsec=2000 WorkerUsec=4000 "
+            "WorkerUtil=0,75 Dropped=QUEUEFULL:0,EXPIRED:1,CLOSED:0,FAILED:1,"
+            "OVERLOADED:0");
+  tor_free(s);
+
+  /* The totals cover all four seconds so far. */
+  rep_hist_note_onionskin_dropped(ONION_DROP_QUEUE_FULL);
+  rep_hist_onion_pipeline_second_elapsed(2, 0);
+  s = rep_hist_format_onion_pipeline(1);
+  tt_str_op(s, ==, "QueueDepth=0 Answered=0 QueueUsec=0 WorkerUsec=0 "
+            "WorkerUtil=0,0 Dropped=QUEUEFULL:1,EXPIRED:0,CLOSED:0,FAILED:0,"
+            "OVERLOADED:0");
+  tor_free(s);
+  s = rep_hist_format_onion_pipeline(0);
+  tt_str_op(s, ==, "QueueDepth=0 Answered=2 QueueUsec=2000 WorkerUsec=4000 "
+            "WorkerUtil=0,18 Dropped=QUEUEFULL:1,EXPIRED:1,CLOSED:0,FAILED:1,"
+            "OVERLOADED:0");
+
+ done:
+  tor_free(s);
+  rep_hist_free_all();
+}
+
+/** Make sure that a full onion queue drops its oldest request, and that
+ * MaxOnionsPending 0 refuses everything. */
+static void
+test_onion_queue_full(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  or_circuit_t *circs[3];
+  int i;
+  (void)arg;
+
+  options->MaxOnionsPending = 2;
+  for (i = 0; i < 3; ++i) {
+    circs[i] = or_circuit_new(i+1, NULL);
+    circs[i]->_base.purpose = CIRCUIT_PURPOSE_OR;
+    tt_int_op(onion_pending_add(circs[i], tor_strdup("skin")), ==, 0);
+  }
+  tt_int_op(onion_pending_len(), ==, 2);
+  tt_assert(circs[0]->_base.marked_for_close);
+  tt_ptr_op(circs[0]->onionqueue_entry, ==, NULL);
+  tt_assert(!circs[1]->_base.marked_for_close);
+  tt_assert(!circs[2]->_base.marked_for_close);
+
+  options->MaxOnionsPending = 0;
+  circs[0] = or_circuit_new(4, NULL);
+  circs[0]->_base.purpose = CIRCUIT_PURPOSE_OR;
+  tt_int_op(onion_pending_add(circs[0], tor_strdup("skin")), ==, -1);
+  tt_int_op(onion_pending_len(), ==, 0);
+  tt_ptr_op(circs[0]->onionqueue_entry, ==, NULL);
+  tt_assert(!circs[0]->_base.marked_for_close);
+  tt_assert(circs[1]->_base.marked_for_close);
+  tt_assert(circs[2]->_base.marked_for_close);
+
+ done:
+  circuit_free_all();
+}
+
+/** Make sure that we learn how fast the onion queue drains only from
+ * seconds when it never emptied, and that we refuse new requests once the
+ * expected wait gets longer than MaxOnionQueueDelay. */
+static void
+test_onion_queue_delay(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  or_connection_t *conn = or_connection_new(AF_INET);
+  or_circuit_t *circ;
+  char *onionskin = NULL;
+  uint64_t when_added;
+  int i;
+  (void)arg;
+
+#define SET_SEC(sec) \
+  onion_queue_set_time_for_testing_(((uint64_t)(sec)) * 1000000000)
+  options->MaxOnionsPending = 100;
+  options->MaxOnionQueueDelay = 1000;
+  SET_SEC(1000);
+  for (i = 0; i < 4; ++i) {
+    circ = or_circuit_new(i+1, conn);
+    circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+    tt_int_op(onion_pending_add(circ, tor_strdup("skin")), ==, 0);
+  }
+  /* The queue was empty when this second began, so it tells us nothing. */
+  SET_SEC(1001);
+  tt_int_op(onion_pending_estimated_wait_msec(), ==, 0);
+  tt_assert(!onion_pending_is_overloaded());
+
+  /* The workers take 2 requests in a second that the queue stays full. */
+  for (i = 0; i < 2; ++i) {
+    tt_assert(onion_next_task(&onionskin, &when_added));
+    tor_free(onionskin);
+  }
+  SET_SEC(1002);
+  tt_int_op(onion_pending_estimated_wait_msec(), ==, 1500);
+  tt_assert(onion_pending_is_overloaded());
+  options->MaxOnionQueueDelay = 2000;
+  tt_assert(!onion_pending_is_overloaded());
+
+  /* One more in the next second: the estimate moves toward it. */
+  tt_assert(onion_next_task(&onionskin, &when_added));
+  tor_free(onionskin);
+  SET_SEC(1003);
+  tt_int_op(onion_pending_estimated_wait_msec(), ==, 1176);
+
+  /* An empty queue has no wait, and the second in which we emptied it
+   * doesn't count. */
+  tt_assert(onion_next_task(&onionskin, &when_added));
+  tor_free(onionskin);
+  tt_int_op(onion_pending_estimated_wait_msec(), ==, 0);
+  SET_SEC(1004);
+  circ = or_circuit_new(5, conn);
+  circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+  tt_int_op(onion_pending_add(circ, tor_strdup("skin")), ==, 0);
+  tt_int_op(onion_pending_estimated_wait_msec(), ==, 1176);
+#undef SET_SEC
+
+ done:
+  tor_free(onionskin);
+  onion_queue_set_time_for_testing_(0);
+  circuit_free_all();
+  connection_free(TO_CONN(conn));
+}
+
+/** Make sure that an adaptive deliver window times the cell that the
+ * sender could only have sent after our SENDME, and aims for the
+ * bandwidth-delay product within the consensus bounds. */
+static void
+test_adaptive_window(void *arg)
+{
+  adaptive_window_t aw;
+  int i;
+  (void)arg;
+
+  memset(&aw, 0, sizeof(aw));
+  aw.target = 2000;
+  get_options_mutable()->AdaptiveCircuitWindows = 0;
+  tt_int_op(adaptive_window_get_target(&aw), ==, CIRCWINDOW_START);
+  adaptive_window_note_sendme(&aw, 3);
+  tt_int_op(aw.cells_until_rtt_sample, ==, 0);
+
+  get_options_mutable()->AdaptiveCircuitWindows = 1;
+  tt_int_op(adaptive_window_get_target(&aw), ==, 2000);
+  memset(&aw, 0, sizeof(aw));
+  tt_int_op(adaptive_window_get_target(&aw), ==, CIRCWINDOW_START);
+
+  /* With a window of 3, the 4th cell after our SENDME ends the sample. */
+  adaptive_window_note_sendme(&aw, 3);
+  tt_int_op(aw.cells_until_rtt_sample, ==, 4);
+  aw.rtt_sample_start_msec -= 400;
+  aw.rate = 5000;
+  for (i = 0; i < 3; ++i)
+    adaptive_window_note_cell_delivered(&aw);
+  tt_int_op(aw.rtt_min_msec, ==, 0);
+  adaptive_window_note_cell_delivered(&aw);
+  tt_int_op(aw.n_delivered, ==, 4);
+  tt_int_op(aw.rtt_min_msec, ==, 400);
+  /* 5000 cells/sec * 0.4 sec * 1.25 */
+  tt_int_op(adaptive_window_get_target(&aw), ==, 2500);
+
+  /* A longer sample doesn't raise the minimum; a faster rate raises the
+   * target only as far as the consensus maximum. */
+  adaptive_window_note_sendme(&aw, 0);
+  aw.rtt_sample_start_msec -= 900;
+  aw.rate = 50000;
+  adaptive_window_note_cell_delivered(&aw);
+  tt_int_op(aw.rtt_min_msec, ==, 400);
+  tt_int_op(adaptive_window_get_target(&aw), ==, 4000);
+
+ done:
+  ;
+}
+
+/** Make sure that we hold back partial data cells only while
+ * DataCellCoalesceDelay is set, never once the inbuf has reached EOF, and
+ * only until the hold-back is due. */
+static void
+test_data_cell_coalesce(void *arg)
+{
+  tor_libevent_cfg cfg;
+  edge_connection_t *a = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  edge_connection_t *b = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+
+  get_options_mutable()->DataCellCoalesceDelay = 0;
+  tt_int_op(connection_edge_should_coalesce(a), ==, 0);
+  tt_assert(!a->coalescing_data);
+
+  get_options_mutable()->DataCellCoalesceDelay = 50;
+  tt_int_op(connection_edge_should_coalesce(a), ==, 1);
+  tt_assert(a->coalescing_data);
+  tt_int_op(connection_edge_should_coalesce(a), ==, 1);
+  b->_base.inbuf_reached_eof = 1;
+  tt_int_op(connection_edge_should_coalesce(b), ==, 0);
+  tt_assert(!b->coalescing_data);
+
+  /* Once the timer says we're due, we package what we have, once. */
+  a->coalesce_due = 1;
+  tt_int_op(connection_edge_should_coalesce(a), ==, 0);
+  tt_assert(!a->coalesce_due);
+
+  connection_edge_cancel_coalescing(a);
+  tt_assert(!a->coalescing_data);
+
+ done:
+  connection_free(TO_CONN(a));
+  connection_free(TO_CONN(b));
+  connection_edge_coalescing_free_all();
+}
+
+/** Make sure that libevent's evdns gets a full window of inflight requests
+ * for each nameserver. */
+static void
+test_dns_max_inflight(void *arg)
+{
+  (void)arg;
+  tt_int_op(dns_max_inflight_for_nameservers(0), ==, 256);
+  tt_int_op(dns_max_inflight_for_nameservers(1), ==, 256);
+  tt_int_op(dns_max_inflight_for_nameservers(3), ==, 768);
+  tt_int_op(dns_max_inflight_for_nameservers(253), ==, 64768);
+  tt_int_op(dns_max_inflight_for_nameservers(254), ==, 65000);
+  tt_int_op(dns_max_inflight_for_nameservers(INT_MAX), ==, 65000);
+ done:
+  ;
+}
+
+/** Make sure that DNS cache entries are only as big as they need to be, and
+ * that long names are looked up the same way they're stored. */
+static void
+test_dns_compact_cache(void *arg)
+{
+  char long_name[300], other_name[300];
+  size_t valid_len, failed_len;
+  (void)arg;
+
+  memset(long_name, 'a', sizeof(long_name)-1);
+  long_name[sizeof(long_name)-1] = '\0';
+  memcpy(other_name, long_name, sizeof(other_name));
+  other_name[sizeof(other_name)-2] = 'b';
+
+  tt_assert(add_answer_to_cache("www.example.com", 0, 0x01020304, NULL, 0,
+                                NULL, DNS_RESOLVE_SUCCEEDED, 3600));
+  tt_assert(add_answer_to_cache("www.example.net", 0, 0, NULL, 0, NULL,
+                                DNS_RESOLVE_FAILED_PERMANENT, 3600));
+  tt_assert(add_answer_to_cache(long_name, 0, 0x01020304, NULL, 0, NULL,
+                                DNS_RESOLVE_SUCCEEDED, 3600));
+  tt_assert(add_answer_to_cache("4.3.2.1.in-addr.arpa", 1, 0, NULL, 0,
+                                "www.example.com", DNS_RESOLVE_SUCCEEDED,
+                                3600));
+
+  /* A failure has no room for an answer. */
+  valid_len = dns_cache_entry_mem_usage("www.example.com");
+  failed_len = dns_cache_entry_mem_usage("www.example.net");
+  tt_int_op(failed_len, >, 0);
+  tt_int_op(failed_len, <, valid_len);
+  tt_int_op(dns_cache_entry_mem_usage("www.example.org"), ==, 0);
+  /* Names are stored at their own length, up to 255 characters... */
+  tt_int_op(dns_cache_entry_mem_usage(long_name), ==,
+            valid_len - strlen("www.example.com") + 255);
+  /* ...and lookups truncate them the same way. */
+  tt_int_op(dns_cache_entry_mem_usage(other_name), ==,
+            dns_cache_entry_mem_usage(long_name));
+  /* Reverse answers count too. */
+  tt_int_op(dns_cache_entry_mem_usage("4.3.2.1.in-addr.arpa"), ==,
+            valid_len - strlen("www.example.com") +
+            strlen("4.3.2.1.in-addr.arpa") + strlen("www.example.com") + 1);
+
+ done:
+  ;
+}
+
+/** Make sure that exit streams take turns at the addresses we cached for a
+ * name, and try the ones that failed lately last. */
+static void
+test_dns_exit_addr_order(void *arg)
+{
+  edge_connection_t *exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  const uint32_t alts[4] = { 0x02000002, 0x03000003, 0x04000004,
+                             0x05000005 };
+  (void)arg;
+
+  /* Start at the fourth answer, and fall back on the ones after it. */
+  set_exitconn_addrs(exitconn, 0x01000001, alts, 4, 3, 0);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x04000004);
+  tt_int_op(exitconn->n_exit_alt_addrs, ==, 3);
+  tt_int_op(exitconn->exit_alt_addrs[0], ==, 0x05000005);
+  tt_int_op(exitconn->exit_alt_addrs[1], ==, 0x01000001);
+  tt_int_op(exitconn->exit_alt_addrs[2], ==, 0x02000002);
+
+  /* Answers that failed go to the back. */
+  set_exitconn_addrs(exitconn, 0x01000001, alts, 4, 3, (1u<<4)|(1u<<0));
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x04000004);
+  tt_int_op(exitconn->exit_alt_addrs[0], ==, 0x02000002);
+  tt_int_op(exitconn->exit_alt_addrs[1], ==, 0x03000003);
+  tt_int_op(exitconn->exit_alt_addrs[2], ==, 0x05000005);
+  set_exitconn_addrs(exitconn, 0x01000001, alts, 4, 3, 1u<<3);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x05000005);
+
+  /* With a single answer, there's nothing to fall back on. */
+  set_exitconn_addrs(exitconn, 0x01000001, NULL, 0, 0, 0);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x01000001);
+  tt_int_op(exitconn->n_exit_alt_addrs, ==, 0);
+
+ done:
+  connection_free(TO_CONN(exitconn));
+}
+
+/** How many resolves has the fake DNS backend been asked to launch? */
+static int fake_dns_n_launched = 0;
+
+/** Pretend nameserver configuration for the fake DNS backend. */
+static int
+fake_dns_configure(int force)
+{
+  (void)force;
+  return 0;
+}
+
+/** Pretend to launch a resolve of <b>address</b>. */
+static int
+fake_dns_launch(const char *address)
+{
+  (void)address;
+  ++fake_dns_n_launched;
+  return 0;
+}
+
+/** A DNS backend that never talks to the network. */
+static const dns_backend_t fake_dns_backend = {
+  "fake", fake_dns_configure, NULL, fake_dns_launch, NULL, NULL
+};
+
+/** Make sure that ServerDNSRefreshPopular re-resolves answers that streams
+ * use before they expire, lets the others expire, and swaps in the new
+ * answer in place. */
+static void
+test_dns_refresh_popular(void *arg)
+{
+  edge_connection_t *exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  time_t now = time(NULL), refresh_at;
+  (void)arg;
+
+  get_options_mutable()->ServerDNSRefreshPopular = 1;
+  dns_set_backend_for_testing_(&fake_dns_backend);
+  /* (Allow for the clock ticking while we add the answers.) */
+  refresh_at = now + MAX_DNS_ENTRY_AGE - 10 + 1;
+
+  tt_assert(add_answer_to_cache("popular.example", 0, 0x01020304, NULL, 0,
+                                NULL, DNS_RESOLVE_SUCCEEDED, 3600));
+  tt_assert(add_answer_to_cache("quiet.example", 0, 0x05060708, NULL, 0,
+                                NULL, DNS_RESOLVE_SUCCEEDED, 3600));
+  TO_CONN(exitconn)->address = tor_strdup("popular.example");
+  tt_int_op(dns_resolve_hostname(exitconn, 0, 0, NULL, now), ==, 1);
+  tt_int_op(dns_resolve_hostname(exitconn, 0, 0, NULL, now), ==, 1);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x01020304);
+
+  /* A little before they expire, we re-resolve only the popular answer. */
+  purge_expired_resolves(refresh_at - 2);
+  tt_int_op(fake_dns_n_launched, ==, 0);
+  purge_expired_resolves(refresh_at);
+  tt_int_op(fake_dns_n_launched, ==, 1);
+
+  /* When they expire, we keep serving the popular answer until the new one
+   * comes in. */
+  purge_expired_resolves(refresh_at + 10);
+  tt_int_op(dns_cache_entry_mem_usage("quiet.example"), ==, 0);
+  tt_int_op(dns_resolve_hostname(exitconn, 0, 0, NULL, refresh_at + 10),
+            ==, 1);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x01020304);
+
+  dns_found_answer("popular.example", 0, 0x0a0b0c0d, NULL, 0, NULL,
+                   DNS_RESOLVE_SUCCEEDED, 3600);
+  /* (The new answer's TTL starts from the real clock.) */
+  tt_int_op(dns_resolve_hostname(exitconn, 0, 0, NULL, time(NULL)), ==, 1);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x0a0b0c0d);
+  tt_int_op(fake_dns_n_launched, ==, 1);
+
+ done:
+  connection_free(TO_CONN(exitconn));
+}
+
+#if defined(USE_PTHREADS) && defined(HAVE_GETADDRINFO)
+/** Make sure that the getaddrinfo backend resolves names in its worker
+ * threads and reports them to the main loop, except for names we've
+ * cancelled. */
+static void
+test_dns_getaddrinfo_backend(void *arg)
+{
+  edge_connection_t *exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  const dns_backend_t *backend = dns_backend_get_by_name("getaddrinfo");
+  tor_libevent_cfg cfg;
+  int i;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  tt_assert(backend);
+  tt_assert(dns_backend_get_by_name("eventdns"));
+  tt_assert(!dns_backend_get_by_name("carrier-pigeon"));
+  /* With a single worker, answers come back in the order we asked. */
+  get_options_mutable()->ServerDNSMaxThreads = 1;
+  dns_set_backend_for_testing_(backend);
+  tt_int_op(backend->configure(1), ==, 0);
+
+  tt_int_op(backend->launch("localhost"), ==, 0);
+  backend->cancel("localhost");
+  tt_int_op(backend->launch("127.0.0.1"), ==, 0);
+  for (i = 0; i < 10 && !dns_cache_entry_mem_usage("127.0.0.1"); ++i)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+
+  tt_int_op(dns_cache_entry_mem_usage("127.0.0.1"), >, 0);
+  tt_int_op(dns_cache_entry_mem_usage("localhost"), ==, 0);
+  TO_CONN(exitconn)->address = tor_strdup("127.0.0.1");
+  tt_int_op(dns_resolve_hostname(exitconn, 0, 0, NULL, time(NULL)), ==, 1);
+  tt_int_op(tor_addr_to_ipv4h(&TO_CONN(exitconn)->addr), ==, 0x7f000001);
+
+ done:
+  connection_free(TO_CONN(exitconn));
+}
+#endif
+
+/** Make sure that a DNSPort request shares a pending request's stream only
+ * when it asks the same question and could have shared its circuit. */
+static void
+test_dnsserv_share_request(void *arg)
+{
+  listener_connection_t *listener =
+    listener_connection_new(CONN_TYPE_AP_DNS_LISTENER, AF_INET);
+  entry_connection_t *pending = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  connection_t *conn = ENTRY_TO_CONN(pending);
+  tor_addr_t client, other_client;
+  (void)arg;
+
+  get_connection_array(); /* Make sure it exists. */
+  tor_addr_from_ipv4h(&client, 0x7f000001);
+  tor_addr_from_ipv4h(&other_client, 0x7f000002);
+  listener->isolation_flags = ISO_DEFAULT;
+  listener->session_group = 3;
+
+  /* A DNSPort request for www.example.com, waiting for its answer. */
+  pending->dns_server_request = (struct evdns_server_request *)listener;
+  pending->socks_request->command = SOCKS_COMMAND_RESOLVE;
+  pending->socks_request->listener_type = CONN_TYPE_AP_DNS_LISTENER;
+  pending->isolation_flags = listener->isolation_flags;
+  pending->session_group = listener->session_group;
+  pending->nym_epoch = get_signewnym_epoch();
+  strlcpy(pending->socks_request->address, "www.example.com",
+          sizeof(pending->socks_request->address));
+  tor_addr_copy(&conn->addr, &client);
+  ENTRY_TO_EDGE_CONN(pending)->is_dns_request = 1;
+  tt_int_op(connection_add(conn), ==, 0);
+
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE, "WWW.example.com"), ==, pending);
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE, "www.example.net"), ==, NULL);
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE_PTR, "www.example.com"), ==, NULL);
+  /* With ISO_CLIENTADDR, only the same client can share. */
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &other_client,
+                   SOCKS_COMMAND_RESOLVE, "www.example.com"), ==, NULL);
+
+  /* Once the address is rewritten, we still match the question. */
+  pending->original_dest_address = tor_strdup("www.example.com");
+  strlcpy(pending->socks_request->address, "www.example.org",
+          sizeof(pending->socks_request->address));
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE, "www.example.com"), ==, pending);
+
+  /* Other isolation settings, or a NEWNYM, keep them apart. */
+  listener->session_group = 4;
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE, "www.example.com"), ==, NULL);
+  listener->session_group = 3;
+  ++pending->nym_epoch;
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE, "www.example.com"), ==, NULL);
+  --pending->nym_epoch;
+  conn->marked_for_close = 1;
+  tt_ptr_op(dnsserv_find_shareable_request(listener, &client,
+                   SOCKS_COMMAND_RESOLVE, "www.example.com"), ==, NULL);
+
+ done:
+  connection_remove(conn);
+  pending->dns_server_request = NULL;
+  connection_free(conn);
+  connection_free(TO_CONN(listener));
+}
+
+/** Make sure that the DNS hijacking checks learn which answers our
+ * nameservers give for nonexistent names, and forget them once the
+ * nameservers stop. */
+static void
+test_dns_wildcard_checks(void *arg)
+{
+  uint32_t hijacked = htonl(0x0a000001);
+  tor_libevent_cfg cfg;
+  int i;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->ServerDNSDetectHijacking = 1;
+  dns_launch_correctness_checks();
+
+  /* We don't believe an answer until we've asked enough bogus names, and
+   * seen it enough times. */
+  for (i = 0; i < 6; ++i)
+    evdns_wildcard_check_callback(DNS_ERR_NOTEXIST, DNS_IPv4_A, 0, 0, NULL,
+                                  tor_strdup("bogus.invalid"));
+  for (i = 0; i < 5; ++i)
+    evdns_wildcard_check_callback(DNS_ERR_NONE, DNS_IPv4_A, 1, 60,
+                                  &hijacked, tor_strdup("bogus.invalid"));
+  tt_assert(!answer_is_wildcarded(0x0a000001));
+  evdns_wildcard_check_callback(DNS_ERR_NONE, DNS_IPv4_A, 1, 60,
+                                &hijacked, tor_strdup("bogus.invalid"));
+  tt_assert(answer_is_wildcarded(0x0a000001));
+  tt_assert(!answer_is_wildcarded(0x0a000002));
+  tt_assert(!dns_seems_to_be_broken());
+
+  /* We keep the answer through the next round, even if we don't see it... */
+  dns_finish_correctness_checks();
+  dns_stop_correctness_checks();
+  dns_launch_correctness_checks();
+  dns_finish_correctness_checks();
+  tt_assert(answer_is_wildcarded(0x0a000001));
+  /* ...but not through a second one. */
+  dns_stop_correctness_checks();
+  dns_launch_correctness_checks();
+  dns_finish_correctness_checks();
+  tt_assert(!answer_is_wildcarded(0x0a000001));
+
+ done:
+  dns_reset_correctness_checks();
+}
+
+/** Make sure that the expiry wheel drops each cached answer when its TTL
+ * runs out, including answers that outlive a whole turn of the wheel. */
+static void
+test_dns_expiry_wheel(void *arg)
+{
+  time_t now = time(NULL);
+  (void)arg;
+
+  tt_assert(add_answer_to_cache("short.example", 0, 0x01020304, NULL, 0,
+                                NULL, DNS_RESOLVE_SUCCEEDED, MIN_DNS_TTL));
+  tt_assert(add_answer_to_cache("long.example", 0, 0x01020305, NULL, 0,
+                                NULL, DNS_RESOLVE_SUCCEEDED, 3600));
+  tt_assert(add_answer_to_cache("gone.example", 0, 0, NULL, 0, NULL,
+                                DNS_RESOLVE_FAILED_PERMANENT, MIN_DNS_TTL));
+
+  /* (Allow for the clock ticking while we add the answers.) */
+  purge_expired_resolves(now + MIN_DNS_TTL - 1);
+  tt_int_op(dns_cache_entry_mem_usage("short.example"), >, 0);
+  tt_int_op(dns_cache_entry_mem_usage("gone.example"), >, 0);
+  purge_expired_resolves(now + MIN_DNS_TTL + 1);
+  tt_int_op(dns_cache_entry_mem_usage("short.example"), ==, 0);
+  tt_int_op(dns_cache_entry_mem_usage("gone.example"), ==, 0);
+  tt_int_op(dns_cache_entry_mem_usage("long.example"), >, 0);
+
+  /* The long answer's slot comes around before it expires. */
+  purge_expired_resolves(now + MAX_DNS_ENTRY_AGE - 1024 + 10);
+  tt_int_op(dns_cache_entry_mem_usage("long.example"), >, 0);
+  purge_expired_resolves(now + MAX_DNS_ENTRY_AGE - 1);
+  tt_int_op(dns_cache_entry_mem_usage("long.example"), >, 0);
+
+  /* If the clock jumps back, we start again from there... */
+  purge_expired_resolves(now);
+  tt_int_op(dns_cache_entry_mem_usage("long.example"), >, 0);
+  /* ...and a jump forward past the whole wheel still expires it. */
+  purge_expired_resolves(now + MAX_DNS_ENTRY_AGE + 5000);
+  tt_int_op(dns_cache_entry_mem_usage("long.example"), ==, 0);
+
+ done:
+  ;
+}
+
+/** Make sure that GETINFO dns/cache and dns/resolves count how exit
+ * streams used the cache, and how the resolves we launched went. */
+static void
+test_dns_metrics(void *arg)
+{
+  edge_connection_t *first = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  edge_connection_t *second = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  time_t now = time(NULL);
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  smartlist_t *buckets = NULL;
+  uint64_t n_resolves = 0;
+  (void)arg;
+
+  dns_set_backend_for_testing_(&fake_dns_backend);
+  tt_assert(add_answer_to_cache("www.example.com", 0, 0x01020304, NULL, 0,
+                                NULL, DNS_RESOLVE_SUCCEEDED, 3600));
+  tt_assert(add_answer_to_cache("www.example.net", 0, 0, NULL, 0, NULL,
+                                DNS_RESOLVE_FAILED_PERMANENT, 3600));
+
+  TO_CONN(first)->address = tor_strdup("www.example.com");
+  tt_int_op(dns_resolve_hostname(first, 0, 0, NULL, now), ==, 1);
+  tt_int_op(dns_resolve_hostname(first, 0, 0, NULL, now), ==, 1);
+  tor_free(TO_CONN(first)->address);
+  TO_CONN(first)->address = tor_strdup("www.example.net");
+  tt_int_op(dns_resolve_hostname(first, 0, 0, NULL, now), ==, -1);
+  /* A miss launches a resolve; the next stream waits for it. */
+  tor_free(TO_CONN(first)->address);
+  TO_CONN(first)->address = tor_strdup("www.example.org");
+  TO_CONN(second)->address = tor_strdup("www.example.org");
+  tt_int_op(dns_resolve_hostname(first, 0, 0, NULL, now), ==, 0);
+  tt_int_op(dns_resolve_hostname(second, 0, 0, NULL, now), ==, 0);
+  tt_int_op(fake_dns_n_launched, ==, 1);
+
+  tt_int_op(getinfo_helper_dns(NULL, "dns/cache", &answer, &errmsg), ==, 0);
+  tt_str_op(answer, ==,
+            "entries=3 hits=2 negative-hits=1 pending-hits=1 misses=1");
+  tor_free(answer);
+  tt_int_op(getinfo_helper_dns(NULL, "dns/resolves", &answer, &errmsg),
+            ==, 0);
+  tt_str_op(answer, ==, "launched=1 succeeded=0 failed=0 "
+            "failed-transient=0 pending=1");
+  tor_free(answer);
+
+  /* Once the answer comes in, it counts, and so does how long it took. */
+  TO_CONN(first)->state = TO_CONN(second)->state = EXIT_CONN_STATE_RESOLVING;
+  TO_CONN(first)->purpose = TO_CONN(second)->purpose = EXIT_PURPOSE_CONNECT;
+  connection_dns_remove(first);
+  connection_dns_remove(second);
+  dns_found_answer("www.example.org", 0, 0x01020306, NULL, 0, NULL,
+                   DNS_RESOLVE_SUCCEEDED, 3600);
+  tt_int_op(getinfo_helper_dns(NULL, "dns/resolves", &answer, &errmsg),
+            ==, 0);
+  tt_str_op(answer, ==, "launched=1 succeeded=1 failed=0 "
+            "failed-transient=0 pending=0");
+  tor_free(answer);
+  tt_int_op(getinfo_helper_dns(NULL, "dns/latency", &answer, &errmsg),
+            ==, 0);
+  /* (However long it took, it's in exactly one bucket.) */
+  buckets = smartlist_new();
+  smartlist_split_string(buckets, answer, ",", 0, 0);
+  tt_int_op(smartlist_len(buckets), ==, LATENCY_HISTOGRAM_N_BUCKETS);
+  SMARTLIST_FOREACH(buckets, const char *, cp,
+                    n_resolves += tor_parse_uint64(cp, 10, 0, UINT64_MAX,
+                                                   NULL, NULL));
+  tt_assert(n_resolves == 1);
+
+ done:
+  tor_free(answer);
+  if (buckets) {
+    SMARTLIST_FOREACH(buckets, char *, cp, tor_free(cp));
+    smartlist_free(buckets);
+  }
+  connection_free(TO_CONN(first));
+  connection_free(TO_CONN(second));
+}
+
+/** Make sure that SocketBufferBudget leaves socket buffers to the kernel
+ * until we're over budget, and then scales them to fit. */
+static void
+test_sockbuf_target_size(void *arg)
+{
+  (void)arg;
+  /* Under budget, we leave buffers we've never set alone. */
+  tt_int_op(connection_sockbuf_target_size(100000, 300000, 1000000, 0), ==,
+            0);
+  tt_int_op(connection_sockbuf_target_size(100, 300000, 300000, 0), ==, 0);
+  /* Over budget, every buffer gets its share, but no less than the
+   * minimum. */
+  tt_int_op(connection_sockbuf_target_size(100000, 400000, 200000, 0), ==,
+            50000);
+  tt_int_op(connection_sockbuf_target_size(100, 400000, 200000, 0), ==,
+            MIN_AUTO_TCP_BUFFER);
+  /* Once we've set a buffer, we keep managing it, but don't bother with
+   * small changes. */
+  tt_int_op(connection_sockbuf_target_size(64000, 300000, 1000000, 8192),
+            ==, 64000);
+  tt_int_op(connection_sockbuf_target_size(55000, 300000, 1000000, 60000),
+            ==, 0);
+  tt_int_op(connection_sockbuf_target_size(100000, 400000, 200000, 45000),
+            ==, 0);
+ done:
+  ;
+}
+
+/** Make sure that we only pack TLS records when TLSRecordCoalescing is set
+ * and the connection has more cells waiting. */
+static void
+test_tls_record_size(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  or_connection_t conn;
+  (void)arg;
+
+  memset(&conn, 0, sizeof(conn));
+  tt_int_op(options->TLSRecordCoalescing, ==, 0);
+  conn.active_circuits = (circuit_t*) &conn; /* Anything non-NULL. */
+  tt_int_op(connection_or_get_tls_record_size(&conn), ==, 0);
+
+  options->TLSRecordCoalescing = 1;
+  tt_int_op(connection_or_get_tls_record_size(&conn), ==,
+            OR_CONN_TLS_RECORD_MAX);
+  conn.active_circuits = NULL;
+  tt_int_op(connection_or_get_tls_record_size(&conn), ==, 0);
+
+ done:
+  options->TLSRecordCoalescing = 0;
+}
+
+/** Check which descriptors routerstatus_download_is_urgent() wants
+ * first: those of nodes in EntryNodes, whether they're listed by nickname
+ * or by country. */
+static void
+test_urgent_desc_download(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  routerstatus_t rs;
+  (void)arg;
+
+  test_eq(0, geoip_parse_entry("10,50,AB"));
+  test_eq(0, geoip_parse_entry("52,90,XY"));
+
+  memset(&rs, 0, sizeof(rs));
+  memset(rs.identity_digest, 0x55, DIGEST_LEN);
+  strlcpy(rs.nickname, "alice", sizeof(rs.nickname));
+  rs.addr = 60;
+  rs.or_port = 9001;
+
+  /* No entry guards and no EntryNodes: nothing is urgent. */
+  test_eq(0, routerstatus_download_is_urgent(&rs));
+
+  options->EntryNodes = routerset_new();
+  test_eq(0, routerset_parse(options->EntryNodes, "{ab},bob", "test"));
+  routerset_refresh_countries(options->EntryNodes);
+
+  /* Wrong country, wrong nickname. */
+  test_eq(0, routerstatus_download_is_urgent(&rs));
+  /* In a country we listed: we have no node for it, so the country is
+   * looked up from its address. */
+  rs.addr = 20;
+  test_eq(1, routerstatus_download_is_urgent(&rs));
+  /* Listed by nickname. */
+  rs.addr = 60;
+  strlcpy(rs.nickname, "bob", sizeof(rs.nickname));
+  test_eq(1, routerstatus_download_is_urgent(&rs));
+
+ done:
+  routerset_free(options->EntryNodes);
+  options->EntryNodes = NULL;
+}
+
+/** Make sure that routerset_contains_node() agrees with the routerset's
+ * entries, and notices when the set or the nodes' routerstatuses change. */
+static void
+test_routerset_node_bits(void *arg)
+{
+  routerinfo_t ri_a, ri_b;
+  routerstatus_t rs_a1, rs_b1, rs_a2;
+  routerset_t *set = routerset_new(), *countries = routerset_new();
+  node_t *node_a, *node_b;
+  (void)arg;
+
+  test_eq(0, geoip_parse_entry("10,50,AB"));
+  test_eq(0, geoip_parse_entry("52,90,XY"));
+
+  /* Two nodes, as if they were listed in a consensus. */
+  memset(&ri_a, 0, sizeof(ri_a));
+  memset(&ri_b, 0, sizeof(ri_b));
+  memset(&rs_a1, 0, sizeof(rs_a1));
+  memset(&rs_b1, 0, sizeof(rs_b1));
+  memset(rs_a1.identity_digest, 0x11, DIGEST_LEN);
+  memset(rs_b1.identity_digest, 0x22, DIGEST_LEN);
+  strlcpy(rs_a1.nickname, "alice", sizeof(rs_a1.nickname));
+  strlcpy(rs_b1.nickname, "bob", sizeof(rs_b1.nickname));
+  rs_a1.addr = ri_a.addr = 20;
+  rs_b1.addr = ri_b.addr = 60;
+  memcpy(ri_a.cache_info.identity_digest, rs_a1.identity_digest, DIGEST_LEN);
+  memcpy(ri_b.cache_info.identity_digest, rs_b1.identity_digest, DIGEST_LEN);
+  node_a = nodelist_add_routerinfo(&ri_a);
+  node_b = nodelist_add_routerinfo(&ri_b);
+  node_a->rs = &rs_a1;
+  node_b->rs = &rs_b1;
+  nodelist_note_changed();
+
+  test_eq(0, routerset_parse(set, "alice", "test"));
+  test_eq(1, routerset_contains_node(set, node_a));
+  test_eq(0, routerset_contains_node(set, node_b));
+  /* Adding to the set takes effect at once. */
+  test_eq(0, routerset_parse(set, "bob", "test"));
+  test_eq(1, routerset_contains_node(set, node_b));
+
+  test_eq(0, routerset_parse(countries, "{ab}", "test"));
+  routerset_refresh_countries(countries);
+  test_eq(1, routerset_contains_node(countries, node_a));
+  test_eq(0, routerset_contains_node(countries, node_b));
+
+  /* A new consensus gives alice a new name and address. */
+  memcpy(&rs_a2, &rs_a1, sizeof(rs_a2));
+  strlcpy(rs_a2.nickname, "carol", sizeof(rs_a2.nickname));
+  rs_a2.addr = ri_a.addr = 60;
+  node_a->rs = &rs_a2;
+  node_set_country(node_a);
+  nodelist_note_changed();
+  test_eq(0, routerset_contains_node(set, node_a));
+  test_eq(0, routerset_contains_node(countries, node_a));
+
+ done:
+  routerset_free(set);
+  routerset_free(countries);
+  nodelist_free_all();
+}
+
+/** Make sure that we can find every node by its identity, even when many
+ * identities want the same slot in the node ID table, and after we drop
+ * nodes from the middle of such a run. */
+static void
+test_nodelist_id_table(void *arg)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t)*100);
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 100; ++i) {
+    char *id = ri[i].cache_info.identity_digest;
+    /* The first 40 nodes bunch up around the end of the table, and wrap
+     * around to its start; the rest are spread out. */
+    memset(id, i < 40 ? 252 + (i % 4) : i, 4);
+    set_uint32(id+4, (uint32_t)i);
+    tt_ptr_op(nodelist_add_routerinfo(&ri[i]), !=, NULL);
+  }
+  tt_int_op(smartlist_len(nodelist_get_list()), ==, 100);
+  for (i = 0; i < 100; ++i)
+    tt_ptr_op(node_get_by_id(ri[i].cache_info.identity_digest)->ri, ==,
+              &ri[i]);
+
+  for (i = 0; i < 100; i += 3)
+    nodelist_remove_routerinfo(&ri[i]);
+  tt_int_op(smartlist_len(nodelist_get_list()), ==, 66);
+  for (i = 0; i < 100; ++i) {
+    const node_t *node = node_get_by_id(ri[i].cache_info.identity_digest);
+    if (i % 3 == 0) {
+      tt_ptr_op(node, ==, NULL);
+    } else {
+      tt_assert(node);
+      tt_ptr_op(node->ri, ==, &ri[i]);
+    }
+  }
+
+ done:
+  nodelist_free_all();
+  tor_free(ri);
+}
+
+/** Make sure that we remember which entry guards are usable until our
+ * directory information changes, and then look again. */
+static void
+test_entry_guard_usability(void *arg)
+{
+  or_state_t state;
+  routerinfo_t ri;
+  node_t *node;
+  char line[64];
+  char *msg = NULL;
+  (void)arg;
+
+  memset(&state, 0, sizeof(state));
+  memset(&ri, 0, sizeof(ri));
+  memset(ri.cache_info.identity_digest, 0x42, DIGEST_LEN);
+  tor_snprintf(line, sizeof(line), "EntryGuard guard %s\n",
+               hex_str(ri.cache_info.identity_digest, DIGEST_LEN));
+  tt_int_op(config_get_lines(line, &state.EntryGuards, 0), ==, 0);
+  state.TorVersion = tor_strdup("Tor "VERSION);
+  tt_int_op(entry_guards_parse_state(&state, 1, &msg), ==, 0);
+
+  /* Without a descriptor, the guard is no use to us. */
+  tt_int_op(num_live_entry_guards(), ==, 0);
+
+  ri.nickname = string_intern("guard");
+  ri.addr = 0x01020304;
+  ri.or_port = 9001;
+  ri.purpose = ROUTER_PURPOSE_GENERAL;
+  node = nodelist_add_routerinfo(&ri);
+  node->is_fast = 1;
+  /* As router_add_to_routerlist() would, tell everyone about it. */
+  router_dir_info_changed();
+  tt_int_op(num_live_entry_guards(), ==, 1);
+
+  /* We don't look at the node again until the directory changes. */
+  node->is_fast = 0;
+  tt_int_op(num_live_entry_guards(), ==, 1);
+  router_dir_info_changed();
+  tt_int_op(num_live_entry_guards(), ==, 0);
+  node->is_fast = 1;
+  entry_guards_note_usability_changed();
+  tt_int_op(num_live_entry_guards(), ==, 1);
+
+ done:
+  tor_free(msg);
+  tor_free(state.TorVersion);
+  config_free_lines(state.EntryGuards);
+  entry_guards_free_all();
+  nodelist_free_all();
+}
+
+/** Make sure that a node's family holds the nodes in its /16 and the
+ * nodes that it and they mutually declare, and that we notice when a
+ * declared family changes. */
+static void
+test_node_family(void *arg)
+{
+  routerinfo_t ri[4];
+  node_t *node[4];
+  char hexid[4][HEX_DIGEST_LEN+2];
+  smartlist_t *fam = smartlist_new();
+  int i;
+  (void)arg;
+
+  get_options_mutable()->EnforceDistinctSubnets = 1;
+  memset(ri, 0, sizeof(ri));
+  for (i = 0; i < 4; ++i) {
+    memset(ri[i].cache_info.identity_digest, 0x11*(i+1), DIGEST_LEN);
+    hexid[i][0] = '$';
+    base16_encode(hexid[i]+1, HEX_DIGEST_LEN+1,
+                  ri[i].cache_info.identity_digest, DIGEST_LEN);
+    ri[i].nickname = string_intern("relay");
+    ri[i].or_port = 9001;
+    ri[i].declared_family = smartlist_new();
+  }
+  /* 0 and 1 share a /16; 0 and 2 declare each other; 3 declares 0, but 0
+   * doesn't declare it back. */
+  ri[0].addr = 0x01020304;
+  ri[1].addr = 0x01020909;
+  ri[2].addr = 0x05060708;
+  ri[3].addr = 0x09090909;
+  smartlist_add(ri[0].declared_family, tor_strdup(hexid[2]));
+  smartlist_add(ri[2].declared_family, tor_strdup(hexid[0]));
+  smartlist_add(ri[3].declared_family, tor_strdup(hexid[0]));
+  for (i = 0; i < 4; ++i)
+    node[i] = nodelist_add_routerinfo(&ri[i]);
+  router_dir_info_changed();
+
+  nodelist_add_node_and_family(fam, node[0]);
+  tt_assert(smartlist_isin(fam, node[0]));
+  tt_assert(smartlist_isin(fam, node[1]));
+  tt_assert(smartlist_isin(fam, node[2]));
+  tt_assert(!smartlist_isin(fam, node[3]));
+  smartlist_clear(fam);
+  nodelist_add_node_and_family(fam, node[3]);
+  tt_assert(smartlist_isin(fam, node[3]));
+  tt_assert(!smartlist_isin(fam, node[0]));
+  smartlist_clear(fam);
+
+  /* Once 2 stops declaring 0, and we hear about it, they aren't family. */
+  SMARTLIST_FOREACH(ri[2].declared_family, char *, cp, tor_free(cp));
+  smartlist_clear(ri[2].declared_family);
+  router_dir_info_changed();
+  nodelist_add_node_and_family(fam, node[0]);
+  tt_assert(smartlist_isin(fam, node[1]));
+  tt_assert(!smartlist_isin(fam, node[2]));
+
+ done:
+  smartlist_free(fam);
+  nodelist_free_all();
+  for (i = 0; i < 4; ++i) {
+    SMARTLIST_FOREACH(ri[i].declared_family, char *, cp, tor_free(cp));
+    smartlist_free(ri[i].declared_family);
+  }
+}
+
+/** Make sure that the responsible HSDirs for an ID are the next few
+ * HSDirs in the consensus after it, wrapping around the end. */
+static void
+test_hsdir_ring(void *arg)
+{
+  networkstatus_t ns;
+  routerstatus_t rs[5];
+  smartlist_t *dirs = smartlist_new();
+  char id[DIGEST_LEN];
+  int i;
+  (void)arg;
+
+  memset(&ns, 0, sizeof(ns));
+  ns.routerstatus_list = smartlist_new();
+  memset(rs, 0, sizeof(rs));
+  for (i = 0; i < 5; ++i) {
+    memset(rs[i].identity_digest, 0x10*(i+1), DIGEST_LEN);
+    rs[i].is_hs_dir = (i != 1);
+    smartlist_add(ns.routerstatus_list, &rs[i]);
+  }
+
+  /* The three HSDirs after the ID, skipping one that isn't an HSDir. */
+  memset(id, 0x15, DIGEST_LEN);
+  hid_serv_find_responsible_in_consensus(&ns, dirs, id);
+  tt_int_op(smartlist_len(dirs), ==, 3);
+  tt_ptr_op(smartlist_get(dirs, 0), ==, &rs[2]);
+  tt_ptr_op(smartlist_get(dirs, 1), ==, &rs[3]);
+  tt_ptr_op(smartlist_get(dirs, 2), ==, &rs[4]);
+  smartlist_clear(dirs);
+
+  /* An HSDir whose identity is the ID is responsible for it. */
+  memset(id, 0x40, DIGEST_LEN);
+  hid_serv_find_responsible_in_consensus(&ns, dirs, id);
+  tt_int_op(smartlist_len(dirs), ==, 3);
+  tt_ptr_op(smartlist_get(dirs, 0), ==, &rs[3]);
+  tt_ptr_op(smartlist_get(dirs, 1), ==, &rs[4]);
+  tt_ptr_op(smartlist_get(dirs, 2), ==, &rs[0]);
+  smartlist_clear(dirs);
+
+  /* After the last one, we wrap around. */
+  memset(id, 0x60, DIGEST_LEN);
+  hid_serv_find_responsible_in_consensus(&ns, dirs, id);
+  tt_int_op(smartlist_len(dirs), ==, 3);
+  tt_ptr_op(smartlist_get(dirs, 0), ==, &rs[0]);
+  tt_ptr_op(smartlist_get(dirs, 1), ==, &rs[2]);
+  tt_ptr_op(smartlist_get(dirs, 2), ==, &rs[3]);
+  smartlist_clear(dirs);
+
+  /* With fewer HSDirs than replicas, we use them all.  (The ring is built
+   * once per consensus, so use a new one.) */
+  smartlist_free(ns.hs_dir_ring);
+  ns.hs_dir_ring = NULL;
+  rs[2].is_hs_dir = rs[3].is_hs_dir = 0;
+  hid_serv_find_responsible_in_consensus(&ns, dirs, id);
+  tt_int_op(smartlist_len(dirs), ==, 2);
+  tt_ptr_op(smartlist_get(dirs, 0), ==, &rs[0]);
+  tt_ptr_op(smartlist_get(dirs, 1), ==, &rs[4]);
+
+ done:
+  smartlist_free(dirs);
+  smartlist_free(ns.routerstatus_list);
+  smartlist_free(ns.hs_dir_ring);
+}
+
+#ifdef USE_PTHREADS
+/** Make sure that an INTRODUCE2 cell we hand to the worker threads gets
+ * decrypted there, and that the main thread finishes answering it. */
+static void
+test_rend_introduce_in_worker(void *arg)
+{
+  rend_service_t *service;
+  rend_service_port_config_t *port;
+  rend_authorized_client_t *client;
+  crypto_pk_t *intro_key = NULL, *onion_key = NULL;
+  crypto_dh_t *client_dh = NULL;
+  char plaintext[RELAY_PAYLOAD_SIZE], *cp;
+  uint8_t request[RELAY_PAYLOAD_SIZE];
+  char dh_hash[DIGEST_LEN];
+  int klen, r, i;
+  tor_libevent_cfg cfg;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  cpu_init();
+
+  /* The service wants client authorization, so it drops our cell once
+   * it has checked it for replays, rather than building a circuit. */
+  service = tor_malloc_zero(sizeof(rend_service_t));
+  service->directory = tor_strdup(get_fname("intro_in_worker"));
+  service->ports = smartlist_new();
+  port = tor_malloc_zero(sizeof(rend_service_port_config_t));
+  port->virtual_port = port->real_port = 80;
+  tor_addr_from_ipv4h(&port->real_addr, 0x7f000001);
+  smartlist_add(service->ports, port);
+  service->auth_type = REND_BASIC_AUTH;
+  service->clients = smartlist_new();
+  client = tor_malloc_zero(sizeof(rend_authorized_client_t));
+  client->client_name = tor_strdup("alice");
+  smartlist_add(service->clients, client);
+  service->private_key = pk_generate(0);
+  tt_int_op(0, ==, crypto_pk_get_digest(service->private_key,
+                                        service->pk_digest));
+  rend_add_service(service);
+
+  /* A version 2 INTRODUCE2 cell, with no authorization data. */
+  intro_key = pk_generate(1);
+  onion_key = pk_generate(2);
+  client_dh = crypto_dh_new(DH_TYPE_REND);
+  tt_assert(client_dh);
+  tt_int_op(0, ==, crypto_dh_generate_public(client_dh));
+  cp = plaintext;
+  *cp++ = 2;
+  set_uint32(cp, htonl(0x7f000001));
+  set_uint16(cp+4, htons(9001));
+  memset(cp+6, 'x', DIGEST_LEN);
+  cp += 6+DIGEST_LEN;
+  klen = crypto_pk_asn1_encode(onion_key, cp+2,
+                               sizeof(plaintext)-(cp+2-plaintext));
+  tt_int_op(klen, >, 0);
+  set_uint16(cp, htons(klen));
+  cp += 2+klen;
+  memset(cp, 'c', REND_COOKIE_LEN);
+  cp += REND_COOKIE_LEN;
+  tt_int_op(0, ==, crypto_dh_get_public(client_dh, cp, DH_KEY_LEN));
+  crypto_digest(dh_hash, cp, DH_KEY_LEN);
+  cp += DH_KEY_LEN;
+
+  tt_int_op(0, ==, crypto_pk_get_digest(intro_key, (char*)request));
+  r = crypto_pk_public_hybrid_encrypt(intro_key, (char*)request+DIGEST_LEN,
+                                      sizeof(request)-DIGEST_LEN,
+                                      plaintext, cp-plaintext,
+                                      PK_PKCS1_OAEP_PADDING, 0);
+  tt_int_op(r, >, 0);
+  tt_int_op(DIGEST_LEN+r, <=, RELAY_PAYLOAD_SIZE);
+
+  tt_int_op(0, ==, assign_rend_introduce_to_cpuworker(service->pk_digest,
+                                                      intro_key, request,
+                                                      DIGEST_LEN+r));
+  /* Nothing is answered until the worker wakes up the main loop. */
+  tt_assert(!service->accepted_intro_dh_parts);
+  for (i = 0; i < 10 && !service->accepted_intro_dh_parts; ++i)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+
+  /* The main thread parsed what the worker decrypted: it remembered the
+   * client's half of the handshake. */
+  tt_assert(service->accepted_intro_dh_parts);
+  tt_assert(replaycache_add_and_test(service->accepted_intro_dh_parts,
+                                     dh_hash, time(NULL)));
+
+ done:
+  rend_service_free_all();
+  crypto_pk_free(intro_key);
+  crypto_pk_free(onion_key);
+  if (client_dh)
+    crypto_dh_free(client_dh);
+}
+#endif
+
+/** Make sure that the quicker our circuits get built, the more of them
+ * we're willing to build in parallel, within limits. */
+static void
+test_predictive_build_concurrency(void *arg)
+{
+  (void)arg;
+
+  /* Before we've learned a timeout, we use the default. */
+  circ_times.have_computed_timeout = 0;
+  circ_times.timeout_ms = 1000;
+  tt_int_op(circuit_predictive_build_concurrency(), ==, 4);
+
+  circ_times.have_computed_timeout = 1;
+  circ_times.timeout_ms = 10000;
+  tt_int_op(circuit_predictive_build_concurrency(), ==, 3);
+  circ_times.timeout_ms = 12000;
+  tt_int_op(circuit_predictive_build_concurrency(), ==, 2);
+  /* Slow networks still get two at once, and fast ones no more than six. */
+  circ_times.timeout_ms = 60000;
+  tt_int_op(circuit_predictive_build_concurrency(), ==, 2);
+  circ_times.timeout_ms = 1000;
+  tt_int_op(circuit_predictive_build_concurrency(), ==, 6);
+  circ_times.timeout_ms = 0;
+  tt_int_op(circuit_predictive_build_concurrency(), ==, 4);
+
+ done:
+  ;
+}
+
+/** Make sure that we keep enough clean internal circuits for a hidden
+ * service connection, and one more with ParallelHSConnect. */
+static void
+test_hs_client_circ_prediction(void *arg)
+{
+  time_t now = time(NULL);
+  int uptime, capacity;
+  (void)arg;
+
+  /* We made a hidden service connection that needed uptime just now. */
+  rep_hist_note_used_internal(now, 1, 1);
+
+  get_options_mutable()->ParallelHSConnect = 0;
+  uptime = capacity = 0;
+  tt_assert(circuit_needs_hs_client_circuits(now, 1, 1, &uptime, &capacity));
+  tt_int_op(uptime, ==, 1);
+  tt_int_op(capacity, ==, 1);
+  tt_assert(!circuit_needs_hs_client_circuits(now, 2, 2, &uptime,
+                                              &capacity));
+  /* Circuits without uptime don't count for ones that need it. */
+  tt_assert(circuit_needs_hs_client_circuits(now, 2, 1, &uptime,
+                                             &capacity));
+
+  /* With ParallelHSConnect, the descriptor fetch gets one too. */
+  get_options_mutable()->ParallelHSConnect = 1;
+  tt_assert(circuit_needs_hs_client_circuits(now, 2, 2, &uptime,
+                                             &capacity));
+  tt_assert(!circuit_needs_hs_client_circuits(now, 3, 3, &uptime,
+                                              &capacity));
+
+  /* Once we haven't used a hidden service for an hour, we need none. */
+  tt_assert(!circuit_needs_hs_client_circuits(now + 2*60*60, 0, 0, &uptime,
+                                              &capacity));
+
+ done:
+  ;
+}
+
+/** Make sure that with ParallelHSConnect, a stream that starts waiting
+ * for a hidden service descriptor goes looking for its rendezvous circuit
+ * right away, without leaving the RENDDESC_WAIT state. */
+static void
+test_rend_launch_early(void *arg)
+{
+  entry_connection_t *conn;
+  or_connection_t *orconn;
+  origin_circuit_t *circ;
+  rend_data_t *rend_data;
+  (void)arg;
+
+  conn = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  conn->socks_request = socks_request_new();
+  conn->socks_request->command = SOCKS_COMMAND_CONNECT;
+  conn->socks_request->port = 80;
+  strlcpy(conn->socks_request->address, "aaaaaaaaaaaaaaaa.onion",
+          sizeof(conn->socks_request->address));
+  rend_data = tor_malloc_zero(sizeof(rend_data_t));
+  strlcpy(rend_data->onion_address, "aaaaaaaaaaaaaaaa",
+          sizeof(rend_data->onion_address));
+  ENTRY_TO_EDGE_CONN(conn)->rend_data = rend_data;
+  ENTRY_TO_CONN(conn)->state = AP_CONN_STATE_RENDDESC_WAIT;
+
+  /* An open rendezvous circuit to the same service, so that we needn't
+   * build one. */
+  orconn = or_connection_new(AF_INET);
+  circ = origin_circuit_new();
+  circuit_set_purpose(TO_CIRCUIT(circ), CIRCUIT_PURPOSE_C_REND_JOINED);
+  circ->build_state = tor_malloc_zero(sizeof(cpath_build_state_t));
+  circ->build_state->is_internal = 1;
+  circ->rend_data = rend_data_dup(rend_data);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(circ), 5, orconn);
+  TO_CIRCUIT(circ)->state = CIRCUIT_STATE_OPEN;
+
+  /* Without ParallelHSConnect, we wait for the descriptor. */
+  get_options_mutable()->ParallelHSConnect = 0;
+  tt_ptr_op(connection_ap_launch_rendezvous_early(conn), ==, NULL);
+
+  /* With it, we pick the circuit now, but still wait for the descriptor
+   * before attaching. */
+  get_options_mutable()->ParallelHSConnect = 1;
+  tt_ptr_op(connection_ap_launch_rendezvous_early(conn), ==, circ);
+  tt_int_op(ENTRY_TO_CONN(conn)->state, ==, AP_CONN_STATE_RENDDESC_WAIT);
+  tt_ptr_op(ENTRY_TO_EDGE_CONN(conn)->on_circuit, ==, NULL);
+
+ done:
+  circuit_free_all();
+  connection_free(TO_CONN(orconn));
+  connection_free(ENTRY_TO_CONN(conn));
+}
+
+/** Make sure that pending streams that every exit must treat alike share
+ * a class, and that streams an exit could treat differently don't. */
+static void
+test_pending_stream_classes(void *arg)
+{
+  static const struct {
+    uint8_t command; const char *address; uint16_t port;
+  } streams[] = {
+    { SOCKS_COMMAND_CONNECT, "www.example.com", 80 },
+    { SOCKS_COMMAND_CONNECT, "www.example.org", 80 },
+    { SOCKS_COMMAND_CONNECT, "www.example.com", 443 },
+    { SOCKS_COMMAND_CONNECT, "10.0.0.1", 80 },
+    { SOCKS_COMMAND_CONNECT, "10.0.0.2", 80 },
+    { SOCKS_COMMAND_CONNECT, "10.0.0.1", 80 },
+    { SOCKS_COMMAND_RESOLVE, "www.example.com", 0 },
+    { SOCKS_COMMAND_RESOLVE, "www.example.net", 0 },
+  };
+  entry_connection_t *conns[8];
+  smartlist_t *classes = smartlist_new();
+  pending_stream_class_t *cls;
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 8; ++i) {
+    conns[i] = entry_connection_new(CONN_TYPE_AP, AF_INET);
+    conns[i]->socks_request->command = streams[i].command;
+    strlcpy(conns[i]->socks_request->address, streams[i].address,
+            sizeof(conns[i]->socks_request->address));
+    conns[i]->socks_request->port = streams[i].port;
+    pending_stream_classes_add(classes, conns[i]);
+  }
+
+  /* Hostnames on one port share a class; each literal address gets its
+   * own; resolves all look alike. */
+  tt_int_op(smartlist_len(classes), ==, 5);
+  cls = smartlist_get(classes, 0);
+  tt_ptr_op(cls->example, ==, conns[0]);
+  tt_int_op(cls->addr_is_literal, ==, 0);
+  tt_int_op(cls->n, ==, 2);
+  cls = smartlist_get(classes, 1);
+  tt_ptr_op(cls->example, ==, conns[2]);
+  tt_int_op(cls->n, ==, 1);
+  cls = smartlist_get(classes, 2);
+  tt_ptr_op(cls->example, ==, conns[3]);
+  tt_int_op(cls->addr_is_literal, ==, 1);
+  tt_int_op(cls->n, ==, 2);
+  cls = smartlist_get(classes, 3);
+  tt_ptr_op(cls->example, ==, conns[4]);
+  tt_int_op(cls->n, ==, 1);
+  cls = smartlist_get(classes, 4);
+  tt_ptr_op(cls->example, ==, conns[6]);
+  tt_int_op(cls->n, ==, 2);
+
+ done:
+  SMARTLIST_FOREACH(classes, pending_stream_class_t *, c, tor_free(c));
+  smartlist_free(classes);
+  for (i = 0; i < 8; ++i)
+    connection_free(ENTRY_TO_CONN(conns[i]));
+}
+
+/** Make sure that weighted node choice picks the first candidate whose
+ * running bandwidth total reaches the random value, skipping candidates
+ * that have no weight. */
+static void
+test_cumulative_bw_index(void *arg)
+{
+  /* Candidates 1 and 3 have zero weight. */
+  const double cumulative[] = { 10.0, 10.0, 25.0, 25.0, 40.0 };
+  (void)arg;
+
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 1.0), ==, 0);
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 10.0), ==, 0);
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 11.0), ==, 2);
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 25.0), ==, 2);
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 26.0), ==, 4);
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 40.0), ==, 4);
+  /* Past the total, we report that nothing matched. */
+  tt_int_op(find_cumulative_bw_index(cumulative, 5, 41.0), ==, 5);
+  tt_int_op(find_cumulative_bw_index(cumulative, 1, 5.0), ==, 0);
+
+ done:
+  ;
+}
+
+/** Make sure that the slower our descriptor requests have been, the more
+ * of them we send to each mirror, within limits. */
+static void
+test_desc_requests_per_mirror(void *arg)
+{
+  int i;
+  (void)arg;
+
+  /* While requests are quick, each one gets its own mirror. */
+  tt_int_op(descriptor_requests_per_mirror(12), ==, 1);
+  router_note_descriptor_request_time(1);
+  router_note_descriptor_request_time(-5);
+  tt_int_op(descriptor_requests_per_mirror(12), ==, 1);
+
+  /* Slow requests share mirrors... */
+  for (i = 0; i < 10; ++i)
+    router_note_descriptor_request_time(5);
+  tt_int_op(descriptor_requests_per_mirror(12), ==, 3);
+  /* ...but no more than four to a mirror... */
+  for (i = 0; i < 20; ++i)
+    router_note_descriptor_request_time(60);
+  tt_int_op(descriptor_requests_per_mirror(100), ==, 4);
+  /* ...and we still spread them over three mirrors if we can. */
+  tt_int_op(descriptor_requests_per_mirror(6), ==, 2);
+  tt_int_op(descriptor_requests_per_mirror(1), ==, 1);
+
+ done:
+  ;
+}
+
+/** Make sure that we back off from fetching a hidden service descriptor
+ * once every directory has failed to give it to us, but not before we've
+ * asked any of them. */
+static void
+test_rend_desc_failure(void *arg)
+{
+  const char *addr = "aaaaaaaaaaaaaaaa";
+  rend_data_t query;
+  time_t now = 1000000;
+  (void)arg;
+
+  /* Each failure in a row doubles the wait, up to the maximum. */
+  tt_int_op(0, ==, rend_client_desc_failure_wait(addr, now));
+  rend_client_note_desc_failure(addr, now);
+  tt_int_op(REND_DESC_FAILURE_MIN_BACKOFF, ==,
+            rend_client_desc_failure_wait(addr, now));
+  tt_int_op(1, ==, rend_client_desc_failure_wait(addr, now+29));
+  tt_int_op(0, ==, rend_client_desc_failure_wait(addr, now+30));
+  now += 30;
+  rend_client_note_desc_failure(addr, now);
+  tt_int_op(2*REND_DESC_FAILURE_MIN_BACKOFF, ==,
+            rend_client_desc_failure_wait(addr, now));
+  while (rend_client_desc_failure_wait(addr, now) <
+         REND_DESC_FAILURE_MAX_BACKOFF) {
+    now += rend_client_desc_failure_wait(addr, now);
+    rend_client_note_desc_failure(addr, now);
+  }
+  tt_int_op(REND_DESC_FAILURE_MAX_BACKOFF, ==,
+            rend_client_desc_failure_wait(addr, now));
+  now += REND_DESC_FAILURE_MAX_BACKOFF;
+  rend_client_note_desc_failure(addr, now);
+  tt_int_op(REND_DESC_FAILURE_MAX_BACKOFF, ==,
+            rend_client_desc_failure_wait(addr, now));
+
+  /* After a long enough quiet spell, we start over. */
+  now += 3*REND_DESC_FAILURE_MAX_BACKOFF;
+  rend_client_note_desc_failure(addr, now);
+  tt_int_op(REND_DESC_FAILURE_MIN_BACKOFF, ==,
+            rend_client_desc_failure_wait(addr, now));
+
+  /* Getting the descriptor, or NEWNYM, resets it. */
+  rend_client_forget_desc_failure(addr);
+  tt_int_op(0, ==, rend_client_desc_failure_wait(addr, now));
+  rend_client_note_desc_failure(addr, now);
+  rend_client_purge_desc_failures();
+  tt_int_op(0, ==, rend_client_desc_failure_wait(addr, now));
+
+  /* Without any directories to ask, we haven't failed to fetch it. */
+  memset(&query, 0, sizeof(query));
+  strlcpy(query.onion_address, addr, sizeof(query.onion_address));
+  query.auth_type = REND_NO_AUTH;
+  get_options_mutable()->FetchHidServDescriptors = 1;
+  rend_cache_init();
+  rend_client_refetch_v2_renddesc(&query);
+  tt_int_op(0, ==, rend_client_desc_failure_wait(addr, time(NULL)));
+
+ done:
+  rend_client_purge_desc_failures();
+  rend_cache_free_all();
+}
+
+/** Look up the descriptor we store as a directory under the ID made of
+ * <b>c</b> repeated, and return it, or NULL. */
+static const char *
+rend_dir_lookup_helper(char c)
+{
+  char id[DIGEST_LEN];
+  char id_base32[REND_DESC_ID_V2_LEN_BASE32 + 1];
+  const char *desc = NULL;
+  memset(id, c, sizeof(id));
+  base32_encode(id_base32, sizeof(id_base32), id, DIGEST_LEN);
+  if (rend_cache_lookup_v2_desc_as_dir(id_base32, &desc) != 1)
+    return NULL;
+  return desc;
+}
+
+/** Make sure that the descriptors we store as a hidden service directory
+ * stay within HidServDirectoryCacheSize, and that we drop the ones that
+ * were stored or served longest ago first. */
+static void
+test_rend_dir_cache_lru(void *arg)
+{
+  const size_t len = 100000;
+  char *body = tor_malloc(len);
+  char id[DIGEST_LEN];
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  time_t now = time(NULL);
+  (void)arg;
+
+  memset(body, 'x', len);
+  get_options_mutable()->HidServDirectoryCacheSize = 250000;
+  rend_cache_init();
+
+  memset(id, 'a', sizeof(id));
+  rend_cache_dir_store(id, now, body, len, now);
+  memset(id, 'b', sizeof(id));
+  rend_cache_dir_store(id, now, body, len, now);
+  rend_cache_dir_enforce_size_limit();
+  tt_assert(rend_dir_lookup_helper('a'));
+  tt_assert(rend_dir_lookup_helper('b'));
+
+  /* Serving "a" makes "b" the least recently used, so "b" goes when "c"
+   * takes us over the limit. */
+  tt_assert(rend_dir_lookup_helper('a'));
+  memset(id, 'c', sizeof(id));
+  rend_cache_dir_store(id, now, body, len, now);
+  rend_cache_dir_enforce_size_limit();
+  tt_assert(!rend_dir_lookup_helper('b'));
+  tt_assert(rend_dir_lookup_helper('a'));
+  tt_assert(rend_dir_lookup_helper('c'));
+
+  /* Replacing a descriptor doesn't count it twice. */
+  memset(id, 'a', sizeof(id));
+  rend_cache_dir_store(id, now+1, body, len, now);
+  rend_cache_dir_enforce_size_limit();
+  tt_assert(rend_dir_lookup_helper('c'));
+
+  getinfo_helper_rend_cache(NULL, "hs-dir/cache", &answer, &errmsg);
+  tt_assert(answer);
+  tt_assert(!strcmpstart(answer, "entries=2 "));
+  tt_assert(strstr(answer, " evicted=1 hits=6 misses=1 "));
+
+ done:
+  tor_free(body);
+  tor_free(answer);
+  rend_cache_free_all();
+}
+
+/** Make sure that the token buckets never get more than what's left of
+ * AccountingMax, and that AccountingShaping slows us down once we're
+ * using up AccountingMax too fast. */
+static void
+test_accounting_shaping(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  /* The middle of a month, so that the interval has a while to go. */
+  time_t now = 1350000000;
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  int i;
+  (void)arg;
+
+  options->AccountingMax = 100*1024*1024;
+  options->AccountingShaping = 1;
+  tt_int_op(0, ==, accounting_parse_options(options, 0));
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_LIVE);
+  reset_accounting(now);
+
+  tt_int_op(accounting_get_bytes_left(0), ==, 100*1024*1024);
+  accounting_add_bytes(1024, 100*1024*1024 + 1, 1);
+  tt_int_op(accounting_get_bytes_left(0), ==, 100*1024*1024 - 1024);
+  tt_int_op(accounting_get_bytes_left(1), ==, 0);
+  /* Dormant, we don't count what we use against the limit. */
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_DORMANT);
+  tt_int_op(accounting_get_bytes_left(1), ==, INT_MAX);
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_LIVE);
+
+  /* A burst of use doesn't start shaping all by itself... */
+  reset_accounting(now);
+  accounting_update_shaping(now);
+  accounting_add_bytes(100000, 0, 1);
+  accounting_update_shaping(++now);
+  tt_int_op(accounting_shape_bandwidth_rate(500000), ==, 500000);
+
+  /* ...but keeping it up, so that we'd run out within the hour, does.
+   * Then we limit ourselves to what lasts until the end of the interval,
+   * but never less than 1 KB/s. */
+  for (i = 0; i < 120; ++i) {
+    accounting_add_bytes(100000, 0, 1);
+    accounting_update_shaping(++now);
+  }
+  tt_int_op(accounting_shape_bandwidth_rate(500000), ==, 1024);
+  tt_int_op(accounting_shape_bandwidth_rate(100), ==, 100);
+  getinfo_helper_accounting(NULL, "accounting/shaped-rate", &answer,
+                            &errmsg);
+  tt_str_op(answer, ==, "1024");
+
+  /* Without AccountingShaping, we don't slow down. */
+  options->AccountingShaping = 0;
+  accounting_update_shaping(++now);
+  tt_int_op(accounting_shape_bandwidth_rate(500000), ==, 500000);
+
+ done:
+  tor_free(answer);
+  options->AccountingMax = 0;
+  options->AccountingShaping = 0;
+}
+
+/** Make sure that when we come back from being dormant, we predict the
+ * circuits we were predicting when we left, even though the predictions
+ * would have expired meanwhile. */
+static void
+test_hibernate_warm_resume(void *arg)
+{
+  time_t now = time(NULL), later = now + 2*60*60;
+  smartlist_t *ports = NULL;
+  int need_uptime = 0, need_capacity = 0;
+  (void)arg;
+
+  rep_hist_init();
+  get_options_mutable()->DisableNetwork = 1;
+  rep_hist_note_used_port(now, 443);
+  rep_hist_note_used_internal(now, 1, 1);
+  hibernate_save_resume_state(now);
+
+  ports = rep_hist_get_predicted_ports(later);
+  tt_int_op(smartlist_len(ports), ==, 0);
+  SMARTLIST_FOREACH(ports, uint16_t *, p, tor_free(p));
+  smartlist_free(ports);
+  ports = NULL;
+  tt_assert(!rep_hist_get_predicted_internal(later, &need_uptime,
+                                             &need_capacity));
+
+  hibernate_warm_resume(later);
+  ports = rep_hist_get_predicted_ports(later);
+  tt_int_op(smartlist_len(ports), ==, 2);
+  tt_int_op(*(uint16_t*)smartlist_get(ports, 0), ==, 80);
+  tt_int_op(*(uint16_t*)smartlist_get(ports, 1), ==, 443);
+  tt_assert(rep_hist_get_predicted_internal(later, &need_uptime,
+                                            &need_capacity));
+  tt_assert(need_uptime);
+
+  /* We only resume from what we saved once. */
+  SMARTLIST_FOREACH(ports, uint16_t *, p, tor_free(p));
+  smartlist_free(ports);
+  ports = NULL;
+  later += 2*60*60;
+  hibernate_warm_resume(later);
+  ports = rep_hist_get_predicted_ports(later);
+  tt_int_op(smartlist_len(ports), ==, 0);
+
+ done:
+  if (ports) {
+    SMARTLIST_FOREACH(ports, uint16_t *, p, tor_free(p));
+    smartlist_free(ports);
+  }
+  hibernate_free_all();
+  get_options_mutable()->DisableNetwork = 0;
+}
+
+/** Make sure that we keep histograms of how long main-loop callbacks take,
+ * overall and by connection type, and count the ones that stall the main
+ * loop. */
+static void
+test_main_loop_profile(void *arg)
+{
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  uint64_t now = tor_monotime_nsec();
+  (void)arg;
+
+  get_options_mutable()->MainLoopStallThreshold = 2;
+  main_loop_profile_callback(MAIN_LOOP_CB_CONN_READ, CONN_TYPE_OR, now);
+  main_loop_profile_callback(MAIN_LOOP_CB_CONN_READ, CONN_TYPE_OR,
+                             now - 5*1000*1000);
+  main_loop_profile_callback(MAIN_LOOP_CB_REFILL, 0, now);
+
+  getinfo_helper_main_loop(NULL, "main-loop/callbacks", &answer, &errmsg);
+  tt_assert(!strcmpstart(answer, "conn_read="));
+  tt_assert(strstr(answer, "\nrefill="));
+  tt_assert(!strstr(answer, "conn_write="));
+  tor_free(answer);
+
+  getinfo_helper_main_loop(NULL, "main-loop/conn-callbacks", &answer,
+                           &errmsg);
+  tt_assert(!strcmpstart(answer, "conn_read/OR="));
+  tt_assert(!strchr(answer, '\n'));
+  tor_free(answer);
+
+  getinfo_helper_main_loop(NULL, "main-loop/stalls", &answer, &errmsg);
+  tt_str_op(answer, ==, "conn_read=1\nconn_write=0\nsecond_elapsed=0\n"
+            "refill=0\ndns_answer=0\ndns_gai_answers=0");
+
+ done:
+  tor_free(answer);
+}
+
+/** Make sure that we only check the signature on each pair of
+ * certificates once, but that we still reject pairs that don't check
+ * out. */
+static void
+test_tls_cert_verify_cache(void *arg)
+{
+  crypto_pk_t *identity = pk_generate(0);
+  const tor_cert_t *link_cert = NULL, *id_cert = NULL;
+  (void)arg;
+
+  tt_int_op(0, ==, tor_tls_context_init(1, identity, identity, 86400));
+  tt_int_op(0, ==, tor_tls_get_my_certs(1, &link_cert, &id_cert));
+  tt_int_op(0, ==, tor_tls_cert_verify_cache_size());
+
+  tt_assert(tor_tls_cert_is_valid(LOG_WARN, link_cert, id_cert, 0));
+  tt_int_op(1, ==, tor_tls_cert_verify_cache_size());
+  tt_assert(tor_tls_cert_is_valid(LOG_WARN, link_cert, id_cert, 0));
+  tt_int_op(1, ==, tor_tls_cert_verify_cache_size());
+  /* Checking the key size too is a different check. */
+  tt_assert(tor_tls_cert_is_valid(LOG_WARN, id_cert, id_cert, 1));
+  tt_int_op(2, ==, tor_tls_cert_verify_cache_size());
+
+  /* The identity cert isn't signed by the link key; that isn't
+   * remembered. */
+  tt_assert(!tor_tls_cert_is_valid(LOG_INFO, id_cert, link_cert, 0));
+  tt_assert(!tor_tls_cert_is_valid(LOG_INFO, id_cert, link_cert, 0));
+  tt_int_op(2, ==, tor_tls_cert_verify_cache_size());
+
+ done:
+  tor_tls_free_all();
+  crypto_pk_free(identity);
+}
+
+/** Make a pair of tor_tls_t objects, a client and a server, over a new
+ * socketpair in <b>fds</b>.  Return 0 on success, -1 on failure. */
+static int
+tls_pair_new(tor_socket_t *fds, tor_tls_t **client, tor_tls_t **server)
+{
+  *client = *server = NULL;
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    fds[0] = fds[1] = TOR_INVALID_SOCKET;
+    return -1;
+  }
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  *client = tor_tls_new(fds[0], 0);
+  *server = tor_tls_new(fds[1], 1);
+  return (*client && *server) ? 0 : -1;
+}
+
+/** Run the TLS handshake between <b>client</b> and <b>server</b> to
+ * completion.  Return 0 on success, -1 on failure. */
+static int
+tls_pair_handshake(tor_tls_t *client, tor_tls_t *server)
+{
+  int c = TOR_TLS_WANTREAD, s = TOR_TLS_WANTREAD, i;
+  for (i = 0; i < 100 && (c != TOR_TLS_DONE || s != TOR_TLS_DONE); ++i) {
+    if (c != TOR_TLS_DONE)
+      c = tor_tls_handshake(client);
+    if (s != TOR_TLS_DONE)
+      s = tor_tls_handshake(server);
+    if (c < TOR_TLS_WANTREAD || s < TOR_TLS_WANTREAD)
+      return -1;
+  }
+  return (c == TOR_TLS_DONE && s == TOR_TLS_DONE) ? 0 : -1;
+}
+
+/** Free a pair made by tls_pair_new(), and close its sockets. */
+static void
+tls_pair_free(tor_socket_t *fds, tor_tls_t **client, tor_tls_t **server)
+{
+  tor_tls_free(*client);
+  tor_tls_free(*server);
+  *client = *server = NULL;
+  if (fds[0] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[0]);
+  if (fds[1] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[1]);
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+}
+
+/** Make sure that, over real TLS handshakes, sessions we save in the
+ * session cache get offered and resumed on the next connection to the
+ * same relay, and only there. */
+static void
+test_tls_session_resumption(void *arg)
+{
+  crypto_pk_t *identity = pk_generate(0);
+  char digest[DIGEST_LEN], other_digest[DIGEST_LEN];
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  (void)arg;
+
+  memset(digest, 0x42, DIGEST_LEN);
+  memset(other_digest, 0x43, DIGEST_LEN);
+  tt_int_op(0, ==, tor_tls_context_init(1, identity, identity, 86400));
+
+  /* With the cache off, there's nothing to offer or save. */
+  tt_int_op(0, ==, tls_pair_new(fds, &client, &server));
+  tt_int_op(0, ==, tor_tls_resume_session(client, digest));
+  tt_int_op(0, ==, tls_pair_handshake(client, server));
+  tt_assert(!tor_tls_session_was_resumed(client));
+  tor_tls_save_session(client, digest);
+  tls_pair_free(fds, &client, &server);
+
+  /* Turn the cache on: the first handshake has nothing to resume. */
+  tor_tls_set_session_cache_size(2);
+  tt_int_op(0, ==, tls_pair_new(fds, &client, &server));
+  tt_int_op(0, ==, tor_tls_resume_session(client, digest));
+  tt_int_op(0, ==, tls_pair_handshake(client, server));
+  tt_assert(!tor_tls_session_was_resumed(client));
+
+  /* A session we save gets resumed next time, on both sides. */
+  tor_tls_save_session(client, digest);
+  tls_pair_free(fds, &client, &server);
+  tt_int_op(0, ==, tls_pair_new(fds, &client, &server));
+  tt_int_op(1, ==, tor_tls_resume_session(client, digest));
+  tt_int_op(0, ==, tls_pair_handshake(client, server));
+  tt_assert(tor_tls_session_was_resumed(client));
+  tt_assert(tor_tls_session_was_resumed(server));
+  /* Both ends still agree they're past the v1 link handshake. */
+  tt_assert(!tor_tls_used_v1_handshake(client));
+  tt_assert(!tor_tls_used_v1_handshake(server));
+  tor_tls_save_session(client, digest);
+  tls_pair_free(fds, &client, &server);
+
+  /* It isn't offered to a different relay. */
+  tt_int_op(0, ==, tls_pair_new(fds, &client, &server));
+  tt_int_op(0, ==, tor_tls_resume_session(client, other_digest));
+  tt_int_op(0, ==, tls_pair_handshake(client, server));
+  tt_assert(!tor_tls_session_was_resumed(client));
+  tls_pair_free(fds, &client, &server);
+
+  /* Shrinking the cache to nothing forgets it. */
+  tor_tls_set_session_cache_size(0);
+  tor_tls_set_session_cache_size(2);
+  tt_int_op(0, ==, tls_pair_new(fds, &client, &server));
+  tt_int_op(0, ==, tor_tls_resume_session(client, digest));
+
+ done:
+  tls_pair_free(fds, &client, &server);
+  tor_tls_free_all();
+  crypto_pk_free(identity);
+}
+
+/** Make sure that flush_buf_tls() sends a buffer of many small chunks in
+ * one TLS record per chunk by default, and in records of up to
+ * <b>record_size</b> bytes when it's asked to gather them. */
+static void
+test_tls_record_coalescing(void *arg)
+{
+  crypto_pk_t *identity = pk_generate(0);
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  buf_t *buf = NULL;
+  char *in = NULL, *out = NULL;
+  const size_t len = 40000;
+  size_t flushlen, total;
+  int r, i, pass;
+  (void)arg;
+
+  in = tor_malloc(len);
+  out = tor_malloc(len);
+  for (i = 0; i < (int)len; ++i)
+    in[i] = (char)(i * 7 + i / 256);
+  tt_int_op(0, ==, tor_tls_context_init(1, identity, identity, 86400));
+  tt_int_op(0, ==, tls_pair_new(fds, &client, &server));
+  tt_int_op(0, ==, tls_pair_handshake(client, server));
+
+  for (pass = 0; pass < 2; ++pass) {
+    size_t record_size = pass ? 16384 : 0;
+    buf = buf_new_with_capacity(512);
+    for (i = 0; i < (int)len; i += 1000)
+      write_to_buf(in + i, 1000, buf);
+    flushlen = len;
+    r = flush_buf_tls(client, buf, len, &flushlen, record_size);
+    tt_int_op(r, ==, len);
+    tt_int_op(flushlen, ==, 0);
+    tt_int_op(buf_datalen(buf), ==, 0);
+    buf_free(buf);
+    buf = NULL;
+
+    /* SSL_read() hands back at most one record at a time, so the size of
+     * the first read tells us how big the first record was. */
+    r = tor_tls_read(server, out, len);
+    if (record_size)
+      tt_int_op(r, ==, record_size);
+    else
+      tt_int_op(r, <, 16384);
+    for (total = r; total < len; total += r) {
+      r = tor_tls_read(server, out + total, len - total);
+      tt_int_op(r, >, 0);
+    }
+    test_memeq(out, in, len);
+  }
+
+ done:
+  buf_free(buf);
+  tls_pair_free(fds, &client, &server);
+  tor_tls_free_all();
+  crypto_pk_free(identity);
+  tor_free(in);
+  tor_free(out);
+}
+
+#ifndef _WIN32
+#ifndef BUILDDIR
+#define BUILDDIR "."
+#endif
+
+/** A connection to the fake SOCKS server in test_tor_resolve_batch. */
+typedef struct fake_socks_conn_t {
+  tor_socket_t s;
+  char buf[256];
+  size_t len;
+} fake_socks_conn_t;
+
+/** If <b>conn</b> holds a whole SOCKS4a resolve request, return the
+ * hostname it asks for; else return NULL. */
+static const char *
+fake_socks_get_hostname(fake_socks_conn_t *conn)
+{
+  const char *user_end, *host_end;
+  if (conn->len < 8 ||
+      !(user_end = memchr(conn->buf+8, '\0', conn->len-8)))
+    return NULL;
+  ++user_end;
+  host_end = memchr(user_end, '\0', conn->buf+conn->len-user_end);
+  return host_end ? user_end : NULL;
+}
+
+/** Run tor-resolve in batch mode against a fake SOCKS server, and make sure
+ * that it has several resolves going at once and reports every result. */
+static void
+test_tor_resolve_batch(void *arg)
+{
+  const char *resolver = BUILDDIR "/src/tools/tor-resolve";
+  tor_socket_t listener = TOR_INVALID_SOCKET;
+  fake_socks_conn_t conns[3];
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+  process_handle_t *handle = NULL;
+  char *cmd = NULL;
+  const char *argv[] = { "/bin/sh", "-c", NULL, NULL };
+  char out[256];
+  ssize_t n;
+  int n_conns = 0, i;
+  (void)arg;
+
+  if (access(resolver, X_OK) < 0)
+    tt_skip();
+  memset(conns, 0, sizeof(conns));
+  for (i = 0; i < 3; ++i)
+    conns[i].s = TOR_INVALID_SOCKET;
+
+  listener = tor_open_socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(0, ==, bind(listener, (struct sockaddr*)&sin, sizeof(sin)));
+  tt_int_op(0, ==, getsockname(listener, (struct sockaddr*)&sin, &sinlen));
+  tt_int_op(0, ==, listen(listener, 8));
+
+  tor_asprintf(&cmd, "printf 'a.example\\n\\nbad.example\\nb.example\\n' | "
+               "%s -4 -b -j 3 127.0.0.1:%d", resolver,
+               (int)ntohs(sin.sin_port));
+  argv[2] = cmd;
+  tt_int_op(PROCESS_STATUS_RUNNING, ==,
+            tor_spawn_background(argv[0], argv, NULL, &handle));
+
+  /* Take all three requests before answering any of them. */
+  while (n_conns < 3 || !fake_socks_get_hostname(&conns[0]) ||
+         !fake_socks_get_hostname(&conns[1]) ||
+         !fake_socks_get_hostname(&conns[2])) {
+    fd_set fds;
+    struct timeval tv;
+    tor_socket_t max_fd = listener;
+    FD_ZERO(&fds);
+    FD_SET(listener, &fds);
+    for (i = 0; i < n_conns; ++i) {
+      FD_SET(conns[i].s, &fds);
+      if (conns[i].s > max_fd)
+        max_fd = conns[i].s;
+    }
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    tt_int_op(select((int)max_fd + 1, &fds, NULL, NULL, &tv), >, 0);
+    if (FD_ISSET(listener, &fds)) {
+      tt_int_op(n_conns, <, 3);
+      conns[n_conns].s = tor_accept_socket(listener, NULL, NULL);
+      tt_assert(SOCKET_OK(conns[n_conns].s));
+      ++n_conns;
+    }
+    for (i = 0; i < n_conns; ++i) {
+      if (FD_ISSET(conns[i].s, &fds)) {
+        n = tor_socket_recv(conns[i].s, conns[i].buf + conns[i].len,
+                            sizeof(conns[i].buf) - conns[i].len, 0);
+        tt_int_op(n, >, 0);
+        conns[i].len += n;
+      }
+    }
+  }
+
+  for (i = 0; i < 3; ++i) {
+    const char *hostname = fake_socks_get_hostname(&conns[i]);
+    char reply[8] = { 0, 90, 0, 0, 10, 0, 0, 0 };
+    tt_int_op(conns[i].buf[0], ==, 4);
+    tt_int_op((uint8_t)conns[i].buf[1], ==, 0xF0);
+    if (!strcmp(hostname, "bad.example"))
+      reply[1] = 91;
+    else
+      reply[7] = hostname[0] == 'a' ? 1 : 2;
+    tt_int_op(8, ==, tor_socket_send(conns[i].s, reply, 8, 0));
+  }
+
+  n = tor_read_all_from_process_stdout(handle, out, sizeof(out)-1);
+  tt_int_op(n, >, 0);
+  out[n] = '\0';
+  tt_assert(strstr(out, "a.example 10.0.0.1\n"));
+  tt_assert(strstr(out, "b.example 10.0.0.2\n"));
+  tt_assert(strstr(out, "bad.example FAILED\n"));
+  tt_int_op(strlen(out), ==, strlen("a.example 10.0.0.1\n"
+                                    "b.example 10.0.0.2\n"
+                                    "bad.example FAILED\n"));
+
+ done:
+  for (i = 0; i < 3; ++i) {
+    if (SOCKET_OK(conns[i].s))
+      tor_close_socket(conns[i].s);
+  }
+  if (SOCKET_OK(listener))
+    tor_close_socket(listener);
+  if (handle)
+    tor_process_handle_destroy(handle, 1);
+  tor_free(cmd);
+}
+#endif
+
+#ifndef USE_BUFFEREVENTS
+/** Make sure that per-connection token buckets catch up on refills when
+ * we look at them, and that refilling wakes just the connections on the
+ * list of those blocked on bandwidth. */
+static void
+test_conn_lazy_refill(void *arg)
+{
+  or_connection_t *a = NULL, *b = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_libevent_cfg cfg;
+  time_t now = time(NULL);
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  connection_bucket_init();
+  get_connection_array(); /* Make sure it exists. */
+  tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  a = or_connection_new(AF_INET);
+  b = or_connection_new(AF_INET);
+  TO_CONN(a)->s = fds[0];
+  TO_CONN(b)->s = fds[1];
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  tt_int_op(0, ==, connection_add(TO_CONN(a)));
+  tt_int_op(0, ==, connection_add(TO_CONN(b)));
+  TO_CONN(a)->state = TO_CONN(b)->state = OR_CONN_STATE_OPEN;
+  a->bandwidthrate = b->bandwidthrate = 1000;
+  a->bandwidthburst = b->bandwidthburst = 4000;
+  connection_or_buckets_catch_up(a);
+  connection_or_buckets_catch_up(b);
+  a->read_bucket = a->write_bucket = b->read_bucket = 0;
+
+  /* A refill doesn't touch a connection that isn't waiting... */
+  connection_bucket_refill(500, now);
+  tt_int_op(a->read_bucket, ==, 0);
+  /* ...until we look at its buckets, and then it gets them once. */
+  connection_or_buckets_catch_up(a);
+  tt_int_op(a->read_bucket, ==, 500);
+  tt_int_op(a->write_bucket, ==, 500);
+  connection_or_buckets_catch_up(a);
+  tt_int_op(a->read_bucket, ==, 500);
+
+  /* A connection that's waiting gets woken up once it has tokens, and
+   * leaves the list. */
+  connection_or_buckets_catch_up(b);
+  b->read_bucket = 0;
+  connection_stop_reading(TO_CONN(b));
+  TO_CONN(b)->read_blocked_on_bw = 1;
+  connection_note_blocked_on_bw(TO_CONN(b));
+  tt_int_op(TO_CONN(b)->bw_blocked_idx, ==, 0);
+  connection_bucket_refill(250, now);
+  tt_int_op(b->read_bucket, ==, 250);
+  tt_assert(!TO_CONN(b)->read_blocked_on_bw);
+  tt_assert(connection_is_reading(TO_CONN(b)));
+  tt_int_op(TO_CONN(b)->bw_blocked_idx, ==, -1);
+
+  /* Freeing a connection takes it off the list. */
+  connection_note_blocked_on_bw(TO_CONN(a));
+  connection_note_blocked_on_bw(TO_CONN(b));
+  tt_int_op(TO_CONN(b)->bw_blocked_idx, ==, 1);
+  connection_remove(TO_CONN(a));
+  connection_free(TO_CONN(a));
+  a = NULL;
+  tt_int_op(TO_CONN(b)->bw_blocked_idx, ==, 0);
+
+ done:
+  if (a) {
+    connection_remove(TO_CONN(a));
+    connection_free(TO_CONN(a));
+  }
+  if (b) {
+    connection_remove(TO_CONN(b));
+    connection_free(TO_CONN(b));
+  }
+  if (fds[0] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[0]);
+  if (fds[1] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[1]);
+}
+#endif
+
+/** Make sure that connection housekeeping works out when each connection
+ * next needs looking at, and looks only at the connections that are due. */
+static void
+test_conn_housekeeping_queue(void *arg)
+{
+  or_connection_t *a = NULL, *b = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_libevent_cfg cfg;
+  time_t now = time(NULL);
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->KeepalivePeriod = 300;
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_LIVE);
+  get_connection_array(); /* Make sure it exists. */
+  /* Get the first pass's rescan of every connection out of the way. */
+  run_due_connection_housekeeping(now);
+
+  tt_int_op(0, ==, tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  a = or_connection_new(AF_INET);
+  b = or_connection_new(AF_INET);
+  TO_CONN(a)->s = fds[0];
+  TO_CONN(b)->s = fds[1];
+  fds[0] = fds[1] = TOR_INVALID_SOCKET;
+  tt_int_op(0, ==, connection_add(TO_CONN(a)));
+  tt_int_op(0, ==, connection_add(TO_CONN(b)));
+  TO_CONN(a)->state = TO_CONN(b)->state = OR_CONN_STATE_OPEN;
+
+  /* An idle connection is due when it would time out; one with circuits
+   * when it needs a keepalive. */
+  TO_CONN(a)->timestamp_lastwritten = now;
+  a->timestamp_last_added_nonpadding = now;
+  tt_int_op(connection_next_housekeeping(TO_CONN(a), now), ==,
+            now + 180);
+  a->n_circuits = 1;
+  tt_int_op(connection_next_housekeeping(TO_CONN(a), now), ==,
+            now + 300);
+  /* Never in the past, though. */
+  tt_int_op(connection_next_housekeeping(TO_CONN(a), now + 1000), ==,
+            now + 1001);
+
+  /* Both connections need a keepalive, but only one of them is due. */
+  b->n_circuits = 1;
+  TO_CONN(a)->timestamp_lastwritten = now - 1000;
+  TO_CONN(b)->timestamp_lastwritten = now - 1000;
+  connection_schedule_housekeeping(TO_CONN(a), now);
+  connection_schedule_housekeeping(TO_CONN(b), now + 10);
+  run_due_connection_housekeeping(now);
+  tt_int_op(connection_get_outbuf_len(TO_CONN(a)), >, 0);
+  tt_int_op(connection_get_outbuf_len(TO_CONN(b)), ==, 0);
+  tt_int_op(TO_CONN(a)->housekeeping_due, >, now);
+  run_due_connection_housekeeping(now + 10);
+  tt_int_op(connection_get_outbuf_len(TO_CONN(b)), >, 0);
+
+ done:
+  if (a) {
+    connection_remove(TO_CONN(a));
+    connection_free(TO_CONN(a));
+  }
+  if (b) {
+    connection_remove(TO_CONN(b));
+    connection_free(TO_CONN(b));
+  }
+  if (fds[0] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[0]);
+  if (fds[1] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[1]);
+}
+
+/** Make sure that an idle client lets its main loop go dormant, and that
+ * it doesn't while there's anything to do. */
+static void
+test_main_loop_dormant(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  entry_connection_t *ap = NULL;
+  origin_circuit_t *circ = NULL;
+  time_t now = time(NULL);
+  (void)arg;
+
+  get_connection_array(); /* Make sure it exists. */
+  hibernate_set_state_for_testing_(HIBERNATE_STATE_LIVE);
+  options->DisableNetwork = 1;
+  options->DormantWakeupInterval = 0;
+  tt_assert(!main_loop_can_go_dormant(now));
+  options->DormantWakeupInterval = 60;
+  tt_assert(main_loop_can_go_dormant(now));
+
+  /* Without directory info, we have to go and get some. */
+  options->DisableNetwork = 0;
+  tt_assert(!main_loop_can_go_dormant(now));
+  options->DisableNetwork = 1;
+
+  /* A circuit being built needs looking at every second; an open one
+   * doesn't. */
+  circ = origin_circuit_new();
+  circ->_base.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  circ->_base.state = CIRCUIT_STATE_BUILDING;
+  tt_assert(!main_loop_can_go_dormant(now));
+  circ->_base.state = CIRCUIT_STATE_OPEN;
+  tt_assert(main_loop_can_go_dormant(now));
+
+  /* So does a stream. */
+  ap = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  ENTRY_TO_EDGE_CONN(ap)->is_dns_request = 1;
+  tt_int_op(0, ==, connection_add(ENTRY_TO_CONN(ap)));
+  tt_assert(!main_loop_can_go_dormant(now));
+  connection_remove(ENTRY_TO_CONN(ap));
+  connection_free(ENTRY_TO_CONN(ap));
+  ap = NULL;
+  tt_assert(main_loop_can_go_dormant(now));
+
+ done:
+  if (ap) {
+    connection_remove(ENTRY_TO_CONN(ap));
+    connection_free(ENTRY_TO_CONN(ap));
+  }
+  circuit_free_all();
+}
+
+#ifndef USE_BUFFEREVENTS
+/** Make sure that each bandwidth class gets its share of the global
+ * buckets while the others are busy, and can borrow while they aren't. */
+static void
+test_conn_bw_classes(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  dir_connection_t *dir = NULL;
+  edge_connection_t *exitconn = NULL;
+  time_t now = time(NULL);
+  (void)arg;
+
+  options->BandwidthRate = options->BandwidthBurst = 9000;
+  options->BandwidthClassWeights = smartlist_new();
+  smartlist_add(options->BandwidthClassWeights, tor_strdup("relay=8"));
+  smartlist_add(options->BandwidthClassWeights, tor_strdup("dir=1"));
+  options->_BandwidthClassWeights[BW_CLASS_RELAY] = 8;
+  options->_BandwidthClassWeights[BW_CLASS_DIR] = 1;
+  connection_bucket_init();
+  connection_bucket_refill(1000, now);
+
+  dir = dir_connection_new(AF_INET);
+  exitconn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+
+  /* Alone, a class can use everything... */
+  tt_int_op(connection_bw_class_allowance(TO_CONN(dir), 1, 9000, now), ==,
+            9000);
+  /* ...but once another class wants bandwidth, each gets what's left
+   * after the other's share. */
+  tt_int_op(connection_bw_class_allowance(TO_CONN(exitconn), 1, 9000, now),
+            ==, 8000);
+  tt_int_op(connection_bw_class_allowance(TO_CONN(dir), 1, 9000, now), ==,
+            1000);
+  /* Its own share is always there, up to what the global bucket has. */
+  tt_int_op(connection_bw_class_allowance(TO_CONN(dir), 0, 5000, now), ==,
+            1000);
+  tt_int_op(connection_bw_class_allowance(TO_CONN(dir), 0, 500, now), ==,
+            500);
+  /* A class that's been quiet for a while has no claim. */
+  tt_int_op(connection_bw_class_allowance(TO_CONN(dir), 1, 9000, now+5), ==,
+            9000);
+
+  /* Without BandwidthClassWeights, there are no shares at all. */
+  SMARTLIST_FOREACH(options->BandwidthClassWeights, char *, cp,
+                    tor_free(cp));
+  smartlist_free(options->BandwidthClassWeights);
+  options->BandwidthClassWeights = NULL;
+  tt_int_op(connection_bw_class_allowance(TO_CONN(exitconn), 1, 9000, now),
+            ==, 9000);
+  tt_int_op(connection_bw_class_allowance(TO_CONN(dir), 1, 9000, now), ==,
+            9000);
+
+ done:
+  if (dir)
+    connection_free(TO_CONN(dir));
+  if (exitconn)
+    connection_free(TO_CONN(exitconn));
+}
+#endif
+
+#ifndef USE_BUFFEREVENTS
+/** Make sure that data written to one end of a pair of linked connections
+ * reaches the other end without waiting for the main loop, unless that
+ * end's inbuf is already full. */
+static void
+test_conn_linked_direct(void *arg)
+{
+  dir_connection_t *dir = NULL;
+  entry_connection_t *ap = NULL;
+  tor_libevent_cfg cfg;
+  char *junk = NULL;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_options_mutable()->BandwidthRate = 1<<20;
+  get_options_mutable()->BandwidthBurst = 1<<20;
+  connection_bucket_init();
+  get_connection_array(); /* Make sure it exists. */
+  dir = dir_connection_new(AF_INET);
+  ap = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  connection_link_connections(TO_CONN(dir), ENTRY_TO_CONN(ap));
+  tt_int_op(0, ==, connection_add(TO_CONN(dir)));
+  tt_int_op(0, ==, connection_add(ENTRY_TO_CONN(ap)));
+  /* Half a SOCKS request: the AP conn will just wait for the rest. */
+  TO_CONN(dir)->state = DIR_CONN_STATE_CLIENT_SENDING;
+  ENTRY_TO_CONN(ap)->state = AP_CONN_STATE_SOCKS_WAIT;
+  connection_start_reading(ENTRY_TO_CONN(ap));
+
+  connection_write_to_buf("\x04", 1, TO_CONN(dir));
+  tt_assert(ENTRY_TO_CONN(ap)->active_on_link);
+  deliver_linked_data_directly();
+  tt_int_op(buf_datalen(ENTRY_TO_CONN(ap)->inbuf), ==, 1);
+  tt_int_op(connection_get_outbuf_len(TO_CONN(dir)), ==, 0);
+  tt_assert(!ENTRY_TO_CONN(ap)->active_on_link);
+
+  /* A full inbuf gets left to the main loop. */
+  junk = tor_malloc_zero(64*1024);
+  write_to_buf(junk, 64*1024, ENTRY_TO_CONN(ap)->inbuf);
+  connection_write_to_buf("\x04", 1, TO_CONN(dir));
+  tt_assert(ENTRY_TO_CONN(ap)->active_on_link);
+  deliver_linked_data_directly();
+  tt_int_op(connection_get_outbuf_len(TO_CONN(dir)), ==, 1);
+  tt_assert(ENTRY_TO_CONN(ap)->active_on_link);
+
+ done:
+  tor_free(junk);
+  if (ap && dir)
+    TO_CONN(dir)->linked_conn = ENTRY_TO_CONN(ap)->linked_conn = NULL;
+  if (ap) {
+    connection_stop_reading(ENTRY_TO_CONN(ap));
+    connection_remove(ENTRY_TO_CONN(ap));
+    connection_free(ENTRY_TO_CONN(ap));
+  }
+  if (dir) {
+    connection_remove(TO_CONN(dir));
+    connection_free(TO_CONN(dir));
+  }
+}
+#endif
+
+#ifdef HAVE_LINUX_SOCKIOS_H
+/** Make sure that with TCPNotSentLowat set, bytes the kernel hasn't sent
+ * yet count toward a connection's outbuf being too full. */
+static void
+test_conn_kernel_unsent(void *arg)
+{
+  tor_socket_t listener = TOR_INVALID_SOCKET, peer = TOR_INVALID_SOCKET;
+  edge_connection_t *conn = NULL;
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(sin);
+  char buf[4096];
+  int i;
+  (void)arg;
+
+  /* A TCP connection whose other end never reads. */
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(bind(listener, (struct sockaddr*)&sin, sizeof(sin)), ==, 0);
+  tt_int_op(listen(listener, 5), ==, 0);
+  tt_int_op(getsockname(listener, (struct sockaddr*)&sin, &sin_len), ==, 0);
+  conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  TO_CONN(conn)->s = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(TO_CONN(conn)->s));
+  tt_int_op(connect(TO_CONN(conn)->s, (struct sockaddr*)&sin, sizeof(sin)),
+            ==, 0);
+  peer = tor_accept_socket(listener, NULL, NULL);
+  tt_assert(SOCKET_OK(peer));
+
+  /* Fill up the peer's receive window and our send queue. */
+  set_socket_nonblocking(TO_CONN(conn)->s);
+  memset(buf, 'x', sizeof(buf));
+  for (i = 0; i < 16384; ++i) {
+    if (send(TO_CONN(conn)->s, buf, sizeof(buf), 0) < 0)
+      break;
+  }
+  tt_int_op(i, <, 16384);
+  tt_int_op(connection_get_outbuf_len(TO_CONN(conn)), ==, 0);
+
+  /* Without TCPNotSentLowat, we don't look. */
+  get_options_mutable()->TCPNotSentLowat = 0;
+  tt_int_op(connection_get_kernel_unsent(TO_CONN(conn)), ==, 0);
+  tt_assert(!connection_outbuf_too_full(TO_CONN(conn)));
+
+  get_options_mutable()->TCPNotSentLowat = 16384;
+  tt_int_op(connection_get_kernel_unsent(TO_CONN(conn)), >,
+            10*CELL_PAYLOAD_SIZE);
+  tt_assert(connection_outbuf_too_full(TO_CONN(conn)));
+
+ done:
+  if (conn)
+    connection_free(TO_CONN(conn));
+  if (SOCKET_OK(peer))
+    tor_close_socket(peer);
+  if (SOCKET_OK(listener))
+    tor_close_socket(listener);
+}
+#endif
+
+/** Make sure that the bytes we note within a second get added up before
+ * they reach the bandwidth history and the exit port stats. */
+static void
+test_rephist_pending_bytes(void *arg)
+{
+  char *s = NULL;
+  time_t now;
+  (void)arg;
+
+  rep_hist_init();
+  now = time(NULL);
+  rep_hist_note_bytes_read(1024, now);
+  rep_hist_note_bytes_read(1024, now);
+  rep_hist_note_bytes_read(1024, now);
+  rep_hist_note_bytes_written(1024, now);
+  /* A new second: the last one's counts go into the history. */
+  rep_hist_note_bytes_read(2048, now+1);
+  /* Once the first 15-minute period is over, its totals are what we
+   * report.  The last second's bytes are still pending when we ask. */
+  rep_hist_note_bytes_read(1, now+15*60+5);
+  rep_hist_note_bytes_written(1, now+15*60+5);
+  s = rep_hist_get_bandwidth_lines();
+  tt_assert(s);
+  tt_assert(strstr(s, "write-history "));
+  tt_assert(strstr(s, " (900 s) 1024\nread-history "));
+  tt_assert(strstr(s, " (900 s) 5120\n"));
+  tor_free(s);
+
+  /* Ports 80 and 96 share a pending slot; neither loses any bytes. */
+  rep_hist_exit_stats_init(now);
+  rep_hist_note_exit_bytes(80, 1024, 2048);
+  rep_hist_note_exit_bytes(96, 3072, 4096);
+  rep_hist_note_exit_bytes(80, 1024, 2048);
+  s = rep_hist_format_exit_stats(now + 86400);
+  tt_assert(s);
+  tt_assert(strstr(s, "exit-kibibytes-written 80=2,96=3,other=0\n"));
+  tt_assert(strstr(s, "exit-kibibytes-read 80=4,96=4,other=0\n"));
+
+ done:
+  tor_free(s);
+  rep_hist_exit_stats_term();
+}
 
-  test_memeq("me", socks->username, 2);
-  test_memeq("mypasswd", socks->password, 8);
+/** Run unit tests for the cell_queue_t functions in relay.c */
+static void
+test_cell_queue(void *arg)
+{
+  cell_queue_t queue;
+  cell_t cell;
+  packed_cell_t *pc;
+  int i, n_popped = 0;
+  (void)arg;
+
+  init_cell_pool();
+  memset(&queue, 0, sizeof(queue));
+  memset(&cell, 0, sizeof(cell));
+  cell.command = CELL_RELAY;
+
+  tt_ptr_op(NULL, ==, cell_queue_pop(&queue));
+
+  /* Fill more than a couple of blocks, and drain some of it in between so
+   * that the queue wraps across block boundaries. */
+  for (i = 0; i < CELL_QUEUE_BLOCK_N_CELLS*3 + 3; ++i) {
+    cell.circ_id = i;
+    cell_queue_append_packed_copy(&queue, &cell);
+    tt_int_op(queue.n, ==, i + 1 - n_popped);
+    if (i % 3 == 2) {
+      pc = cell_queue_pop(&queue);
+      tt_assert(pc);
+      tt_int_op(ntohs(get_uint16(pc->body)), ==, n_popped);
+      tt_int_op((uint8_t)pc->body[2], ==, CELL_RELAY);
+      ++n_popped;
+    }
+  }
+  while ((pc = cell_queue_pop(&queue))) {
+    tt_int_op(ntohs(get_uint16(pc->body)), ==, n_popped);
+    ++n_popped;
+  }
+  tt_int_op(n_popped, ==, CELL_QUEUE_BLOCK_N_CELLS*3 + 3);
+  tt_int_op(queue.n, ==, 0);
+  tt_ptr_op(queue.head, ==, NULL);
+  tt_ptr_op(queue.tail, ==, NULL);
+
+  tt_int_op(cell_queues_get_total_allocation(), ==, 0);
+
+  /* Clearing a partly full queue leaves it empty and usable. */
+  for (i = 0; i < CELL_QUEUE_BLOCK_N_CELLS + 1; ++i)
+    cell_queue_append_packed_copy(&queue, &cell);
+  tt_int_op(cell_queues_get_total_allocation(), ==,
+            2 * sizeof(cell_queue_block_t));
+  cell_queue_clear(&queue);
+  tt_int_op(queue.n, ==, 0);
+  tt_int_op(cell_queues_get_total_allocation(), ==, 0);
+  tt_ptr_op(NULL, ==, cell_queue_pop(&queue));
+  cell.circ_id = 99;
+  cell_queue_append_packed_copy(&queue, &cell);
+  pc = cell_queue_pop(&queue);
+  tt_int_op(ntohs(get_uint16(pc->body)), ==, 99);
 
  done:
-  ;
+  cell_queue_clear(&queue);
+  free_cell_pool();
 }
 
-/** Perform SOCKS 5 authentication and send data all in one go */
+/** Run unit tests for circuit_id_get_unused_on_orconn() in
+ * circuitlist.c */
 static void
-test_socks_5_authenticate_with_data(void *ptr)
+test_circuit_ids(void *arg)
 {
-  SOCKS_TEST_INIT();
+  or_connection_t *conn;
+  or_circuit_t *circ, *circ10 = NULL, *circ3000 = NULL;
+  int i;
+  (void)arg;
 
-  /* SOCKS 5 Negotiate username/password authentication */
-  ADD_DATA(buf, "\x05\x01\x02");
+  conn = or_connection_new(AF_INET);
+
+  /* With few circuits, we probe the map. */
+  for (i = 1; i <= 5; ++i)
+    or_circuit_new(i, conn);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 1), ==, 6);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 100), ==, 100);
+  tt_ptr_op(conn->circid_bitmap, ==, NULL);
+
+  /* With many, we use a bitmap. */
+  for (i = 6; i <= 5000; ++i) {
+    circ = or_circuit_new(i, conn);
+    if (i == 10)
+      circ10 = circ;
+    else if (i == 3000)
+      circ3000 = circ;
+  }
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 1), ==, 5001);
+  tt_assert(conn->circid_bitmap);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 4999), ==, 5001);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 6000), ==, 6000);
+
+  /* Freed IDs become available again, and we find the first one after
+   * where we start. */
+  circuit_set_p_circid_orconn(circ3000, 0, NULL);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 1), ==, 3000);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 3001), ==, 5001);
+  circuit_set_p_circid_orconn(circ10, 0, NULL);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 1), ==, 10);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 11), ==, 3000);
+
+  /* We wrap around past the top of the ID space, skipping 0. */
+  or_circuit_new((1<<15) - 1, conn);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, (1<<15) - 1), ==, 10);
+  circuit_set_p_circid_orconn(circ3000, 3000, conn);
+  circuit_set_p_circid_orconn(circ10, 10, conn);
+  for (i = 5001; i < (1<<15) - 1; ++i)
+    or_circuit_new(i, conn);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 1), ==, 0);
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 0, 20000), ==, 0);
+
+  /* The other half of the ID space is separate. */
+  tt_int_op(circuit_id_get_unused_on_orconn(conn, 1<<15, 1), ==,
+            (1<<15) | 1);
 
-  test_assert(!fetch_from_buf_socks(buf, socks,
-                                   get_options()->TestSocks,
-                                   get_options()->SafeSocks));
-  test_eq(2, socks->replylen);
-  test_eq(5, socks->reply[0]);
-  test_eq(SOCKS_USER_PASS, socks->reply[1]);
-  test_eq(5, socks->socks_version);
+ done:
+  circuit_free_all();
+  connection_free(TO_CONN(conn));
+}
 
-  test_eq(0, buf_datalen(buf));
+/** Look up the stream that a DATA cell for <b>stream_id</b> arriving on
+ * <b>circ</b> from the client would go to. */
+static edge_connection_t *
+stream_for_cell(or_circuit_t *circ, streamid_t stream_id)
+{
+  cell_t cell;
+  relay_header_t rh;
+  memset(&cell, 0, sizeof(cell));
+  memset(&rh, 0, sizeof(rh));
+  rh.command = RELAY_COMMAND_DATA;
+  rh.stream_id = stream_id;
+  relay_header_pack(cell.payload, &rh);
+  return relay_lookup_conn(TO_CIRCUIT(circ), &cell, CELL_DIRECTION_OUT,
+                           NULL);
+}
 
-  /* SOCKS 5 Send username/password */
-  /* SOCKS 5 Send CONNECT [01] to IP address 2.2.2.2:4369 */
-  ADD_DATA(buf, "\x01\x02me\x03you\x05\x01\x00\x01\x02\x02\x02\x02\x11\x11");
-  test_assert(fetch_from_buf_socks(buf, socks,
-                                   get_options()->TestSocks,
-                                   get_options()->SafeSocks) == 1);
-  test_eq(5, socks->socks_version);
-  test_eq(2, socks->replylen);
-  test_eq(5, socks->reply[0]);
-  test_eq(0, socks->reply[1]);
+/** Make sure that a circuit's stream map remembers streams found deep in
+ * its stream list, and forgets them when streams are attached or detached
+ * and when the circuit closes. */
+static void
+test_circuit_stream_map(void *arg)
+{
+  or_circuit_t *circ;
+  edge_connection_t *streams[20];
+  int i;
+  (void)arg;
 
-  test_streq("2.2.2.2", socks->address);
-  test_eq(4369, socks->port);
+  circ = or_circuit_new(1, NULL);
+  circ->_base.purpose = CIRCUIT_PURPOSE_OR;
+  for (i = 0; i < 20; ++i) {
+    streams[i] = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+    streams[i]->stream_id = i+1;
+    streams[i]->on_circuit = TO_CIRCUIT(circ);
+    streams[i]->next_stream = circ->n_streams;
+    circ->n_streams = streams[i];
+  }
 
-  test_eq(2, socks->usernamelen);
-  test_eq(3, socks->passwordlen);
-  test_memeq("me", socks->username, 2);
-  test_memeq("you", socks->password, 3);
+  /* Streams near the front of the list don't need the map. */
+  tt_ptr_op(stream_for_cell(circ, 20), ==, streams[19]);
+  tt_ptr_op(circ->_base.stream_map, ==, NULL);
+
+  /* Streams deep in the list get remembered, and once there's a map,
+   * every stream we find goes in it. */
+  tt_ptr_op(stream_for_cell(circ, 1), ==, streams[0]);
+  tt_ptr_op(circuit_stream_map_lookup(TO_CIRCUIT(circ), 1), ==, streams[0]);
+  tt_ptr_op(stream_for_cell(circ, 20), ==, streams[19]);
+  tt_ptr_op(circuit_stream_map_lookup(TO_CIRCUIT(circ), 20), ==,
+            streams[19]);
+  tt_ptr_op(circuit_stream_map_lookup(TO_CIRCUIT(circ), 5), ==, NULL);
+  tt_ptr_op(stream_for_cell(circ, 21), ==, NULL);
+
+  /* Detaching a stream forgets it. */
+  circuit_detach_stream(TO_CIRCUIT(circ), streams[0]);
+  tt_ptr_op(circuit_stream_map_lookup(TO_CIRCUIT(circ), 1), ==, NULL);
+  tt_ptr_op(stream_for_cell(circ, 1), ==, NULL);
+
+  /* Attaching a stream at the front of the list, as dns_resolve() does,
+   * forgets whatever had its stream ID, so we find the new one. */
+  streams[0]->stream_id = 20;
+  streams[0]->on_circuit = TO_CIRCUIT(circ);
+  streams[0]->next_stream = circ->n_streams;
+  circ->n_streams = streams[0];
+  circuit_stream_map_remove(TO_CIRCUIT(circ), streams[0]);
+  tt_ptr_op(circuit_stream_map_lookup(TO_CIRCUIT(circ), 20), ==, NULL);
+  tt_ptr_op(stream_for_cell(circ, 20), ==, streams[0]);
+
+  /* Closing the circuit frees the map.  (Take the streams off first, so
+   * that it doesn't try to close them too.) */
+  tt_assert(circ->_base.stream_map);
+  circ->n_streams = NULL;
+  circuit_mark_for_close(TO_CIRCUIT(circ), END_CIRC_REASON_FINISHED);
+  tt_ptr_op(circ->_base.stream_map, ==, NULL);
 
  done:
-  ;
+  for (i = 0; i < 20; ++i) {
+    streams[i]->on_circuit = NULL;
+    connection_free(TO_CONN(streams[i]));
+  }
+  circuit_free_all();
 }
 
-/** Perform SOCKS 5 authentication before method negotiated */
+#ifndef USE_BUFFEREVENTS
+/** Make sure that closing an OR connection unlinks the circuits that use it
+ * as n_conn, including those we haven't given an ID there yet. */
 static void
-test_socks_5_auth_before_negotiation(void *ptr)
+test_circuit_unlink_without_id(void *arg)
 {
-  SOCKS_TEST_INIT();
+  or_connection_t *p_conn, *n_conn;
+  or_circuit_t *with_id, *without_id;
+  (void)arg;
 
-  /* SOCKS 5 Send username/password */
-  ADD_DATA(buf, "\x01\x02me\x02me");
-  test_assert(fetch_from_buf_socks(buf, socks,
-                                   get_options()->TestSocks,
-                                   get_options()->SafeSocks) == -1);
-  test_eq(0, socks->socks_version);
-  test_eq(0, socks->replylen);
-  test_eq(0, socks->reply[0]);
-  test_eq(0, socks->reply[1]);
+  p_conn = or_connection_new(AF_INET);
+  n_conn = or_connection_new(AF_INET);
+  with_id = or_circuit_new(1, p_conn);
+  without_id = or_circuit_new(2, p_conn);
+  with_id->_base.purpose = without_id->_base.purpose = CIRCUIT_PURPOSE_OR;
+  circuit_set_n_circid_orconn(TO_CIRCUIT(with_id), 7, n_conn);
+  circuit_set_n_conn_without_circid(TO_CIRCUIT(without_id), n_conn);
+  tt_int_op(smartlist_len(n_conn->circs_without_id), ==, 1);
+
+  circuit_unlink_all_from_or_conn(n_conn, END_CIRC_REASON_OR_CONN_CLOSED);
+  tt_ptr_op(with_id->_base.n_conn, ==, NULL);
+  tt_ptr_op(without_id->_base.n_conn, ==, NULL);
+  tt_int_op(smartlist_len(n_conn->circs_without_id), ==, 0);
+  tt_assert(with_id->_base.marked_for_close);
+  tt_assert(without_id->_base.marked_for_close);
+
+  /* Once it has an ID, a circuit is only in the map. */
+  without_id = or_circuit_new(3, p_conn);
+  circuit_set_n_conn_without_circid(TO_CIRCUIT(without_id), n_conn);
+  circuit_set_n_circid_orconn(TO_CIRCUIT(without_id), 8, n_conn);
+  tt_int_op(smartlist_len(n_conn->circs_without_id), ==, 0);
+  tt_ptr_op(circuit_get_by_circid_orconn(8, n_conn), ==,
+            TO_CIRCUIT(without_id));
 
  done:
-  ;
+  circuit_free_all();
+  connection_free(TO_CONN(p_conn));
+  connection_free(TO_CONN(n_conn));
 }
+#endif
 
+/** Make sure that we don't take a CREATED or CREATED_FAST reply for a hop
+ * whose handshake a cpuworker is still finishing. */
 static void
-test_buffer_copy(void *arg)
+test_circuit_created_while_in_worker(void *arg)
 {
-  generic_buffer_t *buf=NULL, *buf2=NULL;
-  const char *s;
-  size_t len;
-  char b[256];
-  int i;
+  origin_circuit_t *circ;
+  crypt_path_t *first, *second;
+  uint8_t reply[ONIONSKIN_REPLY_LEN];
+  char keys[CPATH_KEY_MATERIAL_LEN];
   (void)arg;
 
-  buf = generic_buffer_new();
-  tt_assert(buf);
+  circ = origin_circuit_new();
+  circ->_base.purpose = CIRCUIT_PURPOSE_C_GENERAL;
+  first = tor_malloc_zero(sizeof(crypt_path_t));
+  second = tor_malloc_zero(sizeof(crypt_path_t));
+  first->magic = second->magic = CRYPT_PATH_MAGIC;
+  first->state = CPATH_STATE_OPEN;
+  second->state = CPATH_STATE_AWAITING_KEYS;
+  first->next = first->prev = second;
+  second->next = second->prev = first;
+  circ->cpath = first;
+
+  /* As if we'd handed the CREATED reply to a worker. */
+  second->handshake_in_worker = 1;
+  memset(reply, 0, sizeof(reply));
+  tt_int_op(circuit_finish_handshake(circ, CELL_CREATED_FAST, reply), ==,
+            -END_CIRC_REASON_TORPROTOCOL);
+  tt_int_op(circuit_finish_handshake(circ, CELL_CREATED, reply), ==,
+            -END_CIRC_REASON_TORPROTOCOL);
+  tt_int_op(second->state, ==, CPATH_STATE_AWAITING_KEYS);
+
+  /* A worker's answer for a hop that isn't waiting on one is ignored. */
+  second->handshake_in_worker = 0;
+  memset(keys, 0, sizeof(keys));
+  circuit_finish_handshake_done(circ->global_identifier, second, 0,
+                                reply, keys);
+  tt_int_op(second->state, ==, CPATH_STATE_AWAITING_KEYS);
+  tt_assert(!circ->_base.marked_for_close);
 
-  /* Copy an empty buffer. */
-  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
-  tt_assert(buf2);
-  tt_int_op(0, ==, generic_buffer_len(buf2));
+ done:
+  circuit_free_all();
+}
 
-  /* Now try with a short buffer. */
-  s = "And now comes an act of enormous enormance!";
-  len = strlen(s);
-  generic_buffer_add(buf, s, len);
-  tt_int_op(len, ==, generic_buffer_len(buf));
-  /* Add junk to buf2 so we can test replacing.*/
-  generic_buffer_add(buf2, "BLARG", 5);
-  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
-  tt_int_op(len, ==, generic_buffer_len(buf2));
-  generic_buffer_get(buf2, b, len);
-  test_mem_op(b, ==, s, len);
-  /* Now free buf2 and retry so we can test allocating */
-  generic_buffer_free(buf2);
-  buf2 = NULL;
-  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
-  tt_int_op(len, ==, generic_buffer_len(buf2));
-  generic_buffer_get(buf2, b, len);
-  test_mem_op(b, ==, s, len);
-  /* Clear buf for next test */
-  generic_buffer_get(buf, b, len);
-  tt_int_op(generic_buffer_len(buf),==,0);
+#ifndef USE_BUFFEREVENTS
+/** Make sure that moving an exit connection to its next address waits
+ * until we're back in the main loop, and then swaps its socket. */
+static void
+test_exit_reconnect_later(void *arg)
+{
+  edge_connection_t *conn = NULL;
+  tor_socket_t listener = TOR_INVALID_SOCKET, old_s;
+  struct sockaddr_in sin;
+  socklen_t sin_len = sizeof(sin);
+  tor_addr_t addr;
+  tor_libevent_cfg cfg;
+  (void)arg;
 
-  /* Okay, now let's try a bigger buffer. */
-  s = "Quis autem vel eum iure reprehenderit qui in ea voluptate velit "
-    "esse quam nihil molestiae consequatur, vel illum qui dolorem eum "
-    "fugiat quo voluptas nulla pariatur?";
-  len = strlen(s);
-  for (i = 0; i < 256; ++i) {
-    b[0]=i;
-    generic_buffer_add(buf, b, 1);
-    generic_buffer_add(buf, s, len);
-  }
-  tt_int_op(0, ==, generic_buffer_set_to_copy(&buf2, buf));
-  tt_int_op(generic_buffer_len(buf2), ==, generic_buffer_len(buf));
-  for (i = 0; i < 256; ++i) {
-    generic_buffer_get(buf2, b, len+1);
-    tt_int_op((unsigned char)b[0],==,i);
-    test_mem_op(b+1, ==, s, len);
-  }
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+  get_connection_array(); /* Make sure it exists. */
+  get_options_mutable()->_ConnLimit = 1000;
+
+  /* Something to connect to. */
+  listener = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(listener));
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(0x7f000001);
+  tt_int_op(bind(listener, (struct sockaddr*)&sin, sizeof(sin)), ==, 0);
+  tt_int_op(listen(listener, 5), ==, 0);
+  tt_int_op(getsockname(listener, (struct sockaddr*)&sin, &sin_len), ==, 0);
+
+  conn = edge_connection_new(CONN_TYPE_EXIT, AF_INET);
+  TO_CONN(conn)->purpose = EXIT_PURPOSE_CONNECT;
+  TO_CONN(conn)->state = EXIT_CONN_STATE_CONNECTING;
+  TO_CONN(conn)->address = tor_strdup("localhost");
+  TO_CONN(conn)->port = ntohs(sin.sin_port);
+  old_s = TO_CONN(conn)->s = tor_open_socket(AF_INET, SOCK_STREAM,
+                                             IPPROTO_TCP);
+  tt_assert(SOCKET_OK(old_s));
+  tt_int_op(connection_add_connecting(TO_CONN(conn)), ==, 0);
+  connection_watch_events(TO_CONN(conn), READ_EVENT | WRITE_EVENT);
+
+  tor_addr_from_ipv4h(&addr, 0x7f000001);
+  connection_exit_reconnect_later(conn, &addr);
+  /* Nothing happens to the socket until we're back in the main loop... */
+  tt_assert(conn->exit_reconnect_pending);
+  tt_int_op(TO_CONN(conn)->s, ==, old_s);
+  tt_assert(!connection_is_reading(TO_CONN(conn)));
+  tt_assert(!connection_is_writing(TO_CONN(conn)));
+
+  /* ...and then it gets a new one. */
+  event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE|EVLOOP_NONBLOCK);
+  tt_assert(!conn->exit_reconnect_pending);
+  tt_int_op(TO_CONN(conn)->s, !=, old_s);
+  tt_assert(SOCKET_OK(TO_CONN(conn)->s));
+  tt_assert(tor_addr_eq(&TO_CONN(conn)->addr, &addr));
 
  done:
-  if (buf)
-    generic_buffer_free(buf);
-  if (buf2)
-    generic_buffer_free(buf2);
+  if (conn) {
+    connection_remove(TO_CONN(conn));
+    connection_free(TO_CONN(conn));
+  }
+  if (SOCKET_OK(listener))
+    tor_close_socket(listener);
+}
+#endif
+
+/** How many times has test_buffers_release() been called? */
+static int n_external_releases = 0;
+
+/** Release function for external buffer chunks in test_buffers(). */
+static void
+test_buffers_release(void *arg)
+{
+  (void)arg;
+  ++n_external_releases;
 }
 
 /** Run unit tests for buffers.c */
@@ -803,6 +4117,73 @@ test_buffers(void)
   buf_free(buf);
   buf = NULL;
 
+  /* Now with the string running across a chunk boundary: each 256-byte
+   * chunk holds a little under 256 bytes of data. */
+  buf = buf_new_with_capacity(5);
+  for (j = 0; j < 195; j++)
+    write_to_buf("x", 1, buf);
+  for (j = 0; cp[j]; j++)
+    write_to_buf(cp+j, 1, buf);
+  test_eq(0, buf_find_string_offset(buf, "xxx", 3));
+  test_eq(194, buf_find_string_offset(buf, "xTesting", 8));
+  test_eq(195, buf_find_string_offset(buf, "Testing", 7));
+  test_eq(196, buf_find_string_offset(buf, "esting", 6));
+  test_eq(234, buf_find_string_offset(buf, "ing str", 7));
+  test_eq(230, buf_find_string_offset(buf, "Testing str", 11));
+  test_eq(238, buf_find_string_offset(buf, "string.", 7));
+  test_eq(-1, buf_find_string_offset(buf, "xxTx", 4));
+  test_eq(-1, buf_find_string_offset(buf, "Testing thing", 13));
+  test_eq(-1, buf_find_string_offset(buf, "string.x", 8));
+  buf_free(buf);
+  buf = NULL;
+
+  /****
+   * write_to_buf_external
+   ****/
+  buf = buf_new();
+  n_external_releases = 0;
+  cp = "Testing. This is a moderately long Testing string.";
+  write_to_buf("xy", 2, buf);
+  write_to_buf_external(cp, 8, test_buffers_release, (void*)cp, buf);
+  /* Adjacent data with the same release argument extends the last chunk. */
+  write_to_buf_external(cp+8, 9, test_buffers_release, (void*)cp, buf);
+  test_eq(n_external_releases, 1);
+  write_to_buf_external(cp+20, 4, test_buffers_release, (void*)cp, buf);
+  test_eq(n_external_releases, 1);
+  /* We can still append regular data after an external chunk. */
+  write_to_buf("!", 1, buf);
+  assert_buf_ok(buf);
+  test_eq(buf_datalen(buf), 24);
+  test_eq(0, buf_find_string_offset(buf, "xyTesting", 9));
+  test_eq(10, buf_find_string_offset(buf, " This is ", 9));
+  fetch_from_buf(str, 5, buf);
+  test_memeq(str, "xyTes", 5);
+  test_eq(n_external_releases, 1);
+  fetch_from_buf(str, 15, buf);
+  test_memeq(str, "ting. This is o", 15);
+  test_eq(n_external_releases, 2);
+  test_eq(buf_datalen(buf), 4);
+  fetch_from_buf(str, 4, buf);
+  test_memeq(str, "der!", 4);
+  test_eq(n_external_releases, 3);
+  /* Pulling data up into an external chunk replaces it with a copy. */
+  cp = "GET / HTTP/1.0\r\n";
+  write_to_buf_external(cp, strlen(cp), test_buffers_release, (void*)cp, buf);
+  write_to_buf_external("\r\n", 2, test_buffers_release, NULL, buf);
+  {
+    char *headers = NULL, *body = NULL;
+    size_t body_used = 0;
+    test_eq(1, fetch_from_buf_http(buf, &headers, 1024, &body, &body_used,
+                                   1024, 0));
+    test_streq(headers, "GET / HTTP/1.0\r\n\r\n");
+    tor_free(headers);
+    tor_free(body);
+  }
+  test_eq(buf_datalen(buf), 0);
+  buf_free(buf);
+  buf = NULL;
+  test_eq(n_external_releases, 5);
+
  done:
   if (buf)
     buf_free(buf);
@@ -857,6 +4238,44 @@ test_onion_handshake(void)
     crypto_pk_free(pk);
 }
 
+/** Run onion handshakes with DH keypairs from the precomputed pool, and
+ * make sure that no two handshakes share a keypair. */
+static void
+test_onion_dh_pool(void)
+{
+  crypto_dh_t *c_dh = NULL;
+  char c_buf[ONIONSKIN_CHALLENGE_LEN];
+  char c_keys[40], s_keys[40];
+  char s_buf[ONIONSKIN_REPLY_LEN];
+  char last_reply[DH_KEY_LEN];
+  crypto_pk_t *pk = NULL;
+  int i;
+
+  pk = pk_generate(0);
+  onion_dh_pool_init();
+  memset(last_reply, 0, sizeof(last_reply));
+
+  for (i = 0; i < 24; ++i) {
+    test_assert(! onion_skin_create(pk, &c_dh, c_buf));
+    test_assert(! onion_skin_server_handshake(c_buf, pk, NULL,
+                                              s_buf, s_keys, 40));
+    test_assert(! onion_skin_client_handshake(c_dh, s_buf, c_keys, 40));
+    test_memeq(c_keys, s_keys, 40);
+    /* The server's g^y must never repeat. */
+    test_memneq(last_reply, s_buf, DH_KEY_LEN);
+    memcpy(last_reply, s_buf, DH_KEY_LEN);
+    crypto_dh_free(c_dh);
+    c_dh = NULL;
+  }
+
+ done:
+  onion_dh_pool_free_all();
+  if (c_dh)
+    crypto_dh_free(c_dh);
+  if (pk)
+    crypto_pk_free(pk);
+}
+
 static void
 test_circuit_timeout(void)
 {
@@ -1002,7 +4421,9 @@ test_circuit_timeout(void)
   }
 
  done:
-  return;
+  circuit_build_times_free_timeouts(&initial);
+  circuit_build_times_free_timeouts(&estimate);
+  circuit_build_times_free_timeouts(&final);
 }
 
 /** Helper: Parse the exit policy string in <b>policy_str</b>, and make sure
@@ -1046,7 +4467,7 @@ test_policies(void)
   int i;
   smartlist_t *policy = NULL, *policy2 = NULL, *policy3 = NULL,
               *policy4 = NULL, *policy5 = NULL, *policy6 = NULL,
-              *policy7 = NULL;
+              *policy7 = NULL, *policy8 = NULL;
   addr_policy_t *p;
   tor_addr_t tar;
   config_line_t line;
@@ -1158,6 +4579,52 @@ test_policies(void)
   addr_policy_list_free(policy);
   policy = NULL;
 
+  /* Identical policies are interned as one, whose compiled form agrees
+   * with checking each entry. */
+  line.key = (char*)"foo";
+  line.value = (char*)"reject 10.0.0.0/8:*,accept *:20-25,"
+    "reject 18.0.0.0/8:22,accept *:80,accept *:6660-6669,reject *:*";
+  line.next = NULL;
+  test_assert(0 == policies_parse_exit_policy(&line, &policy, 0, NULL, 1));
+  test_assert(0 == policies_parse_exit_policy(&line, &policy8, 0, NULL, 1));
+  policy = addr_policy_list_intern(policy);
+  policy8 = addr_policy_list_intern(policy8);
+  test_eq_ptr(policy, policy8);
+  for (i = 1; i <= 65535; ++i) {
+    if (compare_tor_addr_to_interned_policy(NULL, (uint16_t)i, policy) !=
+        compare_tor_addr_to_addr_policy(NULL, (uint16_t)i, policy))
+      break;
+  }
+  test_eq(i, 65536);
+  {
+    const uint32_t addrs[] = { 0x0a010101u, 0x12010101u, 0x01020304u };
+    int j;
+    for (j = 0; j < 3; ++j) {
+      tor_addr_from_ipv4h(&tar, addrs[j]);
+      for (i = 1; i <= 65535; ++i) {
+        if (compare_tor_addr_to_interned_policy(&tar, (uint16_t)i, policy) !=
+            compare_tor_addr_to_addr_policy(&tar, (uint16_t)i, policy))
+          break;
+      }
+      test_eq(i, 65536);
+    }
+  }
+  test_eq(ADDR_POLICY_PROBABLY_ACCEPTED,
+          compare_tor_addr_to_interned_policy(NULL, 22, policy));
+  tor_addr_from_ipv4h(&tar, 0x0a010101u);
+  test_eq(ADDR_POLICY_REJECTED,
+          compare_tor_addr_to_interned_policy(&tar, 22, policy));
+  /* The descriptor form of an interned policy is formatted only once. */
+  test_streq(addr_policy_list_get_descriptor_lines(policy),
+             "reject 10.0.0.0/8:*\naccept *:20-25\naccept *:80\n"
+             "accept *:6660-6669\nreject *:*\n");
+  test_eq_ptr(addr_policy_list_get_descriptor_lines(policy),
+              addr_policy_list_get_descriptor_lines(policy8));
+  addr_policy_list_release(policy8);
+  policy8 = NULL;
+  addr_policy_list_release(policy);
+  policy = NULL;
+
   /* make sure compacting logic works. */
   policy = NULL;
   line.key = (char*)"foo";
@@ -1362,6 +4829,19 @@ test_rend_fns(void)
     test_eq(gen_info->port, par_info->port);
   }
 
+  /* Encoding the same descriptor again should give us the same, already
+   * signed, descriptors. */
+  test_eq(smartlist_len(descs), 2);
+  test_assert(rend_encode_v2_descriptors(descs, generated, now, 0,
+                                         REND_NO_AUTH, NULL, NULL) > 0);
+  test_eq(smartlist_len(descs), 4);
+  for (i = 0; i < 2; i++) {
+    rend_encoded_v2_service_descriptor_t *first = smartlist_get(descs, i),
+      *again = smartlist_get(descs, i + 2);
+    test_memeq(first->desc_id, again->desc_id, DIGEST_LEN);
+    test_streq(first->desc_str, again->desc_str);
+  }
+
   rend_service_descriptor_free(parsed);
   rend_service_descriptor_free(generated);
   parsed = generated = NULL;
@@ -1383,6 +4863,54 @@ test_rend_fns(void)
   tor_free(intro_points_encrypted);
 }
 
+/** Check that a replaycache_t notices replays for at least its interval,
+ * forgets them after about twice that, and can hold many digests. */
+static void
+test_replaycache(void)
+{
+  replaycache_t *rc = NULL, *forever = NULL;
+  char digest[DIGEST_LEN];
+  time_t now = 1000000;
+  int i;
+
+  rc = replaycache_new(300);
+  forever = replaycache_new(0);
+  memset(digest, 0, sizeof(digest));
+  tt_int_op(0, ==, replaycache_add_and_test(rc, digest, now));
+  tt_int_op(1, ==, replaycache_add_and_test(rc, digest, now+1));
+  /* Still remembered in the previous generation... */
+  tt_int_op(1, ==, replaycache_add_and_test(rc, digest, now+599));
+  /* ...but forgotten two rotations later. */
+  tt_int_op(0, ==, replaycache_add_and_test(rc, digest, now+900));
+  tt_int_op(1, ==, replaycache_add_and_test(rc, digest, now+901));
+  /* A digest added just before a rotation survives a whole interval. */
+  digest[5] = 7;
+  tt_int_op(0, ==, replaycache_add_and_test(rc, digest, now+1199));
+  tt_int_op(1, ==, replaycache_add_and_test(rc, digest, now+1200));
+  tt_int_op(1, ==, replaycache_add_and_test(rc, digest, now+1499));
+  /* We don't just go by the first bytes of the digest, which a peer could
+   * grind to collide. */
+  digest[DIGEST_LEN-1] = 1;
+  tt_int_op(0, ==, replaycache_add_and_test(rc, digest, now+1499));
+
+  /* Lots of distinct digests, so that the tables have to grow. */
+  for (i = 0; i < 5000; ++i) {
+    crypto_digest(digest, (char*)&i, sizeof(i));
+    tt_int_op(0, ==, replaycache_add_and_test(forever, digest, now));
+  }
+  tt_int_op(5000, ==, replaycache_size(forever));
+  for (i = 0; i < 5000; ++i) {
+    crypto_digest(digest, (char*)&i, sizeof(i));
+    tt_int_op(1, ==, replaycache_add_and_test(forever, digest,
+                                              now + 100000));
+  }
+  tt_int_op(5000, ==, replaycache_size(forever));
+
+ done:
+  replaycache_free(rc);
+  replaycache_free(forever);
+}
+
 /** Run unit tests for GeoIP code. */
 static void
 test_geoip(void)
@@ -1624,6 +5152,40 @@ test_geoip(void)
   test_streq(entry_stats_2, s);
   tor_free(s);
 
+  /* With approximate counts, small numbers of clients come out the same
+   * as exact counts do, unless a few of them collide in the sketch; we
+   * pick counts that are well clear of a multiple of 8... */
+  get_options_mutable()->ApproximateClientCounts = 1;
+  for (i=32; i < 44; ++i) {
+    tor_addr_from_ipv4h(&addr, (uint32_t) i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, now-7200);
+  }
+  for (j=0; j < 10; ++j)
+    for (i=52; i < 55; ++i) {
+      tor_addr_from_ipv4h(&addr, (uint32_t) i);
+      geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, now-3600);
+    }
+  for (i=110; i < 130; ++i) {
+    tor_addr_from_ipv4h(&addr, (uint32_t) i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, now);
+  }
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_assert(s);
+  test_streq("zz=24,ab=16,xy=8", s);
+  tor_free(s);
+
+  /* ...but old clients are forgotten an hour-long bucket at a time. */
+  geoip_remove_old_clients(now-6000);
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_streq("zz=24,ab=16,xy=8", s);
+  tor_free(s);
+  geoip_remove_old_clients(now-1000);
+  s = geoip_get_client_history(GEOIP_CLIENT_CONNECT);
+  test_streq("zz=24", s);
+  tor_free(s);
+  geoip_reset_entry_stats(now);
+  get_options_mutable()->ApproximateClientCounts = 0;
+
   /* Stop collecting entry statistics. */
   geoip_entry_stats_term();
   get_options_mutable()->EntryStatistics = 0;
@@ -1632,6 +5194,109 @@ test_geoip(void)
   tor_free(s);
 }
 
+/** Run unit tests for loading, writing, and searching binary GeoIP
+ * files. */
+static void
+test_geoip_binary(void)
+{
+  const char *text_fname = get_fname("geoip-text");
+  const char *bin_fname = get_fname("geoip-bin");
+  char *bin = NULL;
+  size_t bin_len;
+  tor_addr_t addr;
+  int pass;
+  unsigned generation;
+  /* A binary file with the countries "??" and "de", one IPv4 range that
+   * covers everything, and an IPv6 range starting at 2001:db8::. */
+  static const char v6_file[] =
+    "TORGEOB1" "\x00\x00\x00\x02" "\x00\x00\x00\x01"
+    "\x00\x00\x00\x02" "??" "DE"
+    "\x00\x00\x00\x00" "\x00\x01"
+    "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+    "\x20\x01\x0d\xb8\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+    "\x00\x00" "\x00\x01";
+  /* Where v6_file's IPv4 and IPv6 range starts are. */
+#define GEOIP_V6_FILE_V4_START (20+4)
+#define GEOIP_V6_FILE_V6_START (20+4+6)
+
+  /* Out of order and overlapping, to check how we build the table. */
+  test_eq(0, write_str_to_file(text_fname,
+                               "200,250,AB\n"
+                               "10,50,AB\n"
+                               "# A comment\n"
+                               "40,90,XY\n"
+                               "91,99,XY\n"
+                               "4294967200,4294967295,ZZ\n", 0));
+  test_eq(0, geoip_load_file(text_fname, get_options()));
+
+  /* Check the text file, then the binary one we write from it. */
+  for (pass = 0; pass < 2; ++pass) {
+#define NAMEFOR(x) geoip_get_country_name(geoip_get_country_by_ip(x))
+    test_assert(geoip_is_loaded());
+    test_streq("??", NAMEFOR(0));
+    test_streq("??", NAMEFOR(9));
+    test_streq("ab", NAMEFOR(10));
+    test_streq("ab", NAMEFOR(50));
+    test_streq("xy", NAMEFOR(51));
+    test_streq("xy", NAMEFOR(99));
+    test_streq("??", NAMEFOR(100));
+    test_streq("ab", NAMEFOR(225));
+    test_streq("??", NAMEFOR(251));
+    test_streq("??", NAMEFOR(4294967199u));
+    test_streq("zz", NAMEFOR(4294967200u));
+    test_streq("zz", NAMEFOR(4294967295u));
+#undef NAMEFOR
+    tor_addr_parse(&addr, "2001:db8::1");
+    test_eq(-1, geoip_get_country_by_addr(&addr));
+    if (pass == 0) {
+      test_eq(0, geoip_write_binary_file(bin_fname));
+      test_eq(0, geoip_load_file(bin_fname, get_options()));
+    }
+  }
+
+  /* IPv6 ranges.  Loading a new file tells the country caches to forget
+   * what they know. */
+  generation = geoip_db_generation();
+  test_eq(0, write_bytes_to_file(bin_fname, v6_file, sizeof(v6_file)-1, 1));
+  test_eq(0, geoip_load_file(bin_fname, get_options()));
+  test_assert(geoip_db_generation() != generation);
+  generation = geoip_db_generation();
+  tor_addr_parse(&addr, "2001:db8::1");
+  test_streq("de", geoip_get_country_name(geoip_get_country_by_addr(&addr)));
+  tor_addr_parse(&addr, "ffff::1");
+  test_streq("de", geoip_get_country_name(geoip_get_country_by_addr(&addr)));
+  tor_addr_parse(&addr, "2001:db7::1");
+  test_streq("??", geoip_get_country_name(geoip_get_country_by_addr(&addr)));
+  test_streq("de", geoip_get_country_name(geoip_get_country_by_ip(12345)));
+  test_eq(generation, geoip_db_generation());
+
+  /* A truncated file is rejected. */
+  bin = read_file_to_str(bin_fname, RFTS_BIN, NULL);
+  test_assert(bin);
+  bin_len = sizeof(v6_file) - 2;
+  test_eq(0, write_bytes_to_file(bin_fname, bin, bin_len, 1));
+  test_eq(-1, geoip_load_file(bin_fname, get_options()));
+  test_assert(!geoip_is_loaded());
+
+  /* So are ranges that don't start at the lowest address... */
+  memcpy(bin, v6_file, sizeof(v6_file)-1);
+  bin[GEOIP_V6_FILE_V4_START+3] = 1;
+  test_eq(0, write_bytes_to_file(bin_fname, bin, sizeof(v6_file)-1, 1));
+  test_eq(-1, geoip_load_file(bin_fname, get_options()));
+  test_assert(!geoip_is_loaded());
+  /* ...or that are out of order. */
+  memcpy(bin, v6_file, sizeof(v6_file)-1);
+  memset(bin+GEOIP_V6_FILE_V6_START+16, 0, 16);
+  test_eq(0, write_bytes_to_file(bin_fname, bin, sizeof(v6_file)-1, 1));
+  test_eq(-1, geoip_load_file(bin_fname, get_options()));
+  test_assert(!geoip_is_loaded());
+
+ done:
+  tor_free(bin);
+#undef GEOIP_V6_FILE_V4_START
+#undef GEOIP_V6_FILE_V6_START
+}
+
 /** Run unit tests for stats code. */
 static void
 test_stats(void)
@@ -1791,6 +5456,60 @@ test_stats(void)
   tor_free(s);
 }
 
+/** Run unit tests for saving MTBF data incrementally to a journal. */
+static void
+test_mtbf_journal(void)
+{
+  time_t now = time(NULL), later = now + 12*60*60 + 1;
+  long known;
+  char d1[DIGEST_LEN], d2[DIGEST_LEN], d3[DIGEST_LEN];
+  memset(d1, 1, DIGEST_LEN);
+  memset(d2, 2, DIGEST_LEN);
+  memset(d3, 3, DIGEST_LEN);
+
+  rep_hist_note_router_reachable(d1, NULL, 0, now-1000);
+  rep_hist_note_router_unreachable(d1, now-500);
+  rep_hist_note_router_reachable(d2, NULL, 0, now-800);
+  rep_hist_note_router_reachable(d3, NULL, 0, now);
+
+  /* The first write is of the whole file... */
+  test_eq(0, rep_hist_record_mtbf_data(now, 0));
+  test_eq(FN_FILE, file_status(get_fname("router-stability")));
+  test_eq(FN_NOENT, file_status(get_fname("router-stability-journal")));
+
+  /* ...and later ones only append the routers that changed. */
+  rep_hist_note_router_unreachable(d2, now-100);
+  test_eq(0, rep_hist_record_mtbf_data(now, 0));
+  test_eq(FN_FILE, file_status(get_fname("router-stability-journal")));
+
+  /* Reloading gives us the file and the journal together. */
+  rep_hist_free_all();
+  rep_hist_init();
+  test_eq(0, rep_hist_load_mtbf_data(now));
+  test_eq(500.0, rep_hist_get_stability(d1, now));
+  test_eq(700.0, rep_hist_get_stability(d2, now));
+
+  /* Discounting old stability info still works, though each router's data
+   * is only discounted when we look at it: 700 weighted seconds become
+   * 665. */
+  rep_hist_downrate_old_runs(now);
+  known = rep_hist_get_weighted_time_known(d2, later);
+  rep_hist_downrate_old_runs(later);
+  test_eq(known - 35, rep_hist_get_weighted_time_known(d2, later));
+
+  /* Once the journal holds as many records as we have routers, we
+   * rewrite the whole file. */
+  rep_hist_note_router_unreachable(d3, now);
+  test_eq(0, rep_hist_record_mtbf_data(now, 0));
+  test_eq(FN_FILE, file_status(get_fname("router-stability-journal")));
+  rep_hist_note_router_reachable(d3, NULL, 0, now);
+  test_eq(0, rep_hist_record_mtbf_data(now, 0));
+  test_eq(FN_NOENT, file_status(get_fname("router-stability-journal")));
+
+ done:
+  ;
+}
+
 static void *
 legacy_test_setup(const struct testcase_t *testcase)
 {
@@ -1828,13 +5547,118 @@ const struct testcase_setup_t legacy_setup = {
 
 static struct testcase_t test_array[] = {
   ENT(buffers),
+  { "buffer_fetch_cell", test_buffer_fetch_cell, 0, NULL, NULL },
+  { "buffer_shrink", test_buffer_shrink, 0, NULL, NULL },
   { "buffer_copy", test_buffer_copy, 0, NULL, NULL },
+  { "buffer_socket_io", test_buffer_socket_io, 0, NULL, NULL },
+  { "buffer_move_shared", test_buffer_move_shared, 0, NULL, NULL },
+  { "buffer_http_across_chunks", test_buffer_http_across_chunks, 0,
+    NULL, NULL },
+  { "buffer_read_size_tuning", test_buffer_read_size_tuning, 0, NULL, NULL },
+  { "buffer_chunk_classes", test_buffer_chunk_classes, TT_FORK, NULL, NULL },
+  { "cell_queue", test_cell_queue, TT_FORK, NULL, NULL },
+  { "circuit_ids", test_circuit_ids, TT_FORK, NULL, NULL },
+  { "circuit_stream_map", test_circuit_stream_map, TT_FORK, NULL, NULL },
+#ifndef USE_BUFFEREVENTS
+  { "circuit_unlink_without_id", test_circuit_unlink_without_id, TT_FORK,
+    NULL, NULL },
+#endif
+  { "circuit_created_while_in_worker", test_circuit_created_while_in_worker,
+    TT_FORK, NULL, NULL },
+#ifndef USE_BUFFEREVENTS
+  { "exit_reconnect_later", test_exit_reconnect_later, TT_FORK,
+    NULL, NULL },
+#endif
+  { "latency_histogram", test_latency_histogram, 0, NULL, NULL },
+  { "onion_pipeline_stats", test_onion_pipeline_stats, TT_FORK, NULL, NULL },
+  { "onion_queue_full", test_onion_queue_full, TT_FORK, NULL, NULL },
+  { "onion_queue_delay", test_onion_queue_delay, TT_FORK, NULL, NULL },
+  { "adaptive_window", test_adaptive_window, TT_FORK, NULL, NULL },
+  { "data_cell_coalesce", test_data_cell_coalesce, TT_FORK, NULL, NULL },
+  { "dns_max_inflight", test_dns_max_inflight, 0, NULL, NULL },
+  { "dns_compact_cache", test_dns_compact_cache, TT_FORK, NULL, NULL },
+  { "dns_exit_addr_order", test_dns_exit_addr_order, 0, NULL, NULL },
+  { "dns_refresh_popular", test_dns_refresh_popular, TT_FORK,
+    NULL, NULL },
+#if defined(USE_PTHREADS) && defined(HAVE_GETADDRINFO)
+  { "dns_getaddrinfo_backend", test_dns_getaddrinfo_backend, TT_FORK,
+    NULL, NULL },
+#endif
+  { "dns_expiry_wheel", test_dns_expiry_wheel, TT_FORK, NULL, NULL },
+  { "dns_metrics", test_dns_metrics, TT_FORK, NULL, NULL },
+  { "dns_wildcard_checks", test_dns_wildcard_checks, TT_FORK,
+    NULL, NULL },
+  { "dnsserv_share_request", test_dnsserv_share_request, TT_FORK,
+    NULL, NULL },
+  { "sockbuf_target_size", test_sockbuf_target_size, 0, NULL, NULL },
+  { "tls_record_size", test_tls_record_size, 0, NULL, NULL },
+  { "urgent_desc_download", test_urgent_desc_download, TT_FORK,
+    NULL, NULL },
+  { "routerset_node_bits", test_routerset_node_bits, TT_FORK,
+    NULL, NULL },
+  { "nodelist_id_table", test_nodelist_id_table, TT_FORK, NULL, NULL },
+  { "entry_guard_usability", test_entry_guard_usability, TT_FORK,
+    NULL, NULL },
+  { "node_family", test_node_family, TT_FORK, NULL, NULL },
+  { "hsdir_ring", test_hsdir_ring, 0, NULL, NULL },
+#ifdef USE_PTHREADS
+  { "rend_introduce_in_worker", test_rend_introduce_in_worker, TT_FORK,
+    NULL, NULL },
+#endif
+  { "predictive_build_concurrency", test_predictive_build_concurrency,
+    TT_FORK, NULL, NULL },
+  { "hs_client_circ_prediction", test_hs_client_circ_prediction, TT_FORK,
+    NULL, NULL },
+  { "rend_launch_early", test_rend_launch_early, TT_FORK, NULL, NULL },
+  { "cumulative_bw_index", test_cumulative_bw_index, 0, NULL, NULL },
+  { "pending_stream_classes", test_pending_stream_classes, TT_FORK,
+    NULL, NULL },
+  { "desc_requests_per_mirror", test_desc_requests_per_mirror, TT_FORK,
+    NULL, NULL },
+  { "rend_desc_failure", test_rend_desc_failure, TT_FORK, NULL, NULL },
+  { "accounting_shaping", test_accounting_shaping, TT_FORK, NULL, NULL },
+  { "hibernate_warm_resume", test_hibernate_warm_resume, TT_FORK,
+    NULL, NULL },
+  { "main_loop_profile", test_main_loop_profile, TT_FORK, NULL, NULL },
+  { "tls_cert_verify_cache", test_tls_cert_verify_cache, TT_FORK,
+    NULL, NULL },
+  { "tls_session_resumption", test_tls_session_resumption, TT_FORK,
+    NULL, NULL },
+  { "tls_record_coalescing", test_tls_record_coalescing, TT_FORK,
+    NULL, NULL },
+#ifndef _WIN32
+  { "tor_resolve_batch", test_tor_resolve_batch, TT_FORK, NULL, NULL },
+#endif
+#ifndef USE_BUFFEREVENTS
+  { "conn_lazy_refill", test_conn_lazy_refill, TT_FORK, NULL, NULL },
+#endif
+  { "conn_housekeeping_queue", test_conn_housekeeping_queue, TT_FORK,
+    NULL, NULL },
+  { "main_loop_dormant", test_main_loop_dormant, TT_FORK, NULL, NULL },
+#ifndef USE_BUFFEREVENTS
+  { "conn_bw_classes", test_conn_bw_classes, TT_FORK, NULL, NULL },
+#endif
+#ifndef USE_BUFFEREVENTS
+  { "conn_linked_direct", test_conn_linked_direct, TT_FORK, NULL, NULL },
+#endif
+#ifdef HAVE_LINUX_SOCKIOS_H
+  { "conn_kernel_unsent", test_conn_kernel_unsent, TT_FORK, NULL, NULL },
+#endif
+  { "rend_dir_cache_lru", test_rend_dir_cache_lru, TT_FORK, NULL, NULL },
+  { "rephist_pending_bytes", test_rephist_pending_bytes, TT_FORK,
+    NULL, NULL },
   ENT(onion_handshake),
+  /* Forked, so that the pool's thread doesn't outlive the test. */
+  { "onion_dh_pool", legacy_test_helper, TT_FORK, &legacy_setup,
+    test_onion_dh_pool },
   ENT(circuit_timeout),
   ENT(policies),
   ENT(rend_fns),
+  ENT(replaycache),
   ENT(geoip),
+  ENT(geoip_binary),
   FORK(stats),
+  FORK(mtbf_journal),
 
   END_OF_TESTCASES
 };
@@ -1851,7 +5675,9 @@ static struct testcase_t socks_tests[] = {
   SOCKSENT(5_no_authenticate),
   SOCKSENT(5_auth_before_negotiation),
   SOCKSENT(5_authenticate),
+  SOCKSENT(5_authenticate_long_password),
   SOCKSENT(5_authenticate_with_data),
+  SOCKSENT(http_request),
 
   END_OF_TESTCASES
 };
@@ -1864,6 +5690,7 @@ extern struct testcase_t dir_tests[];
 extern struct testcase_t microdesc_tests[];
 extern struct testcase_t pt_tests[];
 extern struct testcase_t config_tests[];
+extern struct testcase_t control_tests[];
 
 static struct testgroup_t testgroups[] = {
   { "", test_array },
@@ -1876,6 +5703,7 @@ static struct testgroup_t testgroups[] = {
   { "dir/md/", microdesc_tests },
   { "pt/", pt_tests },
   { "config/", config_tests },
+  { "control/", control_tests },
   END_OF_GROUPS
 };
 
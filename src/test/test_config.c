@@ -3,10 +3,13 @@
  * Copyright (c) 2007-2012, The Tor Project, Inc. */
 /* See LICENSE for licensing information */
 
+#define CONFIG_PRIVATE
+
 #include "orconfig.h"
 #include "or.h"
 #include "config.h"
 #include "connection_edge.h"
+#include "routerlist.h"
 #include "test.h"
 
 static void
@@ -160,11 +163,211 @@ test_config_addressmap(void *arg)
   ;
 }
 
+static void
+test_config_dns_cache(void *arg)
+{
+  char address[256];
+  time_t expires = TIME_MAX;
+  time_t now = time(NULL);
+  or_options_t *options = get_options_mutable();
+  int old_cache = options->ClientDNSCache;
+  int old_max_ttl = options->ClientDNSCacheMaxTTL;
+  (void)arg;
+
+  addressmap_init();
+  options->ClientDNSCache = 1;
+  options->ClientDNSCacheMaxTTL = 100;
+
+  /* Answers get cached, but no longer than ClientDNSCacheMaxTTL. */
+  client_dns_set_addressmap("www.cached.example.com", 0x01020304, NULL,
+                            3600);
+  strlcpy(address, "www.cached.example.com", sizeof(address));
+  test_assert(addressmap_rewrite(address, sizeof(address), &expires, NULL));
+  test_streq(address, "1.2.3.4");
+  test_assert(expires >= now + 100);
+  test_assert(expires <= now + 101);
+
+  /* Clearing the cache forgets them. */
+  addressmap_clear_dns_cache();
+  strlcpy(address, "www.cached.example.com", sizeof(address));
+  test_assert(!addressmap_rewrite(address, sizeof(address), &expires, NULL));
+
+  /* With ClientDNSCache off, we don't remember anything. */
+  options->ClientDNSCache = 0;
+  client_dns_set_addressmap("www.cached.example.com", 0x01020304, NULL,
+                            3600);
+  strlcpy(address, "www.cached.example.com", sizeof(address));
+  test_assert(!addressmap_rewrite(address, sizeof(address), &expires, NULL));
+
+ done:
+  options->ClientDNSCache = old_cache;
+  options->ClientDNSCacheMaxTTL = old_max_ttl;
+  addressmap_free_all();
+}
+
+static void
+test_config_setconf_handlers(void *arg)
+{
+  config_line_t *lines = NULL;
+  char *msg = NULL;
+  (void)arg;
+
+  get_options_mutable()->_ConnLimit = 1000;
+
+  /* MaxCircuitDirtiness has a change handler, so setting it skips
+   * options_act(); the derived _ConnLimit has to survive that. */
+  test_eq(0, config_get_lines("MaxCircuitDirtiness 123", &lines, 0));
+  test_eq(SETOPT_OK, options_trial_assign(lines, 1, 1, &msg));
+  test_eq(123, get_options()->MaxCircuitDirtiness);
+  test_eq(1000, get_options()->_ConnLimit);
+  config_free_lines(lines);
+  lines = NULL;
+
+  /* SafeSocks has none, so this goes through options_act(). */
+  test_eq(0, config_get_lines("SafeSocks 1", &lines, 0));
+  test_eq(SETOPT_OK, options_trial_assign(lines, 1, 1, &msg));
+  test_eq(1, get_options()->SafeSocks);
+  test_eq(123, get_options()->MaxCircuitDirtiness);
+
+ done:
+  config_free_lines(lines);
+  tor_free(msg);
+}
+
+static void
+test_config_reload_unchanged(void *arg)
+{
+  config_line_t *lines = NULL;
+  char *msg = NULL;
+  (void)arg;
+
+  test_eq(0, config_get_lines("SafeSocks 1", &lines, 0));
+  test_eq(SETOPT_OK, options_trial_assign(lines, 1, 1, &msg));
+  test_assert(smartlist_len(router_get_trusted_dir_servers()));
+  clear_trusted_dir_servers();
+
+  /* Setting the same options again changes nothing, but it has to go
+   * through options_act() all the same, which puts back the default
+   * directory authorities. */
+  test_eq(SETOPT_OK, options_trial_assign(lines, 1, 1, &msg));
+  test_assert(smartlist_len(router_get_trusted_dir_servers()));
+
+ done:
+  config_free_lines(lines);
+  tor_free(msg);
+}
+
+static void
+test_config_tls_session_cache(void *arg)
+{
+  or_options_t *options = options_new();
+  (void)arg;
+
+  options->TLSSessionCacheSize = 100;
+  /* Clients never resume sessions, whatever they ask for... */
+  test_eq(0, options_get_tls_session_cache_size(options));
+  /* ...but relays do. */
+  test_eq(0, config_get_lines("ORPort 9001", &options->ORPort, 0));
+  test_eq(100, options_get_tls_session_cache_size(options));
+  options->ClientOnly = 1;
+  test_eq(0, options_get_tls_session_cache_size(options));
+
+ done:
+  config_free_lines(options->ORPort);
+  tor_free(options);
+}
+
+static void
+test_config_option_index(void *arg)
+{
+  config_line_t *lines = NULL;
+  (void)arg;
+
+  /* We look up exact matches case-insensitively... */
+  test_streq("SocksPort", option_get_canonical_name("socksport"));
+  test_streq("SocksPort", option_get_canonical_name("SOCKSPORT"));
+  test_streq("HidServDirectoryV2",
+             option_get_canonical_name("hidservdirectoryv2"));
+  /* ...including of names that start with another option's name. */
+  test_streq("DirPortFrontPage",
+             option_get_canonical_name("dirportfrontpage"));
+  /* Abbreviations and unknown names still work as before. */
+  test_streq("HidServDirectoryV2",
+             option_get_canonical_name("HidServDirectoryV"));
+  test_assert(!option_is_recognized("NoSuchOptionAtAll"));
+  test_assert(!option_is_recognized(""));
+
+  /* Extended lines have their prefixes stripped. */
+  test_eq(0, config_get_lines("+SocksPort 9050\n/ORPort\n", &lines, 1));
+  test_assert(lines);
+  test_streq(lines->key, "SocksPort");
+  test_streq(lines->value, "9050");
+  test_eq(lines->command, CONFIG_LINE_APPEND);
+  test_assert(lines->next);
+  test_streq(lines->next->key, "ORPort");
+  test_streq(lines->next->value, "");
+  test_eq(lines->next->command, CONFIG_LINE_CLEAR);
+  test_eq_ptr(lines->next->next, NULL);
+
+ done:
+  config_free_lines(lines);
+}
+
+static void
+test_config_bandwidth_class_weights(void *arg)
+{
+  smartlist_t *entries = smartlist_new();
+  int weights[N_BW_CLASSES];
+  char *msg = NULL, *bad;
+  (void)arg;
+
+  test_eq(0, parse_bandwidth_class_weights(NULL, weights, &msg));
+  test_eq(0, weights[BW_CLASS_RELAY]);
+
+  smartlist_split_string(entries, "relay=8,DIR=1", ",", 0, 0);
+  test_eq(0, parse_bandwidth_class_weights(entries, weights, &msg));
+  test_eq(8, weights[BW_CLASS_RELAY]);
+  test_eq(1, weights[BW_CLASS_DIR]);
+  test_eq(0, weights[BW_CLASS_CLIENT]);
+  test_eq(0, weights[BW_CLASS_CONTROL]);
+
+  /* Unknown classes, bad weights, and all-zero weights are errors. */
+  smartlist_add(entries, tor_strdup("relayx=1"));
+  test_eq(-1, parse_bandwidth_class_weights(entries, weights, &msg));
+  test_assert(msg);
+  tor_free(msg);
+  bad = smartlist_pop_last(entries);
+  tor_free(bad);
+  smartlist_add(entries, tor_strdup("client=1001"));
+  test_eq(-1, parse_bandwidth_class_weights(entries, weights, &msg));
+  tor_free(msg);
+  bad = smartlist_pop_last(entries);
+  tor_free(bad);
+  smartlist_add(entries, tor_strdup("control"));
+  test_eq(-1, parse_bandwidth_class_weights(entries, weights, &msg));
+  tor_free(msg);
+  SMARTLIST_FOREACH(entries, char *, cp, tor_free(cp));
+  smartlist_clear(entries);
+  smartlist_add(entries, tor_strdup("dir=0"));
+  test_eq(-1, parse_bandwidth_class_weights(entries, weights, &msg));
+
+ done:
+  tor_free(msg);
+  SMARTLIST_FOREACH(entries, char *, cp, tor_free(cp));
+  smartlist_free(entries);
+}
+
 #define CONFIG_TEST(name, flags)                          \
   { #name, test_config_ ## name, flags, NULL, NULL }
 
 struct testcase_t config_tests[] = {
   CONFIG_TEST(addressmap, 0),
+  CONFIG_TEST(dns_cache, TT_FORK),
+  CONFIG_TEST(setconf_handlers, TT_FORK),
+  CONFIG_TEST(reload_unchanged, TT_FORK),
+  CONFIG_TEST(tls_session_cache, 0),
+  CONFIG_TEST(option_index, 0),
+  CONFIG_TEST(bandwidth_class_weights, 0),
   END_OF_TESTCASES
 };
 
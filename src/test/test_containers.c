@@ -4,6 +4,10 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+
+/* See test.c for why we leave math.h out. */
+double fabs(double x);
+
 #include "or.h"
 #include "test.h"
 
@@ -64,6 +68,48 @@ test_container_smartlist_basic(void)
   smartlist_free(sl);
 }
 
+/** Run unit tests for smartlists with inline storage, and for bulk
+ * additions. */
+static void
+test_container_smartlist_small(void)
+{
+  smartlist_t *sl, *sl2 = NULL;
+  void *elts[5] = { (void*)100, (void*)101, (void*)102, (void*)103,
+                    (void*)104 };
+  int i;
+
+  sl = smartlist_new_small();
+  test_assert(sl->list_is_inline);
+  for (i = 0; i < 5; ++i)
+    smartlist_add(sl, (void*)(intptr_t)i);
+  test_assert(sl->list_is_inline);
+  /* Growing past the inline storage keeps what we had. */
+  smartlist_add_array(sl, elts, 5);
+  test_eq(10, smartlist_len(sl));
+  test_assert(!sl->list_is_inline);
+  for (i = 0; i < 5; ++i) {
+    test_eq_ptr((void*)(intptr_t)i, smartlist_get(sl, i));
+    test_eq_ptr(elts[i], smartlist_get(sl, i+5));
+  }
+  smartlist_del_keeporder(sl, 0);
+  test_eq_ptr((void*)1, smartlist_get(sl, 0));
+  test_eq(9, smartlist_len(sl));
+
+  /* Reserving room means we don't need to grow again. */
+  sl2 = smartlist_new();
+  smartlist_reserve(sl2, 1000);
+  test_assert(sl2->capacity >= 1000);
+  test_eq(0, smartlist_len(sl2));
+  smartlist_add_all(sl2, sl);
+  smartlist_add_array(sl2, elts, 0);
+  test_eq(9, smartlist_len(sl2));
+  test_eq_ptr(elts[4], smartlist_get(sl2, 8));
+
+ done:
+  smartlist_free(sl);
+  smartlist_free(sl2);
+}
+
 /** Run unit tests for smartlist-of-strings functionality. */
 static void
 test_container_smartlist_strings(void)
@@ -507,6 +553,24 @@ test_container_digestset(void)
       ++false_positives;
   }
   test_assert(false_positives < 50); /* Should be far lower. */
+  digestset_free(set);
+
+  /* A set sized for a looser false positive rate should still hold
+   * everything we put in it, and not much more. */
+  set = digestset_new_with_fp_rate(1000, 0.01);
+  SMARTLIST_FOREACH(included, const char *, cp,
+                    digestset_add(set, cp));
+  SMARTLIST_FOREACH(included, const char *, cp,
+                    if (!digestset_isin(set, cp))
+                      ok = 0);
+  test_assert(ok);
+  false_positives = 0;
+  for (i = 0; i < 10000; ++i) {
+    crypto_rand(d, DIGEST_LEN);
+    if (digestset_isin(set, d))
+      ++false_positives;
+  }
+  test_assert(false_positives < 300); /* Should be about 100. */
 
  done:
   if (set)
@@ -515,6 +579,79 @@ test_container_digestset(void)
   smartlist_free(included);
 }
 
+/** Run unit tests for the HyperLogLog cardinality sketch. */
+static void
+test_container_hll(void)
+{
+  hll_t *a = hll_new(), *b = hll_new();
+  uint64_t h;
+  double est;
+  int i;
+
+  test_assert(hll_estimate(a) < 0.5);
+
+  /* Small sets are counted almost exactly, give or take the odd
+   * collision; duplicates don't count. */
+  for (i = 0; i < 50; ++i) {
+    crypto_rand((char*)&h, sizeof(h));
+    hll_add(a, h);
+    hll_add(a, h);
+  }
+  est = hll_estimate(a);
+  test_assert(est > 40 && est < 60);
+
+  /* Large sets are within a few standard errors (about 3% here). */
+  for (i = 0; i < 20000; ++i) {
+    crypto_rand((char*)&h, sizeof(h));
+    hll_add(i < 10000 ? a : b, h);
+  }
+  est = hll_estimate(b);
+  test_assert(est > 8500 && est < 11500);
+
+  /* Merging behaves like a union. */
+  hll_merge(a, b);
+  est = hll_estimate(a);
+  test_assert(est > 17000 && est < 23000);
+  hll_merge(a, b);
+  test_assert(fabs(hll_estimate(a) - est) < 1e-9);
+
+ done:
+  hll_free(a);
+  hll_free(b);
+}
+
+/** Run unit tests for the string intern table. */
+static void
+test_container_string_intern(void)
+{
+  char buf[32];
+  const char *a, *b, *c;
+  int n = string_intern_count();
+
+  strlcpy(buf, "Tor 0.2.3.25 on Linux", sizeof(buf));
+  a = string_intern(buf);
+  test_streq(a, buf);
+  test_assert(a != buf);
+  test_eq(n+1, string_intern_count());
+  b = string_intern("Tor 0.2.3.25 on Linux");
+  test_eq_ptr(a, b);
+  c = string_intern("Tor 0.2.3.24 on Linux");
+  test_assert(c != a);
+  test_eq(n+2, string_intern_count());
+
+  string_intern_release(b);
+  test_eq(n+2, string_intern_count());
+  test_streq(a, "Tor 0.2.3.25 on Linux");
+  string_intern_release(a);
+  test_eq(n+1, string_intern_count());
+  string_intern_release(c);
+  test_eq(n, string_intern_count());
+  string_intern_release(NULL);
+
+ done:
+  ;
+}
+
 typedef struct pq_entry_t {
   const char *val;
   int idx;
@@ -716,6 +853,142 @@ test_container_strmap(void)
   tor_free(visited);
 }
 
+/** Run unit tests for digest maps that grow while we insert, look up,
+ * and remove entries, so that we exercise the incremental rehash. */
+static void
+test_container_digestmap_rehash(void)
+{
+  digestmap_t *map;
+  digestmap_iter_t *iter;
+  char d[DIGEST_LEN];
+  const char *k;
+  void *v;
+  int i, j, n_seen;
+
+  map = digestmap_new();
+  memset(d, 0, sizeof(d));
+  for (i = 0; i < 20000; ++i) {
+    set_uint32(d, htonl(i));
+    test_eq_ptr(digestmap_set(map, d, (void*)(uintptr_t)(i+1)), NULL);
+    /* Every few inserts, remove an older key and look up a few others;
+     * some of them will still be waiting in the old table. */
+    if ((i % 7) == 6) {
+      set_uint32(d, htonl(i/2));
+      test_eq_ptr(digestmap_remove(map, d), (void*)(uintptr_t)(i/2+1));
+      test_eq_ptr(digestmap_remove(map, d), NULL);
+    }
+    if ((i % 101) == 0) {
+      digestmap_assert_ok(map);
+      for (j = 0; j <= i; j += 13) {
+        set_uint32(d, htonl(j));
+        v = digestmap_get(map, d);
+        test_assert(v == NULL || v == (void*)(uintptr_t)(j+1));
+      }
+    }
+  }
+  digestmap_assert_ok(map);
+
+  /* Iteration sees every remaining key exactly once. */
+  n_seen = 0;
+  for (iter = digestmap_iter_init(map); !digestmap_iter_done(iter);
+       iter = digestmap_iter_next(map, iter)) {
+    digestmap_iter_get(iter, &k, &v);
+    i = (int)ntohl(get_uint32(k));
+    test_eq_ptr(v, (void*)(uintptr_t)(i+1));
+    ++n_seen;
+  }
+  test_eq(n_seen, digestmap_size(map));
+  test_eq(n_seen, 20000 - 20000/7);
+  digestmap_assert_ok(map);
+
+ done:
+  if (map)
+    digestmap_free(map, NULL);
+}
+
+/** Run unit tests for digest-to-void* map functions */
+static void
+test_container_digestmap(void)
+{
+  digestmap_t *map;
+  digestmap_iter_t *iter;
+  const char *k;
+  void *v;
+  char d[DIGEST_LEN];
+  int i, n_seen;
+  char seen[1000];
+
+  map = digestmap_new();
+  test_assert(map);
+  test_eq(digestmap_size(map), 0);
+  test_assert(digestmap_isempty(map));
+  test_assert(digestmap_iter_done(digestmap_iter_init(map)));
+  memset(d, 0, sizeof(d));
+  test_eq_ptr(digestmap_get(map, d), NULL);
+  test_eq_ptr(digestmap_remove(map, d), NULL);
+  digestmap_assert_ok(map);
+
+  /* Keys that differ only in their last bytes, so that the map has to cope
+   * with more than a trivial spread. */
+  for (i = 0; i < 1000; ++i) {
+    set_uint32(d+16, htonl(i));
+    test_eq_ptr(digestmap_set(map, d, (void*)(uintptr_t)(i+1)), NULL);
+  }
+  test_eq(digestmap_size(map), 1000);
+  digestmap_assert_ok(map);
+  set_uint32(d+16, htonl(7));
+  test_eq_ptr(digestmap_set(map, d, (void*)(uintptr_t)7000), (void*)8);
+  test_eq_ptr(digestmap_get(map, d), (void*)7000);
+  test_eq_ptr(digestmap_set(map, d, (void*)8), (void*)7000);
+
+  /* Remove the odd keys, then make sure the even ones are still there. */
+  for (i = 1; i < 1000; i += 2) {
+    set_uint32(d+16, htonl(i));
+    test_eq_ptr(digestmap_remove(map, d), (void*)(uintptr_t)(i+1));
+    test_eq_ptr(digestmap_remove(map, d), NULL);
+  }
+  test_eq(digestmap_size(map), 500);
+  digestmap_assert_ok(map);
+  for (i = 0; i < 1000; ++i) {
+    set_uint32(d+16, htonl(i));
+    v = (i&1) ? NULL : (void*)(uintptr_t)(i+1);
+    test_eq_ptr(digestmap_get(map, d), v);
+  }
+
+  /* Iterate, removing every key divisible by 4, and make sure we see each
+   * remaining key exactly once. */
+  memset(seen, 0, sizeof(seen));
+  n_seen = 0;
+  for (iter = digestmap_iter_init(map); !digestmap_iter_done(iter); ) {
+    digestmap_iter_get(iter, &k, &v);
+    i = (int)ntohl(get_uint32(k+16));
+    test_assert(i >= 0 && i < 1000);
+    test_eq_ptr(v, (void*)(uintptr_t)(i+1));
+    test_eq(seen[i], 0);
+    seen[i] = 1;
+    ++n_seen;
+    if ((i % 4) == 0)
+      iter = digestmap_iter_next_rmv(map, iter);
+    else
+      iter = digestmap_iter_next(map, iter);
+  }
+  test_eq(n_seen, 500);
+  test_eq(digestmap_size(map), 250);
+  digestmap_assert_ok(map);
+
+  /* Put everything back, reusing the removed slots. */
+  for (i = 0; i < 1000; ++i) {
+    set_uint32(d+16, htonl(i));
+    digestmap_set(map, d, (void*)(uintptr_t)(i+1));
+  }
+  test_eq(digestmap_size(map), 1000);
+  digestmap_assert_ok(map);
+
+ done:
+  if (map)
+    digestmap_free(map, NULL);
+}
+
 /** Run unit tests for getting the median of a list. */
 static void
 test_container_order_functions(void)
@@ -751,13 +1024,18 @@ test_container_order_functions(void)
 
 struct testcase_t container_tests[] = {
   CONTAINER_LEGACY(smartlist_basic),
+  CONTAINER_LEGACY(smartlist_small),
   CONTAINER_LEGACY(smartlist_strings),
   CONTAINER_LEGACY(smartlist_overlap),
   CONTAINER_LEGACY(smartlist_digests),
   CONTAINER_LEGACY(smartlist_join),
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
+  CONTAINER_LEGACY(hll),
   CONTAINER_LEGACY(strmap),
+  CONTAINER_LEGACY(digestmap),
+  CONTAINER_LEGACY(digestmap_rehash),
+  CONTAINER_LEGACY(string_intern),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
   END_OF_TESTCASES
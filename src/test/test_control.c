@@ -0,0 +1,438 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2012, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+#include "orconfig.h"
+#include "or.h"
+#include "buffers.h"
+#include "connection.h"
+#include "control.h"
+#include "main.h"
+#include "nodelist.h"
+#include "routerlist.h"
+#include "test.h"
+
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
+#ifndef USE_BUFFEREVENTS
+/** Send the controller command <b>cmd</b> on <b>conn</b>, as if it had
+ * arrived from the network. */
+static void
+fake_controller_send(control_connection_t *conn, const char *cmd)
+{
+  write_to_buf(cmd, strlen(cmd), TO_CONN(conn)->inbuf);
+  connection_control_process_inbuf(conn);
+}
+
+/** Return a newly allocated string holding everything on <b>conn</b>'s
+ * outbuf, and empty the outbuf. */
+static char *
+fake_controller_read(control_connection_t *conn)
+{
+  buf_t *outbuf = TO_CONN(conn)->outbuf;
+  size_t len = buf_datalen(outbuf);
+  char *out = tor_malloc(len+1);
+  fetch_from_buf(out, len, outbuf);
+  out[len] = '\0';
+  return out;
+}
+
+/** Return a new authenticated control connection that has subscribed to
+ * <b>events</b>.  It has no socket, but it's in the connection array, so
+ * events get sent to it. */
+static control_connection_t *
+fake_controller_new(const char *events)
+{
+  control_connection_t *conn = control_connection_new(AF_INET);
+  char *cmd = NULL, *reply;
+  TO_CONN(conn)->state = CONTROL_CONN_STATE_OPEN;
+  TO_CONN(conn)->conn_array_index = smartlist_len(get_connection_array());
+  smartlist_add(get_connection_array(), conn);
+
+  tor_asprintf(&cmd, "SETEVENTS %s\r\n", events);
+  fake_controller_send(conn, cmd);
+  reply = fake_controller_read(conn);
+  tor_assert(!strcmp(reply, "250 OK\r\n"));
+  tor_free(reply);
+  tor_free(cmd);
+  return conn;
+}
+
+/** Take <b>conn</b> back out of the connection array and free it. */
+static void
+fake_controller_free(control_connection_t *conn)
+{
+  if (!conn)
+    return;
+  smartlist_remove(get_connection_array(), conn);
+  TO_CONN(conn)->conn_array_index = -1;
+  TO_CONN(conn)->state = CONTROL_CONN_STATE_NEEDAUTH;
+  control_update_global_event_mask();
+  connection_free(TO_CONN(conn));
+}
+
+static void
+test_control_event_formats(void *arg)
+{
+  control_connection_t *conn = NULL, *compact = NULL;
+  smartlist_t *elements = smartlist_new();
+  char *out = NULL;
+  (void)arg;
+
+  conn = fake_controller_new("CONF_CHANGED CLIENTS_SEEN");
+  compact = fake_controller_new("CONF_CHANGED CLIENTS_SEEN");
+  fake_controller_send(compact, "USEFEATURE COMPACT_EVENTS\r\n");
+  tor_free(out);
+  out = fake_controller_read(compact);
+  test_streq(out, "250 OK\r\n");
+
+  /* Events that don't come in more than one format reach every
+   * subscribed controller, whichever format it asked for. */
+  smartlist_add(elements, (char*)"Nickname");
+  smartlist_add(elements, (char*)"fred");
+  control_event_conf_changed(elements);
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out, "650-CONF_CHANGED\r\n650-Nickname=fred\r\n650 OK\r\n");
+  tor_free(out);
+  out = fake_controller_read(compact);
+  test_streq(out, "650-CONF_CHANGED\r\n650-Nickname=fred\r\n650 OK\r\n");
+
+  control_event_clients_seen("TimeStarted=\"2012-01-01 00:00:00\"");
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out,
+             "650 CLIENTS_SEEN TimeStarted=\"2012-01-01 00:00:00\"\r\n");
+  tor_free(out);
+  out = fake_controller_read(compact);
+  test_streq(out,
+             "650 CLIENTS_SEEN TimeStarted=\"2012-01-01 00:00:00\"\r\n");
+
+ done:
+  tor_free(out);
+  smartlist_free(elements);
+  fake_controller_free(conn);
+  fake_controller_free(compact);
+}
+
+/** Check that queued events go to the controllers that wanted them when
+ * they happened, not to those that want them when we flush the queue, and
+ * that control_flush_event_queue() sends what's left at exit. */
+static void
+test_control_event_queue(void *arg)
+{
+  control_connection_t *conn = NULL, *other = NULL;
+  tor_libevent_cfg cfg;
+  char *out = NULL;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+
+  conn = fake_controller_new("CONF_CHANGED");
+  other = fake_controller_new("CLIENTS_SEEN");
+
+  /* Events wait in the queue until we're back in the main loop. */
+  control_event_clients_seen("CountrySummary=us=16");
+  out = fake_controller_read(other);
+  test_streq(out, "");
+
+  /* A controller that subscribes after an event happened doesn't get it,
+   * even though the event was still queued. */
+  fake_controller_send(conn, "SETEVENTS CONF_CHANGED CLIENTS_SEEN\r\n");
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out, "250 OK\r\n");
+  event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE|EVLOOP_NONBLOCK);
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out, "");
+  tor_free(out);
+  out = fake_controller_read(other);
+  test_streq(out, "650 CLIENTS_SEEN CountrySummary=us=16\r\n");
+
+  /* A controller that unsubscribes still gets what happened before. */
+  control_event_clients_seen("CountrySummary=de=8");
+  fake_controller_send(other, "SETEVENTS\r\n");
+  tor_free(out);
+  out = fake_controller_read(other);
+  test_streq(out, "250 OK\r\n");
+  event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE|EVLOOP_NONBLOCK);
+  tor_free(out);
+  out = fake_controller_read(other);
+  test_streq(out, "650 CLIENTS_SEEN CountrySummary=de=8\r\n");
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out, "650 CLIENTS_SEEN CountrySummary=de=8\r\n");
+
+  /* At exit, we send whatever is still queued. */
+  control_event_clients_seen("CountrySummary=fr=4");
+  control_flush_event_queue();
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out, "650 CLIENTS_SEEN CountrySummary=fr=4\r\n");
+  tor_free(out);
+  out = fake_controller_read(other);
+  test_streq(out, "");
+
+ done:
+  tor_free(out);
+  fake_controller_free(conn);
+  fake_controller_free(other);
+  control_free_all();
+}
+
+/** Add a made-up router to the routerlist, with a descriptor body of
+ * <b>body_len</b> bytes whose first line names it "fake<b>idx</b>". */
+static void
+fake_router_add(int idx, size_t body_len)
+{
+  routerinfo_t *ri = tor_malloc_zero(sizeof(routerinfo_t));
+  char *body = tor_malloc(body_len+1);
+  const char *msg = NULL;
+  char nickname[MAX_NICKNAME_LEN+1];
+  size_t n;
+
+  tor_snprintf(body, body_len+1, "router fake%d 127.0.0.1 9001 0 0\n", idx);
+  for (n = strlen(body); n < body_len; ++n)
+    body[n] = (n % 64 == 63 || n == body_len-1) ? '\n' : 'x';
+  body[body_len] = '\0';
+
+  ri->cache_info.signed_descriptor_body = body;
+  ri->cache_info.signed_descriptor_len = body_len;
+  ri->cache_info.published_on = time(NULL);
+  ri->cache_info.routerlist_index = -1;
+  memset(ri->cache_info.identity_digest, idx+1, DIGEST_LEN);
+  memset(ri->cache_info.signed_descriptor_digest, idx+1, DIGEST_LEN);
+  tor_snprintf(nickname, sizeof(nickname), "fake%d", idx);
+  ri->nickname = string_intern(nickname);
+  ri->address = tor_strdup("127.0.0.1");
+  ri->addr = 0x7f000001;
+  ri->or_port = 9001;
+  ri->purpose = ROUTER_PURPOSE_GENERAL;
+  tor_assert(router_add_to_routerlist(ri, &msg, 1, 0) ==
+             ROUTER_ADDED_SUCCESSFULLY);
+}
+
+/** Return the position of <b>needle</b> in <b>haystack</b>, or -1. */
+static int
+find_pos(const char *haystack, const char *needle)
+{
+  const char *cp = strstr(haystack, needle);
+  return cp ? (int)(cp - haystack) : -1;
+}
+
+/** Check that a large GETINFO answer gets spooled onto the controller as
+ * its outbuf drains, that commands and events that come in meanwhile
+ * wait for the end of the answer, and that an error event makes us send
+ * the rest of the answer at once. */
+static void
+test_control_getinfo_spool(void *arg)
+{
+  control_connection_t *conn = NULL;
+  smartlist_t *pieces = smartlist_new();
+  char *out = NULL, *all = NULL;
+  char name[32];
+  int i, n, pos;
+  (void)arg;
+
+  for (i = 0; i < 40; ++i)
+    fake_router_add(i, 1000);
+  conn = fake_controller_new("STATUS_GENERAL");
+
+  fake_controller_send(conn,
+                       "GETINFO desc/all-recent\r\nGETINFO version\r\n");
+  /* We've written only part of the answer. */
+  tt_assert(conn->getinfo_spool);
+  tt_int_op(buf_datalen(TO_CONN(conn)->outbuf), >=, 16384);
+  tt_int_op(buf_datalen(TO_CONN(conn)->outbuf), <, 40*1000);
+
+  /* An event that happens now waits for the end of the answer. */
+  control_event_general_status(LOG_NOTICE, "FOO");
+  out = fake_controller_read(conn);
+  tt_int_op(find_pos(out, "650 "), ==, -1);
+  smartlist_add(pieces, out);
+
+  /* Drain the outbuf until we've written the whole answer; then we
+   * answer the next command. */
+  for (n = 0; conn->getinfo_spool && n < 100; ++n) {
+    connection_control_flushed_some(conn);
+    smartlist_add(pieces, fake_controller_read(conn));
+  }
+  tt_assert(!conn->getinfo_spool);
+  connection_control_finished_flushing(conn);
+  smartlist_add(pieces, fake_controller_read(conn));
+  out = NULL;
+  all = smartlist_join_strings(pieces, "", 0, NULL);
+
+  tt_int_op(find_pos(all, "250+desc/all-recent=\r\n"), ==, 0);
+  pos = 0;
+  for (i = 0; i < 40; ++i) {
+    int p;
+    tor_snprintf(name, sizeof(name), "router fake%d ", i);
+    p = find_pos(all, name);
+    tt_int_op(p, >, pos);
+    pos = p;
+  }
+  tt_int_op(find_pos(all, ".\r\n250 OK\r\n"), >, pos);
+  pos = find_pos(all, ".\r\n250 OK\r\n");
+  tt_int_op(find_pos(all, "650 STATUS_GENERAL NOTICE FOO\r\n"), >, pos);
+  pos = find_pos(all, "650 STATUS_GENERAL NOTICE FOO\r\n");
+  tt_int_op(find_pos(all, "250-version="), >, pos);
+  SMARTLIST_FOREACH(pieces, char *, cp, tor_free(cp));
+  smartlist_clear(pieces);
+  tor_free(all);
+
+  /* An error event doesn't wait for the controller to drain its outbuf:
+   * we write the rest of the answer at once, and then the error. */
+  fake_controller_send(conn, "GETINFO desc/all-recent\r\n");
+  tt_assert(conn->getinfo_spool);
+  control_event_general_status(LOG_ERR, "BAR");
+  tt_assert(!conn->getinfo_spool);
+  all = fake_controller_read(conn);
+  tt_int_op(find_pos(all, "router fake39 "), >, 0);
+  pos = find_pos(all, ".\r\n250 OK\r\n");
+  tt_int_op(pos, >, find_pos(all, "router fake39 "));
+  tt_int_op(find_pos(all, "650 STATUS_GENERAL ERR BAR\r\n"), >, pos);
+
+ done:
+  tor_free(out);
+  tor_free(all);
+  SMARTLIST_FOREACH(pieces, char *, cp, tor_free(cp));
+  smartlist_free(pieces);
+  fake_controller_free(conn);
+  routerlist_free_all();
+  nodelist_free_all();
+}
+
+/** Check that STREAM_BW events report the streams that noted new bytes,
+ * and only those, and that a freed stream leaves the dirty list. */
+static void
+test_control_stream_bw_dirty(void *arg)
+{
+  control_connection_t *conn = NULL;
+  entry_connection_t *busy = NULL, *idle = NULL, *freed = NULL;
+  edge_connection_t *edge;
+  char *out = NULL, *expected = NULL;
+  (void)arg;
+
+  busy = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  idle = entry_connection_new(CONN_TYPE_AP, AF_INET);
+  freed = entry_connection_new(CONN_TYPE_AP, AF_INET);
+
+  /* Nobody wants STREAM_BW yet, so we don't keep track. */
+  edge = ENTRY_TO_EDGE_CONN(busy);
+  control_note_stream_bandwidth(edge);
+  tt_assert(!edge->stream_bw_dirty);
+
+  conn = fake_controller_new("STREAM_BW");
+  edge->n_read = 100;
+  edge->n_written = 20;
+  control_note_stream_bandwidth(edge);
+  tt_assert(edge->stream_bw_dirty);
+  /* A stream with counts that never told us about them isn't reported. */
+  ENTRY_TO_EDGE_CONN(idle)->n_read = 7;
+  ENTRY_TO_EDGE_CONN(freed)->n_read = 9;
+  control_note_stream_bandwidth(ENTRY_TO_EDGE_CONN(freed));
+  connection_free(ENTRY_TO_CONN(freed));
+  freed = NULL;
+
+  control_event_stream_bandwidth_used();
+  control_flush_event_queue();
+  tor_asprintf(&expected, "650 STREAM_BW "U64_FORMAT" 100 20\r\n",
+               U64_PRINTF_ARG(ENTRY_TO_CONN(busy)->global_identifier));
+  out = fake_controller_read(conn);
+  test_streq(out, expected);
+  tt_assert(!edge->stream_bw_dirty);
+  tt_int_op(edge->n_read, ==, 0);
+  tt_int_op(ENTRY_TO_EDGE_CONN(idle)->n_read, ==, 7);
+
+  /* Once reported, a stream is reported again only after new bytes. */
+  control_event_stream_bandwidth_used();
+  control_flush_event_queue();
+  tor_free(out);
+  out = fake_controller_read(conn);
+  test_streq(out, "");
+
+ done:
+  tor_free(out);
+  tor_free(expected);
+  if (busy)
+    connection_free(ENTRY_TO_CONN(busy));
+  if (idle)
+    connection_free(ENTRY_TO_CONN(idle));
+  if (freed)
+    connection_free(ENTRY_TO_CONN(freed));
+  fake_controller_free(conn);
+  control_free_all();
+}
+
+/** Check that the startup timeline lists each phase and bootstrap
+ * milestone we note, and that it goes to the controller once we've
+ * finished bootstrapping, after which it stops changing. */
+static void
+test_control_startup_timeline(void *arg)
+{
+  control_connection_t *conn = NULL;
+  char *out = NULL;
+  (void)arg;
+
+  conn = fake_controller_new("STATUS_CLIENT");
+  startup_timeline_note("keys", tor_monotime_nsec());
+  startup_timeline_note_bootstrap("starting", 0);
+  startup_timeline_note_bootstrap("conn_dir", 0);
+  out = fake_controller_read(conn);
+  test_streq(out, "");
+
+  fake_controller_send(conn, "GETINFO status/startup-timeline\r\n");
+  tor_free(out);
+  out = fake_controller_read(conn);
+  tt_assert(!strcmpstart(out, "250-status/startup-timeline=keys="));
+  tt_assert(strstr(out, " bootstrap_starting="));
+  tt_assert(!strstr(out, "conn_dir"));
+  tt_assert(!strstr(out, "total"));
+
+  startup_timeline_note_bootstrap("done", 1);
+  control_flush_event_queue();
+  tor_free(out);
+  out = fake_controller_read(conn);
+  tt_assert(!strcmpstart(out,
+                         "650 STATUS_CLIENT NOTICE STARTUP_TIMELINE keys="));
+  tt_assert(strstr(out, " bootstrap_starting="));
+  tt_assert(strstr(out, " bootstrap_conn_dir="));
+  tt_assert(strstr(out, " total="));
+
+  /* Once we're done, we stop adding to it. */
+  startup_timeline_note("late", tor_monotime_nsec());
+  fake_controller_send(conn, "GETINFO status/startup-timeline\r\n");
+  tor_free(out);
+  out = fake_controller_read(conn);
+  tt_assert(strstr(out, " total="));
+  tt_assert(!strstr(out, "late"));
+
+ done:
+  tor_free(out);
+  fake_controller_free(conn);
+  control_free_all();
+}
+#endif
+
+#define CONTROL(name)                                           \
+  { #name, test_control_ ## name, TT_FORK, NULL, NULL }
+
+struct testcase_t control_tests[] = {
+#ifndef USE_BUFFEREVENTS
+  CONTROL(event_formats),
+  CONTROL(event_queue),
+  CONTROL(getinfo_spool),
+  CONTROL(stream_bw_dirty),
+  CONTROL(startup_timeline),
+#endif
+  END_OF_TESTCASES
+};
+
@@ -5,10 +5,16 @@
 
 #include "orconfig.h"
 #define CRYPTO_PRIVATE
+#define AES_PRIVATE
 #include "or.h"
 #include "test.h"
 #include "aes.h"
 
+/* Our built-in SHA256, which crypto.c uses only with OpenSSLs that lack
+ * one; we include it here so that we can test it against OpenSSL's. */
+#define LTC_ARGCHK(x) tor_assert(x)
+#include "sha256.c"
+
 /** Run unit tests for Diffie-Hellman functionality. */
 static void
 test_crypto_dh(void)
@@ -51,6 +57,14 @@ test_crypto_dh(void)
   crypto_dh_free(dh2);
 }
 
+/** Helper: compare two uint64_t values for qsort. */
+static int
+_compare_uint64s(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
 /** Run unit tests for our random number generation function and its wrappers.
  */
 static void
@@ -59,6 +73,9 @@ test_crypto_rng(void)
   int i, j, allok;
   char data1[100], data2[100];
   double d;
+  const int biglen = 20000;
+  char *big1 = NULL, *big2 = NULL;
+  uint64_t *windows = NULL;
 
   /* Try out RNG. */
   test_assert(! crypto_seed_rng(0));
@@ -90,8 +107,31 @@ test_crypto_rng(void)
     tor_free(host);
   }
   test_assert(allok);
+
+  /* Long draws shouldn't repeat themselves anywhere, and reseeding
+   * shouldn't replay earlier output. */
+  big1 = tor_malloc(biglen);
+  big2 = tor_malloc(biglen);
+  windows = tor_malloc(sizeof(uint64_t) * 2 * (biglen - 7));
+  crypto_rand(big1, biglen);
+  test_assert(! crypto_seed_rng(0));
+  for (i = 0; i < biglen; i += 7)
+    crypto_rand(big2 + i, MIN(7, biglen - i));
+  test_memneq(big1, big2, biglen);
+  for (i = 0; i < biglen - 7; ++i) {
+    memcpy(&windows[i], big1 + i, 8);
+    memcpy(&windows[biglen - 7 + i], big2 + i, 8);
+  }
+  qsort(windows, 2 * (biglen - 7), sizeof(uint64_t), _compare_uint64s);
+  for (i = 1; i < 2 * (biglen - 7); ++i)
+    if (windows[i-1] == windows[i])
+      allok = 0;
+  test_assert(allok);
+
  done:
-  ;
+  tor_free(big1);
+  tor_free(big2);
+  tor_free(windows);
 }
 
 /** Run unit tests for our AES functionality */
@@ -230,6 +270,25 @@ test_crypto_aes(void *arg)
   crypto_cipher_crypt_inplace(env1, data2, 64);
   test_assert(tor_mem_is_zero(data2, 64));
 
+  /* Crypting several buffers in one call should match crypting them one at
+   * a time. */
+  crypto_cipher_free(env1);
+  crypto_cipher_free(env2);
+  env1 = crypto_cipher_new(NULL);
+  env2 = crypto_cipher_new(crypto_cipher_get_key(env1));
+  memcpy(data2, data1, 1024);
+  memcpy(data3, data1, 1024);
+  for (j = 0; j < 7; ++j)
+    crypto_cipher_crypt_inplace(env1, data2+j*131, 131);
+  {
+    char *bufs[7];
+    for (j = 0; j < 7; ++j)
+      bufs[j] = data3+j*131;
+    test_eq(0, crypto_cipher_crypt_inplace_multi(env2, bufs, 131, 7));
+  }
+  test_memeq(data2, data3, 1024);
+  test_memneq(data1, data3, 7*131);
+
  done:
   tor_free(mem_op_hex_tmp);
   if (env1)
@@ -379,6 +438,17 @@ test_crypto_sha(void)
   crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
   crypto_digest(d_out2, "abcdef", 6);
   test_memeq(d_out1, d_out2, DIGEST_LEN);
+  /* Tentative additions only stick if the digest matches. */
+  crypto_digest(d_out2, "abcdefpqr", 9);
+  d_out2[0] ^= 1;
+  test_eq(0, crypto_digest_add_bytes_if_matches(d1, "pqr", 3, d_out2, 4));
+  crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+  crypto_digest(d_out2, "abcdef", 6);
+  test_memeq(d_out1, d_out2, DIGEST_LEN);
+  crypto_digest(d_out2, "abcdefpqr", 9);
+  test_eq(1, crypto_digest_add_bytes_if_matches(d1, "pqr", 3, d_out2, 4));
+  crypto_digest_get_digest(d1, d_out1, sizeof(d_out1));
+  test_memeq(d_out1, d_out2, DIGEST_LEN);
   crypto_digest_free(d1);
   crypto_digest_free(d2);
 
@@ -792,6 +862,274 @@ test_crypto_aes_iv(void *arg)
   tor_free(decrypted2);
 }
 
+/** Test that precomputing keystream doesn't change what a cipher
+ * produces. */
+static void
+test_crypto_aes_keystream(void *arg)
+{
+  crypto_cipher_t *env1 = NULL, *env2 = NULL;
+  char *data1 = NULL, *data2 = NULL, *data3 = NULL;
+  char *bufs[2];
+  char key[CIPHER_KEY_LEN];
+  int use_evp = !strcmp(arg,"evp");
+  evaluate_evp_for_aes(use_evp);
+  evaluate_ctr_for_aes();
+
+  data1 = tor_malloc(4096);
+  data2 = tor_malloc(4096);
+  data3 = tor_malloc(4096);
+  crypto_rand(data1, 4096);
+  crypto_rand(key, sizeof(key));
+  env1 = crypto_cipher_new(key);
+  env2 = crypto_cipher_new(key);
+
+  /* The reference: one cipher, no precomputation. */
+  crypto_cipher_encrypt(env1, data2, data1, 4096);
+
+  /* Precomputing when we already have enough does nothing. */
+  test_eq(crypto_cipher_precompute_keystream(env2, 0), 0);
+  test_eq(crypto_cipher_precompute_keystream(env2, 100), 100);
+  test_eq(crypto_cipher_precompute_keystream(env2, 100), 0);
+  /* Use some of it, then top it up past what we'd allocated. */
+  crypto_cipher_encrypt(env2, data3, data1, 30);
+  test_eq(crypto_cipher_precompute_keystream(env2, 509), 439);
+  /* Use all of it and then some. */
+  crypto_cipher_encrypt(env2, data3+30, data1+30, 600);
+  /* Top up a little, then use exactly that much, in place. */
+  test_eq(crypto_cipher_precompute_keystream(env2, 509), 509);
+  memcpy(data3+630, data1+630, 509);
+  crypto_cipher_crypt_inplace(env2, data3+630, 509);
+  /* And across two buffers at once. */
+  test_eq(crypto_cipher_precompute_keystream(env2, 1100), 1100);
+  memcpy(data3+1139, data1+1139, 1018);
+  bufs[0] = data3+1139;
+  bufs[1] = data3+1648;
+  crypto_cipher_crypt_inplace_multi(env2, bufs, 509, 2);
+  /* Finally, decrypt the rest with some keystream left over. */
+  test_eq(crypto_cipher_precompute_keystream(env2, 17), 0);
+  crypto_cipher_decrypt(env2, data3+2157, data1+2157, 4096-2157);
+  test_memeq(data2, data3, 4096);
+
+ done:
+  crypto_cipher_free(env1);
+  crypto_cipher_free(env2);
+  tor_free(data1);
+  tor_free(data2);
+  tor_free(data3);
+}
+
+/** Run the built-in hardware counter mode, if this CPU can, against the
+ * AES-128-CTR vectors from NIST SP 800-38A F.5.1, and against OpenSSL. */
+static void
+test_crypto_aes_hw(void *arg)
+{
+  uint8_t key[16], ctr[16], in[64], out[64], expected[64];
+  uint8_t hw_key[AES_HW_KEY_LEN];
+  char *data1 = NULL, *data2 = NULL, *data3 = NULL;
+  crypto_cipher_t *env = NULL;
+  char *mem_op_hex_tmp = NULL;
+  (void)arg;
+
+  if (!aes_hw_name() || !aes_hw_cpu_supported())
+    tt_skip();
+
+  base16_decode((char*)key, 16, "2b7e151628aed2a6abf7158809cf4f3c", 32);
+  base16_decode((char*)ctr, 16, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", 32);
+  base16_decode((char*)in, 64,
+                "6bc1bee22e409f96e93d7e117393172a"
+                "ae2d8a571e03ac9c9eb76fac45af8e51"
+                "30c81c46a35ce411e5fbc1191a0a52ef"
+                "f69f2445df4f9b17ad2b417be66c3710", 128);
+  base16_decode((char*)expected, 64,
+                "874d6191b620e3261bef6864990db6ce"
+                "9806f66b7970fdff8617187bb9fffdff"
+                "5ae4df3edbd5d35e5b4f09020db03eab"
+                "1e031dda2fbe03d1792170a0f3009cee", 128);
+  aes_hw_expand_key(key, hw_key);
+
+  /* One block, then the other three: the counter carries between calls. */
+  aes_hw_ctr_blocks(hw_key, ctr, in, out, 1);
+  aes_hw_ctr_blocks(hw_key, ctr, in+16, out+16, 3);
+  test_memeq(out, expected, 64);
+  test_memeq_hex(ctr, "f0f1f2f3f4f5f6f7f8f9fafbfcfdff03");
+
+  test_eq(aes_hw_self_test(), 0);
+
+  /* Enough blocks to use the wide path and the tail, from a zero IV. */
+  data1 = tor_malloc(16*37);
+  data2 = tor_malloc(16*37);
+  data3 = tor_malloc(16*37);
+  crypto_rand(data1, 16*37);
+  crypto_rand((char*)key, sizeof(key));
+  memset(ctr, 0, sizeof(ctr));
+  aes_hw_expand_key(key, hw_key);
+  aes_hw_ctr_blocks(hw_key, ctr, (uint8_t*)data1, (uint8_t*)data2, 37);
+  env = crypto_cipher_new((char*)key);
+  crypto_cipher_encrypt(env, data3, data1, 16*37);
+  test_memeq(data2, data3, 16*37);
+
+ done:
+  crypto_cipher_free(env);
+  tor_free(data1);
+  tor_free(data2);
+  tor_free(data3);
+  tor_free(mem_op_hex_tmp);
+}
+
+/** Test the functions that crypt and digest a buffer in one pass against
+ * doing those steps one at a time. */
+static void
+test_crypto_cipher_digest(void *arg)
+{
+  crypto_cipher_t *send = NULL, *recv = NULL, *ref = NULL;
+  crypto_digest_t *send_d = NULL, *recv_d = NULL, *ref_d = NULL;
+  char key[CIPHER_KEY_LEN];
+  char plain[509], cell[509], expected[509];
+  int i;
+  (void)arg;
+
+  crypto_rand(key, sizeof(key));
+  send = crypto_cipher_new(key);
+  recv = crypto_cipher_new(key);
+  ref = crypto_cipher_new(key);
+  send_d = crypto_digest_new();
+  recv_d = crypto_digest_new();
+  ref_d = crypto_digest_new();
+
+  for (i = 0; i < 20; ++i) {
+    crypto_rand(plain, sizeof(plain));
+    memcpy(expected, plain, sizeof(plain));
+    if (i % 4 == 3) {
+      /* Not for the receiver: plain encryption, and no digest check. */
+      plain[1] = 1;
+      memcpy(expected, plain, sizeof(plain));
+      memcpy(cell, plain, sizeof(cell));
+      crypto_cipher_crypt_inplace(ref, expected, sizeof(expected));
+      crypto_cipher_crypt_inplace(send, cell, sizeof(cell));
+      test_memeq(cell, expected, sizeof(cell));
+      test_eq(0, crypto_cipher_decrypt_and_check_inplace(recv, recv_d, cell,
+                                                 sizeof(cell), 1, 2, 5, 4));
+      test_memeq(cell, plain, sizeof(cell));
+      continue;
+    }
+    memset(plain+1, 0, 2);
+    memset(plain+5, 0, 4);
+    memcpy(expected, plain, sizeof(plain));
+
+    /* The long way round... */
+    crypto_digest_add_bytes(ref_d, expected, sizeof(expected));
+    crypto_digest_get_digest(ref_d, expected+5, 4);
+    crypto_cipher_crypt_inplace(ref, expected, sizeof(expected));
+    /* ... and in one pass. */
+    memcpy(cell, plain, sizeof(cell));
+    test_eq(0, crypto_cipher_digest_and_encrypt_inplace(send, send_d, cell,
+                                                   sizeof(cell), 5, 4));
+    test_memeq(cell, expected, sizeof(cell));
+
+    if (i == 19) {
+      /* Corrupt the last cell: it shouldn't be recognized, and the
+       * receiver's digest shouldn't change. */
+      char d1[DIGEST_LEN], d2[DIGEST_LEN];
+      crypto_digest_get_digest(recv_d, d1, sizeof(d1));
+      cell[300] ^= 1;
+      test_eq(0, crypto_cipher_decrypt_and_check_inplace(recv, recv_d, cell,
+                                                 sizeof(cell), 1, 2, 5, 4));
+      crypto_digest_get_digest(recv_d, d2, sizeof(d2));
+      test_memeq(d1, d2, sizeof(d1));
+      /* The integrity field is left alone. */
+      test_memneq(cell+5, plain+5, 4);
+      break;
+    }
+    test_eq(1, crypto_cipher_decrypt_and_check_inplace(recv, recv_d, cell,
+                                                 sizeof(cell), 1, 2, 5, 4));
+    test_memeq(cell, plain, sizeof(cell));
+  }
+
+ done:
+  crypto_cipher_free(send);
+  crypto_cipher_free(recv);
+  crypto_cipher_free(ref);
+  crypto_digest_free(send_d);
+  crypto_digest_free(recv_d);
+  crypto_digest_free(ref_d);
+}
+
+/** Test our built-in SHA256 against OpenSSL's, on every length up to a few
+ * blocks, fed to it in one piece and in uneven pieces. */
+static void
+test_crypto_sha256_builtin(void *arg)
+{
+  char data[300], expected[DIGEST256_LEN];
+  unsigned char out[DIGEST256_LEN];
+  sha256_state st;
+  int len, i;
+  (void)arg;
+
+  crypto_rand(data, sizeof(data));
+  for (len = 0; len <= (int)sizeof(data); ++len) {
+    crypto_digest256(expected, data, len, DIGEST_SHA256);
+
+    sha256_init(&st);
+    sha256_process(&st, (const unsigned char*)data, len);
+    sha256_done(&st, out);
+    test_memeq(out, expected, DIGEST256_LEN);
+
+    sha256_init(&st);
+    for (i = 0; i < len; i += 37)
+      sha256_process(&st, (const unsigned char*)data+i, MIN(37, len-i));
+    sha256_done(&st, out);
+    test_memeq(out, expected, DIGEST256_LEN);
+  }
+
+ done:
+  ;
+}
+
+/** Test checking a batch of signatures, with and without threads. */
+static void
+test_crypto_checksig_batch(void *arg)
+{
+  crypto_pk_t *pk[3] = { NULL, NULL, NULL };
+  crypto_pk_checksig_t checks[8];
+  char digests[8][DIGEST_LEN];
+  char sigs[8][128];
+  int i, threads;
+  (void)arg;
+
+  for (i = 0; i < 3; ++i) {
+    pk[i] = pk_generate(i);
+    tt_assert(pk[i]);
+  }
+
+  for (threads = 1; threads <= 4; threads += 3) {
+    memset(checks, 0, sizeof(checks));
+    for (i = 0; i < 8; ++i) {
+      crypto_rand(digests[i], DIGEST_LEN);
+      tt_int_op(128, ==, crypto_pk_private_sign(pk[i%3], sigs[i], 128,
+                                                digests[i], DIGEST_LEN));
+      checks[i].key = pk[i%3];
+      checks[i].sig = sigs[i];
+      checks[i].sig_len = 128;
+      checks[i].digest = digests[i];
+      checks[i].digest_len = DIGEST_LEN;
+      checks[i].good = -1;
+    }
+    /* Wrong key, damaged signature, and wrong digest. */
+    checks[2].key = pk[0];
+    sigs[4][7] ^= 0x10;
+    digests[6][0] ^= 1;
+
+    crypto_pk_public_checksig_batch(checks, 8, threads);
+    for (i = 0; i < 8; ++i)
+      tt_int_op(checks[i].good, ==, (i == 2 || i == 4 || i == 6) ? 0 : 1);
+  }
+
+ done:
+  for (i = 0; i < 3; ++i)
+    if (pk[i])
+      crypto_pk_free(pk[i]);
+}
+
 /** Test base32 decoding. */
 static void
 test_crypto_base32_decode(void)
@@ -857,6 +1195,14 @@ struct testcase_t crypto_tests[] = {
   CRYPTO_LEGACY(s2k),
   { "aes_iv_AES", test_crypto_aes_iv, TT_FORK, &pass_data, (void*)"aes" },
   { "aes_iv_EVP", test_crypto_aes_iv, TT_FORK, &pass_data, (void*)"evp" },
+  { "aes_keystream_AES", test_crypto_aes_keystream, TT_FORK, &pass_data,
+    (void*)"aes" },
+  { "aes_keystream_EVP", test_crypto_aes_keystream, TT_FORK, &pass_data,
+    (void*)"evp" },
+  { "aes_hw", test_crypto_aes_hw, TT_FORK, NULL, NULL },
+  { "cipher_digest", test_crypto_cipher_digest, 0, NULL, NULL },
+  { "checksig_batch", test_crypto_checksig_batch, 0, NULL, NULL },
+  { "sha256_builtin", test_crypto_sha256_builtin, 0, NULL, NULL },
   CRYPTO_LEGACY(base32_decode),
   END_OF_TESTCASES
 };
@@ -4,16 +4,22 @@
 /* See LICENSE for licensing information */
 
 #include "orconfig.h"
+#define DIRECTORY_PRIVATE
 #define DIRSERV_PRIVATE
 #define DIRVOTE_PRIVATE
 #define ROUTER_PRIVATE
 #define HIBERNATE_PRIVATE
 #include "or.h"
+#include "buffers.h"
+#include "config.h"
+#include "connection.h"
+#include "consdiff.h"
 #include "directory.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "hibernate.h"
 #include "networkstatus.h"
+#include "policies.h"
 #include "router.h"
 #include "routerlist.h"
 #include "routerparse.h"
@@ -104,8 +110,8 @@ test_dir_formats(void)
   r1->bandwidthburst = 5000;
   r1->bandwidthcapacity = 10000;
   r1->exit_policy = NULL;
-  r1->nickname = tor_strdup("Magri");
-  r1->platform = tor_strdup(platform);
+  r1->nickname = string_intern("Magri");
+  r1->platform = string_intern(platform);
 
   ex1 = tor_malloc_zero(sizeof(addr_policy_t));
   ex2 = tor_malloc_zero(sizeof(addr_policy_t));
@@ -120,7 +126,7 @@ test_dir_formats(void)
   r2 = tor_malloc_zero(sizeof(routerinfo_t));
   r2->address = tor_strdup("1.1.1.1");
   r2->addr = 0x0a030201u; /* 10.3.2.1 */
-  r2->platform = tor_strdup(platform);
+  r2->platform = string_intern(platform);
   r2->cache_info.published_on = 5;
   r2->or_port = 9005;
   r2->dir_port = 0;
@@ -130,7 +136,8 @@ test_dir_formats(void)
   r2->exit_policy = smartlist_new();
   smartlist_add(r2->exit_policy, ex2);
   smartlist_add(r2->exit_policy, ex1);
-  r2->nickname = tor_strdup("Fred");
+  r2->exit_policy = addr_policy_list_intern(r2->exit_policy);
+  r2->nickname = string_intern("Fred");
 
   test_assert(!crypto_pk_write_public_key_to_string(pk1, &pk1_str,
                                                     &pk1_str_len));
@@ -182,6 +189,41 @@ test_dir_formats(void)
   test_assert(crypto_pk_cmp_keys(rp1->identity_pkey, pk2) == 0);
   //test_assert(rp1->exit_policy == NULL);
 
+  /* Parsing the same descriptor again hits the signature cache, but a
+   * different signature on it still has to check out. */
+  routerinfo_free(rp1);
+  rp1 = router_parse_entry_from_string((const char*)cp,NULL,1,0,NULL);
+  test_assert(rp1);
+  {
+    char *sig = strstr(buf, "-----BEGIN SIGNATURE-----\n");
+    routerinfo_t *rp_bad;
+    test_assert(sig);
+    sig += strlen("-----BEGIN SIGNATURE-----\n") + 10;
+    *sig = (*sig == 'A') ? 'B' : 'A';
+    rp_bad = router_parse_entry_from_string((const char*)cp,NULL,1,0,NULL);
+    test_assert(!rp_bad);
+  }
+
+  /* Descriptors we load from disk get their exit policies parsed lazily. */
+  {
+    smartlist_t *lst = smartlist_new();
+    routerinfo_t *rp_lazy;
+    const char *s_lazy = buf;
+    test_assert(router_dump_router_to_string(buf, 2048, r1, pk2)>0);
+    test_eq(0, router_parse_list_from_string(&s_lazy, NULL, lst,
+                                             SAVED_IN_JOURNAL, 0, 0, NULL));
+    test_eq(1, smartlist_len(lst));
+    rp_lazy = smartlist_get(lst, 0);
+    smartlist_free(lst);
+    test_assert(rp_lazy->policy_is_unparsed);
+    test_assert(rp_lazy->exit_policy == NULL);
+    test_assert(router_exit_policy_rejects_all(rp_lazy));
+    test_assert(!rp_lazy->policy_is_unparsed);
+    test_eq(1, smartlist_len(rp_lazy->exit_policy));
+    test_assert(!cmp_addr_policies(rp_lazy->exit_policy, rp1->exit_policy));
+    routerinfo_free(rp_lazy);
+  }
+
 #if 0
   /* XXX Once we have exit policies, test this again. XXX */
   strlcpy(buf2, "router tor.tor.tor 9005 0 0 3000\n", sizeof(buf2));
@@ -714,6 +756,75 @@ test_dir_param_voting(void)
   return;
 }
 
+/** Make sure that lookups in the compiled parameter table of a
+ * networkstatus agree with lookups in its key=value lists. */
+static void
+test_dir_param_table(void)
+{
+  networkstatus_t ns1, ns2;
+
+  memset(&ns1, 0, sizeof(ns1));
+  memset(&ns2, 0, sizeof(ns2));
+  ns1.net_params = smartlist_new();
+  ns1.weight_params = smartlist_new();
+  ns2.net_params = smartlist_new();
+  smartlist_split_string(ns1.net_params,
+                         "CircuitPriorityHalflifeMsec=30000 "
+                         "bwweightscale=1000 cbtdisabled=x circwindow=900 circwindow=100 x-yz=5",
+                         NULL, 0, 0);
+  smartlist_split_string(ns1.weight_params,
+                         "Wbd=10 Wee=600 Wgg=2000", NULL, 0, 0);
+  smartlist_split_string(ns2.net_params,
+                         "CircuitPriorityHalflifeMsec=30000 circwindow=100",
+                         NULL, 0, 0);
+
+  /* Before compiling, we fall back to scanning the lists. */
+  test_eq(900, networkstatus_get_param_by_id(&ns1, NET_PARAM_CIRCWINDOW,
+                                             1000, 100, 1000));
+  test_eq(10, networkstatus_get_bw_weight(&ns1, BW_WEIGHT_WBD, -1));
+
+  networkstatus_compile_params(&ns1);
+  networkstatus_compile_params(&ns2);
+  test_assert(ns1.params_compiled);
+
+  /* The first parseable value wins, and values are clamped on lookup. */
+  test_eq(900, networkstatus_get_param_by_id(&ns1, NET_PARAM_CIRCWINDOW,
+                                             1000, 100, 1000));
+  test_eq(500, networkstatus_get_param_by_id(&ns1, NET_PARAM_CIRCWINDOW,
+                                             100, 100, 500));
+  test_eq(900, networkstatus_get_param(&ns1, "circwindow", 1000, 100, 1000));
+  /* Unparseable and missing values give the default. */
+  test_eq(1, networkstatus_get_param_by_id(&ns1, NET_PARAM_CBTDISABLED,
+                                           1, 0, 1));
+  test_eq(7, networkstatus_get_param_by_id(&ns1, NET_PARAM_CBTMINCIRCS,
+                                           7, 1, 10));
+  /* Names we have no identifier for still work. */
+  test_eq(5, networkstatus_get_param(&ns1, "x-yz", 0, 0, 10));
+
+  test_eq(10, networkstatus_get_bw_weight(&ns1, BW_WEIGHT_WBD, -1));
+  test_eq(600, networkstatus_get_bw_weight(&ns1, BW_WEIGHT_WEE, -1));
+  test_eq(-1, networkstatus_get_bw_weight(&ns1, BW_WEIGHT_WMM, -1));
+  /* Weights are capped at bwweightscale. */
+  test_eq(1000, networkstatus_get_bw_weight(&ns1, BW_WEIGHT_WGG, -1));
+
+  test_assert(!networkstatus_param_changed(&ns1, &ns2,
+                             NET_PARAM_CIRCUIT_PRIORITY_HALFLIFE_MSEC));
+  test_assert(networkstatus_param_changed(&ns1, &ns2, NET_PARAM_CIRCWINDOW));
+  test_assert(networkstatus_param_changed(&ns1, &ns2,
+                                          NET_PARAM_BWWEIGHTSCALE));
+  test_assert(!networkstatus_param_changed(&ns1, &ns2,
+                                           NET_PARAM_CBTDISABLED));
+  test_assert(networkstatus_param_changed(NULL, &ns2, NET_PARAM_CIRCWINDOW));
+
+ done:
+  SMARTLIST_FOREACH(ns1.net_params, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(ns1.weight_params, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(ns2.net_params, char *, cp, tor_free(cp));
+  smartlist_free(ns1.net_params);
+  smartlist_free(ns1.weight_params);
+  smartlist_free(ns2.net_params);
+}
+
 extern const char AUTHORITY_CERT_1[];
 extern const char AUTHORITY_SIGNKEY_1[];
 extern const char AUTHORITY_CERT_2[];
@@ -759,7 +870,7 @@ generate_ri_from_rs(const vote_routerstatus_t *vrs)
     tor_strdup("123456789012345678901234567890123");
   r->cache_info.signed_descriptor_len =
     strlen(r->cache_info.signed_descriptor_body);
-  r->exit_policy = smartlist_new();
+  r->exit_policy = addr_policy_list_intern(smartlist_new());
   r->cache_info.published_on = ++published + time(NULL);
   return r;
 }
@@ -1381,6 +1492,413 @@ test_dir_v3_networkstatus(void)
     ns_detached_signatures_free(dsig2);
 }
 
+/** Number of router entries in the consensus test_dir_parallel_parse()
+ * parses: enough to be split among several threads. */
+#define N_PARALLEL_PARSE_ROUTERS 1100
+
+/** Return a newly allocated consensus with N_PARALLEL_PARSE_ROUTERS
+ * entries.  It's well-formed, but nobody signed it. */
+static char *
+make_big_consensus_text(void)
+{
+  smartlist_t *chunks = smartlist_new();
+  char digest[DIGEST_LEN], id_b64[BASE64_DIGEST_LEN+1];
+  char d_b64[BASE64_DIGEST_LEN+1];
+  char sig[128], sig_b64[256];
+  char *result;
+  int i;
+
+  smartlist_add(chunks, tor_strdup(
+       "network-status-version 3\n"
+       "vote-status consensus\n"
+       "consensus-method 11\n"
+       "valid-after 2012-06-01 12:00:00\n"
+       "fresh-until 2012-06-01 13:00:00\n"
+       "valid-until 2012-06-01 15:00:00\n"
+       "voting-delay 300 300\n"
+       "known-flags Exit Fast Running Stable Valid\n"
+       "dir-source auth " HEX1 " 1.2.3.4 1.2.3.4 80 443\n"
+       "contact nobody\n"
+       "vote-digest " HEX2 "\n"));
+  for (i = 0; i < N_PARALLEL_PARSE_ROUTERS; ++i) {
+    /* Entries must be sorted by identity digest. */
+    memset(digest, 0, sizeof(digest));
+    set_uint32(digest, htonl(i));
+    digest_to_base64(id_b64, digest);
+    memset(digest, 'D', sizeof(digest));
+    set_uint32(digest, htonl(i));
+    digest_to_base64(d_b64, digest);
+    smartlist_add_asprintf(chunks,
+         "r router%d %s %s 2012-06-01 11:00:00 10.0.%d.%d 9001 %d\n"
+         "s Fast Running%s Valid\n"
+         "v Tor 0.2.3.%d-alpha\n"
+         "w Bandwidth=%d\n"
+         "p accept 80,443\n",
+         i, id_b64, d_b64, i / 256, i % 256, i % 3 ? 0 : 80,
+         i % 2 ? " Stable" : "", i % 20, 100 + i);
+  }
+  memset(sig, 'S', sizeof(sig));
+  base64_encode(sig_b64, sizeof(sig_b64), sig, sizeof(sig));
+  smartlist_add_asprintf(chunks,
+       "directory-footer\n"
+       "directory-signature " HEX1 " " HEX3 "\n"
+       "-----BEGIN SIGNATURE-----\n%s-----END SIGNATURE-----\n", sig_b64);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+/** Make sure that parsing a consensus's router entries in parallel gives
+ * the same answer as parsing them one at a time. */
+static void
+test_dir_parallel_parse(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  char *text = make_big_consensus_text();
+  networkstatus_t *serial = NULL, *parallel = NULL;
+  int i;
+  (void)arg;
+
+  options->ParallelConsensusParsing = 0;
+  serial = networkstatus_parse_vote_from_string(text, NULL,
+                                                NS_TYPE_CONSENSUS);
+  test_assert(serial);
+  test_eq(smartlist_len(serial->routerstatus_list),
+          N_PARALLEL_PARSE_ROUTERS);
+
+  options->ParallelConsensusParsing = 1;
+  options->NumCPUs = 3;
+  parallel = networkstatus_parse_vote_from_string(text, NULL,
+                                                  NS_TYPE_CONSENSUS);
+  test_assert(parallel);
+  test_eq(smartlist_len(parallel->routerstatus_list),
+          N_PARALLEL_PARSE_ROUTERS);
+
+  for (i = 0; i < N_PARALLEL_PARSE_ROUTERS; ++i) {
+    routerstatus_t *a = smartlist_get(serial->routerstatus_list, i);
+    routerstatus_t *b = smartlist_get(parallel->routerstatus_list, i);
+    test_streq(a->nickname, b->nickname);
+    test_memeq(a->identity_digest, b->identity_digest, DIGEST_LEN);
+    test_memeq(a->descriptor_digest, b->descriptor_digest, DIGEST_LEN);
+    test_eq(a->addr, b->addr);
+    test_eq(a->dir_port, b->dir_port);
+    test_eq(a->is_stable, b->is_stable);
+    test_eq(a->bandwidth, b->bandwidth);
+    test_eq(a->version_supports_optimistic_data,
+            b->version_supports_optimistic_data);
+    test_streq(a->exitsummary, b->exitsummary);
+  }
+
+ done:
+  options->ParallelConsensusParsing = 0;
+  options->NumCPUs = 0;
+  if (serial)
+    networkstatus_vote_free(serial);
+  if (parallel)
+    networkstatus_vote_free(parallel);
+  tor_free(text);
+}
+
+/** Return a newly allocated consensus-like document published at
+ * <b>valid_after</b>, listing the <b>n_ids</b> relays in <b>ids</b>.  The
+ * relay numbered <b>bump</b> gets a different bandwidth. */
+static char *
+make_consdiff_doc(const char *valid_after, const int *ids, int n_ids,
+                  int bump)
+{
+  smartlist_t *chunks = smartlist_new();
+  char digest[DIGEST_LEN], id_b64[BASE64_DIGEST_LEN+1];
+  char *result;
+  int i;
+
+  smartlist_add_asprintf(chunks,
+       "network-status-version 3\n"
+       "valid-after %s\n"
+       "known-flags Fast Running\n", valid_after);
+  for (i = 0; i < n_ids; ++i) {
+    memset(digest, 0, sizeof(digest));
+    set_uint32(digest, htonl(ids[i]));
+    digest_to_base64(id_b64, digest);
+    smartlist_add_asprintf(chunks,
+         "r router%d %s %s 2012-06-01 11:00:00 10.0.0.%d 9001 0\n"
+         "s Fast Running\n"
+         "w Bandwidth=%d\n",
+         ids[i], id_b64, id_b64, ids[i], 100 + ids[i] + (ids[i] == bump));
+  }
+  smartlist_add_asprintf(chunks,
+       "directory-footer\n"
+       "directory-signature " HEX1 " " HEX3 "\n"
+       "-----BEGIN SIGNATURE-----\n"
+       "signed at %s\n"
+       "-----END SIGNATURE-----\n", valid_after);
+
+  result = smartlist_join_strings(chunks, "", 0, NULL);
+  SMARTLIST_FOREACH(chunks, char *, cp, tor_free(cp));
+  smartlist_free(chunks);
+  return result;
+}
+
+static void
+test_dir_consdiff(void *arg)
+{
+  const int base_ids[] = { 1, 2, 3, 5, 8 };
+  const int target_ids[] = { 0, 2, 3, 5, 9, 10 };
+  const int unsorted_ids[] = { 3, 1 };
+  char *base = NULL, *target = NULL, *diff = NULL, *result = NULL;
+  char *unsorted = NULL;
+  const char *cp;
+  int n_lines;
+  (void)arg;
+
+  base = make_consdiff_doc("2012-06-01 12:00:00", base_ids, 5, -1);
+  target = make_consdiff_doc("2012-06-01 13:00:00", target_ids, 6, 5);
+
+  /* A diff turns base into target, and only base. */
+  diff = consdiff_gen_diff(base, target);
+  test_assert(diff);
+  test_assert(consdiff_looks_like_diff(diff));
+  test_assert(strlen(diff) < strlen(target));
+  result = consdiff_apply_diff(base, diff);
+  test_streq(result, target);
+  tor_free(result);
+  test_assert(!consdiff_looks_like_diff(target));
+  test_eq_ptr(NULL, consdiff_apply_diff(target, diff));
+
+  /* A truncated diff doesn't apply. */
+  diff[strlen(diff)-2] = '\0';
+  test_eq_ptr(NULL, consdiff_apply_diff(base, diff));
+  tor_free(diff);
+
+  /* A document diffs against itself to nothing but the hash line. */
+  diff = consdiff_gen_diff(target, target);
+  test_assert(diff);
+  for (cp = diff, n_lines = 0; *cp; ++cp) {
+    if (*cp == '\n')
+      ++n_lines;
+  }
+  test_eq(2, n_lines);
+  result = consdiff_apply_diff(target, diff);
+  test_streq(result, target);
+  tor_free(result);
+  tor_free(diff);
+
+  /* We only make diffs between documents sorted by identity. */
+  unsorted = make_consdiff_doc("2012-06-01 13:00:00", unsorted_ids, 2, -1);
+  test_eq_ptr(NULL, consdiff_gen_diff(base, unsorted));
+
+ done:
+  tor_free(base);
+  tor_free(target);
+  tor_free(diff);
+  tor_free(result);
+  tor_free(unsorted);
+}
+
+static void
+test_dir_consdiff_serve(void *arg)
+{
+  int ids[200], i;
+  char *base = NULL, *target = NULL, *result = NULL, *text = NULL;
+  char digest[DIGEST256_LEN];
+  digests_t digests;
+  cached_dir_t *cur, *diff;
+  size_t text_len = 0;
+  (void)arg;
+
+  for (i = 0; i < 200; ++i)
+    ids[i] = i;
+  base = make_consdiff_doc("2012-06-01 12:00:00", ids, 200, -1);
+  target = make_consdiff_doc("2012-06-01 13:00:00", ids, 200, 77);
+  memset(&digests, 0, sizeof(digests));
+
+  dirserv_set_cached_consensus_networkstatus(base, "ns", &digests, 1000);
+  dirserv_set_cached_consensus_networkstatus(target, "ns", &digests, 2000);
+
+  /* We serve the current consensus from its compressed form alone. */
+  cur = dirserv_get_consensus("ns");
+  test_assert(cur);
+  test_eq_ptr(NULL, cur->dir);
+  test_eq(cur->dir_len, strlen(target));
+#ifndef _WIN32
+  test_assert(cur->dir_z_mmap);
+#endif
+  test_eq(0, tor_gzip_uncompress(&text, &text_len, cur->dir_z,
+                                 cur->dir_z_len, ZLIB_METHOD, 1, LOG_WARN));
+  test_streq(text, target);
+
+  /* We can serve a diff from the consensus we replaced, and only from it. */
+  consdiff_get_digest(digest, base);
+  diff = dirserv_get_consensus_diff("ns", digest);
+  test_assert(diff);
+  result = consdiff_apply_diff(base, diff->dir);
+  test_streq(result, target);
+  consdiff_get_digest(digest, target);
+  test_eq_ptr(NULL, dirserv_get_consensus_diff("ns", digest));
+
+ done:
+  tor_free(base);
+  tor_free(target);
+  tor_free(result);
+  tor_free(text);
+}
+
+#ifndef USE_BUFFEREVENTS
+/** Feed <b>headers</b> and the <b>body_len</b> bytes of <b>body</b> to a
+ * new client consensus fetch, a few bytes at a time, and return the
+ * connection. */
+static dir_connection_t *
+read_body_in_pieces(const char *headers, const char *body, size_t body_len)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  size_t off;
+  conn->_base.purpose = DIR_PURPOSE_FETCH_CONSENSUS;
+  conn->_base.state = DIR_CONN_STATE_CLIENT_READING;
+  conn->_base.address = tor_strdup("127.0.0.1");
+  write_to_buf(headers, strlen(headers), conn->_base.inbuf);
+  for (off = 0; off < body_len; off += 7) {
+    size_t n = MIN(7, body_len - off);
+    write_to_buf(body + off, n, conn->_base.inbuf);
+    if (connection_dir_client_read_body(conn, 0) < 0)
+      break;
+  }
+  return conn;
+}
+
+/** Free a connection made by read_body_in_pieces().  (It was never added
+ * to the connection lists, so connection_free() would get confused.) */
+static void
+free_read_body_conn(dir_connection_t *conn)
+{
+  buf_free(conn->_base.inbuf);
+  buf_free(conn->_base.outbuf);
+  tor_free(conn->_base.address);
+  tor_free(conn->response_headers);
+  tor_zlib_free(conn->response_zlib_state);
+  tor_free(conn->response_body);
+  tor_free_tagged(conn);
+}
+
+static void
+test_dir_read_body(void *arg)
+{
+  const char *deflated =
+    "HTTP/1.0 200 OK\r\nContent-Encoding: deflate\r\n\r\n";
+  char *doc = NULL, *z1 = NULL, *z2 = NULL, *both = NULL;
+  size_t doc_len, z1_len, z2_len;
+  dir_connection_t *conn = NULL;
+  int i;
+  (void)arg;
+
+  tor_asprintf(&doc, "network-status-version 3\n");
+  for (i = 0; i < 100; ++i) {
+    char *tmp = doc;
+    tor_asprintf(&doc, "%sr router%d AAAAAAAAAAAAAAAAAAAAAAAAAAA\n", tmp, i);
+    tor_free(tmp);
+  }
+  doc_len = strlen(doc);
+  test_eq(0, tor_gzip_compress(&z1, &z1_len, doc, doc_len, ZLIB_METHOD));
+  test_eq(0, tor_gzip_compress(&z2, &z2_len, "x", 1, ZLIB_METHOD));
+  both = tor_malloc(z1_len + z2_len);
+  memcpy(both, z1, z1_len);
+  memcpy(both + z1_len, z2, z2_len);
+
+  /* Compressed objects are decompressed as they arrive, including a second
+   * one following the first. */
+  conn = read_body_in_pieces(deflated, both, z1_len + z2_len);
+  test_assert(conn->response_zlib_state);
+  test_eq(0, buf_datalen(conn->_base.inbuf));
+  test_eq(0, connection_dir_client_read_body(conn, 1));
+  test_eq(conn->response_raw_len, z1_len + z2_len);
+  test_eq(conn->response_body_len, doc_len + 1);
+  test_memeq(conn->response_body, doc, doc_len);
+  test_streq(conn->response_body + doc_len, "x");
+  free_read_body_conn(conn);
+
+  /* A body that doesn't look like what the headers claim is left for the
+   * old code to sort out. */
+  conn = read_body_in_pieces(deflated, doc, doc_len);
+  test_eq_ptr(NULL, conn->response_zlib_state);
+  test_eq(0, connection_dir_client_read_body(conn, 1));
+  test_streq(conn->response_body, doc);
+  free_read_body_conn(conn);
+
+  /* A truncated consensus is an error. */
+  conn = read_body_in_pieces(deflated, z1, z1_len - 3);
+  test_assert(conn->response_zlib_state);
+  test_eq(-1, connection_dir_client_read_body(conn, 1));
+  free_read_body_conn(conn);
+
+  /* We stop at the declared Content-Length. */
+  conn = read_body_in_pieces("HTTP/1.0 200 OK\r\nContent-Length: 10\r\n\r\n",
+                             doc, doc_len);
+  test_eq(0, connection_dir_client_read_body(conn, 1));
+  test_eq(conn->response_body_len, 10);
+  test_memeq(conn->response_body, doc, 10);
+  free_read_body_conn(conn);
+  conn = NULL;
+
+ done:
+  if (conn)
+    free_read_body_conn(conn);
+  tor_free(doc);
+  tor_free(z1);
+  tor_free(z2);
+  tor_free(both);
+}
+
+/** Answer the GET request for <b>url</b> on a new directory connection,
+ * and return the response as a newly allocated string. */
+static char *
+get_url_response(const char *url)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  char *headers = NULL, *response;
+  size_t len;
+  tor_asprintf(&headers, "GET %s HTTP/1.0\r\n\r\n", url);
+  directory_handle_command_get(conn, headers, NULL, 0);
+  len = buf_datalen(conn->_base.outbuf);
+  response = tor_malloc(len+1);
+  fetch_from_buf(response, len, conn->_base.outbuf);
+  response[len] = '\0';
+  free_read_body_conn(conn);
+  tor_free(headers);
+  return response;
+}
+
+static void
+test_dir_get_url_table(void *arg)
+{
+  char *response = NULL;
+  (void)arg;
+
+  /* Exact URLs match only themselves, with or without ".z". */
+  response = get_url_response("/tor/robots.txt");
+  test_assert(!strcmpstart(response, "HTTP/1.0 200 OK\r\n"));
+  test_assert(strstr(response, "\r\n\r\nUser-agent: *\r\nDisallow: /"));
+  tor_free(response);
+  response = get_url_response("/tor/robots.txt.z");
+  test_assert(strstr(response, "\r\n\r\nUser-agent: *\r\nDisallow: /"));
+  tor_free(response);
+  response = get_url_response("/tor/robots.txt2");
+  test_assert(!strcmpstart(response, "HTTP/1.0 404 "));
+  tor_free(response);
+
+  /* Prefixes match anything that starts with them. */
+  response = get_url_response("/tor/bytes.txt?x=1");
+  test_assert(!strcmpstart(response, "HTTP/1.0 200 OK\r\n"));
+  tor_free(response);
+
+  response = get_url_response("/tor/no-such-document");
+  test_assert(!strcmpstart(response, "HTTP/1.0 404 "));
+  tor_free(response);
+
+ done:
+  tor_free(response);
+}
+#endif
+
 #define DIR_LEGACY(name)                                                   \
   { #name, legacy_test_helper, TT_FORK, &legacy_setup, test_dir_ ## name }
 
@@ -1395,7 +1913,15 @@ struct testcase_t dir_tests[] = {
   DIR(split_fps),
   DIR_LEGACY(measured_bw),
   DIR_LEGACY(param_voting),
+  DIR_LEGACY(param_table),
   DIR_LEGACY(v3_networkstatus),
+  DIR(parallel_parse),
+  DIR(consdiff),
+  DIR(consdiff_serve),
+#ifndef USE_BUFFEREVENTS
+  DIR(read_body),
+  DIR(get_url_table),
+#endif
   END_OF_TESTCASES
 };
 
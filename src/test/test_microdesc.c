@@ -5,6 +5,8 @@
 #include "or.h"
 
 #include "config.h"
+#include "connection.h"
+#include "dirserv.h"
 #include "microdesc.h"
 
 #include "test.h"
@@ -199,6 +201,16 @@ test_md_cache(void *data)
   tt_int_op(md2->last_listed, ==, time2);
   tt_int_op(md3->last_listed, ==, time3);
 
+  /* We loaded them from the index, so nothing is parsed until we ask. */
+  tt_assert(md3->is_unparsed);
+  tt_ptr_op(md3->family, ==, NULL);
+  microdesc_parse_if_needed(md3);
+  tt_assert(! md3->is_unparsed);
+  tt_assert(md3->onion_pkey);
+  tt_ptr_op(md3->family, !=, NULL);
+  tt_int_op(smartlist_len(md3->family), ==, 3);
+  tt_str_op(smartlist_get(md3->family, 2), ==, "nodeZ");
+
   /* Okay, now we are going to clear out everything older than a week old.
    * In practice, that means md3 */
   microdesc_cache_clean(mc, time(NULL)-7*24*60*60, 1/*force*/);
@@ -226,8 +238,251 @@ test_md_cache(void *data)
   tor_free(fn);
 }
 
+static void
+test_md_missing(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  networkstatus_t *ns = NULL;
+  routerstatus_t *rs1 = NULL, *rs2 = NULL;
+  smartlist_t *added = NULL, *missing = NULL;
+  (void)data;
+
+  options = get_options_mutable();
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_missing_test"));
+#ifdef _WIN32
+  tt_int_op(0, ==, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, ==, mkdir(options->DataDirectory, 0700));
+#endif
+
+  ns = tor_malloc_zero(sizeof(networkstatus_t));
+  ns->flavor = FLAV_MICRODESC;
+  ns->routerstatus_list = smartlist_new();
+  rs1 = tor_malloc_zero(sizeof(routerstatus_t));
+  rs2 = tor_malloc_zero(sizeof(routerstatus_t));
+  crypto_digest256(rs1->descriptor_digest, test_md1, strlen(test_md1),
+                   DIGEST_SHA256);
+  crypto_digest256(rs2->descriptor_digest, test_md2, strlen(test_md2),
+                   DIGEST_SHA256);
+  smartlist_add(ns->routerstatus_list, rs1);
+  smartlist_add(ns->routerstatus_list, rs2);
+
+  mc = get_microdesc_cache();
+  missing = microdesc_list_missing_digest256(ns, mc, 0, NULL);
+  tt_int_op(2, ==, smartlist_len(missing));
+  smartlist_free(missing);
+
+  /* Once md1 arrives, only md2 should be missing. */
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL) - 60, NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  missing = microdesc_list_missing_digest256(ns, mc, 0, NULL);
+  tt_int_op(1, ==, smartlist_len(missing));
+  tt_ptr_op(rs2->descriptor_digest, ==, smartlist_get(missing, 0));
+  smartlist_free(missing);
+
+  /* Dropping md1 from the cache makes it missing again. */
+  microdesc_cache_clean(mc, time(NULL), 1);
+  missing = microdesc_list_missing_digest256(ns, mc, 0, NULL);
+  tt_int_op(2, ==, smartlist_len(missing));
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  smartlist_free(missing);
+  if (ns) {
+    smartlist_free(ns->routerstatus_list);
+    smartlist_free(ns->missing_microdescs);
+    tor_free(ns);
+  }
+  tor_free(rs1);
+  tor_free(rs2);
+}
+
+static void
+test_md_rebuild_background(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL, *mds = NULL;
+  microdesc_t *late = NULL;
+  char *fn = NULL, *s = NULL, *body = NULL;
+  time_t deadline = time(NULL) + 30;
+  int i, r;
+  (void)data;
+
+  options = get_options_mutable();
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_bg_rebuild_test"));
+#ifdef _WIN32
+  tt_int_op(0, ==, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, ==, mkdir(options->DataDirectory, 0700));
+#endif
+
+  /* Put enough in the journal that a rebuild is worthwhile. */
+  mc = get_microdesc_cache();
+  mds = smartlist_new();
+  for (i = 0; i < 100; ++i) {
+    tor_asprintf(&body, "%sfamily node%d\n", test_md1, i);
+    added = microdescs_add_to_cache(mc, body, NULL, SAVED_NOWHERE, 0,
+                                    time(NULL), NULL);
+    tt_int_op(1, ==, smartlist_len(added));
+    smartlist_add_all(mds, added);
+    smartlist_free(added);
+    added = NULL;
+    tor_free(body);
+  }
+
+  tt_int_op(0, ==, microdesc_cache_rebuild(mc, 0));
+  /* Something that arrives while the new cache is being written belongs
+   * in the journal. */
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  late = smartlist_get(added, 0);
+
+  while ((r = microdesc_cache_finish_rebuild(mc)) == 0 &&
+         smartlist_len(mds) &&
+         ((microdesc_t*)smartlist_get(mds, 0))->saved_location !=
+           SAVED_IN_CACHE &&
+         time(NULL) < deadline)
+    ;
+  /* Without threads, the rebuild happened before we added test_md2. */
+  tt_int_op(r, !=, -1);
+
+  SMARTLIST_FOREACH(mds, microdesc_t *, md,
+                    tt_int_op(md->saved_location, ==, SAVED_IN_CACHE));
+  tt_int_op(late->saved_location, ==, SAVED_IN_JOURNAL);
+
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs",
+               options->DataDirectory);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  SMARTLIST_FOREACH(mds, microdesc_t *, md,
+                    test_mem_op(md->body, ==, s + md->off, md->bodylen));
+  tor_free(s);
+  tor_free(fn);
+
+  tor_asprintf(&fn, "%s"PATH_SEPARATOR"cached-microdescs.new",
+               options->DataDirectory);
+  s = read_file_to_str(fn, RFTS_BIN, NULL);
+  tt_assert(s);
+  tt_int_op(strlen(s), ==, late->off + late->bodylen);
+  test_mem_op(s + late->off, ==, test_md2, strlen(test_md2));
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  microdesc_free_all();
+  smartlist_free(added);
+  smartlist_free(mds);
+  tor_free(body);
+  tor_free(s);
+  tor_free(fn);
+}
+
+/** Return a new connection that is about to spool the microdescriptors
+ * with the <b>n</b> digests in <b>digests</b>. */
+static dir_connection_t *
+md_spool_conn_new(const char **digests, int n)
+{
+  dir_connection_t *conn = dir_connection_new(AF_INET);
+  int i;
+  conn->dir_spool_src = DIR_SPOOL_MICRODESC;
+  conn->fingerprint_stack = smartlist_new();
+  for (i = 0; i < n; ++i)
+    smartlist_add(conn->fingerprint_stack,
+                  tor_memdup(digests[i], DIGEST256_LEN));
+  return conn;
+}
+
+static void
+test_md_precompressed(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  dir_connection_t *conn1 = NULL, *conn2 = NULL, *conn3 = NULL;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *both[2], *with_missing[2];
+  char *text = NULL, *expected = NULL;
+  size_t text_len = 0;
+  (void)data;
+
+  options = get_options_mutable();
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_precompressed_test"));
+#ifdef _WIN32
+  tt_int_op(0, ==, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, ==, mkdir(options->DataDirectory, 0700));
+#endif
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  time(NULL), NULL);
+  tt_int_op(1, ==, smartlist_len(added));
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  memset(d3, 'x', sizeof(d3));
+  both[0] = with_missing[0] = d1;
+  both[1] = d2;
+  with_missing[1] = d3;
+
+  /* The first request gets compressed once, in the order we'd spool it. */
+  conn1 = md_spool_conn_new(both, 2);
+  tt_int_op(1, ==, connection_dirserv_spool_precompressed(conn1));
+  tt_int_op(conn1->dir_spool_src, ==, DIR_SPOOL_CACHED_DIR);
+  tt_ptr_op(conn1->fingerprint_stack, ==, NULL);
+  tt_assert(conn1->cached_dir);
+  tt_int_op(0, ==, tor_gzip_uncompress(&text, &text_len,
+                                       conn1->cached_dir->dir_z,
+                                       conn1->cached_dir->dir_z_len,
+                                       ZLIB_METHOD, 1, LOG_WARN));
+  tor_asprintf(&expected, "%s%s", test_md2, test_md1);
+  tt_str_op(text, ==, expected);
+
+  /* The same request again shares the compressed answer. */
+  conn2 = md_spool_conn_new(both, 2);
+  tt_int_op(1, ==, connection_dirserv_spool_precompressed(conn2));
+  tt_ptr_op(conn2->cached_dir, ==, conn1->cached_dir);
+
+  /* If we're missing anything, the caller compresses as usual. */
+  conn3 = md_spool_conn_new(with_missing, 2);
+  tt_int_op(0, ==, connection_dirserv_spool_precompressed(conn3));
+  tt_int_op(conn3->dir_spool_src, ==, DIR_SPOOL_MICRODESC);
+  tt_int_op(2, ==, smartlist_len(conn3->fingerprint_stack));
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  if (conn1)
+    connection_free(TO_CONN(conn1));
+  if (conn2)
+    connection_free(TO_CONN(conn2));
+  if (conn3)
+    connection_free(TO_CONN(conn3));
+  dirserv_free_all();
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(text);
+  tor_free(expected);
+}
+
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
+  { "missing", test_md_missing, TT_FORK, NULL, NULL },
+  { "rebuild_background", test_md_rebuild_background, TT_FORK, NULL, NULL },
+  { "precompressed", test_md_precompressed, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
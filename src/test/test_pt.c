@@ -10,6 +10,12 @@
 #include "circuitbuild.h"
 #include "test.h"
 
+#ifdef HAVE_EVENT2_EVENT_H
+#include <event2/event.h>
+#else
+#include <event.h>
+#endif
+
 static void
 reset_mp(managed_proxy_t *mp)
 {
@@ -132,12 +138,235 @@ test_pt_protocol(void)
   tor_free(mp);
 }
 
+static void *
+inproc_dummy_conn_new(const tor_addr_t *addr, uint16_t port)
+{
+  (void)addr;
+  (void)port;
+  return NULL;
+}
+
+static int
+inproc_dummy_send(void *arg, tor_socket_t sock, const char *buf, size_t len)
+{
+  (void)arg;
+  return tor_socket_send(sock, buf, len, 0);
+}
+
+static int
+inproc_dummy_recv(void *arg, tor_socket_t sock, char *buf, size_t len)
+{
+  (void)arg;
+  return tor_socket_recv(sock, buf, len, 0);
+}
+
+static void
+test_pt_inproc(void)
+{
+  static inproc_transport_t trebuchet, duplicate;
+
+  trebuchet.name = "trebuchet";
+  trebuchet.conn_new = inproc_dummy_conn_new;
+  trebuchet.io.send = inproc_dummy_send;
+  trebuchet.io.recv = inproc_dummy_recv;
+  memcpy(&duplicate, &trebuchet, sizeof(duplicate));
+
+  test_assert(!pt_get_inproc_transport("trebuchet"));
+  test_eq(pt_register_inproc_transport(&trebuchet), 0);
+  test_eq_ptr(pt_get_inproc_transport("trebuchet"), &trebuchet);
+  test_assert(!pt_get_inproc_transport("catapult"));
+
+  /* Names must be unique. */
+  test_eq(pt_register_inproc_transport(&duplicate), -1);
+  test_eq_ptr(pt_get_inproc_transport("trebuchet"), &trebuchet);
+
+ done:
+  pt_free_all();
+}
+
+/** How many bytes the loopback transport has sent and received, and how
+ * many of its connection states it has freed. */
+static size_t loopback_n_sent = 0, loopback_n_received = 0;
+static int loopback_n_freed = 0;
+
+/** The byte that the loopback transport XORs everything with, so that a
+ * TLS peer that didn't go through it couldn't make sense of us. */
+#define LOOPBACK_MASK 0x5a
+
+static void *
+loopback_conn_new(const tor_addr_t *addr, uint16_t port)
+{
+  (void)addr;
+  (void)port;
+  return tor_malloc_zero(1);
+}
+
+static int
+loopback_send(void *arg, tor_socket_t sock, const char *buf, size_t len)
+{
+  char tmp[4096];
+  size_t i;
+  int r;
+  (void)arg;
+  if (len > sizeof(tmp))
+    len = sizeof(tmp);
+  for (i = 0; i < len; ++i)
+    tmp[i] = buf[i] ^ LOOPBACK_MASK;
+  r = tor_socket_send(sock, tmp, len, 0);
+  if (r > 0)
+    loopback_n_sent += r;
+  return r;
+}
+
+static int
+loopback_recv(void *arg, tor_socket_t sock, char *buf, size_t len)
+{
+  int r, i;
+  (void)arg;
+  r = tor_socket_recv(sock, buf, len, 0);
+  for (i = 0; i < r; ++i)
+    buf[i] ^= LOOPBACK_MASK;
+  if (r > 0)
+    loopback_n_received += r;
+  return r;
+}
+
+static void
+loopback_free(void *arg)
+{
+  tor_free(arg);
+  ++loopback_n_freed;
+}
+
+/** Run a TLS handshake, and send data both ways, between two tor_tls_t
+ * objects that both talk through an in-process transport. */
+static void
+test_pt_inproc_loopback(void)
+{
+  static inproc_transport_t loopback;
+  const inproc_transport_t *t;
+  crypto_pk_t *identity = NULL;
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  tor_tls_t *client = NULL, *server = NULL;
+  tor_addr_t addr;
+  char buf[64];
+  int c = TOR_TLS_WANTREAD, s = TOR_TLS_WANTREAD, i;
+
+  loopback.name = "loopback";
+  loopback.conn_new = loopback_conn_new;
+  loopback.io.send = loopback_send;
+  loopback.io.recv = loopback_recv;
+  loopback.io.free = loopback_free;
+  test_eq(pt_register_inproc_transport(&loopback), 0);
+  t = pt_get_inproc_transport("loopback");
+  test_eq_ptr(t, &loopback);
+
+  identity = pk_generate(0);
+  test_eq(tor_tls_context_init(1, identity, identity, 86400), 0);
+  test_eq(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  set_socket_nonblocking(fds[0]);
+  set_socket_nonblocking(fds[1]);
+  tor_addr_from_ipv4h(&addr, 0x7f000001);
+  client = tor_tls_new_with_io(fds[0], 0, &t->io, t->conn_new(&addr, 443));
+  server = tor_tls_new_with_io(fds[1], 1, &t->io, t->conn_new(&addr, 443));
+  test_assert(client);
+  test_assert(server);
+
+  for (i = 0; i < 100 && (c != TOR_TLS_DONE || s != TOR_TLS_DONE); ++i) {
+    if (c != TOR_TLS_DONE)
+      c = tor_tls_handshake(client);
+    if (s != TOR_TLS_DONE)
+      s = tor_tls_handshake(server);
+    test_assert(c >= TOR_TLS_WANTREAD);
+    test_assert(s >= TOR_TLS_WANTREAD);
+  }
+  test_eq(c, TOR_TLS_DONE);
+  test_eq(s, TOR_TLS_DONE);
+  /* Every byte of the handshake went through the transport. */
+  test_assert(loopback_n_sent > 0);
+  test_eq(loopback_n_sent, loopback_n_received);
+
+  test_eq(tor_tls_write(client, "ghoti", 5), 5);
+  test_eq(tor_tls_read(server, buf, sizeof(buf)), 5);
+  test_memeq(buf, "ghoti", 5);
+  test_eq(tor_tls_write(server, "fish", 4), 4);
+  test_eq(tor_tls_read(client, buf, sizeof(buf)), 4);
+  test_memeq(buf, "fish", 4);
+  test_eq(loopback_n_sent, loopback_n_received);
+
+  /* Freeing the TLS objects frees the transport's states. */
+  tor_tls_free(client);
+  tor_tls_free(server);
+  client = server = NULL;
+  test_eq(loopback_n_freed, 2);
+
+ done:
+  tor_tls_free(client);
+  tor_tls_free(server);
+  if (fds[0] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[0]);
+  if (fds[1] != TOR_INVALID_SOCKET)
+    tor_close_socket(fds[1]);
+  crypto_pk_free(identity);
+  pt_free_all();
+}
+
+#ifndef _WIN32
+/** Launch a client managed proxy, and make sure that we configure it and
+ * register its transport from the libevent callback on its stdout,
+ * without polling it from pt_configure_remaining_proxies() again. */
+static void
+test_pt_managed_stdout(void *arg)
+{
+  smartlist_t *transports = smartlist_new();
+  char **proxy_argv = tor_malloc_zero(sizeof(char*)*4);
+  tor_libevent_cfg cfg;
+  int i;
+  (void)arg;
+
+  memset(&cfg, 0, sizeof(cfg));
+  tor_libevent_initialize(&cfg);
+
+  proxy_argv[0] = tor_strdup("/bin/sh");
+  proxy_argv[1] = tor_strdup("-c");
+  /* Wait a little before speaking, so that we don't configure the proxy
+   * straight away when we launch it. */
+  proxy_argv[2] = tor_strdup("sleep 1; echo VERSION 1; "
+                             "echo CMETHOD trebuchet socks5 127.0.0.1:1999; "
+                             "echo CMETHODS DONE; exec sleep 30");
+  smartlist_add(transports, (char*)"trebuchet");
+  pt_kickstart_proxy(transports, proxy_argv, 0);
+  tt_assert(pt_proxies_configuration_pending());
+  pt_configure_remaining_proxies();
+  tt_assert(pt_proxies_configuration_pending());
+
+  for (i = 0; i < 100 && pt_proxies_configuration_pending(); ++i)
+    event_base_loop(tor_libevent_get_base(), EVLOOP_ONCE);
+  tt_assert(!pt_proxies_configuration_pending());
+  tt_assert(transport_get_by_name("trebuchet"));
+  tt_int_op(transport_get_by_name("trebuchet")->port, ==, 1999);
+
+ done:
+  smartlist_free(transports);
+  pt_free_all();
+  clear_transport_list();
+}
+#endif
+
+#define PT_TEST(name, flags)                                          \
+  { #name, test_pt_ ## name, flags, NULL, NULL }
+
 #define PT_LEGACY(name)                                               \
   { #name, legacy_test_helper, 0, &legacy_setup, test_pt_ ## name }
 
 struct testcase_t pt_tests[] = {
   PT_LEGACY(parsing),
   PT_LEGACY(protocol),
+  PT_LEGACY(inproc),
+  PT_LEGACY(inproc_loopback),
+#ifndef _WIN32
+  PT_TEST(managed_stdout, TT_FORK),
+#endif
   END_OF_TESTCASES
 };
 
@@ -13,10 +13,14 @@
 #include "test.h"
 #include "mempool.h"
 #include "memarea.h"
+#include "workqueue.h"
 
 #ifdef _WIN32
 #include <tchar.h>
 #endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
 
 static void
 test_util_time(void)
@@ -177,6 +181,43 @@ test_util_time(void)
   ;
 }
 
+/** Run unit tests for the monotonic clock functions. */
+static void
+test_util_monotime(void *arg)
+{
+  uint64_t t1, t2, c1, c2;
+  int i;
+  (void)arg;
+
+  /* The precise clock never runs backwards. */
+  t1 = tor_monotime_nsec();
+  for (i = 0; i < 1000; ++i) {
+    t2 = tor_monotime_nsec();
+    tt_assert(t2 >= t1);
+    t1 = t2;
+  }
+  /* The coarse clock stays within a few ticks of it. */
+  c1 = tor_monotime_coarse_nsec();
+  t1 = tor_monotime_nsec();
+  tt_assert(c1 <= t1 + U64_LITERAL(1000000));
+  tt_assert(t1 - c1 < U64_LITERAL(100000000));
+
+  /* The cached clock holds still until we clear it. */
+  tor_monotime_cache_clear();
+  c1 = tor_monotime_cached_nsec();
+  tt_assert(c1 >= t1);
+  while (tor_monotime_nsec() - c1 < U64_LITERAL(5000000))
+    ;
+  c2 = tor_monotime_cached_nsec();
+  tt_assert(c1 == c2);
+  tor_monotime_cache_clear();
+  c2 = tor_monotime_cached_nsec();
+  tt_assert(c2 - c1 >= U64_LITERAL(4000000));
+
+ done:
+  ;
+}
+
 static void
 test_util_parse_http_time(void *arg)
 {
@@ -1257,6 +1298,160 @@ test_util_threads(void)
     tor_mutex_free(_thread_test_start2);
 }
 
+#ifdef USE_PTHREADS
+/** A job for the workqueue test: a worker squares <b>in</b>. */
+typedef struct workqueue_test_job_t {
+  int in;
+  int out;
+  int replied;
+} workqueue_test_job_t;
+
+/** Held by the workqueue test to keep the workers from finishing jobs. */
+static tor_mutex_t *workqueue_test_gate = NULL;
+/** Protects workqueue_test_n_run. */
+static tor_mutex_t *workqueue_test_lock = NULL;
+/** Number of jobs run by worker threads that have exited. */
+static int workqueue_test_n_run = 0;
+/** Number of reply functions called by the workqueue test. */
+static int workqueue_test_n_replies = 0;
+
+/** Workqueue test helper: make a worker thread's state, which counts the
+ * jobs that thread runs. */
+static void *
+workqueue_test_new_state(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(sizeof(int));
+}
+
+/** Workqueue test helper: add up how many jobs a worker ran. */
+static void
+workqueue_test_free_state(void *state)
+{
+  tor_mutex_acquire(workqueue_test_lock);
+  workqueue_test_n_run += *(int*)state;
+  tor_mutex_release(workqueue_test_lock);
+  tor_free(state);
+}
+
+/** Workqueue test helper: run a job in a worker thread. */
+static void
+workqueue_test_work(void *state, void *arg)
+{
+  workqueue_test_job_t *job = arg;
+  tor_mutex_acquire(workqueue_test_gate);
+  tor_mutex_release(workqueue_test_gate);
+  job->out = job->in * job->in;
+  ++*(int*)state;
+}
+
+/** Workqueue test helper: handle a finished job in the main thread. */
+static void
+workqueue_test_reply(void *arg)
+{
+  workqueue_test_job_t *job = arg;
+  ++job->replied;
+  ++workqueue_test_n_replies;
+}
+
+/** Workqueue test helper: wait up to a second for replies on <b>rq</b>,
+ * and process any that arrive. */
+static void
+workqueue_test_wait_for_replies(replyqueue_t *rq)
+{
+  tor_socket_t fd = replyqueue_get_socket(rq);
+  fd_set fds;
+  struct timeval tv;
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  select(fd+1, &fds, NULL, NULL, &tv);
+  replyqueue_process(rq);
+}
+
+/** Run unit tests for thread pools and reply queues. */
+static void
+test_util_workqueue(void *arg)
+{
+#define N_JOBS 500
+  replyqueue_t *rq = NULL;
+  threadpool_t *pool = NULL;
+  workqueue_test_job_t *jobs = tor_calloc(N_JOBS,
+                                          sizeof(workqueue_test_job_t));
+  workqueue_entry_t *ent, *last = NULL;
+  int i, n_queued = 0, gate_held = 0;
+  time_t started;
+  (void)arg;
+
+  workqueue_test_gate = tor_mutex_new();
+  workqueue_test_lock = tor_mutex_new();
+  workqueue_test_n_run = workqueue_test_n_replies = 0;
+  for (i = 0; i < N_JOBS; ++i)
+    jobs[i].in = i;
+
+  rq = replyqueue_new();
+  tt_assert(rq);
+  tor_mutex_acquire(workqueue_test_gate);
+  gate_held = 1;
+  pool = threadpool_new(4, 8, rq, workqueue_test_new_state,
+                        workqueue_test_free_state, NULL);
+  tt_assert(pool);
+  tt_int_op(threadpool_get_n_threads(pool), ==, 4);
+
+  /* With the workers stuck, we can queue 8 jobs, plus one for each worker
+   * that has taken a job already. */
+  while ((ent = threadpool_queue_work(pool, workqueue_test_work,
+                                      workqueue_test_reply,
+                                      &jobs[n_queued]))) {
+    last = ent;
+    ++n_queued;
+    tt_int_op(n_queued, <=, 12);
+  }
+  tt_int_op(n_queued, >=, 8);
+
+  /* The newest job is still pending, so we can cancel it. */
+  tt_ptr_op(workqueue_entry_cancel(pool, last), ==, &jobs[n_queued-1]);
+  --n_queued;
+
+  /* Let the workers go, and queue everything else. */
+  tor_mutex_release(workqueue_test_gate);
+  gate_held = 0;
+  started = time(NULL);
+  while (n_queued < N_JOBS && time(NULL) < started + 30) {
+    if (threadpool_queue_work(pool, workqueue_test_work,
+                              workqueue_test_reply, &jobs[n_queued]))
+      ++n_queued;
+    else
+      workqueue_test_wait_for_replies(rq);
+  }
+  tt_int_op(n_queued, ==, N_JOBS);
+  while (workqueue_test_n_replies < N_JOBS && time(NULL) < started + 30)
+    workqueue_test_wait_for_replies(rq);
+  tt_int_op(workqueue_test_n_replies, ==, N_JOBS);
+  for (i = 0; i < N_JOBS; ++i) {
+    tt_int_op(jobs[i].out, ==, i*i);
+    tt_int_op(jobs[i].replied, ==, 1);
+  }
+
+  /* Every worker counted its jobs as it exited. */
+  threadpool_free(pool);
+  pool = NULL;
+  tt_int_op(workqueue_test_n_run, ==, N_JOBS);
+
+ done:
+  if (gate_held)
+    tor_mutex_release(workqueue_test_gate);
+  threadpool_free(pool);
+  replyqueue_free(rq);
+  tor_mutex_free(workqueue_test_gate);
+  tor_mutex_free(workqueue_test_lock);
+  workqueue_test_gate = workqueue_test_lock = NULL;
+  tor_free(jobs);
+#undef N_JOBS
+}
+#endif
+
 /** Run unit tests for compression functions */
 static void
 test_util_gzip(void)
@@ -1335,7 +1530,7 @@ test_util_gzip(void)
   tor_free(buf1);
   tor_free(buf2);
   tor_free(buf3);
-  state = tor_zlib_new(1, ZLIB_METHOD);
+  state = tor_zlib_new(1, ZLIB_METHOD, HIGH_COMPRESSION);
   tt_assert(state);
   cp1 = buf1 = tor_malloc(1024);
   len1 = 1024;
@@ -1358,6 +1553,35 @@ test_util_gzip(void)
   test_streq(buf3, "ABCDEFGHIJABCDEFGHIJ"); /*Make sure it compressed right.*/
   test_eq(21, len2);
 
+  /* A fast compression level produces output the same decoder reads. */
+  tor_zlib_free(state);
+  tor_free(buf1);
+  tor_free(buf3);
+  state = tor_zlib_new(1, ZLIB_METHOD, LOW_COMPRESSION);
+  tt_assert(state);
+  cp1 = buf1 = tor_malloc(1024);
+  len1 = 1024;
+  ccp2 = "ABCDEFGHIJABCDEFGHIJ";
+  len2 = 21;
+  test_assert(tor_zlib_process(state, &cp1, &len1, &ccp2, &len2, 1)
+              == TOR_ZLIB_DONE);
+  tt_assert(!tor_gzip_uncompress(&buf3, &len2, buf1, 1024-len1,
+                                  ZLIB_METHOD, 1, LOG_WARN));
+  test_streq(buf3, "ABCDEFGHIJABCDEFGHIJ");
+
+  /* Content-coding names map to methods and back. */
+  test_eq(ZLIB_METHOD, compression_method_get_by_name("deflate"));
+  test_eq(ZLIB_METHOD, compression_method_get_by_name("x-deflate"));
+  test_eq(GZIP_METHOD, compression_method_get_by_name("x-gzip"));
+  test_eq(NO_METHOD, compression_method_get_by_name("identity"));
+  test_eq(UNKNOWN_METHOD, compression_method_get_by_name("br"));
+  test_streq("deflate", compression_method_get_name(ZLIB_METHOD));
+  test_streq("gzip", compression_method_get_name(GZIP_METHOD));
+  test_streq("identity", compression_method_get_name(NO_METHOD));
+  test_eq_ptr(NULL, compression_method_get_name(UNKNOWN_METHOD));
+  test_assert(tor_compress_supports_method(ZLIB_METHOD));
+  test_assert(!tor_compress_supports_method(UNKNOWN_METHOD));
+
  done:
   if (state)
     tor_zlib_free(state);
@@ -1691,13 +1915,221 @@ test_util_mempool(void)
     mp_pool_destroy(pool);
 }
 
+/** Run unit tests for tagged heap allocations. */
+static void
+test_util_memtag(void *arg)
+{
+  int64_t bytes0, allocs0, bytes1, allocs1;
+  uint64_t total0, total1;
+  char *a = NULL, *b = NULL;
+  (void)arg;
+
+  memtag_get_usage(MEMTAG_CIRCUIT, &bytes0, &allocs0, &total0);
+  a = tor_malloc_tagged(MEMTAG_CIRCUIT, 100);
+  b = tor_malloc_zero_tagged(MEMTAG_CIRCUIT, 28);
+  tt_int_op((uintptr_t)a % sizeof(void*), ==, 0);
+  tt_int_op(b[0], ==, 0);
+  tt_int_op(b[27], ==, 0);
+  memset(a, 'x', 100);
+  memtag_get_usage(MEMTAG_CIRCUIT, &bytes1, &allocs1, &total1);
+  tt_assert(bytes1 - bytes0 == 128);
+  tt_assert(allocs1 - allocs0 == 2);
+  tt_assert(total1 - total0 == 2);
+
+  tor_free_tagged(a);
+  tt_ptr_op(a, ==, NULL);
+  memtag_get_usage(MEMTAG_CIRCUIT, &bytes1, &allocs1, &total1);
+  tt_assert(bytes1 - bytes0 == 28);
+  tt_assert(allocs1 - allocs0 == 1);
+  tt_assert(total1 - total0 == 2);
+  tt_str_op(memtag_get_name(MEMTAG_CIRCUIT), ==, "circuit");
+
+ done:
+  tor_free_tagged(a);
+  tor_free_tagged(b);
+}
+
+/** Run unit tests for carving memory pool chunks from the hugepage
+ * arena. */
+static void
+test_util_mempool_arena(void *arg)
+{
+  mp_pool_t *pool = NULL;
+  void *items[3000];
+  void *chunk;
+  int i;
+  (void)arg;
+
+  if (mp_arena_set_enabled(1) < 0) {
+    tt_skip();
+  }
+
+  pool = mp_pool_new(241, 16384);
+  for (i = 0; i < 3000; ++i) {
+    items[i] = mp_pool_get(pool);
+    memset(items[i], i & 0xff, 241);
+  }
+  mp_pool_assert_ok(pool);
+  /* Arena chunks are page-aligned; malloc'd ones almost never are. */
+  tt_assert(pool->full_chunks);
+  tt_int_op((uintptr_t)pool->full_chunks & 4095, ==, 0);
+  for (i = 0; i < 3000; ++i)
+    tt_int_op(*(unsigned char*)items[i], ==, i & 0xff);
+
+  /* Freed chunks go back to the arena, and get reused. */
+  for (i = 0; i < 3000; ++i)
+    mp_pool_release(items[i]);
+  mp_pool_clean(pool, 0, 0);
+  mp_pool_assert_ok(pool);
+  items[0] = mp_pool_get(pool);
+  chunk = pool->used_chunks;
+  tt_int_op((uintptr_t)chunk & 4095, ==, 0);
+  mp_pool_release(items[0]);
+  mp_arena_log_status(LOG_DEBUG);
+
+ done:
+  if (pool)
+    mp_pool_destroy(pool);
+  mp_arena_set_enabled(0);
+}
+
+#ifdef USE_PTHREADS
+/** Pool shared by the worker threads in the mempool cache test. */
+static mp_pool_t *mempool_test_pool = NULL;
+/** Number of jobs finished in the mempool cache test. */
+static int mempool_test_n_done = 0;
+/** Number of jobs in the mempool cache test that saw a corrupt item. */
+static int mempool_test_n_bad = 0;
+
+/** Mempool cache test helper: give a worker thread its own cache. */
+static void *
+mempool_test_new_cache(void *arg)
+{
+  (void)arg;
+  return mp_pool_cache_new(mempool_test_pool);
+}
+
+/** Mempool cache test helper: free a worker thread's cache. */
+static void
+mempool_test_free_cache(void *cache)
+{
+  mp_pool_cache_free(cache);
+}
+
+/** Mempool cache test helper: in a worker thread, take a batch of items
+ * from the thread's cache, fill them, check them, and give them back. */
+static void
+mempool_test_work(void *cache, void *arg)
+{
+  int *bad = arg;
+  unsigned char *items[100];
+  int i, j;
+  for (i = 0; i < 100; ++i) {
+    items[i] = mp_pool_cache_get(cache);
+    memset(items[i], i, 64);
+  }
+  for (i = 0; i < 100; ++i) {
+    for (j = 0; j < 64; ++j) {
+      if (items[i][j] != i)
+        *bad = 1;
+    }
+    mp_pool_cache_release(cache, items[i]);
+  }
+}
+
+/** Mempool cache test helper: count a finished job. */
+static void
+mempool_test_reply(void *arg)
+{
+  int *bad = arg;
+  mempool_test_n_bad += *bad;
+  ++mempool_test_n_done;
+}
+
+/** Run unit tests for per-thread caches in front of a shared memory
+ * pool. */
+static void
+test_util_mempool_cache(void *arg)
+{
+  replyqueue_t *rq = NULL;
+  threadpool_t *pool = NULL;
+  mp_pool_cache_t *cache = NULL;
+  void *items[200];
+  int bad[200];
+  int i, n_chunks, n_empty;
+  uint64_t bytes;
+  time_t started;
+  (void)arg;
+
+  mempool_test_pool = mp_pool_new(64, 4096);
+  mp_pool_make_shared(mempool_test_pool);
+  mempool_test_n_done = mempool_test_n_bad = 0;
+
+  /* A cache hands out distinct items, and gives them all back when we
+   * free it. */
+  cache = mp_pool_cache_new(mempool_test_pool);
+  for (i = 0; i < 200; ++i) {
+    items[i] = mp_pool_cache_get(cache);
+    memset(items[i], i, 64);
+  }
+  for (i = 0; i < 200; ++i)
+    tt_int_op(*(unsigned char*)items[i], ==, i);
+  for (i = 0; i < 200; ++i)
+    mp_pool_cache_release(cache, items[i]);
+  mp_pool_cache_free(cache);
+  cache = NULL;
+  mp_pool_assert_ok(mempool_test_pool);
+  mp_pool_get_usage(mempool_test_pool, &n_chunks, &n_empty, &bytes);
+  tt_int_op(n_chunks, >, 0);
+  tt_int_op(n_empty, ==, n_chunks);
+
+  /* Now hammer the pool from four workers, each with its own cache, while
+   * this thread uses the pool directly. */
+  rq = replyqueue_new();
+  tt_assert(rq);
+  pool = threadpool_new(4, 0, rq, mempool_test_new_cache,
+                        mempool_test_free_cache, NULL);
+  tt_assert(pool);
+  for (i = 0; i < 200; ++i) {
+    bad[i] = 0;
+    tt_assert(threadpool_queue_work(pool, mempool_test_work,
+                                    mempool_test_reply, &bad[i]));
+  }
+  started = time(NULL);
+  while (mempool_test_n_done < 200 && time(NULL) < started + 30) {
+    void *item = mp_pool_get(mempool_test_pool);
+    mp_pool_release(item);
+    replyqueue_process(rq);
+  }
+  tt_int_op(mempool_test_n_done, ==, 200);
+  tt_int_op(mempool_test_n_bad, ==, 0);
+
+  /* Once the workers have exited and flushed their caches, every item is
+   * back in the pool. */
+  threadpool_free(pool);
+  pool = NULL;
+  mp_pool_assert_ok(mempool_test_pool);
+  mp_pool_get_usage(mempool_test_pool, &n_chunks, &n_empty, &bytes);
+  tt_int_op(n_empty, ==, n_chunks);
+
+ done:
+  threadpool_free(pool);
+  replyqueue_free(rq);
+  mp_pool_cache_free(cache);
+  mp_pool_destroy(mempool_test_pool);
+  mempool_test_pool = NULL;
+}
+#endif
+
 /** Run unittests for memory area allocator */
 static void
 test_util_memarea(void)
 {
   memarea_t *area = memarea_new();
+  memarea_mark_t mark;
   char *p1, *p2, *p3, *p1_orig;
   void *malloced_ptr = NULL;
+  size_t allocated, allocated2, used;
   int i;
 
   test_assert(area);
@@ -1782,6 +2214,36 @@ test_util_memarea(void)
   test_assert(memarea_owns_ptr(area, p1));
   test_assert(memarea_owns_ptr(area, p2));
 
+  /* Releasing to a mark frees what came after it, and nothing before. */
+  memarea_clear(area);
+  p1 = memarea_strdup(area, "before the mark");
+  memarea_get_mark(area, &mark);
+  for (i = 0; i < 100; ++i) {
+    p2 = memarea_alloc(area, 100);
+    memset(p2, 'x', 100);
+  }
+  p2 = memarea_alloc(area, 9000);
+  test_assert(memarea_owns_ptr(area, p2));
+  memarea_release_to_mark(area, &mark);
+  memarea_assert_ok(area);
+  test_assert(! memarea_owns_ptr(area, p2));
+  test_streq(p1, "before the mark");
+  p3 = memarea_alloc(area, 16);
+  test_assert(p3 > p1);
+  test_assert(memarea_owns_ptr(area, p3));
+
+  /* After a clear, an area holds as much as it ever needed in one chunk. */
+  for (i = 0; i < 100; ++i)
+    memarea_alloc(area, 100);
+  memarea_clear(area);
+  memarea_get_stats(area, &allocated, &used);
+  test_assert(allocated >= 100*100);
+  p1 = memarea_alloc(area, 1);
+  for (i = 0; i < 99; ++i)
+    memarea_alloc(area, 100);
+  memarea_get_stats(area, &allocated2, &used);
+  test_eq(allocated, allocated2);
+
  done:
   memarea_drop_all(area);
   tor_free(malloced_ptr);
@@ -2633,6 +3095,38 @@ test_util_di_ops(void)
     test_eq(neq1, !eq1);
   }
 
+  /* Now flip each bit in turn, at lengths that exercise the word, vector,
+   * and digest-sized code paths, and check against memcmp. */
+  {
+    static const size_t lens[] = { 1, 7, 8, 9, 15, 16, 17, 20, 31, 32, 33,
+                                   64, 100 };
+    uint8_t buf1[100], buf2[100];
+    unsigned j, bit;
+    int want;
+    for (j = 0; j < sizeof(buf1); ++j)
+      buf1[j] = (uint8_t)(j * 37 + 11);
+    for (i = 0; i < (int)(sizeof(lens)/sizeof(lens[0])); ++i) {
+      const size_t len = lens[i];
+      test_assert(tor_memeq(buf1, buf1, len));
+      test_eq(0, tor_memcmp(buf1, buf1, len));
+      for (bit = 0; bit < len * 8; ++bit) {
+        memcpy(buf2, buf1, len);
+        buf2[bit / 8] ^= (uint8_t)(1u << (bit % 8));
+        want = memcmp(buf1, buf2, len) < 0 ? -1 : 1;
+        test_assert(!tor_memeq(buf1, buf2, len));
+        test_assert(!tor_memeq(buf2, buf1, len));
+        test_eq(want, tor_memcmp(buf1, buf2, len) < 0 ? -1 : 1);
+        test_eq(-want, tor_memcmp(buf2, buf1, len) < 0 ? -1 : 1);
+      }
+    }
+    /* The first difference decides, even when later ones disagree. */
+    memcpy(buf2, buf1, sizeof(buf1));
+    buf2[3] ^= 0x80;
+    buf2[50] = 0;
+    want = memcmp(buf1, buf2, sizeof(buf1)) < 0 ? -1 : 1;
+    test_eq(want, tor_memcmp(buf1, buf2, sizeof(buf1)) < 0 ? -1 : 1);
+  }
+
  done:
   ;
 }
@@ -2654,6 +3148,40 @@ test_util_n_bits_set(void *ptr)
   ;
 }
 
+/**
+ * Test corking and uncorking TCP sockets
+ */
+static void
+test_util_socket_cork(void *ptr)
+{
+  tor_socket_t s;
+  (void)ptr;
+  s = tor_open_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  tt_assert(SOCKET_OK(s));
+#if defined(TCP_CORK) || defined(TCP_NOPUSH)
+  test_eq(0, tor_socket_set_cork(s, 1));
+  test_eq(0, tor_socket_set_cork(s, 0));
+#else
+  test_eq(-1, tor_socket_set_cork(s, 1));
+#endif
+ done:
+  if (SOCKET_OK(s))
+    tor_close_socket(s);
+}
+
+/**
+ * Test that we refuse to pin ourselves to nonexistent CPUs
+ */
+static void
+test_util_cpu_affinity(void *ptr)
+{
+  (void)ptr;
+  test_eq(-1, tor_set_thread_cpu_affinity(-1));
+  test_eq(-1, tor_set_thread_cpu_affinity(INT_MAX));
+ done:
+  ;
+}
+
 /**
  * Test LHS whitespace (and comment) eater
  */
@@ -2987,6 +3515,225 @@ test_util_set_env_var_in_sl(void *ptr)
   smartlist_free(expected_resulting_env_vars);
 }
 
+/** Test write_bytes_to_file_in_background */
+static void
+test_util_bg_file_write(void *ptr)
+{
+  char *fname = tor_strdup(get_fname("bg_write"));
+  char *contents = NULL;
+  bg_file_write_t *w;
+  time_t deadline = time(NULL) + 30;
+  int r;
+  (void)ptr;
+
+  w = write_bytes_to_file_in_background(fname, tor_memdup("Hello\0world", 11),
+                                        11);
+  if (!w) {
+    /* No threads on this platform. */
+    tt_skip();
+  }
+  while ((r = bg_file_write_poll(w)) == 0 && time(NULL) < deadline)
+    ;
+  tt_int_op(r, ==, 1);
+  contents = read_file_to_str(fname, RFTS_BIN, NULL);
+  tt_assert(contents);
+  test_memeq(contents, "Hello\0world", 11);
+  bg_file_write_free(w);
+  w = NULL;
+
+  /* Writing into a directory that doesn't exist fails. */
+  w = write_bytes_to_file_in_background(get_fname("no_such_dir/bg_write"),
+                                        tor_strdup("x"), 1);
+  tt_assert(w);
+  while ((r = bg_file_write_poll(w)) == 0 && time(NULL) < deadline)
+    ;
+  tt_int_op(r, ==, -1);
+
+ done:
+  bg_file_write_free(w);
+  tor_free(contents);
+  tor_free(fname);
+}
+
+/** Number of times write_behind_failed_cb() has been called. */
+static int n_write_behind_failures = 0;
+
+/** Helper for test_util_write_behind: note a failed write. */
+static void
+write_behind_failed_cb(const char *fname)
+{
+  (void)fname;
+  ++n_write_behind_failures;
+}
+
+/** Test write_str_to_file_behind */
+static void
+test_util_write_behind(void *ptr)
+{
+  char *fname = tor_strdup(get_fname("write_behind"));
+  char *contents = NULL;
+  (void)ptr;
+
+  /* Rapid updates to the same file coalesce; the last one wins. */
+  tt_int_op(0, ==, write_str_to_file_behind(fname, "one", 0, NULL));
+  tt_int_op(0, ==, write_str_to_file_behind(fname, "two", 0, NULL));
+  tt_int_op(0, ==, write_str_to_file_behind(fname, "three", 0, NULL));
+  write_behind_flush();
+  contents = read_file_to_str(fname, 0, NULL);
+  tt_str_op(contents, ==, "three");
+  tor_free(contents);
+
+  /* Later writes still happen after we've polled. */
+  tt_int_op(0, ==, write_str_to_file_behind(fname, "four", 0, NULL));
+  write_behind_poll();
+  write_behind_flush();
+  contents = read_file_to_str(fname, 0, NULL);
+  tt_str_op(contents, ==, "four");
+  tor_free(contents);
+
+  /* We can wait for one file, before we've polled at all. */
+  tt_int_op(0, ==, write_str_to_file_behind(fname, "five", 0, NULL));
+  tt_int_op(0, ==, write_str_to_file_behind(fname, "six", 0, NULL));
+  write_behind_wait(fname);
+  contents = read_file_to_str(fname, 0, NULL);
+  tt_str_op(contents, ==, "six");
+
+  /* Failures are reported, if we were writing in the background. */
+  if (write_str_to_file_behind(get_fname("no_such_dir/write_behind"), "x",
+                               0, write_behind_failed_cb) == 0) {
+    write_behind_flush();
+    tt_int_op(n_write_behind_failures, ==, 1);
+  }
+
+ done:
+  tor_free(contents);
+  tor_free(fname);
+}
+
+/** How many messages test_util_log_domain_masks's callback has seen. */
+static int n_log_domain_msgs = 0;
+
+/** Log callback for test_util_log_domain_masks: count the message. */
+static void
+log_domain_masks_cb(int severity, uint32_t domain, const char *msg)
+{
+  (void)severity;
+  (void)domain;
+  (void)msg;
+  ++n_log_domain_msgs;
+}
+
+/** Test that the inline log_debug and log_info checks let through exactly
+ * the domains that some log wants. */
+static void
+test_util_log_domain_masks(void *ptr)
+{
+  log_severity_list_t severity;
+  (void)ptr;
+
+  /* Start from no logs at all, then add one that wants everything from
+   * info up, but debug messages only about circuits. */
+  logs_free_all();
+  init_logging();
+  set_log_severity_config(LOG_INFO, LOG_ERR, &severity);
+  severity.masks[LOG_DEBUG-LOG_ERR] = LD_CIRC;
+  add_callback_log(&severity, log_domain_masks_cb);
+
+  tt_assert(log_global_domain_is_enabled(LOG_DEBUG, LD_CIRC));
+  tt_assert(log_global_domain_is_enabled(LOG_DEBUG, LD_CIRC|LD_NET));
+  tt_assert(!log_global_domain_is_enabled(LOG_DEBUG, LD_NET));
+  tt_assert(log_global_domain_is_enabled(LOG_INFO, LD_NET));
+
+  log_debug(LD_NET, "nobody wants this");
+  tt_int_op(n_log_domain_msgs, ==, 0);
+  log_debug(LD_CIRC, "somebody wants this");
+  tt_int_op(n_log_domain_msgs, ==, TOR_COMPILED_LOG_LEVEL >= LOG_DEBUG);
+  log_info(LD_NET, "and this");
+  tt_int_op(n_log_domain_msgs, ==, (TOR_COMPILED_LOG_LEVEL >= LOG_DEBUG) +
+            (TOR_COMPILED_LOG_LEVEL >= LOG_INFO));
+
+  /* Changing the log's severity updates the masks. */
+  change_callback_log_severity(LOG_NOTICE, LOG_ERR, log_domain_masks_cb);
+  tt_assert(!log_global_domain_is_enabled(LOG_DEBUG, LD_CIRC));
+  tt_assert(!log_global_domain_is_enabled(LOG_INFO, LD_NET));
+  tt_assert(log_global_domain_is_enabled(LOG_NOTICE, LD_NET));
+
+ done:
+  ;
+}
+
+#ifndef _WIN32
+/** Test that logs_set_async keeps messages in order, and that a log the
+ * writer thread can't write to gets marked dead. */
+static void
+test_util_async_logs(void *ptr)
+{
+  char *fname_a = tor_strdup(get_fname("async_log_a"));
+  char *fname_b = tor_strdup(get_fname("async_log_b"));
+  char *fname_c = tor_strdup(get_fname("async_log_c"));
+  char *contents = NULL;
+  const char *one, *two, *three;
+  log_severity_list_t severity;
+  int fd_a, fd_b, fd_c = -1;
+  (void)ptr;
+
+  set_log_severity_config(LOG_INFO, LOG_ERR, &severity);
+  fd_a = tor_open_cloexec(fname_a, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  tt_int_op(fd_a, >=, 0);
+  add_stream_log(&severity, "a", fd_a);
+  if (logs_set_async(1) < 0)
+    tt_skip();
+
+  /* Queued messages come out before the notice that flushes them. */
+  log_info(LD_GENERAL, "async one");
+  log_info(LD_GENERAL, "async two");
+  log_notice(LD_GENERAL, "async three");
+  contents = read_file_to_str(fname_a, 0, NULL);
+  tt_assert(contents);
+  one = strstr(contents, "async one");
+  two = strstr(contents, "async two");
+  three = strstr(contents, "async three");
+  tt_assert(one && two && three);
+  tt_assert(one < two && two < three);
+  tor_free(contents);
+
+  /* The writer thread can't write to a read-only fd: the next notice we
+   * log notices that, and marks the log dead. */
+  tt_int_op(0, ==, write_str_to_file(fname_b, "", 0));
+  fd_b = tor_open_cloexec(fname_b, O_RDONLY, 0);
+  tt_int_op(fd_b, >=, 0);
+  add_stream_log(&severity, "b", fd_b);
+  log_info(LD_GENERAL, "async four");
+  log_notice(LD_GENERAL, "async five");
+
+  /* Once it's dead, we don't write to it, even if we could. */
+  fd_c = tor_open_cloexec(fname_c, O_WRONLY|O_CREAT|O_TRUNC, 0600);
+  tt_int_op(fd_c, >=, 0);
+  tt_int_op(dup2(fd_c, fd_b), ==, fd_b);
+  log_info(LD_GENERAL, "async six");
+  log_notice(LD_GENERAL, "async seven");
+  tt_int_op(0, ==, logs_set_async(0));
+  contents = read_file_to_str(fname_c, 0, NULL);
+  tt_str_op(contents, ==, "");
+  tor_free(contents);
+
+  /* The other log didn't miss anything. */
+  contents = read_file_to_str(fname_a, 0, NULL);
+  tt_assert(contents);
+  tt_assert(strstr(contents, "async five"));
+  tt_assert(strstr(contents, "async seven"));
+
+ done:
+  logs_set_async(0);
+  if (fd_c >= 0)
+    close(fd_c);
+  tor_free(contents);
+  tor_free(fname_a);
+  tor_free(fname_b);
+  tor_free(fname_c);
+}
+#endif
+
 #define UTIL_LEGACY(name)                                               \
   { #name, legacy_test_helper, 0, &legacy_setup, test_util_ ## name }
 
@@ -2996,6 +3743,7 @@ test_util_set_env_var_in_sl(void *ptr)
 struct testcase_t util_tests[] = {
   UTIL_LEGACY(time),
   UTIL_TEST(parse_http_time, 0),
+  UTIL_TEST(monotime, 0),
   UTIL_LEGACY(config_line),
   UTIL_LEGACY(config_line_quotes),
   UTIL_LEGACY(config_line_comment_character),
@@ -3008,10 +3756,18 @@ struct testcase_t util_tests[] = {
   UTIL_LEGACY(gzip),
   UTIL_LEGACY(datadir),
   UTIL_LEGACY(mempool),
+  UTIL_TEST(mempool_arena, 0),
+  UTIL_TEST(memtag, 0),
+#ifdef USE_PTHREADS
+  UTIL_TEST(mempool_cache, 0),
+#endif
   UTIL_LEGACY(memarea),
   UTIL_LEGACY(control_formats),
   UTIL_LEGACY(mmap),
   UTIL_LEGACY(threads),
+#ifdef USE_PTHREADS
+  UTIL_TEST(workqueue, 0),
+#endif
   UTIL_LEGACY(sscanf),
   UTIL_LEGACY(path_is_relative),
   UTIL_LEGACY(strtok),
@@ -3034,10 +3790,18 @@ struct testcase_t util_tests[] = {
   UTIL_TEST(join_win_cmdline, 0),
   UTIL_TEST(split_lines, 0),
   UTIL_TEST(n_bits_set, 0),
+  UTIL_TEST(socket_cork, 0),
+  UTIL_TEST(cpu_affinity, 0),
   UTIL_TEST(eat_whitespace, 0),
   UTIL_TEST(sl_new_from_text_lines, 0),
   UTIL_TEST(make_environment, 0),
   UTIL_TEST(set_env_var_in_sl, 0),
+  UTIL_TEST(bg_file_write, 0),
+  UTIL_TEST(write_behind, 0),
+  UTIL_TEST(log_domain_masks, TT_FORK),
+#ifndef _WIN32
+  UTIL_TEST(async_logs, TT_FORK),
+#endif
   END_OF_TESTCASES
 };
 
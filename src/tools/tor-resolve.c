@@ -9,6 +9,7 @@
 #include "../common/util.h"
 #include "address.h"
 #include "../common/torlog.h"
+#include "../common/container.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +32,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h> /* for select() */
+#endif
 
 #ifdef _WIN32
 #if defined(_MSC_VER) && (_MSC_VER <= 1300)
@@ -42,6 +46,13 @@
 #endif
 
 #define RESPONSE_LEN_4 8
+/** Longest SOCKS5 resolve reply we read: the fixed part, a length byte, and
+ * a hostname of up to 255 bytes.  (We ignore the port at the end.) */
+#define RESPONSE_LEN_5_MAX (4 + 1 + 255)
+/** Default for how many resolves we run at once in batch mode. */
+#define DEFAULT_BATCH_IN_FLIGHT 16
+/** Most resolves we'll run at once in batch mode. */
+#define MAX_BATCH_IN_FLIGHT 256
 #define log_sock_error(act, _s)                                         \
   STMT_BEGIN log_fn(LOG_ERR, LD_NET, "Error while %s: %s", act,         \
               tor_socket_strerror(tor_socket_errno(_s))); STMT_END
@@ -172,6 +183,59 @@ socks5_reason_to_string(char reason)
   }
 }
 
+/** Given the first <b>len</b> bytes of a SOCKS5 resolve reply for
+ * <b>hostname</b> in <b>response</b>, return the number of bytes of it we
+ * need if that's more than <b>len</b>.  Otherwise set *<b>addr_out</b> to
+ * the IPv4 address it contains (in host order), or *<b>hostname_out</b> to
+ * a newly allocated copy of the hostname it contains, and return 0.
+ * Return -1 if the reply is bad or reports an error.
+ */
+static int
+parse_socks5_resolve_response(const char *hostname,
+                              const char *response, size_t len,
+                              uint32_t *addr_out, char **hostname_out)
+{
+  size_t result_len;
+  tor_assert(response);
+  tor_assert(addr_out);
+  tor_assert(hostname_out);
+
+  if (len < 4)
+    return 4;
+  if (response[0] != 5) {
+    log_err(LD_NET, "Bad SOCKS5 reply version.");
+    return -1;
+  }
+  /* Give a user some useful feedback about SOCKS5 errors */
+  if (response[1] != 0) {
+    log_warn(LD_NET,"Got SOCKS5 status response '%u': %s",
+             (unsigned)response[1],
+             socks5_reason_to_string(response[1]));
+    if (response[1] == 4 && !strcasecmpend(hostname, ".onion")) {
+      log_warn(LD_NET,
+          "%s is a hidden service; those don't have IP addresses. "
+          "To connect to a hidden service, you need to send the hostname "
+          "to Tor; we suggest an application that uses SOCKS 4a.",
+          hostname);
+    }
+    return -1;
+  }
+  if (response[3] == 1) {
+    /* IPv4 address */
+    if (len < 8)
+      return 8;
+    *addr_out = ntohl(get_uint32(response+4));
+  } else if (response[3] == 3) {
+    if (len < 5)
+      return 5;
+    result_len = *(const uint8_t*)(response+4);
+    if (len < 5 + result_len)
+      return (int)(5 + result_len);
+    *hostname_out = tor_strndup(response+5, result_len);
+  }
+  return 0;
+}
+
 /** Send a resolve request for <b>hostname</b> to the Tor listening on
  * <b>sockshost</b>:<b>socksport</b>.  Store the resulting IPv4
  * address (in host order) into *<b>result_addr</b>.
@@ -255,53 +319,349 @@ do_resolve(const char *hostname, uint32_t sockshost, uint16_t socksport,
       return -1;
     }
   } else {
-    char reply_buf[4];
-    if (read_all(s, reply_buf, 4, 1) != 4) {
-      log_err(LD_NET, "Error reading SOCKS5 response.");
+    char reply_buf[RESPONSE_LEN_5_MAX];
+    int have = 0, need = 4;
+    while (need > have) {
+      if (read_all(s, reply_buf+have, need-have, 1) != need-have) {
+        log_err(LD_NET, "Error reading SOCKS5 response.");
+        return -1;
+      }
+      have = need;
+      need = parse_socks5_resolve_response(hostname, reply_buf, have,
+                                           result_addr, result_hostname);
+      if (need < 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+/** How far along its SOCKS exchange a batch_request_t is. */
+typedef enum {
+  BATCH_CONNECTING, /**< Waiting for the connection to the proxy to open. */
+  BATCH_AWAITING_METHOD, /**< Waiting for a SOCKS5 method choice. */
+  BATCH_AWAITING_REPLY, /**< Waiting for the answer to our resolve. */
+} batch_state_t;
+
+/** One resolve in progress in batch mode.  Each gets its own connection to
+ * the proxy, since SOCKS allows only one request per connection. */
+typedef struct batch_request_t {
+  char *hostname; /**< What we're resolving. */
+  tor_socket_t s; /**< Our nonblocking connection to the proxy. */
+  batch_state_t state; /**< How far along we are. */
+  int version; /**< SOCKS version: 4 or 5. */
+  int reverse; /**< True iff this is a reverse lookup. */
+  char *out; /**< What we're sending, if anything. */
+  size_t out_len; /**< Length of <b>out</b>. */
+  size_t out_sent; /**< How much of <b>out</b> we've sent. */
+  char in[RESPONSE_LEN_5_MAX]; /**< What we've read of the current reply. */
+  size_t in_len; /**< How many bytes of <b>in</b> we've read. */
+  size_t in_needed; /**< How many bytes of reply we want before we look. */
+  uint32_t result_addr; /**< The answer, for a forward lookup. */
+  char *result_hostname; /**< The answer, for a reverse lookup. */
+} batch_request_t;
+
+/** Release all storage held by <b>req</b>, and close its connection. */
+static void
+batch_request_free(batch_request_t *req)
+{
+  if (!req)
+    return;
+  if (SOCKET_OK(req->s))
+    tor_close_socket(req->s);
+  tor_free(req->hostname);
+  tor_free(req->out);
+  tor_free(req->result_hostname);
+  tor_free(req);
+}
+
+/** Make <b>req</b> send the <b>len</b>-byte string <b>out</b>, which it
+ * takes ownership of, and then wait for a reply of <b>reply_len</b>
+ * bytes. */
+static void
+batch_request_send(batch_request_t *req, char *out, size_t len,
+                   size_t reply_len)
+{
+  tor_free(req->out);
+  req->out = out;
+  req->out_len = len;
+  req->out_sent = 0;
+  req->in_len = 0;
+  req->in_needed = reply_len;
+}
+
+/** Called when <b>req</b>'s connection to the proxy has opened: start the
+ * SOCKS handshake.  Return 0 on success, -1 on failure. */
+static int
+batch_request_connected(batch_request_t *req)
+{
+  if (req->version == 5) {
+    batch_request_send(req, tor_memdup("\x05\x01\x00", 3), 3, 2);
+    req->state = BATCH_AWAITING_METHOD;
+  } else {
+    char *request = NULL;
+    ssize_t len = build_socks_resolve_request(&request, "", req->hostname,
+                                              req->reverse, req->version);
+    if (len < 0)
+      return -1;
+    batch_request_send(req, request, len, RESPONSE_LEN_4);
+    req->state = BATCH_AWAITING_REPLY;
+  }
+  return 0;
+}
+
+/** Start resolving <b>hostname</b> through the SOCKS proxy at
+ * <b>sockshost</b>:<b>socksport</b>, and return a new batch_request_t for
+ * it; or NULL if we couldn't start. */
+static batch_request_t *
+batch_request_new(const char *hostname, uint32_t sockshost,
+                  uint16_t socksport, int reverse, int version)
+{
+  batch_request_t *req;
+  struct sockaddr_in socksaddr;
+
+  if (version == 5 && strlen(hostname) > 255) {
+    log_warn(LD_GENERAL, "Hostname %s is too long for SOCKS5.", hostname);
+    return NULL;
+  }
+
+  req = tor_malloc_zero(sizeof(batch_request_t));
+  req->s = TOR_INVALID_SOCKET;
+  req->hostname = tor_strdup(hostname);
+  req->reverse = reverse;
+  req->version = version;
+  req->state = BATCH_CONNECTING;
+  req->s = tor_open_socket(PF_INET,SOCK_STREAM,IPPROTO_TCP);
+  if (!SOCKET_OK(req->s)) {
+    log_sock_error("creating_socket", -1);
+    goto err;
+  }
+#ifndef _WIN32
+  if (req->s >= FD_SETSIZE) {
+    log_warn(LD_NET, "Too many sockets open; try a smaller -j.");
+    goto err;
+  }
+#endif
+  set_socket_nonblocking(req->s);
+
+  memset(&socksaddr, 0, sizeof(socksaddr));
+  socksaddr.sin_family = AF_INET;
+  socksaddr.sin_port = htons(socksport);
+  socksaddr.sin_addr.s_addr = htonl(sockshost);
+  if (connect(req->s, (struct sockaddr*)&socksaddr, sizeof(socksaddr))) {
+    int e = tor_socket_errno(req->s);
+    if (!ERRNO_IS_CONN_EINPROGRESS(e)) {
+      log_sock_error("connecting to SOCKS host", req->s);
+      goto err;
+    }
+  } else if (batch_request_connected(req) < 0) {
+    goto err;
+  }
+  return req;
+ err:
+  batch_request_free(req);
+  return NULL;
+}
+
+/** Make whatever progress we can on <b>req</b>, whose connection is
+ * readable if <b>readable</b> and writable if <b>writable</b>.  Return 0 if
+ * it's still going, 1 if it has its answer, and -1 if it failed. */
+static int
+batch_request_step(batch_request_t *req, int readable, int writable)
+{
+  int n;
+
+  if (req->state == BATCH_CONNECTING) {
+    int e = 0;
+    socklen_t e_len = sizeof(e);
+    if (!writable)
+      return 0;
+    if (getsockopt(req->s, SOL_SOCKET, SO_ERROR, (void*)&e, &e_len) < 0 ||
+        e) {
+      log_warn(LD_NET, "Error connecting to SOCKS host: %s",
+               tor_socket_strerror(e));
       return -1;
     }
-    if (reply_buf[0] != 5) {
-      log_err(LD_NET, "Bad SOCKS5 reply version.");
+    if (batch_request_connected(req) < 0)
+      return -1;
+  }
+
+  if (writable && req->out_sent < req->out_len) {
+    n = (int)tor_socket_send(req->s, req->out + req->out_sent,
+                             req->out_len - req->out_sent, 0);
+    if (n < 0) {
+      if (ERRNO_IS_EAGAIN(tor_socket_errno(req->s)))
+        return 0;
+      log_sock_error("sending SOCKS request", req->s);
       return -1;
     }
-    /* Give a user some useful feedback about SOCKS5 errors */
-    if (reply_buf[1] != 0) {
-      log_warn(LD_NET,"Got SOCKS5 status response '%u': %s",
-               (unsigned)reply_buf[1],
-               socks5_reason_to_string(reply_buf[1]));
-      if (reply_buf[1] == 4 && !strcasecmpend(hostname, ".onion")) {
-        log_warn(LD_NET,
-            "%s is a hidden service; those don't have IP addresses. "
-            "To connect to a hidden service, you need to send the hostname "
-            "to Tor; we suggest an application that uses SOCKS 4a.",
-            hostname);
-      }
+    req->out_sent += n;
+  }
+
+  if (!readable || req->out_sent < req->out_len)
+    return 0;
+  n = (int)tor_socket_recv(req->s, req->in + req->in_len,
+                           req->in_needed - req->in_len, 0);
+  if (n < 0) {
+    if (ERRNO_IS_EAGAIN(tor_socket_errno(req->s)))
+      return 0;
+    log_sock_error("reading SOCKS response", req->s);
+    return -1;
+  } else if (n == 0) {
+    log_warn(LD_NET, "SOCKS host closed the connection while resolving %s.",
+             req->hostname);
+    return -1;
+  }
+  req->in_len += n;
+  if (req->in_len < req->in_needed)
+    return 0;
+
+  if (req->state == BATCH_AWAITING_METHOD) {
+    char *request = NULL;
+    ssize_t len;
+    if (req->in[0] != '\x05' || req->in[1] != '\x00') {
+      log_warn(LD_NET, "Unexpected SOCKS5 method reply: %u %u",
+               (unsigned)req->in[0], (unsigned)req->in[1]);
       return -1;
     }
-    if (reply_buf[3] == 1) {
-      /* IPv4 address */
-      if (read_all(s, reply_buf, 4, 1) != 4) {
-        log_err(LD_NET, "Error reading address in socks5 response.");
-        return -1;
+    len = build_socks_resolve_request(&request, "", req->hostname,
+                                      req->reverse, req->version);
+    if (len < 0)
+      return -1;
+    batch_request_send(req, request, len, 4);
+    req->state = BATCH_AWAITING_REPLY;
+    return 0;
+  }
+
+  if (req->version == 4) {
+    return parse_socks4a_resolve_response(req->hostname, req->in,
+                                          req->in_len,
+                                          &req->result_addr) < 0 ? -1 : 1;
+  } else {
+    n = parse_socks5_resolve_response(req->hostname, req->in, req->in_len,
+                                      &req->result_addr,
+                                      &req->result_hostname);
+    if (n < 0)
+      return -1;
+    if (n > 0) {
+      req->in_needed = n;
+      return 0;
+    }
+    return 1;
+  }
+}
+
+/** Print the result of resolving <b>hostname</b> in batch mode: the
+ * hostname, a space, and then the answer in <b>req</b> if <b>ok</b>, or
+ * FAILED if not. */
+static void
+batch_print_result(const char *hostname, const batch_request_t *req, int ok)
+{
+  if (!ok) {
+    printf("%s FAILED\n", hostname);
+  } else if (req->result_hostname) {
+    printf("%s %s\n", hostname, req->result_hostname);
+  } else {
+    char buf[INET_NTOA_BUF_LEN];
+    struct in_addr a;
+    a.s_addr = htonl(req->result_addr);
+    tor_inet_ntoa(&a, buf, sizeof(buf));
+    printf("%s %s\n", hostname, buf);
+  }
+  fflush(stdout);
+}
+
+/** Read hostnames from <b>in</b>, one per line, and resolve them through
+ * the SOCKS proxy at <b>sockshost</b>:<b>socksport</b>, running up to
+ * <b>max_in_flight</b> resolves at once.  Print each result as soon as we
+ * have it.  Return 0 if every resolve succeeded, and -1 otherwise. */
+static int
+do_resolve_batch(FILE *in, uint32_t sockshost, uint16_t socksport,
+                 int reverse, int version, int max_in_flight)
+{
+  smartlist_t *pending = smartlist_new();
+  char line[1024];
+  int at_eof = 0, any_failed = 0;
+
+  while (!at_eof || smartlist_len(pending)) {
+    fd_set readfds, writefds;
+    tor_socket_t max_fd = -1;
+
+    /* Start as many new resolves as we have room for. */
+    while (!at_eof && smartlist_len(pending) < max_in_flight) {
+      batch_request_t *req;
+      char *cp;
+      if (!fgets(line, sizeof(line), in)) {
+        at_eof = 1;
+        break;
       }
-      *result_addr = ntohl(get_uint32(reply_buf));
-    } else if (reply_buf[3] == 3) {
-      size_t result_len;
-      if (read_all(s, reply_buf, 1, 1) != 1) {
-        log_err(LD_NET, "Error reading address_length in socks5 response.");
-        return -1;
+      if (!strchr(line, '\n') && !feof(in)) {
+        int c;
+        log_warn(LD_GENERAL, "Skipping overlong line in input.");
+        while ((c = getc(in)) != EOF && c != '\n')
+          ;
+        any_failed = 1;
+        continue;
       }
-      result_len = *(uint8_t*)(reply_buf);
-      *result_hostname = tor_malloc(result_len+1);
-      if (read_all(s, *result_hostname, result_len, 1) != (int) result_len) {
-        log_err(LD_NET, "Error reading hostname in socks5 response.");
-        return -1;
+      cp = line + strlen(line);
+      while (cp > line && TOR_ISSPACE(cp[-1]))
+        *--cp = '\0';
+      cp = (char*)eat_whitespace(line);
+      if (!*cp)
+        continue;
+      req = batch_request_new(cp, sockshost, socksport, reverse, version);
+      if (req) {
+        smartlist_add(pending, req);
+      } else {
+        batch_print_result(cp, NULL, 0);
+        any_failed = 1;
       }
-      (*result_hostname)[result_len] = '\0';
     }
+    if (!smartlist_len(pending))
+      continue;
+
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    SMARTLIST_FOREACH_BEGIN(pending, batch_request_t *, req) {
+      if (req->state == BATCH_CONNECTING || req->out_sent < req->out_len)
+        FD_SET(req->s, &writefds);
+      else
+        FD_SET(req->s, &readfds);
+      if (req->s > max_fd)
+        max_fd = req->s;
+    } SMARTLIST_FOREACH_END(req);
+
+    if (select((int)max_fd + 1, &readfds, &writefds, NULL, NULL) < 0) {
+      int e = tor_socket_errno(-1);
+      if (e == EINTR)
+        continue;
+      log_warn(LD_NET, "Error waiting for SOCKS replies: %s",
+               tor_socket_strerror(e));
+      SMARTLIST_FOREACH_BEGIN(pending, batch_request_t *, req) {
+        batch_print_result(req->hostname, req, 0);
+        batch_request_free(req);
+      } SMARTLIST_FOREACH_END(req);
+      smartlist_clear(pending);
+      any_failed = 1;
+      break;
+    }
+
+    SMARTLIST_FOREACH_BEGIN(pending, batch_request_t *, req) {
+      int r = batch_request_step(req, FD_ISSET(req->s, &readfds),
+                                 FD_ISSET(req->s, &writefds));
+      if (r == 0)
+        continue;
+      batch_print_result(req->hostname, req, r > 0);
+      if (r < 0)
+        any_failed = 1;
+      batch_request_free(req);
+      SMARTLIST_DEL_CURRENT(pending, req);
+    } SMARTLIST_FOREACH_END(req);
   }
 
-  return 0;
+  smartlist_free(pending);
+  return any_failed ? -1 : 0;
 }
 
 /** Print a usage message and exit. */
@@ -309,7 +669,9 @@ static void
 usage(void)
 {
   puts("Syntax: tor-resolve [-4] [-v] [-x] [-F] [-p port] "
-       "hostname [sockshost:socksport]");
+       "hostname [sockshost:socksport]\n"
+       "       tor-resolve -b [-j n] [-4] [-v] [-x] [-p port] "
+       "[sockshost:socksport]");
   exit(1);
 }
 
@@ -319,7 +681,9 @@ main(int argc, char **argv)
 {
   uint32_t sockshost;
   uint16_t socksport = 0, port_option = 0;
-  int isSocks4 = 0, isVerbose = 0, isReverse = 0;
+  int isSocks4 = 0, isVerbose = 0, isReverse = 0, isBatch = 0;
+  int max_in_flight = DEFAULT_BATCH_IN_FLIGHT;
+  const char *hostname = NULL, *socks_arg = NULL;
   char **arg;
   int n_args;
   struct in_addr a;
@@ -349,6 +713,22 @@ main(int argc, char **argv)
       isSocks4 = 0;
     else if (!strcmp("-x", arg[0]))
       isReverse = 1;
+    else if (!strcmp("-b", arg[0]))
+      isBatch = 1;
+    else if (!strcmp("-j", arg[0])) {
+      if (n_args < 2) {
+        fprintf(stderr, "No arguments given to -j\n");
+        usage();
+      }
+      max_in_flight = atoi(arg[1]);
+      if (max_in_flight < 1 || max_in_flight > MAX_BATCH_IN_FLIGHT) {
+        fprintf(stderr, "-j requires a number between 1 and %d\n",
+                MAX_BATCH_IN_FLIGHT);
+        usage();
+      }
+      ++arg; /* skip the number */
+      --n_args;
+    }
     else if (!strcmp("-p", arg[0])) {
       int p;
       if (n_args < 2) {
@@ -382,7 +762,20 @@ main(int argc, char **argv)
     set_log_severity_config(LOG_WARN, LOG_ERR, s);
   add_stream_log(s, "<stderr>", fileno(stderr));
 
-  if (n_args == 1) {
+  if (isBatch) {
+    if (n_args > 1)
+      usage();
+    if (n_args == 1)
+      socks_arg = arg[0];
+  } else {
+    if (n_args < 1 || n_args > 2)
+      usage();
+    hostname = arg[0];
+    if (n_args == 2)
+      socks_arg = arg[1];
+  }
+
+  if (!socks_arg) {
     log_debug(LD_CONFIG, "defaulting to localhost");
     sockshost = 0x7f000001u; /* localhost */
     if (port_option) {
@@ -392,9 +785,10 @@ main(int argc, char **argv)
       log_debug(LD_CONFIG, "defaulting to port 9050");
       socksport = 9050; /* 9050 */
     }
-  } else if (n_args == 2) {
-    if (addr_port_lookup(LOG_WARN, arg[1], NULL, &sockshost, &socksport)<0) {
-      fprintf(stderr, "Couldn't parse/resolve address %s", arg[1]);
+  } else {
+    if (addr_port_lookup(LOG_WARN, socks_arg, NULL,
+                         &sockshost, &socksport)<0) {
+      fprintf(stderr, "Couldn't parse/resolve address %s", socks_arg);
       return 1;
     }
     if (socksport && port_option && socksport != port_option) {
@@ -406,8 +800,6 @@ main(int argc, char **argv)
       log_debug(LD_CONFIG, "defaulting to port 9050");
       socksport = 9050;
     }
-  } else {
-    usage();
   }
 
   if (network_init()<0) {
@@ -415,7 +807,12 @@ main(int argc, char **argv)
     return 1;
   }
 
-  if (do_resolve(arg[0], sockshost, socksport, isReverse,
+  if (isBatch) {
+    return do_resolve_batch(stdin, sockshost, socksport, isReverse,
+                            isSocks4 ? 4 : 5, max_in_flight) < 0 ? 1 : 0;
+  }
+
+  if (do_resolve(hostname, sockshost, socksport, isReverse,
                  isSocks4 ? 4 : 5, &result,
                  &result_hostname))
     return 1;